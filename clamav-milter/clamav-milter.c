@@ -46,6 +46,8 @@
 
 #include "connpool.h"
 #include "netcode.h"
+#include "spool.h"
+#include "vcache.h"
 #include "clamfi.h"
 #include "whitelist.h"
 
@@ -71,7 +73,9 @@ static void milter_exit(int sig) {
     optfree(opts);
 
     logg_close();
+    spool_shutdown();
     cpool_free();
+    vcache_free();
     localnets_free();
     whitelist_free();
 }
@@ -423,6 +427,16 @@ int main(int argc, char **argv) {
 	return 1;
     }	
 
+    if(spool_init(opts) || vcache_init(opts)) {
+	spool_shutdown();
+	cpool_free();
+	localnets_free();
+	whitelist_free();
+	logg_close();
+	optfree(opts);
+	return 1;
+    }
+
     if((opt = optget(opts, "PidFile"))->enabled) {
 	FILE *fd;
 	mode_t old_umask = umask(0002);
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
@@ -41,6 +42,8 @@
 
 #include "connpool.h"
 #include "netcode.h"
+#include "spool.h"
+#include "vcache.h"
 #include "whitelist.h"
 #include "clamfi.h"
 
@@ -79,6 +82,9 @@ struct CLAMFI {
     char *msg_date;
     char *msg_id;
     char **recipients;
+    struct CP_ENTRY *cpe;
+    struct SPOOL *spool;
+    void *hctx; /* digest of the body, for the verdict cache */
     int local;
     int main;
     int alt;
@@ -135,10 +141,22 @@ static const char *makesanehdr(char *hdr) {
 }
 
 static void nullify(SMFICTX *ctx, struct CLAMFI *cf, enum CFWHAT closewhat) {
+    if(cf->spool) {
+	spool_free(cf->spool);
+	cf->spool = NULL;
+    }
+    if(cf->hctx) {
+	cl_hash_destroy(cf->hctx);
+	cf->hctx = NULL;
+    }
     if(closewhat & CF_MAIN || ((closewhat & CF_ANY) && cf->main >= 0))
 	close(cf->main);
     if(closewhat & CF_ALT || ((closewhat & CF_ANY) && cf->alt >= 0))
 	close(cf->alt);
+    if(cf->cpe) {
+	cpool_put(cf->cpe, -1, -1);
+	cf->cpe = NULL;
+    }
     if(cf->msg_subj) free(cf->msg_subj);
     if(cf->msg_date) free(cf->msg_date);
     if(cf->msg_id) free(cf->msg_id);
@@ -153,17 +171,26 @@ static void nullify(SMFICTX *ctx, struct CLAMFI *cf, enum CFWHAT closewhat) {
 }
 
 
+static int cfsend(struct CLAMFI *cf, const void *buf, size_t len) {
+    if(cf->spool)
+	return spool_send(cf->spool, buf, len);
+    return nc_send(cf->main, buf, len);
+}
+
+
 static sfsistat sendchunk(struct CLAMFI *cf, unsigned char *bodyp, size_t len, SMFICTX *ctx) {
     if(cf->totsz >= maxfilesize || len == 0)
 	return SMFIS_CONTINUE;
 
     if(!cf->totsz) {
 	sfsistat ret;
-	if(nc_connect_rand(&cf->main, &cf->alt, &cf->local)) {
+	if(nc_connect_pool(&cf->main, &cf->alt, &cf->local, &cf->cpe)) {
 	    logg("!Failed to initiate streaming/fdpassing\n");
 	    nullify(ctx, cf, CF_NONE);
 	    return FailAction;
 	}
+	if(!cf->local)
+	    cf->spool = spool_new(cf->main);
 	cf->totsz = 1; /* do not infloop */
 	if((ret = sendchunk(cf, (unsigned char *)"From clamav-milter\n", 19, ctx)) != SMFIS_CONTINUE)
 	    return ret;
@@ -195,14 +222,14 @@ static sfsistat sendchunk(struct CLAMFI *cf, unsigned char *bodyp, size_t len, S
 	} else if(len < CLAMFIBUFSZ) {
 	    memcpy(&cf->buffer[cf->bufsz], bodyp, CLAMFIBUFSZ - cf->bufsz);
 	    cf->sendme = htonl(CLAMFIBUFSZ);
-	    sendfailed = nc_send(cf->main, &cf->sendme, CLAMFIBUFSZ + 4);
+	    sendfailed = cfsend(cf, &cf->sendme, CLAMFIBUFSZ + 4);
 	    len -= (CLAMFIBUFSZ - cf->bufsz);
 	    memcpy(cf->buffer, &bodyp[CLAMFIBUFSZ - cf->bufsz], len);
 	    cf->bufsz = len;
 	} else {
 	    uint32_t sendmetoo = htonl(len);
 	    cf->sendme = htonl(cf->bufsz);
-	    if((cf->bufsz && nc_send(cf->main, &cf->sendme, cf->bufsz + 4)) || nc_send(cf->main, &sendmetoo, 4) || nc_send(cf->main, bodyp, len))
+	    if((cf->bufsz && cfsend(cf, &cf->sendme, cf->bufsz + 4)) || cfsend(cf, &sendmetoo, 4) || cfsend(cf, bodyp, len))
 		sendfailed = 1;
 	    cf->bufsz = 0;
 	}
@@ -241,6 +268,13 @@ sfsistat clamfi_header(SMFICTX *ctx, char *headerf, char *headerv) {
 	    cf->msg_id = strdup(headerv ? headerv : "");
     }
 
+    /* these drive the MIME parsing of the body, so they're part of what
+       makes two messages identical to clamd */
+    if(cf->hctx && headerv && (!strcasecmp(headerf, "Content-Type") || !strcasecmp(headerf, "Content-Transfer-Encoding"))) {
+	cl_update_hash(cf->hctx, headerf, strlen(headerf));
+	cl_update_hash(cf->hctx, headerv, strlen(headerv) + 1);
+    }
+
     if(addxvirus==1) {
 	if(!strcasecmp(headerf, "X-Virus-Scanned")) cf->scanned_count++;
 	if(!strcasecmp(headerf, "X-Virus-Status")) cf->status_count++;
@@ -281,6 +315,18 @@ sfsistat clamfi_body(SMFICTX *ctx, unsigned char *bodyp, size_t len) {
 	cf->gotbody = 1;
     }
 
+    if(cf->hctx) {
+	/* line endings differ depending on the path the message took */
+	unsigned char *end = bodyp + len, *p = bodyp, *cr;
+
+	while(p < end) {
+	    if(!(cr = memchr(p, '\r', end - p)))
+		cr = end;
+	    cl_update_hash(cf->hctx, p, cr - p);
+	    p = cr + 1;
+	}
+    }
+
     ret = sendchunk(cf, bodyp, len, ctx);
     if(ret != SMFIS_CONTINUE)
 	free(cf);
@@ -300,9 +346,11 @@ sfsistat clamfi_abort(SMFICTX *ctx) {
 
 sfsistat clamfi_eom(SMFICTX *ctx) {
     struct CLAMFI *cf;
-    char *reply;
-    int len, ret;
+    char *reply = NULL;
+    int len, ret, reuse = 0, hashed = 0, cached = 0;
     unsigned int crcpt;
+    struct timeval t0, t1;
+    unsigned char digest[VCACHE_HASHLEN];
 
     if(!(cf = (struct CLAMFI *)smfi_getpriv(ctx)))
 	return SMFIS_CONTINUE; /* whatever */
@@ -316,42 +364,67 @@ sfsistat clamfi_eom(SMFICTX *ctx) {
 	return ret;
     }
 
-    if(cf->local) {
-	lseek(cf->alt, 0, SEEK_SET);
+    if(cf->hctx) {
+	hashed = !cl_finish_hash(cf->hctx, digest);
+	cf->hctx = NULL;
+	if(hashed)
+	    reply = vcache_lookup(digest, cp->dbver);
+    }
 
-	if(nc_sendmsg(cf->main, cf->alt) == -1) {
-	    logg("!FD send failed\n");
-	    nullify(ctx, cf, CF_ALT);
-	    free(cf);
-	    return FailAction;
-	}
+    if(reply) {
+	/* abandon the stream: clamd drops it without scanning */
+	logg("*Using the cached verdict for this message\n");
+	cached = 1;
+	if(cf->local)
+	    close(cf->alt);
+	cf->alt = -1;
     } else {
-	uint32_t sendmetoo = 0;
-	cf->sendme = htonl(cf->bufsz);
-	if((cf->bufsz && nc_send(cf->main, &cf->sendme, cf->bufsz + 4)) || nc_send(cf->main, &sendmetoo, 4))  {
-	    logg("!Failed to flush STREAM\n");
-	    nullify(ctx, cf, CF_NONE);
-	    free(cf);
-	    return FailAction;
+	gettimeofday(&t0, NULL);
+	if(cf->local) {
+	    lseek(cf->alt, 0, SEEK_SET);
+
+	    if(nc_sendmsg(cf->main, cf->alt) == -1) {
+		logg("!FD send failed\n");
+		nullify(ctx, cf, CF_ALT);
+		free(cf);
+		return FailAction;
+	    }
+	} else {
+	    uint32_t sendmetoo = 0;
+	    cf->sendme = htonl(cf->bufsz);
+	    if((cf->bufsz && cfsend(cf, &cf->sendme, cf->bufsz + 4)) || cfsend(cf, &sendmetoo, 4) || (cf->spool && spool_flush(cf->spool)))  {
+		logg("!Failed to flush STREAM\n");
+		nullify(ctx, cf, CF_NONE);
+		free(cf);
+		return FailAction;
+	    }
 	}
-    }
 
-    reply = nc_recv(cf->main);
+	if(cf->spool) {
+	    spool_free(cf->spool);
+	    cf->spool = NULL;
+	}
+	reply = nc_recv(cf->main);
+	gettimeofday(&t1, NULL);
 
-    if(cf->local)
-	close(cf->alt);
+	if(cf->local)
+	    close(cf->alt);
 
-    cf->alt = -1;
+	cf->alt = -1;
 
-    if(!reply) {
-	logg("!No reply from clamd\n");
-	nullify(ctx, cf, CF_NONE);
-	free(cf);
-	return FailAction;
+	if(!reply) {
+	    logg("!No reply from clamd\n");
+	    nullify(ctx, cf, CF_NONE);
+	    free(cf);
+	    return FailAction;
+	}
+	if(hashed && cf->cpe)
+	    vcache_add(digest, cf->cpe->dbver, reply);
     }
 
     len = strlen(reply);
     if(len>5 && !strcmp(reply + len - 5, ": OK\n")) {
+	reuse = 1;
 	if(addxvirus) add_x_header(ctx, "Clean", cf->scanned_count, cf->status_count);
 	if(loginfected & LOGCLN_FULL) {
 	    const char *id = smfi_getsymval(ctx, "{i}");
@@ -378,6 +451,7 @@ sfsistat clamfi_eom(SMFICTX *ctx) {
 	}
 	ret = CleanAction(ctx);
     } else if (len>7 && !strcmp(reply + len - 7, " FOUND\n")) {
+	reuse = 1;
 	cf->virusname = NULL;
 	if((loginfected & (LOGINF_BASIC | LOGINF_FULL)) || addxvirus || rejectfmt || viraction) {
 	    char *vir;
@@ -480,7 +554,13 @@ sfsistat clamfi_eom(SMFICTX *ctx) {
 	ret = FailAction;
     }
 
-    nullify(ctx, cf, CF_MAIN);
+    if(reuse && !cached) {
+	/* the session is idle again: park it for the next message */
+	cpool_put(cf->cpe, cf->main, (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000);
+	cf->cpe = NULL;
+	nullify(ctx, cf, CF_NONE);
+    } else
+	nullify(ctx, cf, CF_MAIN);
     free(cf);
     free(reply);
     return ret;
@@ -710,6 +790,9 @@ sfsistat clamfi_envfrom(SMFICTX *ctx, char **argv) {
     cf->totsz = 0;
     cf->bufsz = 0;
     cf->main = cf->alt = -1;
+    cf->cpe = NULL;
+    cf->spool = NULL;
+    cf->hctx = vcache_enabled() ? cl_hash_init(VCACHE_HASH) : NULL;
     cf->all_whitelisted = 1;
     cf->gotbody = 0;
     cf->msg_subj = cf->msg_date = cf->msg_id = NULL;
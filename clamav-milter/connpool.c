@@ -34,6 +34,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
 #include <netdb.h>
 
 #include "shared/optparser.h"
@@ -52,8 +53,12 @@
 #define _UNUSED_
 #endif
 
+/* how often the monitor polls STATS from the clamd servers (seconds) */
+#define STATS_INTERVAL 5
+
 struct CPOOL *cp = NULL;
 static pthread_cond_t mon_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t cp_lock = PTHREAD_MUTEX_INITIALIZER;
 static int quitting = 1;
 static pthread_t probe_th;
 
@@ -172,19 +177,73 @@ static void cpool_probe(void) {
 }
 
 
+/* Must be called with cp_lock held */
+static void cpool_prune(struct CP_ENTRY *cpe, time_t older) {
+    unsigned int i, j;
+
+    for(i=0, j=0; i<cpe->nidle; i++) {
+	if(cpe->idle[i].last_used < older)
+	    close(cpe->idle[i].sock);
+	else
+	    cpe->idle[j++] = cpe->idle[i];
+    }
+    cpe->nidle = j;
+}
+
+
+/* Fetch the queue depth (and the signature version, if anybody cares) of
+   each live clamd and expire the sessions which clamd is about to drop on
+   its own (IdleTimeout) */
+static void cpool_poll(void) {
+    unsigned int i, load, dbver = 0;
+    struct CP_ENTRY *cpe = cp->pool;
+
+    for(i=1; i<=cp->entries; i++) {
+	if(!cpe->dead) {
+	    if(!nc_stats_entry(cpe, &load)) {
+		pthread_mutex_lock(&cp_lock);
+		cpe->load = load;
+		pthread_mutex_unlock(&cp_lock);
+	    } else
+		logg("*STATS poll for slot %u failed\n", i);
+	    if(cp->track_dbver) {
+		cpe->dbver = nc_version_entry(cpe);
+		if(cpe->dbver > dbver)
+		    dbver = cpe->dbver;
+	    }
+	}
+	pthread_mutex_lock(&cp_lock);
+	cpool_prune(cpe, time(NULL) - cp->keepalive);
+	pthread_mutex_unlock(&cp_lock);
+	cpe++;
+    }
+    if(cp->track_dbver && dbver != cp->dbver) {
+	logg("*Signature version in the pool is now %u\n", dbver);
+	cp->dbver = dbver;
+    }
+}
+
+
 static void *cpool_mon(_UNUSED_ void *v) {
     pthread_mutex_t conv;
+    time_t last_probe = 0;
+    int woken = 0;
 
     pthread_mutex_init(&conv, NULL);
     pthread_mutex_lock(&conv);
 
     while(!quitting) {
 	struct timespec t;
+	time_t now = time(NULL);
 
-	cpool_probe();
-	t.tv_sec = time(NULL) + 60;
+	if(woken || last_probe < now - 60) {
+	    cpool_probe();
+	    last_probe = now;
+	}
+	cpool_poll();
+	t.tv_sec = time(NULL) + STATS_INTERVAL;
 	t.tv_nsec = 0;
-	pthread_cond_timedwait(&mon_cond, &conv, &t);
+	woken = (pthread_cond_timedwait(&mon_cond, &conv, &t) == 0);
     }
     pthread_mutex_unlock(&conv);
     pthread_mutex_destroy(&conv);
@@ -202,6 +261,8 @@ void cpool_init(struct optstruct *opts) {
     }
 
     cp->local_cpe = NULL;
+    cp->keepalive = optget(opts, "ClamdSessionTimeout")->numarg;
+    cp->track_dbver = optget(opts, "VerdictCacheSize")->numarg != 0;
 
     if((opt = optget(opts, "ClamdSocket"))->enabled) {
 	while(opt) {
@@ -253,8 +314,12 @@ void cpool_free(void) {
 
     if(cp) {
 	if(cp->pool) {
-	    for(i=0; i<cp->entries; i++)
+	    for(i=0; i<cp->entries; i++) {
+		while(cp->pool[i].nidle)
+		    close(cp->pool[i].idle[--cp->pool[i].nidle].sock);
+		free(cp->pool[i].idle);
 		FREESRV(cp->pool[i]);
+	    }
 	    free(cp->pool);
 	}
 	free(cp);
@@ -263,29 +328,97 @@ void cpool_free(void) {
 }
 
 
-struct CP_ENTRY *cpool_get_rand(int *s) {
-    unsigned int start, i;
-    struct CP_ENTRY *cpe;
+/* A parked session may have been closed by clamd in the meantime */
+static int session_alive(int s) {
+    char c;
+
+    return recv(s, &c, 1, MSG_PEEK) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+
+/* Lower is better: what clamd reports to be working on plus what we are
+   feeding it ourselves, weighted by how fast it has been replying lately */
+static unsigned long cpool_score(const struct CP_ENTRY *cpe) {
+    return (unsigned long)(cpe->load + cpe->busy + 1) * (cpe->rtt + 1);
+}
+
+
+struct CP_ENTRY *cpool_get(int *s) {
+    unsigned int start, i, tries;
+    struct CP_ENTRY *cpe, *best;
+    unsigned long score, best_score = 0;
 
-    if(cp->alive) {
+    for(tries=0; cp->alive && tries<cp->entries; tries++) {
+	pthread_mutex_lock(&cp_lock);
+	best = NULL;
 	start = rand() % cp->entries;
 	for(i=0; i<cp->entries; i++) {
 	    cpe = &cp->pool[(i+start) % cp->entries];
 	    if(cpe->dead) continue;
-	    if(cpe->local && cp->local_cpe && !cp->local_cpe->dead)
-		cpe = cp->local_cpe;
-	    if((*s = nc_connect_entry(cpe)) == -1) {
-		cpe->dead = 1;
-		continue;
+	    score = cpool_score(cpe);
+	    if(!best || score < best_score) {
+		best = cpe;
+		best_score = score;
 	    }
-	    return cpe;
 	}
+	if(!(cpe = best)) {
+	    pthread_mutex_unlock(&cp_lock);
+	    break;
+	}
+	if(cpe->local && cp->local_cpe && !cp->local_cpe->dead)
+	    cpe = cp->local_cpe;
+	cpe->busy++;
+	while(cpe->nidle) {
+	    struct CP_SESSION *ses = &cpe->idle[--cpe->nidle];
+
+	    if(ses->last_used >= time(NULL) - cp->keepalive && session_alive(ses->sock)) {
+		*s = ses->sock;
+		pthread_mutex_unlock(&cp_lock);
+		return cpe;
+	    }
+	    close(ses->sock);
+	}
+	pthread_mutex_unlock(&cp_lock);
+
+	if((*s = nc_connect_entry(cpe)) != -1) {
+	    if(!cp->keepalive || !nc_send(*s, "nIDSESSION\n", 11))
+		return cpe;
+	}
+	pthread_mutex_lock(&cp_lock);
+	cpe->busy--;
+	cpe->dead = 1;
+	pthread_mutex_unlock(&cp_lock);
     }
     pthread_cond_signal(&mon_cond);
     return NULL;
 }
 
 
+/* Give back a connection obtained from cpool_get(): s is parked for reuse
+   unless it's -1 (already closed); ms, if not negative, is the time clamd
+   took to reply */
+void cpool_put(struct CP_ENTRY *cpe, int s, long ms) {
+    pthread_mutex_lock(&cp_lock);
+    cpe->busy--;
+    if(ms >= 0)
+	cpe->rtt = cpe->rtt ? (cpe->rtt * 7 + ms) / 8 : (unsigned long)ms + 1;
+    if(s >= 0) {
+	struct CP_SESSION *idle = NULL;
+
+	if(cp->keepalive)
+	    idle = realloc(cpe->idle, (cpe->nidle + 1) * sizeof(*idle));
+	if(idle) {
+	    cpe->idle = idle;
+	    idle[cpe->nidle].sock = s;
+	    idle[cpe->nidle].last_used = time(NULL);
+	    cpe->nidle++;
+	} else
+	    close(s);
+    }
+    pthread_mutex_unlock(&cp_lock);
+}
+
+
 /*
  * Local Variables:
  * mode: c
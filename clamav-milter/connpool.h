@@ -34,11 +34,22 @@
 
 #include "shared/optparser.h"
 
+struct CP_SESSION {
+    int sock;
+    time_t last_used;
+};
+
 struct CP_ENTRY {
     struct sockaddr *server;
     void *gai;
     socklen_t socklen;
     time_t last_poll;
+    struct CP_SESSION *idle; /* IDSESSION connections ready for reuse */
+    unsigned int nidle;
+    unsigned int busy; /* connections currently handed out */
+    unsigned int load; /* queued + busy clamd threads, as of the last STATS */
+    unsigned long rtt; /* moving average of the reply time (ms) */
+    unsigned int dbver; /* signature version, as of the last VERSION */
     uint8_t type;
     uint8_t dead;
     uint8_t local;
@@ -47,13 +58,17 @@ struct CP_ENTRY {
 struct CPOOL {
     unsigned int entries;
     unsigned int alive;
+    time_t keepalive;
+    unsigned int dbver; /* newest signature version in the pool (0 if not tracked) */
+    int track_dbver;
     struct CP_ENTRY *local_cpe;
     struct CP_ENTRY *pool;
 };
 
 void cpool_init(struct optstruct *copt);
 void cpool_free(void);
-struct CP_ENTRY *cpool_get_rand(int *s);
+struct CP_ENTRY *cpool_get(int *s);
+void cpool_put(struct CP_ENTRY *cpe, int s, long ms);
 
 extern struct CPOOL *cp;
 
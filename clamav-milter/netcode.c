@@ -312,8 +312,80 @@ void nc_ping_entry(struct CP_ENTRY *cpe) {
 }
 
 
-int nc_connect_rand(int *main, int *alt, int *local) {
-    struct CP_ENTRY *cpe = cpool_get_rand(main);
+/* Reads the STATS reply and reports the number of queued jobs plus the
+   number of busy threads */
+int nc_stats_entry(struct CP_ENTRY *cpe, unsigned int *load) {
+    char buf[1024], *line, *eol;
+    unsigned int len = 0, live = 0, idle = 0, queue = 0, done = 0;
+    time_t now, timeout;
+    int s = nc_connect_entry(cpe);
+
+    if(s < 0) return 1;
+    if(nc_send(s, "nSTATS\n", 7)) return 1;
+
+    timeout = time(NULL) + TIMEOUT;
+    while(!done && len < sizeof(buf) - 1 && (now = time(NULL)) < timeout) {
+	struct timeval tv;
+	fd_set fds;
+	int res;
+
+	tv.tv_sec = timeout - now;
+	tv.tv_usec = 0;
+	FD_ZERO(&fds);
+	FD_SET(s, &fds);
+	res = select(s+1, &fds, NULL, NULL, &tv);
+	if(res < 1) {
+	    if(res == -1 && errno == EINTR) continue;
+	    break;
+	}
+	res = recv(s, &buf[len], sizeof(buf) - 1 - len, 0);
+	if(res == -1 && errno == EAGAIN) continue;
+	if(res < 1) break;
+	len += res;
+	buf[len] = '\0';
+
+	line = buf;
+	while((eol = strchr(line, '\n'))) {
+	    *eol = '\0';
+	    if(!strncmp(line, "THREADS: ", 9))
+		sscanf(line, "THREADS: live %u idle %u", &live, &idle);
+	    else if(!strncmp(line, "QUEUE: ", 7))
+		sscanf(line, "QUEUE: %u", &queue);
+	    else if(!strcmp(line, "END")) {
+		done = 1;
+		break;
+	    }
+	    line = eol + 1;
+	}
+	len -= line - buf;
+	memmove(buf, line, len);
+    }
+    close(s);
+    if(!done) return 1;
+    *load = queue + (live > idle ? live - idle : 0);
+    return 0;
+}
+
+
+/* Returns the signature version reported by VERSION or 0 */
+unsigned int nc_version_entry(struct CP_ENTRY *cpe) {
+    int s = nc_connect_entry(cpe);
+    unsigned int dbver = 0;
+    char *reply, *ver;
+
+    if(s < 0) return 0;
+    if(nc_send(s, "nVERSION\n", 9) || !(reply = nc_recv(s)))
+	return 0;
+    close(s);
+    if((ver = strchr(reply, '/')))
+	dbver = strtoul(ver + 1, NULL, 10);
+    free(reply);
+    return dbver;
+}
+
+
+int nc_connect_pool(int *main, int *alt, int *local, struct CP_ENTRY **cpep) {
+    struct CP_ENTRY *cpe = cpool_get(main);
 
     if(!cpe) return 1;
     *local = (cpe->server->sa_family == AF_UNIX);
@@ -322,6 +394,7 @@ int nc_connect_rand(int *main, int *alt, int *local) {
 	if(cli_gentempfd(tempdir, &unlinkme, alt) != CL_SUCCESS) {
 	    logg("!Failed to create temporary file\n");
 	    close(*main);
+	    cpool_put(cpe, -1, -1);
 	    return 1;
 	}
 	unlink(unlinkme);
@@ -329,16 +402,17 @@ int nc_connect_rand(int *main, int *alt, int *local) {
 	if(nc_send(*main, "nFILDES\n", 8)) {
 	    logg("!FD scan request failed\n");
 	    close(*alt);
-	    close(*main);
+	    cpool_put(cpe, -1, -1);
 	    return 1;
 	}
     } else {
 	if(nc_send(*main, "nINSTREAM\n", 10)) {
 	    logg("!Failed to communicate with clamd\n");
-	    close(*main);
+	    cpool_put(cpe, -1, -1);
 	    return 1;
 	}
     }
+    *cpep = cpe;
     return 0;
 }
 
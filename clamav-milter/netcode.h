@@ -29,11 +29,13 @@
 #include "connpool.h"
 
 void nc_ping_entry(struct CP_ENTRY *cpe);
-int nc_connect_rand(int *main, int *alt, int *local);
+int nc_connect_pool(int *main, int *alt, int *local, struct CP_ENTRY **cpep);
 int nc_send(int s, const void *buf, size_t len);
 char *nc_recv(int s);
 int nc_sendmsg(int s, int fd);
 int nc_connect_entry(struct CP_ENTRY *cpe);
+int nc_stats_entry(struct CP_ENTRY *cpe, unsigned int *load);
+unsigned int nc_version_entry(struct CP_ENTRY *cpe);
 int localnets_init(struct optstruct *opts);
 void localnets_free(void);
 int islocalnet_name(char *name);
@@ -0,0 +1,346 @@
+/*
+ *  Background streaming of message data to clamd.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "shared/optparser.h"
+#include "shared/output.h"
+
+#include "spool.h"
+
+#if __GNUC__ >= 3 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 7)
+#define _UNUSED_ __attribute__ ((__unused__))
+#else
+#define _UNUSED_
+#endif
+
+/* give up on a clamd which accepts no data for this long (seconds) */
+#define SPOOL_TIMEOUT 30
+
+/* The MTA threads queue the (already INSTREAM framed) data here and return
+   immediately; a single writer thread pushes it to the non blocking clamd
+   sockets as they become writable. All the queues share a single memory
+   budget: when it's exhausted the MTA threads wait for the writer, which
+   is the same back-pressure they used to get from the socket. */
+
+struct SPOOL_CHUNK {
+    struct SPOOL_CHUNK *next;
+    size_t len;
+    unsigned char *data;
+};
+
+struct SPOOL {
+    struct SPOOL *next;
+    struct SPOOL_CHUNK *head;
+    struct SPOOL_CHUNK *tail;
+    size_t sent; /* bytes of head already written */
+    time_t last_io;
+    int sock;
+    int error;
+    int linked;
+};
+
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static struct SPOOL *active = NULL;
+static size_t spool_max = 0, spool_used = 0;
+static int wakefd[2] = { -1, -1 };
+static int quitting = 1;
+static pthread_t spool_th;
+
+
+/* Must be called with spool_lock held */
+static void spool_unlink(struct SPOOL *sp) {
+    struct SPOOL **prev = &active;
+
+    while(*prev && *prev != sp)
+	prev = &(*prev)->next;
+    if(*prev)
+	*prev = sp->next;
+    sp->linked = 0;
+
+    while(sp->head) {
+	struct SPOOL_CHUNK *c = sp->head;
+
+	sp->head = c->next;
+	spool_used -= c->len;
+	free(c);
+    }
+    sp->tail = NULL;
+    pthread_cond_broadcast(&space_cond);
+    pthread_cond_broadcast(&done_cond);
+}
+
+
+static void spool_wake(void) {
+    char c = 0;
+
+    if(write(wakefd[1], &c, 1) == -1 && errno != EAGAIN)
+	logg("^Failed to wake up the spool writer\n");
+}
+
+
+/* Must be called with spool_lock held; returns 0 if the queue is now empty */
+static int spool_write(struct SPOOL *sp, time_t now) {
+    while(sp->head) {
+	struct SPOOL_CHUNK *c = sp->head;
+	ssize_t res = send(sp->sock, c->data + sp->sent, c->len - sp->sent, 0);
+
+	if(res > 0) {
+	    sp->sent += res;
+	    sp->last_io = now;
+	    if(sp->sent == c->len) {
+		sp->head = c->next;
+		if(!sp->head)
+		    sp->tail = NULL;
+		sp->sent = 0;
+		spool_used -= c->len;
+		free(c);
+		pthread_cond_broadcast(&space_cond);
+	    }
+	    continue;
+	}
+	if(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+	    if(sp->last_io >= now - SPOOL_TIMEOUT)
+		return 1;
+	    logg("!Failed to stream to clamd\n");
+	} else
+	    logg("!Connection to clamd lost while streaming\n");
+	sp->error = 1;
+	spool_unlink(sp);
+	return 0;
+    }
+    pthread_cond_broadcast(&done_cond);
+    return 0;
+}
+
+
+static void *spool_writer(_UNUSED_ void *v) {
+    struct pollfd *pfds = NULL;
+    unsigned int npfds = 0;
+
+    pthread_mutex_lock(&spool_lock);
+    while(!quitting) {
+	struct SPOOL *sp, *next;
+	unsigned int n = 1;
+	char drain[64];
+	time_t now;
+
+	for(sp = active; sp; sp = sp->next)
+	    n++;
+	if(n > npfds) {
+	    struct pollfd *p = realloc(pfds, n * sizeof(*pfds));
+
+	    if(p) {
+		pfds = p;
+		npfds = n;
+	    } else
+		logg("^Out of memory in the spool writer\n");
+	}
+	if(!pfds) {
+	    /* retry in a while */
+	    pthread_mutex_unlock(&spool_lock);
+	    usleep(100000);
+	    pthread_mutex_lock(&spool_lock);
+	    continue;
+	}
+	pfds[0].fd = wakefd[0];
+	pfds[0].events = POLLIN;
+	for(sp = active, n = 1; sp && n < npfds; sp = sp->next) {
+	    if(!sp->head) continue;
+	    pfds[n].fd = sp->sock;
+	    pfds[n].events = POLLOUT;
+	    n++;
+	}
+	pthread_mutex_unlock(&spool_lock);
+
+	if(poll(pfds, n, 1000) == -1 && errno != EINTR)
+	    logg("^poll failed in the spool writer\n");
+	if(pfds[0].revents & POLLIN)
+	    while(read(wakefd[0], drain, sizeof(drain)) > 0);
+
+	/* rather than mapping pfds back, try all the busy queues: the sockets
+	   are non blocking and the list may have changed while polling */
+	pthread_mutex_lock(&spool_lock);
+	now = time(NULL);
+	for(sp = active; sp; sp = next) {
+	    next = sp->next;
+	    if(sp->head)
+		spool_write(sp, now);
+	}
+    }
+    pthread_mutex_unlock(&spool_lock);
+    free(pfds);
+    return NULL;
+}
+
+
+int spool_init(struct optstruct *opts) {
+    unsigned int i;
+
+    if(!(spool_max = optget(opts, "StreamSpoolSize")->numarg))
+	return 0;
+
+    if(pipe(wakefd) == -1) {
+	logg("!Failed to create the spool pipe\n");
+	return 1;
+    }
+    for(i=0; i<2; i++)
+	fcntl(wakefd[i], F_SETFL, fcntl(wakefd[i], F_GETFL, 0) | O_NONBLOCK);
+
+    quitting = 0;
+    if(pthread_create(&spool_th, NULL, spool_writer, NULL)) {
+	logg("!Failed to start the spool writer\n");
+	quitting = 1;
+	close(wakefd[0]);
+	close(wakefd[1]);
+	return 1;
+    }
+    return 0;
+}
+
+
+void spool_shutdown(void) {
+    if(quitting) return;
+
+    pthread_mutex_lock(&spool_lock);
+    quitting = 1;
+    pthread_mutex_unlock(&spool_lock);
+    spool_wake();
+    pthread_join(spool_th, NULL);
+    close(wakefd[0]);
+    close(wakefd[1]);
+}
+
+
+/* Returns NULL when spooling is disabled: the caller must then write to
+   the socket itself */
+struct SPOOL *spool_new(int sock) {
+    struct SPOOL *sp;
+
+    if(quitting) return NULL;
+    if(!(sp = calloc(1, sizeof(*sp)))) {
+	logg("^Out of memory allocating the spool, streaming directly\n");
+	return NULL;
+    }
+    sp->sock = sock;
+    pthread_mutex_lock(&spool_lock);
+    sp->next = active;
+    sp->linked = 1;
+    active = sp;
+    pthread_mutex_unlock(&spool_lock);
+    return sp;
+}
+
+
+/* Like nc_send(), the socket is closed on failure */
+int spool_send(struct SPOOL *sp, const void *buf, size_t len) {
+    struct SPOOL_CHUNK *c;
+    int wake;
+
+    if(!len) return 0;
+    if(!(c = malloc(sizeof(*c) + len))) {
+	logg("!Out of memory while spooling\n");
+	pthread_mutex_lock(&spool_lock);
+	sp->error = 1;
+	spool_unlink(sp);
+	pthread_mutex_unlock(&spool_lock);
+	close(sp->sock);
+	return 1;
+    }
+    c->next = NULL;
+    c->len = len;
+    c->data = (unsigned char *)(c + 1);
+    memcpy(c->data, buf, len);
+
+    pthread_mutex_lock(&spool_lock);
+    while(spool_used && spool_used + len > spool_max && !sp->error)
+	pthread_cond_wait(&space_cond, &spool_lock);
+    if(sp->error) {
+	pthread_mutex_unlock(&spool_lock);
+	free(c);
+	close(sp->sock);
+	return 1;
+    }
+    wake = !sp->head;
+    if(wake) {
+	sp->head = c;
+	sp->last_io = time(NULL);
+    } else
+	sp->tail->next = c;
+    sp->tail = c;
+    spool_used += len;
+    pthread_mutex_unlock(&spool_lock);
+
+    if(wake)
+	spool_wake();
+    return 0;
+}
+
+
+/* Waits until everything queued has reached clamd; the socket is closed on
+   failure */
+int spool_flush(struct SPOOL *sp) {
+    int err;
+
+    pthread_mutex_lock(&spool_lock);
+    while(sp->head && !sp->error)
+	pthread_cond_wait(&done_cond, &spool_lock);
+    err = sp->error;
+    pthread_mutex_unlock(&spool_lock);
+    if(err)
+	close(sp->sock);
+    return err;
+}
+
+
+/* Drops whatever is still queued; the socket is left alone */
+void spool_free(struct SPOOL *sp) {
+    if(!sp) return;
+
+    pthread_mutex_lock(&spool_lock);
+    if(sp->linked)
+	spool_unlink(sp);
+    pthread_mutex_unlock(&spool_lock);
+    free(sp);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * tab-width: 8
+ * End: 
+ * vim: set cindent smartindent autoindent softtabstop=4 shiftwidth=4 tabstop=8: 
+ */
@@ -0,0 +1,44 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#ifndef _SPOOL_H
+#define _SPOOL_H
+
+#include <sys/types.h>
+
+#include "shared/optparser.h"
+
+struct SPOOL;
+
+int spool_init(struct optstruct *opts);
+void spool_shutdown(void);
+struct SPOOL *spool_new(int sock);
+int spool_send(struct SPOOL *sp, const void *buf, size_t len);
+int spool_flush(struct SPOOL *sp);
+void spool_free(struct SPOOL *sp);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * tab-width: 8
+ * End: 
+ * vim: set cindent smartindent autoindent softtabstop=4 shiftwidth=4 tabstop=8: 
+ */
@@ -0,0 +1,199 @@
+/*
+ *  Cache of the clamd verdicts for recently seen message bodies.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "shared/optparser.h"
+#include "shared/output.h"
+
+#include "vcache.h"
+
+/* Entries are keyed by the digest of the message body (plus the headers
+   which affect its MIME parsing) and by the signature version of the clamd
+   which produced the verdict: as soon as any clamd in the pool reports a
+   newer database the old entries simply stop matching and age out. */
+
+struct VCACHE_ENTRY {
+    struct VCACHE_ENTRY *hnext; /* hash chain */
+    struct VCACHE_ENTRY *prev, *next; /* LRU list, most recent first */
+    unsigned char digest[VCACHE_HASHLEN];
+    unsigned int dbver;
+    char *reply;
+};
+
+static pthread_mutex_t vcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct VCACHE_ENTRY *entries = NULL;
+static struct VCACHE_ENTRY **buckets = NULL;
+static struct VCACHE_ENTRY *mru = NULL, *lru = NULL;
+static unsigned int nbuckets = 0, nentries = 0, maxentries = 0;
+
+
+static unsigned int vcache_bucket(const unsigned char *digest) {
+    unsigned int h;
+
+    /* the digest is already uniformly distributed */
+    memcpy(&h, digest, sizeof(h));
+    return h & (nbuckets - 1);
+}
+
+
+static void lru_unlink(struct VCACHE_ENTRY *e) {
+    if(e->prev) e->prev->next = e->next;
+    else mru = e->next;
+    if(e->next) e->next->prev = e->prev;
+    else lru = e->prev;
+    e->prev = e->next = NULL;
+}
+
+
+static void lru_push(struct VCACHE_ENTRY *e) {
+    e->prev = NULL;
+    e->next = mru;
+    if(mru) mru->prev = e;
+    mru = e;
+    if(!lru) lru = e;
+}
+
+
+static void hash_unlink(struct VCACHE_ENTRY *e) {
+    struct VCACHE_ENTRY **p = &buckets[vcache_bucket(e->digest)];
+
+    while(*p && *p != e)
+	p = &(*p)->hnext;
+    if(*p)
+	*p = e->hnext;
+    e->hnext = NULL;
+}
+
+
+static struct VCACHE_ENTRY *vcache_find(const unsigned char *digest, unsigned int dbver) {
+    struct VCACHE_ENTRY *e = buckets[vcache_bucket(digest)];
+
+    while(e && (e->dbver != dbver || memcmp(e->digest, digest, VCACHE_HASHLEN)))
+	e = e->hnext;
+    return e;
+}
+
+
+int vcache_init(struct optstruct *opts) {
+    if(!(maxentries = optget(opts, "VerdictCacheSize")->numarg))
+	return 0;
+
+    for(nbuckets = 1; nbuckets < maxentries; nbuckets <<= 1);
+    entries = calloc(maxentries, sizeof(*entries));
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    if(!entries || !buckets) {
+	logg("!Out of memory allocating the verdict cache\n");
+	vcache_free();
+	return 1;
+    }
+    logg("*Verdict cache enabled (%u entries)\n", maxentries);
+    return 0;
+}
+
+
+void vcache_free(void) {
+    unsigned int i;
+
+    if(entries) {
+	for(i=0; i<nentries; i++)
+	    free(entries[i].reply);
+	free(entries);
+    }
+    free(buckets);
+    entries = NULL;
+    buckets = NULL;
+    mru = lru = NULL;
+    nbuckets = nentries = maxentries = 0;
+}
+
+
+int vcache_enabled(void) {
+    return maxentries != 0;
+}
+
+
+/* Returns a copy of the cached clamd reply, or NULL on miss */
+char *vcache_lookup(const unsigned char *digest, unsigned int dbver) {
+    struct VCACHE_ENTRY *e;
+    char *reply = NULL;
+
+    if(!maxentries || !dbver) return NULL;
+
+    pthread_mutex_lock(&vcache_lock);
+    if((e = vcache_find(digest, dbver))) {
+	lru_unlink(e);
+	lru_push(e);
+	reply = strdup(e->reply);
+    }
+    pthread_mutex_unlock(&vcache_lock);
+    return reply;
+}
+
+
+/* Only final verdicts are worth remembering: errors and timeouts are not */
+void vcache_add(const unsigned char *digest, unsigned int dbver, const char *reply) {
+    struct VCACHE_ENTRY *e;
+    size_t len = strlen(reply);
+    char *copy;
+
+    if(!maxentries || !dbver) return;
+    if(!(len > 5 && !strcmp(reply + len - 5, ": OK\n")) && !(len > 7 && !strcmp(reply + len - 7, " FOUND\n")))
+	return;
+    if(!(copy = strdup(reply)))
+	return;
+
+    pthread_mutex_lock(&vcache_lock);
+    if((e = vcache_find(digest, dbver))) {
+	free(e->reply);
+	lru_unlink(e);
+    } else {
+	if(nentries < maxentries)
+	    e = &entries[nentries++];
+	else {
+	    e = lru;
+	    lru_unlink(e);
+	    hash_unlink(e);
+	    free(e->reply);
+	}
+	memcpy(e->digest, digest, VCACHE_HASHLEN);
+	e->dbver = dbver;
+	e->hnext = buckets[vcache_bucket(digest)];
+	buckets[vcache_bucket(digest)] = e;
+    }
+    e->reply = copy;
+    lru_push(e);
+    pthread_mutex_unlock(&vcache_lock);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * tab-width: 8
+ * End: 
+ * vim: set cindent smartindent autoindent softtabstop=4 shiftwidth=4 tabstop=8: 
+ */
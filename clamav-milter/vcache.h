@@ -0,0 +1,42 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#ifndef _VCACHE_H
+#define _VCACHE_H
+
+#include "shared/optparser.h"
+
+#define VCACHE_HASH "sha256"
+#define VCACHE_HASHLEN 32
+
+int vcache_init(struct optstruct *opts);
+void vcache_free(void);
+int vcache_enabled(void);
+char *vcache_lookup(const unsigned char *digest, unsigned int dbver);
+void vcache_add(const unsigned char *digest, unsigned int dbver, const char *reply);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * tab-width: 8
+ * End: 
+ * vim: set cindent smartindent autoindent softtabstop=4 shiftwidth=4 tabstop=8: 
+ */
@@ -122,8 +122,11 @@ int main(int argc, char **argv)
     char *pua_cats = NULL, *pt;
     int ret, tcpsock = 0, localsock = 0, min_port, max_port;
     unsigned int sigs = 0;
+    int bgload = 0;
     int *lsockets=NULL;
     unsigned int nlsockets = 0;
+    int *rsockets=NULL; /* see AcceptThreads */
+    unsigned int nrsockets = 0;
     unsigned int dboptions = 0;
     unsigned int i;	
     int j;
@@ -374,6 +377,88 @@ int main(int argc, char **argv)
         if (optget(opts, "disable-cache")->enabled)
             cl_engine_set_num(engine, CL_ENGINE_DISABLE_CACHE, 1);
 
+        if ((opt = optget(opts, "CacheSize"))->active)
+            cl_engine_set_num(engine, CL_ENGINE_CACHE_SIZE, opt->numarg);
+
+        if ((opt = optget(opts, "HugePages"))->enabled && strcmp(opt->strarg, "no")) {
+            if (!strcmp(opt->strarg, "explicit"))
+                cl_engine_set_num(engine, CL_ENGINE_HUGEPAGES, CL_HUGEPAGES_EXPLICIT);
+            else
+                cl_engine_set_num(engine, CL_ENGINE_HUGEPAGES, CL_HUGEPAGES_TRANSPARENT);
+            logg("#Huge pages: %s\n", opt->strarg);
+        }
+
+        if ((opt = optget(opts, "DatabaseLoadThreads"))->numarg) {
+            cl_engine_set_num(engine, CL_ENGINE_LOAD_THREADS, opt->numarg);
+            logg("#Database load threads: %lld\n", opt->numarg);
+        }
+
+        if (optget(opts, "LazyMatchers")->enabled) {
+            cl_engine_set_num(engine, CL_ENGINE_LAZY_MATCHERS, 1);
+            logg("#Lazy matchers: enabled\n");
+        }
+
+        if ((opt = optget(opts, "MergedScanTarget"))->enabled) {
+            uint32_t targets = 0;
+
+            for (; opt; opt = opt->nextarg) {
+                if (opt->numarg > 0 && opt->numarg < 32) {
+                    targets |= 1U << opt->numarg;
+                    logg("#Merged pattern scan for target %lld\n", opt->numarg);
+                }
+            }
+            cl_engine_set_num(engine, CL_ENGINE_MERGED_TARGETS, targets);
+        }
+
+        if ((opt = optget(opts, "SignatureShard"))->enabled) {
+            unsigned int index, count;
+
+            if (sscanf(opt->strarg, "%u/%u", &index, &count) != 2 || !count || !index || index > count) {
+                logg("!Invalid SignatureShard %s\n", opt->strarg);
+                ret = 1;
+                break;
+            }
+            cl_engine_set_num(engine, CL_ENGINE_SHARD_INDEX, index - 1);
+            cl_engine_set_num(engine, CL_ENGINE_SHARD_COUNT, count);
+            logg("#Signature shard: %u of %u\n", index, count);
+        }
+
+        if ((opt = optget(opts, "HashImageFile"))->enabled) {
+            if ((ret = cl_engine_set_str(engine, CL_ENGINE_HASH_IMAGE, opt->strarg))) {
+                logg("!cli_engine_set_str(HashImageFile) failed: %s\n", cl_strerror(ret));
+                ret = 1;
+                break;
+            }
+            logg("#Hash image file: %s\n", opt->strarg);
+        }
+
+        if ((opt = optget(opts, "ACProfileFile"))->enabled) {
+            if ((ret = cl_engine_set_str(engine, CL_ENGINE_AC_PROFILE, opt->strarg))) {
+                logg("!cli_engine_set_str(ACProfileFile) failed: %s\n", cl_strerror(ret));
+                ret = 1;
+                break;
+            }
+            logg("#AC profile file: %s\n", opt->strarg);
+        }
+
+        if ((opt = optget(opts, "CacheFile"))->enabled) {
+            if ((ret = cl_engine_set_str(engine, CL_ENGINE_CACHE_FILE, opt->strarg))) {
+                logg("!cli_engine_set_str(CacheFile) failed: %s\n", cl_strerror(ret));
+                ret = 1;
+                break;
+            }
+            logg("#Cache file: %s\n", opt->strarg);
+        }
+
+        if ((opt = optget(opts, "ScanJournal"))->enabled) {
+            if (!(scan_journal = journal_open(opt->strarg))) {
+                logg("!Can't initialize the scan journal\n");
+                ret = 1;
+                break;
+            }
+            logg("#Scan journal: %s\n", opt->strarg);
+        }
+
         /* load the database(s) */
         dbdir = optget(opts, "DatabaseDirectory")->strarg;
         logg("#Reading databases from %s\n", dbdir);
@@ -587,13 +672,19 @@ int main(int argc, char **argv)
             logg("#Max A-C depth set to %u\n", (unsigned int) opt->numarg);
         }
 
-        if((ret = cl_load(dbdir, engine, &sigs, dboptions))) {
+        /* recvloop_th loads the databases once clamd is listening */
+        if((bgload = optget(opts, "BackgroundStartupLoad")->enabled) && optget(opts, "WorkerProcesses")->numarg) {
+            logg("^BackgroundStartupLoad is ignored with WorkerProcesses\n");
+            bgload = 0;
+        }
+
+        if(!bgload && (ret = cl_load(dbdir, engine, &sigs, dboptions))) {
             logg("!%s\n", cl_strerror(ret));
             ret = 1;
             break;
         }
 
-        if((ret = statinidir_th(dbdir))) {
+        if(!bgload && (ret = statinidir_th(dbdir))) {
             logg("!%s\n", cl_strerror(ret));
             ret = 1;
             break;
@@ -602,7 +693,8 @@ int main(int argc, char **argv)
         if (optget(opts, "DisableCertCheck")->enabled)
             cl_engine_set_num(engine, CL_ENGINE_DISABLE_PE_CERTS, 1);
 
-        logg("#Loaded %u signatures.\n", sigs);
+        if(!bgload)
+            logg("#Loaded %u signatures.\n", sigs);
 
         /* pcre engine limits - required for cl_engine_compile */
         if((opt = optget(opts, "PCREMatchLimit"))->active) {
@@ -621,10 +713,13 @@ int main(int argc, char **argv)
             }
         }
 
-        if((ret = cl_engine_compile(engine)) != 0) {
-            logg("!Database initialization error: %s\n", cl_strerror(ret));
-            ret = 1;
-            break;
+        if(!bgload) {
+            if((ret = cl_engine_compile(engine)) != 0) {
+                logg("!Database initialization error: %s\n", cl_strerror(ret));
+                ret = 1;
+                break;
+            }
+            print_loadstats(engine);
         }
 
         if(tcpsock || num_fd > 0) {
@@ -655,6 +750,14 @@ int main(int argc, char **argv)
                 }
             }
         }
+        if((opt = optget(opts, "AcceptThreads"))->numarg > 1 && nlsockets) {
+            if (num_fd > 0 || optget(opts, "WorkerProcesses")->numarg) {
+                logg("^AcceptThreads is ignored with systemd socket activation and with WorkerProcesses\n");
+            } else if (tcpserver_reuseport(lsockets, nlsockets, &rsockets, &nrsockets, opt->numarg - 1, opts) == -1) {
+                ret = 1;
+                break;
+            }
+        }
 #ifndef _WIN32
         if(localsock && num_fd == 0) {
             int *t;
@@ -797,7 +900,22 @@ int main(int argc, char **argv)
             break;
         }
 
-        ret = recvloop_th(lsockets, nlsockets, engine, dboptions, opts);
+#ifndef _WIN32
+        if(optget(opts, "WorkerProcesses")->numarg) {
+            /* the workers start their own log writer */
+            ret = prefork_run(lsockets, nlsockets, engine, dboptions, opts);
+            break;
+        }
+#endif
+
+        if((opt = optget(opts, "LogBufferSize"))->numarg && logg_file) {
+            if(logg_async_start(opt->numarg))
+                logg("^Can't start the log writer, logging synchronously\n");
+            else
+                logg("#Log buffer size set to %llu bytes.\n", (unsigned long long) opt->numarg);
+        }
+
+        ret = recvloop_th(lsockets, nlsockets, rsockets, nrsockets, engine, dboptions, opts);
 
     } while (0);
 
@@ -808,6 +926,9 @@ int main(int argc, char **argv)
         for (i = 0; i < nlsockets; i++) {
             closesocket(lsockets[i]);
         }
+        for (i = 0; i < nrsockets; i++) {
+            closesocket(rsockets[i]);
+        }
 #ifndef _WIN32
         if(nlsockets && localsock) {
             opt = optget(opts, "LocalSocket");
@@ -821,7 +942,9 @@ int main(int argc, char **argv)
     }
 
     free(lsockets);
+    free(rsockets);
 
+    logg_async_stop();
     logg_close();
     optfree(opts);
 
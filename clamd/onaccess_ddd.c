@@ -28,9 +28,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fts.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
@@ -57,13 +57,12 @@
 #include "scanner.h"
 
 static int onas_ddd_init_ht(uint32_t ht_size);
-static int onas_ddd_init_wdlt(uint64_t nwatches);
-static int onas_ddd_grow_wdlt();
 
 static int onas_ddd_watch(const char *pathname, int fan_fd, uint64_t fan_mask, int in_fd, uint64_t in_mask);
-static int onas_ddd_watch_hierarchy(const char* pathname, size_t len, int fd, uint64_t mask, uint32_t type);
-static int onas_ddd_unwatch(const char *pathname, int fan_fd, int in_fd);
-static int onas_ddd_unwatch_hierarchy(const char* pathname, size_t len, int fd, uint32_t type);
+static int onas_ddd_watch_hierarchy(struct onas_hnode *top, int fd, uint64_t mask, uint32_t type);
+static int onas_ddd_unwatch(const char *pathname, int fan_fd, uint64_t fan_mask, int in_fd);
+static void onas_ddd_unwatch_hierarchy(struct onas_hnode *top, int fd, uint64_t mask, uint32_t type);
+static int onas_ddd_mark_mount(struct ddd_thrarg *tharg, const char *pathname);
 
 static void onas_ddd_handle_in_moved_to(struct ddd_thrarg *tharg, const char *path, const char *child_path, const struct inotify_event *event, int wd, uint64_t in_mask);
 static void onas_ddd_handle_in_create(struct ddd_thrarg *tharg, const char *path, const char *child_path, const struct inotify_event *event, int wd, uint64_t in_mask);
@@ -75,8 +74,6 @@ static void onas_ddd_exit(int sig);
 
 /* TODO: Unglobalize these. */
 static struct onas_ht *ddd_ht;
-static char **wdlt;
-static uint32_t wdlt_len;
 static int onas_in_fd;
 
 static int onas_ddd_init_ht(uint32_t ht_size) {
@@ -87,215 +84,172 @@ static int onas_ddd_init_ht(uint32_t ht_size) {
 	return onas_ht_init(&ddd_ht, ht_size);
 }
 
-static int onas_ddd_init_wdlt(uint64_t nwatches) {
+int onas_ddd_init(uint32_t ht_size) {
 
-	if (nwatches <= 0) return CL_EARG;
-
-	wdlt = (char **) cli_calloc(nwatches << 1, sizeof(char*));
-	if (!wdlt) return CL_EMEM;
-
-	wdlt_len = nwatches << 1;
-
-	return CL_SUCCESS;
+	return onas_ddd_init_ht(ht_size);
 }
 
-static int onas_ddd_grow_wdlt() {
+/* Next node of the hierarchy under top in preorder, NULL once it's all visited. */
+static struct onas_hnode *onas_ddd_next(struct onas_hnode *top, struct onas_hnode *curr) {
 
-	char **ptr = NULL;
+	if (curr->child)
+		return curr->child;
 
-	ptr = (char **) cli_realloc(wdlt, wdlt_len << 1);
-	if (ptr) {
-		wdlt = ptr;
-		memset(&ptr[wdlt_len], 0, sizeof(char *) * (wdlt_len - 1));
-	} else {
-		return CL_EMEM;
-	}
-
-	wdlt_len <<= 1;
+	while (curr != top && !curr->next)
+		curr = curr->parent;
 
-	return CL_SUCCESS;
-}
-
-
-/* TODO: Support configuration for changing/setting number of inotify watches. */
-int onas_ddd_init(uint64_t nwatches, size_t ht_size) {
-
-	const char* nwatch_file = "/proc/sys/fs/inotify/max_user_watches";
-	int nwfd = 0;
-	int ret = 0;
-	char nwatch_str[MAX_WATCH_LEN];
-	char *p = NULL;
-	nwatches = 0;
-
-	nwfd = open(nwatch_file, O_RDONLY);
-	if (nwfd < 0) return CL_EOPEN;
-
-	ret = read(nwfd, nwatch_str, MAX_WATCH_LEN);
-	close(nwfd);
-	if (ret < 0) return CL_EREAD;
-
-	nwatches = strtol(nwatch_str, &p, 10);
-
-	ret = onas_ddd_init_wdlt(nwatches);
-	if (ret) return ret;
-
-	ret = onas_ddd_init_ht(ht_size);
-	if (ret) return ret;
-
-	return CL_SUCCESS;
+	return curr == top ? NULL : curr->next;
 }
 
 static int onas_ddd_watch(const char *pathname, int fan_fd, uint64_t fan_mask, int in_fd, uint64_t in_mask) {
 	if (!pathname || fan_fd <= 0 || in_fd <= 0) return CL_ENULLARG;
 
 	int ret = CL_SUCCESS;
-	size_t len = strlen(pathname);
+	struct onas_hnode *hnode = NULL;
+
+	if(onas_ht_get(ddd_ht, pathname, strlen(pathname), &hnode) != CL_SUCCESS) return CL_EARG;
 
-	ret = onas_ddd_watch_hierarchy(pathname, len, in_fd, in_mask, ONAS_IN);
+	ret = onas_ddd_watch_hierarchy(hnode, in_fd, in_mask, ONAS_IN);
 	if (ret) return ret;
 
-	ret = onas_ddd_watch_hierarchy(pathname, len, fan_fd, fan_mask, ONAS_FAN);
+	ret = onas_ddd_watch_hierarchy(hnode, fan_fd, fan_mask, ONAS_FAN);
 	if (ret) return ret;
 
 	return CL_SUCCESS;
 }
 
-static int onas_ddd_watch_hierarchy(const char* pathname, size_t len, int fd, uint64_t mask, uint32_t type) {
+static int onas_ddd_watch_hierarchy(struct onas_hnode *top, int fd, uint64_t mask, uint32_t type) {
 
-	if (!pathname || fd <= 0 || !type) return CL_ENULLARG;
+	if (!top || fd <= 0 || !type) return CL_ENULLARG;
 
 	if (type == (ONAS_IN | ONAS_FAN)) return CL_EARG;
 
-	struct onas_hnode *hnode = NULL;
-	struct onas_element *elem = NULL;
+	struct onas_hnode *curr = top;
+	char path[PATH_MAX];
 	int wd = 0;
 
-	if(onas_ht_get(ddd_ht, pathname, len, &elem) != CL_SUCCESS) return CL_EARG;
-
-	hnode = elem->data;
-
-	if (type & ONAS_IN) {
-		wd = inotify_add_watch(fd, pathname, (uint32_t) mask);
-
-		if (wd < 0) return CL_EARG;
-
-		if ((uint32_t) wd >= wdlt_len) {
-			onas_ddd_grow_wdlt();
+	for (; curr; curr = onas_ddd_next(top, curr)) {
+		if (!onas_ht_path(curr, path, sizeof(path))) {
+			if (curr == top) return CL_EARG;
+			continue;
 		}
 
-		/* Link the hash node to the watch descriptor lookup table */
-		hnode->wd = wd;
-		wdlt[wd] = hnode->pathname;
-
-		hnode->watched |= ONAS_INWATCH;
-	} else if (type & ONAS_FAN) {
-		if(fanotify_mark(fd, FAN_MARK_ADD, mask, AT_FDCWD, hnode->pathname) < 0) return CL_EARG;
-		hnode->watched |= ONAS_FANWATCH;
-	} else {
-		return CL_EARG;
-	}
+		if (type & ONAS_IN) {
+			wd = inotify_add_watch(fd, path, (uint32_t) mask);
 
-	struct onas_lnode *curr = hnode->childhead;
-
-	while (curr->next != hnode->childtail) {
-		curr = curr->next;
+			if (wd < 0) {
+				/* Removed since the crawl, the event is on its way */
+				if (curr != top && errno == ENOENT) continue;
+				return CL_EARG;
+			}
 
-		size_t size = len + strlen(curr->dirname) + 2;
-		char *child_path = (char *) cli_malloc(size);
-		if (child_path == NULL)
-			return CL_EMEM;
-		if (hnode->pathname[len-1] == '/')
-			snprintf(child_path, --size, "%s%s", hnode->pathname, curr->dirname);
-		else
-			snprintf(child_path, size, "%s/%s", hnode->pathname, curr->dirname);
+			/* Link the node to its watch descriptor */
+			if (onas_ht_set_wd(ddd_ht, curr, wd)) return CL_EMEM;
 
-		if(onas_ddd_watch_hierarchy(child_path, strlen(child_path), fd, mask, type)) {
+			curr->watched |= ONAS_INWATCH;
+		} else if (type & ONAS_FAN) {
+			if(fanotify_mark(fd, FAN_MARK_ADD, mask, AT_FDCWD, path) < 0) {
+				if (curr != top && errno == ENOENT) continue;
+				return CL_EARG;
+			}
+			curr->watched |= ONAS_FANWATCH;
+		} else {
 			return CL_EARG;
 		}
-		free(child_path);
 	}
 
 	return CL_SUCCESS;
 }
 
-static int onas_ddd_unwatch(const char *pathname, int fan_fd, int in_fd) {
+static int onas_ddd_unwatch(const char *pathname, int fan_fd, uint64_t fan_mask, int in_fd) {
 	if (!pathname || fan_fd <= 0 || in_fd <= 0) return CL_ENULLARG;
 
-	int ret = CL_SUCCESS;
-	size_t len = strlen(pathname);
+	struct onas_hnode *hnode = NULL;
 
-	ret = onas_ddd_unwatch_hierarchy(pathname, len, in_fd, ONAS_IN);
-	if (ret) return ret;
+	if(onas_ht_get(ddd_ht, pathname, strlen(pathname), &hnode) != CL_SUCCESS) return CL_EARG;
 
-	ret = onas_ddd_unwatch_hierarchy(pathname, len,fan_fd, ONAS_FAN);
-	if (ret) return ret;
+	onas_ddd_unwatch_hierarchy(hnode, in_fd, 0, ONAS_IN);
+	onas_ddd_unwatch_hierarchy(hnode, fan_fd, fan_mask, ONAS_FAN);
 
 	return CL_SUCCESS;
 }
 
-static int onas_ddd_unwatch_hierarchy(const char* pathname, size_t len, int fd, uint32_t type) {
+/* The watches of deleted directories are already gone, failures don't matter. */
+static void onas_ddd_unwatch_hierarchy(struct onas_hnode *top, int fd, uint64_t mask, uint32_t type) {
 
-	if (!pathname || fd <= 0 || !type) return CL_ENULLARG;
+	struct onas_hnode *curr = top;
+	char path[PATH_MAX];
 
-	if (type == (ONAS_IN | ONAS_FAN)) return CL_EARG;
-
-	struct onas_hnode *hnode = NULL;
-	struct onas_element *elem = NULL;
-	int wd = 0;
+	for (; curr; curr = onas_ddd_next(top, curr)) {
+		if ((type & ONAS_IN) && (curr->watched & ONAS_INWATCH)) {
+			inotify_rm_watch(fd, curr->wd);
 
-	if(onas_ht_get(ddd_ht, pathname, len, &elem)) return CL_EARG;
+			/* Unlink the node from its watch descriptor */
+			onas_ht_clear_wd(ddd_ht, curr);
+			curr->watched &= ~ONAS_INWATCH;
+		} else if ((type & ONAS_FAN) && (curr->watched & ONAS_FANWATCH)) {
+			if (onas_ht_path(curr, path, sizeof(path)))
+				fanotify_mark(fd, FAN_MARK_REMOVE, mask, AT_FDCWD, path);
+			curr->watched &= ~ONAS_FANWATCH;
+		}
+	}
+}
 
-	hnode = elem->data;
+/* Checks if pathname is dir or one of its subdirectories. */
+static int onas_ddd_is_under(const char *pathname, const char *dir) {
 
-	if (type & ONAS_IN) {
-		wd = hnode->wd;
+	size_t len = strlen(dir);
 
-		if(!inotify_rm_watch(fd, wd)) return CL_EARG;
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
 
-		/* Unlink the hash node from the watch descriptor lookup table */
-		hnode->wd = 0;
-		wdlt[wd] = NULL;
+	return !strncmp(pathname, dir, len) && (pathname[len] == '/' || pathname[len] == 0);
+}
 
-		hnode->watched = ONAS_STOPWATCH;
-	} else if (type & ONAS_FAN) {
-		if(fanotify_mark(fd, FAN_MARK_REMOVE, 0, AT_FDCWD, hnode->pathname) < 0) return CL_EARG;
-		hnode->watched = ONAS_STOPWATCH;
-	} else {
-		return CL_EARG;
-	}
+/* An included directory which is the root of a mount is covered by a
+ * single fanotify mark on the mount, instead of a mark on each directory:
+ * it doesn't need to be crawled nor watched with inotify. Like the crawl,
+ * the mark doesn't extend to the file systems mounted below it. */
+static int onas_ddd_mark_mount(struct ddd_thrarg *tharg, const char *pathname) {
 
-	struct onas_lnode *curr = hnode->childhead;
+	const struct optstruct *pt;
+	struct stat s, ps;
+	char prnt[PATH_MAX];
 
-	while (curr->next != hnode->childtail) {
-		curr = curr->next;
+	/* The new files are only seen through inotify */
+	if (optget(tharg->opts, "OnAccessExtraScanning")->enabled) return 0;
 
-		size_t size = len + strlen(curr->dirname) + 2;
-		char *child_path = (char *) cli_malloc(size);
-		if (child_path == NULL)
-			return CL_EMEM;
-		if (hnode->pathname[len-1] == '/')
-			snprintf(child_path, --size, "%s%s", hnode->pathname, curr->dirname);
-		else
-			snprintf(child_path, size, "%s/%s", hnode->pathname, curr->dirname);
+	if (snprintf(prnt, sizeof(prnt), "%s/..", pathname) >= (int) sizeof(prnt)) return 0;
+	if (lstat(pathname, &s) || !S_ISDIR(s.st_mode) || stat(prnt, &ps)) return 0;
+	if (s.st_dev == ps.st_dev && s.st_ino != ps.st_ino) return 0;
 
-		onas_ddd_unwatch_hierarchy(child_path, strlen(child_path), fd, type);
-		free(child_path);
+	/* The mark can't leave out the excluded directories */
+	if((pt = optget(tharg->opts, "OnAccessExcludePath"))->enabled) {
+		while(pt) {
+			if (onas_ddd_is_under(pt->strarg, pathname)) return 0;
+			pt = (struct optstruct *) pt->nextarg;
+		}
 	}
 
-	return CL_SUCCESS;
+	if (fanotify_mark(tharg->fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT, tharg->fan_mask, AT_FDCWD, pathname) < 0) return 0;
+
+	return 1;
 }
 
 void *onas_ddd_th(void *arg) {
 	struct ddd_thrarg *tharg = (struct ddd_thrarg *) arg;
-	sigset_t sigset;
+	sigset_t sigset, blocked;
 	struct sigaction act;
 	const struct optstruct *pt;
 	uint64_t in_mask = IN_ONLYDIR | IN_MOVE | IN_DELETE | IN_CREATE;
 	fd_set rfds;
 	char buf[4096];
+	char path[PATH_MAX], child_path[PATH_MAX];
 	ssize_t bread;
 	const struct inotify_event *event;
-	int ret, len;
+	struct onas_hnode *hnode;
+	int ret, nthreads;
+	size_t len;
 
 	/* ignore all signals except SIGUSR1 */
 	sigfillset(&sigset);
@@ -308,7 +262,10 @@ void *onas_ddd_th(void *arg) {
 #ifdef SIGBUS
 	sigdelset(&sigset, SIGBUS);
 #endif
-	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+	/* SIGUSR1 frees the tree, it's only let in while waiting for events */
+	blocked = sigset;
+	sigaddset(&blocked, SIGUSR1);
+	pthread_sigmask(SIG_SETMASK, &blocked, NULL);
 	memset(&act, 0, sizeof(struct sigaction));
 	act.sa_handler = onas_ddd_exit;
 	sigfillset(&(act.sa_mask));
@@ -321,12 +278,19 @@ void *onas_ddd_th(void *arg) {
 		return NULL;
 	}
 
-	ret = onas_ddd_init(0, ONAS_DEFAULT_HT_SIZE);
+	ret = onas_ddd_init(ONAS_DEFAULT_HT_SIZE);
 	if (ret) {
 		logg("!ScanOnAccess: Failed to initialize 3D. \n");
 		return NULL;
 	}
 
+	/* The initial crawl is mostly spent waiting for the disks */
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	else if (nthreads > ONAS_DDD_CRAWL_THREADS)
+		nthreads = ONAS_DDD_CRAWL_THREADS;
+
 	/* Add provided paths recursively. */
 	if((pt = optget(tharg->opts, "OnAccessIncludePath"))->enabled) {
 		while(pt) {
@@ -336,8 +300,13 @@ void *onas_ddd_th(void *arg) {
 				pt = (struct optstruct *) pt->nextarg;
 				continue;
 			}
+			if (onas_ddd_mark_mount(tharg, pt->strarg)) {
+				logg("ScanOnAccess: Protecting mount '%s' (and all sub-directories)\n", pt->strarg);
+				pt = (struct optstruct *) pt->nextarg;
+				continue;
+			}
 			if(onas_ht_get(ddd_ht, pt->strarg, strlen(pt->strarg), NULL) != CL_SUCCESS) {
-				if(onas_ht_add_hierarchy(ddd_ht, pt->strarg)) {
+				if(onas_ht_add_hierarchy(ddd_ht, pt->strarg, nthreads)) {
 					logg("!ScanOnAccess: Can't include path '%s'\n", pt->strarg);
 					return NULL;
 				} else
@@ -356,7 +325,7 @@ void *onas_ddd_th(void *arg) {
 		while(pt) {
 			size_t ptlen = strlen(pt->strarg);
 			if(onas_ht_get(ddd_ht, pt->strarg, ptlen, NULL) == CL_SUCCESS) {
-				if(onas_ht_rm_hierarchy(ddd_ht, pt->strarg, ptlen, 0)) {
+				if(onas_ht_rm_hierarchy(ddd_ht, pt->strarg, ptlen)) {
 					logg("!ScanOnAccess: Can't exclude path '%s'\n", pt->strarg);
 					return NULL;
 				} else
@@ -396,7 +365,7 @@ void *onas_ddd_th(void *arg) {
 
 	while (1) {
 		do {
-			ret = select(onas_in_fd + 1, &rfds, NULL, NULL, NULL);
+			ret = pselect(onas_in_fd + 1, &rfds, NULL, NULL, NULL, &sigset);
 		} while(ret == -1 && errno == EINTR);
 
 		while((bread = read(onas_in_fd, buf, sizeof(buf))) > 0) {
@@ -404,25 +373,31 @@ void *onas_ddd_th(void *arg) {
 			/* Handle events. */
 			int wd;
 			char *p = buf;
-			const char *path = NULL;
-			const char *child = NULL;
 			for(; p < buf + bread; p += sizeof(struct inotify_event) + event->len) {
 
 				event = (const struct inotify_event *) p;
 				wd = event->wd;
-				path = wdlt[wd];
-				child = event->name;
 
-				len = strlen(path);
-				size_t size = strlen(child) + len + 2;
-				char *child_path = (char *) cli_malloc(size);
-				if (child_path == NULL)
-					return NULL;
+				if (event->mask & IN_Q_OVERFLOW) {
+					logg("^ScanOnAccess: Too many directory changes at once, some new directories may not be watched\n");
+					continue;
+				}
+
+				if (!(hnode = onas_ht_get_wd(ddd_ht, wd)))
+					continue;
 
-				if (path[len-1] == '/')
-					snprintf(child_path, --size, "%s%s", path, child);
-				else
-					snprintf(child_path, size, "%s/%s", path, child);
+				/* The watch is gone along with the directory */
+				if (event->mask & IN_IGNORED) {
+					onas_ht_clear_wd(ddd_ht, hnode);
+					hnode->watched &= ~ONAS_INWATCH;
+					continue;
+				}
+
+				if (!event->len || !(len = onas_ht_path(hnode, path, sizeof(path))))
+					continue;
+
+				if (snprintf(child_path, sizeof(child_path), "%s%s%s", path, path[len-1] == '/' ? "" : "/", event->name) >= (int) sizeof(child_path))
+					continue;
 
 				if (event->mask & IN_DELETE) {
 					onas_ddd_handle_in_delete(tharg, path, child_path, event, wd);
@@ -451,8 +426,8 @@ static void onas_ddd_handle_in_delete(struct ddd_thrarg *tharg,
 	if(!(event->mask & IN_ISDIR)) return;
 
 	logg("*ddd: DELETE - Removing %s from %s with wd:%d\n", child_path, path, wd);
-	onas_ddd_unwatch(child_path, tharg->fan_fd, onas_in_fd);
-	onas_ht_rm_hierarchy(ddd_ht, child_path, strlen(child_path), 0);
+	onas_ddd_unwatch(child_path, tharg->fan_fd, tharg->fan_mask, onas_in_fd);
+	onas_ht_rm_hierarchy(ddd_ht, child_path, strlen(child_path));
 
 	return;
 }
@@ -466,8 +441,8 @@ static void onas_ddd_handle_in_moved_from(struct ddd_thrarg *tharg,
 	if(!(event->mask & IN_ISDIR)) return;
 
 	logg("*ddd: MOVED_FROM - Removing %s from %s with wd:%d\n", child_path, path, wd);
-	onas_ddd_unwatch(child_path, tharg->fan_fd, onas_in_fd);
-	onas_ht_rm_hierarchy(ddd_ht, child_path, strlen(child_path), 0);
+	onas_ddd_unwatch(child_path, tharg->fan_fd, tharg->fan_mask, onas_in_fd);
+	onas_ht_rm_hierarchy(ddd_ht, child_path, strlen(child_path));
 
 	return;
 }
@@ -483,7 +458,7 @@ static void onas_ddd_handle_in_create(struct ddd_thrarg *tharg,
 
 		} else if(stat(child_path, &s) == 0 && S_ISDIR(s.st_mode)) {
 			logg("*ddd: CREATE - Adding %s to %s with wd:%d\n", child_path, path, wd);
-			onas_ht_add_hierarchy(ddd_ht, child_path);
+			onas_ht_add_hierarchy(ddd_ht, child_path, 1);
 			onas_ddd_watch(child_path, tharg->fan_fd, tharg->fan_mask, onas_in_fd, in_mask);
 
 			onas_ddd_handle_extra_scanning(tharg, child_path, ONAS_SCTH_ISDIR);
@@ -493,8 +468,8 @@ static void onas_ddd_handle_in_create(struct ddd_thrarg *tharg,
 		if(stat(child_path, &s) == 0 && S_ISREG(s.st_mode)) return;
 		if(!(event->mask & IN_ISDIR)) return;
 
-		logg("*ddd: MOVED_TO - Adding %s to %s with wd:%d\n", child_path, path, wd);
-		onas_ht_add_hierarchy(ddd_ht, child_path);
+		logg("*ddd: CREATE - Adding %s to %s with wd:%d\n", child_path, path, wd);
+		onas_ht_add_hierarchy(ddd_ht, child_path, 1);
 		onas_ddd_watch(child_path, tharg->fan_fd, tharg->fan_mask, onas_in_fd, in_mask);
 	}
 
@@ -511,7 +486,7 @@ static void onas_ddd_handle_in_moved_to(struct ddd_thrarg *tharg,
 
 		} else if(stat(child_path, &s) == 0 && S_ISDIR(s.st_mode)) {
 			logg("*ddd: MOVED_TO - Adding %s to %s with wd:%d\n", child_path, path, wd);
-			onas_ht_add_hierarchy(ddd_ht, child_path);
+			onas_ht_add_hierarchy(ddd_ht, child_path, 1);
 			onas_ddd_watch(child_path, tharg->fan_fd, tharg->fan_mask, onas_in_fd, in_mask);
 
 			onas_ddd_handle_extra_scanning(tharg, child_path, ONAS_SCTH_ISDIR);
@@ -521,7 +496,7 @@ static void onas_ddd_handle_in_moved_to(struct ddd_thrarg *tharg,
 		if(!(event->mask & IN_ISDIR)) return;
 
 		logg("*ddd: MOVED_TO - Adding %s to %s with wd:%d\n", child_path, path, wd);
-		onas_ht_add_hierarchy(ddd_ht, child_path);
+		onas_ht_add_hierarchy(ddd_ht, child_path, 1);
 		onas_ddd_watch(child_path, tharg->fan_fd, tharg->fan_mask, onas_in_fd, in_mask);
 	}
 
@@ -561,7 +536,6 @@ static void onas_ddd_exit(int sig) {
 	close(onas_in_fd);
 
 	onas_free_ht(ddd_ht);
-	free(wdlt);
 
 	pthread_exit(NULL);
 	logg("ScanOnAccess: stopped\n");
@@ -25,7 +25,8 @@
 #define ONAS_IN 0x01
 #define ONAS_FAN 0x02
 
-#define MAX_WATCH_LEN 7
+/* Most threads reading the directories while the included paths are crawled */
+#define ONAS_DDD_CRAWL_THREADS 8
 
 struct ddd_thrarg {
 	int sid;
@@ -38,7 +39,7 @@ struct ddd_thrarg {
 };
 
 
-int onas_ddd_init(uint64_t nwatches, size_t ht_size);
+int onas_ddd_init(uint32_t ht_size);
 void *onas_ddd_th(void *arg);
 
 
@@ -29,12 +29,15 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/syscall.h>
 
 #include <sys/fanotify.h>
 
@@ -52,13 +55,127 @@
 #include "onaccess_hash.h"
 #include "onaccess_ddd.h"
 
+/* scan workers, fed by onas_fan_th() through a bounded queue */
+#define ONAS_QUEUE_PER_THREAD 16
+
+/* Files found clean with the current engine are remembered, keyed on the
+ * inode, size and modification and change times: a write changes the
+ * times, so an open of an unchanged file needs neither a scan nor the
+ * hashing the libclamav cache does. The files being scanned are tracked
+ * too, an event for one of them waits for its result. */
+
+/* With OnAccessCloseWriteDelay the scan of a written file is deferred:
+ * the closes of the same inode within the delay are merged into one scan,
+ * run at idle I/O priority. Its verdict goes to the cache, so the opens
+ * that follow are answered from there, infected files included. */
+#define ONAS_DEFER_MAX 1024
+struct onas_file_key {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtim;
+	struct timespec ctim;
+};
+
+struct onas_event {
+	int fd;
+	int perm; /* a FAN_ALLOW/FAN_DENY response is expected */
+	int deferred; /* a close after a write, scanned in the background */
+	STATBUF sb;
+	int have_sb;
+};
+
+struct onas_deferred {
+	struct onas_event ev;
+	uint64_t due; /* CLOCK_MONOTONIC, in milliseconds */
+};
+
+struct onas_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+	struct onas_event *items;
+	int size;
+	int head;
+	int count;
+	int stop;
+};
+
+struct onas_cache_entry {
+	struct onas_file_key key;
+	unsigned long engine_gen;
+	unsigned int response;
+	int used;
+};
+
+struct onas_inflight {
+	struct onas_file_key key;
+	int busy;
+	int done;
+	int waiters;
+	unsigned int response;
+};
+
 static pthread_t ddd_pid;
 static int onas_fan_fd;
+static struct onas_queue onas_queue;
+static pthread_t *onas_workers;
+static int onas_nworkers;
+static struct onas_cache_entry *onas_cache;
+static unsigned int onas_cache_size;
+static struct onas_inflight *onas_inflight; /* one per scan thread */
+static pthread_mutex_t onas_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t onas_inflight_cond = PTHREAD_COND_INITIALIZER;
+static int onas_extinfo;
+/* owned by onas_fan_th() */
+static struct onas_deferred *onas_defer;
+static int onas_ndefer;
+static unsigned int onas_defer_delay;
+static const char *onas_quarantine;
+
+static void onas_workers_stop(void)
+{
+	int i;
+
+    if (!onas_workers)
+	return;
+    pthread_mutex_lock(&onas_queue.lock);
+    onas_queue.stop = 1;
+    pthread_cond_broadcast(&onas_queue.nonempty);
+    pthread_cond_broadcast(&onas_queue.nonfull);
+    pthread_mutex_unlock(&onas_queue.lock);
+    for (i = 0; i < onas_nworkers; i++)
+	pthread_join(onas_workers[i], NULL);
+    free(onas_workers);
+    onas_workers = NULL;
+
+    /* the events never picked up */
+    while (onas_queue.count) {
+	close(onas_queue.items[onas_queue.head].fd);
+	onas_queue.head = (onas_queue.head + 1) % onas_queue.size;
+	onas_queue.count--;
+    }
+    free(onas_queue.items);
+    onas_queue.items = NULL;
+    free(onas_inflight);
+    onas_inflight = NULL;
+    free(onas_cache);
+    onas_cache = NULL;
+    onas_cache_size = 0;
+
+    while (onas_ndefer)
+	close(onas_defer[--onas_ndefer].ev.fd);
+    free(onas_defer);
+    onas_defer = NULL;
+}
 
 static void onas_fan_exit(int sig)
 {
 	logg("*ScanOnAccess: onas_fan_exit(), signal %d\n", sig);
 
+	/* before the fanotify descriptor goes away, the workers write
+	 * their responses to it */
+	onas_workers_stop();
 	close(onas_fan_fd);
 
 	if (ddd_pid > 0) {
@@ -70,59 +187,489 @@ static void onas_fan_exit(int sig)
 	logg("ScanOnAccess: stopped\n");
 }
 
-static int onas_fan_scanfile(int fan_fd, const char *fname, struct fanotify_event_metadata *fmd, int scan, int extinfo, struct thrarg *tharg)
+/* the engine the scans use, with a reference held; NULL while a blocking
+ * reload is in progress */
+static struct cl_engine *onas_engine_get(struct thrarg *tharg, unsigned long *gen)
+{
+	struct cl_engine *engine;
+
+    pthread_mutex_lock(&tharg->engine_mutex);
+    engine = (struct cl_engine *) tharg->engine;
+    if (engine)
+	cl_engine_addref(engine);
+    *gen = tharg->engine_gen;
+    pthread_mutex_unlock(&tharg->engine_mutex);
+    return engine;
+}
+
+static void onas_file_key(const STATBUF *sb, struct onas_file_key *key)
+{
+    memset(key, 0, sizeof(*key));
+    key->dev = sb->st_dev;
+    key->ino = sb->st_ino;
+    key->size = sb->st_size;
+    key->mtim = sb->st_mtim;
+    key->ctim = sb->st_ctim;
+}
+
+static int onas_file_key_eq(const struct onas_file_key *a, const struct onas_file_key *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	a->mtim.tv_sec == b->mtim.tv_sec && a->mtim.tv_nsec == b->mtim.tv_nsec &&
+	a->ctim.tv_sec == b->ctim.tv_sec && a->ctim.tv_nsec == b->ctim.tv_nsec;
+}
+
+/* onas_cache_mutex must be held, onas_cache_size must not be 0 */
+static struct onas_cache_entry *onas_cache_slot(const struct onas_file_key *key)
+{
+    return &onas_cache[((unsigned long) key->ino * 31 + (unsigned long) key->dev) % onas_cache_size];
+}
+
+/* the remembered response, 0 if none; onas_cache_mutex must be held */
+static unsigned int onas_cache_hit(const struct onas_file_key *key, unsigned long gen)
+{
+	struct onas_cache_entry *e;
+
+    if (!onas_cache_size)
+	return 0;
+    e = onas_cache_slot(key);
+    if (e->used && e->engine_gen == gen && onas_file_key_eq(&e->key, key))
+	return e->response;
+    return 0;
+}
+
+static unsigned int onas_cache_check(struct thrarg *tharg, const STATBUF *sb)
+{
+	struct onas_file_key key;
+	unsigned long gen;
+	unsigned int hit;
+
+    if (!onas_cache_size)
+	return 0;
+    pthread_mutex_lock(&tharg->engine_mutex);
+    gen = tharg->engine_gen;
+    pthread_mutex_unlock(&tharg->engine_mutex);
+
+    onas_file_key(sb, &key);
+    pthread_mutex_lock(&onas_cache_mutex);
+    hit = onas_cache_hit(&key, gen);
+    pthread_mutex_unlock(&onas_cache_mutex);
+    return hit;
+}
+
+/* onas_cache_mutex must be held */
+static void onas_cache_add(const struct onas_file_key *key, unsigned long gen, unsigned int response)
+{
+	struct onas_cache_entry *e;
+
+    if (!onas_cache_size)
+	return;
+    e = onas_cache_slot(key);
+    e->key = *key;
+    e->engine_gen = gen;
+    e->response = response;
+    e->used = 1;
+}
+
+static void onas_cache_remove(const STATBUF *sb)
+{
+	struct onas_cache_entry *e;
+
+    if (!onas_cache_size)
+	return;
+    pthread_mutex_lock(&onas_cache_mutex);
+    e = &onas_cache[((unsigned long) sb->st_ino * 31 + (unsigned long) sb->st_dev) % onas_cache_size];
+    if (e->key.dev == sb->st_dev && e->key.ino == sb->st_ino)
+	e->used = 0;
+    pthread_mutex_unlock(&onas_cache_mutex);
+}
+
+/* Either the result for the file is known (cached, or scanned by another
+ * thread meanwhile) and stored in *response, or the file is claimed for a
+ * scan and its slot returned. onas_cache_mutex must be held. */
+static struct onas_inflight *onas_inflight_claim(const struct onas_file_key *key, unsigned long gen, unsigned int *response)
+{
+	struct onas_inflight *in, *slot = NULL;
+	unsigned int hit;
+	int i;
+
+    if ((hit = onas_cache_hit(key, gen))) {
+	*response = hit;
+	return NULL;
+    }
+    for (i = 0; i < onas_nworkers; i++) {
+	in = &onas_inflight[i];
+	if (!in->busy) {
+	    if (!slot)
+		slot = in;
+	    continue;
+	}
+	if (!in->done && onas_file_key_eq(&in->key, key)) {
+	    in->waiters++;
+	    while (!in->done)
+		pthread_cond_wait(&onas_inflight_cond, &onas_cache_mutex);
+	    *response = in->response;
+	    if (!--in->waiters)
+		in->busy = 0;
+	    return NULL;
+	}
+    }
+    /* each scan thread holds at most one slot */
+    slot->key = *key;
+    slot->busy = 1;
+    slot->done = 0;
+    slot->waiters = 0;
+    return slot;
+}
+
+/* onas_cache_mutex must be held */
+static void onas_inflight_done(struct onas_inflight *in, unsigned int response)
+{
+    in->response = response;
+    in->done = 1;
+    if (!in->waiters)
+	in->busy = 0;
+    else
+	pthread_cond_broadcast(&onas_inflight_cond);
+}
+
+static int onas_fan_respond(int fan_fd, int fd, unsigned int response)
 {
 	struct fanotify_response res;
+	int ret;
+
+    res.fd = fd;
+    res.response = response;
+    ret = write(fan_fd, &res, sizeof(res));
+    if(ret == -1)
+	logg("!ScanOnAccess: Internal error (can't write to fanotify)\n");
+    return ret;
+}
+
+static uint64_t onas_now(void)
+{
+	struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* I/O priority of the calling thread, 0 restores the default */
+static void onas_ioprio(int prio)
+{
+#ifdef SYS_ioprio_set
+    /* IOPRIO_WHO_PROCESS, with 0 for the calling thread */
+    syscall(SYS_ioprio_set, 1, 0, prio);
+#endif
+}
+#define ONAS_IOPRIO_IDLE (3 << 13)
+
+/* moves a file found by a deferred scan to OnAccessQuarantineDirectory */
+static void onas_quarantine_file(const char *fname, const STATBUF *sb)
+{
+	const char *base;
+	char *dest;
+	size_t len;
+	STATBUF st;
+	char err[128];
+
+    base = strrchr(fname, '/');
+    base = base ? base + 1 : fname;
+    len = strlen(onas_quarantine) + strlen(base) + 32;
+    if (!(dest = (char *) malloc(len))) {
+	logg("!ScanOnAccess: Can't allocate memory to quarantine %s\n", fname);
+	return;
+    }
+    snprintf(dest, len, "%s/%s", onas_quarantine, base);
+    /* don't overwrite an earlier file of the same name */
+    if (!LSTAT(dest, &st))
+	snprintf(dest, len, "%s/%s.%llu", onas_quarantine, base, (unsigned long long) sb->st_ino);
+    if (rename(fname, dest) == -1)
+	logg("!ScanOnAccess: Can't move %s to %s: %s\n", fname, dest, cli_strerror(errno, err, sizeof(err)));
+    else
+	logg("ScanOnAccess: %s: moved to '%s'\n", fname, dest);
+    free(dest);
+}
+
+static void onas_fan_scanfile(int fan_fd, struct onas_event *ev, struct thrarg *tharg)
+{
 	struct cb_context context;
+	struct cl_engine *engine;
+	struct onas_file_key key;
+	struct onas_inflight *in = NULL;
 	const char *virname;
-	int ret = 0;
+	char fname[1024];
+	unsigned long gen;
+	unsigned int response = FAN_ALLOW;
+	int len, ret;
+
+    sprintf(fname, "/proc/self/fd/%d", ev->fd);
+    len = readlink(fname, fname, sizeof(fname) - 1);
+    if(len == -1) {
+	logg("!ScanOnAccess: Internal error (readlink() failed)\n");
+	len = 0;
+    }
+    fname[len] = 0;
+
+    /* a blocking reload frees the engine before loading the new one */
+    while(!(engine = onas_engine_get(tharg, &gen))) {
+	pthread_mutex_lock(&onas_queue.lock);
+	ret = onas_queue.stop;
+	pthread_mutex_unlock(&onas_queue.lock);
+	if(ret)
+	    break;
+	sleep(1);
+    }
 
-    res.fd = fmd->fd;
-    res.response = FAN_ALLOW;
-    context.filename = fname;
-    context.virsize = 0;
-    context.scandata = NULL;
-    if(scan && cl_scandesc_callback(fmd->fd, &virname, NULL, tharg->engine, tharg->options, &context) == CL_VIRUS) {
-	if(extinfo && context.virsize)
-	    logg("ScanOnAccess: %s: %s(%s:%llu) FOUND\n", fname, virname, context.virhash, context.virsize);
-	else
-	    logg("ScanOnAccess: %s: %s FOUND\n", fname, virname);
-	virusaction(fname, virname, tharg->opts);
+    if(engine && ev->have_sb) {
+	onas_file_key(&ev->sb, &key);
+	pthread_mutex_lock(&onas_cache_mutex);
+	in = onas_inflight_claim(&key, gen, &response);
+	pthread_mutex_unlock(&onas_cache_mutex);
+	if(!in) {
+	    /* the result of another open of the same file */
+	    cl_engine_free(engine);
+	    engine = NULL;
+	}
+    }
 
-	res.response = FAN_DENY;
+    if(engine) {
+	context.filename = fname;
+	context.virsize = 0;
+	context.scandata = NULL;
+	if(ev->deferred)
+	    onas_ioprio(ONAS_IOPRIO_IDLE);
+	ret = cl_scandesc_callback(ev->fd, &virname, NULL, engine, tharg->options, &context);
+	if(ev->deferred)
+	    onas_ioprio(0);
+	if(ret == CL_VIRUS) {
+	    if(onas_extinfo && context.virsize)
+		logg("ScanOnAccess: %s: %s(%s:%llu) FOUND\n", fname, virname, context.virhash, context.virsize);
+	    else
+		logg("ScanOnAccess: %s: %s FOUND\n", fname, virname);
+	    virusaction(fname, virname, tharg->opts);
+	    if(ev->deferred && onas_quarantine && len)
+		onas_quarantine_file(fname, &ev->sb);
+
+	    response = FAN_DENY;
+	}
+	if(in) {
+	    pthread_mutex_lock(&onas_cache_mutex);
+	    /* nothing was waiting for the deferred scan, its verdict
+	     * answers the next opens */
+	    if(ret == CL_CLEAN || (ret == CL_VIRUS && ev->deferred))
+		onas_cache_add(&key, gen, response);
+	    onas_inflight_done(in, response);
+	    pthread_mutex_unlock(&onas_cache_mutex);
+	}
+	cl_engine_free(engine);
     }
 
-    if(fmd->mask & FAN_ALL_PERM_EVENTS) {
-	ret = write(fan_fd, &res, sizeof(res));
-	if(ret == -1)
-	    logg("!ScanOnAccess: Internal error (can't write to fanotify)\n");
+    if(ev->perm)
+	onas_fan_respond(fan_fd, ev->fd, response);
+    if(close(ev->fd) == -1)
+	logg("!ScanOnAccess: Internal error (close(%d) failed)\n", ev->fd);
+}
+
+static void *onas_fan_worker(void *arg)
+{
+	struct thrarg *tharg = (struct thrarg *) arg;
+	struct onas_event ev;
+	sigset_t sigset;
+
+    /* the signals are for onas_fan_th() */
+    sigfillset(&sigset);
+    sigdelset(&sigset, SIGFPE);
+    sigdelset(&sigset, SIGILL);
+    sigdelset(&sigset, SIGSEGV);
+#ifdef SIGBUS
+    sigdelset(&sigset, SIGBUS);
+#endif
+    pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+
+    for(;;) {
+	pthread_mutex_lock(&onas_queue.lock);
+	while(!onas_queue.count && !onas_queue.stop)
+	    pthread_cond_wait(&onas_queue.nonempty, &onas_queue.lock);
+	if(onas_queue.stop) {
+	    pthread_mutex_unlock(&onas_queue.lock);
+	    break;
+	}
+	ev = onas_queue.items[onas_queue.head];
+	onas_queue.head = (onas_queue.head + 1) % onas_queue.size;
+	onas_queue.count--;
+	pthread_cond_signal(&onas_queue.nonfull);
+	pthread_mutex_unlock(&onas_queue.lock);
+
+	onas_fan_scanfile(onas_fan_fd, &ev, tharg);
     }
+    return NULL;
+}
 
+static int onas_workers_start(struct thrarg *tharg, int nworkers)
+{
+	int i;
+
+    memset(&onas_queue, 0, sizeof(onas_queue));
+    pthread_mutex_init(&onas_queue.lock, NULL);
+    pthread_cond_init(&onas_queue.nonempty, NULL);
+    pthread_cond_init(&onas_queue.nonfull, NULL);
+    onas_queue.size = nworkers * ONAS_QUEUE_PER_THREAD;
+    onas_queue.items = (struct onas_event *) malloc(onas_queue.size * sizeof(struct onas_event));
+    onas_workers = (pthread_t *) malloc(nworkers * sizeof(pthread_t));
+    onas_inflight = (struct onas_inflight *) calloc(nworkers, sizeof(struct onas_inflight));
+    if(!onas_queue.items || !onas_workers || !onas_inflight) {
+	free(onas_queue.items);
+	free(onas_workers);
+	free(onas_inflight);
+	onas_queue.items = NULL;
+	onas_workers = NULL;
+	onas_inflight = NULL;
+	return -1;
+    }
+    for(onas_nworkers = 0; onas_nworkers < nworkers; onas_nworkers++) {
+	if(pthread_create(&onas_workers[onas_nworkers], NULL, onas_fan_worker, tharg))
+	    break;
+    }
+    if(!onas_nworkers) {
+	free(onas_queue.items);
+	free(onas_workers);
+	free(onas_inflight);
+	onas_queue.items = NULL;
+	onas_workers = NULL;
+	onas_inflight = NULL;
+	return -1;
+    }
+    for(i = onas_nworkers; i < nworkers; i++)
+	logg("^ScanOnAccess: Can't start scan thread %d\n", i + 1);
+    return 0;
+}
+
+/* blocks while the queue is full, the kernel keeps the events meanwhile */
+static int onas_queue_push(const struct onas_event *ev)
+{
+    pthread_mutex_lock(&onas_queue.lock);
+    while(onas_queue.count == onas_queue.size && !onas_queue.stop)
+	pthread_cond_wait(&onas_queue.nonfull, &onas_queue.lock);
+    if(onas_queue.stop) {
+	pthread_mutex_unlock(&onas_queue.lock);
+	return -1;
+    }
+    onas_queue.items[(onas_queue.head + onas_queue.count) % onas_queue.size] = *ev;
+    onas_queue.count++;
+    pthread_cond_signal(&onas_queue.nonempty);
+    pthread_mutex_unlock(&onas_queue.lock);
+    return 0;
+}
+
+/* takes the fd of a written file for a scan after onas_defer_delay; -1 if
+ * the table is full and the file must be queued now */
+static int onas_defer_add(const struct onas_event *ev)
+{
+	struct onas_deferred *d;
+	int i;
+
+    for (i = 0; i < onas_ndefer; i++) {
+	d = &onas_defer[i];
+	if (d->ev.sb.st_dev == ev->sb.st_dev && d->ev.sb.st_ino == ev->sb.st_ino) {
+	    /* written again, the scan waits for the last close */
+	    close(d->ev.fd);
+	    break;
+	}
+    }
+    if (i == onas_ndefer) {
+	if (onas_ndefer == ONAS_DEFER_MAX)
+	    return -1;
+	onas_ndefer++;
+    }
+    d = &onas_defer[i];
+    d->ev = *ev;
+    d->ev.deferred = 1;
+    d->due = onas_now() + onas_defer_delay;
+    return 0;
+}
+
+/* queues the deferred scans which are due */
+static void onas_defer_flush(void)
+{
+	uint64_t now;
+	int i = 0;
+
+    if (!onas_ndefer)
+	return;
+    now = onas_now();
+    while (i < onas_ndefer) {
+	if (onas_defer[i].due > now) {
+	    i++;
+	    continue;
+	}
+	if (onas_queue_push(&onas_defer[i].ev))
+	    close(onas_defer[i].ev.fd);
+	onas_defer[i] = onas_defer[--onas_ndefer];
+    }
+}
+
+/* the time to the next deferred scan, NULL if there is none */
+static struct timespec *onas_defer_timeout(struct timespec *ts)
+{
+	uint64_t now, due;
+	int i;
+
+    if (!onas_ndefer)
+	return NULL;
+    due = onas_defer[0].due;
+    for (i = 1; i < onas_ndefer; i++)
+	if (onas_defer[i].due < due)
+	    due = onas_defer[i].due;
+    now = onas_now();
+    due = due > now ? due - now : 0;
+    ts->tv_sec = due / 1000;
+    ts->tv_nsec = (due % 1000) * 1000000;
+    return ts;
+}
+
+/* waits for fanotify events, queueing the deferred scans as they fall due */
+static int onas_fan_wait(const sigset_t *sigset)
+{
+	fd_set rfds;
+	struct timespec ts;
+	int ret;
+
+    do {
+	if (reload) sleep(1);
+	FD_ZERO(&rfds);
+	FD_SET(onas_fan_fd, &rfds);
+	ret = pselect(onas_fan_fd + 1, &rfds, NULL, NULL, onas_defer_timeout(&ts), sigset);
+	onas_defer_flush();
+    } while((ret == -1 && errno == EINTR) || !ret || reload);
     return ret;
 }
 
 void *onas_fan_th(void *arg)
 {
 	struct thrarg *tharg = (struct thrarg *) arg;
-	sigset_t sigset;
+	sigset_t sigset, blocked;
         struct sigaction act;
 	const struct optstruct *pt;
-	short int scan;
-	int sizelimit = 0, extinfo;
-	STATBUF sb;
+	int sizelimit = 0;
         uint64_t fan_mask = FAN_EVENT_ON_CHILD | FAN_CLOSE;
-        fd_set rfds;
 	char buf[4096];
 	ssize_t bread;
 	struct fanotify_event_metadata *fmd;
-	char fname[1024];
-	int ret, len;
+	struct onas_event ev;
+	/* the events answered without a scan, at most one per metadata
+	 * entry of buf */
+	struct fanotify_response answer[sizeof(buf) / FAN_EVENT_METADATA_LEN];
+	unsigned int cached;
+	int nanswer, i, nworkers, skip;
 	char err[128];
 
 	pthread_attr_t ddd_attr;
 	struct ddd_thrarg *ddd_tharg = NULL;
 
 	ddd_pid = 0;
+	onas_workers = NULL;
+	onas_ndefer = 0;
 
     /* ignore all signals except SIGUSR1 */
     sigfillset(&sigset);
@@ -136,6 +683,7 @@ void *onas_fan_th(void *arg)
     sigdelset(&sigset, SIGBUS);
 #endif
     pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+    blocked = sigset;
     memset(&act, 0, sizeof(struct sigaction));
     act.sa_handler = onas_fan_exit;
     sigfillset(&(act.sa_mask));
@@ -218,14 +766,50 @@ void *onas_fan_th(void *arg)
     else
 	logg("ScanOnAccess: File size limit disabled\n");
 
-    extinfo = optget(tharg->opts, "ExtendedDetectionInfo")->enabled;
+    onas_extinfo = optget(tharg->opts, "ExtendedDetectionInfo")->enabled;
 
-    FD_ZERO(&rfds);
-    FD_SET(onas_fan_fd, &rfds);
-    do {
-	if (reload) sleep(1);
-        ret = select(onas_fan_fd + 1, &rfds, NULL, NULL, NULL);
-    } while((ret == -1 && errno == EINTR) || reload);
+    onas_cache_size = optget(tharg->opts, "OnAccessCacheSize")->numarg;
+    if(onas_cache_size) {
+	onas_cache = (struct onas_cache_entry *) calloc(onas_cache_size, sizeof(struct onas_cache_entry));
+	if(!onas_cache) {
+	    logg("^ScanOnAccess: Can't allocate the cache of clean files\n");
+	    onas_cache_size = 0;
+	}
+    }
+
+    onas_defer_delay = optget(tharg->opts, "OnAccessCloseWriteDelay")->numarg;
+    if(onas_defer_delay) {
+	onas_defer = (struct onas_deferred *) malloc(ONAS_DEFER_MAX * sizeof(struct onas_deferred));
+	if(!onas_defer) {
+	    logg("^ScanOnAccess: Can't allocate the deferred scans, written files are scanned at once\n");
+	    onas_defer_delay = 0;
+	} else {
+	    logg("ScanOnAccess: Written files scanned %u ms after the last close\n", onas_defer_delay);
+	}
+    }
+    pt = optget(tharg->opts, "OnAccessQuarantineDirectory");
+    onas_quarantine = pt->enabled ? pt->strarg : NULL;
+
+    nworkers = optget(tharg->opts, "OnAccessMaxThreads")->numarg;
+    if(nworkers < 1)
+	nworkers = 1;
+    if(onas_workers_start(tharg, nworkers)) {
+	logg("!ScanOnAccess: Can't start the scan threads\n");
+	free(onas_cache);
+	onas_cache = NULL;
+	onas_cache_size = 0;
+	free(onas_defer);
+	onas_defer = NULL;
+	return NULL;
+    }
+    logg("ScanOnAccess: %d scan threads\n", onas_nworkers);
+
+    /* SIGUSR1 stops the thread, only let it in while waiting for events:
+     * the rest of the loop holds the queue lock at times */
+    sigaddset(&blocked, SIGUSR1);
+    pthread_sigmask(SIG_SETMASK, &blocked, NULL);
+
+    onas_fan_wait(&sigset);
 
 
     time_t start = time(NULL) - 30;
@@ -242,53 +826,60 @@ void *onas_fan_th(void *arg)
 		continue;
 	}
 
+	nanswer = 0;
 	fmd = (struct fanotify_event_metadata *) buf;
 	while(FAN_EVENT_OK(fmd, bread)) {
-	    scan = 1;
 	    if(fmd->fd >= 0) {
-		sprintf(fname, "/proc/self/fd/%d", fmd->fd);
-		len = readlink(fname, fname, sizeof(fname) - 1);
-		if(len == -1) {
-		    close(fmd->fd);
-		    logg("!ScanOnAccess: Internal error (readlink() failed)\n");
-		    return NULL;
-		}
-		fname[len] = 0;
+		ev.fd = fmd->fd;
+		ev.perm = (fmd->mask & FAN_ALL_PERM_EVENTS) != 0;
+		ev.deferred = 0;
+		ev.have_sb = FSTAT(fmd->fd, &ev.sb) == 0;
 
-		if(onas_fan_checkowner(fmd->pid, tharg->opts)) {
-		    scan = 0;
-		    logg("*ScanOnAccess: %s skipped (excluded UID)\n", fname);
-		}
+		/* the file changed, the cached result is stale */
+		if(ev.have_sb && (fmd->mask & FAN_CLOSE_WRITE))
+		    onas_cache_remove(&ev.sb);
 
-		if(sizelimit) {
-		    if(FSTAT(fmd->fd, &sb) != 0 || sb.st_size > sizelimit) {
-			scan = 0;
-			/* logg("*ScanOnAccess: %s skipped (size > %d)\n", fname, sizelimit); */
-		    }
-		}
-
-		if(onas_fan_scanfile(onas_fan_fd, fname, fmd, scan, extinfo, tharg) == -1) {
-		    close(fmd->fd);
-		    return NULL;
+		cached = FAN_ALLOW;
+		if(onas_fan_checkowner(fmd->pid, tharg->opts)) {
+		    logg("*ScanOnAccess: fd %d skipped (excluded UID)\n", fmd->fd);
+		    skip = 1;
+		} else if(sizelimit && (!ev.have_sb || ev.sb.st_size > sizelimit)) {
+		    skip = 1;
+		} else if(ev.have_sb && !(fmd->mask & FAN_CLOSE_WRITE) && (cached = onas_cache_check(tharg, &ev.sb))) {
+		    /* unchanged since it was scanned */
+		    skip = 1;
+		} else if(onas_defer_delay && ev.have_sb && !ev.perm && (fmd->mask & FAN_CLOSE_WRITE) && !onas_defer_add(&ev)) {
+		    skip = 0;
+		} else {
+		    cached = FAN_ALLOW;
+		    skip = onas_queue_push(&ev) != 0;
 		}
 
-		if(close(fmd->fd) == -1) {
-		    printf("!ScanOnAccess: Internal error (close(%d) failed)\n", fmd->fd);
+		if(skip && ev.perm) {
+		    answer[nanswer].fd = fmd->fd;
+		    answer[nanswer++].response = cached;
+		} else if(skip) {
 		    close(fmd->fd);
-		    return NULL;
 		}
 	    }
 	    fmd = FAN_EVENT_NEXT(fmd, bread);
 	}
-	do {
-	    if (reload) sleep(1);
-	    ret = select(onas_fan_fd + 1, &rfds, NULL, NULL, NULL);
-	} while((ret == -1 && errno == EINTR) || reload);
+
+	/* the answers that didn't need a scan go out together, after the
+	 * rest of the buffer is queued */
+	for(i = 0; i < nanswer; i++) {
+	    onas_fan_respond(onas_fan_fd, answer[i].fd, answer[i].response);
+	    close(answer[i].fd);
+	}
+
+	onas_defer_flush();
+	onas_fan_wait(&sigset);
     }
 
     if(bread < 0)
 	logg("!ScanOnAccess: Internal error (failed to read data) ... %s\n", strerror(errno));
 
+    onas_workers_stop();
     return NULL;
 }
 
@@ -25,10 +25,12 @@
 
 #if defined(FANOTIFY)
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fts.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
@@ -52,16 +54,8 @@
 #include "others.h"
 #include "scanner.h"
 
-static struct onas_bucket *onas_bucket_init();
-static void onas_free_bucket(struct onas_bucket *bckt);
-static int onas_bucket_insert(struct onas_bucket *bckt, struct onas_element *elem);
-static int onas_bucket_remove(struct onas_bucket *bckt, struct onas_element *elem);
-
-static int onas_add_hashnode_child(struct onas_hnode *node, const char* dirname);
-
-static struct onas_lnode *onas_listnode_init(void);
-
-static struct onas_hnode *onas_hashnode_init(void);
+static int onas_ht_grow(struct onas_ht *ht);
+static int onas_ht_grow_wd(struct onas_ht *ht);
 
 static inline uint32_t onas_hshift(uint32_t hash) {
 
@@ -78,9 +72,11 @@ static inline uint32_t onas_hshift(uint32_t hash) {
 	return hash;
 }
 
-static inline int onas_hash(const char* key, size_t keylen, uint32_t size) {
+/* A name is only unique among the children of its parent, the parent's
+ * address seeds the hash. */
+static inline uint32_t onas_hash(const struct onas_hnode *prnt, const char* key, size_t keylen) {
 
-	uint32_t hash = 1;
+	uint32_t hash = onas_hshift((uint32_t) ((uintptr_t) prnt >> 4));
 	uint32_t i;
 
 	for (i = 0; i < keylen; i++) {
@@ -88,588 +84,593 @@ static inline int onas_hash(const char* key, size_t keylen, uint32_t size) {
 		hash = onas_hshift(hash);
 	}
 
-	return hash & (size - 1);
+	return hash;
 }
 
-int onas_ht_init(struct onas_ht **ht, uint32_t size) {
+/*** Node allocation ***/
 
-	if (size == 0 || (size & (~size + 1)) != size) return CL_EARG;
+static inline size_t onas_hnode_size(size_t namelen) {
+	size_t size = offsetof(struct onas_hnode, name) + namelen + 1;
 
-	*ht = (struct onas_ht *) cli_malloc(sizeof(struct onas_ht));
-	if (!(*ht)) return CL_EMEM;
+	return (size + ONAS_ARENA_ALIGN - 1) & ~((size_t) ONAS_ARENA_ALIGN - 1);
+}
 
-	**ht = (struct onas_ht) {
-		.htable = NULL,
-		.size = size,
-		.nbckts = 0,
-	};
+/* Nodes are carved out of large blocks, a freed node goes on the free list
+ * of its size and is handed out again for a name of the same size class. */
+static struct onas_hnode *onas_hnode_alloc(struct onas_arena *arena, const char *name, size_t namelen) {
 
-	if (!((*ht)->htable = (struct onas_bucket **) cli_calloc(size, sizeof(struct onas_bucket *)))) {
-		onas_free_ht(*ht);
-		return CL_EMEM;
+	struct onas_hnode *hnode = NULL;
+	size_t size = onas_hnode_size(namelen);
+	size_t cls = size / ONAS_ARENA_ALIGN;
+
+	if (namelen > UINT16_MAX) return NULL;
+
+	if (cls >= ONAS_ARENA_CLASSES) {
+		hnode = (struct onas_hnode *) cli_malloc(size);
+	} else if (arena->free[cls]) {
+		hnode = arena->free[cls];
+		arena->free[cls] = hnode->hnext;
+	} else {
+		if (arena->left < size) {
+			struct onas_arena_blk *blk = (struct onas_arena_blk *) cli_malloc(ONAS_ARENA_BLKSIZE);
+			if (!blk) return NULL;
+
+			blk->next = arena->blks;
+			arena->blks = blk;
+			/* the nodes stay aligned after the block header */
+			arena->curr = (char *) blk + ONAS_ARENA_ALIGN;
+			arena->left = ONAS_ARENA_BLKSIZE - ONAS_ARENA_ALIGN;
+		}
+		hnode = (struct onas_hnode *) arena->curr;
+		arena->curr += size;
+		arena->left -= size;
 	}
+	if (!hnode) return NULL;
 
-	return CL_SUCCESS;
+	memset(hnode, 0, offsetof(struct onas_hnode, name));
+	hnode->wd = -1;
+	hnode->namelen = namelen;
+	memcpy(hnode->name, name, namelen);
+	hnode->name[namelen] = 0;
+
+	return hnode;
 }
 
-void onas_free_ht(struct onas_ht *ht) {
+static void onas_hnode_free(struct onas_arena *arena, struct onas_hnode *hnode) {
 
-	if (!ht || ht->size == 0) return;
+	size_t cls = onas_hnode_size(hnode->namelen) / ONAS_ARENA_ALIGN;
 
-	if (!ht->htable) {
-		free(ht);
+	if (cls >= ONAS_ARENA_CLASSES) {
+		free(hnode);
 		return;
 	}
 
-	uint32_t i = 0;
-	for (i = 0; i < ht->size; i++) {
-		onas_free_bucket(ht->htable[i]);
-		ht->htable[i] = NULL;
-	}
+	hnode->hnext = arena->free[cls];
+	arena->free[cls] = hnode;
+}
 
-	free(ht->htable);
-	ht->htable = NULL;
+/*** Tables ***/
 
-	free(ht);
+int onas_ht_init(struct onas_ht **ht, uint32_t size) {
 
-	return;
-}
+	if (size == 0 || (size & (~size + 1)) != size) return CL_EARG;
 
-static struct onas_bucket *onas_bucket_init() {
+	*ht = (struct onas_ht *) cli_calloc(1, sizeof(struct onas_ht));
+	if (!(*ht)) return CL_EMEM;
 
-	struct onas_bucket *bckt = (struct onas_bucket*) cli_malloc(sizeof(struct onas_bucket));
-	if (!bckt) return NULL;
+	(*ht)->size = size;
+	(*ht)->wdsize = size;
 
-	*bckt = (struct onas_bucket) {
-		.size = 0,
-		.head = NULL,
-		.tail = NULL
-	};
+	if (!((*ht)->htable = (struct onas_hnode **) cli_calloc(size, sizeof(struct onas_hnode *))) ||
+		!((*ht)->wdtable = (struct onas_hnode **) cli_calloc(size, sizeof(struct onas_hnode *))) ||
+		!((*ht)->root = onas_hnode_alloc(&(*ht)->arena, "", 0))) {
+		onas_free_ht(*ht);
+		*ht = NULL;
+		return CL_EMEM;
+	}
 
-	return bckt;
+	return CL_SUCCESS;
 }
 
-static void onas_free_bucket(struct onas_bucket *bckt) {
+void onas_free_ht(struct onas_ht *ht) {
 
-	if (!bckt) return;
+	struct onas_arena_blk *blk;
+	struct onas_hnode *hnode;
+	uint32_t i;
 
-	uint32_t i = 0;
-	struct onas_element *curr = NULL;
+	if (!ht) return;
 
-	for (i = 0; i < bckt->size; i++) {
-		curr = bckt->head;
-		bckt->head = curr->next;
-		onas_free_element(curr);
-		curr = NULL;
+	/* Only the nodes with overlong names live outside the blocks */
+	if (ht->htable) {
+		for (i = 0; i < ht->size; i++) {
+			while ((hnode = ht->htable[i])) {
+				ht->htable[i] = hnode->hnext;
+				if (onas_hnode_size(hnode->namelen) / ONAS_ARENA_ALIGN >= ONAS_ARENA_CLASSES)
+					free(hnode);
+			}
+		}
+	}
+
+	while ((blk = ht->arena.blks)) {
+		ht->arena.blks = blk->next;
+		free(blk);
 	}
 
-	free(bckt);
+	free(ht->htable);
+	free(ht->wdtable);
+	free(ht);
 
 	return;
 }
 
-struct onas_element *onas_element_init(struct onas_hnode *value, const char *key, size_t klen) {
-
-	struct onas_element *elem = (struct onas_element *) cli_malloc(sizeof(struct onas_element));
-	if (!elem) return NULL;
-
-	*elem = (struct onas_element) {
-		.key = key,
-		.klen = klen,
-		.data = value,
-		.next = NULL,
-		.prev = NULL
-	};
-
-	return elem;
-}
+static int onas_ht_grow(struct onas_ht *ht) {
 
-void onas_free_element(struct onas_element *elem) {
+	struct onas_hnode **htable, *hnode;
+	uint32_t size = ht->size << 1;
+	uint32_t i;
 
-	if (!elem) return;
+	if (!size) return CL_EMEM;
 
-	onas_free_hashnode(elem->data);
+	htable = (struct onas_hnode **) cli_calloc(size, sizeof(struct onas_hnode *));
+	if (!htable) return CL_EMEM;
 
-	elem->prev = NULL;
-	elem->next = NULL;
+	for (i = 0; i < ht->size; i++) {
+		while ((hnode = ht->htable[i])) {
+			ht->htable[i] = hnode->hnext;
+			hnode->hnext = htable[hnode->hash & (size - 1)];
+			htable[hnode->hash & (size - 1)] = hnode;
+		}
+	}
 
-	free(elem);
+	free(ht->htable);
+	ht->htable = htable;
+	ht->size = size;
 
-	return;
+	return CL_SUCCESS;
 }
 
-int onas_ht_insert(struct onas_ht *ht, struct onas_element *elem) {
+static int onas_ht_grow_wd(struct onas_ht *ht) {
 
-	if (!ht || !elem || !elem->key) return CL_ENULLARG;
+	struct onas_hnode **wdtable, *hnode;
+	uint32_t size = ht->wdsize << 1;
+	uint32_t i;
 
-	int idx = onas_hash(elem->key, elem->klen, ht->size);
-	struct onas_bucket *bckt = ht->htable[idx];
+	if (!size) return CL_EMEM;
 
-	int ret = 0;
-	uint32_t bsize = 0;
+	wdtable = (struct onas_hnode **) cli_calloc(size, sizeof(struct onas_hnode *));
+	if (!wdtable) return CL_EMEM;
 
-	if (bckt == NULL) {
-		ht->htable[idx] = onas_bucket_init();
-		bckt = ht->htable[idx];
+	for (i = 0; i < ht->wdsize; i++) {
+		while ((hnode = ht->wdtable[i])) {
+			ht->wdtable[i] = hnode->wnext;
+			hnode->wnext = wdtable[hnode->wd & (size - 1)];
+			wdtable[hnode->wd & (size - 1)] = hnode;
+		}
 	}
 
-	bsize = bckt->size;
-	ret = onas_bucket_insert(bckt, elem);
-
-	if (ret == CL_SUCCESS)
-		if (bsize < bckt->size)
-			ht->nbckts++;
+	free(ht->wdtable);
+	ht->wdtable = wdtable;
+	ht->wdsize = size;
 
-	return ret;
+	return CL_SUCCESS;
 }
 
-static int onas_bucket_insert(struct onas_bucket *bckt, struct onas_element *elem) {
-	if (!bckt || !elem) return CL_ENULLARG;
+static struct onas_hnode *onas_ht_child(struct onas_ht *ht, const struct onas_hnode *prnt, const char *name, size_t namelen) {
 
-	if (bckt->size == 0) {
-		bckt->head = elem;
-		bckt->tail = elem;
-		elem->prev = NULL;
-		elem->next = NULL;
-		bckt->size++;
-	} else {
-		struct onas_element *btail = bckt->tail;
+	uint32_t hash = onas_hash(prnt, name, namelen);
+	struct onas_hnode *hnode = ht->htable[hash & (ht->size - 1)];
 
-		btail->next = elem;
-		elem->prev = btail;
-		elem->next = NULL;
-		bckt->tail = elem;
-		bckt->size++;
-	}
+	while (hnode && (hnode->hash != hash || hnode->parent != prnt || hnode->namelen != namelen || memcmp(hnode->name, name, namelen)))
+		hnode = hnode->hnext;
 
-	return CL_SUCCESS;
+	return hnode;
 }
 
-/* Checks if key exists and optionally stores address to the element corresponding to the key within elem */
-int onas_ht_get(struct onas_ht *ht, const char *key, size_t klen, struct onas_element **elem) {
+/* Looks up the child of prnt called name, adds it if it isn't there yet. */
+static struct onas_hnode *onas_ht_add_child(struct onas_ht *ht, struct onas_hnode *prnt, const char *name, size_t namelen) {
 
-	if (elem) *elem = NULL;
+	struct onas_hnode *hnode = onas_ht_child(ht, prnt, name, namelen);
+	uint32_t idx;
 
-	if (!ht || !key || klen <= 0) return CL_ENULLARG;
+	if (hnode) return hnode;
 
-	struct onas_bucket *bckt = ht->htable[onas_hash(key, klen, ht->size)];
+	if (ht->nnodes >= ht->size && onas_ht_grow(ht) != CL_SUCCESS) return NULL;
 
-	if (!bckt || bckt->size == 0) return CL_EARG;
+	if (!(hnode = onas_hnode_alloc(&ht->arena, name, namelen))) return NULL;
 
-	struct onas_element *curr = bckt->head;
+	hnode->parent = prnt;
+	hnode->hash = onas_hash(prnt, name, namelen);
 
-	while (curr && strcmp(curr->key, key)) {
-		curr = curr->next;
-	}
-	
-	if (!curr) return CL_EARG;
+	idx = hnode->hash & (ht->size - 1);
+	hnode->hnext = ht->htable[idx];
+	ht->htable[idx] = hnode;
+	ht->nnodes++;
 
-	if (elem) *elem = curr;
+	hnode->next = prnt->child;
+	if (prnt->child) prnt->child->prev = hnode;
+	prnt->child = hnode;
 
-	return CL_SUCCESS;
+	return hnode;
 }
 
-/* Removes the element corresponding to key from the hashtable and optionally returns a pointer to the removed element. */
-int onas_ht_remove(struct onas_ht *ht, const char* key, size_t klen, struct onas_element **relem) {
-	if (!ht || !key || klen <= 0) return CL_ENULLARG;
+/* Unlinks hnode from its parent and from the tables and frees it, the node
+ * must not have any children left. */
+static void onas_ht_rm_node(struct onas_ht *ht, struct onas_hnode *hnode) {
 
-	struct onas_bucket *bckt = ht->htable[onas_hash(key, klen, ht->size)];
+	struct onas_hnode **pp = &ht->htable[hnode->hash & (ht->size - 1)];
+
+	while (*pp && *pp != hnode)
+		pp = &(*pp)->hnext;
+	if (*pp) {
+		*pp = hnode->hnext;
+		ht->nnodes--;
+	}
 
-	if (!bckt) return CL_EARG;
+	onas_ht_clear_wd(ht, hnode);
 
-	struct onas_element *elem = NULL;
-	onas_ht_get(ht, key, klen, &elem);
+	if (hnode->prev)
+		hnode->prev->next = hnode->next;
+	else if (hnode->parent)
+		hnode->parent->child = hnode->next;
+	if (hnode->next)
+		hnode->next->prev = hnode->prev;
 
-	if (!elem) return CL_EARG;
+	onas_hnode_free(&ht->arena, hnode);
+}
 
-	int ret = onas_bucket_remove(bckt, elem);
+/* Walks the components of an absolute path, optionally adding the missing
+ * directories along the way. Repeated and trailing slashes are ignored. */
+static struct onas_hnode *onas_ht_walk(struct onas_ht *ht, const char *pathname, size_t len, int add) {
 
-	if (relem) *relem = elem;
+	struct onas_hnode *hnode = ht->root;
+	size_t i = 0, n;
 
-	return ret;
-}
+	if (!len || pathname[0] != '/') return NULL;
 
-static int onas_bucket_remove(struct onas_bucket *bckt, struct onas_element *elem) {
-	if (!bckt || !elem) return CL_ENULLARG;
+	while (hnode) {
+		while (i < len && pathname[i] == '/')
+			i++;
+		if (i == len)
+			break;
 
-	struct onas_element *curr = bckt->head;
+		for (n = i; n < len && pathname[n] != '/'; n++);
 
-	while (curr && curr != elem) {
-		curr = curr->next;
+		if (add)
+			hnode = onas_ht_add_child(ht, hnode, &pathname[i], n - i);
+		else
+			hnode = onas_ht_child(ht, hnode, &pathname[i], n - i);
+		i = n;
 	}
 
-	if (!curr) return CL_EARG;
+	return hnode;
+}
 
-	if (bckt->head == elem) {
-		bckt->head = elem->next;
-		if (bckt->head) bckt->head->prev = NULL;
+/* Checks if the directory has been added and optionally stores its node within hnode */
+int onas_ht_get(struct onas_ht *ht, const char *pathname, size_t len, struct onas_hnode **hnode) {
 
-		elem->next = NULL;
-	} else if (bckt->tail == elem) {
-		bckt->tail = elem->prev;
-		if (bckt->tail) bckt->tail->next = NULL;
+	struct onas_hnode *curr;
 
-		elem->prev = NULL;
-	} else {
-		struct onas_element *tmp = NULL;
+	if (hnode) *hnode = NULL;
 
-		tmp = elem->prev;
-		if (tmp) {
-			tmp->next = elem->next;
-			tmp = elem->next;
-			tmp->prev = elem->prev;
-		}
+	if (!ht || !pathname || len <= 0) return CL_ENULLARG;
 
-		elem->prev = NULL;
-		elem->next = NULL;
-	}
+	curr = onas_ht_walk(ht, pathname, len, 0);
+	if (!curr || !curr->present) return CL_EARG;
 
-	bckt->size--;
+	if (hnode) *hnode = curr;
 
 	return CL_SUCCESS;
 }
 
+/* Rebuilds the full path of hnode within buf, returns its length or 0 if it doesn't fit. */
+size_t onas_ht_path(const struct onas_hnode *hnode, char *buf, size_t size) {
 
-/* Dealing with hash nodes and list nodes */
+	const struct onas_hnode *curr;
+	size_t len = 0;
 
-/* Function to initialize hashnode. */
-static struct onas_hnode *onas_hashnode_init(void) {
-	struct onas_hnode *hnode = NULL;
-	if(!(hnode = (struct onas_hnode *) cli_malloc(sizeof(struct onas_hnode)))) {
-		return NULL;
-	}
+	if (!hnode || !buf || size < 2) return 0;
 
-	*hnode = (struct onas_hnode) {
-		.pathlen = 0,
-		.pathname = NULL,
-		.prnt_pathlen = 0,
-		.prnt_pathname = NULL,
-		.childhead = NULL,
-		.childtail = NULL,
-		.wd = 0,
-		.watched = 0
-	};
-
-	if (!(hnode->childhead = (struct onas_lnode *) onas_listnode_init())) {
-		onas_free_hashnode(hnode);
-		return NULL;
-	}
+	for (curr = hnode; curr->parent; curr = curr->parent)
+		len += curr->namelen + 1;
 
-	if (!(hnode->childtail = (struct onas_lnode *) onas_listnode_init())) {
-		onas_free_hashnode(hnode);
-		return NULL;
+	if (!len) {
+		strcpy(buf, "/");
+		return 1;
 	}
+	if (len >= size) return 0;
 
-	hnode->childhead->next = (struct onas_lnode *) hnode->childtail;
-	hnode->childtail->prev = (struct onas_lnode *) hnode->childhead;
+	buf[len] = 0;
+	for (curr = hnode; curr->parent; curr = curr->parent) {
+		len -= curr->namelen;
+		memcpy(&buf[len], curr->name, curr->namelen);
+		buf[--len] = '/';
+	}
 
-	return hnode;
+	return strlen(buf);
 }
 
-/* Function to initialize listnode. */
-static struct onas_lnode *onas_listnode_init(void) {
-	struct onas_lnode *lnode = NULL;
-	if(!(lnode = (struct onas_lnode *) cli_malloc(sizeof(struct onas_lnode)))) {
-		return NULL;
-	}
+/*** Watch descriptors ***/
 
-	*lnode = (struct onas_lnode) {
-		.dirname = NULL,
-		.next = NULL,
-		.prev = NULL
-	};
-
-	return lnode;
-}
+int onas_ht_set_wd(struct onas_ht *ht, struct onas_hnode *hnode, int wd) {
 
-/* Function to free hashnode. */
-void onas_free_hashnode(struct onas_hnode *hnode) {
-	if (!hnode) return;
+	uint32_t idx;
 
-	onas_free_dirlist(hnode->childhead);
-	hnode->childhead = NULL;
+	if (!ht || !hnode || wd < 0) return CL_EARG;
 
-	free(hnode->pathname);
-	hnode->pathname = NULL;
+	onas_ht_clear_wd(ht, hnode);
 
-	free(hnode->prnt_pathname);
-	hnode->prnt_pathname = NULL;
+	if (ht->nwatches >= ht->wdsize && onas_ht_grow_wd(ht) != CL_SUCCESS) return CL_EMEM;
 
-	free(hnode);
+	hnode->wd = wd;
+	idx = wd & (ht->wdsize - 1);
+	hnode->wnext = ht->wdtable[idx];
+	ht->wdtable[idx] = hnode;
+	ht->nwatches++;
 
-	return;
+	return CL_SUCCESS;
 }
 
+void onas_ht_clear_wd(struct onas_ht *ht, struct onas_hnode *hnode) {
 
-/* Function to free list of listnodes. */
-void onas_free_dirlist(struct onas_lnode *head) {
-	if (!head) return;
-	struct onas_lnode *curr = head;
-	struct onas_lnode *tmp = curr;
+	struct onas_hnode **pp;
 
-	while(curr) {
-		tmp = curr->next;
-		onas_free_listnode(curr);
-		curr = tmp;
+	if (!ht || !hnode || hnode->wd < 0) return;
+
+	pp = &ht->wdtable[hnode->wd & (ht->wdsize - 1)];
+	while (*pp && *pp != hnode)
+		pp = &(*pp)->wnext;
+	if (*pp) {
+		*pp = hnode->wnext;
+		ht->nwatches--;
 	}
 
-	return;
+	hnode->wnext = NULL;
+	hnode->wd = -1;
 }
 
-/* Function to free a listnode. */
-void onas_free_listnode(struct onas_lnode *lnode) {
-	if (!lnode) return;
+struct onas_hnode *onas_ht_get_wd(struct onas_ht *ht, int wd) {
 
-	lnode->next = NULL;
-	lnode->prev = NULL;
+	struct onas_hnode *hnode;
 
-	free(lnode->dirname);
-	lnode->dirname = NULL;
+	if (!ht || wd < 0) return NULL;
 
-	free(lnode);
+	hnode = ht->wdtable[wd & (ht->wdsize - 1)];
+	while (hnode && hnode->wd != wd)
+		hnode = hnode->wnext;
 
-	return;
+	return hnode;
 }
 
-static int onas_add_hashnode_child(struct onas_hnode *node, const char* dirname) {
-	if (!node || !dirname) return CL_ENULLARG;
+/*** Dealing with hierarchy changes. ***/
 
-	struct onas_lnode *child = onas_listnode_init();
-	if (!child) return CL_EMEM;
-	
-	size_t n = strlen(dirname);
-	child->dirname = strndup(dirname, n);
+/* The crawl of a new hierarchy: directories waiting to be read and the
+ * threads reading them. Only the tree and the stack need the lock, the
+ * names and parents of the nodes don't change once they're added. */
+struct onas_crawl {
+	struct onas_ht *ht;
+	dev_t dev;
 
-	onas_add_listnode(node->childtail, child);
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
 
-	return CL_SUCCESS;
-}
+	struct onas_hnode **stack;
+	size_t nstack;
+	size_t stacksize;
 
-/* Function to add a dir_listnode to a list */
-int onas_add_listnode(struct onas_lnode *tail, struct onas_lnode *node) {
-	if (!tail || !node) return CL_ENULLARG;
+	/* Directories pushed but not read yet */
+	size_t pending;
+	int ret;
+};
 
-	struct onas_lnode *tmp = tail->prev;
+static int onas_crawl_push(struct onas_crawl *crawl, struct onas_hnode *hnode) {
 
-	tmp->next = node;
-	node->prev = tail->prev;
+	if (crawl->nstack == crawl->stacksize) {
+		size_t size = crawl->stacksize ? crawl->stacksize << 1 : 1024;
+		struct onas_hnode **stack = (struct onas_hnode **) cli_realloc(crawl->stack, size * sizeof(struct onas_hnode *));
 
-	node->next = tail;
-	tail->prev = node;
+		if (!stack) return CL_EMEM;
+		crawl->stack = stack;
+		crawl->stacksize = size;
+	}
+
+	crawl->stack[crawl->nstack++] = hnode;
+	crawl->pending++;
 
 	return CL_SUCCESS;
 }
 
-/* Function to remove a listnode based on dirname. */
-int onas_rm_listnode(struct onas_lnode *head, const char *dirname) {
-	if (!dirname || !head) return CL_ENULLARG;
+/* Reads one directory, adds its subdirectories on the same file system to
+ * the tree and to the stack. Like fts(3) with FTS_PHYSICAL | FTS_XDEV,
+ * symbolic links aren't followed and unreadable directories are skipped. */
+static int onas_crawl_dir(struct onas_crawl *crawl, struct onas_hnode *hnode, char **names, size_t *namesize) {
+
+	char path[PATH_MAX];
+	DIR *dd;
+	struct dirent *dent;
+	struct stat sb;
+	size_t used = 0, len, i;
+	int ret = CL_SUCCESS;
+
+	if (!onas_ht_path(hnode, path, sizeof(path))) {
+		logg("*ScanOnAccess: Skipping a directory, its path is longer than %d bytes\n", PATH_MAX);
+		return CL_SUCCESS;
+	}
 
-	struct onas_lnode *curr = head;
-	size_t n = strlen(dirname);
+	if (!(dd = opendir(path))) return CL_SUCCESS;
 
-	while ((curr = curr->next)) {
-		if (!strncmp(curr->dirname, dirname, n)) {
-			struct onas_lnode *tmp = curr->prev;
-			tmp->next = curr->next;
-			tmp = curr->next;
-			tmp->prev = curr->prev;
+	/* The names are gathered first so that the lock is taken once per directory */
+	while ((dent = readdir(dd))) {
+		if (dent->d_name[0] == '.' && (!dent->d_name[1] || (dent->d_name[1] == '.' && !dent->d_name[2])))
+			continue;
+		if (dent->d_type != DT_DIR && dent->d_type != DT_UNKNOWN)
+			continue;
+		if (fstatat(dirfd(dd), dent->d_name, &sb, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(sb.st_mode) || sb.st_dev != crawl->dev)
+			continue;
 
-			onas_free_listnode(curr);
+		len = strlen(dent->d_name) + 1;
+		if (used + len > *namesize) {
+			size_t size = (*namesize << 1) + len;
+			char *tmp = (char *) cli_realloc(*names, size);
 
-			return CL_SUCCESS;
+			if (!tmp) {
+				ret = CL_EMEM;
+				break;
+			}
+			*names = tmp;
+			*namesize = size;
 		}
+		memcpy(*names + used, dent->d_name, len);
+		used += len;
 	}
+	closedir(dd);
 
-	return -1;
-}
-
-/*** Dealing with parent/child relationships in the table. ***/
-
-/* Determines parent and returns a copy based on full pathname. */
-inline static char *onas_get_parent(const char *pathname, size_t len) {
-	if (!pathname || len <= 1) return NULL;
-
-	int idx = len - 2;
-	char *ret = NULL;
+	pthread_mutex_lock(&crawl->mutex);
+	for (i = 0; i < used && ret == CL_SUCCESS; i += len + 1) {
+		struct onas_hnode *child;
 
-	while(idx >= 0 && pathname[idx] != '/') {
-		idx--;
-	}
+		len = strlen(*names + i);
+		if (!(child = onas_ht_add_child(crawl->ht, hnode, *names + i, len))) {
+			ret = CL_EMEM;
+			break;
+		}
 
-	if (idx == 0) {
-		idx++;
-	}
+		/* Already there from the crawl of another included directory */
+		if (child->present)
+			continue;
+		child->present = 1;
 
-	ret = strndup(pathname, idx);
-	if (!ret) {
-		errno = ENOMEM;
-		return NULL;
+		ret = onas_crawl_push(crawl, child);
 	}
+	if (crawl->nstack)
+		pthread_cond_broadcast(&crawl->cond);
+	pthread_mutex_unlock(&crawl->mutex);
 
 	return ret;
 }
 
-/* Gets the index at which the name of directory begins from the full pathname. */
-inline static int onas_get_dirname_idx(const char *pathname, size_t len) {
-	if (!pathname || len <= 1) return -1;
+static void *onas_crawl_th(void *arg) {
 
-	int idx = len - 2;
+	struct onas_crawl *crawl = (struct onas_crawl *) arg;
+	struct onas_hnode *hnode;
+	char *names = NULL;
+	size_t namesize = 0;
+	int ret;
 
-	while(idx >= 0 && pathname[idx] != '/') {
-		idx--;
-	}
+	pthread_mutex_lock(&crawl->mutex);
+	while (1) {
+		while (!crawl->nstack && crawl->pending && crawl->ret == CL_SUCCESS)
+			pthread_cond_wait(&crawl->cond, &crawl->mutex);
 
-	if (pathname[idx] == '/')
-		return idx + 1;
+		if (!crawl->nstack || crawl->ret != CL_SUCCESS)
+			break;
 
-	return idx;
-}
-
-/* Emancipates the specified child from the specified parent. */
-int onas_ht_rm_child(struct onas_ht *ht, const char *prntpath, size_t prntlen, const char *childpath, size_t childlen) {
-
-	if (!ht || !prntpath || prntlen <= 0 || !childpath || childlen <= 1) return CL_ENULLARG;
-
-	struct onas_element *elem = NULL;
-	struct onas_hnode *hnode = NULL;
-	int idx = onas_get_dirname_idx(childpath, childlen);
-	int ret = 0;
+		hnode = crawl->stack[--crawl->nstack];
+		pthread_mutex_unlock(&crawl->mutex);
 
-	if(idx <= 0) return CL_SUCCESS;
+		ret = onas_crawl_dir(crawl, hnode, &names, &namesize);
 
-	if(onas_ht_get(ht, prntpath, prntlen, &elem) != CL_SUCCESS) return CL_EARG;
-
-	hnode = elem->data;
-
-	if ((ret = onas_rm_listnode(hnode->childhead, &(childpath[idx])))) return CL_EARG;
-
-	return CL_SUCCESS;
-}
-
-/* The specified parent adds the specified child to its list. */
-int onas_ht_add_child(struct onas_ht *ht, const char *prntpath, size_t prntlen, const char *childpath, size_t childlen) {
-	if (!ht || !prntpath || prntlen <= 0 || !childpath || childlen <= 1) return CL_ENULLARG;
-
-	struct onas_element *elem = NULL;
-	struct onas_hnode *hnode = NULL;
-	int idx = onas_get_dirname_idx(childpath, childlen);
-
-	if(idx <= 0) return CL_SUCCESS;
+		pthread_mutex_lock(&crawl->mutex);
+		if (ret != CL_SUCCESS)
+			crawl->ret = ret;
+		if (!--crawl->pending || ret != CL_SUCCESS)
+			pthread_cond_broadcast(&crawl->cond);
+	}
+	pthread_mutex_unlock(&crawl->mutex);
 
-	if(onas_ht_get(ht, prntpath, prntlen, &elem)) return CL_EARG;
-	hnode = elem->data;
+	free(names);
 
-	return onas_add_hashnode_child(hnode, &(childpath[idx]));
+	return NULL;
 }
 
-/*** Dealing with hierarchy changes. ***/
+/* Adds the hierarchy under pathname to the tree and allocates all necessary
+ * memory, the directories are read by nthreads threads. */
+int onas_ht_add_hierarchy(struct onas_ht *ht, const char *pathname, int nthreads) {
 
-/* Adds the hierarchy under pathname to the tree and allocates all necessary memory. */
-int onas_ht_add_hierarchy(struct onas_ht *ht, const char *pathname) {
+	struct onas_crawl crawl;
+	struct onas_hnode *hnode;
+	struct stat sb;
+	pthread_t *tids = NULL;
+	int i, nstarted = 0;
 
 	if (!ht || !pathname) return CL_ENULLARG;
 
-	FTS *ftsp = NULL;
-	int ftspopts = FTS_PHYSICAL | FTS_XDEV;
-	FTSENT *curr = NULL;
-	FTSENT *childlist = NULL;
-
-	size_t len = strlen(pathname);
-	char *prnt = onas_get_parent(pathname, len);
-	if (prnt) onas_ht_add_child(ht, prnt, strlen(prnt), pathname, len);
-	free(prnt);
+	if (pathname[0] != '/') {
+		logg("!ScanOnAccess: '%s' is not an absolute path\n", pathname);
+		return CL_EARG;
+	}
 
-	char * const pathargv[] = { (char*) pathname, NULL };
-	if (!(ftsp = fts_open(pathargv, ftspopts, NULL))) {
+	if (lstat(pathname, &sb) || !S_ISDIR(sb.st_mode)) {
 		logg("!ScanOnAccess: Could not open '%s'\n", pathname);
 		return CL_EARG;
 	}
 
-	while((curr = fts_read(ftsp))) {
+	if (!(hnode = onas_ht_walk(ht, pathname, strlen(pathname), 1))) return CL_EMEM;
 
-		struct onas_hnode *hnode = NULL;
+	if (hnode->present) return CL_SUCCESS;
+	hnode->present = 1;
 
-		/* May want to handle other options in the future. */
-		switch (curr->fts_info) {
-			case FTS_D:
-				hnode = onas_hashnode_init();
-				if (!hnode) return CL_EMEM;
+	memset(&crawl, 0, sizeof(crawl));
+	crawl.ht = ht;
+	crawl.dev = sb.st_dev;
+	pthread_mutex_init(&crawl.mutex, NULL);
+	pthread_cond_init(&crawl.cond, NULL);
 
-				hnode->pathlen = curr->fts_pathlen;
-				hnode->pathname = strndup(curr->fts_path, hnode->pathlen);
+	crawl.ret = onas_crawl_push(&crawl, hnode);
 
-				hnode->prnt_pathname = onas_get_parent(hnode->pathname, hnode->pathlen);
-				if (hnode->prnt_pathname)
-					hnode->prnt_pathlen = strlen(hnode->prnt_pathname);
-				else
-					hnode->prnt_pathlen = 0;
+	if (crawl.ret == CL_SUCCESS && nthreads > 1 && (tids = (pthread_t *) cli_malloc((nthreads - 1) * sizeof(pthread_t)))) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&tids[i], NULL, onas_crawl_th, &crawl))
 				break;
-			default:
-				continue;
+			nstarted++;
 		}
+	}
 
-		if((childlist = fts_children(ftsp, 0))) {
-			do {
-				if (childlist->fts_info == FTS_D) {
-					if(CL_EMEM == onas_add_hashnode_child(hnode, childlist->fts_name))
-						return CL_EMEM;
-				}
+	onas_crawl_th(&crawl);
 
-			} while ((childlist = childlist->fts_link));
-		}
+	for (i = 0; i < nstarted; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
 
-		struct onas_element *elem = onas_element_init(hnode, hnode->pathname, hnode->pathlen);
-		if (!elem) return CL_EMEM;
+	pthread_cond_destroy(&crawl.cond);
+	pthread_mutex_destroy(&crawl.mutex);
+	free(crawl.stack);
 
-		if (onas_ht_insert(ht, elem)) return -1;
-	}
-
-	fts_close(ftsp);
-	return CL_SUCCESS;
+	return crawl.ret;
 }
 
 /* Removes the underlying hierarchy from the tree and frees all associated memory. */
-int onas_ht_rm_hierarchy(struct onas_ht *ht, const char* pathname, size_t len, int level) {
-	if (!ht || !pathname || len <= 0) return CL_ENULLARG;
+int onas_ht_rm_hierarchy(struct onas_ht *ht, const char* pathname, size_t len) {
 
-	struct onas_hnode *hnode = NULL;
-	struct onas_element *elem = NULL;
-	char *prntname = NULL;
-	size_t prntlen = 0;
+	struct onas_hnode *top, *curr, *prnt;
 
-	if(onas_ht_get(ht, pathname, len, &elem)) return CL_EARG;
-
-	hnode = elem->data;
-
-	struct onas_lnode *curr = hnode->childhead;
+	if (!ht || !pathname || len <= 0) return CL_ENULLARG;
 
-	if(level == 0) {
-		if(!(prntname = onas_get_parent(pathname, len))) return CL_EARG;
+	if (onas_ht_get(ht, pathname, len, &top)) return CL_EARG;
+	if (top == ht->root) return CL_EARG;
 
-		prntlen = strlen(prntname);
-		if(onas_ht_rm_child(ht, prntname, prntlen, pathname, len)) return CL_EARG;
+	/* Frees the leaves first, going back up once a node's children are gone */
+	curr = top;
+	while (1) {
+		if (curr->child) {
+			curr = curr->child;
+			continue;
+		}
 
-		free(prntname);
+		prnt = curr->parent;
+		if (curr == top) {
+			onas_ht_rm_node(ht, curr);
+			break;
+		}
+		onas_ht_rm_node(ht, curr);
+		curr = prnt;
 	}
 
-	while (curr->next != hnode->childtail) {
-		curr = curr->next;
-
-		size_t size = len + strlen(curr->dirname) + 2;
-		char *child_path = (char *) cli_malloc(size);
-		if (child_path == NULL)
-			return CL_EMEM;
-		if (hnode->pathname[len-1] == '/')
-			snprintf(child_path, size, "%s%s", hnode->pathname, curr->dirname);
-		else
-			snprintf(child_path, size, "%s/%s", hnode->pathname, curr->dirname);
-		onas_ht_rm_hierarchy(ht, child_path, size, level + 1);
-		free(child_path);
+	/* The parents of an included directory only link it to the root */
+	for (curr = prnt; curr != ht->root && !curr->present && !curr->child; curr = prnt) {
+		prnt = curr->parent;
+		onas_ht_rm_node(ht, curr);
 	}
 
-	onas_ht_remove(ht, pathname, len, NULL);
-	onas_free_element(elem);
-
 	return CL_SUCCESS;
 }
 #endif
@@ -22,90 +22,94 @@
 #ifndef __ONAS_HASH_H
 #define __ONAS_HASH_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #define ONAS_FANWATCH   0x1
 #define ONAS_INWATCH   0x2
-#define ONAS_STOPWATCH 0x3
 
-#define ONAS_DEFAULT_HT_SIZE 1 << 18
+/* Initial number of buckets, the tables double as they fill. */
+#define ONAS_DEFAULT_HT_SIZE 1 << 12
 
-struct onas_element {
+/* Sizes of the node allocations are rounded to this, freed nodes are kept
+ * on one list per size and reused. */
+#define ONAS_ARENA_ALIGN 16
+#define ONAS_ARENA_CLASSES 24
+#define ONAS_ARENA_BLKSIZE (64 * 1024)
 
-	const char* key;
-	size_t klen;
-	struct onas_hnode *data;
+/* Directory node. The directories form a trie keyed on the path
+ * components: a node only keeps its own name and the full path is
+ * rebuilt from the parents when needed. */
+struct onas_hnode {
 
-	struct onas_element *next;
-	struct onas_element *prev;
-};
+	struct onas_hnode *parent;
 
-struct onas_bucket {
+	/* First child, the children are linked through next/prev */
+	struct onas_hnode *child;
+	struct onas_hnode *next;
+	struct onas_hnode *prev;
 
-	uint32_t size;
+	/* Chains of the (parent, name) and watch descriptor tables */
+	struct onas_hnode *hnext;
+	struct onas_hnode *wnext;
 
-	struct onas_element *head;
-	struct onas_element *tail;
-};
+	uint32_t hash;
 
-struct onas_ht {
+	/* Inotify watch descriptor, -1 when not watched */
+	int wd;
 
-	struct onas_bucket **htable;
+	/* Watched stuffs */
+	uint8_t watched;
 
-	/* Must be a sufficiently high power of two--will not grow. */
-	uint32_t size;
-	uint32_t nbckts;
-};
+	/* Crawled, rather than only the parent of an included directory */
+	uint8_t present;
 
-/* Directory node struct for lists */
-struct onas_lnode {
+	uint16_t namelen;
+	char name[];
+};
 
-	/* List stuffs */
-	char *dirname;
-	struct onas_lnode *next;
-	struct onas_lnode *prev;
+struct onas_arena_blk {
+	struct onas_arena_blk *next;
 };
 
-/* Directory node struct for hash tables */
-struct onas_hnode {
+struct onas_arena {
+	struct onas_arena_blk *blks;
+	char *curr;
+	size_t left;
 
-	/* Path info */
-	int pathlen;
-	char *pathname;
+	struct onas_hnode *free[ONAS_ARENA_CLASSES];
+};
 
-	/* Parent info */
-	int prnt_pathlen;
-	char *prnt_pathname;
+struct onas_ht {
 
-	/* Child head and tail are empty sentinels */
-	struct onas_lnode *childhead;
-	struct onas_lnode *childtail;
+	/* The root directory, "/" */
+	struct onas_hnode *root;
 
-	/* Inotify watch descriptor */
-	int wd;
+	/* Nodes hashed on their parent and name */
+	struct onas_hnode **htable;
+	uint32_t size;
+	uint32_t nnodes;
 
-	/* Watched stuffs */
-	uint32_t watched;
+	/* Nodes hashed on their inotify watch descriptor */
+	struct onas_hnode **wdtable;
+	uint32_t wdsize;
+	uint32_t nwatches;
+
+	struct onas_arena arena;
 };
 
 
-void onas_free_ht(struct onas_ht *ht);
 int onas_ht_init(struct onas_ht **ht, uint32_t table_size);
-int onas_ht_insert(struct onas_ht *ht, struct onas_element *elem);
-int onas_ht_remove(struct onas_ht *ht, const char *key, size_t klen, struct onas_element **elem);
-int onas_ht_get(struct onas_ht *ht, const char *key, size_t klen, struct onas_element **elem);
-int onas_ht_rm_hierarchy(struct onas_ht *ht, const char *pathname, size_t len, int level);
-int onas_ht_add_hierarchy(struct onas_ht *ht, const char *pathname);
-int onas_ht_add_child(struct onas_ht *ht, const char *prntpath, size_t prntlen, const char *childpath, size_t childlen);
-int onas_ht_rm_child(struct onas_ht *ht, const char *prntpath, size_t prntlen, const char *childpath, size_t childlen);
-
-void onas_free_element(struct onas_element *elem);
-struct onas_element *onas_element_init(struct onas_hnode *value, const char *key, size_t klen);
+void onas_free_ht(struct onas_ht *ht);
 
-void onas_free_hashnode(struct onas_hnode *hnode);
+int onas_ht_get(struct onas_ht *ht, const char *pathname, size_t len, struct onas_hnode **hnode);
+size_t onas_ht_path(const struct onas_hnode *hnode, char *buf, size_t size);
 
-void onas_free_listnode(struct onas_lnode *lnode);
-int onas_add_listnode(struct onas_lnode *tail, struct onas_lnode *node);
-int onas_rm_listnode(struct onas_lnode *head, const char *dirname);
+int onas_ht_add_hierarchy(struct onas_ht *ht, const char *pathname, int nthreads);
+int onas_ht_rm_hierarchy(struct onas_ht *ht, const char *pathname, size_t len);
 
-void onas_free_dirlist(struct onas_lnode *head);
+int onas_ht_set_wd(struct onas_ht *ht, struct onas_hnode *hnode, int wd);
+void onas_ht_clear_wd(struct onas_ht *ht, struct onas_hnode *hnode);
+struct onas_hnode *onas_ht_get_wd(struct onas_ht *ht, int wd);
 
 #endif
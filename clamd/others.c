@@ -223,6 +223,52 @@ writen (int fd, void *buff, unsigned int count)
     return count;
 }
 
+/* INSTREAM memory buffers, kept around for the next stream */
+#define STREAMBUF_POOL 16
+#define STREAMBUF_MIN 65536
+static pthread_mutex_t streambuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    char *mem;
+    size_t size;
+} streambuf_pool[STREAMBUF_POOL];
+static unsigned int streambuf_count;
+
+char *
+streambuf_get (size_t *size)
+{
+    char *mem = NULL;
+
+    pthread_mutex_lock (&streambuf_mutex);
+    if (streambuf_count)
+    {
+        streambuf_count--;
+        mem = streambuf_pool[streambuf_count].mem;
+        *size = streambuf_pool[streambuf_count].size;
+    }
+    pthread_mutex_unlock (&streambuf_mutex);
+    if (!mem && (mem = malloc (STREAMBUF_MIN)))
+        *size = STREAMBUF_MIN;
+    return mem;
+}
+
+void
+streambuf_put (char *mem, size_t size)
+{
+    if (!mem)
+        return;
+    pthread_mutex_lock (&streambuf_mutex);
+    if (streambuf_count < STREAMBUF_POOL)
+    {
+        streambuf_pool[streambuf_count].mem = mem;
+        streambuf_pool[streambuf_count].size = size;
+        streambuf_count++;
+        mem = NULL;
+    }
+    pthread_mutex_unlock (&streambuf_mutex);
+    free (mem);
+}
+
 static int
 realloc_polldata (struct fd_data *data)
 {
@@ -271,10 +317,27 @@ fds_cleanup (struct fd_data *data)
         {
             if (data->buf[i].buffer)
                 free (data->buf[i].buffer);
+#ifdef CLAMD_USE_EPOLL
+            if (data->buf[i].pollfd != -1)
+                close (data->buf[i].pollfd);
+#endif
+#ifdef CLAMD_USE_IOCP
+            fds_iocp_detach (data, &data->buf[i]);
+#endif
             continue;
         }
         if (i != j)
+        {
             data->buf[j] = data->buf[i];
+#ifdef CLAMD_USE_EPOLL
+            if (data->epoll_fd != -1)
+                data->fdmap[data->buf[j].fd] = j;
+#endif
+#ifdef CLAMD_USE_IOCP
+            if (data->buf[j].iocp_op)
+                data->buf[j].iocp_op->idx = j;
+#endif
+        }
         j++;
     }
     if (j == data->nfds)
@@ -382,6 +445,293 @@ read_fd_data (struct fd_buf *buf)
     return n;
 }
 
+#ifdef CLAMD_USE_EPOLL
+/* Each connection is registered through its own dup of the socket, so that a
+ * scanner thread closing the connection can't drop the registration (and the
+ * pending hangup event) before the recv loop has seen it.
+ * Events are EPOLLONESHOT: a descriptor that fired is rearmed by the next
+ * fds_poll_recv() only if it is still ours, which keeps descriptors handed to
+ * the thread pool quiet without an extra epoll_ctl() per handoff.
+ */
+static int
+fds_map (struct fd_data *data, int fd, size_t idx)
+{
+    if ((size_t) fd >= data->fdmap_size)
+    {
+        size_t n = data->fdmap_size ? data->fdmap_size : 64;
+        int *map;
+
+        while (n <= (size_t) fd)
+            n *= 2;
+        map = realloc (data->fdmap, n * sizeof (*map));
+        if (!map)
+        {
+            logg ("!fds_map: Memory allocation failed for fd map\n");
+            return -1;
+        }
+        memset (map + data->fdmap_size, -1,
+                (n - data->fdmap_size) * sizeof (*map));
+        data->fdmap = map;
+        data->fdmap_size = n;
+    }
+    data->fdmap[fd] = idx;
+    return 0;
+}
+
+static struct fd_buf *
+fds_lookup (struct fd_data *data, int fd)
+{
+    unsigned idx;
+
+    if (fd < 0 || (size_t) fd >= data->fdmap_size)
+        return NULL;
+    idx = data->fdmap[fd];
+    if (idx >= data->nfds || data->buf[idx].fd != fd)
+        return NULL;
+    return &data->buf[idx];
+}
+
+static int
+fds_arm (struct fd_data *data, struct fd_buf *buf, int op)
+{
+    struct epoll_event ev;
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = buf->fd;
+    if (epoll_ctl (data->epoll_fd, op, buf->pollfd, &ev) == -1)
+    {
+        char err[128];
+        logg ("!fds_arm: epoll_ctl failed on fd %d: %s\n", buf->fd,
+              cli_strerror (errno, err, sizeof (err)));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+fds_register (struct fd_data *data, struct fd_buf *buf, size_t idx)
+{
+    if (buf->pollfd != -1)
+        close (buf->pollfd);
+    if ((buf->pollfd = dup (buf->fd)) == -1)
+    {
+        logg ("!fds_register: dup failed on fd %d\n", buf->fd);
+        return -1;
+    }
+    if (fds_map (data, buf->fd, idx) == -1
+        || fds_arm (data, buf, EPOLL_CTL_ADD) == -1)
+    {
+        close (buf->pollfd);
+        buf->pollfd = -1;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+#ifdef CLAMD_USE_IOCP
+/* Each buf owns one outstanding wait. The port may still hold a packet for
+ * it when the buf goes away, so a pending op is only orphaned then, and
+ * freed once its packet has been dequeued.
+ * Like the epoll events, a wait that fired is rearmed by the next
+ * fds_poll_recv() only if its buf is still there.
+ */
+struct fds_iocp_op
+{
+    OVERLAPPED ov;              /* must stay first */
+    int fd;                     /* -1 - orphaned */
+    size_t idx;                 /* in data->buf */
+    int pending;
+    HANDLE iocp;
+    HANDLE event;               /* listening sockets only */
+    HANDLE wait;
+    volatile LONG posted;
+};
+
+static VOID CALLBACK
+fds_iocp_signaled (PVOID arg, BOOLEAN timedout)
+{
+    struct fds_iocp_op *op = (struct fds_iocp_op *) arg;
+
+    UNUSEDPARAM (timedout);
+    if (!InterlockedExchange (&op->posted, 1))
+        PostQueuedCompletionStatus (op->iocp, 0, 0, &op->ov);
+}
+
+static VOID CALLBACK
+fds_iocp_wake (PVOID arg, BOOLEAN timedout)
+{
+    UNUSEDPARAM (timedout);
+    PostQueuedCompletionStatus ((HANDLE) arg, 0, 0, NULL);
+}
+
+static void
+fds_iocp_op_free (struct fds_iocp_op *op)
+{
+    if (op->event)
+        CloseHandle (op->event);
+    free (op);
+}
+
+static int
+fds_iocp_register (struct fd_data *data, struct fd_buf *buf, size_t idx)
+{
+    struct fds_iocp_op *op;
+
+    if (!(op = calloc (1, sizeof (*op))))
+    {
+        logg ("!fds_iocp_register: Memory allocation failed\n");
+        return -1;
+    }
+    op->fd = buf->fd;
+    op->idx = idx;
+    op->iocp = data->iocp;
+    if (!buf->buffer)
+    {
+        /* a zero byte read never completes on a listening socket, wait
+         * on its network event instead */
+        if (!(op->event = CreateEvent (NULL, TRUE, FALSE, NULL)))
+        {
+            logg ("!fds_iocp_register: CreateEvent failed on fd %d\n",
+                  buf->fd);
+            free (op);
+            return -1;
+        }
+    }
+    else if (!CreateIoCompletionPort
+             ((HANDLE) (SOCKET) buf->fd, data->iocp, 0, 0)
+             && GetLastError () != ERROR_INVALID_PARAMETER)
+    {
+        /* ERROR_INVALID_PARAMETER: the connection is back from the thread
+         * pool and already associated */
+        logg ("!fds_iocp_register: can't associate fd %d with the port\n",
+              buf->fd);
+        free (op);
+        return -1;
+    }
+    buf->iocp_op = op;
+    return 0;
+}
+
+static void
+fds_iocp_detach (struct fd_data *data, struct fd_buf *buf)
+{
+    struct fds_iocp_op *op = buf->iocp_op;
+
+    if (!op)
+        return;
+    buf->iocp_op = NULL;
+    if (op->pending && op->event)
+    {
+        /* waits for a running callback, after which we know whether a
+         * packet is on its way */
+        UnregisterWaitEx (op->wait, INVALID_HANDLE_VALUE);
+        if (buf->fd >= 0)
+            WSAEventSelect (buf->fd, op->event, 0);
+        if (!InterlockedExchange (&op->posted, 1))
+        {
+            op->pending = 0;
+            data->npending--;
+        }
+    }
+    if (op->pending)
+        op->fd = -1;
+    else
+        fds_iocp_op_free (op);
+}
+
+static int
+fds_iocp_arm (struct fd_data *data, struct fd_buf *buf)
+{
+    struct fds_iocp_op *op = buf->iocp_op;
+
+    memset (&op->ov, 0, sizeof (op->ov));
+    op->posted = 0;
+    if (op->event)
+    {
+        if (WSAEventSelect (buf->fd, op->event,
+                            FD_ACCEPT | FD_READ | FD_CLOSE)
+            || !RegisterWaitForSingleObject (&op->wait, op->event,
+                                             fds_iocp_signaled, op, INFINITE,
+                                             WT_EXECUTEONLYONCE))
+        {
+            logg ("!fds_iocp_arm: can't wait on fd %d\n", buf->fd);
+            WSAEventSelect (buf->fd, op->event, 0);
+            return -1;
+        }
+    }
+    else
+    {
+        WSABUF wsabuf;
+        DWORD got, flags = 0;
+
+        /* completes, without consuming anything, once there is data or
+         * the connection is gone */
+        wsabuf.len = 0;
+        wsabuf.buf = NULL;
+        if (WSARecv ((SOCKET) buf->fd, &wsabuf, 1, &got, &flags, &op->ov,
+                     NULL) && WSAGetLastError () != WSA_IO_PENDING)
+        {
+            logg ("$fds_iocp_arm: WSARecv failed on fd %d\n", buf->fd);
+            return -1;
+        }
+    }
+    op->pending = 1;
+    data->npending++;
+    return 0;
+}
+
+static struct fd_buf *
+fds_iocp_lookup (struct fd_data *data, struct fds_iocp_op *op)
+{
+    struct fd_buf *buf;
+
+    if (op->idx >= data->nfds)
+        return NULL;
+    buf = &data->buf[op->idx];
+    if (buf->iocp_op != op || buf->fd != op->fd)
+        return NULL;
+    return buf;
+}
+#endif
+
+/* Switch data to the epoll (or completion port) backend, must be called
+ * before the first fds_add(). Returns -1 if the backend is not available, in
+ * which case fds_poll_recv() keeps using poll()/select(). */
+int
+fds_init_events (struct fd_data *data)
+{
+#ifdef CLAMD_USE_EPOLL
+    if (data->epoll_fd != -1)
+        return 0;
+    if ((data->epoll_fd = epoll_create (64)) == -1)
+    {
+        char err[128];
+        logg ("^epoll_create failed, falling back to poll(): %s\n",
+              cli_strerror (errno, err, sizeof (err)));
+        return -1;
+    }
+#ifdef FD_CLOEXEC
+    fcntl (data->epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+    return 0;
+#elif defined(CLAMD_USE_IOCP)
+    if (data->iocp)
+        return 0;
+    if (!(data->iocp = CreateIoCompletionPort (INVALID_HANDLE_VALUE, NULL, 0, 1)))
+    {
+        logg ("^CreateIoCompletionPort failed, falling back to poll(): %lu\n",
+              (unsigned long) GetLastError ());
+        return -1;
+    }
+    return 0;
+#else
+    UNUSEDPARAM (data);
+    return -1;
+#endif
+}
+
 static int
 buf_init (struct fd_buf *buf, int listen_only, int timeout)
 {
@@ -394,7 +744,15 @@ buf_init (struct fd_buf *buf, int listen_only, int timeout)
     buf->chunksize = 0;
     buf->quota = 0;
     buf->dumpname = NULL;
+    buf->dumpmem = NULL;
+    buf->dumpmem_len = 0;
+    buf->dumpmem_size = 0;
+    buf->dumphash = NULL;
+    buf->batch = 0;
+    buf->ring = NULL;
     buf->group = NULL;
+    buf->priority = PRIO_NORMAL;
+    buf->deadline = 0;
     buf->term = '\0';
     if (!listen_only)
     {
@@ -441,12 +799,35 @@ fds_add (struct fd_data *data, int fd, int listen_only, int timeout)
     }
     /* we may already have this fd, if
      * the old FD got closed, and the kernel reused the FD */
+#ifdef CLAMD_USE_EPOLL
+    if (data->epoll_fd != -1)
+    {
+        if ((buf = fds_lookup (data, fd)))
+        {
+            /* clear stale data in buffer, the old registration belongs to
+             * the previous socket */
+            if (buf_init (buf, listen_only, timeout) < 0)
+                return -1;
+            return fds_register (data, buf, buf - data->buf);
+        }
+        n = data->nfds;
+    }
+    else
+#endif
     for (n = 0; n < data->nfds; n++)
         if (data->buf[n].fd == fd)
         {
             /* clear stale data in buffer */
             if (buf_init (&data->buf[n], listen_only, timeout) < 0)
                 return -1;
+#ifdef CLAMD_USE_IOCP
+            if (data->iocp)
+            {
+                /* the old wait may belong to the previous socket */
+                fds_iocp_detach (data, &data->buf[n]);
+                return fds_iocp_register (data, &data->buf[n], n);
+            }
+#endif
             return 0;
         }
 
@@ -460,9 +841,30 @@ fds_add (struct fd_data *data, int fd, int listen_only, int timeout)
     data->buf = buf;
     data->nfds = n;
     data->buf[n - 1].buffer = NULL;
+#ifdef CLAMD_USE_EPOLL
+    data->buf[n - 1].pollfd = -1;
+#endif
+#ifdef CLAMD_USE_IOCP
+    data->buf[n - 1].iocp_op = NULL;
+#endif
     if (buf_init (&data->buf[n - 1], listen_only, timeout) < 0)
         return -1;
     data->buf[n - 1].fd = fd;
+#ifdef CLAMD_USE_EPOLL
+    if (data->epoll_fd != -1
+        && fds_register (data, &data->buf[n - 1], n - 1) == -1)
+    {
+        data->buf[n - 1].fd = -1;
+        return -1;
+    }
+#endif
+#ifdef CLAMD_USE_IOCP
+    if (data->iocp && fds_iocp_register (data, &data->buf[n - 1], n - 1) == -1)
+    {
+        data->buf[n - 1].fd = -1;
+        return -1;
+    }
+#endif
     return 0;
 }
 
@@ -499,6 +901,250 @@ fds_remove (struct fd_data *data, int fd)
     fds_unlock (data);
 }
 
+#ifdef HAVE_POLL
+/* Handle the poll() events of one fd, returns 0 if it got an error */
+static int
+buf_revents (struct fd_buf *buf, short revents)
+{
+    if (revents & (POLLIN | POLLHUP))
+    {
+        logg ("$Received POLLIN|POLLHUP on fd %d\n", buf->fd);
+    }
+#ifndef _WIN32
+    if (revents & POLLHUP)
+    {
+        /* avoid SHUT_WR problem on Mac OS X */
+        int ret = send (buf->fd, &revents, 0, 0);
+        if (!ret || (ret == -1 && errno == EINTR))
+            revents &= ~POLLHUP;
+    }
+#endif
+    if (revents & POLLIN)
+    {
+        int ret = read_fd_data (buf);
+        /* Data available to be read */
+        if (ret == -1)
+            revents |= POLLERR;
+        else if (!ret)
+            revents = POLLHUP;
+    }
+
+    if (revents & (POLLHUP | POLLERR | POLLNVAL))
+    {
+        if (revents & (POLLHUP | POLLNVAL))
+        {
+            /* remote disconnected */
+            logg ("*Client disconnected (FD %d)\n", buf->fd);
+        }
+        else
+        {
+            /* error on file descriptor */
+            logg ("^Error condition on fd %d\n", buf->fd);
+        }
+        buf->got_newdata = -1;
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+#ifdef CLAMD_USE_EPOLL
+/* epoll counterpart of the poll() loop in fds_poll_recv(), timeout is in
+ * seconds. Only the descriptors that fired are visited. */
+static int
+fds_poll_events (struct fd_data *data, int timeout, int check_signals)
+{
+    size_t i;
+    int retval;
+
+    /* rearm what fired last time and is still ours */
+    for (i = 0; i < data->nevents; i++)
+    {
+        struct fd_buf *buf = fds_lookup (data, data->events[i].data.fd);
+        if (buf && buf->pollfd != -1)
+            fds_arm (data, buf, EPOLL_CTL_MOD);
+    }
+    data->nevents = 0;
+
+    if (data->events_max < data->nfds)
+    {
+        struct epoll_event *events;
+        events = realloc (data->events, data->nfds * sizeof (*events));
+        if (!events)
+        {
+            logg ("!fds_poll_events: Memory allocation failed for events\n");
+            return -1;
+        }
+        data->events = events;
+        data->events_max = data->nfds;
+    }
+    if (timeout > 0)
+    {
+        /* seconds to ms */
+        timeout *= 1000;
+    }
+    do
+    {
+        int n = data->events_max;
+
+        fds_unlock (data);
+        retval = epoll_wait (data->epoll_fd, data->events, n, timeout);
+        fds_lock (data);
+    }
+    while (retval == -1 && !check_signals && errno == EINTR);
+
+    if (retval > 0)
+    {
+        data->nevents = retval;
+        for (i = 0; i < data->nevents; i++)
+        {
+            uint32_t events = data->events[i].events;
+            struct fd_buf *buf = fds_lookup (data, data->events[i].data.fd);
+            short revents = 0;
+
+            /* nfds may change during epoll_wait, and the fd
+             * may have been handed off meanwhile */
+            if (!buf)
+                continue;
+            if (events & EPOLLIN)
+                revents |= POLLIN;
+            if (events & EPOLLHUP)
+                revents |= POLLHUP;
+            if (events & EPOLLERR)
+                revents |= POLLERR;
+            buf_revents (buf, revents);
+        }
+    }
+    return retval;
+}
+#endif
+
+#ifdef CLAMD_USE_IOCP
+/* Completion port counterpart of the poll_with_event() loop in
+ * fds_poll_recv(), timeout is in seconds. Only the waits that fired are
+ * set up again. */
+static int
+fds_poll_iocp (struct fd_data *data, int timeout, HANDLE event)
+{
+    size_t i;
+    ULONG n = 0;
+    BOOL ok;
+    int retval = 0;
+
+    for (i = 0; i < data->nfds; i++)
+    {
+        struct fd_buf *buf = &data->buf[i];
+
+        if (buf->fd < 0 || !buf->iocp_op || buf->iocp_op->pending)
+            continue;
+        if (fds_iocp_arm (data, buf) == -1)
+        {
+            buf_revents (buf, POLLERR);
+            retval++;
+        }
+    }
+    if (event && !data->wake_armed)
+    {
+        if (RegisterWaitForSingleObject (&data->wake_wait, event,
+                                         fds_iocp_wake, data->iocp, INFINITE,
+                                         WT_EXECUTEONLYONCE))
+            data->wake_armed = 1;
+        else
+            logg ("^fds_poll_iocp: can't wait on the wakeup event\n");
+    }
+
+    if (data->entries_max < data->nfds + 1)
+    {
+        OVERLAPPED_ENTRY *entries;
+        entries = realloc (data->entries, (data->nfds + 1) * sizeof (*entries));
+        if (!entries)
+        {
+            logg ("!fds_poll_iocp: Memory allocation failed for entries\n");
+            return -1;
+        }
+        data->entries = entries;
+        data->entries_max = data->nfds + 1;
+    }
+
+    fds_unlock (data);
+    ok = GetQueuedCompletionStatusEx (data->iocp, data->entries,
+                                      data->entries_max, &n,
+                                      retval ? 0 : timeout < 0 ? INFINITE :
+                                      (DWORD) timeout * 1000, FALSE);
+    fds_lock (data);
+    if (!ok)
+    {
+        if (GetLastError () == WAIT_TIMEOUT || retval)
+            return retval;
+        logg ("!poll_recv_fds: GetQueuedCompletionStatusEx failed: %lu\n",
+              (unsigned long) GetLastError ());
+        errno = EIO;
+        return -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        struct fds_iocp_op *op =
+            (struct fds_iocp_op *) data->entries[i].lpOverlapped;
+        struct fd_buf *buf;
+        short revents = 0;
+
+        if (!op)
+        {
+            /* the wakeup event */
+            UnregisterWait (data->wake_wait);
+            data->wake_armed = 0;
+            retval++;
+            continue;
+        }
+        op->pending = 0;
+        data->npending--;
+        if (op->fd == -1)
+        {
+            fds_iocp_op_free (op);
+            continue;
+        }
+        if (op->event)
+            UnregisterWait (op->wait);
+        /* the fd may have been handed off meanwhile */
+        if (!(buf = fds_iocp_lookup (data, op)))
+            continue;
+        if (op->event)
+        {
+            WSANETWORKEVENTS evt;
+
+            if (WSAEnumNetworkEvents (buf->fd, op->event, &evt))
+                revents = POLLERR;
+            else
+            {
+                if (evt.lNetworkEvents & (FD_ACCEPT | FD_READ))
+                    revents |= POLLIN;
+                if (evt.lNetworkEvents & FD_CLOSE)
+                    revents |= POLLHUP;
+                if ((evt.lNetworkEvents & FD_ACCEPT
+                     && evt.iErrorCode[FD_ACCEPT_BIT])
+                    || (evt.lNetworkEvents & FD_READ
+                        && evt.iErrorCode[FD_READ_BIT])
+                    || (evt.lNetworkEvents & FD_CLOSE
+                        && evt.iErrorCode[FD_CLOSE_BIT]))
+                    revents = POLLERR;
+            }
+            /* an accepted socket would inherit the selection */
+            WSAEventSelect (buf->fd, op->event, 0);
+            if (!revents)
+                continue;
+        }
+        else if (op->ov.Internal)
+            revents = POLLERR;
+        else
+            revents = POLLIN;
+        buf_revents (buf, revents);
+        retval++;
+    }
+    return retval;
+}
+#endif
+
 #define BUFFSIZE 1024
 /* Wait till data is available to be read on any of the fds,
  * read available data on all fds, and mark them as appropriate.
@@ -560,6 +1206,23 @@ fds_poll_recv (struct fd_data *data, int timeout, int check_signals,
         timeout = -1;
     if (timeout > 0)
         logg ("$fds_poll_recv: timeout after %d seconds\n", timeout);
+#ifdef CLAMD_USE_EPOLL
+    if (data->epoll_fd != -1)
+    {
+        retval = fds_poll_events (data, timeout, check_signals);
+        if (retval == -1 && errno != EINTR)
+        {
+            char err[128];
+            logg ("!poll_recv_fds: epoll_wait failed: %s\n",
+                  cli_strerror (errno, err, sizeof (err)));
+        }
+        return retval;
+    }
+#endif
+#ifdef CLAMD_USE_IOCP
+    if (data->iocp)
+        return fds_poll_iocp (data, timeout, event);
+#endif
 #ifdef HAVE_POLL
     /* Use poll() if available, preferred because:
      *  - can poll any number of FDs
@@ -610,51 +1273,8 @@ fds_poll_recv (struct fd_data *data, int timeout, int check_signals,
                     logg ("!poll_recv_fds FD mismatch\n");
                     continue;
                 }
-                revents = data->poll_data[i].revents;
-                if (revents & (POLLIN | POLLHUP))
-                {
-                    logg ("$Received POLLIN|POLLHUP on fd %d\n",
-                          data->poll_data[i].fd);
-                }
-#ifndef _WIN32
-                if (revents & POLLHUP)
-                {
-                    /* avoid SHUT_WR problem on Mac OS X */
-                    int ret = send (data->poll_data[i].fd, &n, 0, 0);
-                    if (!ret || (ret == -1 && errno == EINTR))
-                        revents &= ~POLLHUP;
-                }
-#endif
-                if (revents & POLLIN)
-                {
-                    int ret = read_fd_data (&data->buf[i]);
-                    /* Data available to be read */
-                    if (ret == -1)
-                        revents |= POLLERR;
-                    else if (!ret)
-                        revents = POLLHUP;
-                }
-
-                if (revents & (POLLHUP | POLLERR | POLLNVAL))
-                {
-                    if (revents & (POLLHUP | POLLNVAL))
-                    {
-                        /* remote disconnected */
-                        logg ("*Client disconnected (FD %d)\n",
-                              data->poll_data[i].fd);
-                    }
-                    else
-                    {
-                        /* error on file descriptor */
-                        logg ("^Error condition on fd %d\n",
-                              data->poll_data[i].fd);
-                    }
-                    data->buf[i].got_newdata = -1;
-                }
-                else
-                {
-                    fdsok++;
-                }
+                fdsok += buf_revents (&data->buf[i],
+                                      data->poll_data[i].revents);
             }
         }
     }
@@ -789,12 +1409,67 @@ fds_free (struct fd_data *data)
         {
             free (data->buf[i].buffer);
         }
+#ifdef CLAMD_USE_EPOLL
+        if (data->buf[i].pollfd != -1)
+            close (data->buf[i].pollfd);
+#endif
+#ifdef CLAMD_USE_IOCP
+        if (data->buf[i].iocp_op)
+        {
+            struct fds_iocp_op *op = data->buf[i].iocp_op;
+            if (op->pending && !op->event)
+                CancelIoEx ((HANDLE) (SOCKET) op->fd, &op->ov);
+            fds_iocp_detach (data, &data->buf[i]);
+        }
+#endif
     }
     if (data->buf)
         free (data->buf);
 #ifdef HAVE_POLL
     if (data->poll_data)
         free (data->poll_data);
+#endif
+#ifdef CLAMD_USE_EPOLL
+    if (data->epoll_fd != -1)
+        close (data->epoll_fd);
+    data->epoll_fd = -1;
+    free (data->events);
+    data->events = NULL;
+    data->events_max = data->nevents = 0;
+    free (data->fdmap);
+    data->fdmap = NULL;
+    data->fdmap_size = 0;
+#endif
+#ifdef CLAMD_USE_IOCP
+    if (data->wake_armed)
+        UnregisterWaitEx (data->wake_wait, INVALID_HANDLE_VALUE);
+    data->wake_armed = 0;
+    /* the orphans can only be freed once the port gave them back */
+    while (data->iocp && data->npending)
+    {
+        OVERLAPPED_ENTRY entry;
+        ULONG n;
+
+        if (!GetQueuedCompletionStatusEx (data->iocp, &entry, 1, &n, 1000,
+                                          FALSE))
+        {
+            logg ("^fds_free: %u waits still pending, leaking them\n",
+                  (unsigned) data->npending);
+            break;
+        }
+        if (entry.lpOverlapped)
+        {
+            fds_iocp_op_free ((struct fds_iocp_op *) entry.lpOverlapped);
+            data->npending--;
+        }
+    }
+    if (data->iocp)
+        CloseHandle (data->iocp);
+    data->iocp = NULL;
+    data->npending = 0;
+    free (data->entries);
+    data->entries = NULL;
+    data->entries_max = 0;
 #endif
     data->buf = NULL;
     data->nfds = 0;
@@ -31,13 +31,31 @@
 #include "thrmgr.h"
 #include "cltypes.h"
 
+/* Linux: the recv and accept loops wait on an epoll instance instead of
+ * rebuilding the pollfd array on every wakeup */
+#if defined(C_LINUX) && defined(HAVE_POLL) && !defined(_WIN32)
+#define CLAMD_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/* Windows: the same, on an I/O completion port. Connections are watched with
+ * a zero byte overlapped WSARecv(), listening sockets with a registered wait
+ * on their network event, and both stay armed across fds_poll_recv() calls
+ * instead of being set up again by poll_with_event() on every wakeup */
+#if defined(_WIN32) && defined(HAVE_POLL)
+#define CLAMD_USE_IOCP
+#endif
+
 enum mode {
     MODE_COMMAND,
     MODE_STREAM,
     MODE_WAITREPLY,
-    MODE_WAITANCILL
+    MODE_WAITANCILL,
+    MODE_SHMRING
 };
 
+struct shm_ring;
+
 struct fd_buf {
     char *buffer;
     size_t bufsize;
@@ -54,8 +72,22 @@ struct fd_buf {
     uint32_t chunksize;
     long quota;
     char *dumpname;
+    char *dumpmem; /* INSTREAM data kept in memory while dumpfd == -1 */
+    size_t dumpmem_len;
+    size_t dumpmem_size;
+    void *dumphash; /* MD5 of dumpmem, updated as the chunks arrive */
+    int batch; /* BATCHSTREAM: each chunk is a whole object */
+    struct shm_ring *ring; /* MODE_SHMRING */
     time_t timeout_at; /* 0 - no timeout */
     jobgroup_t *group;
+    enum thrmgr_prio priority; /* set by PRIORITY */
+    unsigned int deadline; /* ms, 0 - none */
+#ifdef CLAMD_USE_EPOLL
+    int pollfd; /* dup of fd registered with epoll, -1 - none */
+#endif
+#ifdef CLAMD_USE_IOCP
+    struct fds_iocp_op *iocp_op; /* outstanding wait, NULL - none */
+#endif
 };
 
 struct fd_data {
@@ -66,9 +98,29 @@ struct fd_data {
     struct pollfd *poll_data;
     size_t poll_data_nfds;
 #endif
+#ifdef CLAMD_USE_EPOLL
+    int epoll_fd; /* -1 - use poll() */
+    struct epoll_event *events; /* last batch, rearmed by the next poll */
+    size_t events_max;
+    size_t nevents;
+    int *fdmap; /* fd -> index in buf */
+    size_t fdmap_size;
+#endif
+#ifdef CLAMD_USE_IOCP
+    HANDLE iocp; /* NULL - use poll_with_event() */
+    OVERLAPPED_ENTRY *entries;
+    size_t entries_max;
+    size_t npending; /* ops the port still owes us a packet for */
+    HANDLE wake_wait; /* registered wait on the wakeup event */
+    int wake_armed;
+#endif
 };
 
-#ifdef HAVE_POLL
+#ifdef CLAMD_USE_EPOLL
+#define FDS_INIT(mutex) { (mutex), NULL, 0, NULL, 0, -1, NULL, 0, 0, NULL, 0}
+#elif defined(CLAMD_USE_IOCP)
+#define FDS_INIT(mutex) { (mutex), NULL, 0, NULL, 0, NULL, NULL, 0, 0, NULL, 0}
+#elif defined(HAVE_POLL)
 #define FDS_INIT(mutex) { (mutex), NULL, 0, NULL, 0}
 #else
 #define FDS_INIT(mutex) { (mutex), NULL, 0}
@@ -77,11 +129,14 @@ struct fd_data {
 int poll_fd(int fd, int timeout_sec, int check_signals);
 void virusaction(const char *filename, const char *virname, const struct optstruct *opts);
 int writen(int fd, void *buff, unsigned int count);
+int fds_init_events(struct fd_data *data);
 int fds_add(struct fd_data *data, int fd, int listen_only, int timeout);
 void fds_remove(struct fd_data *data, int fd);
 void fds_cleanup(struct fd_data *data);
 int fds_poll_recv(struct fd_data *data, int timeout, int check_signals, void *event);
 void fds_free(struct fd_data *data);
+char *streambuf_get(size_t *size);
+void streambuf_put(char *mem, size_t size);
 
 #ifdef FANOTIFY
 int onas_fan_checkowner(int pid, const struct optstruct *opts);
@@ -66,6 +66,7 @@
 
 #ifdef C_LINUX
 dev_t procdev; /* /proc device */
+struct scan_journal *scan_journal;
 #endif
 
 extern int progexit;
@@ -141,6 +142,8 @@ int scan_callback(STATBUF *sb, char *filename, const char *msg, enum cli_ftw_rea
     int ret;
     int type = scandata->type;
     struct cb_context context;
+    STATBUF jsb;
+    time_t start;
 
     /* detect disconnected socket, 
      * this should NOT detect half-shutdown sockets (SHUT_WR) */
@@ -255,12 +258,27 @@ int scan_callback(STATBUF *sb, char *filename, const char *msg, enum cli_ftw_rea
 	return CL_SUCCESS;
     }
 
+    /* MULTISCAN doesn't stat the files it dispatches */
+    if (scan_journal && scandata->journal) {
+	if (!sb && CLAMSTAT(filename, &jsb) == 0)
+	    sb = &jsb;
+	if (sb && journal_check(scan_journal, scandata->engine, scandata->options, filename, sb)) {
+	    if (logok)
+		logg("~%s: OK (unchanged)\n", filename);
+	    free(filename);
+	    return CL_SUCCESS;
+	}
+    }
+
+    start = time(NULL);
     thrmgr_setactivetask(filename, NULL);
     context.filename = filename;
     context.virsize = 0;
     context.scandata = scandata;
     ret = cl_scanfile_callback(filename, &virname, &scandata->scanned, scandata->engine, scandata->options, &context);
     thrmgr_setactivetask(NULL, NULL);
+    if (sb)
+	thrmgr_addscanned(sb->st_size);
 
     if (thrmgr_group_need_terminate(scandata->conn->group)) {
 	free(filename);
@@ -308,6 +326,13 @@ int scan_callback(STATBUF *sb, char *filename, const char *msg, enum cli_ftw_rea
 	logg("~%s: OK\n", filename);
     }
 
+    if (scan_journal && scandata->journal && sb) {
+	if (ret == CL_CLEAN)
+	    journal_add(scan_journal, scandata->engine, scandata->options, filename, sb, start);
+	else
+	    journal_remove(scan_journal, filename);
+    }
+
     free(filename);
 
     if(ret == CL_EMEM) /* stop scanning */
@@ -352,6 +377,51 @@ int scan_pathchk(const char *path, struct cli_ftw_cbdata *data)
     return 0;
 }
 
+/* scan a SHMRING slot, the reply goes into the slot instead of the socket */
+int scanshm(const client_conn_t *conn, const void *data, size_t len, const char **virname,
+	    const struct cl_engine *engine, unsigned int options, const struct optstruct *opts)
+{
+	int ret;
+	struct cb_context context;
+	char slotstr[32];
+	cl_fmap_t *map;
+
+	snprintf(slotstr, sizeof(slotstr), "shmring[%u]", conn->ringslot);
+	thrmgr_setactivetask(slotstr, NULL);
+	context.filename = slotstr;
+	context.virsize = 0;
+	context.scandata = NULL;
+	*virname = NULL;
+	if ((map = cl_fmap_open_memory(len ? data : "", len))) {
+	    ret = cl_scanmap_callback(map, virname, NULL, engine, options, &context);
+	    cl_fmap_close(map);
+	} else
+	    ret = CL_EMEM;
+	thrmgr_setactivetask(NULL, NULL);
+	thrmgr_addscanned(len);
+
+	if(ret == CL_VIRUS) {
+		if(context.virsize && optget(opts, "ExtendedDetectionInfo")->enabled)
+		    logg("%s: %s(%s:%llu) FOUND\n", slotstr, *virname, context.virhash, context.virsize);
+		else
+		    logg("%s: %s FOUND\n", slotstr, *virname);
+		virusaction(slotstr, *virname, opts);
+	} else if(ret != CL_CLEAN) {
+		logg("%s: %s ERROR\n", slotstr, cl_strerror(ret));
+	} else if(logok) {
+		logg("%s: OK\n", slotstr);
+	}
+	return ret;
+}
+
+/* the reply status with ScanUsageReply */
+static void usage_reply(char *buf, size_t size, const char *status, const struct cl_scan_usage *u)
+{
+    snprintf(buf, size, "%s usec=%llu cpu=%llu read=%llu inflated=%llu objects=%u depth=%u limits=0x%x hash=%llu match=%llu bytecode=%llu parse=%llu",
+	     status, u->usec, u->cpu_usec, u->read, u->inflated, u->objects, u->depth, u->limits,
+	     u->hash_usec, u->match_usec, u->bytecode_usec, u->parse_usec);
+}
+
 int scanfd(const client_conn_t *conn, unsigned long int *scanned,
 	   const struct cl_engine *engine,
 	   unsigned int options, const struct optstruct *opts, int odesc, int stream)
@@ -362,6 +432,8 @@ int scanfd(const client_conn_t *conn, unsigned long int *scanned,
 	struct cb_context context;
 	char fdstr[32];
 	const char*reply_fdstr;
+	struct cl_scan_usage usage, *pusage = NULL;
+	char usagestr[256];
 
     UNUSEDPARAM(odesc);
 
@@ -377,7 +449,7 @@ int scanfd(const client_conn_t *conn, unsigned long int *scanned,
 	    snprintf(fdstr, sizeof(fdstr), "fd[%d]", fd);
 	    reply_fdstr = fdstr;
 	}
-	if(FSTAT(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+	if((!stream || fd != -1) && (FSTAT(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode))) {
 		logg("%s: Not a regular file. ERROR\n", fdstr);
 		if (conn_reply(conn, reply_fdstr, "Not a regular file", "ERROR") == -1)
 		    return CL_ETIMEOUT;
@@ -388,16 +460,33 @@ int scanfd(const client_conn_t *conn, unsigned long int *scanned,
 	context.filename = fdstr;
 	context.virsize = 0;
         context.scandata = NULL;
-	ret = cl_scandesc_callback(fd, &virname, scanned, engine, options, &context);
+	if (optget(opts, "ScanUsageReply")->enabled)
+	    pusage = &usage;
+	if (stream && fd == -1) {
+	    /* INSTREAM data that fit in StreamMaxMemSize */
+	    cl_fmap_t *map = cl_fmap_open_memory(conn->scanmem ? conn->scanmem : "", conn->scanmem_len);
+	    if (map) {
+		if (conn->have_scanmd5)
+		    cl_fmap_set_md5(map, conn->scanmd5);
+		ret = cl_scanmap_usage(map, &virname, scanned, engine, options, &context, pusage);
+		cl_fmap_close(map);
+	    } else
+		ret = CL_EMEM;
+	} else
+	    ret = cl_scandesc_usage(fd, &virname, scanned, engine, options, &context, pusage);
 	thrmgr_setactivetask(NULL, NULL);
+	thrmgr_addscanned(fd == -1 ? conn->scanmem_len : (unsigned long long)statbuf.st_size);
 
 	if (thrmgr_group_need_terminate(conn->group)) {
 	    logg("*Client disconnected while scanjob was active\n");
 	    return ret == CL_ETIMEOUT ? ret : CL_BREAK;
 	}
 
+	if(pusage && (ret == CL_VIRUS || ret == CL_CLEAN))
+	    usage_reply(usagestr, sizeof(usagestr), ret == CL_VIRUS ? "FOUND" : "OK", pusage);
+
 	if(ret == CL_VIRUS) {
-		if (conn_reply_virus(conn, reply_fdstr, virname) == -1)
+		if ((pusage ? conn_reply(conn, reply_fdstr, virname, usagestr) : conn_reply_virus(conn, reply_fdstr, virname)) == -1)
 		    ret = CL_ETIMEOUT;
 		if(context.virsize && optget(opts, "ExtendedDetectionInfo")->enabled)
 		    logg("%s: %s(%s:%llu) FOUND\n", fdstr, virname, context.virhash, context.virsize);
@@ -409,7 +498,7 @@ int scanfd(const client_conn_t *conn, unsigned long int *scanned,
 		    ret = CL_ETIMEOUT;
 		logg("%s: %s ERROR\n", fdstr, cl_strerror(ret));
 	} else {
-		if (conn_reply_single(conn, reply_fdstr, "OK") == CL_ETIMEOUT)
+		if (conn_reply_single(conn, reply_fdstr, pusage ? usagestr : "OK") == CL_ETIMEOUT)
 		    ret = CL_ETIMEOUT;
 		if(logok)
 			logg("%s: OK\n", fdstr);
@@ -551,6 +640,7 @@ int scanstream(int odesc, unsigned long int *scanned, const struct cl_engine *en
     }
 
     if(retval == 1) {
+	off_t size = lseek(tmpd, 0, SEEK_CUR);
 	lseek(tmpd, 0, SEEK_SET);
 	thrmgr_setactivetask(peer_addr, NULL);
 	context.filename = peer_addr;
@@ -558,6 +648,8 @@ int scanstream(int odesc, unsigned long int *scanned, const struct cl_engine *en
         context.scandata = NULL;
 	ret = cl_scandesc_callback(tmpd, &virname, scanned, engine, options, &context);
 	thrmgr_setactivetask(NULL, NULL);
+	if (size > 0)
+	    thrmgr_addscanned(size);
     } else {
     	ret = -1;
     }
@@ -26,6 +26,7 @@
 
 #include "libclamav/clamav.h"
 #include "shared/optparser.h"
+#include "shared/journal.h"
 #include "thrmgr.h"
 #include "session.h"
 
@@ -48,6 +49,7 @@ struct scan_cb_data {
     threadpool_t *thr_pool;
     jobgroup_t *group;
     dev_t dev;
+    int journal; /* CONTSCAN/MULTISCAN: use the scan journal */
 };
 
 struct cb_context {
@@ -58,6 +60,7 @@ struct cb_context {
 };
 
 int scanfd(const client_conn_t *conn, unsigned long int *scanned, const struct cl_engine *engine, unsigned int options, const struct optstruct *opts, int odesc, int stream);
+int scanshm(const client_conn_t *conn, const void *data, size_t len, const char **virname, const struct cl_engine *engine, unsigned int options, const struct optstruct *opts);
 int scanstream(int odesc, unsigned long int *scanned, const struct cl_engine *engine, unsigned int options, const struct optstruct *opts, char term);
 int scan_callback(STATBUF *sb, char *filename, const char *msg, enum cli_ftw_reason reason, struct cli_ftw_cbdata *data);
 int scan_pathchk(const char *path, struct cli_ftw_cbdata *data);
@@ -35,6 +35,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #endif
 #ifdef	HAVE_UNISTD_H
@@ -45,11 +46,22 @@
 #ifdef C_SOLARIS
 #include <stdio_ext.h>
 #endif
+#ifndef _WIN32
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_POLL_H)
+#include <sys/inotify.h>
+#include <poll.h>
+#define DBWATCH
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#define DBWATCH
+#endif
+#endif
 #include "libclamav/clamav.h"
 
 #include "shared/output.h"
 #include "shared/optparser.h"
 #include "shared/misc.h"
+#include "shared/journal.h"
 
 #include "shared/idmef_logging.h"
 
@@ -73,6 +85,8 @@ pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
 int sighup = 0;
 extern pthread_mutex_t logg_mutex;
 static struct cl_stat dbstat;
+/* with WorkerProcesses, the slot of this worker process; -1 otherwise */
+static int prefork_slot = -1;
 
 void *event_wake_recv = NULL;
 void *event_wake_accept = NULL;
@@ -130,6 +144,17 @@ static void scanner_thread(void *arg)
 
 static int syncpipe_wake_recv_w = -1;
 
+#if defined(FANOTIFY) || defined(CLAMAUTH)
+/* the on-access threads take their own reference under engine_mutex */
+static void tharg_setengine(struct thrarg *tharg, const struct cl_engine *engine)
+{
+    pthread_mutex_lock(&tharg->engine_mutex);
+    tharg->engine = engine;
+    tharg->engine_gen++;
+    pthread_mutex_unlock(&tharg->engine_mutex);
+}
+#endif
+
 void sighandler_th(int sig)
 {
     int action = 0;
@@ -163,48 +188,19 @@ void sighandler_th(int sig)
 	    logg("$Failed to write to syncpipe\n");
 }
 
-static struct cl_engine *reload_db(struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts, int do_check, int *ret)
+static struct cl_engine *load_db(struct cl_settings *settings, unsigned int dboptions, const struct optstruct *opts, struct cl_stat *stat, int *ret)
 {
 	const char *dbdir;
 	int retval;
 	unsigned int sigs = 0;
-	struct cl_settings *settings = NULL;
+	struct cl_engine *engine;
 
     *ret = 0;
-    if(do_check) {
-	if(!dbstat.entries) {
-	    logg("No stats for Database check - forcing reload\n");
-	    return engine;
-	}
-
-	if(cl_statchkdir(&dbstat) == 1) {
-	    logg("SelfCheck: Database modification detected. Forcing reload.\n");
-	    return engine;
-	} else {
-	    logg("SelfCheck: Database status OK.\n");
-	    return NULL;
-	}
-    }
-
-    /* release old structure */
-    if(engine) {
-	/* copy current settings */
-	settings = cl_engine_settings_copy(engine);
-	if(!settings)
-	    logg("^Can't make a copy of the current engine settings\n");
-
-	thrmgr_setactiveengine(NULL);
-	cl_engine_free(engine);
-    }
-
     dbdir = optget(opts, "DatabaseDirectory")->strarg;
     logg("Reading databases from %s\n", dbdir);
 
-    if(dbstat.entries)
-	cl_statfree(&dbstat);
-
-    memset(&dbstat, 0, sizeof(struct cl_stat));
-    if((retval = cl_statinidir(dbdir, &dbstat))) {
+    memset(stat, 0, sizeof(struct cl_stat));
+    if((retval = cl_statinidir(dbdir, stat))) {
 	logg("!cl_statinidir() failed: %s\n", cl_strerror(retval));
 	*ret = 1;
 	if(settings)
@@ -243,11 +239,397 @@ static struct cl_engine *reload_db(struct cl_engine *engine, unsigned int dbopti
 	return NULL;
     }
     logg("Database correctly reloaded (%u signatures)\n", sigs);
+    print_loadstats(engine);
+    return engine;
+}
+
+/* the phases of the load with LogVerbose, the total always */
+void print_loadstats(const struct cl_engine *engine)
+{
+	struct cl_loadstat stats[32];
+	unsigned int i, count = sizeof(stats) / sizeof(stats[0]);
+	unsigned long long wall = 0, cpu = 0;
+
+    if(cl_engine_get_loadstats(engine, stats, &count) != CL_SUCCESS)
+	return;
+    if(count > sizeof(stats) / sizeof(stats[0]))
+	count = sizeof(stats) / sizeof(stats[0]);
+    for(i = 0; i < count; i++) {
+	logg("*Load phase %s: %llu call%s, %.3f s, %.3f s CPU, %+lld KB\n", stats[i].name, stats[i].calls,
+	     stats[i].calls == 1 ? "" : "s", stats[i].wall_usec / 1e6, stats[i].cpu_usec / 1e6, stats[i].mem_bytes / 1024);
+	wall += stats[i].wall_usec;
+	cpu += stats[i].cpu_usec;
+    }
+    logg("Database loaded and compiled in %.2f s (%.2f s CPU)\n", wall / 1e6, cpu / 1e6);
+}
+
+static struct cl_engine *reload_db(struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts, int do_check, int *ret)
+{
+	struct cl_settings *settings = NULL;
+
+    *ret = 0;
+    if(do_check) {
+	if(!dbstat.entries) {
+	    logg("No stats for Database check - forcing reload\n");
+	    return engine;
+	}
+
+	if(cl_statchkdir(&dbstat) == 1) {
+	    logg("SelfCheck: Database modification detected. Forcing reload.\n");
+	    return engine;
+	} else {
+	    logg("SelfCheck: Database status OK.\n");
+	    return NULL;
+	}
+    }
 
-    thrmgr_setactiveengine(engine);
+    /* release old structure */
+    if(engine) {
+	/* copy current settings */
+	settings = cl_engine_settings_copy(engine);
+	if(!settings)
+	    logg("^Can't make a copy of the current engine settings\n");
+
+	thrmgr_setactiveengine(NULL);
+	cl_engine_free(engine);
+    }
+
+    if(dbstat.entries)
+	cl_statfree(&dbstat);
+
+    engine = load_db(settings, dboptions, opts, &dbstat, ret);
+    if(engine)
+	thrmgr_setactiveengine(engine);
     return engine;
 }
 
+/*
+ * Background reload: the new engine is built by reload_th while the old one
+ * keeps serving, then recvloop_th swaps it in. The sessions dispatched before
+ * the swap hold their own reference and finish on the old engine.
+ */
+enum reload_stage {
+    RELOAD_STAGE_IDLE,
+    RELOAD_STAGE_LOADING,
+    RELOAD_STAGE_DONE
+};
+
+struct reload_th_arg {
+    struct cl_settings *settings;
+    unsigned int dboptions;
+    const struct optstruct *opts;
+    struct cl_stat dbstat;
+    struct cl_engine *engine;
+    int ret;
+};
+
+static enum reload_stage reload_stage = RELOAD_STAGE_IDLE;
+static pthread_cond_t reload_done = PTHREAD_COND_INITIALIZER;
+static struct reload_th_arg reload_arg;
+static pthread_t reload_pid;
+
+static void *reload_th(void *arg)
+{
+	struct reload_th_arg *rarg = (struct reload_th_arg *) arg;
+#ifndef	_WIN32
+	sigset_t sigset;
+
+    /* the signals are for recvloop_th */
+    sigfillset(&sigset);
+    sigdelset(&sigset, SIGFPE);
+    sigdelset(&sigset, SIGILL);
+    sigdelset(&sigset, SIGSEGV);
+#ifdef SIGBUS
+    sigdelset(&sigset, SIGBUS);
+#endif
+    pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+#endif
+
+    rarg->engine = load_db(rarg->settings, rarg->dboptions, rarg->opts, &rarg->dbstat, &rarg->ret);
+
+    pthread_mutex_lock(&reload_mutex);
+    reload_stage = RELOAD_STAGE_DONE;
+    pthread_cond_broadcast(&reload_done);
+    pthread_mutex_unlock(&reload_mutex);
+
+    /* let recvloop_th publish the engine */
+#ifdef _WIN32
+    SetEvent(event_wake_recv);
+#else
+    if (syncpipe_wake_recv_w != -1)
+	if (write(syncpipe_wake_recv_w, "", 1) != 1)
+	    logg("$Failed to write to syncpipe\n");
+#endif
+    return NULL;
+}
+
+/* start loading the databases next to the current engine */
+static int reload_start(struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts)
+{
+	pthread_attr_t reload_attr;
+
+    memset(&reload_arg, 0, sizeof(reload_arg));
+    reload_arg.settings = cl_engine_settings_copy(engine);
+    if(!reload_arg.settings)
+	logg("^Can't make a copy of the current engine settings\n");
+    reload_arg.dboptions = dboptions;
+    reload_arg.opts = opts;
+
+    reload_stage = RELOAD_STAGE_LOADING;
+    pthread_attr_init(&reload_attr);
+    if(pthread_create(&reload_pid, &reload_attr, reload_th, &reload_arg)) {
+	logg("!Can't start the database reload thread\n");
+	reload_stage = RELOAD_STAGE_IDLE;
+	pthread_attr_destroy(&reload_attr);
+	if(reload_arg.settings)
+	    cl_engine_settings_free(reload_arg.settings);
+	return -1;
+    }
+    pthread_attr_destroy(&reload_attr);
+    return 0;
+}
+
+/* collect the result of reload_th, NULL if the reload failed */
+static struct cl_engine *reload_finish(void)
+{
+    pthread_join(reload_pid, NULL);
+    reload_stage = RELOAD_STAGE_IDLE;
+    if(reload_arg.ret) {
+	if(reload_arg.dbstat.entries)
+	    cl_statfree(&reload_arg.dbstat);
+	return NULL;
+    }
+
+    if(dbstat.entries)
+	cl_statfree(&dbstat);
+    dbstat = reload_arg.dbstat;
+    return reload_arg.engine;
+}
+
+/*
+ * BackgroundStartupLoad: clamd listens and accepts the connections while
+ * reload_th loads the databases for the first time, into an engine built
+ * from the settings of the empty one. The commands received meanwhile are
+ * read once the engine is in, so a restart doesn't refuse any connection.
+ * Returns 1 if the load failed and -1 if clamd is exiting, the exit path
+ * then waits for reload_th.
+ */
+static int startup_load(struct cl_engine **engine, unsigned int dboptions, const struct optstruct *opts, struct fd_data *fds, int commandtimeout)
+{
+	struct cl_engine *new_engine;
+	struct timespec ts;
+	time_t now;
+	size_t i;
+	int exiting;
+
+    logg("Loading the databases in the background.\n");
+    pthread_mutex_lock(&reload_mutex);
+    if(reload_start(*engine, dboptions, opts)) {
+	pthread_mutex_unlock(&reload_mutex);
+	return 1;
+    }
+    while(reload_stage != RELOAD_STAGE_DONE) {
+	pthread_mutex_unlock(&reload_mutex);
+	pthread_mutex_lock(&exit_mutex);
+	exiting = progexit;
+	pthread_mutex_unlock(&exit_mutex);
+	if(exiting)
+	    return -1;
+	/* wake up anyway to check progexit */
+	pthread_mutex_lock(&reload_mutex);
+	ts.tv_sec = time(NULL) + 1;
+	ts.tv_nsec = 0;
+	pthread_cond_timedwait(&reload_done, &reload_mutex, &ts);
+    }
+    pthread_mutex_unlock(&reload_mutex);
+
+    if(!(new_engine = reload_finish())) {
+	logg("!Can't load the databases\n");
+	return 1;
+    }
+    cl_engine_free(*engine);
+    *engine = new_engine;
+    thrmgr_setactiveengine(new_engine);
+
+    /* the connections accepted during the load get their full time */
+    pthread_mutex_lock(fds->buf_mutex);
+    time(&now);
+    for(i = 0; i < fds->nfds; i++)
+	if(fds->buf[i].fd >= 0 && fds->buf[i].timeout_at)
+	    fds->buf[i].timeout_at = now + commandtimeout;
+    pthread_mutex_unlock(fds->buf_mutex);
+
+    pthread_mutex_lock(&reload_mutex);
+    time(&reloaded_time);
+    pthread_mutex_unlock(&reload_mutex);
+    return 0;
+}
+
+#ifdef DBWATCH
+/*
+ * Database watch: a change to a database file wakes recvloop_th, which
+ * checks the database like SelfCheck does. The check waits until the
+ * directory has been quiet for WatchDatabaseDelay seconds, so the files
+ * written by one update end up in a single reload.
+ */
+static int dbwatch_fd = -1, dbwatch_dir = -1;
+static int dbwatch_changed = 0;
+static unsigned int dbwatch_delay;
+static pthread_t dbwatch_pid;
+
+/* waits up to timeout ms, or forever when -1: returns 1 when a database
+ * file changed, 2 for other changes, 0 on timeout and -1 on errors */
+static int dbwatch_wait(int timeout)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[4096];
+	const struct inotify_event *event;
+	struct pollfd pfd;
+	ssize_t bread;
+	char *p;
+	int ret;
+
+    pfd.fd = dbwatch_fd;
+    pfd.events = POLLIN;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    ret = poll(&pfd, 1, timeout);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if(ret <= 0)
+	return ret;
+
+    if((bread = read(dbwatch_fd, buf, sizeof(buf))) <= 0)
+	return (bread == -1 && errno != EAGAIN && errno != EINTR) ? -1 : 0;
+
+    ret = 2;
+    for(p = buf; p < buf + bread; p += sizeof(struct inotify_event) + event->len) {
+	event = (const struct inotify_event *) p;
+	if((event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) || (event->len && CLI_DBEXT(event->name)))
+	    ret = 1;
+    }
+    return ret;
+#else
+	struct kevent ev;
+	struct timespec ts;
+	int ret;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    ret = kevent(dbwatch_fd, NULL, 0, &ev, 1, timeout == -1 ? NULL : &ts);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    /* kqueue only tells that the directory changed */
+    return ret > 0 ? 1 : ret;
+#endif
+}
+
+static void *dbwatch_th(void *arg)
+{
+	sigset_t sigset;
+	int ret;
+
+    UNUSEDPARAM(arg);
+
+    /* the signals are for recvloop_th */
+    sigfillset(&sigset);
+    sigdelset(&sigset, SIGFPE);
+    sigdelset(&sigset, SIGILL);
+    sigdelset(&sigset, SIGSEGV);
+#ifdef SIGBUS
+    sigdelset(&sigset, SIGBUS);
+#endif
+    pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for(;;) {
+	if((ret = dbwatch_wait(-1)) == -1)
+	    break;
+	if(ret != 1)
+	    continue;
+
+	/* let the update finish */
+	while((ret = dbwatch_wait(dbwatch_delay * 1000)) > 0);
+	if(ret == -1)
+	    break;
+
+	logg("*Database directory changed\n");
+	pthread_mutex_lock(&reload_mutex);
+	dbwatch_changed = 1;
+	pthread_mutex_unlock(&reload_mutex);
+	if (syncpipe_wake_recv_w != -1)
+	    if (write(syncpipe_wake_recv_w, "", 1) != 1)
+		logg("$Failed to write to syncpipe\n");
+    }
+    logg("^Database watch stopped: %s, use SelfCheck instead\n", strerror(errno));
+    return NULL;
+}
+
+static int dbwatch_start(const char *dbdir, unsigned int delay)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    if((dbwatch_fd = inotify_init()) == -1) {
+	logg("!Can't initialize inotify: %s\n", strerror(errno));
+	return -1;
+    }
+    if(inotify_add_watch(dbwatch_fd, dbdir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+	logg("!Can't watch %s: %s\n", dbdir, strerror(errno));
+	close(dbwatch_fd);
+	dbwatch_fd = -1;
+	return -1;
+    }
+#else
+	struct kevent ev;
+
+    if((dbwatch_dir = open(dbdir, O_RDONLY)) == -1) {
+	logg("!Can't open %s: %s\n", dbdir, strerror(errno));
+	return -1;
+    }
+    if((dbwatch_fd = kqueue()) == -1) {
+	logg("!Can't initialize kqueue: %s\n", strerror(errno));
+	close(dbwatch_dir);
+	dbwatch_dir = -1;
+	return -1;
+    }
+    /* files are replaced by freshclam, which writes to the directory; files
+     * modified in place are left to the next reload */
+    EV_SET(&ev, dbwatch_dir, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+    if(kevent(dbwatch_fd, &ev, 1, NULL, 0, NULL) == -1) {
+	logg("!Can't watch %s: %s\n", dbdir, strerror(errno));
+	close(dbwatch_fd);
+	close(dbwatch_dir);
+	dbwatch_fd = dbwatch_dir = -1;
+	return -1;
+    }
+#endif
+
+    dbwatch_delay = delay;
+    if(pthread_create(&dbwatch_pid, NULL, dbwatch_th, NULL)) {
+	logg("!Can't start the database watch thread\n");
+	close(dbwatch_fd);
+	dbwatch_fd = -1;
+	if(dbwatch_dir != -1) {
+	    close(dbwatch_dir);
+	    dbwatch_dir = -1;
+	}
+	return -1;
+    }
+    return 0;
+}
+
+static void dbwatch_stop(void)
+{
+    if(dbwatch_fd == -1)
+	return;
+    pthread_cancel(dbwatch_pid);
+    pthread_join(dbwatch_pid, NULL);
+    close(dbwatch_fd);
+    dbwatch_fd = -1;
+    if(dbwatch_dir != -1) {
+	close(dbwatch_dir);
+	dbwatch_dir = -1;
+    }
+}
+#endif
+
 /*
  * zCOMMANDS are delimited by \0
  * nCOMMANDS are delimited by \n
@@ -434,8 +816,9 @@ static void *acceptloop_th(void *arg)
 		    continue;
 		}
 #endif
-	    } else if (errno != EINTR) {
-		/* very bad - need to exit or restart */
+	    } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+		/* very bad - need to exit or restart; EAGAIN is another
+		 * worker process taking the connection first */
 #ifdef HAVE_STRERROR_R
 		strerror_r(errno, buff, BUFFSIZE);
 		logg("!accept() failed: %s\n", buff);
@@ -508,8 +891,8 @@ static const char* parse_dispatch_cmd(client_conn_t *conn, struct fd_buf *buf, s
 	cmdtype = parse_command(cmd, &argument, oldstyle);
 	logg("$got command %s (%u, %u), argument: %s\n",
 	     cmd, (unsigned)cmdlen, (unsigned)cmdtype, argument ? argument : "");
-	if (cmdtype == COMMAND_FILDES) {
-	    if (buf->buffer + buf->off <= cmd + strlen("FILDES\n")) {
+	if (cmdtype == COMMAND_FILDES || cmdtype == COMMAND_SHMRING) {
+	    if (buf->buffer + buf->off <= cmd + strlen(cmd) + 1) {
 		/* we need the extra byte from recvmsg */
 		conn->mode = MODE_WAITANCILL;
 		buf->mode = MODE_WAITANCILL;
@@ -521,7 +904,7 @@ static const char* parse_dispatch_cmd(client_conn_t *conn, struct fd_buf *buf, s
 	    }
 	    /* eat extra \0 for controlmsg */
 	    cmdlen++;
-	    logg("$RECVTH: FILDES command complete\n");
+	    logg("$RECVTH: %s command complete\n", cmd);
 	}
 	conn->term = term;
 	buf->term = term;
@@ -540,7 +923,8 @@ static const char* parse_dispatch_cmd(client_conn_t *conn, struct fd_buf *buf, s
 	    *error = CL_ETIMEOUT;
 	    break;
 	}
-	if (*error || !conn->group || rc) {
+	/* PRIORITY only applies to the commands that follow it */
+	if (*error || (!conn->group && cmdtype != COMMAND_PRIORITY) || rc) {
 	    if (rc && thrmgr_group_finished(conn->group, EXIT_OK)) {
 		logg("$Receive thread: closing conn (FD %d), group finished\n", conn->sd);
 		/* if there are no more active jobs */
@@ -587,16 +971,22 @@ static const char* parse_dispatch_cmd(client_conn_t *conn, struct fd_buf *buf, s
 	    /* TODO: this doesn't belong here */
 	    buf->dumpname = conn->filename;
 	    buf->dumpfd = conn->scanfd;
+	    buf->batch = conn->batch;
 	    logg("$Receive thread: INSTREAM: %s fd %u\n", buf->dumpname, buf->dumpfd);
 	}
+	if (conn->mode == MODE_SHMRING)
+	    buf->ring = conn->ring;
 	if (conn->mode != MODE_COMMAND) {
 	    logg("$Breaking command loop, mode is no longer MODE_COMMAND\n");
 	    break;
 	}
-	conn->id++;
+	if (cmdtype != COMMAND_PRIORITY)
+	    conn->id++;
     }
     *ppos = pos;
     buf->mode = conn->mode;
+    buf->priority = conn->priority;
+    buf->deadline = conn->deadline;
     buf->id = conn->id;
     buf->group = conn->group;
     buf->quota = conn->quota;
@@ -627,9 +1017,113 @@ static const char* parse_dispatch_cmd(client_conn_t *conn, struct fd_buf *buf, s
 }
 
 /* static const unsigned char* parse_dispatch_cmd(client_conn_t *conn, struct fd_buf *buf, size_t *ppos, int *error, const struct optstruct *opts, int readtimeout) */
-static int handle_stream(client_conn_t *conn, struct fd_buf *buf, const struct optstruct *opts, int *error, size_t *ppos, int readtimeout)
+/* The MD5 of in-memory streams is computed while the data arrives and handed
+ * to the scan with cl_fmap_set_md5(), so the worker doesn't start with a full
+ * pass over the buffer for the cache lookup */
+static int stream_hash(struct fd_buf *buf, const char *data, size_t len)
+{
+    if (!buf->dumphash && !(buf->dumphash = cl_hash_init("md5")))
+	return -1;
+    return cl_update_hash(buf->dumphash, (void *)data, len) ? -1 : 0;
+}
+
+static void stream_hash_drop(struct fd_buf *buf)
+{
+    if (buf->dumphash) {
+	cl_hash_destroy(buf->dumphash);
+	buf->dumphash = NULL;
+    }
+}
+
+/* Append INSTREAM data to the memory buffer, moving everything to a
+ * temporary file once the stream grows past StreamMaxMemSize */
+static int stream_write(struct fd_buf *buf, const struct optstruct *opts, const char *data, size_t len)
+{
+    if (buf->dumpfd == -1) {
+	size_t need = buf->dumpmem_len + len, limit;
+
+	if (!len)
+	    return 0;
+	if (need <= buf->dumpmem_size) {
+	    memcpy(buf->dumpmem + buf->dumpmem_len, data, len);
+	    buf->dumpmem_len = need;
+	    return stream_hash(buf, data, len);
+	}
+	limit = optget(opts, "StreamMaxMemSize")->numarg;
+	if (need <= limit) {
+	    if (!buf->dumpmem && !(buf->dumpmem = streambuf_get(&buf->dumpmem_size))) {
+		logg("!INSTREAM: Can't allocate memory for stream data\n");
+		return -1;
+	    }
+	    if (need > buf->dumpmem_size) {
+		size_t size = buf->dumpmem_size;
+		char *mem;
+
+		while (size < need)
+		    size *= 2;
+		if (size > limit)
+		    size = limit;
+		if (!(mem = realloc(buf->dumpmem, size))) {
+		    logg("!INSTREAM: Can't allocate memory for stream data\n");
+		    return -1;
+		}
+		buf->dumpmem = mem;
+		buf->dumpmem_size = size;
+	    }
+	    memcpy(buf->dumpmem + buf->dumpmem_len, data, len);
+	    buf->dumpmem_len = need;
+	    return stream_hash(buf, data, len);
+	}
+	logg("$INSTREAM: %lu bytes exceed StreamMaxMemSize, spilling to disk\n", (unsigned long)need);
+	stream_hash_drop(buf);
+	if (cli_gentempfd(optget(opts, "TemporaryDirectory")->strarg, &buf->dumpname, &buf->dumpfd) != CL_SUCCESS)
+	    return -1;
+	if (buf->dumpmem_len && cli_writen(buf->dumpfd, buf->dumpmem, buf->dumpmem_len) < 0)
+	    return -1;
+	streambuf_put(buf->dumpmem, buf->dumpmem_size);
+	buf->dumpmem = NULL;
+	buf->dumpmem_len = buf->dumpmem_size = 0;
+    }
+    return cli_writen(buf->dumpfd, data, len) < 0 ? -1 : 0;
+}
+
+/* hand the data collected for the current stream over to conn */
+static void stream_take(client_conn_t *conn, struct fd_buf *buf)
+{
+    conn->scanfd = buf->dumpfd;
+    conn->filename = buf->dumpname;
+    conn->scanmem = buf->dumpmem;
+    conn->scanmem_len = buf->dumpmem_len;
+    conn->scanmem_size = buf->dumpmem_size;
+    conn->have_scanmd5 = 0;
+    if (buf->dumphash) {
+	conn->have_scanmd5 = !cl_finish_hash(buf->dumphash, conn->scanmd5);
+	buf->dumphash = NULL;
+    }
+    conn->term = buf->term;
+    buf->dumpfd = -1;
+    buf->dumpname = NULL;
+    buf->dumpmem = NULL;
+    buf->dumpmem_len = buf->dumpmem_size = 0;
+}
+
+static int stream_dispatch(client_conn_t *conn, const struct optstruct *opts)
 {
     int rc;
+
+    if ((rc = execute_or_dispatch_command(conn, COMMAND_INSTREAMSCAN, NULL)) < 0) {
+	logg("!Command dispatch failed\n");
+	if(rc == -1 && optget(opts, "ExitOnOOM")->enabled) {
+	    pthread_mutex_lock(&exit_mutex);
+	    progexit = 1;
+	    pthread_mutex_unlock(&exit_mutex);
+	}
+    }
+    return rc;
+}
+
+static int handle_stream(client_conn_t *conn, struct fd_buf *buf, const struct optstruct *opts, int *error, size_t *ppos, int readtimeout)
+{
     size_t pos = *ppos;
     size_t cmdlen;
     
@@ -647,22 +1141,22 @@ static int handle_stream(client_conn_t *conn, struct fd_buf *buf, const struct o
 		buf->chunksize = ntohl(cs);
 		logg("$Got chunksize: %u\n", buf->chunksize);
 		if (!buf->chunksize) {
-		    /* chunksize 0 marks end of stream */
-		    conn->scanfd = buf->dumpfd;
-		    conn->term = buf->term;
-		    buf->dumpfd = -1;
+		    /* chunksize 0 marks end of stream, or end of batch */
+		    if (buf->batch) {
+			buf->batch = 0;
+			buf->mode = MODE_COMMAND;
+			logg("$Batch complete\n");
+			memmove (buf->buffer, &buf->buffer[pos], buf->off - pos);
+			buf->off -= pos;
+			*ppos = 0;
+			return 0;
+		    }
+		    stream_take(conn, buf);
 		    buf->mode = buf->group ? MODE_COMMAND : MODE_WAITREPLY;
 		    if (buf->mode == MODE_WAITREPLY)
 			buf->fd = -1;
 		    logg("$Chunks complete\n");
-		    buf->dumpname = NULL;
-		    if ((rc = execute_or_dispatch_command(conn, COMMAND_INSTREAMSCAN, NULL)) < 0) {
-			logg("!Command dispatch failed\n");
-			if(rc == -1 && optget(opts, "ExitOnOOM")->enabled) {
-			    pthread_mutex_lock(&exit_mutex);
-			    progexit = 1;
-			    pthread_mutex_unlock(&exit_mutex);
-			}
+		    if (stream_dispatch(conn, opts) < 0) {
 			*error = 1;
 		    } else {
 			memmove (buf->buffer, &buf->buffer[pos], buf->off - pos);
@@ -672,6 +1166,9 @@ static int handle_stream(client_conn_t *conn, struct fd_buf *buf, const struct o
 			return 0;
                     }
 		}
+		/* the size limit applies to each object of a batch */
+		if (buf->batch)
+		    buf->quota = optget(opts, "StreamMaxLength")->numarg;
 		if (buf->chunksize > buf->quota) {
 		    logg("^INSTREAM: Size limit reached, (requested: %lu, max: %lu)\n",
 			 (unsigned long)buf->chunksize, (unsigned long)buf->quota);
@@ -696,13 +1193,26 @@ static int handle_stream(client_conn_t *conn, struct fd_buf *buf, const struct o
 	else
 	    cmdlen = buf->off - pos;
 	buf->chunksize -= cmdlen;
-	if (cli_writen(buf->dumpfd, buf->buffer + pos, cmdlen) < 0) {
+	if (stream_write(buf, opts, buf->buffer + pos, cmdlen) < 0) {
 	    conn_reply_error(conn, "Error writing to temporary file");
 	    logg("!INSTREAM: Can't write to temporary file.\n");
 	    *error = 1;
 	}
 	logg("$Processed %llu bytes of chunkdata, pos %llu\n", (long long unsigned)cmdlen, (long long unsigned)pos);
 	pos += cmdlen;
+	if (buf->batch && !buf->chunksize && !*error) {
+	    /* BATCHSTREAM: the chunk was a whole object, each object uses
+	     * the next request number */
+	    conn->id = buf->id;
+	    stream_take(conn, buf);
+	    logg("$Batch object %u complete\n", conn->id);
+	    if (stream_dispatch(conn, opts) < 0) {
+		*error = 1;
+		*ppos = pos;
+		return -1;
+	    }
+	    buf->id++;
+	}
 	if (pos == buf->off) {
 	    buf->off = 0;
 	    pos = 0;
@@ -715,35 +1225,390 @@ static int handle_stream(client_conn_t *conn, struct fd_buf *buf, const struct o
     return 0;
 }
 
-int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts)
+/* Reads and dispatches the commands of the connections which got some data
+ * in the last fds_poll_recv(); called with the buf_mutex held */
+static void recv_process(struct fd_data *fds, size_t *rr_last, int new_sd, int syncfd, unsigned int options, const struct optstruct *opts, threadpool_t *thr_pool, struct cl_engine *engine, int readtimeout)
 {
-	int max_threads, max_queue, readtimeout, ret = 0;
-	unsigned int options = 0;
-	char timestr[32];
-#ifndef	_WIN32
-	struct sigaction sigact;
-	sigset_t sigset;
-	struct rlimit rlim;
-#endif
-	mode_t old_umask;
-	const struct optstruct *opt;
-	char buff[BUFFSIZE + 1];
-	pid_t mainpid;
-	int idletimeout;
-	unsigned long long val;
-	size_t i, j, rr_last = 0;
-	pthread_t accept_th;
-	pthread_mutex_t fds_mutex = PTHREAD_MUTEX_INITIALIZER;
-	pthread_mutex_t recvfds_mutex = PTHREAD_MUTEX_INITIALIZER;
-	struct acceptdata acceptdata = ACCEPTDATA_INIT(&fds_mutex, &recvfds_mutex);
-	struct fd_data *fds = &acceptdata.recv_fds;
-	time_t start_time, current_time;
-	unsigned int selfchk;
-	threadpool_t *thr_pool;
+    char buff[BUFFSIZE + 1];
+    size_t i = 0, j;
 
-#if defined(FANOTIFY) || defined(CLAMAUTH)
-	pthread_t fan_pid;
-	pthread_attr_t fan_attr;
+    if(fds->nfds) i = (*rr_last + 1) % fds->nfds;
+    for (j = 0;  j < fds->nfds && new_sd >= 0; j++, i = (i+1) % fds->nfds) {
+	size_t pos = 0;
+	int error = 0;
+	struct fd_buf *buf = &fds->buf[i];
+	if (!buf->got_newdata)
+	    continue;
+
+#ifndef _WIN32
+	if (buf->fd == syncfd) {
+	    /* dummy sync pipe, just to wake us */
+	    if (read(buf->fd, buff, sizeof(buff)) < 0) {
+		logg("^Syncpipe read failed\n");
+	    }
+	    continue;
+	}
+#endif
+	if (buf->got_newdata == -1) {
+	    if (buf->mode == MODE_WAITREPLY) {
+		logg("$mode WAIT_REPLY -> closed\n");
+		buf->fd = -1;
+		thrmgr_group_terminate(buf->group);
+		thrmgr_group_finished(buf->group, EXIT_ERROR);
+		continue;
+	    } else {
+		logg("$client read error or EOF on read\n");
+		error = 1;
+	    }
+	}
+
+	if (buf->fd != -1 && buf->got_newdata == -2) {
+	    logg("$Client read timed out\n");
+	    mdprintf(buf->fd, "COMMAND READ TIMED OUT\n");
+	    error = 1;
+	}
+
+	*rr_last = i;
+	if (buf->mode == MODE_WAITANCILL) {
+	    buf->mode = MODE_COMMAND;
+	    logg("$mode -> MODE_COMMAND\n");
+	}
+	while (!error && buf->fd != -1 && buf->buffer && pos < buf->off &&
+	       buf->mode != MODE_WAITANCILL) {
+	    client_conn_t conn;
+	    const char *cmd = NULL;
+	    int rc;
+	    /* New data available to read on socket. */
+
+	    memset(&conn, 0, sizeof(conn));
+	    conn.scanfd = buf->recvfd;
+	    buf->recvfd = -1;
+	    conn.sd = buf->fd;
+	    conn.options = options;
+	    conn.opts = opts;
+	    conn.thrpool = thr_pool;
+	    conn.engine = engine;
+	    conn.group = buf->group;
+	    conn.id = buf->id;
+	    conn.quota = buf->quota;
+	    conn.filename = buf->dumpname;
+	    conn.mode = buf->mode;
+	    conn.term = buf->term;
+	    conn.priority = buf->priority;
+	    conn.deadline = buf->deadline;
+	    conn.ring = buf->ring;
+
+	    /* Parse & dispatch command */
+	    cmd = parse_dispatch_cmd(&conn, buf, &pos, &error, opts, readtimeout);
+
+	    if (conn.mode == MODE_COMMAND && !cmd)
+		break;
+	    if (!error) {
+		if (buf->mode == MODE_WAITREPLY && buf->off) {
+		    /* Client is not supposed to send anything more */
+		    logg("^Client sent garbage after last command: %lu bytes\n", (unsigned long)buf->off);
+		    buf->buffer[buf->off] = '\0';
+		    logg("$Garbage: %s\n", buf->buffer);
+		    error = 1;
+		} else if (buf->mode == MODE_STREAM) {
+		    rc = handle_stream(&conn, buf, opts, &error, &pos, readtimeout);
+		    if (rc == -1)
+			break;
+		    else
+			continue;
+		} else if (buf->mode == MODE_SHMRING) {
+		    /* doorbell, the bytes themselves carry nothing */
+		    buf->off = 0;
+		    time(&buf->timeout_at);
+		    buf->timeout_at += readtimeout;
+		    if (shmring_poll(&conn) < 0)
+			error = 1;
+		    break;
+		}
+	    }
+	    if (error && error != CL_ETIMEOUT) {
+		conn_reply_error(&conn, "Error processing command.");
+	    }
+	}
+	if (error) {
+	    if (buf->dumpfd != -1) {
+		close(buf->dumpfd);
+		if (buf->dumpname) {
+		    cli_unlink(buf->dumpname);
+		    free(buf->dumpname);
+		}
+		buf->dumpfd = -1;
+	    }
+	    streambuf_put(buf->dumpmem, buf->dumpmem_size);
+	    buf->dumpmem = NULL;
+	    buf->dumpmem_len = buf->dumpmem_size = 0;
+	    stream_hash_drop(buf);
+	    shmring_release(buf->ring);
+	    buf->ring = NULL;
+	    thrmgr_group_terminate(buf->group);
+	    if (thrmgr_group_finished(buf->group, EXIT_ERROR)) {
+		if (buf->fd < 0) {
+		    logg("$Skipping shutdown of bad socket after error (FD %d)\n", buf->fd);
+		}
+		else {
+		    logg("$Shutting down socket after error (FD %d)\n", buf->fd);
+		    shutdown(buf->fd, 2);
+		    closesocket(buf->fd);
+		}
+	    } else
+		logg("$Socket not shut down due to active tasks\n");
+	    buf->fd = -1;
+	}
+    }
+}
+
+/* Shutdown: closes the connections without a running scan */
+static void recv_shutdown(struct fd_data *fds)
+{
+    size_t i;
+
+    pthread_mutex_lock(fds->buf_mutex);
+    if (sd_listen_fds(0) == 0)
+    {
+        /* only close the sockets, when not using systemd socket activation */
+        for (i=0;i < fds->nfds; i++)
+        {
+            if (fds->buf[i].fd == -1)
+                continue;
+            thrmgr_group_terminate(fds->buf[i].group);
+            if (thrmgr_group_finished(fds->buf[i].group, EXIT_ERROR))
+            {
+                logg("$Shutdown closed fd %d\n", fds->buf[i].fd);
+                shutdown(fds->buf[i].fd, 2);
+                closesocket(fds->buf[i].fd);
+                fds->buf[i].fd = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(fds->buf_mutex);
+}
+
+/*
+ * AcceptThreads: each extra acceptor has listening sockets of its own,
+ * bound to the TCP addresses of the main ones with SO_REUSEPORT so the
+ * kernel spreads the connections over them. Like the main loop it accepts
+ * in one thread and reads and parses the commands in another, dispatching
+ * into the same thread pool. It holds a reference to the engine, replaced
+ * by acceptor_setengine() on reload; NULL while a reload has none.
+ */
+struct acceptor {
+    struct acceptdata acceptdata;
+    pthread_mutex_t fds_mutex, recvfds_mutex;
+    pthread_t accept_th, recv_th;
+    pthread_mutex_t engine_mutex;
+    pthread_cond_t engine_cond;
+    struct cl_engine *engine;
+    unsigned int options;
+    const struct optstruct *opts;
+    threadpool_t *thr_pool;
+    int readtimeout;
+};
+
+static void acceptor_setengine(struct acceptor *a, struct cl_engine *engine)
+{
+    struct cl_engine *old;
+
+    if (engine && cl_engine_addref(engine)) {
+	logg("!cl_engine_addref() failed\n");
+	engine = NULL;
+    }
+    pthread_mutex_lock(&a->engine_mutex);
+    old = a->engine;
+    a->engine = engine;
+    pthread_cond_signal(&a->engine_cond);
+    pthread_mutex_unlock(&a->engine_mutex);
+    if (old)
+	cl_engine_free(old);
+}
+
+static void *acceptor_recv_th(void *arg)
+{
+    struct acceptor *a = (struct acceptor *)arg;
+    struct fd_data *fds = &a->acceptdata.recv_fds;
+    size_t rr_last = 0;
+
+    for (;;) {
+	int new_sd;
+
+	pthread_mutex_lock(fds->buf_mutex);
+	fds_cleanup(fds);
+	if (fds->nfds <= (unsigned)a->acceptdata.max_queue)
+	    pthread_cond_signal(&a->acceptdata.cond_nfds);
+	new_sd = fds_poll_recv(fds, -1, 1, NULL);
+	if (!fds->nfds) {
+	    logg("!All recv() descriptors gone: fatal\n");
+	    pthread_mutex_lock(&exit_mutex);
+	    progexit = 1;
+	    pthread_mutex_unlock(&exit_mutex);
+	    pthread_mutex_unlock(fds->buf_mutex);
+	    break;
+	}
+	if (new_sd == -1 && errno != EINTR) {
+	    logg("!Failed to poll sockets, fatal\n");
+	    pthread_mutex_lock(&exit_mutex);
+	    progexit = 1;
+	    pthread_mutex_unlock(&exit_mutex);
+	}
+
+	/* the commands wait for the engine of a reload */
+	pthread_mutex_lock(&a->engine_mutex);
+	while (!a->engine) {
+	    pthread_mutex_lock(&exit_mutex);
+	    if (progexit) {
+		pthread_mutex_unlock(&exit_mutex);
+		break;
+	    }
+	    pthread_mutex_unlock(&exit_mutex);
+	    pthread_cond_wait(&a->engine_cond, &a->engine_mutex);
+	}
+	if (a->engine)
+	    recv_process(fds, &rr_last, new_sd, a->acceptdata.syncpipe_wake_recv[0], a->options, a->opts, a->thr_pool, a->engine, a->readtimeout);
+	pthread_mutex_unlock(&a->engine_mutex);
+	pthread_mutex_unlock(fds->buf_mutex);
+
+	pthread_mutex_lock(&exit_mutex);
+	if (progexit) {
+	    pthread_mutex_unlock(&exit_mutex);
+	    recv_shutdown(fds);
+	    break;
+	}
+	pthread_mutex_unlock(&exit_mutex);
+    }
+    /* the main loop may not know yet */
+    if (syncpipe_wake_recv_w != -1)
+	if (write(syncpipe_wake_recv_w, "", 1) != 1)
+	    logg("$Failed to write to syncpipe\n");
+    return NULL;
+}
+
+static struct acceptor *acceptor_start(int *socketds, unsigned nsockets, struct cl_engine *engine, unsigned int options, const struct optstruct *opts, threadpool_t *thr_pool, int max_queue, int readtimeout)
+{
+    struct acceptor *a;
+    unsigned int i;
+
+    if (!(a = calloc(1, sizeof(*a))))
+	return NULL;
+    {
+	struct acceptdata init = ACCEPTDATA_INIT(&a->fds_mutex, &a->recvfds_mutex);
+	a->acceptdata = init;
+    }
+    pthread_mutex_init(&a->fds_mutex, NULL);
+    pthread_mutex_init(&a->recvfds_mutex, NULL);
+    pthread_mutex_init(&a->engine_mutex, NULL);
+    pthread_cond_init(&a->engine_cond, NULL);
+    a->acceptdata.max_queue = max_queue;
+    a->acceptdata.commandtimeout = optget(opts, "CommandReadTimeout")->numarg;
+    a->options = options;
+    a->opts = opts;
+    a->thr_pool = thr_pool;
+    a->readtimeout = readtimeout;
+
+    fds_init_events(&a->acceptdata.fds);
+    fds_init_events(&a->acceptdata.recv_fds);
+    for (i = 0; i < nsockets; i++)
+	if (fds_add(&a->acceptdata.fds, socketds[i], 1, 0) == -1)
+	    goto fail;
+    if (pipe(a->acceptdata.syncpipe_wake_recv) == -1)
+	goto fail;
+    if (pipe(a->acceptdata.syncpipe_wake_accept) == -1) {
+	close(a->acceptdata.syncpipe_wake_recv[0]);
+	close(a->acceptdata.syncpipe_wake_recv[1]);
+	goto fail;
+    }
+    if (fds_add(&a->acceptdata.recv_fds, a->acceptdata.syncpipe_wake_recv[0], 1, 0) == -1 ||
+	fds_add(&a->acceptdata.fds, a->acceptdata.syncpipe_wake_accept[0], 1, 0) == -1)
+	goto fail_pipes;
+    acceptor_setengine(a, engine);
+    if (pthread_create(&a->recv_th, NULL, acceptor_recv_th, a))
+	goto fail_engine;
+    if (pthread_create(&a->accept_th, NULL, acceptloop_th, &a->acceptdata)) {
+	pthread_mutex_lock(&exit_mutex);
+	progexit = 1;
+	pthread_mutex_unlock(&exit_mutex);
+	if (write(a->acceptdata.syncpipe_wake_recv[1], "", 1) < 0)
+	    logg("^Write to syncpipe failed\n");
+	pthread_join(a->recv_th, NULL);
+	goto fail_engine;
+    }
+    return a;
+
+fail_engine:
+    acceptor_setengine(a, NULL);
+fail_pipes:
+    close(a->acceptdata.syncpipe_wake_recv[1]);
+    close(a->acceptdata.syncpipe_wake_accept[1]);
+fail:
+    fds_free(&a->acceptdata.fds);
+    fds_free(&a->acceptdata.recv_fds);
+    pthread_cond_destroy(&a->engine_cond);
+    pthread_mutex_destroy(&a->engine_mutex);
+    pthread_mutex_destroy(&a->recvfds_mutex);
+    pthread_mutex_destroy(&a->fds_mutex);
+    free(a);
+    return NULL;
+}
+
+/* progexit is set */
+static void acceptor_stop(struct acceptor *a)
+{
+    if (write(a->acceptdata.syncpipe_wake_accept[1], "", 1) < 0)
+	logg("^Write to syncpipe failed\n");
+    pthread_mutex_lock(&a->engine_mutex);
+    pthread_cond_signal(&a->engine_cond);
+    pthread_mutex_unlock(&a->engine_mutex);
+    pthread_mutex_lock(&a->recvfds_mutex);
+    pthread_cond_signal(&a->acceptdata.cond_nfds);
+    pthread_mutex_unlock(&a->recvfds_mutex);
+    /* the accept thread wakes the other one as it exits */
+    pthread_join(a->accept_th, NULL);
+    pthread_join(a->recv_th, NULL);
+    acceptor_setengine(a, NULL);
+    fds_free(&a->acceptdata.recv_fds);
+    pthread_cond_destroy(&a->acceptdata.cond_nfds);
+    close(a->acceptdata.syncpipe_wake_accept[1]);
+    close(a->acceptdata.syncpipe_wake_recv[1]);
+    pthread_cond_destroy(&a->engine_cond);
+    pthread_mutex_destroy(&a->engine_mutex);
+    pthread_mutex_destroy(&a->recvfds_mutex);
+    free(a);
+}
+
+int recvloop_th(int *socketds, unsigned nsockets, int *acceptds, unsigned nacceptds, struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts)
+{
+	int max_threads, max_queue, readtimeout, ret = 0;
+	unsigned int options = 0;
+	char timestr[32];
+#ifndef	_WIN32
+	struct sigaction sigact;
+	sigset_t sigset;
+	struct rlimit rlim;
+#endif
+	mode_t old_umask;
+	const struct optstruct *opt;
+	pid_t mainpid;
+	int idletimeout;
+	unsigned long long val;
+	size_t i, rr_last = 0;
+	pthread_t accept_th;
+	struct acceptor **acceptors = NULL;
+	unsigned int nacceptors = 0;
+	pthread_mutex_t fds_mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_t recvfds_mutex = PTHREAD_MUTEX_INITIALIZER;
+	struct acceptdata acceptdata = ACCEPTDATA_INIT(&fds_mutex, &recvfds_mutex);
+	struct fd_data *fds = &acceptdata.recv_fds;
+	time_t start_time, current_time;
+	unsigned int selfchk;
+	threadpool_t *thr_pool;
+	int startup = 0;
+
+#if defined(FANOTIFY) || defined(CLAMAUTH)
+	pthread_t fan_pid;
+	pthread_attr_t fan_attr;
 	struct thrarg *tharg = NULL; /* shut up gcc */
 #endif
 
@@ -920,6 +1785,117 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
     val = cl_engine_get_num(engine, CL_ENGINE_PCRE_MAX_FILESIZE, NULL);
     logg("Limits: PCREMaxFileSize limit set to %llu.\n", val);
 
+    if((opt = optget(opts, "ParallelScanThreads"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_PARALLEL_SCAN, opt->numarg))) {
+            logg("!cli_engine_set_num(ParallelScanThreads) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_PARALLEL_SCAN, NULL);
+    if(val > 1)
+        logg("Parallel scanning of large files enabled (%llu threads).\n", val);
+
+    if((opt = optget(opts, "ExtractMaxMemSize"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_EXTRACT_MEM, opt->numarg))) {
+            logg("!cli_engine_set_num(ExtractMaxMemSize) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_EXTRACT_MEM, NULL);
+    logg("Limits: ExtractMaxMemSize limit set to %llu.\n", val);
+
+    if((opt = optget(opts, "ArchiveScanThreads"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_ARCHIVE_THREADS, opt->numarg))) {
+            logg("!cli_engine_set_num(ArchiveScanThreads) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_ARCHIVE_THREADS, NULL);
+    if(val)
+        logg("Parallel scanning of archive members enabled (%llu threads).\n", val);
+
+    if((opt = optget(opts, "DecompressThreads"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_DECOMPRESS_THREADS, opt->numarg))) {
+            logg("!cli_engine_set_num(DecompressThreads) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_DECOMPRESS_THREADS, NULL);
+    if(val)
+        logg("Parallel decompression enabled (%llu threads).\n", val);
+
+    if(optget(opts, "ArchiveRiskOrder")->enabled) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_ARCHIVE_ORDER, 1))) {
+            logg("!cli_engine_set_num(ArchiveRiskOrder) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+        logg("Risk ordered archive scanning enabled.\n");
+    }
+
+    if(optget(opts, "FusedPatternScan")->enabled) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_FUSED_SCAN, 1))) {
+            logg("!cli_engine_set_num(FusedPatternScan) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+        logg("Fused pattern scanning enabled.\n");
+    }
+
+    if((opt = optget(opts, "SignatureProfileRate"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_SIGPROF_RATE, opt->numarg))) {
+            logg("!cli_engine_set_num(SignatureProfileRate) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+        if(opt->numarg)
+            logg("Signature profiling enabled (1 in %lld evaluations).\n", opt->numarg);
+    }
+
+    if((opt = optget(opts, "MaxScanTime"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_TIME_LIMIT, opt->numarg))) {
+            logg("!cli_engine_set_num(MaxScanTime) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_TIME_LIMIT, NULL);
+    logg("Limits: MaxScanTime limit set to %llu.\n", val);
+
+    if((opt = optget(opts, "MaxScanCPUTime"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_CPU_LIMIT, opt->numarg))) {
+            logg("!cli_engine_set_num(MaxScanCPUTime) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_CPU_LIMIT, NULL);
+    logg("Limits: MaxScanCPUTime limit set to %llu.\n", val);
+
+    if((opt = optget(opts, "MaxInflatedSize"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_MAX_INFLATED, opt->numarg))) {
+            logg("!cli_engine_set_num(MaxInflatedSize) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_MAX_INFLATED, NULL);
+    logg("Limits: MaxInflatedSize limit set to %llu.\n", val);
+
+    if((opt = optget(opts, "MaxDecompressMemory"))->active) {
+        if((ret = cl_engine_set_num(engine, CL_ENGINE_MAX_DECOMPRESS_MEM, opt->numarg))) {
+            logg("!cli_engine_set_num(MaxDecompressMemory) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 1;
+        }
+    }
+    val = cl_engine_get_num(engine, CL_ENGINE_MAX_DECOMPRESS_MEM, NULL);
+    logg("Limits: MaxDecompressMemory limit set to %llu.\n", val);
+
     if(optget(opts, "ScanArchive")->enabled) {
 	logg("Archive support enabled.\n");
 	options |= CL_SCAN_ARCHIVE;
@@ -1086,7 +2062,10 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 #endif
 
     selfchk = optget(opts, "SelfCheck")->numarg;
-    if(!selfchk) {
+    if(prefork_slot >= 0) {
+	/* the main process checks the database */
+	selfchk = 0;
+    } else if(!selfchk) {
 	logg("Self checking disabled.\n");
     } else {
 	logg("Self checking every %u seconds.\n", selfchk);
@@ -1094,7 +2073,7 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 
     /* save the PID */
     mainpid = getpid();
-    if((opt = optget(opts, "PidFile"))->enabled) {
+    if((opt = optget(opts, "PidFile"))->enabled && prefork_slot < 0) {
 	    FILE *fd;
 	old_umask = umask(0002);
 	if((fd = fopen(opt->strarg, "w")) == NULL) {
@@ -1205,7 +2184,7 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
     logg("*MaxQueue set to: %d\n", max_queue);
     acceptdata.max_queue = max_queue;
 
-    if(optget(opts, "ScanOnAccess")->enabled)
+    if(optget(opts, "ScanOnAccess")->enabled && prefork_slot <= 0)
 
 #if defined(FANOTIFY) || defined(CLAMAUTH)
     {
@@ -1215,8 +2194,11 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 	    if(!(tharg = (struct thrarg *) malloc(sizeof(struct thrarg)))) break;
 	    tharg->opts = opts;
 	    tharg->engine = engine;
+	    tharg->engine_gen = 0;
 	    tharg->options = options;
+	    pthread_mutex_init(&tharg->engine_mutex, NULL);
 	    if(!pthread_create(&fan_pid, &fan_attr, onas_fan_th, tharg)) break;
+	    pthread_mutex_destroy(&tharg->engine_mutex);
 	    free(tharg);
 	    tharg=NULL;
 	} while(0);
@@ -1265,6 +2247,10 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 
     idletimeout = optget(opts, "IdleTimeout")->numarg;
 
+    /* falls back to poll() if it fails */
+    fds_init_events(&acceptdata.fds);
+    fds_init_events(fds);
+
     for (i=0;i < nsockets;i++)
 	if (fds_add(&acceptdata.fds, socketds[i], 1, 0) == -1) {
 	    logg("!fds_add failed\n");
@@ -1290,18 +2276,73 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
     }
 #endif
 
+    if(optget(opts, "WatchDatabaseDirectory")->enabled && prefork_slot < 0) {
+#ifdef DBWATCH
+	if(!dbwatch_start(optget(opts, "DatabaseDirectory")->strarg, optget(opts, "WatchDatabaseDelay")->numarg)) {
+	    logg("Watching the database directory, self checking disabled.\n");
+	    selfchk = 0;
+	}
+#else
+	logg("^WatchDatabaseDirectory is not supported on this system\n");
+#endif
+    }
+
     if ((thr_pool = thrmgr_new(max_threads, idletimeout, max_queue, scanner_thread)) == NULL) {
 	logg("!thrmgr_new failed\n");
 	exit(-1);
     }
+    if((opt = optget(opts, "WorkerCPUs"))->enabled) {
+	if(thrmgr_setaffinity(thr_pool, opt->strarg, !strcmp(optget(opts, "WorkerCPUPinning")->strarg, "thread")))
+	    exit(-1);
+	logg("Worker threads on CPUs %s (%s).\n", opt->strarg, optget(opts, "WorkerCPUPinning")->strarg);
+    }
+    if(optget(opts, "AdaptiveThreads")->enabled) {
+	thrmgr_setadaptive(thr_pool, optget(opts, "MinThreads")->numarg);
+	logg("Adaptive thread pool: %d to %d threads.\n", thr_pool->thr_min, thr_pool->thr_max);
+    }
+    if((opt = optget(opts, "ProfileSampleInterval"))->numarg > 0) {
+	if(thrmgr_setsampling(thr_pool, opt->numarg))
+	    exit(-1);
+	logg("Sampling the scans every %lld ms.\n", opt->numarg);
+    }
 
     if (pthread_create(&accept_th, NULL, acceptloop_th, &acceptdata)) {
 	logg("!pthread_create failed\n");
 	exit(-1);
     }
 
+    /* clamd.c left the engine empty, the acceptors start with the loaded one */
+    if (prefork_slot < 0 && optget(opts, "BackgroundStartupLoad")->enabled) {
+#if defined(FANOTIFY) || defined(CLAMAUTH)
+	if(optget(opts, "ScanOnAccess")->enabled && tharg)
+	    tharg_setengine(tharg, NULL);
+#endif
+	if ((startup = startup_load(&engine, dboptions, opts, fds, acceptdata.commandtimeout)) > 0)
+	    ret = 1;
+#if defined(FANOTIFY) || defined(CLAMAUTH)
+	if(!startup && optget(opts, "ScanOnAccess")->enabled && tharg)
+	    tharg_setengine(tharg, engine);
+#endif
+    }
+
+    if (!startup && nacceptds && (opt = optget(opts, "AcceptThreads"))->numarg > 1) {
+	unsigned int per = nacceptds / (opt->numarg - 1);
+
+	if (!(acceptors = calloc(opt->numarg - 1, sizeof(*acceptors)))) {
+	    logg("!Can't allocate memory for the acceptors\n");
+	    exit(-1);
+	}
+	for (nacceptors = 0; nacceptors < opt->numarg - 1; nacceptors++) {
+	    if (!(acceptors[nacceptors] = acceptor_start(acceptds + nacceptors * per, per, engine, options, opts, thr_pool, max_queue, readtimeout))) {
+		logg("^Can't start acceptor %u, continuing with %u\n", nacceptors + 2, nacceptors + 1);
+		break;
+	    }
+	}
+	logg("Accepting the TCP connections in %u threads.\n", nacceptors + 1);
+    }
+
     time(&start_time);
-    for(;;) {
+    while (!startup) {
 	int new_sd;
 
 	/* Block waiting for connection on any of the sockets */
@@ -1332,142 +2373,14 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 	}
 
 
-	if(fds->nfds) i = (rr_last + 1) % fds->nfds;
-	for (j = 0;  j < fds->nfds && new_sd >= 0; j++, i = (i+1) % fds->nfds) {
-	    size_t pos = 0;
-	    int error = 0;
-	    struct fd_buf *buf = &fds->buf[i];
-	    if (!buf->got_newdata)
-		continue;
-
-#ifndef _WIN32
-	    if (buf->fd == acceptdata.syncpipe_wake_recv[0]) {
-		/* dummy sync pipe, just to wake us */
-		if (read(buf->fd, buff, sizeof(buff)) < 0) {
-		    logg("^Syncpipe read failed\n");
-		}
-		continue;
-	    }
-#endif
-	    if (buf->got_newdata == -1) {
-		if (buf->mode == MODE_WAITREPLY) {
-		    logg("$mode WAIT_REPLY -> closed\n");
-		    buf->fd = -1;
-		    thrmgr_group_terminate(buf->group);
-		    thrmgr_group_finished(buf->group, EXIT_ERROR);
-		    continue;
-		} else {
-		    logg("$client read error or EOF on read\n");
-		    error = 1;
-		}
-	    }
-
-	    if (buf->fd != -1 && buf->got_newdata == -2) {
-		logg("$Client read timed out\n");
-		mdprintf(buf->fd, "COMMAND READ TIMED OUT\n");
-		error = 1;
-	    }
-
-	    rr_last = i;
-	    if (buf->mode == MODE_WAITANCILL) {
-		buf->mode = MODE_COMMAND;
-		logg("$mode -> MODE_COMMAND\n");
-	    }
-	    while (!error && buf->fd != -1 && buf->buffer && pos < buf->off &&
-		   buf->mode != MODE_WAITANCILL) {
-		client_conn_t conn;
-		const char *cmd = NULL;
-		int rc;
-		/* New data available to read on socket. */
-
-		memset(&conn, 0, sizeof(conn));
-		conn.scanfd = buf->recvfd;
-		buf->recvfd = -1;
-		conn.sd = buf->fd;
-		conn.options = options;
-		conn.opts = opts;
-		conn.thrpool = thr_pool;
-		conn.engine = engine;
-		conn.group = buf->group;
-		conn.id = buf->id;
-		conn.quota = buf->quota;
-		conn.filename = buf->dumpname;
-		conn.mode = buf->mode;
-		conn.term = buf->term;
-
-		/* Parse & dispatch command */
-		cmd = parse_dispatch_cmd(&conn, buf, &pos, &error, opts, readtimeout);
-
-		if (conn.mode == MODE_COMMAND && !cmd)
-		    break;
-		if (!error) {
-		    if (buf->mode == MODE_WAITREPLY && buf->off) {
-			/* Client is not supposed to send anything more */
-			logg("^Client sent garbage after last command: %lu bytes\n", (unsigned long)buf->off);
-			buf->buffer[buf->off] = '\0';
-			logg("$Garbage: %s\n", buf->buffer);
-			error = 1;
-		    } else if (buf->mode == MODE_STREAM) {
-			rc = handle_stream(&conn, buf, opts, &error, &pos, readtimeout);
-			if (rc == -1)
-			    break;
-			else
-			    continue;
-		    }
-		}
-		if (error && error != CL_ETIMEOUT) {
-		    conn_reply_error(&conn, "Error processing command.");
-		}
-	    }
-	    if (error) {
-		if (buf->dumpfd != -1) {
-		    close(buf->dumpfd);
-		    if (buf->dumpname) {
-			cli_unlink(buf->dumpname);
-			free(buf->dumpname);
-		    }
-		    buf->dumpfd = -1;
-		}
-		thrmgr_group_terminate(buf->group);
-		if (thrmgr_group_finished(buf->group, EXIT_ERROR)) {
-		    if (buf->fd < 0) {
-			logg("$Skipping shutdown of bad socket after error (FD %d)\n", buf->fd);
-		    }
-		    else {
-			logg("$Shutting down socket after error (FD %d)\n", buf->fd);
-			shutdown(buf->fd, 2);
-			closesocket(buf->fd);
-		    }
-		} else
-		    logg("$Socket not shut down due to active tasks\n");
-		buf->fd = -1;
-	    }
-	}
+	recv_process(fds, &rr_last, new_sd, acceptdata.syncpipe_wake_recv[0], options, opts, thr_pool, engine, readtimeout);
 	pthread_mutex_unlock(fds->buf_mutex);
 
 	/* handle progexit */
 	pthread_mutex_lock(&exit_mutex);
 	if (progexit) {
 	    pthread_mutex_unlock(&exit_mutex);
-	    pthread_mutex_lock(fds->buf_mutex);
-        if (sd_listen_fds(0) == 0)
-        {
-            /* only close the sockets, when not using systemd socket activation */
-            for (i=0;i < fds->nfds; i++)
-            {
-                if (fds->buf[i].fd == -1)
-                    continue;
-                thrmgr_group_terminate(fds->buf[i].group);
-                if (thrmgr_group_finished(fds->buf[i].group, EXIT_ERROR))
-                {
-                    logg("$Shutdown closed fd %d\n", fds->buf[i].fd);
-                    shutdown(fds->buf[i].fd, 2);
-                    closesocket(fds->buf[i].fd);
-                    fds->buf[i].fd = -1;
-                }
-            }
-	    }
-	    pthread_mutex_unlock(fds->buf_mutex);
+	    recv_shutdown(fds);
 	    break;
 	}
 	pthread_mutex_unlock(&exit_mutex);
@@ -1482,7 +2395,7 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 	}
 
 	/* SelfCheck */
-	if(selfchk) {
+	if(selfchk && reload_stage == RELOAD_STAGE_IDLE) {
 	    time(&current_time);
 	    if((current_time - start_time) >= (time_t)selfchk) {
 		if(reload_db(engine, dboptions, opts, TRUE, &ret)) {
@@ -1494,11 +2407,91 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 	    }
 	}
 
+#ifdef DBWATCH
+	/* Database watch, the changes seen during a reload are checked after it */
+	pthread_mutex_lock(&reload_mutex);
+	if(dbwatch_changed && reload_stage == RELOAD_STAGE_IDLE) {
+	    dbwatch_changed = 0;
+	    pthread_mutex_unlock(&reload_mutex);
+	    if(reload_db(engine, dboptions, opts, TRUE, &ret)) {
+		pthread_mutex_lock(&reload_mutex);
+		reload = 1;
+		pthread_mutex_unlock(&reload_mutex);
+	    }
+	} else {
+	    pthread_mutex_unlock(&reload_mutex);
+	}
+#endif
+
+	/* Publish the engine loaded in the background */
+	pthread_mutex_lock(&reload_mutex);
+	if(reload_stage == RELOAD_STAGE_DONE) {
+	    struct cl_engine *new_engine;
+
+	    pthread_mutex_unlock(&reload_mutex);
+	    new_engine = reload_finish();
+	    if(!new_engine) {
+		logg("!Database reload failed, keeping the old database\n");
+	    } else {
+#if defined(FANOTIFY) || defined(CLAMAUTH)
+		if(optget(opts, "ScanOnAccess")->enabled && tharg)
+		    tharg_setengine(tharg, new_engine);
+#endif
+		/* the jobs already dispatched keep their reference to the
+		 * old engine, it's released when the last one finishes */
+		cl_engine_free(engine);
+		engine = new_engine;
+		thrmgr_setactiveengine(engine);
+		for (i = 0; i < nacceptors; i++)
+		    acceptor_setengine(acceptors[i], engine);
+
+		pthread_mutex_lock(&reload_mutex);
+		time(&reloaded_time);
+		pthread_mutex_unlock(&reload_mutex);
+	    }
+	    time(&start_time);
+	} else {
+	    pthread_mutex_unlock(&reload_mutex);
+	}
+
 	/* DB reload */
 	pthread_mutex_lock(&reload_mutex);
-	if(reload) {
+	if(reload && reload_stage == RELOAD_STAGE_IDLE) {
 	    pthread_mutex_unlock(&reload_mutex);
 
+	    if(prefork_slot >= 0) {
+		/* the main process reloads and replaces the workers */
+		if(kill(getppid(), SIGUSR2) == -1)
+		    logg("!Can't ask the main process for a reload: %s\n", strerror(errno));
+		pthread_mutex_lock(&reload_mutex);
+		reload = 0;
+		pthread_mutex_unlock(&reload_mutex);
+		continue;
+	    }
+
+	    if(!optget(opts, "LowMemoryReload")->enabled &&
+	       optget(opts, "ConcurrentDatabaseReload")->enabled) {
+		pthread_mutex_lock(&reload_mutex);
+		if(reload_start(engine, dboptions, opts) == 0)
+		    reload = 0;
+		pthread_mutex_unlock(&reload_mutex);
+		continue;
+	    }
+
+	    if(optget(opts, "LowMemoryReload")->enabled) {
+		/* the queued and running jobs hold a reference to the old
+		 * engine, let them release it before the new one is built */
+		logg("Waiting for the running scans before reloading the database\n");
+		if(thrmgr_wait_idle(thr_pool, optget(opts, "LowMemoryReloadWait")->numarg))
+		    logg("^Scans still running, reloading the database anyway\n");
+	    }
+#if defined(FANOTIFY) || defined(CLAMAUTH)
+	    /* the engine is freed before the new one is loaded */
+	    if(optget(opts, "ScanOnAccess")->enabled && tharg)
+		tharg_setengine(tharg, NULL);
+#endif
+	    for (i = 0; i < nacceptors; i++)
+		acceptor_setengine(acceptors[i], NULL);
 	    engine = reload_db(engine, dboptions, opts, FALSE, &ret);
 	    if(ret) {
 		logg("Terminating because of a fatal error.\n");
@@ -1513,15 +2506,36 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 	    pthread_mutex_unlock(&reload_mutex);
 
 #if defined(FANOTIFY) || defined(CLAMAUTH)
-	    if(optget(opts, "ScanOnAccess")->enabled && tharg) {
-		tharg->engine = engine;
-	    }
+	    if(optget(opts, "ScanOnAccess")->enabled && tharg)
+		tharg_setengine(tharg, engine);
 #endif
+	    for (i = 0; i < nacceptors; i++)
+		acceptor_setengine(acceptors[i], engine);
 	    time(&start_time);
 	} else {
 	    pthread_mutex_unlock(&reload_mutex);
 	}
     }
+    /* the connections accepted for an engine that never came */
+    if (startup)
+	recv_shutdown(fds);
+
+#ifdef DBWATCH
+    dbwatch_stop();
+#endif
+
+    /* don't leave the loader thread behind */
+    pthread_mutex_lock(&reload_mutex);
+    if(reload_stage != RELOAD_STAGE_IDLE) {
+	struct cl_engine *new_engine;
+
+	pthread_mutex_unlock(&reload_mutex);
+	logg("*Waiting for the database reload to finish\n");
+	if((new_engine = reload_finish()))
+	    cl_engine_free(new_engine);
+    } else {
+	pthread_mutex_unlock(&reload_mutex);
+    }
 
     pthread_mutex_lock(&exit_mutex);
     progexit = 1;
@@ -1533,11 +2547,20 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 	logg("^Write to syncpipe failed\n");
     }
 #endif
+    /* the acceptors dispatch into the pool */
+    for (i = 0; i < nacceptors; i++)
+	acceptor_stop(acceptors[i]);
+    free(acceptors);
     /* Destroy the thread manager.
      * This waits for all current tasks to end
      */
     logg("*Waiting for all threads to finish\n");
     thrmgr_destroy(thr_pool);
+    if(scan_journal) {
+	journal_save(scan_journal);
+	journal_free(scan_journal);
+	scan_journal = NULL;
+    }
 #if defined(FANOTIFY) || defined(CLAMAUTH)
     if(optget(opts, "ScanOnAccess")->enabled && tharg) {
 	logg("Stopping on-access scan\n");
@@ -1545,6 +2568,7 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 	pthread_kill(fan_pid, SIGUSR1);
 	pthread_mutex_unlock(&logg_mutex);
 	pthread_join(fan_pid, NULL);
+    pthread_mutex_destroy(&tharg->engine_mutex);
     free(tharg);
     }
 #endif
@@ -1566,15 +2590,16 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 #endif
     if(dbstat.entries)
 	cl_statfree(&dbstat);
-    if (sd_listen_fds(0) == 0)
+    if (sd_listen_fds(0) == 0 && prefork_slot < 0)
     {
-        /* only close the sockets, when not using systemd socket activation */
+        /* only close the sockets, when not using systemd socket activation;
+         * the worker processes leave them to the others */
         logg("*Shutting down the main socket%s.\n", (nsockets > 1) ? "s" : "");
         for (i = 0; i < nsockets; i++)
             shutdown(socketds[i], 2);
     }
 
-    if((opt = optget(opts, "PidFile"))->enabled) {
+    if((opt = optget(opts, "PidFile"))->enabled && prefork_slot < 0) {
 	if(unlink(opt->strarg) == -1)
 	    logg("!Can't unlink the pid file %s\n", opt->strarg);
 	else
@@ -1586,3 +2611,223 @@ int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsi
 
     return ret;
 } 
+
+#ifndef _WIN32
+/*
+ * Pre-fork mode (WorkerProcesses): the main process loads the engine once
+ * and forks the workers, which get it copy-on-write and each run recvloop_th
+ * on the shared listening sockets. A crash only takes down the scans of one
+ * worker, which is then restarted. The main process does the SelfCheck and
+ * the reloads, then replaces the workers one at a time; the old worker
+ * finishes its running scans on the old engine.
+ */
+struct prefork_worker {
+    pid_t pid;
+    unsigned int gen;
+};
+
+static pid_t prefork_spawn(int slot, int *socketds, unsigned nsockets, struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts)
+{
+	const struct optstruct *opt;
+	pid_t pid;
+	int ret;
+
+    if((pid = fork()) == -1) {
+	logg("!Can't start worker %d: %s\n", slot, strerror(errno));
+	return -1;
+    }
+    if(pid)
+	return pid;
+
+    prefork_slot = slot;
+    reload = 0;
+    sighup = 0;
+    if(slot && scan_journal) {
+	/* a single writer for the journal file */
+	journal_free(scan_journal);
+	scan_journal = NULL;
+    }
+    if((opt = optget(opts, "LogBufferSize"))->numarg && logg_file) {
+	if(logg_async_start(opt->numarg))
+	    logg("^Can't start the log writer, logging synchronously\n");
+    }
+    logg("*Worker %d started, PID %u\n", slot, (unsigned int) getpid());
+
+    ret = recvloop_th(socketds, nsockets, NULL, 0, engine, dboptions, opts);
+
+    logg_async_stop();
+    logg_close();
+    exit(ret);
+}
+
+int prefork_run(int *socketds, unsigned nsockets, struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts)
+{
+	struct prefork_worker *workers;
+	unsigned int nworkers, gen = 0, selfchk;
+	const struct optstruct *opt;
+	struct sigaction sigact;
+	time_t start_time, current_time;
+	char timestr[32];
+	mode_t old_umask;
+	unsigned i;
+	pid_t pid;
+	int status, ret = 0;
+
+    nworkers = optget(opts, "WorkerProcesses")->numarg;
+    if(!(workers = calloc(nworkers, sizeof(*workers)))) {
+	logg("!Can't allocate the worker table\n");
+	cl_engine_free(engine);
+	return 1;
+    }
+
+    /* the workers race for the connections, the losers get EAGAIN */
+    for(i = 0; i < nsockets; i++) {
+	if(fcntl(socketds[i], F_SETFL, fcntl(socketds[i], F_GETFL) | O_NONBLOCK) == -1) {
+	    logg("!fcntl for the main socket failed: %s\n", strerror(errno));
+	    free(workers);
+	    cl_engine_free(engine);
+	    return 1;
+	}
+    }
+
+    if(optget(opts, "WatchDatabaseDirectory")->enabled)
+	logg("^WatchDatabaseDirectory is not supported with WorkerProcesses, use SelfCheck\n");
+    selfchk = optget(opts, "SelfCheck")->numarg;
+    if(!selfchk) {
+	logg("Self checking disabled.\n");
+    } else {
+	logg("Self checking every %u seconds.\n", selfchk);
+    }
+
+    if((opt = optget(opts, "PidFile"))->enabled) {
+	    FILE *fd;
+	old_umask = umask(0002);
+	if((fd = fopen(opt->strarg, "w")) == NULL) {
+	    logg("!Can't save PID in file %s\n", opt->strarg);
+	} else {
+	    if (fprintf(fd, "%u\n", (unsigned int) getpid())<0) {
+	    	logg("!Can't save PID in file %s\n", opt->strarg);
+	    }
+	    fclose(fd);
+	}
+	umask(old_umask);
+    }
+
+    memset(&sigact, 0, sizeof(struct sigaction));
+    sigact.sa_handler = sighandler_th;
+    sigemptyset(&sigact.sa_mask);
+    sigaddset(&sigact.sa_mask, SIGINT);
+    sigaddset(&sigact.sa_mask, SIGTERM);
+    sigaddset(&sigact.sa_mask, SIGHUP);
+    sigaddset(&sigact.sa_mask, SIGPIPE);
+    sigaddset(&sigact.sa_mask, SIGUSR2);
+    sigaction(SIGINT, &sigact, NULL);
+    sigaction(SIGTERM, &sigact, NULL);
+    sigaction(SIGHUP, &sigact, NULL);
+    sigaction(SIGPIPE, &sigact, NULL);
+    sigaction(SIGUSR2, &sigact, NULL);
+
+    logg("Starting %u worker processes\n", nworkers);
+    for(i = 0; i < nworkers; i++) {
+	workers[i].pid = prefork_spawn(i, socketds, nsockets, engine, dboptions, opts);
+	workers[i].gen = gen;
+    }
+
+    time(&start_time);
+    while(!progexit) {
+	/* interrupted by the signals */
+	sleep(1);
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	    for(i = 0; i < nworkers && workers[i].pid != pid; i++);
+	    /* a replaced worker done with its scans */
+	    if(i == nworkers)
+		continue;
+	    if(WIFSIGNALED(status))
+		logg("!Worker %u (PID %u) killed by signal %d, restarting it\n", i, (unsigned int) pid, WTERMSIG(status));
+	    else
+		logg("^Worker %u (PID %u) exited with status %d, restarting it\n", i, (unsigned int) pid, WEXITSTATUS(status));
+	    workers[i].pid = -1;
+	}
+	if(progexit)
+	    break;
+
+	/* SIGHUP */
+	if(sighup) {
+	    logg("SIGHUP caught: re-opening log file.\n");
+	    logg_close();
+	    sighup = 0;
+	    if(!logg_file && (opt = optget(opts, "LogFile"))->enabled)
+		logg_file = opt->strarg;
+	}
+
+	/* SelfCheck */
+	if(selfchk && !reload) {
+	    time(&current_time);
+	    if((current_time - start_time) >= (time_t)selfchk) {
+		if(reload_db(engine, dboptions, opts, TRUE, &ret))
+		    reload = 1;
+		time(&start_time);
+	    }
+	}
+
+	/* DB reload, the old engine stays with the running workers */
+	if(reload) {
+	    reload = 0;
+	    engine = reload_db(engine, dboptions, opts, FALSE, &ret);
+	    if(ret) {
+		logg("Terminating because of a fatal error.\n");
+		break;
+	    }
+	    pthread_mutex_lock(&reload_mutex);
+	    time(&reloaded_time);
+	    pthread_mutex_unlock(&reload_mutex);
+	    gen++;
+	    time(&start_time);
+	}
+
+	/* restart the dead workers, replace one outdated worker per round */
+	for(i = 0; i < nworkers; i++) {
+	    if(workers[i].pid == -1) {
+		workers[i].pid = prefork_spawn(i, socketds, nsockets, engine, dboptions, opts);
+		workers[i].gen = gen;
+	    }
+	}
+	for(i = 0; i < nworkers; i++) {
+	    if(workers[i].pid != -1 && workers[i].gen != gen) {
+		if((pid = prefork_spawn(i, socketds, nsockets, engine, dboptions, opts)) == -1)
+		    break;
+		logg("*Replacing worker %u (PID %u)\n", i, (unsigned int) workers[i].pid);
+		kill(workers[i].pid, SIGTERM);
+		workers[i].pid = pid;
+		workers[i].gen = gen;
+		break;
+	    }
+	}
+    }
+
+    logg("*Waiting for the worker processes to finish\n");
+    for(i = 0; i < nworkers; i++)
+	if(workers[i].pid != -1)
+	    kill(workers[i].pid, SIGTERM);
+    while(waitpid(-1, &status, 0) > 0 || errno == EINTR);
+    free(workers);
+
+    if(engine)
+	cl_engine_free(engine);
+    if(dbstat.entries)
+	cl_statfree(&dbstat);
+
+    if((opt = optget(opts, "PidFile"))->enabled) {
+	if(unlink(opt->strarg) == -1)
+	    logg("!Can't unlink the pid file %s\n", opt->strarg);
+	else
+	    logg("Pid file removed.\n");
+    }
+
+    time(&current_time);
+    logg("--- Stopped at %s", cli_ctime(&current_time, timestr, sizeof(timestr)));
+
+    return ret;
+}
+#endif
@@ -36,6 +36,8 @@ struct thrarg {
     const struct optstruct *opts;
     const struct cl_engine *engine;
     const struct cl_limits *limits;
+    pthread_mutex_t engine_mutex; /* guards engine and engine_gen */
+    unsigned long engine_gen; /* bumped whenever engine changes */
 };
 
 /* thread watcher arguments */
@@ -47,11 +49,13 @@ struct thrwarg {
     unsigned int options;
 };
 
-int recvloop_th(int *socketds, unsigned nsockets, struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts);
+int recvloop_th(int *socketds, unsigned nsockets, int *acceptds, unsigned nacceptds, struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts);
+int prefork_run(int *socketds, unsigned nsockets, struct cl_engine *engine, unsigned int dboptions, const struct optstruct *opts);
 int statinidir_th(const char* dirname);
 void sighandler(int sig);
 void sighandler_th(int sig);
 void sigsegv(int sig);
+void print_loadstats(const struct cl_engine *engine);
 
 extern pthread_mutex_t exit_mutex, reload_mutex;
 extern int progexit, reload;
@@ -63,6 +63,7 @@
 #include "server.h"
 #include "session.h"
 #include "thrmgr.h"
+#include "shared.h"
 
 #ifndef HAVE_FDPASSING
 #define FEATURE_FDPASSING 0
@@ -70,6 +71,12 @@
 #define FEATURE_FDPASSING 1
 #endif
 
+#ifdef SHMRING_SUPPORTED
+#define FEATURE_SHMRING FEATURE_FDPASSING
+#else
+#define FEATURE_SHMRING 0
+#endif
+
 static struct {
     const char *cmd;
     const size_t len;
@@ -96,7 +103,16 @@ static struct {
     {CMD17, sizeof(CMD17)-1,	COMMAND_INSTREAM,   0,	0, 1},
     {CMD19, sizeof(CMD19)-1,	COMMAND_DETSTATSCLEAR,	0, 1, 1},
     {CMD20, sizeof(CMD20)-1,	COMMAND_DETSTATS,   0, 1, 1},
-    {CMD21, sizeof(CMD21)-1,	COMMAND_ALLMATCHSCAN,  1, 0, 1}
+    {CMD21, sizeof(CMD21)-1,	COMMAND_ALLMATCHSCAN,  1, 0, 1},
+    {CMD22, sizeof(CMD22)-1,	COMMAND_MEMSTATS,   0,	0, 1},
+    {CMD23, sizeof(CMD23)-1,	COMMAND_PRIORITY,   1,	0, 1},
+    {CMD24, sizeof(CMD24)-1,	COMMAND_BATCHSTREAM, 0,	0, 1},
+    {CMD25, sizeof(CMD25)-1,	COMMAND_SHMRING,    0,	0, FEATURE_SHMRING},
+    {CMD26, sizeof(CMD26)-1,	COMMAND_METRICS,    0,	0, 1},
+    {CMD27, sizeof(CMD27)-1,	COMMAND_HASHCHECK,  1,	0, 1},
+    {CMD28, sizeof(CMD28)-1,	COMMAND_PROFILE,    0,	0, 1},
+    {CMD29, sizeof(CMD29)-1,	COMMAND_SIGSTATS,   0,	0, 1},
+    {CMD30, sizeof(CMD30)-1,	COMMAND_SUBSCRIBE,  1,	0, 1}
 };
 
 enum commands parse_command(const char *cmd, const char **argument, int oldstyle)
@@ -182,6 +198,159 @@ int conn_reply_errno(const client_conn_t *conn, const char *path,
     return conn_reply(conn, path, msg, err);
 }
 
+#ifdef SHMRING_SUPPORTED
+/* map and check the memfd sent with SHMRING, it must be sealed so the
+ * client can't shrink it under a running scan */
+static struct shm_ring *shmring_attach(int fd)
+{
+    STATBUF sb;
+    struct shmring_header hdr;
+    struct shm_ring *ring;
+    char *base;
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    if (seals == -1 || !(seals & F_SEAL_SHRINK)) {
+	logg("^SHMRING: the memfd must be sealed with F_SEAL_SHRINK\n");
+	return NULL;
+    }
+    if (FSTAT(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(hdr)) {
+	logg("^SHMRING: ring too small\n");
+	return NULL;
+    }
+    base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+	logg("^SHMRING: mmap failed: %d\n", errno);
+	return NULL;
+    }
+    /* the client can change the header at any time, only use our copy */
+    memcpy(&hdr, base, sizeof(hdr));
+    if (hdr.magic != SHMRING_MAGIC || hdr.version != SHMRING_VERSION ||
+	!hdr.nslots || hdr.nslots > 65536 || !hdr.slot_size ||
+	hdr.data_off != shmring_data_off(hdr.nslots) || hdr.data_off > (uint64_t)sb.st_size ||
+	hdr.slot_size > ((uint64_t)sb.st_size - hdr.data_off) / hdr.nslots) {
+	logg("^SHMRING: invalid ring header\n");
+	munmap(base, sb.st_size);
+	return NULL;
+    }
+    if (!(ring = calloc(1, sizeof(*ring)))) {
+	munmap(base, sb.st_size);
+	return NULL;
+    }
+    pthread_mutex_init(&ring->mutex, NULL);
+    ring->refcount = 1;
+    ring->base = base;
+    ring->size = sb.st_size;
+    ring->slots = (struct shmring_slot *)(base + sizeof(hdr));
+    ring->nslots = hdr.nslots;
+    ring->slot_size = hdr.slot_size;
+    ring->data_off = hdr.data_off;
+    logg("$SHMRING: attached %u slots of %llu bytes\n", ring->nslots, (unsigned long long)ring->slot_size);
+    return ring;
+}
+#endif
+
+void shmring_release(struct shm_ring *ring)
+{
+    unsigned int refs;
+
+    if (!ring)
+	return;
+    pthread_mutex_lock(&ring->mutex);
+    refs = --ring->refcount;
+    pthread_mutex_unlock(&ring->mutex);
+    if (refs)
+	return;
+    munmap(ring->base, ring->size);
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring);
+}
+
+/* post the result of the slot of conn, ring the client's doorbell and drop
+ * the reference held by the slot */
+static void shmring_complete(client_conn_t *conn, enum shmring_status status, const char *result)
+{
+    struct shmring_slot *slot = &conn->ring->slots[conn->ringslot];
+
+    slot->status = status;
+    strncpy(slot->result, result, SHMRING_RESULT - 1);
+    slot->result[SHMRING_RESULT - 1] = '\0';
+    __sync_synchronize();
+    slot->state = SHMRING_DONE;
+    /* a full socket buffer means the client has doorbells to read anyway */
+    if (send(conn->sd, ".", 1, 0) == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	logg("$SHMRING: can't ring the doorbell: %d\n", errno);
+    shmring_release(conn->ring);
+}
+
+/* the engine part of METRICS */
+static void print_scanmetrics(int desc, const struct cl_engine *engine)
+{
+    struct cl_scanstat stats[64];
+    unsigned int i, count = sizeof(stats)/sizeof(stats[0]);
+
+    if (cl_engine_get_scanstats(engine, stats, &count) != CL_SUCCESS)
+	return;
+    if (count > sizeof(stats)/sizeof(stats[0]))
+	count = sizeof(stats)/sizeof(stats[0]);
+    mdprintf(desc, "# HELP clamd_filetype_files_total Objects scanned for each file type, including the ones inside containers.\n");
+    mdprintf(desc, "# TYPE clamd_filetype_files_total counter\n");
+    for (i=0;i<count;i++)
+	mdprintf(desc, "clamd_filetype_files_total{type=\"%s\"} %llu\n", stats[i].name, stats[i].files);
+    mdprintf(desc, "# HELP clamd_filetype_bytes_total Bytes scanned for each file type.\n");
+    mdprintf(desc, "# TYPE clamd_filetype_bytes_total counter\n");
+    for (i=0;i<count;i++)
+	mdprintf(desc, "clamd_filetype_bytes_total{type=\"%s\"} %llu\n", stats[i].name, stats[i].bytes);
+    mdprintf(desc, "# HELP clamd_filetype_seconds_total Time spent on each file type, without the objects inside.\n");
+    mdprintf(desc, "# TYPE clamd_filetype_seconds_total counter\n");
+    for (i=0;i<count;i++)
+	mdprintf(desc, "clamd_filetype_seconds_total{type=\"%s\"} %.6f\n", stats[i].name, stats[i].usec / 1e6);
+}
+
+/* SIGSTATS: the most expensive signatures sampled by SignatureProfileRate */
+#define SIGSTATS_TOP 50
+static void print_sigstats(int desc, const struct cl_engine *engine, char term)
+{
+    struct cl_sigstat stats[SIGSTATS_TOP];
+    unsigned int i, count = SIGSTATS_TOP;
+    long long rate = cl_engine_get_num(engine, CL_ENGINE_SIGPROF_RATE, NULL);
+
+    if (rate <= 0) {
+	mdprintf(desc, "SAMPLING DISABLED\nEND%c", term);
+	return;
+    }
+    if (cl_engine_get_sigstats(engine, stats, &count) != CL_SUCCESS) {
+	mdprintf(desc, "ERROR: out of memory\nEND%c", term);
+	return;
+    }
+    mdprintf(desc, "SIGNATURES: %u sampled 1 in %lld\n", count, rate);
+    if (count > SIGSTATS_TOP)
+	count = SIGSTATS_TOP;
+    /* estimated seconds first, then the sampled evaluations and their
+     * average and longest time in usec */
+    for (i=0;i<count;i++)
+	mdprintf(desc, "%s %s %.3f %llu %.1f %.1f\n", stats[i].type, stats[i].name,
+		 stats[i].nsec * (double)rate / 1e9, stats[i].samples,
+		 stats[i].nsec / 1e3 / stats[i].samples, stats[i].max_nsec / 1e3);
+    mdprintf(desc, "END%c", term);
+}
+
+/* drop the INSTREAM data, either the temporary file or the memory buffer */
+static void instream_release(client_conn_t *conn)
+{
+    if (conn->scanfd != -1) {
+	if (ftruncate(conn->scanfd, 0) == -1) {
+	    /* not serious, we're going to close it and unlink it anyway */
+	    logg("*ftruncate failed: %d\n", errno);
+	}
+	close(conn->scanfd);
+	conn->scanfd = -1;
+    }
+    if (conn->filename)
+	cli_unlink(conn->filename);
+    streambuf_put(conn->scanmem, conn->scanmem_size);
+    conn->scanmem = NULL;
+}
+
 /* returns
  *  -1 on fatal error (shutdown)
  *  0 on ok
@@ -206,10 +375,34 @@ int command(client_conn_t *conn, int *virus)
 
     if (thrmgr_group_need_terminate(conn->group)) {
 	logg("$Client disconnected while command was active\n");
-	if (conn->scanfd != -1)
+	if (conn->cmdtype == COMMAND_SHMSCAN)
+	    shmring_complete(conn, SHMRING_ERROR, "Client disconnected");
+	else if (conn->cmdtype == COMMAND_INSTREAMSCAN)
+	    instream_release(conn);
+	else if (conn->scanfd != -1)
 	    close(conn->scanfd);
 	return 1;
     }
+    if (conn->deadline_at.tv_sec) {
+	struct timeval tv_now;
+
+	gettimeofday(&tv_now, NULL);
+	if (tv_now.tv_sec > conn->deadline_at.tv_sec ||
+	    (tv_now.tv_sec == conn->deadline_at.tv_sec && tv_now.tv_usec > conn->deadline_at.tv_usec)) {
+	    logg("$Deadline exceeded before the command was started\n");
+	    if (conn->cmdtype == COMMAND_SHMSCAN) {
+		shmring_complete(conn, SHMRING_ERROR, "Deadline exceeded");
+		return 1;
+	    }
+	    conn_reply(conn, conn->cmdtype == COMMAND_INSTREAMSCAN ? "stream" : conn->filename,
+		       "Deadline exceeded.", "ERROR");
+	    if (conn->cmdtype == COMMAND_INSTREAMSCAN)
+		instream_release(conn);
+	    else if (conn->scanfd != -1)
+		close(conn->scanfd);
+	    return 1;
+	}
+    }
     thrmgr_setactiveengine(engine);
 
     data.data = &scandata;
@@ -232,6 +425,7 @@ int command(client_conn_t *conn, int *virus)
 	case COMMAND_CONTSCAN:
 	    thrmgr_setactivetask(NULL, "CONTSCAN");
 	    type = TYPE_CONTSCAN;
+	    scandata.journal = 1;
 	    break;
 	case COMMAND_MULTISCAN: {
 	    int multiscan, max, alive;
@@ -241,6 +435,7 @@ int command(client_conn_t *conn, int *virus)
 		!S_ISDIR(sb.st_mode)) {
 		thrmgr_setactivetask(NULL, "CONTSCAN");
 		type = TYPE_CONTSCAN;
+		scandata.journal = 1;
 		break;
 	    }
 
@@ -266,6 +461,7 @@ int command(client_conn_t *conn, int *virus)
 	    flags &= ~CLI_FTW_NEED_STAT;
 	    thrmgr_setactivetask(NULL, "MULTISCAN");
 	    type = TYPE_MULTISCAN;
+	    scandata.journal = 1;
 	    scandata.group = group = thrmgr_group_new();
 	    if (!group) {
 	      if(optget(opts, "ExitOnOOM")->enabled)
@@ -280,6 +476,7 @@ int command(client_conn_t *conn, int *virus)
 	    scandata.group = NULL;
 	    scandata.type = TYPE_SCAN;
 	    scandata.thr_pool = NULL;
+	    scandata.journal = 1;
 	    /* TODO: check ret value */
 	    ret = scan_callback(NULL, conn->filename, conn->filename, visit_file, &data);	    /* callback freed it */
 	    conn->filename = NULL;
@@ -326,6 +523,26 @@ int command(client_conn_t *conn, int *virus)
 		 mdprintf(desc, "%u: ", conn->id);
 	     thrmgr_printstats(desc, conn->term);
 	     return 0;
+	 case COMMAND_METRICS:
+	     thrmgr_setactivetask(NULL, "METRICS");
+	     if (conn->group)
+		 mdprintf(desc, "%u: ", conn->id);
+	     thrmgr_printmetrics(desc);
+	     print_scanmetrics(desc, engine);
+	     mdprintf(desc, "# EOF%c", conn->term);
+	     return 0;
+	 case COMMAND_PROFILE:
+	     thrmgr_setactivetask(NULL, "PROFILE");
+	     if (conn->group)
+		 mdprintf(desc, "%u: ", conn->id);
+	     thrmgr_printprofile(desc, conn->term);
+	     return 0;
+	 case COMMAND_SIGSTATS:
+	     thrmgr_setactivetask(NULL, "SIGSTATS");
+	     if (conn->group)
+		 mdprintf(desc, "%u: ", conn->id);
+	     print_sigstats(desc, engine, conn->term);
+	     return 0;
 	 case COMMAND_STREAM:
 	     thrmgr_setactivetask(NULL, "STREAM");
 	     ret = scanstream(desc, NULL, engine, options, opts, conn->term);
@@ -354,14 +571,38 @@ int command(client_conn_t *conn, int *virus)
 		 ret = 1;
 	     } else
 		 ret = 0;
-	     if (ftruncate(conn->scanfd, 0) == -1) {
-		 /* not serious, we're going to close it and unlink it anyway */
-		 logg("*ftruncate failed: %d\n", errno);
-	     }
-	     close(conn->scanfd);
-	     conn->scanfd = -1;
-	     cli_unlink(conn->filename);
+	     instream_release(conn);
 	     return ret;
+	 case COMMAND_SHMSCAN:
+	     {
+		 struct shm_ring *ring = conn->ring;
+		 uint64_t len = ring->slots[conn->ringslot].length;
+		 const char *virname;
+
+		 thrmgr_setactivetask(NULL, "SHMSCAN");
+		 if (len > ring->slot_size) {
+		     shmring_complete(conn, SHMRING_ERROR, "Invalid length");
+		     return 1;
+		 }
+		 if (optget(opts, "StreamMaxLength")->numarg && len > (uint64_t)optget(opts, "StreamMaxLength")->numarg) {
+		     shmring_complete(conn, SHMRING_ERROR, "Size limit reached");
+		     return 1;
+		 }
+		 ret = scanshm(conn, ring->base + ring->data_off + conn->ringslot * ring->slot_size, len,
+			       &virname, engine, options, opts);
+		 if (ret == CL_VIRUS) {
+		     *virus = 1;
+		     shmring_complete(conn, SHMRING_VIRUS, virname);
+		     return 0;
+		 } else if (ret == CL_CLEAN) {
+		     shmring_complete(conn, SHMRING_CLEAN, "OK");
+		     return 0;
+		 }
+		 shmring_complete(conn, SHMRING_ERROR, cl_strerror(ret));
+		 if (ret == CL_EMEM && optget(opts, "ExitOnOOM")->enabled)
+		     return -1;
+		 return 1;
+	     }
 	 case COMMAND_ALLMATCHSCAN:
 	     if (!optget(opts, "AllowAllMatchScan")->enabled) {
 		logg("$Rejecting ALLMATCHSCAN command.\n");
@@ -405,6 +646,8 @@ int command(client_conn_t *conn, int *virus)
 	 total = scandata.total;
 	 ok = total - error - scandata.infected;
      }
+     if (scan_journal && scandata.journal)
+	 journal_save(scan_journal);
 
      if (ok + error == total && (error != total)) {
 	 if (conn_reply_single(conn, conn->filename, "OK") == -1)
@@ -421,6 +664,7 @@ int command(client_conn_t *conn, int *virus)
  {
      int ret = 0;
      int bulk;
+     enum thrmgr_prio prio;
      client_conn_t *dup_conn = (client_conn_t *) malloc(sizeof(struct client_conn_tag));
 
      if(!dup_conn) {
@@ -459,9 +703,15 @@ int command(client_conn_t *conn, int *virus)
 	case COMMAND_INSTREAMSCAN:
 	    dup_conn->scanfd = conn->scanfd;
 	    conn->scanfd = -1;
+	    conn->scanmem = NULL;
+	    break;
+	case COMMAND_SHMSCAN:
 	    break;
 	case COMMAND_STREAM:
 	case COMMAND_STATS:
+	case COMMAND_METRICS:
+	case COMMAND_PROFILE:
+	case COMMAND_SIGSTATS:
 	    /* not a scan command, don't queue to bulk */
 	    bulk = 0;
 	    /* just dispatch the command */
@@ -473,17 +723,55 @@ int command(client_conn_t *conn, int *virus)
     }
     if (!dup_conn->group)
 	bulk = 0;
-    if(!ret && !thrmgr_group_dispatch(dup_conn->thrpool, dup_conn->group, dup_conn, bulk)) {
+    if (dup_conn->priority != PRIO_NORMAL)
+	prio = dup_conn->priority;
+    else
+	prio = bulk ? PRIO_LOW : PRIO_NORMAL;
+    if (dup_conn->deadline) {
+	gettimeofday(&dup_conn->deadline_at, NULL);
+	dup_conn->deadline_at.tv_sec += dup_conn->deadline / 1000;
+	dup_conn->deadline_at.tv_usec += (dup_conn->deadline % 1000) * 1000;
+	if (dup_conn->deadline_at.tv_usec >= 1000000) {
+	    dup_conn->deadline_at.tv_sec++;
+	    dup_conn->deadline_at.tv_usec -= 1000000;
+	}
+    }
+    if(!ret && !thrmgr_group_dispatch_prio(dup_conn->thrpool, dup_conn->group, dup_conn, prio,
+					   dup_conn->deadline ? &dup_conn->deadline_at : NULL)) {
 	logg("!thread dispatch failed\n");
 	ret = -2;
     }
     if (ret) {
+	if (cmd == COMMAND_INSTREAMSCAN)
+	    streambuf_put(dup_conn->scanmem, dup_conn->scanmem_size);
 	cl_engine_free(dup_conn->engine);
 	free(dup_conn);
     }
     return ret;
 }
 
+/* dispatch the slots the client posted, called by the recv loop on doorbells */
+int shmring_poll(client_conn_t *conn)
+{
+    struct shm_ring *ring = conn->ring;
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; i < ring->nslots && !ret; i++) {
+	if (ring->slots[i].state != SHMRING_POSTED)
+	    continue;
+	__sync_synchronize();
+	ring->slots[i].state = SHMRING_BUSY;
+	pthread_mutex_lock(&ring->mutex);
+	ring->refcount++;
+	pthread_mutex_unlock(&ring->mutex);
+	conn->ringslot = i;
+	if ((ret = dispatch_command(conn, COMMAND_SHMSCAN, NULL)))
+	    shmring_complete(conn, SHMRING_ERROR, "Dispatch failed");
+    }
+    return ret;
+}
+
 static int print_ver(int desc, char term, const struct cl_engine *engine)
 {
     uint32_t ver;
@@ -521,6 +809,85 @@ static void print_commands(int desc, char term, const struct cl_engine *engine)
     mdprintf(desc, "%c", term);
 }
 
+/* HASHCHECK <size> <digest> [<digest>...]
+ * the digests are told apart by their length: MD5, SHA1 or SHA256 in hex;
+ * the cache of clean files is keyed on the MD5 */
+static void hashcheck(client_conn_t *conn, const char *argument)
+{
+    unsigned char *digest[3] = { NULL, NULL, NULL };
+    enum cl_hashcheck verdict;
+    const char *virname;
+    char hex[65], *end;
+    unsigned long long size;
+    const char *pt;
+    int i, n, ret = 0;
+
+    size = strtoull(argument, &end, 10);
+    if (end == argument || *end != ' ') {
+	conn_reply_error(conn, "Invalid HASHCHECK argument.");
+	return;
+    }
+    for (pt = end; !ret && sscanf(pt, " %64s%n", hex, &n) == 1; pt += n) {
+	switch (strlen(hex)) {
+	    case 32: i = 0; break;
+	    case 40: i = 1; break;
+	    case 64: i = 2; break;
+	    default: i = -1;
+	}
+	if (i < 0 || digest[i] || !(digest[i] = (unsigned char *)cli_hex2str(hex)))
+	    ret = 1;
+    }
+    if (ret || *pt || (!digest[0] && !digest[1] && !digest[2]))
+	conn_reply_error(conn, "Invalid HASHCHECK argument.");
+    else if (cl_hashcheck(conn->engine, (size_t)size, digest[0], digest[1], digest[2], &virname, &verdict) != CL_SUCCESS)
+	conn_reply_error(conn, "HASHCHECK failed.");
+    else if (verdict == CL_HASH_VIRUS) {
+	conn_reply_virus(conn, "hashcheck", virname);
+	logg("~hashcheck(%s:%llu): %s FOUND\n", hex, size, virname);
+    } else
+	conn_reply_single(conn, "hashcheck", verdict == CL_HASH_CLEAN ? "OK" : "UNKNOWN");
+    for (i = 0; i < 3; i++)
+	free(digest[i]);
+}
+
+static void print_memstats(int desc, char term, const struct cl_engine *engine)
+{
+    struct cl_memstat stats[32];
+    size_t sum[CL_MEMSTAT_TYPES], total, all = 0;
+    unsigned int i, j, count = sizeof(stats)/sizeof(stats[0]), sigs = 0;
+
+    memset(sum, 0, sizeof(sum));
+    if (cl_engine_get_memstats(engine, stats, &count) != CL_SUCCESS) {
+	mdprintf(desc, "ERROR: can't get the engine memory statistics%c", term);
+	return;
+    }
+    if (count > sizeof(stats)/sizeof(stats[0]))
+	count = sizeof(stats)/sizeof(stats[0]);
+    for (i=0;i<count;i++) {
+	total = 0;
+	for (j=0;j<CL_MEMSTAT_TYPES;j++) {
+	    total += stats[i].bytes[j];
+	    sum[j] += stats[i].bytes[j];
+	}
+	all += total;
+	sigs += stats[i].sigs;
+	mdprintf(desc, "%s: sigs %u ac_nodes %.3fM ac_trans %.3fM ac_patterns %.3fM bm %.3fM hash %.3fM pcre %.3fM bytecode %.3fM yara %.3fM total %.3fM\n",
+		 stats[i].name, stats[i].sigs,
+		 stats[i].bytes[CL_MEMSTAT_AC_NODES]/(1024*1024.0), stats[i].bytes[CL_MEMSTAT_AC_TRANS]/(1024*1024.0),
+		 stats[i].bytes[CL_MEMSTAT_AC_PATTERNS]/(1024*1024.0), stats[i].bytes[CL_MEMSTAT_BM]/(1024*1024.0),
+		 stats[i].bytes[CL_MEMSTAT_HASH]/(1024*1024.0), stats[i].bytes[CL_MEMSTAT_PCRE]/(1024*1024.0),
+		 stats[i].bytes[CL_MEMSTAT_BYTECODE]/(1024*1024.0), stats[i].bytes[CL_MEMSTAT_YARA]/(1024*1024.0),
+		 total/(1024*1024.0));
+    }
+    mdprintf(desc, "TOTAL: sigs %u ac_nodes %.3fM ac_trans %.3fM ac_patterns %.3fM bm %.3fM hash %.3fM pcre %.3fM bytecode %.3fM yara %.3fM total %.3fM\n",
+	     sigs, sum[CL_MEMSTAT_AC_NODES]/(1024*1024.0), sum[CL_MEMSTAT_AC_TRANS]/(1024*1024.0),
+	     sum[CL_MEMSTAT_AC_PATTERNS]/(1024*1024.0), sum[CL_MEMSTAT_BM]/(1024*1024.0),
+	     sum[CL_MEMSTAT_HASH]/(1024*1024.0), sum[CL_MEMSTAT_PCRE]/(1024*1024.0),
+	     sum[CL_MEMSTAT_BYTECODE]/(1024*1024.0), sum[CL_MEMSTAT_YARA]/(1024*1024.0),
+	     all/(1024*1024.0));
+    mdprintf(desc, "END%c", term);
+}
+
 /* returns:
  *  <0 for error
  *     -1 out of memory
@@ -549,7 +916,15 @@ int execute_or_dispatch_command(client_conn_t *conn, enum commands cmd, const ch
 	    case COMMAND_VERSION:
 	    case COMMAND_PING:
 	    case COMMAND_STATS:
+	    case COMMAND_METRICS:
+	    case COMMAND_PROFILE:
+	    case COMMAND_SIGSTATS:
+	    case COMMAND_MEMSTATS:
 	    case COMMAND_COMMANDS:
+	    case COMMAND_PRIORITY:
+	    case COMMAND_BATCHSTREAM:
+	    case COMMAND_SHMRING:
+	    case COMMAND_HASHCHECK:
 		/* These commands are accepted inside IDSESSION */
 		break;
 	    default:
@@ -595,6 +970,16 @@ int execute_or_dispatch_command(client_conn_t *conn, enum commands cmd, const ch
 		print_commands(desc, conn->term, engine);
 		return conn->group ? 0 : 1;
 	    }
+	case COMMAND_MEMSTATS:
+	    {
+		if (conn->group)
+		    mdprintf(desc, "%u: ", conn->id);
+		print_memstats(desc, conn->term, engine);
+		return conn->group ? 0 : 1;
+	    }
+	case COMMAND_HASHCHECK:
+	    hashcheck(conn, argument);
+	    return conn->group ? 0 : 1;
 	case COMMAND_DETSTATSCLEAR:
 	    {
         /* TODO: tell client this command has been removed */
@@ -607,22 +992,107 @@ int execute_or_dispatch_command(client_conn_t *conn, enum commands cmd, const ch
 	    }
 	case COMMAND_INSTREAM:
 	    {
-		int rc = cli_gentempfd(optget(conn->opts, "TemporaryDirectory")->strarg, &conn->filename, &conn->scanfd);
-		if (rc != CL_SUCCESS)
-		    return rc;
+		/* with StreamMaxMemSize the temporary file is only created
+		 * once the stream outgrows the memory buffer */
+		if (optget(conn->opts, "StreamMaxMemSize")->numarg) {
+		    conn->filename = NULL;
+		    conn->scanfd = -1;
+		} else {
+		    int rc = cli_gentempfd(optget(conn->opts, "TemporaryDirectory")->strarg, &conn->filename, &conn->scanfd);
+		    if (rc != CL_SUCCESS)
+			return rc;
+		}
 		conn->quota = optget(conn->opts, "StreamMaxLength")->numarg;
 		conn->mode = MODE_STREAM;
 		return 0;
 	    }
+	case COMMAND_SHMRING:
+	    if (!conn->group) {
+		conn_reply_error(conn, "SHMRING is only accepted inside IDSESSION.");
+		return 1;
+	    }
+	    if (conn->scanfd == -1) {
+		conn_reply_error(conn, "SHMRING: didn't receive file descriptor.");
+		return 1;
+	    }
+#ifdef SHMRING_SUPPORTED
+	    conn->ring = shmring_attach(conn->scanfd);
+#endif
+	    close(conn->scanfd);
+	    conn->scanfd = -1;
+	    if (!conn->ring) {
+		conn_reply_error(conn, "SHMRING: invalid ring.");
+		return 1;
+	    }
+	    conn->mode = MODE_SHMRING;
+	    mdprintf(desc, "%u: SHMRING OK%c", conn->id, term);
+	    return 0;
+	case COMMAND_BATCHSTREAM:
+	    /* objects are scanned concurrently and replied to out of order,
+	     * so this needs the IDSESSION request numbers */
+	    if (!conn->group) {
+		conn_reply_error(conn, "BATCHSTREAM is only accepted inside IDSESSION.");
+		return 1;
+	    }
+	    conn->filename = NULL;
+	    conn->scanfd = -1;
+	    conn->quota = optget(conn->opts, "StreamMaxLength")->numarg;
+	    conn->mode = MODE_STREAM;
+	    conn->batch = 1;
+	    return 0;
 	case COMMAND_STREAM:
 	case COMMAND_MULTISCAN:
 	case COMMAND_CONTSCAN:
 	case COMMAND_STATS:
+	case COMMAND_METRICS:
+	case COMMAND_PROFILE:
+	case COMMAND_SIGSTATS:
 	case COMMAND_FILDES:
 	case COMMAND_SCAN:
 	case COMMAND_INSTREAMSCAN:
 	case COMMAND_ALLMATCHSCAN:
 	    return dispatch_command(conn, cmd, argument);
+	case COMMAND_PRIORITY:
+	    {
+		/* PRIORITY high|normal|low [deadline in ms] */
+		char prio[8];
+		unsigned int deadline = 0;
+
+		if (sscanf(argument, "%7s %u", prio, &deadline) < 1) {
+		    conn_reply_error(conn, "Invalid PRIORITY argument.");
+		    return 1;
+		}
+		if (!strcmp(prio, "high"))
+		    conn->priority = PRIO_HIGH;
+		else if (!strcmp(prio, "normal"))
+		    conn->priority = PRIO_NORMAL;
+		else if (!strcmp(prio, "low"))
+		    conn->priority = PRIO_LOW;
+		else {
+		    conn_reply_error(conn, "Invalid PRIORITY argument.");
+		    return 1;
+		}
+		conn->deadline = deadline;
+		return 0;
+	    }
+	case COMMAND_SUBSCRIBE:
+	    {
+		/* SUBSCRIBE <interval in ms>: the connection goes to the
+		 * publisher thread, which pushes the changes of the thread
+		 * and queue state until the client disconnects */
+		unsigned int msec;
+
+		if (sscanf(argument, "%u", &msec) != 1 || msec < SUBSCRIBE_MIN_MSEC) {
+		    conn_reply_error(conn, "Invalid SUBSCRIBE interval.");
+		    return 1;
+		}
+		if (thrmgr_subscribe(desc, msec, term)) {
+		    conn_reply_error(conn, "SUBSCRIBE failed.");
+		    return 1;
+		}
+		/* not closed by the receive thread, see parse_dispatch_cmd() */
+		return 0;
+	    }
 	case COMMAND_IDSESSION:
 	    conn->group = thrmgr_group_new();
 	    if (!conn->group)
@@ -45,11 +45,21 @@
 #define CMD20 "DETSTATS"
 
 #define CMD21 "ALLMATCHSCAN"
+#define CMD22 "MEMSTATS"
+#define CMD23 "PRIORITY"
+#define CMD24 "BATCHSTREAM"
+#define CMD25 "SHMRING"
+#define CMD26 "METRICS"
+#define CMD27 "HASHCHECK"
+#define CMD28 "PROFILE"
+#define CMD29 "SIGSTATS"
+#define CMD30 "SUBSCRIBE"
 
 #include "libclamav/clamav.h"
 #include "shared/optparser.h"
 #include "server.h"
 #include "others.h"
+#include "shared/shmring.h"
 
 enum commands {
     COMMAND_UNKNOWN = 0,
@@ -71,9 +81,19 @@ enum commands {
     COMMAND_COMMANDS,
     COMMAND_DETSTATSCLEAR,
     COMMAND_DETSTATS,
+    COMMAND_MEMSTATS,
+    COMMAND_PRIORITY,
+    COMMAND_BATCHSTREAM,
+    COMMAND_SHMRING,
+    COMMAND_METRICS,
+    COMMAND_HASHCHECK,
+    COMMAND_PROFILE,
+    COMMAND_SIGSTATS,
+    COMMAND_SUBSCRIBE,
     /* internal commands */
     COMMAND_MULTISCANFILE,
     COMMAND_INSTREAMSCAN,
+    COMMAND_SHMSCAN,
     COMMAND_ALLMATCHSCAN
 };
 
@@ -81,6 +101,14 @@ typedef struct client_conn_tag {
     enum commands cmdtype;
     char *filename;
     int scanfd;
+    char *scanmem; /* INSTREAM data, used when scanfd == -1 */
+    size_t scanmem_len;
+    size_t scanmem_size;
+    unsigned char scanmd5[16];
+    int have_scanmd5;
+    int batch; /* BATCHSTREAM instead of INSTREAM */
+    struct shm_ring *ring; /* SHMRING of the connection */
+    uint32_t ringslot; /* slot scanned by COMMAND_SHMSCAN */
     int sd;
     unsigned int options;
     const struct optstruct *opts;
@@ -92,12 +120,30 @@ typedef struct client_conn_tag {
     long quota;
     jobgroup_t *group;
     enum mode mode;
+    enum thrmgr_prio priority;
+    unsigned int deadline; /* ms from dispatch, 0 - none */
+    struct timeval deadline_at;
 } client_conn_t;
 
 int command(client_conn_t *conn, int *virus);
 enum commands parse_command(const char *cmd, const char **argument, int oldstyle);
 int execute_or_dispatch_command(client_conn_t *conn, enum commands command, const char *argument);
 
+/* clamd side of a SHMRING, see shared/shmring.h */
+struct shm_ring {
+    pthread_mutex_t mutex;
+    unsigned int refcount; /* the connection and each dispatched slot */
+    char *base;
+    size_t size;
+    struct shmring_slot *slots;
+    uint32_t nslots;
+    uint64_t slot_size;
+    uint64_t data_off;
+};
+
+int shmring_poll(client_conn_t *conn);
+void shmring_release(struct shm_ring *ring);
+
 int conn_reply(const client_conn_t *conn, const char *path, const char *msg, const char *status);
 int conn_reply_single(const client_conn_t *conn, const char *path, const char *status);
 int conn_reply_virus(const client_conn_t *conn, const char *file, const char *virname);
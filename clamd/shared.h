@@ -23,6 +23,7 @@
 #define __SHARED_H
 
 extern short debug_mode, logok;
+extern struct scan_journal *scan_journal;
 
 #ifdef C_LINUX
 #include <sys/types.h>
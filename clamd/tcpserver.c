@@ -148,6 +148,14 @@ int tcpserver(int **lsockets, unsigned int *nlsockets, char *ipaddr, const struc
             logg("!TCP: setsocktopt(SO_REUSEADDR) error: %s\n", strerror(errno));
         }
 
+#ifdef SO_REUSEPORT
+        /* shared with the sockets of the other acceptors, see tcpserver_reuseport() */
+        if(optget(opts, "AcceptThreads")->numarg > 1 &&
+           setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (void *) &yes, sizeof(yes)) == -1) {
+            logg("!TCP: setsocktopt(SO_REUSEPORT) error: %s\n", strerror(errno));
+        }
+#endif
+
 #ifdef IPV6_V6ONLY
         if (p->ai_family == AF_INET6 &&
             setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1) {
@@ -200,3 +208,65 @@ int tcpserver(int **lsockets, unsigned int *nlsockets, char *ipaddr, const struc
 
     return 0;
 }
+
+/* AcceptThreads: copies of the TCP sockets among lsockets, bound to the
+ * same addresses with SO_REUSEPORT, one set for each of the copies extra
+ * acceptors. The sets follow each other in *rsockets. */
+int tcpserver_reuseport(const int *lsockets, unsigned int nlsockets, int **rsockets, unsigned int *nrsockets, unsigned int copies, const struct optstruct *opts)
+{
+#ifdef SO_REUSEPORT
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned int c, i;
+    int sockfd, *t, yes = 1;
+    int backlog = optget(opts, "MaxConnectionQueueLength")->numarg;
+
+    for (c = 0; c < copies; c++) {
+        for (i = 0; i < nlsockets; i++) {
+            addrlen = sizeof(addr);
+            if (getsockname(lsockets[i], (struct sockaddr *)&addr, &addrlen) == -1 ||
+                (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+                continue;
+
+            t = realloc(*rsockets, sizeof(int) * (*nrsockets + 1));
+            if (!(t))
+                return -1;
+            *rsockets = t;
+
+            if ((sockfd = socket(addr.ss_family, SOCK_STREAM, 0)) == -1) {
+                logg("!TCP: socket() error: %s\n", strerror(errno));
+                return -1;
+            }
+            if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void *) &yes, sizeof(yes)) == -1 ||
+                setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (void *) &yes, sizeof(yes)) == -1) {
+                logg("!TCP: setsocktopt(SO_REUSEPORT) error: %s\n", strerror(errno));
+                closesocket(sockfd);
+                return -1;
+            }
+#ifdef IPV6_V6ONLY
+            if (addr.ss_family == AF_INET6 &&
+                setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1) {
+                logg("!TCP: setsocktopt(IPV6_V6ONLY) error: %s\n", strerror(errno));
+            }
+#endif
+            if (bind(sockfd, (struct sockaddr *)&addr, addrlen) == -1 || listen(sockfd, backlog) == -1) {
+                logg("!TCP: Cannot bind a SO_REUSEPORT socket: %s\n", strerror(errno));
+                closesocket(sockfd);
+                return -1;
+            }
+            (*rsockets)[(*nrsockets)++] = sockfd;
+        }
+    }
+    logg("#TCP: %u more listening sockets for AcceptThreads\n", *nrsockets);
+    return 0;
+#else
+    UNUSEDPARAM(lsockets);
+    UNUSEDPARAM(nlsockets);
+    UNUSEDPARAM(rsockets);
+    UNUSEDPARAM(nrsockets);
+    UNUSEDPARAM(copies);
+    UNUSEDPARAM(opts);
+    logg("^TCP: SO_REUSEPORT is not supported here, ignoring AcceptThreads\n");
+    return 0;
+#endif
+}
@@ -25,5 +25,6 @@
 #include "shared/optparser.h"
 
 int tcpserver(int **lsockets, unsigned int *nlsockets, char *ipaddr, const struct optstruct *opts);
+int tcpserver_reuseport(const int *lsockets, unsigned int nlsockets, int **rsockets, unsigned int *nrsockets, unsigned int copies, const struct optstruct *opts);
 
 #endif
@@ -42,6 +42,14 @@
 #ifdef HAVE_MALLINFO
 #include <malloc.h>
 #endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#endif
+#ifdef C_LINUX
+#include <sched.h>
+#endif
 
 /* BSD and HP-UX need a bigger stacksize than the system default */
 #if defined (C_BSD) || defined (C_HPUX) || defined(C_AIX)
@@ -57,15 +65,26 @@ static work_queue_t *work_queue_new(void)
 		return NULL;
 	}
 
-	work_q->head = work_q->tail = NULL;
-	work_q->item_count = 0;
-	work_q->popped = 0;
+	memset(work_q, 0, sizeof(*work_q));
 	return work_q;
 }
 
-static int work_queue_add(work_queue_t *work_q, void *data)
+#define TV_BEFORE(a, b) ((a)->tv_sec < (b)->tv_sec || ((a)->tv_sec == (b)->tv_sec && (a)->tv_usec < (b)->tv_usec))
+
+static int hist_bucket(long long msec)
 {
-	work_item_t *work_item;
+	int bucket;
+
+	for (bucket = 0; msec > 0 && bucket < TASK_HIST_BUCKETS - 1; bucket++)
+		msec >>= 1;
+	return bucket;
+}
+
+/* items with a deadline are kept in deadline order, ahead of the ones
+ * without */
+static int work_queue_add(work_queue_t *work_q, void *data, const struct timeval *deadline)
+{
+	work_item_t *work_item, *prev, *q;
 
 	if (!work_q) {
 		return FALSE;
@@ -78,6 +97,27 @@ static int work_queue_add(work_queue_t *work_q, void *data)
 	work_item->next = NULL;
 	work_item->data = data;
 	gettimeofday(&(work_item->time_queued), NULL);
+	if (deadline) {
+		work_item->deadline = *deadline;
+	} else {
+		work_item->deadline.tv_sec = work_item->deadline.tv_usec = 0;
+	}
+
+	if (deadline && work_q->head) {
+		for (prev = NULL, q = work_q->head; q; prev = q, q = q->next) {
+			if (!q->deadline.tv_sec || TV_BEFORE(deadline, &q->deadline))
+				break;
+		}
+		if (q) {
+			work_item->next = q;
+			if (prev)
+				prev->next = work_item;
+			else
+				work_q->head = work_item;
+			work_q->item_count++;
+			return TRUE;
+		}
+	}
 
 	if (work_q->head == NULL) {
 		work_q->head = work_q->tail = work_item;
@@ -93,6 +133,8 @@ static int work_queue_add(work_queue_t *work_q, void *data)
 static void *work_queue_pop(work_queue_t *work_q)
 {
 	work_item_t *work_item;
+	struct timeval tv_now;
+	long delta;
 	void *data;
 
 	if (!work_q || !work_q->head) {
@@ -100,6 +142,20 @@ static void *work_queue_pop(work_queue_t *work_q)
 	}
 	work_item = work_q->head;
 	data = work_item->data;
+
+	gettimeofday(&tv_now, NULL);
+	delta = tv_now.tv_usec - work_item->time_queued.tv_usec;
+	delta += (tv_now.tv_sec - work_item->time_queued.tv_sec)*1000000;
+	if (delta > 0) {
+		work_q->wait_usec += delta;
+		if (delta > work_q->wait_max_usec)
+			work_q->wait_max_usec = delta;
+	}
+	work_q->wait_hist[hist_bucket(delta / 1000)]++;
+	work_q->served++;
+	if (work_item->deadline.tv_sec && TV_BEFORE(&work_item->deadline, &tv_now))
+		work_q->missed++;
+
 	work_q->head = work_item->next;
 	if (work_q->head == NULL) {
 		work_q->tail = NULL;
@@ -109,6 +165,73 @@ static void *work_queue_pop(work_queue_t *work_q)
 	return data;
 }
 
+static work_deque_t *work_deques_new(int count)
+{
+	work_deque_t *deques;
+	int i;
+
+	deques = (work_deque_t *) calloc(count, sizeof(work_deque_t));
+	if (!deques) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		if (pthread_mutex_init(&deques[i].lock, NULL)) {
+			break;
+		}
+		if (pthread_cond_init(&deques[i].queueable_cond, NULL)) {
+			pthread_mutex_destroy(&deques[i].lock);
+			break;
+		}
+	}
+	if (i < count) {
+		while (i--) {
+			pthread_cond_destroy(&deques[i].queueable_cond);
+			pthread_mutex_destroy(&deques[i].lock);
+		}
+		free(deques);
+		return NULL;
+	}
+	return deques;
+}
+
+static void work_deques_free(work_deque_t *deques, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		pthread_cond_destroy(&deques[i].queueable_cond);
+		pthread_mutex_destroy(&deques[i].lock);
+	}
+	free(deques);
+}
+
+static inline void task_write_begin(struct task_desc *desc)
+{
+	desc->seq++;
+	__sync_synchronize();
+}
+
+static inline void task_write_end(struct task_desc *desc)
+{
+	__sync_synchronize();
+	desc->seq++;
+}
+
+/* copy a slot without stopping its owner, retrying if it was written
+ * in the meantime */
+static void task_read(const struct task_desc *desc, struct task_desc *copy)
+{
+	unsigned seq;
+
+	do {
+		while ((seq = desc->seq) & 1)
+			;
+		__sync_synchronize();
+		memcpy(copy, (const void *)desc, sizeof(*copy));
+		__sync_synchronize();
+	} while (seq != desc->seq);
+}
+
 static struct threadpool_list {
 	threadpool_t *pool;
 	struct threadpool_list *nxt;
@@ -132,7 +255,6 @@ static void add_topools(threadpool_t *t)
 static void remove_frompools(threadpool_t *t)
 {
 	struct threadpool_list *l, *prev;
-	struct task_desc *desc;
 	pthread_mutex_lock(&pools_lock);
 	prev = NULL;
 	l = pools;
@@ -149,13 +271,6 @@ static void remove_frompools(threadpool_t *t)
 	if(l == pools)
 		pools = l->nxt;
 	free(l);
-	desc = t->tasks;
-	while(desc) {
-		struct task_desc *q = desc;
-		desc = desc->nxt;
-		free(q);
-	}
-	t->tasks = NULL;
 	pthread_mutex_unlock(&pools_lock);
 }
 
@@ -191,14 +306,83 @@ static void print_queue(int f, work_queue_t *queue, struct timeval *tv_now)
 		 (unsigned)queue->item_count);
 }
 
+static void print_waits(int f, const char *prio, const work_queue_t *queue)
+{
+    mdprintf(f, "WAIT %s: served %lu deadline_missed %lu avg_wait: %.6f max_wait: %.6f\n",
+	     prio, queue->served, queue->missed,
+	     queue->served ? queue->wait_usec / (1e6 * queue->served) : 0.0,
+	     queue->wait_max_usec / 1e6);
+}
+
+/* Add up the job counters of the slots of pool, merging the histograms
+ * of the same command. The slots are copied one at a time, the totals
+ * are not a snapshot of the whole pool. */
+static void pool_hists(threadpool_t *pool, struct task_hist *hists, unsigned long *jobs, unsigned long long *scanned)
+{
+	struct task_desc task;
+	int i, j, k, b;
+
+	for(i=0;i<pool->thr_max;i++) {
+		task_read(&pool->tasks[i], &task);
+		*jobs += task.jobs;
+		*scanned += task.scanned;
+		for(j=0;j<TASK_HIST_CMDS && (task.hist[j].command || j == TASK_HIST_CMDS - 1);j++) {
+			const char *cmd = task.hist[j].command;
+			for(k=0;k<TASK_HIST_CMDS - 1 && hists[k].command;k++)
+				if(cmd && !strcmp(hists[k].command, cmd))
+					break;
+			if(!cmd)
+				k = TASK_HIST_CMDS - 1;
+			else if(k < TASK_HIST_CMDS - 1)
+				hists[k].command = cmd;
+			for(b=0;b<TASK_HIST_BUCKETS;b++)
+				hists[k].count[b] += task.hist[j].count[b];
+			hists[k].usec += task.hist[j].usec;
+		}
+	}
+}
+
+/* the low priority waits are spread over the deques */
+static void pool_low_waits(threadpool_t *pool, work_queue_t *low)
+{
+	int i, b;
+
+	memset(low, 0, sizeof(*low));
+	for(i=0;i<pool->thr_max;i++) {
+		const work_queue_t *q = &pool->deques[i].queue;
+		low->served += q->served;
+		low->missed += q->missed;
+		low->wait_usec += q->wait_usec;
+		if(q->wait_max_usec > low->wait_max_usec)
+			low->wait_max_usec = q->wait_max_usec;
+		for(b=0;b<TASK_HIST_BUCKETS;b++)
+			low->wait_hist[b] += q->wait_hist[b];
+	}
+}
+
+/* the MEMSTATS line of STATS */
+static void memstats_line(char *buf, size_t size, unsigned pool_cnt, size_t pool_used, size_t pool_total)
+{
+#ifdef HAVE_MALLINFO
+	struct mallinfo inf = mallinfo();
+
+	snprintf(buf, size, "MEMSTATS: heap %.3fM mmap %.3fM used %.3fM free %.3fM releasable %.3fM pools %u pools_used %.3fM pools_total %.3fM\n",
+		 inf.arena/(1024*1024.0), inf.hblkhd/(1024*1024.0),
+		 (inf.usmblks + inf.uordblks)/(1024*1024.0), (inf.fsmblks + inf.fordblks)/(1024*1024.0),
+		 inf.keepcost/(1024*1024.0), pool_cnt,
+		 pool_used/(1024*1024.0), pool_total/(1024*1024.0));
+#else
+	snprintf(buf, size, "MEMSTATS: heap N/A mmap N/A used N/A free N/A releasable N/A pools %u pools_used %.3fM pools_total %.3fM\n",
+		 pool_cnt, pool_used/(1024*1024.0), pool_total/(1024*1024.0));
+#endif
+}
+
 int thrmgr_printstats(int f, char term)
 {
 	struct threadpool_list *l;
 	unsigned cnt, pool_cnt = 0;
 	size_t pool_used = 0, pool_total = 0, seen_cnt = 0, error_flag = 0;
-	float mem_heap = 0, mem_mmap = 0, mem_used = 0, mem_free = 0, mem_releasable = 0;
 	const struct cl_engine **seen = NULL;
-	int has_libc_memstats = 0;
 
 	pthread_mutex_lock(&pools_lock);
 	for(cnt=0,l=pools;l;l=l->nxt) cnt++;
@@ -207,16 +391,19 @@ int thrmgr_printstats(int f, char term)
 		threadpool_t *pool = l->pool;
 		const char *state;
 		struct timeval tv_now;
-		struct task_desc *task;
+		struct task_desc task;
+		struct task_hist hists[TASK_HIST_CMDS];
+		unsigned long jobs = 0;
+		unsigned long long scanned = 0;
+		work_queue_t low;
+		unsigned items;
+		int i, k;
 		cnt = 0;
 
 		if(!pool) {
 			mdprintf(f,"NULL\n\n");
 			continue;
 		}
-		/* now we can access desc->, knowing that they won't get freed
-		 * because the other tasks can't quit while pool_mutex is taken
-		 */
 		switch(pool->state) {
 			case POOL_INVALID:
 				state = "INVALID";
@@ -236,32 +423,67 @@ int thrmgr_printstats(int f, char term)
 				,pool->thr_alive, pool->thr_idle, pool->thr_max,
 				pool->idle_timeout);
 		/* TODO: show both queues */
-		mdprintf(f,"QUEUE: %u items", pool->single_queue->item_count + pool->bulk_queue->item_count);
+		for(i=0,items=pool->single_queue->item_count+pool->high_queue->item_count;i<pool->thr_max;i++)
+			items += pool->deques[i].queue.item_count;
+		mdprintf(f,"QUEUE: %u items", items);
 		gettimeofday(&tv_now, NULL);
-		print_queue(f, pool->bulk_queue, &tv_now);
+		for(i=0;i<pool->thr_max;i++) {
+			pthread_mutex_lock(&pool->deques[i].lock);
+			print_queue(f, &pool->deques[i].queue, &tv_now);
+			pthread_mutex_unlock(&pool->deques[i].lock);
+		}
+		pool_low_waits(pool, &low);
 		print_queue(f, pool->single_queue, &tv_now);
+		print_queue(f, pool->high_queue, &tv_now);
 		mdprintf(f, "\n");
-		for(task = pool->tasks; task; task = task->nxt) {
+		print_waits(f, "HIGH", pool->high_queue);
+		print_waits(f, "NORMAL", pool->single_queue);
+		print_waits(f, "LOW", &low);
+		memset(hists, 0, sizeof(hists));
+		pool_hists(pool, hists, &jobs, &scanned);
+		mdprintf(f, "JOBS: %lu scanned %.3fM\n", jobs, scanned/(1024*1024.0));
+		for(k=0;k<TASK_HIST_CMDS;k++) {
+			if(!hists[k].command && k < TASK_HIST_CMDS - 1)
+				break;
+			for(cnt=0;cnt<TASK_HIST_BUCKETS && !hists[k].count[cnt];cnt++);
+			if(cnt == TASK_HIST_BUCKETS)
+				continue;
+			mdprintf(f, "LATENCY %s:", hists[k].command ? hists[k].command : "OTHER");
+			for(cnt=0;cnt<TASK_HIST_BUCKETS;cnt++) {
+				if(!hists[k].count[cnt])
+					continue;
+				if(cnt < TASK_HIST_BUCKETS - 1)
+					mdprintf(f, " <%ums %lu", 1u << cnt, hists[k].count[cnt]);
+				else
+					mdprintf(f, " >=%ums %lu", 1u << (cnt - 1), hists[k].count[cnt]);
+			}
+			mdprintf(f, "\n");
+		}
+		cnt = 0;
+		for(i=0;i<pool->thr_max;i++) {
 			double delta;
 			size_t used, total;
 
-			delta = tv_now.tv_usec - task->tv.tv_usec;
-			delta += (tv_now.tv_sec - task->tv.tv_sec)*1000000.0;
+			task_read(&pool->tasks[i], &task);
+			if(!task.used)
+				continue;
+			delta = tv_now.tv_usec - task.tv.tv_usec;
+			delta += (tv_now.tv_sec - task.tv.tv_sec)*1000000.0;
 			mdprintf(f,"\t%s %f %s\n",
-					task->command ? task->command : "N/A",
+					task.command ? task.command : "N/A",
 					delta/1e6,
-					task->filename ? task->filename:"");
-			if (task->engine) {
+					task.filename);
+			if (task.engine) {
 				/* we usually have at most 2 engines so a linear
 				 * search is good enough */
-				size_t i;
-				for (i=0;i<seen_cnt;i++) {
-					if (seen[i] == task->engine)
+				size_t e;
+				for (e=0;e<seen_cnt;e++) {
+					if (seen[e] == task.engine)
 						break;
 				}
 				/* we need to count the memusage from the same
 				 * engine only once */
-				if (i == seen_cnt) {
+				if (e == seen_cnt) {
 					const struct cl_engine **s;
 					/* new engine */
 					++seen_cnt;
@@ -271,9 +493,9 @@ int thrmgr_printstats(int f, char term)
 						break;
 					}
 					seen = s;
-					seen[seen_cnt - 1] = task->engine;
+					seen[seen_cnt - 1] = task.engine;
 
-					if (mpool_getstats(task->engine, &used, &total) != -1) {
+					if (mpool_getstats(task.engine, &used, &total) != -1) {
 						pool_used += used;
 						pool_total += total;
 						pool_cnt++;
@@ -284,33 +506,558 @@ int thrmgr_printstats(int f, char term)
 		mdprintf(f,"\n");
 	}
 	free(seen);
-#ifdef HAVE_MALLINFO
-	{
-		struct mallinfo inf = mallinfo();
-		mem_heap = inf.arena/(1024*1024.0);
-		mem_mmap = inf.hblkhd/(1024*1024.0);
-		mem_used = (inf.usmblks + inf.uordblks)/(1024*1024.0);
-		mem_free = (inf.fsmblks + inf.fordblks)/(1024*1024.0);
-		mem_releasable = inf.keepcost/(1024*1024.0);
-		has_libc_memstats=1;
-	}
-#endif
 	if (error_flag) {
 		mdprintf(f, "ERROR: error encountered while formatting statistics\n");
 	} else {
-	    if (has_libc_memstats)
-		mdprintf(f,"MEMSTATS: heap %.3fM mmap %.3fM used %.3fM free %.3fM releasable %.3fM pools %u pools_used %.3fM pools_total %.3fM\n",
-			mem_heap, mem_mmap, mem_used, mem_free, mem_releasable, pool_cnt,
-			pool_used/(1024*1024.0), pool_total/(1024*1024.0));
-	    else
-		mdprintf(f,"MEMSTATS: heap N/A mmap N/A used N/A free N/A releasable N/A pools %u pools_used %.3fM pools_total %.3fM\n",
-			 pool_cnt, pool_used/(1024*1024.0), pool_total/(1024*1024.0));
+		char line[256];
+
+		memstats_line(line, sizeof(line), pool_cnt, pool_used, pool_total);
+		mdprintf(f, "%s", line);
 	}
 	mdprintf(f,"END%c", term);
 	pthread_mutex_unlock(&pools_lock);
 	return 0;
 }
 
+/* SUBSCRIBE: instead of polling STATS, a client hands its connection over
+ * to the publisher thread, which wakes up at the interval each subscriber
+ * asked for and pushes what changed since its previous update:
+ *
+ *	UPDATE <seq> <server time>
+ *	POOLS <count>					when the count changed
+ *	POOL <n> PRIMARY|OTHER live <n> idle <n> max <n> queue <n>
+ *	TASKS <count>					when the tasks changed
+ *	\t<command> <start time> <filename>		for each task
+ *	MEMSTATS: <as in STATS>				when it changed
+ *	END<term>
+ *
+ * The first update has everything. The state is sampled like STATS does,
+ * once for all the subscribers due, and sent without holding any lock;
+ * the sockets are non-blocking, a client which doesn't keep up gets a full
+ * update once it drained its backlog and is dropped when that grows too
+ * large. */
+#define SUB_POOLS_MAX 8
+#define SUB_BACKLOG_MAX (256*1024)
+
+struct sub_pool {
+	int primary;
+	unsigned live, idle, max, queue;
+};
+
+struct sub_state {
+	unsigned npools;
+	struct sub_pool pools[SUB_POOLS_MAX];
+	unsigned ntasks;
+	uint32_t tasks_hash;
+	char *tasks; /* the task lines */
+	size_t tasks_len, tasks_size;
+	char memstats[256];
+};
+
+struct subscriber {
+	int fd;
+	char term;
+	unsigned msec;
+	struct timeval due;
+	unsigned long seq;
+	int full;
+	struct sub_state sent; /* tasks and memstats aren't copied */
+	char *out;
+	size_t out_len, out_size;
+	struct subscriber *next;
+};
+
+static pthread_mutex_t sub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sub_cond = PTHREAD_COND_INITIALIZER;
+static struct subscriber *subs = NULL;
+static int sub_running = 0;
+
+static int sub_append(char **buf, size_t *len, size_t *size, const char *data, size_t n)
+{
+	if (*len + n > *size) {
+		size_t nsize = *size ? *size : 4096;
+		char *b;
+
+		while (nsize < *len + n)
+			nsize *= 2;
+		if (!(b = realloc(*buf, nsize)))
+			return -1;
+		*buf = b;
+		*size = nsize;
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+	return 0;
+}
+
+static void sub_sample(struct sub_state *st)
+{
+	struct threadpool_list *l;
+	struct timeval tv_now;
+	struct task_desc task;
+	const struct cl_engine *seen[8];
+	unsigned seen_cnt = 0, pool_cnt = 0;
+	size_t pool_used = 0, pool_total = 0, used, total;
+	char line[TASK_FILENAME_MAX + 128];
+	int i, n;
+
+	st->npools = st->ntasks = 0;
+	st->tasks_hash = 0;
+	st->tasks_len = 0;
+	gettimeofday(&tv_now, NULL);
+	pthread_mutex_lock(&pools_lock);
+	for (l=pools;l;l=l->nxt) {
+		threadpool_t *pool = l->pool;
+		struct sub_pool *p;
+
+		if (!pool)
+			continue;
+		if (st->npools < SUB_POOLS_MAX) {
+			p = &st->pools[st->npools++];
+			p->primary = !l->nxt;
+			p->live = pool->thr_alive;
+			p->idle = pool->thr_idle;
+			p->max = pool->thr_max;
+			p->queue = pool->single_queue->item_count + pool->high_queue->item_count;
+			for (i=0;i<pool->thr_max;i++)
+				p->queue += pool->deques[i].queue.item_count;
+		}
+		for (i=0;i<pool->thr_max;i++) {
+			const unsigned char *c;
+
+			task_read(&pool->tasks[i], &task);
+			if (!task.used)
+				continue;
+			/* a task is the same as long as its start and command are */
+			st->tasks_hash = st->tasks_hash * 31 + task.tv.tv_sec;
+			st->tasks_hash = st->tasks_hash * 31 + task.tv.tv_usec;
+			for (c = (const unsigned char *)(task.command ? task.command : "N/A"); *c; c++)
+				st->tasks_hash = st->tasks_hash * 31 + *c;
+			n = snprintf(line, sizeof(line), "\t%s %lu.%06lu %s\n",
+				     task.command ? task.command : "N/A",
+				     (unsigned long)task.tv.tv_sec, (unsigned long)task.tv.tv_usec,
+				     task.filename);
+			if (n > 0 && (size_t)n < sizeof(line) &&
+			    !sub_append(&st->tasks, &st->tasks_len, &st->tasks_size, line, n))
+				st->ntasks++;
+			if (task.engine) {
+				unsigned e;
+
+				for (e=0;e<seen_cnt && seen[e] != task.engine;e++);
+				if (e == seen_cnt && seen_cnt < sizeof(seen)/sizeof(seen[0])) {
+					seen[seen_cnt++] = task.engine;
+					if (mpool_getstats(task.engine, &used, &total) != -1) {
+						pool_used += used;
+						pool_total += total;
+						pool_cnt++;
+					}
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&pools_lock);
+	st->tasks_hash = st->tasks_hash * 31 + st->ntasks;
+	memstats_line(st->memstats, sizeof(st->memstats), pool_cnt, pool_used, pool_total);
+}
+
+/* called with sub_lock held, 0 when the update is queued */
+static int sub_update(struct subscriber *sub, const struct sub_state *st, const struct timeval *now)
+{
+	char line[256];
+	size_t start = sub->out_len;
+	unsigned i;
+	int n;
+
+	n = snprintf(line, sizeof(line), "UPDATE %lu %lu.%06lu\n", ++sub->seq,
+		     (unsigned long)now->tv_sec, (unsigned long)now->tv_usec);
+	if (sub_append(&sub->out, &sub->out_len, &sub->out_size, line, n))
+		goto fail;
+	if (sub->full || st->npools != sub->sent.npools) {
+		n = snprintf(line, sizeof(line), "POOLS %u\n", st->npools);
+		if (sub_append(&sub->out, &sub->out_len, &sub->out_size, line, n))
+			goto fail;
+	}
+	for (i=0;i<st->npools;i++) {
+		const struct sub_pool *p = &st->pools[i];
+
+		if (!sub->full && i < sub->sent.npools && !memcmp(p, &sub->sent.pools[i], sizeof(*p)))
+			continue;
+		n = snprintf(line, sizeof(line), "POOL %u %s live %u idle %u max %u queue %u\n", i,
+			     p->primary ? "PRIMARY" : "OTHER", p->live, p->idle, p->max, p->queue);
+		if (sub_append(&sub->out, &sub->out_len, &sub->out_size, line, n))
+			goto fail;
+	}
+	if (sub->full || st->tasks_hash != sub->sent.tasks_hash) {
+		n = snprintf(line, sizeof(line), "TASKS %u\n", st->ntasks);
+		if (sub_append(&sub->out, &sub->out_len, &sub->out_size, line, n) ||
+		    (st->tasks_len && sub_append(&sub->out, &sub->out_len, &sub->out_size, st->tasks, st->tasks_len)))
+			goto fail;
+	}
+	if (sub->full || strcmp(st->memstats, sub->sent.memstats)) {
+		if (sub_append(&sub->out, &sub->out_len, &sub->out_size, st->memstats, strlen(st->memstats)))
+			goto fail;
+	}
+	n = snprintf(line, sizeof(line), "END%c", sub->term);
+	if (sub_append(&sub->out, &sub->out_len, &sub->out_size, line, n))
+		goto fail;
+
+	sub->sent.npools = st->npools;
+	memcpy(sub->sent.pools, st->pools, sizeof(st->pools));
+	sub->sent.tasks_hash = st->tasks_hash;
+	memcpy(sub->sent.memstats, st->memstats, sizeof(st->memstats));
+	sub->full = 0;
+	return 0;
+    fail:
+	sub->out_len = start;
+	return -1;
+}
+
+/* 0 while the subscriber is still there */
+static int sub_flush(struct subscriber *sub)
+{
+	char c;
+	ssize_t n;
+
+	/* the client isn't supposed to send anything, EOF means it left */
+	n = recv(sub->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (!n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		return -1;
+	while (sub->out_len) {
+		n = send(sub->fd, sub->out, sub->out_len, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			break;
+		}
+		memmove(sub->out, sub->out + n, sub->out_len - n);
+		sub->out_len -= n;
+	}
+	return sub->out_len > SUB_BACKLOG_MAX ? -1 : 0;
+}
+
+static void *sub_publisher(void *arg)
+{
+	struct sub_state st;
+	struct subscriber *sub, **prev;
+	struct timeval now, due;
+	struct timespec ts;
+
+	UNUSEDPARAM(arg);
+	memset(&st, 0, sizeof(st));
+	pthread_mutex_lock(&sub_lock);
+	while (subs) {
+		gettimeofday(&now, NULL);
+		due = subs->due;
+		for (sub=subs->next;sub;sub=sub->next)
+			if (TV_BEFORE(&sub->due, &due))
+				due = sub->due;
+		if (TV_BEFORE(&now, &due)) {
+			ts.tv_sec = due.tv_sec;
+			ts.tv_nsec = due.tv_usec * 1000;
+			pthread_cond_timedwait(&sub_cond, &sub_lock, &ts);
+			continue;
+		}
+
+		/* sampled without sub_lock, SUBSCRIBE doesn't wait for it */
+		pthread_mutex_unlock(&sub_lock);
+		sub_sample(&st);
+		pthread_mutex_lock(&sub_lock);
+		gettimeofday(&now, NULL);
+		for (prev=&subs;(sub=*prev);) {
+			if (!TV_BEFORE(&now, &sub->due)) {
+				/* with a backlog there's no point adding to it,
+				 * the client gets everything once it drained it */
+				if (sub->out_len || sub_update(sub, &st, &now))
+					sub->full = 1;
+				sub->due.tv_sec += sub->msec / 1000;
+				sub->due.tv_usec += (sub->msec % 1000) * 1000;
+				if (sub->due.tv_usec >= 1000000) {
+					sub->due.tv_sec++;
+					sub->due.tv_usec -= 1000000;
+				}
+				if (TV_BEFORE(&sub->due, &now)) {
+					sub->due = now;
+					sub->due.tv_usec += (sub->msec % 1000) * 1000;
+					sub->due.tv_sec += sub->msec / 1000 + sub->due.tv_usec / 1000000;
+					sub->due.tv_usec %= 1000000;
+				}
+			}
+			if (sub_flush(sub)) {
+				logg("$SUBSCRIBE: client on fd %d gone\n", sub->fd);
+				*prev = sub->next;
+				shutdown(sub->fd, 2);
+				closesocket(sub->fd);
+				free(sub->out);
+				free(sub);
+				continue;
+			}
+			prev = &sub->next;
+		}
+	}
+	sub_running = 0;
+	pthread_mutex_unlock(&sub_lock);
+	free(st.tasks);
+	return NULL;
+}
+
+/* takes over fd, the caller must neither use nor close it on success */
+int thrmgr_subscribe(int fd, unsigned msec, char term)
+{
+	struct subscriber *sub;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (!(sub = calloc(1, sizeof(*sub))))
+		return -1;
+	sub->fd = fd;
+	sub->term = term;
+	sub->msec = msec;
+	sub->full = 1;
+	gettimeofday(&sub->due, NULL);
+
+	pthread_mutex_lock(&sub_lock);
+	if (!sub_running) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, sub_publisher, NULL)) {
+			pthread_attr_destroy(&attr);
+			pthread_mutex_unlock(&sub_lock);
+			free(sub);
+			return -1;
+		}
+		pthread_attr_destroy(&attr);
+		sub_running = 1;
+	}
+	sub->next = subs;
+	subs = sub;
+	pthread_cond_signal(&sub_cond);
+	pthread_mutex_unlock(&sub_lock);
+	logg("$SUBSCRIBE: fd %d every %u ms\n", fd, msec);
+	return 0;
+}
+
+static void print_hist(int f, const char *name, const char *label, const unsigned long *count, unsigned long long usec)
+{
+    unsigned long total = 0;
+    int b;
+
+    for (b = 0; b < TASK_HIST_BUCKETS - 1; b++) {
+	total += count[b];
+	mdprintf(f, "%s_bucket{%s,le=\"%g\"} %lu\n", name, label, (1u << b) / 1e3, total);
+    }
+    total += count[b];
+    mdprintf(f, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, label, total);
+    mdprintf(f, "%s_sum{%s} %.6f\n", name, label, usec / 1e6);
+    mdprintf(f, "%s_count{%s} %lu\n", name, label, total);
+}
+
+/* the pool part of METRICS, in the Prometheus text format; nothing here
+ * takes a lock the workers use */
+int thrmgr_printmetrics(int f)
+{
+	struct threadpool_list *l;
+	struct task_hist hists[TASK_HIST_CMDS];
+	work_queue_t waits[3];
+	static const char *prio_names[3] = { "high", "normal", "low" };
+	unsigned long jobs = 0, missed = 0;
+	unsigned long long scanned = 0;
+	unsigned live = 0, idle = 0, max = 0, limit = 0, items = 0;
+	char label[64];
+	int i, b, k;
+
+	memset(hists, 0, sizeof(hists));
+	memset(waits, 0, sizeof(waits));
+	pthread_mutex_lock(&pools_lock);
+	for(l=pools;l;l=l->nxt) {
+		threadpool_t *pool = l->pool;
+		work_queue_t low;
+
+		if(!pool)
+			continue;
+		live += pool->thr_alive;
+		idle += pool->thr_idle;
+		max += pool->thr_max;
+		limit += pool->thr_limit;
+		items += pool->single_queue->item_count + pool->high_queue->item_count;
+		for(i=0;i<pool->thr_max;i++)
+			items += pool->deques[i].queue.item_count;
+		pool_low_waits(pool, &low);
+		for(i=0;i<3;i++) {
+			const work_queue_t *q = i == 0 ? pool->high_queue : i == 1 ? pool->single_queue : &low;
+			waits[i].served += q->served;
+			waits[i].wait_usec += q->wait_usec;
+			missed += q->missed;
+			for(b=0;b<TASK_HIST_BUCKETS;b++)
+				waits[i].wait_hist[b] += q->wait_hist[b];
+		}
+		pool_hists(pool, hists, &jobs, &scanned);
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	mdprintf(f, "# HELP clamd_threads Worker threads.\n");
+	mdprintf(f, "# TYPE clamd_threads gauge\n");
+	mdprintf(f, "clamd_threads{state=\"live\"} %u\n", live);
+	mdprintf(f, "clamd_threads{state=\"idle\"} %u\n", idle);
+	mdprintf(f, "clamd_threads{state=\"max\"} %u\n", max);
+	mdprintf(f, "clamd_threads{state=\"limit\"} %u\n", limit);
+	mdprintf(f, "# HELP clamd_queue_items Jobs waiting in the queues.\n");
+	mdprintf(f, "# TYPE clamd_queue_items gauge\n");
+	mdprintf(f, "clamd_queue_items %u\n", items);
+	mdprintf(f, "# HELP clamd_queue_wait_seconds Time the jobs waited in the queue.\n");
+	mdprintf(f, "# TYPE clamd_queue_wait_seconds histogram\n");
+	for(i=0;i<3;i++) {
+	    snprintf(label, sizeof(label), "priority=\"%s\"", prio_names[i]);
+	    print_hist(f, "clamd_queue_wait_seconds", label, waits[i].wait_hist, waits[i].wait_usec);
+	}
+	mdprintf(f, "# HELP clamd_deadline_missed_total Jobs started after their deadline.\n");
+	mdprintf(f, "# TYPE clamd_deadline_missed_total counter\n");
+	mdprintf(f, "clamd_deadline_missed_total %lu\n", missed);
+	mdprintf(f, "# HELP clamd_job_seconds Time spent on the jobs of each command.\n");
+	mdprintf(f, "# TYPE clamd_job_seconds histogram\n");
+	for(k=0;k<TASK_HIST_CMDS;k++) {
+	    if(!hists[k].command && k < TASK_HIST_CMDS - 1)
+		break;
+	    for(b=0;b<TASK_HIST_BUCKETS && !hists[k].count[b];b++);
+	    if(b == TASK_HIST_BUCKETS)
+		continue;
+	    snprintf(label, sizeof(label), "command=\"%s\"", hists[k].command ? hists[k].command : "OTHER");
+	    print_hist(f, "clamd_job_seconds", label, hists[k].count, hists[k].usec);
+	}
+	mdprintf(f, "# HELP clamd_scanned_bytes_total Bytes of the files and streams scanned.\n");
+	mdprintf(f, "# TYPE clamd_scanned_bytes_total counter\n");
+	mdprintf(f, "clamd_scanned_bytes_total %llu\n", scanned);
+	return 0;
+}
+
+static const char *sample_type(const struct thrmgr_sample *s, unsigned int i)
+{
+	return s->types[i] ? s->types[i] : "CL_TYPE_ANY";
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	const struct thrmgr_sample *x = a, *y = b;
+	unsigned int i, depth;
+	int c;
+
+	if (x->depth != y->depth)
+		return x->depth < y->depth ? -1 : 1;
+	if (x->phase != y->phase)
+		return x->phase < y->phase ? -1 : 1;
+	depth = x->depth < CL_PROBE_DEPTH ? x->depth : CL_PROBE_DEPTH;
+	for (i = 0; i < depth; i++)
+		if ((c = strcmp(sample_type(x, i), sample_type(y, i))))
+			return c;
+	return 0;
+}
+
+struct sample_stack {
+	const struct thrmgr_sample *sample;
+	unsigned long count;
+};
+
+static int stack_cmp(const void *a, const void *b)
+{
+	const struct sample_stack *x = a, *y = b;
+
+	return x->count == y->count ? 0 : x->count > y->count ? -1 : 1;
+}
+
+/* PROFILE: the scan stacks in the sample rings, counted in the folded
+ * format of the flame graph tools, one "type;type;...;phase count" line
+ * per stack, busiest first */
+int thrmgr_printprofile(int f, char term)
+{
+	static const char *phase_names[] = { "idle", "parse", "match" };
+	struct threadpool_list *l;
+	struct thrmgr_sample *samples = NULL, *tmp;
+	struct sample_stack *stacks = NULL;
+	unsigned long long head, first, i;
+	unsigned long count = 0, nstacks = 0, k;
+	unsigned int j, depth;
+	time_t oldest = 0;
+	int msec = 0;
+
+	pthread_mutex_lock(&pools_lock);
+	for(l=pools;l;l=l->nxt) {
+		threadpool_t *pool = l->pool;
+
+		if(!pool || !pool->sample_msec)
+			continue;
+		msec = pool->sample_msec;
+		head = pool->sample_head;
+		__sync_synchronize();
+		first = head > THRMGR_SAMPLES ? head - THRMGR_SAMPLES : 0;
+		if(head == first)
+			continue;
+		if(!(tmp = realloc(samples, (count + head - first) * sizeof(*samples)))) {
+			count = 0;
+			break;
+		}
+		samples = tmp;
+		for(i=first;i<head;i++)
+			samples[count + i - first] = pool->samples[i % THRMGR_SAMPLES];
+		__sync_synchronize();
+		/* the sampler went on meanwhile, drop what it overwrote */
+		i = pool->sample_head;
+		if(i >= first + THRMGR_SAMPLES) {
+			i = i - THRMGR_SAMPLES + 1 - first;
+			if(i > head - first)
+				i = head - first;
+			memmove(&samples[count], &samples[count + i], (head - first - i) * sizeof(*samples));
+			count += head - first - i;
+		} else
+			count += head - first;
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	if(!msec) {
+		mdprintf(f, "SAMPLING DISABLED\nEND%c", term);
+		free(samples);
+		return 0;
+	}
+	if(count && !(stacks = malloc(count * sizeof(*stacks)))) {
+		mdprintf(f, "ERROR: out of memory\nEND%c", term);
+		free(samples);
+		return 0;
+	}
+	if(count) {
+		qsort(samples, count, sizeof(*samples), sample_cmp);
+		for(k=0;k<count;k++) {
+			if(!oldest || samples[k].time < oldest)
+				oldest = samples[k].time;
+			if(nstacks && !sample_cmp(stacks[nstacks - 1].sample, &samples[k])) {
+				stacks[nstacks - 1].count++;
+				continue;
+			}
+			stacks[nstacks].sample = &samples[k];
+			stacks[nstacks++].count = 1;
+		}
+		qsort(stacks, nstacks, sizeof(*stacks), stack_cmp);
+	}
+
+	mdprintf(f, "SAMPLES: %lu every %dms over %lus\n", count, msec, oldest ? (unsigned long)(time(NULL) - oldest) : 0UL);
+	for(k=0;k<nstacks;k++) {
+		const struct thrmgr_sample *s = stacks[k].sample;
+		char line[CL_PROBE_DEPTH * 32 + 64];
+		size_t len = 0;
+
+		depth = s->depth < CL_PROBE_DEPTH ? s->depth : CL_PROBE_DEPTH;
+		for(j=0;j<depth;j++)
+			len += snprintf(line + len, sizeof(line) - len, "%s;", sample_type(s, j));
+		if(s->depth > CL_PROBE_DEPTH)
+			len += snprintf(line + len, sizeof(line) - len, "...;");
+		snprintf(line + len, sizeof(line) - len, "%s", s->phase < 3 ? phase_names[s->phase] : "unknown");
+		mdprintf(f, "%s %lu\n", line, stacks[k].count);
+	}
+	mdprintf(f, "END%c", term);
+	free(stacks);
+	free(samples);
+	return 0;
+}
+
 void thrmgr_destroy(threadpool_t *threadpool)
 {
 	if (!threadpool) {
@@ -351,11 +1098,16 @@ void thrmgr_destroy(threadpool_t *threadpool)
 	pthread_mutex_destroy(&(threadpool->pool_mutex));
 	pthread_cond_destroy(&(threadpool->idle_cond));
 	pthread_cond_destroy(&(threadpool->queueable_single_cond));
-	pthread_cond_destroy(&(threadpool->queueable_bulk_cond));
 	pthread_cond_destroy(&(threadpool->pool_cond));
 	pthread_attr_destroy(&(threadpool->pool_attr));
 	free(threadpool->single_queue);
-	free(threadpool->bulk_queue);
+	free(threadpool->high_queue);
+	if (threadpool->sample_msec)
+		pthread_join(threadpool->sampler, NULL);
+	free(threadpool->samples);
+	work_deques_free(threadpool->deques, threadpool->thr_max);
+	free(threadpool->tasks);
+	free(threadpool->cpus);
 	free(threadpool);
 	return;
 }
@@ -381,12 +1133,28 @@ threadpool_t *thrmgr_new(int max_threads, int idle_timeout, int max_queue, void
 		free(threadpool);
 		return NULL;
 	}
-	threadpool->bulk_queue = work_queue_new();
-	if (!threadpool->bulk_queue) {
+	threadpool->high_queue = work_queue_new();
+	if (!threadpool->high_queue) {
 		free(threadpool->single_queue);
 		free(threadpool);
 		return NULL;
 	}
+	threadpool->deques = work_deques_new(max_threads);
+	if (!threadpool->deques) {
+		free(threadpool->single_queue);
+		free(threadpool->high_queue);
+		free(threadpool);
+		return NULL;
+	}
+	threadpool->tasks = (struct task_desc *) calloc(max_threads, sizeof(struct task_desc));
+	if (!threadpool->tasks) {
+		work_deques_free(threadpool->deques, max_threads);
+		free(threadpool->single_queue);
+		free(threadpool->high_queue);
+		free(threadpool);
+		return NULL;
+	}
+	threadpool->bulk_popped = 0;
 
 	threadpool->queue_max = max_queue;
 
@@ -395,12 +1163,24 @@ threadpool_t *thrmgr_new(int max_threads, int idle_timeout, int max_queue, void
 	threadpool->thr_idle = 0;
 	threadpool->thr_multiscan = 0;
 	threadpool->idle_timeout = idle_timeout;
+	threadpool->thr_min = 0;
+	threadpool->thr_limit = max_threads;
+	threadpool->ncpu = 1;
+	threadpool->adapt_busy = 0;
+	threadpool->adapt_cpu = 0;
+	threadpool->cpus = NULL;
+	threadpool->sample_msec = 0;
+	threadpool->samples = NULL;
+	threadpool->sample_head = 0;
+	threadpool->cpus_count = 0;
+	threadpool->cpus_per_thread = 0;
 	threadpool->handler = handler;
-	threadpool->tasks = NULL;
 
 	if(pthread_mutex_init(&(threadpool->pool_mutex), NULL)) {
 		free(threadpool->single_queue);
-		free(threadpool->bulk_queue);
+		free(threadpool->high_queue);
+		work_deques_free(threadpool->deques, max_threads);
+		free(threadpool->tasks);
 		free(threadpool);
 		return NULL;
 	}
@@ -408,7 +1188,9 @@ threadpool_t *thrmgr_new(int max_threads, int idle_timeout, int max_queue, void
 	if (pthread_cond_init(&(threadpool->pool_cond), NULL) != 0) {
 		pthread_mutex_destroy(&(threadpool->pool_mutex));
 		free(threadpool->single_queue);
-		free(threadpool->bulk_queue);
+		free(threadpool->high_queue);
+		work_deques_free(threadpool->deques, max_threads);
+		free(threadpool->tasks);
 		free(threadpool);
 		return NULL;
 	}
@@ -417,54 +1199,48 @@ threadpool_t *thrmgr_new(int max_threads, int idle_timeout, int max_queue, void
 		pthread_cond_destroy(&(threadpool->pool_cond));
 		pthread_mutex_destroy(&(threadpool->pool_mutex));
 		free(threadpool->single_queue);
-		free(threadpool->bulk_queue);
-		free(threadpool);
-		return NULL;
-	}
-
-	if (pthread_cond_init(&(threadpool->queueable_bulk_cond), NULL) != 0) {
-		pthread_cond_destroy(&(threadpool->queueable_single_cond));
-		pthread_cond_destroy(&(threadpool->pool_cond));
-		pthread_mutex_destroy(&(threadpool->pool_mutex));
-		free(threadpool->single_queue);
-		free(threadpool->bulk_queue);
+		free(threadpool->high_queue);
+		work_deques_free(threadpool->deques, max_threads);
+		free(threadpool->tasks);
 		free(threadpool);
 		return NULL;
 	}
 
-
 	if (pthread_cond_init(&(threadpool->idle_cond),NULL) != 0)  {
 		pthread_cond_destroy(&(threadpool->queueable_single_cond));
-		pthread_cond_destroy(&(threadpool->queueable_bulk_cond));
 		pthread_cond_destroy(&(threadpool->pool_cond));
 		pthread_mutex_destroy(&(threadpool->pool_mutex));
 		free(threadpool->single_queue);
-		free(threadpool->bulk_queue);
+		free(threadpool->high_queue);
+		work_deques_free(threadpool->deques, max_threads);
+		free(threadpool->tasks);
 		free(threadpool);
 		return NULL;
 	}
 
 	if (pthread_attr_init(&(threadpool->pool_attr)) != 0) {
 		pthread_cond_destroy(&(threadpool->queueable_single_cond));
-		pthread_cond_destroy(&(threadpool->queueable_bulk_cond));
 		pthread_cond_destroy(&(threadpool->idle_cond));
 		pthread_cond_destroy(&(threadpool->pool_cond));
 		pthread_mutex_destroy(&(threadpool->pool_mutex));
 		free(threadpool->single_queue);
-		free(threadpool->bulk_queue);
+		free(threadpool->high_queue);
+		work_deques_free(threadpool->deques, max_threads);
+		free(threadpool->tasks);
 		free(threadpool);
 		return NULL;
 	}
 
 	if (pthread_attr_setdetachstate(&(threadpool->pool_attr), PTHREAD_CREATE_DETACHED) != 0) {
 		pthread_cond_destroy(&(threadpool->queueable_single_cond));
-		pthread_cond_destroy(&(threadpool->queueable_bulk_cond));
 		pthread_attr_destroy(&(threadpool->pool_attr));
 		pthread_cond_destroy(&(threadpool->idle_cond));
 		pthread_cond_destroy(&(threadpool->pool_cond));
 		pthread_mutex_destroy(&(threadpool->pool_mutex));
 		free(threadpool->single_queue);
-		free(threadpool->bulk_queue);
+		free(threadpool->high_queue);
+		work_deques_free(threadpool->deques, max_threads);
+		free(threadpool->tasks);
 		free(threadpool);
 		return NULL;
 	}
@@ -490,6 +1266,216 @@ threadpool_t *thrmgr_new(int max_threads, int idle_timeout, int max_queue, void
 	return threadpool;
 }
 
+/* let thrmgr_adapt() size the pool between min_threads and thr_max */
+void thrmgr_setadaptive(threadpool_t *threadpool, int min_threads)
+{
+	int ncpu = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+#endif
+	pthread_mutex_lock(&threadpool->pool_mutex);
+	if (threadpool->cpus)
+		ncpu = threadpool->cpus_count;
+	if (min_threads < 1)
+		min_threads = 1;
+	if (min_threads > threadpool->thr_max)
+		min_threads = threadpool->thr_max;
+	threadpool->thr_min = min_threads;
+	threadpool->ncpu = ncpu;
+	/* start as if the jobs were CPU bound */
+	threadpool->thr_limit = ncpu < min_threads ? min_threads :
+		ncpu > threadpool->thr_max ? threadpool->thr_max : ncpu;
+	gettimeofday(&threadpool->adapt_tv, NULL);
+	pthread_mutex_unlock(&threadpool->pool_mutex);
+}
+
+/* copy a probe without stopping its owner; gives up rather than waiting
+ * for a worker that keeps writing it */
+static int probe_read(const struct cl_scan_probe *probe, struct cl_scan_probe *copy)
+{
+	unsigned seq;
+	int tries;
+
+	for (tries = 0; tries < 8; tries++) {
+		if ((seq = probe->seq) & 1)
+			continue;
+		__sync_synchronize();
+		memcpy(copy, (const void *)probe, sizeof(*copy));
+		__sync_synchronize();
+		if (seq == probe->seq)
+			return 0;
+	}
+	return -1;
+}
+
+/* the sample ring's only writer */
+static void *thrmgr_sampler(void *arg)
+{
+	threadpool_t *pool = (threadpool_t *) arg;
+	struct cl_scan_probe probe;
+	struct thrmgr_sample *sample;
+	struct timespec ts;
+	unsigned int depth;
+	time_t now;
+	int i;
+
+	ts.tv_sec = pool->sample_msec / 1000;
+	ts.tv_nsec = (pool->sample_msec % 1000) * 1000000L;
+	while (pool->state == POOL_VALID) {
+		nanosleep(&ts, NULL);
+		now = time(NULL);
+		for (i = 0; i < pool->thr_max; i++) {
+			if (probe_read(&pool->tasks[i].probe, &probe) || !probe.depth)
+				continue;
+			sample = &pool->samples[pool->sample_head % THRMGR_SAMPLES];
+			sample->time = now;
+			sample->depth = probe.depth > 0xffff ? 0xffff : probe.depth;
+			sample->phase = probe.phase;
+			depth = probe.depth < CL_PROBE_DEPTH ? probe.depth : CL_PROBE_DEPTH;
+			memcpy(sample->types, probe.types, depth * sizeof(*sample->types));
+			__sync_synchronize();
+			pool->sample_head++;
+		}
+	}
+	return NULL;
+}
+
+/* sample the scan stacks of the busy workers every msec milliseconds, see
+ * thrmgr_printprofile(); to be called before the first dispatch, as the
+ * workers register their probes when they start */
+int thrmgr_setsampling(threadpool_t *threadpool, int msec)
+{
+	if (msec <= 0)
+		return 0;
+	if (!(threadpool->samples = calloc(THRMGR_SAMPLES, sizeof(*threadpool->samples)))) {
+		logg("!thrmgr_setsampling: can't allocate the sample ring\n");
+		return -1;
+	}
+	threadpool->sample_msec = msec;
+	if (pthread_create(&threadpool->sampler, NULL, thrmgr_sampler, threadpool)) {
+		logg("!thrmgr_setsampling: can't start the sampler thread\n");
+		threadpool->sample_msec = 0;
+		free(threadpool->samples);
+		threadpool->samples = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+#if defined(C_LINUX) && defined(CPU_SETSIZE)
+/* parse a CPU list such as "0-3,8,10-11" */
+static int *parse_cpulist(const char *list, int *count)
+{
+	int *cpus = NULL, *tmp, n = 0;
+	long first, last;
+	const char *p = list;
+	char *end;
+
+	while (*p) {
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			break;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+				break;
+		}
+		if (last >= CPU_SETSIZE)
+			break;
+		tmp = (int *) realloc(cpus, (n + last - first + 1) * sizeof(int));
+		if (!tmp)
+			break;
+		cpus = tmp;
+		while (first <= last)
+			cpus[n++] = first++;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			break;
+		p = end;
+	}
+	if (*p || !n) {
+		free(cpus);
+		return NULL;
+	}
+	*count = n;
+	return cpus;
+}
+#endif
+
+/* Run the workers on the CPUs in cpulist, each on its own CPU with
+ * per_thread: worker slot i gets the i-th CPU of the list, so the first
+ * CPUs listed are the busiest. The CPUs the process can't use are dropped. */
+int thrmgr_setaffinity(threadpool_t *threadpool, const char *cpulist, int per_thread)
+{
+#if defined(C_LINUX) && defined(CPU_SETSIZE)
+	cpu_set_t allowed;
+	int *cpus, count, i, n = 0;
+
+	if (!(cpus = parse_cpulist(cpulist, &count))) {
+		logg("!Invalid CPU list: %s\n", cpulist);
+		return -1;
+	}
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (i = 0; i < count; i++) {
+			if (CPU_ISSET(cpus[i], &allowed))
+				cpus[n++] = cpus[i];
+			else
+				logg("^CPU %d is not available, ignored\n", cpus[i]);
+		}
+	} else {
+		n = count;
+	}
+	if (!n) {
+		logg("!None of the CPUs in %s is available\n", cpulist);
+		free(cpus);
+		return -1;
+	}
+
+	pthread_mutex_lock(&threadpool->pool_mutex);
+	free(threadpool->cpus);
+	threadpool->cpus = cpus;
+	threadpool->cpus_count = n;
+	threadpool->cpus_per_thread = per_thread;
+	pthread_mutex_unlock(&threadpool->pool_mutex);
+	return 0;
+#else
+	UNUSEDPARAM(threadpool);
+	UNUSEDPARAM(cpulist);
+	UNUSEDPARAM(per_thread);
+	logg("!Setting the CPU affinity of the threads is not supported on this system\n");
+	return -1;
+#endif
+}
+
+/* thread pool mutex must be held on entry, after deque_attach() */
+static void thrmgr_pin(threadpool_t *pool, work_deque_t *self)
+{
+#if defined(C_LINUX) && defined(CPU_SETSIZE)
+	cpu_set_t set;
+	int i, ret;
+
+	if (!pool->cpus)
+		return;
+	CPU_ZERO(&set);
+	if (pool->cpus_per_thread && self) {
+		CPU_SET(pool->cpus[(self - pool->deques) % pool->cpus_count], &set);
+	} else {
+		for (i = 0; i < pool->cpus_count; i++)
+			CPU_SET(pool->cpus[i], &set);
+	}
+	if ((ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
+		logg("^Can't set the CPU affinity of a worker: %s\n", strerror(ret));
+#else
+	UNUSEDPARAM(pool);
+	UNUSEDPARAM(self);
+#endif
+}
+
 static pthread_key_t stats_tls_key;
 static pthread_once_t stats_tls_key_once = PTHREAD_ONCE_INIT;
 
@@ -500,7 +1486,7 @@ static void stats_tls_key_alloc(void)
 
 static const char *IDLE_TASK = "IDLE";
 
-/* no mutex is needed, we are using  thread local variable */
+/* no mutex is needed, only the owner thread writes to its slot */
 void thrmgr_setactivetask(const char *filename, const char* cmd)
 {
 	struct task_desc *desc;
@@ -508,13 +1494,22 @@ void thrmgr_setactivetask(const char *filename, const char* cmd)
 	desc = pthread_getspecific(stats_tls_key);
 	if(!desc)
 		return;
-	desc->filename = filename;
-	if(cmd) {
-		if(cmd == IDLE_TASK && desc->command == cmd)
-			return;
+	if(cmd == IDLE_TASK && desc->command == cmd && !filename && !desc->filename[0])
+		return;
+	task_write_begin(desc);
+	if(filename) {
+		size_t len = strlen(filename);
+		if(len >= sizeof(desc->filename))
+			len = sizeof(desc->filename) - 1;
+		memcpy(desc->filename, filename, len);
+		desc->filename[len] = '\0';
+	} else
+		desc->filename[0] = '\0';
+	if(cmd && (cmd != IDLE_TASK || desc->command != cmd)) {
 		desc->command = cmd;
 		gettimeofday(&desc->tv, NULL);
 	}
+	task_write_end(desc);
 }
 
 void thrmgr_setactiveengine(const struct cl_engine *engine)
@@ -524,125 +1519,374 @@ void thrmgr_setactiveengine(const struct cl_engine *engine)
 	desc = pthread_getspecific(stats_tls_key);
 	if(!desc)
 		return;
+	task_write_begin(desc);
 	desc->engine = engine;
+	task_write_end(desc);
 }
 
-/* thread pool mutex must be held on entry */
-static void stats_init(threadpool_t *pool)
+void thrmgr_addscanned(unsigned long long bytes)
 {
-	struct task_desc *desc = calloc(1, sizeof(*desc));
+	struct task_desc *desc;
+	pthread_once(&stats_tls_key_once, stats_tls_key_alloc);
+	desc = pthread_getspecific(stats_tls_key);
 	if(!desc)
 		return;
+	task_write_begin(desc);
+	desc->scanned += bytes;
+	task_write_end(desc);
+}
+
+/* CPU time used by the calling thread, -1 if the system can't tell */
+static long long thread_cputime(void)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage ru;
+
+	if(getrusage(RUSAGE_THREAD, &ru) == 0)
+		return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+			ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+	return -1;
+}
+
+/* account a finished job to the command it ran last; cpu_start is
+ * the thread_cputime() at the start of the job, -1 if not measured */
+static void task_jobdone(const struct timeval *start, long long cpu_start)
+{
+	struct task_desc *desc;
+	struct task_hist *hist;
+	struct timeval tv_now;
+	long long usec, cpu = -1;
+	int i;
+
 	pthread_once(&stats_tls_key_once, stats_tls_key_alloc);
-	pthread_setspecific(stats_tls_key, desc);
-	if(!pool->tasks)
-		pool->tasks = desc;
-	else {
-		desc->nxt = pool->tasks;
-		pool->tasks->prv = desc;
-		pool->tasks = desc;
+	if(!(desc = pthread_getspecific(stats_tls_key)))
+		return;
+	gettimeofday(&tv_now, NULL);
+	usec = (tv_now.tv_sec - start->tv_sec) * 1000000LL + tv_now.tv_usec - start->tv_usec;
+	if(usec < 0)
+		usec = 0;
+	if(cpu_start >= 0 && (cpu = thread_cputime()) >= 0)
+		cpu -= cpu_start;
+	/* without a measure the job counts as CPU bound */
+	if(cpu < 0 || cpu > usec)
+		cpu = usec;
+	/* the command names are string constants, comparing the pointers
+	 * is enough; the last entry collects the overflow */
+	for(i = 0; i < TASK_HIST_CMDS - 1; i++) {
+		hist = &desc->hist[i];
+		if(!hist->command || hist->command == desc->command)
+			break;
 	}
+	hist = &desc->hist[i];
+	task_write_begin(desc);
+	if(i < TASK_HIST_CMDS - 1)
+		hist->command = desc->command;
+	hist->count[hist_bucket(usec / 1000)]++;
+	hist->usec += usec;
+	desc->busy_usec += usec;
+	desc->cpu_usec += cpu;
+	desc->jobs++;
+	task_write_end(desc);
+}
+
+/* thread pool mutex must be held on entry, after deque_attach() */
+static void stats_init(threadpool_t *pool, work_deque_t *self)
+{
+	struct task_desc *desc;
+	if(!self)
+		return;
+	desc = &pool->tasks[self - pool->deques];
+	pthread_once(&stats_tls_key_once, stats_tls_key_alloc);
+	pthread_setspecific(stats_tls_key, desc);
+	task_write_begin(desc);
+	desc->used = 1;
+	desc->filename[0] = '\0';
+	desc->command = NULL;
+	desc->engine = NULL;
+	task_write_end(desc);
+	if(pool->sample_msec)
+		cl_scan_probe_register(&desc->probe);
 }
 
 /* thread pool mutex must be held on entry */
-static void stats_destroy(threadpool_t *pool)
+static void stats_destroy(void)
 {
 	struct task_desc *desc = pthread_getspecific(stats_tls_key);
 	if(!desc)
 		return;
-	pthread_mutex_lock(&pools_lock);
-	if(desc->prv)
-		desc->prv->nxt = desc->nxt;
-	if(desc->nxt)
-		desc->nxt->prv = desc->prv;
-	if(pool->tasks == desc)
-		pool->tasks = desc->nxt;
-	free(desc);
+	task_write_begin(desc);
+	desc->used = 0;
+	desc->engine = NULL;
+	task_write_end(desc);
 	pthread_setspecific(stats_tls_key, NULL);
-	pthread_mutex_unlock(&pools_lock);
+	cl_scan_probe_register(NULL);
 }
 
-static inline int thrmgr_contended(threadpool_t *pool, int bulk)
+static inline int thrmgr_contended(threadpool_t *pool)
 {
-    /* don't allow bulk items to exceed 50% of queue, so that
-     * non-bulk items get a chance to be in the queue */
-    if (bulk && pool->bulk_queue->item_count >= pool->queue_max/2)
-	return 1;
-    return pool->bulk_queue->item_count + pool->single_queue->item_count
+    /* bulk items are bounded per deque, see thrmgr_dispatch_bulk() */
+    return pool->single_queue->item_count + pool->high_queue->item_count
 	+ pool->thr_alive - pool->thr_idle >= pool->queue_max;
 }
 
+/* workers allowed to run: a MULTISCAN holds one while its jobs run, keep
+ * room for them whatever the adaptive limit says */
+static inline int thrmgr_limit(threadpool_t *pool)
+{
+    int floor = pool->thr_multiscan + 2;
+
+    if (pool->thr_limit >= floor)
+	return pool->thr_limit;
+    return floor < pool->thr_max ? floor : pool->thr_max;
+}
+
+#define ADAPT_INTERVAL 1000000 /* usec */
+#define ADAPT_MAX_PER_CPU 16
+
+/* Adaptive sizing: about once a second, move thr_limit towards the number
+ * of workers that keeps the CPUs busy. Jobs that spend a fraction r of
+ * their time on the CPU need ncpu / r workers for that. While jobs are
+ * waiting and the CPUs still have room, the limit grows past this estimate;
+ * it shrinks back towards it when the CPUs are saturated or nothing waits.
+ * The surplus workers exit as they go idle.
+ * pool_mutex must be held on entry. */
+static void thrmgr_adapt(threadpool_t *pool)
+{
+    struct task_desc desc;
+    struct timeval tv_now;
+    unsigned long long busy = 0, cpu = 0;
+    long long elapsed, util;
+    int i, want, limit, step, backlog;
+
+    if (!pool->thr_min)
+	return;
+    gettimeofday(&tv_now, NULL);
+    elapsed = (tv_now.tv_sec - pool->adapt_tv.tv_sec) * 1000000LL + tv_now.tv_usec - pool->adapt_tv.tv_usec;
+    if (elapsed >= 0 && elapsed < ADAPT_INTERVAL)
+	return;
+    pool->adapt_tv = tv_now;
+
+    for (i = 0; i < pool->thr_max; i++) {
+	task_read(&pool->tasks[i], &desc);
+	busy += desc.busy_usec;
+	cpu += desc.cpu_usec;
+    }
+    busy -= pool->adapt_busy;
+    cpu -= pool->adapt_cpu;
+    pool->adapt_busy += busy;
+    pool->adapt_cpu += cpu;
+    /* no job finished, nothing to learn from */
+    if (!busy || elapsed <= 0)
+	return;
+
+    if (cpu * ADAPT_MAX_PER_CPU < busy)
+	want = pool->ncpu * ADAPT_MAX_PER_CPU;
+    else
+	want = (pool->ncpu * busy + cpu - 1) / cpu;
+    /* permille of the CPUs used by the finished jobs */
+    util = cpu * 1000 / (elapsed * pool->ncpu);
+
+    /* the deques are read without their locks, close enough */
+    backlog = pool->single_queue->item_count + pool->high_queue->item_count;
+    for (i = 0; i < pool->thr_max; i++)
+	backlog += pool->deques[i].queue.item_count;
+
+    step = pool->ncpu > 1 ? pool->ncpu / 2 : 1;
+    if (thrmgr_contended(pool))
+	step *= 2;
+    limit = pool->thr_limit;
+    if (backlog && util < 900) {
+	if (limit + step > want)
+	    want = limit + step;
+	limit = want;
+    } else if (limit > want) {
+	limit = limit - step > want ? limit - step : want;
+    }
+    if (limit < pool->thr_min)
+	limit = pool->thr_min;
+    if (limit > pool->thr_max)
+	limit = pool->thr_max;
+
+    if (limit != pool->thr_limit) {
+	logg("$THRMGR: worker limit %d -> %d (cpu %lld.%lld%%, backlog %d)\n",
+	     pool->thr_limit, limit, util / 10, util % 10, backlog);
+	pool->thr_limit = limit;
+    }
+}
+
+static pthread_key_t deque_tls_key;
+static pthread_once_t deque_tls_key_once = PTHREAD_ONCE_INIT;
+
+static void deque_tls_key_alloc(void)
+{
+	pthread_key_create(&deque_tls_key, NULL);
+}
+
+/* the deque of the calling worker, if it belongs to pool */
+static work_deque_t *thrmgr_self(threadpool_t *pool)
+{
+	work_deque_t *self;
+
+	pthread_once(&deque_tls_key_once, deque_tls_key_alloc);
+	self = pthread_getspecific(deque_tls_key);
+	if (self < pool->deques || self >= pool->deques + pool->thr_max)
+		return NULL;
+	return self;
+}
+
+/* thread pool mutex must be held on entry */
+static void deque_attach(threadpool_t *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->thr_max; i++) {
+		if (!pool->deques[i].owned) {
+			pool->deques[i].owned = 1;
+			pthread_once(&deque_tls_key_once, deque_tls_key_alloc);
+			pthread_setspecific(deque_tls_key, &pool->deques[i]);
+			return;
+		}
+	}
+}
+
+/* thread pool mutex must be held on entry; items left behind are
+ * picked up by the other workers */
+static void deque_detach(threadpool_t *pool)
+{
+	work_deque_t *self = thrmgr_self(pool);
+
+	if (self) {
+		self->owned = 0;
+		pthread_setspecific(deque_tls_key, NULL);
+	}
+}
+
+/* Pop a bulk item, trying our own deque first and then the others. With
+ * peek set the item counts are read without the deque locks: good
+ * enough to skip empty deques, but the idle path must not rely on it. */
+static void *thrmgr_steal(threadpool_t *pool, work_deque_t *self, int peek)
+{
+    work_deque_t *deque;
+    void *task;
+    int i, start;
+
+    start = self ? self - pool->deques : 0;
+    for (i = 0; i < pool->thr_max; i++) {
+	deque = &pool->deques[(start + i) % pool->thr_max];
+	if (peek && !deque->queue.item_count)
+	    continue;
+	pthread_mutex_lock(&deque->lock);
+	task = work_queue_pop(&deque->queue);
+	if (task)
+	    pthread_cond_signal(&deque->queueable_cond);
+	pthread_mutex_unlock(&deque->lock);
+	if (task)
+	    return task;
+    }
+    return NULL;
+}
+
 /* when both queues have tasks, it will pick 4 items from the single queue,
  * and 1 from the bulk */
 #define SINGLE_BULK_RATIO 4
 #define SINGLE_BULK_SUM (SINGLE_BULK_RATIO + 1)
 
 /* must be called with pool_mutex held */
-static void *thrmgr_pop(threadpool_t *pool)
+static void *thrmgr_pop(threadpool_t *pool, work_deque_t *self)
 {
-    void *task;
-    work_queue_t *first, *second;
-    int ratio;
-
-    if (pool->single_queue->popped < SINGLE_BULK_RATIO) {
-	first = pool->single_queue;
-	second = pool->bulk_queue;
-	ratio = SINGLE_BULK_RATIO;
-    } else {
-	second = pool->single_queue;
-	first = pool->bulk_queue;
-	ratio = SINGLE_BULK_SUM - SINGLE_BULK_RATIO;
-    }
-
-    task = work_queue_pop(first);
-    if (task) {
-	if (++first->popped == ratio)
-	    second->popped = 0;
-    } else {
-	task = work_queue_pop(second);
-	if (task) {
-	    if (++second->popped == ratio)
-		first->popped = 0;
+    void *task = NULL;
+    int single_first = pool->single_queue->popped < SINGLE_BULK_RATIO;
+
+    /* high priority items don't count towards the ratio */
+    if (!(task = work_queue_pop(pool->high_queue))) {
+	if (single_first)
+	    task = work_queue_pop(pool->single_queue);
+	if (!task && (task = thrmgr_steal(pool, self, 0))) {
+	    if (++pool->bulk_popped == SINGLE_BULK_SUM - SINGLE_BULK_RATIO)
+		pool->single_queue->popped = 0;
+	} else if (task || (task = work_queue_pop(pool->single_queue))) {
+	    if (++pool->single_queue->popped == SINGLE_BULK_RATIO)
+		pool->bulk_popped = 0;
 	}
     }
 
-    if (!thrmgr_contended(pool, 0)) {
+    if (!thrmgr_contended(pool)) {
 	logg("$THRMGR: queue (single) crossed low threshold -> signaling\n");
 	pthread_cond_signal(&pool->queueable_single_cond);
     }
 
-    if (!thrmgr_contended(pool, 1)) {
-	logg("$THRMGR: queue (bulk) crossed low threshold -> signaling\n");
-	pthread_cond_signal(&pool->queueable_bulk_cond);
-    }
-
     return task;
 }
 
 
+/* thread pool mutex must be held on entry, it is released */
+static void thrmgr_worker_exit(threadpool_t *threadpool)
+{
+	threadpool->thr_alive--;
+	if (threadpool->thr_alive == 0) {
+		/* signal that all threads are finished */
+		pthread_cond_broadcast(&threadpool->pool_cond);
+	}
+	deque_detach(threadpool);
+	stats_destroy();
+	if (pthread_mutex_unlock(&(threadpool->pool_mutex)) != 0) {
+		/* Fatal error */
+		logg("!Fatal: mutex unlock failed\n");
+		exit(-2);
+	}
+}
+
 static void *thrmgr_worker(void *arg)
 {
 	threadpool_t *threadpool = (threadpool_t *) arg;
+	work_deque_t *self = NULL;
 	void *job_data;
 	int retval, must_exit = FALSE, stats_inited = FALSE;
 	struct timespec timeout;
+	struct timeval tv_start;
+	long long cpu_start;
 
 	/* loop looking for work */
 	for (;;) {
+		/* keep draining the bulk deques while no single item is
+		 * waiting, without going through pool_mutex */
+		if (stats_inited && !threadpool->single_queue->item_count &&
+		    !threadpool->high_queue->item_count &&
+		    threadpool->thr_alive <= thrmgr_limit(threadpool) &&
+		    (job_data = thrmgr_steal(threadpool, self, 1))) {
+			thrmgr_setactiveengine(NULL);
+			thrmgr_setactivetask(NULL, IDLE_TASK);
+			gettimeofday(&tv_start, NULL);
+			cpu_start = threadpool->thr_min ? thread_cputime() : -1;
+			threadpool->handler(job_data);
+			task_jobdone(&tv_start, cpu_start);
+			continue;
+		}
 		if (pthread_mutex_lock(&(threadpool->pool_mutex)) != 0) {
 			logg("!Fatal: mutex lock failed\n");
 			exit(-2);
 		}
 		if(!stats_inited) {
-			stats_init(threadpool);
+			deque_attach(threadpool);
+			self = thrmgr_self(threadpool);
+			thrmgr_pin(threadpool, self);
+			stats_init(threadpool, self);
 			stats_inited = TRUE;
 		}
 		thrmgr_setactiveengine(NULL);
 		thrmgr_setactivetask(NULL, IDLE_TASK);
+		thrmgr_adapt(threadpool);
+		if (threadpool->thr_alive > thrmgr_limit(threadpool)) {
+			/* the adaptive limit went down, leave while still
+			 * holding the lock so that only the surplus exits */
+			thrmgr_worker_exit(threadpool);
+			return NULL;
+		}
 		timeout.tv_sec = time(NULL) + threadpool->idle_timeout;
 		timeout.tv_nsec = 0;
 		threadpool->thr_idle++;
-		while (((job_data=thrmgr_pop(threadpool)) == NULL)
+		while (((job_data=thrmgr_pop(threadpool, self)) == NULL)
 				&& (threadpool->state != POOL_EXIT)) {
 			/* Sleep, awaiting wakeup */
 			pthread_cond_signal(&threadpool->idle_cond);
@@ -663,7 +1907,10 @@ static void *thrmgr_worker(void *arg)
 			exit(-2);
 		}
 		if (job_data) {
+			gettimeofday(&tv_start, NULL);
+			cpu_start = threadpool->thr_min ? thread_cputime() : -1;
 			threadpool->handler(job_data);
+			task_jobdone(&tv_start, cpu_start);
 		} else if (must_exit) {
 			break;
 		}
@@ -673,28 +1920,113 @@ static void *thrmgr_worker(void *arg)
 		logg("!Fatal: mutex lock failed\n");
 		exit(-2);
 	}
-	threadpool->thr_alive--;
-	if (threadpool->thr_alive == 0) {
-		/* signal that all threads are finished */
-		pthread_cond_broadcast(&threadpool->pool_cond);
+	thrmgr_worker_exit(threadpool);
+	return NULL;
+}
+
+/* Wait until no job is queued or running, for at most timeout seconds
+ * (0: no limit). Returns 0 when the pool went idle. */
+int thrmgr_wait_idle(threadpool_t *threadpool, unsigned int timeout)
+{
+	struct timespec ts;
+	time_t end = time(NULL) + timeout;
+	int i, busy, needexit;
+
+	pthread_mutex_lock(&threadpool->pool_mutex);
+	for (;;) {
+		busy = threadpool->thr_alive - threadpool->thr_idle +
+			threadpool->single_queue->item_count + threadpool->high_queue->item_count;
+		for (i = 0; i < threadpool->thr_max; i++)
+			busy += threadpool->deques[i].queue.item_count;
+		pthread_mutex_lock(&exit_mutex);
+		needexit = progexit;
+		pthread_mutex_unlock(&exit_mutex);
+		if (!busy || needexit || (timeout && time(NULL) >= end))
+			break;
+		/* idle_cond is signaled by the workers going idle, wake up
+		 * anyway to check progexit and the timeout */
+		ts.tv_sec = time(NULL) + 1;
+		ts.tv_nsec = 0;
+		pthread_cond_timedwait(&threadpool->idle_cond, &threadpool->pool_mutex, &ts);
 	}
-	stats_destroy(threadpool);
+	pthread_mutex_unlock(&threadpool->pool_mutex);
+	return busy ? -1 : 0;
+}
+
+/* must be called with pool_mutex held */
+static void thrmgr_wakeup(threadpool_t *threadpool, int items)
+{
+	pthread_t thr_id;
+
+	thrmgr_adapt(threadpool);
+	if ((threadpool->thr_idle < items) &&
+	    (threadpool->thr_alive < thrmgr_limit(threadpool))) {
+		/* Start a new thread */
+		if (pthread_create(&thr_id, &(threadpool->pool_attr),
+				   thrmgr_worker, threadpool) != 0) {
+		    logg("!pthread_create failed\n");
+		} else {
+		    threadpool->thr_alive++;
+		}
+	}
+	pthread_cond_signal(&(threadpool->pool_cond));
+}
+
+static int thrmgr_dispatch_bulk(threadpool_t *threadpool, void *user_data, const struct timeval *deadline)
+{
+	work_deque_t *deque;
+	int items, ret, wake;
+
+	if (threadpool->state != POOL_VALID) {
+		return FALSE;
+	}
+	if (!(deque = thrmgr_self(threadpool))) {
+		deque = &threadpool->deques[0];
+	}
+
+	pthread_mutex_lock(&deque->lock);
+	/* don't allow bulk items to exceed 50% of queue, so that
+	 * non-bulk items get a chance to be in the queue */
+	while (deque->queue.item_count >= threadpool->queue_max/2 &&
+	       deque->queue.item_count) {
+		logg("$THRMGR: contended, sleeping\n");
+		pthread_cond_wait(&deque->queueable_cond, &deque->lock);
+		logg("$THRMGR: contended, woken\n");
+	}
+	ret = work_queue_add(&deque->queue, user_data, deadline);
+	items = deque->queue.item_count;
+	/* read under the deque lock: a worker going idle bumps thr_idle
+	 * before it rechecks the deques */
+	wake = threadpool->thr_idle || threadpool->thr_alive < thrmgr_limit(threadpool);
+	pthread_mutex_unlock(&deque->lock);
+	if (!ret || !wake) {
+		return ret;
+	}
+
+	if (pthread_mutex_lock(&(threadpool->pool_mutex)) != 0) {
+		logg("!Mutex lock failed\n");
+		return FALSE;
+	}
+	thrmgr_wakeup(threadpool, items + threadpool->single_queue->item_count + threadpool->high_queue->item_count);
 	if (pthread_mutex_unlock(&(threadpool->pool_mutex)) != 0) {
-		/* Fatal error */
-		logg("!Fatal: mutex unlock failed\n");
-		exit(-2);
+	    logg("!Mutex unlock failed\n");
+	    return FALSE;
 	}
-	return NULL;
+	return ret;
 }
 
-static int thrmgr_dispatch_internal(threadpool_t *threadpool, void *user_data, int bulk)
+static int thrmgr_dispatch_internal(threadpool_t *threadpool, void *user_data, enum thrmgr_prio prio, const struct timeval *deadline)
 {
+	work_queue_t *queue;
 	int ret = TRUE;
-	pthread_t thr_id;
 
 	if (!threadpool) {
 		return FALSE;
 	}
+	if (prio == PRIO_LOW) {
+		return thrmgr_dispatch_bulk(threadpool, user_data, deadline);
+	}
+	queue = prio == PRIO_HIGH ? threadpool->high_queue : threadpool->single_queue;
 
 	/* Lock the threadpool */
 	if (pthread_mutex_lock(&(threadpool->pool_mutex)) != 0) {
@@ -703,46 +2035,23 @@ static int thrmgr_dispatch_internal(threadpool_t *threadpool, void *user_data, i
 	}
 
 	do {
-	    work_queue_t *queue;
-	    pthread_cond_t *queueable_cond;
-	    int items;
-
 	    if (threadpool->state != POOL_VALID) {
 		ret = FALSE;
 		break;
 	    }
 
-	    if (bulk) {
-		queue = threadpool->bulk_queue;
-		queueable_cond = &threadpool->queueable_bulk_cond;
-	    } else {
-		queue = threadpool->single_queue;
-		queueable_cond = &threadpool->queueable_single_cond;
-	    }
-
-	    while (thrmgr_contended(threadpool, bulk)) {
+	    while (thrmgr_contended(threadpool)) {
 		logg("$THRMGR: contended, sleeping\n");
-		pthread_cond_wait(queueable_cond, &threadpool->pool_mutex);
+		pthread_cond_wait(&threadpool->queueable_single_cond, &threadpool->pool_mutex);
 		logg("$THRMGR: contended, woken\n");
 	    }
 
-	    if (!work_queue_add(queue, user_data)) {
+	    if (!work_queue_add(queue, user_data, deadline)) {
 		ret = FALSE;
 		break;
 	    }
 
-	    items = threadpool->single_queue->item_count + threadpool->bulk_queue->item_count;
-	    if ((threadpool->thr_idle < items) &&
-		(threadpool->thr_alive < threadpool->thr_max)) {
-		/* Start a new thread */
-		if (pthread_create(&thr_id, &(threadpool->pool_attr),
-				   thrmgr_worker, threadpool) != 0) {
-		    logg("!pthread_create failed\n");
-		} else {
-		    threadpool->thr_alive++;
-		}
-	    }
-	    pthread_cond_signal(&(threadpool->pool_cond));
+	    thrmgr_wakeup(threadpool, threadpool->single_queue->item_count + threadpool->high_queue->item_count);
 
 	} while (0);
 
@@ -755,10 +2064,15 @@ static int thrmgr_dispatch_internal(threadpool_t *threadpool, void *user_data, i
 
 int thrmgr_dispatch(threadpool_t *threadpool, void *user_data)
 {
-    return thrmgr_dispatch_internal(threadpool, user_data, 0);
+    return thrmgr_dispatch_internal(threadpool, user_data, PRIO_NORMAL, NULL);
 }
 
 int thrmgr_group_dispatch(threadpool_t *threadpool, jobgroup_t *group, void *user_data, int bulk)
+{
+    return thrmgr_group_dispatch_prio(threadpool, group, user_data, bulk ? PRIO_LOW : PRIO_NORMAL, NULL);
+}
+
+int thrmgr_group_dispatch_prio(threadpool_t *threadpool, jobgroup_t *group, void *user_data, enum thrmgr_prio prio, const struct timeval *deadline)
 {
     int ret;
     if (group) {
@@ -767,7 +2081,7 @@ int thrmgr_group_dispatch(threadpool_t *threadpool, jobgroup_t *group, void *use
 	logg("$THRMGR: active jobs for %p: %d\n", group, group->jobs);
 	pthread_mutex_unlock(&group->mutex);
     }
-    if (!(ret = thrmgr_dispatch_internal(threadpool, user_data, bulk)) && group) {
+    if (!(ret = thrmgr_dispatch_internal(threadpool, user_data, prio, deadline)) && group) {
 	pthread_mutex_lock(&group->mutex);
 	group->jobs--;
 	logg("$THRMGR: active jobs for %p: %d\n", group, group->jobs);
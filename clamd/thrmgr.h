@@ -29,10 +29,18 @@
 #include <sys/time.h>
 #endif
 
+#include "libclamav/clamav.h"
+
+/* job and queue wait times are counted in power of two buckets of
+ * milliseconds: the first one is below 1ms, the last one is everything
+ * above 8s */
+#define TASK_HIST_BUCKETS 15
+
 typedef struct work_item_tag {
 	struct work_item_tag *next;
 	void *data;
 	struct timeval time_queued;
+	struct timeval deadline; /* 0 - none */
 } work_item_t;
 	
 typedef struct work_queue_tag {
@@ -40,21 +48,77 @@ typedef struct work_queue_tag {
 	work_item_t *tail;
 	int item_count;
 	int popped;
+	/* wait time accounting, updated when items are popped */
+	unsigned long served;
+	unsigned long missed;
+	long long wait_usec;
+	long wait_max_usec;
+	unsigned long wait_hist[TASK_HIST_BUCKETS];
 } work_queue_t;
 
+/* Bulk (MULTISCAN) items are queued on the dispatching worker's own
+ * deque; idle workers steal from the other deques, so bulk traffic only
+ * takes pool_mutex to wake or start a thread */
+typedef struct work_deque_tag {
+	pthread_mutex_t lock;
+	pthread_cond_t queueable_cond;
+	work_queue_t queue;
+	int owned;
+} work_deque_t;
+
+/* high priority items are always served first, low priority ones share
+ * the bulk deques with MULTISCAN */
+enum thrmgr_prio {
+	PRIO_NORMAL,
+	PRIO_HIGH,
+	PRIO_LOW
+};
+
 typedef enum {
 	POOL_INVALID,
 	POOL_VALID,
 	POOL_EXIT
 } pool_state_t;
 
+#define TASK_HIST_CMDS 16
+#define TASK_FILENAME_MAX 1024
+
+struct task_hist {
+	const char *command; /* NULL: commands that didn't fit the table */
+	unsigned long count[TASK_HIST_BUCKETS];
+	unsigned long long usec;
+};
+
+/* Per-worker statistics slot, one for each deque. A slot is only written
+ * by the worker that owns it, inside task_write_begin()/task_write_end();
+ * STATS copies it with task_read() instead of taking any lock. */
 struct task_desc {
-	const char *filename;
+	volatile unsigned seq; /* odd while the owner is writing */
+	int used;
+	char filename[TASK_FILENAME_MAX];
 	const char *command;
 	struct timeval tv;
-	struct task_desc *prv;
-	struct task_desc *nxt;
 	const struct cl_engine *engine;
+	/* kept when the worker exits, the next owner continues them */
+	unsigned long jobs;
+	unsigned long long scanned;
+	unsigned long long busy_usec; /* wall and CPU time spent on the jobs */
+	unsigned long long cpu_usec;
+	struct task_hist hist[TASK_HIST_CMDS];
+	/* written by libclamav, read by the sampler, see cl_scan_probe_register() */
+	struct cl_scan_probe probe;
+};
+
+/* Scan stacks taken by the sampler; the ring only has one writer, the
+ * sampler thread, and PROFILE copies it without any lock, dropping the
+ * entries overwritten while it read them. */
+#define THRMGR_SAMPLES 16384
+
+struct thrmgr_sample {
+	time_t time;
+	unsigned short depth;
+	unsigned short phase;
+	const char *types[CL_PROBE_DEPTH];
 };
 
 typedef struct threadpool_tag {
@@ -64,7 +128,6 @@ typedef struct threadpool_tag {
 
 	pthread_cond_t  idle_cond;
 	pthread_cond_t  queueable_single_cond;
-	pthread_cond_t  queueable_bulk_cond;
 
 	pool_state_t state;
 	int thr_max;
@@ -73,12 +136,30 @@ typedef struct threadpool_tag {
 	int thr_idle;
 	int thr_multiscan;
 	int idle_timeout;
-	struct task_desc *tasks;
+	/* adaptive sizing, see thrmgr_adapt(): thr_min is 0 when disabled,
+	 * otherwise at most thr_limit workers run */
+	int thr_min;
+	int thr_limit;
+	int ncpu;
+	struct timeval adapt_tv;
+	unsigned long long adapt_busy;
+	unsigned long long adapt_cpu;
+	int *cpus; /* WorkerCPUs, NULL when the workers aren't pinned */
+	int cpus_count;
+	int cpus_per_thread;
+	struct task_desc *tasks; /* thr_max entries, same index as deques */
+	/* sampling profiler, see thrmgr_setsampling() */
+	int sample_msec; /* 0 when disabled */
+	pthread_t sampler;
+	struct thrmgr_sample *samples; /* THRMGR_SAMPLES entries */
+	volatile unsigned long long sample_head; /* samples taken so far */
 	
 	void (*handler)(void *);
 
-	work_queue_t *bulk_queue;
+	work_deque_t *deques; /* thr_max entries, one per live worker */
+	int bulk_popped;
 	work_queue_t *single_queue;
+	work_queue_t *high_queue;
 } threadpool_t;
 
 typedef struct jobgroup {
@@ -98,16 +179,27 @@ enum thrmgr_exit {
 };
 
 threadpool_t *thrmgr_new(int max_threads, int idle_timeout, int max_queue, void (*handler)(void *));
+void thrmgr_setadaptive(threadpool_t *threadpool, int min_threads);
+int thrmgr_setsampling(threadpool_t *threadpool, int msec);
+int thrmgr_setaffinity(threadpool_t *threadpool, const char *cpulist, int per_thread);
 void thrmgr_destroy(threadpool_t *threadpool);
 int thrmgr_dispatch(threadpool_t *threadpool, void *user_data);
 int thrmgr_group_dispatch(threadpool_t *threadpool, jobgroup_t *group, void *user_data, int bulk);
+int thrmgr_group_dispatch_prio(threadpool_t *threadpool, jobgroup_t *group, void *user_data, enum thrmgr_prio prio, const struct timeval *deadline);
 void thrmgr_group_waitforall(jobgroup_t *group, unsigned *ok, unsigned *error, unsigned *total);
 int thrmgr_group_finished(jobgroup_t *group, enum thrmgr_exit exitc);
 int thrmgr_group_need_terminate(jobgroup_t *group);
 void thrmgr_group_terminate(jobgroup_t *group);
 jobgroup_t *thrmgr_group_new(void);
 int thrmgr_printstats(int outfd, char term);
+/* SUBSCRIBE, see thrmgr.c */
+#define SUBSCRIBE_MIN_MSEC 100
+int thrmgr_subscribe(int fd, unsigned msec, char term);
+int thrmgr_printmetrics(int outfd);
+int thrmgr_printprofile(int outfd, char term);
+int thrmgr_wait_idle(threadpool_t *threadpool, unsigned int timeout);
 void thrmgr_setactivetask(const char *filename, const char* command);
 void thrmgr_setactiveengine(const struct cl_engine *engine);
+void thrmgr_addscanned(unsigned long long bytes);
 
 #endif
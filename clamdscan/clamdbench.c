@@ -0,0 +1,827 @@
+/*
+ *  clamdbench: load generator and latency benchmark for clamd.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+/* must be first because it may define _XOPEN_SOURCE */
+#include "shared/fdpassing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#include "shared/output.h"
+#include "shared/clamdcom.h"
+
+enum bench_mode { MODE_INSTREAM, MODE_FILDES, MODE_MULTISCAN, MODE_IDSESSION };
+static const char *mode_names[] = { "INSTREAM", "FILDES", "MULTISCAN", "IDSESSION" };
+
+struct bench_file {
+    char *path;
+    unsigned long size;
+};
+
+/* one per connection, merged at the end */
+struct bench_worker {
+    struct bench *b;
+    pthread_t tid;
+    double *usecs;
+    unsigned long count, max;
+    unsigned long infected, errors;
+    unsigned long long bytes;
+};
+
+struct bench {
+    enum bench_mode mode;
+    const char *socket;
+    struct addrinfo *addr;
+    struct bench_file *files;
+    unsigned int nfiles, nsynthetic;
+    unsigned int *weights; /* synthetic files: cumulative weights */
+    unsigned int concurrency;
+    unsigned long requests;
+    double duration;
+    int unique;
+    char *tmpdir;
+
+    pthread_mutex_t mutex;
+    unsigned long next;
+    int stop;
+    struct timeval start;
+
+    /* sampled from METRICS while the benchmark runs */
+    unsigned long samples;
+    double queue_sum, queue_max, busy_sum;
+};
+
+struct metric {
+    char name[160];
+    double value;
+};
+
+static double elapsed(const struct timeval *start)
+{
+	struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static int bench_connect(const struct bench *b)
+{
+	int sockd;
+
+    if(b->socket) {
+	    struct sockaddr_un nixsock;
+
+	memset(&nixsock, 0, sizeof(nixsock));
+	nixsock.sun_family = AF_UNIX;
+	strncpy(nixsock.sun_path, b->socket, sizeof(nixsock.sun_path) - 1);
+	if((sockd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	    return -1;
+	if(connect(sockd, (struct sockaddr *)&nixsock, sizeof(nixsock))) {
+	    close(sockd);
+	    return -1;
+	}
+	return sockd;
+    }
+    if((sockd = socket(b->addr->ai_family, b->addr->ai_socktype, b->addr->ai_protocol)) < 0)
+	return -1;
+    if(connect(sockd, b->addr->ai_addr, b->addr->ai_addrlen)) {
+	close(sockd);
+	return -1;
+    }
+    return sockd;
+}
+
+/* the INSTREAM data; with -u every request starts with a different chunk
+ * so that clamd can't answer from its cache */
+static int send_stream(int sockd, const char *cmd, const char *filename, unsigned long seq, int unique)
+{
+	uint32_t buf[BUFSIZ/sizeof(uint32_t)];
+	int fd, len;
+
+    if((fd = open(filename, O_RDONLY)) < 0) {
+	logg("!%s: Can't open file: %s\n", filename, strerror(errno));
+	return 0;
+    }
+    if(sendln(sockd, cmd, strlen(cmd) + 1)) {
+	close(fd);
+	return -1;
+    }
+    if(unique) {
+	buf[0] = htonl(sizeof(seq));
+	memcpy(&buf[1], &seq, sizeof(seq));
+	if(sendln(sockd, (const char *)buf, sizeof(uint32_t) + sizeof(seq))) {
+	    close(fd);
+	    return -1;
+	}
+    }
+    while((len = read(fd, &buf[1], sizeof(buf) - sizeof(uint32_t))) > 0) {
+	buf[0] = htonl(len);
+	if(sendln(sockd, (const char *)buf, len + sizeof(uint32_t))) {
+	    close(fd);
+	    return -1;
+	}
+    }
+    close(fd);
+    *buf = 0;
+    if(len < 0 || sendln(sockd, (const char *)buf, 4))
+	return -1;
+    return 1;
+}
+
+#ifdef HAVE_FD_PASSING
+static int send_fdpass(int sockd, const char *filename)
+{
+	struct iovec iov[1];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	unsigned char fdbuf[CMSG_SPACE(sizeof(int))];
+	char dummy[] = "";
+	int fd, ret = 1;
+
+    if((fd = open(filename, O_RDONLY)) < 0) {
+	logg("!%s: Can't open file: %s\n", filename, strerror(errno));
+	return 0;
+    }
+    if(sendln(sockd, "zFILDES", 8)) {
+	close(fd);
+	return -1;
+    }
+    iov[0].iov_base = dummy;
+    iov[0].iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = fdbuf;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_controllen = CMSG_LEN(sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    *(int *)CMSG_DATA(cmsg) = fd;
+    if(sendmsg(sockd, &msg, 0) == -1) {
+	logg("!FD send failed: %s\n", strerror(errno));
+	ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+#endif
+
+/* counts a reply line, returns -1 if it isn't one */
+static int bench_reply(struct bench_worker *w, const char *bol, const char *eol)
+{
+    if(!strchr(bol, ':'))
+	return -1;
+    if(eol - bol > 7 && !memcmp(eol - 7, " FOUND", 6))
+	w->infected++;
+    else if(eol - bol > 7 && !memcmp(eol - 7, " ERROR", 6))
+	w->errors++;
+    return 0;
+}
+
+/* one request on a new connection; MULTISCAN may reply with several lines */
+static int bench_request(struct bench_worker *w, const struct bench_file *f, unsigned long seq)
+{
+	struct RCVLN rcv;
+	char *cmd, *bol, *eol;
+	int sockd, len, ret = -1;
+
+    if((sockd = bench_connect(w->b)) < 0) {
+	logg("!Can't connect to clamd: %s\n", strerror(errno));
+	return -1;
+    }
+    switch(w->b->mode) {
+	case MODE_INSTREAM:
+	    len = send_stream(sockd, "zINSTREAM", f->path, seq, w->b->unique);
+	    break;
+#ifdef HAVE_FD_PASSING
+	case MODE_FILDES:
+	    len = send_fdpass(sockd, f->path);
+	    break;
+#endif
+	case MODE_MULTISCAN:
+	    if(!(cmd = malloc(strlen(f->path) + 12))) {
+		len = -1;
+		break;
+	    }
+	    len = sprintf(cmd, "zMULTISCAN %s", f->path) + 1;
+	    len = sendln(sockd, cmd, len) ? -1 : 1;
+	    free(cmd);
+	    break;
+	default:
+	    len = -1;
+    }
+    if(len > 0) {
+	recvlninit(&rcv, sockd);
+	while((len = recvln(&rcv, &bol, &eol)) > 0) {
+	    if(bench_reply(w, bol, eol))
+		break;
+	    ret = 0;
+	}
+	if(len)
+	    ret = -1;
+    }
+    close(sockd);
+    return ret;
+}
+
+static int bench_record(struct bench_worker *w, double usec, unsigned long size)
+{
+	double *usecs;
+
+    if(w->count == w->max) {
+	if(!(usecs = realloc(w->usecs, (w->max ? 2 * w->max : 4096) * sizeof(double)))) {
+	    logg("!Can't allocate memory for the latencies\n");
+	    return -1;
+	}
+	w->usecs = usecs;
+	w->max = w->max ? 2 * w->max : 4096;
+    }
+    w->usecs[w->count++] = usec;
+    w->bytes += size;
+    return 0;
+}
+
+/* the next file to scan, or NULL when the benchmark is over */
+static const struct bench_file *bench_next(struct bench *b, unsigned long *seq)
+{
+	unsigned int i, r;
+
+    pthread_mutex_lock(&b->mutex);
+    if(b->stop || (b->requests && b->next >= b->requests) || (b->duration && elapsed(&b->start) >= b->duration)) {
+	b->stop = 1;
+	pthread_mutex_unlock(&b->mutex);
+	return NULL;
+    }
+    *seq = b->next++;
+    r = rand();
+    pthread_mutex_unlock(&b->mutex);
+
+    if(!b->weights)
+	return &b->files[*seq % b->nfiles];
+    r %= b->weights[b->nfiles - 1];
+    for(i = 0; b->weights[i] <= r; i++);
+    return &b->files[i];
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct bench *b = w->b;
+	const struct bench_file *f;
+	struct timeval start;
+	struct RCVLN rcv;
+	char *bol, *eol;
+	unsigned long seq;
+	int sockd = -1, len;
+
+    while((f = bench_next(b, &seq))) {
+	gettimeofday(&start, NULL);
+	if(b->mode != MODE_IDSESSION) {
+	    if(bench_request(w, f, seq)) {
+		w->errors++;
+		continue;
+	    }
+	} else {
+	    /* one session per worker, opened again after a failure */
+	    if(sockd < 0) {
+		if((sockd = bench_connect(b)) < 0) {
+		    logg("!Can't connect to clamd: %s\n", strerror(errno));
+		    w->errors++;
+		    continue;
+		}
+		recvlninit(&rcv, sockd);
+		if(sendln(sockd, "zIDSESSION", 11)) {
+		    close(sockd);
+		    sockd = -1;
+		    w->errors++;
+		    continue;
+		}
+		gettimeofday(&start, NULL);
+	    }
+	    len = send_stream(sockd, "zINSTREAM", f->path, seq, b->unique);
+	    if(len > 0)
+		len = recvln(&rcv, &bol, &eol);
+	    if(len <= 0 || bench_reply(w, bol, eol)) {
+		close(sockd);
+		sockd = -1;
+		w->errors++;
+		continue;
+	    }
+	}
+	if(bench_record(w, elapsed(&start) * 1000000.0, f->size))
+	    break;
+    }
+    if(sockd >= 0) {
+	sendln(sockd, "zEND", 5);
+	close(sockd);
+    }
+    return NULL;
+}
+
+/* the whole reply of a command that closes the connection */
+static char *bench_command(const struct bench *b, const char *cmd)
+{
+	char *reply = NULL, *r;
+	size_t len = 0, max = 0;
+	ssize_t n;
+	int sockd;
+
+    if((sockd = bench_connect(b)) < 0)
+	return NULL;
+    if(sendln(sockd, cmd, strlen(cmd) + 1)) {
+	close(sockd);
+	return NULL;
+    }
+    for(;;) {
+	if(len + 1 >= max) {
+	    if(!(r = realloc(reply, max + 65536))) {
+		free(reply);
+		reply = NULL;
+		break;
+	    }
+	    reply = r;
+	    max += 65536;
+	}
+	if((n = recv(sockd, reply + len, max - len - 1, 0)) < 0 && errno == EINTR)
+	    continue;
+	if(n <= 0)
+	    break;
+	len += n;
+    }
+    close(sockd);
+    if(reply)
+	reply[len] = '\0';
+    return reply;
+}
+
+/* the samples of a METRICS reply, without the histogram buckets */
+static int parse_metrics(char *reply, struct metric **metrics)
+{
+	struct metric *m = NULL, *mm;
+	char *line, *sp, *save = NULL;
+	int n = 0;
+
+    if(!reply || !strstr(reply, "# EOF"))
+	return -1;
+    for(line = strtok_r(reply, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+	if(*line == '#' || strstr(line, "_bucket{") || !(sp = strrchr(line, ' ')) || sp - line >= (int)sizeof(m->name))
+	    continue;
+	if(!(mm = realloc(m, (n + 1) * sizeof(*m)))) {
+	    free(m);
+	    return -1;
+	}
+	m = mm;
+	memcpy(m[n].name, line, sp - line);
+	m[n].name[sp - line] = '\0';
+	m[n].value = atof(sp + 1);
+	n++;
+    }
+    *metrics = m;
+    return n;
+}
+
+static double metric_value(const struct metric *m, int n, const char *name)
+{
+	int i;
+
+    for(i = 0; i < n; i++)
+	if(!strcmp(m[i].name, name))
+	    return m[i].value;
+    return 0.0;
+}
+
+static int fetch_metrics(const struct bench *b, struct metric **m)
+{
+	char *reply = bench_command(b, "zMETRICS");
+	int n = parse_metrics(reply, m);
+
+    free(reply);
+    return n;
+}
+
+/* clamd's queue and busy threads once a second */
+static void *bench_sampler(void *arg)
+{
+	struct bench *b = arg;
+	struct metric *m;
+	double queue, busy;
+	int n, stop;
+
+    for(;;) {
+	pthread_mutex_lock(&b->mutex);
+	stop = b->stop;
+	pthread_mutex_unlock(&b->mutex);
+	if(stop)
+	    break;
+	if((n = fetch_metrics(b, &m)) >= 0) {
+	    queue = metric_value(m, n, "clamd_queue_items");
+	    busy = metric_value(m, n, "clamd_threads{state=\"live\"}") - metric_value(m, n, "clamd_threads{state=\"idle\"}");
+	    free(m);
+	    b->samples++;
+	    b->queue_sum += queue;
+	    b->busy_sum += busy;
+	    if(queue > b->queue_max)
+		b->queue_max = queue;
+	}
+	sleep(1);
+    }
+    return NULL;
+}
+
+static void print_clamd(const struct bench *b, struct metric *before, int nbefore)
+{
+	struct metric *after;
+	char *reply, name[sizeof(after->name)], *p;
+	double d, count;
+	int nafter, i;
+
+    if(nbefore < 0 || (nafter = fetch_metrics(b, &after)) < 0) {
+	/* no METRICS in this clamd, STATS at least shows the pool */
+	if((reply = bench_command(b, "zSTATS"))) {
+	    mprintf("\nclamd STATS:\n%s\n", reply);
+	    free(reply);
+	}
+	return;
+    }
+    if(b->samples)
+	mprintf("\nclamd queue: %.1f jobs on average, %.0f at most; %.1f threads busy on average\n",
+		b->queue_sum / b->samples, b->queue_max, b->busy_sum / b->samples);
+    mprintf("\nclamd METRICS during the run:\n");
+    for(i = 0; i < nafter; i++) {
+	d = after[i].value - metric_value(before, nbefore, after[i].name);
+	if(d <= 0.0)
+	    continue;
+	if((p = strstr(after[i].name, "_total")) && (p[6] == '{' || !p[6])) {
+	    mprintf("  %-64s %.0f\n", after[i].name, d);
+	} else if((p = strstr(after[i].name, "_sum")) && (p[4] == '{' || !p[4])) {
+	    /* histograms: their average over the run */
+	    snprintf(name, sizeof(name), "%.*s_count%s", (int)(p - after[i].name), after[i].name, p + 4);
+	    count = metric_value(after, nafter, name) - metric_value(before, nbefore, name);
+	    if(count > 0)
+		mprintf("  %-64s %.0f, %.3f ms on average\n", name, count, d * 1000.0 / count);
+	}
+    }
+    free(after);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_results(const struct bench *b, struct bench_worker *w, double secs)
+{
+	unsigned long count = 0, infected = 0, errors = 0, i, j, n;
+	unsigned long long bytes = 0;
+	double *usecs, bound;
+	unsigned int k;
+
+    for(k = 0; k < b->concurrency; k++) {
+	count += w[k].count;
+	infected += w[k].infected;
+	errors += w[k].errors;
+	bytes += w[k].bytes;
+    }
+    mprintf("%s with %u connection%s, %lu requests in %.2f s\n", mode_names[b->mode], b->concurrency,
+	    b->concurrency > 1 ? "s" : "", count, secs);
+    mprintf("Throughput: %.1f requests/s, %.2f MB/s\n", count / secs, bytes / secs / 1048576.0);
+    mprintf("Infected: %lu, errors: %lu\n", infected, errors);
+    if(!count || !(usecs = malloc(count * sizeof(double))))
+	return;
+    for(n = 0, k = 0; k < b->concurrency; k++)
+	for(i = 0; i < w[k].count; i++)
+	    usecs[n++] = w[k].usecs[i];
+    qsort(usecs, count, sizeof(double), cmp_double);
+
+    mprintf("\nLatency (ms): min %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n", usecs[0] / 1000.0,
+	    usecs[(count - 1) / 2] / 1000.0, usecs[(count - 1) * 9 / 10] / 1000.0,
+	    usecs[(count - 1) * 99 / 100] / 1000.0, usecs[count - 1] / 1000.0);
+    /* powers of two from 0.125 ms */
+    for(i = 0, bound = 125.0; i < count; bound *= 2) {
+	for(j = i; j < count && usecs[j] < bound; j++);
+	if(j > i)
+	    mprintf("  < %10.3f ms %10lu %6.2f%%\n", bound / 1000.0, j - i, 100.0 * (j - i) / count);
+	i = j;
+    }
+    free(usecs);
+}
+
+static int add_file(struct bench *b, const char *path, unsigned long size)
+{
+	struct bench_file *files;
+
+    if(!(files = realloc(b->files, (b->nfiles + 1) * sizeof(*files))))
+	return -1;
+    b->files = files;
+    if(!(b->files[b->nfiles].path = strdup(path)))
+	return -1;
+    b->files[b->nfiles++].size = size;
+    return 0;
+}
+
+static int add_corpus(struct bench *b, const char *name)
+{
+	struct dirent *dent;
+	struct stat sb;
+	char path[PATH_MAX], *full;
+	DIR *dd;
+	int ret = 0;
+
+    if(lstat(name, &sb) == -1) {
+	logg("!Can't access %s: %s\n", name, strerror(errno));
+	return -1;
+    }
+    if(S_ISREG(sb.st_mode)) {
+	/* clamd opens MULTISCAN paths itself */
+	if(!(full = realpath(name, path)))
+	    return -1;
+	return add_file(b, full, sb.st_size);
+    }
+    if(!S_ISDIR(sb.st_mode) || !(dd = opendir(name)))
+	return 0;
+    while(!ret && (dent = readdir(dd))) {
+	if(!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", name, dent->d_name);
+	ret = add_corpus(b, path);
+    }
+    closedir(dd);
+    return ret;
+}
+
+/* -z 4k:60,64k:30,1m:10 creates eight random files of each size in a
+ * temporary directory, picked in proportion to the weights */
+static int add_synthetic(struct bench *b, const char *dist)
+{
+	char template[PATH_MAX], path[PATH_MAX], *end, buf[8192];
+	const char *tmp = getenv("TMPDIR");
+	unsigned long size, done, n;
+	unsigned int weight, total = 0, i, *weights;
+	int fd;
+
+    snprintf(template, sizeof(template), "%s/clamdbench-XXXXXX", tmp ? tmp : "/tmp");
+    if(!mkdtemp(template) || !(b->tmpdir = strdup(template))) {
+	logg("!Can't create a temporary directory: %s\n", strerror(errno));
+	return -1;
+    }
+    /* clamd may run as another user */
+    chmod(b->tmpdir, 0755);
+    while(*dist) {
+	size = strtoul(dist, &end, 10);
+	if(*end == 'k' || *end == 'K')
+	    size *= 1024, end++;
+	else if(*end == 'm' || *end == 'M')
+	    size *= 1048576, end++;
+	weight = *end == ':' ? strtoul(end + 1, &end, 10) : 1;
+	if(!size || !weight || (*end && *end != ',')) {
+	    logg("!Invalid size distribution: %s\n", dist);
+	    return -1;
+	}
+	dist = *end ? end + 1 : end;
+	for(i = 0; i < 8; i++) {
+	    snprintf(path, sizeof(path), "%s/%lu-%u", b->tmpdir, size, i);
+	    if((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+		return -1;
+	    for(done = 0; done < size; done += n) {
+		for(n = 0; n < sizeof(buf); n++)
+		    buf[n] = rand();
+		n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+		if(write(fd, buf, n) != (ssize_t)n) {
+		    close(fd);
+		    return -1;
+		}
+	    }
+	    close(fd);
+	    if(add_file(b, path, size))
+		return -1;
+	    b->nsynthetic++;
+	    if(!(weights = realloc(b->weights, b->nfiles * sizeof(*weights))))
+		return -1;
+	    b->weights = weights;
+	    total += weight;
+	    b->weights[b->nfiles - 1] = total;
+	}
+    }
+    return 0;
+}
+
+static void help(void)
+{
+    mprintf("\n");
+    mprintf("                      Clam AntiVirus: Daemon Benchmark\n");
+    mprintf("\n");
+    mprintf("    clamdbench [options] [file/directory...]\n");
+    mprintf("\n");
+    mprintf("    -h                    Show this help\n");
+    mprintf("    -m MODE               INSTREAM (default), FILDES, MULTISCAN or IDSESSION\n");
+    mprintf("    -c CONNECTIONS        Concurrent connections (default: 8)\n");
+    mprintf("    -d SECONDS            Duration of the run (default: 10)\n");
+    mprintf("    -n REQUESTS           Stop after REQUESTS scans\n");
+    mprintf("    -s SOCKET             clamd's local socket\n");
+    mprintf("    -a HOST[:PORT]        clamd's TCP address (default: localhost:3310)\n");
+    mprintf("    -z SIZE:WEIGHT,...    Scan random files of these sizes, e.g. 4k:60,1m:10\n");
+    mprintf("    -u                    Make every INSTREAM unique to bypass clamd's cache\n");
+    mprintf("    -q                    Don't query clamd's METRICS\n");
+    mprintf("\n");
+    mprintf("IDSESSION runs one session per connection and streams the files in it.\n");
+    mprintf("FILDES needs a local socket. MULTISCAN sends the paths of the files, clamd\n");
+    mprintf("must be able to open them.\n");
+    mprintf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	struct bench_worker *w = NULL;
+	struct metric *before = NULL;
+	struct addrinfo hints;
+	pthread_t sampler;
+	char host[256] = "localhost", *port = "3310", *p;
+	const char *dist = NULL;
+	unsigned int i, started = 0;
+	int opt, quiet = 0, sampling = 0, nbefore = -1, ret = 1;
+	double secs;
+
+    memset(&b, 0, sizeof(b));
+    b.concurrency = 8;
+    b.duration = 10.0;
+    pthread_mutex_init(&b.mutex, NULL);
+
+    while((opt = getopt(argc, argv, "hm:c:d:n:s:a:z:uq")) != -1) {
+	switch(opt) {
+	    case 'm':
+		for(i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]) && strcasecmp(optarg, mode_names[i]); i++);
+		if(i == sizeof(mode_names) / sizeof(mode_names[0])) {
+		    logg("!Unknown mode %s\n", optarg);
+		    return 1;
+		}
+		b.mode = i;
+		break;
+	    case 'c':
+		b.concurrency = atoi(optarg);
+		break;
+	    case 'd':
+		b.duration = atof(optarg);
+		break;
+	    case 'n':
+		b.requests = strtoul(optarg, NULL, 10);
+		if(b.duration == 10.0)
+		    b.duration = 0.0;
+		break;
+	    case 's':
+		b.socket = optarg;
+		break;
+	    case 'a':
+		strncpy(host, optarg, sizeof(host) - 1);
+		if((p = strrchr(host, ':')) && !strchr(p, ']')) {
+		    *p = '\0';
+		    port = p + 1;
+		}
+		break;
+	    case 'z':
+		dist = optarg;
+		break;
+	    case 'u':
+		b.unique = 1;
+		break;
+	    case 'q':
+		quiet = 1;
+		break;
+	    default:
+		help();
+		return opt == 'h' ? 0 : 1;
+	}
+    }
+    if(!b.concurrency || (!b.duration && !b.requests) || (!dist && optind == argc)) {
+	help();
+	return 1;
+    }
+#ifndef HAVE_FD_PASSING
+    if(b.mode == MODE_FILDES) {
+	logg("!FILDES support not compiled in\n");
+	return 1;
+    }
+#endif
+    if(b.mode == MODE_FILDES && !b.socket) {
+	logg("!FILDES needs a local socket (-s)\n");
+	return 1;
+    }
+    if(!b.socket) {
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if((i = getaddrinfo(host, port, &hints, &b.addr))) {
+	    logg("!Could not lookup %s: %s\n", host, gai_strerror(i));
+	    return 1;
+	}
+    }
+
+    if(dist && add_synthetic(&b, dist))
+	goto done;
+    for(i = optind; i < (unsigned int)argc; i++)
+	if(add_corpus(&b, argv[i]))
+	    goto done;
+    if(!b.nfiles) {
+	logg("!No files to scan\n");
+	goto done;
+    }
+    if(dist && optind < argc) {
+	/* the weights only cover the synthetic files */
+	free(b.weights);
+	b.weights = NULL;
+    }
+
+    if(!quiet)
+	nbefore = fetch_metrics(&b, &before);
+    if(!(w = calloc(b.concurrency, sizeof(*w)))) {
+	logg("!Can't allocate memory for the workers\n");
+	goto done;
+    }
+    gettimeofday(&b.start, NULL);
+    for(started = 0; started < b.concurrency; started++) {
+	w[started].b = &b;
+	if(pthread_create(&w[started].tid, NULL, bench_worker, &w[started])) {
+	    logg("!Can't start the workers: %s\n", strerror(errno));
+	    break;
+	}
+    }
+    if(nbefore >= 0 && !pthread_create(&sampler, NULL, bench_sampler, &b))
+	sampling = 1;
+    for(i = 0; i < started; i++)
+	pthread_join(w[i].tid, NULL);
+    secs = elapsed(&b.start);
+    pthread_mutex_lock(&b.mutex);
+    b.stop = 1;
+    pthread_mutex_unlock(&b.mutex);
+    if(sampling)
+	pthread_join(sampler, NULL);
+
+    b.concurrency = started;
+    print_results(&b, w, secs);
+    if(!quiet)
+	print_clamd(&b, before, nbefore);
+    ret = 0;
+
+done:
+    if(w) {
+	for(i = 0; i < started; i++)
+	    free(w[i].usecs);
+	free(w);
+    }
+    free(before);
+    for(i = 0; i < b.nfiles; i++) {
+	if(i < b.nsynthetic)
+	    unlink(b.files[i].path);
+	free(b.files[i].path);
+    }
+    free(b.files);
+    free(b.weights);
+    if(b.tmpdir) {
+	rmdir(b.tmpdir);
+	free(b.tmpdir);
+    }
+    if(b.addr)
+	freeaddrinfo(b.addr);
+    pthread_mutex_destroy(&b.mutex);
+    return ret;
+}
@@ -206,6 +206,7 @@ void help(void)
     mprintf("    --reload                           Request clamd to reload virus database\n");
     mprintf("    --fdpass                           Pass filedescriptor to clamd (useful if clamd is running as a different user)\n");
     mprintf("    --stream                           Force streaming files to clamd (for debugging and unit testing)\n");
+    mprintf("    --connections=#n                   Stream files over #n connections to clamd\n");
     mprintf("\n");
 
     exit(0);
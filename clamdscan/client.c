@@ -66,7 +66,10 @@
 #include "client.h"
 #include "proto.h"
 
+#define MAX_CONNECTIONS 64
+
 unsigned long int maxstream;
+unsigned int connections;
 #ifndef _WIN32
 struct sockaddr_un nixsock;
 #endif
@@ -202,6 +205,10 @@ static int client_scan(const char *file, int scantype, int *infected, int *err,
 	return 0;
     if (!session)
 	ret = serial_client_scan(fullpath, scantype, infected, err, maxlevel, flags);
+#ifndef _WIN32
+    else if (scantype == STREAM)
+	ret = pool_client_scan(fullpath, scantype, infected, err, maxlevel, flags);
+#endif
     else
 	ret = parallel_client_scan(fullpath, scantype, infected, err, maxlevel, flags);
     free(fullpath);
@@ -264,6 +271,12 @@ int client(const struct optstruct *opts, int *infected, int *err)
 	int remote, scantype, session = 0, errors = 0, scandash = 0, maxrec, flags = 0;
 	const char *fname;
 
+    connections = optget(opts, "connections")->numarg;
+    if(connections > MAX_CONNECTIONS) {
+	logg("^--connections: using %u connections\n", MAX_CONNECTIONS);
+	connections = MAX_CONNECTIONS;
+    }
+
     scandash = (opts->filename && opts->filename[0] && !strcmp(opts->filename[0], "-") && !optget(opts, "file-list")->enabled && !opts->filename[1]);
     remote = isremote(opts) | optget(opts, "stream")->enabled;
 #ifdef HAVE_FD_PASSING
@@ -274,7 +287,7 @@ int client(const struct optstruct *opts, int *infected, int *err)
 #endif
     if(remote || scandash) {
 	scantype = STREAM;
-	session = optget(opts, "multiscan")->enabled;
+	session = optget(opts, "multiscan")->enabled || connections > 1;
     } 
     else if(optget(opts, "multiscan")->enabled) scantype = MULTI;
     else if(optget(opts, "allmatch")->enabled) scantype = ALLMATCH;
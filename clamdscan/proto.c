@@ -51,6 +51,9 @@
 #include <sys/un.h>
 #include <netdb.h>
 #endif
+#if defined(C_LINUX)
+#include <sys/sendfile.h>
+#endif
 
 #include "libclamav/clamav.h"
 #include "libclamav/others.h"
@@ -63,6 +66,7 @@
 #include "client.h"
 
 extern unsigned long int maxstream;
+extern unsigned int connections;
 int printinfected;
 extern struct optstruct *clamdopts;
 #ifndef _WIN32
@@ -486,15 +490,56 @@ struct client_parallel_data {
     } *ids;
 };
 
+/* Handles one reply received in IDSESSION mode
+ * Returns 0 on success, 1 on hard failures */
+static int idreply(struct client_parallel_data *c, char *bol, char *eol, int len) {
+    const char *filename;
+    unsigned int rid;
+    struct SCANID **id = NULL;
+
+    if((rid = atoi(bol))) {
+	id = &c->ids;
+	while(*id) {
+	    if((*id)->id == rid) break;
+	    id = &((*id)->next);
+	}
+	if(!*id) id = NULL;
+    }
+    if(!id) {
+	logg("!Bogus session id from clamd\n");
+	return 1;
+    }
+    filename = (*id)->file;
+    if(len > 7) {
+	char *colon = strrchr(bol, ':');
+	if(!colon) {
+	    logg("!Failed to parse reply\n");
+	    free((void *)filename);
+	    return 1;
+	} else if(!memcmp(eol - 7, " FOUND", 6)) {
+	    c->infected++;
+	    c->printok = 0;
+	    logg("~%s%s\n", filename, colon);
+	    if(action) action(filename);
+	} else if(!memcmp(eol-7, " ERROR", 6)) {
+	    c->errors++;
+	    c->printok = 0;
+	    logg("~%s%s\n", filename, colon);
+	}
+    }
+    free((void *)filename);
+    bol = (char *)*id;
+    *id = (*id)->next;
+    free(bol);
+    return 0;
+}
+
 /* Sends a proper scan request to clamd and parses its replies
  * This is used only in IDSESSION mode
  * Returns 0 on success, 1 on hard failures, 2 on len == 0 (bb#1717) */
 static int dspresult(struct client_parallel_data *c) {
-    const char *filename;
     char *bol, *eol;
-    unsigned int rid;
     int len;
-    struct SCANID **id = NULL;
     struct RCVLN rcv;
 
     recvlninit(&rcv, c->sockd);
@@ -502,40 +547,8 @@ static int dspresult(struct client_parallel_data *c) {
 	len = recvln(&rcv, &bol, &eol);
 	if(len < 0) return 1;
 	if(!len) return 2;
-	if((rid = atoi(bol))) {
-	    id = &c->ids;
-	    while(*id) {
-		if((*id)->id == rid) break;
-		id = &((*id)->next);
-	    }
-	    if(!*id) id = NULL;
-	}
-	if(!id) {
-	    logg("!Bogus session id from clamd\n");
+	if(idreply(c, bol, eol, len))
 	    return 1;
-	}
-	filename = (*id)->file;
-	if(len > 7) {
-	    char *colon = strrchr(bol, ':');
-	    if(!colon) {
-		logg("!Failed to parse reply\n");
-		free((void *)filename);
-		return 1;
-	    } else if(!memcmp(eol - 7, " FOUND", 6)) {
-		c->infected++;
-		c->printok = 0;
-		logg("~%s%s\n", filename, colon);
-		if(action) action(filename);
-	    } else if(!memcmp(eol-7, " ERROR", 6)) {
-		c->errors++;
-		c->printok = 0;
-		logg("~%s%s\n", filename, colon);
-	    }
-	}
-	free((void *)filename);
-	bol = (char *)*id;
-	*id = (*id)->next;
-	free(bol);
     } while(rcv.cur != rcv.buf); /* clamd sends whole lines, so, on partial lines, we just assume
 				    more data can be recv()'d with close to zero latency */
     return 0;
@@ -686,3 +699,456 @@ int parallel_client_scan(char *file, int scantype, int *infected, int *err, int
 	logg("~%s: OK\n", file);
     return 0;
 }
+
+#ifndef _WIN32
+/* Connection pool for streaming to a remote clamd
+ *
+ * Each connection runs its own IDSESSION and the files are assigned to the
+ * connection which is free to take one, so several requests are in flight
+ * on every connection and the transfers overlap with the scans. When clamd
+ * supports it the files are sent as the objects of a single BATCHSTREAM,
+ * otherwise as INSTREAM requests with the whole file in one chunk. The file
+ * data goes straight from the file to the socket (sendfile() where
+ * available), the sockets being non blocking so that one slow connection
+ * doesn't hold up the others. */
+#define POOL_BUFSIZE (256 * 1024)
+
+struct pool_conn {
+    struct client_parallel_data c;
+    /* replies not consumed yet */
+    char rbuf[PATH_MAX + 1024];
+    unsigned int rlen;
+    /* commands and chunk lengths, sent before the object data */
+    char ctl[64];
+    unsigned int ctllen;
+    /* the object being sent: len bytes from fd, the zero padding making up
+     * for files shrinking while they're sent */
+    int fd;
+    unsigned long int left, pad;
+    char *buf;
+    unsigned int bufoff, buflen;
+    int batch, nosendfile;
+};
+
+struct client_pool {
+    struct pool_conn *conns;
+    unsigned int nconns, alive;
+    int batch;
+    int files, errors;
+};
+
+static const char zeros[4096];
+
+/* Asks clamd whether it accepts BATCHSTREAM
+ * Returns 1 if it does, 0 otherwise */
+static int batch_supported(void) {
+    static int supported = -1;
+    struct RCVLN rcv;
+    char *bol;
+    int sockd;
+
+    if(supported != -1)
+	return supported;
+    supported = 0;
+    if((sockd = dconnect()) < 0)
+	return 0;
+    recvlninit(&rcv, sockd);
+    if(!sendln(sockd, "zVERSIONCOMMANDS", 17) && recvln(&rcv, &bol, NULL) > 0) {
+	char *cmds = strstr(bol, "| COMMANDS:");
+
+	if(cmds && strstr(cmds, " BATCHSTREAM"))
+	    supported = 1;
+    }
+    closesocket(sockd);
+    return supported;
+}
+
+static void ctl_add(struct pool_conn *p, const void *data, unsigned int len) {
+    memcpy(&p->ctl[p->ctllen], data, len);
+    p->ctllen += len;
+}
+
+/* Drops a connection, failing the files it didn't reply to */
+static void pool_drop(struct client_pool *pool, struct pool_conn *p) {
+    struct SCANID *id;
+
+    if(p->c.ids)
+	logg("!Clamd closed the connection before scanning all files.\n");
+    while((id = p->c.ids)) {
+	p->c.ids = id->next;
+	logg("~%s: no reply from clamd\n", id->file);
+	p->c.errors++;
+	p->c.printok = 0;
+	free((void *)id->file);
+	free(id);
+    }
+    if(p->fd >= 0) {
+	close(p->fd);
+	p->fd = -1;
+    }
+    p->left = p->pad = 0;
+    p->ctllen = 0;
+    closesocket(p->c.sockd);
+    p->c.sockd = -1;
+    pool->alive--;
+}
+
+/* Consumes the replies available on a connection
+ * Returns 0 on success, -1 if the connection is gone */
+static int pool_read(struct pool_conn *p) {
+    char *bol, *eol;
+    int r;
+
+    while(1) {
+	r = recv(p->c.sockd, &p->rbuf[p->rlen], sizeof(p->rbuf) - p->rlen, 0);
+	if(r < 0) {
+	    if(errno == EINTR)
+		continue;
+	    if(errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	    logg("!Communication error: %s\n", strerror(errno));
+	    return -1;
+	}
+	if(!r)
+	    return -1;
+	p->rlen += r;
+	bol = p->rbuf;
+	while((eol = memchr(bol, 0, p->rlen - (bol - p->rbuf)))) {
+	    eol++;
+	    if(idreply(&p->c, bol, eol, eol - bol))
+		return -1;
+	    p->c.files++;
+	    bol = eol;
+	}
+	p->rlen -= bol - p->rbuf;
+	if(p->rlen == sizeof(p->rbuf)) {
+	    logg("!Overlong reply from clamd\n");
+	    return -1;
+	}
+	memmove(p->rbuf, bol, p->rlen);
+    }
+}
+
+/* Sends the next piece of the object data
+ * Returns the number of bytes sent, 0 if the socket is full, -1 on error */
+static long pool_senddata(struct pool_conn *p) {
+    unsigned long int todo = p->left < POOL_BUFSIZE ? p->left : POOL_BUFSIZE;
+    ssize_t n;
+
+#if defined(C_LINUX)
+    if(!p->nosendfile) {
+	n = sendfile(p->c.sockd, p->fd, NULL, todo);
+	if(n >= 0 || (errno != EINVAL && errno != ENOSYS))
+	    return n ? n : -2;
+	p->nosendfile = 1;
+    }
+#endif
+    if(p->bufoff == p->buflen) {
+	if(!p->buf && !(p->buf = malloc(POOL_BUFSIZE))) {
+	    logg("!Can't allocate the stream buffer\n");
+	    return -1;
+	}
+	do
+	    n = read(p->fd, p->buf, todo);
+	while(n < 0 && errno == EINTR);
+	if(n <= 0)
+	    return -2;
+	p->bufoff = 0;
+	p->buflen = n;
+    }
+    n = send(p->c.sockd, &p->buf[p->bufoff], p->buflen - p->bufoff, 0);
+    if(n > 0)
+	p->bufoff += n;
+    return n;
+}
+
+/* Pushes out as much as the socket takes
+ * Returns 0 on success, -1 if the connection failed */
+static int pool_write(struct pool_conn *p) {
+    uint32_t end = 0;
+    ssize_t n;
+
+    while(1) {
+	if(p->ctllen) {
+	    n = send(p->c.sockd, p->ctl, p->ctllen, 0);
+	    if(n > 0) {
+		p->ctllen -= n;
+		memmove(p->ctl, &p->ctl[n], p->ctllen);
+		continue;
+	    }
+	} else if(p->left) {
+	    n = pool_senddata(p);
+	    if(n == -2) {
+		/* the file shrank: keep the chunk length we announced */
+		logg("^%s: File changed or unreadable while it was sent to clamd\n", p->c.ids->file);
+		p->pad = p->left;
+		p->left = 0;
+		continue;
+	    }
+	    if(n > 0) {
+		p->left -= n;
+		if(!p->left && !p->pad)
+		    goto done;
+		continue;
+	    }
+	} else if(p->pad) {
+	    n = send(p->c.sockd, zeros, p->pad < sizeof(zeros) ? p->pad : sizeof(zeros), 0);
+	    if(n > 0) {
+		p->pad -= n;
+		if(!p->pad)
+		    goto done;
+		continue;
+	    }
+	} else {
+	    return 0;
+	}
+	if(n < 0 && errno == EINTR)
+	    continue;
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return 0;
+	logg("!Can't send to clamd: %s\n", strerror(errno));
+	return -1;
+
+    done:
+	close(p->fd);
+	p->fd = -1;
+	p->bufoff = p->buflen = 0;
+	if(!p->batch)
+	    ctl_add(p, &end, sizeof(end));
+    }
+}
+
+/* Waits for the connections to make progress, unless poll is set, and
+ * services them */
+static void pool_io(struct client_pool *pool, int poll) {
+    struct timeval tv = { 0, 0 };
+    fd_set rfds, wfds;
+    unsigned int i;
+    int maxfd = -1;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for(i = 0; i < pool->nconns; i++) {
+	struct pool_conn *p = &pool->conns[i];
+
+	if(p->c.sockd < 0)
+	    continue;
+	FD_SET(p->c.sockd, &rfds);
+	if(p->ctllen || p->left || p->pad)
+	    FD_SET(p->c.sockd, &wfds);
+	if(p->c.sockd > maxfd)
+	    maxfd = p->c.sockd;
+    }
+    if(maxfd < 0)
+	return;
+    if(select(maxfd + 1, &rfds, &wfds, NULL, poll ? &tv : NULL) < 0) {
+	if(errno != EINTR) {
+	    logg("!select() failed during session: %s\n", strerror(errno));
+	    for(i = 0; i < pool->nconns; i++)
+		if(pool->conns[i].c.sockd >= 0)
+		    pool_drop(pool, &pool->conns[i]);
+	}
+	return;
+    }
+    for(i = 0; i < pool->nconns; i++) {
+	struct pool_conn *p = &pool->conns[i];
+
+	if(p->c.sockd >= 0 && FD_ISSET(p->c.sockd, &rfds) && pool_read(p))
+	    pool_drop(pool, p);
+	if(p->c.sockd >= 0 && FD_ISSET(p->c.sockd, &wfds) && pool_write(p))
+	    pool_drop(pool, p);
+    }
+}
+
+/* Returns the connection with the fewest pending replies among the ones
+ * that can take a new file right away, or NULL */
+static struct pool_conn *pool_idle(struct client_pool *pool) {
+    struct pool_conn *best = NULL;
+    unsigned int i;
+
+    for(i = 0; i < pool->nconns; i++) {
+	struct pool_conn *p = &pool->conns[i];
+
+	if(p->c.sockd < 0 || p->fd >= 0)
+	    continue;
+	if(!best || p->c.lastid - p->c.files < best->c.lastid - best->c.files)
+	    best = p;
+    }
+    return best;
+}
+
+/* FTW callback for scanning through the connection pool
+ * Returns SUCCESS on success, CL_EXXX or BREAK on error */
+static int pool_callback(STATBUF *sb, char *filename, const char *path, enum cli_ftw_reason reason, struct cli_ftw_cbdata *data) {
+    struct client_pool *pool = (struct client_pool *)data->data;
+    struct pool_conn *p;
+    struct SCANID *cid;
+    unsigned long int len;
+    uint32_t chunk;
+    STATBUF st;
+    int fd;
+
+    UNUSEDPARAM(sb);
+
+    if(chkpath(path))
+	return CL_SUCCESS;
+    pool->files++;
+    switch(reason) {
+    case error_stat:
+	logg("!Can't access file %s\n", path);
+	pool->errors++;
+	return CL_SUCCESS;
+    case error_mem:
+	logg("!Memory allocation failed in ftw\n");
+	pool->errors++;
+	return CL_EMEM;
+    case warning_skipped_dir:
+	logg("^Directory recursion limit reached\n");
+	return CL_SUCCESS;
+    case warning_skipped_special:
+	logg("^%s: Not supported file type\n", path);
+	pool->errors++;
+    case warning_skipped_link:
+    case visit_directory_toplev:
+	return CL_SUCCESS;
+    case visit_file:
+	break;
+    }
+
+    if((fd = safe_open(filename, O_RDONLY | O_BINARY)) < 0 || FSTAT(fd, &st)) {
+	logg("~%s: Access denied. ERROR\n", filename);
+	if(fd >= 0)
+	    close(fd);
+	pool->errors++;
+	free(filename);
+	return CL_SUCCESS;
+    }
+    len = st.st_size;
+    if(len > maxstream)
+	len = maxstream;
+    if(!len) {
+	/* nothing to scan, and BATCHSTREAM can't carry empty objects */
+	close(fd);
+	free(filename);
+	return CL_SUCCESS;
+    }
+
+    /* collect the replies which came in, so clamd doesn't stall on them */
+    pool_io(pool, 1);
+    while(!(p = pool_idle(pool))) {
+	if(!pool->alive) {
+	    close(fd);
+	    free(filename);
+	    return CL_BREAK;
+	}
+	pool_io(pool, 0);
+    }
+
+    if(!(cid = (struct SCANID *)malloc(sizeof(struct SCANID)))) {
+	close(fd);
+	free(filename);
+	logg("!Failed to allocate scanid entry: %s\n", strerror(errno));
+	return CL_BREAK;
+    }
+    cid->id = ++p->c.lastid;
+    cid->file = filename;
+    cid->next = p->c.ids;
+    p->c.ids = cid;
+
+    if(!p->batch)
+	ctl_add(p, "zINSTREAM", 10);
+    chunk = htonl(len);
+    ctl_add(p, &chunk, sizeof(chunk));
+    p->fd = fd;
+    p->left = len;
+    if(pool_write(p))
+	pool_drop(pool, p);
+    return CL_SUCCESS;
+}
+
+/* Connection pool handler, see above
+ * Returns non zero for serious errors, zero otherwise */
+int pool_client_scan(char *file, int scantype, int *infected, int *err, int maxlevel, int flags) {
+    struct cli_ftw_cbdata data;
+    struct client_pool pool;
+    unsigned int i;
+    uint32_t end = 0;
+    int ftw, printok = printinfected^1;
+
+    UNUSEDPARAM(scantype);
+
+    memset(&pool, 0, sizeof(pool));
+    pool.nconns = connections ? connections : 1;
+    pool.batch = batch_supported();
+    if(!(pool.conns = calloc(pool.nconns, sizeof(*pool.conns)))) {
+	logg("!Can't allocate the connection pool\n");
+	return 1;
+    }
+    for(i = 0; i < pool.nconns; i++) {
+	struct pool_conn *p = &pool.conns[i];
+
+	p->fd = -1;
+	p->batch = pool.batch;
+	/* c.files counts the replies received */
+	p->c.scantype = STREAM;
+	p->c.printok = 1;
+	if((p->c.sockd = dconnect()) < 0)
+	    continue;
+	if(fcntl(p->c.sockd, F_SETFL, fcntl(p->c.sockd, F_GETFL) | O_NONBLOCK) == -1) {
+	    logg("!Can't make the connection non blocking: %s\n", strerror(errno));
+	    closesocket(p->c.sockd);
+	    p->c.sockd = -1;
+	    continue;
+	}
+	ctl_add(p, "zIDSESSION", 11);
+	if(pool.batch)
+	    ctl_add(p, "zBATCHSTREAM", 13);
+	pool.alive++;
+    }
+    if(!pool.alive) {
+	free(pool.conns);
+	return 1;
+    }
+    logg("*Streaming to clamd over %u connections%s\n", pool.alive, pool.batch ? " with BATCHSTREAM" : "");
+
+    data.data = &pool;
+    ftw = cli_ftw(file, flags, maxlevel ? maxlevel : INT_MAX, pool_callback, &data, ftw_chkpath);
+
+    /* end the batches and the sessions once the last files are out */
+    for(i = 0; i < pool.nconns; i++) {
+	struct pool_conn *p = &pool.conns[i];
+
+	while(p->c.sockd >= 0 && p->fd >= 0)
+	    pool_io(&pool, 0);
+	if(p->c.sockd < 0)
+	    continue;
+	if(pool.batch)
+	    ctl_add(p, &end, sizeof(end));
+	ctl_add(p, "zEND", 5);
+	if(pool_write(p))
+	    pool_drop(&pool, p);
+    }
+    while(pool.alive)
+	pool_io(&pool, 0);
+
+    for(i = 0; i < pool.nconns; i++) {
+	struct pool_conn *p = &pool.conns[i];
+
+	*infected += p->c.infected;
+	pool.errors += p->c.errors;
+	if(!p->c.printok)
+	    printok = 0;
+	free(p->buf);
+    }
+    free(pool.conns);
+    *err += pool.errors;
+
+    if(ftw != CL_SUCCESS || pool.errors)
+	return 1;
+    if(!pool.files)
+	return 0;
+    if(printok)
+	logg("~%s: OK\n", file);
+    return 0;
+}
+#endif
@@ -26,5 +26,8 @@
 int dconnect(void);
 int serial_client_scan(char *file, int scantype, int *infected, int *err, int maxlevel, int flags);
 int parallel_client_scan(char *file, int scantype, int *infected, int *err, int maxlevel, int flags);
+#ifndef _WIN32
+int pool_client_scan(char *file, int scantype, int *infected, int *err, int maxlevel, int flags);
+#endif
 int dsresult(int sockd, int scantype, const char *filename, int *printok, int *errors);
 #endif
@@ -63,6 +63,21 @@
 #include "shared/misc.h"
 
 /* Types, prototypes and globals*/
+#define SUB_POOLS_MAX 8
+
+/* state pushed by a clamd with SUBSCRIBE, see apply_update() */
+struct sub_view {
+	double now; /* clamd's clock */
+	unsigned npools;
+	struct {
+		int primary;
+		unsigned live, idle, max, queue;
+	} pools[SUB_POOLS_MAX];
+	char **tasks; /* "\tCOMMAND start filename" */
+	unsigned ntasks;
+	char *memstats;
+};
+
 typedef struct connection {
 	int sd;
 	char *remote;
@@ -70,6 +85,11 @@ typedef struct connection {
 	struct timeval tv_conn;
 	char *version;
 	int line;
+	/* sd is a SUBSCRIBE feed instead of an IDSESSION */
+	int subscribed;
+	char *rbuf;
+	size_t rlen, rsize;
+	struct sub_view view;
 } conn_t;
 
 struct global_stats {
@@ -100,6 +120,7 @@ struct stats {
 };
 
 static void cleanup(void);
+static void free_view(conn_t *conn);
 static int send_string_noreconn(conn_t *conn, const char *cmd);
 static void send_string(conn_t *conn, const char *cmd);
 static int read_version(conn_t *conn);
@@ -418,11 +439,13 @@ static void cleanup(void)
 	curses_inited = 0;
 	for (i=0;i<global.num_clamd;i++) {
 		if (global.conn[i].sd && global.conn[i].sd != -1) {
-			send_string_noreconn(&global.conn[i], "nEND\n");
+			if (!global.conn[i].subscribed)
+				send_string_noreconn(&global.conn[i], "nEND\n");
 			close(global.conn[i].sd);
 		}
 		free(global.conn[i].version);
 		free(global.conn[i].remote);
+		free_view(&global.conn[i]);
 	}
 	free(global.all_stats);
 	free(global.conn);
@@ -708,6 +731,49 @@ end:
     return 0;
 }
 
+static void free_view(conn_t *conn)
+{
+    unsigned i;
+
+    for (i = 0; i < conn->view.ntasks; i++)
+        free(conn->view.tasks[i]);
+    free(conn->view.tasks);
+    free(conn->view.memstats);
+    free(conn->rbuf);
+    memset(&conn->view, 0, sizeof(conn->view));
+    conn->rbuf = NULL;
+    conn->rlen = conn->rsize = 0;
+    conn->subscribed = 0;
+}
+
+/* Replaces the IDSESSION by a SUBSCRIBE feed on a new connection, clamd then
+ * pushes its state instead of being polled with STATS. The IDSESSION is
+ * kept with a clamd which doesn't know SUBSCRIBE. */
+static void subscribe(const char *soname, conn_t *conn)
+{
+    conn_t sub;
+    char buf[64];
+    ssize_t n;
+
+    memset(&sub, 0, sizeof(sub));
+    sub.line = conn->line;
+    if (make_connection_real(soname, &sub))
+        return;
+    free(sub.remote);
+    snprintf(buf, sizeof(buf), "nSUBSCRIBE %u\n", MIN_INTERVAL * 1000);
+    /* the first update is sent right away */
+    if (send_string_noreconn(&sub, buf) == -1 ||
+        (n = recv(sub.sd, buf, 7, MSG_PEEK | MSG_WAITALL)) != 7 || memcmp(buf, "UPDATE ", 7)) {
+        close(sub.sd);
+        return;
+    }
+    send_string_noreconn(conn, "nEND\n");
+    close(conn->sd);
+    free_view(conn);
+    conn->sd = sub.sd;
+    conn->subscribed = 1;
+}
+
 static int make_connection(const char *soname, conn_t *conn)
 {
     int rc;
@@ -718,8 +784,10 @@ static int make_connection(const char *soname, conn_t *conn)
     send_string(conn, "nIDSESSION\nnVERSION\n");
     free(conn->version);
     conn->version = NULL;
-    if (!read_version(conn))
+    if (!read_version(conn)) {
+        subscribe(soname, conn);
         return 0;
+    }
 
     /* clamd < 0.95 */
     if ((rc = make_connection_real(soname, conn)))
@@ -757,6 +825,7 @@ static void reconnect(conn_t *conn)
 	}
 	if (conn->sd != -1)
 	    close(conn->sd);
+	free_view(conn);
 	if (make_connection(conn->remote, conn) < 0) {
 		print_con_info(conn, "Unable to reconnect to %s: %s", conn->remote, strerror(errno));
 		EXIT_PROGRAM(RECONNECT_FAIL);
@@ -860,6 +929,17 @@ static void output_queue(size_t line, ssize_t max)
 /* ---------------------- stats parsing routines ------------------- */
 
 
+static void add_task(const char *line, double tim, unsigned idx)
+{
+	++global.n;
+	global.tasks = realloc(global.tasks, sizeof(*global.tasks)*global.n);
+	OOM_CHECK(global.tasks);
+	global.tasks[global.n-1].line = strdup(line);
+	OOM_CHECK(global.tasks[global.n-1].line);
+	global.tasks[global.n-1].tim  = tim;
+	global.tasks[global.n-1].clamd_no = idx + 1;
+}
+
 static void parse_queue(conn_t *conn, char* buf, size_t len, unsigned idx)
 {
 	do {
@@ -869,16 +949,128 @@ static void parse_queue(conn_t *conn, char* buf, size_t len, unsigned idx)
 			continue;
 		if(sscanf(t,"%lf", &tim) != 1)
 			continue;
-		++global.n;
-		global.tasks = realloc(global.tasks, sizeof(*global.tasks)*global.n);
-		OOM_CHECK(global.tasks);
-		global.tasks[global.n-1].line = strdup(buf);
-		OOM_CHECK(global.tasks[global.n-1].line);
-		global.tasks[global.n-1].tim  = tim;
-		global.tasks[global.n-1].clamd_no = idx + 1;
+		add_task(buf, tim, idx);
 	} while (recv_line(conn, buf, len) && buf[0] == '\t' && strcmp("END\n", buf) != 0);
 }
 
+/* one line of a SUBSCRIBE update, only what changed is sent */
+static void apply_update(conn_t *conn, char *line)
+{
+	struct sub_view *v = &conn->view;
+	unsigned i, live, idle, max, queue;
+	double now;
+	char kind[16];
+
+	if (line[0] == '\t') {
+		v->tasks = realloc(v->tasks, sizeof(*v->tasks) * (v->ntasks + 1));
+		OOM_CHECK(v->tasks);
+		v->tasks[v->ntasks] = strdup(line);
+		OOM_CHECK(v->tasks[v->ntasks]);
+		v->ntasks++;
+	} else if (sscanf(line, "UPDATE %*u %lf", &now) == 1) {
+		v->now = now;
+	} else if (sscanf(line, "POOLS %u", &i) == 1) {
+		v->npools = i < SUB_POOLS_MAX ? i : SUB_POOLS_MAX;
+	} else if (sscanf(line, "POOL %u %15s live %u idle %u max %u queue %u", &i, kind, &live, &idle, &max, &queue) == 6) {
+		if (i >= SUB_POOLS_MAX)
+			return;
+		v->pools[i].primary = !strcmp(kind, "PRIMARY");
+		v->pools[i].live = live;
+		v->pools[i].idle = idle;
+		v->pools[i].max = max;
+		v->pools[i].queue = queue;
+	} else if (!strncmp(line, "TASKS ", 6)) {
+		for (i = 0; i < v->ntasks; i++)
+			free(v->tasks[i]);
+		v->ntasks = 0;
+	} else if (!strncmp(line, "MEMSTATS:", 9)) {
+		free(v->memstats);
+		v->memstats = strdup(line + 9);
+		OOM_CHECK(v->memstats);
+	}
+}
+
+/* Reads whatever the SUBSCRIBE feed has without waiting, and applies the
+ * complete updates; 0 when the connection was lost */
+static int read_updates(conn_t *conn)
+{
+	char *line, *end, *last;
+	ssize_t n;
+
+	while (1) {
+		if (conn->rsize - conn->rlen < 4096) {
+			conn->rsize = conn->rsize ? conn->rsize * 2 : 16384;
+			conn->rbuf = realloc(conn->rbuf, conn->rsize);
+			OOM_CHECK(conn->rbuf);
+		}
+		n = recv(conn->sd, conn->rbuf + conn->rlen, conn->rsize - conn->rlen - 1, MSG_DONTWAIT);
+		if (n > 0) {
+			conn->rlen += n;
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0 && errno == EINTR)
+			continue;
+		print_con_info(conn, "%s: %s", conn->remote, n ? strerror(errno) : "connection closed");
+		close(conn->sd);
+		conn->sd = -1;
+		return 0;
+	}
+	conn->rbuf[conn->rlen] = '\0';
+
+	/* up to the last END line */
+	for (last = NULL, line = conn->rbuf; (end = strchr(line, '\n')); line = end + 1)
+		if (end - line == 3 && !memcmp(line, "END", 3))
+			last = end + 1;
+	if (!last)
+		return 1;
+	for (line = conn->rbuf; line < last; line = end + 1) {
+		end = strchr(line, '\n');
+		*end = '\0';
+		apply_update(conn, line);
+	}
+	conn->rlen -= last - conn->rbuf;
+	memmove(conn->rbuf, last, conn->rlen);
+	return 1;
+}
+
+static void parse_memstats(const char *line, struct stats *stats);
+
+static void parse_view(conn_t *conn, struct stats *stats, unsigned idx)
+{
+	const struct sub_view *v = &conn->view;
+	char cmd[64];
+	double start;
+	int off;
+	unsigned i;
+
+	if (conn->sd == -1 || !read_updates(conn))
+		return;
+	for (i = 0; i < v->npools; i++) {
+		if (v->pools[i].primary) {
+			stats->prim_live = v->pools[i].live;
+			stats->prim_idle = v->pools[i].idle;
+			stats->prim_max = v->pools[i].max;
+		}
+		stats->live += v->pools[i].live;
+		stats->idle += v->pools[i].idle;
+		stats->max += v->pools[i].max;
+		stats->current_q += v->pools[i].queue;
+	}
+	for (i = 0; i < v->ntasks; i++) {
+		char line[1100];
+
+		/* the same line as STATS, with the time the task has run */
+		if (sscanf(v->tasks[i], "\t%63s %lf %n", cmd, &start, &off) != 2)
+			continue;
+		snprintf(line, sizeof(line), "\t%s %f %s\n", cmd, v->now - start, v->tasks[i] + off);
+		add_task(line, v->now - start, idx);
+	}
+	if (v->memstats)
+		parse_memstats(v->memstats, stats);
+}
+
 static unsigned biggest_mem = 0;
 
 static void output_memstats(struct stats *stats)
@@ -1149,6 +1341,10 @@ static void parse_stats(conn_t *conn, struct stats *stats, unsigned idx)
 	stats->conn_min = (conn_dt/60)%60;
 	stats->conn_sec = conn_dt%60;
 	stats->current_q = 0;
+	if (conn->subscribed) {
+		parse_view(conn, stats, idx);
+		return;
+	}
 	buf[sizeof(buf) - 1] = 0x0;
 	while(recv_line(conn, buf, sizeof(buf)-1) && strcmp("END\n",buf) != 0) {
 		char *val = strchr(buf, ':');
@@ -1475,7 +1671,7 @@ int main(int argc, char *argv[])
 			for(i=0;i<global.num_clamd;i++) {
 				unsigned biggest_q;
 				struct stats *stats = &global.all_stats[i];
-				if (global.conn[i].sd != -1)
+				if (global.conn[i].sd != -1 && !global.conn[i].subscribed)
 					send_string(&global.conn[i], "nSTATS\n");
 				biggest_q = stats->biggest_queue;
 				memset(stats, 0, sizeof(*stats));
@@ -172,6 +172,8 @@ int main(int argc, char **argv)
 	logg("Engine version: %s\n", get_version());
 	logg("Scanned directories: %u\n", info.dirs);
 	logg("Scanned files: %u\n", info.files);
+	if(optget(opts, "journal")->enabled)
+	    logg("Unchanged files: %u\n", info.jfiles);
 	logg("Infected files: %u\n", info.ifiles);
 	if(info.errors)
 	    logg("Total errors: %u\n", info.errors);
@@ -224,6 +226,7 @@ void help(void)
     mprintf("    --official-db-only[=yes/no(*)]       Only load official signatures\n");
     mprintf("    --log=FILE            -l FILE        Save scan report to FILE\n");
     mprintf("    --recursive[=yes/no(*)]  -r          Scan subdirectories recursively\n");
+    mprintf("    --threads=#n                         Scan with #n threads sharing the databases\n");
     mprintf("    --allmatch[=yes/no(*)]   -z          Continue scanning within file after finding a match\n");
     mprintf("    --cross-fs[=yes(*)/no]               Scan files and directories on other filesystems\n");
     mprintf("    --follow-dir-symlinks[=0/1(*)/2]     Follow directory symlinks (0 = never, 1 = direct, 2 = always)\n");
@@ -285,16 +288,36 @@ void help(void)
     mprintf("    --max-partitions=#n                  Maximum number of partitions in disk image to be scanned\n");
     mprintf("    --max-iconspe=#n                     Maximum number of icons in PE file to be scanned\n");
     mprintf("    --max-rechwp3=#n                     Maximum recursive calls to HWP3 parsing function\n");
+    mprintf("    --max-scantime=#n                    Maximum time in milliseconds to scan a file\n");
+    mprintf("    --max-scan-cputime=#n                Maximum CPU time in milliseconds to scan a file\n");
+    mprintf("    --max-inflated-size=#n               Maximum amount of data extracted while scanning a file\n");
 #if HAVE_PCRE
     mprintf("    --pcre-match-limit=#n                Maximum calls to the PCRE match function.\n");
     mprintf("    --pcre-recmatch-limit=#n             Maximum recursive calls to the PCRE match function.\n");
     mprintf("    --pcre-max-filesize=#n               Maximum size file to perform PCRE subsig matching.\n");
 #endif /* HAVE_PCRE */
+    mprintf("    --parallel-scan-threads=#n           Number of threads scanning a single large file\n");
+    mprintf("    --extract-max-mem-size=#n            Extracted files up to this size are scanned from memory\n");
+    mprintf("    --archive-scan-threads=#n            Number of threads scanning the members of a large archive\n");
+    mprintf("    --decompress-threads=#n              Number of threads decoding xz and bzip2 blocks\n");
+    mprintf("    --archive-risk-order[=yes/no(*)]     Extract the likely malicious members of zip archives first\n");
+    mprintf("    --fused-pattern-scan[=yes/no(*)]     Match static body signatures in the same pass as the others\n");
+    mprintf("    --merged-scan-target=#n              Match the signatures of this target and the generic ones in one pass\n");
     mprintf("    --enable-stats                       Enable statistical reporting of malware\n");
     mprintf("    --disable-pe-stats                   Disable submission of individual PE sections in stats submissions\n");
     mprintf("    --stats-timeout=#n                   Number of seconds to wait for waiting a response back from the stats server\n");
     mprintf("    --stats-host-id=UUID                 Set the Host ID used when submitting statistical info.\n");
     mprintf("    --disable-cache                      Disable caching and cache checks for hash sums of scanned files.\n");
+    mprintf("    --cache-size=#n                      Number of files remembered by the cache of clean files\n");
+    mprintf("    --cache-file=FILE                    Load the cache from FILE and save it back on exit\n");
+    mprintf("    --journal=FILE                       Skip the files found clean by earlier runs recorded in FILE\n");
+    mprintf("    --profile=FILE                       Append the time spent on each object of the scanned files to FILE\n");
+    mprintf("    --debug-load-timing                  Print the time spent on each phase of the database load\n");
+    mprintf("    --hash-image-file=FILE               Share the hash signatures with other processes through FILE\n");
+    mprintf("    --ac-profile-file=FILE               Anchor the body signatures on the bytes rare in the FILE profile\n");
+    mprintf("    --huge-pages=MODE                    Keep the signatures in huge pages (no, transparent, explicit)\n");
+    mprintf("    --database-load-threads=#n           Load the hash databases and build the matchers with #n threads\n");
+    mprintf("    --lazy-matchers[=yes/no(*)]          Build the file type matchers when first needed\n");
     mprintf("\n");
     mprintf("(*) Default scan settings\n");
     mprintf("(**) Certain files (e.g. documents, archives, etc.) may in turn contain other\n");
@@ -26,6 +26,7 @@ struct s_info {
     unsigned int sigs;		/* number of signatures */
     unsigned int dirs;		/* number of scanned directories */
     unsigned int files;		/* number of scanned files */
+    unsigned int jfiles;	/* number of files skipped as unchanged */
     unsigned int ifiles;	/* number of infected files */
     unsigned int errors;	/* number of errors */
     unsigned long int blocks;	/* number of *scanned* 16kb blocks */
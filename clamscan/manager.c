@@ -48,6 +48,9 @@
 #include <signal.h>
 #include <errno.h>
 #include <target.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "manager.h"
 #include "global.h"
@@ -56,6 +59,7 @@
 #include "shared/actions.h"
 #include "shared/output.h"
 #include "shared/misc.h"
+#include "shared/journal.h"
 
 #include "libclamav/clamav.h"
 #include "libclamav/others.h"
@@ -71,9 +75,209 @@ dev_t procdev;
 
 char hostid[37];
 
+static struct scan_journal *journal;
+static FILE *profile_file;
+
 int is_valid_hostid(void);
 char *get_hostid(void *cbdata);
 
+static void scanfile(const char *filename, struct cl_engine *engine, const struct optstruct *opts, unsigned int options);
+static void scandirs(const char *dirname, struct cl_engine *engine, const struct optstruct *opts, unsigned int options, unsigned int depth, dev_t dev);
+
+#ifdef CL_THREAD_SAFE
+/* With --threads, the directories are read and the files scanned by a pool
+ * of threads sharing the engine. A job that doesn't fit in the queue is run
+ * by the thread that found it, so the walk can't stall on a full queue. */
+struct scan_job {
+    char *path;
+    int isdir;
+    unsigned int depth;
+    dev_t dev;
+};
+
+struct scan_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    struct scan_job *jobs;
+    unsigned int size;
+    unsigned int head;
+    unsigned int count;
+
+    /* jobs being run */
+    unsigned int active;
+    int done;
+
+    pthread_t *threads;
+    unsigned int nthreads;
+
+    struct cl_engine *engine;
+    const struct optstruct *opts;
+    unsigned int options;
+};
+
+static struct scan_pool *pool;
+
+/* the counters, the bell and the actions are shared by the scan threads */
+static pthread_mutex_t info_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define INFO_LOCK() pthread_mutex_lock(&info_mutex)
+#define INFO_UNLOCK() pthread_mutex_unlock(&info_mutex)
+#else
+#define INFO_LOCK()
+#define INFO_UNLOCK()
+#endif
+
+#define INFO_ADD(field, n) do { INFO_LOCK(); info.field += (n); INFO_UNLOCK(); } while(0)
+
+#ifdef CL_THREAD_SAFE
+static void *scan_worker(void *arg)
+{
+    struct scan_job job;
+
+    UNUSEDPARAM(arg);
+
+    pthread_mutex_lock(&pool->mutex);
+    while(1) {
+        while(!pool->count && !pool->done)
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+
+        if(!pool->count)
+            break;
+
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->size;
+        pool->count--;
+        pool->active++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if(job.isdir)
+            scandirs(job.path, pool->engine, pool->opts, pool->options, job.depth, job.dev);
+        else
+            scanfile(job.path, pool->engine, pool->opts, pool->options);
+        free(job.path);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->active--;
+        if(!pool->count && !pool->active)
+            pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/* Returns 0 if the job was queued, -1 if the caller has to run it. */
+static int scan_push(const char *path, int isdir, unsigned int depth, dev_t dev)
+{
+    struct scan_job *job;
+    char *copy;
+
+    if(!pool)
+        return -1;
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->count == pool->size || !(copy = strdup(path))) {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    job = &pool->jobs[(pool->head + pool->count) % pool->size];
+    job->path = copy;
+    job->isdir = isdir;
+    job->depth = depth;
+    job->dev = dev;
+    pool->count++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+static int scan_pool_start(unsigned int nthreads, struct cl_engine *engine, const struct optstruct *opts, unsigned int options)
+{
+    unsigned int i;
+
+    if(!(pool = calloc(1, sizeof(*pool))))
+        return -1;
+
+    pool->size = nthreads * 64;
+    pool->jobs = malloc(pool->size * sizeof(*pool->jobs));
+    pool->threads = malloc(nthreads * sizeof(pthread_t));
+    if(!pool->jobs || !pool->threads) {
+        free(pool->jobs);
+        free(pool->threads);
+        free(pool);
+        pool = NULL;
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->engine = engine;
+    pool->opts = opts;
+    pool->options = options;
+
+    for(i = 0; i < nthreads; i++) {
+        if(pthread_create(&pool->threads[i], NULL, scan_worker, NULL))
+            break;
+        pool->nthreads++;
+    }
+
+    if(!pool->nthreads) {
+        logg("^Can't start the scan threads, scanning with a single thread\n");
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->jobs);
+        free(pool->threads);
+        free(pool);
+        pool = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Waits for all the queued jobs, and the ones they queue in turn, to be done. */
+static void scan_pool_stop(void)
+{
+    unsigned int i;
+
+    if(!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->count || pool->active)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+    pool = NULL;
+}
+#else
+#define scan_push(path, isdir, depth, dev) (-1)
+#endif
+
+static void queuefile(const char *filename, struct cl_engine *engine, const struct optstruct *opts, unsigned int options)
+{
+    if(scan_push(filename, 0, 0, 0))
+        scanfile(filename, engine, opts, options);
+}
+
+static void queuedir(const char *dirname, struct cl_engine *engine, const struct optstruct *opts, unsigned int options, unsigned int depth, dev_t dev)
+{
+    if(scan_push(dirname, 1, depth, dev))
+        scandirs(dirname, engine, opts, options, depth, dev);
+}
+
 #ifdef _WIN32
 /* FIXME: If possible, handle users correctly */
 static int checkaccess(const char *path, const char *username, int mode)
@@ -136,6 +340,52 @@ struct clamscan_cb_data {
     const char * filename;
 };
 
+/* --debug-load-timing */
+static void print_loadstats(const struct cl_engine *engine)
+{
+    struct cl_loadstat stats[32];
+    unsigned int i, count = sizeof(stats) / sizeof(stats[0]);
+    unsigned long long calls = 0, wall = 0, cpu = 0;
+    long long mem = 0;
+
+    if (cl_engine_get_loadstats(engine, stats, &count) != CL_SUCCESS)
+        return;
+    if (count > sizeof(stats) / sizeof(stats[0]))
+        count = sizeof(stats) / sizeof(stats[0]);
+    logg("%-18s %8s %11s %11s %11s\n", "PHASE", "CALLS", "WALL(ms)", "CPU(ms)", "MEM(KB)");
+    for (i = 0; i < count; i++) {
+        logg("%-18s %8llu %11.2f %11.2f %+11lld\n", stats[i].name, stats[i].calls,
+             stats[i].wall_usec / 1000.0, stats[i].cpu_usec / 1000.0, stats[i].mem_bytes / 1024);
+        calls += stats[i].calls;
+        wall += stats[i].wall_usec;
+        cpu += stats[i].cpu_usec;
+        mem += stats[i].mem_bytes;
+    }
+    logg("%-18s %8llu %11.2f %11.2f %+11lld\n\n", "total", calls, wall / 1000.0, cpu / 1000.0, mem / 1024);
+}
+
+/* --profile: a line per scanned file with its name and the profile tree */
+static void profile(int fd, const char *tree, void *context)
+{
+    struct clamscan_cb_data *d = context;
+    const char *name = d && d->filename ? d->filename : "";
+
+    UNUSEDPARAM(fd);
+
+    INFO_LOCK();
+    fputs("{\"file\":\"", profile_file);
+    for (; *name; name++) {
+        if (*name == '"' || *name == '\\')
+            fprintf(profile_file, "\\%c", *name);
+        else if ((unsigned char)*name < 0x20)
+            fprintf(profile_file, "\\u%04x", (unsigned char)*name);
+        else
+            fputc(*name, profile_file);
+    }
+    fprintf(profile_file, "\",\"profile\":%s}\n", tree);
+    INFO_UNLOCK();
+}
+
 static cl_error_t pre(int fd, const char *type, void *context)
 {
     struct metachain *c;
@@ -298,6 +548,9 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
     STATBUF sb;
     struct metachain chain;
     struct clamscan_cb_data data;
+    unsigned long int blocks = 0;
+    time_t start = time(NULL);
+    int statok = 0;
 
     if((opt = optget(opts, "exclude"))->enabled) {
         while(opt) {
@@ -349,7 +602,16 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
             return;
         }
 
-        info.rblocks += sb.st_size / CL_COUNT_PRECISION;
+        if(journal && journal_check(journal, engine, options, filename, &sb)) {
+            if(!printinfected && printclean)
+                mprintf("~%s: OK\n", filename);
+
+            INFO_ADD(jfiles, 1);
+            return;
+        }
+
+        INFO_ADD(rblocks, sb.st_size / CL_COUNT_PRECISION);
+        statok = 1;
     }
 
 #ifndef _WIN32
@@ -358,7 +620,7 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
             if(!printinfected)
                 logg("~%s: Access denied\n", filename);
 
-            info.errors++;
+            INFO_ADD(errors, 1);
             return;
         }
     }
@@ -372,7 +634,7 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
             if (!chain.chains[0]) {
                 free(chain.chains);
                 logg("Unable to allocate memory in scanfile()\n");
-                info.errors++;
+                INFO_ADD(errors, 1);
                 return;
             }
             chain.nchains = 1;
@@ -383,13 +645,15 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
 
     if((fd = safe_open(filename, O_RDONLY|O_BINARY)) == -1) {
         logg("^Can't open file %s: %s\n", filename, strerror(errno));
-        info.errors++;
+        INFO_ADD(errors, 1);
         return;
     }
 
     data.chain = &chain;
     data.filename = filename;
-    if((ret = cl_scandesc_callback(fd, &virname, &info.blocks, engine, options, &data)) == CL_VIRUS) {
+    ret = cl_scandesc_callback(fd, &virname, &blocks, engine, options, &data);
+    INFO_ADD(blocks, blocks);
+    if(ret == CL_VIRUS) {
         if(optget(opts, "archive-verbose")->enabled) {
             if (chain.nchains > 1) {
                 char str[128];
@@ -400,21 +664,30 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
                 logg("~%s!(%llu): %s FOUND\n", filename, (long long unsigned)(chain.lastvir-1), virname);
             }
         }
+        INFO_LOCK();
         info.files++;
         info.ifiles++;
 
         if(bell)
             fprintf(stderr, "\007");
+        INFO_UNLOCK();
     } else if(ret == CL_CLEAN) {
         if(!printinfected && printclean)
             mprintf("~%s: OK\n", filename);
 
-        info.files++;
+        INFO_ADD(files, 1);
     } else {
         if(!printinfected)
             logg("~%s: %s ERROR\n", filename, cl_strerror(ret));
 
-        info.errors++;
+        INFO_ADD(errors, 1);
+    }
+
+    if(journal && statok) {
+        if(ret == CL_CLEAN)
+            journal_add(journal, engine, options, filename, &sb, start);
+        else
+            journal_remove(journal, filename);
     }
 
     for (i=0;i<chain.nchains;i++)
@@ -423,8 +696,11 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
     free(chain.chains);
     close(fd);
 
-    if(ret == CL_VIRUS && action)
+    if(ret == CL_VIRUS && action) {
+        INFO_LOCK();
         action(filename);
+        INFO_UNLOCK();
+    }
 }
 
 static void scandirs(const char *dirname, struct cl_engine *engine, const struct optstruct *opts, unsigned int options, unsigned int depth, dev_t dev)
@@ -477,7 +753,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
     filelnk = optget(opts, "follow-file-symlinks")->numarg;
 
     if((dd = opendir(dirname)) != NULL) {
-        info.dirs++;
+        INFO_ADD(dirs, 1);
         depth++;
         while((dent = readdir(dd))) {
             if(dent->d_ino) {
@@ -511,19 +787,19 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
                                     logg("%s: Symbolic link\n", fname);
                             } else if(CLAMSTAT(fname, &sb) != -1) {
                                 if(S_ISREG(sb.st_mode) && filelnk == 2) {
-                                    scanfile(fname, engine, opts, options);
+                                    queuefile(fname, engine, opts, options);
                                 } else if(S_ISDIR(sb.st_mode) && dirlnk == 2) {
                                     if(recursion)
-                                        scandirs(fname, engine, opts, options, depth, dev);
+                                        queuedir(fname, engine, opts, options, depth, dev);
                                 } else {
                                     if(!printinfected)
                                         logg("%s: Symbolic link\n", fname);
                                 }
                             }
                         } else if(S_ISREG(sb.st_mode)) {
-                            scanfile(fname, engine, opts, options);
+                            queuefile(fname, engine, opts, options);
                         } else if(S_ISDIR(sb.st_mode) && recursion) {
-                            scandirs(fname, engine, opts, options, depth, dev);
+                            queuedir(fname, engine, opts, options, depth, dev);
                         }
                     }
 
@@ -536,7 +812,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
         if(!printinfected)
             logg("~%s: Can't open directory.\n", dirname);
 
-        info.errors++;
+        INFO_ADD(errors, 1);
     }
 }
 
@@ -675,6 +951,55 @@ int scanmanager(const struct optstruct *opts)
     if (optget(opts, "disable-cache")->enabled)
         cl_engine_set_num(engine, CL_ENGINE_DISABLE_CACHE, 1);
 
+    if ((opt = optget(opts, "cache-size"))->active)
+        cl_engine_set_num(engine, CL_ENGINE_CACHE_SIZE, opt->numarg);
+
+    if ((opt = optget(opts, "huge-pages"))->enabled && strcmp(opt->strarg, "no")) {
+        if (!strcmp(opt->strarg, "explicit"))
+            cl_engine_set_num(engine, CL_ENGINE_HUGEPAGES, CL_HUGEPAGES_EXPLICIT);
+        else
+            cl_engine_set_num(engine, CL_ENGINE_HUGEPAGES, CL_HUGEPAGES_TRANSPARENT);
+    }
+
+    if ((opt = optget(opts, "database-load-threads"))->numarg)
+        cl_engine_set_num(engine, CL_ENGINE_LOAD_THREADS, opt->numarg);
+
+    if (optget(opts, "lazy-matchers")->enabled)
+        cl_engine_set_num(engine, CL_ENGINE_LAZY_MATCHERS, 1);
+
+    if ((opt = optget(opts, "merged-scan-target"))->enabled) {
+        uint32_t targets = 0;
+
+        for (; opt; opt = opt->nextarg)
+            if (opt->numarg > 0 && opt->numarg < 32)
+                targets |= 1U << opt->numarg;
+        cl_engine_set_num(engine, CL_ENGINE_MERGED_TARGETS, targets);
+    }
+
+    if ((opt = optget(opts, "hash-image-file"))->enabled) {
+        if ((ret = cl_engine_set_str(engine, CL_ENGINE_HASH_IMAGE, opt->strarg))) {
+            logg("!cli_engine_set_str(CL_ENGINE_HASH_IMAGE) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if ((opt = optget(opts, "ac-profile-file"))->enabled) {
+        if ((ret = cl_engine_set_str(engine, CL_ENGINE_AC_PROFILE, opt->strarg))) {
+            logg("!cli_engine_set_str(CL_ENGINE_AC_PROFILE) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if ((opt = optget(opts, "cache-file"))->enabled) {
+        if ((ret = cl_engine_set_str(engine, CL_ENGINE_CACHE_FILE, opt->strarg))) {
+            logg("!cli_engine_set_str(CL_ENGINE_CACHE_FILE) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
     if (optget(opts, "disable-pe-stats")->enabled) {
         cl_engine_set_num(engine, CL_ENGINE_DISABLE_PE_STATS, 1);
     }
@@ -885,6 +1210,18 @@ int scanmanager(const struct optstruct *opts)
         return 2;
     }
 
+    if(optget(opts, "debug-load-timing")->enabled)
+        print_loadstats(engine);
+
+    if((opt = optget(opts, "profile"))->enabled) {
+        if(!(profile_file = fopen(opt->strarg, "a"))) {
+            logg("!Can't open %s for writing\n", opt->strarg);
+            cl_engine_free(engine);
+            return 2;
+        }
+        cl_engine_set_clcb_profile(engine, profile);
+    }
+
     if(optget(opts, "archive-verbose")->enabled) {
         cl_engine_set_clcb_meta(engine, meta);
         cl_engine_set_clcb_pre_cache(engine, pre);
@@ -1014,7 +1351,7 @@ int scanmanager(const struct optstruct *opts)
         }
     }
 
-    if ((opt = optget(opts, "timelimit"))->active) {
+    if ((opt = optget(opts, "max-scantime"))->active || (opt = optget(opts, "timelimit"))->active) {
         if ((ret = cl_engine_set_num(engine, CL_ENGINE_TIME_LIMIT, opt->numarg))) {
             logg("!cli_engine_set_num(CL_ENGINE_TIME_LIMIT) failed: %s\n", cl_strerror(ret));
 
@@ -1023,6 +1360,22 @@ int scanmanager(const struct optstruct *opts)
         }
     }
 
+    if ((opt = optget(opts, "max-scan-cputime"))->active) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_CPU_LIMIT, opt->numarg))) {
+            logg("!cli_engine_set_num(CL_ENGINE_CPU_LIMIT) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if ((opt = optget(opts, "max-inflated-size"))->active) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_MAX_INFLATED, opt->numarg))) {
+            logg("!cli_engine_set_num(CL_ENGINE_MAX_INFLATED) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
     if ((opt = optget(opts, "pcre-max-filesize"))->active) {
         if ((ret = cl_engine_set_num(engine, CL_ENGINE_PCRE_MAX_FILESIZE, opt->numarg))) {
             logg("!cli_engine_set_num(CL_ENGINE_PCRE_MAX_FILESIZE) failed: %s\n", cl_strerror(ret));
@@ -1031,6 +1384,54 @@ int scanmanager(const struct optstruct *opts)
         }
     }
 
+    if ((opt = optget(opts, "extract-max-mem-size"))->active) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_EXTRACT_MEM, opt->numarg))) {
+            logg("!cli_engine_set_num(CL_ENGINE_EXTRACT_MEM) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if ((opt = optget(opts, "archive-scan-threads"))->active) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_ARCHIVE_THREADS, opt->numarg))) {
+            logg("!cli_engine_set_num(CL_ENGINE_ARCHIVE_THREADS) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if ((opt = optget(opts, "decompress-threads"))->active) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_DECOMPRESS_THREADS, opt->numarg))) {
+            logg("!cli_engine_set_num(CL_ENGINE_DECOMPRESS_THREADS) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if (optget(opts, "archive-risk-order")->enabled) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_ARCHIVE_ORDER, 1))) {
+            logg("!cli_engine_set_num(CL_ENGINE_ARCHIVE_ORDER) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if (optget(opts, "fused-pattern-scan")->enabled) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_FUSED_SCAN, 1))) {
+            logg("!cli_engine_set_num(CL_ENGINE_FUSED_SCAN) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if ((opt = optget(opts, "parallel-scan-threads"))->active) {
+        if ((ret = cl_engine_set_num(engine, CL_ENGINE_PARALLEL_SCAN, opt->numarg))) {
+            logg("!cli_engine_set_num(CL_ENGINE_PARALLEL_SCAN) failed: %s\n", cl_strerror(ret));
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
     /* set scan options */
     if(optget(opts, "allmatch")->enabled) {
         options |= CL_SCAN_ALLMATCHES;
@@ -1155,6 +1556,25 @@ int scanmanager(const struct optstruct *opts)
         options |= CL_SCAN_FILE_PROPERTIES;
 #endif
 
+    if((opt = optget(opts, "journal"))->enabled) {
+        if(!(journal = journal_open(opt->strarg))) {
+            logg("!Can't initialize the scan journal\n");
+            cl_engine_free(engine);
+            return 2;
+        }
+    }
+
+    if((opt = optget(opts, "threads"))->numarg > 1) {
+#ifdef CL_THREAD_SAFE
+        if(opts->filename && !optget(opts, "file-list")->enabled && !strcmp(opts->filename[0], "-"))
+            logg("^--threads: stdin is scanned with a single thread\n");
+        else
+            scan_pool_start(opt->numarg, engine, opts, options);
+#else
+        logg("^--threads: this build of clamscan doesn't support threads\n");
+#endif
+    }
+
     /* check filetype */
     if(!opts->filename && !optget(opts, "file-list")->enabled) {
         /* we need full path for some reasons (eg. archive handling) */
@@ -1163,7 +1583,7 @@ int scanmanager(const struct optstruct *opts)
             ret = 2;
         } else {
             CLAMSTAT(cwd, &sb);
-            scandirs(cwd, engine, opts, options, 1, sb.st_dev);
+            queuedir(cwd, engine, opts, options, 1, sb.st_dev);
         }
 
     } else if(opts->filename && !optget(opts, "file-list")->enabled && !strcmp(opts->filename[0], "-")) { /* read data from stdin */
@@ -1191,18 +1611,18 @@ int scanmanager(const struct optstruct *opts)
                             logg("%s: Symbolic link\n", file);
                     } else if(CLAMSTAT(file, &sb) != -1) {
                         if(S_ISREG(sb.st_mode) && filelnk) {
-                            scanfile(file, engine, opts, options);
+                            queuefile(file, engine, opts, options);
                         } else if(S_ISDIR(sb.st_mode) && dirlnk) {
-                            scandirs(file, engine, opts, options, 1, sb.st_dev);
+                            queuedir(file, engine, opts, options, 1, sb.st_dev);
                         } else {
                             if(!printinfected)
                                 logg("%s: Symbolic link\n", file);
                         }
                     }
                 } else if(S_ISREG(sb.st_mode)) {
-                    scanfile(file, engine, opts, options);
+                    queuefile(file, engine, opts, options);
                 } else if(S_ISDIR(sb.st_mode)) {
-                    scandirs(file, engine, opts, options, 1, sb.st_dev);
+                    queuedir(file, engine, opts, options, 1, sb.st_dev);
                 } else {
                     logg("^%s: Not supported file type\n", file);
                     ret = 2;
@@ -1213,6 +1633,21 @@ int scanmanager(const struct optstruct *opts)
         }
     }
 
+#ifdef CL_THREAD_SAFE
+    scan_pool_stop();
+#endif
+
+    if(journal) {
+        journal_save(journal);
+        journal_free(journal);
+        journal = NULL;
+    }
+
+    if(profile_file) {
+        fclose(profile_file);
+        profile_file = NULL;
+    }
+
     if((opt = optget(opts, "statistics"))->enabled) {
 	while(opt) {
 	    if (!strcasecmp(opt->strarg, "bytecode")) {
@@ -55,6 +55,9 @@
 #ifndef	_WIN32
 #include <sys/wait.h>
 #endif
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
@@ -181,21 +184,71 @@ qcompare (const void *a, const void *b)
         (*(const struct addrinfo **) b)->ai_flags;
 }
 
+/* downloads shorter than this don't count for the throughput of a mirror */
+#define MIRROR_RATE_MIN 65536
+
+#ifdef SO_ERROR
+/* the runner-up gets a connect of its own when the best mirror hasn't
+ * answered within this many ms, and the first one to answer is used */
+#define MIRROR_RACE_DELAY 250
+
+/* connects *sd to rp, racing it against rp2; on success *sd is the winner
+ * (with *won set to 1 for rp2 and *rtt to its connect time) and the other
+ * socket is closed */
+static int
+mirror_race (int *sd, const struct addrinfo *rp, const struct addrinfo *rp2,
+             const char *localip, int ctimeout, int *won, long *rtt)
+{
+    const struct sockaddr *addrs[2];
+    socklen_t addrlens[2];
+    int socks[2];
+
+    socks[0] = *sd;
+    if ((socks[1] = getclientsock (localip, rp2->ai_family)) < 0)
+    {
+        *won = 0;
+        return wait_connect (*sd, rp->ai_addr, rp->ai_addrlen, ctimeout);
+    }
+    addrs[0] = rp->ai_addr;
+    addrlens[0] = rp->ai_addrlen;
+    addrs[1] = rp2->ai_addr;
+    addrlens[1] = rp2->ai_addrlen;
+
+    *won = race_connect (socks, addrs, addrlens, MIRROR_RACE_DELAY, ctimeout,
+                         rtt);
+    if (*won == 1)
+    {
+        closesocket (socks[0]);
+        *sd = socks[1];
+        return 0;
+    }
+    closesocket (socks[1]);
+    if (*won == -1)
+    {
+        *won = 0;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 static int
 wwwconnect (const char *server, const char *proxy, int pport, char *ip,
             const char *localip, int ctimeout, struct mirdat *mdat,
             int logerr, unsigned int can_whitelist, unsigned int attempt)
 {
-    int socketfd, port, ret;
+    int socketfd, port, ret, won;
     unsigned int ips = 0, ignored = 0, i;
-    struct addrinfo hints, *res = NULL, *rp, *loadbal_rp = NULL, *addrs[128];
-    char port_s[6], loadbal_ipaddr[46];
-    uint32_t loadbal = 1, minsucc = 0xffffffff, minfail =
-        0xffffffff, addrnum = 0;
+    struct addrinfo hints, *res = NULL, *rp, *loadbal_rp = NULL,
+        *loadbal_rp2 = NULL, *addrs[128];
+    char port_s[6], loadbal_ipaddr[46], loadbal_ipaddr2[46];
+    uint32_t loadbal = 1, addrnum = 0;
     int ipv4start = -1, ipv4end = -1;
-    struct mirdat_ip *md;
+    struct mirdat_ip *md, *loadbal_md = NULL, *loadbal_md2 = NULL;
     char ipaddr[46];
     const char *hostpt;
+    struct timeval tv_start, tv_end;
+    long rtt;
 
     if (ip)
         strcpy (ip, "UNKNOWN");
@@ -305,21 +358,30 @@ wwwconnect (const char *server, const char *proxy, int pport, char *ip,
         {
             if (!ret)
             {
-                if (!md)
+                /* the best mirror so far becomes the runner-up */
+                if (!md || !loadbal_md || mirman_prefer (md, loadbal_md))
                 {
+                    if (loadbal_rp)
+                    {
+                        loadbal_rp2 = loadbal_rp;
+                        loadbal_md2 = loadbal_md;
+                        strncpy (loadbal_ipaddr2, loadbal_ipaddr,
+                                 sizeof (loadbal_ipaddr2));
+                    }
                     loadbal_rp = rp;
+                    loadbal_md = md;
                     strncpy (loadbal_ipaddr, ipaddr, sizeof (loadbal_ipaddr));
                 }
-                else
+                else if (!loadbal_md2 || mirman_prefer (md, loadbal_md2))
+                {
+                    loadbal_rp2 = rp;
+                    loadbal_md2 = md;
+                    strncpy (loadbal_ipaddr2, ipaddr,
+                             sizeof (loadbal_ipaddr2));
+                }
+
+                if (md)
                 {
-                    if (md->succ <= minsucc && md->fail <= minfail)
-                    {
-                        minsucc = md->succ;
-                        minfail = md->fail;
-                        loadbal_rp = rp;
-                        strncpy (loadbal_ipaddr, ipaddr,
-                                 sizeof (loadbal_ipaddr));
-                    }
                     if (i + 1 < addrnum)
                     {
                         i++;
@@ -365,9 +427,17 @@ wwwconnect (const char *server, const char *proxy, int pport, char *ip,
             return -1;
         }
 
+        won = 0;
+        rtt = -1;
+        gettimeofday (&tv_start, NULL);
 #ifdef SO_ERROR
-        if (wait_connect (socketfd, rp->ai_addr, rp->ai_addrlen, ctimeout) ==
-            -1)
+        if (rp == loadbal_rp && loadbal_rp2 && loadbal)
+            ret = mirror_race (&socketfd, rp, loadbal_rp2, localip, ctimeout,
+                               &won, &rtt);
+        else
+            ret = wait_connect (socketfd, rp->ai_addr, rp->ai_addrlen,
+                                ctimeout);
+        if (ret == -1)
         {
 #else
         if (connect (socketfd, rp->ai_addr, rp->ai_addrlen) == -1)
@@ -389,8 +459,30 @@ wwwconnect (const char *server, const char *proxy, int pport, char *ip,
         }
         else
         {
+            if (won)
+            {
+                rp = loadbal_rp2;
+                strncpy (ipaddr, loadbal_ipaddr2, sizeof (ipaddr));
+#ifdef SUPPORT_IPv6
+                if (rp->ai_family == AF_INET6)
+                    addr = &((struct sockaddr_in6 *) rp->ai_addr)->sin6_addr;
+                else
+#endif
+                    addr = &((struct sockaddr_in *) rp->ai_addr)->sin_addr;
+                if (ip)
+                    strcpy (ip, ipaddr);
+                logg ("*Mirror %s answered first\n", ipaddr);
+            }
+            else if (rtt < 0)
+            {
+                gettimeofday (&tv_end, NULL);
+                rtt = (tv_end.tv_sec - tv_start.tv_sec) * 1000
+                    + (tv_end.tv_usec - tv_start.tv_usec) / 1000;
+            }
             if (mdat)
             {
+                mirman_measure (addr, rp->ai_family, mdat,
+                                rtt > 0 ? (uint32_t) rtt : 1, 0);
                 if (rp->ai_family == AF_INET)
                     mdat->currip[0] = *((uint32_t *) addr);
                 else
@@ -504,29 +596,25 @@ Rfc2822DateTime (char *buf, time_t mtime)
     return strftime (buf, 36, "%a, %d %b %Y %X GMT", gmt);
 }
 
-static struct cl_cvd *
-remote_cvdhead (const char *cvdfile, const char *localfile,
-                const char *hostname, char *ip, const char *localip,
-                const char *proxy, int port, const char *user,
-                const char *pass, const char *uas, int *ims, int ctimeout,
-                int rtimeout, struct mirdat *mdat, int logerr,
-                unsigned int can_whitelist, unsigned int attempt)
-{
-    char cmd[512], head[513], buffer[FILEBUFF], ipaddr[46], *ch, *tmp;
-    int bread, cnt, sd;
-    unsigned int i, j;
-    char *remotename = NULL, *authorization = NULL;
-    struct cl_cvd *cvd;
-    char last_modified[36], uastr[128];
+/* request modes of httpreq() */
+#define HTTPREQ_CLOSE       0   /* one file per connection */
+#define HTTPREQ_KEEPALIVE   1   /* more requests follow, see getpatches() */
+#define HTTPREQ_LAST        2   /* last request on a persistent connection */
 
+static int
+httpreq (char *cmd, size_t size, const char *srcfile, const char *hostname,
+         const char *proxy, const char *user, const char *pass,
+         const char *uas, const char *ims, const char *range, int mode)
+{
+    char uastr[128], *remotename = NULL, *authorization = NULL;
 
     if (proxy)
     {
         remotename = malloc (strlen (hostname) + 8);
         if (!remotename)
         {
-            logg ("!remote_cvdhead: Can't allocate memory for 'remotename'\n");
-            return NULL;
+            logg ("!getfile: Can't allocate memory for 'remotename'\n");
+            return FCE_MEM;
         }
         sprintf (remotename, "http://%s", hostname);
 
@@ -536,19 +624,178 @@ remote_cvdhead (const char *cvdfile, const char *localfile,
             if (!authorization)
             {
                 free (remotename);
-                return NULL;
+                return FCE_MEM;
             }
         }
     }
 
+    if (uas)
+        strncpy (uastr, uas, sizeof (uastr));
+    else
+        snprintf (uastr, sizeof (uastr),
+                  PACKAGE "/%s (OS: " TARGET_OS_TYPE ", ARCH: "
+                  TARGET_ARCH_TYPE ", CPU: " TARGET_CPU_TYPE ")",
+                  get_version ());
+    uastr[sizeof (uastr) - 1] = 0;
+
+    snprintf (cmd, size,
+              "GET %s/%s HTTP/1.%c\r\n" "Host: %s\r\n%s" "User-Agent: %s\r\n"
+#ifdef FRESHCLAM_NO_CACHE
+              "Cache-Control: no-cache\r\n"
+#endif
+              "%s"
+              "%s%s%s"
+              "%s%s%s"
+              "\r\n", (remotename != NULL) ? remotename : "", srcfile,
+              mode == HTTPREQ_CLOSE ? '0' : '1',
+              hostname, (authorization != NULL) ? authorization : "", uastr,
+              mode == HTTPREQ_KEEPALIVE ? "" : "Connection: close\r\n",
+              ims ? "If-Modified-Since: " : "", ims ? ims : "",
+              ims ? "\r\n" : "",
+              range ? "Range: bytes=" : "", range ? range : "",
+              range ? "\r\n" : "");
+
+    if (remotename)
+        free (remotename);
+
+    if (authorization)
+        free (authorization);
+
+    return 0;
+}
+
+/* reads the response headers, up to the empty line */
+static int
+httphead (int sd, char *buffer, size_t size, int rtimeout)
+{
+    char *ch = buffer;
+    unsigned int i = 0;
+
+    UNUSEDPARAM(rtimeout);
+
+    while (1)
+    {
+        /* recv one byte at a time, until we reach \r\n\r\n */
+#ifdef SO_ERROR
+        if ((i >= size - 1) || wait_recv (sd, buffer + i, 1, 0, rtimeout) <= 0)
+#else
+        if ((i >= size - 1) || recv (sd, buffer + i, 1, 0) <= 0)
+#endif
+            return -1;
+
+        if (i > 2 && *ch == '\n' && *(ch - 1) == '\r' && *(ch - 2) == '\n'
+            && *(ch - 3) == '\r')
+        {
+            i++;
+            break;
+        }
+        ch++;
+        i++;
+    }
+
+    buffer[i] = 0;
+    return i;
+}
+
+/* A connection the server agreed to keep open, left by remote_cvdhead()
+ * for the download of the database or its patches that usually follows
+ * from the same server, or for the header of the next database. */
+static struct
+{
+    int sd;
+    char hostname[256], proxy[256], ipaddr[46];
+    uint32_t currip[4], af;
+} keepconn = { -1 };
+
+static void
+keepconn_close (void)
+{
+    if (keepconn.sd >= 0)
+    {
+        closesocket (keepconn.sd);
+        keepconn.sd = -1;
+    }
+}
+
+static void
+keepconn_put (int sd, const char *hostname, const char *proxy,
+              const char *ipaddr, const struct mirdat *mdat)
+{
+    keepconn_close ();
+    if (strlen (hostname) >= sizeof (keepconn.hostname)
+        || (proxy && strlen (proxy) >= sizeof (keepconn.proxy)))
+    {
+        closesocket (sd);
+        return;
+    }
+    strcpy (keepconn.hostname, hostname);
+    strcpy (keepconn.proxy, proxy ? proxy : "");
+    strncpy (keepconn.ipaddr, ipaddr, sizeof (keepconn.ipaddr) - 1);
+    if (mdat)
+    {
+        memcpy (keepconn.currip, mdat->currip, sizeof (keepconn.currip));
+        keepconn.af = mdat->af;
+    }
+    keepconn.sd = sd;
+}
+
+/* hands over the kept connection if it leads to the same server and the
+ * server hasn't closed it since; returns -1 otherwise */
+static int
+keepconn_get (const char *hostname, const char *ip, const char *proxy,
+              char *ipaddr, struct mirdat *mdat)
+{
+    int sd = keepconn.sd;
+    char c;
+
+    if (sd < 0)
+        return -1;
+    keepconn.sd = -1;
+
+#ifdef MSG_DONTWAIT
+    if (!strcmp (hostname, keepconn.hostname)
+        && !strcmp (proxy ? proxy : "", keepconn.proxy)
+        && (!ip || !ip[0] || !strcmp (ip, keepconn.ipaddr))
+        && recv (sd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+        && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        strcpy (ipaddr, keepconn.ipaddr);
+        if (mdat)
+        {
+            memcpy (mdat->currip, keepconn.currip, sizeof (mdat->currip));
+            mdat->af = keepconn.af;
+        }
+        logg ("*Reusing the connection to %s\n", hostname);
+        return sd;
+    }
+#else
+    UNUSEDPARAM(c);
+#endif
+    closesocket (sd);
+    return -1;
+}
+
+static struct cl_cvd *
+remote_cvdhead (const char *cvdfile, const char *localfile,
+                const char *hostname, char *ip, const char *localip,
+                const char *proxy, int port, const char *user,
+                const char *pass, const char *uas, int *ims, int ctimeout,
+                int rtimeout, struct mirdat *mdat, int logerr,
+                unsigned int can_whitelist, unsigned int attempt)
+{
+    char cmd[512], head[513], buffer[FILEBUFF], ipaddr[46], *headerline;
+    int bread, sd, size = -1, keepalive;
+    unsigned int i;
+    struct cl_cvd *cvd;
+    char last_modified[36];
+
+
     if (!access (localfile, R_OK))
     {
         cvd = cl_cvdhead (localfile);
         if (!cvd)
         {
             logg ("!remote_cvdhead: Can't parse file %s\n", localfile);
-            free (remotename);
-            free (authorization);
             return NULL;
         }
         Rfc2822DateTime (last_modified, (time_t) cvd->stime);
@@ -566,51 +813,32 @@ remote_cvdhead (const char *cvdfile, const char *localfile,
 
     logg ("Reading CVD header (%s): ", cvdfile);
 
-    if (uas)
-        strncpy (uastr, uas, sizeof (uastr));
-    else
-        snprintf (uastr, sizeof (uastr),
-                  PACKAGE "/%s (OS: " TARGET_OS_TYPE ", ARCH: "
-                  TARGET_ARCH_TYPE ", CPU: " TARGET_CPU_TYPE ")",
-                  get_version ());
-    uastr[sizeof (uastr) - 1] = 0;
-
-    snprintf (cmd, sizeof (cmd),
-              "GET %s/%s HTTP/1.0\r\n"
-              "Host: %s\r\n%s"
-              "User-Agent: %s\r\n"
-              "Connection: close\r\n"
-              "Range: bytes=0-511\r\n"
-              "If-Modified-Since: %s\r\n"
-              "\r\n", (remotename != NULL) ? remotename : "", cvdfile,
-              hostname, (authorization != NULL) ? authorization : "", uastr,
-              last_modified);
-
-    free (remotename);
-    free (authorization);
+    /* HTTP/1.1 so that the server keeps the connection for the download */
+    if (httpreq (cmd, sizeof (cmd), cvdfile, hostname, proxy, user, pass,
+                 uas, last_modified, "0-511", HTTPREQ_KEEPALIVE))
+        return NULL;
 
     memset (ipaddr, 0, sizeof (ipaddr));
 
-    if (ip[0])                  /* use ip to connect */
-        sd = wwwconnect (ip, proxy, port, ipaddr, localip, ctimeout, mdat,
-                         logerr, can_whitelist, attempt);
-    else
-        sd = wwwconnect (hostname, proxy, port, ipaddr, localip, ctimeout,
-                         mdat, logerr, can_whitelist, attempt);
-
-    if (sd < 0)
-    {
-        return NULL;
-    }
-    else
+    if ((sd = keepconn_get (hostname, ip, proxy, ipaddr, mdat)) < 0)
     {
+        if (ip[0])              /* use ip to connect */
+            sd = wwwconnect (ip, proxy, port, ipaddr, localip, ctimeout,
+                             mdat, logerr, can_whitelist, attempt);
+        else
+            sd = wwwconnect (hostname, proxy, port, ipaddr, localip,
+                             ctimeout, mdat, logerr, can_whitelist, attempt);
+
+        if (sd < 0)
+            return NULL;
+
         if (proxy)
             logg ("*Connected to %s.\n", hostname);
         else
             logg ("*Connected to %s (IP: %s).\n", hostname, ipaddr);
-        logg ("*Trying to retrieve CVD header of http://%s/%s\n", hostname,
-              cvdfile);
     }
+    logg ("*Trying to retrieve CVD header of http://%s/%s\n", hostname,
+          cvdfile);
 
     if (!ip[0])
         strcpy (ip, ipaddr);
@@ -622,35 +850,35 @@ remote_cvdhead (const char *cvdfile, const char *localfile,
         return NULL;
     }
 
-    tmp = buffer;
-    cnt = FILEBUFF;
-#ifdef SO_ERROR
-    while ((bread = wait_recv (sd, tmp, cnt, 0, rtimeout)) > 0)
-    {
-#else
-    while ((bread = recv (sd, tmp, cnt, 0)) > 0)
-    {
-#endif
-        tmp += bread;
-        cnt -= bread;
-        if (cnt <= 0)
-            break;
-    }
-    closesocket (sd);
-
-    if (bread == -1)
+    if (httphead (sd, buffer, sizeof (buffer), rtimeout) == -1)
     {
         logg ("%cremote_cvdhead: Error while reading CVD header from %s\n",
               logerr ? '!' : '^', hostname);
+        closesocket (sd);
         mirman_update (mdat->currip, mdat->af, mdat, 1);
         return NULL;
     }
 
+    /* the connection can be kept only when the body is read in full */
+    keepalive = !strncmp (buffer, "HTTP/1.1", 8);
+    for (i = 0; (headerline = cli_strtok (buffer, i, "\n")); i++)
+    {
+        if (!strncasecmp (headerline, "Content-Length:", 15))
+            size = atoi (headerline + 15);
+        else if (!strncasecmp (headerline, "Transfer-Encoding:", 18))
+            keepalive = 0;
+        else if (!strncasecmp (headerline, "Connection:", 11)
+                 && strstr (headerline, "lose"))
+            keepalive = 0;
+        free (headerline);
+    }
+
     if ((strstr (buffer, "HTTP/1.1 404")) != NULL
         || (strstr (buffer, "HTTP/1.0 404")) != NULL)
     {
         logg ("%c%s not found on remote server\n", logerr ? '!' : '^',
               cvdfile);
+        closesocket (sd);
         mirman_update (mdat->currip, mdat->af, mdat, 2);
         return NULL;
     }
@@ -661,6 +889,10 @@ remote_cvdhead (const char *cvdfile, const char *localfile,
     {
         *ims = 0;
         logg ("OK (IMS)\n");
+        if (keepalive && size <= 0)
+            keepconn_put (sd, hostname, proxy, ipaddr, mdat);
+        else
+            closesocket (sd);
         mirman_update (mdat->currip, mdat->af, mdat, 0);
         return NULL;
     }
@@ -674,26 +906,29 @@ remote_cvdhead (const char *cvdfile, const char *localfile,
         && !strstr (buffer, "HTTP/1.0 206"))
     {
         logg ("%cUnknown response from remote server\n", logerr ? '!' : '^');
+        closesocket (sd);
         mirman_update (mdat->currip, mdat->af, mdat, 1);
         return NULL;
     }
 
-    i = 3;
-    ch = buffer + i;
-    while (i < sizeof (buffer))
+    for (i = 0; i < 512; i += bread)
     {
-        if (*ch == '\n' && *(ch - 1) == '\r' && *(ch - 2) == '\n'
-            && *(ch - 3) == '\r')
-        {
-            ch++;
-            i++;
+#ifdef SO_ERROR
+        bread = wait_recv (sd, head + i, 512 - i, 0, rtimeout);
+#else
+        bread = recv (sd, head + i, 512 - i, 0);
+#endif
+        if (bread <= 0)
             break;
-        }
-        ch++;
-        i++;
     }
 
-    if (sizeof (buffer) - i < 512)
+    /* a server ignoring the range sends the whole file */
+    if (i == 512 && keepalive && size == 512)
+        keepconn_put (sd, hostname, proxy, ipaddr, mdat);
+    else
+        closesocket (sd);
+
+    if (i < 512)
     {
         logg ("%cremote_cvdhead: Malformed CVD header (too short)\n",
               logerr ? '!' : '^');
@@ -701,18 +936,16 @@ remote_cvdhead (const char *cvdfile, const char *localfile,
         return NULL;
     }
 
-    memset (head, 0, sizeof (head));
-
-    for (j = 0; j < 512; j++)
+    head[512] = 0;
+    for (i = 0; i < 512; i++)
     {
-        if (!ch || (ch && !*ch) || (ch && !isprint (ch[j])))
+        if (!isprint (head[i]))
         {
             logg ("%cremote_cvdhead: Malformed CVD header (bad chars)\n",
                   logerr ? '!' : '^');
             mirman_update (mdat->currip, mdat->af, mdat, 1);
             return NULL;
         }
-        head[j] = ch[j];
     }
 
     if (!(cvd = cl_cvdparse (head)))
@@ -736,70 +969,36 @@ getfile_mirman (const char *srcfile, const char *destfile,
                 const char *proxy, int port, const char *user,
                 const char *pass, const char *uas, int ctimeout, int rtimeout,
                 struct mirdat *mdat, int logerr, unsigned int can_whitelist,
-                const char *ims, const char *ipaddr, int sd)
+                const char *ims, off_t offset, const char *ipaddr, int sd)
 {
-    char cmd[512], uastr[128], buffer[FILEBUFF], *ch;
+    char cmd[512], buffer[FILEBUFF], range[32], *ch;
     int bread, fd, totalsize = 0, rot = 0, totaldownloaded = 0,
-        percentage = 0;
+        percentage = 0, ret, flags;
     unsigned int i;
-    char *remotename = NULL, *authorization = NULL, *headerline;
+    long long rangestart = -1;
+    char *headerline;
     const char *rotation = "|/-\\", *fname;
+    struct timeval tv_start, tv_end;
 
     UNUSEDPARAM(localip);
     UNUSEDPARAM(port);
     UNUSEDPARAM(ctimeout);
     UNUSEDPARAM(can_whitelist);
 
-    if (proxy)
-    {
-        remotename = malloc (strlen (hostname) + 8);
-        if (!remotename)
-        {
-            logg ("!getfile: Can't allocate memory for 'remotename'\n");
-            return FCE_MEM;
-        }
-        sprintf (remotename, "http://%s", hostname);
-
-        if (user)
-        {
-            authorization = proxyauth (user, pass);
-            if (!authorization)
-            {
-                free (remotename);
-                return FCE_MEM;
-            }
-        }
-    }
-
     if (ims)
         logg ("*If-Modified-Since: %s\n", ims);
 
-    if (uas)
-        strncpy (uastr, uas, sizeof (uastr));
-    else
-        snprintf (uastr, sizeof (uastr),
-                  PACKAGE "/%s (OS: " TARGET_OS_TYPE ", ARCH: "
-                  TARGET_ARCH_TYPE ", CPU: " TARGET_CPU_TYPE ")",
-                  get_version ());
-    uastr[sizeof (uastr) - 1] = 0;
-
-    snprintf (cmd, sizeof (cmd),
-              "GET %s/%s HTTP/1.0\r\n" "Host: %s\r\n%s" "User-Agent: %s\r\n"
-#ifdef FRESHCLAM_NO_CACHE
-              "Cache-Control: no-cache\r\n"
-#endif
-              "Connection: close\r\n"
-              "%s%s%s"
-              "\r\n", (remotename != NULL) ? remotename : "", srcfile,
-              hostname, (authorization != NULL) ? authorization : "", uastr,
-              ims ? "If-Modified-Since: " : "", ims ? ims : "",
-              ims ? "\r\n" : "");
-
-    if (remotename)
-        free (remotename);
+    if (offset)
+    {
+        logg ("*Resuming the download of %s at byte %lld\n", srcfile,
+              (long long) offset);
+        snprintf (range, sizeof (range), "%lld-", (long long) offset);
+    }
 
-    if (authorization)
-        free (authorization);
+    if ((ret = httpreq (cmd, sizeof (cmd), srcfile, hostname, proxy, user,
+                        pass, uas, ims, offset ? range : NULL,
+                        HTTPREQ_CLOSE)))
+        return ret;
 
     if (proxy)
         logg ("*Trying to download http://%s/%s\n", hostname, srcfile);
@@ -817,40 +1016,17 @@ getfile_mirman (const char *srcfile, const char *destfile,
     }
 
     /* read http headers */
-    ch = buffer;
-    i = 0;
-    while (1)
+    if (httphead (sd, buffer, sizeof (buffer), rtimeout) == -1)
     {
-        /* recv one byte at a time, until we reach \r\n\r\n */
-#ifdef SO_ERROR
-        if ((i >= sizeof (buffer) - 1)
-            || wait_recv (sd, buffer + i, 1, 0, rtimeout) == -1)
-        {
-#else
-        if ((i >= sizeof (buffer) - 1) || recv (sd, buffer + i, 1, 0) == -1)
-        {
-#endif
-            if (proxy)
-                logg ("%cgetfile: Error while reading database from %s: %s\n", logerr ? '!' : '^', hostname, strerror (errno));
-            else
-                logg ("%cgetfile: Error while reading database from %s (IP: %s): %s\n", logerr ? '!' : '^', hostname, ipaddr, strerror (errno));
-            if (mdat)
-                mirman_update (mdat->currip, mdat->af, mdat, 1);
-            return FCE_CONNECTION;
-        }
-
-        if (i > 2 && *ch == '\n' && *(ch - 1) == '\r' && *(ch - 2) == '\n'
-            && *(ch - 3) == '\r')
-        {
-            i++;
-            break;
-        }
-        ch++;
-        i++;
+        if (proxy)
+            logg ("%cgetfile: Error while reading database from %s: %s\n", logerr ? '!' : '^', hostname, strerror (errno));
+        else
+            logg ("%cgetfile: Error while reading database from %s (IP: %s): %s\n", logerr ? '!' : '^', hostname, ipaddr, strerror (errno));
+        if (mdat)
+            mirman_update (mdat->currip, mdat->af, mdat, 1);
+        return FCE_CONNECTION;
     }
 
-    buffer[i] = 0;
-
     /* check whether the resource actually existed or not */
     if ((strstr (buffer, "HTTP/1.1 404")) != NULL
         || (strstr (buffer, "HTTP/1.0 404")) != NULL)
@@ -904,11 +1080,43 @@ getfile_mirman (const char *srcfile, const char *destfile,
                 totalsize = 0;
             }
         }
+        else if (!strncasecmp (headerline, "Content-Range: bytes ", 21))
+        {
+            rangestart = atoll (headerline + 21);
+        }
         free (headerline);
     }
 
-    if ((fd =
-         open (destfile, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644)) == -1)
+    /* a partial file is continued on a 206 for its end and started over
+     * on a 200 */
+    flags = O_WRONLY | O_CREAT | O_EXCL | O_BINARY;
+    if (offset)
+    {
+        if (!strstr (buffer, "HTTP/1.1 206")
+            && !strstr (buffer, "HTTP/1.0 206"))
+        {
+            logg ("*getfile: Range not supported, downloading %s again\n",
+                  srcfile);
+            flags = O_WRONLY | O_TRUNC | O_BINARY;
+        }
+        else if (rangestart != (long long) offset)
+        {
+            logg ("%cgetfile: Unexpected range of %s from %s\n",
+                  logerr ? '!' : '^', srcfile, hostname);
+            if (mdat)
+                mirman_update (mdat->currip, mdat->af, mdat, 1);
+            return FCE_FAILEDGET;
+        }
+        else
+        {
+            flags = O_WRONLY | O_APPEND | O_BINARY;
+            totaldownloaded = offset;
+            if (totalsize > 0)
+                totalsize += offset;
+        }
+    }
+
+    if ((fd = open (destfile, flags, 0644)) == -1)
     {
         char currdir[512];
 
@@ -927,6 +1135,7 @@ getfile_mirman (const char *srcfile, const char *destfile,
     else
         fname = srcfile;
 
+    gettimeofday (&tv_start, NULL);
 #ifdef SO_ERROR
     while ((bread = wait_recv (sd, buffer, FILEBUFF, 0, rtimeout)) > 0)
     {
@@ -980,6 +1189,15 @@ getfile_mirman (const char *srcfile, const char *destfile,
         return FCE_CONNECTION;
     }
 
+    if (totalsize > 0 && totaldownloaded < totalsize)
+    {
+        logg ("%cgetfile: Download interrupted after %d of %d bytes of %s\n",
+              logerr ? '!' : '^', totaldownloaded, totalsize, fname);
+        if (mdat)
+            mirman_update (mdat->currip, mdat->af, mdat, 2);
+        return FCE_CONNECTION;
+    }
+
     if (!totaldownloaded)
         return FCE_EMPTYFILE;
 
@@ -989,7 +1207,19 @@ getfile_mirman (const char *srcfile, const char *destfile,
         logg ("Downloading %s [*]\n", fname);
 
     if (mdat)
+    {
+        long msecs;
+
+        /* small files only tell the latency */
+        gettimeofday (&tv_end, NULL);
+        msecs = (tv_end.tv_sec - tv_start.tv_sec) * 1000
+            + (tv_end.tv_usec - tv_start.tv_usec) / 1000;
+        if (totaldownloaded >= MIRROR_RATE_MIN && msecs > 0)
+            mirman_measure (mdat->currip, mdat->af, mdat, 0,
+                            (uint32_t) ((long long) totaldownloaded * 1000
+                                        / msecs));
         mirman_update (mdat->currip, mdat->af, mdat, 0);
+    }
     return 0;
 }
 
@@ -998,7 +1228,7 @@ getfile (const char *srcfile, const char *destfile, const char *hostname,
          char *ip, const char *localip, const char *proxy, int port,
          const char *user, const char *pass, const char *uas, int ctimeout,
          int rtimeout, struct mirdat *mdat, int logerr,
-         unsigned int can_whitelist, const char *ims,
+         unsigned int can_whitelist, const char *ims, off_t offset,
          const struct optstruct *opts, unsigned int attempt)
 {
     int ret, sd;
@@ -1007,15 +1237,18 @@ getfile (const char *srcfile, const char *destfile, const char *hostname,
     UNUSEDPARAM(opts);
 
     memset (ipaddr, 0, sizeof (ipaddr));
-    if (ip && ip[0])            /* use ip to connect */
-        sd = wwwconnect (ip, proxy, port, ipaddr, localip, ctimeout, mdat,
-                         logerr, can_whitelist, attempt);
-    else
-        sd = wwwconnect (hostname, proxy, port, ipaddr, localip, ctimeout,
-                         mdat, logerr, can_whitelist, attempt);
+    if ((sd = keepconn_get (hostname, ip, proxy, ipaddr, mdat)) < 0)
+    {
+        if (ip && ip[0])        /* use ip to connect */
+            sd = wwwconnect (ip, proxy, port, ipaddr, localip, ctimeout,
+                             mdat, logerr, can_whitelist, attempt);
+        else
+            sd = wwwconnect (hostname, proxy, port, ipaddr, localip,
+                             ctimeout, mdat, logerr, can_whitelist, attempt);
 
-    if (sd < 0)
-        return FCE_CONNECTION;
+        if (sd < 0)
+            return FCE_CONNECTION;
+    }
 
     if (mdat)
     {
@@ -1026,7 +1259,7 @@ getfile (const char *srcfile, const char *destfile, const char *hostname,
     ret =
         getfile_mirman (srcfile, destfile, hostname, ip, localip, proxy, port,
                         user, pass, uas, ctimeout, rtimeout, mdat, logerr,
-                        can_whitelist, ims, ipaddr, sd);
+                        can_whitelist, ims, offset, ipaddr, sd);
     closesocket (sd);
 
     if (mdat)
@@ -1038,6 +1271,9 @@ getfile (const char *srcfile, const char *destfile, const char *hostname,
     return ret;
 }
 
+/* attempts to continue an interrupted download of a CVD */
+#define CVD_RESUMES 3
+
 static int
 getcvd (const char *cvdfile, const char *newfile, const char *hostname,
         char *ip, const char *localip, const char *proxy, int port,
@@ -1048,15 +1284,35 @@ getcvd (const char *cvdfile, const char *newfile, const char *hostname,
 {
     struct cl_cvd *cvd;
     int ret;
+    unsigned int resumes = 0;
     char *newfile2;
+    STATBUF sb;
 
 
     logg ("*Retrieving http://%s/%s\n", hostname, cvdfile);
 
-    if ((ret =
-         getfile (cvdfile, newfile, hostname, ip, localip, proxy, port, user,
-                  pass, uas, ctimeout, rtimeout, mdat, logerr, can_whitelist,
-                  NULL, opts, attempt)))
+    ret = getfile (cvdfile, newfile, hostname, ip, localip, proxy, port, user,
+                   pass, uas, ctimeout, rtimeout, mdat, logerr, can_whitelist,
+                   NULL, 0, opts, attempt);
+
+    /* an interrupted download continues from the same mirror (even though
+     * getfile() just marked it), for as long as the retries make progress;
+     * the verification below catches a file that changed in the meantime */
+    while (ret == FCE_CONNECTION && ip && ip[0] && resumes < CVD_RESUMES
+           && CLAMSTAT (newfile, &sb) != -1 && sb.st_size > 0)
+    {
+        off_t offset = sb.st_size;
+
+        resumes++;
+        ret = getfile (cvdfile, newfile, hostname, ip, localip, proxy, port,
+                       user, pass, uas, ctimeout, rtimeout, NULL, logerr,
+                       can_whitelist, NULL, offset, opts, attempt);
+        if (ret == FCE_CONNECTION
+            && (CLAMSTAT (newfile, &sb) == -1 || sb.st_size <= offset))
+            break;
+    }
+
+    if (ret)
     {
         logg ("%cCan't download %s from %s\n", logerr ? '!' : '^', cvdfile,
               hostname);
@@ -1121,10 +1377,114 @@ getcvd (const char *cvdfile, const char *newfile, const char *hostname,
     return 0;
 }
 
+/* The local database a tmpdir is patched from. Its members are only
+ * extracted when a cdiff touches them (patchsrc_fetch()), buildcld() copies
+ * the others straight from the old archive into the new one. */
+static struct
+{
+    char archive[512];
+    char **fetched;
+    unsigned int nfetched;
+} patchsrc;
+
+static void
+patchsrc_reset (const char *archive)
+{
+    unsigned int i;
+
+    for (i = 0; i < patchsrc.nfetched; i++)
+        free (patchsrc.fetched[i]);
+    free (patchsrc.fetched);
+    patchsrc.fetched = NULL;
+    patchsrc.nfetched = 0;
+    strncpy (patchsrc.archive, archive, sizeof (patchsrc.archive));
+    patchsrc.archive[sizeof (patchsrc.archive) - 1] = 0;
+}
+
+static int
+patchsrc_fetched (const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < patchsrc.nfetched; i++)
+        if (!strcmp (patchsrc.fetched[i], name))
+            return 1;
+    return 0;
+}
+
+/* the tar stream after the CVD header */
+static gzFile
+patchsrc_open (void)
+{
+    gzFile gzs;
+    int fd;
+
+    if (!patchsrc.archive[0]
+        || (fd = open (patchsrc.archive, O_RDONLY | O_BINARY)) == -1)
+        return NULL;
+    if (lseek (fd, 512, SEEK_SET) == -1 || !(gzs = gzdopen (fd, "rb")))
+    {
+        close (fd);
+        return NULL;
+    }
+    return gzs;
+}
+
+/* cdiff_fetch_t: extracts a member of the old database into the working
+ * directory, once; a member fetched before and now missing was unlinked */
+static int
+patchsrc_fetch (const char *name, void *ctx)
+{
+    char member[101], **fetched;
+    unsigned int size;
+    gzFile gzs;
+    int ret;
+
+    UNUSEDPARAM (ctx);
+
+    if (patchsrc_fetched (name))
+        return 1;
+    if (!(fetched = realloc (patchsrc.fetched, (patchsrc.nfetched + 1) * sizeof (char *)))
+        || !(fetched[patchsrc.nfetched] = strdup (name)))
+    {
+        if (fetched)
+            patchsrc.fetched = fetched;
+        logg ("!patchsrc_fetch: Can't allocate memory\n");
+        return -1;
+    }
+    patchsrc.fetched = fetched;
+    patchsrc.nfetched++;
+
+    if (!(gzs = patchsrc_open ()))
+    {
+        logg ("!patchsrc_fetch: Can't open %s\n", patchsrc.archive);
+        return -1;
+    }
+    while ((ret = tar_nextfile (gzs, member, &size)) == 1)
+    {
+        if (!strcmp (member, name))
+        {
+            if ((ret = tar_extractfile (gzs, name, size)) == -1)
+                logg ("!patchsrc_fetch: Can't extract %s from %s\n", name, patchsrc.archive);
+            gzclose (gzs);
+            return ret;
+        }
+        if (tar_skipfile (gzs, size) == -1)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    gzclose (gzs);
+    if (ret == -1)
+        logg ("!patchsrc_fetch: Can't read %s\n", patchsrc.archive);
+    return ret == -1 ? -1 : 1;
+}
+
 static int
 chdir_tmp (const char *dbname, const char *tmpdir)
 {
-    char cvdfile[32];
+    char cvdfile[32], cwd[512], archive[512];
 
     if (access (tmpdir, R_OK | W_OK) == -1)
     {
@@ -1148,18 +1508,19 @@ chdir_tmp (const char *dbname, const char *tmpdir)
             }
         }
 
-        if (mkdir (tmpdir, 0755) == -1)
+        if (!getcwd (cwd, sizeof (cwd)))
         {
-            logg ("!chdir_tmp: Can't create directory %s\n", tmpdir);
+            logg ("!chdir_tmp: Can't get path of current working directory\n");
             return -1;
         }
+        snprintf (archive, sizeof (archive), "%s" PATHSEP "%s", cwd, cvdfile);
 
-        if (cli_cvdunpack (cvdfile, tmpdir) == -1)
+        if (mkdir (tmpdir, 0755) == -1)
         {
-            logg ("!chdir_tmp: Can't unpack %s into %s\n", cvdfile, tmpdir);
-            cli_rmdirs (tmpdir);
+            logg ("!chdir_tmp: Can't create directory %s\n", tmpdir);
             return -1;
         }
+        patchsrc_reset (archive);
     }
 
     if (chdir (tmpdir) == -1)
@@ -1171,6 +1532,28 @@ chdir_tmp (const char *dbname, const char *tmpdir)
     return 0;
 }
 
+static int
+applypatch (const char *patchfile)
+{
+    int fd;
+
+    if ((fd = open (patchfile, O_RDONLY | O_BINARY)) == -1)
+    {
+        logg ("!getpatch: Can't open %s for reading\n", patchfile);
+        return FCE_FILE;
+    }
+
+    if (cdiff_apply_fetch (fd, 1, patchsrc_fetch, NULL) == -1)
+    {
+        logg ("!getpatch: Can't apply patch\n");
+        close (fd);
+        return FCE_FAILEDUPDATE;
+    }
+
+    close (fd);
+    return 0;
+}
+
 static int
 getpatch (const char *dbname, const char *tmpdir, int version,
           const char *hostname, char *ip, const char *localip,
@@ -1180,7 +1563,7 @@ getpatch (const char *dbname, const char *tmpdir, int version,
           const struct optstruct *opts, unsigned int attempt)
 {
     char *tempname, patch[32], olddir[512];
-    int ret, fd;
+    int ret;
 
 
     if (!getcwd (olddir, sizeof (olddir)))
@@ -1203,48 +1586,192 @@ getpatch (const char *dbname, const char *tmpdir, int version,
     if ((ret =
          getfile (patch, tempname, hostname, ip, localip, proxy, port, user,
                   pass, uas, ctimeout, rtimeout, mdat, logerr, can_whitelist,
-                  NULL, opts, attempt)))
+                  NULL, 0, opts, attempt)))
     {
         if (ret == FCE_EMPTYFILE)
             logg ("Empty script %s, need to download entire database\n",
                   patch);
         else
-            logg ("%cgetpatch: Can't download %s from %s\n",
-                  logerr ? '!' : '^', patch, hostname);
-        unlink (tempname);
-        free (tempname);
+            logg ("%cgetpatch: Can't download %s from %s\n",
+                  logerr ? '!' : '^', patch, hostname);
+        unlink (tempname);
+        free (tempname);
+        CHDIR_ERR (olddir);
+        return ret;
+    }
+
+    if ((ret = applypatch (tempname)))
+    {
+        unlink (tempname);
+        free (tempname);
+        CHDIR_ERR (olddir);
+        return ret;
+    }
+
+    unlink (tempname);
+    free (tempname);
+    if (chdir (olddir) == -1)
+    {
+        logg ("!getpatch: Can't chdir to %s\n", olddir);
+        return FCE_DIRECTORY;
+    }
+    return 0;
+}
+
+/* cdiffs requested ahead on the connection of getpatches() */
+#define PATCH_PIPELINE 8
+
+/* Fetches the cdiffs from version 'from' to 'to' over one persistent
+ * HTTP/1.1 connection with up to PATCH_PIPELINE requests in flight, and
+ * applies each patch while the next ones are on their way. *next is set to
+ * the first version not applied, which updatedb() fetches with getpatch()
+ * as before: anything unexpected (a status other than 200, no
+ * Content-Length, the server closing the connection) just ends the
+ * pipeline there. Only a patch failing to apply is an error. */
+static int
+getpatches (const char *dbname, const char *tmpdir, unsigned int from,
+            unsigned int to,
+            const char *hostname, char *ip, const char *localip,
+            const char *proxy, int port, const char *user, const char *pass,
+            const char *uas, int ctimeout, int rtimeout, struct mirdat *mdat,
+            unsigned int can_whitelist, unsigned int attempt,
+            unsigned int *next)
+{
+    char cmd[512], buffer[FILEBUFF], patch[32], olddir[512], ipaddr[46];
+    char *tempname, *headerline;
+    int sd, fd, ret = 0, size, bread, total, keepalive;
+    unsigned int i, sent;
+
+    *next = from;
+    if (to <= from)
+        return 0;
+
+    if (!getcwd (olddir, sizeof (olddir)))
+    {
+        logg ("!getpatch: Can't get path of current working directory\n");
+        return FCE_DIRECTORY;
+    }
+
+    if (chdir_tmp (dbname, tmpdir) == -1)
+        return FCE_DIRECTORY;
+
+    memset (ipaddr, 0, sizeof (ipaddr));
+    if ((sd = keepconn_get (hostname, ip, proxy, ipaddr, mdat)) < 0)
+    {
+        if (ip && ip[0])
+            sd = wwwconnect (ip, proxy, port, ipaddr, localip, ctimeout,
+                             mdat, 0, can_whitelist, attempt);
+        else
+            sd = wwwconnect (hostname, proxy, port, ipaddr, localip,
+                             ctimeout, mdat, 0, can_whitelist, attempt);
+    }
+    if (sd < 0)
+    {
         CHDIR_ERR (olddir);
-        return ret;
+        return 0;
     }
+    if (ip && !ip[0])
+        strcpy (ip, ipaddr);
 
-    if ((fd = open (tempname, O_RDONLY | O_BINARY)) == -1)
+    if (mdat)
     {
-        logg ("!getpatch: Can't open %s for reading\n", tempname);
-        unlink (tempname);
-        free (tempname);
-        CHDIR_ERR (olddir);
-        return FCE_FILE;
+        mirman_update_sf (mdat->currip, mdat->af, mdat, 0, 1);
+        mirman_write ("mirrors.dat", dbdir, mdat);
     }
 
-    if (cdiff_apply (fd, 1) == -1)
+    for (sent = from; *next <= to;)
     {
-        logg ("!getpatch: Can't apply patch\n");
+        /* keep the pipeline full */
+        for (; sent <= to && sent - *next < PATCH_PIPELINE; sent++)
+        {
+            snprintf (patch, sizeof (patch), "%s-%u.cdiff", dbname, sent);
+            logg ("*Retrieving http://%s/%s\n", hostname, patch);
+            if (httpreq (cmd, sizeof (cmd), patch, hostname, proxy, user,
+                         pass, uas, NULL, NULL,
+                         sent == to ? HTTPREQ_LAST : HTTPREQ_KEEPALIVE)
+                || send (sd, cmd, strlen (cmd), 0) < 0)
+                break;
+        }
+        if (sent == *next)
+            break;
+
+        snprintf (patch, sizeof (patch), "%s-%u.cdiff", dbname, *next);
+        if (httphead (sd, buffer, sizeof (buffer), rtimeout) == -1
+            || strncmp (buffer, "HTTP/1.1 200", 12))
+        {
+            logg ("*getpatches: No response for %s, continuing without pipelining\n", patch);
+            break;
+        }
+
+        size = -1;
+        keepalive = 1;
+        for (i = 0; (headerline = cli_strtok (buffer, i, "\n")); i++)
+        {
+            if (!strncasecmp (headerline, "Content-Length:", 15))
+                size = atoi (headerline + 15);
+            else if (!strncasecmp (headerline, "Transfer-Encoding:", 18))
+                size = -1;
+            else if (!strncasecmp (headerline, "Connection:", 11)
+                     && strstr (headerline, "lose"))
+                keepalive = 0;
+            free (headerline);
+        }
+        /* empty scripts are reported by getpatch() */
+        if (size <= 0)
+            break;
+
+        if (!(tempname = cli_gentemp (".")))
+        {
+            ret = FCE_MEM;
+            break;
+        }
+        if ((fd = open (tempname, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644)) == -1)
+        {
+            logg ("!getpatch: Can't create new file %s\n", tempname);
+            free (tempname);
+            ret = FCE_DBDIRACCESS;
+            break;
+        }
+        for (total = 0; total < size; total += bread)
+        {
+            bread = size - total < FILEBUFF ? size - total : FILEBUFF;
+#ifdef SO_ERROR
+            bread = wait_recv (sd, buffer, bread, 0, rtimeout);
+#else
+            bread = recv (sd, buffer, bread, 0);
+#endif
+            if (bread <= 0 || write (fd, buffer, bread) != bread)
+                break;
+        }
         close (fd);
+
+        if (total == size)
+        {
+            logg ("Downloading %s [100%%]\n", patch);
+            if (!(ret = applypatch (tempname)))
+                (*next)++;
+        }
         unlink (tempname);
         free (tempname);
-        CHDIR_ERR (olddir);
-        return FCE_FAILEDUPDATE;
+        if (ret || total != size || !keepalive)
+            break;
+    }
+
+    closesocket (sd);
+    if (mdat)
+    {
+        if (*next > from)
+            mirman_update (mdat->currip, mdat->af, mdat, 0);
+        mirman_update_sf (mdat->currip, mdat->af, mdat, 0, -1);
+        mirman_write ("mirrors.dat", dbdir, mdat);
     }
 
-    close (fd);
-    unlink (tempname);
-    free (tempname);
     if (chdir (olddir) == -1)
     {
         logg ("!getpatch: Can't chdir to %s\n", olddir);
         return FCE_DIRECTORY;
     }
-    return 0;
+    return ret;
 }
 
 static struct cl_cvd *
@@ -1276,10 +1803,12 @@ buildcld (const char *tmpdir, const char *dbname, const char *newfile,
           unsigned int compr)
 {
     DIR *dir;
-    char cwd[512], info[32], buff[513], *pt;
+    char cwd[512], info[32], buff[513], member[101], *pt;
+    const char *special[3];
     struct dirent *dent;
-    int fd, err = 0;
-    gzFile gzs = NULL;
+    int fd, err = 0, ret = 0;
+    unsigned int i, size;
+    gzFile gzs = NULL, src;
 
     if (!getcwd (cwd, sizeof (cwd)))
     {
@@ -1294,6 +1823,19 @@ buildcld (const char *tmpdir, const char *dbname, const char *newfile,
     }
 
     snprintf (info, sizeof (info), "%s.info", dbname);
+    special[0] = "COPYING";
+    special[1] = info;
+    special[2] = "daily.cfg";
+    for (i = 0; i < 3; i++)
+    {
+        if (access (special[i], R_OK) == -1
+            && patchsrc_fetch (special[i], NULL) == -1)
+        {
+            CHDIR_ERR (cwd);
+            return -1;
+        }
+    }
+
     if ((fd = open (info, O_RDONLY | O_BINARY)) == -1)
     {
         logg ("!buildcld: Can't open %s\n", info);
@@ -1393,6 +1935,36 @@ buildcld (const char *tmpdir, const char *dbname, const char *newfile,
         }
     }
 
+    /* the members of the old database no cdiff touched */
+    if (!err)
+    {
+        if (!(src = patchsrc_open ()))
+        {
+            logg ("!buildcld: Can't open %s\n", patchsrc.archive);
+            err = 1;
+        }
+        else
+        {
+            while ((ret = tar_nextfile (src, member, &size)) == 1)
+            {
+                if (patchsrc_fetched (member) || !strcmp (member, special[0])
+                    || !strcmp (member, special[1])
+                    || !strcmp (member, special[2]))
+                    ret = tar_skipfile (src, size);
+                else
+                    ret = tar_copyfile (fd, gzs, src, member, size);
+                if (ret == -1)
+                    break;
+            }
+            gzclose (src);
+            if (ret == -1)
+            {
+                logg ("!buildcld: Can't copy %s from %s to new %s.cld - please check if there is enough disk space available\n", member, patchsrc.archive, dbname);
+                err = 1;
+            }
+        }
+    }
+
     if (err)
     {
         CHDIR_ERR (cwd);
@@ -1463,10 +2035,11 @@ buildcld (const char *tmpdir, const char *dbname, const char *newfile,
 }
 
 static int
-test_database (const char *newfile, const char *newdb, int bytecode)
+test_database (const char *newfile, const char *newdb, int bytecode,
+               int full)
 {
     struct cl_engine *engine;
-    unsigned newsigs = 0;
+    unsigned newsigs = 0, dboptions;
     int ret;
 
     logg ("*Loading signatures from %s\n", newdb);
@@ -1476,10 +2049,18 @@ test_database (const char *newfile, const char *newdb, int bytecode)
     }
     cl_engine_set_clcb_stats_submit(engine, NULL);
 
-    if ((ret =
-         cl_load (newfile, engine, &newsigs,
-                  CL_DB_PHISHING | CL_DB_PHISHING_URLS | CL_DB_BYTECODE |
-                  CL_DB_PUA | CL_DB_ENHANCED)) != CL_SUCCESS)
+    dboptions = CL_DB_PHISHING | CL_DB_PHISHING_URLS | CL_DB_BYTECODE |
+        CL_DB_PUA | CL_DB_ENHANCED;
+    if (!full)
+    {
+        /* the signatures are parsed and checked without building the
+         * matchers, and the bytecodes are checked without the JIT */
+        dboptions |= CL_DB_VERIFY_ONLY;
+        cl_engine_set_num (engine, CL_ENGINE_BYTECODE_MODE,
+                           CL_BYTECODE_MODE_INTERPRETER);
+    }
+
+    if ((ret = cl_load (newfile, engine, &newsigs, dboptions)) != CL_SUCCESS)
     {
         logg ("!Failed to load new database: %s\n", cl_strerror (ret));
         cl_engine_free (engine);
@@ -1506,7 +2087,8 @@ test_database (const char *newfile, const char *newdb, int bytecode)
 
 #ifndef WIN32
 static int
-test_database_wrap (const char *file, const char *newdb, int bytecode)
+test_database_wrap (const char *file, const char *newdb, int bytecode,
+                    int full)
 {
     char firstline[256];
     char lastline[256];
@@ -1518,7 +2100,7 @@ test_database_wrap (const char *file, const char *newdb, int bytecode)
     if (pipe (pipefd) == -1)
     {
         logg ("^pipe() failed: %s\n", strerror (errno));
-        return test_database (file, newdb, bytecode);
+        return test_database (file, newdb, bytecode, full);
     }
 
     switch (pid = fork ())
@@ -1527,12 +2109,12 @@ test_database_wrap (const char *file, const char *newdb, int bytecode)
         close (pipefd[0]);
         if (dup2 (pipefd[1], 2) == -1)
             logg("^dup2() failed: %s\n", strerror(errno));
-        exit (test_database (file, newdb, bytecode));
+        exit (test_database (file, newdb, bytecode, full));
     case -1:
         close (pipefd[0]);
         close (pipefd[1]);
         logg ("^fork() failed: %s\n", strerror (errno));
-        return test_database (file, newdb, bytecode);
+        return test_database (file, newdb, bytecode, full);
     default:
         /* read first / last line printed by child */
         close (pipefd[1]);
@@ -1588,12 +2170,13 @@ test_database_wrap (const char *file, const char *newdb, int bytecode)
 }
 #else
 static int
-test_database_wrap (const char *file, const char *newdb, int bytecode)
+test_database_wrap (const char *file, const char *newdb, int bytecode,
+                    int full)
 {
     int ret = FCE_TESTFAIL;
     __try
     {
-        ret = test_database (file, newdb, bytecode);
+        ret = test_database (file, newdb, bytecode, full);
     }
     __except (logg ("!Exception during database testing, code %08x\n",
                     GetExceptionCode ()), EXCEPTION_CONTINUE_SEARCH)
@@ -2059,7 +2642,10 @@ updatedb (const char *dbname, const char *hostname, char *ip, int *signo,
 	}    
 
         maxattempts = optget (opts, "MaxAttempts")->numarg;
-        for (i = currver + 1; i <= newver; i++)
+        ret = getpatches (dbname, tmpdir, currver + 1, newver, hostname, ip,
+                          localip, proxy, port, user, pass, uas, ctimeout,
+                          rtimeout, mdat, can_whitelist, attempt, &i);
+        for (; !ret && i <= newver; i++)
         {
             for (j = 1; j <= maxattempts; j++)
             {
@@ -2177,7 +2763,8 @@ updatedb (const char *dbname, const char *hostname, char *ip, int *signo,
         newfile = newfile2;
         sigchld_wait = 0;       /* we need to wait() for the child ourselves */
         if (test_database_wrap
-            (newfile, newdb, optget (opts, "Bytecode")->enabled))
+            (newfile, newdb, optget (opts, "Bytecode")->enabled,
+             optget (opts, "TestDatabasesFull")->enabled))
         {
             logg ("!Failed to load new database\n");
             unlink (newfile);
@@ -2328,7 +2915,7 @@ updatecustomdb (const char *url, int *signo, const struct optstruct *opts,
         ret =
             getfile (rpath, newfile, host, NULL, localip, proxy, port, user,
                      pass, uas, ctimeout, rtimeout, NULL, logerr, 0,
-                     *mtime ? mtime : NULL, opts, 1);
+                     *mtime ? mtime : NULL, 0, opts, 1);
         if (ret == 1)
         {
             logg ("%s is up to date (version: custom database)\n", dbname);
@@ -2417,7 +3004,8 @@ updatecustomdb (const char *url, int *signo, const struct optstruct *opts,
         newfile = newfile2;
         sigchld_wait = 0;       /* we need to wait() for the child ourselves */
         if (test_database_wrap
-            (newfile, dbname, optget (opts, "Bytecode")->enabled))
+            (newfile, dbname, optget (opts, "Bytecode")->enabled,
+             optget (opts, "TestDatabasesFull")->enabled))
         {
             logg ("!Failed to load new database\n");
             unlink (newfile);
@@ -2469,13 +3057,287 @@ updatecustomdb (const char *url, int *signo, const struct optstruct *opts,
     return 0;
 }
 
-int
-downloadmanager (const struct optstruct *opts, const char *hostname,
-                 unsigned int attempt)
+/* a database for updatedbs() */
+struct updjob
+{
+    const char *dbname;
+    const char *dnsreply;
+    int extra;
+    pid_t pid;                  /* of the child updating it, 0 if none */
+    int fd;
+    struct mirdat_ip *mirtab;   /* the mirrors when the child started */
+    unsigned int mirnum;
+};
+
+/* written by the child to its pipe, followed by its mirrors */
+struct updres
+{
+    int ret;
+    int signo;
+    char ipaddr[46];
+    unsigned int mirnum;
+};
+
+#ifndef _WIN32
+static struct mirdat_ip *
+mirtab_find (struct mirdat_ip *mirtab, unsigned int num,
+             const struct mirdat_ip *mir)
+{
+    unsigned int i;
+
+    for (i = 0; i < num; i++)
+        if (mirtab[i].ip4 == mir->ip4
+            && !memcmp (mirtab[i].ip6, mir->ip6, sizeof (mir->ip6)))
+            return &mirtab[i];
+    return NULL;
+}
+
+/* adds to mdat what the child learnt about the mirrors since it started */
+static void
+updjob_merge (struct mirdat *mdat, const struct updjob *job,
+              const struct mirdat_ip *mirtab, unsigned int mirnum)
+{
+    const struct mirdat_ip *old;
+    struct mirdat_ip *cur, *newtab;
+    unsigned int i;
+    int d;
+
+    for (i = 0; i < mirnum; i++)
+    {
+        old = mirtab_find (job->mirtab, job->mirnum, &mirtab[i]);
+        if (old && !memcmp (old, &mirtab[i], sizeof (*old)))
+            continue;
+
+        if (!(cur = mirtab_find (mdat->mirtab, mdat->num, &mirtab[i])))
+        {
+            newtab = realloc (mdat->mirtab,
+                              (mdat->num + 1) * sizeof (struct mirdat_ip));
+            if (!newtab)
+            {
+                logg ("!Can't allocate memory for new element in mdat->mirtab\n");
+                return;
+            }
+            mdat->mirtab = newtab;
+            mdat->mirtab[mdat->num++] = mirtab[i];
+            continue;
+        }
+
+        d = (int) mirtab[i].succ - (old ? (int) old->succ : 0);
+        cur->succ = (int) cur->succ + d < 0 ? 0 : cur->succ + d;
+        d = (int) mirtab[i].fail - (old ? (int) old->fail : 0);
+        cur->fail = (int) cur->fail + d < 0 ? 0 : cur->fail + d;
+        cur->ignore = mirtab[i].ignore;
+        if (!mirtab[i].atime || mirtab[i].atime > cur->atime)
+            cur->atime = mirtab[i].atime;
+    }
+}
+
+static int
+updjob_start (struct updjob *job, const char *hostname, char *ipaddr,
+              const struct optstruct *opts, char *localip, int outdated,
+              struct mirdat *mdat, int logerr, unsigned int attempt)
+{
+    struct updres res;
+    int fds[2];
+
+    job->mirnum = mdat->num;
+    if (!(job->mirtab = malloc (mdat->num * sizeof (struct mirdat_ip) + 1)))
+    {
+        logg ("!updatedbs: Can't allocate memory for the mirrors\n");
+        return -1;
+    }
+    memcpy (job->mirtab, mdat->mirtab, mdat->num * sizeof (struct mirdat_ip));
+
+    if (pipe (fds) == -1)
+    {
+        logg ("^pipe() failed: %s\n", strerror (errno));
+        free (job->mirtab);
+        job->mirtab = NULL;
+        return -1;
+    }
+
+    switch (job->pid = fork ())
+    {
+    case 0:
+        close (fds[0]);
+        /* or cli_gentemp() would give the same names in all the children */
+        srand ((unsigned int) getpid () ^ (unsigned int) time (NULL));
+        memset (&res, 0, sizeof (res));
+        res.ret = updatedb (job->dbname, hostname, ipaddr, &res.signo, opts,
+                            job->dnsreply, localip, outdated, mdat, logerr,
+                            job->extra, attempt);
+        strncpy (res.ipaddr, ipaddr, sizeof (res.ipaddr) - 1);
+        res.mirnum = mdat->num;
+        if (write (fds[1], &res, sizeof (res)) != sizeof (res)
+            || write (fds[1], mdat->mirtab,
+                      res.mirnum * sizeof (struct mirdat_ip)) !=
+            (ssize_t) (res.mirnum * sizeof (struct mirdat_ip)))
+            exit (1);
+        exit (0);
+    case -1:
+        logg ("^fork() failed: %s\n", strerror (errno));
+        close (fds[0]);
+        close (fds[1]);
+        free (job->mirtab);
+        job->mirtab = NULL;
+        job->pid = 0;
+        return -1;
+    default:
+        close (fds[1]);
+        job->fd = fds[0];
+        return 0;
+    }
+}
+
+static int
+updjob_finish (struct updjob *job, char *ipaddr, int *signo,
+               struct mirdat *mdat)
+{
+    struct updres res;
+    struct mirdat_ip *mirtab = NULL;
+    int status;
+
+    if (cli_readn (job->fd, &res, sizeof (res)) != sizeof (res)
+        || !(mirtab = malloc (res.mirnum * sizeof (struct mirdat_ip) + 1))
+        || cli_readn (job->fd, mirtab, res.mirnum * sizeof (struct mirdat_ip))
+        != (int) (res.mirnum * sizeof (struct mirdat_ip)))
+    {
+        logg ("!Update of %s failed: no result from its process\n",
+              job->dbname);
+        res.ret = FCE_FAILEDUPDATE;
+    }
+    else
+    {
+        *signo += res.signo;
+        res.ipaddr[sizeof (res.ipaddr) - 1] = 0;
+        if (!ipaddr[0])
+            strcpy (ipaddr, res.ipaddr);
+        updjob_merge (mdat, job, mirtab, res.mirnum);
+    }
+    close (job->fd);
+    while (waitpid (job->pid, &status, 0) == -1 && errno == EINTR);
+    job->pid = 0;
+    free (mirtab);
+    free (job->mirtab);
+    job->mirtab = NULL;
+
+    return res.ret;
+}
+#endif
+
+/* Updates the databases, up to ConcurrentDatabases of them at once in
+ * child processes, each with its own mirror selection and connection. The
+ * children send back their result, signature count, mirror IP and what
+ * they learnt about the mirrors, so the caller goes on as after updating
+ * them one by one. Returns the first fatal (> 50) error, after which no
+ * more updates are started. */
+static int
+updatedbs (struct updjob *jobs, unsigned int njobs, const char *hostname,
+           char *ipaddr, int *signo, const struct optstruct *opts,
+           char *localip, int outdated, struct mirdat *mdat, int logerr,
+           unsigned int attempt, int *updated)
+{
+    unsigned int i;
+    int ret;
+#ifndef _WIN32
+    unsigned int max = optget (opts, "ConcurrentDatabases")->numarg;
+    unsigned int next, running = 0;
+    int fatal = 0, maxfd;
+    fd_set all, rfds;
+
+    if (max < 2 || njobs < 2)
+#endif
+    {
+        for (i = 0; i < njobs; i++)
+        {
+            if ((ret = updatedb (jobs[i].dbname, hostname, ipaddr, signo,
+                                 opts, jobs[i].dnsreply, localip, outdated,
+                                 mdat, logerr, jobs[i].extra, attempt)) > 50)
+                return ret;
+            else if (ret == 0)
+                *updated = 1;
+        }
+        return 0;
+    }
+
+#ifndef _WIN32
+    /* the children can't share it */
+    keepconn_close ();
+
+    for (next = 0; next < njobs || running;)
+    {
+        if (next < njobs && running < max && !fatal)
+        {
+            if (!updjob_start (&jobs[next], hostname, ipaddr, opts, localip,
+                               outdated, mdat, logerr, attempt))
+            {
+                running++;
+                next++;
+                continue;
+            }
+            ret = updatedb (jobs[next].dbname, hostname, ipaddr, signo, opts,
+                            jobs[next].dnsreply, localip, outdated, mdat,
+                            logerr, jobs[next].extra, attempt);
+            next++;
+            if (ret > 50)
+                fatal = ret;
+            else if (ret == 0)
+                *updated = 1;
+            continue;
+        }
+        if (!running)
+            break;
+
+        FD_ZERO (&all);
+        maxfd = -1;
+        for (i = 0; i < next; i++)
+        {
+            if (jobs[i].pid > 0)
+            {
+                FD_SET (jobs[i].fd, &all);
+                if (jobs[i].fd > maxfd)
+                    maxfd = jobs[i].fd;
+            }
+        }
+        rfds = all;
+        if (select (maxfd + 1, &rfds, NULL, NULL, NULL) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            /* then the results are simply read in order */
+            logg ("^updatedbs: select() failed: %s\n", strerror (errno));
+            rfds = all;
+        }
+        for (i = 0; i < next; i++)
+        {
+            if (jobs[i].pid <= 0 || !FD_ISSET (jobs[i].fd, &rfds))
+                continue;
+            ret = updjob_finish (&jobs[i], ipaddr, signo, mdat);
+            running--;
+            if (ret > 50)
+            {
+                if (!fatal)
+                    fatal = ret;
+            }
+            else if (ret == 0)
+                *updated = 1;
+        }
+    }
+    mirman_write ("mirrors.dat", dbdir, mdat);
+
+    return fatal;
+#endif
+}
+
+static int
+updateall (const struct optstruct *opts, const char *hostname,
+           unsigned int attempt)
 {
     time_t currtime;
     int ret, custret, updated = 0, outdated = 0, signo = 0, logerr;
-    unsigned int ttl;
+    int onlycustom = 0;
+    unsigned int ttl, njobs, i;
+    struct updjob *jobs;
     char ipaddr[46], *dnsreply = NULL, *pt, *localip = NULL, *newver = NULL;
     const struct optstruct *opt;
     struct mirdat mdat;
@@ -2604,11 +3466,29 @@ downloadmanager (const struct optstruct *opts, const char *hostname,
         }
     }
 
+    njobs = 4;
     if ((opt = optget (opts, "update-db"))->enabled)
-    {
-        const char *u_dnsreply;
-        int u_extra;
+        for (; opt; opt = opt->nextarg)
+            njobs++;
+    if ((opt = optget (opts, "ExtraDatabase"))->enabled)
+        for (; opt; opt = opt->nextarg)
+            njobs++;
+    if (!(jobs = calloc (njobs, sizeof (*jobs))))
+    {
+        logg ("!downloadmanager: Can't allocate memory for the databases\n");
+        if (dnsreply)
+            free (dnsreply);
+        if (newver)
+            free (newver);
+        mirman_write ("mirrors.dat", dbdir, &mdat);
+        mirman_free (&mdat);
+        cli_rmdirs (updtmpdir);
+        return FCE_MEM;
+    }
+    njobs = 0;
 
+    if ((opt = optget (opts, "update-db"))->enabled)
+    {
         while (opt)
         {
             if (!strcmp (opt->strarg, "custom"))
@@ -2618,43 +3498,23 @@ downloadmanager (const struct optstruct *opts, const char *hostname,
                     logg ("!--update-db=custom requires DatabaseCustomURL\n");
                     custret = FCE_CONFIG;
                 }
-                free (dnsreply);
-                free (newver);
-                mirman_write ("mirrors.dat", dbdir, &mdat);
-                mirman_free (&mdat);
-                cli_rmdirs (updtmpdir);
-                return custret;
+                onlycustom = 1;
+                break;
             }
 
+            jobs[njobs].dbname = opt->strarg;
             if (!strcmp (opt->strarg, "main")
                 || !strcmp (opt->strarg, "daily")
                 || !strcmp (opt->strarg, "safebrowsing")
                 || !strcmp (opt->strarg, "bytecode"))
             {
-                u_dnsreply = dnsreply;
-                u_extra = 0;
+                jobs[njobs].dnsreply = dnsreply;
             }
             else
             {
-                u_dnsreply = NULL;
-                u_extra = 1;
-            }
-            if ((ret =
-                 updatedb (opt->strarg, hostname, ipaddr, &signo, opts,
-                           u_dnsreply, localip, outdated, &mdat, logerr,
-                           u_extra, attempt)) > 50)
-            {
-                if (dnsreply)
-                    free (dnsreply);
-                if (newver)
-                    free (newver);
-                mirman_write ("mirrors.dat", dbdir, &mdat);
-                mirman_free (&mdat);
-                cli_rmdirs (updtmpdir);
-                return ret;
+                jobs[njobs].extra = 1;
             }
-            else if (ret == 0)
-                updated = 1;
+            njobs++;
 
             opt = opt->nextarg;
         }
@@ -2662,38 +3522,9 @@ downloadmanager (const struct optstruct *opts, const char *hostname,
     }
     else
     {
-        if ((ret =
-             updatedb ("main", hostname, ipaddr, &signo, opts, dnsreply,
-                       localip, outdated, &mdat, logerr, 0, attempt)) > 50)
-        {
-            if (dnsreply)
-                free (dnsreply);
-            if (newver)
-                free (newver);
-            mirman_write ("mirrors.dat", dbdir, &mdat);
-            mirman_free (&mdat);
-            cli_rmdirs (updtmpdir);
-            return ret;
-        }
-        else if (ret == 0)
-            updated = 1;
-
+        jobs[njobs++].dbname = "main";
         /* if ipaddr[0] != 0 it will use it to connect to the web host */
-        if ((ret =
-             updatedb ("daily", hostname, ipaddr, &signo, opts, dnsreply,
-                       localip, outdated, &mdat, logerr, 0, attempt)) > 50)
-        {
-            if (dnsreply)
-                free (dnsreply);
-            if (newver)
-                free (newver);
-            mirman_write ("mirrors.dat", dbdir, &mdat);
-            mirman_free (&mdat);
-            cli_rmdirs (updtmpdir);
-            return ret;
-        }
-        else if (ret == 0)
-            updated = 1;
+        jobs[njobs++].dbname = "daily";
 
         if (!optget (opts, "SafeBrowsing")->enabled)
         {
@@ -2712,22 +3543,10 @@ downloadmanager (const struct optstruct *opts, const char *hostname,
                     logg ("*%s removed\n", safedb);
             }
         }
-        else if ((ret =
-                  updatedb ("safebrowsing", hostname, ipaddr, &signo, opts,
-                            dnsreply, localip, outdated, &mdat, logerr, 0,
-                            attempt)) > 50)
+        else
         {
-            if (dnsreply)
-                free (dnsreply);
-            if (newver)
-                free (newver);
-            mirman_write ("mirrors.dat", dbdir, &mdat);
-            mirman_free (&mdat);
-            cli_rmdirs (updtmpdir);
-            return ret;
+            jobs[njobs++].dbname = "safebrowsing";
         }
-        else if (ret == 0)
-            updated = 1;
 
         if (!optget (opts, "Bytecode")->enabled)
         {
@@ -2747,49 +3566,40 @@ downloadmanager (const struct optstruct *opts, const char *hostname,
                     logg ("*%s removed\n", dbname);
             }
         }
-        else if ((ret =
-                  updatedb ("bytecode", hostname, ipaddr, &signo, opts,
-                            dnsreply, localip, outdated, &mdat, logerr, 0,
-                            attempt)) > 50)
+        else
         {
-            if (dnsreply)
-                free (dnsreply);
-            if (newver)
-                free (newver);
-            mirman_write ("mirrors.dat", dbdir, &mdat);
-            mirman_free (&mdat);
-            cli_rmdirs (updtmpdir);
-            return ret;
+            jobs[njobs++].dbname = "bytecode";
         }
-        else if (ret == 0)
-            updated = 1;
+        for (i = 0; i < njobs; i++)
+            jobs[i].dnsreply = dnsreply;
 
         /* handle extra dbs */
         if ((opt = optget (opts, "ExtraDatabase"))->enabled)
         {
             while (opt)
             {
-                if ((ret =
-                     updatedb (opt->strarg, hostname, ipaddr, &signo, opts,
-                               NULL, localip, outdated, &mdat, logerr, 1,
-                               attempt)) > 50)
-                {
-                    if (dnsreply)
-                        free (dnsreply);
-                    if (newver)
-                        free (newver);
-                    mirman_write ("mirrors.dat", dbdir, &mdat);
-                    mirman_free (&mdat);
-                    cli_rmdirs (updtmpdir);
-                    return ret;
-                }
-                else if (ret == 0)
-                    updated = 1;
+                jobs[njobs].dbname = opt->strarg;
+                jobs[njobs++].extra = 1;
                 opt = opt->nextarg;
             }
         }
     }
 
+    ret = updatedbs (jobs, njobs, hostname, ipaddr, &signo, opts, localip,
+                     outdated, &mdat, logerr, attempt, &updated);
+    free (jobs);
+    if (ret > 50 || onlycustom)
+    {
+        if (dnsreply)
+            free (dnsreply);
+        if (newver)
+            free (newver);
+        mirman_write ("mirrors.dat", dbdir, &mdat);
+        mirman_free (&mdat);
+        cli_rmdirs (updtmpdir);
+        return ret > 50 ? ret : custret;
+    }
+
     if (dnsreply)
         free (dnsreply);
 
@@ -2895,3 +3705,13 @@ downloadmanager (const struct optstruct *opts, const char *hostname,
 
     return updated ? 0 : FC_UPTODATE;
 }
+
+int
+downloadmanager (const struct optstruct *opts, const char *hostname,
+                 unsigned int attempt)
+{
+    int ret = updateall (opts, hostname, attempt);
+
+    keepconn_close ();
+    return ret;
+}
@@ -176,52 +176,81 @@ mirman_check (uint32_t * ip, int af, struct mirdat *mdat,
     return 0;
 }
 
-static int
-mirman_update_int (uint32_t * ip, int af, struct mirdat *mdat, uint8_t broken,
-                   int succ, int fail)
+static struct mirdat_ip *
+mirman_find (uint32_t * ip, int af, struct mirdat *mdat)
 {
-    unsigned int i, found = 0;
-
-
-    if (!mdat->active)
-        return 0;
+    unsigned int i;
 
     for (i = 0; i < mdat->num; i++)
     {
         if ((af == AF_INET && mdat->mirtab[i].ip4 == *ip)
             || (af == AF_INET6
                 && !memcmp (mdat->mirtab[i].ip6, ip, 4 * sizeof (uint32_t))))
-        {
-            found = 1;
-            break;
-        }
+            return &mdat->mirtab[i];
+    }
+
+    return NULL;
+}
+
+static struct mirdat_ip *
+mirman_add (uint32_t * ip, int af, struct mirdat *mdat)
+{
+    struct mirdat_ip *mirtab;
+
+    mirtab =
+        (struct mirdat_ip *) realloc (mdat->mirtab,
+                                      (mdat->num +
+                                       1) * sizeof (struct mirdat_ip));
+    if (!mirtab)
+    {
+        logg ("!Can't allocate memory for new element in mdat->mirtab\n");
+        return NULL;
     }
+    mdat->mirtab = mirtab;
+    memset (&mdat->mirtab[mdat->num], 0, sizeof (struct mirdat_ip));
+    if (af == AF_INET)
+        mdat->mirtab[mdat->num].ip4 = *ip;
+    else
+        memcpy (mdat->mirtab[mdat->num].ip6, ip, 4 * sizeof (uint32_t));
+
+    return &mdat->mirtab[mdat->num++];
+}
+
+static int
+mirman_update_int (uint32_t * ip, int af, struct mirdat *mdat, uint8_t broken,
+                   int succ, int fail)
+{
+    struct mirdat_ip *md;
+
 
-    if (found)
+    if (!mdat->active)
+        return 0;
+
+    if ((md = mirman_find (ip, af, mdat)))
     {
-        mdat->mirtab[i].atime = 0;  /* will be updated in mirman_write() */
+        md->atime = 0;  /* will be updated in mirman_write() */
         if (succ || fail)
         {
-            if ((int) mdat->mirtab[i].fail + fail < 0)
-                mdat->mirtab[i].fail = 0;
+            if ((int) md->fail + fail < 0)
+                md->fail = 0;
             else
-                mdat->mirtab[i].fail += fail;
+                md->fail += fail;
 
-            if ((int) mdat->mirtab[i].succ + succ < 0)
-                mdat->mirtab[i].succ = 0;
+            if ((int) md->succ + succ < 0)
+                md->succ = 0;
             else
-                mdat->mirtab[i].succ += succ;
+                md->succ += succ;
         }
         else
         {
             if (broken)
-                mdat->mirtab[i].fail++;
+                md->fail++;
             else
-                mdat->mirtab[i].succ++;
+                md->succ++;
 
             if (broken == 2)
             {
-                mdat->mirtab[i].ignore = 2;
+                md->ignore = 2;
             }
             else
             {
@@ -229,46 +258,27 @@ mirman_update_int (uint32_t * ip, int af, struct mirdat *mdat, uint8_t broken,
                  * If the total number of failures is less than 3 then never
                  * mark a permanent failure, in other case use the real status.
                  */
-                if (mdat->mirtab[i].fail < 3)
-                    mdat->mirtab[i].ignore = 0;
+                if (md->fail < 3)
+                    md->ignore = 0;
                 else
-                    mdat->mirtab[i].ignore = broken;
+                    md->ignore = broken;
             }
         }
     }
     else
     {
-        mdat->mirtab =
-            (struct mirdat_ip *) realloc (mdat->mirtab,
-                                          (mdat->num +
-                                           1) * sizeof (struct mirdat_ip));
-        if (!mdat->mirtab)
-        {
-            logg ("!Can't allocate memory for new element in mdat->mirtab\n");
+        if (!(md = mirman_add (ip, af, mdat)))
             return -1;
-        }
-        memset (&mdat->mirtab[mdat->num], 0, sizeof (struct mirdat_ip));
-        if (af == AF_INET)
-        {
-            mdat->mirtab[mdat->num].ip4 = *ip;
-        }
-        else
-        {
-            mdat->mirtab[mdat->num].ip4 = 0;
-            memcpy (mdat->mirtab[mdat->num].ip6, ip, 4 * sizeof (uint32_t));
-        }
-        mdat->mirtab[mdat->num].atime = 0;
-        mdat->mirtab[mdat->num].succ = (succ > 0) ? succ : 0;
-        mdat->mirtab[mdat->num].fail = (fail > 0) ? fail : 0;
-        mdat->mirtab[mdat->num].ignore = (broken == 2) ? 2 : 0;
+        md->succ = (succ > 0) ? succ : 0;
+        md->fail = (fail > 0) ? fail : 0;
+        md->ignore = (broken == 2) ? 2 : 0;
         if (!succ && !fail)
         {
             if (broken)
-                mdat->mirtab[mdat->num].fail++;
+                md->fail++;
             else
-                mdat->mirtab[mdat->num].succ++;
+                md->succ++;
         }
-        mdat->num++;
     }
 
     return 0;
@@ -287,6 +297,67 @@ mirman_update_sf (uint32_t * ip, int af, struct mirdat *mdat, int succ,
     return mirman_update_int (ip, af, mdat, 0, succ, fail);
 }
 
+/* weight of a new sample in the running averages, 1/2^MIRMAN_EWMA_SHIFT */
+#define MIRMAN_EWMA_SHIFT 2
+
+static uint32_t
+mirman_ewma (uint32_t avg, uint32_t sample)
+{
+    if (!avg)
+        return sample;
+    return (uint32_t) (((uint64_t) avg * ((1 << MIRMAN_EWMA_SHIFT) - 1)
+                        + sample) >> MIRMAN_EWMA_SHIFT);
+}
+
+/* rtt is the connect time in ms, rate the download throughput in bytes/s;
+ * 0 means no sample */
+int
+mirman_measure (uint32_t * ip, int af, struct mirdat *mdat, uint32_t rtt,
+                uint32_t rate)
+{
+    struct mirdat_ip *md;
+
+    if (!mdat->active)
+        return 0;
+
+    if (!(md = mirman_find (ip, af, mdat)) && !(md = mirman_add (ip, af, mdat)))
+        return -1;
+
+    if (rtt)
+        md->rtt = mirman_ewma (md->rtt, rtt);
+    if (rate)
+        md->rate = mirman_ewma (md->rate, rate);
+
+    return 0;
+}
+
+/* expected time in ms to fetch a 1 MB file, 0 if never measured */
+static uint32_t
+mirman_cost (const struct mirdat_ip *md)
+{
+    if (!md->rate)
+        return md->rtt;
+    return md->rtt + (uint32_t) (1000ULL * 1048576 / md->rate);
+}
+
+/*
+ * Returns 1 when mirror a should be tried before b. Mirrors that were never
+ * measured go first, so that each one gets its chance; among the others
+ * the expected time of a download decides, and the balance of successes
+ * and failures breaks the ties.
+ */
+int
+mirman_prefer (const struct mirdat_ip *a, const struct mirdat_ip *b)
+{
+    uint32_t ca = mirman_cost (a), cb = mirman_cost (b);
+
+    if (!ca != !cb)
+        return !ca;
+    if (ca != cb)
+        return ca < cb;
+    return a->succ <= b->succ && a->fail <= b->fail;
+}
+
 void
 mirman_list (const struct mirdat *mdat)
 {
@@ -314,6 +385,10 @@ mirman_list (const struct mirdat *mdat)
 #endif
         printf ("Successes: %u\n", mdat->mirtab[i].succ);
         printf ("Failures: %u\n", mdat->mirtab[i].fail);
+        if (mdat->mirtab[i].rtt)
+            printf ("Connect time: %u ms\n", mdat->mirtab[i].rtt);
+        if (mdat->mirtab[i].rate)
+            printf ("Throughput: %u KB/s\n", mdat->mirtab[i].rate / 1024);
         tm = mdat->mirtab[i].atime;
         printf ("Last access: %s", ctime ((const time_t *) &tm));
         printf ("Ignore: %s\n", mdat->mirtab[i].ignore ? "Yes" : "No");
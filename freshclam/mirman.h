@@ -29,7 +29,9 @@ struct mirdat_ip
     uint32_t fail;              /* number of failures */
     uint8_t ignore;             /* ignore flag */
     uint32_t ip6[4];            /* IPv6 address */
-    char res[16];               /* reserved */
+    uint32_t rtt;               /* average connect time (ms) */
+    uint32_t rate;              /* average download throughput (bytes/s) */
+    char res[8];                /* reserved */
 };
 
 struct mirdat
@@ -49,6 +51,9 @@ int mirman_update (uint32_t * ip, int af, struct mirdat *mdat,
                    uint8_t broken);
 int mirman_update_sf (uint32_t * ip, int af, struct mirdat *mdat, int succ,
                       int fail);
+int mirman_measure (uint32_t * ip, int af, struct mirdat *mdat, uint32_t rtt,
+                    uint32_t rate);
+int mirman_prefer (const struct mirdat_ip *a, const struct mirdat_ip *b);
 void mirman_list (const struct mirdat *mdat);
 void mirman_whitelist (struct mirdat *mdat, unsigned int mode);
 int mirman_write (const char *file, const char *dir, struct mirdat *mdat);
@@ -319,6 +319,129 @@ wait_connect (int sock, const struct sockaddr *addr, socklen_t addrlen,
     return ret;
 }
 
+/* 1 when connected, 0 when in progress, -1 on failure */
+static int
+race_start (int sock, const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (!connect (sock, addr, addrlen))
+        return connect_error (sock) ? -1 : 1;
+
+    switch (errno)
+    {
+    case EALREADY:
+    case EINPROGRESS:
+    case EAGAIN:
+        return 0;
+    case EISCONN:
+        return 1;
+    default:
+        logg ("race_start: connect(): fd=%d errno=%d: %s\n", sock, errno,
+              strerror (errno));
+        return -1;
+    }
+}
+
+/*
+	race_connect(): connects 'socks[0]' and, unless it has connected
+	within 'delay' msecs, also 'socks[1]'; returns the index of the first
+	socket to connect (or -1 when both failed within 'secs') and sets
+	'msecs' to the time it took
+*/
+int
+race_connect (const int *socks, const struct sockaddr *const *addrs,
+              const socklen_t * addrlens, int delay, int secs, long *msecs)
+{
+    int select_failures = NONBLOCK_SELECT_MAX_FAILURES;
+    long fcntl_flags[2];
+    struct timeval start[2], timeout, now, wait;
+    int state[2] = { -1, -1 }, started = 0, won = -1, i, n;
+
+    fcntl_flags[0] = nonblock_fcntl (socks[0]);
+    fcntl_flags[1] = nonblock_fcntl (socks[1]);
+
+    gettimeofday (&timeout, 0);
+    timeout.tv_sec += secs;
+
+    for (;;)
+    {
+        fd_set fds;
+        int numfd = 0;
+
+        gettimeofday (&now, 0);
+        /* the second one starts after the delay, or when the first failed */
+        if (started < 2
+            && (!started || state[0] == -1
+                || (now.tv_sec - start[0].tv_sec) * 1000
+                + (now.tv_usec - start[0].tv_usec) / 1000 >= delay))
+        {
+            start[started] = now;
+            state[started] = race_start (socks[started], addrs[started],
+                                         addrlens[started]);
+            if (state[started++] == 1)
+            {
+                won = started - 1;
+                break;
+            }
+            continue;
+        }
+
+        if (state[0] == -1 && state[1] == -1)
+            break;              /* both failed */
+
+        if (timercmp (&now, &timeout, >))
+        {
+            logg ("race_connect: connect timing out (%d secs)\n", secs);
+            break;
+        }
+
+        timersub (&timeout, &now, &wait);
+        if (started < 2 && wait.tv_sec * 1000 + wait.tv_usec / 1000 > delay)
+        {
+            wait.tv_sec = delay / 1000;
+            wait.tv_usec = (delay % 1000) * 1000;
+        }
+
+        FD_ZERO (&fds);
+        for (i = 0; i < started; i++)
+            if (!state[i])
+            {
+                FD_SET (socks[i], &fds);
+                if (socks[i] >= numfd)
+                    numfd = socks[i] + 1;
+            }
+
+        n = select (numfd, 0, &fds, 0, &wait);
+        if (n < 0)
+        {
+            logg ("race_connect: select() failure %d: errno=%d: %s\n",
+                  select_failures, errno, strerror (errno));
+            if (--select_failures >= 0)
+                continue;
+            break;
+        }
+
+        for (i = 0; i < started && won == -1; i++)
+            if (!state[i] && FD_ISSET (socks[i], &fds))
+            {
+                if ((state[i] = connect_error (socks[i]) ? -1 : 1) == 1)
+                    won = i;
+            }
+        if (won != -1)
+            break;
+    }
+
+    if (won != -1)
+    {
+        gettimeofday (&now, 0);
+        timersub (&now, &start[won], &wait);
+        *msecs = wait.tv_sec * 1000 + wait.tv_usec / 1000;
+    }
+    restore_fcntl (socks[0], fcntl_flags[0]);
+    restore_fcntl (socks[1], fcntl_flags[1]);
+
+    return won;
+}
+
 /*
 	wait_recv(): wrapper for recv(), with explicit 'secs' timeout
 */
@@ -34,6 +34,14 @@
 int wait_connect (int sock, const struct sockaddr *addr, socklen_t addrlen,
                   int secs);
 
+/*
+	race_connect(): connects to the first of two addresses, and to the
+	second one too when the first hasn't answered within 'delay' msecs
+*/
+int race_connect (const int *socks, const struct sockaddr *const *addrs,
+                  const socklen_t * addrlens, int delay, int secs,
+                  long *msecs);
+
 /*
         wait_recv(): wrapper for recv(), with explicit 'secs' timeout
 */
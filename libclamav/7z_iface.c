@@ -30,10 +30,16 @@
 #include "scanners.h"
 #include "others.h"
 #include "fmap.h"
+#include "cache.h"
 
 #include "7z/7z.h"
 #include "7z/7zAlloc.h"
 #include "7z/7zFile.h"
+#include "7z/7zCrc.h"
+#include "7z/LzmaDec.h"
+#include "7z/Lzma2Dec.h"
+#include "7z/Bra.h"
+#include "7z/CpuArch.h"
 
 
 static ISzAlloc allocImp = { __lzma_wrap_alloc, __lzma_wrap_free}, allocTempImp = { __lzma_wrap_alloc, __lzma_wrap_free};
@@ -78,14 +84,487 @@ static SRes FileInStream_fmap_Seek(void *pp, Int64 *pos, ESzSeek origin) {
     return 0;
 }
 
+/* Digest of the coders and the packed streams of a folder, which decide
+ * what the folder decodes to; returns -1 on error */
+static int folder_digest(cli_ctx *ctx, const CSzArEx *db, UInt32 fi, unsigned char *digest) {
+    const CSzFolder *folder = db->db.Folders + fi;
+    fmap_t *map = *ctx->fmap;
+    UInt64 pos, size;
+    UInt32 j, outs = 0;
+    const void *data;
+    size_t len;
+    void *h;
+
+    if (SzArEx_GetFolderFullPackSize(db, fi, &size) != SZ_OK)
+	return -1;
+    pos = SzArEx_GetFolderStreamPos(db, fi, 0);
+    if (pos > map->len || size > map->len - pos || !(h = cl_hash_init("md5")))
+	return -1;
+
+    for (j = 0; j < folder->NumCoders; j++) {
+	const CSzCoderInfo *coder = folder->Coders + j;
+	UInt32 params[2] = { coder->NumInStreams, coder->NumOutStreams };
+
+	cl_update_hash(h, (void *)&coder->MethodID, sizeof(coder->MethodID));
+	cl_update_hash(h, params, sizeof(params));
+	if (coder->Props.size)
+	    cl_update_hash(h, coder->Props.data, coder->Props.size);
+	outs += coder->NumOutStreams;
+    }
+    if (folder->NumBindPairs)
+	cl_update_hash(h, folder->BindPairs, folder->NumBindPairs * sizeof(*folder->BindPairs));
+    if (folder->NumPackStreams)
+	cl_update_hash(h, folder->PackStreams, folder->NumPackStreams * sizeof(*folder->PackStreams));
+    if (outs)
+	cl_update_hash(h, folder->UnpackSizes, outs * sizeof(*folder->UnpackSizes));
+
+    while (size) {
+	len = size < 1024 * 1024 ? size : 1024 * 1024;
+	if (!(data = fmap_need_off_once(map, pos, len))) {
+	    cl_hash_destroy(h);
+	    return -1;
+	}
+	cl_update_hash(h, (void *)data, len);
+	pos += len;
+	size -= len;
+    }
+    return cl_finish_hash(h, digest) ? -1 : 1;
+}
+
 #define UTFBUFSZ 256
+
+#define k_Copy 0
+#define k_LZMA2 0x21
+#define k_LZMA  0x30101
+#define k_BCJ   0x03030103
+#define k_ARM   0x03030501
+
+#define UNZ7_CHUNK (1 << 16)
+#define UNZ7_LZMA2_DIC(p) (((UInt32)2 | ((p) & 1)) << ((p) / 2 + 11))
+
+struct unz7 {
+    cli_ctx *ctx;
+    CSzArEx db;
+    UInt16 utf16buf[UTFBUFSZ], *utf16name;
+    int namelen;
+    char *name;
+    UInt32 viruses_found;
+    unsigned int encrypted;
+    /* where the file starts in what its folder decodes to */
+    UInt32 keyFolder;
+    UInt64 keyOffset;
+    unsigned char keyDigest[16];
+    int keyed;
+    /* the current file is not extracted: a directory or over the limits */
+    int skip;
+    /* the current file was found clean before */
+    int cached;
+    struct cli_member_key key, *mkey;
+};
+
+/* What comes before the data of file i: the limits, the member cache and
+ * the name. Anything but CL_CLEAN ends the extraction. */
+static int unz7_begin(struct unz7 *u, UInt32 i)
+{
+    cli_ctx *ctx = u->ctx;
+    const CSzFileItem *f = u->db.db.Files + i;
+    UInt32 fi = u->db.FileIndexToFolderIndexMap[i];
+    UInt64 params[3] = { 0 };
+    int newnamelen, ret;
+    size_t j;
+    void *h;
+
+    u->skip = 1;
+    u->cached = 0;
+    u->mkey = NULL;
+
+    if ((ret = cli_checklimits("7unz", ctx, 0, 0, 0)))
+	return ret;
+
+    if (f->IsDir)
+	return CL_CLEAN;
+
+    if (fi != 0xFFFFFFFF) {
+	if (fi != u->keyFolder) {
+	    u->keyFolder = fi;
+	    u->keyOffset = 0;
+	    u->keyed = 0;
+	    for (j = u->db.FolderStartFileIndex[fi]; j < i; j++)
+		u->keyOffset += u->db.db.Files[j].Size;
+	}
+	params[0] = u->keyOffset;
+	u->keyOffset += f->Size;
+    }
+
+    if (cli_checklimits("7unz", ctx, f->Size, 0, 0))
+	return CL_CLEAN;
+
+    /* the same file was found clean before, see cli_member_cache_check() */
+    params[1] = f->Size;
+    params[2] = f->CrcDefined ? f->Crc : 0x100000000ULL;
+    if (fi != 0xFFFFFFFF && (h = cli_member_cache_start(ctx, f->Size, params, sizeof(params)))) {
+	if (!u->keyed)
+	    u->keyed = folder_digest(ctx, &u->db, fi, u->keyDigest);
+	if (u->keyed < 0) {
+	    cl_hash_destroy(h);
+	} else {
+	    cl_update_hash(h, u->keyDigest, sizeof(u->keyDigest));
+	    if (cli_member_cache_check(h, ctx, &u->key) == CL_CLEAN)
+		u->cached = 1;
+	    else
+		u->mkey = &u->key;
+	}
+    }
+
+    if (!u->db.FileNameOffsets)
+	newnamelen = 0; /* no filename */
+    else {
+	newnamelen = SzArEx_GetFileNameUtf16(&u->db, i, NULL);
+	if (newnamelen > u->namelen) {
+	    if (u->namelen > UTFBUFSZ)
+		free(u->utf16name);
+	    u->utf16name = cli_malloc(newnamelen*2);
+	    if (!u->utf16name) {
+		u->namelen = 0;
+		return CL_EMEM;
+	    }
+	    u->namelen = newnamelen;
+	}
+	SzArEx_GetFileNameUtf16(&u->db, i, u->utf16name);
+    }
+
+    u->name = (char *)u->utf16name;
+    for (j=0; j<(size_t)newnamelen; j++) /* FIXME */
+	u->name[j] = u->utf16name[j];
+    u->name[j] = 0;
+    cli_dbgmsg("cli_7unz: extracting %s\n", u->name);
+    u->skip = 0;
+    return CL_CLEAN;
+}
+
+/* What comes after the data of file i, extracted to x unless res says it
+ * failed: the metadata signatures and the scan */
+static int unz7_end(struct unz7 *u, UInt32 i, SRes res, struct cli_extract *x)
+{
+    cli_ctx *ctx = u->ctx;
+    const CSzFileItem *f = u->db.db.Files + i;
+    struct cli_member_key *saved_key;
+    int found = CL_CLEAN, ret;
+
+    if (res == SZ_ERROR_ENCRYPTED) {
+	u->encrypted = 1;
+	if (DETECT_ENCRYPTED) {
+	    cli_dbgmsg("cli_7unz: Encrypted files found in archive.\n");
+	    cli_append_virus(ctx, "Heuristics.Encrypted.7Zip");
+	    u->viruses_found++;
+	    if (!SCAN_ALL)
+		return CL_VIRUS;
+	}
+    }
+    if (cli_matchmeta(ctx, u->name, 0, f->Size, u->encrypted, i, f->CrcDefined ? f->Crc : 0, NULL)) {
+	u->viruses_found++;
+	if (!SCAN_ALL)
+	    return CL_VIRUS;
+	found = CL_VIRUS;
+    }
+    if (res != SZ_OK) {
+	cli_dbgmsg("cli_unz: extraction failed with %d\n", res);
+    } else if (!u->cached) {
+	saved_key = ctx->member_key;
+	ctx->member_key = u->mkey;
+	if ((ret = cli_extract_scan(x)) == CL_VIRUS)
+	    u->viruses_found++;
+	ctx->member_key = saved_key;
+	if (ret != CL_CLEAN)
+	    found = ret;
+    }
+    return found;
+}
+
+/* Whether the folder decodes with unz7_folder(): a single LZMA, LZMA2 or
+ * copy coder, possibly followed by the BCJ or ARM filter */
+static int unz7_streamable(const CSzFolder *f)
+{
+    const CSzCoderInfo *c = f->Coders;
+
+    if (f->NumCoders < 1 || f->NumCoders > 2 || f->NumPackStreams != 1 || f->PackStreams[0] != 0 ||
+	c->NumInStreams != 1 || c->NumOutStreams != 1 ||
+	(c->MethodID != k_Copy && c->MethodID != k_LZMA && c->MethodID != k_LZMA2))
+	return 0;
+    if (f->NumCoders == 1)
+	return f->NumBindPairs == 0;
+    c++;
+    return c->NumInStreams == 1 && c->NumOutStreams == 1 && (c->MethodID == k_BCJ || c->MethodID == k_ARM) &&
+	f->NumBindPairs == 1 && f->BindPairs[0].InIndex == 1 && f->BindPairs[0].OutIndex == 0;
+}
+
+struct unz7_folder {
+    /* the file being cut out, the next one to look at and the end */
+    UInt32 fi, cur, file, end;
+    int started;
+    UInt64 left;
+    UInt32 crc;
+    int extract;
+    struct cli_extract x;
+};
+
+/* Ends the current file of the folder */
+static int unz7_folder_end(struct unz7 *u, struct unz7_folder *s, SRes res)
+{
+    const CSzFileItem *f = u->db.db.Files + s->cur;
+    int found;
+
+    s->started = 0;
+    if (u->skip)
+	return CL_CLEAN;
+    if (res == SZ_OK && s->extract && f->CrcDefined && CRC_GET_DIGEST(s->crc) != f->Crc)
+	res = SZ_ERROR_CRC;
+    found = unz7_end(u, s->cur, res, &s->x);
+    if (s->extract && cli_extract_done(&s->x) && found == CL_CLEAN)
+	found = CL_EUNLINK;
+    return found;
+}
+
+/* Starts the next file of the folder; 0 when there's none left */
+static int unz7_folder_next(struct unz7 *u, struct unz7_folder *s, int *found)
+{
+    const CSzFileItem *f;
+
+    while (s->file < s->end && u->db.FileIndexToFolderIndexMap[s->file] != s->fi)
+	s->file++;
+    if (s->file >= s->end)
+	return 0;
+    s->cur = s->file++;
+    f = u->db.db.Files + s->cur;
+    s->started = 1;
+    s->left = f->Size;
+    s->extract = 0;
+    if ((*found = unz7_begin(u, s->cur)) != CL_CLEAN) {
+	s->started = 0;
+	return 0;
+    }
+    if (!u->skip && !u->cached) {
+	cli_extract_init(&s->x, u->ctx, NULL);
+	s->crc = CRC_INIT_VAL;
+	s->extract = 1;
+    }
+    return 1;
+}
+
+static int unz7_folder_stop(cli_ctx *ctx, int found)
+{
+    return found != CL_CLEAN && !(SCAN_ALL && found == CL_VIRUS);
+}
+
+/* Cuts the files out of what the folder decodes to */
+static int unz7_folder_feed(struct unz7 *u, struct unz7_folder *s, const Byte *data, size_t len)
+{
+    cli_ctx *ctx = u->ctx;
+    size_t n;
+    int found = CL_CLEAN, ret;
+
+    while (len) {
+	while (!s->started || !s->left) {
+	    if (s->started && unz7_folder_stop(ctx, ret = unz7_folder_end(u, s, SZ_OK)))
+		return ret;
+	    if (!unz7_folder_next(u, s, &found))
+		return found != CL_CLEAN ? found : CL_BREAK;
+	}
+	n = len < s->left ? len : (size_t)s->left;
+	if (s->extract) {
+	    s->crc = CrcUpdate(s->crc, data, n);
+	    if ((ret = cli_extract_write(&s->x, data, n)) != CL_SUCCESS)
+		return ret;
+	} else if ((ret = cli_budget_inflate(ctx, n)) != CL_SUCCESS) {
+	    return ret;
+	}
+	s->left -= n;
+	data += n;
+	len -= n;
+    }
+    return CL_CLEAN;
+}
+
+/* Applies the filter as the data comes: the last few bytes of a block
+ * wait for the next one, they're only converted in context */
+static int unz7_folder_filter(struct unz7 *u, struct unz7_folder *s, UInt64 method, Byte *buf, size_t *carry, size_t len, UInt32 *ip, UInt32 *x86state, int last)
+{
+    size_t n = *carry + len;
+    size_t done = 0;
+    int ret;
+
+    if (method == k_BCJ)
+	done = x86_Convert(buf, n, *ip, x86state, 0);
+    else if (method == k_ARM)
+	done = ARM_Convert(buf, n, *ip, 0);
+    else
+	done = n;
+    if (last)
+	done = n;
+    *ip += done;
+    if ((ret = unz7_folder_feed(u, s, buf, done)) != CL_CLEAN)
+	return ret;
+    memmove(buf, buf + done, n - done);
+    *carry = n - done;
+    return CL_CLEAN;
+}
+
+/* Decodes folder fi once, handing each file over to the scanner as soon
+ * as it's complete; only a dictionary and the file being extracted are
+ * held in memory, not the whole folder. first is the first file of the
+ * folder, the files up to end are looked at. */
+static int unz7_folder(struct unz7 *u, UInt32 fi, UInt32 first, UInt32 end)
+{
+    cli_ctx *ctx = u->ctx;
+    fmap_t *map = *ctx->fmap;
+    CSzFolder *folder = u->db.db.Folders + fi;
+    const CSzCoderInfo *coder = folder->Coders;
+    UInt64 method = coder->MethodID, filter = folder->NumCoders > 1 ? folder->Coders[1].MethodID : k_Copy;
+    UInt64 unpack = SzFolder_GetUnpackSize(folder), pos, packed, outleft;
+    CLzmaDec lzma;
+    CLzma2Dec lzma2;
+    struct unz7_folder s;
+    Byte props[5], *buf = NULL;
+    size_t carry = 0;
+    UInt32 ip = 0, x86state = 0, p;
+    uint64_t reserved = 0;
+    SRes res = SZ_OK;
+    int found = CL_CLEAN;
+
+    if (u->db.FolderStartPackStreamIndex[fi] >= u->db.db.NumPackStreams)
+	return CL_EFORMAT;
+    pos = SzArEx_GetFolderStreamPos(&u->db, fi, 0);
+    packed = u->db.db.PackSizes[u->db.FolderStartPackStreamIndex[fi]];
+    if (pos > map->len || packed > map->len - pos)
+	res = SZ_ERROR_INPUT_EOF;
+
+    /* no larger dictionary than the output */
+    LzmaDec_Construct(&lzma);
+    Lzma2Dec_Construct(&lzma2);
+    if (res != SZ_OK) {
+	;
+    } else if (method == k_LZMA) {
+	if (coder->Props.size != 5) {
+	    res = SZ_ERROR_UNSUPPORTED;
+	} else {
+	    memcpy(props, coder->Props.data, 5);
+	    if (unpack < GetUi32(props + 1)) {
+		p = unpack < (1 << 12) ? (1 << 12) : (UInt32)unpack;
+		SetUi32(props + 1, p);
+	    }
+	    if (cli_memgov_reserve(ctx, GetUi32(props + 1), 1) != CL_SUCCESS) {
+		res = SZ_ERROR_MEM;
+	    } else {
+		reserved = GetUi32(props + 1);
+		res = LzmaDec_Allocate(&lzma, props, 5, &allocImp);
+		LzmaDec_Init(&lzma);
+	    }
+	}
+    } else if (method == k_LZMA2) {
+	if (coder->Props.size != 1 || coder->Props.data[0] > 40) {
+	    res = SZ_ERROR_UNSUPPORTED;
+	} else {
+	    for (p = 0; p < coder->Props.data[0] && UNZ7_LZMA2_DIC(p) < unpack; p++);
+	    if (cli_memgov_reserve(ctx, UNZ7_LZMA2_DIC(p), 1) != CL_SUCCESS) {
+		res = SZ_ERROR_MEM;
+	    } else {
+		reserved = UNZ7_LZMA2_DIC(p);
+		res = Lzma2Dec_Allocate(&lzma2, (Byte)p, &allocImp);
+		Lzma2Dec_Init(&lzma2);
+	    }
+	}
+    } else if (packed != unpack) {
+	res = SZ_ERROR_DATA;
+    }
+    if (res == SZ_OK && !(buf = cli_malloc(UNZ7_CHUNK + 8)))
+	res = SZ_ERROR_MEM;
+    cli_dbgmsg("cli_7unz: decoding folder %u (%llu bytes) in one pass\n", fi, (long long unsigned)unpack);
+
+    memset(&s, 0, sizeof(s));
+    s.fi = fi;
+    s.file = first;
+    s.end = end;
+    outleft = unpack;
+    while (res == SZ_OK && found == CL_CLEAN && outleft) {
+	const Byte *src = NULL;
+	SizeT srcLen = packed < (1 << 18) ? (SizeT)packed : (1 << 18);
+	SizeT destLen = outleft < UNZ7_CHUNK ? (SizeT)outleft : UNZ7_CHUNK;
+	ELzmaStatus status;
+
+	if (srcLen && !(src = fmap_need_off_once(map, pos, srcLen))) {
+	    res = SZ_ERROR_READ;
+	    break;
+	}
+	if (method == k_LZMA) {
+	    res = LzmaDec_DecodeToBuf(&lzma, buf + carry, &destLen, src, &srcLen, LZMA_FINISH_ANY, &status);
+	} else if (method == k_LZMA2) {
+	    res = Lzma2Dec_DecodeToBuf(&lzma2, buf + carry, &destLen, src, &srcLen, LZMA_FINISH_ANY, &status);
+	} else {
+	    destLen = srcLen = destLen < srcLen ? destLen : srcLen;
+	    memcpy(buf + carry, src, destLen);
+	}
+	pos += srcLen;
+	packed -= srcLen;
+	outleft -= destLen;
+	/* neither read nor written, it's not going anywhere */
+	if (res == SZ_OK && !destLen && !srcLen)
+	    res = SZ_ERROR_DATA;
+	if (res == SZ_OK)
+	    found = unz7_folder_filter(u, &s, filter, buf, &carry, destLen, &ip, &x86state, !outleft);
+    }
+
+    /* the files left, if any, are empty or failed */
+    if (found == CL_CLEAN || found == CL_BREAK) {
+	found = CL_CLEAN;
+	if (s.started)
+	    found = unz7_folder_end(u, &s, s.left ? (res != SZ_OK ? res : SZ_ERROR_DATA) : SZ_OK);
+	while (!unz7_folder_stop(ctx, found) && unz7_folder_next(u, &s, &found))
+	    found = unz7_folder_end(u, &s, s.left ? (res != SZ_OK ? res : SZ_ERROR_DATA) : SZ_OK);
+    } else if (s.started && s.extract) {
+	cli_extract_done(&s.x);
+    }
+
+    if (res != SZ_OK)
+	cli_dbgmsg("cli_7unz: folder %u failed with %d\n", fi, res);
+    free(buf);
+    LzmaDec_Free(&lzma, &allocImp);
+    Lzma2Dec_Free(&lzma2, &allocImp);
+    cli_memgov_release(ctx->engine, reserved);
+    return found;
+}
+
+/* The other folders are decoded whole by SzArEx_Extract(), which drops the
+ * previous block as it allocates the next: its memory is reserved first.
+ * The files of a block refused once all fail without waiting again. */
+static SRes unz7_block_reserve(struct unz7 *u, UInt32 fi, UInt32 *blockIndex, Byte **outBuffer, size_t *outBufferSize, uint64_t *reserved, UInt32 *refused)
+{
+    uint64_t size;
+
+    if (fi == 0xFFFFFFFF || fi == *blockIndex)
+	return SZ_OK;
+    if (fi == *refused)
+	return SZ_ERROR_MEM;
+    IAlloc_Free(&allocImp, *outBuffer);
+    *outBuffer = NULL;
+    *outBufferSize = 0;
+    *blockIndex = 0xFFFFFFFF;
+    cli_memgov_release(u->ctx->engine, *reserved);
+    *reserved = 0;
+    size = SzFolder_GetUnpackSize(u->db.db.Folders + fi);
+    if (cli_memgov_reserve(u->ctx, size, 1) != CL_SUCCESS) {
+	*refused = fi;
+	return SZ_ERROR_MEM;
+    }
+    *reserved = size;
+    return SZ_OK;
+}
+
 int cli_7unz (cli_ctx *ctx, size_t offset) {
     CFileInStream archiveStream;
     CLookToRead lookStream;
-    CSzArEx db;
+    struct unz7 *u;
     SRes res;
-    UInt16 utf16buf[UTFBUFSZ], *utf16name = utf16buf;
-    int namelen = UTFBUFSZ, found = CL_CLEAN;
+    int found = CL_CLEAN;
     Int64 begin_of_archive = offset;
     UInt32 viruses_found = 0;
 
@@ -101,11 +580,18 @@ int cli_7unz (cli_ctx *ctx, size_t offset) {
     if(archiveStream.s.Seek(&archiveStream.s, &begin_of_archive, SZ_SEEK_SET) != 0)
 	return CL_CLEAN;
 
+    if (!(u = cli_calloc(1, sizeof(*u))))
+	return CL_EMEM;
+    u->ctx = ctx;
+    u->utf16name = u->utf16buf;
+    u->namelen = UTFBUFSZ;
+    u->keyFolder = 0xFFFFFFFF;
+
     lookStream.realStream = &archiveStream.s;
     LookToRead_Init(&lookStream);
 
-    SzArEx_Init(&db);
-    res = SzArEx_Open(&db, &lookStream.s, &allocImp, &allocTempImp);
+    SzArEx_Init(&u->db);
+    res = SzArEx_Open(&u->db, &lookStream.s, &allocImp, &allocTempImp);
     if(res == SZ_ERROR_ENCRYPTED && DETECT_ENCRYPTED) {
 	cli_dbgmsg("cli_7unz: Encrypted header found in archive.\n");
 	cli_append_virus(ctx, "Heuristics.Encrypted.7Zip");
@@ -114,97 +600,62 @@ int cli_7unz (cli_ctx *ctx, size_t offset) {
 	    found = CL_VIRUS;
 	}
     } else if(res == SZ_OK) {
-	UInt32 i, blockIndex = 0xFFFFFFFF;
+	UInt32 i, blockIndex = 0xFFFFFFFF, lastBlock, streamed = 0xFFFFFFFF, refused = 0xFFFFFFFF;
 	Byte *outBuffer = 0;
 	size_t outBufferSize = 0;
-	unsigned int encrypted = 0;
+	uint64_t reserved = 0;
+	struct cli_extract x;
 
-	for (i = 0; i < db.db.NumFiles; i++) {
+	for (i = 0; i < u->db.db.NumFiles; i++) {
 	    size_t offset = 0;
 	    size_t outSizeProcessed = 0;
-	    const CSzFileItem *f = db.db.Files + i;
-	    char *name;
-	    size_t j;
-	    int newnamelen, fd;
+	    UInt32 fi = u->db.FileIndexToFolderIndexMap[i];
 
-	    if((found = cli_checklimits("7unz", ctx, 0, 0, 0)))
-		break;
-
-	    if (f->IsDir)
+	    /* done along with the first file of the folder */
+	    if (fi != 0xFFFFFFFF && fi == streamed)
 		continue;
-
-	    if(cli_checklimits("7unz", ctx, f->Size, 0, 0))
+	    if (fi != 0xFFFFFFFF && unz7_streamable(u->db.db.Folders + fi)) {
+		streamed = fi;
+		res = SZ_OK;
+		if ((found = unz7_folder(u, fi, i, u->db.db.NumFiles)) != CL_CLEAN && !(SCAN_ALL && found == CL_VIRUS))
+		    break;
 		continue;
-
-	    if (!db.FileNameOffsets)
-		newnamelen = 0; /* no filename */
-	    else {
-		newnamelen = SzArEx_GetFileNameUtf16(&db, i, NULL);
-		if (newnamelen > namelen) {
-		    if(namelen > UTFBUFSZ)
-			free(utf16name);
-		    utf16name = cli_malloc(newnamelen*2);
-		    if(!utf16name) {
-			found = CL_EMEM;
-			break;
-		    }
-		    namelen = newnamelen;
-		}
-		SzArEx_GetFileNameUtf16(&db, i, utf16name);
 	    }
 
-	    name = (char *)utf16name;
-	    for(j=0; j<(size_t)newnamelen; j++) /* FIXME */
-		name[j] = utf16name[j];
-	    name[j] = 0;
-	    cli_dbgmsg("cli_7unz: extracting %s\n", name);
-
-	    res = SzArEx_Extract(&db, &lookStream.s, i, &blockIndex, &outBuffer, &outBufferSize, &offset, &outSizeProcessed, &allocImp, &allocTempImp);
-	    if(res == SZ_ERROR_ENCRYPTED) {
-		encrypted = 1;
-		if(DETECT_ENCRYPTED) {
-		    cli_dbgmsg("cli_7unz: Encrypted files found in archive.\n");
-		    cli_append_virus(ctx, "Heuristics.Encrypted.7Zip");
-		    viruses_found++;
-		    if(!SCAN_ALL) {
-			found = CL_VIRUS;
-			break;
-		    }
-		}
-	    }
-	    if(cli_matchmeta(ctx, name, 0, f->Size, encrypted, i, f->CrcDefined ? f->Crc : 0, NULL)) {
-		found = CL_VIRUS;
-		viruses_found++;
-		if (!SCAN_ALL)
+	    if ((found = unz7_begin(u, i)) != CL_CLEAN)
+		break;
+	    if (u->skip)
+		continue;
+
+	    cli_extract_init(&x, ctx, NULL);
+	    if (u->cached) {
+		res = SZ_OK;
+	    } else {
+		lastBlock = blockIndex;
+		if ((res = unz7_block_reserve(u, fi, &blockIndex, &outBuffer, &outBufferSize, &reserved, &refused)) == SZ_OK)
+		    res = SzArEx_Extract(&u->db, &lookStream.s, i, &blockIndex, &outBuffer, &outBufferSize, &offset, &outSizeProcessed, &allocImp, &allocTempImp);
+		/* a whole solid block is decoded at once */
+		if(res == SZ_OK && blockIndex != lastBlock && (found = cli_budget_inflate(ctx, outBufferSize)) != CL_SUCCESS)
 		    break;
-	    }
-	    if (res != SZ_OK)
-		cli_dbgmsg("cli_unz: extraction failed with %d\n", res);
-	    else {
-		if((found = cli_gentempfd(ctx->engine->tmpdir, &name, &fd)))
+		if(res == SZ_OK && (found = cli_extract_write(&x, outBuffer + offset, outSizeProcessed)) != CL_SUCCESS) {
+		    cli_extract_done(&x);
 		    break;
-		    
-		cli_dbgmsg("cli_7unz: Saving to %s\n", name);
-		if((size_t)cli_writen(fd, outBuffer + offset, outSizeProcessed) != outSizeProcessed)
-		    found = CL_EWRITE;
-		else
-		    if ((found = cli_magic_scandesc(fd, ctx)) == CL_VIRUS)
-			viruses_found++;
-		close(fd);
-		if(!ctx->engine->keeptmp && cli_unlink(name))
-		    found = CL_EUNLINK;
-
-		free(name);
-		if(found != CL_CLEAN)
-		    if (!(SCAN_ALL && found == CL_VIRUS))
-			break;
+		}
 	    }
+	    found = unz7_end(u, i, res, &x);
+	    if (cli_extract_done(&x) && found == CL_CLEAN)
+		found = CL_EUNLINK;
+	    if (found != CL_CLEAN && !(SCAN_ALL && found == CL_VIRUS))
+		break;
 	}
 	IAlloc_Free(&allocImp, outBuffer);
+	cli_memgov_release(ctx->engine, reserved);
     }
-    SzArEx_Free(&db, &allocImp);
-    if(namelen > UTFBUFSZ)
-	free(utf16name);
+    SzArEx_Free(&u->db, &allocImp);
+    if(u->namelen > UTFBUFSZ)
+	free(u->utf16name);
+    viruses_found += u->viruses_found;
+    free(u);
 
     if (res == SZ_OK)
 	cli_dbgmsg("cli_7unz: completed successfully\n");
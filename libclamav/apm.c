@@ -45,9 +45,22 @@
 #  define apm_parsemsg(...) ;
 #endif
 
+static int apm_scan(cli_ctx *ctx);
 static int apm_prtn_intxn(cli_ctx *ctx, struct apm_partition_info *aptable, size_t sectorsize, int old_school);
 
 int cli_scanapm(cli_ctx *ctx)
+{
+    int ret, pooled;
+
+    /* the partitions are scanned on the archive member threads */
+    pooled = cli_member_pool_start(ctx);
+    ret = apm_scan(ctx);
+    if (pooled)
+        ret = cli_member_pool_finish(ctx, ret);
+    return ret;
+}
+
+static int apm_scan(cli_ctx *ctx)
 {
     struct apm_driver_desc_map ddm;
     struct apm_partition_info aptable, apentry;
@@ -83,7 +96,7 @@ int cli_scanapm(cli_ctx *ctx)
     sectorsize = ddm.blockSize;
 
     /* size of total file must be described by the ddm */
-    maplen = (*ctx->fmap)->real_len;
+    maplen = (*ctx->fmap)->len;
     if ((ddm.blockSize * ddm.blockCount) != maplen) {
         cli_dbgmsg("cli_scanapm: File described %u size does not match %lu actual size\n",
                    (ddm.blockSize * ddm.blockCount), (unsigned long)maplen);
@@ -223,8 +236,8 @@ int cli_scanapm(cli_ctx *ctx)
         cli_dbgmsg("Blocks: [%u, +%u), ([%lu, +%lu))\n",
                    apentry.pBlockStart, apentry.pBlockCount, (long unsigned)partoff, (long unsigned)partsize);
 
-        /* send the partition to cli_map_scan */
-        ret = cli_map_scan(*ctx->fmap, partoff, partsize, ctx, CL_TYPE_PART_ANY);
+        /* send the partition to cli_member_scan_range */
+        ret = cli_member_scan_range(ctx, partoff, partsize, CL_TYPE_PART_ANY);
         if (ret != CL_CLEAN) {
             if ((ctx->options & CL_SCAN_ALLMATCHES) && (ret == CL_VIRUS))
                 detection = CL_VIRUS;
@@ -325,7 +325,7 @@ static int decomp_block(struct ASPK *stream, uint32_t size, uint8_t *stuff, uint
   stream.dict_helper[n].size = sz;				\
   wrkbuf = &wrkbuf[sz * sizeof(uint32_t) + 0x100];
 
-int unaspack212(uint8_t *image, unsigned int size, struct cli_exe_section *sections, uint16_t sectcount, uint32_t ep, uint32_t base, int f) {
+int unaspack212(uint8_t *image, unsigned int size, struct cli_exe_section *sections, uint16_t sectcount, uint32_t ep, uint32_t base, struct cli_extract *x) {
   struct ASPK stream;
   uint32_t i=0, j=0;
   uint8_t *blocks = image+ep+0x57c, *wrkbuf;
@@ -400,7 +400,7 @@ int unaspack212(uint8_t *image, unsigned int size, struct cli_exe_section *secti
   }
   if(!(outsects=cli_malloc(sizeof(struct cli_exe_section)*sectcount))) {
     cli_dbgmsg("Aspack: OOM - rebuild failed\n");
-    cli_writen(f, image, size);
+    cli_extract_write(x, image, size);
     return 1; /* No whatsoheader - won't infloop in pe.c */
   }
   memcpy(outsects, sections, sizeof(struct cli_exe_section)*sectcount);
@@ -408,9 +408,9 @@ int unaspack212(uint8_t *image, unsigned int size, struct cli_exe_section *secti
     outsects[i].raw=outsects[i].rva;
     outsects[i].rsz=outsects[i].vsz;
   }
-  if (!cli_rebuildpe((char *)image, outsects, sectcount, base, cli_readint32(image + ep + 0x39b), 0, 0, f)) {
+  if (!cli_rebuildpe((char *)image, outsects, sectcount, base, cli_readint32(image + ep + 0x39b), 0, 0, x)) {
     cli_dbgmsg("Aspack: rebuild failed\n");
-    cli_writen(f, image, size);
+    cli_extract_write(x, image, size);
   } else {
     cli_dbgmsg("Aspack: successfully rebuilt\n");
   }
@@ -24,7 +24,8 @@
 
 #include "cltypes.h"
 #include "execs.h"
+#include "scanners.h"
 
-int unaspack212(uint8_t *, unsigned int, struct cli_exe_section *, uint16_t, uint32_t, uint32_t, int);
+int unaspack212(uint8_t *, unsigned int, struct cli_exe_section *, uint16_t, uint32_t, uint32_t, struct cli_extract *);
 
 #endif
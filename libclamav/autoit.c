@@ -181,12 +181,42 @@ static uint32_t getbits(struct UNP *UNP, uint32_t size) {
 *********************/
 
 
+/*********************
+   extracted files
+*********************/
+
+/* The files go through an extraction buffer, see cli_extract_init(): they
+ * are only written to tmpd with leave-temps. The errors of the scan itself
+ * are ignored. */
+static int autoit_scan(cli_ctx *ctx, const uint8_t *buf, uint32_t len, const char *tmpd, unsigned int files, const char *what) {
+  struct cli_extract x;
+  char tempfile[1024];
+  int ret;
+
+  if (tmpd) {
+    snprintf(tempfile, 1023, "%s"PATHSEP"autoit.%.3u", tmpd, files);
+    tempfile[1023]='\0';
+  }
+  cli_extract_init(&x, ctx, tmpd ? tempfile : NULL);
+  if((ret = cli_extract_write(&x, buf, len)) != CL_SUCCESS) {
+    cli_dbgmsg("autoit: cannot write %u bytes\n", len);
+  } else {
+    if(tmpd)
+      cli_dbgmsg("autoit: %s extracted to %s\n", what, tempfile);
+    else
+      cli_dbgmsg("autoit: %s successfully extracted\n", what);
+    ret = cli_extract_scan(&x) == CL_VIRUS ? CL_VIRUS : CL_CLEAN;
+  }
+  if(cli_extract_done(&x) && ret != CL_VIRUS)
+    ret = CL_EUNLINK;
+  return ret;
+}
+
 static int ea05(cli_ctx *ctx, const uint8_t *base, char *tmpd) {
   uint8_t b[300], comp;
   uint32_t s, m4sum=0;
   int i, ret, det = 0;
   unsigned int files=0;
-  char tempfile[1024];
   struct UNP UNP;
   fmap_t *map = *ctx->fmap;
 
@@ -370,41 +400,14 @@ static int ea05(cli_ctx *ctx, const uint8_t *base, char *tmpd) {
     /* FIXME: REGRESSION NEEDED! */
     /* UNP.usize = u2a(UNP.outputbuf, UNP.usize); */
 
-    snprintf(tempfile, 1023, "%s"PATHSEP"autoit.%.3u", tmpd, files);
-    tempfile[1023]='\0';
-    if((i = open(tempfile, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRWXU)) < 0) {
-      cli_dbgmsg("autoit: Can't create file %s\n", tempfile);
-      free(UNP.outputbuf);
-      return CL_ECREAT;
-    }
-    if(cli_writen(i, UNP.outputbuf, UNP.usize) != (int32_t)UNP.usize) {
-      cli_dbgmsg("autoit: cannot write %d bytes\n", UNP.usize);
-      close(i);
-      free(UNP.outputbuf);
-      return CL_EWRITE;
-    }
+    i = autoit_scan(ctx, UNP.outputbuf, UNP.usize, tmpd, files, "file");
     free(UNP.outputbuf);
-    if(ctx->engine->keeptmp)
-      cli_dbgmsg("autoit: file extracted to %s\n", tempfile);
-    else 
-      cli_dbgmsg("autoit: file successfully extracted\n");
-    if (lseek(i, 0, SEEK_SET) == -1) {
-        cli_dbgmsg("autoit: call to lseek() has failed\n");
-        close(i);
-        return CL_ESEEK;
-    }
-    if(cli_magic_scandesc(i, ctx) == CL_VIRUS) {
-      if (!SCAN_ALL) {
-	close(i);
-	if(!ctx->engine->keeptmp)
-	  if(cli_unlink(tempfile)) return CL_EUNLINK;
+    if(i == CL_VIRUS) {
+      if (!SCAN_ALL)
 	return CL_VIRUS;
-      }
       det = 1;
-    }
-    close(i);
-    if(!ctx->engine->keeptmp)
-      if (cli_unlink(tempfile)) return CL_EUNLINK;
+    } else if(i != CL_CLEAN)
+      return i;
   }
   return (det ? CL_VIRUS : ret);
 }
@@ -501,7 +504,6 @@ static int ea06(cli_ctx *ctx, const uint8_t *base, char *tmpd) {
   uint32_t s;
   int i, ret, det = 0;
   unsigned int files=0;
-  char tempfile[1024];
   const char prefixes[] = { '\0', '\0', '@', '$', '\0', '.', '"', '#' };
   const char *opers[] = { ",", "=", ">", "<", "<>", ">=", "<=", "(", ")", "+", "-", "/", "*", "&", "[", "]", "==", "^", "+=", "-=", "/=", "*=", "&=" };
   struct UNP UNP;
@@ -897,41 +899,14 @@ static int ea06(cli_ctx *ctx, const uint8_t *base, char *tmpd) {
       UNP.cur_output = UNP.usize ;
     }
 
-    snprintf(tempfile, 1023, "%s"PATHSEP"autoit.%.3u", tmpd, files);
-    tempfile[1023]='\0';
-    if((i = open(tempfile, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRWXU)) < 0) {
-      cli_dbgmsg("autoit: Can't create file %s\n", tempfile);
-      free(buf);
-      return CL_ECREAT;
-    }
-    if(cli_writen(i, buf, UNP.cur_output) != (int32_t)UNP.cur_output) {
-      cli_dbgmsg("autoit: cannot write %d bytes\n", UNP.usize);
-      close(i);
-      free(buf);
-      return CL_EWRITE;
-    }
+    i = autoit_scan(ctx, buf, UNP.cur_output, tmpd, files, (script)?"script":"file");
     free(buf);
-    if(ctx->engine->keeptmp)
-      cli_dbgmsg("autoit: %s extracted to %s\n", (script)?"script":"file", tempfile);
-    else 
-      cli_dbgmsg("autoit: %s successfully extracted\n", (script)?"script":"file");
-    if (lseek(i, 0, SEEK_SET) == -1) {
-        cli_dbgmsg("autoit: call to lseek() has failed\n");
-        close(i);
-        return CL_ESEEK;
-    }
-    if(cli_magic_scandesc(i, ctx) == CL_VIRUS) {
-      if (!SCAN_ALL) {
-	close(i);
-	if(!ctx->engine->keeptmp)
-	  if (cli_unlink(tempfile)) return CL_EUNLINK;
+    if(i == CL_VIRUS) {
+      if (!SCAN_ALL)
 	return CL_VIRUS;
-      }
       det = 1;
-    }
-    close(i);
-    if(!ctx->engine->keeptmp)
-      if (cli_unlink(tempfile)) return CL_EUNLINK;
+    } else if(i != CL_CLEAN)
+      return i;
   }
   return (det ? CL_VIRUS : ret);
 }
@@ -943,7 +918,7 @@ static int ea06(cli_ctx *ctx, const uint8_t *base, char *tmpd) {
 int cli_scanautoit(cli_ctx *ctx, off_t offset) {
   const uint8_t *version;
   int r;
-  char *tmpd;
+  char *tmpd = NULL;
   fmap_t *map = *ctx->fmap;
 
   cli_dbgmsg("in scanautoit()\n");
@@ -951,15 +926,17 @@ int cli_scanautoit(cli_ctx *ctx, off_t offset) {
   if(!(version = fmap_need_off_once(map, offset, sizeof(*version))))
     return CL_EREAD;
 
-  if (!(tmpd = cli_gentemp(ctx->engine->tmpdir)))    
-    return CL_ETMPDIR;
-  if (mkdir(tmpd, 0700)) {
-    cli_dbgmsg("autoit: Can't create temporary directory %s\n", tmpd);
-    free(tmpd);
-    return CL_ETMPDIR;
-  }
-  if (ctx->engine->keeptmp)
+  /* the files only go to disk with leave-temps */
+  if (ctx->engine->keeptmp) {
+    if (!(tmpd = cli_gentemp(ctx->engine->tmpdir)))
+      return CL_ETMPDIR;
+    if (mkdir(tmpd, 0700)) {
+      cli_dbgmsg("autoit: Can't create temporary directory %s\n", tmpd);
+      free(tmpd);
+      return CL_ETMPDIR;
+    }
     cli_dbgmsg("autoit: Extracting files to %s\n", tmpd);
+  }
 
   switch(*version) {
   case 0x35:
@@ -982,9 +959,6 @@ int cli_scanautoit(cli_ctx *ctx, off_t offset) {
     r = CL_CLEAN;
   }
 
-  if (!ctx->engine->keeptmp)
-    cli_rmdirs(tmpd);
-
   free(tmpd);
   return r;
 }
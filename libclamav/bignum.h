@@ -20,9 +20,32 @@ typedef fp_int mp_int;
 #define mp_unsigned_bin_size fp_unsigned_bin_size
 #define mp_to_unsigned_bin(a,b) (fp_to_unsigned_bin(a,b), 0)
 #define mp_read_radix fp_read_radix
-#define mp_exptmod fp_exptmod
+#define mp_exptmod cli_exptmod
 #define mp_get_int(a) ((a)->used > 0 ? (a)->dp[0] : 0)
 #define mp_set_int(a, b) fp_set(a, b)
 #define mp_mul_2d fp_mul_2d
 #define mp_clear(x)
+
+/* d = a^b mod c with the OpenSSL bignums (crypto.c), big endian; returns
+ * the length of d (at most clen) or -1 */
+int cli_bn_exptmod(const unsigned char *a, unsigned int alen, const unsigned char *b, unsigned int blen, const unsigned char *c, unsigned int clen, unsigned char *d);
+
+/* fp_exptmod() replacement using the (usually much faster) OpenSSL
+ * implementation, tomsfastmath is only used when that fails */
+static inline int cli_exptmod(fp_int *a, fp_int *b, fp_int *c, fp_int *d)
+{
+    unsigned char abuf[FP_MAX_SIZE/8], bbuf[FP_MAX_SIZE/8], cbuf[FP_MAX_SIZE/8];
+    int alen = fp_unsigned_bin_size(a), blen = fp_unsigned_bin_size(b), clen = fp_unsigned_bin_size(c);
+    int len;
+
+    if(a->sign || b->sign || alen > (int)sizeof(abuf) || blen > (int)sizeof(bbuf) || clen > (int)sizeof(cbuf))
+        return fp_exptmod(a, b, c, d);
+    fp_to_unsigned_bin(a, abuf);
+    fp_to_unsigned_bin(b, bbuf);
+    fp_to_unsigned_bin(c, cbuf);
+    if((len = cli_bn_exptmod(abuf, alen, bbuf, blen, cbuf, clen, abuf)) < 0)
+        return fp_exptmod(a, b, c, d);
+    fp_read_unsigned_bin(d, abuf, len);
+    return FP_OKAY;
+}
 #endif
@@ -28,6 +28,9 @@
 #include <string.h>
 #include <assert.h>
 #include <fcntl.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "dconf.h"
 #include "clamav.h"
@@ -41,6 +44,7 @@
 #include "bytecode_api.h"
 #include "bytecode_api_impl.h"
 #include "builtin_bytecodes.h"
+#include "sigprof.h"
 #if HAVE_JSON
 #include "json.h"
 #endif
@@ -1555,7 +1559,7 @@ void cli_sigperf_events_destroy()
     cli_events_free(g_sigevents);
 }
 
-int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int trust, int sigperf)
+static int bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int trust, int sigperf, void *hashctx)
 {
     unsigned row = 0, current_func = 0, bb=0;
     char *buffer;
@@ -1576,6 +1580,7 @@ int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int tru
 	return CL_EMALFDB;
     }
     cli_chomp(firstbuf);
+    cl_update_hash(hashctx, firstbuf, strlen(firstbuf));
     rc = parseHeader(bc, (unsigned char*)firstbuf, &linelength);
     state = PARSE_BC_LSIG;
     if (rc == CL_BREAK) {
@@ -1601,6 +1606,7 @@ int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int tru
     }
     while (cli_dbgets(buffer, linelength, f, dbio) && !end) {
 	cli_chomp(buffer);
+	cl_update_hash(hashctx, buffer, strlen(buffer));
 	row++;
 	switch (state) {
 	    case PARSE_BC_LSIG:
@@ -1724,6 +1730,22 @@ DEAD CODE
     return CL_SUCCESS;
 }
 
+int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int trust, int sigperf)
+{
+    void *hashctx = cl_hash_init("md5");
+    int rc;
+
+    rc = bytecode_load(bc, f, dbio, trust, sigperf, hashctx);
+    if (!hashctx)
+	return rc;
+    /* the JIT reuses native code of bytecodes with the same digest */
+    if (rc == CL_SUCCESS)
+	cl_finish_hash(hashctx, bc->digest);
+    else
+	cl_hash_destroy(hashctx);
+    return rc;
+}
+
 static struct {
     enum bc_events id;
     const char *name;
@@ -1758,12 +1780,65 @@ static int register_events(cli_events_t *ev)
     return 0;
 }
 
+static int cli_bytecode_prepare_interpreter(struct cli_bc *bc);
+
+#ifdef CL_THREAD_SAFE
+static pthread_mutex_t lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Prepares a bytecode left lazy by cli_bytecode_prepare2 on its first run:
+ * JIT it as a set of its own, or fall back to the interpreter. It can't be
+ * interpreted while the JIT works, because preparing for the interpreter
+ * rewrites the instructions the JIT reads. Returns the set to run it with. */
+static const struct cli_all_bc *prepare_lazy(const struct cli_all_bc *bcs, struct cli_bc *bc)
+{
+    const struct cli_all_bc *run = bcs;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&lazy_mutex);
+#endif
+    if (bc->state == bc_lazy) {
+	struct cli_all_bc *one = cli_calloc(1, sizeof(*one));
+	int rc = CL_EBYTECODE;
+
+	bc->state = bc_loaded;
+	if (one) {
+	    one->all_bcs = bc;
+	    one->count = 1;
+	    one->env = bcs->env;
+	    if (cli_bytecode_init_jit(one, 0) == CL_SUCCESS && one->engine)
+		rc = cli_bytecode_prepare_jit(one);
+	}
+	if (rc == CL_SUCCESS) {
+	    bc->lazy_bcs = one;
+	    cli_dbgmsg("Bytecode %u: prepared with JIT on first use\n", bc->id);
+	} else {
+	    if (one) {
+		cli_bytecode_done_jit(one, 0);
+		free(one);
+	    }
+	    if (cli_bytecode_prepare_interpreter(bc) != CL_SUCCESS) {
+		bc->state = bc_disabled;
+		cli_warnmsg("Bytecode: %d failed to prepare for interpreter mode\n", bc->id);
+	    } else
+		cli_dbgmsg("Bytecode %u: prepared with interpreter on first use\n", bc->id);
+	}
+    }
+    if (bc->lazy_bcs)
+	run = bc->lazy_bcs;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&lazy_mutex);
+#endif
+    return run;
+}
+
 int cli_bytecode_run(const struct cli_all_bc *bcs, const struct cli_bc *bc, struct cli_bc_ctx *ctx)
 {
     int ret = CL_SUCCESS;
     struct cli_bc_inst inst;
     struct cli_bc_func func;
     cli_events_t *jit_ev = NULL, *interp_ev = NULL;
+    uint64_t sampled, usage;
 
     int test_mode = 0;
     cli_ctx *cctx =(cli_ctx*)ctx->ctx;
@@ -1776,6 +1851,8 @@ int cli_bytecode_run(const struct cli_all_bc *bcs, const struct cli_bc *bc, stru
     if (cctx && cctx->engine->bytecode_mode == CL_BYTECODE_MODE_TEST)
 	test_mode = 1;
 
+    if (bc->lazy)
+	bcs = prepare_lazy(bcs, (struct cli_bc *)bc);
     if (bc->state == bc_loaded) {
 	cli_errmsg("bytecode has to be prepared either for interpreter or JIT!\n");
 	return CL_EARG;
@@ -1804,6 +1881,8 @@ int cli_bytecode_run(const struct cli_all_bc *bcs, const struct cli_bc *bc, stru
 	}
     }
     cli_event_time_start(g_sigevents, bc->sigtime_id);
+    sampled = cli_sigprof_start(cctx);
+    usage = cli_usage_start(cctx);
     if (bc->state == bc_interp || test_mode) {
 	ctx->bc_events = interp_ev;
 	memset(&func, 0, sizeof(func));
@@ -1858,6 +1937,8 @@ int cli_bytecode_run(const struct cli_all_bc *bcs, const struct cli_bc *bc, stru
 	    cli_bcapi_extract_new(ctx, -1);
     }
     cli_event_time_stop(g_sigevents, bc->sigtime_id);
+    cli_sigprof_stop(cctx, CLI_SIGPROF_BYTECODE, bc, bc->lsig ? bc->lsig : bc->hook_name, sampled);
+    cli_usage_stop(cctx, usage, CLI_USAGE_BYTECODE);
     if (ctx->virname)
 	cli_event_count(g_sigevents, bc->sigmatch_id);
 
@@ -1913,12 +1994,40 @@ uint64_t cli_bytecode_context_getresult_int(struct cli_bc_ctx *ctx)
     return *(uint32_t*)ctx->values;/*XXX*/
 }
 
+/* Memory held by the interpreter form of bc (JIT code is not included) */
+size_t cli_bytecode_memsize(const struct cli_bc *bc)
+{
+    unsigned i;
+    size_t bytes = sizeof(*bc);
+
+    if (bc->funcs) {
+	for (i=0;i<bc->num_func;i++) {
+	    const struct cli_bc_func *f = &bc->funcs[i];
+	    bytes += sizeof(*f);
+	    bytes += (f->numValues + f->numConstants) * sizeof(*f->types);
+	    bytes += f->numBB * sizeof(*f->BB);
+	    bytes += f->numInsts * sizeof(*f->allinsts);
+	    bytes += f->numConstants * sizeof(*f->constants);
+	}
+    }
+    bytes += bc->num_types * sizeof(*bc->types);
+    bytes += bc->num_globals * (sizeof(*bc->globals) + sizeof(*bc->globaltys));
+    bytes += bc->numGlobalBytes;
+    if (bc->lsig)
+	bytes += strlen(bc->lsig) + 1;
+    return bytes;
+}
+
 void cli_bytecode_destroy(struct cli_bc *bc)
 {
     unsigned i, j, k;
     free(bc->metadata.compiler);
     free(bc->metadata.sigmaker);
 
+    if (bc->lazy_bcs) {
+	cli_bytecode_done_jit(bc->lazy_bcs, 0);
+	free(bc->lazy_bcs);
+    }
     if (bc->funcs) {
 	for (i=0;i<bc->num_func;i++) {
 	    struct cli_bc_func *f = &bc->funcs[i];
@@ -2331,6 +2440,38 @@ static int cli_bytecode_prepare_interpreter(struct cli_bc *bc)
 		    ret = CL_EBYTECODE;
 	    }
 	}
+	/* the interpreter relies on every block ending in a terminator with
+	 * valid targets, instead of checking each step */
+	for (j=0;j<bcfunc->numBB && ret == CL_SUCCESS;j++) {
+	    const struct cli_bc_bb *BB = &bcfunc->BB[j];
+	    const struct cli_bc_inst *last;
+
+	    if (!BB->numInsts) {
+		cli_errmsg("bytecode: empty basic block %u\n", j);
+		ret = CL_EBYTECODE;
+		break;
+	    }
+	    last = &BB->insts[BB->numInsts-1];
+	    switch (last->opcode) {
+		case OP_BC_BRANCH:
+		    if (last->u.branch.br_true >= bcfunc->numBB ||
+			last->u.branch.br_false >= bcfunc->numBB)
+			ret = CL_EBYTECODE;
+		    break;
+		case OP_BC_JMP:
+		    if (last->u.jump >= bcfunc->numBB)
+			ret = CL_EBYTECODE;
+		    break;
+		case OP_BC_RET:
+		case OP_BC_RET_VOID:
+		case OP_BC_ABORT:
+		    break;
+		default:
+		    ret = CL_EBYTECODE;
+	    }
+	    if (ret != CL_SUCCESS)
+		cli_errmsg("bytecode: basic block %u doesn't end in a valid terminator\n", j);
+	}
     if (map)
 	    free(map);
     }
@@ -2599,7 +2740,7 @@ static int run_builtin_or_loaded(struct cli_all_bc *bcs, uint8_t kind, const cha
 
 int cli_bytecode_prepare2(struct cl_engine *engine, struct cli_all_bc *bcs, unsigned dconfmask)
 {
-    unsigned i, interp = 0, jitok = 0, jitcount=0;
+    unsigned i, interp = 0, jitok = 0, jitcount=0, lazycount=0;
     int rc;
     struct cli_bc_ctx *ctx;
 
@@ -2681,10 +2822,23 @@ int cli_bytecode_prepare2(struct cl_engine *engine, struct cli_all_bc *bcs, unsi
     if (engine->bytecode_mode != CL_BYTECODE_MODE_INTERPRETER &&
 	engine->bytecode_mode != CL_BYTECODE_MODE_OFF) {
 	selfcheck(1, bcs->engine);
+	/* signatures that may never fire are compiled when they first do */
+	if (engine->bytecode_mode == CL_BYTECODE_MODE_AUTO && bcs->engine &&
+	    (dconfmask & BYTECODE_INTERPRETER)) {
+	    for (i=0;i<bcs->count;i++) {
+		struct cli_bc *bc = &bcs->all_bcs[i];
+		if (bc->state == bc_loaded && bc->kind == BC_LOGICAL) {
+		    bc->state = bc_lazy;
+		    bc->lazy = 1;
+		    lazycount++;
+		}
+	    }
+	}
 	rc = cli_bytecode_prepare_jit(bcs);
 	if (rc == CL_SUCCESS) {
 	    jitok = 1;
-	    cli_dbgmsg("Bytecode: %u bytecode prepared with JIT\n", bcs->count);
+	    cli_dbgmsg("Bytecode: %u bytecode prepared with JIT, %u left for first use\n",
+		       bcs->count - lazycount, lazycount);
 	    if (engine->bytecode_mode != CL_BYTECODE_MODE_TEST)
 		return CL_SUCCESS;
 	}
@@ -2724,6 +2878,7 @@ int cli_bytecode_prepare2(struct cl_engine *engine, struct cli_all_bc *bcs, unsi
 	    interp++;
 	    continue;
 	}
+	bc->lazy = 0;
 	rc = cli_bytecode_prepare_interpreter(bc);
 	if (rc != CL_SUCCESS) {
 	    bc->state = bc_disabled;
@@ -2777,7 +2932,7 @@ int cli_bytecode_runlsig(cli_ctx *cctx, struct cli_target_info *tinfo,
     ctx.hooks.match_offsets = lsigsuboff;
     cli_bytecode_context_setctx(&ctx, cctx);
     cli_bytecode_context_setfile(&ctx, map);
-    if (tinfo && tinfo->status == 1) {
+    if (tinfo && cli_targetinfo_exe(tinfo) == 1) {
 	ctx.sections = tinfo->exeinfo.section;
 	memset(&pehookdata, 0, sizeof(pehookdata));
 	pehookdata.offset = tinfo->exeinfo.offset;
@@ -2824,6 +2979,30 @@ int cli_bytecode_runlsig(cli_ctx *cctx, struct cli_target_info *tinfo,
     return CL_SUCCESS;
 }
 
+static inline int hook_wanted(const cli_ctx *cctx, const struct cli_bc *bc)
+{
+    if (!bc->lsig)
+	return 1;
+    return cctx->hook_lsig_matches &&
+	cli_bitset_test(cctx->hook_lsig_matches, bc->hook_lsig_id-1);
+}
+
+/* Tells whether cli_bytecode_runhook() would execute anything for hook id, so
+ * callers can skip building a bytecode context when every hook is filtered
+ * out by its logical signature. */
+int cli_bytecode_hook_pending(const cli_ctx *cctx, const struct cl_engine *engine, unsigned id)
+{
+    const unsigned *hooks = engine->hooks[id - _BC_START_HOOKS];
+    unsigned i, hooks_cnt = engine->hooks_cnt[id - _BC_START_HOOKS];
+
+    if (!cctx)
+	return 1; /* let runhook report the error */
+    for (i=0;i < hooks_cnt;i++)
+	if (hook_wanted(cctx, &engine->bcs.all_bcs[hooks[i]]))
+	    return 1;
+    return 0;
+}
+
 int cli_bytecode_runhook(cli_ctx *cctx, const struct cl_engine *engine, struct cli_bc_ctx *ctx,
 			 unsigned id, fmap_t *map)
 {
@@ -2842,12 +3021,10 @@ int cli_bytecode_runhook(cli_ctx *cctx, const struct cl_engine *engine, struct c
     ctx->hooks.match_offsets = ctx->lsigoff;
     for (i=0;i < hooks_cnt;i++) {
 	const struct cli_bc *bc = &engine->bcs.all_bcs[hooks[i]];
-	if (bc->lsig) {
-	    if (!cctx->hook_lsig_matches ||
-		!cli_bitset_test(cctx->hook_lsig_matches, bc->hook_lsig_id-1))
-		continue;
+	if (!hook_wanted(cctx, bc))
+	    continue;
+	if (bc->lsig)
 	    cli_dbgmsg("Bytecode: executing bytecode %u (lsig matched)\n" , bc->id);
-	}
 	cli_bytecode_context_setfuncid(ctx, bc, 0);
 	ret = cli_bytecode_run(&engine->bcs, bc, ctx);
 	executed++;
@@ -2931,8 +3108,13 @@ int cli_bytecode_context_setpe(struct cli_bc_ctx *ctx, const struct cli_pe_hook_
 
 void cli_bytecode_context_setctx(struct cli_bc_ctx *ctx, void *cctx)
 {
+    uint32_t left = cli_budget_remaining((cli_ctx*)cctx);
+
     ctx->ctx = cctx;
     ctx->bytecode_timeout = ((cli_ctx*)cctx)->engine->bytecode_timeout;
+    /* no further than the scan's own deadline */
+    if (left < ctx->bytecode_timeout)
+	ctx->bytecode_timeout = left;
 }
 
 void cli_bytecode_describe(const struct cli_bc *bc)
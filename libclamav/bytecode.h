@@ -44,7 +44,8 @@ enum bc_state {
     bc_loaded,
     bc_jit,
     bc_interp,
-    bc_disabled
+    bc_disabled,
+    bc_lazy
 };
 
 struct cli_bc {
@@ -73,6 +74,9 @@ struct cli_bc {
     uint8_t *globalBytes;
     uint32_t sigtime_id, sigmatch_id;
     char * hook_name;
+    unsigned char digest[16]; /* md5 of the source lines, all 0 if unknown */
+    unsigned lazy; /* prepared on first run */
+    struct cli_all_bc *lazy_bcs; /* own JIT set, once prepared */
 };
 
 struct cli_all_bc {
@@ -114,6 +118,7 @@ int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int sec
 int cli_bytecode_prepare2(struct cl_engine *engine, struct cli_all_bc *allbc, unsigned dconfmask);
 int cli_bytecode_run(const struct cli_all_bc *bcs, const struct cli_bc *bc, struct cli_bc_ctx *ctx);
 void cli_bytecode_destroy(struct cli_bc *bc);
+size_t cli_bytecode_memsize(const struct cli_bc *bc);
 int cli_bytecode_done(struct cli_all_bc *allbc);
 
 /* Bytecode IR descriptions */
@@ -129,6 +134,7 @@ struct cli_exe_info;
 struct cli_ctx_tag;
 struct cli_target_info;
 int cli_bytecode_runlsig(struct cli_ctx_tag *ctx, struct cli_target_info *info, const struct cli_all_bc *bcs, unsigned bc_idx, const uint32_t* lsigcnt, const uint32_t *lsigsuboff, fmap_t *map);
+int cli_bytecode_hook_pending(const struct cli_ctx_tag *cctx, const struct cl_engine *engine, unsigned id);
 int cli_bytecode_runhook(struct cli_ctx_tag *cctx, const struct cl_engine *engine, struct cli_bc_ctx *ctx, unsigned id, fmap_t *map);
 
 #ifdef __cplusplus
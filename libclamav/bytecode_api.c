@@ -385,14 +385,17 @@ int32_t cli_bcapi_file_find(struct cli_bc_ctx *ctx, const uint8_t* data, uint32_
     return cli_bcapi_file_find_limit(ctx, data, len, map->len);
 }
 
+/* the map is searched in place, in windows overlapping by len - 1 bytes so
+ * that the matches across two windows are found too */
+#define FILE_FIND_WINDOW 65536
+
 int32_t cli_bcapi_file_find_limit(struct cli_bc_ctx *ctx , const uint8_t* data, uint32_t len, int32_t limit)
 {
-    char buf[4096];
     fmap_t *map = ctx->fmap;
     uint32_t off = ctx->off;
-    int n;
+    size_t end, n;
 
-    if (!map || len > sizeof(buf)/4 || len <= 0 || limit <= 0) {
+    if (!map || len > 1024 || len <= 0 || limit <= 0) {
         cli_dbgmsg("bcapi_file_find_limit preconditions not met\n");
         API_MISUSE();
         return -1;
@@ -400,25 +403,47 @@ int32_t cli_bcapi_file_find_limit(struct cli_bc_ctx *ctx , const uint8_t* data,
 
     cli_event_int(EV, BCEV_OFFSET, off);
     cli_event_fastdata(EV, BCEV_FIND, data, len);
-    for (;;) {
-        const char *p;
-        int32_t readlen = sizeof(buf);
-        if (off + readlen > (unsigned int)limit) {
-            readlen = limit - off;
-            if (readlen < 0)
-                return -1;
-        }
-        n = fmap_readn(map, buf, off, readlen);
-        if ((unsigned)n < len || n < 0)
+    end = MIN((size_t)limit, map->len);
+    while (off < end && end - off >= len) {
+        const char *s, *p;
+
+        n = MIN(end - off, FILE_FIND_WINDOW);
+        if (!(s = fmap_need_off_once(map, off, n)))
             return -1;
-        p = cli_memmem(buf, n, data, len);
+        p = cli_memmem(s, n, data, len);
         if (p)
-            return off + p - buf;
-        off += n;
+            return off + p - s;
+        if (off + n >= end)
+            break;
+        off += n - len + 1;
     }
     return -1;
 }
 
+const uint8_t* cli_bcapi_file_view(struct cli_bc_ctx *ctx, int32_t off, uint32_t size)
+{
+    const uint8_t *p;
+
+    if (!ctx->fmap) {
+        cli_dbgmsg("bcapi_file_view: no fmap\n");
+        API_MISUSE();
+        return NULL;
+    }
+    if (off < 0 || !size || size > CLI_MAX_ALLOCATION ||
+        (size_t)off > ctx->fmap->len || size > ctx->fmap->len - off) {
+        cli_dbgmsg("bcapi_file_view: [%d, +%u) out of the file\n", off, size);
+        return NULL;
+    }
+    cli_event_int(EV, BCEV_OFFSET, off);
+    /* the pages stay mapped for the rest of the scan, like the ones
+     * buffer_pipe_read_get() hands out */
+    if (!(p = fmap_need_off(ctx->fmap, off, size))) {
+        cli_dbgmsg("bcapi_file_view: fmap_need_off failed at %d\n", off);
+        cli_event_count(EV, BCEV_READ_ERR);
+    }
+    return p;
+}
+
 int32_t cli_bcapi_file_byteat(struct cli_bc_ctx *ctx, uint32_t off)
 {
     unsigned char c;
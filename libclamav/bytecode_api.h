@@ -1215,5 +1215,17 @@ int32_t json_get_int(int32_t objid);
 //double json_get_double(int32_t objid);
 
 /* ----------------- END 0.98.4 APIs ---------------------------------- */
+
+/**
+\group_file
+  * Returns a read-only view of \p size bytes of the current file, starting
+  * at \p offset, without copying them like read() does. The view is valid
+  * until the end of the scan and accesses are checked against \p size.
+  * The current file position isn't changed.
+  * @param[in] offset absolute offset in the current file
+  * @param[in] size amount of bytes in the view
+  * @return pointer to the data, or NULL if the range isn't in the file
+  */
+const uint8_t *file_view(int32_t offset, uint32_t size);
 #endif
 #endif
@@ -133,6 +133,7 @@ int32_t cli_bcapi_json_get_string_length(struct cli_bc_ctx *ctx , int32_t);
 int32_t cli_bcapi_json_get_string(struct cli_bc_ctx *ctx , int8_t*, int32_t, int32_t);
 int32_t cli_bcapi_json_get_boolean(struct cli_bc_ctx *ctx , int32_t);
 int32_t cli_bcapi_json_get_int(struct cli_bc_ctx *ctx , int32_t);
+const uint8_t* cli_bcapi_file_view(struct cli_bc_ctx *ctx , int32_t, uint32_t);
 
 const struct cli_apiglobal cli_globals[] = {
 /* Bytecode globals BEGIN */
@@ -317,7 +318,8 @@ const struct cli_apicall cli_apicalls[]={
 	{"json_get_string_length", 8, 31, 2},
 	{"json_get_string", 9, 8, 9},
 	{"json_get_boolean", 8, 32, 2},
-	{"json_get_int", 8, 33, 2}
+	{"json_get_int", 8, 33, 2},
+	{"file_view", 13, 4, 6}
 /* Bytecode APIcalls END */
 };
 const unsigned cli_numapicalls=sizeof(cli_apicalls)/sizeof(cli_apicalls[0]);
@@ -416,7 +418,8 @@ const cli_apicall_bufget cli_apicalls6[] = {
 	(cli_apicall_bufget)cli_bcapi_buffer_pipe_read_get,
 	(cli_apicall_bufget)cli_bcapi_buffer_pipe_write_get,
 	(cli_apicall_bufget)cli_bcapi_map_getvalue,
-	(cli_apicall_bufget)cli_bcapi_pdf_getobj
+	(cli_apicall_bufget)cli_bcapi_pdf_getobj,
+	(cli_apicall_bufget)cli_bcapi_file_view
 };
 const cli_apicall_int3 cli_apicalls7[] = {
 	(cli_apicall_int3)cli_bcapi_inflate_init,
@@ -94,10 +94,10 @@ static inline int bcfail(const char *msg, long a, long b,
 #define always_inline
 #endif
 
+/* targets were checked by cli_bytecode_prepare_interpreter */
 static always_inline int jump(const struct cli_bc_func *func, uint16_t bbid, struct cli_bc_bb **bb, const struct cli_bc_inst **inst,
                 unsigned *bb_inst)
 {
-    CHECK_GT(func->numBB, bbid);
     *bb = &func->BB[bbid];
     *inst = (*bb)->insts;
     *bb_inst = 0;
@@ -489,6 +489,7 @@ struct ptr_infos {
     struct ptr_info *stack_infos;
     struct ptr_info *glob_infos;
     unsigned nstacks, nglobs;
+    unsigned stackcap;
 };
 
 static inline int64_t ptr_compose(int32_t id, uint32_t offset)
@@ -514,11 +515,16 @@ static inline int64_t ptr_register_stack(struct ptr_infos *infos,
                                          uint32_t off, uint32_t size)
 {
     unsigned n = infos->nstacks + 1;
-    struct ptr_info *sinfos = cli_realloc(infos->stack_infos,
-                                          sizeof(*sinfos)*n);
-    if (!sinfos)
-        return 0;
-    infos->stack_infos = sinfos;
+    struct ptr_info *sinfos = infos->stack_infos;
+    if (n > infos->stackcap) {
+        /* a frame is registered on every call and return, grow geometrically */
+        unsigned cap = infos->stackcap ? infos->stackcap*2 : 16;
+        sinfos = cli_realloc(sinfos, sizeof(*sinfos)*cap);
+        if (!sinfos)
+            return 0;
+        infos->stack_infos = sinfos;
+        infos->stackcap = cap;
+    }
     infos->nstacks = n;
     sinfos = &sinfos[n-1];
     sinfos->base = (uint8_t*)values + off;
@@ -634,7 +640,7 @@ static struct {
 
 int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct cli_bc_func *func, const struct cli_bc_inst *inst)
 {
-    unsigned i, j, stack_depth=0, bb_inst=0, stop=0, pc=0;
+    unsigned i, j, stack_depth=0, bb_inst=0, stop=0, pc=0, timecheck=5000;
     struct cli_bc_func *func2;
     struct stack stack;
     struct stack_entry *stack_entry = NULL;
@@ -668,7 +674,8 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 
     do {
         pc++;
-        if (!(pc % 5000)) {
+        if (!--timecheck) {
+            timecheck = 5000;
             gettimeofday(&tv1, NULL);
             if (tv1.tv_sec > timeout.tv_sec ||
                 (tv1.tv_sec == timeout.tv_sec &&
@@ -1239,11 +1246,9 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
                 stop = CL_EARG;
                 continue;
         }
+        /* blocks end in a terminator, so this stays inside bb */
         bb_inst++;
         inst++;
-        if (bb) {
-            CHECK_GT(bb->numInsts, bb_inst);
-        }
     } while (stop == CL_SUCCESS);
     if (cli_debug_flag) {
         gettimeofday(&tv1, NULL);
@@ -30,6 +30,7 @@
 #include <new>
 #include <cerrno>
 #include <string>
+#include <vector>
 
 #include "ClamBCModule.h"
 #include "ClamBCDiagnostics.h"
@@ -208,17 +209,42 @@ void LLVMInitializePowerPCAsmPrinter();
 extern "C" unsigned int cli_rndnum(unsigned int max);
 using namespace llvm;
 typedef DenseMap<const struct cli_bc_func*, void*> FunctionMapTy;
-struct cli_bcengine {
+// Native code for one set of bytecodes.  Images are shared by engines that
+// load the same bytecodes (e.g. across reloads), and kept in a small cache.
+struct cli_bcjit_image {
     ExecutionEngine *EE;
     JITEventListener *Listener;
     LLVMContext Context;
-    FunctionMapTy compiledFunctions;
     union {
 	unsigned char b[16];
 	void* align;/* just to align field to ptr */
     } guard;
+    unsigned refs;
+    unsigned char key[16];
+    std::vector<void*> entrypoints;// by bytecode index, 0 if not JITed
+};
+struct cli_bcengine {
+    struct cli_bcjit_image *image;
+    FunctionMapTy compiledFunctions;
 };
 
+#define JIT_CACHE_SLOTS 2
+// most recently used first, protected by the LLVM API lock
+static struct cli_bcjit_image *jit_cache[JIT_CACHE_SLOTS];
+
+static void jit_image_release(struct cli_bcjit_image *image)
+{
+    if (--image->refs)
+	return;
+    if (image->EE) {
+	if (image->Listener)
+	    image->EE->UnregisterJITEventListener(image->Listener);
+	delete image->EE;
+    }
+    delete image->Listener;
+    delete image;
+}
+
 extern "C" uint8_t cli_debug_flag;
 #if LLVM_VERSION >= 29
 namespace llvm {
@@ -301,6 +327,11 @@ void do_shutdown() {
 	// otherwise destructor calls report_fatal_error
 	((class raw_fd_ostream&)errs()).clear_error();
 
+	for (unsigned i=0;i<JIT_CACHE_SLOTS;i++) {
+	    if (jit_cache[i])
+		jit_image_release(jit_cache[i]);
+	    jit_cache[i] = 0;
+	}
 	llvm_shutdown();
 
 	((class raw_fd_ostream&)errs()).clear_error();
@@ -2460,6 +2491,65 @@ static void addFPasses(FunctionPassManager &FPM, bool trusted, Module *M)
     FPM.add(createDeadCodeEliminationPass());
 }
 
+// Digest of everything the native code depends on: the bytecodes, how they
+// were loaded, and the target.  Fails if a bytecode has no digest.
+static bool jit_image_key(const struct cli_all_bc *bcs, unsigned char *key)
+{
+    static const unsigned char nodigest[16] = { 0 };
+    unsigned version = LLVM_VERSION;
+    std::string target;
+    void *ctx;
+
+    // single bytecodes (selfcheck, first use) are cheap to rebuild and would
+    // only push the database set out of the cache
+    if (bcs->count < 2 || !(ctx = cl_hash_init("md5")))
+	return false;
+#if LLVM_VERSION < 31
+    target = sys::getHostTriple();
+#else
+    target = sys::getDefaultTargetTriple();
+#endif
+    target += "/" + sys::getHostCPUName();
+    cl_update_hash(ctx, (void*)target.data(), target.size());
+    cl_update_hash(ctx, &version, sizeof(version));
+    for (unsigned i=0;i<bcs->count;i++) {
+	const struct cli_bc *bc = &bcs->all_bcs[i];
+	unsigned meta[3] = { bc->id, bc->trusted, (unsigned)bc->state };
+
+	if (!memcmp(bc->digest, nodigest, sizeof(nodigest))) {
+	    cl_hash_destroy(ctx);
+	    return false;
+	}
+	cl_update_hash(ctx, (void*)bc->digest, sizeof(bc->digest));
+	cl_update_hash(ctx, meta, sizeof(meta));
+    }
+    return cl_finish_hash(ctx, key) == 0;
+}
+
+static struct cli_bcjit_image *jit_cache_get(const unsigned char *key)
+{
+    for (unsigned i=0;i<JIT_CACHE_SLOTS && jit_cache[i];i++) {
+	struct cli_bcjit_image *image = jit_cache[i];
+
+	if (memcmp(image->key, key, sizeof(image->key)))
+	    continue;
+	memmove(&jit_cache[1], &jit_cache[0], i*sizeof(jit_cache[0]));
+	jit_cache[0] = image;
+	image->refs++;
+	return image;
+    }
+    return 0;
+}
+
+static void jit_cache_put(struct cli_bcjit_image *image)
+{
+    if (jit_cache[JIT_CACHE_SLOTS-1])
+	jit_image_release(jit_cache[JIT_CACHE_SLOTS-1]);
+    memmove(&jit_cache[1], &jit_cache[0], (JIT_CACHE_SLOTS-1)*sizeof(jit_cache[0]));
+    jit_cache[0] = image;
+    image->refs++;
+}
+
 int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 {
   if (!bcs->engine)
@@ -2470,7 +2560,32 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
   HANDLER_TRY(handler) {
   // LLVM itself never throws exceptions, but operator new may throw bad_alloc
   try {
-    Module *M = new Module("ClamAV jit module", bcs->engine->Context);
+    unsigned char key[16];
+    struct cli_bcjit_image *image;
+    bool cacheable;
+
+    if (bcs->engine->image) {
+	jit_image_release(bcs->engine->image);
+	bcs->engine->image = 0;
+	bcs->engine->compiledFunctions.clear();
+    }
+    cacheable = jit_image_key(bcs, key);
+    if (cacheable && (image = jit_cache_get(key))) {
+	bcs->engine->image = image;
+	for (unsigned i=0;i<bcs->count;i++) {
+	    if (!image->entrypoints[i])
+		continue;// not JITed
+	    bcs->engine->compiledFunctions[&bcs->all_bcs[i].funcs[0]] = image->entrypoints[i];
+	    bcs->all_bcs[i].state = bc_jit;
+	}
+	cli_dbgmsg("[Bytecode JIT]: reusing native code for %u bytecodes\n", bcs->count);
+	return CL_SUCCESS;
+    }
+    image = bcs->engine->image = new cli_bcjit_image;
+    image->EE = 0;
+    image->Listener = 0;
+    image->refs = 1;
+    Module *M = new Module("ClamAV jit module", image->Context);
     {
 	// Create the JIT.
 	std::string ErrorMsg;
@@ -2500,7 +2615,7 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 	builder.setErrorStr(&ErrorMsg);
 	builder.setEngineKind(EngineKind::JIT);
 	builder.setOptLevel(CodeGenOpt::Default);
-	ExecutionEngine *EE = bcs->engine->EE = builder.create();
+	ExecutionEngine *EE = image->EE = builder.create();
 	if (!EE) {
 	    if (!ErrorMsg.empty())
 		cli_errmsg("[Bytecode JIT]: error creating execution engine: %s\n",
@@ -2509,8 +2624,8 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 		cli_errmsg("[Bytecode JIT]: JIT not registered?\n");
 	    return CL_EBYTECODE;
 	}
-	bcs->engine->Listener  = new NotifyListener();
-	EE->RegisterJITEventListener(bcs->engine->Listener);
+	image->Listener  = new NotifyListener();
+	EE->RegisterJITEventListener(image->Listener);
 //	EE->RegisterJITEventListener(createOProfileJITEventListener());
 	// Due to LLVM PR4816 only X86 supports non-lazy compilation, disable
 	// for now.
@@ -2550,9 +2665,9 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 
 	//TODO: create a wrapper that calls pthread_getspecific
 	unsigned maxh = cli_globals[0].offset + sizeof(struct cli_bc_hooks);
-	constType *HiddenCtx = PointerType::getUnqual(ArrayType::get(Type::getInt8Ty(bcs->engine->Context), maxh));
+	constType *HiddenCtx = PointerType::getUnqual(ArrayType::get(Type::getInt8Ty(image->Context), maxh));
 
-	LLVMTypeMapper apiMap(bcs->engine->Context, cli_apicall_types, cli_apicall_maxtypes, HiddenCtx);
+	LLVMTypeMapper apiMap(image->Context, cli_apicall_types, cli_apicall_maxtypes, HiddenCtx);
 	Function **apiFuncs = new Function *[cli_apicall_maxapi];
 	for (unsigned i=0;i<cli_apicall_maxapi;i++) {
 	    const struct cli_apicall *api = &cli_apicalls[i];
@@ -2618,13 +2733,13 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 	    plus = sizeof(void*);
 	}
 #if LLVM_VERSION < 36
-	EE->addGlobalMapping(Guard, (void*)(&bcs->engine->guard.b[plus]));
+	EE->addGlobalMapping(Guard, (void*)(&image->guard.b[plus]));
 #else
-    sys::DynamicLibrary::AddSymbol(Guard->getName(), (void*)(&bcs->engine->guard.b[plus]));
+    sys::DynamicLibrary::AddSymbol(Guard->getName(), (void*)(&image->guard.b[plus]));
 #endif
-	setGuard(bcs->engine->guard.b);
-	bcs->engine->guard.b[plus+sizeof(void*)-1] = 0x00;
-//	printf("%p\n", *(void**)(&bcs->engine->guard.b[plus]));
+	setGuard(image->guard.b);
+	image->guard.b[plus+sizeof(void*)-1] = 0x00;
+//	printf("%p\n", *(void**)(&image->guard.b[plus]));
 	Function *SFail = Function::Create(FTy, Function::ExternalLinkage,
 					      "__stack_chk_fail", M);
 #if LLVM_VERSION < 36
@@ -2637,7 +2752,7 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 	llvm::Function **Functions = new Function*[bcs->count];
 	for (unsigned i=0;i<bcs->count;i++) {
 	    const struct cli_bc *bc = &bcs->all_bcs[i];
-	    if (bc->state == bc_skip || bc->state == bc_interp) {
+	    if (bc->state == bc_skip || bc->state == bc_interp || bc->state == bc_lazy) {
 		Functions[i] = 0;
 		continue;
 	    }
@@ -2721,14 +2836,20 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 	    codegenTimer.stopTimer();
 	}
 
+	image->entrypoints.assign(bcs->count, (void*)0);
 	for (unsigned i=0;i<bcs->count;i++) {
 	    const struct cli_bc_func *func = &bcs->all_bcs[i].funcs[0];
 	    if (!Functions[i])
 		continue;// not JITed
-	    bcs->engine->compiledFunctions[func] = EE->getPointerToFunction(Functions[i]);
+	    image->entrypoints[i] = EE->getPointerToFunction(Functions[i]);
+	    bcs->engine->compiledFunctions[func] = image->entrypoints[i];
 	    bcs->all_bcs[i].state = bc_jit;
 	}
 	delete [] Functions;
+	if (cacheable) {
+	    memcpy(image->key, key, sizeof(image->key));
+	    jit_cache_put(image);
+	}
     }
     return CL_SUCCESS;
   } catch (std::bad_alloc &badalloc) {
@@ -2822,8 +2943,7 @@ int cli_bytecode_init_jit(struct cli_all_bc *bcs, unsigned dconfmask)
     bcs->engine = new(std::nothrow) cli_bcengine;
     if (!bcs->engine)
 	return CL_EMEM;
-    bcs->engine->EE = 0;
-    bcs->engine->Listener = 0;
+    bcs->engine->image = 0;
     return 0;
 }
 
@@ -2831,14 +2951,11 @@ int cli_bytecode_done_jit(struct cli_all_bc *bcs, int partial)
 {
     LLVMApiScopedLock scopedLock;
     if (bcs->engine) {
-	if (bcs->engine->EE) {
-	    if (bcs->engine->Listener)
-		bcs->engine->EE->UnregisterJITEventListener(bcs->engine->Listener);
-	    delete bcs->engine->EE;
-	    bcs->engine->EE = 0;
+	if (bcs->engine->image) {
+	    jit_image_release(bcs->engine->image);
+	    bcs->engine->image = 0;
 	}
-	delete bcs->engine->Listener;
-	bcs->engine->Listener = 0;
+	bcs->engine->compiledFunctions.clear();
 	if (!partial) {
 	    delete bcs->engine;
 	    bcs->engine = 0;
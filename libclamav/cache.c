@@ -23,15 +23,25 @@
 #include "clamav-config.h"
 #endif
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "mpool.h"
 #include "clamav.h"
 #include "cache.h"
 #include "fmap.h"
+#include "matcher.h"
+#include "default.h"
+#include "str.h"
 
 #ifdef CL_THREAD_SAFE
 static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -53,13 +63,18 @@ static inline unsigned int getkey(uint8_t *hash) { return *hash; }
 /* #define TREES 65536 */
 /* static inline unsigned int getkey(uint8_t *hash) { return hash[0] | (((unsigned int)hash[1])<<8) ; } */
 
-/* The number of nodes in each tree */
+/* The default number of nodes in each tree, see CL_ENGINE_CACHE_SIZE */
 #define NODES 256
 
 
 /* The replacement policy algorithm to use */
 /* #define USE_LRUHASHCACHE */
+/* #define USE_SPLAY */
+#if defined(__GNUC__) || !defined(CL_THREAD_SAFE)
+#define USE_CLOCKCACHE
+#else
 #define USE_SPLAY
+#endif
 
 /* LRUHASHCACHE --------------------------------------------------------------------- */
 #ifdef USE_LRUHASHCACHE
@@ -168,7 +183,7 @@ static inline void lru_addtail(struct cache_set *map, struct cache_key *newkey)
 
 
 static void cacheset_add(struct cache_set *map, unsigned char *md5, size_t size, mpool_t *mempool);
-static int cacheset_init(struct cache_set *map, mpool_t *mempool);
+static int cacheset_init(struct cache_set *map, mpool_t *mempool, unsigned int nodes);
 
 static void cacheset_rehash(struct cache_set *map, mpool_t *mempool)
 {
@@ -177,7 +192,7 @@ static void cacheset_rehash(struct cache_set *map, mpool_t *mempool)
     struct cache_set tmp_set;
     struct cache_key *key;
     pthread_mutex_lock(&pool_mutex);
-    ret = cacheset_init(&tmp_set, mempool);
+    ret = cacheset_init(&tmp_set, mempool, NODES);
     pthread_mutex_unlock(&pool_mutex);
     if (ret)
 	return;
@@ -262,12 +277,12 @@ static int cacheset_lookup(struct cache_set *map, unsigned char *md5, size_t siz
     return 1;
 }
 
-static int cacheset_init(struct cache_set *map, mpool_t *mempool) {
-    map->data = mpool_calloc(mempool, NODES, sizeof(*map->data));
+static int cacheset_init(struct cache_set *map, mpool_t *mempool, unsigned int nodes) {
+    map->data = mpool_calloc(mempool, nodes, sizeof(*map->data));
     if (!map->data)
 	return CL_EMEM;
-    map->maxelements = 80 * NODES / 100;
-    map->maxdeleted = NODES - map->maxelements - 1;
+    map->maxelements = 80 * nodes / 100;
+    map->maxdeleted = nodes - map->maxelements - 1;
     map->elements = 0;
     map->lru_head = map->lru_tail = NULL;
     return 0;
@@ -292,6 +307,7 @@ struct node { /* a node */
     struct node *prev;
     uint32_t size;
     uint32_t minrec;
+    uint8_t leaf;
 };
 
 struct cache_set { /* a tree */
@@ -302,21 +318,21 @@ struct cache_set { /* a tree */
 };
 
 /* Allocates all the nodes and sets up the replacement chain */
-static int cacheset_init(struct cache_set *cs, mpool_t *mempool) {
+static int cacheset_init(struct cache_set *cs, mpool_t *mempool, unsigned int nodes) {
     unsigned int i;
-    cs->data = mpool_calloc(mempool, NODES,  sizeof(*cs->data));
+    cs->data = mpool_calloc(mempool, nodes,  sizeof(*cs->data));
     cs->root = NULL;
 
     if(!cs->data)
 	return 1;
 
-    for(i=1; i<NODES; i++) {
+    for(i=1; i<nodes; i++) {
 	cs->data[i-1].next = &cs->data[i];
 	cs->data[i].prev = &cs->data[i-1];
     }
 
     cs->first = cs->data;
-    cs->last = &cs->data[NODES-1];
+    cs->last = &cs->data[nodes-1];
 
     return 0;
 }
@@ -327,6 +343,15 @@ static inline void cacheset_destroy(struct cache_set *cs, mpool_t *mempool) {
     cs->data = NULL;
 }
 
+/* Calls cb for each node in use */
+static void cacheset_walk(struct cache_set *cs, unsigned int nodes, void (*cb)(void *, const int64_t *, uint32_t, uint32_t, int), void *arg) {
+    unsigned int i;
+
+    for(i=0; i<nodes; i++)
+	if(cs->data[i].size)
+	    cb(arg, cs->data[i].digest, cs->data[i].size, cs->data[i].minrec, cs->data[i].leaf);
+}
+
 /* The left/right cooser for the splay tree */
 static inline int cmp(int64_t *a, ssize_t sa, int64_t *b, ssize_t sb) {
     if(a[1] < b[1]) return -1;
@@ -563,7 +588,7 @@ static inline int cacheset_lookup(struct cache_set *cs, unsigned char *md5, size
 /* If the hash is present nothing happens.
    Otherwise a new node is created for the hash picking one from the begin of the chain.
    Used nodes are moved to the end of the chain */
-static inline void cacheset_add(struct cache_set *cs, unsigned char *md5, size_t size, uint32_t reclevel) {
+static inline void cacheset_add(struct cache_set *cs, unsigned char *md5, size_t size, uint32_t reclevel, int leaf) {
     struct node *newnode;
     int64_t hash[2];
 
@@ -571,6 +596,8 @@ static inline void cacheset_add(struct cache_set *cs, unsigned char *md5, size_t
     if(splay(hash, size, cs)) {
 	if(cs->root->minrec > reclevel)
 	    cs->root->minrec = reclevel;
+	if(!leaf)
+	    cs->root->leaf = 0;
 	return; /* Already there */
     }
 
@@ -645,6 +672,7 @@ static inline void cacheset_add(struct cache_set *cs, unsigned char *md5, size_t
     newnode->up = NULL;
     newnode->size = size;
     newnode->minrec = reclevel;
+    newnode->leaf = !!leaf;
     cs->root = newnode;
 
     ptree("3: %lld\n", hash[1]);
@@ -728,6 +756,185 @@ static inline void cacheset_remove(struct cache_set *cs, unsigned char *md5, siz
 }
 #endif /* USE_SPLAY */
 
+/* CLOCK --------------------------------------------------------------------- */
+#ifdef USE_CLOCKCACHE
+
+/* Each tree is a table of CACHE_WAYS-way buckets with CLOCK replacement.
+   Writers are serialized by the mutex of the tree, lookups take no lock:
+   the sequence counter of the bucket is odd while the bucket is being
+   updated and changes with every update, so a lookup which raced with a
+   writer reports a miss instead of waiting. The reference bits are set by
+   the lookups without any locking, a lost update only affects the choice of
+   the next victim. */
+#define CACHE_WAYS 4
+
+#ifdef CL_THREAD_SAFE
+#define cache_barrier() __sync_synchronize()
+#else
+#define cache_barrier() do { } while(0)
+#endif
+
+struct cache_slot {
+    int64_t digest[2];
+    uint32_t size;
+    uint32_t minrec;
+    uint8_t used;
+    uint8_t leaf;
+    volatile uint8_t ref;
+};
+
+struct cache_bucket {
+    volatile uint32_t seq;
+    uint32_t hand;
+    struct cache_slot slot[CACHE_WAYS];
+};
+
+struct cache_set {
+    struct cache_bucket *data;
+    uint32_t mask;
+};
+
+/* Allocates the buckets, rounded up to a power of two */
+static int cacheset_init(struct cache_set *cs, mpool_t *mempool, unsigned int nodes) {
+    uint32_t buckets = 1;
+
+    while(buckets * CACHE_WAYS < nodes)
+        buckets <<= 1;
+    cs->data = mpool_calloc(mempool, buckets, sizeof(*cs->data));
+    if(!cs->data)
+        return 1;
+    cs->mask = buckets - 1;
+    return 0;
+}
+
+static inline void cacheset_destroy(struct cache_set *cs, mpool_t *mempool) {
+    mpool_free(mempool, cs->data);
+    cs->data = NULL;
+}
+
+/* Calls cb for each slot in use */
+static void cacheset_walk(struct cache_set *cs, unsigned int nodes, void (*cb)(void *, const int64_t *, uint32_t, uint32_t, int), void *arg) {
+    uint32_t i;
+    unsigned int j;
+
+    UNUSEDPARAM(nodes);
+    for(i = 0; i <= cs->mask; i++)
+        for(j = 0; j < CACHE_WAYS; j++)
+            if(cs->data[i].slot[j].used)
+                cb(arg, cs->data[i].slot[j].digest, cs->data[i].slot[j].size, cs->data[i].slot[j].minrec, cs->data[i].slot[j].leaf);
+}
+
+/* The first byte of the digest selects the tree, the next ones the bucket */
+static inline struct cache_bucket *cacheset_bucket(struct cache_set *cs, const unsigned char *md5) {
+    return &cs->data[(md5[1] | ((uint32_t)md5[2] << 8) | ((uint32_t)md5[3] << 16) | ((uint32_t)md5[4] << 24)) & cs->mask];
+}
+
+static inline int cacheset_find(const struct cache_bucket *b, const int64_t *hash, size_t size) {
+    unsigned int i;
+
+    for(i = 0; i < CACHE_WAYS; i++) {
+        const struct cache_slot *s = &b->slot[i];
+        if(s->used && s->size == size && s->digest[0] == hash[0] && s->digest[1] == hash[1])
+            return i;
+    }
+    return -1;
+}
+
+/* Lock free lookup */
+static inline int cacheset_lookup(struct cache_set *cs, unsigned char *md5, size_t size, uint32_t reclevel) {
+    struct cache_bucket *b = cacheset_bucket(cs, md5);
+    int64_t hash[2];
+    uint32_t seq, minrec = 0;
+    int i;
+
+    memcpy(hash, md5, 16);
+    seq = b->seq;
+    if(seq & 1)
+        return 0;
+    cache_barrier();
+    if((i = cacheset_find(b, hash, size)) >= 0)
+        minrec = b->slot[i].minrec;
+    cache_barrier();
+    if(i < 0 || b->seq != seq)
+        return 0;
+    if(!b->slot[i].ref)
+        b->slot[i].ref = 1;
+    return reclevel >= minrec;
+}
+
+/* Caller must hold the tree mutex */
+static inline void cacheset_add(struct cache_set *cs, unsigned char *md5, size_t size, uint32_t reclevel, int leaf) {
+    struct cache_bucket *b = cacheset_bucket(cs, md5);
+    struct cache_slot *s;
+    int64_t hash[2];
+    int i;
+
+    memcpy(hash, md5, 16);
+    if((i = cacheset_find(b, hash, size)) >= 0) {
+        s = &b->slot[i];
+        if(s->minrec > reclevel || (s->leaf && !leaf)) {
+            b->seq++;
+            cache_barrier();
+            if(s->minrec > reclevel)
+                s->minrec = reclevel;
+            if(!leaf)
+                s->leaf = 0;
+            cache_barrier();
+            b->seq++;
+        }
+        return; /* Already there */
+    }
+
+    for(i = 0; i < CACHE_WAYS; i++)
+        if(!b->slot[i].used)
+            break;
+    if(i == CACHE_WAYS) {
+        unsigned int sweep;
+
+        /* the lookups keep setting the bits of a hot bucket, so after two
+           rounds the slot under the hand goes whatever its bit says */
+        for(sweep = 0; sweep < 2 * CACHE_WAYS && b->slot[b->hand].ref; sweep++) {
+            b->slot[b->hand].ref = 0;
+            b->hand = (b->hand + 1) % CACHE_WAYS;
+        }
+        i = b->hand;
+        b->hand = (b->hand + 1) % CACHE_WAYS;
+    }
+
+    s = &b->slot[i];
+    b->seq++;
+    cache_barrier();
+    s->digest[0] = hash[0];
+    s->digest[1] = hash[1];
+    s->size = size;
+    s->minrec = reclevel;
+    s->leaf = !!leaf;
+    s->used = 1;
+    s->ref = 1;
+    cache_barrier();
+    b->seq++;
+}
+
+/* Caller must hold the tree mutex */
+static inline void cacheset_remove(struct cache_set *cs, unsigned char *md5, size_t size) {
+    struct cache_bucket *b = cacheset_bucket(cs, md5);
+    int64_t hash[2];
+    int i;
+
+    memcpy(hash, md5, 16);
+    if((i = cacheset_find(b, hash, size)) < 0) {
+	cli_dbgmsg("cacheset_remove: node not found in tree\n");
+	return; /* No op */
+    }
+    b->seq++;
+    cache_barrier();
+    b->slot[i].used = 0;
+    b->slot[i].ref = 0;
+    cache_barrier();
+    b->seq++;
+}
+#endif /* USE_CLOCKCACHE */
+
 
 /* COMMON STUFF --------------------------------------------------------------------- */
 
@@ -738,10 +945,44 @@ struct CACHE {
 #endif
 };
 
+/* see cli_member_cache_check() */
+#define MEMBER_CACHE_SIZE 4096
+/* below this, extracting is about as cheap as hashing */
+#define MEMBER_CACHE_MIN 1024
+
+struct member_entry {
+    unsigned char key[16];
+    unsigned char md5[16];
+    uint64_t size;
+};
+
+struct member_cache {
+    struct member_entry entry[MEMBER_CACHE_SIZE];
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+#endif
+};
+
+static void cache_save(struct cl_engine *engine);
+static void member_cache_init(struct cl_engine *engine);
+static void member_cache_add(cli_ctx *ctx, const unsigned char *md5, size_t size);
+
+/* The number of nodes in each tree for CL_ENGINE_CACHE_SIZE */
+static unsigned int cache_nodes(const struct cl_engine *engine) {
+    unsigned int nodes;
+
+    nodes = engine->cache_size ? (engine->cache_size + TREES - 1) / TREES : NODES;
+    if(nodes > CLI_MAX_CACHE_SIZE / TREES)
+        nodes = CLI_MAX_CACHE_SIZE / TREES;
+    if(nodes < 2)
+        nodes = 2;
+    return nodes;
+}
+
 /* Allocates the trees for the engine cache */
 int cli_cache_init(struct cl_engine *engine) {
     struct CACHE *cache;
-    unsigned int i, j;
+    unsigned int i, j, nodes;
 
     if(!engine) {
 	cli_errmsg("cli_cache_init: mpool malloc fail\n");
@@ -753,6 +994,9 @@ int cli_cache_init(struct cl_engine *engine) {
         return 0;
     }
 
+    nodes = cache_nodes(engine);
+    cli_dbgmsg("cli_cache_init: %u entries\n", nodes * TREES);
+
     if(!(cache = mpool_malloc(engine->mempool, sizeof(struct CACHE) * TREES))) {
 	cli_errmsg("cli_cache_init: mpool malloc fail\n");
 	return 1;
@@ -766,7 +1010,7 @@ int cli_cache_init(struct cl_engine *engine) {
 	    mpool_free(engine->mempool, cache);
 	    return 1;
 	}
-	if(cacheset_init(&cache[i].cacheset, engine->mempool)) {
+	if(cacheset_init(&cache[i].cacheset, engine->mempool, nodes)) {
 	    for(j=0; j<i; j++) cacheset_destroy(&cache[j].cacheset, engine->mempool);
 	    for(j=0; j<=i; j++) pthread_mutex_destroy(&cache[j].mutex);
 	    mpool_free(engine->mempool, cache);
@@ -774,6 +1018,7 @@ int cli_cache_init(struct cl_engine *engine) {
 	}
     }
     engine->cache = cache;
+    member_cache_init(engine);
     return 0;
 }
 
@@ -789,11 +1034,19 @@ void cli_cache_destroy(struct cl_engine *engine) {
         return;
     }
 
+    if(engine->cache_file && (engine->dboptions & CL_DB_COMPILED))
+	cache_save(engine);
+
     for(i=0; i<TREES; i++) {
 	cacheset_destroy(&cache[i].cacheset, engine->mempool);
 	pthread_mutex_destroy(&cache[i].mutex);
     }
     mpool_free(engine->mempool, cache);
+    if(engine->member_cache) {
+	pthread_mutex_destroy(&engine->member_cache->mutex);
+	mpool_free(engine->mempool, engine->member_cache);
+	engine->member_cache = NULL;
+    }
 }
 
 /* Looks up an hash in the proper tree */
@@ -803,6 +1056,10 @@ static int cache_lookup_hash(unsigned char *md5, size_t len, struct CACHE *cache
     struct CACHE *c;
 
     c = &cache[key];
+#ifdef USE_CLOCKCACHE
+    /* lookups don't modify the tree, no locking needed */
+    ret = (cacheset_lookup(&c->cacheset, md5, len, reclevel)) ? CL_CLEAN : CL_VIRUS;
+#else
     if(pthread_mutex_lock(&c->mutex)) {
 	cli_errmsg("cache_lookup_hash: cache_lookup_hash: mutex lock fail\n");
 	return ret;
@@ -812,17 +1069,20 @@ static int cache_lookup_hash(unsigned char *md5, size_t len, struct CACHE *cache
 
     ret = (cacheset_lookup(&c->cacheset, md5, len, reclevel)) ? CL_CLEAN : CL_VIRUS;
     pthread_mutex_unlock(&c->mutex);
+#endif
     /* if(ret == CL_CLEAN) cli_warnmsg("cached\n"); */
     return ret;
 }
 
-/* Adds an hash to the cache */
-void cache_add(unsigned char *md5, size_t size, cli_ctx *ctx) {
+/* Adds an hash to the cache; leaf is set when no other object was extracted
+   or normalized while scanning this one, see cli_cache_migrate() */
+void cache_add(unsigned char *md5, size_t size, cli_ctx *ctx, int leaf) {
     unsigned int key = getkey(md5);
     uint32_t level;
     struct CACHE *c;
 
-    if(!ctx || !ctx->engine || !ctx->engine->cache)
+    /* the results of the base engine alone aren't those of the overlay */
+    if(!ctx || !ctx->engine || !ctx->engine->cache || ctx->overlay)
        return;
 
     if (ctx->engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE) {
@@ -848,14 +1108,15 @@ void cache_add(unsigned char *md5, size_t size, cli_ctx *ctx) {
 #ifdef USE_LRUHASHCACHE
     cacheset_add(&c->cacheset, md5, size, ctx->engine->mempool);
 #else
-#ifdef USE_SPLAY
-    cacheset_add(&c->cacheset, md5, size, level);
+#if defined(USE_SPLAY) || defined(USE_CLOCKCACHE)
+    cacheset_add(&c->cacheset, md5, size, level, leaf);
 #else
-#error #define USE_SPLAY or USE_LRUHASHCACHE
+#error #define USE_SPLAY, USE_CLOCKCACHE or USE_LRUHASHCACHE
 #endif
 #endif
 
     pthread_mutex_unlock(&c->mutex);
+    member_cache_add(ctx, md5, size);
     cli_dbgmsg("cache_add: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x (level %u)\n", md5[0], md5[1], md5[2], md5[3], md5[4], md5[5], md5[6], md5[7], md5[8], md5[9], md5[10], md5[11], md5[12], md5[13], md5[14], md5[15], level);
     return;
 }
@@ -884,10 +1145,10 @@ void cache_remove(unsigned char *md5, size_t size, const struct cl_engine *engin
 #ifdef USE_LRUHASHCACHE
     cacheset_remove(&c->cacheset, md5, size, engine->mempool);
 #else
-#ifdef USE_SPLAY
+#if defined(USE_SPLAY) || defined(USE_CLOCKCACHE)
     cacheset_remove(&c->cacheset, md5, size);
 #else
-#error #define USE_SPLAY or USE_LRUHASHCACHE
+#error #define USE_SPLAY, USE_CLOCKCACHE or USE_LRUHASHCACHE
 #endif
 #endif
 
@@ -896,39 +1157,597 @@ void cache_remove(unsigned char *md5, size_t size, const struct cl_engine *engin
     return;
 }
 
+/* PERSISTENCE ----------------------------------------------------------------- */
+
+/* The cache file (CL_ENGINE_CACHE_FILE) is a header followed by the entries
+   of all the trees. It is only reused by an engine with the same signature
+   set and settings, see cli_cache_dbfile() and cache_fingerprint(): files
+   are cached along with the result of their whole recursive scan, so any
+   change in the signatures may affect any of them. */
+#define CACHE_FILE_MAGIC "ClamCach"
+#define CACHE_FILE_VERSION 2
+
+struct cache_file_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrysize;
+    uint32_t entries;
+    uint32_t flevel;
+    unsigned char fingerprint[16];
+};
+
+struct cache_file_entry {
+    int64_t digest[2];
+    uint32_t size;
+    uint32_t minrec;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+#define CACHE_ENTRY_LEAF 1
+
+/* Whole-file MD5 signatures can be checked against the cached digests
+   directly, so they are left out of the second fingerprint used by
+   cli_cache_migrate() */
+static int cache_md5db(const char *dbname) {
+    return cli_strbcasestr(dbname, ".hdb") || cli_strbcasestr(dbname, ".hdu");
+}
+
+static void cache_dbhash(void **hashctx, const void *data, size_t len) {
+    if(!*hashctx && !(*hashctx = cl_hash_init("md5")))
+	return;
+    cl_update_hash(*hashctx, (void *)data, len);
+}
+
+/* Adds a database file loaded from disk to the signature set fingerprints */
+void cli_cache_dbfile(struct cl_engine *engine, const char *filename, int fd) {
+    STATBUF sb;
+    uint64_t n[2];
+
+    if(FSTAT(fd, &sb))
+	memset(&sb, 0, sizeof(sb));
+    n[0] = sb.st_size;
+    n[1] = sb.st_mtime;
+    cache_dbhash(&engine->cache_dbctx, filename, strlen(filename) + 1);
+    cache_dbhash(&engine->cache_dbctx, n, sizeof(n));
+    /* the files in containers are added by cli_cache_dbentry() */
+    if(cache_md5db(filename) || cli_strbcasestr(filename, ".cvd") || cli_strbcasestr(filename, ".cld"))
+	return;
+    cache_dbhash(&engine->cache_sigctx, filename, strlen(filename) + 1);
+    cache_dbhash(&engine->cache_sigctx, n, sizeof(n));
+}
+
+/* Adds a verified database file from a CVD to the second fingerprint */
+void cli_cache_dbentry(struct cl_engine *engine, const char *dbname, const unsigned char *sha256) {
+    if(cache_md5db(dbname))
+	return;
+    cache_dbhash(&engine->cache_sigctx, dbname, strlen(dbname) + 1);
+    cache_dbhash(&engine->cache_sigctx, sha256, 32);
+}
+
+/* Combines the database files with the settings that affect the results */
+static int cache_fingerprint(struct cl_engine *engine) {
+    uint64_t settings[8], version[2];
+
+    settings[0] = engine->dboptions & ~CL_DB_COMPILED;
+    settings[1] = engine->engine_options;
+    settings[2] = engine->maxscansize;
+    settings[3] = engine->maxfilesize;
+    settings[4] = engine->maxreclevel;
+    settings[5] = engine->maxfiles;
+    settings[6] = engine->ac_mindepth | ((uint64_t)engine->ac_maxdepth << 32);
+    settings[7] = cl_retflevel();
+    version[0] = engine->dbversion[0];
+    version[1] = engine->dbversion[1];
+    cache_dbhash(&engine->cache_dbctx, version, sizeof(version));
+    cache_dbhash(&engine->cache_dbctx, settings, sizeof(settings));
+    cache_dbhash(&engine->cache_sigctx, settings, sizeof(settings));
+    if(engine->pua_cats) {
+	cache_dbhash(&engine->cache_dbctx, engine->pua_cats, strlen(engine->pua_cats));
+	cache_dbhash(&engine->cache_sigctx, engine->pua_cats, strlen(engine->pua_cats));
+    }
+    if(!engine->cache_dbctx || !engine->cache_sigctx)
+	return 1;
+    cl_finish_hash(engine->cache_dbctx, engine->cache_dbdigest);
+    cl_finish_hash(engine->cache_sigctx, engine->cache_sigdigest);
+    engine->cache_dbctx = engine->cache_sigctx = NULL;
+    return 0;
+}
+
+static void cache_save_entry(void *arg, const int64_t *digest, uint32_t size, uint32_t minrec, int leaf) {
+    FILE **f = (FILE **)arg;
+    struct cache_file_entry entry;
+
+    if(!*f)
+	return;
+    memset(&entry, 0, sizeof(entry));
+    entry.digest[0] = digest[0];
+    entry.digest[1] = digest[1];
+    entry.size = size;
+    entry.minrec = minrec;
+    entry.flags = leaf ? CACHE_ENTRY_LEAF : 0;
+    if(fwrite(&entry, sizeof(entry), 1, *f) != 1) {
+	fclose(*f);
+	*f = NULL;
+    }
+}
+
+/* Writes the cache to a temporary file which then replaces the cache file */
+static void cache_save(struct cl_engine *engine) {
+    struct CACHE *cache = engine->cache;
+    struct cache_file_hdr hdr;
+    unsigned int i, nodes = cache_nodes(engine);
+    char *tmpname;
+    FILE *f;
+    int fd;
+    long size;
+
+    if(!(tmpname = cli_malloc(strlen(engine->cache_file) + 32)))
+	return;
+    /* the directory may be writable by others: never follow or reuse
+       what is already there */
+    sprintf(tmpname, "%s.%u.%08x", engine->cache_file, (unsigned int)getpid(), cli_rndnum(0xffffffff));
+    if((fd = open(tmpname, O_WRONLY|O_CREAT|O_EXCL|O_BINARY, S_IRUSR|S_IWUSR)) < 0 || !(f = fdopen(fd, "wb"))) {
+	cli_warnmsg("cache_save: Can't create %s\n", tmpname);
+	if(fd >= 0)
+	    close(fd);
+	free(tmpname);
+	return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+	fclose(f);
+	f = NULL;
+    }
+    for(i=0; f && i<TREES; i++) {
+	if(pthread_mutex_lock(&cache[i].mutex))
+	    continue;
+	cacheset_walk(&cache[i].cacheset, nodes, cache_save_entry, &f);
+	pthread_mutex_unlock(&cache[i].mutex);
+    }
+
+    if(f && (size = ftell(f)) >= (long)sizeof(hdr)) {
+	memcpy(hdr.magic, CACHE_FILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_FILE_VERSION;
+	hdr.entrysize = sizeof(struct cache_file_entry);
+	hdr.entries = (size - sizeof(hdr)) / sizeof(struct cache_file_entry);
+	hdr.flevel = cl_retflevel();
+	memcpy(hdr.fingerprint, engine->cache_dbdigest, sizeof(hdr.fingerprint));
+	if(fseek(f, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+	    fclose(f);
+	    f = NULL;
+	}
+    }
+    if(!f || fclose(f) || rename(tmpname, engine->cache_file)) {
+	cli_warnmsg("cache_save: Can't write %s\n", engine->cache_file);
+	unlink(tmpname);
+    } else {
+	cli_dbgmsg("cache_save: %u entries written to %s\n", hdr.entries, engine->cache_file);
+    }
+    free(tmpname);
+}
+
+/* Called by cl_engine_compile() once all the databases are loaded */
+int cli_cache_load(struct cl_engine *engine) {
+    struct CACHE *cache = engine->cache;
+    struct cache_file_hdr hdr;
+    struct cache_file_entry entry;
+    unsigned char md5[16];
+    uint32_t i;
+    FILE *f;
+
+    if(cache_fingerprint(engine))
+	return CL_EMEM;
+    if(!cache || !engine->cache_file || (engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE))
+	return CL_SUCCESS;
+
+    if(!(f = fopen(engine->cache_file, "rb"))) {
+	cli_dbgmsg("cli_cache_load: Can't open %s\n", engine->cache_file);
+	return CL_SUCCESS;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, CACHE_FILE_MAGIC, sizeof(hdr.magic))
+       || hdr.version != CACHE_FILE_VERSION || hdr.entrysize != sizeof(struct cache_file_entry)) {
+	cli_warnmsg("cli_cache_load: %s is not a valid cache file\n", engine->cache_file);
+	fclose(f);
+	return CL_SUCCESS;
+    }
+    if(hdr.flevel != cl_retflevel() || memcmp(hdr.fingerprint, engine->cache_dbdigest, sizeof(hdr.fingerprint))) {
+	cli_dbgmsg("cli_cache_load: %s belongs to a different signature set, ignoring it\n", engine->cache_file);
+	fclose(f);
+	return CL_SUCCESS;
+    }
+
+    for(i=0; i<hdr.entries && fread(&entry, sizeof(entry), 1, f) == 1; i++) {
+	memcpy(md5, entry.digest, sizeof(md5));
+#if defined(USE_SPLAY) || defined(USE_CLOCKCACHE)
+	cacheset_add(&cache[getkey(md5)].cacheset, md5, entry.size, entry.minrec, entry.flags & CACHE_ENTRY_LEAF);
+#endif
+    }
+    fclose(f);
+    cli_dbgmsg("cli_cache_load: %u entries loaded from %s\n", i, engine->cache_file);
+    return CL_SUCCESS;
+}
+
+int cl_engine_get_digest(const struct cl_engine *engine, unsigned char *digest) {
+    if(!engine || !digest) {
+	cli_errmsg("cl_engine_get_digest: NULL argument\n");
+	return CL_ENULLARG;
+    }
+    if(!(engine->dboptions & CL_DB_COMPILED)) {
+	cli_errmsg("cl_engine_get_digest: Engine not compiled\n");
+	return CL_EARG;
+    }
+    memcpy(digest, engine->cache_dbdigest, 16);
+    return CL_SUCCESS;
+}
+
+/* HASH LOOKUP ----------------------------------------------------------------- */
+
+/* Checks whether a whitelisting signature could apply to a file we only know
+   the given digests of: 1 if one matches, -1 if one might */
+static int hashcheck_fp(const struct cli_matcher *fp, const unsigned char **digest, uint32_t size) {
+    enum CLI_HASH_TYPE t;
+
+    if(!fp)
+	return 0;
+    for(t = CLI_HASH_MD5; t < CLI_HASH_AVAIL_TYPES; t++) {
+	if(!digest[t])
+	    continue;
+	if(cli_hm_scan(digest[t], size, NULL, fp, t) == CL_VIRUS || cli_hm_scan_wild(digest[t], NULL, fp, t) == CL_VIRUS)
+	    return 1;
+    }
+    if(digest[CLI_HASH_SHA1] && cli_hm_scan(digest[CLI_HASH_SHA1], 1, NULL, fp, CLI_HASH_SHA1) == CL_VIRUS)
+	return 1;
+    for(t = CLI_HASH_MD5; t < CLI_HASH_AVAIL_TYPES; t++)
+	if(!digest[t] && (cli_hm_have_size(fp, t, size) || cli_hm_have_wild(fp, t)))
+	    return -1;
+    /* authenticode whitelisting needs the content */
+    if(cli_hm_have_size(fp, CLI_HASH_SHA1, 1))
+	return -1;
+    return 0;
+}
+
+int cl_hashcheck(const struct cl_engine *engine, size_t size, const unsigned char *md5, const unsigned char *sha1, const unsigned char *sha256, const char **virname, enum cl_hashcheck *verdict) {
+    const unsigned char *digest[CLI_HASH_AVAIL_TYPES];
+    const char *vname = NULL;
+    unsigned char hash[16];
+    enum CLI_HASH_TYPE t;
+
+    if(!engine || !verdict) {
+	cli_errmsg("cl_hashcheck: NULL argument\n");
+	return CL_ENULLARG;
+    }
+    if(!(engine->dboptions & CL_DB_COMPILED)) {
+	cli_errmsg("cl_hashcheck: Engine not compiled\n");
+	return CL_EARG;
+    }
+    *verdict = CL_HASH_UNKNOWN;
+    if(virname)
+	*virname = NULL;
+    if(!size || size >= 0xffffffff)
+	return CL_SUCCESS;
+
+    digest[CLI_HASH_MD5] = md5;
+    digest[CLI_HASH_SHA1] = sha1;
+    digest[CLI_HASH_SHA256] = sha256;
+    for(t = CLI_HASH_MD5; t < CLI_HASH_AVAIL_TYPES && !vname; t++) {
+	if(!digest[t])
+	    continue;
+	if(cli_hm_scan(digest[t], size, &vname, engine->hm_hdb, t) != CL_VIRUS)
+	    cli_hm_scan_wild(digest[t], &vname, engine->hm_hdb, t);
+    }
+    if(vname) {
+	if(!hashcheck_fp(engine->hm_fp, digest, size)) {
+	    if(virname)
+		*virname = vname;
+	    *verdict = CL_HASH_VIRUS;
+	}
+	return CL_SUCCESS;
+    }
+
+    if(md5 && engine->cache && !(engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE)) {
+	memcpy(hash, md5, sizeof(hash));
+	if(cache_lookup_hash(hash, size, engine->cache, 0) == CL_CLEAN)
+	    *verdict = CL_HASH_CLEAN;
+    }
+    return CL_SUCCESS;
+}
+
+/* MIGRATION ------------------------------------------------------------------- */
+
+/* cl_engine_settings_copy() takes a snapshot of the cache, which the engine
+   the settings are applied to keeps if only whole-file MD5 signatures changed.
+   Only the leaf entries can be carried over: the result of a container also
+   covers the objects found in it, whose digests aren't in the cache. Of
+   those, the digests which are now detected are dropped */
+struct cache_migration {
+    unsigned char sigdigest[16];
+    uint32_t entries, max;
+    struct cache_file_entry entry[1];
+};
+
+static void cache_export_entry(void *arg, const int64_t *digest, uint32_t size, uint32_t minrec, int leaf) {
+    struct cache_migration **m = (struct cache_migration **)arg, *n;
+    struct cache_file_entry *entry;
+
+    if(!*m)
+	return;
+    if((*m)->entries == (*m)->max) {
+	if(!(n = cli_realloc(*m, sizeof(*n) + sizeof(n->entry[0]) * (*m)->max * 2))) {
+	    free(*m);
+	    *m = NULL;
+	    return;
+	}
+	n->max *= 2;
+	*m = n;
+    }
+    entry = &(*m)->entry[(*m)->entries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->digest[0] = digest[0];
+    entry->digest[1] = digest[1];
+    entry->size = size;
+    entry->minrec = minrec;
+    entry->flags = leaf ? CACHE_ENTRY_LEAF : 0;
+}
+
+void *cli_cache_export(const struct cl_engine *engine, size_t *size) {
+    struct CACHE *cache = engine->cache;
+    struct cache_migration *m;
+    unsigned int i, nodes;
+
+    *size = 0;
+    if(!cache || !(engine->dboptions & CL_DB_COMPILED) || (engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE))
+	return NULL;
+
+    nodes = cache_nodes(engine);
+    if(!(m = cli_malloc(sizeof(*m) + sizeof(m->entry[0]) * nodes)))
+	return NULL;
+    memcpy(m->sigdigest, engine->cache_sigdigest, sizeof(m->sigdigest));
+    m->entries = 0;
+    m->max = nodes + 1;
+    for(i=0; m && i<TREES; i++) {
+	if(pthread_mutex_lock(&cache[i].mutex))
+	    continue;
+	cacheset_walk(&cache[i].cacheset, nodes, cache_export_entry, &m);
+	pthread_mutex_unlock(&cache[i].mutex);
+    }
+    if(m)
+	*size = sizeof(*m) + sizeof(m->entry[0]) * m->entries;
+    return m;
+}
+
+/* Called by cl_engine_compile() once all the databases are loaded */
+void cli_cache_migrate(struct cl_engine *engine) {
+    struct cache_migration *m = engine->cache_migrate;
+    struct CACHE *cache = engine->cache;
+    unsigned char md5[16];
+    uint32_t i, kept = 0;
+
+    if(!m)
+	return;
+    engine->cache_migrate = NULL;
+
+    if(!cache || (engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE)) {
+	free(m);
+	return;
+    }
+    if(memcmp(m->sigdigest, engine->cache_sigdigest, sizeof(m->sigdigest))) {
+	cli_dbgmsg("cli_cache_migrate: Signatures other than MD5 hashes changed, not migrating the cache\n");
+	free(m);
+	return;
+    }
+
+    for(i=0; i<m->entries; i++) {
+	if(!(m->entry[i].flags & CACHE_ENTRY_LEAF))
+	    continue;
+	memcpy(md5, m->entry[i].digest, sizeof(md5));
+	if(cli_hm_scan(md5, m->entry[i].size, NULL, engine->hm_hdb, CLI_HASH_MD5) == CL_VIRUS ||
+	   cli_hm_scan_wild(md5, NULL, engine->hm_hdb, CLI_HASH_MD5) == CL_VIRUS)
+	    continue;
+#if defined(USE_SPLAY) || defined(USE_CLOCKCACHE)
+	cacheset_add(&cache[getkey(md5)].cacheset, md5, m->entry[i].size, m->entry[i].minrec, 1);
+	kept++;
+#endif
+    }
+    cli_dbgmsg("cli_cache_migrate: %u of %u entries kept\n", kept, m->entries);
+    free(m);
+}
+
+/* Drops all the entries, called by cl_engine_apply_cdiff() once new
+   signatures are live */
+void cli_cache_clear(struct cl_engine *engine) {
+    struct CACHE *cache = engine->cache;
+    struct cache_migration *m;
+    unsigned char md5[16];
+    unsigned int i, nodes;
+    uint32_t j, dropped = 0;
+
+    if(!cache || (engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE))
+	return;
+
+    nodes = cache_nodes(engine);
+    if(!(m = cli_malloc(sizeof(*m) + sizeof(m->entry[0]) * nodes)))
+	return;
+    for(i=0; m && i<TREES; i++) {
+	if(pthread_mutex_lock(&cache[i].mutex))
+	    continue;
+	m->entries = 0;
+	m->max = nodes + 1;
+	cacheset_walk(&cache[i].cacheset, nodes, cache_export_entry, &m);
+	for(j=0; m && j<m->entries; j++) {
+	    memcpy(md5, m->entry[j].digest, sizeof(md5));
+#if defined(USE_SPLAY) || defined(USE_CLOCKCACHE)
+	    cacheset_remove(&cache[i].cacheset, md5, m->entry[j].size);
+	    dropped++;
+#endif
+	}
+	pthread_mutex_unlock(&cache[i].mutex);
+    }
+    cli_dbgmsg("cli_cache_clear: %u entries dropped\n", dropped);
+    free(m);
+    if(engine->member_cache && !pthread_mutex_lock(&engine->member_cache->mutex)) {
+	memset(engine->member_cache->entry, 0, sizeof(engine->member_cache->entry));
+	pthread_mutex_unlock(&engine->member_cache->mutex);
+    }
+}
+
+/* MEMBER CACHE ---------------------------------------------------------------- */
+
+/* Archive members are also known by a digest of their compressed data and
+ * of what the container says about them (method, sizes, CRC). The member
+ * cache maps that digest to the MD5 and size of the extracted data, which
+ * are then looked up in the cache above: the attachment sent over and over
+ * is neither extracted nor scanned again, while new signatures or
+ * cache_remove() apply to it like to any other file. */
+static inline struct member_entry *member_cache_entry(struct member_cache *mc, const unsigned char *key) {
+    return &mc->entry[(key[0] | (key[1] << 8)) & (MEMBER_CACHE_SIZE - 1)];
+}
+
+static void member_cache_init(struct cl_engine *engine) {
+    struct member_cache *mc;
+
+    if(!(mc = mpool_calloc(engine->mempool, 1, sizeof(*mc)))) {
+	cli_dbgmsg("member_cache_init: no memory for the member cache\n");
+	return;
+    }
+    if(pthread_mutex_init(&mc->mutex, NULL)) {
+	mpool_free(engine->mempool, mc);
+	return;
+    }
+    engine->member_cache = mc;
+}
+
+/* Remembers md5 for the member being extracted, if that's the object at hand */
+static void member_cache_add(cli_ctx *ctx, const unsigned char *md5, size_t size) {
+    struct member_cache *mc = ctx->engine->member_cache;
+    struct cli_member_key *key = ctx->member_key;
+    struct member_entry *e;
+
+    if(!mc || !key || key->recursion != ctx->recursion)
+	return;
+    e = member_cache_entry(mc, key->digest);
+    if(pthread_mutex_lock(&mc->mutex))
+	return;
+    memcpy(e->key, key->digest, sizeof(e->key));
+    memcpy(e->md5, md5, sizeof(e->md5));
+    e->size = size;
+    pthread_mutex_unlock(&mc->mutex);
+}
+
+/* Starts the digest of a member of csize compressed bytes with the
+ * parameters of the container in params; the compressed data is then added
+ * with cl_update_hash(). Returns NULL when the member cache can't be used:
+ * the objects scanned with properties or callbacks have to be seen */
+void *cli_member_cache_start(cli_ctx *ctx, uint64_t csize, const void *params, size_t len) {
+    const struct cl_engine *engine = ctx->engine;
+    void *h;
+
+    if(!engine->member_cache || (engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE) || ctx->overlay ||
+       csize < MEMBER_CACHE_MIN || SCAN_PROPERTIES ||
+       engine->cb_pre_cache || engine->cb_pre_scan || engine->cb_post_scan ||
+       (engine->maxreclevel && ctx->recursion >= engine->maxreclevel))
+	return NULL;
+    if(!(h = cl_hash_init("md5")))
+	return NULL;
+    cl_update_hash(h, (void *)params, len);
+    return h;
+}
+
+/* Completes the digest started by cli_member_cache_start() into key.
+ * Returns CL_CLEAN if the member was found clean before, which then counts
+ * against the limits as if it had been scanned, and CL_VIRUS if it has to
+ * be extracted; key is to be set as ctx->member_key while it is scanned */
+int cli_member_cache_check(void *h, cli_ctx *ctx, struct cli_member_key *key) {
+    struct member_cache *mc = ctx->engine->member_cache;
+    struct member_entry *e;
+    unsigned char md5[16];
+    uint64_t size = 0;
+    int found;
+
+    if(cl_finish_hash(h, key->digest))
+	return CL_VIRUS;
+    key->recursion = ctx->recursion;
+    e = member_cache_entry(mc, key->digest);
+    if(pthread_mutex_lock(&mc->mutex))
+	return CL_VIRUS;
+    if((found = !memcmp(e->key, key->digest, sizeof(e->key)))) {
+	memcpy(md5, e->md5, sizeof(md5));
+	size = e->size;
+    }
+    pthread_mutex_unlock(&mc->mutex);
+
+    if(!found || cache_lookup_hash(md5, size, ctx->engine->cache, ctx->recursion) != CL_CLEAN ||
+       cli_updatelimits(ctx, size) != CL_CLEAN)
+	return CL_VIRUS;
+    cli_dbgmsg("cli_member_cache_check: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x (%llu bytes) is known clean\n", md5[0], md5[1], md5[2], md5[3], md5[4], md5[5], md5[6], md5[7], md5[8], md5[9], md5[10], md5[11], md5[12], md5[13], md5[14], md5[15], (long long unsigned)size);
+    return CL_CLEAN;
+}
+
+/* The SHA1 and SHA256 digests wanted by the hash signatures are computed in
+ * the same pass and kept in the map for cli_fmap_scandesc() and
+ * cli_checkfp() */
 int cache_get_MD5(unsigned char *hash, cli_ctx *ctx)
 {
     fmap_t *map;
     size_t todo, at = 0;
-    void *hashctx;
+    void *hashctx[CLI_HASH_AVAIL_TYPES] = { NULL };
+    static const char *alg[CLI_HASH_AVAIL_TYPES] = { "md5", "sha1", "sha256" };
+    static const size_t hashlen[CLI_HASH_AVAIL_TYPES] = { CLI_HASHLEN_MD5, CLI_HASHLEN_SHA1, CLI_HASHLEN_SHA256 };
+    unsigned char digest[CLI_HASHLEN_MAX];
+    const struct cli_matcher *hdb, *fp;
+    enum CLI_HASH_TYPE type;
 
     map = *ctx->fmap;
     todo = map->len;
 
-    hashctx = cl_hash_init("md5");
-    if (!(hashctx))
-        return CL_VIRUS;
+    if(fmap_get_hash(map, CLI_HASH_MD5, hash, CLI_HASHLEN_MD5))
+        return CL_CLEAN;
+
+    hdb = ctx->engine->hm_hdb;
+    fp = ctx->engine->hm_fp;
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+        if(type != CLI_HASH_MD5 && !cli_hm_have_size(hdb, type, map->len) && !cli_hm_have_wild(hdb, type)
+           && !cli_hm_have_size(fp, type, map->len) && !cli_hm_have_wild(fp, type))
+            continue;
+        if(!(hashctx[type] = cl_hash_init(alg[type]))) {
+            while(type--)
+                cl_hash_destroy(hashctx[type]);
+            return CL_VIRUS;
+        }
+    }
 
     while(todo) {
         const void *buf;
         size_t readme = todo < FILEBUFF ? todo : FILEBUFF;
 
         if(!(buf = fmap_need_off_once(map, at, readme))) {
-            cl_hash_destroy(hashctx);
+            for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+                cl_hash_destroy(hashctx[type]);
             return CL_EREAD;
         }
 
         todo -= readme;
         at += readme;
 
-        if (cl_update_hash(hashctx, (void *)buf, readme)) {
-            cl_hash_destroy(hashctx);
-            cli_errmsg("cache_check: error reading while generating hash!\n");
-            return CL_EREAD;
+        for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+            if(hashctx[type] && cl_update_hash(hashctx[type], (void *)buf, readme)) {
+                for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+                    cl_hash_destroy(hashctx[type]);
+                cli_errmsg("cache_check: error reading while generating hash!\n");
+                return CL_EREAD;
+            }
         }
     }
 
-    cl_finish_hash(hashctx, hash);
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+        if(!hashctx[type])
+            continue;
+        cl_finish_hash(hashctx[type], digest);
+        fmap_set_hash(map, type, digest, hashlen[type]);
+        if(type == CLI_HASH_MD5)
+            memcpy(hash, digest, CLI_HASHLEN_MD5);
+    }
 
     return CL_CLEAN;
 }
@@ -940,7 +1759,7 @@ int cache_check(unsigned char *hash, cli_ctx *ctx) {
     fmap_t *map;
     int ret;
 
-    if(!ctx || !ctx->engine || !ctx->engine->cache)
+    if(!ctx || !ctx->engine || !ctx->engine->cache || ctx->overlay)
        return CL_VIRUS;
 
     if (ctx->engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE) {
@@ -954,6 +1773,8 @@ int cache_check(unsigned char *hash, cli_ctx *ctx) {
         
     map = *ctx->fmap;
     ret = cache_lookup_hash(hash, map->len, ctx->engine->cache, ctx->recursion);
+    if(ret == CL_CLEAN)
+	member_cache_add(ctx, hash, map->len);
     cli_dbgmsg("cache_check: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x is %s\n", hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7], hash[8], hash[9], hash[10], hash[11], hash[12], hash[13], hash[14], hash[15], (ret == CL_VIRUS) ? "negative" : "positive");
     return ret;
 }
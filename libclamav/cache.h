@@ -25,10 +25,18 @@
 #include "clamav.h"
 #include "others.h"
 
-void cache_add(unsigned char *md5, size_t size, cli_ctx *ctx);
+void cache_add(unsigned char *md5, size_t size, cli_ctx *ctx, int leaf);
 /* Removes a hash from the cache */
 void cache_remove(unsigned char *md5, size_t size, const struct cl_engine *engine);
 int cache_check(unsigned char *hash, cli_ctx *ctx);
 int cli_cache_init(struct cl_engine *engine);
 void cli_cache_destroy(struct cl_engine *engine);
+int cli_cache_load(struct cl_engine *engine);
+void cli_cache_dbfile(struct cl_engine *engine, const char *filename, int fd);
+void cli_cache_dbentry(struct cl_engine *engine, const char *dbname, const unsigned char *sha256);
+void *cli_cache_export(const struct cl_engine *engine, size_t *size);
+void cli_cache_migrate(struct cl_engine *engine);
+void cli_cache_clear(struct cl_engine *engine);
+void *cli_member_cache_start(cli_ctx *ctx, uint64_t csize, const void *params, size_t len);
+int cli_member_cache_check(void *h, cli_ctx *ctx, struct cli_member_key *key);
 #endif
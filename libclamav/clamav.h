@@ -137,6 +137,7 @@ typedef enum {
 #define CL_DB_PCRE_STATS    0x80000
 #define CL_DB_YARA_EXCLUDE  0x100000
 #define CL_DB_YARA_ONLY     0x200000
+#define CL_DB_VERIFY_ONLY   0x400000 /* parse and check, don't build the matchers */
 
 /* recommended db settings */
 #define CL_DB_STDOPT	    (CL_DB_PHISHING | CL_DB_PHISHING_URLS | CL_DB_BYTECODE)
@@ -246,7 +247,33 @@ enum cl_engine_field {
     CL_ENGINE_PCRE_RECMATCH_LIMIT,  /* uint64_t */
     CL_ENGINE_PCRE_MAX_FILESIZE,    /* uint64_t */
     CL_ENGINE_DISABLE_PE_CERTS,     /* uint32_t */
-    CL_ENGINE_PE_DUMPCERTS          /* uint32_t */
+    CL_ENGINE_PE_DUMPCERTS,         /* uint32_t */
+    CL_ENGINE_PARALLEL_SCAN,        /* uint32_t */
+    CL_ENGINE_CACHE_SIZE,           /* uint32_t */
+    CL_ENGINE_CACHE_FILE,           /* (char *) */
+    CL_ENGINE_HUGEPAGES,            /* uint32_t */
+    CL_ENGINE_HASH_IMAGE,           /* (char *) */
+    CL_ENGINE_LOAD_THREADS,         /* uint32_t */
+    CL_ENGINE_LAZY_MATCHERS,        /* uint32_t */
+    CL_ENGINE_EXTRACT_MEM,          /* uint64_t */
+    CL_ENGINE_ARCHIVE_THREADS,      /* uint32_t */
+    CL_ENGINE_CPU_LIMIT,            /* uint32_t */
+    CL_ENGINE_MAX_INFLATED,         /* uint64_t */
+    CL_ENGINE_DECOMPRESS_THREADS,   /* uint32_t */
+    CL_ENGINE_SIGPROF_RATE,         /* uint32_t */
+    CL_ENGINE_FUSED_SCAN,           /* uint32_t */
+    CL_ENGINE_MERGED_TARGETS,       /* uint32_t */
+    CL_ENGINE_ARCHIVE_ORDER,        /* uint32_t */
+    CL_ENGINE_SHARD_INDEX,          /* uint32_t */
+    CL_ENGINE_SHARD_COUNT,          /* uint32_t */
+    CL_ENGINE_AC_PROFILE,           /* (char *) */
+    CL_ENGINE_MAX_DECOMPRESS_MEM    /* uint64_t */
+};
+
+enum cl_hugepages {
+    CL_HUGEPAGES_NONE=0, /* default */
+    CL_HUGEPAGES_TRANSPARENT, /* ask the kernel for transparent huge pages */
+    CL_HUGEPAGES_EXPLICIT /* use reserved huge pages, fallback to transparent */
 };
 
 enum bytecode_security {
@@ -294,6 +321,110 @@ extern int cl_engine_addref(struct cl_engine *engine);
 
 extern int cl_engine_free(struct cl_engine *engine);
 
+/* Creates an overlay of a compiled engine: an engine of its own, with the
+ * settings of the base, for a few extra signatures (e.g. those of a single
+ * customer) loaded with cl_load() and compiled with cl_engine_compile().
+ * Scanning with the overlay matches the files against the signatures of
+ * both engines, while the settings and the other databases are those of
+ * the base. The overlay holds a reference to the base until it is freed
+ * with cl_engine_free(). The scan cache of the base isn't used for such
+ * scans. */
+extern struct cl_engine *cl_engine_overlay_new(struct cl_engine *base);
+
+/* Memory footprint of the signatures of a compiled engine, one entry per
+ * matcher root, hash database type, bytecode and YARA. The
+ * sizes are computed from the engine structures (allocator overhead and
+ * the shared hash image are not included). Fills at most *count entries
+ * of stats and sets *count to the number of entries available. */
+enum cl_memstat_type {
+    CL_MEMSTAT_AC_NODES = 0,	/* AC trie nodes and match lists */
+    CL_MEMSTAT_AC_TRANS,	/* AC transition tables */
+    CL_MEMSTAT_AC_PATTERNS,	/* AC patterns and logical signatures */
+    CL_MEMSTAT_BM,		/* Boyer-Moore tables and patterns */
+    CL_MEMSTAT_HASH,		/* hash sets */
+    CL_MEMSTAT_PCRE,		/* PCRE metadata and compiled code */
+    CL_MEMSTAT_BYTECODE,
+    CL_MEMSTAT_YARA,
+    CL_MEMSTAT_TYPES
+};
+
+struct cl_memstat {
+    char name[16];
+    unsigned int sigs;
+    size_t bytes[CL_MEMSTAT_TYPES];
+};
+
+extern int cl_engine_get_memstats(const struct cl_engine *engine, struct cl_memstat *stats, unsigned int *count);
+
+/* Objects scanned with an engine for each file type, including the ones
+ * extracted from containers. usec is the time spent on the objects
+ * themselves, without the objects they contain. Only the file types that
+ * were seen are reported; fills at most *count entries of stats and sets
+ * *count to the number of entries available. */
+struct cl_scanstat {
+    char name[32];
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long usec;
+};
+
+extern int cl_engine_get_scanstats(const struct cl_engine *engine, struct cl_scanstat *stats, unsigned int *count);
+
+/* Cost of the signatures, sampled when CL_ENGINE_SIGPROF_RATE is set before
+ * cl_engine_compile(): about one in that many evaluations of the bytecodes,
+ * PCREs, logical signature and YARA conditions and of the body signatures
+ * with alternatives or ranges is timed. type is one of "bytecode", "pcre",
+ * "lsig", "yara" and "special", nsec the time of the samples, which times
+ * the rate estimates the total. Fills at most *count entries of stats with
+ * the most expensive signatures first and sets *count to the number of
+ * signatures sampled. */
+struct cl_sigstat {
+    char type[16];
+    char name[128];
+    unsigned long long samples;
+    unsigned long long nsec;
+    unsigned long long max_nsec;
+};
+
+extern int cl_engine_get_sigstats(const struct cl_engine *engine, struct cl_sigstat *stats, unsigned int *count);
+
+/* Time spent by cl_load() and cl_engine_compile() in each phase, added up
+ * over all the calls on the engine: the CVD signature checks, their
+ * unpacking, the parsing of each kind of database, the builds of the
+ * matchers, the PCRE and bytecode compilations and the cache. A phase
+ * doesn't include the phases it runs, so they add up to the total.
+ * cpu_usec is the CPU time of the whole process, mem_bytes the growth of
+ * the memory pool (it can be negative). Only the phases that ran are
+ * reported; fills at most *count entries of stats and sets *count to the
+ * number of entries available. */
+struct cl_loadstat {
+    char name[32];
+    unsigned long long calls;
+    unsigned long long wall_usec;
+    unsigned long long cpu_usec;
+    long long mem_bytes;
+};
+
+extern int cl_engine_get_loadstats(const struct cl_engine *engine, struct cl_loadstat *stats, unsigned int *count);
+
+/* Copies the 16 byte fingerprint of the signature set and the settings of a
+ * compiled engine to digest. Results obtained with engines which share the
+ * fingerprint are interchangeable. */
+extern int cl_engine_get_digest(const struct cl_engine *engine, unsigned char *digest);
+
+/* Looks up a file by its size and digests without its content. Any of md5,
+ * sha1 and sha256 may be NULL. The verdict is CL_HASH_VIRUS if a hash
+ * signature matches (virname is set), CL_HASH_CLEAN if the file is in the
+ * cache of clean files, which is keyed on the MD5, and CL_HASH_UNKNOWN if the
+ * content has to be scanned. */
+enum cl_hashcheck {
+    CL_HASH_UNKNOWN = 0,
+    CL_HASH_CLEAN,
+    CL_HASH_VIRUS
+};
+
+extern int cl_hashcheck(const struct cl_engine *engine, size_t size, const unsigned char *md5, const unsigned char *sha1, const unsigned char *sha256, const char **virname, enum cl_hashcheck *verdict);
+
 extern void cli_cache_disable(void);
 
 extern int cli_cache_enable(struct cl_engine *engine);
@@ -426,6 +557,50 @@ extern void cl_engine_set_clcb_meta(struct cl_engine *engine, clcb_meta callback
 typedef int (*clcb_file_props)(const char *j_propstr, int rc, void *cbdata);
 extern void cl_engine_set_clcb_file_props(struct cl_engine *engine, clcb_file_props callback);
 
+/* Streaming file properties callback: the JSON text is handed out in pieces
+ * of a few KiB as it's serialized, and a last time with len 0 once it's
+ * complete; rc is the result of the scan. Unlike clcb_file_props, the
+ * properties are not turned into one string first (unless that one is set
+ * too, or there are signatures for target type 13). Return CL_SUCCESS to
+ * get the rest, anything else is passed on as the scan result. */
+typedef int (*clcb_file_props_stream)(const char *chunk, size_t len, int rc, void *cbdata);
+extern void cl_engine_set_clcb_file_props_stream(struct cl_engine *engine, clcb_file_props_stream callback);
+
+/* Scan profile callback: when set, each scan records the objects it went
+ * through and passes them to the callback once it's over, as a JSON tree in
+ * the format of the flame graph tools. A node has the type of the object
+ * ("name"), the usec spent on it and on the objects it contains ("value")
+ * and "children"; "size" is its size and "read", "inflated" and "matcher"
+ * are the bytes read from the descriptors, the bytes decompressed and the
+ * usec spent in the signature matcher, the contained objects included.
+ * fd is the descriptor scanned, -1 for a map. The members of an archive are
+ * not handed to other threads while profiling (CL_ENGINE_ARCHIVE_THREADS). */
+typedef void (*clcb_profile)(int fd, const char *profile, void *context);
+extern void cl_engine_set_clcb_profile(struct cl_engine *engine, clcb_profile callback);
+
+/* Scan probe for sampling profilers: once a thread registered one, its scans
+ * keep it up to date with the types of the objects being scanned, outermost
+ * first, and whether the parsers or the signature matcher are running. Any
+ * other thread may read it at any time: it copies the probe while seq is even
+ * and retries if seq changed meanwhile. depth may exceed CL_PROBE_DEPTH, only
+ * the outermost types are kept then. NULL unregisters the probe. */
+#define CL_PROBE_DEPTH 16
+
+enum cl_probe_phase {
+    CL_PROBE_IDLE = 0,
+    CL_PROBE_PARSE,
+    CL_PROBE_MATCH
+};
+
+struct cl_scan_probe {
+    volatile unsigned int seq; /* odd while the probe is written */
+    unsigned int depth; /* 0: not scanning */
+    volatile unsigned int phase; /* written on its own, without seq */
+    const char *types[CL_PROBE_DEPTH];
+};
+
+extern void cl_scan_probe_register(struct cl_scan_probe *probe);
+
 /* Statistics/intelligence gathering callbacks */
 extern void cl_engine_set_stats_set_cbdata(struct cl_engine *engine, void *cbdata);
 
@@ -483,6 +658,12 @@ extern int cl_scanfile_callback(const char *filename, const char **virname, unsi
 
 /* database handling */
 extern int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, unsigned int dboptions);
+
+/* Applies an uncompressed, verified .cdiff script to a compiled engine
+ * without reloading it. Only the hash, body and logical signature
+ * databases are supported; CL_EFORMAT means a full reload is required.
+ * Must not be called concurrently for the same engine. */
+extern int cl_engine_apply_cdiff(struct cl_engine *engine, const char *script, unsigned int *signo);
 extern const char *cl_retdbdir(void);
 
 /* engine handling */
@@ -544,9 +725,81 @@ extern cl_fmap_t *cl_fmap_open_memory(const void *start, size_t len);
  * you hold only after (handles, maps) calling this function */
 extern void cl_fmap_close(cl_fmap_t*);
 
+/* Provide the MD5 of the whole map when the caller already computed it,
+ * e.g. while receiving the data, so the scan doesn't need a separate pass
+ * over the map for the cache lookup. md5 must be 16 bytes. */
+extern void cl_fmap_set_md5(cl_fmap_t *map, const unsigned char *md5);
+
 /* Scan custom data */
 extern int cl_scanmap_callback(cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context);
 
+/* Resources used by one scan, filled in by cl_scandesc_usage() and
+ * cl_scanmap_usage(). The times are in usec; cpu_usec adds up the threads
+ * that worked on the scan (CL_ENGINE_ARCHIVE_THREADS). read is what was
+ * read from the descriptors, inflated what was extracted or decompressed.
+ * objects counts the file and everything scanned inside it, depth is the
+ * deepest recursion level reached and limits has a CL_LIMIT_* bit for each
+ * limit the scan ran into. The phases overlap: the MD5 of each object for
+ * the cache is hash_usec, match_usec includes the bytecodes of the logical
+ * signatures and parse_usec is what's left of usec without these two. */
+#define CL_LIMIT_SIZE       0x01 /* CL_ENGINE_MAX_SCANSIZE, CL_ENGINE_MAX_FILESIZE */
+#define CL_LIMIT_FILES      0x02 /* CL_ENGINE_MAX_FILES */
+#define CL_LIMIT_RECURSION  0x04 /* CL_ENGINE_MAX_RECURSION */
+#define CL_LIMIT_TIME       0x08 /* CL_ENGINE_TIME_LIMIT */
+#define CL_LIMIT_CPU        0x10 /* CL_ENGINE_CPU_LIMIT */
+#define CL_LIMIT_INFLATED   0x20 /* CL_ENGINE_MAX_INFLATED */
+#define CL_LIMIT_MEMORY     0x40 /* CL_ENGINE_MAX_DECOMPRESS_MEM */
+
+struct cl_scan_usage {
+    unsigned long long usec;
+    unsigned long long cpu_usec;
+    unsigned long long read;
+    unsigned long long inflated;
+    unsigned int objects;
+    unsigned int depth;
+    unsigned int limits;
+    unsigned long long hash_usec;
+    unsigned long long match_usec;
+    unsigned long long bytecode_usec;
+    unsigned long long parse_usec;
+};
+
+extern int cl_scandesc_usage(int desc, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context, struct cl_scan_usage *usage);
+extern int cl_scanmap_usage(cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context, struct cl_scan_usage *usage);
+
+/* Asynchronous scanning. A scan queue runs the submitted scans on its own
+ * threads (nthreads, 0 for the default) and keeps the results until they
+ * are reaped. The descriptors and maps must stay open, and the engine
+ * alive, until the result of their scan has been reaped.
+ * cl_scan_queue_fd() returns a descriptor that polls readable while
+ * results are waiting; don't read from it. cl_scan_reap() stores up to max
+ * results and returns their number; with wait set it blocks until at
+ * least one scan completes, unless none is in flight.
+ * cl_scan_queue_free() finishes the queued scans and drops their results.
+ * The callbacks of the engine are called from the queue threads. */
+struct cl_scan_queue;
+
+struct cl_scan_result {
+    void *context;
+    int ret;
+    const char *virname;
+    unsigned long int scanned;
+};
+
+extern struct cl_scan_queue *cl_scan_queue_new(const struct cl_engine *engine, unsigned int nthreads);
+extern int cl_scan_submit(struct cl_scan_queue *queue, int desc, unsigned int scanoptions, void *context);
+extern int cl_scan_submit_map(struct cl_scan_queue *queue, cl_fmap_t *map, unsigned int scanoptions, void *context);
+extern int cl_scan_queue_fd(const struct cl_scan_queue *queue);
+extern int cl_scan_reap(struct cl_scan_queue *queue, struct cl_scan_result *results, unsigned int max, int wait);
+extern void cl_scan_queue_free(struct cl_scan_queue *queue);
+
+/* Scans count maps one after the other in a single call, reusing the scan
+ * state set up for the first one, which pays off on many small buffers.
+ * The caller sets the context of each result, the other fields are filled
+ * in with the outcome of the scan of the matching map. Returns CL_SUCCESS
+ * unless the batch couldn't be started at all. */
+extern int cl_scanmap_batch(cl_fmap_t * const *maps, struct cl_scan_result *results, unsigned int count, const struct cl_engine *engine, unsigned int scanoptions);
+
 /* Crypto/hashing functions */
 #define SHA1_HASH_SIZE 20
 #define SHA256_HASH_SIZE 32
@@ -0,0 +1,204 @@
+/*
+ *  Compressed storage for the cold strings of the engine.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "clamav.h"
+#include "others.h"
+#include "mpool.h"
+#include "coldstore.h"
+
+#define COLD_OFFBITS 14 /* log2(CLI_COLD_BLOCK) */
+#define COLD_MAXBLOCKS (1U << (32 - COLD_OFFBITS))
+
+struct cli_coldblock {
+    unsigned char *data; /* in the pool once sealed, on the heap before */
+    uint32_t ulen;
+    uint32_t clen; /* 0 if stored as is */
+};
+
+struct cli_coldstore {
+    mpool_t *mempool;
+    struct cli_coldblock *blocks;
+    uint32_t nblocks, size;
+    int open; /* the last block is still being filled */
+    size_t ulen, clen;
+};
+
+struct cli_coldstore *cli_cold_new(mpool_t *mempool)
+{
+    struct cli_coldstore *cs;
+
+    if(!(cs = cli_calloc(1, sizeof(*cs))))
+        return NULL;
+    cs->mempool = mempool;
+    return cs;
+}
+
+static struct cli_coldblock *cold_newblock(struct cli_coldstore *cs, uint32_t size)
+{
+    struct cli_coldblock *b;
+
+    if(cs->nblocks == COLD_MAXBLOCKS) {
+        cli_errmsg("cli_cold_add: Too many blocks\n");
+        return NULL;
+    }
+    if(cs->nblocks == cs->size) {
+        uint32_t n = cs->size ? cs->size * 2 : 64;
+
+        if(!(b = cli_realloc(cs->blocks, n * sizeof(*b))))
+            return NULL;
+        cs->blocks = b;
+        cs->size = n;
+    }
+    b = &cs->blocks[cs->nblocks];
+    if(!(b->data = cli_malloc(size)))
+        return NULL;
+    b->ulen = b->clen = 0;
+    cs->nblocks++;
+    cs->open = 1;
+    return b;
+}
+
+/* Deflates the block being filled into the pool */
+int cli_cold_seal(struct cli_coldstore *cs)
+{
+    struct cli_coldblock *b;
+    unsigned char *z, *data;
+    uLongf zlen;
+
+    if(!cs || !cs->open)
+        return CL_SUCCESS;
+    b = &cs->blocks[cs->nblocks - 1];
+    cs->open = 0;
+
+    zlen = compressBound(b->ulen);
+    if(!(z = cli_malloc(zlen)))
+        return CL_EMEM;
+    if(compress2(z, &zlen, b->data, b->ulen, Z_BEST_COMPRESSION) != Z_OK || zlen >= b->ulen) {
+        /* left as is */
+        free(z);
+        z = b->data;
+        zlen = b->ulen;
+        b->clen = 0;
+    } else {
+        free(b->data);
+        b->clen = zlen;
+    }
+    data = mpool_malloc(cs->mempool, zlen);
+    if(data)
+        memcpy(data, z, zlen);
+    free(z);
+    b->data = data;
+    if(!data) {
+        b->ulen = b->clen = 0;
+        cli_errmsg("cli_cold_seal: Can't allocate memory for the block\n");
+        return CL_EMEM;
+    }
+    cs->ulen += b->ulen;
+    cs->clen += zlen;
+    return CL_SUCCESS;
+}
+
+int cli_cold_add(struct cli_coldstore *cs, const char *str, uint32_t *ref)
+{
+    struct cli_coldblock *b = NULL;
+    size_t len = strlen(str) + 1;
+    int ret;
+
+    *ref = CLI_COLD_NONE;
+    if(cs->open) {
+        b = &cs->blocks[cs->nblocks - 1];
+        if(b->ulen + len > CLI_COLD_BLOCK) {
+            if((ret = cli_cold_seal(cs)))
+                return ret;
+            b = NULL;
+        }
+    }
+    if(!b) {
+        /* the strings longer than a block get one of their own */
+        if(!(b = cold_newblock(cs, len > CLI_COLD_BLOCK ? len : CLI_COLD_BLOCK)))
+            return CL_EMEM;
+    }
+
+    memcpy(b->data + b->ulen, str, len);
+    *ref = ((cs->nblocks - 1) << COLD_OFFBITS) | b->ulen;
+    b->ulen += len;
+    if(len > CLI_COLD_BLOCK)
+        return cli_cold_seal(cs);
+    return CL_SUCCESS;
+}
+
+/* Returns a copy of the string, to be freed by the caller */
+char *cli_cold_get(const struct cli_coldstore *cs, uint32_t ref)
+{
+    const struct cli_coldblock *b;
+    uint32_t off = ref & (CLI_COLD_BLOCK - 1);
+    unsigned char *buf;
+    uLongf len;
+    char *str;
+
+    if(!cs || ref == CLI_COLD_NONE || (ref >> COLD_OFFBITS) >= cs->nblocks)
+        return NULL;
+    b = &cs->blocks[ref >> COLD_OFFBITS];
+    if(off >= b->ulen)
+        return NULL;
+    if(!b->clen)
+        return cli_strdup((const char *)b->data + off);
+
+    len = b->ulen;
+    if(!(buf = cli_malloc(len)))
+        return NULL;
+    if(uncompress(buf, &len, b->data, b->clen) != Z_OK || len != b->ulen) {
+        cli_errmsg("cli_cold_get: Can't inflate block %u\n", ref >> COLD_OFFBITS);
+        free(buf);
+        return NULL;
+    }
+    str = cli_strdup((const char *)buf + off);
+    free(buf);
+    return str;
+}
+
+void cli_cold_stats(const struct cli_coldstore *cs, size_t *ulen, size_t *clen)
+{
+    *ulen = cs ? cs->ulen : 0;
+    *clen = cs ? cs->clen : 0;
+}
+
+void cli_cold_free(struct cli_coldstore *cs)
+{
+    uint32_t i;
+
+    if(!cs)
+        return;
+    for(i = 0; i < cs->nblocks; i++) {
+        if(cs->open && i == cs->nblocks - 1)
+            free(cs->blocks[i].data);
+        else
+            mpool_free(cs->mempool, cs->blocks[i].data);
+    }
+    free(cs->blocks);
+    free(cs);
+}
@@ -0,0 +1,48 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/* Compressed storage for the strings of the engine a scan hardly ever
+ * reads, such as the names of the icons and the logic of the compiled
+ * logical signatures.
+ *
+ * The strings are packed in blocks of CLI_COLD_BLOCK bytes, which
+ * cli_cold_seal() deflates into the memory pool of the engine once the
+ * databases are loaded. A string is referred to by its block and offset,
+ * cli_cold_get() inflates its block into a copy for the caller. Adding
+ * and sealing belong to the loading of the engine, the lookups don't lock
+ * and can run from any number of scans. */
+
+#ifndef __COLDSTORE_H
+#define __COLDSTORE_H
+
+#include "cltypes.h"
+#include "mpool.h"
+
+#define CLI_COLD_BLOCK 16384
+#define CLI_COLD_NONE 0xffffffff
+
+struct cli_coldstore;
+
+struct cli_coldstore *cli_cold_new(mpool_t *mempool);
+int cli_cold_add(struct cli_coldstore *cs, const char *str, uint32_t *ref);
+int cli_cold_seal(struct cli_coldstore *cs);
+char *cli_cold_get(const struct cli_coldstore *cs, uint32_t ref);
+void cli_cold_stats(const struct cli_coldstore *cs, size_t *ulen, size_t *clen);
+void cli_cold_free(struct cli_coldstore *cs);
+
+#endif
@@ -27,6 +27,55 @@
 #include "others.h"
 #include "crtmgr.h"
 
+#define CRT_SUBJECT_HASH(subject) ((subject)[0] % CRTMGR_HASH_SIZE)
+#define CRT_ISSUER_HASH(issuer, serial) (((issuer)[0] ^ (serial)[0]) % CRTMGR_HASH_SIZE)
+
+/* Results of crtmgr_rsa_verify() keyed by the SHA1 of the public key, the
+ * signature and the signed hash, so that the certificates of the common
+ * signers are only verified once per engine. Direct mapped, the newest
+ * result wins. */
+#define CRTMGR_CACHE_SIZE 1024
+
+struct crtmgr_cache {
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+#endif
+    struct {
+	uint8_t key[SHA1_HASH_SIZE];
+	uint8_t state; /* 0 = unused, 1 = verified, 2 = failed */
+    } entries[CRTMGR_CACHE_SIZE];
+};
+
+static int crt_hash_mp(void *ctx, mp_int *x) {
+    uint8_t buf[FP_MAX_SIZE/8];
+    unsigned int len = mp_unsigned_bin_size(x);
+    uint8_t hdr[2];
+
+    if(len > sizeof(buf))
+	return 1;
+    mp_to_unsigned_bin(x, buf);
+    hdr[0] = len >> 8;
+    hdr[1] = len;
+    cl_update_hash(ctx, hdr, 2);
+    cl_update_hash(ctx, buf, len);
+    return 0;
+}
+
+/* SHA1 of the given numbers, 0 on success */
+static int crt_hash_mps(uint8_t *hash, mp_int *a, mp_int *b) {
+    void *ctx = cl_hash_init("sha1");
+    int ret;
+
+    if(!ctx)
+	return 1;
+    ret = crt_hash_mp(ctx, a);
+    if(!ret && b)
+	ret = crt_hash_mp(ctx, b);
+    if(cl_finish_hash(ctx, hash))
+	ret = 1;
+    return ret;
+}
+
 int cli_crt_init(cli_crt *x509) {
     int ret;
     if((ret = mp_init_multi(&x509->n, &x509->e, &x509->sig, NULL))) {
@@ -37,6 +86,7 @@ int cli_crt_init(cli_crt *x509) {
     x509->isBlacklisted = 0;
     x509->not_before = x509->not_after = 0;
     x509->prev = x509->next = NULL;
+    x509->subject_next = x509->issuer_next = NULL;
     x509->certSign = x509->codeSign = x509->timeSign = 0;
     return 0;
 }
@@ -47,8 +97,11 @@ void cli_crt_clear(cli_crt *x509) {
 }
 
 cli_crt *crtmgr_lookup(crtmgr *m, cli_crt *x509) {
+    const crtmgr *s;
     cli_crt *i;
-    for(i = m->crts; i; i = i->next) {
+
+    for(s = m; s; s = s->parent)
+    for(i = s->by_subject[CRT_SUBJECT_HASH(x509->subject)]; i; i = i->subject_next) {
 	if(x509->not_before >= i->not_before &&
 	   x509->not_after <= i->not_after &&
 	   (i->certSign | x509->certSign) == i->certSign &&
@@ -66,9 +119,11 @@ cli_crt *crtmgr_lookup(crtmgr *m, cli_crt *x509) {
 
 int crtmgr_add(crtmgr *m, cli_crt *x509) {
     cli_crt *i;
+    unsigned int h;
     int ret = 0;
 
-    for(i = m->crts; i; i = i->next) {
+    /* both checks below need the same subject */
+    for(i = m->by_subject[CRT_SUBJECT_HASH(x509->subject)]; i; i = i->subject_next) {
 	if(!memcmp(x509->subject, i->subject, sizeof(i->subject)) &&
 	   !memcmp(x509->serial, i->subject, sizeof(i->serial)) &&
 	   !mp_cmp(&x509->n, &i->n) &&
@@ -124,6 +179,12 @@ int crtmgr_add(crtmgr *m, cli_crt *x509) {
 	free(i);
 	return 1;
     }
+    if(crt_hash_mps(i->keyhash, &i->n, &i->e)) {
+	cli_warnmsg("crtmgr_add: failed to hash the public key\n");
+	cli_crt_clear(i);
+	free(i);
+	return 1;
+    }
 
     if ((x509->name))
 	i->name = strdup(x509->name);
@@ -151,17 +212,23 @@ int crtmgr_add(crtmgr *m, cli_crt *x509) {
 	m->crts->prev = i;
     m->crts = i;
 
+    h = CRT_SUBJECT_HASH(i->subject);
+    i->subject_next = m->by_subject[h];
+    m->by_subject[h] = i;
+    h = CRT_ISSUER_HASH(i->issuer, i->serial);
+    i->issuer_next = m->by_issuer[h];
+    m->by_issuer[h] = i;
+
     m->items++;
     return 0;
 }
 
 void crtmgr_init(crtmgr *m) {
-    m->crts = NULL;
-    m->items = 0;
+    memset(m, 0, sizeof(*m));
 }
 
 void crtmgr_del(crtmgr *m, cli_crt *x509) {
-    cli_crt *i;
+    cli_crt *i, **p;
     for(i = m->crts; i; i = i->next) {
 	if(i==x509) {
 	    if(i->prev)
@@ -170,6 +237,16 @@ void crtmgr_del(crtmgr *m, cli_crt *x509) {
 		m->crts = i->next;
 	    if(i->next)
 		i->next->prev = i->prev;
+	    for(p = &m->by_subject[CRT_SUBJECT_HASH(x509->subject)]; *p; p = &(*p)->subject_next)
+		if(*p == x509) {
+		    *p = x509->subject_next;
+		    break;
+		}
+	    for(p = &m->by_issuer[CRT_ISSUER_HASH(x509->issuer, x509->serial)]; *p; p = &(*p)->issuer_next)
+		if(*p == x509) {
+		    *p = x509->issuer_next;
+		    break;
+		}
 	    cli_crt_clear(x509);
 	    if ((x509->name))
 		free(x509->name);
@@ -183,6 +260,13 @@ void crtmgr_del(crtmgr *m, cli_crt *x509) {
 void crtmgr_free(crtmgr *m) {
     while(m->items)
 	crtmgr_del(m, m->crts);
+    if(m->cache) {
+#ifdef CL_THREAD_SAFE
+	pthread_mutex_destroy(&m->cache->mutex);
+#endif
+	free(m->cache);
+	m->cache = NULL;
+    }
 }
 
 static int crtmgr_rsa_verify(cli_crt *x509, mp_int *sig, cli_crt_hashtype hashtype, const uint8_t *refhash) {
@@ -279,23 +363,74 @@ static int crtmgr_rsa_verify(cli_crt *x509, mp_int *sig, cli_crt_hashtype hashty
     return 1;
 }
 
+/* crtmgr_rsa_verify() through the cache of the engine store; sighash is
+ * the SHA1 of the signature, NULL to bypass the cache */
+static int crtmgr_rsa_verify_cached(const crtmgr *m, cli_crt *x509, mp_int *sig, const uint8_t *sighash, cli_crt_hashtype hashtype, const uint8_t *refhash) {
+    struct crtmgr_cache *c;
+    uint8_t key[SHA1_HASH_SIZE], type = hashtype;
+    unsigned int slot;
+    void *ctx;
+    int ret;
+
+    while(m->parent)
+	m = m->parent;
+    if(!(c = m->cache) || !sighash || !(ctx = cl_hash_init("sha1")))
+	return crtmgr_rsa_verify(x509, sig, hashtype, refhash);
+    cl_update_hash(ctx, x509->keyhash, SHA1_HASH_SIZE);
+    cl_update_hash(ctx, (void *)sighash, SHA1_HASH_SIZE);
+    cl_update_hash(ctx, &type, 1);
+    cl_update_hash(ctx, (void *)refhash, (hashtype == CLI_SHA1RSA) ? SHA1_HASH_SIZE : 16);
+    if(cl_finish_hash(ctx, key))
+	return crtmgr_rsa_verify(x509, sig, hashtype, refhash);
+    slot = (uint32_t)cli_readint32(key) % CRTMGR_CACHE_SIZE;
+
+    ret = -1;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&c->mutex);
+#endif
+    if(c->entries[slot].state && !memcmp(c->entries[slot].key, key, sizeof(key)))
+	ret = (c->entries[slot].state == 2);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    if(ret >= 0)
+	return ret;
+
+    ret = crtmgr_rsa_verify(x509, sig, hashtype, refhash);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&c->mutex);
+#endif
+    memcpy(c->entries[slot].key, key, sizeof(key));
+    c->entries[slot].state = ret ? 2 : 1;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    return ret;
+}
 
 cli_crt *crtmgr_verify_crt(crtmgr *m, cli_crt *x509) {
-    cli_crt *i = m->crts, *best = NULL;
+    const crtmgr *s;
+    cli_crt *i, *best = NULL;
+    uint8_t sighash[SHA1_HASH_SIZE], *sh = sighash;
     int score = 0;
 
-    for (i = m->crts; i; i = i->next) {
-        if (!memcmp(i->subject, x509->subject, sizeof(i->subject)) &&
-            !memcmp(i->serial, x509->serial, sizeof(i->serial))) {
-            if (i->isBlacklisted)
-                return i;
+    for(s = m; s; s = s->parent) {
+        for (i = s->by_subject[CRT_SUBJECT_HASH(x509->subject)]; i; i = i->subject_next) {
+            if (!memcmp(i->subject, x509->subject, sizeof(i->subject)) &&
+                !memcmp(i->serial, x509->serial, sizeof(i->serial))) {
+                if (i->isBlacklisted)
+                    return i;
+            }
         }
     }
 
-    for(i = m->crts; i; i = i->next) {
+    if(crt_hash_mps(sighash, &x509->sig, NULL))
+	sh = NULL;
+    for(s = m; s; s = s->parent)
+    for(i = s->by_subject[CRT_SUBJECT_HASH(x509->issuer)]; i; i = i->subject_next) {
 	if(i->certSign &&
 	   !memcmp(i->subject, x509->issuer, sizeof(i->subject)) &&
-	   !crtmgr_rsa_verify(i, &x509->sig, x509->hashtype, x509->tbshash)) {
+	   !crtmgr_rsa_verify_cached(m, i, &x509->sig, sh, x509->hashtype, x509->tbshash)) {
 	    int curscore;
 	    if((x509->codeSign & i->codeSign) == x509->codeSign && (x509->timeSign & i->timeSign) == x509->timeSign)
 		return i;
@@ -310,7 +445,9 @@ cli_crt *crtmgr_verify_crt(crtmgr *m, cli_crt *x509) {
 }
 
 cli_crt *crtmgr_verify_pkcs7(crtmgr *m, const uint8_t *issuer, const uint8_t *serial, const void *signature, unsigned int signature_len, cli_crt_hashtype hashtype, const uint8_t *refhash, cli_vrfy_type vrfytype) {
-    cli_crt *i;
+    const crtmgr *s;
+    cli_crt *i = NULL;
+    uint8_t sighash[SHA1_HASH_SIZE], *sh = sighash;
     mp_int sig;
     int ret;
 
@@ -328,36 +465,43 @@ cli_crt *crtmgr_verify_pkcs7(crtmgr *m, const uint8_t *issuer, const uint8_t *se
 	return NULL;
     }
 
-    for(i = m->crts; i; i = i->next) {
-	if(vrfytype == VRFY_CODE && !i->codeSign)
-	    continue;
-	if(vrfytype == VRFY_TIME && !i->timeSign)
-	    continue;
-	if(!memcmp(i->issuer, issuer, sizeof(i->issuer)) &&
-	   !memcmp(i->serial, serial, sizeof(i->serial)) &&
-	   !crtmgr_rsa_verify(i, &sig, hashtype, refhash)) {
-	    break;
-        }
+    if(!cl_sha1(signature, signature_len, sighash, NULL))
+	sh = NULL;
+    for(s = m; s && !i; s = s->parent) {
+	for(i = s->by_issuer[CRT_ISSUER_HASH(issuer, serial)]; i; i = i->issuer_next) {
+	    if(vrfytype == VRFY_CODE && !i->codeSign)
+		continue;
+	    if(vrfytype == VRFY_TIME && !i->timeSign)
+		continue;
+	    if(!memcmp(i->issuer, issuer, sizeof(i->issuer)) &&
+	       !memcmp(i->serial, serial, sizeof(i->serial)) &&
+	       !crtmgr_rsa_verify_cached(m, i, &sig, sh, hashtype, refhash)) {
+		break;
+	    }
+	}
     }
     mp_clear(&sig);
     return i;
 }
 
 int crtmgr_add_roots(struct cl_engine *engine, crtmgr *m) {
-    cli_crt *crt;
     /*
-     * Certs are cached in engine->cmgr. Copy from there.
+     * Certs are cached in engine->cmgr. Look them up from there.
      */
     if (m != &(engine->cmgr)) {
-       for (crt = engine->cmgr.crts; crt != NULL; crt = crt->next) {
-           if (crtmgr_add(m, crt)) {
-               crtmgr_free(m);
-               return 1;
-           }
-       }
-
+       m->parent = &(engine->cmgr);
        return 0;
     }
 
+    if (!m->cache) {
+	if (!(m->cache = cli_calloc(1, sizeof(*m->cache)))) {
+	    cli_errmsg("crtmgr_add_roots: failed to allocate the verification cache\n");
+	    return 1;
+	}
+#ifdef CL_THREAD_SAFE
+	pthread_mutex_init(&m->cache->mutex, NULL);
+#endif
+    }
+
     return 0;
 }
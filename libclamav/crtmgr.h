@@ -40,6 +40,7 @@ typedef struct cli_crt_t {
     uint8_t issuer[SHA1_HASH_SIZE];
     uint8_t tbshash[SHA1_HASH_SIZE];
     uint8_t serial[SHA1_HASH_SIZE];
+    uint8_t keyhash[SHA1_HASH_SIZE]; /* of n and e, set by crtmgr_add() */
     mp_int n;
     mp_int e;
     mp_int sig;
@@ -52,11 +53,24 @@ typedef struct cli_crt_t {
     int isBlacklisted;
     struct cli_crt_t *prev;
     struct cli_crt_t *next;
+    struct cli_crt_t *subject_next;
+    struct cli_crt_t *issuer_next;
 } cli_crt;
 
-typedef struct {
+#define CRTMGR_HASH_SIZE 64
+
+struct crtmgr_cache;
+
+typedef struct crtmgr_t {
     cli_crt *crts;
     unsigned int items;
+    /* crts chained by subject and by issuer + serial */
+    cli_crt *by_subject[CRTMGR_HASH_SIZE];
+    cli_crt *by_issuer[CRTMGR_HASH_SIZE];
+    /* the engine store, looked up after this one */
+    const struct crtmgr_t *parent;
+    /* RSA verification results, engine store only */
+    struct crtmgr_cache *cache;
 } crtmgr;
 
 
@@ -55,6 +55,9 @@
 #include <unistd.h>
 #endif
 
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+
 #include "clamav.h"
 #include "default.h"
 #include "others.h"
@@ -1188,3 +1191,71 @@ void cl_hash_destroy(void *ctx)
 
     EVP_MD_CTX_destroy((EVP_MD_CTX *)ctx);
 }
+
+int cli_bn_exptmod(const unsigned char *a, unsigned int alen, const unsigned char *b, unsigned int blen, const unsigned char *c, unsigned int clen, unsigned char *d)
+{
+    BN_CTX *ctx;
+    BIGNUM *x, *y, *m, *r;
+    int ret = -1;
+
+    if (!(ctx = BN_CTX_new()))
+        return -1;
+
+    BN_CTX_start(ctx);
+    x = BN_CTX_get(ctx);
+    y = BN_CTX_get(ctx);
+    m = BN_CTX_get(ctx);
+    r = BN_CTX_get(ctx);
+    if (r && BN_bin2bn(a, alen, x) && BN_bin2bn(b, blen, y) && BN_bin2bn(c, clen, m) &&
+        !BN_is_zero(m) && BN_mod_exp(r, x, y, m, ctx))
+        ret = BN_bn2bin(r, d);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+
+    return ret;
+}
+
+int cli_aes_cbc_decrypt(const unsigned char *key, unsigned int keylen, const unsigned char *iv, const unsigned char *in, unsigned char *out, size_t len)
+{
+    const EVP_CIPHER *cipher;
+    EVP_CIPHER_CTX *ctx;
+    int outl, ret = -1;
+
+    switch (keylen) {
+        case 16:
+            cipher = EVP_aes_128_cbc();
+            break;
+        case 24:
+            cipher = EVP_aes_192_cbc();
+            break;
+        case 32:
+            cipher = EVP_aes_256_cbc();
+            break;
+        default:
+            return -1;
+    }
+    if (len % 16)
+        return -1;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    if (EVP_DecryptInit_ex(ctx, cipher, NULL, key, iv)) {
+        /* the caller checks the padding */
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+        while (len) {
+            int chunk = (len > 0x40000000) ? 0x40000000 : (int)len;
+
+            if (!EVP_DecryptUpdate(ctx, out, &outl, in, chunk))
+                break;
+            in += chunk;
+            out += outl;
+            len -= chunk;
+        }
+        if (!len)
+            ret = 0;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ret;
+}
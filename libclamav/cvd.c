@@ -43,6 +43,8 @@
 #include "cvd.h"
 #include "readdb.h"
 #include "default.h"
+#include "cache.h"
+#include "loadstats.h"
 
 #define TAR_BLOCKSIZE 512
 
@@ -182,18 +184,142 @@ static int cli_untgz(int fd, const char *destdir)
     return 0;
 }
 
-static void cli_tgzload_cleanup(int comp, struct cli_dbio *dbio, int fdd)
+/* The tgz following the CVD header, inflated by hand instead of through
+ * gzdopen() so that cli_cvdload() can compute the MD5 of the compressed
+ * data in the same pass that loads the signatures. */
+struct cli_cvdstream {
+    int fd, compr, zinit, zend;
+    z_stream z;
+    off_t pos; /* uncompressed bytes returned so far */
+    void *md5ctx;
+    unsigned char in[FILEBUFF];
+};
+
+static void cvdstream_free(struct cli_cvdstream *cs)
 {
-    UNUSEDPARAM(fdd);
-    cli_dbgmsg("in cli_tgzload_cleanup()\n");
-    if(comp) {
-        gzclose(dbio->gzs);
-        dbio->gzs = NULL;
+    if(!cs)
+	return;
+    if(cs->zinit)
+	inflateEnd(&cs->z);
+    if(cs->md5ctx)
+	cl_hash_destroy(cs->md5ctx);
+    free(cs);
+}
+
+static struct cli_cvdstream *cvdstream_new(int fd, int compr, int md5)
+{
+	struct cli_cvdstream *cs;
+
+
+    if(!(cs = cli_calloc(1, sizeof(*cs)))) {
+	cli_errmsg("cvdstream_new: Can't allocate memory for the stream\n");
+	return NULL;
+    }
+    cs->fd = fd;
+    cs->compr = compr;
+    if(compr) {
+	if(inflateInit2(&cs->z, 16 + MAX_WBITS) != Z_OK) {
+	    cli_errmsg("cvdstream_new: inflateInit2() failed\n");
+	    free(cs);
+	    return NULL;
+	}
+	cs->zinit = 1;
+    }
+    if(md5 && !(cs->md5ctx = cl_hash_init("md5"))) {
+	cvdstream_free(cs);
+	return NULL;
+    }
+    return cs;
+}
+
+static int cvdstream_raw(struct cli_cvdstream *cs, unsigned char *buff, unsigned int size)
+{
+	int n;
+
+    if((n = cli_readn(cs->fd, buff, size)) > 0 && cs->md5ctx)
+	cl_update_hash(cs->md5ctx, buff, n);
+    return n;
+}
+
+static int cvdstream_read(struct cli_cvdstream *cs, void *buff, unsigned int size)
+{
+	int n, ret;
+
+
+    if(!cs->compr) {
+	if((n = cvdstream_raw(cs, buff, size)) > 0)
+	    cs->pos += n;
+	return n;
     }
-    else {
-        fclose(dbio->fs);
-        dbio->fs = NULL;
+
+    cs->z.next_out = buff;
+    cs->z.avail_out = size;
+    while(cs->z.avail_out && !cs->zend) {
+	if(!cs->z.avail_in) {
+	    if((n = cvdstream_raw(cs, cs->in, sizeof(cs->in))) == -1)
+		return -1;
+	    if(!n)
+		break;
+	    cs->z.next_in = cs->in;
+	    cs->z.avail_in = n;
+	}
+	ret = inflate(&cs->z, Z_NO_FLUSH);
+	if(ret == Z_STREAM_END)
+	    cs->zend = 1;
+	else if(ret != Z_OK) {
+	    cli_errmsg("cvdstream_read: inflate() failed (%d)\n", ret);
+	    return -1;
+	}
     }
+    n = size - cs->z.avail_out;
+    cs->pos += n;
+    return n;
+}
+
+static void cvdstream_skip(struct cli_cvdstream *cs, off_t len)
+{
+	char buff[FILEBUFF];
+	int n;
+
+    while(len > 0 && (n = cvdstream_read(cs, buff, len < FILEBUFF ? len : FILEBUFF)) > 0)
+	len -= n;
+}
+
+/* hashes whatever is left of the file and returns the MD5 in hex */
+static int cvdstream_md5(struct cli_cvdstream *cs, char *md5)
+{
+	unsigned char digest[16];
+	int i;
+
+    while(cvdstream_raw(cs, cs->in, sizeof(cs->in)) > 0);
+    i = cl_finish_hash(cs->md5ctx, digest);
+    cs->md5ctx = NULL;
+    if(i)
+	return -1;
+    for(i = 0; i < 16; i++)
+	sprintf(md5 + i * 2, "%02x", digest[i]);
+    return 0;
+}
+
+int cli_dbio_read(struct cli_dbio *dbio, void *buff, unsigned int size)
+{
+	int n;
+
+    if(dbio->cs)
+	return cvdstream_read(dbio->cs, buff, size);
+    if(dbio->gzs)
+	return gzread(dbio->gzs, buff, size);
+    n = fread(buff, 1, size, dbio->fs);
+    if(!n && ferror(dbio->fs))
+	return -1;
+    return n;
+}
+
+static void cli_tgzload_cleanup(struct cli_dbio *dbio)
+{
+    cli_dbgmsg("in cli_tgzload_cleanup()\n");
+    cvdstream_free(dbio->cs);
+    dbio->cs = NULL;
     if(dbio->buf != NULL) {
         free(dbio->buf);
         dbio->buf = NULL;
@@ -205,11 +331,13 @@ static void cli_tgzload_cleanup(int comp, struct cli_dbio *dbio, int fdd)
     }
 }
 
-static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio, struct cli_dbinfo *dbinfo)
+/* With md5 set, the MD5 of everything after the CVD header is computed
+ * while loading and returned there in hex. */
+static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio, struct cli_dbinfo *dbinfo, char *md5)
 {
 	char osize[13], name[101];
 	char block[TAR_BLOCKSIZE];
-	int nread, fdd, ret;
+	int nread, ret;
 	unsigned int type, size, pad, compr = 1;
 	off_t off;
 	struct cli_dbinfo *db;
@@ -231,34 +359,16 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
         return CL_ESEEK;
     }
 
-    if((fdd = dup(fd)) == -1) {
-	cli_errmsg("cli_tgzload: Can't duplicate descriptor %d\n", fd);
-	return CL_EDUP;
-    }
-
-    if(compr) {
-	if((dbio->gzs = gzdopen(fdd, "rb")) == NULL) {
-	    cli_errmsg("cli_tgzload: Can't gzdopen() descriptor %d, errno = %d\n", fdd, errno);
-	    if (fdd > -1)
-		close(fdd);
-	    return CL_EOPEN;
-	}
-	dbio->fs = NULL;
-    } else {
-	if((dbio->fs = fdopen(fdd, "rb")) == NULL) {
-	    cli_errmsg("cli_tgzload: Can't fdopen() descriptor %d, errno = %d\n", fdd, errno);
-	    if (fdd > -1)
-		close(fdd);
-	    return CL_EOPEN;
-	}
-	dbio->gzs = NULL;
-    }
+    dbio->gzs = NULL;
+    dbio->fs = NULL;
+    if(!(dbio->cs = cvdstream_new(fd, compr, md5 != NULL)))
+	return CL_EMEM;
 
     dbio->bufsize = CLI_DEFAULT_DBIO_BUFSIZE;
     dbio->buf = cli_malloc(dbio->bufsize);
     if(!dbio->buf) {
 	cli_errmsg("cli_tgzload: Can't allocate memory for dbio->buf\n");
-	cli_tgzload_cleanup(compr, dbio, fdd);
+	cli_tgzload_cleanup(dbio);
 	return CL_EMALFDB;
     }
     dbio->bufpt = NULL;
@@ -267,17 +377,14 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
 
     while(1) {
 
-	if(compr)
-	    nread = gzread(dbio->gzs, block, TAR_BLOCKSIZE);
-	else
-	    nread = fread(block, 1, TAR_BLOCKSIZE, dbio->fs);
+	nread = cvdstream_read(dbio->cs, block, TAR_BLOCKSIZE);
 
 	if(!nread)
 	    break;
 
 	if(nread != TAR_BLOCKSIZE) {
 	    cli_errmsg("cli_tgzload: Incomplete block read\n");
-	    cli_tgzload_cleanup(compr, dbio, fdd);
+	    cli_tgzload_cleanup(dbio);
 	    return CL_EMALFDB;
 	}
 
@@ -289,7 +396,7 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
 
 	if(strchr(name, '/')) {
 	    cli_errmsg("cli_tgzload: Slash separators are not allowed in CVD\n");
-	    cli_tgzload_cleanup(compr, dbio, fdd);
+	    cli_tgzload_cleanup(dbio);
 	    return CL_EMALFDB;
 	}
 
@@ -301,11 +408,11 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
 		break;
 	    case '5':
 		cli_errmsg("cli_tgzload: Directories are not supported in CVD\n");
-		cli_tgzload_cleanup(compr, dbio, fdd);
+		cli_tgzload_cleanup(dbio);
 		return CL_EMALFDB;
 	    default:
 		cli_errmsg("cli_tgzload: Unknown type flag '%c'\n", type);
-		cli_tgzload_cleanup(compr, dbio, fdd);
+		cli_tgzload_cleanup(dbio);
 		return CL_EMALFDB;
 	}
 
@@ -314,7 +421,7 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
 
 	if((sscanf(osize, "%o", &size)) == 0) {
 	    cli_errmsg("cli_tgzload: Invalid size in header\n");
-	    cli_tgzload_cleanup(compr, dbio, fdd);
+	    cli_tgzload_cleanup(dbio);
 	    return CL_EMALFDB;
 	}
 	dbio->size = size;
@@ -324,27 +431,24 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
     if (!(dbio->hashctx)) {
         dbio->hashctx = cl_hash_init("sha256");
         if (!(dbio->hashctx)) {
-            cli_tgzload_cleanup(compr, dbio, fdd);
+            cli_tgzload_cleanup(dbio);
             return CL_EMALFDB;
         }
     }
 	dbio->bread = 0;
 
 	/* cli_dbgmsg("cli_tgzload: Loading %s, size: %u\n", name, size); */
-	if(compr)
-	    off = (off_t) gzseek(dbio->gzs, 0, SEEK_CUR);
-	else
-	    off = ftell(dbio->fs);
+	off = dbio->cs->pos;
 
 	if((!dbinfo && cli_strbcasestr(name, ".info")) || (dbinfo && (CLI_DBEXT(name) || cli_strbcasestr(name, ".ign") || cli_strbcasestr(name, ".ign2")))) {
 	    ret = cli_load(name, engine, signo, options, dbio);
 	    if(ret) {
 		cli_errmsg("cli_tgzload: Can't load %s\n", name);
-		cli_tgzload_cleanup(compr, dbio, fdd);
+		cli_tgzload_cleanup(dbio);
 		return CL_EMALFDB;
 	    }
 	    if(!dbinfo) {
-		cli_tgzload_cleanup(compr, dbio, fdd);
+		cli_tgzload_cleanup(dbio);
 		return CL_SUCCESS;
 	    } else {
 		db = dbinfo;
@@ -352,45 +456,42 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
 		    db = db->next;
 		if(!db) {
 		    cli_errmsg("cli_tgzload: File %s not found in .info\n", name);
-		    cli_tgzload_cleanup(compr, dbio, fdd);
+		    cli_tgzload_cleanup(dbio);
 		    return CL_EMALFDB;
 		}
 		if(dbio->bread) {
 		    if(db->size != dbio->bread) {
 			cli_errmsg("cli_tgzload: File %s not correctly loaded\n", name);
-			cli_tgzload_cleanup(compr, dbio, fdd);
+			cli_tgzload_cleanup(dbio);
 			return CL_EMALFDB;
 		    }
             cl_finish_hash(dbio->hashctx, hash);
             dbio->hashctx = cl_hash_init("sha256");
             if (!(dbio->hashctx)) {
-                cli_tgzload_cleanup(compr, dbio, fdd);
+                cli_tgzload_cleanup(dbio);
                 return CL_EMALFDB;
             }
 		    if(memcmp(db->hash, hash, 32)) {
 			cli_errmsg("cli_tgzload: Invalid checksum for file %s\n", name);
-			cli_tgzload_cleanup(compr, dbio, fdd);
+			cli_tgzload_cleanup(dbio);
 			return CL_EMALFDB;
 		    }
+		    cli_cache_dbentry(engine, name, hash);
 		}
 	    }
 	}
 	pad = size % TAR_BLOCKSIZE ? (TAR_BLOCKSIZE - (size % TAR_BLOCKSIZE)) : 0;
-	if(compr) {
-	    if(off == gzseek(dbio->gzs, 0, SEEK_CUR))
-		gzseek(dbio->gzs, size + pad, SEEK_CUR);
-	    else if(pad)
-		gzseek(dbio->gzs, pad, SEEK_CUR);
-	} else {
-	    if(off == ftell(dbio->fs))
-		fseek(dbio->fs, size + pad, SEEK_CUR);
-	    else if(pad)
-		fseek(dbio->fs, pad, SEEK_CUR);
-	}
+	if(off == dbio->cs->pos)
+	    cvdstream_skip(dbio->cs, size + pad);
+	else
+	    cvdstream_skip(dbio->cs, off + size + pad - dbio->cs->pos);
     }
 
-    cli_tgzload_cleanup(compr, dbio, fdd);
-    return CL_SUCCESS;
+    ret = CL_SUCCESS;
+    if(md5 && cvdstream_md5(dbio->cs, md5) == -1)
+	ret = CL_EVERIFY;
+    cli_tgzload_cleanup(dbio);
+    return ret;
 }
 
 struct cl_cvd *cl_cvdparse(const char *head)
@@ -516,23 +617,50 @@ void cl_cvdfree(struct cl_cvd *cvd)
     free(cvd);
 }
 
-static int cli_cvdverify(FILE *fs, struct cl_cvd *cvdpt, unsigned int skipsig)
+static struct cl_cvd *cli_cvdreadhead(FILE *fs)
 {
-	struct cl_cvd *cvd;
-	char *md5, head[513];
+	char head[513];
 	int i;
 
 
     fseek(fs, 0, SEEK_SET);
     if(fread(head, 1, 512, fs) != 512) {
 	cli_errmsg("cli_cvdverify: Can't read CVD header\n");
-	return CL_ECVD;
+	return NULL;
     }
 
     head[512] = 0;
     for(i = 511; i > 0 && (head[i] == ' ' || head[i] == 10); head[i] = 0, i--);
 
-    if((cvd = cl_cvdparse(head)) == NULL)
+    return cl_cvdparse(head);
+}
+
+/* md5 is the checksum of the .tar.gz */
+static int cli_cvdchecksig(const char *md5, const struct cl_cvd *cvd)
+{
+    cli_dbgmsg("MD5(.tar.gz) = %s\n", md5);
+
+    if(strncmp(md5, cvd->md5, 32)) {
+	cli_dbgmsg("cli_cvdverify: MD5 verification error\n");
+	return CL_EVERIFY;
+    }
+
+    if(cli_versig(md5, cvd->dsig)) {
+	cli_dbgmsg("cli_cvdverify: Digital signature verification error\n");
+	return CL_EVERIFY;
+    }
+
+    return CL_SUCCESS;
+}
+
+static int cli_cvdverify(FILE *fs, struct cl_cvd *cvdpt, unsigned int skipsig)
+{
+	struct cl_cvd *cvd;
+	char *md5;
+	int ret;
+
+
+    if((cvd = cli_cvdreadhead(fs)) == NULL)
 	return CL_ECVD;
 
     if(cvdpt)
@@ -549,25 +677,11 @@ static int cli_cvdverify(FILE *fs, struct cl_cvd *cvdpt, unsigned int skipsig)
 	cl_cvdfree(cvd);
 	return CL_EMEM;
     }
-    cli_dbgmsg("MD5(.tar.gz) = %s\n", md5);
-
-    if(strncmp(md5, cvd->md5, 32)) {
-	cli_dbgmsg("cli_cvdverify: MD5 verification error\n");
-	free(md5);
-	cl_cvdfree(cvd);
-	return CL_EVERIFY;
-    }
-
-    if(cli_versig(md5, cvd->dsig)) {
-	cli_dbgmsg("cli_cvdverify: Digital signature verification error\n");
-	free(md5);
-	cl_cvdfree(cvd);
-	return CL_EVERIFY;
-    }
 
+    ret = cli_cvdchecksig(md5, cvd);
     free(md5);
     cl_cvdfree(cvd);
-    return CL_SUCCESS;
+    return ret;
 }
 
 int cl_cvdverify(const char *file)
@@ -603,43 +717,53 @@ int cl_cvdverify(const char *file)
 
 int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, unsigned int dbtype, const char *filename, unsigned int chkonly)
 {
-	struct cl_cvd cvd, dupcvd;
+	struct cl_cvd *cvd, dupcvd;
 	FILE *dupfs;
 	int ret;
 	time_t s_time;
 	int cfd;
 	struct cli_dbio dbio;
 	struct cli_dbinfo *dbinfo = NULL;
-	char *dupname;
+	char *dupname, md5[33];
+	struct cli_loadtimer timer;
 
-    dbio.hashctx = NULL;
+    memset(&dbio, 0, sizeof(dbio));
 
     cli_dbgmsg("in cli_cvdload()\n");
 
-    /* verify */
-    if((ret = cli_cvdverify(fs, &cvd, dbtype)))
-	return ret;
+    /* the signature of a .cvd is verified with the MD5 computed by the
+     * full load below, which fails if it doesn't match */
+    if((cvd = cli_cvdreadhead(fs)) == NULL)
+	return CL_ECVD;
 
     if(dbtype <= 1) {
 	/* check for duplicate db */
 	dupname = cli_strdup(filename);
-	if(!dupname)
+	if(!dupname) {
+	    cl_cvdfree(cvd);
 	    return CL_EMEM;
+	}
 	dupname[strlen(dupname) - 2] = (dbtype == 1 ? 'v' : 'l');
 	if(!access(dupname, R_OK) && (dupfs = fopen(dupname, "rb"))) {
-	    if((ret = cli_cvdverify(dupfs, &dupcvd, !dbtype))) {
+	    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_CVD_VERIFY);
+	    ret = cli_cvdverify(dupfs, &dupcvd, !dbtype);
+	    cli_loadstat_stop(engine, &timer);
+	    if(ret) {
 		fclose(dupfs);
 		free(dupname);
+		cl_cvdfree(cvd);
 		return ret;
 	    }
 	    fclose(dupfs);
-	    if(dupcvd.version > cvd.version) {
+	    if(dupcvd.version > cvd->version) {
 		cli_warnmsg("Detected duplicate databases %s and %s. The %s database is older and will not be loaded, you should manually remove it from the database directory.\n", filename, dupname, filename);
 		free(dupname);
+		cl_cvdfree(cvd);
 		return CL_SUCCESS;
-	    } else if(dupcvd.version == cvd.version && !dbtype) {
+	    } else if(dupcvd.version == cvd->version && !dbtype) {
 		cli_warnmsg("Detected duplicate databases %s and %s, please manually remove one of them\n", filename, dupname);
 		free(dupname);
+		cl_cvdfree(cvd);
 		return CL_SUCCESS;
 	    }
 	}
@@ -648,24 +772,24 @@ int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigne
 
     if(strstr(filename, "daily.")) {
 	time(&s_time);
-	if(cvd.stime > s_time) {
-	    if(cvd.stime - (unsigned int ) s_time > 3600) {
+	if(cvd->stime > s_time) {
+	    if(cvd->stime - (unsigned int ) s_time > 3600) {
 		cli_warnmsg("******************************************************\n");
 		cli_warnmsg("***      Virus database timestamp in the future!   ***\n");
 		cli_warnmsg("***  Please check the timezone and clock settings  ***\n");
 		cli_warnmsg("******************************************************\n");
 	    }
-	} else if((unsigned int) s_time - cvd.stime > 604800) {
+	} else if((unsigned int) s_time - cvd->stime > 604800) {
 	    cli_warnmsg("**************************************************\n");
 	    cli_warnmsg("***  The virus database is older than 7 days!  ***\n");
 	    cli_warnmsg("***   Please update it as soon as possible.    ***\n");
 	    cli_warnmsg("**************************************************\n");
 	}
-	engine->dbversion[0] = cvd.version;
-	engine->dbversion[1] = cvd.stime;
+	engine->dbversion[0] = cvd->version;
+	engine->dbversion[1] = cvd->stime;
     }
 
-    if(cvd.fl > cl_retflevel()) {
+    if(cvd->fl > cl_retflevel()) {
 	cli_warnmsg("***********************************************************\n");
 	cli_warnmsg("***  This version of the ClamAV engine is outdated.     ***\n");
 	cli_warnmsg("***   Read http://www.clamav.net/doc/install.html       ***\n");
@@ -674,21 +798,27 @@ int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigne
 
     cfd = fileno(fs);
     dbio.chkonly = 0;
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_CVD_UNPACK);
     if(dbtype == 2)
-	ret = cli_tgzload(cfd, engine, signo, options | CL_DB_UNSIGNED, &dbio, NULL);
+	ret = cli_tgzload(cfd, engine, signo, options | CL_DB_UNSIGNED, &dbio, NULL, NULL);
     else
-	ret = cli_tgzload(cfd, engine, signo, options | CL_DB_OFFICIAL, &dbio, NULL);
-    if(ret != CL_SUCCESS)
+	ret = cli_tgzload(cfd, engine, signo, options | CL_DB_OFFICIAL, &dbio, NULL, NULL);
+    cli_loadstat_stop(engine, &timer);
+    if(ret != CL_SUCCESS) {
+	cl_cvdfree(cvd);
 	return ret;
+    }
 
     dbinfo = engine->dbinfo;
-    if(!dbinfo || !dbinfo->cvd || (dbinfo->cvd->version != cvd.version) || (dbinfo->cvd->sigs != cvd.sigs) || (dbinfo->cvd->fl != cvd.fl) || (dbinfo->cvd->stime != cvd.stime)) {
+    if(!dbinfo || !dbinfo->cvd || (dbinfo->cvd->version != cvd->version) || (dbinfo->cvd->sigs != cvd->sigs) || (dbinfo->cvd->fl != cvd->fl) || (dbinfo->cvd->stime != cvd->stime)) {
 	cli_errmsg("cli_cvdload: Corrupted CVD header\n");
+	cl_cvdfree(cvd);
 	return CL_EMALFDB;
     }
     dbinfo = engine->dbinfo ? engine->dbinfo->next : NULL;
     if(!dbinfo) {
 	cli_errmsg("cli_cvdload: dbinfo error\n");
+	cl_cvdfree(cvd);
 	return CL_EMALFDB;
     }
 
@@ -698,7 +828,17 @@ int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigne
     else
 	options |= CL_DB_SIGNED | CL_DB_OFFICIAL;
 
-    ret = cli_tgzload(cfd, engine, signo, options, &dbio, dbinfo);
+    /* the files are parsed as they are decompressed, the parsing is
+     * timed in its own phases */
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_CVD_UNPACK);
+    ret = cli_tgzload(cfd, engine, signo, options, &dbio, dbinfo, dbtype ? NULL : md5);
+    cli_loadstat_stop(engine, &timer);
+    if(!ret && !dbtype) {
+	cli_loadstat_start(engine, &timer, CLI_LOADSTAT_CVD_VERIFY);
+	ret = cli_cvdchecksig(md5, cvd);
+	cli_loadstat_stop(engine, &timer);
+    }
+    cl_cvdfree(cvd);
 
     while(engine->dbinfo) {
 	dbinfo = engine->dbinfo;
@@ -26,9 +26,12 @@
 #include <zlib.h>
 #include "clamav.h"
 
+struct cli_cvdstream;
+
 struct cli_dbio {
     gzFile gzs;
     FILE *fs;
+    struct cli_cvdstream *cs; /* CVD members, instead of gzs or fs */
     unsigned int size, bread;
     char *buf, *bufpt, *readpt;
     unsigned int usebuf, bufsize, readsize;
@@ -38,5 +41,6 @@ struct cli_dbio {
 
 int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, unsigned int dbtype, const char *filename, unsigned int chkonly);
 int cli_cvdunpack(const char *file, const char *dir);
+int cli_dbio_read(struct cli_dbio *dbio, void *buff, unsigned int size);
 
 #endif
@@ -132,6 +132,7 @@ static struct dconf_module modules[] = {
     { "OTHER",      "PDFNAMEOBJ",   OTHER_CONF_PDFNAMEOBJ,  1 },
     { "OTHER",      "PRTNINTXN",   OTHER_CONF_PRTNINTXN,  1 },
     { "OTHER",      "LZW",      OTHER_CONF_LZW,     1 },
+    { "OTHER",      "YARAOPT",  OTHER_CONF_YARAOPT, 1 },
 
     { "PHISHING",   "ENGINE",       PHISHING_CONF_ENGINE,   1 },
     { "PHISHING",   "ENTCONV",      PHISHING_CONF_ENTCONV,  1 },
@@ -123,6 +123,7 @@ struct cli_dconf {
 #define OTHER_CONF_PDFNAMEOBJ	0x100
 #define OTHER_CONF_PRTNINTXN	0x200
 #define OTHER_CONF_LZW		0x400
+#define OTHER_CONF_YARAOPT	0x800
 
 /* Phishing flags */
 #define PHISHING_CONF_ENGINE   0x1
@@ -53,4 +53,29 @@
 #define CLI_DEFAULT_PCRE_RECMATCH_LIMIT  5000
 #define CLI_DEFAULT_PCRE_MAX_FILESIZE    26214400
 
+/* entries in the scan cache */
+#define CLI_DEFAULT_CACHE_SIZE           65536
+#define CLI_MAX_CACHE_SIZE               67108864
+
+/* threads loading the hash databases and compiling the engine */
+#define CLI_MAX_LOAD_THREADS             32
+
+/* files below this size are always scanned by a single thread */
+#define CLI_DEFAULT_PARALLEL_SCAN_FSIZE  33554432
+#define CLI_MAX_PARALLEL_SCAN            32
+
+/* extracted objects up to this size are scanned from memory */
+#define CLI_DEFAULT_EXTRACT_MEM          4194304
+#define CLI_EXTRACT_MINBUF               65536
+
+/* archives below this size have their members scanned by a single thread */
+#define CLI_DEFAULT_ARCHIVE_THREADS_FSIZE 16777216
+#define CLI_MAX_ARCHIVE_THREADS          32
+
+/* compressed blocks decoded on their own by one of the threads at most */
+#define CLI_MAX_DECOMPRESS_THREADS       32
+#define CLI_MAX_DECOMPRESS_BLOCK         67108864
+/* bzip2 files below this size are decoded by a single thread */
+#define CLI_DEFAULT_DECOMPRESS_THREADS_FSIZE 1048576
+
 #endif
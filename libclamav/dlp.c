@@ -34,6 +34,11 @@
 #include "others.h"
 #include "str.h"
 
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#define DLP_SIMD 1
+#endif
+
 /* detection mode macros for the contains_* functions */
 #define DETECT_MODE_DETECT  0
 #define DETECT_MODE_COUNT   1
@@ -153,33 +158,64 @@ static struct iin_map_struct iin_map[] = {
     {0}
 };
 
+#define IIN_MAP_SIZE (sizeof(iin_map) / sizeof(iin_map[0]) - 1)
+
 /* Fixme: some card ranges can have lengths other than 16 */
 
-static const struct iin_map_struct * get_iin(char * digits)
+/* the ranges are sorted and don't overlap */
+static const struct iin_map_struct * get_iin(uint32_t iin, const char * digits)
 {
-    int iin = atoi(digits);
-    int i = 0;
-
-    while (iin_map[i].iin_start != 0) {
-        if (iin < iin_map[i].iin_start)
-            break;
-        if (iin <= iin_map[i].iin_end) {
-            cli_dbgmsg("Credit card IIN %s matched range for %s\n", digits, iin_map[i].iin_name);
-            return &iin_map[i];
+    unsigned int lo = 0, hi = IIN_MAP_SIZE, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (iin < iin_map[mid].iin_start)
+            hi = mid;
+        else if (iin > iin_map[mid].iin_end)
+            lo = mid + 1;
+        else {
+            cli_dbgmsg("Credit card IIN %s matched range for %s\n", digits, iin_map[mid].iin_name);
+            return &iin_map[mid];
         }
-        i++;
     }
     cli_dbgmsg("Credit card %s did not match an IIN range\n", digits);
     return NULL;
 }
 
+/* returns the first digit at or after idx that doesn't follow another one */
+static const unsigned char *next_digit_run(const unsigned char *buffer, const unsigned char *idx, const unsigned char *end)
+{
+#ifdef DLP_SIMD
+    const __m128i lo = _mm_set1_epi8('0' - 1);
+    const __m128i hi = _mm_set1_epi8('9' + 1);
+    unsigned int prev = (idx > buffer && isdigit(idx[-1]));
+    unsigned int digits, starts;
+    __m128i v;
+
+    /* sixteen bytes at a time; signed compares keep bytes >= 0x80 out */
+    while (end - idx >= 16) {
+        v = _mm_loadu_si128((const __m128i *)idx);
+        digits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+        starts = digits & ~((digits << 1) | prev);
+        if (starts)
+            return idx + __builtin_ctz(starts);
+        prev = digits >> 15;
+        idx += 16;
+    }
+#endif
+    for (; idx < end; idx++)
+        if (isdigit(*idx) && (idx == buffer || !isdigit(idx[-1])))
+            return idx;
+    return end;
+}
+
 int dlp_is_valid_cc(const unsigned char *buffer, int length)
 {
-    int mult = 0;
+    static const int luhn_double[10] = { 0, 2, 4, 6, 8, 1, 3, 5, 7, 9 };
     int sum = 0;
     int i = 0;
-    int val = 0;
     int digits = 0;
+    uint32_t iin_num = 0;
     char cc_digits[20];
     int pad_allowance = MAX_CC_BREAKS;
     const struct iin_map_struct * iin;
@@ -206,6 +242,7 @@ int dlp_is_valid_cc(const unsigned char *buffer, int length)
             break;
 	}
 	cc_digits[digits] = buffer[i];
+	iin_num = iin_num * 10 + (buffer[i] - '0');
 	digits++;
     }
 
@@ -215,7 +252,7 @@ int dlp_is_valid_cc(const unsigned char *buffer, int length)
         return 0;
 
     /* See if it is a valid IIN. */ 
-    iin = get_iin(cc_digits);
+    iin = get_iin(iin_num, cc_digits);
     if (iin == NULL)
          return 0;
 
@@ -235,20 +272,15 @@ int dlp_is_valid_cc(const unsigned char *buffer, int length)
     if(digits < 13 || (i < length && isdigit(buffer[i])))
 	return 0;
 
-    //figure out luhn digits 
-    for(i = digits - 1; i >= 0; i--)
-    {
-	val = cc_digits[i] - '0';
-        if(mult)
-        {
-            if((val *= 2) > 9) val -= 9;
-        }
-	mult = !mult;
-	sum += val;
-    }
+    //figure out luhn digits, every second one from the right is doubled
+    for(i = digits - 1; i > 0; i -= 2)
+	sum += (cc_digits[i] - '0') + luhn_double[cc_digits[i - 1] - '0'];
+    if(i == 0)
+	sum += cc_digits[0] - '0';
 
     if(sum % 10)
 	return 0;
+    cc_digits[digits] = 0;
 
     cli_dbgmsg("Luhn algorithm successful for %s\n", cc_digits);
 
@@ -268,11 +300,12 @@ static int contains_cc(const unsigned char *buffer, int length, int detmode)
 
     end = buffer + length;
     idx = buffer;
-    while(idx < end)
+    while((idx = next_digit_run(buffer, idx, end)) < end)
     {
-        if(isdigit(*idx))
+        /* all the IIN ranges start with 1 to 6 */
+        if(*idx >= '1' && *idx <= '6')
         {
-            if((idx == buffer || !isdigit(idx[-1])) && dlp_is_valid_cc(idx, length - (idx - buffer)) == 1)
+            if(dlp_is_valid_cc(idx, length - (idx - buffer)) == 1)
             {
                 if(detmode == DETECT_MODE_DETECT)
                     return 1;
@@ -399,12 +432,12 @@ static int contains_ssn(const unsigned char *buffer, int length, int format, int
 
     end = buffer + length;
     idx = buffer;
-    while(idx < end)
+    while((idx = next_digit_run(buffer, idx, end)) < end)
     {
-        if(isdigit(*idx))
+        /* check the shape of the number before the full parse */
+        if(format == SSN_FORMAT_HYPHENS ? (end - idx >= 11 && idx[3] == '-' && idx[6] == '-') : (end - idx >= 9 && isdigit(idx[8])))
         {
-            /* check for area number and the first hyphen */
-            if((idx == buffer || !isdigit(idx[-1])) && dlp_is_valid_ssn(idx, length - (idx - buffer), format) == 1)
+            if(dlp_is_valid_ssn(idx, length - (idx - buffer), format) == 1)
             {
                 if(detmode == DETECT_MODE_COUNT)
                 {
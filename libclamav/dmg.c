@@ -114,7 +114,7 @@ int cli_scandmg(cli_ctx *ctx)
         return CL_ENULLARG;
     }
 
-    maplen = (*ctx->fmap)->real_len;
+    maplen = (*ctx->fmap)->len;
     pos = maplen - 512;
     if (pos <= 0) {
         cli_dbgmsg("cli_scandmg: Sizing problem for DMG archive.\n");
@@ -646,98 +646,46 @@ static int dmg_track_sectors(uint64_t *total, uint8_t *data_to_write,
     return ret;
 }
 
-/* Stripe handling: zero block (type 0x0 or 0x2) */
-static int dmg_stripe_zeroes(cli_ctx *ctx, int fd, uint32_t index, struct dmg_mish_with_stripes *mish_set)
-{
-    int ret = CL_CLEAN;
-    size_t len = mish_set->stripes[index].sectorCount * DMG_SECTOR_SIZE;
-    ssize_t written;
-    uint8_t obuf[BUFSIZ];
-
-    UNUSEDPARAM(ctx);
-
-    cli_dbgmsg("dmg_stripe_zeroes: stripe " STDu32 "\n", index);
-    if (len == 0)
-        return CL_CLEAN;
-
-    memset(obuf, 0, sizeof(obuf));
-    while (len > sizeof(obuf)) {
-        written = cli_writen(fd, obuf, sizeof(obuf));
-        if ((size_t)written != sizeof(obuf)) {
-            ret = CL_EWRITE;
-            break;
-        }
-        len -= sizeof(obuf);
-    }
-
-    if ((ret == CL_CLEAN) && (len > 0)) {
-        written = cli_writen(fd, obuf, len);
-        if ((size_t)written != len) {
-            ret = CL_EWRITE;
-        }
-    }
-
-    if (ret != CL_CLEAN) {
-        cli_errmsg("dmg_stripe_zeroes: error writing bytes to file (out of disk space?)\n");
-        return CL_EWRITE;
-    }
-    return CL_CLEAN;
-}
-
 /* Stripe handling: stored block (type 0x1) */
-static int dmg_stripe_store(cli_ctx *ctx, int fd, uint32_t index, struct dmg_mish_with_stripes *mish_set)
+static int dmg_stripe_store(fmap_t *map, const struct dmg_block_data *stripe, uint32_t index, uint8_t *dst, size_t size)
 {
-    const void *obuf;
-    size_t off = mish_set->stripes[index].dataOffset;
-    size_t len = mish_set->stripes[index].dataLength;
-    ssize_t written;
+    const void *ibuf;
+    size_t len = MIN(stripe->dataLength, size);
 
     cli_dbgmsg("dmg_stripe_store: stripe " STDu32 "\n", index);
     if (len == 0)
         return CL_CLEAN;
 
-    obuf = (void *)fmap_need_off_once(*ctx->fmap, off, len);
-    if (!obuf) {
+    ibuf = fmap_need_off_once(map, stripe->dataOffset, len);
+    if (!ibuf) {
         cli_warnmsg("dmg_stripe_store: fmap need failed on stripe " STDu32 "\n", index);
         return CL_EMAP;
     }
-    written = cli_writen(fd, obuf, len);
-    if (written < 0) {
-        cli_errmsg("dmg_stripe_store: error writing bytes to file (out of disk space?)\n");
-        return CL_EWRITE;
-    }
-    else if ((size_t)written != len) {
-        cli_errmsg("dmg_stripe_store: error writing bytes to file (out of disk space?)\n");
-        return CL_EWRITE;
-    }
+    memcpy(dst, ibuf, len);
     return CL_CLEAN;
 }
 
 /* Stripe handling: ADC block (type 0x80000004) */
-static int dmg_stripe_adc(cli_ctx *ctx, int fd, uint32_t index, struct dmg_mish_with_stripes *mish_set)
+static int dmg_stripe_adc(fmap_t *map, const struct dmg_block_data *stripe, uint32_t index, uint8_t *dst, size_t size)
 {
     int adcret;
     adc_stream strm;
-    size_t off = mish_set->stripes[index].dataOffset;
-    size_t len = mish_set->stripes[index].dataLength;
-    uint64_t size_so_far = 0;
-    uint64_t expected_len = mish_set->stripes[index].sectorCount * DMG_SECTOR_SIZE;
-    uint8_t obuf[BUFSIZ];
+    size_t len = stripe->dataLength;
 
     cli_dbgmsg("dmg_stripe_adc: stripe " STDu32 " initial len " STDu64 " expected len " STDu64 "\n",
-            index, (uint64_t)len, (uint64_t)expected_len);
+            index, (uint64_t)len, (uint64_t)size);
     if (len == 0)
         return CL_CLEAN;
 
     memset(&strm, 0, sizeof(strm));
-    strm.next_in = (uint8_t *)fmap_need_off_once(*ctx->fmap, off, len);
+    strm.next_in = (uint8_t *)fmap_need_off_once(map, stripe->dataOffset, len);
     if (!strm.next_in) {
         cli_warnmsg("dmg_stripe_adc: fmap need failed on stripe " STDu32 "\n", index);
         return CL_EMAP;
     }
     strm.avail_in = len;
-    strm.next_out = obuf;
-    strm.avail_out = sizeof(obuf);
+    strm.next_out = dst;
+    strm.avail_out = size;
 
     adcret = adc_decompressInit(&strm);
     if(adcret != ADC_OK) {
@@ -745,81 +693,50 @@ static int dmg_stripe_adc(cli_ctx *ctx, int fd, uint32_t index, struct dmg_mish_
         return CL_EMEM;
     }
 
-    while(adcret == ADC_OK) {
-        int written;
-        if (size_so_far > expected_len) {
-            cli_warnmsg("dmg_stripe_adc: expected size exceeded!\n");
-            adc_decompressEnd(&strm);
-            return CL_EFORMAT;
-        }
+    do {
         adcret = adc_decompress(&strm);
-        switch(adcret) {
-            case ADC_OK:
-                if(strm.avail_out == 0) {
-                    if ((written=cli_writen(fd, obuf, sizeof(obuf)))!=sizeof(obuf)) {
-                        cli_errmsg("dmg_stripe_adc: failed write to output file\n");
-                        adc_decompressEnd(&strm);
-                        return CL_EWRITE;
-                    }
-                    size_so_far += written;
-                    strm.next_out = obuf;
-                    strm.avail_out = sizeof(obuf);
-                }
-                continue;
-            case ADC_STREAM_END:
-            default:
-                written = sizeof(obuf) - strm.avail_out;
-                if (written) {
-                    if ((cli_writen(fd, obuf, written))!=written) {
-                        cli_errmsg("dmg_stripe_adc: failed write to output file\n");
-                        adc_decompressEnd(&strm);
-                        return CL_EWRITE;
-                    }
-                    size_so_far += written;
-                    strm.next_out = obuf;
-                    strm.avail_out = sizeof(obuf);
-                }
-                if (adcret == ADC_STREAM_END)
-                    break;
-                cli_dbgmsg("dmg_stripe_adc: after writing " STDu64 " bytes, "
-                           "got error %d decompressing stripe " STDu32 "\n",
-                           size_so_far, adcret, index);
-                adc_decompressEnd(&strm);
-                return CL_EFORMAT;
-        }
-        break;
-    }
-
+    } while (adcret == ADC_OK && strm.avail_out);
     adc_decompressEnd(&strm);
+
+    if (adcret == ADC_OK && strm.avail_in) {
+        cli_warnmsg("dmg_stripe_adc: expected size exceeded!\n");
+        return CL_EFORMAT;
+    }
+    if (adcret != ADC_OK && adcret != ADC_STREAM_END) {
+        cli_dbgmsg("dmg_stripe_adc: after writing " STDu64 " bytes, "
+                   "got error %d decompressing stripe " STDu32 "\n",
+                   (uint64_t)(size - strm.avail_out), adcret, index);
+        return CL_EFORMAT;
+    }
     cli_dbgmsg("dmg_stripe_adc: stripe " STDu32 " actual len " STDu64 " expected len " STDu64 "\n",
-            index, size_so_far, expected_len);
+            index, (uint64_t)(size - strm.avail_out), (uint64_t)size);
     return CL_CLEAN;
 }
 
 /* Stripe handling: deflate block (type 0x80000005) */
-static int dmg_stripe_inflate(cli_ctx *ctx, int fd, uint32_t index, struct dmg_mish_with_stripes *mish_set)
+static int dmg_stripe_inflate(fmap_t *map, const struct dmg_block_data *stripe, uint32_t index, uint8_t *dst, size_t size)
 {
     int zstat;
     z_stream strm;
-    size_t off = mish_set->stripes[index].dataOffset;
-    size_t len = mish_set->stripes[index].dataLength;
-    uint64_t size_so_far = 0;
-    uint64_t expected_len = mish_set->stripes[index].sectorCount * DMG_SECTOR_SIZE;
-    uint8_t obuf[BUFSIZ];
+    size_t len = stripe->dataLength;
 
     cli_dbgmsg("dmg_stripe_inflate: stripe " STDu32 "\n", index);
     if (len == 0)
         return CL_CLEAN;
+    if (len > UINT_MAX || size > UINT_MAX) {
+        cli_dbgmsg("dmg_stripe_inflate: stripe " STDu32 " too big\n", index);
+        return CL_EFORMAT;
+    }
 
     memset(&strm, 0, sizeof(strm));
-    strm.next_in = (void*)fmap_need_off_once(*ctx->fmap, off, len);
+    strm.next_in = (void*)fmap_need_off_once(map, stripe->dataOffset, len);
     if (!strm.next_in) {
         cli_warnmsg("dmg_stripe_inflate: fmap need failed on stripe " STDu32 "\n", index);
         return CL_EMAP;
     }
     strm.avail_in = len;
-    strm.next_out = obuf;
-    strm.avail_out = sizeof(obuf);
+    strm.next_out = dst;
+    strm.avail_out = size;
 
     zstat = inflateInit(&strm);
     if(zstat != Z_OK) {
@@ -827,62 +744,25 @@ static int dmg_stripe_inflate(cli_ctx *ctx, int fd, uint32_t index, struct dmg_m
         return CL_EMEM;
     }
 
-    while(strm.avail_in) {
-        int written;
-        if (size_so_far > expected_len) {
-            cli_warnmsg("dmg_stripe_inflate: expected size exceeded!\n");
-            inflateEnd(&strm);
-            return CL_EFORMAT;
-        }
-        zstat = inflate(&strm, Z_NO_FLUSH);   /* zlib */
-        switch(zstat) {
-            case Z_OK:
-                if(strm.avail_out == 0) {
-                    if ((written=cli_writen(fd, obuf, sizeof(obuf)))!=sizeof(obuf)) {
-                        cli_errmsg("dmg_stripe_inflate: failed write to output file\n");
-                        inflateEnd(&strm);
-                        return CL_EWRITE;
-                    }
-                    size_so_far += written;
-                    strm.next_out = (Bytef *)obuf;
-                    strm.avail_out = sizeof(obuf);
-                }
-                continue;
-            case Z_STREAM_END:
-            default:
-                written = sizeof(obuf) - strm.avail_out;
-                if (written) {
-                    if ((cli_writen(fd, obuf, written))!=written) {
-                        cli_errmsg("dmg_stripe_inflate: failed write to output file\n");
-                        inflateEnd(&strm);
-                        return CL_EWRITE;
-                    }
-                    size_so_far += written;
-                    strm.next_out = (Bytef *)obuf;
-                    strm.avail_out = sizeof(obuf);
-                    if (zstat == Z_STREAM_END)
-                        break;
-                }
-                if(strm.msg)
-                    cli_dbgmsg("dmg_stripe_inflate: after writing " STDu64 " bytes, "
-                               "got error \"%s\" inflating stripe " STDu32 "\n",
-                               size_so_far, strm.msg, index);
-                else
-                    cli_dbgmsg("dmg_stripe_inflate: after writing " STDu64 " bytes, "
-                               "got error %d inflating stripe " STDu32 "\n",
-                               size_so_far, zstat, index);
-                inflateEnd(&strm);
-                return CL_EFORMAT;
-        }
-        break;
+    /* all the input is there, Z_BUF_ERROR is either a full buffer or a
+     * truncated stream, which is scanned as far as it goes */
+    zstat = inflate(&strm, Z_FINISH);   /* zlib */
+    if (zstat == Z_BUF_ERROR && !strm.avail_out) {
+        cli_warnmsg("dmg_stripe_inflate: expected size exceeded!\n");
+        inflateEnd(&strm);
+        return CL_EFORMAT;
     }
-
-    if(strm.avail_out != sizeof(obuf)) {
-        if(cli_writen(fd, obuf, sizeof(obuf) - strm.avail_out) < 0) {
-            cli_errmsg("dmg_stripe_inflate: failed write to output file\n");
-            inflateEnd(&strm);
-            return CL_EWRITE;
-        }
+    if (zstat != Z_STREAM_END && zstat != Z_BUF_ERROR) {
+        if(strm.msg)
+            cli_dbgmsg("dmg_stripe_inflate: after writing " STDu64 " bytes, "
+                       "got error \"%s\" inflating stripe " STDu32 "\n",
+                       (uint64_t)strm.total_out, strm.msg, index);
+        else
+            cli_dbgmsg("dmg_stripe_inflate: after writing " STDu64 " bytes, "
+                       "got error %d inflating stripe " STDu32 "\n",
+                       (uint64_t)strm.total_out, zstat, index);
+        inflateEnd(&strm);
+        return CL_EFORMAT;
     }
 
     inflateEnd(&strm);
@@ -890,127 +770,275 @@ static int dmg_stripe_inflate(cli_ctx *ctx, int fd, uint32_t index, struct dmg_m
 }
 
 /* Stripe handling: bzip block (type 0x80000006) */
-static int dmg_stripe_bzip(cli_ctx *ctx, int fd, uint32_t index, struct dmg_mish_with_stripes *mish_set)
+static int dmg_stripe_bzip(fmap_t *map, const struct dmg_block_data *stripe, uint32_t index, uint8_t *dst, size_t size)
 {
     int ret = CL_CLEAN;
-    size_t off = mish_set->stripes[index].dataOffset;
-    size_t len = mish_set->stripes[index].dataLength;
-    uint64_t size_so_far = 0;
-    uint64_t expected_len = mish_set->stripes[index].sectorCount * DMG_SECTOR_SIZE;
+    size_t len = stripe->dataLength;
 #if HAVE_BZLIB_H
     int rc;
     bz_stream strm;
-    uint8_t obuf[BUFSIZ];
 #endif
 
     cli_dbgmsg("dmg_stripe_bzip: stripe " STDu32 " initial len " STDu64 " expected len " STDu64 "\n",
-            index, (uint64_t)len, (uint64_t)expected_len);
+            index, (uint64_t)len, (uint64_t)size);
 
 #if HAVE_BZLIB_H
+    if (len > UINT_MAX || size > UINT_MAX) {
+        cli_dbgmsg("dmg_stripe_bzip: stripe " STDu32 " too big\n", index);
+        return CL_EFORMAT;
+    }
+
     memset(&strm, 0, sizeof(strm));
-    strm.next_out = (char *)obuf;
-    strm.avail_out = sizeof(obuf);
+    strm.next_in = (void*)fmap_need_off_once(map, stripe->dataOffset, len);
+    if (strm.next_in == NULL) {
+        cli_dbgmsg("dmg_stripe_bzip: expected more stream\n");
+        return CL_EMAP;
+    }
+    strm.avail_in = len;
+    strm.next_out = (char *)dst;
+    strm.avail_out = size;
     if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
         cli_dbgmsg("dmg_stripe_bzip: bzDecompressInit failed\n");
         return CL_EOPEN;
     }
 
     do {
-        if (size_so_far > expected_len) {
-            cli_warnmsg("dmg_stripe_bzip: expected size exceeded!\n");
-            ret = CL_EFORMAT;
-            break;
-        }
-        if (strm.avail_in == 0) {
-            size_t next_len = (len > sizeof(obuf)) ? sizeof(obuf) : len;
-            dmg_bzipmsg("dmg_stripe_bzip: off %lu len %lu next_len %lu\n", off, len, next_len);
-            strm.next_in = (void*)fmap_need_off_once(*ctx->fmap, off, next_len);
-            if (strm.next_in == NULL) {
-                cli_dbgmsg("dmg_stripe_bzip: expected more stream\n");
-                ret = CL_EMAP;
-                break;
-            }
-            strm.avail_in = next_len;
-            len -= next_len;
-            off += next_len;
-        }
-
-        dmg_bzipmsg("dmg_stripe_bzip: before = strm.avail_in %lu strm.avail_out: %lu\n", strm.avail_in, strm.avail_out);
         rc = BZ2_bzDecompress(&strm);
-        if ((rc != BZ_OK) && (rc != BZ_STREAM_END)) {
-            cli_dbgmsg("dmg_stripe_bzip: decompress error: %d\n", rc);
-            ret = CL_EFORMAT;
-            break;
+    } while (rc == BZ_OK && strm.avail_in && strm.avail_out);
+    dmg_bzipmsg("dmg_stripe_bzip: strm.avail_in %u strm.avail_out: %u rc: %d\n",
+            strm.avail_in, strm.avail_out, rc);
+
+    if ((rc != BZ_OK) && (rc != BZ_STREAM_END)) {
+        cli_dbgmsg("dmg_stripe_bzip: decompress error: %d\n", rc);
+        ret = CL_EFORMAT;
+    }
+    else if (rc == BZ_OK && !strm.avail_out && strm.avail_in) {
+        cli_warnmsg("dmg_stripe_bzip: expected size exceeded!\n");
+        ret = CL_EFORMAT;
+    }
+    else if (strm.avail_out) {
+        cli_dbgmsg("dmg_stripe_bzip: output does not match expected size!\n");
+    }
+
+    BZ2_bzDecompressEnd(&strm);
+#else
+    UNUSEDPARAM(map);
+    UNUSEDPARAM(dst);
+#endif
+
+    return ret;
+}
+
+/* The partition of a mish block is read through a map of its own, the
+ * stripes are only decoded when their sectors are read and the last ones
+ * are kept around, so that nothing is written to disk. Every stripe fills
+ * exactly its sectorCount sectors: short output is padded with zeroes. */
+
+/* decoded stripes kept in memory, beyond the one being read */
+#define DMG_CACHE_SLOTS 8
+#define DMG_CACHE_SIZE  (8 * 1024 * 1024)
+
+struct dmg_extent {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t stripe;
+};
+
+struct dmg_cached {
+    uint8_t *buf;
+    size_t size;
+    uint32_t extent;
+    unsigned int used;
+};
+
+struct dmg_vdev {
+    fmap_t *map;
+    struct dmg_block_data *stripes;
+    struct dmg_extent *extents;
+    uint32_t nextents;
+    struct dmg_cached cache[DMG_CACHE_SLOTS];
+    size_t cached;
+    unsigned int tick;
+    int error;
+};
+
+static const uint8_t *dmg_vdev_stripe(struct dmg_vdev *dev, uint32_t e)
+{
+    const struct dmg_extent *ext = &dev->extents[e];
+    const struct dmg_block_data *stripe = &dev->stripes[ext->stripe];
+    struct dmg_cached *slot = NULL;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < DMG_CACHE_SLOTS; i++) {
+        if (dev->cache[i].buf && dev->cache[i].extent == e) {
+            dev->cache[i].used = ++dev->tick;
+            return dev->cache[i].buf;
         }
+    }
 
-        dmg_bzipmsg("dmg_stripe_bzip: after = strm.avail_in %lu strm.avail_out: %lu rc: %d %d\n",
-                strm.avail_in, strm.avail_out, rc, BZ_STREAM_END);
-        /* Drain output buffer */
-        if (!strm.avail_out) {
-            size_t next_write = sizeof(obuf);
-            do {
-                size_so_far += next_write;
-                dmg_bzipmsg("dmg_stripe_bzip: size_so_far: " STDu64 " next_write: %lu\n", size_so_far, next_write);
-                if (size_so_far > expected_len) {
-                    cli_warnmsg("dmg_stripe_bzip: expected size exceeded!\n");
-                    ret = CL_EFORMAT;
-                    rc = BZ_DATA_ERROR; /* prevent stream end block */
-                    break;
-                }
+    /* make room, the least recently used stripes go first */
+    for (;;) {
+        struct dmg_cached *lru = NULL;
 
-                ret = cli_checklimits("dmg_stripe_bzip", ctx, (unsigned long)(size_so_far + sizeof(obuf)), 0, 0);
-                if (ret != CL_CLEAN) {
-                    break;
-                }
+        slot = NULL;
+        for (i = 0; i < DMG_CACHE_SLOTS; i++) {
+            if (!dev->cache[i].buf)
+                slot = &dev->cache[i];
+            else if (!lru || dev->cache[i].used < lru->used)
+                lru = &dev->cache[i];
+        }
+        if (!lru || (slot && dev->cached + ext->size <= DMG_CACHE_SIZE))
+            break;
+        dev->cached -= lru->size;
+        free(lru->buf);
+        lru->buf = NULL;
+    }
 
-                if ((size_t)cli_writen(fd, obuf, next_write) != next_write) {
-                    cli_dbgmsg("dmg_stripe_bzip: error writing to tmpfile\n");
-                    ret = CL_EWRITE;
-                    break;
-                }
+    if (!(slot->buf = cli_calloc(1, ext->size))) {
+        cli_errmsg("dmg_vdev_stripe: cannot allocate " STDu64 " bytes for stripe " STDu32 "\n",
+                ext->size, ext->stripe);
+        dev->error = CL_EMEM;
+        return NULL;
+    }
+    slot->size = ext->size;
+    slot->extent = e;
+    slot->used = ++dev->tick;
+    dev->cached += slot->size;
 
-                strm.next_out = (char *)obuf;
-                strm.avail_out = sizeof(obuf);
+    switch (stripe->type) {
+        case DMG_STRIPE_ADC:
+            ret = dmg_stripe_adc(dev->map, stripe, ext->stripe, slot->buf, slot->size);
+            break;
+        case DMG_STRIPE_DEFLATE:
+            ret = dmg_stripe_inflate(dev->map, stripe, ext->stripe, slot->buf, slot->size);
+            break;
+        case DMG_STRIPE_BZ:
+            ret = dmg_stripe_bzip(dev->map, stripe, ext->stripe, slot->buf, slot->size);
+            break;
+        default:
+            ret = CL_CLEAN;
+            break;
+    }
+    /* what could be decoded is scanned, the mish block is reported as
+     * broken afterwards */
+    if (ret != CL_CLEAN && !dev->error)
+        dev->error = ret;
+    return slot->buf;
+}
 
-                if (rc == BZ_OK)
-                    rc = BZ2_bzDecompress(&strm);
-                if ((rc != BZ_OK) && (rc != BZ_STREAM_END)) {
-                    cli_dbgmsg("dmg_stripe_bzip: decompress error: %d\n", rc);
-                    ret = CL_EFORMAT;
-                    break;
-                }
-            } while (!strm.avail_out);
+static off_t dmg_vdev_pread(void *handle, void *buf, size_t count, off_t offset)
+{
+    struct dmg_vdev *dev = handle;
+    uint8_t *out = buf;
+    size_t done = 0;
+
+    while (done < count) {
+        uint64_t pos = (uint64_t)offset + done;
+        uint32_t lo = 0, hi = dev->nextents;
+        const struct dmg_extent *ext;
+        const struct dmg_block_data *stripe;
+        size_t skip, len;
+
+        /* the extent holding pos */
+        while (hi - lo > 1) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (dev->extents[mid].offset <= pos)
+                lo = mid;
+            else
+                hi = mid;
         }
-        /* Stream end, so write data if any remains in buffer */
-        if (rc == BZ_STREAM_END) {
-            size_t next_write = sizeof(obuf) - strm.avail_out;
-            size_so_far += next_write;
-            dmg_bzipmsg("dmg_stripe_bzip: size_so_far: " STDu64 " next_write: %lu\n", size_so_far, next_write);
-
-            ret = cli_checklimits("dmg_stripe_bzip", ctx, (unsigned long)(size_so_far + sizeof(obuf)), 0, 0);
-            if (ret != CL_CLEAN) {
+        ext = &dev->extents[lo];
+        if (pos < ext->offset || pos - ext->offset >= ext->size)
+            break;
+        stripe = &dev->stripes[ext->stripe];
+        skip = pos - ext->offset;
+        len = MIN(count - done, ext->size - skip);
+
+        switch (stripe->type) {
+            case DMG_STRIPE_STORED:
+                if (skip < stripe->dataLength) {
+                    size_t n = MIN(len, stripe->dataLength - skip);
+                    const void *src = fmap_need_off_once(dev->map, stripe->dataOffset + skip, n);
+
+                    if (!src) {
+                        cli_warnmsg("dmg_vdev_pread: fmap need failed on stripe " STDu32 "\n", ext->stripe);
+                        if (!dev->error)
+                            dev->error = CL_EMAP;
+                        n = 0;
+                    }
+                    else {
+                        memcpy(out + done, src, n);
+                    }
+                    memset(out + done + n, 0, len - n);
+                }
+                else {
+                    memset(out + done, 0, len);
+                }
                 break;
-            }
+            case DMG_STRIPE_ADC:
+            case DMG_STRIPE_DEFLATE:
+            case DMG_STRIPE_BZ: {
+                const uint8_t *src = dmg_vdev_stripe(dev, lo);
 
-            if ((size_t)cli_writen(fd, obuf, next_write) != next_write) {
-                cli_dbgmsg("dmg_stripe_bzip: error writing to tmpfile\n");
-                ret = CL_EWRITE;
+                if (!src)
+                    return -1;
+                memcpy(out + done, src + skip, len);
                 break;
             }
-
-            strm.next_out = (char *)obuf;
-            strm.avail_out = sizeof(obuf);
+            default:
+                memset(out + done, 0, len);
+                break;
         }
-    } while ((rc == BZ_OK) && (len > 0));
+        done += len;
+    }
+    return done;
+}
 
-    BZ2_bzDecompressEnd(&strm);
-#endif
+static void dmg_vdev_free(struct dmg_vdev *dev)
+{
+    unsigned int i;
 
-    if (ret == CL_CLEAN) {
-        if (size_so_far != expected_len) {
-            cli_dbgmsg("dmg_stripe_bzip: output does not match expected size!\n");
+    for (i = 0; i < DMG_CACHE_SLOTS; i++)
+        free(dev->cache[i].buf);
+    free(dev->extents);
+}
+
+/* Dump the partition for --leave-temps and scan the file */
+static int dmg_dump_partition(cli_ctx *ctx, fmap_t *vmap, const char *outfile)
+{
+    int ret = CL_CLEAN, ofd;
+    size_t off;
+
+    ofd = open(outfile, O_RDWR|O_CREAT|O_EXCL|O_TRUNC|O_BINARY, 0600);
+    if (ofd < 0) {
+        char err[128];
+        cli_errmsg("cli_scandmg: Can't create temporary file %s: %s\n", 
+            outfile, cli_strerror(errno, err, sizeof(err)));
+        return CL_ETMPFILE;
+    }
+    cli_dbgmsg("dmg_handle_mish: extracting to %s\n", outfile);
+
+    for (off = 0; off < vmap->len; off += FILEBUFF) {
+        size_t len = MIN(FILEBUFF, vmap->len - off);
+        const void *data = fmap_need_off_once(vmap, off, len);
+
+        if (!data) {
+            ret = CL_EMAP;
+            break;
+        }
+        if ((size_t)cli_writen(ofd, data, len) != len) {
+            cli_errmsg("dmg_handle_mish: error writing bytes to file (out of disk space?)\n");
+            ret = CL_EWRITE;
+            break;
         }
     }
+
+    /* If okay so far, scan rebuilt partition */
+    if (ret == CL_CLEAN)
+        ret = cli_partition_scandesc(ofd, ctx);
+
+    close(ofd);
     return ret;
 }
 
@@ -1019,12 +1047,14 @@ static int dmg_handle_mish(cli_ctx *ctx, unsigned int mishblocknum, char *dir,
         uint64_t xmlOffset, struct dmg_mish_with_stripes *mish_set)
 {
     struct dmg_block_data *blocklist = mish_set->stripes;
-    uint64_t totalSectors = 0;
+    uint64_t totalSectors = 0, offset = 0;
     uint32_t i;
     unsigned long projected_size;
-    int ret = CL_CLEAN, ofd;
+    int ret = CL_CLEAN;
     uint8_t sorted = 1, writeable_data = 0;
     char outfile[NAME_MAX + 1];
+    struct dmg_vdev dev;
+    fmap_t *vmap;
 
     /* First loop, fix endian-ness and check if already sorted */
     for (i = 0; i < mish_set->mish->blockDataCount; i++) {
@@ -1063,8 +1093,9 @@ static int dmg_handle_mish(cli_ctx *ctx, unsigned int mishblocknum, char *dir,
         cli_dbgmsg("dmg_handle_mish: no data to output\n");
         return CL_CLEAN;
     }
-    else if (totalSectors > (ULONG_MAX / DMG_SECTOR_SIZE)) {
-        /* cli_checklimits only takes unsigned long for now */
+    else if (totalSectors > (ULONG_MAX / DMG_SECTOR_SIZE) || totalSectors > INT_MAX / DMG_SECTOR_SIZE) {
+        /* cli_checklimits only takes unsigned long for now, and the
+         * partition map has to be addressable by fmap */
         cli_warnmsg("dmg_handle_mish: mish block %u too big to handle (for now)", mishblocknum);
         return CL_CLEAN;
     }
@@ -1076,36 +1107,30 @@ static int dmg_handle_mish(cli_ctx *ctx, unsigned int mishblocknum, char *dir,
         return ret;
     }
 
-    /* Prepare for file */
-    snprintf(outfile, sizeof(outfile)-1, "%s"PATHSEP"dmg%02u", dir, mishblocknum);
-    outfile[sizeof(outfile)-1] = '\0';
-    ofd = open(outfile, O_RDWR|O_CREAT|O_EXCL|O_TRUNC|O_BINARY, 0600);
-    if (ofd < 0) {
-        char err[128];
-        cli_errmsg("cli_scandmg: Can't create temporary file %s: %s\n", 
-            outfile, cli_strerror(errno, err, sizeof(err)));
-        return CL_ETMPFILE;
+    /* Lay the stripes out, in order, on the partition */
+    memset(&dev, 0, sizeof(dev));
+    dev.map = *ctx->fmap;
+    dev.stripes = blocklist;
+    dev.extents = cli_malloc(mish_set->mish->blockDataCount * sizeof(*dev.extents));
+    if (!dev.extents) {
+        cli_errmsg("dmg_handle_mish: cannot allocate the stripe table\n");
+        return CL_EMEM;
     }
-    cli_dbgmsg("dmg_handle_mish: extracting block %u to %s\n", mishblocknum, outfile);
-
-    /* Push data, stripe by stripe */
-    for(i=0; i < mish_set->mish->blockDataCount && ret == CL_CLEAN; i++) {
+    for (i = 0; i < mish_set->mish->blockDataCount; i++) {
         switch (blocklist[i].type) {
             case DMG_STRIPE_EMPTY:
             case DMG_STRIPE_ZEROES:
-                ret = dmg_stripe_zeroes(ctx, ofd, i, mish_set);
-                break;
             case DMG_STRIPE_STORED:
-                ret = dmg_stripe_store(ctx, ofd, i, mish_set);
-                break;
             case DMG_STRIPE_ADC:
-                ret = dmg_stripe_adc(ctx, ofd, i, mish_set);
-                break;
             case DMG_STRIPE_DEFLATE:
-                ret = dmg_stripe_inflate(ctx, ofd, i, mish_set);
-                break;
             case DMG_STRIPE_BZ:
-                ret = dmg_stripe_bzip(ctx, ofd, i, mish_set);
+                if (!blocklist[i].sectorCount)
+                    break;
+                dev.extents[dev.nextents].offset = offset;
+                dev.extents[dev.nextents].size = blocklist[i].sectorCount * DMG_SECTOR_SIZE;
+                dev.extents[dev.nextents].stripe = i;
+                dev.nextents++;
+                offset += blocklist[i].sectorCount * DMG_SECTOR_SIZE;
                 break;
             case DMG_STRIPE_SKIP:
             case DMG_STRIPE_END:
@@ -1115,15 +1140,29 @@ static int dmg_handle_mish(cli_ctx *ctx, unsigned int mishblocknum, char *dir,
         }
     }
 
-    /* If okay so far, scan rebuilt partition */
-    if (ret == CL_CLEAN) {
-        ret = cli_partition_scandesc(ofd, ctx);
+    vmap = cl_fmap_open_handle(&dev, 0, projected_size, dmg_vdev_pread, 1);
+    if (!vmap) {
+        cli_errmsg("dmg_handle_mish: cannot map the partition of block %u\n", mishblocknum);
+        dmg_vdev_free(&dev);
+        return CL_EMEM;
     }
 
-    close(ofd);
-    if (!ctx->engine->keeptmp)
-        if (cli_unlink(outfile)) return CL_EUNLINK;
-    
+    if (ctx->engine->keeptmp) {
+        snprintf(outfile, sizeof(outfile)-1, "%s"PATHSEP"dmg%02u", dir, mishblocknum);
+        outfile[sizeof(outfile)-1] = '\0';
+        ret = dmg_dump_partition(ctx, vmap, outfile);
+    }
+    else {
+        cli_dbgmsg("dmg_handle_mish: scanning block %u in place\n", mishblocknum);
+        ret = cli_map_scan(vmap, 0, projected_size, ctx, CL_TYPE_PART_ANY);
+    }
+
+    funmap(vmap);
+    if (ret == CL_CLEAN && dev.error) {
+        cli_dbgmsg("dmg_handle_mish: block %u did not decode: %s\n", mishblocknum, cl_strerror(dev.error));
+        ret = dev.error;
+    }
+    dmg_vdev_free(&dev);
     return ret;
 }
 
@@ -39,6 +39,7 @@
 #include "clamav.h"
 #include "execs.h"
 #include "matcher.h"
+#include "fmap.h"
 
 #define EC16(v, conv)   (conv ? cbswap16(v) : v)
 #define EC32(v, conv)   (conv ? cbswap32(v) : v)
@@ -87,7 +88,7 @@ static uint64_t cli_rawaddr64(uint64_t vaddr, struct elf_program_hdr64 *ph, uint
 }
 
 /* Return converted endian-fixed header, or error code */
-static int cli_elf_fileheader(cli_ctx *ctx, fmap_t *map, union elf_file_hdr *file_hdr,
+static int cli_elf_fileheader(fmap_t *map, union elf_file_hdr *file_hdr,
     uint8_t *do_convert, uint8_t *is64)
 {
 	uint8_t format64, conv;
@@ -115,30 +116,24 @@ static int cli_elf_fileheader(cli_ctx *ctx, fmap_t *map, union elf_file_hdr *fil
 	    break;
         default:
 	    cli_dbgmsg("ELF: Unknown ELF class (%u)\n", file_hdr->hdr64.e_ident[4]);
-	    if (ctx)
-	      cli_append_virus(ctx, "Heuristics.Broken.Executable");
-	    return CL_VIRUS;
+	    return CL_VIRUS; /* Heuristics.Broken.Executable for cli_scanelf() */
     }
 
     /* Need to know to endian convert */
     if(file_hdr->hdr64.e_ident[5] == 1) {
 #if WORDS_BIGENDIAN == 0
-	if(ctx)
-            cli_dbgmsg("ELF: File is little-endian - conversion not required\n");
+	cli_dbgmsg("ELF: File is little-endian - conversion not required\n");
 	conv = 0;
 #else
-	if(ctx)
-            cli_dbgmsg("ELF: File is little-endian - data conversion enabled\n");
+	cli_dbgmsg("ELF: File is little-endian - data conversion enabled\n");
 	conv = 1;
 #endif
     } else {
 #if WORDS_BIGENDIAN == 0
-	if(ctx)
-            cli_dbgmsg("ELF: File is big-endian - data conversion enabled\n");
+	cli_dbgmsg("ELF: File is big-endian - data conversion enabled\n");
 	conv = 1;
 #else
-	if(ctx)
-            cli_dbgmsg("ELF: File is big-endian - conversion not required\n");
+	cli_dbgmsg("ELF: File is big-endian - conversion not required\n");
 	conv = 0;
 #endif
     }
@@ -194,8 +189,110 @@ static int cli_elf_fileheader(cli_ctx *ctx, fmap_t *map, union elf_file_hdr *fil
     return CL_CLEAN;
 }
 
+/* The file header and the raw program and section header tables of the ELF
+ * file, read once for cli_scanelf() and cli_elfheader() */
+struct elf_headers {
+    size_t off, len; /* the extent of the map they were read for */
+    int ret; /* of cli_elf_fileheader() */
+    union elf_file_hdr file_hdr;
+    uint8_t conv, is64;
+    /* entries that could be read, see elf_read_headers() */
+    uint16_t nph, nsh;
+    void *ph, *sh;
+};
+
+/* Returns the number of entries that could be read */
+static uint16_t elf_read_table(fmap_t *map, void *table, uint64_t off, uint16_t num, size_t entsize, uint8_t is64)
+{
+    uint16_t i;
+
+    for(i = 0; i < num; i++, off += entsize) {
+        if(!is64)
+            off = (uint32_t)off; /* as the 32-bit offsets wrapped before */
+        if(off != (size_t)off || fmap_readn(map, (char *)table + i * entsize, off, entsize) != entsize)
+            break;
+    }
+    return i;
+}
+
+static struct elf_headers *elf_read_headers(fmap_t *map)
+{
+    struct elf_headers hdr, *h;
+    size_t phsize, shsize;
+    uint64_t phoff = 0, shoff = 0;
+    uint16_t phnum = 0, shnum = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ret = cli_elf_fileheader(map, &hdr.file_hdr, &hdr.conv, &hdr.is64);
+    phsize = hdr.is64 ? sizeof(struct elf_program_hdr64) : sizeof(struct elf_program_hdr32);
+    shsize = hdr.is64 ? sizeof(struct elf_section_hdr64) : sizeof(struct elf_section_hdr32);
+
+    /* only the tables the ph/sh functions below go on to walk */
+    if(hdr.ret == CL_CLEAN) {
+        if(hdr.is64) {
+            struct elf_file_hdr64 *fh = &hdr.file_hdr.hdr64;
+
+            if(fh->e_phnum <= 128 && fh->e_entry && fh->e_phentsize == phsize) {
+                phnum = fh->e_phnum;
+                phoff = fh->e_phoff;
+            }
+            if(fh->e_shnum <= 2048 && fh->e_shentsize == shsize) {
+                shnum = fh->e_shnum;
+                shoff = fh->e_shoff;
+            }
+        } else {
+            struct elf_file_hdr32 *fh = &hdr.file_hdr.hdr32.hdr;
+
+            if(fh->e_phnum <= 128 && fh->e_entry && fh->e_phentsize == phsize) {
+                phnum = fh->e_phnum;
+                phoff = fh->e_phoff;
+            }
+            if(fh->e_shnum <= 2048 && fh->e_shentsize == shsize) {
+                shnum = fh->e_shnum;
+                shoff = fh->e_shoff;
+            }
+        }
+        /* entries past the end of the map can't be read anyway */
+        if(phnum > map->len / phsize)
+            phnum = map->len / phsize;
+        if(shnum > map->len / shsize)
+            shnum = map->len / shsize;
+    }
+
+    if(!(h = cli_malloc(sizeof(*h) + phnum * phsize + shnum * shsize))) {
+        cli_errmsg("ELF: Can't allocate memory for the headers\n");
+        return NULL;
+    }
+    memcpy(h, &hdr, sizeof(*h));
+    h->ph = h + 1;
+    h->sh = (char *)h->ph + phnum * phsize;
+    h->nph = elf_read_table(map, h->ph, phoff, phnum, phsize, h->is64);
+    h->nsh = elf_read_table(map, h->sh, shoff, shnum, shsize, h->is64);
+    return h;
+}
+
+/* Returns the headers of the ELF file at the start of the map, reading them
+ * on the first call for the current extent of the map; NULL if out of
+ * memory */
+static struct elf_headers *elf_headers(fmap_t *map)
+{
+    struct elf_headers *h = map->elfheaders;
+
+    if(h && h->off == map->nested_offset && h->len == map->len)
+        return h;
+    free(map->elfheaders);
+    map->elfheaders = NULL;
+
+    if(!(h = elf_read_headers(map)))
+        return NULL;
+    h->off = map->nested_offset;
+    h->len = map->len;
+    map->elfheaders = h;
+    return h;
+}
+
 /* Read 32-bit program headers */
-static int cli_elf_ph32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
+static int cli_elf_ph32(cli_ctx *ctx, const struct elf_headers *h, struct cli_exe_info *elfinfo,
     struct elf_file_hdr32 *file_hdr, uint8_t conv)
 {
 	struct elf_program_hdr32 *program_hdr = NULL;
@@ -234,29 +331,17 @@ static int cli_elf_ph32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
             cli_dbgmsg("ELF: Program header table offset: %u\n", phoff);
         }
 
-        if(phnum) {
-            program_hdr = (struct elf_program_hdr32 *) cli_calloc(phnum, sizeof(struct elf_program_hdr32));
-            if(!program_hdr) {
-                cli_errmsg("ELF: Can't allocate memory for program headers\n");
-                return CL_EMEM;
-            }
-            if(ctx) {
-                cli_dbgmsg("------------------------------------\n");
-            }
+        program_hdr = (struct elf_program_hdr32 *) h->ph;
+        if(ctx) {
+            cli_dbgmsg("------------------------------------\n");
         }
 
         for(i = 0; i < phnum; i++) {
-            err = 0;
-            if(fmap_readn(map, &program_hdr[i], phoff, sizeof(struct elf_program_hdr32)) != sizeof(struct elf_program_hdr32))
-                err = 1;
-            phoff += sizeof(struct elf_program_hdr32);
-
-            if(err) {
+            if(i >= h->nph) {
                 cli_dbgmsg("ELF: Can't read segment #%d\n", i);
                 if(ctx) {
                     cli_dbgmsg("ELF: Possibly broken ELF file\n");
                 }
-                free(program_hdr);
                 if(ctx && DETECT_BROKEN) {
                     cli_append_virus(ctx, "Heuristics.Broken.Executable");
                     return CL_VIRUS;
@@ -276,7 +361,6 @@ static int cli_elf_ph32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
         }
 
         fentry = cli_rawaddr32(entry, program_hdr, phnum, conv, &err);
-        free(program_hdr);
         if(err) {
             cli_dbgmsg("ELF: Can't calculate file offset of entry point\n");
             if(ctx && DETECT_BROKEN) {
@@ -299,7 +383,7 @@ static int cli_elf_ph32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
 }
 
 /* Read 64-bit program headers */
-static int cli_elf_ph64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
+static int cli_elf_ph64(cli_ctx *ctx, const struct elf_headers *h, struct cli_exe_info *elfinfo,
     struct elf_file_hdr64 *file_hdr, uint8_t conv)
 {
 	struct elf_program_hdr64 *program_hdr = NULL;
@@ -338,29 +422,17 @@ static int cli_elf_ph64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
             cli_dbgmsg("ELF: Program header table offset: " STDu64 "\n", phoff);
         }
 
-        if(phnum) {
-            program_hdr = (struct elf_program_hdr64 *) cli_calloc(phnum, sizeof(struct elf_program_hdr64));
-            if(!program_hdr) {
-                cli_errmsg("ELF: Can't allocate memory for program headers\n");
-                return CL_EMEM;
-            }
-            if(ctx) {
-                cli_dbgmsg("------------------------------------\n");
-            }
+        program_hdr = (struct elf_program_hdr64 *) h->ph;
+        if(ctx) {
+            cli_dbgmsg("------------------------------------\n");
         }
 
         for(i = 0; i < phnum; i++) {
-            err = 0;
-            if(fmap_readn(map, &program_hdr[i], phoff, sizeof(struct elf_program_hdr64)) != sizeof(struct elf_program_hdr64))
-                err = 1;
-            phoff += sizeof(struct elf_program_hdr64);
-
-            if(err) {
+            if(i >= h->nph) {
                 cli_dbgmsg("ELF: Can't read segment #%d\n", i);
                 if(ctx) {
                     cli_dbgmsg("ELF: Possibly broken ELF file\n");
                 }
-                free(program_hdr);
                 if(ctx && DETECT_BROKEN) {
                     cli_append_virus(ctx, "Heuristics.Broken.Executable");
                     return CL_VIRUS;
@@ -380,7 +452,6 @@ static int cli_elf_ph64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
         }
 
         fentry = cli_rawaddr64(entry, program_hdr, phnum, conv, &err);
-        free(program_hdr);
         if(err) {
             cli_dbgmsg("ELF: Can't calculate file offset of entry point\n");
             if(ctx && DETECT_BROKEN) {
@@ -403,7 +474,7 @@ static int cli_elf_ph64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
 }
 
 /* 32-bit version of section header parsing */
-static int cli_elf_sh32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
+static int cli_elf_sh32(cli_ctx *ctx, const struct elf_headers *h, struct cli_exe_info *elfinfo,
     struct elf_file_hdr32 *file_hdr, uint8_t conv)
 {
 	struct elf_section_hdr32 *section_hdr = NULL;
@@ -451,31 +522,20 @@ static int cli_elf_sh32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
         }
     }
 
-    if(shnum) {
-	section_hdr = (struct elf_section_hdr32 *) cli_calloc(shnum, shentsize);
-	if(!section_hdr) {
-	    cli_errmsg("ELF: Can't allocate memory for section headers\n");
-	    if(elfinfo) {
-                free(elfinfo->section);
-                elfinfo->section = NULL;
-	    }
-	    return CL_EMEM;
-	}
-	if(ctx) {
-            cli_dbgmsg("------------------------------------\n");
-	}
+    section_hdr = (struct elf_section_hdr32 *) h->sh;
+    if(shnum && ctx) {
+        cli_dbgmsg("------------------------------------\n");
     }
 
     /* Loop over section headers */
     for(i = 0; i < shnum; i++) {
         uint32_t sh_type, sh_flags;
 
-	if(fmap_readn(map, &section_hdr[i], shoff, sizeof(struct elf_section_hdr32)) != sizeof(struct elf_section_hdr32)) {
+	if(i >= h->nsh) {
             cli_dbgmsg("ELF: Can't read section header\n");
             if(ctx) {
                 cli_dbgmsg("ELF: Possibly broken ELF file\n");
             }
-            free(section_hdr);
             if(elfinfo) {
                 free(elfinfo->section);
                 elfinfo->section = NULL;
@@ -487,8 +547,6 @@ static int cli_elf_sh32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
             return CL_BREAK;
         }
 
-	shoff += sizeof(struct elf_section_hdr32);
-
         if(elfinfo) {
             elfinfo->section[i].rva = EC32(section_hdr[i].sh_addr, conv);
             elfinfo->section[i].raw = EC32(section_hdr[i].sh_offset, conv);
@@ -507,12 +565,11 @@ static int cli_elf_sh32(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
         }
     }
 
-    free(section_hdr);
     return CL_CLEAN;
 }
 
 /* 64-bit version of section header parsing */
-static int cli_elf_sh64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
+static int cli_elf_sh64(cli_ctx *ctx, const struct elf_headers *h, struct cli_exe_info *elfinfo,
     struct elf_file_hdr64 *file_hdr, uint8_t conv)
 {
 	struct elf_section_hdr64 *section_hdr = NULL;
@@ -561,31 +618,20 @@ static int cli_elf_sh64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
         }
     }
 
-    if(shnum) {
-	section_hdr = (struct elf_section_hdr64 *) cli_calloc(shnum, shentsize);
-	if(!section_hdr) {
-	    cli_errmsg("ELF: Can't allocate memory for section headers\n");
-	    if(elfinfo) {
-                free(elfinfo->section);
-                elfinfo->section = NULL;
-	    }
-	    return CL_EMEM;
-	}
-	if(ctx) {
-            cli_dbgmsg("------------------------------------\n");
-	}
+    section_hdr = (struct elf_section_hdr64 *) h->sh;
+    if(shnum && ctx) {
+        cli_dbgmsg("------------------------------------\n");
     }
 
     /* Loop over section headers */
     for(i = 0; i < shnum; i++) {
         uint32_t sh_type, sh_flags;
 
-	if(fmap_readn(map, &section_hdr[i], shoff, sizeof(struct elf_section_hdr64)) != sizeof(struct elf_section_hdr64)) {
+	if(i >= h->nsh) {
             cli_dbgmsg("ELF: Can't read section header\n");
             if(ctx) {
                 cli_dbgmsg("ELF: Possibly broken ELF file\n");
             }
-            free(section_hdr);
             if(elfinfo) {
                 free(elfinfo->section);
                 elfinfo->section = NULL;
@@ -597,8 +643,6 @@ static int cli_elf_sh64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
             return CL_BREAK;
         }
 
-	shoff += sizeof(struct elf_section_hdr64);
-
         if(elfinfo) {
             elfinfo->section[i].rva = EC64(section_hdr[i].sh_addr, conv);
             elfinfo->section[i].raw = EC64(section_hdr[i].sh_offset, conv);
@@ -617,7 +661,6 @@ static int cli_elf_sh64(cli_ctx *ctx, fmap_t *map, struct cli_exe_info *elfinfo,
         }
     }
 
-    free(section_hdr);
     return CL_CLEAN;
 }
 
@@ -693,21 +736,30 @@ static void cli_elf_sectionlog(uint32_t sh_type, uint32_t sh_flags)
 /* Scan function for ELF */
 int cli_scanelf(cli_ctx *ctx)
 {
+	struct elf_headers *h;
 	union elf_file_hdr file_hdr;
-	fmap_t *map = *ctx->fmap;
 	int ret;
 	uint8_t conv = 0, is64 = 0;
 
     cli_dbgmsg("in cli_scanelf\n");
 
     /* Load header to determine size and class */
-    ret = cli_elf_fileheader(ctx, map, &file_hdr, &conv, &is64);
+    if(!(h = elf_headers(*ctx->fmap)))
+	return CL_EMEM;
+    ret = h->ret;
     if(ret == CL_BREAK) {
 	return CL_CLEAN; /* here, break means "exit but report clean" */
     }
+    else if(ret == CL_VIRUS) {
+	cli_append_virus(ctx, "Heuristics.Broken.Executable");
+	return ret;
+    }
     else if(ret != CL_CLEAN) {
 	return ret;
     }
+    file_hdr = h->file_hdr;
+    conv = h->conv;
+    is64 = h->is64;
 
     /* Log File type and machine type */
     switch(file_hdr.hdr64.e_type) {
@@ -783,10 +835,10 @@ int cli_scanelf(cli_ctx *ctx)
 
     /* Program headers and Entry */
     if(is64) {
-        ret = cli_elf_ph64(ctx, map, NULL, &(file_hdr.hdr64), conv);
+        ret = cli_elf_ph64(ctx, h, NULL, &(file_hdr.hdr64), conv);
     }
     else {
-        ret = cli_elf_ph32(ctx, map, NULL, &(file_hdr.hdr32.hdr), conv);
+        ret = cli_elf_ph32(ctx, h, NULL, &(file_hdr.hdr32.hdr), conv);
     }
     if(ret == CL_BREAK) {
 	return CL_CLEAN; /* break means "exit but report clean" */
@@ -797,10 +849,10 @@ int cli_scanelf(cli_ctx *ctx)
 
     /* Sections */
     if(is64) {
-        ret = cli_elf_sh64(ctx, map, NULL, &(file_hdr.hdr64), conv);
+        ret = cli_elf_sh64(ctx, h, NULL, &(file_hdr.hdr64), conv);
     }
     else {
-        ret = cli_elf_sh32(ctx, map, NULL, &(file_hdr.hdr32.hdr), conv);
+        ret = cli_elf_sh32(ctx, h, NULL, &(file_hdr.hdr32.hdr), conv);
     }
     if(ret == CL_BREAK) {
 	return CL_CLEAN; /* break means "exit but report clean" */
@@ -817,23 +869,26 @@ int cli_scanelf(cli_ctx *ctx)
  */
 int cli_elfheader(fmap_t *map, struct cli_exe_info *elfinfo)
 {
+	struct elf_headers *h;
 	union elf_file_hdr file_hdr;
 	uint8_t conv = 0, is64 = 0;
     int ret;
 
     cli_dbgmsg("in cli_elfheader\n");
 
-    ret = cli_elf_fileheader(NULL, map, &file_hdr, &conv, &is64);
-    if(ret != CL_CLEAN) {
+    if(!(h = elf_headers(map)) || h->ret != CL_CLEAN) {
 	return -1;
     }
+    file_hdr = h->file_hdr;
+    conv = h->conv;
+    is64 = h->is64;
 
     /* Program headers and Entry */
     if(is64) {
-        ret = cli_elf_ph64(NULL, map, elfinfo, &(file_hdr.hdr64), conv);
+        ret = cli_elf_ph64(NULL, h, elfinfo, &(file_hdr.hdr64), conv);
     }
     else {
-        ret = cli_elf_ph32(NULL, map, elfinfo, &(file_hdr.hdr32.hdr), conv);
+        ret = cli_elf_ph32(NULL, h, elfinfo, &(file_hdr.hdr32.hdr), conv);
     }
     if(ret != CL_CLEAN) {
 	return -1;
@@ -841,10 +896,10 @@ int cli_elfheader(fmap_t *map, struct cli_exe_info *elfinfo)
 
     /* Section Headers */
     if(is64) {
-        ret = cli_elf_sh64(NULL, map, elfinfo, &(file_hdr.hdr64), conv);
+        ret = cli_elf_sh64(NULL, h, elfinfo, &(file_hdr.hdr64), conv);
     }
     else {
-        ret = cli_elf_sh32(NULL, map, elfinfo, &(file_hdr.hdr32.hdr), conv);
+        ret = cli_elf_sh32(NULL, h, elfinfo, &(file_hdr.hdr32.hdr), conv);
     }
     if(ret != CL_CLEAN) {
 	return -1;
@@ -23,57 +23,57 @@
 
 #include <hashtab.h>
 static struct cli_element aliases_htable_elements[] = {
+	{"UTF32", 0, 5},
+	{"10646-1:1993/UCS4", 0, 17},
+	{"UTF-32", 0, 6},
 	{NULL,0,0},
 	{NULL,0,0},
 	{NULL,0,0},
 	{NULL,0,0},
-	{"UTF32BE", 3, 7},
 	{NULL,0,0},
 	{NULL,0,0},
-	{"UTF-16LE", 7, 8},
 	{NULL,0,0},
 	{NULL,0,0},
-	{"UCS-4BE", 3, 7},
-	{"UTF32LE", 2, 7},
 	{NULL,0,0},
-	{"ISO-10646/UTF8", 8, 14},
 	{NULL,0,0},
-	{"UTF-16BE", 6, 8},
-	{"UTF-32BE", 3, 8},
 	{NULL,0,0},
 	{NULL,0,0},
-	{"UCS2", 1, 4},
-	{"UTF16BE", 6, 7},
 	{NULL,0,0},
-	{"UTF32", 0, 5},
-	{"UCS-4", 0, 5},
-	{"UTF-16", 1, 6},
+	{"UTF32BE", 3, 7},
+	{"UTF-16LE", 7, 8},
+	{"ISO-10646/UTF8", 8, 14},
+	{"UTF-16BE", 6, 8},
+	{"UTF16BE", 6, 7},
+	{"UTF-8", 8, 5},
+	{"ISO-10646/UTF-8", 8, 15},
+	{"UCS4", 0, 4},
+	{"ISO-10646", 0, 9},
+	{"UTF-32LE", 2, 8},
+	{"UTF8", 8, 4},
+	{"10646-1:1993", 0, 12},
 	{NULL,0,0},
 	{NULL,0,0},
 	{NULL,0,0},
 	{NULL,0,0},
+	{"UTF32LE", 2, 7},
+	{"UTF-32BE", 3, 8},
+	{"UCS2", 1, 4},
+	{"UCS-4", 0, 5},
+	{"UTF-16", 1, 6},
+	{"UTF16LE", 7, 7},
+	{"UCS-4LE", 2, 7},
+	{"ISO-10646/UCS4", 0, 14},
 	{NULL,0,0},
-	{"ISO-10646/UCS2", 1, 14},
 	{NULL,0,0},
 	{NULL,0,0},
-	{"UTF-8", 8, 5},
-	{"ISO-10646/UTF-8", 8, 15},
-	{"UCS4", 0, 4},
-	{"10646-1:1993/UCS4", 0, 17},
 	{NULL,0,0},
 	{NULL,0,0},
-	{"UTF16LE", 7, 7},
-	{"UCS-4LE", 2, 7},
-	{"ISO-10646", 0, 9},
-	{"UTF-32LE", 2, 8},
-	{"UTF8", 8, 4},
-	{"ISO-10646/UCS4", 0, 14},
 	{NULL,0,0},
 	{NULL,0,0},
 	{NULL,0,0},
+	{"UCS-4BE", 3, 7},
+	{"ISO-10646/UCS2", 1, 14},
 	{NULL,0,0},
-	{"10646-1:1993", 0, 12},
-	{"UTF-32", 0, 6},
 	{NULL,0,0},
 	{NULL,0,0},
 	{NULL,0,0},
@@ -88,6 +88,12 @@ static struct cli_element aliases_htable_elements[] = {
 	{NULL,0,0},
 	{NULL,0,0},
 };
+static unsigned char aliases_htable_ctrl[] = {
+	0x6f, 0x66, 0x4a, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x14, 0x7f, 0x3d, 0x1a, 0x07, 0x34, 0x5f, 0x1b, 0x78, 0x1e, 0x7c, 0x3b, 0x80, 0x80, 0x80, 0x80,
+	0x6b, 0x52, 0x39, 0x2d, 0x0c, 0x68, 0x58, 0x3e, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	0x68, 0x41, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
 const struct cli_hashtable aliases_htable = {
-	aliases_htable_elements, 64, 25, 51
+	aliases_htable_elements, aliases_htable_ctrl, 64, 25, 0, 56
 };
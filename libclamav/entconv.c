@@ -558,8 +558,7 @@ static void iconv_cache_destroy(struct iconv_cache* cache)
 		cli_dbgmsg(MODULE_NAME "closing iconv:%p\n",cache->tab[i]);
 		iconv_close(cache->tab[i]);
 	}
-	cli_hashtab_clear(&cache->hashtab);
-	free(cache->hashtab.htable);
+	cli_hashtab_free(&cache->hashtab);
 	free(cache->tab);
 	free(cache);
 }
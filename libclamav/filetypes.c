@@ -175,6 +175,65 @@ void cli_ftfree(const struct cl_engine *engine)
 	mpool_free(engine->mempool, pt->tname);
 	mpool_free(engine->mempool, pt);
     }
+
+    if(engine->ftindex)
+	mpool_free(engine->mempool, engine->ftindex);
+}
+
+/* The static magic (engine->ftypes) by the first byte of the file: under
+ * each byte the entries which can match a buffer starting with it, in list
+ * order. An entry at offset 0 only appears under the first byte of its
+ * magic, the few others under every byte. */
+struct cli_ftindex {
+    uint32_t start[257];
+    const struct cli_ftype *entry[1];
+};
+
+static inline int ftindex_has(const struct cli_ftype *ftype, unsigned int c)
+{
+    return ftype->offset || !ftype->length || ftype->magic[0] == c;
+}
+
+int cli_ftindex_build(struct cl_engine *engine)
+{
+	struct cli_ftindex *idx;
+	const struct cli_ftype *ftype;
+	uint32_t n = 0;
+	unsigned int c;
+
+    if(engine->ftindex) {
+	mpool_free(engine->mempool, engine->ftindex);
+	engine->ftindex = NULL;
+    }
+
+    for(c = 0; c < 256; c++)
+	for(ftype = engine->ftypes; ftype; ftype = ftype->next)
+	    if(ftindex_has(ftype, c))
+		n++;
+
+    if(!(idx = mpool_malloc(engine->mempool, sizeof(*idx) + n * sizeof(idx->entry[0])))) {
+	cli_errmsg("cli_ftindex_build: Can't allocate memory for the file type index\n");
+	return CL_EMEM;
+    }
+    n = 0;
+    for(c = 0; c < 256; c++) {
+	idx->start[c] = n;
+	for(ftype = engine->ftypes; ftype; ftype = ftype->next)
+	    if(ftindex_has(ftype, c))
+		idx->entry[n++] = ftype;
+    }
+    idx->start[256] = n;
+    engine->ftindex = idx;
+    return CL_SUCCESS;
+}
+
+static inline int ftype_match(const struct cli_ftype *ftype, const unsigned char *buf, size_t buflen)
+{
+    if(ftype->offset + ftype->length <= buflen && !memcmp(buf + ftype->offset, ftype->magic, ftype->length)) {
+	cli_dbgmsg("Recognized %s file\n", ftype->tname);
+	return 1;
+    }
+    return 0;
 }
 
 cli_file_t cli_partitiontype(const unsigned char *buf, size_t buflen, const struct cl_engine *engine)
@@ -197,17 +256,18 @@ cli_file_t cli_partitiontype(const unsigned char *buf, size_t buflen, const stru
 
 cli_file_t cli_filetype(const unsigned char *buf, size_t buflen, const struct cl_engine *engine)
 {
-	struct cli_ftype *ftype = engine->ftypes;
-
-
-    while(ftype) {
-	if(ftype->offset + ftype->length <= buflen) {
-	    if(!memcmp(buf + ftype->offset, ftype->magic, ftype->length)) {
-		cli_dbgmsg("Recognized %s file\n", ftype->tname);
+	const struct cli_ftindex *idx = engine->ftindex;
+	const struct cli_ftype *ftype;
+	uint32_t i;
+
+    if(idx && buflen) {
+	for(i = idx->start[buf[0]]; i < idx->start[buf[0] + 1]; i++)
+	    if(ftype_match(idx->entry[i], buf, buflen))
+		return idx->entry[i]->type;
+    } else {
+	for(ftype = engine->ftypes; ftype; ftype = ftype->next)
+	    if(ftype_match(ftype, buf, buflen))
 		return ftype->type;
-	    }
-	}
-	ftype = ftype->next;
     }
 
     return cli_texttype(buf, buflen);
@@ -404,14 +464,14 @@ cli_file_t cli_filetype2(fmap_t *map, const struct cl_engine *engine, cli_file_t
 	/* HTML files may contain special characters and could be
 	 * misidentified as BINARY_DATA by cli_filetype()
 	 */
-	root = engine->root[0];
+	root = engine->ftroot ? engine->ftroot : engine->root[0];
 	if(!root)
 	    return ret;
 
 	if(cli_ac_initdata(&mdata, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN))
 	    return ret;
 
-	sret = cli_ac_scanbuff(buff, bread, NULL, NULL, NULL, engine->root[0], &mdata, 0, ret, NULL, AC_SCAN_FT, NULL);
+	sret = cli_ac_scanbuff(buff, bread, NULL, NULL, NULL, root, &mdata, 0, ret, NULL, AC_SCAN_FT, NULL);
 
 	cli_ac_freedata(&mdata);
 
@@ -423,7 +483,7 @@ cli_file_t cli_filetype2(fmap_t *map, const struct cl_engine *engine, cli_file_t
 
 	    decoded = (unsigned char *) cli_utf16toascii((char *) buff, bread);
 	    if(decoded) {
-		sret = cli_ac_scanbuff(decoded, bread / 2, NULL, NULL, NULL,  engine->root[0], &mdata, 0, CL_TYPE_TEXT_ASCII, NULL, AC_SCAN_FT, NULL);
+		sret = cli_ac_scanbuff(decoded, bread / 2, NULL, NULL, NULL, root, &mdata, 0, CL_TYPE_TEXT_ASCII, NULL, AC_SCAN_FT, NULL);
 		free(decoded);
 		if(sret == CL_TYPE_HTML)
 		    ret = CL_TYPE_HTML_UTF16;
@@ -458,7 +518,7 @@ cli_file_t cli_filetype2(fmap_t *map, const struct cl_engine *engine, cli_file_t
 					    return ret;
 
 				    if(out_area.length > 0) {
-					    sret = cli_ac_scanbuff(decodedbuff, out_area.length, NULL, NULL, NULL, engine->root[0], &mdata, 0, 0, NULL, AC_SCAN_FT, NULL); /* FIXME: can we use CL_TYPE_TEXT_ASCII instead of 0? */
+					    sret = cli_ac_scanbuff(decodedbuff, out_area.length, NULL, NULL, NULL, root, &mdata, 0, 0, NULL, AC_SCAN_FT, NULL); /* FIXME: can we use CL_TYPE_TEXT_ASCII instead of 0? */
 					    if(sret == CL_TYPE_HTML) {
 						    cli_dbgmsg("cli_filetype2: detected HTML signature in Unicode file\n");
 						    /* htmlnorm is able to handle any unicode now, since it skips null chars */
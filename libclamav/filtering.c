@@ -30,6 +30,15 @@
 #include <string.h>
 #include <assert.h>
 #include "perflogging.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#define FILTER_SIMD 1
+#if defined(__clang__) || __GNUC__ >= 5
+#include <immintrin.h>
+#define FILTER_SIMD_AVX2 1
+#endif
+#endif
 /* ----- shift-or filtering -------------- */
 
 /*
@@ -140,10 +149,21 @@
 #define BITMAP_CONTAINS(bmap, val) ((bmap)[(val) >> 5] & (1 << ((val) & 0x1f)))
 #define BITMAP_INSERT(bmap, val) ((bmap)[(val) >> 5] |= (1 << ((val) & 0x1f)))
 
+#ifdef FILTER_SIMD
+typedef uint32_t (*filter_block_t)(const uint8_t *b, const uint8_t *e);
+static filter_block_t filter_block;
+static filter_block_t filter_block_select(void);
+#endif
+
 void filter_init(struct filter *m)
 {
 	memset(m->B, ~0, sizeof(m->B));
 	memset(m->end, ~0, sizeof(m->end));
+	m->cost = NULL;
+#ifdef FILTER_SIMD
+	if (!filter_block)
+		filter_block = filter_block_select();
+#endif
 }
 
 /* because we use uint32_t */
@@ -218,8 +238,14 @@ int filter_add_static(struct filter *m, const unsigned char *pattern, unsigned l
 			/* we want to favor subsigs that add as little as
 			 * possible to the filter */
 			num += filter_isset(m, k-j, q) ? 0 : MAXSOPATLEN - (k-j);
-			if ((k == j || k == j+1) && (q == 0x0000 || q == 0xffff))
-				num += k==j ?  10000 : 1000;/* bad */
+			if (k == j || k == j+1) {
+				/* with a profile, the more common the pair the
+				 * worse; 0x0000 and 0xffff otherwise */
+				if (m->cost)
+					num += (255 - m->cost[(pattern[k] << 8) | pattern[k+1]]) * (k==j ? 40 : 4);
+				else if (q == 0x0000 || q == 0xffff)
+					num += k==j ?  10000 : 1000;/* bad */
+			}
 		}
 		/* it is very important to keep the end set small */
 		num += 10*(filter_end_isset(m, k-j-1, q) ? 0 : 1);
@@ -692,6 +718,107 @@ int  filter_add_acpatt(struct filter *m, const struct cli_ac_patt *pat)
 
 /* state 11110011 means that we may have a match of length min 4, max 5 */
 
+#ifdef FILTER_SIMD
+/* Block-wise variant of the shift-or loop below.
+ * Since the state is only 8 bits wide and is shifted once per position, the
+ * state at position j is fully determined by the last 8 B[] lookups:
+ *   state_j = B_j | B_(j-1) << 1 | ... | B_(j-7) << 7
+ * (with B = 0xff before the start of the data, which reproduces the ~0 initial
+ * state). This removes the loop carried dependency, so FILTER_BLOCK positions
+ * can be evaluated at once and only blocks with a candidate are looked at
+ * more closely.
+ *
+ * b[] holds the B values for the FILTER_BLOCK positions of the block preceded
+ * by the 8 positions before it, e[] the End values of the block. The kernels
+ * return a bitmask of candidate positions within the block.
+ */
+#define FILTER_BLOCK 32
+
+static inline __m128i filter_state_sse2(const uint8_t *b)
+{
+	__m128i s = _mm_loadu_si128((const __m128i *)(b + 8));
+
+#define FILTER_SHIFT(k) \
+	s = _mm_or_si128(s, _mm_and_si128(_mm_slli_epi16(_mm_loadu_si128((const __m128i *)(b + 8 - k)), k), \
+					  _mm_set1_epi8((char)(0xff << k))))
+	FILTER_SHIFT(1); FILTER_SHIFT(2); FILTER_SHIFT(3); FILTER_SHIFT(4);
+	FILTER_SHIFT(5); FILTER_SHIFT(6); FILTER_SHIFT(7);
+#undef FILTER_SHIFT
+	return s;
+}
+
+static uint32_t filter_block_sse2(const uint8_t *b, const uint8_t *e)
+{
+	const __m128i ones = _mm_set1_epi8((char)0xff);
+	__m128i m0, m1;
+
+	m0 = _mm_or_si128(filter_state_sse2(b), _mm_loadu_si128((const __m128i *)e));
+	m1 = _mm_or_si128(filter_state_sse2(b + 16), _mm_loadu_si128((const __m128i *)(e + 16)));
+	return ~((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(m0, ones)) |
+		 ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(m1, ones)) << 16));
+}
+
+#ifdef FILTER_SIMD_AVX2
+__attribute__((target("avx2")))
+static uint32_t filter_block_avx2(const uint8_t *b, const uint8_t *e)
+{
+	__m256i s = _mm256_loadu_si256((const __m256i *)(b + 8));
+
+#define FILTER_SHIFT(k) \
+	s = _mm256_or_si256(s, _mm256_and_si256(_mm256_slli_epi16(_mm256_loadu_si256((const __m256i *)(b + 8 - k)), k), \
+						_mm256_set1_epi8((char)(0xff << k))))
+	FILTER_SHIFT(1); FILTER_SHIFT(2); FILTER_SHIFT(3); FILTER_SHIFT(4);
+	FILTER_SHIFT(5); FILTER_SHIFT(6); FILTER_SHIFT(7);
+#undef FILTER_SHIFT
+	s = _mm256_or_si256(s, _mm256_loadu_si256((const __m256i *)e));
+	return ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, _mm256_set1_epi8((char)0xff)));
+}
+#endif
+
+static filter_block_t filter_block_select(void)
+{
+#ifdef FILTER_SIMD_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return filter_block_avx2;
+#endif
+	return filter_block_sse2;
+}
+
+/* returns the first position where a pattern may end, as the scalar loop, or -1 */
+static long filter_search_simd(const struct filter *m, const unsigned char *data, unsigned long len)
+{
+	uint8_t b[FILTER_BLOCK + 8], e[FILTER_BLOCK], state;
+	const uint8_t *B = m->B;
+	const uint8_t *End = m->end;
+	const filter_block_t block = filter_block;
+	unsigned long j = 0, i;
+	uint32_t cand;
+
+	memset(b, 0xff, 8);
+	for (; j + FILTER_BLOCK < len; j += FILTER_BLOCK) {
+		for (i = 0; i < FILTER_BLOCK; i++) {
+			const uint16_t q0 = cli_readint16(&data[j + i]);
+			b[8 + i] = B[q0];
+			e[i] = End[q0];
+		}
+		if ((cand = block(b, e)))
+			return j + __builtin_ctz(cand);
+		memcpy(b, b + FILTER_BLOCK, 8);
+	}
+
+	/* tail: resume the scalar automaton from the state of the last block */
+	state = b[7] | b[6] << 1 | b[5] << 2 | b[4] << 3 | b[3] << 4 | b[2] << 5 | b[1] << 6 | b[0] << 7;
+	for (; j < len - 1; j++) {
+		const uint16_t q0 = cli_readint16(&data[j]);
+
+		state = (state << 1) | B[q0];
+		if ((uint8_t)(state | End[q0]) != 0xff)
+			return j;
+	}
+	return -1;
+}
+#endif
+
 __hot__ int filter_search_ext(const struct filter *m, const unsigned char *data, unsigned long len, struct filter_match_info *inf)
 {
 	size_t j;
@@ -700,6 +827,16 @@ __hot__ int filter_search_ext(const struct filter *m, const unsigned char *data,
 	const uint8_t *End = m->end;
 
 	if (len < 2) return -1;
+#ifdef FILTER_SIMD
+	if (filter_block) {
+		long pos = filter_search_simd(m, data, len);
+
+		if (pos == -1)
+			return -1;
+		inf->first_match = pos;
+		return 0;
+	}
+#endif
 	/* look for first match */
 	for (j=0; j < len-1;j++) {
 		uint8_t match_state_end;
@@ -729,6 +866,15 @@ long filter_search(const struct filter *m, const unsigned char *data, unsigned l
 
 	/* we use 2-grams, must be higher than 1 */
 	if(len < 2) return -1;
+#ifdef FILTER_SIMD
+	if (filter_block) {
+		long pos = filter_search_simd(m, data, len);
+
+		if (pos == -1)
+			return -1;
+		return pos >= MAXSOPATLEN ? pos - MAXSOPATLEN : 0;
+	}
+#endif
 	/* Shift-Or like search algorithm */
 	for(j=0;j < len-1; j++) {
 		const uint16_t q0 = cli_readint16( &data[j] );
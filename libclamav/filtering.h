@@ -27,6 +27,7 @@ struct filter {
 	uint8_t B[65536];
 	uint8_t end[65536];
 	unsigned long m;
+	const uint8_t *cost; /* byte pair costs, see cli_ac_profile_load() */
 };
 
 struct filter_match_info {
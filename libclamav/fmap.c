@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <fcntl.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -91,6 +92,41 @@ fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) {
 }
 #else
 /* vvvvv WIN32 STUFF BELOW vvvvv */
+
+/* Up to this size the file is paged in on demand like on POSIX, larger
+ * files are mapped whole since the page buffer can't be aged here */
+#define FMAP_WIN32_READ_MAX (64*1024*1024)
+
+/* Positional read: the offset goes in the OVERLAPPED, so concurrent maps of
+ * the same descriptor don't race on the file pointer */
+static off_t pread_cb(void *handle, void *buf, size_t count, off_t offset) /* WIN32 */
+{
+    HANDLE fh = (HANDLE)_get_osfhandle((int)(ssize_t)handle);
+    OVERLAPPED ov;
+    DWORD got = 0;
+
+    if(fh == INVALID_HANDLE_VALUE)
+	return -1;
+    if(count > 0x7fffffff)
+	count = 0x7fffffff;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)((offset>>31)>>1);
+    if(!ReadFile(fh, buf, (DWORD)count, &got, &ov)) {
+	switch(GetLastError()) {
+	case ERROR_IO_PENDING: /* the handle was opened for overlapped I/O */
+	    if(GetOverlappedResult(fh, &ov, &got, TRUE))
+		break;
+	    return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+	case ERROR_HANDLE_EOF:
+	    return 0;
+	default:
+	    return -1;
+	}
+    }
+    return got;
+}
+
 static void unmap_win32(fmap_t *m) { /* WIN32 */
     UnmapViewOfFile(m->data);
     CloseHandle(m->mh);
@@ -126,6 +162,15 @@ fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) { /* WIN3
 	return NULL;
     }
 
+    if(len <= FMAP_WIN32_READ_MAX) {
+	m = cl_fmap_open_handle((void*)(ssize_t)fd, offset, len, pread_cb, 1);
+	if(!m)
+	    return NULL;
+	m->mtime = st.st_mtime;
+	m->handle_is_fd = 1;
+	return m;
+    }
+
     pages = fmap_align_items(len, pgsz);
     hdrsz = fmap_align_to(sizeof(fmap_t), pgsz);
 
@@ -220,7 +265,7 @@ extern cl_fmap_t *cl_fmap_open_handle(void *handle, size_t offset, size_t len,
 	cli_dbgmsg("fmap: attempted void mapping\n");
 	return NULL;
     }
-    if (offset >= len) {
+    if (offset + len < offset) {
 	cli_warnmsg("fmap: attempted oof mapping\n");
 	return NULL;
     }
@@ -279,11 +324,30 @@ extern cl_fmap_t *cl_fmap_open_handle(void *handle, size_t offset, size_t len,
     return m;
 }
 
+/* The oldest pages go once more than hi bytes are paged in, down to lo.
+ * A sequential reader won't come back to what it's done with, so it keeps
+ * little more than its readahead window; a random one is more likely to hit
+ * the same pages again and keeps twice as much as usual. */
+#define READAHEAD_SEQ_MAX (2*1024*1024)
+#define UNPAGE_SEQ_HI (READAHEAD_SEQ_MAX * 2)
+#define UNPAGE_SEQ_LO READAHEAD_SEQ_MAX
+#define UNPAGE_RANDOM_HI (UNPAGE_THRSHLD_HI * 2)
+#define UNPAGE_RANDOM_LO (UNPAGE_THRSHLD_LO * 2)
+
 static void fmap_aging(fmap_t *m) {
 #ifdef ANONYMOUS_MAP
+    unsigned int hi = UNPAGE_THRSHLD_HI, lo = UNPAGE_THRSHLD_LO;
+
     if(!m->aging) return;
-    if(m->paged * m->pgsz > UNPAGE_THRSHLD_HI) { /* we alloc'd too much */
-	unsigned int i, avail = 0, freeme[2048], maxavail = MIN(sizeof(freeme)/sizeof(*freeme), m->paged - UNPAGE_THRSHLD_LO / m->pgsz) - 1;
+    if(m->pattern == FMAP_ACCESS_SEQUENTIAL) {
+	hi = UNPAGE_SEQ_HI;
+	lo = UNPAGE_SEQ_LO;
+    } else if(m->pattern == FMAP_ACCESS_RANDOM) {
+	hi = UNPAGE_RANDOM_HI;
+	lo = UNPAGE_RANDOM_LO;
+    }
+    if(m->paged * m->pgsz > hi) { /* we alloc'd too much */
+	unsigned int i, avail = 0, freeme[2048], maxavail = MIN(sizeof(freeme)/sizeof(*freeme), m->paged - lo / m->pgsz) - 1;
 
 	for(i=0; i<m->pages; i++) {
 	    uint32_t s = fmap_bitmap[i];
@@ -430,6 +494,7 @@ static int fmap_readpage(fmap_t *m, unsigned int first_page, unsigned int count,
 		    continue;
 
 		if(got > 0) {
+		    m->bytes_read += got;
 		    pptr += got;
 		    eintr_off += got;
 		    readsz -= got;
@@ -472,6 +537,78 @@ static int fmap_readpage(fmap_t *m, unsigned int first_page, unsigned int count,
 }
 
 
+/* Sequential reads ahead of the cursor: when a need() which has to hit the
+ * file starts where the previous read ended, up to ra_pages more pages are
+ * read along with it. The window doubles on each such read up to
+ * READAHEAD_MAX bytes, and the kernel is asked to prefetch the following one
+ * so that the next read doesn't wait for the disk (or the network) */
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX (1024*1024)
+
+/* Reads in a row which have to hit the file before the access pattern
+ * changes, see fmap_pattern() */
+#define PATTERN_HITS 4
+
+/* Once the map is known to be read sequentially the window grows to
+ * READAHEAD_SEQ_MAX and the kernel reads ahead as far as it likes; once
+ * it's known to be read at random the kernel stops reading ahead. On a
+ * large file, a sequential reader hands the pages of the page cache it's
+ * done with back to the kernel, a sweep over big files would push
+ * everything else out of it otherwise. */
+#define PATTERN_DROP_MIN (16*1024*1024)
+
+static void fmap_pattern(fmap_t *m, unsigned short pattern) {
+    if(m->pattern == pattern) {
+	m->pattern_hits = 0;
+	return;
+    }
+    if(++m->pattern_hits < PATTERN_HITS)
+	return;
+    m->pattern = pattern;
+    m->pattern_hits = 0;
+#if defined(POSIX_FADV_SEQUENTIAL) && !defined(_WIN32)
+    if(m->handle_is_fd)
+	posix_fadvise((int)(ssize_t)m->handle, m->offset, m->real_len,
+		      pattern == FMAP_ACCESS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+#endif
+}
+
+static unsigned int fmap_readahead(fmap_t *m, unsigned int first_page, unsigned int last_page) {
+    unsigned int ra, max;
+
+    if(fmap_bitmap[last_page] & FM_MASK_PAGED)
+	return 0;
+    if(m->ra_next && first_page <= m->ra_next && m->ra_next <= last_page + 1) {
+	fmap_pattern(m, FMAP_ACCESS_SEQUENTIAL);
+	max = m->pattern == FMAP_ACCESS_SEQUENTIAL ? READAHEAD_SEQ_MAX : READAHEAD_MAX;
+	m->ra_pages = m->ra_pages ? m->ra_pages * 2 : READAHEAD_MIN;
+	if(m->ra_pages > READAHEAD_MIN && m->ra_pages * m->pgsz > max)
+	    m->ra_pages /= 2;
+    } else {
+	if(m->ra_next)
+	    fmap_pattern(m, FMAP_ACCESS_RANDOM);
+	m->ra_pages = 0;
+    }
+    ra = MIN(m->ra_pages, m->pages - 1 - last_page);
+    m->ra_next = last_page + ra + 1;
+#if defined(POSIX_FADV_WILLNEED) && !defined(_WIN32)
+    if(ra && m->handle_is_fd && m->ra_next < m->pages)
+	posix_fadvise((int)(ssize_t)m->handle, m->offset + (off_t)m->ra_next * m->pgsz, (off_t)m->ra_pages * m->pgsz, POSIX_FADV_WILLNEED);
+#endif
+#if defined(POSIX_FADV_DONTNEED) && !defined(_WIN32)
+    /* what's before the read is in the map already */
+    if(m->pattern == FMAP_ACCESS_SEQUENTIAL && m->handle_is_fd && m->real_len >= PATTERN_DROP_MIN &&
+       first_page > m->ra_dropped) {
+	posix_fadvise((int)(ssize_t)m->handle, m->offset + (off_t)m->ra_dropped * m->pgsz, (off_t)(first_page - m->ra_dropped) * m->pgsz, POSIX_FADV_DONTNEED);
+	m->ra_dropped = first_page;
+    }
+#endif
+    return ra;
+}
+
+/* Maps this small are read whole on the first need() */
+#define FMAP_SMALL (128*1024)
+
 static const void *handle_need(fmap_t *m, size_t at, size_t len, int lock) {
     unsigned int first_page, last_page, lock_count;
     char *ret;
@@ -485,13 +622,14 @@ static const void *handle_need(fmap_t *m, size_t at, size_t len, int lock) {
 
     fmap_aging(m);
 
+    /* one read instead of a few, the pages just get paged below */
+    if(!m->paged && m->real_len <= FMAP_SMALL && fmap_readpage(m, 0, m->pages, 0))
+	return NULL;
+
     first_page = fmap_which_page(m, at);
     last_page = fmap_which_page(m, at + len - 1);
     lock_count = (lock!=0) * (last_page-first_page+1);
-#ifdef READAHED_PAGES
-    last_page += READAHED_PAGES;
-    if(last_page >= m->pages) last_page = m->pages - 1;
-#endif
+    last_page += fmap_readahead(m, first_page, last_page);
 
     if(fmap_readpage(m, first_page, last_page-first_page+1, lock_count))
 	return NULL;
@@ -558,7 +696,10 @@ static void unmap_malloc(fmap_t *m) {
 
 static const void *handle_need_offstr(fmap_t *m, size_t at, size_t len_hint) {
     unsigned int i, first_page, last_page;
-    void *ptr = (void *)((char *)m + m->hdrsz + at);
+    void *ptr;
+
+    at += m->nested_offset;
+    ptr = (void *)((char *)m + m->hdrsz + at);
 
     if(!len_hint || len_hint > m->real_len - at)
 	len_hint = m->real_len - at;
@@ -597,16 +738,17 @@ static const void *handle_need_offstr(fmap_t *m, size_t at, size_t len_hint) {
 
 static const void *handle_gets(fmap_t *m, char *dst, size_t *at, size_t max_len) {
     unsigned int i, first_page, last_page;
-    char *src = (void *)((char *)m + m->hdrsz + *at), *endptr = NULL;
-    size_t len = MIN(max_len-1, m->real_len - *at), fullen = len;
+    size_t off = *at + m->nested_offset;
+    char *src = (void *)((char *)m + m->hdrsz + off), *endptr = NULL;
+    size_t len = MIN(max_len-1, m->real_len - off), fullen = len;
 
-    if(!len || !CLI_ISCONTAINED(0, m->real_len, *at, len))
+    if(!len || !CLI_ISCONTAINED(0, m->real_len, off, len))
 	return NULL;
 
     fmap_aging(m);
 
-    first_page = fmap_which_page(m, *at);
-    last_page = fmap_which_page(m, *at + len - 1);
+    first_page = fmap_which_page(m, off);
+    last_page = fmap_which_page(m, off + len - 1);
 
     for(i=first_page; i<=last_page; i++) {
 	char *thispage = (char *)m + m->hdrsz + i * m->pgsz;
@@ -616,7 +758,7 @@ static const void *handle_gets(fmap_t *m, char *dst, size_t *at, size_t max_len)
 	    return NULL;
 
 	if(i == first_page) {
-	    scanat = *at % m->pgsz;
+	    scanat = off % m->pgsz;
 	    scansz = MIN(len, m->pgsz - scanat);
 	} else {
 	    scanat = 0;
@@ -691,7 +833,10 @@ static void mem_unneed_off(fmap_t *m, size_t at, size_t len)
 }
 
 static const void *mem_need_offstr(fmap_t *m, size_t at, size_t len_hint) {
-    char *ptr = (char *)m->data + at;
+    char *ptr;
+
+    at += m->nested_offset;
+    ptr = (char *)m->data + at;
 
     if(!len_hint || len_hint > m->real_len - at)
 	len_hint = m->real_len - at;
@@ -705,10 +850,11 @@ static const void *mem_need_offstr(fmap_t *m, size_t at, size_t len_hint) {
 }
 
 static const void *mem_gets(fmap_t *m, char *dst, size_t *at, size_t max_len) {
-    char *src = (char *)m->data + *at, *endptr = NULL;
-    size_t len = MIN(max_len-1, m->real_len - *at);
+    size_t off = *at + m->nested_offset;
+    char *src = (char *)m->data + off, *endptr = NULL;
+    size_t len = MIN(max_len-1, m->real_len - off);
 
-    if(!len || !CLI_ISCONTAINED(0, m->real_len, *at, len))
+    if(!len || !CLI_ISCONTAINED(0, m->real_len, off, len))
 	return NULL;
 
     if((endptr = memchr(src, '\n', len))) {
@@ -729,6 +875,33 @@ fmap_t *fmap(int fd, off_t offset, size_t len) {
     return fmap_check_empty(fd, offset, len, &unused);
 }
 
+fmap_t *fmap_duplicate(fmap_t *map, size_t offset, size_t len)
+{
+    fmap_t *m;
+    size_t start, aligned;
+
+    if(!len || !CLI_ISCONTAINED(0, map->len, offset, len)) {
+	cli_dbgmsg("fmap_duplicate: range %lu+%lu is out of the map\n", (unsigned long)offset, (unsigned long)len);
+	return NULL;
+    }
+
+    if(map->data)
+	return cl_fmap_open_memory((const char *)map->data + map->nested_offset + offset, len);
+
+    /* handle maps must start on a page boundary: map from the page the range
+     * begins in and nest the rest */
+    start = map->offset + map->nested_offset + offset;
+    aligned = start - start % map->pgsz;
+    m = cl_fmap_open_handle(map->handle, aligned, len + (start - aligned), map->pread_cb, map->aging);
+    if(!m)
+	return NULL;
+    m->nested_offset = start - aligned;
+    m->len = len;
+    m->mtime = map->mtime;
+    m->handle_is_fd = map->handle_is_fd;
+    return m;
+}
+
 static inline unsigned int fmap_align_items(unsigned int sz, unsigned int al) {
     return sz / al + (sz % al != 0);
 }
@@ -782,7 +955,8 @@ int fmap_dump_to_file(fmap_t *map, const char *tmpdir, char **outname, int *outf
 int fmap_fd(fmap_t *m)
 {
     int fd;
-    if (!m->handle_is_fd)
+    /* the descriptor has more than a nested map */
+    if (!m->handle_is_fd || m->nested_offset || m->len != m->real_len)
 	return -1;
     fd = (int)(ssize_t)m->handle;
     lseek(fd, 0, SEEK_SET);
@@ -793,3 +967,8 @@ extern void cl_fmap_close(cl_fmap_t *map)
 {
     funmap(map);
 }
+
+extern void cl_fmap_set_md5(cl_fmap_t *map, const unsigned char *md5)
+{
+    fmap_set_hash(map, CLI_HASH_MD5, md5, CLI_HASHLEN_MD5);
+}
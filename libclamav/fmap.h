@@ -32,8 +32,10 @@
 
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
 #include "cltypes.h"
 #include "clamav.h"
+#include "matcher-hash.h"
 
 struct cl_fmap;
 typedef cl_fmap_t fmap_t;
@@ -56,6 +58,15 @@ struct cl_fmap {
     /* memory interface */
     const void *data;
 
+    /* readahead state, see fmap_readahead() */
+    unsigned int ra_next;
+    unsigned int ra_pages;
+    unsigned int ra_dropped; /* pages handed back to the page cache */
+    unsigned short pattern, pattern_hits; /* FMAP_ACCESS_* */
+
+    /* bytes read through the handle, see cl_engine_set_clcb_profile() */
+    uint64_t bytes_read;
+
     /* common interface */
     size_t offset;/* file offset */
     size_t nested_offset;/* buffer offset for nested scan*/
@@ -80,14 +91,41 @@ struct cl_fmap {
     HANDLE fh;
     HANDLE mh;
 #endif
+    /* digests of the current extent, filled in by cache_get_MD5() and
+     * indexed by enum CLI_HASH_TYPE */
+    unsigned char maphash[CLI_HASH_AVAIL_TYPES][CLI_HASHLEN_MAX];
+    unsigned char have_maphash[CLI_HASH_AVAIL_TYPES];
+    size_t maphash_off, maphash_len;
+    /* zip central directory of the current extent, see unzip_index() */
+    void *zipindex;
+    /* headers of the PE file of the current extent, see pe_headers() */
+    void *peheaders;
+    /* headers of the ELF and Mach-O files of the current extent, see
+     * elf_headers() and macho_headers() */
+    void *elfheaders, *machoheaders;
+    /* metrics of the icons of the current extent, see icon_cached() */
+    void *iconmetrics;
     uint32_t placeholder_for_bitmap;
 };
 
+/* How the map is being read, as guessed by fmap_readahead() */
+#define FMAP_ACCESS_UNKNOWN	0
+#define FMAP_ACCESS_SEQUENTIAL	1
+#define FMAP_ACCESS_RANDOM	2
+
 fmap_t *fmap(int fd, off_t offset, size_t len);
 fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty);
+/* Maps len bytes at offset of map on their own, so that they can be read
+ * from another thread without touching the page cache of map */
+fmap_t *fmap_duplicate(fmap_t *map, size_t offset, size_t len);
 
 static inline void funmap(fmap_t *m)
 {
+    free(m->zipindex);
+    free(m->peheaders);
+    free(m->elfheaders);
+    free(m->machoheaders);
+    free(m->iconmetrics);
     m->unmap(m);
 }
 
@@ -128,6 +166,27 @@ static inline void fmap_unneed_ptr(fmap_t *m, const void *ptr, size_t len)
     fmap_unneed_off(m, fmap_ptr2off(m, ptr), len);
 }
 
+/* nested scans reuse the parent map with a different extent, so the digests
+ * are only valid for the extent they were computed for */
+static inline void fmap_set_hash(fmap_t *m, enum CLI_HASH_TYPE type, const unsigned char *digest, size_t len)
+{
+    if(m->maphash_off != m->nested_offset || m->maphash_len != m->len) {
+        memset(m->have_maphash, 0, sizeof(m->have_maphash));
+        m->maphash_off = m->nested_offset;
+        m->maphash_len = m->len;
+    }
+    memcpy(m->maphash[type], digest, len);
+    m->have_maphash[type] = 1;
+}
+
+static inline int fmap_get_hash(const fmap_t *m, enum CLI_HASH_TYPE type, unsigned char *digest, size_t len)
+{
+    if(!m->have_maphash[type] || m->maphash_off != m->nested_offset || m->maphash_len != m->len)
+        return 0;
+    memcpy(digest, m->maphash[type], len);
+    return 1;
+}
+
 static inline int fmap_readn(fmap_t *m, void *dst, size_t at, size_t len)
 {
     const void *src;
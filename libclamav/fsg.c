@@ -48,7 +48,7 @@
 #include "packlibs.h"
 #include "fsg.h"
 
-int unfsg_200(const char *source, char *dest, int ssize, int dsize, uint32_t rva, uint32_t base, uint32_t ep, int file) {
+int unfsg_200(const char *source, char *dest, int ssize, int dsize, uint32_t rva, uint32_t base, uint32_t ep, struct cli_extract *x) {
   struct cli_exe_section section; /* Yup, just one ;) */
   
   if ( cli_unfsg(source, dest, ssize, dsize, NULL, NULL) ) return -1;
@@ -58,7 +58,7 @@ int unfsg_200(const char *source, char *dest, int ssize, int dsize, uint32_t rva
   section.vsz = dsize;
   section.rva = rva;
 
-  if (!cli_rebuildpe(dest, &section, 1, base, ep, 0, 0, file)) {
+  if (!cli_rebuildpe(dest, &section, 1, base, ep, 0, 0, x)) {
     cli_dbgmsg("FSG: Rebuilding failed\n");
     return 0;
   }
@@ -66,7 +66,7 @@ int unfsg_200(const char *source, char *dest, int ssize, int dsize, uint32_t rva
 }
 
 
-int unfsg_133(const char *source, char *dest, int ssize, int dsize, struct cli_exe_section *sections, int sectcount, uint32_t base, uint32_t ep, int file) {
+int unfsg_133(const char *source, char *dest, int ssize, int dsize, struct cli_exe_section *sections, int sectcount, uint32_t base, uint32_t ep, struct cli_extract *x) {
   const char *tsrc=source;
   char *tdst=dest;
   int i, upd=1, offs=0, lastsz=dsize;
@@ -116,7 +116,7 @@ int unfsg_133(const char *source, char *dest, int ssize, int dsize, struct cli_e
     cli_dbgmsg("FSG: .SECT%d RVA:%x VSize:%x ROffset: %x, RSize:%x\n", i, sections[i].rva, sections[i].vsz, sections[i].raw, sections[i].rsz);
   }
 
-  if (!cli_rebuildpe(dest, sections, sectcount+1, base, ep, 0, 0, file)) {
+  if (!cli_rebuildpe(dest, sections, sectcount+1, base, ep, 0, 0, x)) {
     cli_dbgmsg("FSG: Rebuilding failed\n");
     return 0;
   }
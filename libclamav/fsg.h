@@ -24,9 +24,10 @@
 
 #include "cltypes.h"
 #include "execs.h"
+#include "scanners.h"
 
-int unfsg_200(const char *, char *, int, int, uint32_t, uint32_t, uint32_t, int);
-int unfsg_133(const char *, char *, int , int, struct cli_exe_section *, int, uint32_t, uint32_t, int);
+int unfsg_200(const char *, char *, int, int, uint32_t, uint32_t, uint32_t, struct cli_extract *);
+int unfsg_133(const char *, char *, int , int, struct cli_exe_section *, int, uint32_t, uint32_t, struct cli_extract *);
 
 #endif
 
@@ -64,6 +64,7 @@ enum GPT_SCANSTATE {
     BOTH
 };
 
+static int gpt_scan(cli_ctx *ctx, size_t sectorsize);
 static int gpt_scan_partitions(cli_ctx *ctx, struct gpt_header hdr, size_t sectorsize);
 static int gpt_validate_header(cli_ctx *ctx, struct gpt_header hdr, size_t sectorsize);
 static int gpt_check_mbr(cli_ctx *ctx, size_t sectorsize);
@@ -102,6 +103,18 @@ size_t gpt_detect_size(fmap_t *map)
 
 /* attempts to detect sector size is input as 0 */
 int cli_scangpt(cli_ctx *ctx, size_t sectorsize)
+{
+    int ret, pooled;
+
+    /* the partitions are scanned on the archive member threads */
+    pooled = cli_member_pool_start(ctx);
+    ret = gpt_scan(ctx, sectorsize);
+    if (pooled)
+        ret = cli_member_pool_finish(ctx, ret);
+    return ret;
+}
+
+static int gpt_scan(cli_ctx *ctx, size_t sectorsize)
 {
     struct gpt_header phdr, shdr;
     enum GPT_SCANSTATE state = INVALID;
@@ -127,7 +140,7 @@ int cli_scangpt(cli_ctx *ctx, size_t sectorsize)
     }
 
     /* size of total file must be a multiple of the sector size */
-    maplen = (*ctx->fmap)->real_len;
+    maplen = (*ctx->fmap)->len;
     if ((maplen % sectorsize) != 0) {
         cli_dbgmsg("cli_scangpt: File sized %lu is not a multiple of sector size %lu\n",
                    (unsigned long)maplen, (unsigned long)sectorsize);
@@ -294,7 +307,7 @@ static int gpt_scan_partitions(cli_ctx *ctx, struct gpt_header hdr, size_t secto
     cli_dbgmsg("Partition Entry Count: %u\n", hdr.tableNumEntries);
     cli_dbgmsg("Partition Entry Size: %u\n", hdr.tableEntrySize);
 
-    maplen = (*ctx->fmap)->real_len;
+    maplen = (*ctx->fmap)->len;
 
     /* check engine maxpartitions limit */
     if (hdr.tableNumEntries < ctx->engine->maxpartitions) {
@@ -304,7 +317,7 @@ static int gpt_scan_partitions(cli_ctx *ctx, struct gpt_header hdr, size_t secto
         max_prtns = ctx->engine->maxpartitions;
     }
 
-    /* use the partition tables to pass partitions to cli_map_scan */
+    /* use the partition tables to pass partitions to cli_member_scan_range */
     pos = hdr.tableStartLBA * sectorsize;
     for (i = 0; i < max_prtns; ++i) {
         /* read in partition entry */
@@ -346,10 +359,10 @@ static int gpt_scan_partitions(cli_ctx *ctx, struct gpt_header hdr, size_t secto
                        gpe.firstLBA, (gpe.firstLBA * sectorsize), 
                        gpe.lastLBA, ((gpe.lastLBA+1) * sectorsize));
 
-            /* send the partition to cli_map_scan */
+            /* send the partition to cli_member_scan_range */
             part_off = gpe.firstLBA * sectorsize;
             part_size = (gpe.lastLBA - gpe.firstLBA + 1) * sectorsize;
-            ret = cli_map_scan(*ctx->fmap, part_off, part_size, ctx, CL_TYPE_PART_ANY);
+            ret = cli_member_scan_range(ctx, part_off, part_size, CL_TYPE_PART_ANY);
             if (ret != CL_CLEAN) {
                 if ((ctx->options & CL_SCAN_ALLMATCHES) && (ret == CL_VIRUS))
                     detection = CL_VIRUS;
@@ -376,7 +389,7 @@ static int gpt_validate_header(cli_ctx *ctx, struct gpt_header hdr, size_t secto
     size_t maplen, ptable_start, ptable_len;
     unsigned char *ptable;
 
-    maplen = (*ctx->fmap)->real_len;
+    maplen = (*ctx->fmap)->len;
 
     /* checking header crc32 checksum */
     crc32_ref = le32_to_host(hdr.headerCRC32);
@@ -545,7 +558,7 @@ static void gpt_printSectors(cli_ctx *ctx, size_t sectorsize)
     /* sector size calculation */
     sectorsize = GPT_DEFAULT_SECTOR_SIZE;
 
-    maplen = (*ctx->fmap)->real_len;
+    maplen = (*ctx->fmap)->len;
 
     ppos = 1 * sectorsize; /* sector 1 (second sector) is the primary gpt header */
     spos = maplen - sectorsize; /* last sector is the secondary gpt header */
@@ -605,7 +618,7 @@ static int gpt_prtn_intxn(cli_ctx *ctx, struct gpt_header hdr, size_t sectorsize
     size_t maplen;
     uint32_t max_prtns = 0;
 
-    maplen = (*ctx->fmap)->real_len;
+    maplen = (*ctx->fmap)->len;
 
     /* convert endian to host to check partition table */
     hdr.tableStartLBA = le64_to_host(hdr.tableStartLBA);
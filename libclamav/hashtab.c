@@ -33,8 +33,36 @@
 
 #define MODULE_NAME "hashtab: "
 
-static const char DELETED_KEY[] = "";
-#define DELETED_HTU32_KEY ((uint32_t)(-1))
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#define HASHTAB_SIMD 1
+#endif
+
+/*
+ * All the tables below share the same layout: next to the slots there's an
+ * array with one control byte per slot, which is either CTRL_EMPTY,
+ * CTRL_DELETED or, for slots in use, the low 7 bits of the hash of the key
+ * (h2). The slots are probed in groups of HT_GROUP: the group is picked by
+ * the rest of the hash (h1), and all its control bytes are compared against
+ * h2 at once, so that keys are only compared on (near certain) matches.
+ * A lookup stops at the first group which still has an empty slot.
+ *
+ * A group which has an empty slot was never full, hence no probe sequence
+ * ever went past it: this lets deletions from such groups leave no
+ * tombstone. The remaining tombstones are dropped when the table is
+ * rehashed.
+ *
+ * The group width is fixed (and independent of HASHTAB_SIMD) since the
+ * layout is also baked into the pre-generated tables (see
+ * cli_hashtab_generate_c).
+ */
+#define HT_GROUP 16
+#define CTRL_EMPTY ((unsigned char)0x80)
+#define CTRL_DELETED ((unsigned char)0xfe)
+#define CTRL_ISFULL(c) (!((c) & 0x80))
+
+/* maximum load (used + tombstones), in eighths */
+#define HT_MAXLOAD(capacity) ((capacity) / 8 * 7)
 
 static unsigned long nearest_power(unsigned long num)
 {
@@ -49,6 +77,168 @@ static unsigned long nearest_power(unsigned long num)
 	return n;
 }
 
+#ifdef HASHTAB_SIMD
+static inline unsigned int group_match(const unsigned char *ctrl, unsigned char h2)
+{
+	const __m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)h2)));
+}
+
+static inline unsigned int group_empty(const unsigned char *ctrl)
+{
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline unsigned int group_free(const unsigned char *ctrl)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+#define LSB64 0x0101010101010101ULL
+#define MSB64 0x8080808080808080ULL
+
+static inline uint64_t group_load(const unsigned char *ctrl)
+{
+	uint64_t v;
+	memcpy(&v, ctrl, sizeof(v));
+	return le64_to_host(v);
+}
+
+/* gathers the top bit of each byte into the low 8 bits */
+static inline unsigned int pack_msb(uint64_t v)
+{
+	return (unsigned int)(((v & MSB64) * 0x0002040810204081ULL) >> 56);
+}
+
+static inline unsigned int group_match(const unsigned char *ctrl, unsigned char h2)
+{
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < HT_GROUP / 8; i++) {
+		const uint64_t v = group_load(ctrl + 8 * i) ^ (LSB64 * h2);
+		/* may report a false positive past a true match: the caller
+		 * compares the keys anyway */
+		mask |= pack_msb((v - LSB64) & ~v) << (8 * i);
+	}
+	return mask;
+}
+
+static inline unsigned int group_empty(const unsigned char *ctrl)
+{
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < HT_GROUP / 8; i++) {
+		const uint64_t v = group_load(ctrl + 8 * i);
+		/* top bit set, bit 1 clear */
+		mask |= pack_msb(v & (~v << 6)) << (8 * i);
+	}
+	return mask;
+}
+
+static inline unsigned int group_free(const unsigned char *ctrl)
+{
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < HT_GROUP / 8; i++)
+		mask |= pack_msb(group_load(ctrl + 8 * i)) << (8 * i);
+	return mask;
+}
+#endif
+
+static inline unsigned int mask_first(unsigned int mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	unsigned int i = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+/* the probe sequence visits every group once for power of 2 group counts */
+#define PROBE_FIRST(h, ngroups) (((h) >> 7) & ((ngroups) - 1))
+#define PROBE_NEXT(g, i, ngroups) (((g) + (i)) & ((ngroups) - 1))
+#define H2(h) ((unsigned char)((h) & 0x7f))
+
+static inline uint64_t hash_fmix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t hash_word(uint64_t h, uint64_t v)
+{
+	h ^= v * 0x87c37b91114253d5ULL;
+	h = (h << 31) | (h >> 33);
+	return h * 0x4cf5ad432745937fULL;
+}
+
+static inline uint64_t hash(const unsigned char* k, size_t len)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)len * 0xc2b2ae3d27d4eb4fULL);
+	uint64_t v;
+	size_t i;
+
+	for (; len >= 8; k += 8, len -= 8) {
+		memcpy(&v, k, sizeof(v));
+		h = hash_word(h, le64_to_host(v));
+	}
+	if (len) {
+		v = 0;
+		for (i = 0; i < len; i++)
+			v |= (uint64_t)k[i] << (8 * i);
+		h = hash_word(h, v);
+	}
+	return hash_fmix64(h);
+}
+
+static inline uint64_t hash_u32(uint32_t k)
+{
+	return hash_fmix64((uint64_t)k ^ 0x9e3779b97f4a7c15ULL);
+}
+
+/* first free (empty or deleted) slot on the probe sequence of h */
+static size_t find_free_slot(const unsigned char *ctrl, size_t capacity, uint64_t h)
+{
+	const size_t ngroups = capacity / HT_GROUP;
+	size_t g = PROBE_FIRST(h, ngroups), i;
+
+	for (i = 1; i <= ngroups; i++) {
+		const unsigned int m = group_free(&ctrl[g * HT_GROUP]);
+		if (m)
+			return g * HT_GROUP + mask_first(m);
+		g = PROBE_NEXT(g, i, ngroups);
+	}
+	return capacity;
+}
+
+/* marks slot idx as unused, returns 1 if it had to leave a tombstone */
+static inline int clear_slot(unsigned char *ctrl, size_t idx)
+{
+	if (group_empty(&ctrl[idx & ~(size_t)(HT_GROUP - 1)])) {
+		ctrl[idx] = CTRL_EMPTY;
+		return 0;
+	}
+	ctrl[idx] = CTRL_DELETED;
+	return 1;
+}
+
+/* new capacity to rehash to: the same one if mostly tombstones are in the way */
+static inline size_t rehash_capacity(size_t capacity, size_t used)
+{
+	if (used < HT_MAXLOAD(capacity) / 2)
+		return capacity;
+	return nearest_power(capacity + 1);
+}
+
 #ifdef PROFILE_HASHTABLE
 /* I know, this is ugly, most of these functions get a const s, that gets its const-ness discarded,
  * and then these functions modify something the compiler assumes is readonly.
@@ -170,134 +360,152 @@ static inline void PROFILE_REPORT(const struct cli_hashtable *s)
 #define PROFILE_REPORT(s)
 #endif
 
-int cli_hashtab_init(struct cli_hashtable *s,size_t capacity)
+static int hashtab_alloc(struct cli_hashtable *s, size_t capacity)
 {
-	if(!s)
-		return CL_ENULLARG;
-
-	PROFILE_INIT(s);
-
-	capacity = nearest_power(capacity);
-	s->htable = cli_calloc(capacity,sizeof(*s->htable));
-	if(!s->htable)
+	s->htable = cli_calloc(capacity, sizeof(*s->htable));
+	s->ctrl = cli_malloc(capacity);
+	if(!s->htable || !s->ctrl) {
+		free(s->htable);
+		free(s->ctrl);
+		s->htable = NULL;
+		s->ctrl = NULL;
 		return CL_EMEM;
+	}
+	memset(s->ctrl, CTRL_EMPTY, capacity);
 	s->capacity = capacity;
 	s->used = 0;
-	s->maxfill = 8*capacity/10;
+	s->deleted = 0;
+	s->maxfill = HT_MAXLOAD(capacity);
 	return 0;
 }
 
-int cli_htu32_init(struct cli_htu32 *s, size_t capacity, mpool_t *mempool)
+int cli_hashtab_init(struct cli_hashtable *s,size_t capacity)
 {
 	if(!s)
 		return CL_ENULLARG;
 
 	PROFILE_INIT(s);
 
-	capacity = nearest_power(capacity);
+	return hashtab_alloc(s, nearest_power(capacity));
+}
+
+#ifndef USE_MPOOL
+#define htu32_alloc(A, B, C) htu32_alloc(A, B)
+#endif
+
+static int htu32_alloc(struct cli_htu32 *s, size_t capacity, mpool_t *mempool)
+{
 	s->htable = mpool_calloc(mempool, capacity, sizeof(*s->htable));
-	if(!s->htable)
+	s->ctrl = mpool_malloc(mempool, capacity);
+	if(!s->htable || !s->ctrl) {
+		if(s->htable)
+			mpool_free(mempool, s->htable);
+		if(s->ctrl)
+			mpool_free(mempool, s->ctrl);
+		s->htable = NULL;
+		s->ctrl = NULL;
 		return CL_EMEM;
+	}
+	memset(s->ctrl, CTRL_EMPTY, capacity);
 	s->capacity = capacity;
 	s->used = 0;
-	s->maxfill = 8*capacity/10;
+	s->deleted = 0;
+	s->maxfill = HT_MAXLOAD(capacity);
 	return 0;
 }
 
-
-static inline uint32_t hash32shift(uint32_t key)
+int cli_htu32_init(struct cli_htu32 *s, size_t capacity, mpool_t *mempool)
 {
-  key = ~key + (key << 15);
-  key = key ^ (key >> 12);
-  key = key + (key << 2);
-  key = key ^ (key >> 4);
-  key = (key + (key << 3)) + (key << 11);
-  key = key ^ (key >> 16);
-  return key;
-}
+	if(!s)
+		return CL_ENULLARG;
 
-static inline size_t hash(const unsigned char* k,const size_t len,const size_t SIZE)
-{
-	size_t Hash = 1;
-	size_t i;
-	for(i=0;i<len;i++) {
-		/* a simple add is good, because we use the mixing function below */
-		Hash +=  k[i];
-		/* mixing function */
-		Hash = hash32shift(Hash);
-	}
-	/* SIZE is power of 2 */
-	return Hash & (SIZE - 1);
+	PROFILE_INIT(s);
+
+	return htu32_alloc(s, nearest_power(capacity), mempool);
 }
 
-static inline size_t hash_htu32(uint32_t k, const size_t SIZE)
+static size_t hashtab_lookup(const struct cli_hashtable *s, const char* key, const size_t len, uint64_t h)
 {
-	/* mixing function */
-	size_t Hash = hash32shift(k);
-	/* SIZE is power of 2 */
-	return Hash & (SIZE - 1);
+	const size_t ngroups = s->capacity / HT_GROUP;
+	size_t g = PROBE_FIRST(h, ngroups);
+	size_t tries;
+
+	for(tries = 1; tries <= ngroups; tries++) {
+		const unsigned char *ctrl = &s->ctrl[g * HT_GROUP];
+		unsigned int m = group_match(ctrl, H2(h));
+
+		while(m) {
+			const size_t idx = g * HT_GROUP + mask_first(m);
+			const struct cli_element *element = &s->htable[idx];
+
+			if(len == element->len && element->key && (key == element->key || memcmp(key, element->key, len) == 0)) {
+				PROFILE_FIND_FOUND(s, tries);
+				return idx;
+			}
+			m &= m - 1;
+		}
+		if(group_empty(ctrl)) {
+			PROFILE_FIND_NOTFOUND(s, tries);
+			return s->capacity;
+		}
+		g = PROBE_NEXT(g, tries, ngroups);
+	}
+	PROFILE_HASH_EXHAUSTED(s);
+	return s->capacity;
 }
 
-/* if returned element has key==NULL, then key was not found in table */
 struct cli_element* cli_hashtab_find(const struct cli_hashtable *s,const char* key,const size_t len)
 {
-	struct cli_element* element;
-	size_t tries = 1;
 	size_t idx;
 
-	if(!s)
+	if(!s || !s->capacity)
 		return NULL;
 	PROFILE_CALC_HASH(s);
 	PROFILE_FIND_ELEMENT(s);
-	idx = hash((const unsigned char*)key, len, s->capacity);
-	element = &s->htable[idx];
-	do {
-		if(!element->key) {
-			PROFILE_FIND_NOTFOUND(s, tries);
-			return NULL; /* element not found, place is empty*/
-		}
-		else if(element->key != DELETED_KEY && len == element->len && (key == element->key || strncmp(key, element->key,len)==0)) {
-			PROFILE_FIND_FOUND(s, tries);
-			return element;/* found */
+	idx = hashtab_lookup(s, key, len, hash((const unsigned char*)key, len));
+	return idx < s->capacity ? &s->htable[idx] : NULL;
+}
+
+static size_t htu32_lookup(const struct cli_htu32 *s, uint32_t key)
+{
+	const uint64_t h = hash_u32(key);
+	const size_t ngroups = s->capacity / HT_GROUP;
+	size_t g = PROBE_FIRST(h, ngroups);
+	size_t tries;
+
+	for(tries = 1; tries <= ngroups; tries++) {
+		const unsigned char *ctrl = &s->ctrl[g * HT_GROUP];
+		unsigned int m = group_match(ctrl, H2(h));
+
+		while(m) {
+			const size_t idx = g * HT_GROUP + mask_first(m);
+
+			if(s->htable[idx].key == key && CTRL_ISFULL(s->ctrl[idx])) {
+				PROFILE_FIND_FOUND(s, tries);
+				return idx;
+			}
+			m &= m - 1;
 		}
-		else {
-			idx = (idx + tries++) & (s->capacity-1);
-			element = &s->htable[idx];
+		if(group_empty(ctrl)) {
+			PROFILE_FIND_NOTFOUND(s, tries);
+			return s->capacity;
 		}
-	} while (tries <= s->capacity);
+		g = PROBE_NEXT(g, tries, ngroups);
+	}
 	PROFILE_HASH_EXHAUSTED(s);
-	return NULL; /* not found */
+	return s->capacity;
 }
 
-
 const struct cli_htu32_element *cli_htu32_find(const struct cli_htu32 *s, uint32_t key)
 {
-	struct cli_htu32_element* element;
-	size_t tries = 1;
 	size_t idx;
 
-	if(!s)
+	if(!s || !s->capacity)
 		return NULL;
 	PROFILE_CALC_HASH(s);
 	PROFILE_FIND_ELEMENT(s);
-	idx = hash_htu32(key, s->capacity);
-	element = &s->htable[idx];
-	do {
-		if(!element->key) {
-			PROFILE_FIND_NOTFOUND(s, tries);
-			return NULL; /* element not found, place is empty */
-		}
-		else if(key == element->key) {
-			PROFILE_FIND_FOUND(s, tries);
-			return element;/* found */
-		}
-		else {
-			idx = (idx + tries++) & (s->capacity-1);
-			element = &s->htable[idx];
-		}
-	} while (tries <= s->capacity);
-	PROFILE_HASH_EXHAUSTED(s);
-	return NULL; /* not found */
+	idx = htu32_lookup(s, key);
+	return idx < s->capacity ? &s->htable[idx] : NULL;
 }
 
 /* linear enumeration - start with current = NULL, returns next item if present or NULL if not */
@@ -316,9 +524,8 @@ const struct cli_htu32_element *cli_htu32_next(const struct cli_htu32 *s, const
 		ncur++;
 	}
 	for(; ncur<s->capacity; ncur++) {
-		const struct cli_htu32_element *item = &s->htable[ncur & (s->capacity - 1)];
-		if(item->key && item->key != DELETED_HTU32_KEY)
-			return item;
+		if(CTRL_ISFULL(s->ctrl[ncur]))
+			return &s->htable[ncur];
 	}
 	return NULL;
 }
@@ -326,53 +533,34 @@ const struct cli_htu32_element *cli_htu32_next(const struct cli_htu32 *s, const
 
 static int cli_hashtab_grow(struct cli_hashtable *s)
 {
-	const size_t new_capacity = nearest_power(s->capacity + 1);
-	struct cli_element* htable;
-	size_t i,idx, used = 0;
+	struct cli_hashtable old = *s;
+	const size_t new_capacity = rehash_capacity(s->capacity, s->used);
+	size_t i;
 
 	cli_dbgmsg("hashtab.c: new capacity: %llu\n",(long long unsigned)new_capacity);
-	if(new_capacity == s->capacity) {
+	if(new_capacity < s->capacity) {
 		cli_errmsg("hashtab.c: capacity problem growing from: %llu\n",(long long unsigned)s->capacity);
 		return CL_EMEM;
 	}
-	htable = cli_calloc(new_capacity, sizeof(*s->htable));
-	if(!htable) {
+	if(hashtab_alloc(s, new_capacity)) {
+		*s = old;
 		return CL_EMEM;
 	}
 
 	PROFILE_GROW_START(s);
-	cli_dbgmsg("hashtab.c: Warning: growing open-addressing hashtables is slow. Either allocate more storage when initializing, or use other hashtable types!\n");
-	for(i=0; i < s->capacity;i++) {
-		if(s->htable[i].key && s->htable[i].key != DELETED_KEY) {
-			struct cli_element* element;
-			size_t tries = 1;
+	for(i=0; i < old.capacity;i++) {
+		if(CTRL_ISFULL(old.ctrl[i])) {
+			const uint64_t h = hash((const unsigned char*)old.htable[i].key, old.htable[i].len);
+			const size_t idx = find_free_slot(s->ctrl, new_capacity, h);
 
 			PROFILE_CALC_HASH(s);
-			idx = hash((const unsigned char*)s->htable[i].key, s->htable[i].len, new_capacity);
-			element = &htable[idx];
-
-			while(element->key && tries <= new_capacity) {
-				idx = (idx + tries++) & (new_capacity-1);
-				element = &htable[idx];
-			}
-			if(!element->key) {
-				/* copy element from old hashtable to new */
-				PROFILE_GROW_FOUND(s, tries);
-				*element = s->htable[i];
-				used++;
-			}
-			else {
-				cli_errmsg("hashtab.c: Impossible - unable to rehash table");
-				free (htable);
-				return CL_EMEM;/* this means we didn't find enough room for all elements in the new table, should never happen */ 
-			}
+			s->ctrl[idx] = H2(h);
+			s->htable[idx] = old.htable[i];
+			s->used++;
 		}
 	}
-	free(s->htable);
-	s->htable = htable;
-	s->used = used;
-	s->capacity = new_capacity;
-	s->maxfill = new_capacity*8/10;
+	free(old.htable);
+	free(old.ctrl);
 	cli_dbgmsg("Table %p size after grow:%llu\n",(void*)s,(long long unsigned)s->capacity);
 	PROFILE_GROW_DONE(s);
 	return CL_SUCCESS;
@@ -384,45 +572,32 @@ static int cli_hashtab_grow(struct cli_hashtable *s)
 
 static int cli_htu32_grow(struct cli_htu32 *s, mpool_t *mempool)
 {
-	const size_t new_capacity = nearest_power(s->capacity + 1);
-	struct cli_htu32_element* htable = mpool_calloc(mempool, new_capacity, sizeof(*s->htable));
-	size_t i,idx, used = 0;
+	struct cli_htu32 old = *s;
+	const size_t new_capacity = rehash_capacity(s->capacity, s->used);
+	size_t i;
+
 	cli_dbgmsg("hashtab.c: new capacity: %llu\n",(long long unsigned)new_capacity);
-	if(new_capacity == s->capacity || !htable)
+	if(new_capacity < s->capacity)
+		return CL_EMEM;
+	if(htu32_alloc(s, new_capacity, mempool)) {
+		*s = old;
 		return CL_EMEM;
+	}
 
 	PROFILE_GROW_START(s);
-
-	for(i=0; i < s->capacity; i++) {
-		if(s->htable[i].key && s->htable[i].key != DELETED_HTU32_KEY) {
-			struct cli_htu32_element* element;
-			size_t tries = 1;
+	for(i=0; i < old.capacity; i++) {
+		if(CTRL_ISFULL(old.ctrl[i])) {
+			const uint64_t h = hash_u32(old.htable[i].key);
+			const size_t idx = find_free_slot(s->ctrl, new_capacity, h);
 
 			PROFILE_CALC_HASH(s);
-			idx = hash_htu32(s->htable[i].key, new_capacity);
-			element = &htable[idx];
-
-			while(element->key && tries <= new_capacity) {
-				idx = (idx + tries++) & (new_capacity-1);
-				element = &htable[idx];
-			}
-			if(!element->key) {
-				/* copy element from old hashtable to new */
-				PROFILE_GROW_FOUND(s, tries);
-				*element = s->htable[i];
-				used++;
-			}
-			else {
-				cli_errmsg("hashtab.c: Impossible - unable to rehash table");
-				return CL_EMEM;/* this means we didn't find enough room for all elements in the new table, should never happen */ 
-			}
+			s->ctrl[idx] = H2(h);
+			s->htable[idx] = old.htable[i];
+			s->used++;
 		}
 	}
-	mpool_free(mempool, s->htable);
-	s->htable = htable;
-	s->used = used;
-	s->capacity = new_capacity;
-	s->maxfill = new_capacity*8/10;
+	mpool_free(mempool, old.htable);
+	mpool_free(mempool, old.ctrl);
 	cli_dbgmsg("Table %p size after grow:%llu\n",(void*)s,(long long unsigned)s->capacity);
 	PROFILE_GROW_DONE(s);
 	return CL_SUCCESS;
@@ -432,139 +607,131 @@ static int cli_htu32_grow(struct cli_htu32 *s, mpool_t *mempool)
 const struct cli_element* cli_hashtab_insert(struct cli_hashtable *s, const char* key, const size_t len, const cli_element_data data)
 {
 	struct cli_element* element;
-	struct cli_element* deleted_element = NULL;
-	size_t tries = 1;
+	uint64_t h;
 	size_t idx;
+	char* thekey;
+
 	if(!s)
 		return NULL;
-	if(s->used > s->maxfill) {
+	PROFILE_CALC_HASH(s);
+	h = hash((const unsigned char*)key, len);
+	idx = hashtab_lookup(s, key, len, h);
+	if(idx < s->capacity) {
+		PROFILE_DATA_UPDATE(s, 1);
+		element = &s->htable[idx];
+		element->data = data;/* key found, update */
+		return element;
+	}
+
+	if(s->used + s->deleted >= s->maxfill) {
 		cli_dbgmsg("hashtab.c:Growing hashtable %p, because it has exceeded maxfill, old size:%llu\n",(void*)s,(long long unsigned)s->capacity);
-		cli_hashtab_grow(s);
+		if(cli_hashtab_grow(s) != CL_SUCCESS) {
+			cli_warnmsg("hashtab.c: Unable to grow hashtable\n");
+			return NULL;
+		}
+	}
+	idx = find_free_slot(s->ctrl, s->capacity, h);
+	if(idx >= s->capacity) {
+		/* can't happen, the load is capped */
+		cli_errmsg("hashtab.c: no free slot in hashtable %p\n", (void*)s);
+		return NULL;
 	}
-	do {
-		PROFILE_CALC_HASH(s);
-		idx = hash((const unsigned char*)key, len, s->capacity);
-		element = &s->htable[idx];
 
-		do {
-			if(!element->key) {
-				char* thekey;
-				/* element not found, place is empty, insert*/
-				if(deleted_element) {
-					/* reuse deleted elements*/
-					element = deleted_element;
-					PROFILE_DELETED_REUSE(s, tries);
-				}
-				else {
-					PROFILE_INSERT(s, tries);
-				}
-				thekey = cli_malloc(len+1);
-				if(!thekey) {
-                    cli_errmsg("hashtab.c: Unable to allocate memory for thekey\n");
-					return NULL;
-                }
-				strncpy(thekey, key, len+1);
-				thekey[len]='\0';
-				element->key = thekey;
-				element->data = data;
-				element->len = len;
-				s->used++;
-				return element;
-			}
-			else if(element->key == DELETED_KEY) {
-				deleted_element = element;
-				element->key = NULL;
-			}
-			else if(len == element->len && strncmp(key, element->key, len)==0) {
-				PROFILE_DATA_UPDATE(s, tries);
-				element->data = data;/* key found, update */
-				return element;
-			}
-			else {
-				idx = (idx + tries++) % s->capacity;
-				element = &s->htable[idx];
-			}
-		} while (tries <= s->capacity);
-		/* no free place found*/
-		PROFILE_HASH_EXHAUSTED(s);
-		cli_dbgmsg("hashtab.c: Growing hashtable %p, because its full, old size:%llu.\n",(void*)s,(long long unsigned)s->capacity);
-	} while( cli_hashtab_grow(s) >= 0 );
-	cli_warnmsg("hashtab.c: Unable to grow hashtable\n");
-	return NULL;
+	thekey = cli_malloc(len+1);
+	if(!thekey) {
+		cli_errmsg("hashtab.c: Unable to allocate memory for thekey\n");
+		return NULL;
+	}
+	memcpy(thekey, key, len);
+	thekey[len]='\0';
+
+	if(s->ctrl[idx] == CTRL_DELETED) {
+		PROFILE_DELETED_REUSE(s, 1);
+		s->deleted--;
+	} else {
+		PROFILE_INSERT(s, 1);
+	}
+	s->ctrl[idx] = H2(h);
+	element = &s->htable[idx];
+	element->key = thekey;
+	element->data = data;
+	element->len = len;
+	s->used++;
+	return element;
 }
 
 
 int cli_htu32_insert(struct cli_htu32 *s, const struct cli_htu32_element *item, mpool_t *mempool)
 {
-	struct cli_htu32_element* element;
-	struct cli_htu32_element* deleted_element = NULL;
-	size_t tries = 1;
+	uint64_t h;
 	size_t idx;
 	int ret;
 
 	if(!s)
 		return CL_ENULLARG;
-	if(s->used > s->maxfill) {
-		cli_dbgmsg("hashtab.c:Growing hashtable %p, because it has exceeded maxfill, old size:%llu\n",(void*)s,(long long unsigned)s->capacity);
-		cli_htu32_grow(s, mempool);
+	PROFILE_CALC_HASH(s);
+	idx = htu32_lookup(s, item->key);
+	if(idx < s->capacity) {
+		PROFILE_DATA_UPDATE(s, 1);
+		s->htable[idx].data = item->data;/* key found, update */
+		return 0;
 	}
-	do {
-		PROFILE_CALC_HASH(s);
-		idx = hash_htu32(item->key, s->capacity);
-		element = &s->htable[idx];
 
-		do {
-			if(!element->key) {
-				/* element not found, place is empty, insert*/
-				if(deleted_element) {
-					/* reuse deleted elements*/
-					element = deleted_element;
-					PROFILE_DELETED_REUSE(s, tries);
-				}
-				else {
-					PROFILE_INSERT(s, tries);
-				}
-				*element = *item;
-				s->used++;
-				return 0;
-			}
-			else if(element->key == DELETED_HTU32_KEY) {
-				deleted_element = element;
-				element->key = 0;
-			}
-			else if(item->key == element->key) {
-				PROFILE_DATA_UPDATE(s, tries);
-				element->data = item->data;/* key found, update */
-				return 0;
-			}
-			else {
-				idx = (idx + tries++) % s->capacity;
-				element = &s->htable[idx];
-			}
-		} while (tries <= s->capacity);
-		/* no free place found*/
-		PROFILE_HASH_EXHAUSTED(s);
-		cli_dbgmsg("hashtab.c: Growing hashtable %p, because its full, old size:%llu.\n",(void*)s,(long long unsigned)s->capacity);
-	} while( (ret = cli_htu32_grow(s, mempool)) >= 0 );
-	cli_warnmsg("hashtab.c: Unable to grow hashtable\n");
-	return ret;
+	if(s->used + s->deleted >= s->maxfill) {
+		cli_dbgmsg("hashtab.c:Growing hashtable %p, because it has exceeded maxfill, old size:%llu\n",(void*)s,(long long unsigned)s->capacity);
+		if((ret = cli_htu32_grow(s, mempool)) != CL_SUCCESS) {
+			cli_warnmsg("hashtab.c: Unable to grow hashtable\n");
+			return ret;
+		}
+	}
+	h = hash_u32(item->key);
+	idx = find_free_slot(s->ctrl, s->capacity, h);
+	if(idx >= s->capacity) {
+		cli_errmsg("hashtab.c: no free slot in hashtable %p\n", (void*)s);
+		return CL_EMEM;
+	}
+	if(s->ctrl[idx] == CTRL_DELETED) {
+		PROFILE_DELETED_REUSE(s, 1);
+		s->deleted--;
+	} else {
+		PROFILE_INSERT(s, 1);
+	}
+	s->ctrl[idx] = H2(h);
+	s->htable[idx] = *item;
+	s->used++;
+	return 0;
 }
 
 
 void cli_hashtab_delete(struct cli_hashtable *s,const char* key,const size_t len)
 {
-    struct cli_element *el = cli_hashtab_find(s, key, len);
-    if (!el || el->key == DELETED_KEY)
-	return;
-    free((void*)el->key);
-    el->key = DELETED_KEY;
+	size_t idx;
+
+	if(!s || !s->capacity)
+		return;
+	PROFILE_HASH_DELETE(s);
+	idx = hashtab_lookup(s, key, len, hash((const unsigned char*)key, len));
+	if(idx >= s->capacity)
+		return;
+	free((void*)s->htable[idx].key);
+	s->htable[idx].key = NULL;
+	s->htable[idx].len = 0;
+	s->deleted += clear_slot(s->ctrl, idx);
+	s->used--;
 }
 
 void cli_htu32_delete(struct cli_htu32 *s, uint32_t key)
 {
-	struct cli_htu32_element *el = (struct cli_htu32_element *)cli_htu32_find(s, key);
-	if(el)
-		el->key = DELETED_HTU32_KEY;
+	size_t idx;
+
+	if(!s || !s->capacity)
+		return;
+	PROFILE_HASH_DELETE(s);
+	idx = htu32_lookup(s, key);
+	if(idx >= s->capacity)
+		return;
+	s->deleted += clear_slot(s->ctrl, idx);
+	s->used--;
 }
 
 void cli_hashtab_clear(struct cli_hashtable *s)
@@ -572,34 +739,46 @@ void cli_hashtab_clear(struct cli_hashtable *s)
 	size_t i;
 	PROFILE_HASH_CLEAR(s);
 	for(i=0;i < s->capacity;i++) {
-		if(s->htable[i].key && s->htable[i].key != DELETED_KEY)
+		if(CTRL_ISFULL(s->ctrl[i]))
 			free((void *)s->htable[i].key);
 	}
-	if(s->htable)
+	if(s->htable) {
 		memset(s->htable, 0, s->capacity * sizeof(*s->htable));
+		memset(s->ctrl, CTRL_EMPTY, s->capacity);
+	}
 	s->used = 0;
+	s->deleted = 0;
 }
 
 void cli_htu32_clear(struct cli_htu32 *s)
 {
 	PROFILE_HASH_CLEAR(s);
-	if(s->htable)
+	if(s->htable) {
 		memset(s->htable, 0, s->capacity * sizeof(struct cli_htu32_element));
+		memset(s->ctrl, CTRL_EMPTY, s->capacity);
+	}
 	s->used = 0;
+	s->deleted = 0;
 }
 
 void cli_hashtab_free(struct cli_hashtable *s)
 {
 	cli_hashtab_clear(s);
 	free(s->htable);
+	free(s->ctrl);
 	s->htable = NULL;
+	s->ctrl = NULL;
 	s->capacity = 0;
 }
 
 void cli_htu32_free(struct cli_htu32 *s, mpool_t *mempool)
 {
-	mpool_free(mempool, s->htable);
+	if(s->htable)
+		mpool_free(mempool, s->htable);
+	if(s->ctrl)
+		mpool_free(mempool, s->ctrl);
 	s->htable = NULL;
+	s->ctrl = NULL;
 	s->capacity = 0;
 }
 
@@ -613,7 +792,7 @@ int cli_hashtab_store(const struct cli_hashtable *s,FILE* out)
 	size_t i;
 	for(i=0; i < s->capacity; i++) {
 		const struct cli_element* e = &s->htable[i];
-		if(e->key && e->key != DELETED_KEY) {
+		if(CTRL_ISFULL(s->ctrl[i])) {
 			fprintf(out,"%ld %s\n",e->data,e->key);
 		}
 	}
@@ -628,17 +807,21 @@ int cli_hashtab_generate_c(const struct cli_hashtable *s,const char* name)
 	printf("static struct cli_element %s_elements[] = {\n",name);
 	for(i=0; i < s->capacity; i++) {
 		const struct cli_element* e = &s->htable[i];
-		if(!e->key)
+		if(!CTRL_ISFULL(s->ctrl[i]))
 			printf("\t{NULL,0,0},\n");
-		else if(e->key == DELETED_KEY)
-			printf("\t{DELETED_KEY,0,0},\n");
 		else
 			printf("\t{\"%s\", %ld, %llu},\n", e->key, e->data, (long long unsigned)e->len);
 	}
 	printf("};\n");
+	printf("static unsigned char %s_ctrl[] = {", name);
+	for(i=0; i < s->capacity; i++) {
+		/* tombstones are kept: the probe sequences depend on them */
+		printf("%s0x%02x,", (i % 16) ? " " : "\n\t", s->ctrl[i]);
+	}
+	printf("\n};\n");
 	printf("const struct cli_hashtable %s = {\n",name);
-	printf("\t%s_elements, %llu, %llu, %llu", name, (long long unsigned)s->capacity,
-	       (long long unsigned)s->used, (long long unsigned)s->maxfill);
+	printf("\t%s_elements, %s_ctrl, %llu, %llu, %llu, %llu", name, name, (long long unsigned)s->capacity,
+	       (long long unsigned)s->used, (long long unsigned)s->deleted, (long long unsigned)s->maxfill);
 	printf("\n};\n");
 
 	PROFILE_REPORT(s);
@@ -670,18 +853,20 @@ int cli_hashset_init(struct cli_hashset* hs, size_t initial_capacity, uint8_t lo
 	hs->capacity = initial_capacity;
 	hs->mask = initial_capacity - 1;
 	hs->count=0;
+	hs->deleted=0;
 	hs->keys = cli_malloc(initial_capacity * sizeof(*hs->keys));
 	hs->mempool = NULL;
 	if(!hs->keys) {
         cli_errmsg("hashtab.c: Uable to allocate memory for hs->keys\n");
 		return CL_EMEM;
 	}
-	hs->bitmap = cli_calloc(initial_capacity >> 5, sizeof(*hs->bitmap));
-	if(!hs->bitmap) {
+	hs->ctrl = cli_malloc(initial_capacity);
+	if(!hs->ctrl) {
 		free(hs->keys);
-        cli_errmsg("hashtab.c: Unable to allocate memory for hs->bitmap\n");
+        cli_errmsg("hashtab.c: Unable to allocate memory for hs->ctrl\n");
 		return CL_EMEM;
 	}
+	memset(hs->ctrl, CTRL_EMPTY, initial_capacity);
 	return 0;
 }
 
@@ -695,18 +880,20 @@ int cli_hashset_init_pool(struct cli_hashset* hs, size_t initial_capacity, uint8
 	hs->capacity = initial_capacity;
 	hs->mask = initial_capacity - 1;
 	hs->count=0;
+	hs->deleted=0;
 	hs->mempool = mempool;
 	hs->keys = mpool_malloc(mempool, initial_capacity * sizeof(*hs->keys));
 	if(!hs->keys) {
         cli_errmsg("hashtab.c: Unable to allocate memory pool for hs->keys\n");
 		return CL_EMEM;
 	}
-	hs->bitmap = mpool_calloc(mempool, initial_capacity >> 5, sizeof(*hs->bitmap));
-	if(!hs->bitmap) {
+	hs->ctrl = mpool_malloc(mempool, initial_capacity);
+	if(!hs->ctrl) {
 		mpool_free(mempool, hs->keys);
-        cli_errmsg("hashtab.c: Unable to allocate/initialize memory for hs->keys\n");
+        cli_errmsg("hashtab.c: Unable to allocate/initialize memory for hs->ctrl\n");
 		return CL_EMEM;
 	}
+	memset(hs->ctrl, CTRL_EMPTY, initial_capacity);
 	return 0;
 }
 
@@ -716,75 +903,78 @@ void cli_hashset_destroy(struct cli_hashset* hs)
 	cli_dbgmsg(MODULE_NAME "Freeing hashset, elements: %u, capacity: %u\n", hs->count, hs->capacity);
 	if(hs->mempool) {
 		mpool_free(hs->mempool, hs->keys);
-		mpool_free(hs->mempool, hs->bitmap);
+		mpool_free(hs->mempool, hs->ctrl);
 	} else {
 	    free(hs->keys);
-	    free(hs->bitmap);
+	    free(hs->ctrl);
 	}
-	hs->keys = hs->bitmap = NULL;
+	hs->keys = NULL;
+	hs->ctrl = NULL;
 	hs->capacity = 0;
 }
 
-#define BITMAP_CONTAINS(bmap, val) ((bmap)[(val) >> 5] & (1 << ((val) & 0x1f)))
-#define BITMAP_INSERT(bmap, val) ((bmap)[(val) >> 5] |= (1 << ((val) & 0x1f)))
-#define BITMAP_REMOVE(bmap, val) ((bmap)[(val) >> 5] &= ~(1 << ((val) & 0x1f)))
-
 /*
  * searches the hashset for the @key.
- * Returns the position the key is at, or a candidate position where it could be inserted.
+ * Returns the position the key is at, or hs->capacity if it's not there.
  */
-static inline size_t cli_hashset_search(const struct cli_hashset* hs, const uint32_t key)
+static inline size_t cli_hashset_search(const struct cli_hashset* hs, const uint32_t key, const uint64_t h)
 {
-	/* calculate hash value for this key, and map it to our table */
-	size_t idx = hash32shift(key) & (hs->mask);
-	size_t tries = 1;
-
-	/* check whether the entry is used, and if the key matches */
-	while(BITMAP_CONTAINS(hs->bitmap, idx) && (hs->keys[idx] != key)) {
-		/* entry used, key different -> collision */
-		idx = (idx + tries++)&(hs->mask);
-		/* quadratic probing, with c1 = c2 = 1/2, guaranteed to walk the entire table
-		 * for table sizes power of 2.*/
+	const size_t ngroups = hs->capacity / HT_GROUP;
+	size_t g = PROBE_FIRST(h, ngroups);
+	size_t tries;
+
+	for(tries = 1; tries <= ngroups; tries++) {
+		const unsigned char *ctrl = &hs->ctrl[g * HT_GROUP];
+		unsigned int m = group_match(ctrl, H2(h));
+
+		while(m) {
+			const size_t idx = g * HT_GROUP + mask_first(m);
+			if(hs->keys[idx] == key && CTRL_ISFULL(hs->ctrl[idx]))
+				return idx;
+			m &= m - 1;
+		}
+		if(group_empty(ctrl))
+			break;
+		g = PROBE_NEXT(g, tries, ngroups);
 	}
-	/* we have either found the key, or a candidate insertion position */
-	return idx;
+	return hs->capacity;
 }
 
-static void cli_hashset_addkey_internal(struct cli_hashset* hs, const uint32_t key)
+static void cli_hashset_addkey_internal(struct cli_hashset* hs, const uint32_t key, const uint64_t h)
 {
-	const size_t idx = cli_hashset_search(hs, key);
-	/* we know hashtable is not full, when this method is called */
-
-	if(!BITMAP_CONTAINS(hs->bitmap, idx)) {
-		/* add new key */
-		BITMAP_INSERT(hs->bitmap, idx);
-		hs->keys[idx] = key;
-		hs->count++;
-	}
+	/* we know hashtable is not full and doesn't have the key, when this method is called */
+	const size_t idx = find_free_slot(hs->ctrl, hs->capacity, h);
+
+	if(hs->ctrl[idx] == CTRL_DELETED)
+		hs->deleted--;
+	hs->ctrl[idx] = H2(h);
+	hs->keys[idx] = key;
+	hs->count++;
 }
 
 static int cli_hashset_grow(struct cli_hashset *hs)
 {
 	struct cli_hashset new_hs;
-	size_t i;
+	size_t i, new_capacity;
 	int rc;
 
 	/* in-place growing is not possible, since the new keys
 	 * will hash to different locations. */
 	cli_dbgmsg(MODULE_NAME "Growing hashset, used: %u, capacity: %u\n", hs->count, hs->capacity);
-	/* create a bigger hashset */
+	/* create a bigger hashset, unless it's only clogged with tombstones */
+	new_capacity = (hs->count < hs->limit / 2) ? hs->capacity : (size_t)hs->capacity << 1;
 
 	if(hs->mempool)
-		rc = cli_hashset_init_pool(&new_hs, hs->capacity << 1, hs->limit*100/hs->capacity, hs->mempool);
+		rc = cli_hashset_init_pool(&new_hs, new_capacity, hs->limit*100/hs->capacity, hs->mempool);
 	else
-		rc = cli_hashset_init(&new_hs, hs->capacity << 1, hs->limit*100/hs->capacity);
+		rc = cli_hashset_init(&new_hs, new_capacity, hs->limit*100/hs->capacity);
 	if(rc != 0)
 		return rc;
 	/* and copy keys */
 	for(i=0;i < hs->capacity;i++) {
-		if(BITMAP_CONTAINS(hs->bitmap, i)) {
-			const size_t key = hs->keys[i];
-			cli_hashset_addkey_internal(&new_hs, key);
+		if(CTRL_ISFULL(hs->ctrl[i])) {
+			const uint32_t key = hs->keys[i];
+			cli_hashset_addkey_internal(&new_hs, key, hash_u32(key));
 		}
 	}
 	cli_hashset_destroy(hs);
@@ -795,23 +985,26 @@ static int cli_hashset_grow(struct cli_hashset *hs)
 
 int cli_hashset_addkey(struct cli_hashset* hs, const uint32_t key)
 {
-	/* check that we didn't reach the load factor.
-	 * Even if we don't know yet whether we'd add this key */
-	if(hs->count + 1 > hs->limit) {
+	const uint64_t h = hash_u32(key);
+
+	if(cli_hashset_search(hs, key, h) < hs->capacity)
+		return 0;
+	/* check that we didn't reach the load factor */
+	if(hs->count + hs->deleted + 1 > hs->limit) {
 		int rc = cli_hashset_grow(hs);
 		if(rc) {
 			return rc;
 		}
 	}
-	cli_hashset_addkey_internal(hs, key);
+	cli_hashset_addkey_internal(hs, key, h);
 	return 0;
 }
 
 int cli_hashset_removekey(struct cli_hashset* hs, const uint32_t key)
 {
-    const size_t idx = cli_hashset_search(hs, key);
-    if (BITMAP_CONTAINS(hs->bitmap, idx)) {
-	BITMAP_REMOVE(hs->bitmap, idx);
+    const size_t idx = cli_hashset_search(hs, key, hash_u32(key));
+    if (idx < hs->capacity) {
+	hs->deleted += clear_slot(hs->ctrl, idx);
 	hs->keys[idx] = 0;
 	hs->count--;
 	return 0;
@@ -821,8 +1014,7 @@ int cli_hashset_removekey(struct cli_hashset* hs, const uint32_t key)
 
 int cli_hashset_contains(const struct cli_hashset* hs, const uint32_t key)
 {
-	const size_t idx =  cli_hashset_search(hs, key);
-	return BITMAP_CONTAINS(hs->bitmap, idx);
+	return cli_hashset_search(hs, key, hash_u32(key)) < hs->capacity;
 }
 
 ssize_t cli_hashset_toarray(const struct cli_hashset* hs, uint32_t** array)
@@ -840,7 +1032,7 @@ ssize_t cli_hashset_toarray(const struct cli_hashset* hs, uint32_t** array)
 	}
 
 	for(i=0,j=0 ; i < hs->capacity && j < hs->count;i++) {
-		if(BITMAP_CONTAINS(hs->bitmap, i)) {
+		if(CTRL_ISFULL(hs->ctrl[i])) {
 			arr[j++] = hs->keys[i];
 		}
 	}
@@ -70,9 +70,11 @@ struct cli_element
 
 struct cli_hashtable {
 	struct cli_element* htable;
+	unsigned char* ctrl;/* one control byte per slot */
 	size_t capacity;
 	size_t used;
-	size_t maxfill;/* 80% */
+	size_t deleted;
+	size_t maxfill;/* 87.5% */
 
 	STRUCT_PROFILE
 };
@@ -98,9 +100,11 @@ struct cli_htu32_element {
 
 struct cli_htu32 {
     struct cli_htu32_element* htable;
+    unsigned char* ctrl;/* one control byte per slot */
     size_t capacity;
     size_t used;
-    size_t maxfill;/* 80% */
+    size_t deleted;
+    size_t maxfill;/* 87.5% */
 
     STRUCT_PROFILE
 };
@@ -151,11 +155,12 @@ void cli_map_delete(struct cli_map *m);
 /* A set of unique keys. */
 struct cli_hashset {
 	uint32_t* keys;
-	uint32_t* bitmap;
+	unsigned char* ctrl;
 	mpool_t* mempool;
 	uint32_t capacity;
 	uint32_t mask;
 	uint32_t count;
+	uint32_t deleted;
 	uint32_t limit;
 };
 
@@ -91,6 +91,7 @@ typedef enum {
 
 typedef struct file_buff_tag {
 	int fd;
+	struct text_buffer *mem;	/* instead of fd, see html_normalise_map_mem() */
 	unsigned char buffer[HTML_FILE_BUFF_LEN];
 	int length;
 } file_buff_t;
@@ -119,6 +120,28 @@ static const int base64_chars[256] = {
     -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1,
 };
 
+/* Lowercased value of the bytes that HTML_NORM copies verbatim; 0 for the
+ * bytes that end a plain text run (NUL, whitespace and control characters,
+ * '<', '&' and 8 bit characters) */
+static const unsigned char html_text_chars[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x21, 0x22, 0x23, 0x24, 0x25, 0x00, 0x27,  0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,  0x38, 0x39, 0x3a, 0x3b, 0x00, 0x3d, 0x3e, 0x3f,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,  0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,  0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,  0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,  0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
 int table_order[] = {
        00, 02, 01, 00, 02, 01, 02, 01, 01, 02, 01, 02, 00, 01, 02, 01,
        00, 01, 02, 01, 00, 00, 02, 01, 01, 02, 00, 01, 02, 01, 01, 02,
@@ -299,10 +322,20 @@ static unsigned char *cli_readchunk(FILE *stream, m_area_t *m_area, unsigned int
 	return chunk;
 }
 
+static void html_output_write(file_buff_t *fbuff, const unsigned char *data, size_t len)
+{
+	if (fbuff->mem) {
+		if (textbuffer_append_len(fbuff->mem, (const char *)data, len) == -1)
+			cli_errmsg("html_output_write: Unable to allocate memory for the normalised output\n");
+	} else {
+		cli_writen(fbuff->fd, data, len);
+	}
+}
+
 static void html_output_flush(file_buff_t *fbuff)
 {
 	if (fbuff && (fbuff->length > 0)) {
-		cli_writen(fbuff->fd, fbuff->buffer, fbuff->length);
+		html_output_write(fbuff, fbuff->buffer, fbuff->length);
 		fbuff->length = 0;
 	}
 }
@@ -325,7 +358,7 @@ static void html_output_str(file_buff_t *fbuff, const unsigned char *str, size_t
 		}
 		if (len >= HTML_FILE_BUFF_LEN) {
 			html_output_flush(fbuff);
-			cli_writen(fbuff->fd, str, len);
+			html_output_write(fbuff, str, len);
 		} else {
 			memcpy(fbuff->buffer + fbuff->length, str, len);
 			fbuff->length += len;
@@ -624,8 +657,17 @@ static void screnc_decode(unsigned char *ptr, struct screnc_state *s)
 	}
 }
 
+static void js_output(struct parser_state *js_state, const char *dirname, struct html_norm_output *out)
+{
+	if (out)
+		cli_js_output_mem(js_state, &out->javascript);
+	else
+		cli_js_output(js_state, dirname);
+}
+
 static void js_process(struct parser_state *js_state, const unsigned char *js_begin, const unsigned char *js_end,
-		const unsigned char *line, const unsigned char *ptr, int in_script, const char *dirname)
+		const unsigned char *line, const unsigned char *ptr, int in_script, const char *dirname,
+		struct html_norm_output *out)
 {
 	if(!js_begin)
 		js_begin = line;
@@ -639,12 +681,12 @@ static void js_process(struct parser_state *js_state, const unsigned char *js_be
 	if(!in_script) {
 		/*  we found a /script, normalize script now */
 		cli_js_parse_done(js_state);
-		cli_js_output(js_state, dirname);
+		js_output(js_state, dirname, out);
 		cli_js_destroy(js_state);
 	}
 }
 
-static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag_arguments_t *hrefs,const struct cli_dconf* dconf)
+static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag_arguments_t *hrefs,const struct cli_dconf* dconf, struct html_norm_output *out)
 {
 	int fd_tmp, tag_length = 0, tag_arg_length = 0, binary;
 	int retval=FALSE, escape=FALSE, value = 0, hex=FALSE, tag_val_length=0;
@@ -700,7 +742,22 @@ static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag
 	tag_args.tag = NULL;
 	tag_args.value = NULL;
 	tag_args.contents = NULL;
-	if (dirname) {
+	if (dirname && out) {
+		file_buff_o2 = (file_buff_t *) cli_malloc(sizeof(file_buff_t));
+		file_buff_text = (file_buff_t *) cli_malloc(sizeof(file_buff_t));
+		if (!file_buff_o2 || !file_buff_text) {
+			cli_errmsg("cli_html_normalise: Unable to allocate memory for the output buffers\n");
+			free(file_buff_o2);
+			free(file_buff_text);
+			file_buff_o2 = file_buff_text = NULL;
+			goto abort;
+		}
+		file_buff_o2->fd = file_buff_text->fd = -1;
+		file_buff_o2->mem = &out->nocomment;
+		file_buff_text->mem = &out->notags;
+		file_buff_o2->length = 0;
+		file_buff_text->length = 0;
+	} else if (dirname) {
 		snprintf(filename, 1024, "%s"PATHSEP"rfc2397", dirname);
 		if (mkdir(filename, 0700) && errno != EEXIST) {
 			file_buff_o2 = file_buff_text = NULL;
@@ -743,6 +800,7 @@ static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag
 			file_buff_o2 = file_buff_text = NULL;
 			goto abort;
 		}
+		file_buff_o2->mem = file_buff_text->mem = NULL;
 		file_buff_o2->length = 0;
 		file_buff_text->length = 0;
 	} else {
@@ -849,6 +907,23 @@ static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag
 					state = HTML_SKIP_WS;
 					tag_length=0;
 					next_state = HTML_TAG;
+				} else if (html_text_chars[*ptr]) {
+					/* copy the whole run of plain text in one go */
+					unsigned char run[256];
+					size_t run_len = 0;
+
+					do {
+						unsigned char c = html_text_chars[*ptr];
+						/* normalize ' to " for scripts */
+						if(in_script && c == '\'') c = '"';
+						run[run_len++] = c;
+						ptr++;
+					} while (run_len < sizeof(run) && html_text_chars[*ptr]);
+					html_output_str(file_buff_o2, run, run_len);
+					if (!in_script) {
+						html_output_str(file_buff_text, run, run_len);
+						text_space_written = FALSE;
+					}
 				} else if (isspace(*ptr)) {
 					if(!text_space_written && !in_script) {
 						html_output_c(file_buff_text, ' ');
@@ -1169,7 +1244,7 @@ static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag
 						in_script = FALSE;
 						if(js_state) {
 							js_end = ptr;
-							js_process(js_state, js_begin, js_end, line, ptr, in_script, dirname);
+							js_process(js_state, js_begin, js_end, line, ptr, in_script, dirname, out);
 							js_state = NULL;
 							js_begin = js_end = NULL;
 						}
@@ -1608,7 +1683,17 @@ static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag
                         cli_errmsg("cli_html_normalise: Unable to allocate memory for file_tmp_o1\n");
 						goto abort;
 					}
+					file_tmp_o1->fd = -1;
+					file_tmp_o1->mem = NULL;
+					file_tmp_o1->length = 0;
 					snprintf(filename, 1024, "%s"PATHSEP"rfc2397", dirname);
+					if (out && !out->rfc2397++) {
+						if ((mkdir(dirname, 0700) && errno != EEXIST) ||
+						    (mkdir(filename, 0700) && errno != EEXIST)) {
+							cli_dbgmsg("cli_html_normalise: Can't create directory %s\n", filename);
+							goto abort;
+						}
+					}
 					tmp_file = cli_gentemp(filename);
 					if(!tmp_file) {
 						goto abort;
@@ -1733,7 +1818,7 @@ static int cli_html_normalise(int fd, m_area_t *m_area, const char *dirname, tag
 		ptrend = NULL;
 
 		if(js_state) {
-			js_process(js_state, js_begin, js_end, line, ptr, in_script, dirname);
+			js_process(js_state, js_begin, js_end, line, ptr, in_script, dirname, out);
 			js_begin = js_end = NULL;
 			if(!in_script) {
 				js_state = NULL;
@@ -1795,7 +1880,7 @@ abort:
 	if(js_state) {
 		/*  output script so far */
 		cli_js_parse_done(js_state);
-		cli_js_output(js_state, dirname);
+		js_output(js_state, dirname, out);
 		cli_js_destroy(js_state);
 		js_state = NULL;
 	}
@@ -1834,7 +1919,7 @@ int html_normalise_mem(unsigned char *in_buff, off_t in_size, const char *dirnam
 	m_area.offset = 0;
 	m_area.map = NULL;
 
-	return cli_html_normalise(-1, &m_area, dirname, hrefs, dconf);
+	return cli_html_normalise(-1, &m_area, dirname, hrefs, dconf, NULL);
 }
 
 int html_normalise_map(fmap_t *map, const char *dirname, tag_arguments_t *hrefs,const struct cli_dconf* dconf)
@@ -1845,10 +1930,31 @@ int html_normalise_map(fmap_t *map, const char *dirname, tag_arguments_t *hrefs,
 	m_area.length = map->len;
 	m_area.offset = 0;
 	m_area.map = map;
-	retval = cli_html_normalise(-1, &m_area, dirname, hrefs, dconf);
+	retval = cli_html_normalise(-1, &m_area, dirname, hrefs, dconf, NULL);
 	return retval;
 }
 
+/* Same as html_normalise_map(), the normalised streams are returned in out
+ * instead of being written to dirname; html_norm_output_free() them */
+int html_normalise_map_mem(fmap_t *map, const char *dirname, struct html_norm_output *out, const struct cli_dconf* dconf)
+{
+	m_area_t m_area;
+
+	memset(out, 0, sizeof(*out));
+	m_area.length = map->len;
+	m_area.offset = 0;
+	m_area.map = map;
+	return cli_html_normalise(-1, &m_area, dirname, NULL, dconf, out);
+}
+
+void html_norm_output_free(struct html_norm_output *out)
+{
+	free(out->nocomment.data);
+	free(out->notags.data);
+	free(out->javascript.data);
+	memset(out, 0, sizeof(*out));
+}
+
 int html_screnc_decode(fmap_t *map, const char *dirname)
 {
 	int count, retval=FALSE;
@@ -22,6 +22,8 @@
 #ifndef __HTMLNORM_H
 #define __HTMLNORM_H
 
+#include "jsparse/textbuf.h"
+
 typedef struct tag_arguments_tag
 {
         int count;
@@ -38,8 +40,21 @@ typedef struct m_area_tag {
 	fmap_t *map;
 } m_area_t;
 
+/* The normalised streams of html_normalise_map_mem(), kept in memory in
+ * place of the nocomment.html, notags.html and javascript files; rfc2397
+ * counts the data: URIs written to the rfc2397 directory of dirname,
+ * which is only created for them */
+struct html_norm_output {
+	struct text_buffer nocomment;
+	struct text_buffer notags;
+	struct text_buffer javascript;
+	unsigned int rfc2397;
+};
+
 int html_normalise_mem(unsigned char *in_buff, off_t in_size, const char *dirname, tag_arguments_t *hrefs,const struct cli_dconf* dconf);
 int html_normalise_map(fmap_t *map, const char *dirname, tag_arguments_t *hrefs, const struct cli_dconf* dconf);
+int html_normalise_map_mem(fmap_t *map, const char *dirname, struct html_norm_output *out, const struct cli_dconf* dconf);
+void html_norm_output_free(struct html_norm_output *out);
 void html_tag_arg_free(tag_arguments_t *tags);
 int html_screnc_decode(fmap_t *map, const char *dirname);
 void html_tag_arg_add(tag_arguments_t *tags, const char *tag, char *value);
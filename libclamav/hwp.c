@@ -77,34 +77,34 @@
 #define hwpml_debug(...) ;
 #endif
 
-typedef int (*hwp_cb )(void *cbdata, int fd, cli_ctx *ctx);
+/* The stream is inflated into an extraction buffer, see cli_extract_init():
+ * the callback gets a map of the inflated data, which is scanned as is when
+ * there's no callback or the inflation failed */
+typedef int (*hwp_cb )(void *cbdata, fmap_t *map, cli_ctx *ctx);
 static int decompress_and_callback(cli_ctx *ctx, fmap_t *input, off_t at, size_t len, const char *parent, hwp_cb cb, void *cbdata)
 {
-    int zret, ofd, in, ret = CL_SUCCESS;
+    int zret, ret = CL_SUCCESS;
     off_t off_in = at;
-    size_t count, remain = 1, outsize = 0;
+    size_t count, in, remain = 1, outsize = 0;
     z_stream zstrm;
-    char *tmpname;
-    unsigned char inbuf[FILEBUFF], outbuf[FILEBUFF];
+    struct cli_extract x;
+    fmap_t *map;
+    unsigned char outbuf[FILEBUFF];
 
-    if (!ctx || !input || !cb)
+    if (!ctx || !input)
         return CL_ENULLARG;
 
     if (len)
         remain = len;
 
-    /* reserve tempfile for output and callback */
-    if ((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &ofd)) != CL_SUCCESS) {
-        cli_errmsg("%s: Can't generate temporary file\n", parent);
-        return ret;
-    }
+    cli_extract_init(&x, ctx, NULL);
 
     /* initialize zlib inflation stream */
     memset(&zstrm, 0, sizeof(zstrm));
     zstrm.zalloc = Z_NULL;
     zstrm.zfree = Z_NULL;
     zstrm.opaque = Z_NULL;
-    zstrm.next_in = inbuf;
+    zstrm.next_in = NULL;
     zstrm.next_out = outbuf;
     zstrm.avail_in = 0;
     zstrm.avail_out = FILEBUFF;
@@ -112,21 +112,16 @@ static int decompress_and_callback(cli_ctx *ctx, fmap_t *input, off_t at, size_t
     zret = inflateInit2(&zstrm, -15);
     if (zret != Z_OK) {
         cli_errmsg("%s: Can't initialize zlib inflation stream\n", parent);
-        ret = CL_EUNPACK;
-        goto dc_end;
+        if (cli_extract_done(&x))
+            return CL_EUNLINK;
+        return CL_EUNPACK;
     }
 
     /* inflation loop */
     do {
         if (zstrm.avail_in == 0) {
-            zstrm.next_in = inbuf;
-            in = fmap_readn(input, inbuf, off_in, FILEBUFF);
-            if (in < 0) {
-                cli_errmsg("%s: Error reading stream\n", parent);
-                ret = CL_EUNPACK;
-                goto dc_end;
-            }
-            if (!in)
+            zstrm.next_in = (Bytef *)fmap_need_off_once_len(input, off_in, FILEBUFF, &in);
+            if (!zstrm.next_in || !in)
                 break;
 
             if (len) {
@@ -143,9 +138,8 @@ static int decompress_and_callback(cli_ctx *ctx, fmap_t *input, off_t at, size_t
             if ((ret = cli_checklimits("HWP", ctx, outsize + count, 0, 0)) != CL_SUCCESS)
                 break;
 
-            if (cli_writen(ofd, outbuf, count) != count) {
-                cli_errmsg("%s: Can't write to file %s\n", parent, tmpname);
-                ret = CL_EWRITE;
+            if ((ret = cli_extract_write(&x, outbuf, count)) != CL_SUCCESS) {
+                cli_errmsg("%s: Can't write decompressed data\n", parent);
                 goto dc_end;
             }
             outsize += count;
@@ -154,7 +148,7 @@ static int decompress_and_callback(cli_ctx *ctx, fmap_t *input, off_t at, size_t
         zstrm.avail_out = FILEBUFF;
     } while(zret == Z_OK && remain);
 
-    cli_dbgmsg("%s: Decompressed %llu bytes to %s\n", parent, (long long unsigned)outsize, tmpname);
+    cli_dbgmsg("%s: Decompressed %llu bytes\n", parent, (long long unsigned)outsize);
 
     /* post inflation checks */
     if (zret != Z_STREAM_END && zret != Z_OK) {
@@ -168,15 +162,21 @@ static int decompress_and_callback(cli_ctx *ctx, fmap_t *input, off_t at, size_t
     }
 
     /* check for limits exceeded or zlib failure */
-    if (ret == CL_SUCCESS && (zret == Z_STREAM_END || zret == Z_OK)) {
+    if (cb && ret == CL_SUCCESS && (zret == Z_STREAM_END || zret == Z_OK)) {
         if (len && remain > 0)
             cli_infomsg(ctx, "%s: Error decompressing stream. Not all requested input was converted\n", parent);
 
         /* scanning inflated stream */
-        ret = cb(cbdata, ofd, ctx);
+        if (!(map = cli_extract_map(&x))) {
+            cli_errmsg("%s: Failed to get fmap for uncompressed stream\n", parent);
+            ret = CL_EMAP;
+            goto dc_end;
+        }
+        ret = cb(cbdata, map, ctx);
+        funmap(map);
     } else {
         /* default to scanning what we got */
-        ret = cli_magic_scandesc(ofd, ctx);
+        ret = cli_extract_scan(&x);
     }
 
     /* clean-up */
@@ -187,11 +187,8 @@ static int decompress_and_callback(cli_ctx *ctx, fmap_t *input, off_t at, size_t
         if (ret == CL_SUCCESS)
             ret = CL_EUNPACK;
     }
-    close(ofd);
-    if (!ctx->engine->keeptmp)
-        if (cli_unlink(tmpname))
-            ret = CL_EUNLINK;
-    free(tmpname);
+    if (cli_extract_done(&x))
+        ret = CL_EUNLINK;
     return ret;
 }
 
@@ -371,20 +368,12 @@ int cli_hwp5header(cli_ctx *ctx, hwp5_header_t *hwp5)
     return CL_SUCCESS;
 }
 
-static int hwp5_cb(void *cbdata, int fd, cli_ctx *ctx)
-{
-    if (fd < 0 || !ctx)
-        return CL_ENULLARG;
-
-    return cli_magic_scandesc(fd, ctx);
-}
-
-int cli_scanhwp5_stream(cli_ctx *ctx, hwp5_header_t *hwp5, char *name, int fd)
+int cli_scanhwp5_stream(cli_ctx *ctx, hwp5_header_t *hwp5, char *name, fmap_t *map)
 {
     hwp5_debug("HWP5.x: NAME: %s\n", name ? name : "(NULL)");
 
-    if (fd < 0) {
-        cli_errmsg("HWP5.x: Invalid file descriptor argument\n");
+    if (!map) {
+        cli_errmsg("HWP5.x: Invalid stream map argument\n");
         return CL_ENULLARG;
     }
 
@@ -396,31 +385,13 @@ int cli_scanhwp5_stream(cli_ctx *ctx, hwp5_header_t *hwp5, char *name, int fd)
 
             if (hwp5->flags & HWP5_PASSWORD) {
                 cli_dbgmsg("HWP5.x: Password encrypted stream, scanning as-is\n");
-                return cli_magic_scandesc(fd, ctx);
+                return cli_map_scan(map, 0, map->len, ctx, CL_TYPE_ANY);
             }
 
             if (hwp5->flags & HWP5_COMPRESSED) {
                 /* DocInfo JSON Handling */
-                STATBUF statbuf;
-                fmap_t *input;
-                int ret;
-
                 hwp5_debug("HWP5.x: Sending %s for decompress and scan\n", name);
-
-                /* fmap the input file for easier manipulation */
-                if (FSTAT(fd, &statbuf) == -1) {
-                    cli_errmsg("HWP5.x: Can't stat file descriptor\n");
-                    return CL_ESTAT;
-                }
-
-                input = fmap(fd, 0, statbuf.st_size);
-                if (!input) {
-                    cli_errmsg("HWP5.x: Failed to get fmap for input stream\n");
-                    return CL_EMAP;
-                }
-                ret = decompress_and_callback(ctx, input, 0, 0, "HWP5.x", hwp5_cb, NULL);
-                funmap(input);
-                return ret;
+                return decompress_and_callback(ctx, map, 0, 0, "HWP5.x", NULL, NULL);
             }
         }
 
@@ -430,7 +401,7 @@ int cli_scanhwp5_stream(cli_ctx *ctx, hwp5_header_t *hwp5, char *name, int fd)
             if (name && !strncmp(name, "_5_hwpsummaryinformation", 24)) {
                 cli_dbgmsg("HWP5.x: Detected a '_5_hwpsummaryinformation' stream\n");
                 /* JSONOLE2 - what to do if something breaks? */
-                if (cli_ole2_summary_json(ctx, fd, 2) == CL_ETIMEOUT)
+                if (cli_ole2_summary_json_map(ctx, map, 2) == CL_ETIMEOUT)
                     return CL_ETIMEOUT;
             }
         }
@@ -439,7 +410,7 @@ int cli_scanhwp5_stream(cli_ctx *ctx, hwp5_header_t *hwp5, char *name, int fd)
     }
 
     /* normal streams */
-    return cli_magic_scandesc(fd, ctx);
+    return cli_map_scan(map, 0, map->len, ctx, CL_TYPE_ANY);
 }
 
 /*** HWP3 ***/
@@ -1722,9 +1693,8 @@ static inline int parsehwp3_infoblk_1(cli_ctx *ctx, fmap_t *dmap, off_t *offset,
     return ret;
 }
 
-static int hwp3_cb(void *cbdata, int fd, cli_ctx *ctx)
+static int hwp3_cb(void *cbdata, fmap_t *map, cli_ctx *ctx)
 {
-    fmap_t *map, *dmap;
     off_t offset, start;
     int i, t = 0, p = 0, last = 0, ret = CL_SUCCESS;
     uint16_t nstyles;
@@ -1734,30 +1704,12 @@ static int hwp3_cb(void *cbdata, int fd, cli_ctx *ctx)
 
     offset = start = cbdata ? *(off_t *)cbdata : 0;
 
-    if (offset == 0) {
-        if (fd < 0) {
-            cli_errmsg("HWP3.x: Invalid file descriptor argument\n");
-            return CL_ENULLARG;
-        } else {
-            STATBUF statbuf;
-
-            if (FSTAT(fd, &statbuf) == -1) {
-                cli_errmsg("HWP3.x: Can't stat file descriptor\n");
-                return CL_ESTAT;
-            }
-
-            map = dmap = fmap(fd, 0, statbuf.st_size);
-            if (!map) {
-                cli_errmsg("HWP3.x: Failed to get fmap for uncompressed stream\n");
-                return CL_EMAP;
-            }
-        }
-    } else {
-        hwp3_debug("HWP3.x: Document Content Stream starts @ offset %llu\n", (long long unsigned)offset);
-
-        map = *ctx->fmap;
-        dmap = NULL;
+    if (!map) {
+        cli_errmsg("HWP3.x: Invalid stream map argument\n");
+        return CL_ENULLARG;
     }
+    if (offset)
+        hwp3_debug("HWP3.x: Document Content Stream starts @ offset %llu\n", (long long unsigned)offset);
 
     /* Fonts - 7 entries of 2 + (n x 40) bytes where n is the first 2 bytes of the entry */
 #if HAVE_JSON
@@ -1767,11 +1719,8 @@ static int hwp3_cb(void *cbdata, int fd, cli_ctx *ctx)
     for (i = 0; i < 7; i++) {
         uint16_t nfonts;
 
-        if (fmap_readn(map, &nfonts, offset, sizeof(nfonts)) != sizeof(nfonts)) {
-            if (dmap)
-                funmap(dmap);
+        if (fmap_readn(map, &nfonts, offset, sizeof(nfonts)) != sizeof(nfonts))
             return CL_EREAD;
-        }
         nfonts = le16_to_host(nfonts);
 
 #if HAVE_JSON
@@ -1784,11 +1733,8 @@ static int hwp3_cb(void *cbdata, int fd, cli_ctx *ctx)
     }
 
     /* Styles - 2 + (n x 238) bytes where n is the first 2 bytes of the section */
-    if (fmap_readn(map, &nstyles, offset, sizeof(nstyles)) != sizeof(nstyles)) {
-        if (dmap)
-            funmap(dmap);
+    if (fmap_readn(map, &nstyles, offset, sizeof(nstyles)) != sizeof(nstyles))
         return CL_EREAD;
-    }
     nstyles = le16_to_host(nstyles);
 
 #if HAVE_JSON
@@ -1804,11 +1750,8 @@ static int hwp3_cb(void *cbdata, int fd, cli_ctx *ctx)
     /* Paragraphs - are terminated with 0x0d00[13(CR) as hchar], empty paragraph marks end of section and do NOT end with 0x0d00 */
     while (!last && ((ret = parsehwp3_paragraph(ctx, map, p++, 0, &offset, &last)) == CL_SUCCESS));
     /* return is never a virus */
-    if (ret != CL_SUCCESS) {
-        if (dmap)
-            funmap(dmap);
+    if (ret != CL_SUCCESS)
         return ret;
-    }
 #if HAVE_JSON
     if (ctx->options & CL_SCAN_FILE_PROPERTIES)
         cli_jsonint(ctx->wrkproperty, "ParagraphCount", p);
@@ -1830,8 +1773,6 @@ static int hwp3_cb(void *cbdata, int fd, cli_ctx *ctx)
             ret = subret;
     }
 
-    if (dmap)
-        funmap(dmap);
     return ret;
 }
 
@@ -1876,7 +1817,7 @@ int cli_scanhwp3(cli_ctx *ctx)
     if (docinfo.di_compressed)
         ret = decompress_and_callback(ctx, *ctx->fmap, offset, 0, "HWP3.x", hwp3_cb, NULL);
     else
-        ret = hwp3_cb(&offset, 0, ctx);
+        ret = hwp3_cb(&offset, *ctx->fmap, ctx);
 
     if (ret != CL_SUCCESS)
         return ret;
@@ -1925,18 +1866,13 @@ static const struct key_entry hwpml_keys[] = {
 static size_t num_hwpml_keys = sizeof(hwpml_keys) / sizeof(struct key_entry);
 
 /* binary streams needs to be base64-decoded then decompressed if fields are set */
-static int hwpml_scan_cb(void *cbdata, int fd, cli_ctx *ctx)
-{
-    if (fd < 0 || !ctx)
-        return CL_ENULLARG;
-
-    return cli_magic_scandesc(fd, ctx);
-}
-
 static int hwpml_binary_cb(int fd, cli_ctx *ctx, int num_attribs, struct attrib_entry *attribs, void *cbdata)
 {
-    int i, ret, df = 0, com = 0, enc = 0;
-    char *tempfile;
+    int i, ret, com = 0, enc = 0;
+    STATBUF statbuf;
+    fmap_t *input;
+    char *decoded = NULL;
+    size_t decodedlen;
 
     UNUSEDPARAM(cbdata);
 
@@ -1961,29 +1897,29 @@ static int hwpml_binary_cb(int fd, cli_ctx *ctx, int num_attribs, struct attrib_
 
     hwpml_debug("HWPML: Checking attributes: com: %d, enc: %d\n", com, enc);
 
-    /* decode the binary data if needed - base64 */
     if (enc < 0) {
         cli_errmsg("HWPML: Unrecognized encoding method\n");
         return cli_magic_scandesc(fd, ctx);
-    } else if (enc == 1) {
-        STATBUF statbuf;
-        fmap_t *input;
-        const char *instream;
-        char *decoded;
-        size_t decodedlen;
+    }
+    if (enc == 0 && !com)
+        return cli_magic_scandesc(fd, ctx);
 
-        hwpml_debug("HWPML: Decoding base64-encoded binary data\n");
+    /* fmap the input file for easier manipulation */
+    if (FSTAT(fd, &statbuf) == -1) {
+        cli_errmsg("HWPML: Can't stat file descriptor\n");
+        return CL_ESTAT;
+    }
 
-        /* fmap the input file for easier manipulation */
-        if (FSTAT(fd, &statbuf) == -1) {
-            cli_errmsg("HWPML: Can't stat file descriptor\n");
-            return CL_ESTAT;
-        }
+    if (!(input = fmap(fd, 0, statbuf.st_size))) {
+        cli_errmsg("HWPML: Failed to get fmap for binary data\n");
+        return CL_EMAP;
+    }
 
-        if (!(input = fmap(fd, 0, statbuf.st_size))) {
-            cli_errmsg("HWPML: Failed to get fmap for binary data\n");
-            return CL_EMAP;
-        }
+    /* decode the binary data if needed - base64, the decoded data stays in memory */
+    if (enc == 1) {
+        const char *instream;
+
+        hwpml_debug("HWPML: Decoding base64-encoded binary data\n");
 
         /* send data for base64 conversion - TODO: what happens with really big files? */
         if (!(instream = fmap_need_off_once(input, 0, input->len))) {
@@ -1998,60 +1934,26 @@ static int hwpml_binary_cb(int fd, cli_ctx *ctx, int num_attribs, struct attrib_
             cli_errmsg("HWPML: Failed to get base64 decode binary data\n");
             return cli_magic_scandesc(fd, ctx);
         }
+        cli_dbgmsg("HWPML: Decoded %lu bytes of binary data\n", (unsigned long)decodedlen);
 
-        /* open file for writing and scanning */
-        if ((ret = cli_gentempfd(ctx->engine->tmpdir, &tempfile, &df)) != CL_SUCCESS) {
-            cli_warnmsg("HWPML: Failed to create temporary file for decoded stream scanning\n");
+        if (!com) {
+            ret = cli_mem_scandesc(decoded, decodedlen, ctx);
+            free(decoded);
             return ret;
         }
 
-        if(cli_writen(df, decoded, decodedlen) != (int)decodedlen) {
+        if (!(input = cl_fmap_open_memory(decoded, decodedlen))) {
+            cli_errmsg("HWPML: Failed to get fmap for decoded data\n");
             free(decoded);
-            ret = CL_EWRITE;
-            goto hwpml_end;
+            return CL_EMAP;
         }
-        free(decoded);
-
-        /* keeps the later logic simpler */
-        fd = df;
-
-        cli_dbgmsg("HWPML: Decoded binary data to %s\n", tempfile);
     }
 
     /* decompress the file if needed - zlib */
-    if (com) {
-        STATBUF statbuf;
-        fmap_t *input;
-
-        hwpml_debug("HWPML: Decompressing binary data\n");
-
-        /* fmap the input file for easier manipulation */
-        if (FSTAT(fd, &statbuf) == -1) {
-            cli_errmsg("HWPML: Can't stat file descriptor\n");
-            ret = CL_ESTAT;
-            goto hwpml_end;
-        }
-
-        input = fmap(fd, 0, statbuf.st_size);
-        if (!input) {
-            cli_errmsg("HWPML: Failed to get fmap for binary data\n");
-            ret = CL_EMAP;
-            goto hwpml_end;
-        }
-        ret = decompress_and_callback(ctx, input, 0, 0, "HWPML", hwpml_scan_cb, NULL);
-        funmap(input);
-    } else {
-        ret = hwpml_scan_cb(NULL, fd, ctx);
-    }
-
-    /* close decoded file descriptor if used */
- hwpml_end:
-    if (df) {
-        close(df);
-        if (!(ctx->engine->keeptmp))
-            cli_unlink(tempfile);
-        free(tempfile);
-    }
+    hwpml_debug("HWPML: Decompressing binary data\n");
+    ret = decompress_and_callback(ctx, input, 0, 0, "HWPML", NULL, NULL);
+    funmap(input);
+    free(decoded);
     return ret;
 }
 #endif /* HAVE_LIBXML2 */
@@ -0,0 +1,579 @@
+/*
+ *  Deflate decoder writing to a contiguous buffer
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "clamav.h"
+#include "others.h"
+#include "inflate_buf.h"
+
+/* Huffman codes are decoded with a root table indexed by the next ROOT
+ * bits of the input and, for the longer codes, subtables indexed by the
+ * bits that follow, as in zlib. A subtable never takes more entries than
+ * 2^(15 - ROOT) for each code longer than ROOT bits. */
+#define LEN_ROOT    10
+#define DIST_ROOT   8
+#define CODE_ROOT   7
+#define LEN_TABLE   ((1 << LEN_ROOT) + 288 * (1 << (15 - LEN_ROOT)))
+#define DIST_TABLE  ((1 << DIST_ROOT) + 32 * (1 << (15 - DIST_ROOT)))
+
+/* op of a table entry: a literal, a subtable (its index bits), a length
+ * or distance base (16 + its extra bits), the end of block, or a code
+ * which isn't valid */
+#define OP_LIT	    0
+#define OP_BASE	    16
+#define OP_EOB	    64
+#define OP_BAD	    128
+
+struct huff {
+    uint16_t val;
+    uint8_t bits;
+    uint8_t op;
+};
+
+enum huff_kind {
+    KIND_CODES,
+    KIND_LENS,
+    KIND_DISTS
+};
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+/* deflate64: the last length code takes 16 extra bits */
+static const uint16_t len64_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 3 };
+static const uint8_t len64_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 16 };
+/* codes 30 and 31 are only valid in deflate64 */
+static const uint16_t dist_base[32] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577, 32769, 49153 };
+static const uint8_t dist_extra[32] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14 };
+
+/* the input, read little endian up to 64 bits at a time; past its end
+ * the reader gets zero bytes, counted in virt, which mustn't be used */
+struct bits {
+    const unsigned char *in, *end;
+    uint64_t buf;
+    unsigned int cnt, virt;
+};
+
+enum inflate_state {
+    ST_HEADER,
+    ST_STORED,
+    ST_HUFF,
+    ST_END
+};
+
+struct cli_inflate {
+    const unsigned char *start;
+    struct bits br;
+    size_t out;
+    int deflate64;
+    enum inflate_state state;
+    int final;
+    size_t stored; /* bytes left in a stored block */
+    unsigned int copy_len, copy_dist; /* match cut short by a full buffer */
+    const struct huff *lt, *dt;
+    int have_fixed;
+    struct huff fixed_lt[1 << LEN_ROOT], fixed_dt[1 << DIST_ROOT];
+    struct huff lt_dyn[LEN_TABLE], dt_dyn[DIST_TABLE];
+};
+
+static inline uint64_t load64(const unsigned char *p)
+{
+#if WORDS_BIGENDIAN == 0
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+#else
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+#endif
+}
+
+/* at least 56 bits in the buffer; a whole word at once while there are 8
+ * bytes left, the bytes which don't fit are loaded again next time */
+static inline int refill(struct bits *b)
+{
+    if (b->end - b->in >= 8) {
+	b->buf |= load64(b->in) << b->cnt;
+	b->in += (63 - b->cnt) >> 3;
+	b->cnt |= 56;
+	return 0;
+    }
+    while (b->cnt <= 56) {
+	if (b->in < b->end)
+	    b->buf |= (uint64_t)*b->in++ << b->cnt;
+	else if (++b->virt > 8)
+	    return -1; /* the stream is truncated */
+	b->cnt += 8;
+    }
+    return 0;
+}
+
+#define BITS(b, n)  ((unsigned int)((b)->buf & ((1U << (n)) - 1)))
+#define DROP(b, n)  do { (b)->buf >>= (n); (b)->cnt -= (n); } while(0)
+
+static struct huff huff_entry(enum huff_kind kind, unsigned int sym, unsigned int len, int deflate64)
+{
+    struct huff e;
+
+    e.bits = len;
+    e.val = 0;
+    if (kind == KIND_CODES || (kind == KIND_LENS && sym < 256)) {
+	e.op = OP_LIT;
+	e.val = sym;
+    } else if (kind == KIND_LENS && sym == 256) {
+	e.op = OP_EOB;
+    } else if (kind == KIND_LENS && sym - 257 < 29) {
+	e.op = OP_BASE + (deflate64 ? len64_extra : len_extra)[sym - 257];
+	e.val = (deflate64 ? len64_base : len_base)[sym - 257];
+    } else if (kind == KIND_DISTS && sym < (deflate64 ? 32U : 30U)) {
+	e.op = OP_BASE + dist_extra[sym];
+	e.val = dist_base[sym];
+    } else {
+	e.op = OP_BAD;
+    }
+    return e;
+}
+
+/* Builds the tables for the code lengths of n symbols. Fails for the
+ * lengths zlib rejects: an over-subscribed set, or an incomplete one but
+ * for a single code of one bit in a literal/length or distance set. */
+static int huff_build(struct huff *table, unsigned int tsize, unsigned int root, const uint8_t *lens, unsigned int n, enum huff_kind kind, int deflate64)
+{
+    unsigned int count[16], left_count[16], offs[16];
+    uint16_t sorted[320];
+    unsigned int len, max, sym, i, j, k, code, rev, prefix, next, sub_bits = 0, sub_at = 0;
+    struct huff e;
+    int left;
+
+    memset(count, 0, sizeof(count));
+    for (sym = 0; sym < n; sym++)
+	count[lens[sym]]++;
+    for (max = 15; max && !count[max]; max--);
+    e.val = 0;
+    e.bits = 1;
+    e.op = OP_BAD;
+    for (i = 0; i < (1U << root); i++)
+	table[i] = e;
+    if (!max)
+	return 0;
+
+    left = 1;
+    for (len = 1; len <= 15; len++) {
+	left <<= 1;
+	left -= count[len];
+	if (left < 0)
+	    return -1;
+    }
+    if (left > 0 && (kind == KIND_CODES || max != 1))
+	return -1;
+
+    offs[1] = 0;
+    for (len = 1; len < 15; len++)
+	offs[len + 1] = offs[len] + count[len];
+    for (sym = 0; sym < n; sym++)
+	if (lens[sym])
+	    sorted[offs[lens[sym]]++] = sym;
+
+    memcpy(left_count, count, sizeof(count));
+    next = 1U << root;
+    prefix = ~0U;
+    code = 0;
+    k = 0;
+    for (len = 1; len <= max; len++) {
+	for (i = 0; i < count[len]; i++, code++) {
+	    e = huff_entry(kind, sorted[k++], len, deflate64);
+	    for (rev = 0, j = 0; j < len; j++)
+		rev |= ((code >> j) & 1) << (len - 1 - j);
+	    if (len <= root) {
+		for (j = rev; j < (1U << root); j += 1U << len)
+		    table[j] = e;
+	    } else {
+		if ((rev & ((1U << root) - 1)) != prefix) {
+		    /* enough index bits for the codes left with this prefix */
+		    prefix = rev & ((1U << root) - 1);
+		    sub_bits = len - root;
+		    left = 1 << sub_bits;
+		    while (sub_bits + root < max) {
+			left -= left_count[sub_bits + root];
+			if (left <= 0)
+			    break;
+			sub_bits++;
+			left <<= 1;
+		    }
+		    if (next + (1U << sub_bits) > tsize)
+			return -1;
+		    sub_at = next;
+		    next += 1U << sub_bits;
+		    table[prefix].val = sub_at;
+		    table[prefix].bits = root;
+		    table[prefix].op = sub_bits;
+		}
+		for (j = rev >> root; j < (1U << sub_bits); j += 1U << (len - root))
+		    table[sub_at + j] = e;
+	    }
+	    left_count[len]--;
+	}
+	code <<= 1;
+    }
+    return 0;
+}
+
+#define DECODE(e, t, root, b) do {						\
+    (e) = (t)[(b)->buf & ((1U << (root)) - 1)];					\
+    if ((e).op && (e).op < OP_BASE)						\
+	(e) = (t)[(e).val + (((b)->buf >> (root)) & ((1U << (e).op) - 1))];	\
+} while(0)
+
+static void fixed_tables(struct cli_inflate *s)
+{
+    uint8_t lens[288];
+
+    memset(lens, 8, 144);
+    memset(lens + 144, 9, 112);
+    memset(lens + 256, 7, 24);
+    memset(lens + 280, 8, 8);
+    huff_build(s->fixed_lt, 1 << LEN_ROOT, LEN_ROOT, lens, 288, KIND_LENS, s->deflate64);
+    memset(lens, 5, 32);
+    huff_build(s->fixed_dt, 1 << DIST_ROOT, DIST_ROOT, lens, 32, KIND_DISTS, s->deflate64);
+    s->have_fixed = 1;
+}
+
+/* the code lengths of a dynamic block */
+static int dynamic_tables(struct cli_inflate *s, struct bits *b)
+{
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    struct huff codes[1 << CODE_ROOT], e;
+    uint8_t lens[286 + 30];
+    unsigned int nlen, ndist, ncode, i, n, rep, len;
+
+    if (refill(b))
+	return -1;
+    nlen = BITS(b, 5) + 257;
+    DROP(b, 5);
+    ndist = BITS(b, 5) + 1;
+    DROP(b, 5);
+    ncode = BITS(b, 4) + 4;
+    DROP(b, 4);
+    /* inflate64 has the same limit on the distance codes */
+    if (nlen > 286 || ndist > 30)
+	return -1;
+
+    memset(lens, 0, 19);
+    for (i = 0; i < ncode; i++) {
+	if (b->cnt < 3 && refill(b))
+	    return -1;
+	lens[order[i]] = BITS(b, 3);
+	DROP(b, 3);
+    }
+    if (huff_build(codes, 1 << CODE_ROOT, CODE_ROOT, lens, 19, KIND_CODES, 0))
+	return -1;
+
+    for (n = 0; n < nlen + ndist; ) {
+	if (b->cnt < 14 && refill(b))
+	    return -1;
+	e = codes[BITS(b, CODE_ROOT)];
+	if (e.op != OP_LIT)
+	    return -1;
+	DROP(b, e.bits);
+	if (e.val < 16) {
+	    lens[n++] = e.val;
+	    continue;
+	}
+	if (e.val == 16) {
+	    if (!n)
+		return -1;
+	    len = lens[n - 1];
+	    rep = 3 + BITS(b, 2);
+	    DROP(b, 2);
+	} else if (e.val == 17) {
+	    len = 0;
+	    rep = 3 + BITS(b, 3);
+	    DROP(b, 3);
+	} else {
+	    len = 0;
+	    rep = 11 + BITS(b, 7);
+	    DROP(b, 7);
+	}
+	if (n + rep > nlen + ndist)
+	    return -1;
+	while (rep--)
+	    lens[n++] = len;
+    }
+    if (!lens[256])
+	return -1;
+    if (huff_build(s->lt_dyn, LEN_TABLE, LEN_ROOT, lens, nlen, KIND_LENS, s->deflate64) ||
+	huff_build(s->dt_dyn, DIST_TABLE, DIST_ROOT, lens + nlen, ndist, KIND_DISTS, s->deflate64))
+	return -1;
+    s->lt = s->lt_dyn;
+    s->dt = s->dt_dyn;
+    return 0;
+}
+
+/* The copies go 16 or 8 bytes at a time when the match is far enough
+ * behind and the buffer has room for the overshoot, which the following
+ * output overwrites. */
+static inline void match_copy(unsigned char *dst, size_t out, size_t size, unsigned int len, unsigned int dist)
+{
+    unsigned char *d = dst + out, *e = d + len;
+    const unsigned char *src = d - dist;
+
+    if (dist >= 16 && size - out >= (size_t)len + 16) {
+	do {
+	    memcpy(d, src, 16);
+	    d += 16;
+	    src += 16;
+	} while (d < e);
+    } else if (dist >= 8 && size - out >= (size_t)len + 8) {
+	do {
+	    memcpy(d, src, 8);
+	    d += 8;
+	    src += 8;
+	} while (d < e);
+    } else if (dist == 1) {
+	memset(d, *src, len);
+    } else {
+	while (d < e)
+	    *d++ = *src++;
+    }
+}
+
+struct cli_inflate *cli_inflate_new(const void *src, size_t len, int deflate64)
+{
+    struct cli_inflate *s;
+
+    if (!(s = cli_malloc(sizeof(*s)))) {
+	cli_errmsg("cli_inflate_new: Can't allocate memory for the decoder\n");
+	return NULL;
+    }
+    s->start = src;
+    s->br.in = src;
+    s->br.end = s->start + len;
+    s->br.buf = 0;
+    s->br.cnt = 0;
+    s->br.virt = 0;
+    s->out = 0;
+    s->deflate64 = deflate64;
+    s->state = ST_HEADER;
+    s->final = 0;
+    s->stored = 0;
+    s->copy_len = 0;
+    s->copy_dist = 0;
+    s->lt = s->dt = NULL;
+    s->have_fixed = 0;
+    return s;
+}
+
+/* Decodes to dst[cli_inflate_out(s)] and on, up to size; dst keeps what
+ * the previous calls decoded */
+int cli_inflate(struct cli_inflate *s, unsigned char *dst, size_t size)
+{
+    struct bits br = s->br;
+    size_t out = s->out, n;
+    unsigned int len, dist, type;
+    struct huff e;
+    int ret;
+
+    if (s->copy_len) {
+	n = MIN(s->copy_len, size - out);
+	match_copy(dst, out, out + n, n, s->copy_dist);
+	out += n;
+	s->copy_len -= n;
+	if (s->copy_len) {
+	    ret = CLI_INFLATE_FULL;
+	    goto done;
+	}
+    }
+
+    for (;;) {
+	switch (s->state) {
+	case ST_HEADER:
+	    if (s->final) {
+		s->state = ST_END;
+		break;
+	    }
+	    if (refill(&br))
+		goto error;
+	    s->final = br.buf & 1;
+	    type = (br.buf >> 1) & 3;
+	    DROP(&br, 3);
+	    if (type == 0) {
+		/* stored: back to the byte boundary and to the input */
+		DROP(&br, br.cnt & 7);
+		if (br.virt > br.cnt >> 3)
+		    goto error;
+		br.in -= (br.cnt >> 3) - br.virt;
+		br.buf = 0;
+		br.cnt = 0;
+		br.virt = 0;
+		if (br.end - br.in < 4)
+		    goto error;
+		len = br.in[0] | br.in[1] << 8;
+		if (len != (~(br.in[2] | br.in[3] << 8) & 0xffff))
+		    goto error;
+		br.in += 4;
+		s->stored = len;
+		s->state = ST_STORED;
+	    } else if (type == 1) {
+		if (!s->have_fixed)
+		    fixed_tables(s);
+		s->lt = s->fixed_lt;
+		s->dt = s->fixed_dt;
+		s->state = ST_HUFF;
+	    } else if (type == 2) {
+		if (dynamic_tables(s, &br))
+		    goto error;
+		s->state = ST_HUFF;
+	    } else {
+		goto error;
+	    }
+	    break;
+
+	case ST_STORED:
+	    n = MIN(s->stored, size - out);
+	    if (n > (size_t)(br.end - br.in))
+		goto error;
+	    memcpy(dst + out, br.in, n);
+	    br.in += n;
+	    out += n;
+	    s->stored -= n;
+	    if (s->stored) {
+		ret = CLI_INFLATE_FULL;
+		goto done;
+	    }
+	    s->state = ST_HEADER;
+	    break;
+
+	case ST_HUFF:
+	    for (;;) {
+		if (refill(&br))
+		    goto error;
+		DECODE(e, s->lt, LEN_ROOT, &br);
+		if (e.op == OP_LIT) {
+		    if (out == size) {
+			ret = CLI_INFLATE_FULL;
+			goto done;
+		    }
+		    DROP(&br, e.bits);
+		    dst[out++] = e.val;
+		    continue;
+		}
+		if (e.op == OP_EOB) {
+		    DROP(&br, e.bits);
+		    s->state = ST_HEADER;
+		    break;
+		}
+		if (e.op < OP_BASE || e.op > OP_BASE + 16)
+		    goto error;
+		DROP(&br, e.bits);
+		len = e.val + BITS(&br, e.op - OP_BASE);
+		DROP(&br, e.op - OP_BASE);
+
+		if (br.cnt < 32 && refill(&br))
+		    goto error;
+		DECODE(e, s->dt, DIST_ROOT, &br);
+		if (e.op < OP_BASE || e.op > OP_BASE + 16)
+		    goto error;
+		DROP(&br, e.bits);
+		dist = e.val + BITS(&br, e.op - OP_BASE);
+		DROP(&br, e.op - OP_BASE);
+		if (dist > out)
+		    goto error;
+
+		if (len > size - out) {
+		    n = size - out;
+		    match_copy(dst, out, size, n, dist);
+		    out = size;
+		    s->copy_len = len - n;
+		    s->copy_dist = dist;
+		    ret = CLI_INFLATE_FULL;
+		    goto done;
+		}
+		match_copy(dst, out, size, len, dist);
+		out += len;
+	    }
+	    break;
+
+	case ST_END:
+	    /* the zero bytes past the end must not have been used */
+	    if (br.virt * 8 > br.cnt)
+		goto error;
+	    ret = CLI_INFLATE_END;
+	    goto done;
+	}
+    }
+
+ error:
+    ret = CLI_INFLATE_ERROR;
+ done:
+    s->br = br;
+    s->out = out;
+    return ret;
+}
+
+size_t cli_inflate_out(const struct cli_inflate *s)
+{
+    return s->out;
+}
+
+/* the bytes up to the end of the last block decoded */
+size_t cli_inflate_in(const struct cli_inflate *s)
+{
+    return (s->br.in - s->start) + s->br.virt - (s->br.cnt >> 3);
+}
+
+void cli_inflate_free(struct cli_inflate *s)
+{
+    free(s);
+}
+
+int cli_inflate_buf(const void *src, size_t len, void *dst, size_t size, size_t *inlen, size_t *outlen, int deflate64)
+{
+    struct cli_inflate *s;
+    int ret;
+
+    if (!(s = cli_inflate_new(src, len, deflate64)))
+	return CLI_INFLATE_ERROR;
+    ret = cli_inflate(s, dst, size);
+    if (inlen)
+	*inlen = cli_inflate_in(s);
+    if (outlen)
+	*outlen = cli_inflate_out(s);
+    cli_inflate_free(s);
+    return ret;
+}
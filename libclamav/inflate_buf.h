@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/* Deflate (and deflate64) decoder for data which is all in memory and
+ * decodes to a contiguous buffer.
+ *
+ * As the output is never moved the matches are copied straight from the
+ * bytes decoded before, there is no window to maintain. The decoder stops
+ * with CLI_INFLATE_FULL when the buffer is full: the caller may then grow
+ * the buffer, keeping its contents, and call cli_inflate() again.
+ *
+ * It only decodes the streams zlib would decode without complaining: any
+ * error, a truncated stream included, is reported as CLI_INFLATE_ERROR
+ * and the callers start over with zlib (or inflate64), so that whatever
+ * zlib does with broken data doesn't have to be reproduced here. */
+
+#ifndef __INFLATE_BUF_H
+#define __INFLATE_BUF_H
+
+#include <stddef.h>
+
+#define CLI_INFLATE_END	    0  /* end of the last block */
+#define CLI_INFLATE_FULL    1  /* the output buffer is full */
+#define CLI_INFLATE_ERROR   -1
+
+struct cli_inflate;
+
+struct cli_inflate *cli_inflate_new(const void *src, size_t len, int deflate64);
+int cli_inflate(struct cli_inflate *s, unsigned char *dst, size_t size);
+size_t cli_inflate_out(const struct cli_inflate *s);
+size_t cli_inflate_in(const struct cli_inflate *s);
+void cli_inflate_free(struct cli_inflate *s);
+
+/* one-shot version: *inlen and *outlen (either may be NULL) get the bytes
+ * used up to the end of the stream */
+int cli_inflate_buf(const void *src, size_t len, void *dst, size_t size, size_t *inlen, size_t *outlen, int deflate64);
+
+#endif
@@ -459,6 +459,9 @@ static int is_dump_and_scan(cli_ctx *ctx, off_t off, size_t fsize) {
 	cli_dbgmsg("ishield: skipping empty file\n");
 	return CL_CLEAN;
     }
+    /* stored as is, scan it in place unless the temporary files are kept */
+    if(!ctx->engine->keeptmp && off >= 0 && (size_t)off < map->len && fsize <= map->len - off)
+	return cli_map_scan(map, off, fsize, ctx, CL_TYPE_ANY);
     if(!(fname = cli_gentemp(ctx->engine->tmpdir)))
 	return CL_EMEM;
 
@@ -57,6 +57,13 @@ static const void *needblock(const iso9660_t *iso, unsigned int block, int temp)
 static int iso_scan_file(const iso9660_t *iso, unsigned int block, unsigned int len) {
     char *tmpf;
     int fd, ret = CL_SUCCESS;
+    fmap_t *map = *iso->ctx->fmap;
+    size_t off = iso->base_offset + (size_t)block * iso->blocksz;
+
+    /* with plain 2048 byte sectors the file is contiguous, scan it in place
+     * unless the temporary files are to be kept */
+    if(iso->sectsz == 2048 && !iso->ctx->engine->keeptmp && len && off < map->len && len <= map->len - off)
+        return cli_map_scan(map, off, len, iso->ctx, CL_TYPE_ANY);
 
     if(cli_gentempfd(iso->ctx->engine->tmpdir, &tmpf, &fd) != CL_SUCCESS)
         return CL_ETMPFILE;
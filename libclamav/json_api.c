@@ -23,6 +23,9 @@
 #include "clamav-config.h"
 #endif
 
+#include <stdio.h>
+#include <string.h>
+
 #include "clamav.h"
 #include "cltypes.h"
 #include "others.h"
@@ -33,9 +36,11 @@ int cli_json_timeout_cycle_check(cli_ctx *ctx, int *toval)
 {
     if (ctx->options & CL_SCAN_FILE_PROPERTIES) {
         if (*toval <= 0) {
-            if (cli_checktimelimit(ctx) != CL_SUCCESS) {
-                cli_errmsg("cli_json_timeout_cycle_check: timeout!\n");
-                return CL_ETIMEOUT;
+            int ret = cli_checkbudget(ctx);
+
+            if (ret != CL_SUCCESS) {
+                cli_dbgmsg("cli_json_timeout_cycle_check: scan budget exhausted\n");
+                return ret;
             }
             (*toval)++;
         }
@@ -536,6 +541,154 @@ int cli_json_delowner(json_object *owner, const char *key, int idx)
     return CL_SUCCESS;
 }
 
+/* Streaming serializer: the text goes through a fixed buffer and is handed
+ * to emit() each time the buffer fills up, so a large tree never needs a
+ * string of its own. The output is laid out like json_object_to_json_string()
+ * does it. */
+struct json_writer {
+    char *buf;
+    size_t size, pos;
+    cli_json_emit emit;
+    void *cbdata;
+    int ret;
+};
+
+static void jw_flush(struct json_writer *w)
+{
+    if (w->pos && w->ret == CL_SUCCESS)
+        w->ret = w->emit(w->buf, w->pos, w->cbdata);
+    w->pos = 0;
+}
+
+static void jw_put(struct json_writer *w, const char *s, size_t len)
+{
+    while (len && w->ret == CL_SUCCESS) {
+        size_t n = w->size - w->pos;
+
+        if (n > len)
+            n = len;
+        memcpy(w->buf + w->pos, s, n);
+        w->pos += n;
+        s += n;
+        len -= n;
+        if (w->pos == w->size)
+            jw_flush(w);
+    }
+}
+
+#define jw_puts(w, s) jw_put(w, s, strlen(s))
+
+static void jw_string(struct json_writer *w, const char *s, size_t len)
+{
+    size_t i, start = 0;
+    char esc[8];
+
+    jw_put(w, "\"", 1);
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+
+        switch (c) {
+        case '\b': strcpy(esc, "\\b"); break;
+        case '\n': strcpy(esc, "\\n"); break;
+        case '\r': strcpy(esc, "\\r"); break;
+        case '\t': strcpy(esc, "\\t"); break;
+        case '\f': strcpy(esc, "\\f"); break;
+        case '"': strcpy(esc, "\\\""); break;
+        case '\\': strcpy(esc, "\\\\"); break;
+        case '/': strcpy(esc, "\\/"); break;
+        default:
+            if (c >= ' ')
+                continue;
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+        }
+        jw_put(w, s + start, i - start);
+        jw_puts(w, esc);
+        start = i + 1;
+    }
+    jw_put(w, s + start, len - start);
+    jw_put(w, "\"", 1);
+}
+
+static void jw_value(struct json_writer *w, json_object *obj)
+{
+    char num[64];
+
+    switch (obj ? json_object_get_type(obj) : json_type_null) {
+    case json_type_null:
+        jw_puts(w, "null");
+        break;
+    case json_type_boolean:
+        jw_puts(w, json_object_get_boolean(obj) ? "true" : "false");
+        break;
+    case json_type_double:
+        snprintf(num, sizeof(num), "%.17g", json_object_get_double(obj));
+        if (!strpbrk(num, ".eEni"))
+            strcat(num, ".0");
+        jw_puts(w, num);
+        break;
+    case json_type_int:
+#ifdef JSON10
+        snprintf(num, sizeof(num), "%lld", (long long)json_object_get_int64(obj));
+#else
+        snprintf(num, sizeof(num), "%d", json_object_get_int(obj));
+#endif
+        jw_puts(w, num);
+        break;
+    case json_type_string:
+#ifdef JSON10
+        jw_string(w, json_object_get_string(obj), json_object_get_string_len(obj));
+#else
+        jw_string(w, json_object_get_string(obj), strlen(json_object_get_string(obj)));
+#endif
+        break;
+    case json_type_object: {
+        struct json_object_iter iter;
+        int first = 1;
+
+        jw_put(w, "{", 1);
+        json_object_object_foreachC(obj, iter) {
+            jw_puts(w, first ? " " : ", ");
+            jw_string(w, iter.key, strlen(iter.key));
+            jw_put(w, ": ", 2);
+            jw_value(w, iter.val);
+            first = 0;
+        }
+        jw_put(w, " }", 2);
+        break;
+    }
+    case json_type_array: {
+        int i, n = json_object_array_length(obj);
+
+        jw_put(w, "[", 1);
+        for (i = 0; i < n; i++) {
+            jw_puts(w, i ? ", " : " ");
+            jw_value(w, json_object_array_get_idx(obj, i));
+        }
+        jw_put(w, " ]", 2);
+        break;
+    }
+    }
+}
+
+int cli_json_write(json_object *obj, char *buf, size_t bufsize, cli_json_emit emit, void *cbdata)
+{
+    struct json_writer w;
+
+    if (!buf || !bufsize || !emit)
+        return CL_ENULLARG;
+
+    w.buf = buf;
+    w.size = bufsize;
+    w.pos = 0;
+    w.emit = emit;
+    w.cbdata = cbdata;
+    w.ret = CL_SUCCESS;
+
+    jw_value(&w, obj);
+    jw_flush(&w);
+    return w.ret;
+}
+
 #else
 
 int cli_json_nojson()
@@ -54,6 +54,11 @@ int cli_json_addowner(json_object *owner, json_object *child, const char *key, i
 int cli_json_delowner(json_object *owner, const char *key, int idx);
 #define cli_json_delobj(obj)  json_object_put(obj)
 
+/* serializes obj through emit(), bufsize bytes at a time, see clcb_file_props_stream */
+#define JSON_WRITER_CHUNK   8192
+typedef int (*cli_json_emit)(const char *chunk, size_t len, void *cbdata);
+int cli_json_write(json_object *obj, char *buf, size_t bufsize, cli_json_emit emit, void *cbdata);
+
 #if HAVE_DEPRECATED_JSON
 int json_object_object_get_ex(struct json_object *obj, const char *key, struct json_object **value);
 #endif
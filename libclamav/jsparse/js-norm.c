@@ -46,6 +46,8 @@
 #include "jsparse/generated/keywords.h"
 #include "jsparse/textbuf.h"
 
+#define MODULE "JS-Norm: "
+
 /* ----------- tokenizer ---------------- */
 enum tokenizer_state {
 	Initial,
@@ -106,6 +108,19 @@ struct tokens {
 	size_t   capacity;
 };
 
+/* Token strings are carved out of a chain of blocks owned by the parser
+ * state, and are all released together in cli_js_destroy() */
+#define STRING_BLOCK_SIZE 65536
+
+struct string_block {
+	struct string_block *next;
+	size_t size;
+	size_t used;
+	/* followed by size bytes of string data */
+};
+
+#define STRING_BLOCK_DATA(b) ((char*)((b) + 1))
+
 /* state for the current JS file being parsed */
 struct parser_state {
 	unsigned long     var_uniq;
@@ -115,6 +130,7 @@ struct parser_state {
 	struct scope *list;
 	yyscan_t scanner;
 	struct tokens tokens;
+	struct string_block *strings;
 	unsigned int      rec;
 };
 
@@ -139,9 +155,7 @@ static struct scope* scope_new(struct parser_state *state)
 static struct scope* scope_done(struct scope *s)
 {
 	struct scope* parent = s->parent;
-	/* TODO: have a hashtab_destroy */
-	cli_hashtab_clear(&s->id_map);
-	free(s->id_map.htable);
+	cli_hashtab_free(&s->id_map);
 	free(s);
 	return parent;
 }
@@ -287,10 +301,84 @@ static long scope_lookup(struct scope *s, const char *token, const size_t len)
 	return -1;
 }
 
+static char *strings_alloc(struct parser_state *state, size_t len)
+{
+	struct string_block *b = state->strings, *nb;
+	size_t size;
+
+	if(b && b->size - b->used >= len) {
+		char *str = STRING_BLOCK_DATA(b) + b->used;
+		b->used += len;
+		return str;
+	}
+	size = len > STRING_BLOCK_SIZE ? len : STRING_BLOCK_SIZE;
+	nb = cli_malloc(sizeof(*nb) + size);
+	if(!nb) {
+		cli_errmsg(MODULE "Unable to allocate memory for token strings\n");
+		return NULL;
+	}
+	nb->size = size;
+	nb->used = len;
+	if(b && len > STRING_BLOCK_SIZE / 4) {
+		/* large string: keep filling the current block */
+		nb->next = b->next;
+		b->next = nb;
+	} else {
+		nb->next = b;
+		state->strings = nb;
+	}
+	return STRING_BLOCK_DATA(nb);
+}
+
+static char *strings_dup(struct parser_state *state, const char *text, size_t len)
+{
+	char *str = strings_alloc(state, len + 1);
+	if(str) {
+		memcpy(str, text, len);
+		str[len] = '\0';
+	}
+	return str;
+}
+
+/* appends text to str, in place when str is the last string allocated */
+static char *strings_append(struct parser_state *state, char *str, size_t str_len, const char *text, size_t len)
+{
+	struct string_block *b = state->strings;
+	char *nstr;
+
+	if(b && str + str_len + 1 == STRING_BLOCK_DATA(b) + b->used &&
+	   b->size - b->used >= len) {
+		b->used += len;
+		nstr = str;
+	} else {
+		nstr = strings_alloc(state, str_len + len + 1);
+		if(!nstr)
+			return NULL;
+		memcpy(nstr, str, str_len);
+	}
+	memcpy(nstr + str_len, text, len);
+	nstr[str_len + len] = '\0';
+	return nstr;
+}
+
+static void strings_free(struct parser_state *state)
+{
+	struct string_block *b = state->strings;
+	while(b) {
+		struct string_block *nxt = b->next;
+		free(b);
+		b = nxt;
+	}
+	state->strings = NULL;
+}
+
 static int tokens_ensure_capacity(struct tokens *tokens, size_t cap)
 {
 	if(tokens->capacity < cap) {
 	        yystype *data;
+		/* grow geometrically, obfuscated scripts have lots of tokens */
+		if(cap < tokens->capacity * 2)
+			cap = tokens->capacity * 2;
 		cap += 1024;
 		/* Keep old data if OOM */
 		data = cli_realloc(tokens->data, cap * sizeof(*tokens->data));
@@ -313,13 +401,23 @@ static int add_token(struct parser_state *state, const yystype *token)
 struct buf {
 	size_t pos;
 	int outfd;
+	struct text_buffer *mem;
 	char buf[65536];
 };
 
+static inline int buf_flush(struct buf *buf, size_t len)
+{
+	if(buf->mem)
+		return textbuffer_append_len(buf->mem, buf->buf, len) == -1 ? CL_EMEM : CL_SUCCESS;
+	if(write(buf->outfd, buf->buf, len) != (ssize_t)len)
+		return CL_EWRITE;
+	return CL_SUCCESS;
+}
+
 static inline int buf_outc(char c, struct buf *buf)
 {
 	if(buf->pos >= sizeof(buf->buf)) {
-		if(write(buf->outfd, buf->buf, sizeof(buf->buf)) != sizeof(buf->buf))
+		if(buf_flush(buf, sizeof(buf->buf)) != CL_SUCCESS)
 			return CL_EWRITE;
 		buf->pos = 0;
 	}
@@ -342,7 +440,7 @@ static inline int buf_outs(const char *s, struct buf *buf)
 			++s;
 		}
 		if(i == buf_len) {
-			if(write(buf->outfd, buf->buf, buf_len) < 0)
+			if(buf_flush(buf, buf_len) != CL_SUCCESS)
 				return CL_EWRITE;
 		       i = 0;
 		}
@@ -500,39 +598,13 @@ static int match_parameters(const yystype *tokens, const char ** param_names, si
 static const char *de_packer_3[] = {"p","a","c","k","e","r"};
 static const char *de_packer_2[] = {"p","a","c","k","e","d"};
 
-static inline char *textbuffer_done(yyscan_t scanner)
-{
-       char *str = cli_realloc(scanner->buf.data, scanner->buf.pos);
-       if(!str) {
-               str = scanner->buf.data;
-       }
-       scanner->yytext = str;
-       scanner->yylen = scanner->buf.pos - 1;
-       memset(&scanner->buf, 0, sizeof(scanner->buf));
-       return str;
-}
-
-#define MODULE "JS-Norm: "
-
-static void free_token(yystype *token)
-{
-	if(token->vtype == vtype_string) {
-		free(token->val.string);
-		token->val.string = NULL;
-	}
-}
-
 static int replace_token_range(struct tokens *dst, size_t start, size_t end, const struct tokens *with)
 {
 	const size_t len = with ? with->cnt : 0;
-	size_t i;
 	cli_dbgmsg(MODULE "Replacing tokens %lu - %lu with %lu tokens\n", (unsigned long)start,
                    (unsigned long)end, (unsigned long)len);
 	if(start >= dst->cnt || end > dst->cnt)
 		return -1;
-	for(i=start;i<end;i++) {
-		free_token(&dst->data[i]);
-	}
 	if(tokens_ensure_capacity(dst, dst->cnt - (end-start) + len))
 		return CL_EMEM;
 	memmove(&dst->data[start+len], &dst->data[end], (dst->cnt - end) * sizeof(dst->data[0]));
@@ -613,6 +685,7 @@ struct decode_result {
 	size_t pos_end;
         unsigned append:1; /* 0: tokens are replaced with new token(s),
                             1: old tokens are deleted, new ones appended at the end */
+        unsigned borrowed:1; /* txtbuf.data belongs to a token, don't free it */
 };
 
 static void handle_de(yystype *tokens, size_t start, const size_t cnt, const char *name, struct decode_result *res)
@@ -685,22 +758,18 @@ static void handle_de(yystype *tokens, size_t start, const size_t cnt, const cha
 	}
 }
 
-static int handle_unescape(struct tokens *tokens, size_t start)
+/* the unescaped string is never longer than the original, so it is written
+ * back into the token's own storage */
+static void handle_unescape(yystype *token)
 {
-	if(tokens->data[start].type == TOK_StringLiteral) {
-		char *R;
-		struct tokens new_tokens;
-		yystype tok;
-
-		R = cli_unescape(TOKEN_GET(&tokens->data[start], cstring));
-		tok.type = TOK_StringLiteral;
-		TOKEN_SET(&tok, string, R);
-		new_tokens.capacity = new_tokens.cnt = 1;
-		new_tokens.data = &tok;
-		if(replace_token_range(tokens, start-2, start+2, &new_tokens) < 0)
-			return CL_EMEM;
+	char *str = TOKEN_GET(token, string);
+	if(str && strchr(str, '%')) {
+		char *R = cli_unescape(str);
+		if(R) {
+			strcpy(str, R);
+			free(R);
+		}
 	}
-	return CL_SUCCESS;
 }
 
 
@@ -743,7 +812,8 @@ static void handle_eval(struct tokens *tokens, size_t start, struct decode_resul
 {
 	res->txtbuf.data = TOKEN_GET(&tokens->data[start], string);
 	if(res->txtbuf.data && tokens->data[start+1].type == TOK_PAR_CLOSE) {
-		TOKEN_SET(&tokens->data[start], string, NULL);
+		/* the string stays owned by the token arena */
+		res->borrowed = 1;
 		res->txtbuf.pos = strlen(res->txtbuf.data);
 		res->pos_begin = start-2;
 		res->pos_end = start+2;
@@ -752,17 +822,25 @@ static void handle_eval(struct tokens *tokens, size_t start, struct decode_resul
 
 static void run_folders(struct tokens *tokens)
 {
-  size_t i;
+  size_t i, j;
 
-  for(i = 0; i < tokens->cnt; i++) {
+  /* unescape(<string>) is folded into the string literal, compacting the
+   * tokens in a single pass */
+  for(i = 0, j = 0; i < tokens->cnt; i++, j++) {
 	  const char *cstring = TOKEN_GET(&tokens->data[i], cstring);
-	  if(i+2 < tokens->cnt && tokens->data[i].type == TOK_IDENTIFIER_NAME &&
+	  if(i+4 <= tokens->cnt && tokens->data[i].type == TOK_IDENTIFIER_NAME &&
 		    cstring &&
-		    !strcmp("unescape", cstring) && tokens->data[i+1].type == TOK_PAR_OPEN) {
-
-		  handle_unescape(tokens, i+2);
+		    !strcmp("unescape", cstring) && tokens->data[i+1].type == TOK_PAR_OPEN &&
+		    tokens->data[i+2].type == TOK_StringLiteral) {
+
+		  handle_unescape(&tokens->data[i+2]);
+		  tokens->data[j] = tokens->data[i+2];
+		  i += 3;
+	  } else if(i != j) {
+		  tokens->data[j] = tokens->data[i];
 	  }
   }
+  tokens->cnt = j;
 }
 
 static inline int state_update_scope(struct parser_state *state, const yystype *token)
@@ -794,6 +872,7 @@ static void run_decoders(struct parser_state *state)
 	  struct decode_result res;
 	  res.pos_begin = res.pos_end = 0;
 	  res.append = 0;
+	  res.borrowed = 0;
 	  if(tokens->data[i].type == TOK_FUNCTION && i+13 < tokens->cnt) {
 		  name = NULL;
 		  ++i;
@@ -832,7 +911,8 @@ static void run_decoders(struct parser_state *state)
 			cli_js_process_buffer(state, res.txtbuf.data, res.txtbuf.pos);
 			--state->rec;
 		}
-		free(res.txtbuf.data);
+		if(!res.borrowed)
+			free(res.txtbuf.data);
 		/* state->tokens still refers to the embedded/nested context
 		 * here */
 		if(!res.append) {
@@ -897,16 +977,34 @@ void cli_js_parse_done(struct parser_state* state)
 }
 
 
-void cli_js_output(struct parser_state *state, const char *tempdir)
+static void js_output(struct parser_state *state, struct buf *buf)
 {
 	unsigned i;
-	struct buf buf;
 	char lastchar = '\0';
+
+	buf_outs("<script>", buf);
+	state->current = state->global;
+	for(i = 0; i < state->tokens.cnt; i++) {
+		if(state_update_scope(state, &state->tokens.data[i]))
+			lastchar = output_token(&state->tokens.data[i], state->current, buf, lastchar);
+	}
+	/* add /script if not already there */
+	if(buf->pos < 9 || memcmp(buf->buf + buf->pos - 9, "</script>", 9))
+		buf_outs("</script>", buf);
+	if(buf_flush(buf, buf->pos) != CL_SUCCESS) {
+		cli_dbgmsg(MODULE "I/O error\n");
+	}
+}
+
+void cli_js_output(struct parser_state *state, const char *tempdir)
+{
+	struct buf buf;
 	char filename[1024];
 
 	snprintf(filename, 1024, "%s"PATHSEP"javascript", tempdir);
 
 	buf.pos = 0;
+	buf.mem = NULL;
 	buf.outfd = open(filename, O_CREAT | O_WRONLY, 0600);
 	if(buf.outfd < 0) {
 		cli_errmsg(MODULE "cannot open output file for writing: %s\n", filename);
@@ -917,32 +1015,35 @@ void cli_js_output(struct parser_state *state, const char *tempdir)
 		/* separate multiple scripts with \n */
 		buf_outc('\n', &buf);
 	}
-	buf_outs("<script>", &buf);
-	state->current = state->global;
-	for(i = 0; i < state->tokens.cnt; i++) {
-		if(state_update_scope(state, &state->tokens.data[i]))
-			lastchar = output_token(&state->tokens.data[i], state->current, &buf, lastchar);
-	}
-	/* add /script if not already there */
-	if(buf.pos < 9 || memcmp(buf.buf + buf.pos - 9, "</script>", 9))
-		buf_outs("</script>", &buf);
-	if(write(buf.outfd, buf.buf, buf.pos) < 0) {
-		cli_dbgmsg(MODULE "I/O error\n");
-	}
+	js_output(state, &buf);
 	close(buf.outfd);
 	cli_dbgmsg(MODULE "dumped/appended normalized script to: %s\n",filename);
 }
 
+/* Same as cli_js_output(), appending to a buffer instead of the javascript
+ * file */
+void cli_js_output_mem(struct parser_state *state, struct text_buffer *out)
+{
+	struct buf buf;
+
+	buf.pos = 0;
+	buf.outfd = -1;
+	buf.mem = out;
+	if(out->pos) {
+		/* separate multiple scripts with \n */
+		buf_outc('\n', &buf);
+	}
+	js_output(state, &buf);
+	cli_dbgmsg(MODULE "appended normalized script, %lu bytes in memory\n", (unsigned long)out->pos);
+}
+
 void cli_js_destroy(struct parser_state *state)
 {
-	size_t i;
 	if(!state)
 		return;
 	scope_free_all(state->list);
-	for(i=0;i<state->tokens.cnt;i++) {
-		free_token(&state->tokens.data[i]);
-	}
 	free(state->tokens.data);
+	strings_free(state);
 	/* detect use after free */
 	if(state->scanner)
 		yylex_destroy(state->scanner);
@@ -990,7 +1091,7 @@ void cli_js_process_buffer(struct parser_state *state, const char *buf, size_t n
 				if(current->last_token == TOK_DOT) {
 					/* this is a member name, don't normalize
 					*/
-					TOKEN_SET(&val, string, cli_strdup(text));
+					TOKEN_SET(&val, string, strings_dup(state, text, leng));
 					val.type = TOK_UNNORM_IDENTIFIER;
 				} else {
 					switch(current->fsm_state) {
@@ -1114,32 +1215,26 @@ void cli_js_process_buffer(struct parser_state *state, const char *buf, size_t n
 				TOKEN_SET(&val, scope, state->current);
 				break;
 			case TOK_StringLiteral:
+				if(val.vtype != vtype_string)
+					break;
+				/* the lexer returns the string in its own buffer */
+				text = yyget_text(state->scanner);
+				leng = yyget_leng(state->scanner);
 				if(state->tokens.cnt > 1 && state->tokens.data[state->tokens.cnt-1].type == TOK_PLUS) {
 					/* see if can fold */
 					yystype *prev_string = &state->tokens.data[state->tokens.cnt-2];
-					if(prev_string->type == TOK_StringLiteral) {
-						char *str = TOKEN_GET(prev_string, string);
-						size_t str_len = strlen(str);
-
-						text = yyget_text(state->scanner);
-						leng = yyget_leng(state->scanner);
-
-
+					char *str = TOKEN_GET(prev_string, string);
+					if(prev_string->type == TOK_StringLiteral && str &&
+					   (str = strings_append(state, str, strlen(str), text, leng))) {
 						/* delete TOK_PLUS */
-						free_token(&state->tokens.data[--state->tokens.cnt]);
-
-						str = cli_realloc(str, str_len + leng + 1);
-						if (!str)
-						    break;
-						strncpy(str+str_len, text, leng);
-						str[str_len + leng] = '\0';
+						--state->tokens.cnt;
 						TOKEN_SET(prev_string, string, str);
-						free(val.val.string);
 						memset(&val, 0, sizeof(val));
 						val.vtype = vtype_undefined;
 						continue;
 					}
 				}
+				TOKEN_SET(&val, string, strings_dup(state, text, leng));
 				break;
 		}
 		if(val.vtype == vtype_undefined) {
@@ -1291,7 +1386,7 @@ static inline int parseString(YYSTYPE *lvalp, yyscan_t scanner, const char q,
 		/* skip over end quote */
 		scanner->pos += len + 1;
 		textbuffer_putc(&scanner->buf, '\0');
-		str = textbuffer_done(scanner);
+		str = scanner->buf.data;
 		if (str) {
 		    TOKEN_SET(lvalp, string, str);
 		} else {
@@ -29,6 +29,7 @@ struct parser_state *cli_js_init(void);
 void cli_js_process_buffer(struct parser_state *state, const char *buf, size_t n);
 void cli_js_parse_done(struct parser_state* state);
 void cli_js_output(struct parser_state *state, const char *tempdir);
+void cli_js_output_mem(struct parser_state *state, struct text_buffer *out);
 void cli_js_destroy(struct parser_state *state);
 
 char *cli_unescape(const char *str);
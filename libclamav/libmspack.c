@@ -20,6 +20,7 @@ enum mspack_type {
 	FILETYPE_DUNNO,
 	FILETYPE_FMAP,
 	FILETYPE_FILENAME,
+	FILETYPE_EXTRACT,
 };
 
 struct mspack_name {
@@ -27,9 +28,13 @@ struct mspack_name {
 	off_t org;
 };
 
+/* the members are written to x instead of a file when it's set, ret is the
+ * error which made the write fail */
 struct mspack_system_ex {
 	struct mspack_system ops;
 	off_t max_size;
+	struct cli_extract *x;
+	int ret;
 };
 
 struct mspack_handle {
@@ -41,6 +46,8 @@ struct mspack_handle {
 
 	FILE *f;
 	off_t max_size;
+
+	struct mspack_system_ex *ops_ex;
 };
 
 static struct mspack_file *mspack_fmap_open(struct mspack_system *self,
@@ -86,6 +93,15 @@ static struct mspack_file *mspack_fmap_open(struct mspack_system *self,
 		goto out_err;
 	}
 
+	self_ex = (struct mspack_system_ex *)((char *)mptr - offsetof(struct mspack_system_ex,ops));
+	mspack_handle->max_size = self_ex->max_size;
+	mspack_handle->ops_ex = self_ex;
+
+	if (self_ex->x && mode == MSPACK_SYS_OPEN_WRITE) {
+		mspack_handle->type = FILETYPE_EXTRACT;
+		return (struct mspack_file *)mspack_handle;
+	}
+
 	mspack_handle->type = FILETYPE_FILENAME;
 
 	mspack_handle->f = fopen(filename, fmode);
@@ -94,8 +110,6 @@ static struct mspack_file *mspack_fmap_open(struct mspack_system *self,
 		goto out_err;
 	}
 
-	self_ex = (struct mspack_system_ex *)((char *)mptr - offsetof(struct mspack_system_ex,ops));
-	mspack_handle->max_size = self_ex->max_size;
 	return (struct mspack_file *)mspack_handle;
 
 out_err:
@@ -143,6 +157,10 @@ static int mspack_fmap_read(struct mspack_file *file, void *buffer, int bytes)
 		mspack_handle->offset += bytes;
 		return bytes;
 	}
+	if (mspack_handle->type == FILETYPE_EXTRACT) {
+		cli_dbgmsg("%s() %d\n", __func__, __LINE__);
+		return -1;
+	}
 	count = fread(buffer, bytes, 1, mspack_handle->f);
 	if (count < 1) {
 		cli_dbgmsg("%s() %d %d, %zd\n", __func__, __LINE__, bytes, count);
@@ -178,6 +196,17 @@ static int mspack_fmap_write(struct mspack_file *file, void *buffer, int bytes)
  
 	mspack_handle->max_size -= max_size;
 
+	if (mspack_handle->type == FILETYPE_EXTRACT) {
+		struct mspack_system_ex *self_ex = mspack_handle->ops_ex;
+
+		self_ex->ret = cli_extract_write(self_ex->x, buffer, (size_t)max_size);
+		if (self_ex->ret != CL_SUCCESS) {
+			cli_dbgmsg("%s() err %d <%d>\n", __func__, self_ex->ret, bytes);
+			return -1;
+		}
+		return bytes;
+	}
+
 	count = fwrite(buffer, max_size, 1, mspack_handle->f);
 	if (count < 1) {
 		cli_dbgmsg("%s() err %m <%zd %d>\n", __func__, count, bytes);
@@ -221,6 +250,10 @@ static int mspack_fmap_seek(struct mspack_file *file, off_t offset, int mode)
 		mspack_handle->offset = new_pos;
 		return 0;
 	}
+	if (mspack_handle->type == FILETYPE_EXTRACT) {
+		cli_dbgmsg("%s() err %d\n", __func__, __LINE__);
+		return -1;
+	}
 
 	switch (mode) {
 	case MSPACK_SYS_SEEK_START:
@@ -249,6 +282,8 @@ static off_t mspack_fmap_tell(struct mspack_file *file)
 
 	if (mspack_handle->type == FILETYPE_FMAP)
 		return mspack_handle->offset;
+	if (mspack_handle->type == FILETYPE_EXTRACT)
+		return (off_t) mspack_handle->ops_ex->x->len;
 
 	return (off_t) ftell(mspack_handle->f);
 }
@@ -285,18 +320,54 @@ static struct mspack_system mspack_sys_fmap_ops = {
 	.copy = mspack_fmap_copy,
 };
 
-static int cli_scanfile(const char *filename, cli_ctx *ctx)
+/* The members are written to the extraction sink, which keeps them in memory
+ * and scans the large ones while they're decompressed, see
+ * cli_extract_expect(). The extraction starts over when such a member turns
+ * out to need the whole file. */
+typedef int (*mspack_extract_cb)(void *d, void *f, const char *name);
+
+static int mspack_cab_extract(void *d, void *f, const char *name)
+{
+	struct mscab_decompressor *cab_d = d;
+
+	return cab_d->extract(cab_d, f, name);
+}
+
+static int mspack_chm_extract(void *d, void *f, const char *name)
+{
+	struct mschm_decompressor *mschm_d = d;
+
+	return mschm_d->extract(mschm_d, f, name);
+}
+
+static int mspack_scan_member(cli_ctx *ctx, struct mspack_system_ex *ops_ex,
+		mspack_extract_cb extract, void *d, void *f, off_t length, off_t max_size)
 {
-	int fd, ret;
+	struct cli_extract x;
+	int ret;
 
-	/* internal version of cl_scanfile with arec/mrec preserved */
-	fd = safe_open(filename, O_RDONLY|O_BINARY);
-	if (fd < 0)
-		return CL_EOPEN;
+	cli_extract_init(&x, ctx, NULL);
+	if (length > 0 && (!ctx->engine->maxfilesize || length <= (off_t) ctx->engine->maxfilesize))
+		cli_extract_expect(&x, length);
+	ops_ex->x = &x;
+	do {
+		ops_ex->max_size = max_size;
+		ops_ex->ret = CL_SUCCESS;
+		ret = extract(d, f, "");
+		if (ops_ex->ret != CL_SUCCESS) {
+			ret = ops_ex->ret;
+			continue;
+		}
+		if (ret)
+			/* Failed to extract. Try to scan what is there */
+			cli_dbgmsg("%s() failed to extract %d\n", __func__, ret);
 
-	ret = cli_magic_scandesc(fd, ctx);
+		ret = cli_extract_scan(&x);
+	} while (cli_extract_again(&x));
+	ops_ex->x = NULL;
 
-	close(fd);
+	if (cli_extract_done(&x) && ret == CL_CLEAN)
+		ret = CL_EUNLINK;
 	return ret;
 }
 
@@ -337,7 +408,6 @@ int cli_scanmscab(cli_ctx *ctx, off_t sfx_offset)
 	files = 0;
 	for (cab_f = cab_h->files; cab_f; cab_f = cab_f->next) {
 		off_t max_size;
-		char *tmp_fname;
 
 		ret = cli_matchmeta(ctx, cab_f->filename, 0, cab_f->length, 0,
 				files, 0, NULL);
@@ -367,31 +437,11 @@ int cli_scanmscab(cli_ctx *ctx, off_t sfx_offset)
 				ctx->engine->maxfilesize :
 				0xffffffff;
 
-		tmp_fname = cli_gentemp(ctx->engine->tmpdir);
-		if (!tmp_fname) {
-			ret = CL_EMEM;
-			break;
-		}
-
-		ops_ex.max_size = max_size;
-		/* scan */
-		ret = cab_d->extract(cab_d, cab_f, tmp_fname);
-		if (ret)
-			/* Failed to extract. Try to scan what is there */
-			cli_dbgmsg("%s() failed to extract %d\n", __func__, ret);
-
-		ret = cli_scanfile(tmp_fname, ctx);
+		ret = mspack_scan_member(ctx, &ops_ex, mspack_cab_extract, cab_d, cab_f,
+				cab_f->length, max_size);
 		if (ret == CL_VIRUS)
 			virus_num++;
 
-		if (!ctx->engine->keeptmp) {
-			if (!access(tmp_fname, R_OK) && cli_unlink(tmp_fname)) {
-				free(tmp_fname);
-				ret = CL_EUNLINK;
-				break;
-			}
-		}
-		free(tmp_fname);
 		files++;
 		if (ret == CL_VIRUS && SCAN_ALL)
 			continue;
@@ -444,7 +494,6 @@ int cli_scanmschm(cli_ctx *ctx)
 	files = 0;
 	for (mschm_f = mschm_h->files; mschm_f;	mschm_f = mschm_f->next) {
 		off_t max_size;
-		char *tmp_fname;
 
 		ret = cli_matchmeta(ctx, mschm_f->filename, 0, mschm_f->length,
 				0, files, 0, NULL);
@@ -474,32 +523,11 @@ int cli_scanmschm(cli_ctx *ctx)
 				ctx->engine->maxfilesize :
 				0xffffffff;
 
-		ops_ex.max_size = max_size;
-
-		tmp_fname = cli_gentemp(ctx->engine->tmpdir);
-		if (!tmp_fname) {
-			ret = CL_EMEM;
-			break;
-		}
-
-		/* scan */
-		ret = mschm_d->extract(mschm_d, mschm_f, tmp_fname);
-		if (ret)
-			/* Failed to extract. Try to scan what is there */
-			cli_dbgmsg("%s() failed to extract %d\n", __func__, ret);
-
-		ret = cli_scanfile(tmp_fname, ctx);
+		ret = mspack_scan_member(ctx, &ops_ex, mspack_chm_extract, mschm_d, mschm_f,
+				mschm_f->length, max_size);
 		if (ret == CL_VIRUS)
 			virus_num++;
 
-		if (!ctx->engine->keeptmp) {
-			if (!access(tmp_fname, R_OK) && cli_unlink(tmp_fname)) {
-				free(tmp_fname);
-				ret = CL_EUNLINK;
-				break;
-			}
-		}
-		free(tmp_fname);
 		files++;
 		if (ret == CL_VIRUS && SCAN_ALL)
 			continue;
@@ -61,22 +61,165 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "clamav.h"
 #include "line.h"
 #include "others.h"
 
+/*
+ * A mail has one line per line of text, so rather than being allocated
+ * one by one they are carved out of blocks. Each line is preceded by a
+ * pointer to its block. A block is freed when its last line is, unless
+ * its thread is still filling it, in which case it's reused from the
+ * start. Lines never go from one thread to another.
+ */
+#define	LINE_BLOCK_SIZE	65536
+#define	LINE_HDR_SIZE	sizeof(line_block *)
+#define	LINE_ALIGN(n)	(((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+typedef struct line_block {
+	size_t	size;
+	size_t	used;
+	size_t	live;	/* lines not unlinked yet */
+	int	current;	/* being filled by its thread */
+} line_block;
+
+#define	LINE_BLOCK_DATA(b)	((char *)(b) + LINE_ALIGN(sizeof(line_block)))
+
+static void
+lineBlockRetire(void *ptr)
+{
+	line_block *b = (line_block *)ptr;
+
+	if(b == NULL)
+		return;
+	b->current = 0;
+	if(b->live == 0)
+		free(b);
+}
+
+#ifdef CL_THREAD_SAFE
+static pthread_key_t line_tls_key;
+static pthread_once_t line_tls_key_once = PTHREAD_ONCE_INIT;
+
+/* the destructor doesn't run for the main thread */
+static void
+lineCleanupMain(void)
+{
+	lineBlockRetire(pthread_getspecific(line_tls_key));
+	pthread_setspecific(line_tls_key, NULL);
+}
+
+static void
+lineTlsKeyAlloc(void)
+{
+	pthread_key_create(&line_tls_key, lineBlockRetire);
+	if(atexit(lineCleanupMain))
+		cli_dbgmsg("line: failed to register atexit\n");
+}
+
+static line_block *
+lineBlockCurrent(void)
+{
+	pthread_once(&line_tls_key_once, lineTlsKeyAlloc);
+	return (line_block *)pthread_getspecific(line_tls_key);
+}
+
+static int
+lineBlockSetCurrent(line_block *b)
+{
+	return pthread_setspecific(line_tls_key, b) ? -1 : 0;
+}
+#else
+static line_block *line_block_current = NULL;
+static int line_atexit_done = 0;
+
+static void
+lineCleanupMain(void)
+{
+	lineBlockRetire(line_block_current);
+	line_block_current = NULL;
+}
+
+static line_block *
+lineBlockCurrent(void)
+{
+	return line_block_current;
+}
+
+static int
+lineBlockSetCurrent(line_block *b)
+{
+	if(!line_atexit_done) {
+		line_atexit_done = 1;
+		if(atexit(lineCleanupMain))
+			cli_dbgmsg("line: failed to register atexit\n");
+	}
+	line_block_current = b;
+	return 0;
+}
+#endif
+
+/* returns a block with room for need bytes */
+static line_block *
+lineBlockGet(size_t need)
+{
+	line_block *cur = lineBlockCurrent(), *b;
+	const size_t hdr = LINE_ALIGN(sizeof(line_block));
+
+	if(cur && cur->size - cur->used >= need)
+		return cur;
+
+	if(need > LINE_BLOCK_SIZE / 4) {
+		/* long lines get a block of their own */
+		b = (line_block *)cli_malloc(hdr + need);
+		if(b == NULL)
+			return NULL;
+		b->size = need;
+		b->used = b->live = 0;
+		b->current = 0;
+		return b;
+	}
+
+	b = (line_block *)cli_malloc(hdr + LINE_BLOCK_SIZE);
+	if(b == NULL)
+		return NULL;
+	b->size = LINE_BLOCK_SIZE;
+	b->used = b->live = 0;
+	b->current = 1;
+	if(lineBlockSetCurrent(b) < 0) {
+		free(b);
+		return NULL;
+	}
+	lineBlockRetire(cur);
+
+	return b;
+}
+
 line_t *
 lineCreate(const char *data)
 {
 	const size_t size = strlen(data);
-	line_t *ret = (line_t *)cli_malloc(size + 2);
+	const size_t need = LINE_ALIGN(LINE_HDR_SIZE + size + 2);
+	line_block *b = lineBlockGet(need);
+	char *hdr;
+	line_t *ret;
 
-    if(ret == NULL) {
+    if(b == NULL) {
         cli_errmsg("lineCreate: Unable to allocate memory for ret\n");
         return (line_t *)NULL;
     }
 
+	hdr = LINE_BLOCK_DATA(b) + b->used;
+	b->used += need;
+	b->live++;
+	memcpy(hdr, &b, sizeof(b));
+	ret = hdr + LINE_HDR_SIZE;
+
 	ret[0] = (char)1;
 	/*strcpy(&ret[1], data);*/
 	memcpy(&ret[1], data, size);
@@ -104,7 +247,15 @@ lineUnlink(line_t *line)
 	/*printf("%d:\n\t'%s'\n", (int)line[0], &line[1]);*/
 
 	if(--line[0] == 0) {
-		free(line);
+		line_block *b;
+
+		memcpy(&b, line - LINE_HDR_SIZE, sizeof(b));
+		if(--b->live == 0) {
+			if(b->current)
+				b->used = 0;
+			else
+				free(b);
+		}
 		return NULL;
 	}
 	return line;
@@ -0,0 +1,150 @@
+/*
+ *  Time and memory of the phases of the engine load.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "clamav.h"
+#include "others.h"
+#include "mpool.h"
+#include "loadstats.h"
+
+static const char *loadstat_names[CLI_LOADSTAT_PHASES] = {
+    "load",
+    "cvd-verify",
+    "cvd-unpack",
+    "parse-hash",
+    "parse-body",
+    "parse-logical",
+    "parse-bytecode",
+    "parse-yara",
+    "parse-other",
+    "compile",
+    "ac-buildtrie",
+    "hm-flush",
+    "pcre-compile",
+    "bytecode-prepare",
+    "cache-init"
+};
+
+static uint64_t loadstat_wall(void)
+{
+    struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* the whole process, to include the parsing threads */
+static uint64_t loadstat_cpu(void)
+{
+#ifndef _WIN32
+    struct rusage ru;
+
+    if (!getrusage(RUSAGE_SELF, &ru))
+        return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+    return 0;
+}
+
+/* the memory pool, the rest of the allocations isn't seen */
+static size_t loadstat_mem(const struct cl_engine *engine)
+{
+#ifdef USE_MPOOL
+    size_t used, total;
+
+    if (!mpool_getstats(engine, &used, &total))
+        return used;
+#else
+    UNUSEDPARAM(engine);
+#endif
+    return 0;
+}
+
+void cli_loadstat_start(const struct cl_engine *engine, struct cli_loadtimer *timer, enum cli_loadstat_phase phase)
+{
+    struct cl_engine *eng = (struct cl_engine *)engine;
+
+    memset(timer, 0, sizeof(*timer));
+    timer->phase = phase;
+    timer->parent = eng->loadtimer;
+    eng->loadtimer = timer;
+    timer->mem = loadstat_mem(engine);
+    timer->cpu = loadstat_cpu();
+    timer->wall = loadstat_wall();
+}
+
+void cli_loadstat_stop(const struct cl_engine *engine, struct cli_loadtimer *timer)
+{
+    struct cl_engine *eng = (struct cl_engine *)engine;
+    struct cli_loadstat *stat = &eng->loadstats[timer->phase];
+    uint64_t wall = loadstat_wall() - timer->wall, cpu = loadstat_cpu() - timer->cpu;
+    int64_t mem = (int64_t)loadstat_mem(engine) - (int64_t)timer->mem;
+
+    stat->calls++;
+    stat->wall_usec += wall > timer->child_wall ? wall - timer->child_wall : 0;
+    stat->cpu_usec += cpu > timer->child_cpu ? cpu - timer->child_cpu : 0;
+    stat->mem += mem - timer->child_mem;
+    if ((eng->loadtimer = timer->parent)) {
+        timer->parent->child_wall += wall;
+        timer->parent->child_cpu += cpu;
+        timer->parent->child_mem += mem;
+    }
+}
+
+int cl_engine_get_loadstats(const struct cl_engine *engine, struct cl_loadstat *stats, unsigned int *count)
+{
+    unsigned int i, n = 0;
+
+    if (!engine || !count || (*count && !stats)) {
+        cli_errmsg("cl_engine_get_loadstats: NULL argument\n");
+        return CL_ENULLARG;
+    }
+    for (i = 0; i < CLI_LOADSTAT_PHASES; i++) {
+        const struct cli_loadstat *stat = &engine->loadstats[i];
+
+        if (!stat->calls)
+            continue;
+        if (n < *count) {
+            memset(&stats[n], 0, sizeof(stats[n]));
+            strncpy(stats[n].name, loadstat_names[i], sizeof(stats[n].name) - 1);
+            stats[n].calls = stat->calls;
+            stats[n].wall_usec = stat->wall_usec;
+            stats[n].cpu_usec = stat->cpu_usec;
+            stats[n].mem_bytes = stat->mem;
+        }
+        n++;
+    }
+    *count = n;
+    return CL_SUCCESS;
+}
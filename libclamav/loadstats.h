@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/* Time and memory of the phases of cl_load() and cl_engine_compile(), see
+ * cl_engine_get_loadstats().
+ *
+ * A phase is timed between cli_loadstat_start() and cli_loadstat_stop()
+ * with a timer on the stack of the caller. The timers nest: the phases
+ * started inside another one are subtracted from it, so each one reports
+ * its own cost and the sum of the phases is the total. Loading an engine
+ * is serial, the parsing threads of CL_ENGINE_LOAD_THREADS are only seen
+ * in the CPU time of the process. */
+
+#ifndef __LOADSTATS_H
+#define __LOADSTATS_H
+
+#include "others.h"
+
+struct cli_loadtimer {
+    enum cli_loadstat_phase phase;
+    uint64_t wall, cpu;
+    size_t mem;
+    uint64_t child_wall, child_cpu;
+    int64_t child_mem;
+    struct cli_loadtimer *parent;
+};
+
+void cli_loadstat_start(const struct cl_engine *engine, struct cli_loadtimer *timer, enum cli_loadstat_phase phase);
+void cli_loadstat_stop(const struct cl_engine *engine, struct cli_loadtimer *timer);
+
+#endif
@@ -88,9 +88,23 @@ int cli_LzmaInit(struct CLI_LZMA *L, uint64_t size_override) {
 	L->s_cnt--;
     }
 
+    if(L->ctx) {
+	CLzmaProps props;
+
+	if(LzmaProps_Decode(&props, L->header, LZMA_PROPS_SIZE) != SZ_OK)
+	    return LZMA_RESULT_DATA_ERROR;
+	if(cli_memgov_reserve(L->ctx, props.dicSize, 1) != CL_SUCCESS)
+	    return LZMA_RESULT_DATA_ERROR;
+	L->reserved = props.dicSize;
+    }
+
     LzmaDec_Construct(&L->state);
-    if(LzmaDec_Allocate(&L->state, L->header, LZMA_PROPS_SIZE, &g_Alloc) != SZ_OK)
+    if(LzmaDec_Allocate(&L->state, L->header, LZMA_PROPS_SIZE, &g_Alloc) != SZ_OK) {
+	if(L->reserved)
+	    cli_memgov_release(L->ctx->engine, L->reserved);
+	L->reserved = 0;
 	return LZMA_RESULT_DATA_ERROR;
+    }
     LzmaDec_Init(&L->state);
 
     L->freeme = 1;
@@ -101,6 +115,9 @@ int cli_LzmaInit(struct CLI_LZMA *L, uint64_t size_override) {
 void cli_LzmaShutdown(struct CLI_LZMA *L) {
     if(L->freeme)
 	LzmaDec_Free(&L->state, &g_Alloc);
+    if(L->reserved)
+	cli_memgov_release(L->ctx->engine, L->reserved);
+    L->reserved = 0;
     return;
 }
 
@@ -40,6 +40,9 @@ struct CLI_LZMA {
     unsigned char *next_out;
     SizeT avail_in;
     SizeT avail_out;
+    /* when set, the dictionary is reserved with cli_memgov_reserve() */
+    cli_ctx *ctx;
+    uint64_t reserved;
 };
 
 
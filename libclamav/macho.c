@@ -35,6 +35,7 @@
 #include "macho.h"
 #include "execs.h"
 #include "scanners.h"
+#include "fmap.h"
 
 #define EC32(v, conv)	(conv ? cbswap32(v) : v)
 #define EC64(v, conv)	(conv ? cbswap64(v) : v)
@@ -172,6 +173,18 @@ struct macho_fat_arch
     uint32_t align;
 };
 
+/* The result of walking the load commands, once for cli_scanmacho() and
+ * cli_machoheader() */
+struct macho_headers {
+    size_t off, len; /* the extent of the map they were read for */
+    int ret; /* of macho_parse() */
+    uint32_t ep;
+    uint16_t nsections;
+    struct cli_exe_section *section;
+};
+
+#define MACHO_BROKEN -1
+
 #define RETURN_BROKEN					    \
     if(matcher)						    \
 	return -1;					    \
@@ -202,7 +215,10 @@ static uint32_t cli_rawaddr(uint32_t vaddr, struct cli_exe_section *sects, uint1
     return vaddr - sects[i].rva + sects[i].raw;
 }
 
-int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
+/* Walks the load commands; returns the result for cli_scanmacho() with
+ * MACHO_BROKEN for Heuristics.Broken.Executable and fills in fileinfo on
+ * success */
+static int macho_parse(fmap_t *map, struct cli_exe_info *fileinfo)
 {
 	struct macho_hdr hdr;
 	struct macho_load_cmd load_cmd;
@@ -210,19 +226,15 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 	struct macho_segment_cmd64 segment_cmd64;
 	struct macho_section section;
 	struct macho_section64 section64;
-	unsigned int i, j, sect = 0, conv, m64, nsects, matcher = 0;
+	unsigned int i, j, sect = 0, conv, m64, nsects;
 	unsigned int arch = 0, ep = 0, err;
 	struct cli_exe_section *sections = NULL;
 	char name[16];
-	fmap_t *map = *ctx->fmap;
 	ssize_t at;
 
-    if(fileinfo)
-	matcher = 1;
-
     if(fmap_readn(map, &hdr, 0, sizeof(hdr)) != sizeof(hdr)) {
 	cli_dbgmsg("cli_scanmacho: Can't read header\n");
-	return matcher ? -1 : CL_EFORMAT;
+	return CL_EFORMAT;
     }
     at = sizeof(hdr);
 
@@ -240,44 +252,37 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 	m64 = 1;
     } else {
 	cli_dbgmsg("cli_scanmacho: Incorrect magic\n");
-	return matcher ? -1 : CL_EFORMAT;
+	return CL_EFORMAT;
     }
 
     switch(EC32(hdr.cpu_type, conv)) {
 	case 7:
-	    if(!matcher)
-		cli_dbgmsg("MACHO: CPU Type: Intel 32-bit\n");
+	    cli_dbgmsg("MACHO: CPU Type: Intel 32-bit\n");
 	    arch = 1;
 	    break;
 	case 7 | 0x1000000:
-	    if(!matcher)
-		cli_dbgmsg("MACHO: CPU Type: Intel 64-bit\n");
+	    cli_dbgmsg("MACHO: CPU Type: Intel 64-bit\n");
 	    break;
 	case 12:
-	    if(!matcher)
-		cli_dbgmsg("MACHO: CPU Type: ARM\n");
+	    cli_dbgmsg("MACHO: CPU Type: ARM\n");
 	    break;
 	case 14:
-	    if(!matcher)
-		cli_dbgmsg("MACHO: CPU Type: SPARC\n");
+	    cli_dbgmsg("MACHO: CPU Type: SPARC\n");
 	    break;
 	case 18:
-	    if(!matcher)
-		cli_dbgmsg("MACHO: CPU Type: POWERPC 32-bit\n");
+	    cli_dbgmsg("MACHO: CPU Type: POWERPC 32-bit\n");
 	    arch = 2;
 	    break;
 	case 18 | 0x1000000:
-	    if(!matcher)
-		cli_dbgmsg("MACHO: CPU Type: POWERPC 64-bit\n");
+	    cli_dbgmsg("MACHO: CPU Type: POWERPC 64-bit\n");
 	    arch = 3;
 	    break;
 	default:
-	    if(!matcher)
-		cli_dbgmsg("MACHO: CPU Type: ** UNKNOWN ** (%u)\n", EC32(hdr.cpu_type, conv));
+	    cli_dbgmsg("MACHO: CPU Type: ** UNKNOWN ** (%u)\n", EC32(hdr.cpu_type, conv));
 	    break;
     }
 
-    if(!matcher) switch(EC32(hdr.filetype, conv)) {
+    switch(EC32(hdr.filetype, conv)) {
 	case 0x1: /* MH_OBJECT */
 	    cli_dbgmsg("MACHO: Filetype: Relocatable object file\n");
 	    break;
@@ -309,10 +314,8 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 	    cli_dbgmsg("MACHO: Filetype: ** UNKNOWN ** (0x%x)\n", EC32(hdr.filetype, conv));
     }
 
-    if(!matcher) {
-	cli_dbgmsg("MACHO: Number of load commands: %u\n", EC32(hdr.ncmds, conv));
-	cli_dbgmsg("MACHO: Size of load commands: %u\n", EC32(hdr.sizeofcmds, conv));
-    }
+    cli_dbgmsg("MACHO: Number of load commands: %u\n", EC32(hdr.ncmds, conv));
+    cli_dbgmsg("MACHO: Size of load commands: %u\n", EC32(hdr.sizeofcmds, conv));
 
     if(m64)
 	at += 4;
@@ -320,21 +323,21 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
     hdr.ncmds = EC32(hdr.ncmds, conv);
     if(!hdr.ncmds || hdr.ncmds > 1024) {
 	cli_dbgmsg("cli_scanmacho: Invalid number of load commands (%u)\n", hdr.ncmds);
-	RETURN_BROKEN;
+	return MACHO_BROKEN;
     }
 
     for(i = 0; i < hdr.ncmds; i++) {
 	if(fmap_readn(map, &load_cmd, at, sizeof(load_cmd)) != sizeof(load_cmd)) {
 	    cli_dbgmsg("cli_scanmacho: Can't read load command\n");
 	    free(sections);
-	    RETURN_BROKEN;
+	    return MACHO_BROKEN;
 	}
 	at += sizeof(load_cmd);
 	/*
 	if((m64 && EC32(load_cmd.cmdsize, conv) % 8) || (!m64 && EC32(load_cmd.cmdsize, conv) % 4)) {
 	    cli_dbgmsg("cli_scanmacho: Invalid command size (%u)\n", EC32(load_cmd.cmdsize, conv));
 	    free(sections);
-	    RETURN_BROKEN;
+	    return MACHO_BROKEN;
 	}
 	*/
 	load_cmd.cmd = EC32(load_cmd.cmd, conv);
@@ -343,7 +346,7 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		if(fmap_readn(map, &segment_cmd64, at, sizeof(segment_cmd64)) != sizeof(segment_cmd64)) {
 		    cli_dbgmsg("cli_scanmacho: Can't read segment command\n");
 		    free(sections);
-		    RETURN_BROKEN;
+		    return MACHO_BROKEN;
 		}
 		at += sizeof(segment_cmd64);
 		nsects = EC32(segment_cmd64.nsects, conv);
@@ -353,31 +356,28 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		if(fmap_readn(map, &segment_cmd, at, sizeof(segment_cmd)) != sizeof(segment_cmd)) {
 		    cli_dbgmsg("cli_scanmacho: Can't read segment command\n");
 		    free(sections);
-		    RETURN_BROKEN;
+		    return MACHO_BROKEN;
 		}
 		at += sizeof(segment_cmd);
 		nsects = EC32(segment_cmd.nsects, conv);
 		strncpy(name, segment_cmd.segname, sizeof(name));
 		name[sizeof(name)-1] = '\0';
 	    }
-	    if(!matcher) {
-		cli_dbgmsg("MACHO: Segment name: %s\n", name);
-		cli_dbgmsg("MACHO: Number of sections: %u\n", nsects);
-	    }
+	    cli_dbgmsg("MACHO: Segment name: %s\n", name);
+	    cli_dbgmsg("MACHO: Number of sections: %u\n", nsects);
 	    if(nsects > 255) {
 		cli_dbgmsg("cli_scanmacho: Invalid number of sections\n");
 		free(sections);
-		RETURN_BROKEN;
+		return MACHO_BROKEN;
 	    }
 	    if(!nsects) {
-		if(!matcher)
-		    cli_dbgmsg("MACHO: ------------------\n");
+		cli_dbgmsg("MACHO: ------------------\n");
 		continue;
 	    }
 	    sections = (struct cli_exe_section *) cli_realloc2(sections, (sect + nsects) * sizeof(struct cli_exe_section));
 	    if(!sections) {
 		cli_errmsg("cli_scanmacho: Can't allocate memory for 'sections'\n");
-		return matcher ? -1 : CL_EMEM;
+		return CL_EMEM;
 	    }
 
 	    for(j = 0; j < nsects; j++) {
@@ -385,7 +385,7 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		    if(fmap_readn(map, &section64, at, sizeof(section64)) != sizeof(section64)) {
 			cli_dbgmsg("cli_scanmacho: Can't read section\n");
 			free(sections);
-			RETURN_BROKEN;
+			return MACHO_BROKEN;
 		    }
 		    at += sizeof(section64);
 		    sections[sect].rva = EC64(section64.addr, conv);
@@ -399,7 +399,7 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		    if(fmap_readn(map, &section, at, sizeof(section)) != sizeof(section)) {
 			cli_dbgmsg("cli_scanmacho: Can't read section\n");
 			free(sections);
-			RETURN_BROKEN;
+			return MACHO_BROKEN;
 		    }
 		    at += sizeof(section);
 		    sections[sect].rva = EC32(section.addr, conv);
@@ -410,19 +410,16 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		    strncpy(name, section.sectname, sizeof(name));
 		    name[sizeof(name)-1] = '\0';
 		}
-		if(!matcher) {
-		    cli_dbgmsg("MACHO: --- Section %u ---\n", sect);
-		    cli_dbgmsg("MACHO: Name: %s\n", name);
-		    cli_dbgmsg("MACHO: Virtual address: 0x%x\n", (unsigned int) sections[sect].rva);
-		    cli_dbgmsg("MACHO: Virtual size: %u\n", (unsigned int) sections[sect].vsz);
-		    cli_dbgmsg("MACHO: Raw size: %u\n", (unsigned int) sections[sect].rsz);
-		    if(sections[sect].raw)
-			cli_dbgmsg("MACHO: File offset: %u\n", (unsigned int) sections[sect].raw);
-		}
+		cli_dbgmsg("MACHO: --- Section %u ---\n", sect);
+		cli_dbgmsg("MACHO: Name: %s\n", name);
+		cli_dbgmsg("MACHO: Virtual address: 0x%x\n", (unsigned int) sections[sect].rva);
+		cli_dbgmsg("MACHO: Virtual size: %u\n", (unsigned int) sections[sect].vsz);
+		cli_dbgmsg("MACHO: Raw size: %u\n", (unsigned int) sections[sect].rsz);
+		if(sections[sect].raw)
+		    cli_dbgmsg("MACHO: File offset: %u\n", (unsigned int) sections[sect].raw);
 		sect++;
 	    }
-	    if(!matcher)
-		cli_dbgmsg("MACHO: ------------------\n");
+	    cli_dbgmsg("MACHO: ------------------\n");
 
 	} else if(arch && (load_cmd.cmd == 0x4 || load_cmd.cmd == 0x5)) { /* LC_(UNIX)THREAD */
 	    at += 8;
@@ -434,7 +431,7 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		    if(fmap_readn(map, &thread_state_x86, at, sizeof(thread_state_x86)) != sizeof(thread_state_x86)) {
 			cli_dbgmsg("cli_scanmacho: Can't read thread_state_x86\n");
 			free(sections);
-			RETURN_BROKEN;
+			return MACHO_BROKEN;
 		    }
 		    at += sizeof(thread_state_x86);
 		    break;
@@ -447,7 +444,7 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		    if(fmap_readn(map, &thread_state_ppc, at, sizeof(thread_state_ppc)) != sizeof(thread_state_ppc)) {
 			cli_dbgmsg("cli_scanmacho: Can't read thread_state_ppc\n");
 			free(sections);
-			RETURN_BROKEN;
+			return MACHO_BROKEN;
 		    }
 		    at += sizeof(thread_state_ppc);
 		    ep = EC32(thread_state_ppc.srr0, conv);
@@ -461,7 +458,7 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		    if(fmap_readn(map, &thread_state_ppc64, at, sizeof(thread_state_ppc64)) != sizeof(thread_state_ppc64)) {
 			cli_dbgmsg("cli_scanmacho: Can't read thread_state_ppc64\n");
 			free(sections);
-			RETURN_BROKEN;
+			return MACHO_BROKEN;
 		    }
 		    at += sizeof(thread_state_ppc64);
 		    ep = EC64(thread_state_ppc64.srr0, conv);
@@ -470,7 +467,7 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
 		default:
 		    cli_errmsg("cli_scanmacho: Invalid arch setting!\n");
 		    free(sections);
-		    return matcher ? -1 : CL_EARG;
+		    return CL_EARG;
 	    }
 	} else {
 	    if(EC32(load_cmd.cmdsize, conv) > sizeof(load_cmd))
@@ -479,29 +476,93 @@ int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
     }
 
     if(ep) {
-	if(!matcher)
-	    cli_dbgmsg("Entry Point: 0x%x\n", ep);
+	cli_dbgmsg("Entry Point: 0x%x\n", ep);
 	if(sections) {
 	    ep = cli_rawaddr(ep, sections, sect, &err);
 	    if(err) {
 		cli_dbgmsg("cli_scanmacho: Can't calculate EP offset\n");
 		free(sections);
-		return matcher ? -1 : CL_EFORMAT;
+		return CL_EFORMAT;
 	    }
-	    if(!matcher)
-		cli_dbgmsg("Entry Point file offset: %u\n", ep);
+	    cli_dbgmsg("Entry Point file offset: %u\n", ep);
 	}
     }
 
+    fileinfo->ep = ep;
+    fileinfo->nsections = sect;
+    fileinfo->section = sections;
+    return CL_SUCCESS;
+}
+
+/* Returns the headers of the Mach-O file at the start of the map, reading
+ * them on the first call for the current extent of the map; NULL if out of
+ * memory */
+static struct macho_headers *macho_headers(fmap_t *map)
+{
+    struct macho_headers *h = map->machoheaders;
+    struct cli_exe_info info;
+    int ret;
+
+    if(h && h->off == map->nested_offset && h->len == map->len)
+        return h;
+    free(map->machoheaders);
+    map->machoheaders = NULL;
+
+    memset(&info, 0, sizeof(info));
+    if((ret = macho_parse(map, &info)) == CL_EMEM)
+        return NULL;
+    if(!(h = cli_malloc(sizeof(*h) + info.nsections * sizeof(*h->section)))) {
+        cli_errmsg("cli_scanmacho: Can't allocate memory for the headers\n");
+        free(info.section);
+        return NULL;
+    }
+    h->off = map->nested_offset;
+    h->len = map->len;
+    h->ret = ret;
+    h->ep = info.ep;
+    h->nsections = info.nsections;
+    h->section = NULL;
+    if(info.section) {
+        h->section = (struct cli_exe_section *)(h + 1);
+        memcpy(h->section, info.section, info.nsections * sizeof(*h->section));
+        free(info.section);
+    }
+    map->machoheaders = h;
+    return h;
+}
+
+int cli_scanmacho(cli_ctx *ctx, struct cli_exe_info *fileinfo)
+{
+	struct macho_headers *h;
+	unsigned int matcher = 0;
+
+    if(fileinfo)
+	matcher = 1;
+
+    if(!(h = macho_headers(*ctx->fmap)))
+	return matcher ? -1 : CL_EMEM;
+
+    if(h->ret == MACHO_BROKEN) {
+	RETURN_BROKEN;
+    } else if(h->ret != CL_SUCCESS) {
+	return matcher ? -1 : h->ret;
+    }
+
     if(matcher) {
-	fileinfo->ep = ep;
-	fileinfo->nsections = sect;
-	fileinfo->section = sections;
+	fileinfo->ep = h->ep;
+	fileinfo->nsections = h->nsections;
+	fileinfo->section = NULL;
+	if(h->section) {
+	    fileinfo->section = (struct cli_exe_section *) cli_malloc(h->nsections * sizeof(struct cli_exe_section));
+	    if(!fileinfo->section) {
+		cli_errmsg("cli_scanmacho: Can't allocate memory for 'sections'\n");
+		return -1;
+	    }
+	    memcpy(fileinfo->section, h->section, h->nsections * sizeof(struct cli_exe_section));
+	}
 	return 0;
-    } else {
-	free(sections);
-	return CL_SUCCESS;
     }
+    return CL_SUCCESS;
 }
 
 int cli_machoheader(fmap_t *map, struct cli_exe_info *fileinfo)
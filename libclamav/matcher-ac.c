@@ -33,6 +33,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "clamav.h"
 #include "others.h"
@@ -44,6 +47,7 @@
 #include "readdb.h"
 #include "default.h"
 #include "filtering.h"
+#include "sigprof.h"
 
 #include "mpool.h"
 
@@ -341,71 +345,49 @@ int cli_ac_addpatt(struct cli_matcher *root, struct cli_ac_patt *pattern)
     return cli_ac_addpatt_recursive(root, pattern, root->ac_root, 0, len);
 }
 
-struct bfs_list {
-    struct cli_ac_node *node;
-    struct bfs_list *next;
-};
-
-static int bfs_enqueue(struct bfs_list **bfs, struct bfs_list **last, struct cli_ac_node *n)
-{
-    struct bfs_list *new;
-
-    new = (struct bfs_list *) cli_malloc(sizeof(struct bfs_list));
-    if(!new) {
-        cli_errmsg("bfs_enqueue: Can't allocate memory for bfs_list\n");
-        return CL_EMEM;
-    }
+/* Breadth first passes over the trie, one level at a time. The nodes of a
+ * level only depend on the levels above them, so a large level is split
+ * between several threads.
+ */
+#define AC_BFS_SPLIT 4096
 
-    new->next = NULL;
-    new->node = n;
+struct ac_bfs {
+    struct cli_ac_node **nodes;
+    uint32_t count, maxnodes;
 
-    if(*last) {
-        (*last)->next = new;
-        *last = new;
-    } else {
-        *bfs = *last = new;
-    }
+    /* children queued for the next level */
+    struct cli_ac_node **next;
+    uint32_t nnext, maxnext;
 
-    return CL_SUCCESS;
-}
+    int pass, ret;
+};
 
-static struct cli_ac_node *bfs_dequeue(struct bfs_list **bfs, struct bfs_list **last)
+static inline int ac_bfs_push(struct ac_bfs *bfs, struct cli_ac_node *node)
 {
-    struct bfs_list *lpt;
-    struct cli_ac_node *pt;
+    if(bfs->nnext == bfs->maxnext) {
+        struct cli_ac_node **next;
+        uint32_t max = bfs->maxnext ? bfs->maxnext * 2 : 256;
 
-    if(!(lpt = *bfs)) {
-        return NULL;
-    } else {
-        *bfs = (*bfs)->next;
-        pt = lpt->node;
-
-        if(lpt == *last)
-            *last = NULL;
-
-        free(lpt);
-        return pt;
+        if(!(next = (struct cli_ac_node **) cli_realloc(bfs->next, max * sizeof(*next)))) {
+            cli_errmsg("ac_bfs_push: Can't allocate memory for the BFS level\n");
+            return CL_EMEM;
+        }
+        bfs->next = next;
+        bfs->maxnext = max;
     }
+    bfs->next[bfs->nnext++] = node;
+    return CL_SUCCESS;
 }
 
-static int ac_maketrans(struct cli_matcher *root)
+/* first pass: fail transitions */
+static int ac_bfs_fail(struct ac_bfs *bfs)
 {
-    struct bfs_list *bfs = NULL, *bfs_last = NULL;
-    struct cli_ac_node *ac_root = root->ac_root, *child, *node, *fail;
+    struct cli_ac_node *child, *node, *fail;
+    uint32_t n;
     int i, ret;
 
-    for(i = 0; i < 256; i++) {
-        node = ac_root->trans[i];
-        if(!node) {
-            ac_root->trans[i] = ac_root;
-        } else {
-            node->fail = ac_root;
-            if((ret = bfs_enqueue(&bfs, &bfs_last, node)))
-                return ret;
-        }
-    }
-
-    while((node = bfs_dequeue(&bfs, &bfs_last))) {
+    for(n = 0; n < bfs->count; n++) {
+        node = bfs->nodes[n];
         if(IS_LEAF(node)) {
             struct cli_ac_node *failtarget = node->fail;
 
@@ -428,22 +410,23 @@ static int ac_maketrans(struct cli_matcher *root)
 
                 child->fail = fail->trans[i];
 
-                if((ret = bfs_enqueue(&bfs, &bfs_last, child)) != 0)
+                if((ret = ac_bfs_push(bfs, child)) != 0)
                     return ret;
             }
         }
     }
+    return CL_SUCCESS;
+}
 
-    bfs = bfs_last = NULL;
-    for(i = 0; i < 256; i++) {
-        node = ac_root->trans[i];
-        if(node != ac_root) {
-            if((ret = bfs_enqueue(&bfs, &bfs_last, node)))
-                return ret;
-        }
-    }
+/* second pass: complete the transitions */
+static int ac_bfs_trans(struct ac_bfs *bfs)
+{
+    struct cli_ac_node *child, *node;
+    uint32_t n;
+    int i, ret;
 
-    while((node = bfs_dequeue(&bfs, &bfs_last))) {
+    for(n = 0; n < bfs->count; n++) {
+        node = bfs->nodes[n];
         if(IS_LEAF(node))
             continue;
         for(i = 0; i < 256; i++) {
@@ -471,17 +454,341 @@ static int ac_maketrans(struct cli_matcher *root)
 
                 child->trans = child->fail->trans;
             } else {
-                if((ret = bfs_enqueue(&bfs, &bfs_last, child)) != 0)
+                if((ret = ac_bfs_push(bfs, child)) != 0)
                     return ret;
             }
         }
     }
+    return CL_SUCCESS;
+}
+
+static int ac_bfs_run(struct ac_bfs *bfs)
+{
+    return bfs->ret = (bfs->pass ? ac_bfs_trans(bfs) : ac_bfs_fail(bfs));
+}
+
+#ifdef CL_THREAD_SAFE
+static void *ac_bfs_worker(void *arg)
+{
+    ac_bfs_run((struct ac_bfs *) arg);
+    return NULL;
+}
+#endif
+
+/* the queued children become the current level, the old array is reused */
+static void ac_bfs_swap(struct ac_bfs *level)
+{
+    struct cli_ac_node **nodes = level->nodes;
+    uint32_t max = level->maxnodes;
+
+    level->nodes = level->next;
+    level->maxnodes = level->maxnext;
+    level->count = level->nnext;
+    level->next = nodes;
+    level->maxnext = max;
+    level->nnext = 0;
+}
+
+/* Runs a pass over the current level and moves on to the next one */
+static int ac_bfs_level(struct ac_bfs *level, unsigned int threads)
+{
+    int ret;
+#ifdef CL_THREAD_SAFE
+    struct ac_bfs part[CLI_MAX_LOAD_THREADS];
+    pthread_t tid[CLI_MAX_LOAD_THREADS];
+    int started[CLI_MAX_LOAD_THREADS];
+    uint32_t chunk, total;
+    unsigned int i;
+
+    if(threads > CLI_MAX_LOAD_THREADS)
+        threads = CLI_MAX_LOAD_THREADS;
+    if(threads > 1 && level->count >= AC_BFS_SPLIT) {
+        memset(part, 0, sizeof(part));
+        chunk = (level->count + threads - 1) / threads;
+        for(i = 0; i < threads; i++) {
+            part[i].pass = level->pass;
+            if(i * chunk < level->count) {
+                part[i].nodes = level->nodes + i * chunk;
+                part[i].count = MIN(chunk, level->count - i * chunk);
+            }
+            started[i] = i && !pthread_create(&tid[i], NULL, ac_bfs_worker, &part[i]);
+        }
+        /* the slices of the threads that didn't start are done here */
+        for(i = 0; i < threads; i++)
+            if(!started[i])
+                ac_bfs_run(&part[i]);
+        for(i = 0; i < threads; i++)
+            if(started[i])
+                pthread_join(tid[i], NULL);
+
+        ret = CL_SUCCESS;
+        total = 0;
+        for(i = 0; i < threads; i++) {
+            if(part[i].ret && !ret)
+                ret = part[i].ret;
+            total += part[i].nnext;
+        }
+        if(!ret && total > level->maxnext) {
+            struct cli_ac_node **next = (struct cli_ac_node **) cli_realloc(level->next, total * sizeof(*next));
+
+            if(next) {
+                level->next = next;
+                level->maxnext = total;
+            } else {
+                cli_errmsg("ac_bfs_level: Can't allocate memory for the BFS level\n");
+                ret = CL_EMEM;
+            }
+        }
+        level->nnext = 0;
+        for(i = 0; i < threads; i++) {
+            if(!ret && part[i].nnext) {
+                memcpy(level->next + level->nnext, part[i].next, part[i].nnext * sizeof(*level->next));
+                level->nnext += part[i].nnext;
+            }
+            free(part[i].next);
+        }
+        if(ret)
+            return ret;
+    } else
+#else
+    UNUSEDPARAM(threads);
+#endif
+    {
+        level->nnext = 0;
+        if((ret = ac_bfs_run(level)))
+            return ret;
+    }
 
+    ac_bfs_swap(level);
     return CL_SUCCESS;
 }
 
-int cli_ac_buildtrie(struct cli_matcher *root)
+static int ac_maketrans(struct cli_matcher *root, unsigned int threads)
+{
+    struct cli_ac_node *ac_root = root->ac_root, *node;
+    struct ac_bfs level;
+    int i, ret = CL_SUCCESS;
+
+    memset(&level, 0, sizeof(level));
+    for(i = 0; i < 256; i++) {
+        node = ac_root->trans[i];
+        if(!node) {
+            ac_root->trans[i] = ac_root;
+        } else {
+            node->fail = ac_root;
+            if((ret = ac_bfs_push(&level, node)))
+                goto done;
+        }
+    }
+    ac_bfs_swap(&level);
+
+    while(level.count)
+        if((ret = ac_bfs_level(&level, threads)))
+            goto done;
+
+    level.pass = 1;
+    for(i = 0; i < 256; i++) {
+        node = ac_root->trans[i];
+        if(node != ac_root) {
+            if((ret = ac_bfs_push(&level, node)))
+                goto done;
+        }
+    }
+    ac_bfs_swap(&level);
+
+    while(level.count)
+        if((ret = ac_bfs_level(&level, threads)))
+            goto done;
+
+done:
+    free(level.nodes);
+    free(level.next);
+    return ret;
+}
+
+/* node -> state map, only used while ac_compact() flattens the trie */
+struct ac_cmap_entry {
+    const struct cli_ac_node *node;
+    uint32_t state;
+};
+
+static inline size_t ac_cmap_slot(const struct cli_ac_node *node, size_t mask)
+{
+    uint64_t h = (uint64_t) (size_t) node;
+
+    h = (h >> 4) * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h >> 32) & mask;
+}
+
+static void ac_cmap_insert(struct ac_cmap_entry *map, size_t mask, const struct cli_ac_node *node, uint32_t state)
+{
+    size_t slot = ac_cmap_slot(node, mask);
+
+    while(map[slot].node)
+        slot = (slot + 1) & mask;
+    map[slot].node = node;
+    map[slot].state = state;
+}
+
+static inline uint32_t ac_cmap_lookup(const struct ac_cmap_entry *map, size_t mask, const struct cli_ac_node *node)
+{
+    size_t slot = ac_cmap_slot(node, mask);
+
+    while(map[slot].node) {
+        if(map[slot].node == node)
+            return map[slot].state;
+        slot = (slot + 1) & mask;
+    }
+    /* unreachable: every transition target is a registered node */
+    return 0;
+}
+
+/* true if node has its own trans array (as opposed to sharing its fail's) */
+static inline int ac_owns_trans(const struct cli_ac_node *node, const struct cli_ac_node *ac_root)
+{
+    return node == ac_root || (node->trans && node->fail && node->trans != node->fail->trans);
+}
+
+static void ac_compact_free(struct cli_matcher *root)
+{
+    free(root->ac_ctrans);
+    free(root->ac_cfinal);
+    root->ac_ctrans = NULL;
+    root->ac_cfinal = NULL;
+    root->ac_crows = root->ac_cfinals = 0;
+}
+
+/* Flatten the pointer trie into ac_ctrans/ac_cfinal. On failure the
+ * pointer form is left untouched and scanning falls back to it.
+ */
+static int ac_compact(struct cli_matcher *root)
 {
+    struct cli_ac_node *ac_root = root->ac_root, *node;
+    const struct cli_ac_node *owner;
+    struct ac_cmap_entry *map;
+    uint32_t i, j, rows = 1, finals = 0, row, fidx, *trow;
+    size_t mapsize = 1, mask;
+
+    for(i = 0; i < root->ac_nodes; i++) {
+        node = root->ac_nodetable[i];
+        if(IS_FINAL(node))
+            finals++;
+        else if(ac_owns_trans(node, ac_root))
+            rows++;
+    }
+    for(i = 0; i < root->ac_nodes; i++) {
+        node = root->ac_nodetable[i];
+        if(IS_FINAL(node) && ac_owns_trans(node, ac_root))
+            rows++;
+    }
+
+    if(rows >= AC_CSTATE_FINAL / 256 || finals >= AC_CSTATE_FINAL) {
+        cli_dbgmsg("ac_compact: trie too large for the compact layout (%u rows)\n", rows);
+        return CL_SUCCESS;
+    }
+
+    while(mapsize < 2 * ((size_t) root->ac_nodes + 1))
+        mapsize <<= 1;
+    mask = mapsize - 1;
+
+    map = (struct ac_cmap_entry *) cli_calloc(mapsize, sizeof(*map));
+    root->ac_ctrans = (uint32_t *) cli_malloc((size_t) rows * 256 * sizeof(uint32_t));
+    if(finals)
+        root->ac_cfinal = (struct cli_ac_cfinal *) cli_malloc((size_t) finals * sizeof(struct cli_ac_cfinal));
+    if(!map || !root->ac_ctrans || (finals && !root->ac_cfinal)) {
+        cli_dbgmsg("ac_compact: can't allocate the compact layout, using the pointer trie\n");
+        free(map);
+        ac_compact_free(root);
+        return CL_SUCCESS;
+    }
+
+    /* number the rows; final nodes map to their ac_cfinal slot instead */
+    ac_cmap_insert(map, mask, ac_root, 0);
+    row = 1;
+    fidx = 0;
+    for(i = 0; i < root->ac_nodes; i++) {
+        node = root->ac_nodetable[i];
+        if(IS_FINAL(node))
+            ac_cmap_insert(map, mask, node, AC_CSTATE_FINAL | fidx++);
+        else if(ac_owns_trans(node, ac_root))
+            ac_cmap_insert(map, mask, node, row++);
+    }
+
+    /* owner rows of final nodes are looked up through their own entry */
+    fidx = 0;
+    for(i = 0; i < root->ac_nodes; i++) {
+        node = root->ac_nodetable[i];
+        if(!IS_FINAL(node))
+            continue;
+        if(ac_owns_trans(node, ac_root))
+            root->ac_cfinal[fidx].row = row++;
+        else
+            root->ac_cfinal[fidx].row = (uint32_t) -1;
+        root->ac_cfinal[fidx++].node = node;
+    }
+
+    /* final leaves share the row of the first trans owner on their fail chain */
+    for(i = 0; i < finals; i++) {
+        if(root->ac_cfinal[i].row != (uint32_t) -1)
+            continue;
+        owner = root->ac_cfinal[i].node;
+        while(owner && !ac_owns_trans(owner, ac_root))
+            owner = owner->fail;
+        if(!owner || owner == ac_root) {
+            root->ac_cfinal[i].row = 0;
+        } else {
+            j = ac_cmap_lookup(map, mask, owner);
+            root->ac_cfinal[i].row = (j & AC_CSTATE_FINAL) ? root->ac_cfinal[j & ~AC_CSTATE_FINAL].row : j;
+        }
+    }
+
+    /* fill the rows */
+    for(i = 0; i <= root->ac_nodes; i++) {
+        node = i ? root->ac_nodetable[i - 1] : ac_root;
+        if(!ac_owns_trans(node, ac_root))
+            continue;
+        j = ac_cmap_lookup(map, mask, node);
+        row = (j & AC_CSTATE_FINAL) ? root->ac_cfinal[j & ~AC_CSTATE_FINAL].row : j;
+        trow = &root->ac_ctrans[(size_t) row << 8];
+        for(j = 0; j < 256; j++)
+            trow[j] = node->trans[j] ? ac_cmap_lookup(map, mask, node->trans[j]) : 0;
+    }
+    free(map);
+
+    root->ac_crows = rows;
+    root->ac_cfinals = finals;
+
+    cli_dbgmsg("ac_compact: %u rows, %u final states (%lu KiB)\n", rows, finals,
+               (unsigned long) (((size_t) rows * 256 * sizeof(uint32_t) + (size_t) finals * sizeof(struct cli_ac_cfinal)) >> 10));
+    return CL_SUCCESS;
+}
+
+/* Releases the 256-pointer trans arrays once the trie has been flattened.
+ * The pointer nodes are kept for their lists.
+ */
+static void ac_compact_release(struct cli_matcher *root)
+{
+    struct cli_ac_node *ac_root = root->ac_root, *node;
+    uint32_t i;
+
+    if(!root->ac_ctrans || !ac_root->trans)
+        return;
+
+    for(i = 0; i < root->ac_nodes; i++) {
+        node = root->ac_nodetable[i];
+        if(ac_owns_trans(node, ac_root))
+            mpool_free(root->mempool, node->trans);
+    }
+    for(i = 0; i < root->ac_nodes; i++)
+        root->ac_nodetable[i]->trans = NULL;
+    mpool_free(root->mempool, ac_root->trans);
+    ac_root->trans = NULL;
+}
+
+int cli_ac_maketrie(struct cli_matcher *root, unsigned int threads)
+{
+    int ret;
+
     if(!root)
         return CL_EMALFDB;
 
@@ -493,7 +800,174 @@ int cli_ac_buildtrie(struct cli_matcher *root)
     if (root->filter)
         cli_dbgmsg("Using filter for trie %d\n", root->type);
 
-    return ac_maketrans(root);
+    if((ret = ac_maketrans(root, threads)))
+        return ret;
+
+    return ac_compact(root);
+}
+
+static int ac_special_char(uint16_t p, unsigned char b)
+{
+    switch(p & CLI_MATCH_METADATA) {
+    case CLI_MATCH_CHAR:
+        return (unsigned char) p == b;
+    case CLI_MATCH_NOCASE:
+        return (unsigned char) (p & 0xff) == cli_nocase(b);
+    case CLI_MATCH_IGNORE:
+        return 1;
+    case CLI_MATCH_NIBBLE_HIGH:
+        return (unsigned char) (p & 0x00f0) == (b & 0xf0);
+    case CLI_MATCH_NIBBLE_LOW:
+        return (unsigned char) (p & 0x000f) == (b & 0x0f);
+    }
+    return 0;
+}
+
+/* Turns the alternates of a special into something ac_findmatch_special()
+ * checks without walking them one by one: a bitmap of the single bytes, an
+ * index of the fixed strings by their leading byte (they are sorted) and
+ * for the generic ones a shift-and program following all the alternates at
+ * once, in the direction the special is matched. Without memory, or past
+ * 64 positions in total, the special keeps using its lists. */
+static void ac_special_compile(struct cli_matcher *root, struct cli_ac_special *special, int rev)
+{
+    struct cli_alt_node *alt;
+    unsigned int c, j, off;
+    uint16_t p;
+
+    switch(special->type) {
+    case AC_SPECIAL_ALT_CHAR:
+        if(special->bytemap || !(special->bytemap = (uint8_t *) mpool_calloc(root->mempool, 32, sizeof(uint8_t))))
+            return;
+        for(j = 0; j < special->num; j++)
+            special->bytemap[special->alt.byte[j] >> 3] |= 1 << (special->alt.byte[j] & 7);
+        break;
+
+    case AC_SPECIAL_ALT_STR_FIXED:
+        if(special->first || !(special->first = (uint16_t *) mpool_malloc(root->mempool, 257 * sizeof(uint16_t))))
+            return;
+        for(c = 0, j = 0; c <= 256; c++) {
+            while(j < special->num && special->alt.f_str[j][0] < c)
+                j++;
+            special->first[c] = j;
+        }
+        break;
+
+    case AC_SPECIAL_ALT_STR:
+        if(special->bitap)
+            return;
+        for(off = 0, alt = special->alt.v_str; alt; alt = alt->next) {
+            if(!alt->len)
+                return;
+            off += alt->len;
+        }
+        if(!off || off > 64 || !(special->bitap = (uint64_t *) mpool_calloc(root->mempool, 256, sizeof(uint64_t))))
+            return;
+        for(off = 0, alt = special->alt.v_str; alt; off += alt->len, alt = alt->next) {
+            special->bitap_start |= (uint64_t) 1 << off;
+            special->bitap_end |= (uint64_t) 1 << (off + alt->len - 1);
+            for(j = 0; j < alt->len; j++) {
+                p = alt->str[rev ? alt->len - 1 - j : j];
+                for(c = 0; c < 256; c++)
+                    if(ac_special_char(p, c))
+                        special->bitap[c] |= (uint64_t) 1 << (off + j);
+            }
+        }
+        special->bitap_rev = rev;
+        break;
+    }
+}
+
+void cli_ac_finishtrie(struct cli_matcher *root)
+{
+    struct cli_ac_patt *patt;
+    uint32_t i;
+    uint16_t j;
+
+    if(root && root->ac_root) {
+        ac_compact_release(root);
+        /* the specials of the prefix are matched backwards */
+        for(i = 0; i < root->ac_patterns; i++) {
+            patt = root->ac_pattable[i];
+            for(j = 0; j < patt->special; j++)
+                ac_special_compile(root, patt->special_table[j], j < patt->special_pattern);
+        }
+    }
+}
+
+int cli_ac_buildtrie(struct cli_matcher *root)
+{
+    int ret;
+
+    if((ret = cli_ac_maketrie(root, 1)))
+        return ret;
+
+    cli_ac_finishtrie(root);
+    return CL_SUCCESS;
+}
+
+/* Builds root->ac_merged, a trie holding the patterns of root and those of
+ * the generic root, so that the files of the target are read once by the
+ * AC matcher instead of twice. The trie only owns its nodes and lists: the
+ * patterns keep the depth of their own root and the ones of groot are
+ * tagged so that cli_ac_scanbuff_merged() hands their matches to gdata.
+ * Both roots must be built. */
+int cli_ac_merge(struct cli_matcher *root, struct cli_matcher *groot, unsigned int threads)
+{
+    struct cli_matcher *merged;
+    struct cli_ac_patt *patt;
+    uint32_t i;
+    int ret;
+
+    if(root->ac_merged || !root->ac_root || !groot->ac_root)
+        return CL_SUCCESS;
+
+    merged = (struct cli_matcher *) mpool_calloc(root->mempool, 1, sizeof(struct cli_matcher));
+    if(!merged) {
+        cli_errmsg("cli_ac_merge: Can't allocate memory for the merged matcher\n");
+        return CL_EMEM;
+    }
+    merged->type = root->type;
+#ifdef USE_MPOOL
+    merged->mempool = root->mempool;
+#endif
+    root->ac_merged = merged;
+
+    /* no filter, matcher_run() starts from the first match of either root */
+    if((ret = cli_ac_init(merged, root->ac_mindepth, root->ac_maxdepth, 0))) {
+        mpool_free(root->mempool, merged);
+        root->ac_merged = NULL;
+        return ret;
+    }
+
+    merged->ac_pattable = (struct cli_ac_patt **) mpool_malloc(root->mempool, ((size_t) root->ac_patterns + groot->ac_patterns + 1) * sizeof(struct cli_ac_patt *));
+    if(!merged->ac_pattable) {
+        cli_errmsg("cli_ac_merge: Can't allocate memory for the pattern table\n");
+        cli_ac_free_merged(root);
+        return CL_EMEM;
+    }
+    for(i = 0; i < root->ac_patterns + groot->ac_patterns; i++) {
+        if(i < root->ac_patterns) {
+            patt = root->ac_pattable[i];
+        } else {
+            patt = groot->ac_pattable[i - root->ac_patterns];
+            patt->generic = 1;
+        }
+        merged->ac_pattable[merged->ac_patterns++] = patt;
+        if((ret = cli_ac_addpatt_recursive(merged, patt, merged->ac_root, 0, patt->depth))) {
+            cli_ac_free_merged(root);
+            return ret;
+        }
+    }
+
+    if((ret = cli_ac_maketrie(merged, threads))) {
+        cli_ac_free_merged(root);
+        return ret;
+    }
+    cli_ac_finishtrie(merged);
+
+    cli_dbgmsg("cli_ac_merge: %s: %u nodes for %u + %u patterns\n", cli_mtargets[root->type].name, merged->ac_nodes, root->ac_patterns, groot->ac_patterns);
+    return CL_SUCCESS;
 }
 
 int cli_ac_init(struct cli_matcher *root, uint8_t mindepth, uint8_t maxdepth, uint8_t dconf_prefiltering)
@@ -532,6 +1006,74 @@ int cli_ac_init(struct cli_matcher *root, uint8_t mindepth, uint8_t maxdepth, ui
     return CL_SUCCESS;
 }
 
+/* An AC profile (CL_ENGINE_AC_PROFILE) holds the cost of each of the 65536
+ * byte pairs, roughly 8 * -log2 of how often the pair was seen in a sample
+ * of the scanned data (sigtool --build-ac-profile). The patterns enter the
+ * trie and the prefilter at their most expensive pairs, which keeps both
+ * from triggering on what is common in the data actually scanned. */
+int cli_ac_profile_load(struct cl_engine *engine)
+{
+    FILE *fs;
+    char magic[sizeof(CLI_AC_PROFILE_MAGIC) - 1];
+
+    if(!(fs = fopen(engine->ac_profile, "rb"))) {
+        cli_warnmsg("cli_ac_profile_load: Can't open %s, using the default anchors\n", engine->ac_profile);
+        return CL_SUCCESS;
+    }
+    if(!(engine->ac_cost = mpool_malloc(engine->mempool, 65536))) {
+        cli_errmsg("cli_ac_profile_load: Can't allocate memory for the byte pair costs\n");
+        fclose(fs);
+        return CL_EMEM;
+    }
+    if(fread(magic, sizeof(magic), 1, fs) != 1 || memcmp(magic, CLI_AC_PROFILE_MAGIC, sizeof(magic)) || fread(engine->ac_cost, 65536, 1, fs) != 1) {
+        cli_warnmsg("cli_ac_profile_load: %s is not a valid AC profile, using the default anchors\n", engine->ac_profile);
+        mpool_free(engine->mempool, engine->ac_cost);
+        engine->ac_cost = NULL;
+    } else {
+        cli_dbgmsg("cli_ac_profile_load: Loaded %s\n", engine->ac_profile);
+    }
+    fclose(fs);
+    return CL_SUCCESS;
+}
+
+/* counts[] are the numbers of times each byte pair was seen, indexed by
+ * the first byte << 8 | the second one */
+int cli_ac_profile_write(const char *path, const uint64_t *counts)
+{
+    FILE *fs;
+    uint8_t *cost;
+    uint64_t total = 65536, r;
+    unsigned int i, c;
+    int ret = CL_SUCCESS;
+
+    if(!(cost = cli_malloc(65536)))
+        return CL_EMEM;
+    for(i = 0; i < 65536; i++)
+        total += counts[i];
+    for(i = 0; i < 65536; i++) {
+        /* 8 * log2(total / (count + 1)): the integer part from the bit
+         * length, the fraction from the next 3 bits */
+        r = total / (counts[i] + 1);
+        for(c = 0; r >> (c + 1); c++);
+        c = 8 * c + (c >= 3 ? (r >> (c - 3)) & 7 : (r << (3 - c)) & 7);
+        cost[i] = c > 255 ? 255 : c;
+    }
+
+    if(!(fs = fopen(path, "wb"))) {
+        cli_errmsg("cli_ac_profile_write: Can't create %s\n", path);
+        free(cost);
+        return CL_ECREAT;
+    }
+    if(fwrite(CLI_AC_PROFILE_MAGIC, sizeof(CLI_AC_PROFILE_MAGIC) - 1, 1, fs) != 1 || fwrite(cost, 65536, 1, fs) != 1) {
+        cli_errmsg("cli_ac_profile_write: Can't write to %s\n", path);
+        ret = CL_EWRITE;
+    }
+    if(fclose(fs) && ret == CL_SUCCESS)
+        ret = CL_EWRITE;
+    free(cost);
+    return ret;
+}
+
 #ifdef USE_MPOOL
 #define mpool_ac_free_special(a, b) ac_free_special(a, b)
 static void ac_free_special(mpool_t *mempool, struct cli_ac_patt *p)
@@ -550,6 +1092,12 @@ static void ac_free_special(struct cli_ac_patt *p)
 
     for(i = 0; i < p->special; i++) {
         a1 = p->special_table[i];
+        if (a1->bytemap)
+            mpool_free(mempool, a1->bytemap);
+        if (a1->first)
+            mpool_free(mempool, a1->first);
+        if (a1->bitap)
+            mpool_free(mempool, a1->bitap);
         if (a1->type == AC_SPECIAL_ALT_CHAR) {
             mpool_free(mempool, (a1->alt).byte);
         } else if (a1->type == AC_SPECIAL_ALT_STR_FIXED) {
@@ -570,25 +1118,10 @@ static void ac_free_special(struct cli_ac_patt *p)
     mpool_free(mempool, p->special_table);
 }
 
-void cli_ac_free(struct cli_matcher *root)
+/* nodes, lists and transitions of a trie, not its patterns */
+static void ac_free_trie(struct cli_matcher *root)
 {
     uint32_t i;
-    struct cli_ac_patt *patt;
-
-    for(i = 0; i < root->ac_patterns; i++) {
-        patt = root->ac_pattable[i];
-        mpool_free(root->mempool, patt->prefix ? patt->prefix : patt->pattern);
-        mpool_free(root->mempool, patt->virname);
-        if(patt->special)
-            mpool_ac_free_special(root->mempool, patt);
-        mpool_free(root->mempool, patt);
-    }
-
-    if(root->ac_pattable)
-        mpool_free(root->mempool, root->ac_pattable);
-
-    if(root->ac_reloff)
-        mpool_free(root->mempool, root->ac_reloff);
 
     /* Freeing trans nodes must be done before freeing table nodes! */
     for(i = 0; i < root->ac_nodes; i++) {
@@ -616,14 +1149,155 @@ void cli_ac_free(struct cli_matcher *root)
         mpool_free(root->mempool, root->ac_root);
     }
 
+    ac_compact_free(root);
+}
+
+void cli_ac_free(struct cli_matcher *root)
+{
+    uint32_t i;
+    struct cli_ac_patt *patt;
+
+    for(i = 0; i < root->ac_patterns; i++) {
+        patt = root->ac_pattable[i];
+        mpool_free(root->mempool, patt->prefix ? patt->prefix : patt->pattern);
+        mpool_free(root->mempool, patt->virname);
+        if(patt->special)
+            mpool_ac_free_special(root->mempool, patt);
+        mpool_free(root->mempool, patt);
+    }
+
+    if(root->ac_pattable)
+        mpool_free(root->mempool, root->ac_pattable);
+
+    if(root->ac_reloff)
+        mpool_free(root->mempool, root->ac_reloff);
+
+    for(i = 0; i < root->ac_lsigs; i++) {
+        if(root->ac_lsigtable[i]->ops) {
+            mpool_free(root->mempool, root->ac_lsigtable[i]->ops);
+            root->ac_lsigtable[i]->ops = NULL;
+        }
+    }
+
+    if(root->ac_lsig_always) {
+        mpool_free(root->mempool, root->ac_lsig_always);
+        root->ac_lsig_always = NULL;
+    }
+
+    ac_free_trie(root);
+
     if (root->filter)
         mpool_free(root->mempool, root->filter);
 }
 
+/* Frees the trie built by cli_ac_merge(), the patterns are left to their
+ * roots */
+void cli_ac_free_merged(struct cli_matcher *root)
+{
+    struct cli_matcher *merged = root->ac_merged;
+
+    if(!merged)
+        return;
+
+    ac_free_trie(merged);
+    if(merged->ac_pattable)
+        mpool_free(root->mempool, merged->ac_pattable);
+    mpool_free(root->mempool, merged);
+    root->ac_merged = NULL;
+}
+
+/* Calls cb for the virus name of each body signature until it returns non
+ * zero; the subsignatures of the logical ones are skipped */
+void cli_ac_memstats(const struct cli_matcher *root, size_t *nodes, size_t *trans, size_t *patterns)
+{
+    const struct cli_ac_node *node;
+    uint32_t i;
+    uint16_t j;
+
+    if(!root->ac_root)
+        return;
+
+    *nodes += ((size_t) root->ac_nodes + 1) * sizeof(struct cli_ac_node) + (size_t) root->ac_nodes * sizeof(*root->ac_nodetable);
+    *nodes += (size_t) root->ac_lists * (sizeof(struct cli_ac_list) + sizeof(*root->ac_listtable));
+
+    /* trans arrays not released yet (pointer trie or a root not built) */
+    for(i = 0; i <= root->ac_nodes; i++) {
+        node = i ? root->ac_nodetable[i - 1] : root->ac_root;
+        if(node->trans && (!node->fail || node->trans != node->fail->trans))
+            *trans += 256 * sizeof(struct cli_ac_node *);
+    }
+    *trans += (size_t) root->ac_crows * 256 * sizeof(uint32_t) + (size_t) root->ac_cfinals * sizeof(struct cli_ac_cfinal);
+    if(root->filter)
+        *trans += sizeof(*root->filter);
+
+    for(i = 0; i < root->ac_patterns; i++) {
+        const struct cli_ac_patt *patt = root->ac_pattable[i];
+
+        *patterns += sizeof(*patt) + sizeof(*root->ac_pattable);
+        *patterns += (patt->length[0] + patt->prefix_length[0]) * sizeof(uint16_t);
+        *patterns += patt->special * (sizeof(*patt->special_table) + sizeof(struct cli_ac_special));
+        for(j = 0; j < patt->special; j++) {
+            if(patt->special_table[j]->bytemap)
+                *patterns += 32;
+            if(patt->special_table[j]->first)
+                *patterns += 257 * sizeof(uint16_t);
+            if(patt->special_table[j]->bitap)
+                *patterns += 256 * sizeof(uint64_t);
+        }
+        if(patt->virname && patt->partno <= 1)
+            *patterns += strlen(patt->virname) + 1;
+    }
+    *patterns += (size_t) (root->ac_reloff_num) * sizeof(*root->ac_reloff);
+    *patterns += (size_t) root->ac_lsigs * (sizeof(struct cli_ac_lsig) + sizeof(*root->ac_lsigtable));
+}
+
+int cli_ac_walknames(struct cli_matcher *root, int (*cb)(void *arg, const char **slot, const char *virname), void *arg)
+{
+    uint32_t i;
+    int ret;
+
+    for(i = 0; i < root->ac_patterns; i++) {
+        struct cli_ac_patt *patt = root->ac_pattable[i];
+
+        if(patt->lsigid[0] || patt->type || !patt->virname)
+            continue;
+        if((ret = cb(arg, (const char **)&patt->virname, patt->virname)))
+            return ret;
+    }
+    return 0;
+}
+
 /*
  * In parse_only mode this function returns -1 on error or the max subsig id
  */
-int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only)
+/* postfix program being compiled by ac_chklsig() */
+struct ac_lsig_prog {
+    struct cli_lsig_op *ops;
+    unsigned int nops, max, depth, maxdepth;
+};
+
+static int ac_lsig_emit(struct ac_lsig_prog *prog, char op, char mod, unsigned int id, unsigned int val1, unsigned int val2)
+{
+    struct cli_lsig_op *lop;
+
+    if(prog->nops == prog->max || id > 0xffff)
+        return -1;
+    lop = &prog->ops[prog->nops++];
+    lop->op = op;
+    lop->mod = mod;
+    lop->id = id;
+    lop->val1 = val1;
+    lop->val2 = val2;
+    if(op) {
+        prog->depth--;
+    } else if(++prog->depth > prog->maxdepth) {
+        prog->maxdepth = prog->depth;
+    }
+    return 0;
+}
+
+/* With prog, also compiles the expression when parse_only is set */
+static int ac_chklsig(const char *expr, const char *end, const uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only, struct ac_lsig_prog *prog)
 {
     unsigned int i, len = end - expr, pth = 0, opoff = 0, op1off = 0, val;
     unsigned int blkend = 0, id, modval1, modval2 = 0, lcnt = 0, rcnt = 0, tcnt, modoff = 0;
@@ -699,7 +1373,7 @@ int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigne
 
     if(!op && !op1) {
         if(expr[0] == '(')
-            return cli_ac_chklsig(++expr, --end, lsigcnt, cnt, ids, parse_only);
+            return ac_chklsig(++expr, --end, lsigcnt, cnt, ids, parse_only, prog);
 
         ret = sscanf(expr, "%u", &id);
         if(!ret || ret == EOF) {
@@ -745,6 +1419,8 @@ int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigne
         }
 
         if(parse_only) {
+            if(prog && ac_lsig_emit(prog, 0, mod, id, mod ? modval1 : 0, 0))
+                return -1;
             return val;
         } else {
             if(val) {
@@ -777,13 +1453,13 @@ int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigne
 
     rstart = &expr[opoff + 1];
 
-    lval = cli_ac_chklsig(lstart, lend, lsigcnt, &lcnt, &lids, parse_only);
+    lval = ac_chklsig(lstart, lend, lsigcnt, &lcnt, &lids, parse_only, prog);
     if(lval == -1) {
         cli_errmsg("cli_ac_chklsig: Calculation of lval failed\n");
         return -1;
     }
 
-    rval = cli_ac_chklsig(rstart, rend, lsigcnt, &rcnt, &rids, parse_only);
+    rval = ac_chklsig(rstart, rend, lsigcnt, &rcnt, &rids, parse_only, prog);
     if(rval == -1) {
         cli_errmsg("cli_ac_chklsig: Calculation of rval failed\n");
         return -1;
@@ -793,6 +1469,8 @@ int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigne
         switch(op) {
         case '&':
         case '|':
+            if(prog && ac_lsig_emit(prog, op, blkmod, 0, blkmod ? modval1 : 0, blkmod ? modval2 : 0))
+                return -1;
             return MAX(lval, rval);
         default:
             cli_errmsg("cli_ac_chklsig: Incorrect operator type\n");
@@ -861,6 +1539,160 @@ int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigne
     }
 }
 
+int cli_ac_chklsig(const char *expr, const char *end, const uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only)
+{
+    return ac_chklsig(expr, end, lsigcnt, cnt, ids, parse_only, NULL);
+}
+
+/* Same result as cli_ac_chklsig() on the expression ops were compiled
+ * from, including the counts the block modifiers look at */
+int cli_ac_runlsig(const struct cli_lsig_op *ops, unsigned int nops, const uint32_t *lsigcnt)
+{
+    struct {
+        int ret;
+        unsigned int cnt;
+        uint64_t ids;
+    } stack[CLI_LSIG_MAXDEPTH], *l, *r;
+    const struct cli_lsig_op *op;
+    unsigned int i, sp = 0, val, tcnt;
+    uint64_t tids;
+    int ret;
+
+    for(i = 0; i < nops; i++) {
+        op = &ops[i];
+        if(!op->op) {
+            r = &stack[sp++];
+            val = lsigcnt[op->id];
+            switch(op->mod) {
+            case 0:
+                ret = val != 0;
+                break;
+            case '=':
+                ret = val == op->val1;
+                break;
+            case '<':
+                ret = val < op->val1;
+                break;
+            case '>':
+                ret = val > op->val1;
+                break;
+            default:
+                ret = 0;
+            }
+            r->ret = ret;
+            r->cnt = ret ? val : 0;
+            r->ids = ret ? (uint64_t) 1 << op->id : 0;
+            continue;
+        }
+
+        r = &stack[--sp];
+        l = &stack[sp - 1];
+        if(op->op == '&')
+            ret = l->ret && r->ret;
+        else
+            ret = l->ret || r->ret;
+        tcnt = ret ? l->cnt + r->cnt : 0;
+        tids = ret ? l->ids | r->ids : 0;
+
+        if(!op->mod) {
+            l->ret = ret;
+            l->cnt = tcnt;
+            l->ids = tids;
+            continue;
+        }
+
+        switch(op->mod) {
+        case '=':
+            ret = tcnt == op->val1;
+            break;
+        case '<':
+            ret = tcnt < op->val1;
+            break;
+        case '>':
+            ret = tcnt > op->val1;
+            break;
+        default:
+            ret = 0;
+        }
+        if(ret && op->val2) {
+            for(val = 0; tids; tids >>= 1)
+                val += tids & (uint64_t) 1;
+            if(val < op->val2)
+                ret = 0;
+        }
+        /* a block passes its count up, not its subsignatures */
+        l->ret = ret;
+        l->cnt = ret ? tcnt : 0;
+        l->ids = 0;
+    }
+
+    return nops ? stack[0].ret : 0;
+}
+
+/* Compiles the expressions of the logical signatures and lists the ones
+ * cli_exp_eval() has to run even when none of their subsignatures matched:
+ * the YARA rules and the expressions true on zero counts ("0=0" and the
+ * like). The rest only need evaluating when lsig_sub_matched() marked them
+ * dirty. */
+int cli_ac_buildlsigs(struct cli_matcher *root)
+{
+    static uint32_t nohits[64];
+    struct cli_ac_lsig *lsig;
+    struct ac_lsig_prog prog;
+    unsigned int cnt;
+    uint64_t ids;
+    uint32_t i;
+    int ret;
+
+    if(root->ac_lsig_always)
+        return CL_SUCCESS;
+
+    root->ac_lsig_always = (uint32_t *) mpool_malloc(root->mempool, (root->ac_lsigs + 1) * sizeof(uint32_t));
+    if(!root->ac_lsig_always) {
+        cli_errmsg("cli_ac_buildlsigs: Can't allocate memory for ac_lsig_always\n");
+        return CL_EMEM;
+    }
+    root->ac_lsig_nalways = 0;
+
+    for(i = 0; i < root->ac_lsigs; i++) {
+        lsig = root->ac_lsigtable[i];
+        if(lsig->type != CLI_LSIG_NORMAL) {
+            root->ac_lsig_always[root->ac_lsig_nalways++] = i;
+            continue;
+        }
+
+        /* an operator or a count takes one char at least */
+        memset(&prog, 0, sizeof(prog));
+        prog.max = strlen(lsig->u.logic);
+        prog.ops = (struct cli_lsig_op *) mpool_malloc(root->mempool, prog.max * sizeof(struct cli_lsig_op));
+        if(!prog.ops) {
+            cli_errmsg("cli_ac_buildlsigs: Can't allocate memory for the expression of %s\n", lsig->virname);
+            return CL_EMEM;
+        }
+        if(ac_chklsig(lsig->u.logic, lsig->u.logic + prog.max, NULL, NULL, NULL, 1, &prog) < 0 ||
+           prog.depth != 1 || prog.maxdepth > CLI_LSIG_MAXDEPTH) {
+            cli_dbgmsg("cli_ac_buildlsigs: %s evaluated from its logic string\n", lsig->virname);
+            mpool_free(root->mempool, prog.ops);
+        } else {
+            lsig->ops = prog.ops;
+            lsig->nops = prog.nops;
+        }
+
+        if(lsig->ops) {
+            ret = cli_ac_runlsig(lsig->ops, lsig->nops, nohits);
+        } else {
+            cnt = 0;
+            ids = 0;
+            ret = cli_ac_chklsig(lsig->u.logic, lsig->u.logic + strlen(lsig->u.logic), nohits, &cnt, &ids, 0);
+        }
+        if(ret)
+            root->ac_lsig_always[root->ac_lsig_nalways++] = i;
+    }
+
+    cli_dbgmsg("cli_ac_buildlsigs: %u of %u logical signatures evaluated without matches\n", root->ac_lsig_nalways, root->ac_lsigs);
+    return CL_SUCCESS;
+}
+
 inline static int ac_findmatch_special(const unsigned char *buffer, uint32_t offset, uint32_t bp, uint32_t fileoffset, uint32_t length,
                                        const struct cli_ac_patt *pattern, uint32_t pp, uint16_t specialcnt, uint32_t *start, uint32_t *end, int rev);
 static int ac_backward_match_branch(const unsigned char *buffer, uint32_t bp, uint32_t offset, uint32_t length, uint32_t fileoffset,
@@ -952,9 +1784,10 @@ inline static int ac_findmatch_special(const unsigned char *buffer, uint32_t off
                                        const struct cli_ac_patt *pattern, uint32_t pp, uint16_t specialcnt, uint32_t *start, uint32_t *end, int rev)
 {
     int match, cmp;
-    uint16_t j, b = buffer[bp];
+    uint16_t j, n, b = buffer[bp];
     uint16_t wc;
-    uint32_t subbp;
+    uint32_t subbp, k;
+    uint64_t state, found = 0;
     struct cli_ac_special *special = pattern->special_table[specialcnt];
     struct cli_alt_node *alt = NULL;
 
@@ -962,6 +1795,10 @@ inline static int ac_findmatch_special(const unsigned char *buffer, uint32_t off
 
     switch(special->type) {
     case AC_SPECIAL_ALT_CHAR: /* single-byte */
+        if (special->bytemap) {
+            match = !!(special->bytemap[b >> 3] & (1 << (b & 7))) ^ special->negative;
+            break;
+        }
         for (j = 0; j < special->num; j++) {
             cmp = b - (special->alt).byte[j];
             if (cmp == 0) {
@@ -984,7 +1821,10 @@ inline static int ac_findmatch_special(const unsigned char *buffer, uint32_t off
         }
 
         match *= special->len[0];
-        for (j = 0; j < special->num; j++) {
+        /* only the alternates starting with the same byte can match */
+        j = special->first ? special->first[buffer[subbp]] : 0;
+        n = special->first ? special->first[buffer[subbp] + 1] : special->num;
+        for (; j < n; j++) {
             cmp = memcmp(&buffer[subbp], (special->alt).f_str[j], special->len[0]);
             if (cmp == 0) {
                 match = (!special->negative) * special->len[0];
@@ -995,6 +1835,31 @@ inline static int ac_findmatch_special(const unsigned char *buffer, uint32_t off
         break;
 
     case AC_SPECIAL_ALT_STR: /* generic */
+        if (special->bitap && special->bitap_rev == rev) {
+            /* all alternates in one pass, then in list order as below */
+            state = special->bitap_start;
+            for (k = 0; state && (rev ? k <= bp : bp + k < length); k++) {
+                state &= special->bitap[buffer[rev ? bp - k : bp + k]];
+                found |= state & special->bitap_end;
+                state = (state & ~special->bitap_end) << 1;
+            }
+            match = 0;
+            for (k = 0, alt = (special->alt).v_str; found && alt; k += alt->len, alt = alt->next) {
+                if (!(found & ((uint64_t) 1 << (k + alt->len - 1))))
+                    continue;
+                if (alt->unique) {
+                    match = alt->len;
+                    break;
+                }
+                if (!rev)
+                    match = ac_forward_match_branch(buffer, bp+alt->len, offset, fileoffset, length, pattern, pp+1, specialcnt+1, start, end);
+                else
+                    match = ac_backward_match_branch(buffer, bp-alt->len, offset, fileoffset, length, pattern, pp-1, specialcnt-1, start, end);
+                if (match)
+                    return -1;
+            }
+            break;
+        }
         alt = (special->alt).v_str;
         while (alt) {
             if (!rev) {
@@ -1225,34 +2090,187 @@ static int ac_forward_match_branch(const unsigned char *buffer, uint32_t bp, uin
             if(match)
                 break;
 
-            bp++;
-        }
+            bp++;
+        }
+
+        if(!match)
+            return 0;
+    }
+
+    return ac_backward_match_branch(buffer, offset-1, offset, fileoffset, length, pattern, pattern->prefix_length[0]-1, pattern->special_pattern-1, start, end);
+}
+
+inline static int ac_findmatch(const unsigned char *buffer, uint32_t offset, uint32_t fileoffset, uint32_t length, const struct cli_ac_patt *pattern, uint32_t *start, uint32_t *end)
+{
+    int match;
+    uint16_t specialcnt = pattern->special_pattern;
+
+    /* minimal check as the maximum variable length may exceed the buffer */
+    if((offset + pattern->length[1] > length) || (pattern->prefix_length[1] > offset))
+        return 0;
+
+    match = ac_forward_match_branch(buffer, offset+pattern->depth, offset, fileoffset, length, pattern, pattern->depth, specialcnt, start, end);
+    if(match)
+        return 1;
+    return 0;
+}
+
+static void *ac_data_malloc(struct cli_ac_data *data, size_t size)
+{
+    if(data->arena)
+        return cli_arena_malloc(data->arena, size);
+    return cli_malloc(size);
+}
+
+static void *ac_data_calloc(struct cli_ac_data *data, size_t nmemb, size_t size)
+{
+    if(data->arena)
+        return cli_arena_calloc(data->arena, nmemb, size);
+    return cli_calloc(nmemb, size);
+}
+
+/* Arena memory is reclaimed by the owner of the arena */
+static void ac_data_free(struct cli_ac_data *data, void *ptr)
+{
+    if(!data->arena)
+        free(ptr);
+}
+
+#define AC_NOOFF8 CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE
+const uint32_t cli_ac_nocnt[64] = { 0 };
+const uint32_t cli_ac_nooff[64] = { AC_NOOFF8, AC_NOOFF8, AC_NOOFF8, AC_NOOFF8, AC_NOOFF8, AC_NOOFF8, AC_NOOFF8, AC_NOOFF8 };
+
+static int ac_idmap_grow(struct cli_ac_data *data, struct cli_ac_idmap *map)
+{
+    uint32_t size = map->size ? map->size * 2 : 16, *ids, *order, i, j;
+    void **vals;
+
+    ids = (uint32_t *) ac_data_calloc(data, size, sizeof(uint32_t));
+    order = (uint32_t *) ac_data_malloc(data, size / 2 * sizeof(uint32_t));
+    vals = (void **) ac_data_malloc(data, size * sizeof(void *));
+    if(!ids || !order || !vals) {
+        cli_errmsg("ac_idmap_grow: Can't allocate memory for %u signatures\n", size);
+        ac_data_free(data, ids);
+        ac_data_free(data, order);
+        ac_data_free(data, vals);
+        return CL_EMEM;
+    }
+    for(i = 0; i < map->size; i++) {
+        if(!map->ids[i])
+            continue;
+        for(j = ((map->ids[i] - 1) * 2654435761U) & (size - 1); ids[j]; j = (j + 1) & (size - 1));
+        ids[j] = map->ids[i];
+        vals[j] = map->vals[i];
+    }
+    if(map->used)
+        memcpy(order, map->order, map->used * sizeof(uint32_t));
+
+    ac_data_free(data, map->ids);
+    ac_data_free(data, map->order);
+    ac_data_free(data, map->vals);
+    map->ids = ids;
+    map->order = order;
+    map->vals = vals;
+    map->size = size;
+    return CL_SUCCESS;
+}
+
+static int ac_idmap_add(struct cli_ac_data *data, struct cli_ac_idmap *map, uint32_t id, void *val)
+{
+    uint32_t i;
+
+    if(2 * (map->used + 1) > map->size && ac_idmap_grow(data, map) != CL_SUCCESS)
+        return CL_EMEM;
+    for(i = (id * 2654435761U) & (map->size - 1); map->ids[i]; i = (i + 1) & (map->size - 1));
+    map->ids[i] = id + 1;
+    map->vals[i] = val;
+    map->order[map->used++] = id;
+    return CL_SUCCESS;
+}
+
+/* Empty the map, keeping its arrays; the slots are all looked up before
+ * any is freed, as that breaks the probing for the ones after it */
+static void ac_idmap_clear(struct cli_ac_idmap *map)
+{
+    uint32_t i, k;
 
-        if(!match)
-            return 0;
+    for(k = 0; k < map->used; k++) {
+        for(i = (map->order[k] * 2654435761U) & (map->size - 1); map->ids[i] != map->order[k] + 1; i = (i + 1) & (map->size - 1));
+        map->order[k] = i;
     }
+    for(k = 0; k < map->used; k++)
+        map->ids[map->order[k]] = 0;
+    map->used = 0;
+}
 
-    return ac_backward_match_branch(buffer, offset-1, offset, fileoffset, length, pattern, pattern->prefix_length[0]-1, pattern->special_pattern-1, start, end);
+static void ac_idmap_free(struct cli_ac_data *data, struct cli_ac_idmap *map)
+{
+    ac_data_free(data, map->ids);
+    ac_data_free(data, map->order);
+    ac_data_free(data, map->vals);
+    memset(map, 0, sizeof(*map));
 }
 
-inline static int ac_findmatch(const unsigned char *buffer, uint32_t offset, uint32_t fileoffset, uint32_t length, const struct cli_ac_patt *pattern, uint32_t *start, uint32_t *end)
+/* the subsig match lists are grown with realloc() during the scan and
+ * always live on the heap */
+static void ac_data_freestates(struct cli_ac_data *data)
 {
-    int match;
-    uint16_t specialcnt = pattern->special_pattern;
+    struct cli_ac_lsigstate *st;
+    int32_t **offmatrix;
+    uint32_t i, j;
+
+    for(i = 0; i < data->psigmap.used; i++) {
+        offmatrix = (int32_t **) cli_ac_idmap_get(&data->psigmap, data->psigmap.order[i]);
+        ac_data_free(data, offmatrix[0]);
+        ac_data_free(data, offmatrix);
+    }
+    for(i = 0; i < data->lsigmap.used; i++) {
+        st = cli_ac_lsigstate(data, data->lsigmap.order[i]);
+        if(st->matches) {
+            for(j = 0; j < st->matches->subsigs; j++)
+                free(st->matches->matches[j]);
+            free(st->matches);
+        }
+        ac_data_free(data, st);
+    }
+}
 
-    /* minimal check as the maximum variable length may exceed the buffer */
-    if((offset + pattern->length[1] > length) || (pattern->prefix_length[1] > offset))
-        return 0;
+static void ac_data_freearrays(struct cli_ac_data *data)
+{
+    ac_data_free(data, data->offset);
+    ac_idmap_free(data, &data->psigmap);
+    ac_idmap_free(data, &data->lsigmap);
+    data->offset = NULL;
+    data->partsigs = data->lsigs = data->reloffsigs = 0;
+}
 
-    match = ac_forward_match_branch(buffer, offset+pattern->depth, offset, fileoffset, length, pattern, pattern->depth, specialcnt, start, end);
-    if(match)
-        return 1;
-    return 0;
+struct cli_ac_lsigstate *cli_ac_lsigstate_add(struct cli_ac_data *data, uint32_t lsigid)
+{
+    struct cli_ac_lsigstate *st;
+
+    if((st = cli_ac_lsigstate(data, lsigid)))
+        return st;
+    if(!(st = (struct cli_ac_lsigstate *) ac_data_malloc(data, sizeof(*st)))) {
+        cli_errmsg("cli_ac_lsigstate_add: Can't allocate memory for the state of lsig %u\n", lsigid);
+        return NULL;
+    }
+    memset(st->cnt, 0, sizeof(st->cnt));
+    memcpy(st->suboff_last, cli_ac_nooff, sizeof(st->suboff_last));
+    memcpy(st->suboff_first, cli_ac_nooff, sizeof(st->suboff_first));
+    st->matches = NULL;
+    st->yr_match = 0;
+    if(ac_idmap_add(data, &data->lsigmap, lsigid, st) != CL_SUCCESS) {
+        ac_data_free(data, st);
+        return NULL;
+    }
+    return st;
 }
 
-int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs, uint32_t reloffsigs, uint8_t tracklen)
+/* Only the relative offsets are set up front; the state of the partial and
+ * logical signatures is allocated as they match, as most of them don't */
+int cli_ac_initdata_arena(struct cli_ac_data *data, struct cli_arena *arena, uint32_t partsigs, uint32_t lsigs, uint32_t reloffsigs, uint8_t tracklen)
 {
-    unsigned int i, j;
+    unsigned int i;
 
     UNUSEDPARAM(tracklen);
 
@@ -1261,12 +2279,14 @@ int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs,
         return CL_ENULLARG;
     }
     memset((void *)data, 0, sizeof(struct cli_ac_data));
+    data->arena = arena;
 
     data->reloffsigs = reloffsigs;
     if(reloffsigs) {
-        data->offset = (uint32_t *) cli_malloc(reloffsigs * 2 * sizeof(uint32_t));
+        data->offset = (uint32_t *) ac_data_malloc(data, reloffsigs * 2 * sizeof(uint32_t));
         if(!data->offset) {
             cli_errmsg("cli_ac_init: Can't allocate memory for data->offset\n");
+            ac_data_freearrays(data);
             return CL_EMEM;
         }
         for(i = 0; i < reloffsigs * 2; i += 2)
@@ -1274,207 +2294,217 @@ int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs,
     }
 
     data->partsigs = partsigs;
-    if(partsigs) {
-        data->offmatrix = (int32_t ***) cli_calloc(partsigs, sizeof(int32_t **));
-        if(!data->offmatrix) {
-            cli_errmsg("cli_ac_init: Can't allocate memory for data->offmatrix\n");
+    data->lsigs = lsigs;
+    for (i=0;i<32;i++)
+        data->macro_lastmatch[i] = CLI_OFF_NONE;
 
-            if(reloffsigs)
-                free(data->offset);
+    data->min_partno = 1;
 
-            return CL_EMEM;
+    return CL_SUCCESS;
+}
+
+int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs, uint32_t reloffsigs, uint8_t tracklen)
+{
+    return cli_ac_initdata_arena(data, NULL, partsigs, lsigs, reloffsigs, tracklen);
+}
+
+/* Per-thread cache of match data, one slot per (engine, root) pair. The
+ * slots are keyed on the engine generation so a reloaded engine never
+ * picks up state sized for the old one. */
+#define CLI_AC_POOLSLOTS 8
+
+struct cli_ac_pooldata {
+    uint32_t generation;
+    const struct cli_matcher *root;
+    uint8_t busy;
+    unsigned int lastuse;
+    struct cli_ac_data data;
+};
+
+struct cli_ac_pool {
+    struct cli_ac_pooldata slots[CLI_AC_POOLSLOTS];
+    unsigned int tick;
+};
+
+static void ac_pool_destroy(void *ptr)
+{
+    struct cli_ac_pool *pool = ptr;
+    unsigned int i;
+
+    if(!pool)
+        return;
+    for(i = 0; i < CLI_AC_POOLSLOTS; i++)
+        if(pool->slots[i].generation)
+            cli_ac_freedata(&pool->slots[i].data);
+    free(pool);
+}
+
+#ifdef CL_THREAD_SAFE
+static pthread_key_t ac_pool_tls_key;
+static pthread_once_t ac_pool_tls_key_once = PTHREAD_ONCE_INIT;
+
+/* the destructor doesn't run for the main thread */
+static void ac_pool_cleanup_main(void)
+{
+    ac_pool_destroy(pthread_getspecific(ac_pool_tls_key));
+    pthread_setspecific(ac_pool_tls_key, NULL);
+}
+
+static void ac_pool_tls_key_alloc(void)
+{
+    pthread_key_create(&ac_pool_tls_key, ac_pool_destroy);
+    if(atexit(ac_pool_cleanup_main))
+        cli_dbgmsg("ac_pool: failed to register atexit\n");
+}
+
+static struct cli_ac_pool *ac_pool_get(void)
+{
+    struct cli_ac_pool *pool;
+
+    pthread_once(&ac_pool_tls_key_once, ac_pool_tls_key_alloc);
+    if(!(pool = pthread_getspecific(ac_pool_tls_key))) {
+        if(!(pool = cli_calloc(1, sizeof(*pool))))
+            return NULL;
+        if(pthread_setspecific(ac_pool_tls_key, pool)) {
+            free(pool);
+            return NULL;
         }
     }
- 
-    data->lsigs = lsigs;
-    if(lsigs) {
-        data->lsigcnt = (uint32_t **) cli_malloc(lsigs * sizeof(uint32_t *));
-        if(!data->lsigcnt) {
-            if(partsigs)
-                free(data->offmatrix);
+    return pool;
+}
+#else
+static struct cli_ac_pool *ac_pool_global = NULL;
 
-            if(reloffsigs)
-                free(data->offset);
+static void ac_pool_cleanup_main(void)
+{
+    ac_pool_destroy(ac_pool_global);
+    ac_pool_global = NULL;
+}
 
-            cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigcnt\n");
-            return CL_EMEM;
-        }
-        data->lsigcnt[0] = (uint32_t *) cli_calloc(lsigs * 64, sizeof(uint32_t));
-        if(!data->lsigcnt[0]) {
-            free(data->lsigcnt);
-            if(partsigs)
-                free(data->offmatrix);
+static struct cli_ac_pool *ac_pool_get(void)
+{
+    if(!ac_pool_global) {
+        if(!(ac_pool_global = cli_calloc(1, sizeof(*ac_pool_global))))
+            return NULL;
+        if(atexit(ac_pool_cleanup_main))
+            cli_dbgmsg("ac_pool: failed to register atexit\n");
+    }
+    return ac_pool_global;
+}
+#endif
 
-            if(reloffsigs)
-                free(data->offset);
+/* Bring pooled data back to the state cli_ac_initdata() leaves it in,
+ * keeping the maps grown by the earlier scans */
+static void ac_data_reset(struct cli_ac_data *data)
+{
+    uint32_t i;
 
-            cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigcnt[0]\n");
-            return CL_EMEM;
-        }
-        for(i = 1; i < lsigs; i++)
-            data->lsigcnt[i] = data->lsigcnt[0] + 64 * i;
-        data->yr_matches = (uint8_t *) cli_calloc(lsigs, sizeof(uint8_t));
-        if (data->yr_matches == NULL) {
-            free(data->lsigcnt[0]);
-            free(data->lsigcnt);
-            if(partsigs)
-                free(data->offmatrix);
-            
-            if(reloffsigs)
-                free(data->offset);
-            return CL_EMEM;
-        }
+    ac_data_freestates(data);
+    ac_idmap_clear(&data->psigmap);
+    ac_idmap_clear(&data->lsigmap);
 
-        /* subsig offsets */
-        data->lsig_matches = (struct cli_lsig_matches **) cli_calloc(lsigs, sizeof(struct cli_lsig_matches *));
-        if(!data->lsig_matches) {
-            free(data->yr_matches);
-            free(data->lsigcnt[0]);
-            free(data->lsigcnt);
-            if(partsigs)
-                free(data->offmatrix);
+    for(i = 0; i < 32; i++)
+        data->macro_lastmatch[i] = CLI_OFF_NONE;
+    data->vinfo = NULL;
+    data->info = NULL;
+    data->min_partno = 1;
+}
 
-            if(reloffsigs)
-                free(data->offset);
+int cli_ac_initdata_cached(struct cli_ac_data *data, cli_ctx *ctx, const struct cli_matcher *root)
+{
+    const struct cl_engine *engine = ctx->engine;
+    struct cli_ac_pool *pool;
+    struct cli_ac_pooldata *slot = NULL;
+    unsigned int i;
+    int ret;
 
-            cli_errmsg("cli_ac_init: Can't allocate memory for data->lsig_matches\n");
-            return CL_EMEM;
-        }
-        data->lsigsuboff_last = (uint32_t **) cli_malloc(lsigs * sizeof(uint32_t *));
-        data->lsigsuboff_first = (uint32_t **) cli_malloc(lsigs * sizeof(uint32_t *));
-        if(!data->lsigsuboff_last || !data->lsigsuboff_first) {
-            free(data->lsig_matches);
-            free(data->lsigsuboff_last);
-            free(data->lsigsuboff_first);
-            free(data->yr_matches);
-            free(data->lsigcnt[0]);
-            free(data->lsigcnt);
-            if(partsigs)
-                free(data->offmatrix);
-
-            if(reloffsigs)
-                free(data->offset);
-
-            cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigsuboff_(last|first)\n");
-            return CL_EMEM;
-        }
-        data->lsigsuboff_last[0] = (uint32_t *) cli_calloc(lsigs * 64, sizeof(uint32_t));
-        data->lsigsuboff_first[0] = (uint32_t *) cli_calloc(lsigs * 64, sizeof(uint32_t));
-        if(!data->lsigsuboff_last[0] || !data->lsigsuboff_first[0]) {
-            free(data->lsig_matches);
-            free(data->lsigsuboff_last[0]);
-            free(data->lsigsuboff_first[0]);
-            free(data->lsigsuboff_last);
-            free(data->lsigsuboff_first);
-            free(data->yr_matches);
-            free(data->lsigcnt[0]);
-            free(data->lsigcnt);
-            if(partsigs)
-                free(data->offmatrix);
-
-            if(reloffsigs)
-                free(data->offset);
-
-            cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigsuboff_(last|first)[0]\n");
-            return CL_EMEM;
-        }
-        for(j = 0; j < 64; j++) {
-            data->lsigsuboff_last[0][j] = CLI_OFF_NONE;
-            data->lsigsuboff_first[0][j] = CLI_OFF_NONE;
-        }
-        for(i = 1; i < lsigs; i++) {
-            data->lsigsuboff_last[i] = data->lsigsuboff_last[0] + 64 * i;
-            data->lsigsuboff_first[i] = data->lsigsuboff_first[0] + 64 * i;
-            for(j = 0; j < 64; j++) {
-                data->lsigsuboff_last[i][j] = CLI_OFF_NONE;
-                data->lsigsuboff_first[i][j] = CLI_OFF_NONE;
-            }
+    /* safe to pass to cli_ac_freedata() whatever happens below */
+    memset(data, 0, sizeof(*data));
+    if(!engine->generation || !(pool = ac_pool_get()))
+        return cli_ac_initdata_arena(data, &ctx->arena, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN);
+
+    for(i = 0; i < CLI_AC_POOLSLOTS; i++) {
+        struct cli_ac_pooldata *pt = &pool->slots[i];
+
+        if(pt->busy)
+            continue;
+        /* lazily built roots change size once, check the counts too */
+        if(pt->generation == engine->generation && pt->root == root && pt->data.partsigs == root->ac_partsigs &&
+           pt->data.lsigs == root->ac_lsigs && pt->data.reloffsigs == root->ac_reloff_num) {
+            slot = pt;
+            break;
         }
+        if(!slot || pt->lastuse < slot->lastuse)
+            slot = pt;
     }
-    for (i=0;i<32;i++)
-        data->macro_lastmatch[i] = CLI_OFF_NONE;
 
-    data->min_partno = 1;
+    /* all slots taken by outer scan levels */
+    if(!slot)
+        return cli_ac_initdata_arena(data, &ctx->arena, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN);
+
+    if(i == CLI_AC_POOLSLOTS) {
+        if(slot->generation)
+            cli_ac_freedata(&slot->data);
+        slot->generation = 0;
+        if((ret = cli_ac_initdata(&slot->data, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)))
+            return ret;
+        slot->generation = engine->generation;
+        slot->root = root;
+    }
 
+    slot->busy = 1;
+    slot->lastuse = ++pool->tick;
+    *data = slot->data;
+    data->pooled = slot;
     return CL_SUCCESS;
 }
 
-int cli_ac_caloff(const struct cli_matcher *root, struct cli_ac_data *data, const struct cli_target_info *info)
+int cli_ac_caloff(const struct cli_matcher *root, struct cli_ac_data *data, struct cli_target_info *info)
 {
-    int ret;
     unsigned int i;
-    struct cli_ac_patt *patt;
 
+    data->info = info;
     if(info)
         data->vinfo = &info->exeinfo.vinfo;
 
-    for(i = 0; i < root->ac_reloff_num; i++) {
-        patt = root->ac_reloff[i];
-        if(!info) {
-            data->offset[patt->offset_min] = CLI_OFF_NONE;
-        } else if((ret = cli_caloff(NULL, info, root->type, patt->offdata, &data->offset[patt->offset_min], &data->offset[patt->offset_max]))) {
-            cli_errmsg("cli_ac_caloff: Can't calculate relative offset in signature for %s\n", patt->virname);
-            return ret;
-        } else if((data->offset[patt->offset_min] != CLI_OFF_NONE) && (data->offset[patt->offset_min] + patt->length[1] > info->fsize)) {
-            data->offset[patt->offset_min] = CLI_OFF_NONE;
-        }
-    }
+    /* the offsets are calculated by ac_reloff() when a pattern first hits */
+    for(i = 0; i < root->ac_reloff_num; i++)
+        data->offset[root->ac_reloff[i]->offset_min] = info ? CLI_OFF_LAZY : CLI_OFF_NONE;
 
     return CL_SUCCESS;
 }
 
-void cli_ac_freedata(struct cli_ac_data *data)
+static void ac_reloff(const struct cli_matcher *root, struct cli_ac_data *data, struct cli_ac_patt *patt)
 {
-    uint32_t i;
+    uint32_t *offset = data->offset;
+
+    if(!data->info) {
+        offset[patt->offset_min] = CLI_OFF_NONE;
+    } else if(cli_caloff(NULL, data->info, root->type, patt->offdata, &offset[patt->offset_min], &offset[patt->offset_max])) {
+        cli_errmsg("cli_ac_scanbuff: Can't calculate relative offset in signature for %s\n", patt->virname);
+        offset[patt->offset_min] = CLI_OFF_NONE;
+    } else if((offset[patt->offset_min] != CLI_OFF_NONE) && (offset[patt->offset_min] + patt->length[1] > data->info->fsize)) {
+        offset[patt->offset_min] = CLI_OFF_NONE;
+    }
+}
 
+void cli_ac_freedata(struct cli_ac_data *data)
+{
     if (!data)
         return;
 
-    if(data->partsigs) {
-        for(i = 0; i < data->partsigs; i++) {
-            if(data->offmatrix[i]) {
-                free(data->offmatrix[i][0]);
-                free(data->offmatrix[i]);
-            }
-        }
-        free(data->offmatrix);
-        data->offmatrix = NULL;
-        data->partsigs = 0;
-    }
+    if(data->pooled) {
+        struct cli_ac_pooldata *slot = data->pooled;
 
-    if(data->lsigs) {
-        if (data->lsig_matches) {
-            for (i = 0; i < data->lsigs; i++) {
-                struct cli_lsig_matches * ls_matches;
-                if ((ls_matches = data->lsig_matches[i])) {
-                    uint32_t j;
-                    for (j = 0; j < ls_matches->subsigs; j++) {
-                        if (ls_matches->matches[j]) {
-                            free(ls_matches->matches[j]);
-                            ls_matches->matches[j] = 0;
-                        }
-                    }
-                    free(data->lsig_matches[i]);
-                    data->lsig_matches[i] = 0;
-                }
-            }
-            free(data->lsig_matches);
-            data->lsig_matches = 0;
-        }
-        free(data->yr_matches);
-        free(data->lsigcnt[0]);
-        free(data->lsigcnt);
-        free(data->lsigsuboff_last[0]);
-        free(data->lsigsuboff_last);
-        free(data->lsigsuboff_first[0]);
-        free(data->lsigsuboff_first);
-        data->lsigs = 0;
+        ac_data_reset(data);
+        data->pooled = NULL;
+        slot->data = *data;
+        slot->busy = 0;
+        return;
     }
 
-    if(data->reloffsigs) {
-        free(data->offset);
-        data->reloffsigs = 0;
-    }
+    ac_data_freestates(data);
+    ac_data_freearrays(data);
 }
 
 /* returns only CL_SUCCESS or CL_EMEM */
@@ -1515,17 +2545,21 @@ int lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata,
 {
     const struct cli_ac_lsig *ac_lsig = root->ac_lsigtable[lsigid1];
     const struct cli_lsig_tdb *tdb = &ac_lsig->tdb;
+    struct cli_ac_lsigstate *st;
+
+    if(!(st = cli_ac_lsigstate_add(mdata, lsigid1)))
+        return CL_EMEM;
 
     if(realoff != CLI_OFF_NONE) {
-        if(mdata->lsigsuboff_first[lsigid1][lsigid2] == CLI_OFF_NONE)
-            mdata->lsigsuboff_first[lsigid1][lsigid2] = realoff;
+        if(st->suboff_first[lsigid2] == CLI_OFF_NONE)
+            st->suboff_first[lsigid2] = realoff;
 
-        if(mdata->lsigsuboff_last[lsigid1][lsigid2] != CLI_OFF_NONE && ((!partial && realoff <= mdata->lsigsuboff_last[lsigid1][lsigid2]) || (partial && realoff < mdata->lsigsuboff_last[lsigid1][lsigid2])))
+        if(st->suboff_last[lsigid2] != CLI_OFF_NONE && ((!partial && realoff <= st->suboff_last[lsigid2]) || (partial && realoff < st->suboff_last[lsigid2])))
             return CL_SUCCESS;
 
-        mdata->lsigcnt[lsigid1][lsigid2]++;
-        if(mdata->lsigcnt[lsigid1][lsigid2] <= 1 || !tdb->macro_ptids || !tdb->macro_ptids[lsigid2])
-            mdata->lsigsuboff_last[lsigid1][lsigid2] = realoff;
+        st->cnt[lsigid2]++;
+        if(st->cnt[lsigid2] <= 1 || !tdb->macro_ptids || !tdb->macro_ptids[lsigid2])
+            st->suboff_last[lsigid2] = realoff;
     }
 
     if (ac_lsig->type & CLI_YARA_OFFSET && realoff != CLI_OFF_NONE) {
@@ -1534,9 +2568,9 @@ int lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata,
         struct cli_lsig_matches * ls_matches;
         cli_dbgmsg("lsig_sub_matched lsig %u:%u at %u\n", lsigid1, lsigid2, realoff);
 
-        ls_matches = mdata->lsig_matches[lsigid1];
+        ls_matches = st->matches;
         if (ls_matches == NULL) { /* allocate cli_lsig_matches */
-            ls_matches = mdata->lsig_matches[lsigid1] = (struct cli_lsig_matches *)cli_calloc(1, sizeof(struct cli_lsig_matches) +
+            ls_matches = st->matches = (struct cli_lsig_matches *)cli_calloc(1, sizeof(struct cli_lsig_matches) +
                                                                                               (ac_lsig->tdb.subsigs - 1) * sizeof(struct cli_subsig_matches *));
             if (ls_matches == NULL) {
                 cli_errmsg("lsig_sub_matched: cli_calloc failed for cli_lsig_matches\n");
@@ -1567,7 +2601,7 @@ int lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata,
         ss_matches->next++;
     }
 
-    if (mdata->lsigcnt[lsigid1][lsigid2] > 1) {
+    if (st->cnt[lsigid2] > 1) {
         /* Check that the previous match had a macro match following it at the 
          * correct distance. This check is only done after the 1st match.*/
         const struct cli_ac_patt *macropt;
@@ -1586,7 +2620,7 @@ int lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata,
         /* start of last macro match */
         last_macro_match = mdata->macro_lastmatch[macropt->sigid];
         /* start of previous lsig subsig match */
-        last_macroprev_match = mdata->lsigsuboff_last[lsigid1][lsigid2];
+        last_macroprev_match = st->suboff_last[lsigid2];
         if (last_macro_match != CLI_OFF_NONE)
             cli_dbgmsg("Checking macro match: %u + (%u - %u) == %u\n",
                        last_macroprev_match, smin, smax, last_macro_match);
@@ -1596,12 +2630,12 @@ int lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata,
             last_macroprev_match + smax < last_macro_match) {
             cli_dbgmsg("Canceled false lsig macro match\n");
             /* Previous match was false - cancel it */
-            mdata->lsigcnt[lsigid1][lsigid2]--;
-            mdata->lsigsuboff_last[lsigid1][lsigid2] = realoff;
+            st->cnt[lsigid2]--;
+            st->suboff_last[lsigid2] = realoff;
         } else {
             /* mark the macro sig itself matched */
-            mdata->lsigcnt[lsigid1][lsigid2+1]++;
-            mdata->lsigsuboff_last[lsigid1][lsigid2+1] = last_macro_match;
+            st->cnt[lsigid2+1]++;
+            st->suboff_last[lsigid2+1] = last_macro_match;
         }
     }
     return CL_SUCCESS;
@@ -1624,9 +2658,75 @@ int cli_ac_chkmacro(struct cli_matcher *root, struct cli_ac_data *data, unsigned
 }
 
 
-int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
+/* the lowest part number looked for by the roots of the trie */
+#define AC_MIN_PARTNO (gdata && gdata->min_partno > tdata->min_partno ? gdata->min_partno : tdata->min_partno)
+
+/* the root and match data a pattern of the trie reports to */
+#define AC_PATT_ROOT(p)                 \
+    do {                                \
+        if((p)->generic && gdata) {     \
+            root = groot;               \
+            mdata = gdata;              \
+        } else {                        \
+            root = troot;               \
+            mdata = tdata;              \
+        }                               \
+    } while(0)
+
+/* With the compact transition table, the positions where the automaton
+ * reaches a final state (and those where the BM hash table has an entry)
+ * are first collected for a stretch of the buffer by a loop doing nothing
+ * else, and then verified in order. The table walk stays tight and keeps
+ * its cache lines, while the pattern checks don't interleave with it. */
+#define AC_CAND_MAX 256
+#define AC_CAND_NOFINAL 0xffffffff
+
+struct ac_cand {
+    uint32_t pos;
+    uint32_t final; /* index in ac_cfinal or AC_CAND_NOFINAL */
+    uint8_t bm; /* the BM block ending at pos is to be checked */
+};
+
+/* Walks ctrans from *pos, starting in *row, until AC_CAND_MAX candidates
+ * are found or the buffer ends; returns their number */
+static uint32_t ac_candidates(const struct cli_matcher *acroot, const struct cli_matcher *bmroot, const unsigned char *buffer, uint32_t length, uint32_t *pos, uint32_t *row, struct ac_cand *cand)
+{
+    const uint32_t *ctrans = acroot->ac_ctrans;
+    uint32_t i = *pos, r = *row, state, n = 0;
+    uint8_t bm;
+
+    for(; i < length && n < AC_CAND_MAX; i++) {
+        bm = bmroot && i >= BM_BLOCK_SIZE - 1 && bmroot->bm_suffix[BM_HASH(buffer[i - 2], buffer[i - 1], buffer[i])];
+        state = ctrans[((size_t) r << 8) | buffer[i]];
+        if(LIKELY(!(state & AC_CSTATE_FINAL))) {
+            r = state;
+            if(LIKELY(!bm))
+                continue;
+            state = AC_CAND_NOFINAL;
+        } else {
+            state &= ~AC_CSTATE_FINAL;
+            r = acroot->ac_cfinal[state].row;
+        }
+        cand[n].pos = i;
+        cand[n].final = state;
+        cand[n].bm = bm;
+        n++;
+    }
+    *pos = i;
+    *row = r;
+    return n;
+}
+
+/* Scans buffer with the trie of acroot. Its patterns belong to troot, or
+ * with a merged trie (see cli_ac_merge()) to either troot or groot, and the
+ * matches go to the data of the root of each pattern. */
+static int ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *acroot, const struct cli_matcher *troot, struct cli_ac_data *tdata, const struct cli_matcher *groot, struct cli_ac_data *gdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
 {
-    struct cli_ac_node *current;
+    const struct cli_matcher *root = troot;
+    struct cli_ac_data *mdata = tdata;
+    const struct cli_ac_node *current;
+    const uint32_t *ctrans;
+    uint32_t row, state;
     struct cli_ac_list *pattN, *ptN;
     struct cli_ac_patt *patt, *pt;
     uint32_t i, bp, exptoff[2], realoff, matchstart, matchend;
@@ -1635,32 +2735,69 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
     int32_t **offmatrix, swp;
     int type = CL_CLEAN;
     struct cli_ac_result *newres;
-    int rc;
+    int rc, matched, bm_found = 0;
+    uint64_t sampled;
+    const struct cli_matcher *bmroot = NULL;
+    struct ac_cand cand[AC_CAND_MAX];
+    uint32_t ncand = 0, ncur = 0, walked = 0;
 
-    if(!root->ac_root)
+    if(!acroot->ac_root)
         return CL_CLEAN;
 
-    if(!mdata && (root->ac_partsigs || root->ac_lsigs || root->ac_reloff_num)) {
+    /* every position is looked up in the BM hash table as the AC automaton
+     * reads it, so that the data goes through the cache once */
+    if((mode & AC_SCAN_BM) && troot->bm_suffix)
+        bmroot = troot;
+
+    if(!tdata && (troot->ac_partsigs || troot->ac_lsigs || troot->ac_reloff_num)) {
         cli_errmsg("cli_ac_scanbuff: mdata == NULL\n");
         return CL_ENULLARG;
     }
 
-    current = root->ac_root;
+    current = acroot->ac_root;
+    ctrans = acroot->ac_ctrans;
+    row = 0;
 
     for(i = 0; i < length; i++)  {
-        current = current->trans[buffer[i]];
+        if(ctrans) {
+            /* the candidates have increasing positions, so the loop ends
+             * with the last one on the last byte at the latest */
+            if(ncur == ncand) {
+                ncur = 0;
+                if(!(ncand = ac_candidates(acroot, bmroot, buffer, length, &walked, &row, cand)))
+                    break;
+            }
+            i = cand[ncur].pos;
+            state = cand[ncur].final;
+            if(cand[ncur++].bm) {
+                rc = cli_bm_scanpos(buffer, length, i + 1 - BM_BLOCK_SIZE, virname, bmroot, offset, tdata ? tdata->info : NULL, ctx, &bm_found);
+                if(rc != CL_CLEAN)
+                    return rc;
+            }
+            if(state == AC_CAND_NOFINAL)
+                continue;
+            current = acroot->ac_cfinal[state].node;
+        } else {
+            if(bmroot && i >= BM_BLOCK_SIZE - 1 && bmroot->bm_suffix[BM_HASH(buffer[i - 2], buffer[i - 1], buffer[i])]) {
+                rc = cli_bm_scanpos(buffer, length, i + 1 - BM_BLOCK_SIZE, virname, bmroot, offset, tdata ? tdata->info : NULL, ctx, &bm_found);
+                if(rc != CL_CLEAN)
+                    return rc;
+            }
+            current = current->trans[buffer[i]];
+        }
 
         if(UNLIKELY(IS_FINAL(current))) {
             struct cli_ac_list *faillist = current->fail->list;
             pattN = current->list;
             while(pattN) {
                 patt = pattN->me;
-                if(patt->partno > mdata->min_partno) {
+                if(patt->partno > AC_MIN_PARTNO) {
                     pattN = faillist;
                     faillist = NULL;
                     continue;
                 }
                 bp = i + 1 - patt->depth;
+                AC_PATT_ROOT(patt);
                 if(patt->offdata[0] != CLI_OFF_VERSION && patt->offdata[0] != CLI_OFF_MACRO && !pattN->next_same && (patt->offset_min != CLI_OFF_ANY) && (!patt->sigid || patt->partno == 1)) {
                     if(patt->offset_min == CLI_OFF_NONE) {
                         pattN = pattN->next;
@@ -1674,6 +2811,8 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
                             continue;
                         }
                     } else {
+                        if(mdata->offset[patt->offset_min] == CLI_OFF_LAZY)
+                            ac_reloff(root, mdata, patt);
                         if(mdata->offset[patt->offset_min] == CLI_OFF_NONE || mdata->offset[patt->offset_max] < exptoff[0] || mdata->offset[patt->offset_min] > exptoff[1]) {
                             pattN = pattN->next;
                             continue;
@@ -1682,11 +2821,21 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
                 }
 
                 ptN = pattN;
-                if(ac_findmatch(buffer, bp, offset + bp, length, patt, &matchstart, &matchend)) {
+                /* the alternatives and ranges are what can make a body signature slow */
+                sampled = patt->special ? cli_sigprof_start(ctx) : 0;
+                matched = ac_findmatch(buffer, bp, offset + bp, length, patt, &matchstart, &matchend);
+                cli_sigprof_stop(ctx, CLI_SIGPROF_SPECIAL, patt, patt->virname, sampled);
+                if(matched) {
                     while(ptN) {
                         pt = ptN->me;
-                        if(pt->partno > mdata->min_partno)
-                            break;
+                        AC_PATT_ROOT(pt);
+                        if(pt->partno > mdata->min_partno) {
+                            /* sorted by part number, but not by root */
+                            if(!gdata)
+                                break;
+                            ptN = ptN->next_same;
+                            continue;
+                        }
 
                         if((pt->type && !(mode & AC_SCAN_FT)) || (!pt->type && !(mode & AC_SCAN_VIR))) {
                             ptN = ptN->next_same;
@@ -1695,6 +2844,8 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 
                         realoff = offset + matchstart;
                         if(pt->offdata[0] == CLI_OFF_VERSION) {
+                            if(mdata->info)
+                                cli_targetinfo_exe(mdata->info);
                             if(!cli_hashset_contains_maybe_noalloc(mdata->vinfo, realoff)) {
                                 ptN = ptN->next_same;
                                 continue;
@@ -1715,6 +2866,8 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
                                     continue;
                                 }
                             } else {
+                                if(mdata->offset[pt->offset_min] == CLI_OFF_LAZY)
+                                    ac_reloff(root, mdata, pt);
                                 if(mdata->offset[pt->offset_min] == CLI_OFF_NONE || mdata->offset[pt->offset_max] < realoff || mdata->offset[pt->offset_min] > realoff) {
                                     ptN = ptN->next_same;
                                     continue;
@@ -1725,7 +2878,8 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
                         if(pt->sigid) { /* it's a partial signature */
 
                             /* if 2nd or later part, confirm some prior part has matched */
-                            if(pt->partno != 1 && (!mdata->offmatrix[pt->sigid - 1] || !mdata->offmatrix[pt->sigid - 1][pt->partno - 2][0])) {
+                            offmatrix = (int32_t **) cli_ac_idmap_get(&mdata->psigmap, pt->sigid - 1);
+                            if(pt->partno != 1 && (!offmatrix || !offmatrix[pt->partno - 2][0])) {
                                 ptN = ptN->next_same;
                                 continue;
                             }
@@ -1734,28 +2888,27 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
                                 mdata->min_partno = pt->partno + 1;
 
                             /* sparsely populated matrix, so allocate and initialize if NULL */
-                            if(!mdata->offmatrix[pt->sigid - 1]) {
-                                mdata->offmatrix[pt->sigid - 1] = cli_malloc(pt->parts * sizeof(int32_t *));
-                                if(!mdata->offmatrix[pt->sigid - 1]) {
-                                    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for mdata->offmatrix[%u]\n", pt->sigid - 1);
+                            if(!offmatrix) {
+                                offmatrix = ac_data_malloc(mdata, pt->parts * sizeof(int32_t *));
+                                if(!offmatrix) {
+                                    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for the offset matrix of %u\n", pt->sigid - 1);
                                     return CL_EMEM;
                                 }
 
-                                mdata->offmatrix[pt->sigid - 1][0] = cli_malloc(pt->parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
-                                if(!mdata->offmatrix[pt->sigid - 1][0]) {
-                                    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for mdata->offmatrix[%u][0]\n", pt->sigid - 1);
-                                    free(mdata->offmatrix[pt->sigid - 1]);
-                                    mdata->offmatrix[pt->sigid - 1] = NULL;
+                                offmatrix[0] = ac_data_malloc(mdata, pt->parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
+                                if(!offmatrix[0] || ac_idmap_add(mdata, &mdata->psigmap, pt->sigid - 1, offmatrix) != CL_SUCCESS) {
+                                    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for the offset matrix of %u\n", pt->sigid - 1);
+                                    ac_data_free(mdata, offmatrix[0]);
+                                    ac_data_free(mdata, offmatrix);
                                     return CL_EMEM;
                                 }
-                                memset(mdata->offmatrix[pt->sigid - 1][0], -1, pt->parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
-                                mdata->offmatrix[pt->sigid - 1][0][0] = 0;
+                                memset(offmatrix[0], -1, pt->parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
+                                offmatrix[0][0] = 0;
                                 for(j = 1; j < pt->parts; j++) {
-                                    mdata->offmatrix[pt->sigid - 1][j] = mdata->offmatrix[pt->sigid - 1][0] + j * (CLI_DEFAULT_AC_TRACKLEN + 2);
-                                    mdata->offmatrix[pt->sigid - 1][j][0] = 0;
+                                    offmatrix[j] = offmatrix[0] + j * (CLI_DEFAULT_AC_TRACKLEN + 2);
+                                    offmatrix[j][0] = 0;
                                 }
                             }
-                            offmatrix = mdata->offmatrix[pt->sigid - 1];
 
                             found = 0;
                             if(pt->partno != 1) {
@@ -1829,6 +2982,11 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
                                         continue;
                                     }
 
+                                    if(pt->virname == cli_virname_deleted) {
+                                        ptN = ptN->next_same;
+                                        continue;
+                                    }
+
                                     if(res) {
                                         newres = (struct cli_ac_result *) malloc(sizeof(struct cli_ac_result));
                                         if(!newres) {
@@ -1884,6 +3042,11 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
                                     continue;
                                 }
 
+                                if(pt->virname == cli_virname_deleted) {
+                                    ptN = ptN->next_same;
+                                    continue;
+                                }
+
                                 if(res) {
                                     newres = (struct cli_ac_result *) malloc(sizeof(struct cli_ac_result));
                                     if(!newres) {
@@ -1926,12 +3089,103 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
         }
     }
 
-    if (viruses_found)
+    if (viruses_found || bm_found)
         return CL_VIRUS;
 
     return (mode & AC_SCAN_FT) ? type : CL_CLEAN;
 }
 
+int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
+{
+    return ac_scanbuff(buffer, length, virname, customdata, res, root, root, mdata, NULL, NULL, offset, ftype, ftoffset, mode, ctx);
+}
+
+/* One pass over buffer for the patterns of troot and groot, with the trie
+ * built by cli_ac_merge() */
+int cli_ac_scanbuff_merged(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *troot, struct cli_ac_data *tdata, const struct cli_matcher *groot, struct cli_ac_data *gdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
+{
+    if(!troot->ac_merged || !tdata || !gdata)
+        return cli_ac_scanbuff(buffer, length, virname, customdata, res, troot, tdata, offset, ftype, ftoffset, mode, ctx);
+
+    return ac_scanbuff(buffer, length, virname, customdata, res, troot->ac_merged, troot, tdata, groot, gdata, offset, ftype, ftoffset, mode & ~AC_SCAN_BM, ctx);
+}
+
+
+/* Side-effect free variant of cli_ac_scanbuff() used to find out which
+ * buffers need a real scan. Returns 1 if a single-part pattern relevant to
+ * mode and ftype matches within the buffer. Parts of multi-part signatures
+ * only have an effect once their last part matches, so those are reported
+ * through two masks of (hashed) signature ids instead: parts gets the ids of
+ * all matched parts, final the ids of signatures whose last part matched.
+ * Offsets and matching state are ignored, so the answer is a superset of what
+ * cli_ac_scanbuff() would act upon for the same buffer.
+ */
+int cli_ac_probebuff(const unsigned char *buffer, uint32_t length, const struct cli_matcher *root, uint32_t offset, unsigned int mode, cli_file_t ftype, uint64_t *parts, uint64_t *final)
+{
+    const struct cli_ac_node *current;
+    const struct cli_ac_list *pattN, *ptN;
+    const struct cli_ac_patt *patt, *pt;
+    const uint32_t *ctrans;
+    uint32_t i, bp, row, state, matchstart, matchend;
+    int pass, hit = 0;
+
+    if(!root->ac_root)
+        return 0;
+
+    current = root->ac_root;
+    ctrans = root->ac_ctrans;
+    row = 0;
+
+    for(i = 0; i < length; i++) {
+        if(ctrans) {
+            state = ctrans[((size_t) row << 8) | buffer[i]];
+            if(LIKELY(!(state & AC_CSTATE_FINAL))) {
+                row = state;
+                continue;
+            }
+            state &= ~AC_CSTATE_FINAL;
+            row = root->ac_cfinal[state].row;
+            current = root->ac_cfinal[state].node;
+        } else {
+            current = current->trans[buffer[i]];
+        }
+
+        if(UNLIKELY(IS_FINAL(current))) {
+            for(pass = 0; pass < 2; pass++) {
+                pattN = pass ? current->fail->list : current->list;
+                for(; pattN; pattN = pattN->next) {
+                    patt = pattN->me;
+                    bp = i + 1 - patt->depth;
+                    /* same absolute offset filter as cli_ac_scanbuff() */
+                    if(patt->offdata[0] != CLI_OFF_VERSION && patt->offdata[0] != CLI_OFF_MACRO && !pattN->next_same && (patt->offset_min != CLI_OFF_ANY) && (!patt->sigid || patt->partno == 1)) {
+                        if(patt->offset_min == CLI_OFF_NONE)
+                            continue;
+                        if(patt->offdata[0] == CLI_OFF_ABSOLUTE && (patt->offset_max < offset + bp - patt->prefix_length[2] || patt->offset_min > offset + bp - patt->prefix_length[1]))
+                            continue;
+                    }
+                    if(!ac_findmatch(buffer, bp, offset + bp, length, patt, &matchstart, &matchend))
+                        continue;
+
+                    for(ptN = pattN; ptN; ptN = ptN->next_same) {
+                        pt = ptN->me;
+                        if((pt->type && !(mode & AC_SCAN_FT)) || (!pt->type && !(mode & AC_SCAN_VIR)))
+                            continue;
+                        if(pt->sigid) {
+                            *parts |= (uint64_t) 1 << (pt->sigid & 63);
+                            if(pt->partno == pt->parts)
+                                *final |= (uint64_t) 1 << (pt->sigid & 63);
+                        } else if(!pt->type || !pt->rtype || pt->rtype == ftype) {
+                            hit = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return hit;
+}
+
 static int qcompare_byte(const void *a, const void *b)
 {
     return *(const unsigned char *)a - *(const unsigned char *)b;
@@ -2398,6 +3652,82 @@ inline static int ac_special_altstr(const char *hexpr, uint8_t sigopts, struct c
 }
 
 /* FIXME: clean up the code */
+/* How unlikely a pattern part is to show up in scanned data: bytes of
+ * padding, code alignment and text are the common ones, and repeating the
+ * same byte adds nothing. */
+static unsigned int ac_atom_quality(const uint16_t *part, uint16_t len)
+{
+    unsigned int i, j, q = 0;
+    uint8_t c;
+
+    for(i = 0; i < len; i++) {
+        c = part[i] & 0xff;
+        for(j = 0; j < i; j++)
+            if((part[j] & 0xff) == c)
+                break;
+        if(j < i)
+            continue;
+
+        switch(c) {
+            case 0x00:
+            case 0xff:
+                q += 1;
+                break;
+            case 0x01:
+            case 0x09:
+            case 0x0a:
+            case 0x0d:
+            case 0x20:
+            case 0x90:
+            case 0xcc:
+                q += 6;
+                break;
+            default:
+                q += isalnum(c) ? 10 : 14;
+        }
+    }
+    return q;
+}
+
+/* With a profile the quality is what the byte pairs cost in the sampled
+ * data instead */
+static unsigned int ac_atom_cost(const uint8_t *cost, const uint16_t *part, uint16_t len)
+{
+    unsigned int i, q = 0;
+
+    for(i = 0; i + 1 < len; i++)
+        q += cost[((part[i] & 0xff) << 8) | (part[i + 1] & 0xff)];
+    return q;
+}
+
+/* Position of the static part of ac_maxdepth chars with the best quality,
+ * the earliest one on a tie; 0 if there's none past the start */
+static uint16_t ac_atom_pos(const struct cli_matcher *root, const uint16_t *pattern, uint16_t len)
+{
+    uint16_t i, j, pos = 0;
+    unsigned int q, best = 0;
+
+    for(i = 0; i + root->ac_maxdepth <= len; i++) {
+        for(j = i; j < i + root->ac_maxdepth; j++)
+            if(pattern[j] & CLI_MATCH_WILDCARD)
+                break;
+        if(j < i + root->ac_maxdepth) {
+            i = j;
+            continue;
+        }
+
+        if(root->ac_cost)
+            q = ac_atom_cost(root->ac_cost, &pattern[i], root->ac_maxdepth);
+        else
+            q = ac_atom_quality(&pattern[i], root->ac_maxdepth);
+        if(q > best) {
+            best = q;
+            pos = i;
+        }
+    }
+    return pos;
+}
+
 int cli_ac_addsig(struct cli_matcher *root, const char *virname, const char *hexsig, uint8_t sigopts, uint32_t sigid, uint16_t parts, uint16_t partno, uint16_t rtype, uint16_t type, uint32_t mindist, uint32_t maxdist, const char *offset, const uint32_t *lsigid, unsigned int options)
 {
     struct cli_ac_patt *new;
@@ -2735,44 +4065,52 @@ int cli_ac_addsig(struct cli_matcher *root, const char *virname, const char *hex
             zprefix = 0;
     }
 
-    if(wprefix || zprefix) {
-        pend = new->length[0] - root->ac_mindepth + 1;
-        for(i = 0; i < pend; i++) {
-            for(j = i; j < i + root->ac_maxdepth && j < new->length[0]; j++) {
-                if(new->pattern[j] & CLI_MATCH_WILDCARD) {
-                    break;
-                } else {
-                    if(j - i + 1 >= plen) {
-                        plen = j - i + 1;
-                        ppos = i;
+    /* YARA strings enter the trie at their rarest part, the rest is
+     * matched backwards as a prefix; so do all the patterns when there is
+     * a profile to tell which parts are rare */
+    if((sigopts & ACPATT_OPTION_ATOM) || root->ac_cost)
+        ppos = ac_atom_pos(root, new->pattern, new->length[0]);
+
+    if(ppos || wprefix || zprefix) {
+        if(!ppos) {
+            pend = new->length[0] - root->ac_mindepth + 1;
+            for(i = 0; i < pend; i++) {
+                for(j = i; j < i + root->ac_maxdepth && j < new->length[0]; j++) {
+                    if(new->pattern[j] & CLI_MATCH_WILDCARD) {
+                        break;
+                    } else {
+                        if(j - i + 1 >= plen) {
+                            plen = j - i + 1;
+                            ppos = i;
+                        }
                     }
-                }
 
-                if(new->pattern[ppos] || new->pattern[ppos + 1]) {
-                    if(plen >= root->ac_maxdepth) {
-                        break;
-                    } else if(plen >= root->ac_mindepth && plen > nzplen) {
-                        nzplen = plen;
-                        nzpos = ppos;
+                    if(new->pattern[ppos] || new->pattern[ppos + 1]) {
+                        if(plen >= root->ac_maxdepth) {
+                            break;
+                        } else if(plen >= root->ac_mindepth && plen > nzplen) {
+                            nzplen = plen;
+                            nzpos = ppos;
+                        }
                     }
                 }
-            }
 
-            if(plen >= root->ac_maxdepth && (new->pattern[ppos] || new->pattern[ppos + 1]))
-                break;
-        }
+                if(plen >= root->ac_maxdepth && (new->pattern[ppos] || new->pattern[ppos + 1]))
+                    break;
+            }
 
-        if(!new->pattern[ppos] && !new->pattern[ppos + 1] && nzplen) {
-            plen = nzplen;
-            ppos = nzpos;
-        }
+            if(!new->pattern[ppos] && !new->pattern[ppos + 1] && nzplen) {
+                plen = nzplen;
+                ppos = nzpos;
+            }
 
-        if(plen < root->ac_mindepth) {
-            cli_errmsg("cli_ac_addsig: Can't find a static subpattern of length %u\n", root->ac_mindepth);
-            mpool_ac_free_special(root->mempool, new);
-            mpool_free(root->mempool, new->pattern);
-            mpool_free(root->mempool, new);
-            return CL_EMALFDB;
+            if(plen < root->ac_mindepth) {
+                cli_errmsg("cli_ac_addsig: Can't find a static subpattern of length %u\n", root->ac_mindepth);
+                mpool_ac_free_special(root->mempool, new);
+                mpool_free(root->mempool, new->pattern);
+                mpool_free(root->mempool, new);
+                return CL_EMALFDB;
+            }
         }
 
         new->prefix = new->pattern;
@@ -2820,6 +4158,16 @@ int cli_ac_addsig(struct cli_matcher *root, const char *virname, const char *hex
         return ret;
     }
 
+    /* checked, but kept out of the trie; the lsig keeps the name */
+    if(options & CL_DB_VERIFY_ONLY) {
+        mpool_free(root->mempool, new->prefix ? new->prefix : new->pattern);
+        mpool_ac_free_special(root->mempool, new);
+        if(!new->lsigid[0])
+            mpool_free(root->mempool, new->virname);
+        mpool_free(root->mempool, new);
+        return CL_SUCCESS;
+    }
+
     if((ret = cli_ac_addpatt(root, new))) {
         mpool_free(root->mempool, new->prefix ? new->prefix : new->pattern);
         mpool_free(root->mempool, new->virname);
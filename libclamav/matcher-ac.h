@@ -35,6 +35,7 @@
 /* AC scanning modes */
 #define AC_SCAN_VIR 1
 #define AC_SCAN_FT  2
+#define AC_SCAN_BM  4 /* also match the BM patterns of the root */
 
 /* Pattern options */
 #define ACPATT_OPTION_NOOPTS   0x00
@@ -43,6 +44,7 @@
 #define ACPATT_OPTION_WIDE     0x04
 #define ACPATT_OPTION_ASCII    0x08
 
+#define ACPATT_OPTION_ATOM     0x40 /* trie entry chosen by byte rarity */
 #define ACPATT_OPTION_ONCE     0x80
 
 struct cli_subsig_matches {
@@ -56,17 +58,43 @@ struct cli_lsig_matches {
     struct cli_subsig_matches * matches[1]; /* matches[] is variable length */ 
 };
 
+struct cli_arena;
+struct cli_ac_pooldata;
+struct cli_lsig_op;
+
+/** Match state of a logical signature, allocated when it's first touched */
+struct cli_ac_lsigstate {
+    uint32_t cnt[64];
+    uint32_t suboff_last[64], suboff_first[64];
+    struct cli_lsig_matches *matches;
+    uint8_t yr_match;
+};
+
+/** Open addressed map of signature ids to their match state. ids[] holds
+ * id + 1 (0 is a free slot), order[] the ids in the order they were
+ * added; size is a power of 2 and at most half of it is used. */
+struct cli_ac_idmap {
+    uint32_t *ids, *order;
+    void **vals;
+    uint32_t size, used;
+};
+
 struct cli_ac_data {
-    int32_t ***offmatrix;
+    /** Backing store for the arrays below, NULL for malloc() */
+    struct cli_arena *arena;
+    /** Per-thread pool slot this data was taken from, if any */
+    struct cli_ac_pooldata *pooled;
+    /** Offset matrices of the partial signatures (int32_t **) and states of
+     * the logical ones (struct cli_ac_lsigstate *) touched by the scan;
+     * order[] lists them for the reset and cli_exp_eval() */
+    struct cli_ac_idmap psigmap, lsigmap;
     uint32_t partsigs, lsigs, reloffsigs;
-    uint32_t **lsigcnt;
-    uint32_t **lsigsuboff_last, **lsigsuboff_first;
-    struct cli_lsig_matches **lsig_matches;
-    uint8_t *yr_matches;
     uint32_t *offset;
     uint32_t macro_lastmatch[32];
     /** Hashset for versioninfo matching */
     const struct cli_hashset *vinfo;
+    /** Target the relative offsets are calculated against on first use */
+    struct cli_target_info *info;
     uint32_t min_partno;
 };
 
@@ -85,24 +113,40 @@ struct cli_ac_special {
     } alt;
     uint16_t len[2], num; /* 0=MIN, 1=MAX */
     uint16_t type, negative;
+    /* built by cli_ac_finishtrie(), NULL when the lists are walked instead */
+    uint8_t *bytemap;   /* ALT_CHAR: one bit per byte */
+    uint16_t *first;    /* ALT_STR_FIXED: first alternate by leading byte, 257 entries */
+    uint64_t *bitap;    /* ALT_STR: alternate positions accepting each byte */
+    uint64_t bitap_start, bitap_end;
+    uint8_t bitap_rev;
 };
 
+/* The fields are grouped by use: the ones cli_ac_scanbuff() checks for
+ * every pattern of a final state come first and fit in 40 bytes, then the
+ * ones ac_findmatch() reads and last those only needed after a match. */
 struct cli_ac_patt {
-    uint16_t *pattern, *prefix, length[3], prefix_length[3];
-    uint32_t mindist, maxdist;
+    /* final state screening */
+    uint16_t partno;
+    uint8_t depth;
+    uint8_t generic; /* of the generic root, in a trie built by cli_ac_merge() */
+    uint16_t special, prefix_length[3];
     uint32_t sigid;
-    uint32_t lsigid[3];
+    uint32_t offdata[4], offset_min, offset_max;
+
+    /* matching */
+    uint16_t *pattern, *prefix, length[3], special_pattern;
     uint16_t ch[2];
-    char *virname;
-    void *customdata;
     uint16_t ch_mindist[2];
     uint16_t ch_maxdist[2];
-    uint16_t parts, partno, special, special_pattern;
-    struct cli_ac_special **special_table;
-    uint16_t rtype, type;
-    uint32_t offdata[4], offset_min, offset_max;
     uint32_t boundary;
-    uint8_t depth;
+    struct cli_ac_special **special_table;
+
+    /* match handling */
+    char *virname;
+    void *customdata;
+    uint32_t mindist, maxdist;
+    uint32_t lsigid[3];
+    uint16_t parts, rtype, type;
     uint8_t sigopts;
 };
 
@@ -119,6 +163,18 @@ struct cli_ac_node {
 #define IS_LEAF(node) (!node->trans)
 #define IS_FINAL(node) (!!node->list)
 
+/* Compact trie layout built by cli_ac_buildtrie(): every node that owns a
+ * transition array gets a row of 256 32-bit states in ac_ctrans. A state
+ * is either the next row or, with AC_CSTATE_FINAL set, an index into
+ * ac_cfinal which links back to the (final) pointer node.
+ */
+#define AC_CSTATE_FINAL 0x80000000
+
+struct cli_ac_cfinal {
+    const struct cli_ac_node *node;
+    uint32_t row;
+};
+
 struct cli_ac_result {
     const char *virname;
     void *customdata;
@@ -130,15 +186,77 @@ struct cli_ac_result {
 
 int cli_ac_addpatt(struct cli_matcher *root, struct cli_ac_patt *pattern);
 int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs, uint32_t reloffsigs, uint8_t tracklen);
+int cli_ac_initdata_cached(struct cli_ac_data *data, cli_ctx *ctx, const struct cli_matcher *root);
+int cli_ac_initdata_arena(struct cli_ac_data *data, struct cli_arena *arena, uint32_t partsigs, uint32_t lsigs, uint32_t reloffsigs, uint8_t tracklen);
 int lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t lsigid1, uint32_t lsigid2, uint32_t realoff, int partial);
+struct cli_ac_lsigstate *cli_ac_lsigstate_add(struct cli_ac_data *data, uint32_t lsigid);
 int cli_ac_chkmacro(struct cli_matcher *root, struct cli_ac_data *data, unsigned lsigid1);
-int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only);
+int cli_ac_chklsig(const char *expr, const char *end, const uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only);
+int cli_ac_runlsig(const struct cli_lsig_op *ops, unsigned int nops, const uint32_t *lsigcnt);
 void cli_ac_freedata(struct cli_ac_data *data);
+
+/* The rows of a logical signature nothing has touched yet */
+extern const uint32_t cli_ac_nocnt[64];
+extern const uint32_t cli_ac_nooff[64];
+
+static inline void *cli_ac_idmap_get(const struct cli_ac_idmap *map, uint32_t id)
+{
+    uint32_t i;
+
+    if(!map->used)
+        return NULL;
+    for(i = (id * 2654435761U) & (map->size - 1); map->ids[i]; i = (i + 1) & (map->size - 1))
+        if(map->ids[i] == id + 1)
+            return map->vals[i];
+    return NULL;
+}
+
+static inline struct cli_ac_lsigstate *cli_ac_lsigstate(const struct cli_ac_data *data, uint32_t lsigid)
+{
+    return (struct cli_ac_lsigstate *) cli_ac_idmap_get(&data->lsigmap, lsigid);
+}
+
+static inline const uint32_t *cli_ac_lsigcnt(const struct cli_ac_data *data, uint32_t lsigid)
+{
+    const struct cli_ac_lsigstate *st = cli_ac_lsigstate(data, lsigid);
+
+    return st ? st->cnt : cli_ac_nocnt;
+}
+
+static inline const uint32_t *cli_ac_lsigsuboff_first(const struct cli_ac_data *data, uint32_t lsigid)
+{
+    const struct cli_ac_lsigstate *st = cli_ac_lsigstate(data, lsigid);
+
+    return st ? st->suboff_first : cli_ac_nooff;
+}
+
+static inline struct cli_lsig_matches *cli_ac_lsigmatches(const struct cli_ac_data *data, uint32_t lsigid)
+{
+    const struct cli_ac_lsigstate *st = cli_ac_lsigstate(data, lsigid);
+
+    return st ? st->matches : NULL;
+}
 int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx);
+int cli_ac_scanbuff_merged(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *troot, struct cli_ac_data *tdata, const struct cli_matcher *groot, struct cli_ac_data *gdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx);
+int cli_ac_probebuff(const unsigned char *buffer, uint32_t length, const struct cli_matcher *root, uint32_t offset, unsigned int mode, cli_file_t ftype, uint64_t *parts, uint64_t *final);
 int cli_ac_buildtrie(struct cli_matcher *root);
+
+/* cli_ac_buildtrie() in two steps: cli_ac_maketrie() doesn't touch the
+ * memory pool, so different roots can be built at the same time, and
+ * cli_ac_finishtrie() releases the pointer transitions */
+int cli_ac_maketrie(struct cli_matcher *root, unsigned int threads);
+void cli_ac_finishtrie(struct cli_matcher *root);
+int cli_ac_merge(struct cli_matcher *root, struct cli_matcher *groot, unsigned int threads);
+int cli_ac_buildlsigs(struct cli_matcher *root);
 int cli_ac_init(struct cli_matcher *root, uint8_t mindepth, uint8_t maxdepth, uint8_t dconf_prefiltering);
-int cli_ac_caloff(const struct cli_matcher *root, struct cli_ac_data *data, const struct cli_target_info *info);
+#define CLI_AC_PROFILE_MAGIC "ClamAV-AC-Profile:1\n"
+int cli_ac_profile_load(struct cl_engine *engine);
+int cli_ac_profile_write(const char *path, const uint64_t *counts);
+int cli_ac_caloff(const struct cli_matcher *root, struct cli_ac_data *data, struct cli_target_info *info);
 void cli_ac_free(struct cli_matcher *root);
+void cli_ac_free_merged(struct cli_matcher *root);
+void cli_ac_memstats(const struct cli_matcher *root, size_t *nodes, size_t *trans, size_t *patterns);
+int cli_ac_walknames(struct cli_matcher *root, int (*cb)(void *arg, const char **slot, const char *virname), void *arg);
 int cli_ac_addsig(struct cli_matcher *root, const char *virname, const char *hexsig, uint8_t sigopts, uint32_t sigid, uint16_t parts, uint16_t partno, uint16_t rtype, uint16_t type, uint32_t mindist, uint32_t maxdist, const char *offset, const uint32_t *lsigid, unsigned int options);
 
 #endif
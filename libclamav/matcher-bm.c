@@ -37,15 +37,36 @@
 
 #include "mpool.h"
 
-#define BM_MIN_LENGTH	3
-#define BM_BLOCK_SIZE	3
-#define HASH(a,b,c) (211 * a + 37 * b + c)
+/* Looks for a pattern with the same bytes, offset and boundary, wherever
+ * the load balancing in cli_bm_addpatt() has split it; returns the link to
+ * it in its bm_suffix chain */
+static struct cli_bm_patt **bm_findsame(struct cli_matcher *root, const struct cli_bm_patt *pattern)
+{
+	const unsigned char *pt = pattern->pattern;
+	struct cli_bm_patt **link, *p;
+	uint16_t i;
+
+    for(i = 0; i < pattern->length - BM_BLOCK_SIZE + 1; i++) {
+	link = &root->bm_suffix[BM_HASH(pt[i], pt[i + 1], pt[i + 2])];
+	for(p = *link; p; link = &p->next, p = p->next) {
+	    if(p->prefix_length != i || p->pattern0 != pt[i] || p->length + i != pattern->length)
+		continue;
+	    if(p->boundary != pattern->boundary || memcmp(p->offdata, pattern->offdata, sizeof(p->offdata)))
+		continue;
+	    if(pattern->offdata[0] == CLI_OFF_ABSOLUTE && (p->offset_min != pattern->offset_min || p->offset_max != pattern->offset_max))
+		continue;
+	    if(!memcmp(p->prefix ? p->prefix : p->pattern, pt, pattern->length))
+		return link;
+	}
+    }
+    return NULL;
+}
 
 int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const char *offset)
 {
 	uint16_t idx, i;
 	const unsigned char *pt = pattern->pattern;
-	struct cli_bm_patt *prev, *next = NULL;
+	struct cli_bm_patt *prev, *next = NULL, *same, **link;
 	int ret;
 
 
@@ -58,6 +79,29 @@ int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const
 	cli_errmsg("cli_bm_addpatt: Can't calculate offset for signature %s\n", pattern->virname);
 	return ret;
     }
+
+    /* A duplicate takes the place of the pattern already in the chain and
+     * keeps it in its next_same list, so the bytes are compared once for all
+     * of them and the newest is still reported first */
+    if((link = bm_findsame(root, pattern))) {
+	same = *link;
+	if(same->prefix_length) {
+	    pattern->prefix = pattern->pattern;
+	    pattern->prefix_length = same->prefix_length;
+	    pattern->pattern = &pattern->pattern[same->prefix_length];
+	    pattern->length -= same->prefix_length;
+	}
+	pattern->pattern0 = same->pattern0;
+	pattern->cnt = same->cnt;
+	pattern->offset_min = same->offset_min;
+	pattern->offset_max = same->offset_max;
+	pattern->next = same->next;
+	pattern->next_same = same;
+	same->next = NULL;
+	*link = pattern;
+	return CL_SUCCESS;
+    }
+
     if(pattern->offdata[0] != CLI_OFF_ANY) {
 	if(pattern->offdata[0] == CLI_OFF_ABSOLUTE)
 	    root->bm_absoff_num++;
@@ -81,7 +125,7 @@ int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const
 #if BM_MIN_LENGTH == BM_BLOCK_SIZE
     /* try to load balance bm_suffix (at the cost of bm_shift) */
     for(i = 0; i < pattern->length - BM_BLOCK_SIZE + 1; i++) {
-	idx = HASH(pt[i], pt[i + 1], pt[i + 2]);
+	idx = BM_HASH(pt[i], pt[i + 1], pt[i + 2]);
 	if(!root->bm_suffix[idx]) {
 	    if(i) {
 		pattern->prefix = pattern->pattern;
@@ -96,7 +140,7 @@ int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const
 #endif
 
     for(i = 0; i <= BM_MIN_LENGTH - BM_BLOCK_SIZE; i++) {
-	idx = HASH(pt[i], pt[i + 1], pt[i + 2]);
+	idx = BM_HASH(pt[i], pt[i + 1], pt[i + 2]);
 	root->bm_shift[idx] = MIN(root->bm_shift[idx], BM_MIN_LENGTH - BM_BLOCK_SIZE - i);
     }
 
@@ -137,7 +181,7 @@ int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const
 
 int cli_bm_init(struct cli_matcher *root)
 {
-	uint16_t i, size = HASH(255, 255, 255) + 1;
+	uint16_t i, size = BM_HASH(255, 255, 255) + 1;
 #ifdef USE_MPOOL
     assert (root->mempool && "mempool must be initialized");
 #endif
@@ -156,7 +200,7 @@ int cli_bm_init(struct cli_matcher *root)
     return CL_SUCCESS;
 }
 
-int cli_bm_initoff(const struct cli_matcher *root, struct cli_bm_off *data, const struct cli_target_info *info)
+int cli_bm_initoff(const struct cli_matcher *root, struct cli_bm_off *data, struct cli_target_info *info)
 {
 	int ret;
 	unsigned int i;
@@ -217,8 +261,8 @@ void cli_bm_freeoff(struct cli_bm_off *data)
 
 void cli_bm_free(struct cli_matcher *root)
 {
-	struct cli_bm_patt *patt, *prev;
-	uint16_t i, size = HASH(255, 255, 255) + 1;
+	struct cli_bm_patt *chain, *patt, *prev;
+	uint16_t i, size = BM_HASH(255, 255, 255) + 1;
 
 
     if(root->bm_shift)
@@ -229,30 +273,202 @@ void cli_bm_free(struct cli_matcher *root)
 
     if(root->bm_suffix) {
 	for(i = 0; i < size; i++) {
-	    patt = root->bm_suffix[i];
-	    while(patt) {
-		prev = patt;
-		patt = patt->next;
-		if(prev->prefix)
-		    mpool_free(root->mempool, prev->prefix);
-		else
-		    mpool_free(root->mempool, prev->pattern);
-		if(prev->virname)
-		    mpool_free(root->mempool, prev->virname);
-		mpool_free(root->mempool, prev);
+	    chain = root->bm_suffix[i];
+	    while(chain) {
+		patt = chain;
+		chain = chain->next;
+		while(patt) {
+		    prev = patt;
+		    patt = patt->next_same;
+		    if(prev->prefix)
+			mpool_free(root->mempool, prev->prefix);
+		    else
+			mpool_free(root->mempool, prev->pattern);
+		    if(prev->virname)
+			mpool_free(root->mempool, prev->virname);
+		    mpool_free(root->mempool, prev);
+		}
 	    }
 	}
 	mpool_free(root->mempool, root->bm_suffix);
     }
 }
 
-int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, const struct cli_bm_patt **patt, const struct cli_matcher *root, uint32_t offset, const struct cli_target_info *info, struct cli_bm_off *offdata, cli_ctx *ctx)
+/* Calls cb for the virus name of each pattern until it returns non zero */
+int cli_bm_walknames(struct cli_matcher *root, int (*cb)(void *arg, const char **slot, const char *virname), void *arg)
 {
-	uint32_t i, j, off, off_min, off_max;
-	uint8_t found, pchain, shift;
-	uint16_t idx, idxchk;
-	struct cli_bm_patt *p;
+	struct cli_bm_patt *chain, *patt;
+	uint16_t i, size = BM_HASH(255, 255, 255) + 1;
+	int ret;
+
+
+    if(!root->bm_suffix)
+	return 0;
+
+    for(i = 0; i < size; i++)
+	for(chain = root->bm_suffix[i]; chain; chain = chain->next)
+	    for(patt = chain; patt; patt = patt->next_same)
+		if(patt->virname && (ret = cb(arg, (const char **)&patt->virname, patt->virname)))
+		    return ret;
+    return 0;
+}
+
+size_t cli_bm_memstats(const struct cli_matcher *root)
+{
+	const struct cli_bm_patt *chain, *patt;
+	uint16_t i, size = BM_HASH(255, 255, 255) + 1;
+	size_t bytes = 0;
+
+
+    if(!root->bm_shift)
+	return 0;
+
+    bytes += size * (sizeof(*root->bm_shift) + sizeof(*root->bm_suffix));
+    bytes += root->bm_patterns * sizeof(*root->bm_pattab);
+    bytes += root->soff_len * sizeof(*root->soff);
+    for(i = 0; i < size; i++)
+	for(chain = root->bm_suffix[i]; chain; chain = chain->next)
+	    for(patt = chain; patt; patt = patt->next_same) {
+		bytes += sizeof(*patt) + patt->length + patt->prefix_length;
+		if(patt->virname)
+		    bytes += strlen(patt->virname) + 1;
+	    }
+    return bytes;
+}
+
+/* Walks the chain of the patterns whose block starts at buffer[i]; returns
+ * CL_VIRUS when the scan should stop on a match */
+static inline int bm_chain(const unsigned char *buffer, uint32_t length, uint32_t i, struct cli_bm_patt *p, unsigned char prefix, const char **virname, const struct cli_bm_patt **patt, const struct cli_matcher *root, uint32_t offset, struct cli_target_info *info, struct cli_bm_off *offdata, cli_ctx *ctx, int *viruses_found)
+{
+	uint32_t j, off, off_min, off_max;
+	uint8_t found, pchain;
+	uint16_t idxchk;
 	const unsigned char *bp, *pt;
+	const struct cli_bm_patt *q;
+	int ret;
+
+    pchain = 0;
+    while(p) {
+	if(p->pattern0 != prefix) {
+	    if(pchain)
+		break;
+	    p = p->next;
+	    continue;
+	} else pchain = 1;
+
+	off = i - BM_MIN_LENGTH + BM_BLOCK_SIZE;
+	bp = buffer + off;
+
+	if((off + p->length > length) || (p->prefix_length > off)) {
+	    p = p->next;
+	    continue;
+	}
+
+	if(offdata) {
+	    if(p->offdata[0] == CLI_OFF_ABSOLUTE) {
+		if(p->offset_min != offset + off - p->prefix_length) {
+		    p = p->next;
+		    continue;
+		}
+	    } else if((offdata->offset[p->offset_min] == CLI_OFF_NONE) || (offdata->offset[p->offset_min] != offset + off - p->prefix_length)) {
+		p = p->next;
+		continue;
+	    }
+	}
+
+	idxchk = MIN(p->length, length - off) - 1;
+	if(idxchk) {
+	    if((bp[idxchk] != p->pattern[idxchk]) ||  (bp[idxchk / 2] != p->pattern[idxchk / 2])) {
+		p = p->next;
+		continue;
+	    }
+	}
+
+	if(p->prefix_length) {
+	    off -= p->prefix_length;
+	    bp -= p->prefix_length;
+	    pt = p->prefix;
+	} else {
+	    pt = p->pattern;
+	}
+
+	found = 1;
+	for(j = 0; j < p->length + p->prefix_length && off < length; j++, off++) {
+	    if(bp[j] != pt[j]) {
+		found = 0;
+		break;
+	    }
+	}
+
+	if(found && (p->boundary & BM_BOUNDARY_EOL)) {
+	    if(off != length) {
+		p = p->next;
+		continue;
+	    }
+	}
+
+	if(found && p->length + p->prefix_length == j) {
+	    if(!offdata && (p->offset_min != CLI_OFF_ANY)) {
+		if(p->offdata[0] != CLI_OFF_ABSOLUTE) {
+		    if(!info) {
+			p = p->next;
+			continue;
+		    }
+		    ret = cli_caloff(NULL, info, root->type, p->offdata, &off_min, &off_max);
+		    if(ret != CL_SUCCESS) {
+			cli_errmsg("cli_bm_scanbuff: Can't calculate relative offset in signature for %s\n", p->virname);
+			return ret;
+		    }
+		} else {
+		    off_min = p->offset_min;
+		    off_max = p->offset_max;
+		}
+		off = offset + i - p->prefix_length - BM_MIN_LENGTH + BM_BLOCK_SIZE;
+		if(off_min == CLI_OFF_NONE || off_max < off || off_min > off) {
+		    p = p->next;
+		    continue;
+		}
+	    }
+	    for(q = p; q; q = q->next_same) {
+		if(q->virname == cli_virname_deleted)
+		    continue;
+		if(virname) {
+		    *virname = q->virname;
+		    if(ctx != NULL && SCAN_ALL) {
+			cli_append_virus(ctx, *virname);
+			//*viroffset = offset + i + j - BM_MIN_LENGTH + BM_BLOCK_SIZE;
+		    }
+		}
+		if(patt)
+		    *patt = q;
+
+		*viruses_found = 1;
+
+		if(ctx != NULL && !SCAN_ALL)
+		    return CL_VIRUS;
+	    }
+	}
+	p = p->next;
+    }
+
+    return CL_CLEAN;
+}
+
+/* Checks the patterns starting at buffer[i] for the scan of the BM patterns
+ * fused with the AC one, see cli_ac_scanbuff() */
+int cli_bm_scanpos(const unsigned char *buffer, uint32_t length, uint32_t i, const char **virname, const struct cli_matcher *root, uint32_t offset, struct cli_target_info *info, cli_ctx *ctx, int *viruses_found)
+{
+    if(i + BM_BLOCK_SIZE > length)
+	return CL_CLEAN;
+    return bm_chain(buffer, length, i, root->bm_suffix[BM_HASH(buffer[i], buffer[i + 1], buffer[i + 2])], buffer[i], virname, NULL, root, offset, info, NULL, ctx, viruses_found);
+}
+
+int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, const struct cli_bm_patt **patt, const struct cli_matcher *root, uint32_t offset, struct cli_target_info *info, struct cli_bm_off *offdata, cli_ctx *ctx)
+{
+	uint32_t i, off;
+	uint8_t shift;
+	uint16_t idx;
+	struct cli_bm_patt *p;
 	unsigned char prefix;
         int ret, viruses_found = 0;
 
@@ -276,7 +492,7 @@ int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 	i += offdata->offtab[offdata->pos] - offset;
     }
     for(; i < length - BM_BLOCK_SIZE + 1; ) {
-	idx = HASH(buffer[i], buffer[i + 1], buffer[i + 2]);
+	idx = BM_HASH(buffer[i], buffer[i + 1], buffer[i + 2]);
 	shift = root->bm_shift[idx];
 
 	if(shift == 0) {
@@ -297,105 +513,8 @@ int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 		}
 		continue;
 	    }
-	    pchain = 0;
-	    while(p) {
-		if(p->pattern0 != prefix) {
-		    if(pchain)
-			break;
-		    p = p->next;
-		    continue;
-		} else pchain = 1;
-
-		off = i - BM_MIN_LENGTH + BM_BLOCK_SIZE;
-		bp = buffer + off;
-
-		if((off + p->length > length) || (p->prefix_length > off)) {
-		    p = p->next;
-		    continue;
-		}
-
-		if(offdata) {
-		    if(p->offdata[0] == CLI_OFF_ABSOLUTE) {
-			if(p->offset_min != offset + off - p->prefix_length) {
-			    p = p->next;
-			    continue;
-			}
-		    } else if((offdata->offset[p->offset_min] == CLI_OFF_NONE) || (offdata->offset[p->offset_min] != offset + off - p->prefix_length)) {
-			p = p->next;
-			continue;
-		    }
-		}
-
-		idxchk = MIN(p->length, length - off) - 1;
-		if(idxchk) {
-		    if((bp[idxchk] != p->pattern[idxchk]) ||  (bp[idxchk / 2] != p->pattern[idxchk / 2])) {
-			p = p->next;
-			continue;
-		    }
-		}
-
-		if(p->prefix_length) {
-		    off -= p->prefix_length;
-		    bp -= p->prefix_length;
-		    pt = p->prefix;
-		} else {
-		    pt = p->pattern;
-		}
-
-		found = 1;
-		for(j = 0; j < p->length + p->prefix_length && off < length; j++, off++) {
-		    if(bp[j] != pt[j]) {
-			found = 0;
-			break;
-		    }
-		}
-
-		if(found && (p->boundary & BM_BOUNDARY_EOL)) {
-		    if(off != length) {
-			p = p->next;
-			continue;
-		    }
-		}
-
-		if(found && p->length + p->prefix_length == j) {
-		    if(!offdata && (p->offset_min != CLI_OFF_ANY)) {
-			if(p->offdata[0] != CLI_OFF_ABSOLUTE) {
-			    if(!info) {
-				p = p->next;
-				continue;
-			    }
-			    ret = cli_caloff(NULL, info, root->type, p->offdata, &off_min, &off_max);
-			    if(ret != CL_SUCCESS) {
-				cli_errmsg("cli_bm_scanbuff: Can't calculate relative offset in signature for %s\n", p->virname);
-				return ret;
-			    }
-			} else {
-			    off_min = p->offset_min;
-			    off_max = p->offset_max;
-			}
-			off = offset + i - p->prefix_length - BM_MIN_LENGTH + BM_BLOCK_SIZE;
-			if(off_min == CLI_OFF_NONE || off_max < off || off_min > off) {
-			    p = p->next;
-			    continue;
-			}
-		    }
-		    if(virname) {
-			*virname = p->virname;
-			if(ctx != NULL && SCAN_ALL) {
-			    cli_append_virus(ctx, *virname);
-			    //*viroffset = offset + i + j - BM_MIN_LENGTH + BM_BLOCK_SIZE;
-			}
-		    }
-		    if(patt)
-			*patt = p;
-
-		    viruses_found = 1;
-
-		    if(ctx != NULL && !SCAN_ALL)
-			return CL_VIRUS;
-		}
-		p = p->next;
-	    }
+	    if((ret = bm_chain(buffer, length, i, p, prefix, virname, patt, root, offset, info, offdata, ctx, &viruses_found)) != CL_CLEAN)
+		return ret;
 	    shift = 1;
 	}
 
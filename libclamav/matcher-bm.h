@@ -29,12 +29,15 @@
 #include "others.h"
 
 #define BM_BOUNDARY_EOL	1
+#define BM_MIN_LENGTH	3
+#define BM_BLOCK_SIZE	3
+#define BM_HASH(a,b,c) (211 * a + 37 * b + c)
 
 struct cli_bm_patt {
     unsigned char *pattern, *prefix;
     char *virname;
     uint32_t offdata[4], offset_min, offset_max;
-    struct cli_bm_patt *next;
+    struct cli_bm_patt *next, *next_same;
     uint16_t length, prefix_length;
     uint16_t cnt;
     unsigned char pattern0;
@@ -47,9 +50,12 @@ struct cli_bm_off {
 
 int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const char *offset);
 int cli_bm_init(struct cli_matcher *root);
-int cli_bm_initoff(const struct cli_matcher *root, struct cli_bm_off *data, const struct cli_target_info *info);
+int cli_bm_initoff(const struct cli_matcher *root, struct cli_bm_off *data, struct cli_target_info *info);
 void cli_bm_freeoff(struct cli_bm_off *data);
-int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, const struct cli_bm_patt **patt, const struct cli_matcher *root, uint32_t offset, const struct cli_target_info *info, struct cli_bm_off *offdata, cli_ctx *ctx);
+int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, const struct cli_bm_patt **patt, const struct cli_matcher *root, uint32_t offset, struct cli_target_info *info, struct cli_bm_off *offdata, cli_ctx *ctx);
+int cli_bm_scanpos(const unsigned char *buffer, uint32_t length, uint32_t i, const char **virname, const struct cli_matcher *root, uint32_t offset, struct cli_target_info *info, cli_ctx *ctx, int *viruses_found);
 void cli_bm_free(struct cli_matcher *root);
+size_t cli_bm_memstats(const struct cli_matcher *root);
+int cli_bm_walknames(struct cli_matcher *root, int (*cb)(void *arg, const char **slot, const char *virname), void *arg);
 
 #endif
@@ -19,24 +19,36 @@
  *  MA 02110-1301, USA.
  */
 
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
 #include <string.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
 
 #include "matcher.h"
 #include "others.h"
 #include "str.h"
+#include "cache.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
-int hm_addhash_str(struct cli_matcher *root, const char *strhash, uint32_t size, const char *virusname) {
+
+static int hm_parsehash_str(const char *strhash, uint32_t size, char *binhash, enum CLI_HASH_TYPE *ptype) {
     enum CLI_HASH_TYPE type;
-    char binhash[CLI_HASHLEN_MAX];
     int hlen;
 
-    if(!root || !strhash) {
-	cli_errmsg("hm_addhash_str: NULL root or hash\n");
-	return CL_ENULLARG;
-    }
-
     /* size 0 here is now a wildcard size match */
     if(size == (uint32_t)-1) {
 	cli_errmsg("hm_addhash_str: null or invalid size (%u)\n", size);
@@ -63,9 +75,39 @@ int hm_addhash_str(struct cli_matcher *root, const char *strhash, uint32_t size,
 	return CL_EARG;
     }
 
+    *ptype = type;
+    return CL_SUCCESS;
+}
+
+int hm_addhash_str(struct cli_matcher *root, const char *strhash, uint32_t size, const char *virusname) {
+    enum CLI_HASH_TYPE type;
+    char binhash[CLI_HASHLEN_MAX];
+    int ret;
+
+    if(!root || !strhash) {
+	cli_errmsg("hm_addhash_str: NULL root or hash\n");
+	return CL_ENULLARG;
+    }
+
+    if((ret = hm_parsehash_str(strhash, size, binhash, &type)))
+	return ret;
+
     return hm_addhash_bin(root, binhash, type, size, virusname);
 }
 
+/* the checks of hm_addhash_str(), for CL_DB_VERIFY_ONLY */
+int hm_checkhash_str(const char *strhash, uint32_t size) {
+    enum CLI_HASH_TYPE type;
+    char binhash[CLI_HASHLEN_MAX];
+
+    if(!strhash) {
+	cli_errmsg("hm_checkhash_str: NULL hash\n");
+	return CL_ENULLARG;
+    }
+
+    return hm_parsehash_str(strhash, size, binhash, &type);
+}
+
 const unsigned int hashlen[] = {
     CLI_HASHLEN_MD5,
     CLI_HASHLEN_SHA1,
@@ -188,6 +230,112 @@ static void hm_sort(struct cli_sz_hash *szh, size_t l, size_t r, unsigned int ke
     hm_sort(szh, r1, r, keylen);
 }
 
+/* Sets with at least this many hashes get a directory */
+#define HM_DIR_MIN 32
+
+/* The leading bits of a hash, ascending in the hm_cmp() order */
+static inline uint32_t hm_dirkey(const uint8_t *hash, uint32_t bits) {
+    uint32_t k;
+
+    memcpy(&k, hash, sizeof(k));
+#if WORDS_BIGENDIAN == 0
+    /* the first word sorts in descending order */
+    k = ~k;
+#endif
+    return k >> (32 - bits);
+}
+
+/* Indexes the sorted hashes on their leading bits, about four per slot, so
+ * that a lookup only compares the few hashes sharing the slot of the digest */
+static void hm_mkdir(struct cli_sz_hash *szh, unsigned int keylen, mpool_t *mempool) {
+    uint32_t bits = 1, b, i = 0;
+
+    if(szh->dir) {
+	mpool_free(mempool, szh->dir);
+	szh->dir = NULL;
+    }
+    if(szh->items < HM_DIR_MIN)
+	return;
+
+    while(bits < 24 && (szh->items >> (bits + 2)))
+	bits++;
+    if(!(szh->dir = mpool_malloc(mempool, ((1 << bits) + 1) * sizeof(uint32_t))))
+	return; /* the binary search still works */
+    for(b = 0; b < (1U << bits); b++) {
+	while(i < szh->items && hm_dirkey(&szh->hash_array[keylen * i], bits) < b)
+	    i++;
+	szh->dir[b] = i;
+    }
+    szh->dir[1 << bits] = szh->items;
+    szh->dirbits = bits;
+}
+
+/* Types with fewer hashes are looked up directly */
+#define HM_FILTER_MIN 64
+
+/* One block per digest, three bits set in it */
+static inline const uint64_t *hm_filter_block(const struct cli_hash_filter *f, const uint8_t *hash, uint32_t *bits) {
+    uint32_t w;
+
+    memcpy(&w, hash + 4, sizeof(w));
+    memcpy(bits, hash + 8, sizeof(*bits));
+    return &f->blocks[(size_t)(w & f->mask) * 8];
+}
+
+static inline int hm_filter_test(const struct cli_hash_filter *f, const uint8_t *hash) {
+    const uint64_t *blk;
+    uint32_t bits, i;
+
+    if(!f->blocks)
+	return 1;
+    blk = hm_filter_block(f, hash, &bits);
+    for(i = 0; i < 3; i++, bits >>= 9)
+	if(!(blk[(bits & 511) >> 6] & ((uint64_t)1 << (bits & 63))))
+	    return 0;
+    return 1;
+}
+
+static void hm_filter_add(struct cli_hash_filter *f, const struct cli_sz_hash *szh, unsigned int keylen) {
+    uint64_t *blk;
+    uint32_t bits, i, j;
+
+    for(i = 0; i < szh->items; i++) {
+	blk = (uint64_t *)hm_filter_block(f, &szh->hash_array[keylen * i], &bits);
+	for(j = 0; j < 3; j++, bits >>= 9)
+	    blk[(bits & 511) >> 6] |= (uint64_t)1 << (bits & 63);
+    }
+}
+
+/* Sized to 8-16 bits per hash, i.e. a few percent of false positives */
+static void hm_filter_build(struct cli_matcher *root, enum CLI_HASH_TYPE type) {
+    struct cli_hash_filter *f = &root->hm.filter[type];
+    struct cli_htu32 *ht = &root->hm.sizehashes[type];
+    const struct cli_htu32_element *item = NULL;
+    uint64_t items = root->hwild.hashes[type].items;
+    uint32_t nblocks = 1;
+
+    if(f->blocks) {
+	mpool_free(root->mempool, f->blocks);
+	f->blocks = NULL;
+    }
+    if(ht->capacity)
+	while((item = cli_htu32_next(ht, item)))
+	    items += ((struct cli_sz_hash *)item->data.as_ptr)->items;
+    if(items < HM_FILTER_MIN)
+	return;
+
+    while(nblocks < (1U << 31) && (uint64_t)nblocks * 512 < items * 8)
+	nblocks <<= 1;
+    if(!(f->blocks = mpool_calloc(root->mempool, (size_t)nblocks * 8, sizeof(uint64_t))))
+	return;
+    f->mask = nblocks - 1;
+
+    if(ht->capacity)
+	while((item = cli_htu32_next(ht, item)))
+	    hm_filter_add(f, (struct cli_sz_hash *)item->data.as_ptr, hashlen[type]);
+    hm_filter_add(f, &root->hwild.hashes[type], hashlen[type]);
+}
+
 /* flush both size-specific and agnostic hash sets */
 void hm_flush(struct cli_matcher *root) {
     enum CLI_HASH_TYPE type;
@@ -211,6 +359,7 @@ void hm_flush(struct cli_matcher *root) {
 
 	    if(szh->items > 1)
 		hm_sort(szh, 0, szh->items, keylen);
+	    hm_mkdir(szh, keylen, root->mempool);
 	}
     }
 
@@ -220,20 +369,97 @@ void hm_flush(struct cli_matcher *root) {
 
 	if(szh->items > 1)
 	    hm_sort(szh, 0, szh->items, keylen);
+	hm_mkdir(szh, keylen, root->mempool);
     }
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+	hm_filter_build(root, type);
 }
 
 
+/* locates the items of the given size in a segment */
+static int hm_seg_find(const struct cli_hm_seg *seg, uint32_t size, uint32_t *first, uint32_t *count) {
+    uint32_t l = 0, r = seg->nsizes;
+
+    while(l < r) {
+	uint32_t c = l + (r - l) / 2;
+
+	if(seg->sizes[2 * c] < size)
+	    l = c + 1;
+	else if(seg->sizes[2 * c] > size)
+	    r = c;
+	else {
+	    *first = seg->sizes[2 * c + 1];
+	    *count = (c + 1 < seg->nsizes ? seg->sizes[2 * c + 3] : seg->items) - *first;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static int hm_seg_have(const struct cli_matcher *root, enum CLI_HASH_TYPE type, uint32_t size) {
+    uint32_t first, count;
+    unsigned int i;
+
+    for(i = 0; i < root->hmsegs; i++)
+	if(root->hmseg[i].type == type && hm_seg_find(&root->hmseg[i], size, &first, &count))
+	    return 1;
+    return 0;
+}
+
+static int hm_seg_scan(const unsigned char *digest, uint32_t size, const char **virname, const struct cli_matcher *root, enum CLI_HASH_TYPE type) {
+    const unsigned int keylen = hashlen[type];
+    uint32_t first, count;
+    unsigned int i;
+
+    for(i = 0; i < root->hmsegs; i++) {
+	const struct cli_hm_seg *seg = &root->hmseg[i];
+	uint32_t l, r;
+
+	if(seg->type != type || !hm_seg_find(seg, size, &first, &count))
+	    continue;
+
+	l = first;
+	r = first + count;
+	while(l < r) {
+	    uint32_t c = l + (r - l) / 2;
+	    int res = memcmp(digest, &seg->hashes[(size_t)keylen * c], keylen);
+
+	    if(res < 0)
+		r = c;
+	    else if(res > 0)
+		l = c + 1;
+	    else {
+		if(virname)
+		    *virname = seg->strings + seg->names[c];
+		return CL_VIRUS;
+	    }
+	}
+    }
+    return CL_CLEAN;
+}
+
 int cli_hm_have_size(const struct cli_matcher *root, enum CLI_HASH_TYPE type, uint32_t size) {
-    return (size && size != 0xffffffff && root && root->hm.sizehashes[type].capacity && cli_htu32_find(&root->hm.sizehashes[type], size));
+    if(!size || size == 0xffffffff || !root)
+	return 0;
+    return ((root->hm.sizehashes[type].capacity && cli_htu32_find(&root->hm.sizehashes[type], size)) || hm_seg_have(root, type, size));
 }
 
 int cli_hm_have_wild(const struct cli_matcher *root, enum CLI_HASH_TYPE type) {
-    return (root && root->hwild.hashes[type].items);
+    return (root && (root->hwild.hashes[type].items || hm_seg_have(root, type, 0)));
 }
 
 int cli_hm_have_any(const struct cli_matcher *root, enum CLI_HASH_TYPE type) {
-    return (root && (root->hwild.hashes[type].items || root->hm.sizehashes[type].capacity));
+    unsigned int i;
+
+    if(!root)
+	return 0;
+    if(root->hwild.hashes[type].items || root->hm.sizehashes[type].capacity)
+	return 1;
+    for(i = 0; i < root->hmsegs; i++)
+	if(root->hmseg[i].type == type && root->hmseg[i].items)
+	    return 1;
+    return 0;
 }
 
 /* cli_hm_scan will scan only size-specific hashes, if any */
@@ -246,6 +472,21 @@ static int hm_scan(const unsigned char *digest, const char **virname, const stru
 
     keylen = hashlen[type];
 
+    if(szh->dir) {
+	uint32_t b = hm_dirkey(digest, szh->dirbits);
+
+	for(l = szh->dir[b]; l < szh->dir[b + 1]; l++) {
+	    if(memcmp(digest, &szh->hash_array[keylen * l], keylen))
+		continue;
+	    if(szh->virusnames[l] == cli_virname_deleted)
+		return CL_CLEAN;
+	    if(virname)
+		*virname = szh->virusnames[l];
+	    return CL_VIRUS;
+	}
+	return CL_CLEAN;
+    }
+
     l = 0;
     r = szh->items - 1;
     while(l <= r) {
@@ -259,6 +500,8 @@ static int hm_scan(const unsigned char *digest, const char **virname, const stru
 	} else if(res > 0)
 	    l = c + 1;
 	else {
+	    if(szh->virusnames[c] == cli_virname_deleted)
+		return CL_CLEAN;
 	    if(virname)
 		*virname = szh->virusnames[c];
 	    return CL_VIRUS;
@@ -272,24 +515,113 @@ int cli_hm_scan(const unsigned char *digest, uint32_t size, const char **virname
     const struct cli_htu32_element *item;
     struct cli_sz_hash *szh;
 
-    if(!digest || !size || size == 0xffffffff || !root || !root->hm.sizehashes[type].capacity)
-	return CL_CLEAN;
-
-    item = cli_htu32_find(&root->hm.sizehashes[type], size);
-    if(!item)
+    if(!digest || !size || size == 0xffffffff || !root)
 	return CL_CLEAN;
 
-    szh = (struct cli_sz_hash *)item->data.as_ptr;
+    if(root->hm.sizehashes[type].capacity && hm_filter_test(&root->hm.filter[type], digest) && (item = cli_htu32_find(&root->hm.sizehashes[type], size))) {
+	szh = (struct cli_sz_hash *)item->data.as_ptr;
+	if(hm_scan(digest, virname, szh, type) == CL_VIRUS)
+	    return CL_VIRUS;
+    }
 
-    return hm_scan(digest, virname, szh, type);
+    return root->hmsegs ? hm_seg_scan(digest, size, virname, root, type) : CL_CLEAN;
 }
 
 /* cli_hm_scan_wild will scan only size-agnostic hashes, if any */
 int cli_hm_scan_wild(const unsigned char *digest, const char **virname, const struct cli_matcher *root, enum CLI_HASH_TYPE type) {
-    if(!digest || !root || !root->hwild.hashes[type].items)
+    if(!digest || !root)
 	return CL_CLEAN;
 
-    return hm_scan(digest, virname, &root->hwild.hashes[type], type);
+    if(root->hwild.hashes[type].items && hm_filter_test(&root->hm.filter[type], digest) && hm_scan(digest, virname, &root->hwild.hashes[type], type) == CL_VIRUS)
+	return CL_VIRUS;
+
+    return root->hmsegs ? hm_seg_scan(digest, 0, virname, root, type) : CL_CLEAN;
+}
+
+/* Calls cb for the virus name of each hash until it returns non zero; slot
+ * is NULL for the read-only entries of the mapped image */
+int cli_hm_walknames(struct cli_matcher *root, int (*cb)(void *arg, const char **slot, const char *virname), void *arg) {
+    enum CLI_HASH_TYPE type;
+    struct cli_sz_hash *szh;
+    unsigned int j;
+    uint32_t i;
+    int ret;
+
+    if(!root)
+	return 0;
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	struct cli_htu32 *ht = &root->hm.sizehashes[type];
+	const struct cli_htu32_element *item = NULL;
+
+	if(!root->hm.sizehashes[type].capacity)
+	    continue;
+
+	while((item = cli_htu32_next(ht, item))) {
+	    szh = (struct cli_sz_hash *)item->data.as_ptr;
+	    for(i = 0; i < szh->items; i++)
+		if((ret = cb(arg, &szh->virusnames[i], szh->virusnames[i])))
+		    return ret;
+	}
+    }
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	szh = &root->hwild.hashes[type];
+	for(i = 0; i < szh->items; i++)
+	    if((ret = cb(arg, &szh->virusnames[i], szh->virusnames[i])))
+		return ret;
+    }
+
+    for(j = 0; j < root->hmsegs; j++) {
+	const struct cli_hm_seg *seg = &root->hmseg[j];
+
+	for(i = 0; i < seg->items; i++)
+	    if((ret = cb(arg, NULL, seg->strings + seg->names[i])))
+		return ret;
+    }
+    return 0;
+}
+
+static size_t hm_szh_memsize(const struct cli_sz_hash *szh, unsigned int keylen) {
+    size_t bytes = (size_t)szh->items * (keylen + sizeof(*szh->virusnames));
+    uint32_t i;
+
+    for(i = 0; i < szh->items; i++)
+	bytes += strlen(szh->virusnames[i]) + 1;
+    if(szh->dir)
+	bytes += ((1 << szh->dirbits) + 1) * sizeof(uint32_t);
+    return bytes;
+}
+
+/* Memory held by the hash sets; segments mapped from the hash image are
+ * shared and only counted in sigs. */
+size_t cli_hm_memstats(const struct cli_matcher *root, unsigned int *sigs) {
+    enum CLI_HASH_TYPE type;
+    size_t bytes = 0;
+    unsigned int i;
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	const struct cli_htu32 *ht = &root->hm.sizehashes[type];
+	const struct cli_htu32_element *item = NULL;
+
+	if(ht->capacity) {
+	    bytes += ht->capacity * sizeof(struct cli_htu32_element);
+	    while((item = cli_htu32_next(ht, item))) {
+		const struct cli_sz_hash *szh = (const struct cli_sz_hash *)item->data.as_ptr;
+
+		bytes += sizeof(*szh) + hm_szh_memsize(szh, hashlen[type]);
+		*sigs += szh->items;
+	    }
+	}
+	bytes += hm_szh_memsize(&root->hwild.hashes[type], hashlen[type]);
+	*sigs += root->hwild.hashes[type].items;
+	if(root->hm.filter[type].blocks)
+	    bytes += ((size_t)root->hm.filter[type].mask + 1) * 8 * sizeof(uint64_t);
+    }
+    for(i = 0; i < root->hmsegs; i++)
+	*sigs += root->hmseg[i].items;
+    bytes += root->hmsegs * sizeof(*root->hmseg);
+    return bytes;
 }
 
 /* free both size-specific and agnostic hash sets */
@@ -313,6 +645,8 @@ void hm_free(struct cli_matcher *root) {
 	    while(szh->items)
 		mpool_free(root->mempool, (void *)szh->virusnames[--szh->items]);
 	    mpool_free(root->mempool, szh->virusnames);
+	    if(szh->dir)
+		mpool_free(root->mempool, szh->dir);
 	    mpool_free(root->mempool, szh);
 	}
 	cli_htu32_free(ht, root->mempool);
@@ -328,6 +662,793 @@ void hm_free(struct cli_matcher *root) {
 	while(szh->items)
 	    mpool_free(root->mempool, (void *)szh->virusnames[--szh->items]);
 	mpool_free(root->mempool, szh->virusnames);
+	if(szh->dir)
+	    mpool_free(root->mempool, szh->dir);
+    }
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	if(root->hm.filter[type].blocks)
+	    mpool_free(root->mempool, root->hm.filter[type].blocks);
+	root->hm.filter[type].blocks = NULL;
+    }
+
+    /* the segment data belongs to the hash image */
+    free(root->hmseg);
+    root->hmseg = NULL;
+    root->hmsegs = 0;
+}
+
+
+/*
+ * Hash image
+ *
+ * With CL_ENGINE_HASH_IMAGE set, the hash databases are not merged into the
+ * size hashtables. Each database file gets its own sorted segments instead,
+ * and at compile time all the segments are written to the image file,
+ * which is then mapped read-only and shared by every process using it.
+ * Engines loading the same database files later map their segments from
+ * the image instead of parsing them. Sections are keyed by the content of
+ * the database file and by everything that filters its entries (options,
+ * PUA categories, ignore lists, flevel), so partial updates only re-parse
+ * the files that changed.
+ */
+
+#define HM_IMAGE_MAGIC "ClamHImg"
+#define HM_IMAGE_VERSION 1
+#define HM_IMAGE_BYTEORDER 0x01020304
+#define HM_IMAGE_NAMELEN 64
+#define HM_IMAGE_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+struct hm_image_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t flevel;
+    uint32_t nsrc;
+    uint32_t nsegs;
+    uint32_t pad;
+    uint64_t size;
+};
+
+struct hm_image_src {
+    uint8_t key[32];
+    char name[HM_IMAGE_NAMELEN];
+    uint32_t sigs;
+    uint32_t pad;
+    uint64_t strings_off;
+    uint64_t strings_len;
+};
+
+struct hm_image_seg {
+    uint32_t src;
+    uint32_t type;
+    uint32_t nsizes;
+    uint32_t items;
+    uint64_t sizes_off;
+    uint64_t hashes_off;
+    uint64_t names_off;
+};
+
+/* entry of the database file being parsed */
+struct hm_stage {
+    uint32_t size;
+    uint32_t name;
+    uint8_t hash[CLI_HASHLEN_MAX];
+};
+
+struct hm_source {
+    uint8_t key[32];
+    char name[HM_IMAGE_NAMELEN];
+    uint32_t sigs;
+    struct cli_matcher *root;
+    const char *strings;
+    uint64_t strings_len;
+    void *priv[CLI_HASH_AVAIL_TYPES + 1]; /* NULL for mapped sources */
+};
+
+struct cli_hm_image {
+    const unsigned char *map;
+    size_t maplen;
+    unsigned int tried, dirty, staging;
+    struct hm_source *src;
+    unsigned int nsrc;
+    uint8_t ign[32];
+    void *ignctx;
+
+    /* database file being parsed */
+    struct cli_matcher *root;
+    uint8_t key[32];
+    char name[HM_IMAGE_NAMELEN];
+    struct hm_stage *stage[CLI_HASH_AVAIL_TYPES];
+    uint32_t nstage[CLI_HASH_AVAIL_TYPES], maxstage[CLI_HASH_AVAIL_TYPES];
+    char *strings;
+    uint64_t strings_len, strings_max;
+};
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+
+static const struct hm_image_hdr *hm_image_check(const unsigned char *map, size_t len) {
+    const struct hm_image_hdr *hdr = (const struct hm_image_hdr *)map;
+    const struct hm_image_src *src;
+    const struct hm_image_seg *seg;
+    uint64_t end;
+    unsigned int i;
+
+    if(len < sizeof(*hdr) || memcmp(hdr->magic, HM_IMAGE_MAGIC, 8) || hdr->version != HM_IMAGE_VERSION
+       || hdr->byteorder != HM_IMAGE_BYTEORDER || hdr->flevel != cl_retflevel() || hdr->size != len)
+	return NULL;
+    end = sizeof(*hdr) + (uint64_t)hdr->nsrc * sizeof(*src) + (uint64_t)hdr->nsegs * sizeof(*seg);
+    if(end > len)
+	return NULL;
+    src = (const struct hm_image_src *)(hdr + 1);
+    for(i = 0; i < hdr->nsrc; i++) {
+	if(!src[i].strings_len || src[i].strings_off > len || src[i].strings_len > len - src[i].strings_off
+	   || map[src[i].strings_off + src[i].strings_len - 1] || src[i].name[HM_IMAGE_NAMELEN - 1])
+	    return NULL;
+    }
+    seg = (const struct hm_image_seg *)(src + hdr->nsrc);
+    for(i = 0; i < hdr->nsegs; i++) {
+	if(seg[i].src >= hdr->nsrc || seg[i].type >= CLI_HASH_AVAIL_TYPES || seg[i].nsizes > seg[i].items
+	   || (seg[i].sizes_off & 3) || (seg[i].names_off & 3)
+	   || seg[i].sizes_off > len || (uint64_t)seg[i].nsizes * 8 > len - seg[i].sizes_off
+	   || seg[i].hashes_off > len || (uint64_t)seg[i].items * hashlen[seg[i].type] > len - seg[i].hashes_off
+	   || seg[i].names_off > len || (uint64_t)seg[i].items * 4 > len - seg[i].names_off)
+	    return NULL;
     }
+    return hdr;
 }
 
+static int hm_image_map(struct cli_hm_image *img, int fd) {
+    STATBUF sb;
+    void *map;
+
+    if(FSTAT(fd, &sb) || !sb.st_size || (uint64_t)sb.st_size != (size_t)sb.st_size)
+	return -1;
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+	return -1;
+    if(!hm_image_check(map, sb.st_size)) {
+	munmap(map, sb.st_size);
+	return -1;
+    }
+    img->map = map;
+    img->maplen = sb.st_size;
+    return 0;
+}
+
+static void hm_image_unmap(struct cli_hm_image *img) {
+    if(img->map)
+	munmap((void *)img->map, img->maplen);
+    img->map = NULL;
+    img->maplen = 0;
+}
+
+#else
+
+static int hm_image_map(struct cli_hm_image *img, int fd) {
+    UNUSEDPARAM(img);
+    UNUSEDPARAM(fd);
+    return -1;
+}
+
+static void hm_image_unmap(struct cli_hm_image *img) {
+    UNUSEDPARAM(img);
+}
+
+#endif
+
+static int hm_image_addseg(struct cli_matcher *root, const struct cli_hm_seg *seg) {
+    struct cli_hm_seg *segs = cli_realloc(root->hmseg, (root->hmsegs + 1) * sizeof(*segs));
+
+    if(!segs)
+	return CL_EMEM;
+    segs[root->hmsegs++] = *seg;
+    root->hmseg = segs;
+    return CL_SUCCESS;
+}
+
+/* Attaches the segments of an image source, after making sure they are sane */
+static int hm_image_attach(struct cli_hm_image *img, unsigned int isrc, unsigned int src) {
+    const struct hm_image_hdr *hdr = (const struct hm_image_hdr *)img->map;
+    const struct hm_image_src *s = (const struct hm_image_src *)(hdr + 1);
+    const struct hm_image_seg *seg = (const struct hm_image_seg *)(s + hdr->nsrc);
+    struct cli_matcher *root = img->src[src].root;
+    unsigned int i, start = root->hmsegs;
+    uint32_t j;
+
+    img->src[src].strings = (const char *)img->map + s[isrc].strings_off;
+    img->src[src].strings_len = s[isrc].strings_len;
+    for(i = 0; i < hdr->nsegs; i++) {
+	struct cli_hm_seg new;
+
+	if(seg[i].src != isrc)
+	    continue;
+	new.sizes = (const uint32_t *)(img->map + seg[i].sizes_off);
+	new.hashes = img->map + seg[i].hashes_off;
+	new.names = (const uint32_t *)(img->map + seg[i].names_off);
+	new.strings = img->src[src].strings;
+	new.nsizes = seg[i].nsizes;
+	new.items = seg[i].items;
+	new.type = seg[i].type;
+	new.src = src;
+	for(j = 0; j < new.nsizes; j++)
+	    if(new.sizes[2 * j + 1] >= new.items || (j && (new.sizes[2 * j] <= new.sizes[2 * j - 2] || new.sizes[2 * j + 1] <= new.sizes[2 * j - 1])) || (!j && new.sizes[1]))
+		break;
+	if(j < new.nsizes)
+	    break;
+	for(j = 0; j < new.items; j++)
+	    if(new.names[j] >= img->src[src].strings_len)
+		break;
+	if(j < new.items || hm_image_addseg(root, &new))
+	    break;
+    }
+    if(i < hdr->nsegs) {
+	cli_warnmsg("cli_hm_image: Damaged section %s in hash image\n", img->src[src].name);
+	root->hmsegs = start;
+	return CL_EMALFDB;
+    }
+    return CL_SUCCESS;
+}
+
+static struct cli_hm_image *hm_image_get(struct cl_engine *engine) {
+    struct cli_hm_image *img = engine->hm_image;
+    int fd;
+
+    if(img)
+	return img;
+    if(!(img = cli_calloc(1, sizeof(*img))))
+	return NULL;
+    engine->hm_image = img;
+    if((fd = open(engine->hash_image, O_RDONLY|O_BINARY)) >= 0) {
+	if(hm_image_map(img, fd))
+	    cli_warnmsg("cli_hm_image: Ignoring invalid hash image %s\n", engine->hash_image);
+	else
+	    cli_dbgmsg("cli_hm_image: Using hash image %s\n", engine->hash_image);
+	close(fd);
+    }
+    return img;
+}
+
+/* Computes the key of a database file, from its content and its filters */
+static int hm_image_key(struct cl_engine *engine, struct cli_hm_image *img, unsigned int mode, unsigned int options, FILE *fs, struct cli_dbio *dbio, const char *dbname, unsigned char *digest, uint8_t *key) {
+    unsigned char buff[FILEBUFF];
+    uint32_t filter[3];
+    void *ctx;
+    size_t n;
+
+    if(dbio) {
+	/* files in containers are verified against the .info entries */
+	const struct cli_dbinfo *db;
+
+	for(db = engine->dbinfo; db; db = db->next)
+	    if(!db->cvd && db->name && db->hash && !strcmp(db->name, dbname))
+		break;
+	if(!db)
+	    return -1;
+	memcpy(digest, db->hash, 32);
+    } else {
+	if(!fs || !(ctx = cl_hash_init("sha256")))
+	    return -1;
+	while((n = fread(buff, 1, sizeof(buff), fs)))
+	    cl_update_hash(ctx, buff, n);
+	cl_finish_hash(ctx, digest);
+	if(ferror(fs) || fseek(fs, 0, SEEK_SET))
+	    return -1;
+    }
+
+    if(img->ignctx) {
+	/* fold the ignore entries loaded so far */
+	unsigned char ign[32];
+
+	cl_finish_hash(img->ignctx, ign);
+	img->ignctx = NULL;
+	if(!(ctx = cl_hash_init("sha256")))
+	    return -1;
+	cl_update_hash(ctx, img->ign, 32);
+	cl_update_hash(ctx, ign, 32);
+	cl_finish_hash(ctx, img->ign);
+    }
+
+    if(!(ctx = cl_hash_init("sha256")))
+	return -1;
+    filter[0] = mode;
+    filter[1] = options & (CL_DB_OFFICIAL | CL_DB_PUA_MODE | CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE);
+    filter[2] = cl_retflevel();
+    cl_update_hash(ctx, (void *)dbname, strlen(dbname) + 1);
+    cl_update_hash(ctx, digest, 32);
+    cl_update_hash(ctx, filter, sizeof(filter));
+    cl_update_hash(ctx, img->ign, 32);
+    if(engine->pua_cats)
+	cl_update_hash(ctx, engine->pua_cats, strlen(engine->pua_cats));
+    cl_finish_hash(ctx, key);
+    return 0;
+}
+
+static int hm_image_newsrc(struct cli_hm_image *img, struct cli_matcher *root, const uint8_t *key, const char *name, uint32_t sigs) {
+    struct hm_source *src = cli_realloc(img->src, (img->nsrc + 1) * sizeof(*src));
+
+    if(!src)
+	return -1;
+    img->src = src;
+    src += img->nsrc;
+    memset(src, 0, sizeof(*src));
+    memcpy(src->key, key, 32);
+    strncpy(src->name, name, HM_IMAGE_NAMELEN - 1);
+    src->sigs = sigs;
+    src->root = root;
+    return img->nsrc++;
+}
+
+static void hm_image_unstage(struct cli_hm_image *img) {
+    enum CLI_HASH_TYPE type;
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	free(img->stage[type]);
+	img->stage[type] = NULL;
+	img->nstage[type] = img->maxstage[type] = 0;
+    }
+    free(img->strings);
+    img->strings = NULL;
+    img->strings_len = img->strings_max = 0;
+    img->staging = 0;
+}
+
+/*
+ * Called before parsing a hash database: returns 0 if the database was
+ * attached from the image, 1 if it must be parsed into a new section (see
+ * cli_hm_image_stage()) and -1 if the hash image can't be used for it.
+ */
+int cli_hm_image_begin(struct cl_engine *engine, struct cli_matcher *root, unsigned int mode, unsigned int options, FILE *fs, struct cli_dbio *dbio, const char *dbname, unsigned int *signo, uint8_t *key) {
+    struct cli_hm_image *img;
+    unsigned char digest[32];
+    int src;
+
+    if(!engine->hash_image || engine->cb_sigload || !(img = hm_image_get(engine)))
+	return -1;
+    if(hm_image_key(engine, img, mode, options, fs, dbio, dbname, digest, key))
+	return -1;
+
+    if(img->map) {
+	const struct hm_image_hdr *hdr = (const struct hm_image_hdr *)img->map;
+	const struct hm_image_src *s = (const struct hm_image_src *)(hdr + 1);
+	unsigned int i;
+
+	for(i = 0; i < hdr->nsrc; i++)
+	    if(!memcmp(s[i].key, key, 32))
+		break;
+	if(i < hdr->nsrc && (src = hm_image_newsrc(img, root, key, dbname, s[i].sigs)) >= 0) {
+	    if(!hm_image_attach(img, i, src)) {
+		cli_dbgmsg("cli_hm_image: %s mapped from the hash image (%u sigs)\n", dbname, s[i].sigs);
+		if(signo)
+		    *signo += s[i].sigs;
+		if(dbio)
+		    cli_cache_dbentry(engine, dbname, digest);
+		return 0;
+	    }
+	    img->nsrc--;
+	}
+    }
+    return 1;
+}
+
+/* Starts a new section, its entries are passed to cli_hm_image_add() */
+void cli_hm_image_stage(struct cl_engine *engine, struct cli_matcher *root, const uint8_t *key, const char *dbname) {
+    struct cli_hm_image *img = engine->hm_image;
+
+    hm_image_unstage(img);
+    memcpy(img->key, key, 32);
+    memset(img->name, 0, sizeof(img->name));
+    strncpy(img->name, dbname, HM_IMAGE_NAMELEN - 1);
+    img->root = root;
+    img->staging = 1;
+}
+
+int cli_hm_image_add(struct cl_engine *engine, const char *strhash, uint32_t size, const char *virusname) {
+    enum CLI_HASH_TYPE type;
+    char binhash[CLI_HASHLEN_MAX];
+    int hlen = strlen(strhash);
+
+    switch(hlen) {
+    case 32:
+	type = CLI_HASH_MD5;
+	break;
+    case 40:
+	type = CLI_HASH_SHA1;
+	break;
+    case 64:
+	type = CLI_HASH_SHA256;
+	break;
+    default:
+	cli_errmsg("cli_hm_image_add: invalid hash %s\n", strhash);
+	return CL_EARG;
+    }
+    if(cli_hex2str_to(strhash, binhash, hlen)) {
+	cli_errmsg("cli_hm_image_add: invalid hash %s\n", strhash);
+	return CL_EARG;
+    }
+
+    return cli_hm_image_addbin(engine, binhash, type, size, virusname);
+}
+
+int cli_hm_image_addbin(struct cl_engine *engine, const void *binhash, enum CLI_HASH_TYPE type, uint32_t size, const char *virusname) {
+    struct cli_hm_image *img = engine->hm_image;
+    struct hm_stage *entry;
+    size_t len = strlen(virusname) + 1;
+
+    if(img->nstage[type] == img->maxstage[type]) {
+	uint32_t max = img->maxstage[type] ? img->maxstage[type] * 2 : 1024;
+
+	if(!(entry = cli_realloc(img->stage[type], max * sizeof(*entry))))
+	    return CL_EMEM;
+	img->stage[type] = entry;
+	img->maxstage[type] = max;
+    }
+    if(img->strings_len + len > img->strings_max) {
+	uint64_t max = img->strings_max ? img->strings_max * 2 : 65536;
+	char *strings;
+
+	if(max > 0xffffffff) {
+	    cli_errmsg("cli_hm_image_add: too many signatures in %s\n", img->name);
+	    return CL_EMEM;
+	}
+	if(!(strings = cli_realloc(img->strings, max)))
+	    return CL_EMEM;
+	img->strings = strings;
+	img->strings_max = max;
+    }
+
+    entry = &img->stage[type][img->nstage[type]];
+    memset(entry->hash, 0, sizeof(entry->hash));
+    memcpy(entry->hash, binhash, hashlen[type]);
+    entry->size = size;
+    entry->name = img->strings_len;
+    memcpy(&img->strings[img->strings_len], virusname, len);
+    img->strings_len += len;
+    img->nstage[type]++;
+    return CL_SUCCESS;
+}
+
+static int hm_stage_cmp(const void *a, const void *b) {
+    const struct hm_stage *x = (const struct hm_stage *)a, *y = (const struct hm_stage *)b;
+
+    if(x->size != y->size)
+	return x->size < y->size ? -1 : 1;
+    return memcmp(x->hash, y->hash, sizeof(x->hash));
+}
+
+/* Turns the parsed entries into private segments of a new source */
+int cli_hm_image_end(struct cl_engine *engine, unsigned int sigs, int failed) {
+    struct cli_hm_image *img = engine->hm_image;
+    enum CLI_HASH_TYPE type;
+    struct hm_source *s;
+    int src;
+
+    if(!img || !img->staging)
+	return CL_SUCCESS;
+    if(failed) {
+	hm_image_unstage(img);
+	return CL_SUCCESS;
+    }
+    if(!img->strings_len) {
+	/* the strings of a section are never empty */
+	if(!(img->strings = cli_calloc(1, 1))) {
+	    hm_image_unstage(img);
+	    return CL_EMEM;
+	}
+	img->strings_len = img->strings_max = 1;
+    }
+    if((src = hm_image_newsrc(img, img->root, img->key, img->name, sigs)) < 0) {
+	hm_image_unstage(img);
+	return CL_EMEM;
+    }
+    s = &img->src[src];
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	const unsigned int keylen = hashlen[type];
+	struct hm_stage *stage = img->stage[type];
+	uint32_t i, n = img->nstage[type], nsizes = 0;
+	struct cli_hm_seg seg;
+	uint32_t *sizes, *names;
+	uint8_t *hashes;
+
+	if(!n)
+	    continue;
+	qsort(stage, n, sizeof(*stage), hm_stage_cmp);
+	for(i = 0; i < n; i++)
+	    if(!i || stage[i].size != stage[i - 1].size)
+		nsizes++;
+	if(!(s->priv[type] = cli_malloc((size_t)nsizes * 8 + (size_t)n * 4 + (size_t)n * keylen)))
+	    break;
+	sizes = (uint32_t *)s->priv[type];
+	names = sizes + 2 * nsizes;
+	hashes = (uint8_t *)(names + n);
+	for(i = 0, nsizes = 0; i < n; i++) {
+	    if(!i || stage[i].size != stage[i - 1].size) {
+		sizes[2 * nsizes] = stage[i].size;
+		sizes[2 * nsizes + 1] = i;
+		nsizes++;
+	    }
+	    names[i] = stage[i].name;
+	    memcpy(&hashes[(size_t)keylen * i], stage[i].hash, keylen);
+	}
+	seg.sizes = sizes;
+	seg.hashes = hashes;
+	seg.names = names;
+	seg.strings = img->strings;
+	seg.nsizes = nsizes;
+	seg.items = n;
+	seg.type = type;
+	seg.src = src;
+	if(hm_image_addseg(img->root, &seg))
+	    break;
+    }
+    s->strings = img->strings;
+    s->strings_len = img->strings_len;
+    s->priv[CLI_HASH_AVAIL_TYPES] = img->strings;
+    img->strings = NULL;
+    hm_image_unstage(img);
+    if(type < CLI_HASH_AVAIL_TYPES) {
+	cli_errmsg("cli_hm_image_end: Can't allocate memory for %s\n", s->name);
+	return CL_EMEM;
+    }
+    img->dirty = 1;
+    return CL_SUCCESS;
+}
+
+/* Ignore lists filter the hash databases loaded after them */
+void cli_hm_image_ignore(struct cl_engine *engine, const char *signame, const char *hash) {
+    struct cli_hm_image *img;
+
+    if(!engine->hash_image || !(img = hm_image_get(engine)))
+	return;
+    if(!img->ignctx && !(img->ignctx = cl_hash_init("sha256")))
+	return;
+    cl_update_hash(img->ignctx, (void *)signame, strlen(signame) + 1);
+    if(hash)
+	cl_update_hash(img->ignctx, (void *)hash, strlen(hash));
+    cl_update_hash(img->ignctx, "\n", 1);
+}
+
+static int hm_image_put(FILE *f, uint64_t *pos, uint64_t off, const void *data, size_t len) {
+    static const char zero[8];
+
+    if(off > *pos && fwrite(zero, 1, off - *pos, f) != off - *pos)
+	return -1;
+    if(len && fwrite(data, 1, len, f) != len)
+	return -1;
+    *pos = off + len;
+    return 0;
+}
+
+static int hm_image_write(struct cli_hm_image *img, FILE *f) {
+    struct hm_image_hdr hdr;
+    struct hm_image_src *s;
+    struct hm_image_seg *seg;
+    const struct cli_hm_seg **data;
+    uint64_t pos = 0, off;
+    unsigned int i, j, n = 0;
+    int ret = -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HM_IMAGE_MAGIC, 8);
+    hdr.version = HM_IMAGE_VERSION;
+    hdr.byteorder = HM_IMAGE_BYTEORDER;
+    hdr.flevel = cl_retflevel();
+    hdr.nsrc = img->nsrc;
+    for(i = 0; i < img->nsrc; i++)
+	for(j = 0; j < img->src[i].root->hmsegs; j++)
+	    if(img->src[i].root->hmseg[j].src == i)
+		hdr.nsegs++;
+
+    s = cli_calloc(hdr.nsrc + 1, sizeof(*s));
+    seg = cli_calloc(hdr.nsegs + 1, sizeof(*seg));
+    data = cli_calloc(hdr.nsegs + 1, sizeof(*data));
+    if(!s || !seg || !data)
+	goto done;
+
+    /* layout */
+    off = sizeof(hdr) + (uint64_t)hdr.nsrc * sizeof(*s) + (uint64_t)hdr.nsegs * sizeof(*seg);
+    for(i = 0; i < img->nsrc; i++) {
+	for(j = 0; j < img->src[i].root->hmsegs; j++) {
+	    const struct cli_hm_seg *sg = &img->src[i].root->hmseg[j];
+
+	    if(sg->src != i)
+		continue;
+	    data[n] = sg;
+	    seg[n].src = i;
+	    seg[n].type = sg->type;
+	    seg[n].nsizes = sg->nsizes;
+	    seg[n].items = sg->items;
+	    seg[n].sizes_off = HM_IMAGE_ALIGN(off);
+	    seg[n].hashes_off = seg[n].sizes_off + (uint64_t)sg->nsizes * 8;
+	    seg[n].names_off = HM_IMAGE_ALIGN(seg[n].hashes_off + (uint64_t)sg->items * hashlen[sg->type]);
+	    off = seg[n].names_off + (uint64_t)sg->items * 4;
+	    n++;
+	}
+    }
+    for(i = 0; i < img->nsrc; i++) {
+	memcpy(s[i].key, img->src[i].key, 32);
+	memcpy(s[i].name, img->src[i].name, HM_IMAGE_NAMELEN);
+	s[i].sigs = img->src[i].sigs;
+	s[i].strings_off = HM_IMAGE_ALIGN(off);
+	s[i].strings_len = img->src[i].strings_len;
+	off = s[i].strings_off + s[i].strings_len;
+    }
+    hdr.size = off;
+
+    if(hm_image_put(f, &pos, 0, &hdr, sizeof(hdr))
+       || hm_image_put(f, &pos, pos, s, hdr.nsrc * sizeof(*s))
+       || hm_image_put(f, &pos, pos, seg, hdr.nsegs * sizeof(*seg)))
+	goto done;
+    for(i = 0; i < n; i++) {
+	if(hm_image_put(f, &pos, seg[i].sizes_off, data[i]->sizes, (size_t)data[i]->nsizes * 8)
+	   || hm_image_put(f, &pos, seg[i].hashes_off, data[i]->hashes, (size_t)data[i]->items * hashlen[data[i]->type])
+	   || hm_image_put(f, &pos, seg[i].names_off, data[i]->names, (size_t)data[i]->items * 4))
+	    goto done;
+    }
+    for(i = 0; i < img->nsrc; i++)
+	if(hm_image_put(f, &pos, s[i].strings_off, img->src[i].strings, img->src[i].strings_len))
+	    goto done;
+    ret = 0;
+
+done:
+    free(s);
+    free(seg);
+    free(data);
+    return ret;
+}
+
+static void hm_image_release(struct cli_hm_image *img) {
+    unsigned int i, j;
+
+    for(i = 0; i < img->nsrc; i++)
+	for(j = 0; j <= CLI_HASH_AVAIL_TYPES; j++) {
+	    free(img->src[i].priv[j]);
+	    img->src[i].priv[j] = NULL;
+	}
+}
+
+/* Moves all the sources to the mapped image in new */
+static int hm_image_switch(struct cli_hm_image *img, struct cli_hm_image *new) {
+    struct cli_matcher **roots;
+    struct cli_hm_seg **segs;
+    unsigned int *nsegs, i, j, nroots = 0;
+    const char **strings;
+    const unsigned char *map = img->map;
+    size_t maplen = img->maplen;
+    int ret = CL_SUCCESS;
+
+    roots = cli_calloc(img->nsrc, sizeof(*roots));
+    segs = cli_calloc(img->nsrc, sizeof(*segs));
+    nsegs = cli_calloc(img->nsrc, sizeof(*nsegs));
+    strings = cli_calloc(img->nsrc, sizeof(*strings));
+    if(!roots || !segs || !nsegs || !strings) {
+	ret = CL_EMEM;
+	goto done;
+    }
+
+    for(i = 0; i < img->nsrc; i++) {
+	for(j = 0; j < nroots; j++)
+	    if(roots[j] == img->src[i].root)
+		break;
+	if(j == nroots) {
+	    roots[nroots] = img->src[i].root;
+	    segs[nroots] = roots[nroots]->hmseg;
+	    nsegs[nroots] = roots[nroots]->hmsegs;
+	    roots[nroots]->hmseg = NULL;
+	    roots[nroots]->hmsegs = 0;
+	    nroots++;
+	}
+	strings[i] = img->src[i].strings;
+    }
+
+    img->map = new->map;
+    img->maplen = new->maplen;
+    for(i = 0; i < img->nsrc; i++)
+	if((ret = hm_image_attach(img, i, i)))
+	    break;
+
+    if(ret) {
+	/* keep the current segments */
+	for(j = 0; j < nroots; j++) {
+	    free(roots[j]->hmseg);
+	    roots[j]->hmseg = segs[j];
+	    roots[j]->hmsegs = nsegs[j];
+	}
+	for(i = 0; i < img->nsrc; i++)
+	    img->src[i].strings = strings[i];
+	img->map = map;
+	img->maplen = maplen;
+    } else {
+	for(j = 0; j < nroots; j++)
+	    free(segs[j]);
+	hm_image_release(img);
+	new->map = map;
+	new->maplen = maplen;
+    }
+
+done:
+    free(roots);
+    free(segs);
+    free(nsegs);
+    free(strings);
+    return ret;
+}
+
+/* Writes the hash image and switches the engine to the mapped copy */
+static void hm_image_save(struct cl_engine *engine, struct cli_hm_image *img) {
+    struct cli_hm_image new;
+    char *tmpname;
+    FILE *f = NULL;
+    int fd, ret;
+
+    if(!(tmpname = cli_malloc(strlen(engine->hash_image) + 16))) {
+	cli_errmsg("cli_hm_image: Can't allocate memory for tmpname\n");
+	return;
+    }
+    sprintf(tmpname, "%s.%u", engine->hash_image, (unsigned int)getpid());
+    if((fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) < 0 || !(f = fdopen(fd, "wb"))) {
+	cli_warnmsg("cli_hm_image: Can't create %s\n", tmpname);
+	if(fd >= 0)
+	    close(fd);
+	free(tmpname);
+	return;
+    }
+    ret = hm_image_write(img, f);
+    if(fclose(f))
+	ret = -1;
+
+    memset(&new, 0, sizeof(new));
+    if(!ret && (fd = open(tmpname, O_RDONLY|O_BINARY)) >= 0) {
+	ret = hm_image_map(&new, fd);
+	close(fd);
+    } else
+	ret = -1;
+    if(ret || hm_image_switch(img, &new)) {
+	cli_warnmsg("cli_hm_image: Can't save the hash image to %s\n", engine->hash_image);
+	hm_image_unmap(&new);
+	unlink(tmpname);
+	free(tmpname);
+	return;
+    }
+    /* new now holds the previous image */
+    hm_image_unmap(&new);
+    if(rename(tmpname, engine->hash_image)) {
+	cli_warnmsg("cli_hm_image: Can't rename %s to %s\n", tmpname, engine->hash_image);
+	unlink(tmpname);
+    } else
+	cli_dbgmsg("cli_hm_image: Saved %u database files to %s\n", img->nsrc, engine->hash_image);
+    free(tmpname);
+}
+
+void cli_hm_image_compile(struct cl_engine *engine) {
+    struct cli_hm_image *img = engine->hm_image;
+
+    if(!img)
+	return;
+    hm_image_unstage(img);
+    if(img->ignctx) {
+	cl_hash_destroy(img->ignctx);
+	img->ignctx = NULL;
+    }
+    if(img->dirty && img->nsrc) {
+	img->dirty = 0;
+	hm_image_save(engine, img);
+    }
+}
+
+/* called after hm_free() on the hash roots */
+void cli_hm_image_free(struct cl_engine *engine) {
+    struct cli_hm_image *img = engine->hm_image;
+
+    if(!img)
+	return;
+    hm_image_unstage(img);
+    if(img->ignctx)
+	cl_hash_destroy(img->ignctx);
+    hm_image_release(img);
+    hm_image_unmap(img);
+    free(img->src);
+    free(img);
+    engine->hm_image = NULL;
+}
@@ -26,6 +26,8 @@
 #include "clamav-config.h"
 #endif
 
+#include <stdio.h>
+
 #include "cltypes.h"
 #include "hashtab.h"
 
@@ -47,17 +49,46 @@ struct cli_sz_hash {
     uint8_t *hash_array;
     const char **virusnames;
     uint32_t items;
+    /* built by hm_flush() for the large sets: dir[b] is the first hash whose
+     * leading dirbits (see hm_cmp()) are b, dir[1 << dirbits] = items */
+    uint32_t *dir;
+    uint32_t dirbits;
+};
+
+/* blocked Bloom filter over the size-specific and wildcard hashes of a
+ * type, built by hm_flush(): blocks of 512 bits, mask + 1 of them */
+struct cli_hash_filter {
+    uint64_t *blocks;
+    uint32_t mask;
 };
 
 struct cli_hash_patt {
     struct cli_htu32 sizehashes[CLI_HASH_AVAIL_TYPES];
+    struct cli_hash_filter filter[CLI_HASH_AVAIL_TYPES];
 };
 
 struct cli_hash_wild {
     struct cli_sz_hash hashes[CLI_HASH_AVAIL_TYPES];
 };
 
+/* sorted hashes of one database file, private or mapped from a hash image */
+struct cli_hm_seg {
+    const uint32_t *sizes; /* (size, first item) pairs, size 0 = wildcard */
+    const uint8_t *hashes;
+    const uint32_t *names; /* offsets into strings */
+    const char *strings;
+    uint32_t nsizes;
+    uint32_t items;
+    uint32_t type;
+    uint32_t src;
+};
+
+struct cli_matcher;
+struct cl_engine;
+struct cli_dbio;
+
 int hm_addhash_str(struct cli_matcher *root, const char *strhash, uint32_t size, const char *virusname);
+int hm_checkhash_str(const char *strhash, uint32_t size);
 int hm_addhash_bin(struct cli_matcher *root, const void *binhash, enum CLI_HASH_TYPE type, uint32_t size, const char *virusname);
 void hm_flush(struct cli_matcher *root);
 int cli_hm_scan(const unsigned char *digest, uint32_t size, const char **virname, const struct cli_matcher *root, enum CLI_HASH_TYPE type);
@@ -65,6 +96,17 @@ int cli_hm_scan_wild(const unsigned char *digest, const char **virname, const st
 int cli_hm_have_size(const struct cli_matcher *root, enum CLI_HASH_TYPE type, uint32_t size);
 int cli_hm_have_wild(const struct cli_matcher *root, enum CLI_HASH_TYPE type);
 int cli_hm_have_any(const struct cli_matcher *root, enum CLI_HASH_TYPE type);
+int cli_hm_walknames(struct cli_matcher *root, int (*cb)(void *arg, const char **slot, const char *virname), void *arg);
+size_t cli_hm_memstats(const struct cli_matcher *root, unsigned int *sigs);
 void hm_free(struct cli_matcher *root);
 
+int cli_hm_image_begin(struct cl_engine *engine, struct cli_matcher *root, unsigned int mode, unsigned int options, FILE *fs, struct cli_dbio *dbio, const char *dbname, unsigned int *signo, uint8_t *key);
+void cli_hm_image_stage(struct cl_engine *engine, struct cli_matcher *root, const uint8_t *key, const char *dbname);
+int cli_hm_image_add(struct cl_engine *engine, const char *strhash, uint32_t size, const char *virusname);
+int cli_hm_image_addbin(struct cl_engine *engine, const void *binhash, enum CLI_HASH_TYPE type, uint32_t size, const char *virusname);
+int cli_hm_image_end(struct cl_engine *engine, unsigned int sigs, int failed);
+void cli_hm_image_ignore(struct cl_engine *engine, const char *signame, const char *hash);
+void cli_hm_image_compile(struct cl_engine *engine);
+void cli_hm_image_free(struct cl_engine *engine);
+
 #endif
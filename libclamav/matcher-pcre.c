@@ -26,6 +26,8 @@
 #include "clamav-config.h"
 #endif
 
+#include <ctype.h>
+
 #include "clamav.h"
 #include "cltypes.h"
 #include "dconf.h"
@@ -37,6 +39,8 @@
 #include "mpool.h"
 #include "readdb.h"
 #include "regex_pcre.h"
+#include "str.h"
+#include "sigprof.h"
 
 #if HAVE_PCRE
 #if USING_PCRE2
@@ -192,6 +196,215 @@ void cli_pcre_perf_events_destroy()
 }
 
 
+/* REQUIRED LITERAL EXTRACTION */
+#define PCRE_LIT_MIN 4  /* shorter literals hit too often to be worth an AC pattern */
+#define PCRE_LIT_MAX 64
+
+/* skips a character class starting at re[i] == '['; returns the index past ']' or -1 */
+static int pcre_lit_skipclass(const char *re, int i)
+{
+    i++;
+    if (re[i] == '^')
+        i++;
+    if (re[i] == ']')
+        i++;
+    for (; re[i]; i++) {
+        if (re[i] == '\\') {
+            if (!re[++i])
+                return -1;
+        }
+        else if (re[i] == '[' && re[i+1] == ':') {
+            const char *end = strstr(re + i + 2, ":]");
+            if (!end)
+                return -1;
+            i = end - re + 1;
+        }
+        else if (re[i] == ']')
+            return i + 1;
+    }
+    return -1;
+}
+
+/* skips a group starting at re[i] == '('; returns the index past ')' or -1 */
+static int pcre_lit_skipgroup(const char *re, int i)
+{
+    int depth = 0;
+
+    while (re[i]) {
+        switch (re[i]) {
+        case '\\':
+            if (re[i+1] == 'Q' || !re[i+1])
+                return -1;
+            i += 2;
+            continue;
+        case '[':
+            if ((i = pcre_lit_skipclass(re, i)) < 0)
+                return -1;
+            continue;
+        case '(':
+            depth++;
+            break;
+        case ')':
+            if (!--depth)
+                return i + 1;
+            break;
+        }
+        i++;
+    }
+    return -1;
+}
+
+/* parses a {n}, {n,} or {n,m} quantifier at re[i]; returns the index past '}' or -1 if it is a literal '{' */
+static int pcre_lit_quantifier(const char *re, int i, unsigned int *min)
+{
+    int j = i + 1;
+
+    if (!isdigit((unsigned char)re[j]))
+        return -1;
+    *min = 0;
+    while (isdigit((unsigned char)re[j]) && *min < 65536)
+        *min = *min * 10 + (re[j++] - '0');
+    if (re[j] == ',')
+        while (isdigit((unsigned char)re[++j]));
+    if (re[j] != '}')
+        return -1;
+    return j + 1;
+}
+
+/* cli_pcre_literal: finds the longest run of literal bytes that every
+ * match of a regex contains at its top level. Groups, classes, anchors
+ * and escapes other than plain characters end a run; a top level
+ * alternation or a construct not understood here gives up. Returns the
+ * run length, 0 if there is none long enough, and sets *prefix when
+ * every match starts with the run. */
+static int cli_pcre_literal(const char *re, int options, unsigned char *lit, int *prefix)
+{
+    unsigned char run[PCRE_LIT_MAX];
+    int i = 0, item, len = 0, best = 0, beststart = -1, runstart = 0, last_lit = 0;
+    unsigned int min, val;
+    char c;
+
+#if USING_PCRE2
+    if (options & PCRE2_EXTENDED)
+#else
+    if (options & PCRE_EXTENDED)
+#endif
+        return 0;
+
+    while (1) {
+        item = i;
+        c = re[i];
+
+        /* quantifiers apply to the last item only; optional items leave the run */
+        if (c == '*' || c == '?' || c == '+' || (c == '{' && pcre_lit_quantifier(re, i, &min) > 0)) {
+            if (c == '{')
+                i = pcre_lit_quantifier(re, i, &min);
+            else {
+                min = (c == '+');
+                i++;
+            }
+            if (re[i] == '?' || re[i] == '+')
+                i++;
+            if (last_lit && !min)
+                len--;
+            c = '\0';
+        }
+        else if (c == '\\') {
+            c = re[++i];
+            i++;
+            if (isalnum((unsigned char)c)) {
+                switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'f': c = '\f'; break;
+                case 'a': c = '\a'; break;
+                case 'e': c = '\033'; break;
+                case 'x':
+                    if (!isxdigit((unsigned char)re[i]) || !isxdigit((unsigned char)re[i+1]) || sscanf(re + i, "%2x", &val) != 1)
+                        return 0;
+                    c = (char)val;
+                    i += 2;
+                    break;
+                case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+                case 'h': case 'H': case 'v': case 'V': case 'R': case 'X':
+                case 'b': case 'B': case 'A': case 'z': case 'Z': case 'G': case 'K':
+                    /* classes and assertions */
+                    c = '\0';
+                    break;
+                default:
+                    /* back references, octal, \Q...\E and escapes with arguments */
+                    return 0;
+                }
+                if (c)
+                    goto literal;
+            }
+            else if (c)
+                goto literal;
+            else
+                return 0;
+        }
+        else if (c && !strchr(".^$[(|)", c)) {
+            i++;
+            goto literal;
+        }
+
+        /* the current run ends here */
+        if (len > best) {
+            best = len;
+            beststart = runstart;
+            memcpy(lit, run, len);
+        }
+        len = 0;
+        last_lit = 0;
+
+        switch (re[item]) {
+        case '\0':
+            goto done;
+        case '|':
+        case ')':
+            return 0;
+        case '.':
+        case '^':
+        case '$':
+            i++;
+            break;
+        case '[':
+            if ((i = pcre_lit_skipclass(re, i)) < 0)
+                return 0;
+            break;
+        case '(':
+            /* option settings and verbs change the rest of the regex, comments aren't nested */
+            if (re[i+1] == '*' || (re[i+1] == '?' && strchr("imsxJUX-^#)", re[i+2])))
+                return 0;
+            if ((i = pcre_lit_skipgroup(re, i)) < 0)
+                return 0;
+            break;
+        }
+        continue;
+
+literal:
+        if (!len)
+            runstart = item;
+        if (len < PCRE_LIT_MAX) {
+            run[len++] = c;
+            last_lit = 1;
+        }
+        else
+            last_lit = 0;
+    }
+
+done:
+    if (best < PCRE_LIT_MIN)
+        return 0;
+#if USING_PCRE2
+    *prefix = !beststart && !(options & PCRE2_ANCHORED);
+#else
+    *prefix = !beststart && !(options & PCRE_ANCHORED);
+#endif
+    return best;
+}
+
 /* PCRE MATCHER FUNCTIONS */
 int cli_pcre_init()
 {
@@ -370,6 +583,31 @@ int cli_pcre_addpatt(struct cli_matcher *root, const char *virname, const char *
             pm_dbgmsg("Compiler: NONE\n");
     }
 
+    /* a literal required by the regex can be looked for by the AC matcher;
+     * cli_pcre_addlits() registers it once the lsig has all its subsigs */
+    if (lsigid) {
+        unsigned char lit[PCRE_LIT_MAX];
+        int litlen, prefix;
+        char *hex;
+
+        if ((litlen = cli_pcre_literal(pattern, pm->pdata.options, lit, &prefix))) {
+            hex = cli_str2hex((const char *)lit, litlen);
+            if (hex) {
+                pm->literal = cli_mpool_strdup(root->mempool, hex);
+                free(hex);
+            }
+            if (!hex || !pm->literal) {
+                cli_errmsg("cli_pcre_addpatt: Unable to allocate memory for literal\n");
+                cli_pcre_freemeta(root, pm);
+                mpool_free(root->mempool, pm);
+                return CL_EMEM;
+            }
+            if (prefix)
+                pm->flags |= CLI_PCRE_LITPREFIX;
+            pm_dbgmsg("cli_pcre_addpatt: /%s/ requires literal %s%s\n", pattern, pm->literal, prefix ? " (prefix)" : "");
+        }
+    }
+
     /* add metadata to the performance tracker */
     if (options & CL_DB_PCRE_STATS)
         pcre_perf_events_init(pm, virname);
@@ -393,6 +631,49 @@ int cli_pcre_addpatt(struct cli_matcher *root, const char *virname, const char *
     return CL_SUCCESS;
 }
 
+/* entries of cli_ac_lsigstate.cnt */
+#define PCRE_LIT_SUBSIGS 64
+
+int cli_pcre_addlits(struct cli_matcher *root, uint32_t lsigid, uint32_t subsigs)
+{
+    const struct cli_ac_lsig *lsig = root->ac_lsigtable[lsigid];
+    struct cli_pcre_meta *pm;
+    uint32_t i, ids[2];
+    int ret;
+
+    /* the regexes of the lsig were the last added */
+    for (i = root->pcre_metas; i > 0; i--) {
+        pm = root->pcre_metatable[i-1];
+        if (!pm->lsigid[0] || pm->lsigid[1] != lsigid)
+            break;
+        if (!pm->literal)
+            continue;
+
+        /* macros index their table by subsig; the counts only have so many rows */
+        if (!lsig->tdb.macro_ptids && subsigs < PCRE_LIT_SUBSIGS) {
+            ids[0] = lsigid;
+            ids[1] = subsigs;
+#if USING_PCRE2
+            ret = cli_ac_addsig(root, pm->virname, pm->literal, (pm->pdata.options & PCRE2_CASELESS) ? ACPATT_OPTION_NOCASE : 0,
+                                0, 0, 0, 0, 0, 0, 0, "*", ids, CL_DB_OFFICIAL);
+#else
+            ret = cli_ac_addsig(root, pm->virname, pm->literal, (pm->pdata.options & PCRE_CASELESS) ? ACPATT_OPTION_NOCASE : 0,
+                                0, 0, 0, 0, 0, 0, 0, "*", ids, CL_DB_OFFICIAL);
+#endif
+            if (ret != CL_SUCCESS) {
+                cli_errmsg("cli_pcre_addlits: failed to add literal %s of /%s/\n", pm->literal, pm->pdata.expression);
+                return ret;
+            }
+            pm->litsubsig = subsigs++;
+        }
+
+        mpool_free(root->mempool, pm->literal);
+        pm->literal = NULL;
+    }
+
+    return CL_SUCCESS;
+}
+
 int cli_pcre_build(struct cli_matcher *root, long long unsigned match_limit, long long unsigned recmatch_limit, const struct cli_dconf *dconf)
 {
     unsigned int i;
@@ -592,9 +873,13 @@ int cli_pcre_scanbuf(const unsigned char *buffer, uint32_t length, const char **
     uint32_t adjbuffer, adjshift, adjlength;
     unsigned int i, evalcnt = 0;
     uint64_t maxfilesize, evalids = 0;
-    uint32_t global, encompass, rolling;
+    uint32_t global, encompass, rolling, litoff;
     int rc, offset, ret = CL_SUCCESS, options=0;
     uint8_t viruses_found = 0;
+    const char *last_trigger = NULL;
+    uint32_t last_lsigid = 0;
+    int last_triggered = 0;
+    uint64_t sampled;
 
     if ((root->pcre_metas == 0) || (!root->pcre_metatable) || (ctx && ctx->dconf && !(ctx->dconf->pcre & PCRE_CONF_SUPPORT)))
         return CL_SUCCESS;
@@ -617,20 +902,40 @@ int cli_pcre_scanbuf(const unsigned char *buffer, uint32_t length, const char **
             continue;
         }
 
-        /* evaluate trigger */
+        /* evaluate trigger; the regexes of a signature often share it, so
+         * reuse the last result until a subsignature of it matches */
         if (pm->lsigid[0]) {
             cli_dbgmsg("cli_pcre_scanbuf: checking %s; running regex /%s/\n", pm->trigger, pd->expression);
+            if (!last_trigger || last_lsigid != pm->lsigid[1] || strcmp(last_trigger, pm->trigger)) {
+                last_trigger = pm->trigger;
+                last_lsigid = pm->lsigid[1];
+                last_triggered = 1;
 #ifdef PCRE_BYPASS
-            if (strcmp(pm->trigger, PCRE_BYPASS))
+                if (strcmp(pm->trigger, PCRE_BYPASS))
 #endif
-                if (cli_ac_chklsig(pm->trigger, pm->trigger + strlen(pm->trigger), mdata->lsigcnt[pm->lsigid[1]], &evalcnt, &evalids, 0) != 1)
-                    continue;
+                    if (cli_ac_chklsig(pm->trigger, pm->trigger + strlen(pm->trigger), cli_ac_lsigcnt(mdata, pm->lsigid[1]), &evalcnt, &evalids, 0) != 1)
+                        last_triggered = 0;
+            }
+            if (!last_triggered)
+                continue;
         }
         else {
             cli_dbgmsg("cli_pcre_scanbuf: skipping %s check due to uninitialized lsigid\n", pm->trigger);
             /* fall-through to unconditional execution - sigtool-only */
         }
 
+        /* the regex can't match without its literal; when the literal starts
+         * every match, matches of a map can't start before its first hit */
+        litoff = CLI_OFF_NONE;
+        if (pm->litsubsig && mdata) {
+            if (!cli_ac_lsigcnt(mdata, pm->lsigid[1])[pm->litsubsig]) {
+                pm_dbgmsg("cli_pcre_scanbuf: skipping regex /%s/, literal not found\n", pd->expression);
+                continue;
+            }
+            if (data && (pm->flags & CLI_PCRE_LITPREFIX))
+                litoff = cli_ac_lsigsuboff_first(mdata, pm->lsigid[1])[pm->litsubsig];
+        }
+
         global = (pm->flags & CLI_PCRE_GLOBAL);       /* globally search for all matches (within bounds) */
         encompass = (pm->flags & CLI_PCRE_ENCOMPASS); /* encompass search to offset->offset+maxshift */
         rolling = (pm->flags & CLI_PCRE_ROLLING);     /* rolling search (unanchored) */
@@ -685,6 +990,12 @@ int cli_pcre_scanbuf(const unsigned char *buffer, uint32_t length, const char **
 
         pm_dbgmsg("cli_pcre_scanbuf: passed buffer adjusted to %u +%u(%u)[%u]%s\n", adjbuffer, adjlength, adjbuffer+adjlength, adjshift, encompass ? " (encompass)":"");
 
+        if (litoff != CLI_OFF_NONE && !options && litoff > adjbuffer + offset) {
+            if (litoff >= adjbuffer + adjlength)
+                continue;
+            offset = litoff - adjbuffer;
+        }
+
         /* if the global flag is set, loop through the scanning */
         do {
             /* reset the match results */
@@ -693,7 +1004,9 @@ int cli_pcre_scanbuf(const unsigned char *buffer, uint32_t length, const char **
 
             /* performance metrics */
             cli_event_time_start(p_sigevents, pm->sigtime_id);
+            sampled = cli_sigprof_start(ctx);
             rc = cli_pcre_match(pd, buffer+adjbuffer, adjlength, offset, options, &p_res);
+            cli_sigprof_stop(ctx, CLI_SIGPROF_PCRE, pm, pm->virname, sampled);
             cli_event_time_stop(p_sigevents, pm->sigtime_id);
             /* if debug, generate a match report */
             if (cli_debug_flag)
@@ -723,6 +1036,8 @@ int cli_pcre_scanbuf(const unsigned char *buffer, uint32_t length, const char **
                     ret = lsig_sub_matched(root, mdata, pm->lsigid[1], pm->lsigid[2], adjbuffer+p_res.match[0], 0);
                     if (ret != CL_SUCCESS)
                         break;
+                    if (pm->lsigid[1] == last_lsigid)
+                        last_trigger = NULL;
                 } else {
                     /* for raw match data - sigtool only */
                     if(res) {
@@ -789,6 +1104,11 @@ void cli_pcre_freemeta(struct cli_matcher *root, struct cli_pcre_meta *pm)
         pm->virname = NULL;
     }
 
+    if (pm->literal) {
+        mpool_free(root->mempool, pm->literal);
+        pm->literal = NULL;
+    }
+
     if (pm->statname) {
         free(pm->statname);
         pm->statname = NULL;
@@ -815,6 +1135,26 @@ void cli_pcre_freetable(struct cli_matcher *root)
     root->pcre_metas = 0;
 }
 
+size_t cli_pcre_memstats(const struct cli_matcher *root)
+{
+    uint32_t i;
+    size_t bytes = 0;
+    const struct cli_pcre_meta *pm;
+
+    for (i = 0; i < root->pcre_metas; ++i) {
+        pm = root->pcre_metatable[i];
+        bytes += sizeof(*pm) + sizeof(*root->pcre_metatable);
+        if (pm->trigger)
+            bytes += strlen(pm->trigger) + 1;
+        if (pm->virname)
+            bytes += strlen(pm->virname) + 1;
+        if (pm->pdata.expression)
+            bytes += strlen(pm->pdata.expression) + 1;
+        bytes += cli_pcre_memsize(&(pm->pdata));
+    }
+    return bytes;
+}
+
 #else
 /* NO-PCRE FUNCTIONS */
 void cli_pcre_perf_print()
@@ -879,4 +1219,10 @@ void cli_pcre_freeoff(struct cli_pcre_off *data)
     return;
 }
 
+size_t cli_pcre_memstats(const struct cli_matcher *root)
+{
+    UNUSEDPARAM(root);
+    return 0;
+}
+
 #endif /* HAVE_PCRE */
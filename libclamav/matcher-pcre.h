@@ -51,6 +51,7 @@ struct cli_pcre_off {
 #define CLI_PCRE_ENCOMPASS 0x00000002 /* e */
 #define CLI_PCRE_ROLLING   0x00000004 /* r */
 
+#define CLI_PCRE_LITPREFIX 0x40000000 /* matches start with the literal */
 #define CLI_PCRE_DISABLED  0x80000000 /* used for dconf or fail to build */
 
 struct cli_pcre_meta {
@@ -63,6 +64,9 @@ struct cli_pcre_meta {
     uint32_t offset_min, offset_max;
     /* internal flags (bitfield?) */
     uint32_t flags;
+    /* literal every match contains, counted by a hidden subsig of the lsig */
+    char *literal; /* hex, dropped once registered */
+    uint32_t litsubsig; /* 0 if none */
     /* performance tracking */
     char *statname; /* freed by us, not cli_events_free */
     uint32_t sigtime_id, sigmatch_id;
@@ -75,12 +79,14 @@ void cli_pcre_perf_events_destroy();
 /* PCRE MATCHER DECLARATIONS */
 int cli_pcre_init();
 int cli_pcre_addpatt(struct cli_matcher *root, const char *virname, const char *trigger,  const char *pattern, const char *cflags, const char *offset, const uint32_t *lsigid, unsigned int options);
+int cli_pcre_addlits(struct cli_matcher *root, uint32_t lsigid, uint32_t subsigs);
 int cli_pcre_build(struct cli_matcher *root, long long unsigned match_limit, long long unsigned recmatch_limit, const struct cli_dconf *dconf);
 int cli_pcre_recaloff(struct cli_matcher *root, struct cli_pcre_off *data, struct cli_target_info *info, cli_ctx *ctx);
 void cli_pcre_freeoff(struct cli_pcre_off *data);
 int cli_pcre_scanbuf(const unsigned char *buffer, uint32_t length, const char **virname, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, const struct cli_pcre_off *data, cli_ctx *ctx);
 void cli_pcre_freemeta(struct cli_matcher *root, struct cli_pcre_meta *pm);
 void cli_pcre_freetable(struct cli_matcher *root);
+size_t cli_pcre_memstats(const struct cli_matcher *root);
 #else
 /* NO-PCRE DECLARATIONS - defined because encasing everything in '#if' is a pain and because dynamic library mappings are weird */
 #define PCRE_BYPASS ""
@@ -93,5 +99,6 @@ int cli_pcre_build(struct cli_matcher *root, long long unsigned match_limit, lon
 int cli_pcre_scanbuf(const unsigned char *buffer, uint32_t length, const char **virname, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, const struct cli_pcre_off *data, cli_ctx *ctx);
 int cli_pcre_recaloff(struct cli_matcher *root, struct cli_pcre_off *data, struct cli_target_info *info, cli_ctx *ctx);
 void cli_pcre_freeoff(struct cli_pcre_off *data);
+size_t cli_pcre_memstats(const struct cli_matcher *root);
 #endif /* HAVE_PCRE */
 #endif /*__MATCHER_PCRE_H*/
@@ -28,6 +28,7 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #ifdef	HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -55,11 +56,17 @@
 #include "perflogging.h"
 #include "bytecode_priv.h"
 #include "bytecode_api_impl.h"
+#include "sigprof.h"
+#include "coldstore.h"
 #ifdef HAVE_YARA
 #include "yara_clam.h"
 #include "yara_exec.h"
 #endif
 
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
 #ifdef CLI_PERF_LOGGING
 
 static inline void PERF_LOG_FILTER(int32_t pos, int32_t length, int8_t trie)
@@ -94,11 +101,34 @@ static inline int PERF_LOG_TRIES(int8_t acmode, int8_t bm_called, int32_t length
 }
 #endif
 
+/* start of the data the patterns of root may match in, from its filter */
+static inline int32_t matcher_filter(const struct cli_matcher *root, const unsigned char *buffer, uint32_t length)
+{
+    struct filter_match_info info;
+    int32_t pos;
+
+    if (!root->filter)
+	return 0;
+    if(filter_search_ext(root->filter, buffer, length, &info) == -1) {
+	/*  for safety always scan last maxpatlen bytes */
+	pos = length - root->maxpatlen - 1;
+    } else {
+	/* must not cut buffer for 64[4-4]6161, because we must be able to check
+	 * 64! */
+	pos = info.first_match - root->maxpatlen - 1;
+    }
+    return pos < 0 ? 0 : pos;
+}
+
+/* With gdata, root is a target root with a merged trie (see cli_ac_merge())
+ * and its AC pass also matches the patterns of the generic root, with gdata;
+ * the run of the generic root then leaves acmode out. */
 static inline int matcher_run(const struct cli_matcher *root,
 			      const unsigned char *buffer, uint32_t length,
 			      const char **virname, struct cli_ac_data *mdata,
+			      struct cli_ac_data *gdata,
 			      uint32_t offset,
-			      const struct cli_target_info *tinfo,
+			      struct cli_target_info *tinfo,
 			      cli_file_t ftype,
 			      struct cli_matched_type **ftoffset,
 			      unsigned int acmode,
@@ -110,27 +140,21 @@ static inline int matcher_run(const struct cli_matcher *root,
 			      cli_ctx *ctx)
 {
     int ret, saved_ret = CL_CLEAN;
-    int32_t pos = 0;
-    struct filter_match_info info;
+    int32_t pos, gpos = 0;
     uint32_t orig_length, orig_offset;
     const unsigned char* orig_buffer;
     unsigned int viruses_found = 0;
-
-    if (root->filter) {
-	if(filter_search_ext(root->filter, buffer, length, &info) == -1) {
-	    /*  for safety always scan last maxpatlen bytes */
-	    pos = length - root->maxpatlen - 1;
-	    if (pos < 0) pos = 0;
-	    PERF_LOG_FILTER(pos, length, root->type);
-	} else {
-	    /* must not cut buffer for 64[4-4]6161, because we must be able to check
-	     * 64! */
-	    pos = info.first_match - root->maxpatlen - 1;
-	    if (pos < 0) pos = 0;
-	    PERF_LOG_FILTER(pos, length, root->type);
-	}
-    } else {
-	PERF_LOG_FILTER(0, length, root->type);
+    const struct cli_matcher *groot = gdata ? ctx->engine->root[0] : NULL;
+    /* the offset mode of BM jumps between the expected offsets instead */
+    int fused = !gdata && !root->ac_only && !root->bm_offmode && ctx && ctx->engine->fused_scan;
+
+    pos = matcher_filter(root, buffer, length);
+    PERF_LOG_FILTER(pos, length, root->type);
+    /* the merged trie starts where the first of both roots would */
+    if (groot) {
+	gpos = matcher_filter(groot, buffer, length);
+	if (gpos > pos)
+	    gpos = pos;
     }
 
     orig_length = length;
@@ -139,7 +163,7 @@ static inline int matcher_run(const struct cli_matcher *root,
     length -= pos;
     buffer += pos;
     offset += pos;
-    if (!root->ac_only) {
+    if (!root->ac_only && !fused) {
 	PERF_LOG_TRIES(0, 1, length);
 	if (root->bm_offmode) {
 	    /* Don't use prefiltering for BM offset mode, since BM keeps tracks
@@ -163,7 +187,12 @@ static inline int matcher_run(const struct cli_matcher *root,
 	}
     }
     PERF_LOG_TRIES(acmode, 0, length);
-    ret = cli_ac_scanbuff(buffer, length, virname, NULL, acres, root, mdata, offset, ftype, ftoffset, acmode, ctx);
+    if (!acmode)
+	ret = CL_CLEAN;
+    else if (groot)
+	ret = cli_ac_scanbuff_merged(orig_buffer + gpos, orig_length - gpos, virname, NULL, acres, root, mdata, groot, gdata, orig_offset + gpos, ftype, ftoffset, acmode, ctx);
+    else
+	ret = cli_ac_scanbuff(buffer, length, virname, NULL, acres, root, mdata, offset, ftype, ftoffset, fused ? acmode | AC_SCAN_BM : acmode, ctx);
     if (ret != CL_CLEAN) {
 	    if (ret == CL_VIRUS) {
             if (SCAN_ALL)
@@ -236,7 +265,50 @@ static inline int matcher_run(const struct cli_matcher *root,
     return ret;
 }
 
-int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset, cli_ctx *ctx, cli_file_t ftype, struct cli_ac_data **acdata)
+/* Time spent in the matcher for the scan profile and the scan usage, see
+ * cl_engine_set_clcb_profile() and cl_scandesc_usage(); only the outermost
+ * call counts, the scans started from inside the matcher (bytecode hooks)
+ * are part of it */
+static uint64_t profile_matcher_start(cli_ctx *ctx)
+{
+    struct timeval tv;
+
+    if ((!ctx->profile && !cli_usage(ctx)) || ctx->in_matcher++)
+        return 0;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void profile_matcher_stop(cli_ctx *ctx, uint64_t start)
+{
+    struct timeval tv;
+    uint64_t now;
+
+    if ((!ctx->profile && !cli_usage(ctx)) || --ctx->in_matcher)
+        return;
+    gettimeofday(&tv, NULL);
+    now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    if (now <= start)
+        return;
+    if (ctx->profile)
+        ctx->profile->matcher += now - start;
+    if (cli_usage(ctx))
+        __sync_fetch_and_add(&ctx->budget->phase_usec[CLI_USAGE_MATCH], now - start);
+}
+
+/* the matcher phase of the scan probe, see cl_scan_probe_register() */
+static inline unsigned int probe_phase(cli_ctx *ctx, unsigned int phase)
+{
+    unsigned int old;
+
+    if (!ctx->probe)
+        return 0;
+    old = ctx->probe->phase;
+    ctx->probe->phase = phase;
+    return old;
+}
+
+static int scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset, cli_ctx *ctx, cli_file_t ftype, struct cli_ac_data **acdata)
 {
 	int ret = CL_CLEAN;
 	unsigned int i = 0, j = 0, viruses_found = 0;
@@ -256,7 +328,7 @@ int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset,
         for(i = 1; i < CLI_MTARGETS; i++) {
             for (j = 0; j < cli_mtargets[i].target_count; ++j) {
                 if(cli_mtargets[i].target[j] == ftype) {
-                    troot = ctx->engine->root[i];
+                    troot = cli_getroot(ctx->engine, i);
                     break;
                 }
             }
@@ -269,7 +341,7 @@ int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset,
 	if(!acdata && (ret = cli_ac_initdata(&mdata, troot->ac_partsigs, troot->ac_lsigs, troot->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)))
 	    return ret;
 
-	ret = matcher_run(troot, buffer, length, &virname, acdata ? (acdata[0]): (&mdata), offset, NULL, ftype, NULL, AC_SCAN_VIR, PCRE_SCAN_BUFF, NULL, *ctx->fmap, NULL, NULL, ctx);
+	ret = matcher_run(troot, buffer, length, &virname, acdata ? (acdata[0]): (&mdata), NULL, offset, NULL, ftype, NULL, AC_SCAN_VIR, PCRE_SCAN_BUFF, NULL, *ctx->fmap, NULL, NULL, ctx);
 
 	if(!acdata)
 	    cli_ac_freedata(&mdata);
@@ -289,7 +361,7 @@ int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset,
     if(!acdata && (ret = cli_ac_initdata(&mdata, groot->ac_partsigs, groot->ac_lsigs, groot->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)))
 	return ret;
 
-    ret = matcher_run(groot, buffer, length, &virname, acdata ? (acdata[1]): (&mdata), offset, NULL, ftype, NULL, AC_SCAN_VIR, PCRE_SCAN_BUFF, NULL, *ctx->fmap, NULL, NULL, ctx);
+    ret = matcher_run(groot, buffer, length, &virname, acdata ? (acdata[1]): (&mdata), NULL, offset, NULL, ftype, NULL, AC_SCAN_VIR, PCRE_SCAN_BUFF, NULL, *ctx->fmap, NULL, NULL, ctx);
 
     if(!acdata)
 	cli_ac_freedata(&mdata);
@@ -299,13 +371,24 @@ int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset,
     return ret;
 }
 
+int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset, cli_ctx *ctx, cli_file_t ftype, struct cli_ac_data **acdata)
+{
+    uint64_t start = profile_matcher_start(ctx);
+    unsigned int phase = probe_phase(ctx, CL_PROBE_MATCH);
+    int ret = scanbuff(buffer, length, offset, ctx, ftype, acdata);
+
+    probe_phase(ctx, phase);
+    profile_matcher_stop(ctx, start);
+    return ret;
+}
+
 /*
  * offdata[0]: type
  * offdata[1]: offset value
  * offdata[2]: max shift
  * offdata[3]: section number
  */
-int cli_caloff(const char *offstr, const struct cli_target_info *info, unsigned int target, uint32_t *offdata, uint32_t *offset_min, uint32_t *offset_max)
+int cli_caloff(const char *offstr, struct cli_target_info *info, unsigned int target, uint32_t *offdata, uint32_t *offset_min, uint32_t *offset_max)
 {
 	char offcpy[65];
 	unsigned int n, val;
@@ -423,7 +506,7 @@ int cli_caloff(const char *offstr, const struct cli_target_info *info, unsigned
 	*offset_min = CLI_OFF_NONE;
 	if(offset_max)
 	    *offset_max = CLI_OFF_NONE;
-	if(info->status == -1)
+	if(cli_targetinfo_exe(info) == -1)
 	    return CL_SUCCESS;
 
 	switch(offdata[0]) {
@@ -478,25 +561,37 @@ int cli_caloff(const char *offstr, const struct cli_target_info *info, unsigned
 
 void cli_targetinfo(struct cli_target_info *info, unsigned int target, fmap_t *map)
 {
-	int (*einfo)(fmap_t *, struct cli_exe_info *) = NULL;
-
-
     memset(info, 0, sizeof(struct cli_target_info));
     info->fsize = map->len;
+    info->map = map;
+    info->target = target;
     cli_hashset_init_noalloc(&info->exeinfo.vinfo);
+}
+
+/* Parses the executable headers of the target the first time they are
+ * needed; most scans never use them. Returns info->status. */
+int cli_targetinfo_exe(struct cli_target_info *info)
+{
+	int (*einfo)(fmap_t *, struct cli_exe_info *) = NULL;
+
+
+    if(info->status || !info->map)
+	return info->status;
 
-    if(target == 1)
+    if(info->target == 1)
 	einfo = cli_peheader;
-    else if(target == 6)
+    else if(info->target == 6)
 	einfo = cli_elfheader;
-    else if(target == 9)
+    else if(info->target == 9)
 	einfo = cli_machoheader;
-    else return;
+    else return 0;
 
-    if(einfo(map, &info->exeinfo))
+    if(einfo(info->map, &info->exeinfo))
 	info->status = -1;
     else
 	info->status = 1;
+
+    return info->status;
 }
 
 int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
@@ -508,7 +603,7 @@ int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
     const char *ptr;
     uint8_t shash1[SHA1_HASH_SIZE*2+1];
     uint8_t shash256[SHA256_HASH_SIZE*2+1];
-    int have_sha1, have_sha256, do_dsig_check = 1;
+    int have_sha1, have_sha256, got_sha1, got_sha256, do_dsig_check = 1;
     stats_section_t sections;
 
     if(cli_hm_scan(digest, size, &virname, ctx->engine->hm_fp, CLI_HASH_MD5) == CL_VIRUS) {
@@ -538,9 +633,14 @@ int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
     have_sha256 = cli_hm_have_size(ctx->engine->hm_fp, CLI_HASH_SHA256, size)
      || cli_hm_have_wild(ctx->engine->hm_fp, CLI_HASH_SHA256);
     if(have_sha1 || have_sha256) {
-        if((ptr = fmap_need_off_once(map, 0, size))) {
+        /* the digests may already be known from cache_get_MD5() */
+        got_sha1 = have_sha1 && size == map->len && fmap_get_hash(map, CLI_HASH_SHA1, &shash1[SHA1_HASH_SIZE], SHA1_HASH_SIZE);
+        got_sha256 = have_sha256 && size == map->len && fmap_get_hash(map, CLI_HASH_SHA256, &shash256[SHA256_HASH_SIZE], SHA256_HASH_SIZE);
+        ptr = NULL;
+        if((have_sha1 == got_sha1 && have_sha256 == got_sha256) || (ptr = fmap_need_off_once(map, 0, size))) {
             if(have_sha1) {
-                cl_sha1(ptr, size, &shash1[SHA1_HASH_SIZE], NULL);
+                if(!got_sha1)
+                    cl_sha1(ptr, size, &shash1[SHA1_HASH_SIZE], NULL);
 
                 if(cli_hm_scan(&shash1[SHA1_HASH_SIZE], size, &virname, ctx->engine->hm_fp, CLI_HASH_SHA1) == CL_VIRUS) {
                     cli_dbgmsg("cli_checkfp(sha1): Found false positive detection (fp sig: %s)\n", virname);
@@ -557,7 +657,8 @@ int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
             }
 
             if(have_sha256) {
-                cl_sha256(ptr, size, &shash256[SHA256_HASH_SIZE], NULL);
+                if(!got_sha256)
+                    cl_sha256(ptr, size, &shash256[SHA256_HASH_SIZE], NULL);
 
                 if(cli_hm_scan(&shash256[SHA256_HASH_SIZE], size, &virname, ctx->engine->hm_fp, CLI_HASH_SHA256) == CL_VIRUS) {
                     cli_dbgmsg("cli_checkfp(sha256): Found false positive detection (fp sig: %s)\n", virname);
@@ -613,8 +714,12 @@ int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
         }
     }
 
-    if (ctx->engine->cb_hash)
-        ctx->engine->cb_hash(fmap_fd(*ctx->fmap), size, (const unsigned char *)md5, cli_get_last_virus(ctx), ctx->cb_ctx);
+    if (ctx->engine->cb_hash) {
+        if (ctx->member_job)
+            cli_member_hash(ctx->member_job, size, md5);
+        else
+            ctx->engine->cb_hash(fmap_fd(*ctx->fmap), size, (const unsigned char *)md5, cli_get_last_virus(ctx), ctx->cb_ctx);
+    }
 
     if (ctx->engine->cb_stats_add_sample)
         ctx->engine->cb_stats_add_sample(cli_get_last_virus(ctx), digest, size, &sections, ctx->engine->stats_data);
@@ -693,6 +798,7 @@ int cli_scandesc(int desc, cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struc
     fmap_t *map = *ctx->fmap;
 
     if((*ctx->fmap = fmap_check_empty(desc, 0, 0, &empty))) {
+	ctx->nested_maps++;
 	ret = cli_fmap_scandesc(ctx, ftype, ftonly, ftoffset, acmode, acres, NULL);
 	map->dont_cache_flag = (*ctx->fmap)->dont_cache_flag;
 	funmap(*ctx->fmap);
@@ -708,22 +814,36 @@ static int lsig_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data
     unsigned evalcnt = 0;
     uint64_t evalids = 0;
     fmap_t *map = *ctx->fmap;
+    uint64_t fsize = target_info ? (uint64_t)target_info->fsize : map->len;
     struct cli_ac_lsig *ac_lsig = root->ac_lsigtable[lsid];
-    char * exp = ac_lsig->u.logic;
-    char* exp_end = exp + strlen(exp);
+    char *exp = ac_lsig->u.logic;
     int rc;
+    uint64_t sampled = cli_sigprof_start(ctx);
 
     rc = cli_ac_chkmacro(root, acdata, lsid);
     if (rc != CL_SUCCESS)
         return rc;
-    if (cli_ac_chklsig(exp, exp_end, acdata->lsigcnt[lsid], &evalcnt, &evalids, 0) == 1) {
+    if (ac_lsig->ops)
+        rc = cli_ac_runlsig(ac_lsig->ops, ac_lsig->nops, cli_ac_lsigcnt(acdata, lsid));
+    else
+        rc = cli_ac_chklsig(exp, exp + strlen(exp), cli_ac_lsigcnt(acdata, lsid), &evalcnt, &evalids, 0);
+    /* only the condition, the bytecodes and the scans it triggers are apart */
+    cli_sigprof_stop(ctx, CLI_SIGPROF_LSIG, ac_lsig, ac_lsig->virname, sampled);
+    if (rc == 1) {
+        if(cli_debug_flag) {
+            /* the logic of the compiled ones is in the cold store */
+            char *cold = exp ? NULL : cli_cold_get(ctx->engine->cold, ac_lsig->logic_cold);
+
+            cli_dbgmsg("lsig_eval: %s: %s holds\n", ac_lsig->virname, exp ? exp : (cold ? cold : "(logic unavailable)"));
+            free(cold);
+        }
         if(ac_lsig->tdb.container && ac_lsig->tdb.container[0] != ctx->container_type)
             return CL_CLEAN;
-        if(ac_lsig->tdb.filesize && (ac_lsig->tdb.filesize[0] > map->len || ac_lsig->tdb.filesize[1] < map->len))
+        if(ac_lsig->tdb.filesize && (ac_lsig->tdb.filesize[0] > fsize || ac_lsig->tdb.filesize[1] < fsize))
             return CL_CLEAN;
 
         if(ac_lsig->tdb.ep || ac_lsig->tdb.nos) {
-            if(!target_info || target_info->status != 1)
+            if(!target_info || cli_targetinfo_exe(target_info) != 1)
                 return CL_CLEAN;
             if(ac_lsig->tdb.ep && (ac_lsig->tdb.ep[0] > target_info->exeinfo.ep || ac_lsig->tdb.ep[1] < target_info->exeinfo.ep))
                 return CL_CLEAN;
@@ -745,13 +865,13 @@ static int lsig_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data
         }
         
         if(ac_lsig->tdb.icongrp1 || ac_lsig->tdb.icongrp2) {
-            if(!target_info || target_info->status != 1)
+            if(!target_info || cli_targetinfo_exe(target_info) != 1)
                 return CL_CLEAN;
             if(matchicon(ctx, &target_info->exeinfo, ac_lsig->tdb.icongrp1, ac_lsig->tdb.icongrp2) == CL_VIRUS) {
                 if(!ac_lsig->bc_idx) {
                     cli_append_virus(ctx, ac_lsig->virname);
                     return CL_VIRUS;
-                } else if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, ac_lsig->bc_idx, acdata->lsigcnt[lsid], acdata->lsigsuboff_first[lsid], map) == CL_VIRUS) {
+                } else if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, ac_lsig->bc_idx, cli_ac_lsigcnt(acdata, lsid), cli_ac_lsigsuboff_first(acdata, lsid), map) == CL_VIRUS) {
                     return CL_VIRUS;
                 }
             }
@@ -761,7 +881,7 @@ static int lsig_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data
             cli_append_virus(ctx, ac_lsig->virname);
             return CL_VIRUS;
         }
-        if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, ac_lsig->bc_idx, acdata->lsigcnt[lsid], acdata->lsigsuboff_first[lsid], map) == CL_VIRUS) {
+        if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, ac_lsig->bc_idx, cli_ac_lsigcnt(acdata, lsid), cli_ac_lsigsuboff_first(acdata, lsid), map) == CL_VIRUS) {
             return CL_VIRUS;
         }
     }
@@ -775,15 +895,17 @@ static int yara_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data
     struct cli_ac_lsig *ac_lsig = root->ac_lsigtable[lsid];
     int rc;
     YR_SCAN_CONTEXT context = {0};
+    uint64_t sampled = cli_sigprof_start(ctx);
  
     context.fmap = *ctx->fmap;
     context.file_size = (*ctx->fmap)->len;
     if (target_info != NULL) {
-        if (target_info->status == 1)   
+        if (cli_targetinfo_exe(target_info) == 1)
             context.entry_point = target_info->exeinfo.ep;
     }
 
     rc = yr_execute_code(ac_lsig, acdata, &context, 0, 0);
+    cli_sigprof_stop(ctx, CLI_SIGPROF_YARA, ac_lsig, ac_lsig->virname, sampled);
 
     if (rc == CL_VIRUS) {
         if (ac_lsig->flag & CLI_LSIG_FLAG_PRIVATE) {
@@ -796,19 +918,64 @@ static int yara_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data
 }
 #endif
 
+static int exp_eval_one(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acdata, struct cli_target_info *target_info, const char *hash, uint32_t lsid)
+{
+    if (root->ac_lsigtable[lsid]->virname == cli_virname_deleted)
+        return CL_CLEAN;
+    if (root->ac_lsigtable[lsid]->type == CLI_LSIG_NORMAL)
+        return lsig_eval(ctx, root, acdata, target_info, hash, lsid);
+#ifdef HAVE_YARA
+    if (root->ac_lsigtable[lsid]->type == CLI_YARA_NORMAL || root->ac_lsigtable[lsid]->type == CLI_YARA_OFFSET)
+        return yara_eval(ctx, root, acdata, target_info, hash, lsid);
+#endif
+    return CL_CLEAN;
+}
+
+static int exp_lsid_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Only the logical signatures with subsignature hits (the dirty ones) and
+ * those cli_ac_buildlsigs() found true without any can match, the others
+ * are skipped. Both lists are merged so the evaluation order, and so the
+ * reported viruses, stay the same as for a run over the whole table. */
 int cli_exp_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acdata, struct cli_target_info *target_info, const char *hash)
 {
     uint8_t viruses_found = 0;
-    uint32_t i;
+    uint32_t i, j, n, lsid;
     int32_t rc = CL_SUCCESS;
 
-    for(i = 0; i < root->ac_lsigs; i++) {
-        if (root->ac_lsigtable[i]->type == CLI_LSIG_NORMAL)
-            rc = lsig_eval(ctx, root, acdata, target_info, hash, i);
-#ifdef HAVE_YARA
-        else if (root->ac_lsigtable[i]->type == CLI_YARA_NORMAL || root->ac_lsigtable[i]->type == CLI_YARA_OFFSET)
-            rc = yara_eval(ctx, root, acdata, target_info, hash, i);
-#endif
+    if (!root->ac_lsig_always) {
+        for(i = 0; i < root->ac_lsigs; i++) {
+            rc = exp_eval_one(ctx, root, acdata, target_info, hash, i);
+            if (rc == CL_VIRUS) {
+                viruses_found = 1;
+                if (SCAN_ALL)
+                    continue;
+                break;
+            }
+        }
+        if (viruses_found)
+            return CL_VIRUS;
+        return CL_CLEAN;
+    }
+
+    /* cli_ac_chkmacro() may append to the list, past n */
+    n = acdata->lsigmap.used;
+    if (n)
+        cli_qsort(acdata->lsigmap.order, n, sizeof(uint32_t), exp_lsid_cmp);
+    for(i = 0, j = 0; i < n || j < root->ac_lsig_nalways;) {
+        if (j == root->ac_lsig_nalways || (i < n && acdata->lsigmap.order[i] < root->ac_lsig_always[j])) {
+            lsid = acdata->lsigmap.order[i++];
+        } else {
+            lsid = root->ac_lsig_always[j++];
+            if (i < n && acdata->lsigmap.order[i] == lsid)
+                i++;
+        }
+        rc = exp_eval_one(ctx, root, acdata, target_info, hash, lsid);
         if (rc == CL_VIRUS) {
             viruses_found = 1;
             if (SCAN_ALL)
@@ -821,10 +988,260 @@ int cli_exp_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acd
     return CL_CLEAN;
 }
 
-int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, unsigned char *refhash)
+#ifdef CL_THREAD_SAFE
+/* Parallel raw scan of large files (CL_ENGINE_PARALLEL_SCAN).
+ *
+ * Before the regular scan loop, all SCANBUFF windows of the file are probed
+ * by a set of threads with cli_bm_scanbuff() and cli_ac_probebuff(), which
+ * have no side effects on the matching state. cli_fmap_scandesc() then runs
+ * the regular matchers only on the windows with a single-part match or with
+ * a part of a multi-part signature whose last part matches somewhere in the
+ * file (and always on the last window, which also triggers the PCRE pass),
+ * in file order. The other windows can't change the outcome of the scan, so
+ * the result is the same as for a serial scan and partial and logical
+ * signatures need no merging.
+ */
+#define SCANPAR_BATCH 64
+
+struct scanpar_win {
+    uint32_t offset, len;
+    const unsigned char *buff;
+    uint64_t parts;
+    int hit;
+};
+
+struct scanpar {
+    fmap_t *map;
+    const struct cli_matcher *roots[2];
+    struct cli_target_info *info;
+    unsigned int threads;
+    unsigned int acmode;
+    cli_file_t ftype;
+    struct scanpar_win *win;
+    unsigned int nwin, cur, bend, next;
+    uint64_t final;
+    unsigned long hits;
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+    pthread_t tid[CLI_MAX_PARALLEL_SCAN];
+    unsigned int started, gen, busy;
+    int quit;
+};
+
+/* probes the windows of the current batch until none is left */
+static void scanpar_probe(struct scanpar *par)
+{
+    struct scanpar_win *win;
+    uint64_t final = 0;
+    unsigned int i, k;
+
+    while(1) {
+        pthread_mutex_lock(&par->mutex);
+        k = par->next++;
+        pthread_mutex_unlock(&par->mutex);
+        if(k >= par->bend)
+            break;
+
+        win = &par->win[k];
+        if(win->hit)
+            continue;
+        for(i = 0; i < 2; i++) {
+            const struct cli_matcher *root = par->roots[i];
+
+            if(!root)
+                continue;
+            if(!root->ac_only && cli_bm_scanbuff(win->buff, win->len, NULL, NULL, root, win->offset, par->info, NULL, NULL) != CL_CLEAN)
+                win->hit = 1;
+            if(cli_ac_probebuff(win->buff, win->len, root, win->offset, par->acmode, par->ftype, &win->parts, &final))
+                win->hit = 1;
+        }
+    }
+
+    pthread_mutex_lock(&par->mutex);
+    par->final |= final;
+    pthread_mutex_unlock(&par->mutex);
+}
+
+/* the workers live for the whole scan and join each batch as it's posted */
+static void *scanpar_worker(void *arg)
+{
+    struct scanpar *par = (struct scanpar *) arg;
+    unsigned int gen = 0;
+
+    pthread_mutex_lock(&par->mutex);
+    while(1) {
+        while(par->gen == gen && !par->quit)
+            pthread_cond_wait(&par->work, &par->mutex);
+        if(par->quit)
+            break;
+        gen = par->gen;
+        par->busy++;
+        pthread_mutex_unlock(&par->mutex);
+
+        scanpar_probe(par);
+
+        pthread_mutex_lock(&par->mutex);
+        if(!--par->busy)
+            pthread_cond_broadcast(&par->done);
+    }
+    pthread_mutex_unlock(&par->mutex);
+    return NULL;
+}
+
+/* lock and probe the windows [batch, bend) */
+static void scanpar_batch(struct scanpar *par, unsigned int batch, unsigned int bend)
+{
+    unsigned int k;
+    struct scanpar_win *win;
+
+    for(k = batch; k < bend; k++) {
+        win = &par->win[k];
+        win->buff = fmap_need_off(par->map, win->offset, win->len);
+        /* windows that can't be probed are left to the serial scan */
+        if(!win->buff)
+            win->hit = 1;
+    }
+
+    pthread_mutex_lock(&par->mutex);
+    par->next = batch;
+    par->bend = bend;
+    par->gen++;
+    pthread_cond_broadcast(&par->work);
+    pthread_mutex_unlock(&par->mutex);
+    scanpar_probe(par);
+    /* a worker that wakes up late finds the batch empty */
+    pthread_mutex_lock(&par->mutex);
+    while(par->busy)
+        pthread_cond_wait(&par->done, &par->mutex);
+    pthread_mutex_unlock(&par->mutex);
+
+    for(k = batch; k < bend; k++) {
+        win = &par->win[k];
+        if(win->buff)
+            fmap_unneed_off(par->map, win->offset, win->len);
+        win->buff = NULL;
+    }
+}
+
+static void scanpar_stop(struct scanpar *par)
+{
+    unsigned int k;
+
+    pthread_mutex_lock(&par->mutex);
+    par->quit = 1;
+    pthread_cond_broadcast(&par->work);
+    pthread_mutex_unlock(&par->mutex);
+    for(k = 0; k < par->started; k++)
+        pthread_join(par->tid[k], NULL);
+    par->started = 0;
+}
+
+static int scanpar_init(struct scanpar *par, cli_ctx *ctx, const struct cli_matcher *troot, const struct cli_matcher *groot, struct cli_target_info *info, uint32_t maxpatlen, unsigned int acmode, cli_file_t ftype)
+{
+    struct scanpar_win *win;
+    uint32_t offset = 0;
+    unsigned int k;
+
+    memset(par, 0, sizeof(*par));
+    if(ctx->engine->parallel_scan < 2 || (*ctx->fmap)->len < CLI_DEFAULT_PARALLEL_SCAN_FSIZE)
+        return 0;
+
+    par->map = *ctx->fmap;
+    /* same windows and overlap as the serial scan loop */
+    while(offset < par->map->len) {
+        par->nwin++;
+        if(par->map->len - offset < SCANBUFF)
+            break;
+        offset += SCANBUFF - maxpatlen;
+    }
+    if(!(par->win = cli_calloc(par->nwin, sizeof(struct scanpar_win)))) {
+        par->map = NULL;
+        return 0;
+    }
+    if(pthread_mutex_init(&par->mutex, NULL)) {
+        free(par->win);
+        par->map = NULL;
+        return 0;
+    }
+    if(pthread_cond_init(&par->work, NULL)) {
+        pthread_mutex_destroy(&par->mutex);
+        free(par->win);
+        par->map = NULL;
+        return 0;
+    }
+    if(pthread_cond_init(&par->done, NULL)) {
+        pthread_cond_destroy(&par->work);
+        pthread_mutex_destroy(&par->mutex);
+        free(par->win);
+        par->map = NULL;
+        return 0;
+    }
+    for(offset = 0, k = 0; k < par->nwin; k++) {
+        win = &par->win[k];
+        win->offset = offset;
+        win->len = MIN(par->map->len - offset, SCANBUFF);
+        win->hit = win->len < SCANBUFF;
+        offset += SCANBUFF - maxpatlen;
+    }
+
+    par->roots[0] = troot;
+    par->roots[1] = groot;
+    par->info = info;
+    /* the workers share info, so don't leave its parsing to them */
+    if((troot && troot->bm_reloff_num) || (groot && groot->bm_reloff_num))
+        cli_targetinfo_exe(info);
+    par->acmode = acmode;
+    par->ftype = ftype;
+    par->threads = MIN(ctx->engine->parallel_scan, CLI_MAX_PARALLEL_SCAN);
+
+    /* the calling thread probes too, if no worker starts it does it alone */
+    for(k = 1; k < par->threads; k++) {
+        if(pthread_create(&par->tid[par->started], NULL, scanpar_worker, par))
+            break;
+        par->started++;
+    }
+    cli_dbgmsg("cli_fmap_scandesc: parallel scan with %u threads\n", par->started + 1);
+
+    for(k = 0; k < par->nwin; k += SCANPAR_BATCH)
+        scanpar_batch(par, k, MIN(k + SCANPAR_BATCH, par->nwin));
+    scanpar_stop(par);
+    for(k = 0; k < par->nwin; k++) {
+        win = &par->win[k];
+        if(win->parts & par->final)
+            win->hit = 1;
+        if(win->hit)
+            par->hits++;
+    }
+    cli_dbgmsg("cli_fmap_scandesc: parallel scan matched %lu of %u windows\n", par->hits, par->nwin);
+    return 1;
+}
+
+/* returns 0 if the window at offset can't affect the result of the scan */
+static int scanpar_hit(struct scanpar *par, uint32_t offset)
+{
+    while(par->cur < par->nwin && par->win[par->cur].offset < offset)
+        par->cur++;
+    if(par->cur >= par->nwin || par->win[par->cur].offset != offset)
+        return 1;
+    return par->win[par->cur].hit;
+}
+
+static void scanpar_done(struct scanpar *par)
+{
+    if(!par->map)
+        return;
+    free(par->win);
+    pthread_cond_destroy(&par->work);
+    pthread_cond_destroy(&par->done);
+    pthread_mutex_destroy(&par->mutex);
+    par->map = NULL;
+}
+#endif
+
+static int fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, unsigned char *refhash)
 {
     const unsigned char *buff;
-    int ret = CL_CLEAN, type = CL_CLEAN, bytes, compute_hash[CLI_HASH_AVAIL_TYPES];
+    int ret = CL_CLEAN, type = CL_CLEAN, bytes, compute_hash[CLI_HASH_AVAIL_TYPES], have_hash[CLI_HASH_AVAIL_TYPES] = { 0 };
     unsigned int i = 0, j = 0, bm_offmode = 0;
     uint32_t maxpatlen, offset = 0;
     struct cli_ac_data gdata, tdata;
@@ -838,6 +1255,11 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
     const char *virname = NULL;
     uint32_t viruses_found = 0;
     void *md5ctx, *sha1ctx, *sha256ctx;
+    int skip = 0, budget = CL_SUCCESS, merged = 0;
+#ifdef CL_THREAD_SAFE
+    int parallel;
+    struct scanpar par;
+#endif
 
     if(!ctx->engine) {
         cli_errmsg("cli_scandesc: engine == NULL\n");
@@ -868,7 +1290,7 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
         for(i = 1; i < CLI_MTARGETS; i++) {
             for (j = 0; j < cli_mtargets[i].target_count; ++j) {
                 if(cli_mtargets[i].target[j] == ftype) {
-                    troot = ctx->engine->root[i];
+                    troot = cli_getroot(ctx->engine, i);
                     break;
                 }
             }
@@ -890,12 +1312,15 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
             maxpatlen = MAX(troot->maxpatlen, groot->maxpatlen);
         else
             maxpatlen = groot->maxpatlen;
+        /* a single AC pass for both roots, see CL_ENGINE_MERGED_TARGETS */
+        merged = troot && troot->ac_merged;
     }
 
     cli_targetinfo(&info, i, map);
 
     if(!ftonly) {
-        if((ret = cli_ac_initdata(&gdata, groot->ac_partsigs, groot->ac_lsigs, groot->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)) || (ret = cli_ac_caloff(groot, &gdata, &info))) {
+        if((ret = cli_ac_initdata_cached(&gdata, ctx, groot)) || (ret = cli_ac_caloff(groot, &gdata, &info))) {
+            cli_ac_freedata(&gdata);
             if(info.exeinfo.section)
                 free(info.exeinfo.section);
 
@@ -920,7 +1345,8 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
     }
 
     if(troot) {
-        if((ret = cli_ac_initdata(&tdata, troot->ac_partsigs, troot->ac_lsigs, troot->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)) || (ret = cli_ac_caloff(troot, &tdata, &info))) {
+        if((ret = cli_ac_initdata_cached(&tdata, ctx, troot)) || (ret = cli_ac_caloff(troot, &tdata, &info))) {
+            cli_ac_freedata(&tdata);
             if(!ftonly) {
                 cli_ac_freedata(&gdata);
                 cli_pcre_freeoff(&gpoff);
@@ -1005,18 +1431,39 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
         } else {
             compute_hash[CLI_HASH_SHA256] = 0;
         }
+
+        /* reuse the digests computed along with the cache MD5 */
+        for(i = CLI_HASH_MD5; i < CLI_HASH_AVAIL_TYPES; i++) {
+            if(compute_hash[i] && fmap_get_hash(map, i, digest[i], CLI_HASHLEN_MAX)) {
+                compute_hash[i] = 0;
+                have_hash[i] = 1;
+            }
+        }
     }
 
+#ifdef CL_THREAD_SAFE
+    parallel = scanpar_init(&par, ctx, troot, groot, &info, maxpatlen, acmode, ftype);
+#endif
+
     while(offset < map->len) {
+        if((budget = cli_checkbudget(ctx)) != CL_SUCCESS) {
+            /* the digests would only cover a part of the file */
+            memset(compute_hash, 0, sizeof(compute_hash));
+            break;
+        }
         bytes = MIN(map->len - offset, SCANBUFF);
         if(!(buff = fmap_need_off_once(map, offset, bytes)))
             break;
         if(ctx->scanned)
             *ctx->scanned += bytes / CL_COUNT_PRECISION;
+#ifdef CL_THREAD_SAFE
+        if(parallel)
+            skip = !scanpar_hit(&par, offset);
+#endif
 
-        if(troot) {
+        if(troot && !skip) {
                 virname = NULL;
-                ret = matcher_run(troot, buff, bytes, &virname, &tdata, offset, &info, ftype, ftoffset, acmode, PCRE_SCAN_FMAP, acres, map, bm_offmode ? &toff : NULL, &tpoff, ctx);
+                ret = matcher_run(troot, buff, bytes, &virname, &tdata, merged ? &gdata : NULL, offset, &info, ftype, ftoffset, acmode, PCRE_SCAN_FMAP, acres, map, bm_offmode ? &toff : NULL, &tpoff, ctx);
 
             if (virname) {
                 /* virname already appended by matcher_run */
@@ -1040,13 +1487,24 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
                 cl_hash_destroy(md5ctx);
                 cl_hash_destroy(sha1ctx);
                 cl_hash_destroy(sha256ctx);
+#ifdef CL_THREAD_SAFE
+                if(parallel)
+                    scanpar_done(&par);
+#endif
                 return ret;
+            } else if(merged && (acmode & AC_SCAN_FT) && ret >= CL_TYPENO) {
+                /* the file types are generic patterns */
+                if(ret > type)
+                    type = ret;
             }
         }
 
         if(!ftonly) {
             virname = NULL;
-            ret = matcher_run(groot, buff, bytes, &virname, &gdata, offset, &info, ftype, ftoffset, acmode, PCRE_SCAN_FMAP, acres, map, NULL, &gpoff, ctx);
+            if(skip)
+                ret = CL_CLEAN;
+            else
+                ret = matcher_run(groot, buff, bytes, &virname, &gdata, NULL, offset, &info, ftype, ftoffset, merged ? 0 : acmode, PCRE_SCAN_FMAP, acres, map, NULL, &gpoff, ctx);
 
             if (virname) {
                 /* virname already appended by matcher_run */
@@ -1069,6 +1527,10 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
                 cl_hash_destroy(md5ctx);
                 cl_hash_destroy(sha1ctx);
                 cl_hash_destroy(sha256ctx);
+#ifdef CL_THREAD_SAFE
+                if(parallel)
+                    scanpar_done(&par);
+#endif
                 return ret;
             } else if((acmode & AC_SCAN_FT) && ret >= CL_TYPENO) {
                 if(ret > type)
@@ -1096,6 +1558,11 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
         offset += bytes - maxpatlen;
     }
 
+#ifdef CL_THREAD_SAFE
+    if(parallel)
+        scanpar_done(&par);
+#endif
+
     if(!ftonly && hdb) {
         enum CLI_HASH_TYPE hashtype, hashtype2;
 
@@ -1113,6 +1580,9 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
             cl_finish_hash(sha256ctx, digest[CLI_HASH_SHA256]);
             sha256ctx = NULL;
         }
+        for(i = CLI_HASH_MD5; i < CLI_HASH_AVAIL_TYPES; i++)
+            if(have_hash[i])
+                compute_hash[i] = 1;
 
         virname = NULL;
         for(hashtype = CLI_HASH_MD5; hashtype < CLI_HASH_AVAIL_TYPES; hashtype++) {
@@ -1201,10 +1671,414 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
         return CL_VIRUS;
     if(ret == CL_VIRUS)
         return CL_VIRUS;
+    if(budget != CL_SUCCESS)
+        return budget;
 
     return (acmode & AC_SCAN_FT) ? type : CL_CLEAN;
 }
 
+const char cli_virname_deleted[] = "";
+
+static int fmap_scandesc_all(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, unsigned char *refhash)
+{
+    const struct cl_engine *engine = ctx->engine, *extra[2];
+    unsigned long int *scanned = ctx->scanned;
+    struct cli_arena_mark mark;
+    unsigned int i;
+    int ret, pret;
+
+    /* matcher state not served from the per-thread pool lives in the
+     * per-scan arena; inner scans started from here release theirs
+     * before returning, so the marks nest */
+    cli_arena_getmark(&ctx->arena, &mark);
+    ret = fmap_scandesc(ctx, ftype, ftonly, ftoffset, acmode, acres, refhash);
+    cli_arena_release(&ctx->arena, &mark);
+    if(!engine || (ret == CL_VIRUS && !SCAN_ALL))
+        return ret;
+    if(ret != CL_CLEAN && ret != CL_VIRUS && ret < CL_TYPENO)
+        return ret;
+
+    /* signatures added by cl_engine_apply_cdiff() since the last reload and
+     * those of the overlay engine the scan was started with; the file types
+     * were already recognised by the main pass */
+    extra[0] = engine->patch;
+    extra[1] = ctx->overlay;
+    for(i = 0; i < 2; i++) {
+        if(!extra[i])
+            continue;
+        ctx->engine = extra[i];
+        ctx->scanned = NULL;
+        pret = fmap_scandesc(ctx, ftype, ftonly, NULL, acmode & ~AC_SCAN_FT, NULL, refhash);
+        cli_arena_release(&ctx->arena, &mark);
+        ctx->engine = engine;
+        ctx->scanned = scanned;
+        if(pret == CL_CLEAN)
+            continue;
+        ret = pret;
+        if(pret != CL_VIRUS || !SCAN_ALL)
+            break;
+    }
+
+    return ret;
+}
+
+int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, unsigned char *refhash)
+{
+    uint64_t start = profile_matcher_start(ctx);
+    unsigned int phase = probe_phase(ctx, CL_PROBE_MATCH);
+    int ret = fmap_scandesc_all(ctx, ftype, ftonly, ftoffset, acmode, acres, refhash);
+
+    probe_phase(ctx, phase);
+    profile_matcher_stop(ctx, start);
+    return ret;
+}
+
+/* Raw scan of data delivered in file order (see cli_extract_expect()).
+ *
+ * The data goes through the same SCANBUFF windows as in fmap_scandesc(),
+ * overlapping by maxpatlen bytes, so the matchers see what they'd see for
+ * the whole file. That only works with the roots which never look back at
+ * the file: no PCRE, no bytecode triggered by a logical signature, no
+ * handler types or YARA rules and no executable targets. The size of the
+ * data must be known in advance for the offsets relative to the end.
+ *
+ * The virus name of a match is only reported by cli_stream_scan_final(),
+ * once the digests for the false positive check are known. CL_BREAK from
+ * any of these functions means the data has to be scanned as a whole file
+ * after all.
+ */
+struct cli_stream_scan {
+    cli_ctx *ctx;
+    struct cli_matcher *groot, *troot;
+    struct cli_ac_data gdata, tdata;
+    struct cli_target_info info;
+    struct cli_matched_type *ftoffset;
+    struct cli_arena_mark mark;
+    cli_file_t ftype;
+    unsigned int acmode;
+    uint32_t maxpatlen, offset, wlen;
+    uint64_t len;
+    unsigned char *win;
+    const char *virname;
+    void *hctx[CLI_HASH_AVAIL_TYPES];
+    int have_hash[CLI_HASH_AVAIL_TYPES];
+    unsigned char digest[CLI_HASH_AVAIL_TYPES][32];
+};
+
+static const char *stream_hashes[CLI_HASH_AVAIL_TYPES] = { "md5", "sha1", "sha256" };
+
+static int stream_root_ok(const struct cli_matcher *root)
+{
+    uint32_t i;
+
+#if HAVE_PCRE
+    if(root->pcre_metas)
+	return 0;
+#endif
+    if(root->linked_bcs)
+	return 0;
+    for(i = 0; i < root->ac_lsigs; i++) {
+	const struct cli_ac_lsig *lsig = root->ac_lsigtable[i];
+
+	if(lsig->virname == cli_virname_deleted)
+	    continue;
+	if(lsig->type != CLI_LSIG_NORMAL || lsig->bc_idx || lsig->tdb.handlertype)
+	    return 0;
+    }
+    return 1;
+}
+
+int cli_stream_scan_new(struct cli_stream_scan **sp, cli_ctx *ctx, uint64_t fsize, cli_file_t ftype, uint8_t ftonly, unsigned int acmode)
+{
+    const struct cl_engine *engine = ctx->engine;
+    struct cli_matcher *hdb = engine->hm_hdb, *fp = engine->hm_fp;
+    struct cli_stream_scan *s;
+    unsigned int i = 0, j;
+    int compute[CLI_HASH_AVAIL_TYPES] = { 0 };
+    int ret;
+
+    *sp = NULL;
+    if(fsize > INT_MAX - 2)
+	return CL_BREAK;
+    if(!(s = cli_calloc(1, sizeof(*s)))) {
+	cli_errmsg("cli_stream_scan_new: Can't allocate memory for the scan state\n");
+	return CL_EMEM;
+    }
+    s->ctx = ctx;
+    s->ftype = ftype;
+    s->acmode = acmode;
+    if(!ftonly)
+	s->groot = engine->root[0];
+    if(ftype) {
+	for(i = 1; i < CLI_MTARGETS; i++) {
+	    for(j = 0; j < cli_mtargets[i].target_count; ++j) {
+		if(cli_mtargets[i].target[j] == ftype) {
+		    s->troot = cli_getroot(engine, i);
+		    break;
+		}
+	    }
+	    if(s->troot)
+		break;
+	}
+    }
+    if((s->groot && !stream_root_ok(s->groot)) ||
+       (s->troot && (i == 1 || i == 6 || i == 9 || s->troot->bm_offmode || !stream_root_ok(s->troot)))) {
+	free(s);
+	return CL_BREAK;
+    }
+
+    memset(&s->info, 0, sizeof(s->info));
+    s->info.fsize = fsize;
+    cli_hashset_init_noalloc(&s->info.exeinfo.vinfo);
+    cli_arena_getmark(&ctx->arena, &s->mark);
+
+    if(s->groot || s->troot) {
+	s->maxpatlen = MAX(s->groot ? s->groot->maxpatlen : 0, s->troot ? s->troot->maxpatlen : 0);
+	if(!(s->win = cli_malloc(SCANBUFF))) {
+	    cli_stream_scan_free(s);
+	    return CL_EMEM;
+	}
+    }
+    if(s->groot && ((ret = cli_ac_initdata_cached(&s->gdata, ctx, s->groot)) || (ret = cli_ac_caloff(s->groot, &s->gdata, &s->info)))) {
+	cli_stream_scan_free(s);
+	return ret;
+    }
+    if(s->troot && ((ret = cli_ac_initdata_cached(&s->tdata, ctx, s->troot)) || (ret = cli_ac_caloff(s->troot, &s->tdata, &s->info)))) {
+	cli_stream_scan_free(s);
+	return ret;
+    }
+
+    /* the MD5 is always needed for the cache */
+    if(!ftonly) {
+	compute[CLI_HASH_MD5] = 1;
+	compute[CLI_HASH_SHA1] = cli_hm_have_size(hdb, CLI_HASH_SHA1, fsize) || cli_hm_have_wild(hdb, CLI_HASH_SHA1)
+	    || cli_hm_have_size(fp, CLI_HASH_SHA1, fsize) || cli_hm_have_wild(fp, CLI_HASH_SHA1) || cli_hm_have_size(fp, CLI_HASH_SHA1, 1);
+	compute[CLI_HASH_SHA256] = cli_hm_have_size(hdb, CLI_HASH_SHA256, fsize) || cli_hm_have_wild(hdb, CLI_HASH_SHA256)
+	    || cli_hm_have_size(fp, CLI_HASH_SHA256, fsize) || cli_hm_have_wild(fp, CLI_HASH_SHA256);
+    }
+    for(i = CLI_HASH_MD5; i < CLI_HASH_AVAIL_TYPES; i++) {
+	if(compute[i] && !(s->hctx[i] = cl_hash_init(stream_hashes[i]))) {
+	    cli_stream_scan_free(s);
+	    return CL_EMEM;
+	}
+    }
+
+    *sp = s;
+    return CL_SUCCESS;
+}
+
+/* matcher_run() without the PCRE pass and the reporting */
+static int stream_run(struct cli_stream_scan *s, const struct cli_matcher *root, struct cli_ac_data *mdata)
+{
+    const unsigned char *buffer = s->win;
+    uint32_t length = s->wlen, offset = s->offset;
+    struct filter_match_info info;
+    const char *virname = NULL;
+    int32_t pos = 0;
+    int ret;
+
+    if(root->filter) {
+	if(filter_search_ext(root->filter, buffer, length, &info) == -1)
+	    pos = length - root->maxpatlen - 1;
+	else
+	    pos = info.first_match - root->maxpatlen - 1;
+	if(pos < 0)
+	    pos = 0;
+    }
+    if(!root->ac_only) {
+	if(root->bm_offmode)
+	    ret = cli_bm_scanbuff(buffer, length, &virname, NULL, root, offset, &s->info, NULL, s->ctx);
+	else
+	    ret = cli_bm_scanbuff(buffer + pos, length - pos, &virname, NULL, root, offset + pos, &s->info, NULL, s->ctx);
+	if(ret == CL_VIRUS)
+	    s->virname = virname;
+	if(ret != CL_CLEAN)
+	    return ret;
+    }
+    ret = cli_ac_scanbuff(buffer + pos, length - pos, &virname, NULL, NULL, root, mdata, offset + pos, s->ftype, &s->ftoffset, s->acmode, s->ctx);
+    if(ret == CL_VIRUS)
+	s->virname = virname;
+    return ret;
+}
+
+static int stream_window_run(struct cli_stream_scan *s)
+{
+    cli_ctx *ctx = s->ctx;
+    int ret;
+
+    if(ctx->scanned)
+	*ctx->scanned += s->wlen / CL_COUNT_PRECISION;
+    if(s->troot) {
+	ret = stream_run(s, s->troot, &s->tdata);
+	if(ret == CL_VIRUS || ret == CL_EMEM)
+	    return ret;
+    }
+    if(s->groot) {
+	ret = stream_run(s, s->groot, &s->gdata);
+	if(ret == CL_VIRUS || ret == CL_EMEM)
+	    return ret;
+	/* the embedded objects are scanned from the whole file */
+	if((s->acmode & AC_SCAN_FT) && ret >= CL_TYPENO) {
+	    cli_dbgmsg("cli_stream_scan: %s found near offset %u\n", cli_ftname(ret), s->offset);
+	    return CL_BREAK;
+	}
+    }
+    return CL_SUCCESS;
+}
+
+static int stream_window(struct cli_stream_scan *s)
+{
+    uint64_t start = profile_matcher_start(s->ctx);
+    unsigned int phase = probe_phase(s->ctx, CL_PROBE_MATCH);
+    int ret = stream_window_run(s);
+
+    probe_phase(s->ctx, phase);
+    profile_matcher_stop(s->ctx, start);
+    return ret;
+}
+
+int cli_stream_scan_update(struct cli_stream_scan *s, const unsigned char *data, size_t len)
+{
+    unsigned int i;
+    size_t n;
+    int ret;
+
+    if(len > (uint64_t)s->info.fsize - s->len) {
+	cli_dbgmsg("cli_stream_scan: more than the %llu bytes expected\n", (long long unsigned)s->info.fsize);
+	return CL_BREAK;
+    }
+    s->len += len;
+    for(i = CLI_HASH_MD5; i < CLI_HASH_AVAIL_TYPES; i++)
+	if(s->hctx[i])
+	    cl_update_hash(s->hctx[i], (void *)data, len);
+
+    /* after a match only the digests are still needed */
+    while(len && s->win && !s->virname) {
+	n = MIN(len, SCANBUFF - s->wlen);
+	memcpy(s->win + s->wlen, data, n);
+	s->wlen += n;
+	data += n;
+	len -= n;
+	if(s->wlen < SCANBUFF)
+	    break;
+	if((ret = stream_window(s)) != CL_SUCCESS && ret != CL_VIRUS)
+	    return ret;
+	memmove(s->win, s->win + SCANBUFF - s->maxpatlen, s->maxpatlen);
+	s->offset += SCANBUFF - s->maxpatlen;
+	s->wlen = s->maxpatlen;
+    }
+    return CL_SUCCESS;
+}
+
+/* md5, if not NULL, gets the MD5 of the data */
+int cli_stream_scan_final(struct cli_stream_scan *s, unsigned char *md5)
+{
+    cli_ctx *ctx = s->ctx;
+    struct cli_matcher *hdb = ctx->engine->hm_hdb, *fp = ctx->engine->hm_fp;
+    enum CLI_HASH_TYPE hashtype, hashtype2;
+    int ret;
+
+    if(s->len != (uint64_t)s->info.fsize) {
+	cli_dbgmsg("cli_stream_scan: got %llu bytes instead of %llu\n", (long long unsigned)s->len, (long long unsigned)s->info.fsize);
+	return CL_BREAK;
+    }
+    if(s->win && s->wlen && !s->virname && (ret = stream_window(s)) != CL_SUCCESS && ret != CL_VIRUS)
+	return ret;
+    for(hashtype = CLI_HASH_MD5; hashtype < CLI_HASH_AVAIL_TYPES; hashtype++) {
+	if(s->hctx[hashtype]) {
+	    cl_finish_hash(s->hctx[hashtype], s->digest[hashtype]);
+	    s->hctx[hashtype] = NULL;
+	    s->have_hash[hashtype] = 1;
+	}
+    }
+    if(md5 && s->have_hash[CLI_HASH_MD5])
+	memcpy(md5, s->digest[CLI_HASH_MD5], 16);
+
+    if(s->virname) {
+	cli_append_virus(ctx, s->virname);
+	return CL_VIRUS;
+    }
+
+    if(s->groot && hdb) {
+	for(hashtype = CLI_HASH_MD5; hashtype < CLI_HASH_AVAIL_TYPES; hashtype++) {
+	    const char *virname = NULL;
+	    int found = 0;
+
+	    if(!s->have_hash[hashtype])
+		continue;
+	    if(cli_hm_scan(s->digest[hashtype], s->len, &virname, hdb, hashtype) == CL_VIRUS ||
+	       cli_hm_scan_wild(s->digest[hashtype], &virname, hdb, hashtype) == CL_VIRUS)
+		found = 1;
+	    if(found && fp) {
+		for(hashtype2 = CLI_HASH_MD5; hashtype2 < CLI_HASH_AVAIL_TYPES; hashtype2++) {
+		    if(s->have_hash[hashtype2] && (cli_hm_scan(s->digest[hashtype2], s->len, NULL, fp, hashtype2) == CL_VIRUS ||
+						   cli_hm_scan_wild(s->digest[hashtype2], NULL, fp, hashtype2) == CL_VIRUS)) {
+			found = 0;
+			break;
+		    }
+		}
+	    }
+	    if(found) {
+		cli_append_virus(ctx, virname);
+		return CL_VIRUS;
+	    }
+	}
+    }
+
+    if(s->troot && (ret = cli_exp_eval(ctx, s->troot, &s->tdata, &s->info, NULL)) == CL_VIRUS)
+	return ret;
+    if(s->groot)
+	return cli_exp_eval(ctx, s->groot, &s->gdata, &s->info, NULL);
+    return CL_CLEAN;
+}
+
+/* cli_checkfp() with the digests of cli_stream_scan_final(), CL_CLEAN for
+ * a false positive */
+int cli_stream_scan_checkfp(struct cli_stream_scan *s)
+{
+    cli_ctx *ctx = s->ctx;
+    struct cli_matcher *fp = ctx->engine->hm_fp;
+    const char *virname = NULL, *last = cli_get_last_virus(ctx);
+    enum CLI_HASH_TYPE hashtype;
+
+    for(hashtype = CLI_HASH_MD5; hashtype < CLI_HASH_AVAIL_TYPES; hashtype++) {
+	if(!s->have_hash[hashtype])
+	    continue;
+	if(cli_hm_scan(s->digest[hashtype], s->len, &virname, fp, hashtype) == CL_VIRUS ||
+	   cli_hm_scan_wild(s->digest[hashtype], &virname, fp, hashtype) == CL_VIRUS ||
+	   (hashtype == CLI_HASH_SHA1 && (!last || strncmp("W32S.", last, 5)) &&
+	    cli_hm_scan(s->digest[hashtype], 1, &virname, fp, hashtype) == CL_VIRUS)) {
+	    cli_dbgmsg("cli_stream_scan: Found false positive detection (fp sig: %s)\n", virname);
+	    return CL_CLEAN;
+	}
+    }
+    return CL_VIRUS;
+}
+
+void cli_stream_scan_free(struct cli_stream_scan *s)
+{
+    struct cli_matched_type *fpt;
+    unsigned int i;
+
+    if(!s)
+	return;
+    if(s->troot)
+	cli_ac_freedata(&s->tdata);
+    if(s->groot)
+	cli_ac_freedata(&s->gdata);
+    cli_arena_release(&s->ctx->arena, &s->mark);
+    cli_hashset_destroy(&s->info.exeinfo.vinfo);
+    for(i = CLI_HASH_MD5; i < CLI_HASH_AVAIL_TYPES; i++)
+	cl_hash_destroy(s->hctx[i]);
+    while(s->ftoffset) {
+	fpt = s->ftoffset;
+	s->ftoffset = fpt->next;
+	free(fpt);
+    }
+    free(s->win);
+    free(s);
+}
+
 int cli_matchmeta(cli_ctx *ctx, const char *fname, size_t fsizec, size_t fsizer, int encrypted, unsigned int filepos, int res1, void *res2)
 {
 	const struct cli_cdb *cdb;
@@ -34,6 +34,9 @@ struct cli_target_info {
     off_t fsize;
     struct cli_exe_info exeinfo;
     int status; /* 0 == not initialised, 1 == initialised OK, -1 == error */
+    /* exeinfo is parsed from map on first use, see cli_targetinfo_exe() */
+    fmap_t *map;
+    unsigned int target;
 };
 
 #include "matcher-ac.h"
@@ -80,6 +83,15 @@ struct cli_lsig_tdb {
 
 #define CLI_LSIG_FLAG_PRIVATE 0x01
 
+/* logical expression in postfix order, see cli_ac_runlsig() */
+#define CLI_LSIG_MAXDEPTH 32
+struct cli_lsig_op {
+    char op;  /* '&' or '|', 0 for a subsignature count */
+    char mod; /* '=', '<' or '>' on the count, 0 for none */
+    uint16_t id;
+    uint32_t val1, val2;
+};
+
 struct cli_bc;
 struct cli_ac_lsig {
 #define CLI_LSIG_NORMAL 0
@@ -93,6 +105,9 @@ struct cli_ac_lsig {
         char *logic;
         uint8_t *code_start;
     } u;
+    struct cli_lsig_op *ops; /* compiled u.logic, NULL if not */
+    uint16_t nops;
+    uint32_t logic_cold; /* u.logic in engine->cold once compiled, u.logic is then NULL */
     const char *virname;
     struct cli_lsig_tdb tdb;
 };
@@ -109,20 +124,29 @@ struct cli_matcher {
     /* HASH */
     struct cli_hash_patt hm;
     struct cli_hash_wild hwild;
+    struct cli_hm_seg *hmseg;
+    unsigned int hmsegs;
 
     /* Extended Aho-Corasick */
     uint32_t ac_partsigs, ac_nodes, ac_lists, ac_patterns, ac_lsigs;
     struct cli_ac_lsig **ac_lsigtable;
+    uint32_t *ac_lsig_always, ac_lsig_nalways; /* see cli_ac_buildlsigs() */
     struct cli_ac_node *ac_root, **ac_nodetable;
     struct cli_ac_list **ac_listtable;
     struct cli_ac_patt **ac_pattable;
     struct cli_ac_patt **ac_reloff;
     uint32_t ac_reloff_num, ac_absoff_num;
+    uint32_t *ac_ctrans, ac_crows;
+    struct cli_ac_cfinal *ac_cfinal;
+    uint32_t ac_cfinals;
+    struct cli_matcher *ac_merged; /* this root and the generic one, see cli_ac_merge() */
     uint8_t ac_mindepth, ac_maxdepth;
+    const uint8_t *ac_cost; /* byte pair costs, see cli_ac_profile_load() */
     struct filter *filter;
 
     uint16_t maxpatlen;
     uint8_t ac_only;
+    uint8_t lazy; /* 1 = not built yet (CL_ENGINE_LAZY_MATCHERS), 2 = build failed */
 
     /* Perl-Compiled Regular Expressions */
 #if HAVE_PCRE
@@ -188,6 +212,7 @@ static const struct cli_mtarget cli_mtargets[CLI_MTARGETS] =  {
 
 #define CLI_OFF_ANY         0xffffffff
 #define CLI_OFF_NONE	    0xfffffffe
+#define CLI_OFF_LAZY	    0xfffffffd /* relative offset not calculated yet */
 #define CLI_OFF_ABSOLUTE    1
 #define CLI_OFF_EOF_MINUS   2
 #define CLI_OFF_EP_PLUS     3
@@ -203,12 +228,27 @@ int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset,
 int cli_scandesc(int desc, cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres);
 int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, unsigned char *refhash);
 int cli_exp_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acdata, struct cli_target_info *target_info, const char *hash);
-int cli_caloff(const char *offstr, const struct cli_target_info *info, unsigned int target, uint32_t *offdata, uint32_t *offset_min, uint32_t *offset_max);
+int cli_caloff(const char *offstr, struct cli_target_info *info, unsigned int target, uint32_t *offdata, uint32_t *offset_min, uint32_t *offset_max);
 
 int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx);
 
+struct cli_stream_scan;
+int cli_stream_scan_new(struct cli_stream_scan **sp, cli_ctx *ctx, uint64_t fsize, cli_file_t ftype, uint8_t ftonly, unsigned int acmode);
+int cli_stream_scan_update(struct cli_stream_scan *s, const unsigned char *data, size_t len);
+int cli_stream_scan_final(struct cli_stream_scan *s, unsigned char *md5);
+int cli_stream_scan_checkfp(struct cli_stream_scan *s);
+void cli_stream_scan_free(struct cli_stream_scan *s);
+
+/* engine->root[target], built first if it was left to the first scan */
+struct cli_matcher *cli_getroot(const struct cl_engine *engine, unsigned int target);
+
+/* virname of the signatures removed by cl_engine_apply_cdiff(), the
+ * matchers skip them */
+extern const char cli_virname_deleted[];
+
 int cli_matchmeta(cli_ctx *ctx, const char *fname, size_t fsizec, size_t fsizer, int encrypted, unsigned int filepos, int res1, void *res2);
 
 void cli_targetinfo(struct cli_target_info *info, unsigned int target, fmap_t *map);
+int cli_targetinfo_exe(struct cli_target_info *info);
 
 #endif
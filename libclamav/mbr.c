@@ -68,6 +68,7 @@ enum MBR_STATE {
 
 static int mbr_scanextprtn(cli_ctx *ctx, unsigned *prtncount, off_t extlba, 
                            size_t extlbasize, size_t sectorsize);
+static int mbr_scan(cli_ctx *ctx, size_t sectorsize);
 static int mbr_check_mbr(struct mbr_boot_record *record, size_t maplen, size_t sectorsize);
 static int mbr_check_ebr(struct mbr_boot_record *record);
 static int mbr_primary_prtn_intxn(cli_ctx *ctx, struct mbr_boot_record mbr, size_t sectorsize);
@@ -136,6 +137,18 @@ int cli_mbr_check2(cli_ctx *ctx, size_t sectorsize) {
 
 /* sets sectorsize to default value if specified to be 0 */
 int cli_scanmbr(cli_ctx *ctx, size_t sectorsize)
+{
+    int ret, pooled;
+
+    /* the partitions are scanned on the archive member threads */
+    pooled = cli_member_pool_start(ctx);
+    ret = mbr_scan(ctx, sectorsize);
+    if (pooled)
+        ret = cli_member_pool_finish(ctx, ret);
+    return ret;
+}
+
+static int mbr_scan(cli_ctx *ctx, size_t sectorsize)
 {
     struct mbr_boot_record mbr;
     enum MBR_STATE state = SEEN_NOTHING;
@@ -241,8 +254,8 @@ int cli_scanmbr(cli_ctx *ctx, size_t sectorsize)
 
             partoff = mbr.entries[i].firstLBA * sectorsize;
             partsize = mbr.entries[i].numLBA * sectorsize;
-            mbr_parsemsg("cli_map_scan: [%u, +%u)\n", partoff, partsize);
-            ret = cli_map_scan(*ctx->fmap, partoff, partsize, ctx, CL_TYPE_PART_ANY);
+            mbr_parsemsg("cli_member_scan_range: [%u, +%u)\n", partoff, partsize);
+            ret = cli_member_scan_range(ctx, partoff, partsize, CL_TYPE_PART_ANY);
             if (ret != CL_CLEAN) {
                 if ((ctx->options & CL_SCAN_ALLMATCHES) && (ret == CL_VIRUS))
                     detection = CL_VIRUS;
@@ -385,7 +398,7 @@ static int mbr_scanextprtn(cli_ctx *ctx, unsigned *prtncount, off_t extlba, size
                         return CL_EFORMAT;
                     }
 
-                    ret = cli_map_scan(*ctx->fmap, partoff, partsize, ctx, CL_TYPE_PART_ANY);
+                    ret = cli_member_scan_range(ctx, partoff, partsize, CL_TYPE_PART_ANY);
                     if (ret != CL_CLEAN) {
                         if ((ctx->options & CL_SCAN_ALLMATCHES) && (ret == CL_VIRUS))
                             detection = CL_VIRUS;
@@ -54,6 +54,7 @@
 #include "mbox.h"
 #include "clamav.h"
 #include "json_api.h"
+#include "sf_base64decode.h"
 
 #ifndef isblank
 #define isblank(c)	(((c) == ' ') || ((c) == '\t'))
@@ -1964,15 +1965,13 @@ decodeLine(message *m, encoding_type et, const char *line, unsigned char *buf, s
 static void
 sanitiseBase64(char *s)
 {
-	cli_dbgmsg("sanitiseBase64 '%s'\n", s);
-	while(*s)
-		if(base64Table[(unsigned int)(*s & 0xFF)] == 255) {
-			char *p1;
+	char *p1;
 
-			for(p1 = s; p1[0] != '\0'; p1++)
-				p1[0] = p1[1];
-		} else
-			s++;
+	cli_dbgmsg("sanitiseBase64 '%s'\n", s);
+	for(p1 = s; *s; s++)
+		if(base64Table[(unsigned int)(*s & 0xFF)] != 255)
+			*p1++ = *s;
+	*p1 = '\0';
 }
 
 /*
@@ -2009,8 +2008,14 @@ decode(message *m, const char *in, unsigned char *out, unsigned char (*decoder)(
 			assert(m->base64chars <= 3);
 	}
 
-	if(isFast)
+	if(isFast) {
 		/* Fast decoding if not last line */
+		if(decoder == base64) {
+			const size_t done = sf_base64decode_run((const uint8_t *)in, strlen(in), out);
+
+			in += done;
+			out += done / 4 * 3;
+		}
 		while(*in) {
 			b1 = (*decoder)(*in++);
 			b2 = (*decoder)(*in++);
@@ -2028,7 +2033,7 @@ decode(message *m, const char *in, unsigned char *out, unsigned char (*decoder)(
 			*out++ = (b2 << 4) | ((b3 >> 2) & 0xF);
 			*out++ = (b3 << 6) | (b4 & 0x3F);
 		}
-	else if(in == NULL) {	/* flush */
+	} else if(in == NULL) {	/* flush */
 		int nbytes;
 
 		if(m->base64chars == 0)
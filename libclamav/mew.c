@@ -783,7 +783,7 @@ uint32_t lzma_upack_esi_54(struct lzmastate *p, uint32_t old_eax, uint32_t *old_
 }
 
 
-int unmew11(char *src, int off, int ssize, int dsize, uint32_t base, uint32_t vadd, int uselzma, int filedesc)
+int unmew11(char *src, int off, int ssize, int dsize, uint32_t base, uint32_t vadd, int uselzma, struct cli_extract *x)
 {
 	uint32_t entry_point, newedi, loc_ds=dsize, loc_ss=ssize;
 	char *source = src + dsize + off;
@@ -909,7 +909,7 @@ int unmew11(char *src, int off, int ssize, int dsize, uint32_t base, uint32_t va
 		section[0].raw = 0; section[0].rva = vadd;
 		section[0].rsz = section[0].vsz = dsize;
 	}
-	if (!cli_rebuildpe_align(src, section, i, base, entry_point - base, 0, 0, filedesc, 0x1000))
+	if (!cli_rebuildpe_align(src, section, i, base, entry_point - base, 0, 0, x, 0x1000))
 	{
 		cli_dbgmsg("MEW: Rebuilding failed\n");
 		free(section);
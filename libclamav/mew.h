@@ -27,6 +27,7 @@
 #endif
 
 #include "cltypes.h"
+#include "scanners.h"
 
 struct lzmastate {
 	const char *p0;
@@ -38,6 +39,6 @@ int mew_lzma(char *, const char *, uint32_t, uint32_t, uint32_t);
 uint32_t lzma_upack_esi_00(struct lzmastate *, char *, char *, uint32_t);
 uint32_t lzma_upack_esi_50(struct lzmastate *, uint32_t, uint32_t, char **, char *, uint32_t *, char *, uint32_t);
 uint32_t lzma_upack_esi_54(struct lzmastate *, uint32_t, uint32_t *, char **, uint32_t *, char *, uint32_t);
-int unmew11(char *, int, int, int, uint32_t, uint32_t, int, int);
+int unmew11(char *, int, int, int, uint32_t, uint32_t, int, struct cli_extract *);
 
 #endif
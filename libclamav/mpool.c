@@ -72,6 +72,16 @@ static inline void spam(const char *fmt, ...) { UNUSEDPARAM(fmt); }
 #define MIN_FRAGSIZE 262144
 #endif
 
+/* maps are sized and aligned to this when huge pages are requested */
+#define MPOOL_HUGEPAGE_SIZE 2097152
+
+#if !defined(_WIN32) && defined(MAP_HUGETLB)
+#define MPOOL_HUGETLB
+#endif
+#if !defined(_WIN32) && defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+#define MPOOL_THP
+#endif
+
 #if SIZEOF_VOID_P==8
 static const unsigned int fragsz[] = {
     8,
@@ -370,11 +380,26 @@ struct MPMAP {
   struct MPMAP *next;
   size_t size;
   size_t usize;
+  unsigned int hugetlb;
+};
+
+/* Interned virus names, see cli_mpool_virname(). The strings are packed in
+ * blocks of the pool behind a fake frag header which makes mpool_free() a
+ * no-op on them, the index lives on the heap until mpool_flush(). */
+#define MPOOL_NAMEBLOCK 65536
+
+struct mpool_names {
+  const char **slots;
+  size_t mask, count;
+  char *block;
+  size_t used, size;
 };
 
 struct MP {
   size_t psize;
+  unsigned int hugepages;
   struct FRAG *avail[FRAGSBITS];
+  struct mpool_names names;
   union {
       struct MPMAP mpm;
       uint64_t dummy_align;
@@ -480,6 +505,7 @@ void mpool_destroy(struct MP *mp) {
   struct MPMAP *mpm_next = mp->u.mpm.next, *mpm;
   size_t mpmsize;
 
+  free(mp->names.slots);
   while((mpm = mpm_next)) {
     mpmsize = mpm->size;
     mpm_next = mpm->next;
@@ -504,17 +530,56 @@ void mpool_destroy(struct MP *mp) {
   spam("Map destroyed @%p\n", mp);
 }
 
+/* Gives the pages inside the large free frags back to the system; they
+ * read back as zeroes when the frag is reused. With huge pages the kernel
+ * would have to split them, so they are left alone. */
+static size_t mpool_trim(struct MP *mp) {
+    size_t released = 0;
+#if !defined(_WIN32) && defined(HAVE_MADVISE) && defined(MADV_DONTNEED)
+    unsigned int sbits;
+    struct FRAG *f;
+
+    if (mp->hugepages != CL_HUGEPAGES_NONE)
+	return 0;
+    for (sbits = 0; sbits < FRAGSBITS; sbits++) {
+	size_t fsize = from_bits(sbits);
+
+	if (fsize < 2 * mp->psize)
+	    continue;
+	for (f = mp->avail[sbits]; f; f = f->u.next.ptr) {
+	    /* the free list link stays */
+	    char *start = (char *)alignto((size_t)f + sizeof(*f), mp->psize);
+	    char *end = (char *)(((size_t)f + fsize) & ~(mp->psize - 1));
+
+	    if (end > start && !madvise(start, end - start, MADV_DONTNEED))
+		released += end - start;
+	}
+    }
+#else
+    UNUSEDPARAM(mp);
+#endif
+    return released;
+}
+
 void mpool_flush(struct MP *mp) {
-    size_t used = 0, mused;
+    size_t used = 0, mused, released;
     struct MPMAP *mpm_next = mp->u.mpm.next, *mpm;
 
 #ifdef EXIT_ON_FLUSH
     exit(0);
 #endif
 
+    /* the names loaded later are only interned among themselves */
+    free(mp->names.slots);
+    mp->names.slots = NULL;
+    mp->names.mask = mp->names.count = 0;
+
     while((mpm = mpm_next)) {
 	mpm_next = mpm->next;
-	mused = align_to_pagesize(mp, mpm->usize);
+	if(mpm->hugetlb)
+	    mused = alignto(mpm->usize, MPOOL_HUGEPAGE_SIZE);
+	else
+	    mused = align_to_pagesize(mp, mpm->usize);
 	if(mused < mpm->size) {
 #ifdef CL_DEBUG
 	    memset((char *)mpm + mused, FREEPOISON, mpm->size - mused);
@@ -542,10 +607,37 @@ void mpool_flush(struct MP *mp) {
 	mp->u.mpm.size = mused - sizeof(*mp);
     }
     used += mp->u.mpm.size;
-    cli_dbgmsg("pool memory used: %.3f MB\n", used/(1024*1024.0));
+    released = mpool_trim(mp);
+    cli_dbgmsg("pool memory used: %.3f MB (%.3f MB of free frags released)\n", used/(1024*1024.0), released/(1024*1024.0));
     spam("Map flushed @%p, in use: %lu\n", mp, (unsigned long)used);
 }
 
+unsigned int mpool_hugepages(struct MP *mp, unsigned int mode)
+{
+#ifdef MPOOL_THP
+  struct MPMAP *mpm;
+#endif
+
+#ifndef MPOOL_HUGETLB
+  if (mode == CL_HUGEPAGES_EXPLICIT)
+    mode = CL_HUGEPAGES_TRANSPARENT;
+#endif
+#ifndef MPOOL_THP
+  if (mode == CL_HUGEPAGES_TRANSPARENT)
+    mode = CL_HUGEPAGES_NONE;
+#else
+  /* maps allocated so far can't be moved to reserved pages, just advise them */
+  if (mode != CL_HUGEPAGES_NONE) {
+    madvise(mp, mp->u.mpm.size + sizeof(*mp), MADV_HUGEPAGE);
+    for(mpm = mp->u.mpm.next; mpm; mpm = mpm->next)
+      if(!mpm->hugetlb)
+	madvise(mpm, mpm->size, MADV_HUGEPAGE);
+  }
+#endif
+  mp->hugepages = mode;
+  return mode;
+}
+
 int mpool_getstats(const struct cl_engine *eng, size_t *used, size_t *total)
 {
   size_t sum_used = 0, sum_total = 0;
@@ -606,10 +698,64 @@ static void* allocate_aligned(struct MPMAP *mpm, size_t size, unsigned align, co
     return &f->u.a.fake;
 }
 
+/* Maps a chunk of at least *size bytes, using huge pages if requested */
+static struct MPMAP *mpool_newmap(struct MP *mp, size_t *size, unsigned int *hugetlb)
+{
+  void *map;
+  size_t sz = *size;
+
+  *hugetlb = 0;
+#ifndef _WIN32
+  if (mp->hugepages != CL_HUGEPAGES_NONE) {
+    sz = alignto(sz, MPOOL_HUGEPAGE_SIZE);
+#ifdef MPOOL_HUGETLB
+    if (mp->hugepages == CL_HUGEPAGES_EXPLICIT) {
+      map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE|ANONYMOUS_MAP|MAP_HUGETLB, -1, 0);
+      if (map != MAP_FAILED) {
+	*size = sz;
+	*hugetlb = 1;
+	return (struct MPMAP *)map;
+      }
+      cli_dbgmsg("mpool_malloc(): No huge pages available, falling back\n");
+#ifdef MPOOL_THP
+      mp->hugepages = CL_HUGEPAGES_TRANSPARENT;
+#else
+      mp->hugepages = CL_HUGEPAGES_NONE;
+#endif
+    }
+#endif
+#ifdef MPOOL_THP
+    if (mp->hugepages == CL_HUGEPAGES_TRANSPARENT) {
+      /* over-map so the chunk can start on a huge page boundary */
+      map = mmap(NULL, sz + MPOOL_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE|ANONYMOUS_MAP, -1, 0);
+      if (map != MAP_FAILED) {
+	char *start = (char *)alignto((size_t)map, MPOOL_HUGEPAGE_SIZE);
+
+	if (start != (char *)map)
+	  munmap(map, start - (char *)map);
+	munmap(start + sz, (char *)map + MPOOL_HUGEPAGE_SIZE - start);
+	madvise(start, sz, MADV_HUGEPAGE);
+	*size = sz;
+	return (struct MPMAP *)start;
+      }
+    }
+#endif
+  }
+  if ((map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE|ANONYMOUS_MAP, -1, 0)) == MAP_FAILED)
+    return NULL;
+#else
+  if (!(map = VirtualAlloc(NULL, sz, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)))
+    return NULL;
+#endif
+  *size = sz;
+  return (struct MPMAP *)map;
+}
+
 void *mpool_malloc(struct MP *mp, size_t size) {
   size_t align = alignof(size);
   size_t i, needed = align_increase(size+FRAG_OVERHEAD, align);
   const unsigned int sbits = to_bits(needed);
+  unsigned int hugetlb;
   struct FRAG *f = NULL;
   struct MPMAP *mpm = &mp->u.mpm;
 
@@ -657,11 +803,7 @@ void *mpool_malloc(struct MP *mp, size_t size) {
   else
   i = align_to_pagesize(mp, MIN_FRAGSIZE);
 
-#ifndef _WIN32
-  if ((mpm = (struct MPMAP *)mmap(NULL, i, PROT_READ | PROT_WRITE, MAP_PRIVATE|ANONYMOUS_MAP, -1, 0)) == MAP_FAILED) {
-#else
-  if (!(mpm = (struct MPMAP *)VirtualAlloc(NULL, i, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE))) {
-#endif
+  if (!(mpm = mpool_newmap(mp, &i, &hugetlb))) {
     cli_errmsg("mpool_malloc(): Can't allocate memory (%lu bytes).\n", (unsigned long)i);
     spam("failed to alloc %lu bytes (%lu requested)\n", (unsigned long)i, (unsigned long)size);
     return NULL;
@@ -671,6 +813,7 @@ void *mpool_malloc(struct MP *mp, size_t size) {
 #endif
   mpm->size = i;
   mpm->usize = sizeof(*mpm);
+  mpm->hugetlb = hugetlb;
   mpm->next = mp->u.mpm.next;
   mp->u.mpm.next = mpm;
   return allocate_aligned(mpm, size, align, "new map");
@@ -695,6 +838,9 @@ void mpool_free(struct MP *mp, void *ptr) {
 
   spam("free @%p\n", f);
   sbits = f->u.a.sbits;
+  /* interned name, released with the pool */
+  if (sbits == FRAGSBITS)
+    return;
   f = allocbase_fromfrag(f);
 #ifdef CL_DEBUG
   memset(f, FREEPOISON, from_bits(sbits));
@@ -804,7 +950,85 @@ char *cli_mpool_strndup(mpool_t *mp, const char *s, size_t n) {
   return alloc;
 }
 
+static uint32_t mpool_namehash(const char *s, size_t len, const char *suffix, size_t slen) {
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for(i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619U;
+  for(i = 0; i < slen; i++)
+    h = (h ^ (unsigned char)suffix[i]) * 16777619U;
+  return h;
+}
+
+static int mpool_names_grow(struct mpool_names *n) {
+  size_t i, j, mask = n->mask ? n->mask * 2 + 1 : 4095;
+  const char **slots = cli_calloc(mask + 1, sizeof(*slots));
+
+  if(!slots)
+    return 1;
+  for(i = 0; n->slots && i <= n->mask; i++) {
+    if(!n->slots[i])
+      continue;
+    j = mpool_namehash(n->slots[i], strlen(n->slots[i]), NULL, 0) & mask;
+    while(slots[j])
+      j = (j + 1) & mask;
+    slots[j] = n->slots[i];
+  }
+  free(n->slots);
+  n->slots = slots;
+  n->mask = mask;
+  return 0;
+}
+
+/* Returns the single copy of s + suffix in the pool */
+static char *mpool_intern(struct MP *mp, const char *s, size_t len, const char *suffix, size_t slen) {
+  struct mpool_names *n = &mp->names;
+  size_t i, need = len + slen + 1;
+  struct FRAG *f;
+  char *str;
+
+  if(n->count * 2 >= n->mask && mpool_names_grow(n))
+    return NULL;
+  i = mpool_namehash(s, len, suffix, slen) & n->mask;
+  for(; n->slots[i]; i = (i + 1) & n->mask) {
+    const char *c = n->slots[i];
+    if(!memcmp(c, s, len) && !memcmp(c + len, suffix, slen) && !c[len + slen])
+      return (char *)c;
+  }
+
+  n->used = alignto(n->used, 2);
+  if(FRAG_OVERHEAD + need > MPOOL_NAMEBLOCK / 4) {
+    if(!(f = mpool_malloc(mp, FRAG_OVERHEAD + need)))
+      return NULL;
+  } else {
+    if(!n->block || n->used + FRAG_OVERHEAD + need > n->size) {
+      if(!(n->block = mpool_malloc(mp, MPOOL_NAMEBLOCK)))
+        return NULL;
+      n->used = 0;
+      n->size = MPOOL_NAMEBLOCK;
+    }
+    f = (struct FRAG *)(n->block + n->used);
+    n->used += FRAG_OVERHEAD + need;
+  }
+#ifdef CL_DEBUG
+  f->magic = MPOOLMAGIC;
+#endif
+  f->u.a.padding = 0;
+  f->u.a.sbits = FRAGSBITS;
+  str = (char *)&f->u.a.fake;
+  memcpy(str, s, len);
+  memcpy(str + len, suffix, slen);
+  str[len + slen] = '\0';
+
+  n->slots[i] = str;
+  n->count++;
+  return str;
+}
+
 /* #define EXPAND_PUA */
+/* Virus names are interned: equal names share one copy, which mpool_free()
+ * leaves alone. */
 char *cli_mpool_virname(mpool_t *mp, const char *virname, unsigned int official) {
   char *newname, *pt;
 #ifdef EXPAND_PUA
@@ -831,14 +1055,11 @@ char *cli_mpool_virname(mpool_t *mp, const char *virname, unsigned int official)
     }
 #endif
   if(official)
-    return cli_mpool_strdup(mp, virname);
-
-  newname = (char *)mpool_malloc(mp, strlen(virname) + 11 + 1);
-  if(!newname) {
+    newname = mpool_intern(mp, virname, strlen(virname), "", 0);
+  else
+    newname = mpool_intern(mp, virname, strlen(virname), ".UNOFFICIAL", 11);
+  if(!newname)
     cli_errmsg("cli_virname: Can't allocate memory for newname\n");
-    return NULL;
-  }
-  sprintf(newname, "%s.UNOFFICIAL", virname);
   return newname;
 }
 
@@ -41,6 +41,7 @@ char *cli_mpool_virname(mpool_t *mpool, const char *virname, unsigned int offici
 uint16_t *cli_mpool_hex2ui(mpool_t *mpool, const char *hex);
 void mpool_flush(mpool_t *mpool);
 int mpool_getstats(const struct cl_engine *engine, size_t *used, size_t *total);
+unsigned int mpool_hugepages(mpool_t *mpool, unsigned int mode);
 #else /* USE_MPOOL */
 
 typedef void mpool_t;
@@ -56,6 +57,7 @@ typedef void mpool_t;
 #define cli_mpool_hex2ui(mpool, hex) cli_hex2ui(hex)
 #define mpool_flush(val)
 #define mpool_getstats(mpool,used,total) -1
+#define mpool_hugepages(mpool, mode) CL_HUGEPAGES_NONE
 #endif /* USE_MPOOL */
 
 #endif
@@ -810,10 +810,6 @@ static int cli_ole2_summary_json_cleanup(summary_ctx_t *sctx, int retcode)
 
     cli_dbgmsg("in cli_ole2_summary_json_cleanup: %d[%x]\n", retcode, sctx->flags);
 
-    if (sctx->sfmap) {
-        funmap(sctx->sfmap);
-    }
-
     if (sctx->flags) {
         jarr = cli_jsonarray(sctx->summary, "ParseErrors");
 
@@ -872,8 +868,33 @@ static int cli_ole2_summary_json_cleanup(summary_ctx_t *sctx, int retcode)
 
 int cli_ole2_summary_json(cli_ctx *ctx, int fd, int mode)
 {
-    summary_ctx_t sctx;
     STATBUF statbuf;
+    fmap_t *sfmap;
+    int ret;
+
+    if (fd < 0) {
+        cli_dbgmsg("ole2_summary_json: invalid file descriptor\n");
+        return CL_ENULLARG; /* placeholder */
+    }
+
+    if (FSTAT(fd, &statbuf) == -1) {
+        cli_dbgmsg("ole2_summary_json: cannot stat file descriptor\n");
+        return CL_ESTAT;
+    }
+
+    sfmap = fmap(fd, 0, statbuf.st_size);
+    if (!sfmap) {
+        cli_dbgmsg("ole2_summary_json: failed to get fmap\n");
+        return CL_EMAP;
+    }
+    ret = cli_ole2_summary_json_map(ctx, sfmap, mode);
+    funmap(sfmap);
+    return ret;
+}
+
+int cli_ole2_summary_json_map(cli_ctx *ctx, fmap_t *sfmap, int mode)
+{
+    summary_ctx_t sctx;
     off_t foff = 0;
     unsigned char *databuf;
     summary_stub_t sumstub;
@@ -887,11 +908,6 @@ int cli_ole2_summary_json(cli_ctx *ctx, int fd, int mode)
         return CL_ENULLARG;
     }
 
-    if (fd < 0) {
-        cli_dbgmsg("ole2_summary_json: invalid file descriptor\n");
-        return CL_ENULLARG; /* placeholder */
-    }
-
     if (mode < 0 && mode > 2) {
         cli_dbgmsg("ole2_summary_json: invalid mode specified\n");
         return CL_ENULLARG; /* placeholder */
@@ -902,16 +918,7 @@ int cli_ole2_summary_json(cli_ctx *ctx, int fd, int mode)
     sctx.ctx = ctx;
     sctx.mode = mode;
 
-    if (FSTAT(fd, &statbuf) == -1) {
-        cli_dbgmsg("ole2_summary_json: cannot stat file descriptor\n");
-        return CL_ESTAT;
-    }
-
-    sctx.sfmap = fmap(fd, 0, statbuf.st_size);
-    if (!sctx.sfmap) {
-        cli_dbgmsg("ole2_summary_json: failed to get fmap\n");
-        return CL_EMAP;
-    }
+    sctx.sfmap = sfmap;
     sctx.maplen = sctx.sfmap->len;
     cli_dbgmsg("ole2_summary_json: streamsize: %u\n", sctx.maplen);
 
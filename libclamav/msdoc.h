@@ -332,6 +332,7 @@ static const struct codepage_entry codepage_entries[] = {
 };
 
 int cli_ole2_summary_json(cli_ctx *ctx, int fd, int mode);
+int cli_ole2_summary_json_map(cli_ctx *ctx, fmap_t *sfmap, int mode);
 #endif /* HAVE_JSON */
 
 #endif /* __MSDOC_H_ */
@@ -84,16 +84,15 @@ struct msexp_hdr {
     r = 0;
 
 #define WRITEBYTES				\
-    ret = cli_writen(ofd, wbuff, w);		\
-    if(ret == -1 || (unsigned int) ret != w)	\
-	return CL_EWRITE;			\
+    if((ret = cli_extract_write(x, wbuff, w)) != CL_SUCCESS) \
+	return ret;				\
     wbytes += w;				\
     if(wbytes >= fsize)				\
 	return CL_SUCCESS;			\
     w = 0;
 
 
-int cli_msexpand(cli_ctx *ctx, int ofd)
+int cli_msexpand(cli_ctx *ctx, struct cli_extract *x)
 {
 	const struct msexp_hdr *hdr;
 	uint8_t i, mask, bits;
@@ -23,7 +23,8 @@
 #define __MSEXPAND_H
 
 #include "others.h"
+#include "scanners.h"
 
-int cli_msexpand(cli_ctx *ctx, int ofd);
+int cli_msexpand(cli_ctx *ctx, struct cli_extract *x);
 
 #endif
@@ -566,6 +566,26 @@ static int msxml_parse_element(struct msxml_ctx *mxctx, xmlTextReaderPtr reader,
     return (virus ? CL_VIRUS : CL_SUCCESS);
 }
 
+/* Points the reader, or a new one when NULL, at the document in map: a map
+ * in memory is parsed in place. The documents of a container go through the
+ * same reader, which keeps its buffers from one to the next. Returns NULL
+ * when libxml2 fails, the reader passed in is then still the caller's. */
+xmlTextReaderPtr cli_msxml_reader_map(xmlTextReaderPtr reader, fmap_t *map, const char *url)
+{
+    const char *buf;
+
+    if (!map->len || map->len > INT_MAX)
+        return NULL;
+    if (!(buf = fmap_need_off_once(map, 0, map->len)))
+        return NULL;
+
+    if (!reader)
+        return xmlReaderForMemory(buf, (int)map->len, url, NULL, CLAMAV_MIN_XMLREADER_FLAGS);
+    if (xmlReaderNewMemory(reader, buf, (int)map->len, url, NULL, CLAMAV_MIN_XMLREADER_FLAGS))
+        return NULL;
+    return reader;
+}
+
 /* reader initialization and closing handled by caller */
 int cli_msxml_parse_document(cli_ctx *ctx, xmlTextReaderPtr reader, const struct key_entry *keys, const size_t num_keys, uint32_t flags, struct msxml_ctx *mxctx)
 {
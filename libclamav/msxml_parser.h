@@ -88,6 +88,7 @@ struct msxml_ctx {
 };
 
 int cli_msxml_parse_document(cli_ctx *ctx, xmlTextReaderPtr reader, const struct key_entry *keys, const size_t num_keys, uint32_t flags, struct msxml_ctx *mxctx);
+xmlTextReaderPtr cli_msxml_reader_map(xmlTextReaderPtr reader, fmap_t *map, const char *url);
 
 #endif /* HAVE_LIBXML2 */
 
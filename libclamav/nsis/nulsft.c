@@ -55,11 +55,11 @@ enum {
 
 struct nsis_st {
   size_t curpos;
-  int ofd;
+  struct cli_extract x;
   int opened;
   off_t off;
   off_t fullsz;
-  char *dir;
+  char *dir; /* only with leave-temps, for the names of the files */
   uint32_t asz;
   uint32_t hsz;
   uint32_t fno;
@@ -184,10 +184,16 @@ static int nsis_decomp(struct nsis_st *n) {
   return ret;
 }
 
+/* the files are extracted into memory, see cli_extract_init() */
+static void nsis_open(struct nsis_st *n, cli_ctx *ctx) {
+  cli_extract_init(&n->x, ctx, n->dir ? n->ofn : NULL);
+  n->opened = 1;
+}
+
 static int nsis_unpack_next(struct nsis_st *n, cli_ctx *ctx) {
   const unsigned char *ibuf;
   uint32_t size, loops;
-  int ret, gotsome=0;
+  int ret, wret, gotsome=0;
   unsigned char obuf[BUFSIZ];
 
   if (n->eof) {
@@ -198,10 +204,12 @@ static int nsis_unpack_next(struct nsis_st *n, cli_ctx *ctx) {
   if ((ret=cli_checklimits("NSIS", ctx, 0, 0, 0))!=CL_CLEAN)
     return ret;
 
-  if (n->fno)
-    snprintf(n->ofn, 1023, "%s"PATHSEP"content.%.3u", n->dir, n->fno);
-  else
-    snprintf(n->ofn, 1023, "%s"PATHSEP"headers", n->dir);
+  if (n->dir) {
+    if (n->fno)
+      snprintf(n->ofn, 1023, "%s"PATHSEP"content.%.3u", n->dir, n->fno);
+    else
+      snprintf(n->ofn, 1023, "%s"PATHSEP"headers", n->dir);
+  }
 
   n->fno++;
   n->opened = 0;
@@ -236,23 +244,17 @@ static int nsis_unpack_next(struct nsis_st *n, cli_ctx *ctx) {
       cli_dbgmsg("NSIS: cannot read %u bytes"__AT__"\n", size);
       return CL_EREAD;
     }
-  if ((n->ofd=open(n->ofn, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0600))==-1) {
-    cli_errmsg("NSIS: unable to create output file %s - aborting.", n->ofn);
-    return CL_ECREAT;
-  }
-  n->opened = 1;
+    nsis_open(n, ctx);
     n->curpos += size;
     if (loops==size) {
 
-      if (cli_writen(n->ofd, ibuf, size) != (ssize_t) size) {
+      if ((ret=cli_extract_write(&n->x, ibuf, size))!=CL_SUCCESS) {
 	cli_dbgmsg("NSIS: cannot write output file"__AT__"\n");
-	close(n->ofd);
-	return CL_EWRITE;
+	return ret;
       }
     } else {
       if ((ret=nsis_init(n))!=CL_SUCCESS) {
 	cli_dbgmsg("NSIS: decompressor init failed"__AT__"\n");
-	close(n->ofd);
 	return ret;
       }
       
@@ -265,17 +267,15 @@ static int nsis_unpack_next(struct nsis_st *n, cli_ctx *ctx) {
       while ((ret=nsis_decomp(n))==CL_SUCCESS) {
 	if ((size = n->nsis.next_out - obuf)) {
 	  gotsome=1;
-	  if (cli_writen(n->ofd, obuf, size) != (ssize_t) size) {
+	  if ((ret=cli_extract_write(&n->x, obuf, size))!=CL_SUCCESS) {
 	    cli_dbgmsg("NSIS: cannot write output file"__AT__"\n");
-	    close(n->ofd);
 	    nsis_shutdown(n);
-	    return CL_EWRITE;
+	    return ret;
 	  }
 	  n->nsis.next_out = obuf;
 	  n->nsis.avail_out = BUFSIZ;
 	  loops=0;
 	  if ((ret=cli_checklimits("NSIS", ctx, size, 0, 0))!=CL_CLEAN) {
-	    close(n->ofd);
 	    nsis_shutdown(n);
 	    return ret;
 	  }
@@ -290,22 +290,15 @@ static int nsis_unpack_next(struct nsis_st *n, cli_ctx *ctx) {
 
       if (n->nsis.next_out - obuf) {
 	gotsome=1;
-	if (cli_writen(n->ofd, obuf, n->nsis.next_out - obuf) != n->nsis.next_out - obuf) {
+	if ((wret=cli_extract_write(&n->x, obuf, n->nsis.next_out - obuf))!=CL_SUCCESS) {
 	  cli_dbgmsg("NSIS: cannot write output file"__AT__"\n");
-	  close(n->ofd);
-	  return CL_EWRITE;
+	  return wret;
 	}
       }
 
       if (ret != CL_SUCCESS && ret != CL_BREAK) {
 	cli_dbgmsg("NSIS: bad stream"__AT__"\n");
-	if (gotsome) {
-	  ret = CL_SUCCESS;
-	} else {
-	  ret = CL_EMAXSIZE;
-	  close(n->ofd);
-	}
-	return ret;
+	return gotsome ? CL_SUCCESS : CL_EMAXSIZE;
       }
 
     }
@@ -362,20 +355,15 @@ static int nsis_unpack_next(struct nsis_st *n, cli_ctx *ctx) {
     n->nsis.avail_out = MIN(BUFSIZ,size);
     loops = 0;
 
-      if ((n->ofd=open(n->ofn, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0600))==-1) {
-        cli_errmsg("NSIS: unable to create output file %s - aborting.", n->ofn);
-        return CL_ECREAT;
-      }
-      n->opened = 1;
+    nsis_open(n, ctx);
 
     while (size && (ret=nsis_decomp(n))==CL_SUCCESS) {
       unsigned int wsz;
       if ((wsz = n->nsis.next_out - obuf)) {
 	gotsome=1;
-	if (cli_writen(n->ofd, obuf, wsz) != (ssize_t) wsz) {
+	if ((ret=cli_extract_write(&n->x, obuf, wsz))!=CL_SUCCESS) {
 	  cli_dbgmsg("NSIS: cannot write output file"__AT__"\n");
-	  close(n->ofd);
-	  return CL_EWRITE;
+	  return ret;
 	}
 	size-=wsz;
 	loops=0;
@@ -390,26 +378,22 @@ static int nsis_unpack_next(struct nsis_st *n, cli_ctx *ctx) {
 
     if (n->nsis.next_out - obuf) {
       gotsome=1;
-      if (cli_writen(n->ofd, obuf, n->nsis.next_out - obuf) != n->nsis.next_out - obuf) {
+      if ((wret=cli_extract_write(&n->x, obuf, n->nsis.next_out - obuf))!=CL_SUCCESS) {
 	cli_dbgmsg("NSIS: cannot write output file"__AT__"\n");
-	close(n->ofd);
-	return CL_EWRITE;
+	return wret;
       }
     }
 
     if (ret == CL_EFORMAT) {
       cli_dbgmsg("NSIS: bad stream"__AT__"\n");
-      if (!gotsome) {
-	close(n->ofd);
+      if (!gotsome)
 	return CL_EMAXSIZE;
-      } 
     }
 
     if (ret == CL_EFORMAT || ret == CL_BREAK) {
       n->eof=1;
     } else if (ret != CL_SUCCESS) {
       cli_dbgmsg("NSIS: bad stream"__AT__"\n");
-      close(n->ofd);
       return CL_EFORMAT;
     }
     return CL_SUCCESS;
@@ -488,6 +472,22 @@ static int nsis_headers(struct nsis_st *n, cli_ctx *ctx) {
 
 
 
+/* the headers only get the raw scan */
+static int nsis_scan_headers(struct nsis_st *n, cli_ctx *ctx) {
+  fmap_t *map = *ctx->fmap;
+  int ret = CL_EMEM;
+
+  if (!n->x.len)
+    return CL_CLEAN;
+  if ((*ctx->fmap = cli_extract_map(&n->x))) {
+    ret = cli_fmap_scandesc(ctx, 0, 0, NULL, AC_SCAN_VIR, NULL, NULL);
+    map->dont_cache_flag = (*ctx->fmap)->dont_cache_flag;
+    funmap(*ctx->fmap);
+  }
+  *ctx->fmap = map;
+  return ret;
+}
+
 static int cli_nsis_unpack(struct nsis_st *n, cli_ctx *ctx) {
   return (n->fno) ? nsis_unpack_next(n, ctx) : nsis_headers(n, ctx);
 }
@@ -502,16 +502,18 @@ int cli_scannulsft(cli_ctx *ctx, off_t offset) {
     memset(&nsist, 0, sizeof(struct nsis_st));
 
     nsist.off = offset;
-    if (!(nsist.dir = cli_gentemp(ctx->engine->tmpdir)))
-        return CL_ETMPDIR;
-    if(mkdir(nsist.dir, 0700)) {
-	cli_dbgmsg("NSIS: Can't create temporary directory %s\n", nsist.dir);
-	free(nsist.dir);
-	return CL_ETMPDIR;
+    if(ctx->engine->keeptmp) {
+	if (!(nsist.dir = cli_gentemp(ctx->engine->tmpdir)))
+	    return CL_ETMPDIR;
+	if(mkdir(nsist.dir, 0700)) {
+	    cli_dbgmsg("NSIS: Can't create temporary directory %s\n", nsist.dir);
+	    free(nsist.dir);
+	    return CL_ETMPDIR;
+	}
+	cli_dbgmsg("NSIS: Extracting files to %s\n", nsist.dir);
     }
-    
+
     nsist.map = *ctx->fmap;
-    if(ctx->engine->keeptmp) cli_dbgmsg("NSIS: Extracting files to %s\n", nsist.dir);
 
     do {
         ret = cli_nsis_unpack(&nsist, ctx);
@@ -521,21 +523,17 @@ int cli_scannulsft(cli_ctx *ctx, off_t offset) {
         }
 	if (ret == CL_SUCCESS) {
 	  cli_dbgmsg("NSIS: Successully extracted file #%u\n", nsist.fno);
-	  if (lseek(nsist.ofd, 0, SEEK_SET) == -1) {
-          cli_dbgmsg("NSIS: call to lseek() failed\n");
-          free(nsist.dir);
-        return CL_ESEEK;
-      }
 	  if(nsist.fno == 1)
-	    ret=cli_scandesc(nsist.ofd, ctx, 0, 0, NULL, AC_SCAN_VIR, NULL);
+	    ret=nsis_scan_headers(&nsist, ctx);
 	  else
-	    ret=cli_magic_scandesc(nsist.ofd, ctx);
-	  close(nsist.ofd);
-	  if(!ctx->engine->keeptmp)
-	    if(cli_unlink(nsist.ofn)) ret = CL_EUNLINK;
+	    ret=cli_extract_scan(&nsist.x);
 	} else if(ret == CL_EMAXSIZE) {
 	    ret = nsist.solid ? CL_BREAK : CL_SUCCESS;
 	}
+	if(nsist.opened) {
+	  nsist.opened = 0;
+	  if(cli_extract_done(&nsist.x) && ret != CL_VIRUS) ret = CL_EUNLINK;
+	}
     } while(ret == CL_SUCCESS);
 
     if(ret == CL_BREAK || ret == CL_EMAXFILES)
@@ -543,11 +541,7 @@ int cli_scannulsft(cli_ctx *ctx, off_t offset) {
 
     nsis_shutdown(&nsist);
 
-    if(!ctx->engine->keeptmp)
-        cli_rmdirs(nsist.dir);
-
     free(nsist.dir);
 
     return ret;
 }
-
@@ -537,6 +537,167 @@ ole2_get_sbat_data_block(ole2_header_t * hdr, void *buff, int32_t sbat_index)
     return (ole2_read_block(hdr, buff, 1 << hdr->log2_big_block_size, current_block));
 }
 
+/*
+ * A stream of the compound file, seen as a virtual fmap: its sector chain is
+ * resolved once, up to the first bad sector, and the data is read from the
+ * document's map as the fmap pages it in.
+ */
+struct ole2_stream {
+    ole2_header_t  *hdr;
+    off_t          *blocks;     /* file offset of each sector of the stream */
+    uint32_t        nblocks;
+    unsigned int    blksz;
+    size_t          len;
+    int             error;      /* CL_BREAK on a loop in the sector chain */
+};
+
+static off_t
+ole2_block_offset(ole2_header_t * hdr, int32_t blockno)
+{
+    off_t           offset;
+
+    if (blockno < 0)
+        return -1;
+    /* 512 is header size */
+    offset = ((off_t) blockno << hdr->log2_big_block_size) + MAX(512, 1 << hdr->log2_big_block_size);
+    if ((offset < 0) || (offset >= hdr->m_length))
+        return -1;
+    return offset;
+}
+
+/* File offset of the given small block, inside its sbat data block */
+static off_t
+ole2_sbat_offset(ole2_header_t * hdr, int32_t sbat_index)
+{
+    int32_t         block_count, current_block;
+    off_t           offset;
+
+    if (sbat_index < 0)
+        return -1;
+    if (hdr->sbat_root_start < 0) {
+        cli_dbgmsg("No root start block\n");
+        return -1;
+    }
+    block_count = sbat_index / (1 << (hdr->log2_big_block_size - hdr->log2_small_block_size));
+    current_block = hdr->sbat_root_start;
+    while (block_count > 0) {
+        current_block = ole2_get_next_block_number(hdr, current_block);
+        block_count--;
+    }
+    if ((offset = ole2_block_offset(hdr, current_block)) < 0)
+        return -1;
+    return offset + (1 << hdr->log2_small_block_size) * (sbat_index % (1 << (hdr->log2_big_block_size - hdr->log2_small_block_size)));
+}
+
+static int
+ole2_stream_open(ole2_header_t * hdr, property_t * prop, struct ole2_stream *strm)
+{
+    int32_t         current_block, len;
+    bitset_t       *blk_bitset;
+    int             small;
+    off_t           offset;
+
+    memset(strm, 0, sizeof(*strm));
+    strm->hdr = hdr;
+    small = prop->size < (int64_t) hdr->sbat_cutoff;
+    strm->blksz = 1 << (small ? hdr->log2_small_block_size : hdr->log2_big_block_size);
+
+    current_block = prop->start_block;
+    len = prop->size;
+    if ((current_block < 0) || (len <= 0))
+        return CL_SUCCESS;
+
+    strm->blocks = cli_malloc(((len - 1) / strm->blksz + 1) * sizeof(off_t));
+    if (!strm->blocks) {
+        cli_errmsg("OLE2: Unable to allocate memory for the stream block list\n");
+        return CL_EMEM;
+    }
+    if (!(blk_bitset = cli_bitset_init())) {
+        cli_errmsg("OLE2: init bitset failed\n");
+        free(strm->blocks);
+        strm->blocks = NULL;
+        return CL_EMEM;
+    }
+    while ((current_block >= 0) && (len > 0)) {
+        if (current_block > (int32_t) hdr->max_block_no) {
+            cli_dbgmsg("OLE2: Max block number for file size exceeded: %d\n", current_block);
+            break;
+        }
+        /* Check we aren't in a loop */
+        if (cli_bitset_test(blk_bitset, (unsigned long)current_block)) {
+            /* Loop in block list */
+            cli_dbgmsg("OLE2: Block list loop detected\n");
+            strm->error = CL_BREAK;
+            break;
+        }
+        if (!cli_bitset_set(blk_bitset, (unsigned long)current_block)) {
+            strm->error = CL_BREAK;
+            break;
+        }
+        if (small) {
+            if ((offset = ole2_sbat_offset(hdr, current_block)) < 0) {
+                cli_dbgmsg("ole2_get_sbat_data_block failed\n");
+                break;
+            }
+            current_block = ole2_get_next_sbat_block(hdr, current_block);
+        } else {
+            if ((offset = ole2_block_offset(hdr, current_block)) < 0)
+                break;
+            current_block = ole2_get_next_block_number(hdr, current_block);
+        }
+        strm->blocks[strm->nblocks++] = offset;
+        strm->len += MIN((uint32_t) len, strm->blksz);
+        len -= MIN((uint32_t) len, strm->blksz);
+    }
+    cli_bitset_free(blk_bitset);
+    return CL_SUCCESS;
+}
+
+static void
+ole2_stream_close(struct ole2_stream *strm)
+{
+    free(strm->blocks);
+    strm->blocks = NULL;
+}
+
+static off_t
+ole2_stream_pread(void *handle, void *buf, size_t count, off_t offset)
+{
+    struct ole2_stream *strm = handle;
+    unsigned char  *out = buf;
+    size_t          done = 0;
+
+    while (done < count && (size_t)offset + done < strm->len) {
+        size_t          pos = (size_t)offset + done;
+        size_t          skip = pos % strm->blksz, n, avail;
+        off_t           at = strm->blocks[pos / strm->blksz] + skip;
+        const void     *src;
+
+        n = MIN(count - done, MIN(strm->blksz - skip, strm->len - pos));
+        /* bb#11369 - ole2 files may not be a block multiple in size */
+        avail = at < strm->hdr->m_length ? MIN(n, (size_t)(strm->hdr->m_length - at)) : 0;
+        if (avail) {
+            if (!(src = fmap_need_off_once(strm->hdr->map, at, avail))) {
+                cli_dbgmsg("OLE2: failed to read stream data at %lu\n", (unsigned long)at);
+                avail = 0;
+            } else {
+                memcpy(out + done, src, avail);
+            }
+        }
+        memset(out + done + avail, 0, n - avail);
+        done += n;
+    }
+    return done;
+}
+
+static fmap_t *
+ole2_stream_map(struct ole2_stream *strm)
+{
+    if (!strm->len)
+        return NULL;
+    return cl_fmap_open_handle(strm, 0, strm->len, ole2_stream_pread, 1);
+}
+
 static int
 ole2_walk_property_tree(ole2_header_t * hdr, const char *dir, int32_t prop_index,
                         int (*handler) (ole2_header_t * hdr, property_t * prop, const char *dir, cli_ctx * ctx),
@@ -795,12 +956,15 @@ ole2_walk_property_tree(ole2_header_t * hdr, const char *dir, int32_t prop_index
 static int
 handler_writefile(ole2_header_t * hdr, property_t * prop, const char *dir, cli_ctx * ctx)
 {
-    unsigned char  *buff;
-    int32_t         current_block, ofd, len, offset;
+    struct ole2_stream strm;
+    fmap_t         *map;
+    int32_t         ofd;
+    size_t          pos, len;
+    const void     *data;
     char           *name, newname[1024];
-    bitset_t       *blk_bitset;
     char           *hash;
     uint32_t        cnt;
+    int             ret;
 
     UNUSEDPARAM(ctx);
 
@@ -828,88 +992,25 @@ handler_writefile(ole2_header_t * hdr, property_t * prop, const char *dir, cli_c
         cli_errmsg("OLE2 [handler_writefile]: failed to create file: %s\n", newname);
         return CL_SUCCESS;
     }
-    current_block = prop->start_block;
-    len = prop->size;
-
-    buff = (unsigned char *)cli_malloc(1 << hdr->log2_big_block_size);
-    if (!buff) {
-        cli_errmsg("OLE2 [handler_writefile]: Unable to allocate memory for buff: %u\n", 1 << hdr->log2_big_block_size);
+    if (ole2_stream_open(hdr, prop, &strm) != CL_SUCCESS) {
         close(ofd);
         return CL_BREAK;
     }
-    blk_bitset = cli_bitset_init();
-    if (!blk_bitset) {
-        cli_errmsg("OLE2 [handler_writefile]: init bitset failed\n");
-        close(ofd);
-        free(buff);
-        return CL_BREAK;
-    }
-    while ((current_block >= 0) && (len > 0)) {
-        if (current_block > (int32_t) hdr->max_block_no) {
-            cli_dbgmsg("OLE2 [handler_writefile]: Max block number for file size exceeded: %d\n", current_block);
-            close(ofd);
-            free(buff);
-            cli_bitset_free(blk_bitset);
-            return CL_SUCCESS;
-        }
-        /* Check we aren't in a loop */
-        if (cli_bitset_test(blk_bitset, (unsigned long)current_block)) {
-            /* Loop in block list */
-            cli_dbgmsg("OLE2 [handler_writefile]: Block list loop detected\n");
-            close(ofd);
-            free(buff);
-            cli_bitset_free(blk_bitset);
-            return CL_BREAK;
-        }
-        if (!cli_bitset_set(blk_bitset, (unsigned long)current_block)) {
-            close(ofd);
-            free(buff);
-            cli_bitset_free(blk_bitset);
-            return CL_BREAK;
-        }
-        if (prop->size < (int64_t) hdr->sbat_cutoff) {
-            /* Small block file */
-            if (!ole2_get_sbat_data_block(hdr, buff, current_block)) {
-                cli_dbgmsg("OLE2 [handler_writefile]: ole2_get_sbat_data_block failed\n");
-                close(ofd);
-                free(buff);
-                cli_bitset_free(blk_bitset);
-                return CL_SUCCESS;
-            }
-            /* buff now contains the block with N small blocks in it */
-            offset = (1 << hdr->log2_small_block_size) * (current_block % (1 << (hdr->log2_big_block_size - hdr->log2_small_block_size)));
-
-            if (cli_writen(ofd, &buff[offset], MIN(len, 1 << hdr->log2_small_block_size)) != MIN(len, 1 << hdr->log2_small_block_size)) {
-                close(ofd);
-                free(buff);
-                cli_bitset_free(blk_bitset);
-                return CL_BREAK;
-            }
-            len -= MIN(len, 1 << hdr->log2_small_block_size);
-            current_block = ole2_get_next_sbat_block(hdr, current_block);
-        } else {
-            /* Big block file */
-            if (!ole2_read_block(hdr, buff, 1 << hdr->log2_big_block_size, current_block)) {
-                close(ofd);
-                free(buff);
-                cli_bitset_free(blk_bitset);
-                return CL_SUCCESS;
-            }
-            if (cli_writen(ofd, buff, MIN(len, (1 << hdr->log2_big_block_size))) !=
-                    MIN(len, (1 << hdr->log2_big_block_size))) {
-                close(ofd);
-                free(buff);
-                cli_bitset_free(blk_bitset);
-                return CL_BREAK;
+    ret = strm.error;
+    if ((map = ole2_stream_map(&strm))) {
+        for (pos = 0; pos < map->len; pos += len) {
+            if (!(data = fmap_need_off_once_len(map, pos, BUFSIZ, &len)) || !len)
+                break;
+            if ((size_t)cli_writen(ofd, data, len) != len) {
+                ret = CL_BREAK;
+                break;
             }
-            current_block = ole2_get_next_block_number(hdr, current_block);
-            len -= MIN(len, (1 << hdr->log2_big_block_size));
         }
+        funmap(map);
     }
+    ole2_stream_close(&strm);
     close(ofd);
-    free(buff);
-    cli_bitset_free(blk_bitset);
-    return CL_SUCCESS;
+    return ret;
 }
 
 /* enum file Handler - checks for VBA presence */
@@ -1036,26 +1137,15 @@ handler_enum(ole2_header_t * hdr, property_t * prop, const char *dir, cli_ctx *
 }
 
 static int
-likely_mso_stream(int fd)
+likely_mso_stream(fmap_t *map)
 {
-    off_t fsize;
-    unsigned char check[2];
+    const unsigned char *check;
 
-    fsize = lseek(fd, 0, SEEK_END);
-    if (fsize == -1) {
-        cli_dbgmsg("likely_mso_stream: call to lseek() failed\n");
-        return 0;
-    } else if (fsize < 6) {
+    if (map->len < 6)
         return 0;
-    }
 
-    if (lseek(fd, 4, SEEK_SET) == -1) {
-        cli_dbgmsg("likely_mso_stream: call to lseek() failed\n");
-        return 0;
-    }
-
-    if (cli_readn(fd, check, 2) != 2) {
-        cli_dbgmsg("likely_mso_stream: reading from fd failed\n");
+    if (!(check = fmap_need_off_once(map, 4, 2))) {
+        cli_dbgmsg("likely_mso_stream: reading from stream failed\n");
         return 0;
     }
 
@@ -1066,10 +1156,9 @@ likely_mso_stream(int fd)
 }
 
 static int
-scan_mso_stream(int fd, cli_ctx *ctx)
+scan_mso_stream(fmap_t *input, cli_ctx *ctx)
 {
     int zret, ofd, ret = CL_SUCCESS;
-    fmap_t *input;
     off_t off_in = 0;
     size_t count, outsize = 0;
     z_stream zstrm;
@@ -1077,29 +1166,9 @@ scan_mso_stream(int fd, cli_ctx *ctx)
     uint32_t prefix;
     unsigned char inbuf[FILEBUFF], outbuf[FILEBUFF];
 
-    /* fmap the input file for easier manipulation */
-    if (fd < 0) {
-        cli_dbgmsg("scan_mso_stream: Invalid file descriptor argument\n");
-        return CL_ENULLARG;
-    } else {
-        STATBUF statbuf;
-
-        if (FSTAT(fd, &statbuf) == -1) {
-            cli_dbgmsg("scan_mso_stream: Can't stat file descriptor\n");
-            return CL_ESTAT;
-        }
-
-        input = fmap(fd, 0, statbuf.st_size);
-        if (!input) {
-            cli_dbgmsg("scan_mso_stream: Failed to get fmap for input stream\n");
-            return CL_EMAP;
-        }
-    }
-
     /* reserve tempfile for output and scanning */
     if ((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &ofd)) != CL_SUCCESS) {
         cli_errmsg("scan_mso_stream: Can't generate temporary file\n");
-        funmap(input);
         return ret;
     }
 
@@ -1198,18 +1267,16 @@ scan_mso_stream(int fd, cli_ctx *ctx)
         if (cli_unlink(tmpname))
             ret = CL_EUNLINK;
     free(tmpname);
-    funmap(input);
     return ret;
 }
 
 static int
 handler_otf(ole2_header_t * hdr, property_t * prop, const char *dir, cli_ctx * ctx)
 {
-    char           *tempfile, *name = NULL;
-    unsigned char  *buff;
-    int32_t         current_block, len, offset;
-    int             ofd, is_mso, ret;
-    bitset_t       *blk_bitset;
+    struct ole2_stream strm;
+    fmap_t         *map;
+    char           *name = NULL;
+    int             ret;
 
     UNUSEDPARAM(dir);
 
@@ -1219,124 +1286,29 @@ handler_otf(ole2_header_t * hdr, property_t * prop, const char *dir, cli_ctx * c
     }
     print_ole2_property(prop);
 
-    if (!(tempfile = cli_gentemp(ctx ? ctx->engine->tmpdir : NULL)))
-        return CL_EMEM;
-
-    if ((ofd = open(tempfile, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, S_IRWXU)) < 0) {
-        cli_dbgmsg("OLE2: Can't create file %s\n", tempfile);
-        free(tempfile);
-        return CL_ECREAT;
+    if ((ret = ole2_stream_open(hdr, prop, &strm)) != CL_SUCCESS)
+        return ret;
+    if (!(map = ole2_stream_map(&strm))) {
+        ole2_stream_close(&strm);
+        return strm.len ? CL_EMEM : CL_SUCCESS;
     }
-    current_block = prop->start_block;
-    len = prop->size;
 
     if (cli_debug_flag) {
-        if (!name)
-            name = get_property_name2(prop->name, prop->name_size);
-        cli_dbgmsg("OLE2 [handler_otf]: Dumping '%s' to '%s'\n", name, tempfile);
+        name = get_property_name2(prop->name, prop->name_size);
+        cli_dbgmsg("OLE2 [handler_otf]: Scanning '%s' in place (%lu bytes)\n", name, (unsigned long)map->len);
     }
 
-    buff = (unsigned char *)cli_malloc(1 << hdr->log2_big_block_size);
-    if (!buff) {
-        close(ofd);
-        if (name)
-            free(name);
-        cli_unlink(tempfile);
-        free(tempfile);
-        return CL_EMEM;
-    }
-    blk_bitset = cli_bitset_init();
+    if (ctx->engine->keeptmp) {
+        char *tempfile;
+        int ofd;
 
-    if (!blk_bitset) {
-        cli_errmsg("OLE2: OTF handler init bitset failed\n");
-        free(buff);
-        close(ofd);
-        if (name)
-            free(name);
-        if (cli_unlink(tempfile)) {
+        if (fmap_dump_to_file(map, ctx->engine->tmpdir, &tempfile, &ofd) == CL_SUCCESS) {
+            cli_dbgmsg("OLE2 [handler_otf]: Dumped stream to '%s'\n", tempfile);
+            close(ofd);
             free(tempfile);
-            return CL_EUNLINK;
-        }
-        free(tempfile);
-        return CL_BREAK;
-    }
-    while ((current_block >= 0) && (len > 0)) {
-        if (current_block > (int32_t) hdr->max_block_no) {
-            cli_dbgmsg("OLE2: Max block number for file size exceeded: %d\n", current_block);
-            break;
-        }
-        /* Check we aren't in a loop */
-        if (cli_bitset_test(blk_bitset, (unsigned long)current_block)) {
-            /* Loop in block list */
-            cli_dbgmsg("OLE2: Block list loop detected\n");
-            break;
-        }
-        if (!cli_bitset_set(blk_bitset, (unsigned long)current_block)) {
-            break;
-        }
-        if (prop->size < (int64_t) hdr->sbat_cutoff) {
-            /* Small block file */
-            if (!ole2_get_sbat_data_block(hdr, buff, current_block)) {
-                cli_dbgmsg("ole2_get_sbat_data_block failed\n");
-                break;
-            }
-            /* buff now contains the block with N small blocks in it */
-            offset = (1 << hdr->log2_small_block_size) * (current_block % (1 << (hdr->log2_big_block_size - hdr->log2_small_block_size)));
-            if (cli_writen(ofd, &buff[offset], MIN(len, 1 << hdr->log2_small_block_size)) != MIN(len, 1 << hdr->log2_small_block_size)) {
-                close(ofd);
-                if (name)
-                    free(name);
-                free(buff);
-                cli_bitset_free(blk_bitset);
-                if (cli_unlink(tempfile)) {
-                    free(tempfile);
-                    return CL_EUNLINK;
-                }
-                free(tempfile);
-                return CL_BREAK;
-            }
-            len -= MIN(len, 1 << hdr->log2_small_block_size);
-            current_block = ole2_get_next_sbat_block(hdr, current_block);
-        } else {
-            /* Big block file */
-            if (!ole2_read_block(hdr, buff, 1 << hdr->log2_big_block_size, current_block)) {
-                break;
-            }
-            if (cli_writen(ofd, buff, MIN(len, (1 << hdr->log2_big_block_size))) !=
-                    MIN(len, (1 << hdr->log2_big_block_size))) {
-                close(ofd);
-                if (name)
-                    free(name);
-                free(buff);
-                cli_bitset_free(blk_bitset);
-                if (cli_unlink(tempfile)) {
-                    free(tempfile);
-                    return CL_EUNLINK;
-                }
-                free(tempfile);
-                return CL_EWRITE;
-            }
-            current_block = ole2_get_next_block_number(hdr, current_block);
-            len -= MIN(len, (1 << hdr->log2_big_block_size));
         }
     }
 
-    /* defragmenting of ole2 stream complete */
-
-    is_mso = likely_mso_stream(ofd);
-    if (lseek(ofd, 0, SEEK_SET) == -1) {
-        close(ofd);
-        if (name)
-            free(name);
-        if (ctx && !(ctx->engine->keeptmp))
-            cli_unlink(tempfile);
-
-        free(tempfile);
-        free(buff);
-        cli_bitset_free(blk_bitset);
-        return CL_ESEEK;
-    }
-
 #if HAVE_JSON
     /* JSON Output Summary Information */
     if (ctx->options & CL_SCAN_FILE_PROPERTIES && ctx->properties != NULL) {
@@ -1346,30 +1318,20 @@ handler_otf(ole2_header_t * hdr, property_t * prop, const char *dir, cli_ctx * c
             if (!strncmp(name, "_5_summaryinformation", 21)) {
                 cli_dbgmsg("OLE2: detected a '_5_summaryinformation' stream\n");
                 /* JSONOLE2 - what to do if something breaks? */
-                if (cli_ole2_summary_json(ctx, ofd, 0) == CL_ETIMEOUT) {
+                if (cli_ole2_summary_json_map(ctx, map, 0) == CL_ETIMEOUT) {
                     free(name);
-                    close(ofd);
-                    if (ctx && !(ctx->engine->keeptmp))
-                        cli_unlink(tempfile);
-
-                    free(tempfile);
-                    free(buff);
-                    cli_bitset_free(blk_bitset);
+                    funmap(map);
+                    ole2_stream_close(&strm);
                     return CL_ETIMEOUT;
                 }
             }
             if (!strncmp(name, "_5_documentsummaryinformation", 29)) {
                 cli_dbgmsg("OLE2: detected a '_5_documentsummaryinformation' stream\n");
                 /* JSONOLE2 - what to do if something breaks? */
-                if (cli_ole2_summary_json(ctx, ofd, 1) == CL_ETIMEOUT) {
+                if (cli_ole2_summary_json_map(ctx, map, 1) == CL_ETIMEOUT) {
                     free(name);
-                    close(ofd);
-                    if (ctx && !(ctx->engine->keeptmp))
-                        cli_unlink(tempfile);
-
-                    free(tempfile);
-                    free(buff);
-                    cli_bitset_free(blk_bitset);
+                    funmap(map);
+                    ole2_stream_close(&strm);
                     return CL_ETIMEOUT;
                 }
             }
@@ -1380,28 +1342,18 @@ handler_otf(ole2_header_t * hdr, property_t * prop, const char *dir, cli_ctx * c
     if (hdr->is_hwp) {
         if (!name)
             name = get_property_name2(prop->name, prop->name_size);
-        ret = cli_scanhwp5_stream(ctx, hdr->is_hwp, name, ofd);
-    } else if (is_mso < 0) {
-        ret = CL_ESEEK;
-    } else if (is_mso) {
+        ret = cli_scanhwp5_stream(ctx, hdr->is_hwp, name, map);
+    } else if (likely_mso_stream(map)) {
         /* MSO Stream Scan */
-        ret = scan_mso_stream(ofd, ctx);
+        ret = scan_mso_stream(map, ctx);
     } else {
         /* Normal File Scan */
-        ret = cli_magic_scandesc(ofd, ctx);
+        ret = cli_map_scan(map, 0, map->len, ctx, CL_TYPE_ANY);
     }
     if (name)
         free(name);
-    close(ofd);
-    free(buff);
-    cli_bitset_free(blk_bitset);
-    if (ctx && !ctx->engine->keeptmp) {
-        if (cli_unlink(tempfile)) {
-            free(tempfile);
-            return CL_EUNLINK;
-        }
-    }
-    free(tempfile);
+    funmap(map);
+    ole2_stream_close(&strm);
     return ret == CL_VIRUS ? CL_VIRUS : CL_SUCCESS;
 
 }
@@ -99,18 +99,9 @@ static const struct key_entry ooxml_keys[] = {
 };
 static size_t num_ooxml_keys = sizeof(ooxml_keys) / sizeof(struct key_entry);
 
-static int ooxml_updatelimits(int fd, cli_ctx *ctx)
-{
-    STATBUF sb;
-    if (FSTAT(fd, &sb) == -1) {
-        cli_errmsg("ooxml_updatelimits: Can't fstat descriptor %d\n", fd);
-        return CL_ESTAT;
-    }
-
-    return cli_updatelimits(ctx, sb.st_size);
-}
-
-static int ooxml_parse_document(int fd, cli_ctx *ctx)
+/* The property documents of a package go through the same reader, which is
+ * freed by cli_process_ooxml(); cbdata points to it */
+static int ooxml_parse_document(fmap_t *map, cli_ctx *ctx, xmlTextReaderPtr *preader)
 {
     int ret = CL_SUCCESS;
     xmlTextReaderPtr reader = NULL;
@@ -118,15 +109,16 @@ static int ooxml_parse_document(int fd, cli_ctx *ctx)
     cli_dbgmsg("in ooxml_parse_document\n");
 
     /* perform engine limit checks in temporary tracking session */
-    ret = ooxml_updatelimits(fd, ctx);
+    ret = cli_updatelimits(ctx, map->len);
     if (ret != CL_CLEAN)
         return ret;
 
-    reader = xmlReaderForFd(fd, "properties.xml", NULL, CLAMAV_MIN_XMLREADER_FLAGS);
+    reader = cli_msxml_reader_map(*preader, map, "properties.xml");
     if (reader == NULL) {
-        cli_dbgmsg("ooxml_parse_document: xmlReaderForFd error\n");
+        cli_dbgmsg("ooxml_parse_document: xmlReader error\n");
         return CL_SUCCESS; // internal error from libxml2
     }
+    *preader = reader;
 
     ret = cli_msxml_parse_document(ctx, reader, ooxml_keys, num_ooxml_keys, MSXML_FLAG_JSON, NULL);
 
@@ -134,16 +126,15 @@ static int ooxml_parse_document(int fd, cli_ctx *ctx)
         cli_warnmsg("ooxml_parse_document: encountered issue in parsing properties document\n");
 
     xmlTextReaderClose(reader);
-    xmlFreeTextReader(reader);
     return ret;
 }
 
-static int ooxml_core_cb(int fd, cli_ctx *ctx)
+static int ooxml_core_cb(fmap_t *map, cli_ctx *ctx, void *cbdata)
 {
     int ret;
 
     cli_dbgmsg("in ooxml_core_cb\n");
-    ret = ooxml_parse_document(fd, ctx);
+    ret = ooxml_parse_document(map, ctx, (xmlTextReaderPtr *)cbdata);
     if (ret == CL_EPARSE)
         cli_json_parse_error(ctx->wrkproperty, "OOXML_ERROR_CORE_XMLPARSER");
     else if (ret == CL_EFORMAT)
@@ -152,12 +143,12 @@ static int ooxml_core_cb(int fd, cli_ctx *ctx)
     return ret;
 }
 
-static int ooxml_extn_cb(int fd, cli_ctx *ctx)
+static int ooxml_extn_cb(fmap_t *map, cli_ctx *ctx, void *cbdata)
 {
     int ret;
 
     cli_dbgmsg("in ooxml_extn_cb\n");
-    ret = ooxml_parse_document(fd, ctx);
+    ret = ooxml_parse_document(map, ctx, (xmlTextReaderPtr *)cbdata);
     if (ret == CL_EPARSE)
         cli_json_parse_error(ctx->wrkproperty, "OOXML_ERROR_EXTN_XMLPARSER");
     else if (ret == CL_EFORMAT)
@@ -166,7 +157,7 @@ static int ooxml_extn_cb(int fd, cli_ctx *ctx)
     return ret;
 }
 
-static int ooxml_content_cb(int fd, cli_ctx *ctx)
+static int ooxml_content_cb(fmap_t *map, cli_ctx *ctx, void *cbdata)
 {
     int ret = CL_SUCCESS, tmp, toval = 0, state;
     int core=0, extn=0, cust=0, dsig=0;
@@ -181,14 +172,15 @@ static int ooxml_content_cb(int fd, cli_ctx *ctx)
     cli_dbgmsg("in ooxml_content_cb\n");
 
     /* perform engine limit checks in temporary tracking session */
-    ret = ooxml_updatelimits(fd, ctx);
+    ret = cli_updatelimits(ctx, map->len);
     if (ret != CL_CLEAN)
         return ret;
 
-    /* apply a reader to the document */
-    reader = xmlReaderForFd(fd, "[Content_Types].xml", NULL, CLAMAV_MIN_XMLREADER_FLAGS);
+    /* apply a reader to the document, the property documents found through
+     * it share the one in cbdata */
+    reader = cli_msxml_reader_map(NULL, map, "[Content_Types].xml");
     if (reader == NULL) {
-        cli_dbgmsg("ooxml_content_cb: xmlReaderForFd error for ""[Content_Types].xml""\n");
+        cli_dbgmsg("ooxml_content_cb: xmlReader error for ""[Content_Types].xml""\n");
         cli_json_parse_error(ctx->wrkproperty, "OOXML_ERROR_XML_READER_FD");
 
         ctx->scansize = sav_scansize;
@@ -241,7 +233,7 @@ static int ooxml_content_cb(int fd, cli_ctx *ctx)
             else {
                 cli_dbgmsg("ooxml_content_cb: found core properties file \"%s\" @ %x\n", PN, loff);
                 if (!core) {
-                    tmp = unzip_single_internal(ctx, loff, ooxml_core_cb);
+                    tmp = unzip_single_internal(ctx, loff, ooxml_core_cb, cbdata);
                     if (tmp == CL_ETIMEOUT || tmp == CL_EMEM) {
                         ret = tmp;
                     }
@@ -262,7 +254,7 @@ static int ooxml_content_cb(int fd, cli_ctx *ctx)
             else {
                 cli_dbgmsg("ooxml_content_cb: found extended properties file \"%s\" @ %x\n", PN, loff);
                 if (!extn) {
-                    tmp = unzip_single_internal(ctx, loff, ooxml_extn_cb);
+                    tmp = unzip_single_internal(ctx, loff, ooxml_extn_cb, cbdata);
                     if (tmp == CL_ETIMEOUT || tmp == CL_EMEM) {
                         ret = tmp;
                     }
@@ -357,23 +349,24 @@ static const struct key_entry ooxml_hwp_keys[] = {
 };
 static size_t num_ooxml_hwp_keys = sizeof(ooxml_hwp_keys) / sizeof(struct key_entry);
 
-static int ooxml_hwp_cb(int fd, cli_ctx *ctx)
+static int ooxml_hwp_cb(fmap_t *map, cli_ctx *ctx, void *cbdata)
 {
     int ret = CL_SUCCESS;
-    xmlTextReaderPtr reader = NULL;
+    xmlTextReaderPtr reader = NULL, *preader = (xmlTextReaderPtr *)cbdata;
 
     cli_dbgmsg("in ooxml_hwp_cb\n");
 
     /* perform engine limit checks in temporary tracking session */
-    ret = ooxml_updatelimits(fd, ctx);
+    ret = cli_updatelimits(ctx, map->len);
     if (ret != CL_CLEAN)
         return ret;
 
-    reader = xmlReaderForFd(fd, "ooxml_hwp.xml", NULL, CLAMAV_MIN_XMLREADER_FLAGS);
+    reader = cli_msxml_reader_map(*preader, map, "ooxml_hwp.xml");
     if (reader == NULL) {
-        cli_dbgmsg("ooxml_hwp_cb: xmlReaderForFd error\n");
+        cli_dbgmsg("ooxml_hwp_cb: xmlReader error\n");
         return CL_SUCCESS; // internal error from libxml2
     }
+    *preader = reader;
 
     ret = cli_msxml_parse_document(ctx, reader, ooxml_hwp_keys, num_ooxml_hwp_keys, MSXML_FLAG_JSON, NULL);
 
@@ -381,7 +374,6 @@ static int ooxml_hwp_cb(int fd, cli_ctx *ctx)
         cli_warnmsg("ooxml_hwp_cb: encountered issue in parsing properties document\n");
 
     xmlTextReaderClose(reader);
-    xmlFreeTextReader(reader);
     return ret;
 }
 
@@ -430,6 +422,7 @@ int cli_process_ooxml(cli_ctx *ctx, int type)
 #if HAVE_LIBXML2 && HAVE_JSON
     uint32_t loff = 0;
     int ret = CL_SUCCESS;
+    xmlTextReaderPtr reader = NULL;
 
     cli_dbgmsg("in cli_process_ooxml\n");
     if (!ctx) {
@@ -448,21 +441,21 @@ int cli_process_ooxml(cli_ctx *ctx, int type)
             cli_json_parse_error(ctx->wrkproperty, "OOXML_ERROR_NO_HWP_VERSION");
             return CL_EFORMAT;
         }
-        ret = unzip_single_internal(ctx, loff, ooxml_hwp_cb);
+        ret = unzip_single_internal(ctx, loff, ooxml_hwp_cb, &reader);
 
         if (ret == CL_SUCCESS) {
             ret = unzip_search_single(ctx, "Contents/content.hpf", 20, &loff);
-            if (ret == CL_ETIMEOUT) {
-                cli_json_parse_error(ctx->wrkproperty, "OOXML_ERROR_TIMEOUT");
-                return CL_ETIMEOUT;
+            if (ret == CL_VIRUS) {
+                ret = unzip_single_internal(ctx, loff, ooxml_hwp_cb, &reader);
             }
-            else if (ret != CL_VIRUS) {
+            else if (ret != CL_ETIMEOUT) {
                 cli_dbgmsg("cli_process_ooxml: failed to find ""Contents/content.hpf""!\n");
                 cli_json_parse_error(ctx->wrkproperty, "OOXML_ERROR_NO_HWP_CONTENT");
-                return CL_EFORMAT;
+                ret = CL_EFORMAT;
             }
-            ret = unzip_single_internal(ctx, loff, ooxml_hwp_cb);
         }
+        if (reader)
+            xmlFreeTextReader(reader);
     } else {
         /* find "[Content Types].xml" */
         ret = unzip_search_single(ctx, "[Content_Types].xml", 19, &loff);
@@ -477,7 +470,9 @@ int cli_process_ooxml(cli_ctx *ctx, int type)
         }
         cli_dbgmsg("cli_process_ooxml: found ""[Content_Types].xml"" @ %x\n", loff);
 
-        ret = unzip_single_internal(ctx, loff, ooxml_content_cb);
+        ret = unzip_single_internal(ctx, loff, ooxml_content_cb, &reader);
+        if (reader)
+            xmlFreeTextReader(reader);
     }
 
     if (ret == CL_ETIMEOUT)
@@ -81,9 +81,9 @@
 #include "readdb.h"
 #include "stats.h"
 
-int (*cli_unrar_open)(int fd, const char *dirname, unrar_state_t *state);
+int (*cli_unrar_open)(unrar_pread_cb_t pread_cb, void *handle, off_t start, const char *dirname, unrar_state_t *state);
 int (*cli_unrar_extract_next_prepare)(unrar_state_t *state, const char *dirname);
-int (*cli_unrar_extract_next)(unrar_state_t *state, const char *dirname);
+int (*cli_unrar_extract_next)(unrar_state_t *state);
 void (*cli_unrar_close)(unrar_state_t *state);
 int have_rar = 0;
 static int is_rar_initd = 0;
@@ -180,9 +180,9 @@ static void cli_rarload(void) {
     if (!rhandle)
 	return;
 
-    if (!(cli_unrar_open = (int(*)(int, const char *, unrar_state_t *))lt_dlsym(rhandle, "libclamunrar_iface_LTX_unrar_open")) ||
+    if (!(cli_unrar_open = (int(*)(unrar_pread_cb_t, void *, off_t, const char *, unrar_state_t *))lt_dlsym(rhandle, "libclamunrar_iface_LTX_unrar_open")) ||
 	!(cli_unrar_extract_next_prepare = (int(*)(unrar_state_t *, const char *))lt_dlsym(rhandle, "libclamunrar_iface_LTX_unrar_extract_next_prepare")) ||
-	!(cli_unrar_extract_next = (int(*)(unrar_state_t *, const char *))lt_dlsym(rhandle, "libclamunrar_iface_LTX_unrar_extract_next")) ||
+	!(cli_unrar_extract_next = (int(*)(unrar_state_t *))lt_dlsym(rhandle, "libclamunrar_iface_LTX_unrar_extract_next")) ||
 	!(cli_unrar_close = (void(*)(unrar_state_t *))lt_dlsym(rhandle, "libclamunrar_iface_LTX_unrar_close"))
 	) {
 	/* ideally we should never land here, we'd better warn so */
@@ -329,6 +329,8 @@ struct cl_engine *cl_engine_new(void)
 
     /* Setup default limits */
     new->maxscansize = CLI_DEFAULT_MAXSCANSIZE;
+    new->cache_size = CLI_DEFAULT_CACHE_SIZE;
+    new->extract_mem = CLI_DEFAULT_EXTRACT_MEM;
     new->maxfilesize = CLI_DEFAULT_MAXFILESIZE;
     new->maxreclevel = CLI_DEFAULT_MAXRECLEVEL;
     new->maxfiles = CLI_DEFAULT_MAXFILES;
@@ -407,8 +409,7 @@ struct cl_engine *cl_engine_new(void)
     /* Set up default stats/intel gathering callbacks */
     intel = cli_calloc(1, sizeof(cli_intel_t));
     if ((intel)) {
-#ifdef CL_THREAD_SAFE
-        if (pthread_mutex_init(&(intel->mutex), NULL)) {
+        if (clamav_stats_init(intel)) {
             cli_errmsg("cli_engine_new: Cannot initialize stats gathering mutex\n");
 	    mpool_free(new->mempool, new->pwdbs);
             mpool_free(new->mempool, new->dconf);
@@ -420,7 +421,6 @@ struct cl_engine *cl_engine_new(void)
             free(intel);
             return NULL;
         }
-#endif
         intel->engine = new;
         intel->maxsamples = STATS_MAX_SAMPLES;
         intel->maxmem = STATS_MAX_MEM;
@@ -476,6 +476,134 @@ struct cl_engine *cl_engine_new(void)
     return new;
 }
 
+/* Memory held by the decompressors of all the scans of an engine. The
+ * count is kept with atomics; the mutex and the condition are only used by
+ * the scans waiting for room, see CL_ENGINE_MAX_DECOMPRESS_MEM. */
+struct cli_memgov {
+    uint64_t used;
+    unsigned int waiters;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+    pthread_cond_t freed;
+#endif
+};
+
+/* longest wait for the other scans to release some memory, in ms */
+#define MEMGOV_WAIT 2000
+
+static int memgov_init(struct cl_engine *engine)
+{
+    struct cli_memgov *gov;
+
+    if (engine->memgov)
+	return CL_SUCCESS;
+    if (!(gov = cli_calloc(1, sizeof(*gov))))
+	return CL_EMEM;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_init(&gov->mutex, NULL);
+    pthread_cond_init(&gov->freed, NULL);
+#endif
+    engine->memgov = gov;
+    return CL_SUCCESS;
+}
+
+void cli_memgov_free(struct cl_engine *engine)
+{
+    struct cli_memgov *gov = engine->memgov;
+
+    if (!gov)
+	return;
+#ifdef CL_THREAD_SAFE
+    pthread_cond_destroy(&gov->freed);
+    pthread_mutex_destroy(&gov->mutex);
+#endif
+    free(gov);
+    engine->memgov = NULL;
+}
+
+static int memgov_take(struct cli_memgov *gov, uint64_t size, uint64_t max)
+{
+    uint64_t used;
+
+    while ((used = gov->used) <= max && size <= max - used)
+	if (__sync_bool_compare_and_swap(&gov->used, used, used + size))
+	    return 1;
+    return 0;
+}
+
+/* Takes size bytes out of the engine's budget. With wait the scan may
+ * block a while (never past its time limit) for the other scans to free
+ * some; the caller then degrades as it sees fit. */
+int cli_memgov_reserve(cli_ctx *ctx, uint64_t size, int wait)
+{
+    const struct cl_engine *engine = ctx->engine;
+    struct cli_memgov *gov = engine->memgov;
+    uint64_t max = engine->max_decompress_mem;
+
+    if (!gov || !size)
+	return CL_SUCCESS;
+    if (!max) {
+	__sync_fetch_and_add(&gov->used, size);
+	return CL_SUCCESS;
+    }
+    if (memgov_take(gov, size, max))
+	return CL_SUCCESS;
+#ifdef CL_THREAD_SAFE
+    if (wait && size <= max) {
+	uint32_t ms = cli_budget_remaining(ctx);
+	struct timespec ts;
+	struct timeval tv;
+	int got = 0;
+
+	if (ms > MEMGOV_WAIT)
+	    ms = MEMGOV_WAIT;
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + ms / 1000;
+	ts.tv_nsec = (tv.tv_usec + (ms % 1000) * 1000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+	cli_dbgmsg("cli_memgov: waiting for %llu bytes\n", (long long unsigned)size);
+	pthread_mutex_lock(&gov->mutex);
+	__sync_fetch_and_add(&gov->waiters, 1);
+	while (!(got = memgov_take(gov, size, max)))
+	    if (pthread_cond_timedwait(&gov->freed, &gov->mutex, &ts) == ETIMEDOUT)
+		break;
+	__sync_fetch_and_sub(&gov->waiters, 1);
+	pthread_mutex_unlock(&gov->mutex);
+	if (got || memgov_take(gov, size, max))
+	    return CL_SUCCESS;
+    }
+#else
+    UNUSEDPARAM(wait);
+#endif
+    cli_dbgmsg("cli_memgov: no room for %llu bytes (%llu of %llu in use)\n",
+	       (long long unsigned)size, (long long unsigned)gov->used, (long long unsigned)max);
+    cli_usage_limit(ctx, CL_LIMIT_MEMORY);
+    return CL_EMEM;
+}
+
+void cli_memgov_release(const struct cl_engine *engine, uint64_t size)
+{
+    struct cli_memgov *gov = engine->memgov;
+    uint64_t used;
+
+    if (!gov || !size)
+	return;
+    /* the limit may have been set after the reservation */
+    do {
+	used = gov->used;
+    } while (!__sync_bool_compare_and_swap(&gov->used, used, used > size ? used - size : 0));
+#ifdef CL_THREAD_SAFE
+    if (gov->waiters) {
+	pthread_mutex_lock(&gov->mutex);
+	pthread_cond_broadcast(&gov->freed);
+	pthread_mutex_unlock(&gov->mutex);
+    }
+#endif
+}
+
 int cl_engine_set_num(struct cl_engine *engine, enum cl_engine_field field, long long num)
 {
     if(!engine)
@@ -646,6 +774,78 @@ int cl_engine_set_num(struct cl_engine *engine, enum cl_engine_field field, long
 		engine->engine_options &= ~(ENGINE_OPTIONS_PE_DUMPCERTS);
 	    }
 	    break;
+	case CL_ENGINE_PARALLEL_SCAN:
+	    engine->parallel_scan = (uint32_t)num;
+	    break;
+	case CL_ENGINE_CACHE_SIZE:
+	    engine->cache_size = (uint32_t)num;
+	    break;
+	case CL_ENGINE_HUGEPAGES:
+	    if(num < CL_HUGEPAGES_NONE || num > CL_HUGEPAGES_EXPLICIT) {
+		cli_errmsg("cl_engine_set_num: Invalid huge pages mode %lld\n", num);
+		return CL_EARG;
+	    }
+	    engine->hugepages = mpool_hugepages(engine->mempool, (unsigned int)num);
+	    if(engine->hugepages != num)
+		cli_warnmsg("cl_engine_set_num: Huge pages mode %u not supported, using %u\n", (unsigned int)num, engine->hugepages);
+	    break;
+	case CL_ENGINE_LOAD_THREADS:
+	    if(num > CLI_MAX_LOAD_THREADS) {
+		cli_warnmsg("cl_engine_set_num: Limiting database load threads to %u\n", CLI_MAX_LOAD_THREADS);
+		num = CLI_MAX_LOAD_THREADS;
+	    }
+	    engine->load_threads = (uint32_t)num;
+	    break;
+	case CL_ENGINE_LAZY_MATCHERS:
+	    engine->lazy_matchers = num ? 1 : 0;
+	    break;
+	case CL_ENGINE_EXTRACT_MEM:
+	    engine->extract_mem = num;
+	    break;
+	case CL_ENGINE_ARCHIVE_THREADS:
+	    if(num > CLI_MAX_ARCHIVE_THREADS) {
+		cli_warnmsg("cl_engine_set_num: Limiting archive scan threads to %u\n", CLI_MAX_ARCHIVE_THREADS);
+		num = CLI_MAX_ARCHIVE_THREADS;
+	    }
+	    engine->archive_threads = (uint32_t)num;
+	    break;
+	case CL_ENGINE_CPU_LIMIT:
+	    engine->cpu_limit = (uint32_t)num;
+	    break;
+	case CL_ENGINE_MAX_INFLATED:
+	    engine->max_inflated = (uint64_t)num;
+	    break;
+	case CL_ENGINE_DECOMPRESS_THREADS:
+	    if(num > CLI_MAX_DECOMPRESS_THREADS) {
+		cli_warnmsg("cl_engine_set_num: Limiting decompression threads to %u\n", CLI_MAX_DECOMPRESS_THREADS);
+		num = CLI_MAX_DECOMPRESS_THREADS;
+	    }
+	    engine->decompress_threads = (uint32_t)num;
+	    break;
+	case CL_ENGINE_SIGPROF_RATE:
+	    engine->sigprof_rate = (uint32_t)num;
+	    break;
+	case CL_ENGINE_FUSED_SCAN:
+	    engine->fused_scan = num ? 1 : 0;
+	    break;
+	case CL_ENGINE_MERGED_TARGETS:
+	    /* the generic root is target 0 */
+	    engine->merged_targets = (uint32_t)num & ~1U & ((1U << CLI_MTARGETS) - 1);
+	    break;
+	case CL_ENGINE_ARCHIVE_ORDER:
+	    engine->archive_order = num ? 1 : 0;
+	    break;
+	case CL_ENGINE_SHARD_INDEX:
+	    engine->shard_index = (uint32_t)num;
+	    break;
+	case CL_ENGINE_SHARD_COUNT:
+	    engine->shard_count = (uint32_t)num;
+	    break;
+	case CL_ENGINE_MAX_DECOMPRESS_MEM:
+	    if (num && memgov_init(engine) != CL_SUCCESS)
+		return CL_EMEM;
+	    engine->max_decompress_mem = (uint64_t)num;
+	    break;
 	default:
 	    cli_errmsg("cl_engine_set_num: Incorrect field number\n");
 	    return CL_EARG;
@@ -729,6 +929,40 @@ long long cl_engine_get_num(const struct cl_engine *engine, enum cl_engine_field
 	    return engine->pcre_recmatch_limit;
 	case CL_ENGINE_PCRE_MAX_FILESIZE:
 	    return engine->pcre_max_filesize;
+	case CL_ENGINE_PARALLEL_SCAN:
+	    return engine->parallel_scan;
+	case CL_ENGINE_CACHE_SIZE:
+	    return engine->cache_size;
+	case CL_ENGINE_HUGEPAGES:
+	    return engine->hugepages;
+	case CL_ENGINE_LOAD_THREADS:
+	    return engine->load_threads;
+	case CL_ENGINE_LAZY_MATCHERS:
+	    return engine->lazy_matchers;
+	case CL_ENGINE_EXTRACT_MEM:
+	    return engine->extract_mem;
+	case CL_ENGINE_ARCHIVE_THREADS:
+	    return engine->archive_threads;
+	case CL_ENGINE_CPU_LIMIT:
+	    return engine->cpu_limit;
+	case CL_ENGINE_MAX_INFLATED:
+	    return engine->max_inflated;
+	case CL_ENGINE_DECOMPRESS_THREADS:
+	    return engine->decompress_threads;
+	case CL_ENGINE_SIGPROF_RATE:
+	    return engine->sigprof_rate;
+	case CL_ENGINE_FUSED_SCAN:
+	    return engine->fused_scan;
+	case CL_ENGINE_MERGED_TARGETS:
+	    return engine->merged_targets;
+	case CL_ENGINE_ARCHIVE_ORDER:
+	    return engine->archive_order;
+	case CL_ENGINE_SHARD_INDEX:
+	    return engine->shard_index;
+	case CL_ENGINE_SHARD_COUNT:
+	    return engine->shard_count;
+	case CL_ENGINE_MAX_DECOMPRESS_MEM:
+	    return engine->max_decompress_mem;
 	default:
 	    cli_errmsg("cl_engine_get: Incorrect field number\n");
 	    if(err)
@@ -753,6 +987,21 @@ int cl_engine_set_str(struct cl_engine *engine, enum cl_engine_field field, cons
 	    if(!engine->tmpdir)
 		return CL_EMEM;
 	    break;
+	case CL_ENGINE_CACHE_FILE:
+	    engine->cache_file = cli_mpool_strdup(engine->mempool, str);
+	    if(!engine->cache_file)
+		return CL_EMEM;
+	    break;
+	case CL_ENGINE_HASH_IMAGE:
+	    engine->hash_image = cli_mpool_strdup(engine->mempool, str);
+	    if(!engine->hash_image)
+		return CL_EMEM;
+	    break;
+	case CL_ENGINE_AC_PROFILE:
+	    engine->ac_profile = cli_mpool_strdup(engine->mempool, str);
+	    if(!engine->ac_profile)
+		return CL_EMEM;
+	    break;
 	default:
 	    cli_errmsg("cl_engine_set_num: Incorrect field number\n");
 	    return CL_EARG;
@@ -778,6 +1027,12 @@ const char *cl_engine_get_str(const struct cl_engine *engine, enum cl_engine_fie
 	    return engine->pua_cats;
 	case CL_ENGINE_TMPDIR:
 	    return engine->tmpdir;
+	case CL_ENGINE_CACHE_FILE:
+	    return engine->cache_file;
+	case CL_ENGINE_HASH_IMAGE:
+	    return engine->hash_image;
+	case CL_ENGINE_AC_PROFILE:
+	    return engine->ac_profile;
 	default:
 	    cli_errmsg("cl_engine_get: Incorrect field number\n");
 	    if(err)
@@ -801,6 +1056,10 @@ struct cl_settings *cl_engine_settings_copy(const struct cl_engine *engine)
     settings->ac_mindepth = engine->ac_mindepth;
     settings->ac_maxdepth = engine->ac_maxdepth;
     settings->tmpdir = engine->tmpdir ? strdup(engine->tmpdir) : NULL;
+    settings->cache_file = engine->cache_file ? strdup(engine->cache_file) : NULL;
+    settings->hash_image = engine->hash_image ? strdup(engine->hash_image) : NULL;
+    settings->ac_profile = engine->ac_profile ? strdup(engine->ac_profile) : NULL;
+    settings->cache_migrate = cli_cache_export(engine, &settings->cache_migrate_size);
     settings->keeptmp = engine->keeptmp;
     settings->maxscansize = engine->maxscansize;
     settings->maxfilesize = engine->maxfilesize;
@@ -827,6 +1086,8 @@ struct cl_settings *cl_engine_settings_copy(const struct cl_engine *engine)
     settings->cb_hash = engine->cb_hash;
     settings->cb_meta = engine->cb_meta;
     settings->cb_file_props = engine->cb_file_props;
+    settings->cb_file_props_stream = engine->cb_file_props_stream;
+    settings->cb_profile = engine->cb_profile;
     settings->engine_options = engine->engine_options;
 
     settings->cb_stats_add_sample = engine->cb_stats_add_sample;
@@ -847,6 +1108,25 @@ struct cl_settings *cl_engine_settings_copy(const struct cl_engine *engine)
     settings->pcre_recmatch_limit = engine->pcre_recmatch_limit;
     settings->pcre_max_filesize = engine->pcre_max_filesize;
 
+    settings->parallel_scan = engine->parallel_scan;
+    settings->cache_size = engine->cache_size;
+    settings->hugepages = engine->hugepages;
+    settings->load_threads = engine->load_threads;
+    settings->lazy_matchers = engine->lazy_matchers;
+    settings->extract_mem = engine->extract_mem;
+    settings->archive_threads = engine->archive_threads;
+    settings->time_limit = engine->time_limit;
+    settings->cpu_limit = engine->cpu_limit;
+    settings->max_inflated = engine->max_inflated;
+    settings->decompress_threads = engine->decompress_threads;
+    settings->sigprof_rate = engine->sigprof_rate;
+    settings->fused_scan = engine->fused_scan;
+    settings->merged_targets = engine->merged_targets;
+    settings->archive_order = engine->archive_order;
+    settings->shard_index = engine->shard_index;
+    settings->shard_count = engine->shard_count;
+    settings->max_decompress_mem = engine->max_decompress_mem;
+
     return settings;
 }
 
@@ -882,6 +1162,49 @@ int cl_engine_settings_apply(struct cl_engine *engine, const struct cl_settings
 	engine->tmpdir = NULL;
     }
 
+    if(engine->cache_file)
+	mpool_free(engine->mempool, engine->cache_file);
+    if(settings->cache_file) {
+	engine->cache_file = cli_mpool_strdup(engine->mempool, settings->cache_file);
+	if(!engine->cache_file)
+	    return CL_EMEM;
+    } else {
+	engine->cache_file = NULL;
+    }
+
+    if(engine->hash_image)
+	mpool_free(engine->mempool, engine->hash_image);
+    if(settings->hash_image) {
+	engine->hash_image = cli_mpool_strdup(engine->mempool, settings->hash_image);
+	if(!engine->hash_image)
+	    return CL_EMEM;
+    } else {
+	engine->hash_image = NULL;
+    }
+
+    /* the costs are loaded again with the roots */
+    if(engine->ac_profile)
+	mpool_free(engine->mempool, engine->ac_profile);
+    if(engine->ac_cost) {
+	mpool_free(engine->mempool, engine->ac_cost);
+	engine->ac_cost = NULL;
+    }
+    if(settings->ac_profile) {
+	engine->ac_profile = cli_mpool_strdup(engine->mempool, settings->ac_profile);
+	if(!engine->ac_profile)
+	    return CL_EMEM;
+    } else {
+	engine->ac_profile = NULL;
+    }
+
+    free(engine->cache_migrate);
+    engine->cache_migrate = NULL;
+    if(settings->cache_migrate) {
+	if(!(engine->cache_migrate = cli_malloc(settings->cache_migrate_size)))
+	    return CL_EMEM;
+	memcpy(engine->cache_migrate, settings->cache_migrate, settings->cache_migrate_size);
+    }
+
     if(engine->pua_cats)
 	mpool_free(engine->mempool, engine->pua_cats);
     if(settings->pua_cats) {
@@ -901,6 +1224,8 @@ int cl_engine_settings_apply(struct cl_engine *engine, const struct cl_settings
     engine->cb_hash = settings->cb_hash;
     engine->cb_meta = settings->cb_meta;
     engine->cb_file_props = settings->cb_file_props;
+    engine->cb_file_props_stream = settings->cb_file_props_stream;
+    engine->cb_profile = settings->cb_profile;
 
     engine->cb_stats_add_sample = settings->cb_stats_add_sample;
     engine->cb_stats_remove_sample = settings->cb_stats_remove_sample;
@@ -920,6 +1245,27 @@ int cl_engine_settings_apply(struct cl_engine *engine, const struct cl_settings
     engine->pcre_recmatch_limit = settings->pcre_recmatch_limit;
     engine->pcre_max_filesize = settings->pcre_max_filesize;
 
+    engine->parallel_scan = settings->parallel_scan;
+    engine->cache_size = settings->cache_size;
+    engine->hugepages = mpool_hugepages(engine->mempool, settings->hugepages);
+    engine->load_threads = settings->load_threads;
+    engine->lazy_matchers = settings->lazy_matchers;
+    engine->extract_mem = settings->extract_mem;
+    engine->archive_threads = settings->archive_threads;
+    engine->time_limit = settings->time_limit;
+    engine->cpu_limit = settings->cpu_limit;
+    engine->max_inflated = settings->max_inflated;
+    engine->decompress_threads = settings->decompress_threads;
+    engine->sigprof_rate = settings->sigprof_rate;
+    engine->fused_scan = settings->fused_scan;
+    engine->merged_targets = settings->merged_targets;
+    engine->archive_order = settings->archive_order;
+    engine->shard_index = settings->shard_index;
+    engine->shard_count = settings->shard_count;
+    if (settings->max_decompress_mem && memgov_init(engine) != CL_SUCCESS)
+	return CL_EMEM;
+    engine->max_decompress_mem = settings->max_decompress_mem;
+
     return CL_SUCCESS;
 }
 
@@ -929,6 +1275,10 @@ int cl_engine_settings_free(struct cl_settings *settings)
 	return CL_ENULLARG;
 
     free(settings->tmpdir);
+    free(settings->cache_file);
+    free(settings->hash_image);
+    free(settings->ac_profile);
+    free(settings->cache_migrate);
     free(settings->pua_cats);
     free(settings);
     return CL_SUCCESS;
@@ -951,6 +1301,15 @@ int cli_checklimits(const char *who, cli_ctx *ctx, unsigned long need1, unsigned
     /* if called without limits, go on, unpack, scan */
     if(!ctx) return CL_CLEAN;
 
+    /* an earlier member of the archive scanned in parallel is infected */
+    if(cli_member_cancelled(ctx)) {
+        cli_dbgmsg("%s: scan cancelled\n", who);
+        return CL_BREAK;
+    }
+
+    if((ret = cli_checkbudget(ctx)) != CL_SUCCESS)
+        return ret;
+
     needed = (need1>need2)?need1:need2;
     needed = (needed>need3)?needed:need3;
 
@@ -960,6 +1319,7 @@ int cli_checklimits(const char *who, cli_ctx *ctx, unsigned long need1, unsigned
         if(ctx->engine->maxscansize-ctx->scansize<needed) {
 	    /* ... we tell the caller to skip this file */
 	    cli_dbgmsg("%s: scansize exceeded (initial: %lu, consumed: %lu, needed: %lu)\n", who, (unsigned long int) ctx->engine->maxscansize, (unsigned long int) ctx->scansize, needed);
+	    cli_usage_limit(ctx, CL_LIMIT_SIZE);
 	    ret = CL_EMAXSIZE;
 	}
     }
@@ -968,11 +1328,13 @@ int cli_checklimits(const char *who, cli_ctx *ctx, unsigned long need1, unsigned
     if(needed && ctx->engine->maxfilesize && ctx->engine->maxfilesize<needed) {
 	/* ... we tell the caller to skip this file */
         cli_dbgmsg("%s: filesize exceeded (allowed: %lu, needed: %lu)\n", who, (unsigned long int) ctx->engine->maxfilesize, needed);
+	cli_usage_limit(ctx, CL_LIMIT_SIZE);
 	ret = CL_EMAXSIZE;
     }
 
     if(ctx->engine->maxfiles && ctx->scannedfiles>=ctx->engine->maxfiles) {
         cli_dbgmsg("%s: files limit reached (max: %u)\n", who, ctx->engine->maxfiles);
+	cli_usage_limit(ctx, CL_LIMIT_FILES);
 	ret = CL_EMAXFILES;
     }
 
@@ -993,20 +1355,189 @@ int cli_updatelimits(cli_ctx *ctx, unsigned long needed) {
     return CL_CLEAN;
 }
 
-int cli_checktimelimit(cli_ctx *ctx)
+/* the thread CPU clock is only read every so many checks */
+#define BUDGET_CPU_TICKS 16
+
+static uint64_t budget_now(void)
 {
-    if (ctx->time_limit.tv_sec != 0) {
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == 0) {
-            if (now.tv_sec < ctx->time_limit.tv_sec)
-                return CL_SUCCESS;
-            if (now.tv_sec > ctx->time_limit.tv_sec || now.tv_usec > ctx->time_limit.tv_usec)
-                return CL_ETIMEOUT;
-        }
+    struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t budget_cputime(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    return 0;
+}
+
+void cli_budget_init(struct cli_budget *budget, const struct cl_engine *engine)
+{
+    memset(budget, 0, sizeof(*budget));
+    if (engine->time_limit)
+	budget->deadline = budget_now() + (uint64_t)engine->time_limit * 1000;
+    budget->cpu_limit = (uint64_t)engine->cpu_limit * 1000;
+    budget->max_inflated = engine->max_inflated;
+    budget->armed = budget->deadline || budget->cpu_limit || budget->max_inflated;
+}
+
+/* Charges the CPU time the thread spent since the last call */
+static void budget_charge(cli_ctx *ctx)
+{
+    uint64_t now = budget_cputime();
+
+    if (now > ctx->budget_cpu) {
+	__sync_fetch_and_add(&ctx->budget->cpu_used, now - ctx->budget_cpu);
+	ctx->budget_cpu = now;
+    }
+}
+
+/* Binds the budget to a context running on the calling thread; NULL
+ * charges the time spent and unbinds it */
+void cli_budget_attach(cli_ctx *ctx, struct cli_budget *budget)
+{
+    if (ctx->budget && (ctx->budget->cpu_limit || ctx->budget->usage))
+	budget_charge(ctx);
+    ctx->budget = budget;
+    ctx->budget_tick = 0;
+    ctx->budget_cpu = (budget && (budget->cpu_limit || budget->usage)) ? budget_cputime() : 0;
+}
+
+static int budget_result(cli_ctx *ctx)
+{
+    int rc = ctx->budget->exceeded;
+
+    cli_check_blockmax(ctx, rc);
+    return rc;
+}
+
+static int budget_exceed(cli_ctx *ctx, int rc, const char *what, unsigned int limit)
+{
+    if (__sync_bool_compare_and_swap(&ctx->budget->exceeded, 0, rc))
+	cli_dbgmsg("cli_budget: %s limit reached, giving up on the file\n", what);
+    cli_usage_limit(ctx, limit);
+    return budget_result(ctx);
+}
+
+int cli_budget_check(cli_ctx *ctx)
+{
+    struct cli_budget *budget = ctx->budget;
+
+    if (budget->exceeded)
+	return budget_result(ctx);
+    if (budget->deadline && budget_now() > budget->deadline)
+	return budget_exceed(ctx, CL_ETIMEOUT, "time", CL_LIMIT_TIME);
+    if (budget->cpu_limit && !(++ctx->budget_tick % BUDGET_CPU_TICKS)) {
+	budget_charge(ctx);
+	if (budget->cpu_used > budget->cpu_limit)
+	    return budget_exceed(ctx, CL_ETIMEOUT, "CPU time", CL_LIMIT_CPU);
     }
     return CL_SUCCESS;
 }
 
+/* Accounts for len bytes extracted from an archive or decompressed */
+int cli_budget_inflate(cli_ctx *ctx, size_t len)
+{
+    struct cli_budget *budget;
+    uint64_t inflated;
+
+    if (ctx && ctx->profile)
+	ctx->profile->inflated += len;
+    if (!ctx || !(budget = ctx->budget) || !(budget->armed || budget->usage))
+	return CL_SUCCESS;
+    inflated = __sync_add_and_fetch(&budget->inflated, len);
+    if (budget->max_inflated && inflated > budget->max_inflated)
+	return budget_exceed(ctx, CL_EMAXSIZE, "extracted size", CL_LIMIT_INFLATED);
+    return budget->armed ? cli_budget_check(ctx) : CL_SUCCESS;
+}
+
+/* Milliseconds of wall time left (at least 1), 0xffffffff if unlimited */
+uint32_t cli_budget_remaining(const cli_ctx *ctx)
+{
+    const struct cli_budget *budget = ctx ? ctx->budget : NULL;
+    uint64_t now, left;
+
+    if (!budget || !budget->deadline)
+	return 0xffffffff;
+    if (budget->exceeded || (now = budget_now()) >= budget->deadline)
+	return 1;
+    left = (budget->deadline - now) / 1000;
+    if (left > 0xffffffff)
+	return 0xffffffff;
+    return left ? (uint32_t)left : 1;
+}
+
+/* Scan usage, see cl_scandesc_usage(). The counters live in the budget,
+ * which the threads scanning the members of an archive share as well. */
+void cli_usage_limit(cli_ctx *ctx, unsigned int limit)
+{
+    if (ctx && ctx->budget)
+	__sync_fetch_and_or(&ctx->budget->limits, limit);
+}
+
+/* An object is scanned at ctx->recursion */
+void cli_usage_object(cli_ctx *ctx)
+{
+    struct cli_budget *budget = ctx->budget;
+    unsigned int depth;
+
+    __sync_fetch_and_add(&budget->objects, 1);
+    while ((depth = budget->depth) < ctx->recursion)
+	if (__sync_bool_compare_and_swap(&budget->depth, depth, ctx->recursion))
+	    break;
+}
+
+void cli_usage_read(cli_ctx *ctx, uint64_t len)
+{
+    if (len)
+	__sync_fetch_and_add(&ctx->budget->read, len);
+}
+
+/* Phase timers, 0 when the usage isn't collected */
+uint64_t cli_usage_start(cli_ctx *ctx)
+{
+    return cli_usage(ctx) ? budget_now() : 0;
+}
+
+void cli_usage_stop(cli_ctx *ctx, uint64_t start, enum cli_usage_phase phase)
+{
+    uint64_t now;
+
+    if (start && (now = budget_now()) > start)
+	__sync_fetch_and_add(&ctx->budget->phase_usec[phase], now - start);
+}
+
+/* Once the budget has been detached from every context */
+void cli_usage_fill(const struct cli_budget *budget, uint64_t start, struct cl_scan_usage *usage)
+{
+    uint64_t now = budget_now(), phases;
+
+    memset(usage, 0, sizeof(*usage));
+    usage->usec = now > start ? now - start : 0;
+    usage->cpu_usec = budget->cpu_used;
+    usage->read = budget->read;
+    usage->inflated = budget->inflated;
+    usage->objects = budget->objects;
+    usage->depth = budget->depth;
+    usage->limits = budget->limits;
+    usage->hash_usec = budget->phase_usec[CLI_USAGE_HASH];
+    usage->match_usec = budget->phase_usec[CLI_USAGE_MATCH];
+    usage->bytecode_usec = budget->phase_usec[CLI_USAGE_BYTECODE];
+    phases = usage->hash_usec + usage->match_usec;
+    usage->parse_usec = usage->usec > phases ? usage->usec - phases : 0;
+}
+
 /*
  * Type: 1 = MD5, 2 = SHA1, 3 = SHA256
  */
@@ -1093,7 +1624,9 @@ void cli_append_virus(cli_ctx * ctx, const char * virname)
     if (ctx->virname == NULL)
         return;
     if (ctx->limit_exceeded == 0 || SCAN_ALL) { 
-        if (ctx->engine->cb_virus_found)
+        if (ctx->member_job)
+            cli_member_virus(ctx->member_job, virname);
+        else if (ctx->engine->cb_virus_found)
             ctx->engine->cb_virus_found(fmap_fd(*ctx->fmap), virname, ctx->cb_ctx);
         ctx->num_viruses++;
         *ctx->virname = virname;
@@ -1297,6 +1830,111 @@ int cli_rmdirs(const char *dirname)
 
 /* Implement a generic bitset, trog@clamav.net */
 
+/* Arena blocks; larger requests get a block of their own */
+#define CLI_ARENA_BLKSIZE (64 * 1024)
+/* Released blocks kept for reuse */
+#define CLI_ARENA_SPARE 4
+
+struct cli_arena_blk {
+    struct cli_arena_blk *next;
+    size_t size, used;
+};
+
+#define CLI_ARENA_HDR ((sizeof(struct cli_arena_blk) + 15) & ~(size_t) 15)
+
+void *cli_arena_malloc(struct cli_arena *arena, size_t size)
+{
+	struct cli_arena_blk *blk, **pt;
+	size_t bsize;
+	void *alloc;
+
+
+    if(!size || size > CLI_MAX_ALLOCATION) {
+	cli_errmsg("cli_arena_malloc(): Attempt to allocate %lu bytes. Please report to http://bugs.clamav.net\n", (unsigned long int) size);
+	return NULL;
+    }
+    size = (size + 15) & ~(size_t) 15;
+
+    blk = arena->cur;
+    if(!blk || blk->size - blk->used < size) {
+	bsize = size > CLI_ARENA_BLKSIZE ? size : CLI_ARENA_BLKSIZE;
+	for(pt = &arena->spare; *pt && (*pt)->size < bsize; pt = &(*pt)->next);
+	if((blk = *pt)) {
+	    *pt = blk->next;
+	} else {
+	    if(!(blk = cli_malloc(CLI_ARENA_HDR + bsize)))
+		return NULL;
+	    blk->size = bsize;
+	}
+	blk->used = 0;
+	blk->next = arena->cur;
+	arena->cur = blk;
+    }
+
+    alloc = (char *) blk + CLI_ARENA_HDR + blk->used;
+    blk->used += size;
+    return alloc;
+}
+
+void *cli_arena_calloc(struct cli_arena *arena, size_t nmemb, size_t size)
+{
+	void *alloc;
+
+
+    if(!nmemb || !size || nmemb > CLI_MAX_ALLOCATION || size > CLI_MAX_ALLOCATION / nmemb) {
+	cli_errmsg("cli_arena_calloc(): Attempt to allocate %lu bytes. Please report to http://bugs.clamav.net\n", (unsigned long int) nmemb*size);
+	return NULL;
+    }
+    if((alloc = cli_arena_malloc(arena, nmemb * size)))
+	memset(alloc, 0, nmemb * size);
+    return alloc;
+}
+
+void cli_arena_getmark(const struct cli_arena *arena, struct cli_arena_mark *mark)
+{
+    mark->blk = arena->cur;
+    mark->used = arena->cur ? arena->cur->used : 0;
+}
+
+/* Frees everything allocated after mark was taken */
+void cli_arena_release(struct cli_arena *arena, const struct cli_arena_mark *mark)
+{
+	struct cli_arena_blk *blk, *spare;
+	unsigned int nspare = 0;
+
+
+    for(spare = arena->spare; spare; spare = spare->next)
+	nspare++;
+
+    while((blk = arena->cur) && blk != mark->blk) {
+	arena->cur = blk->next;
+	if(nspare < CLI_ARENA_SPARE && blk->size == CLI_ARENA_BLKSIZE) {
+	    blk->next = arena->spare;
+	    arena->spare = blk;
+	    nspare++;
+	} else {
+	    free(blk);
+	}
+    }
+    if(arena->cur)
+	arena->cur->used = mark->used;
+}
+
+void cli_arena_destroy(struct cli_arena *arena)
+{
+	struct cli_arena_blk *blk;
+
+
+    while((blk = arena->cur)) {
+	arena->cur = blk->next;
+	free(blk);
+    }
+    while((blk = arena->spare)) {
+	arena->spare = blk->next;
+	free(blk);
+    }
+}
+
 #define BITS_PER_CHAR (8)
 #define BITSET_DEFAULT_SIZE (1024)
 
@@ -1424,3 +2062,13 @@ void cl_engine_set_clcb_file_props(struct cl_engine *engine, clcb_file_props cal
 {
     engine->cb_file_props = callback;
 }
+
+void cl_engine_set_clcb_file_props_stream(struct cl_engine *engine, clcb_file_props_stream callback)
+{
+    engine->cb_file_props_stream = callback;
+}
+
+void cl_engine_set_clcb_profile(struct cl_engine *engine, clcb_profile callback)
+{
+    engine->cb_profile = callback;
+}
@@ -126,6 +126,70 @@ typedef struct bitset_tag
         unsigned long length;
 } bitset_t;
 
+/* Per-scan bump allocator: memory is given back with cli_arena_release()
+ * (in LIFO order, to a mark) and dropped by cli_arena_destroy() at the end
+ * of the scan. Not thread safe. */
+struct cli_arena_blk;
+
+struct cli_arena {
+    struct cli_arena_blk *cur, *spare;
+};
+
+struct cli_arena_mark {
+    struct cli_arena_blk *blk;
+    size_t used;
+};
+
+/* What a single scan may spend (CL_ENGINE_TIME_LIMIT, CL_ENGINE_CPU_LIMIT
+ * and CL_ENGINE_MAX_INFLATED), shared by every object found in the file,
+ * including the members scanned on other threads. Once any of the limits is
+ * hit, exceeded holds the error the scan ends with and every check point
+ * returns it, so the whole recursion unwinds. */
+enum cli_usage_phase {
+    CLI_USAGE_HASH = 0,
+    CLI_USAGE_MATCH,
+    CLI_USAGE_BYTECODE,
+    CLI_USAGE_PHASES
+};
+
+struct cli_budget {
+    uint64_t deadline; /* usec, monotonic clock */
+    uint64_t cpu_limit, cpu_used; /* usec */
+    uint64_t max_inflated, inflated;
+    volatile int exceeded;
+    int armed;
+    /* what the scan used, collected for cl_scandesc_usage() */
+    int usage;
+    unsigned int limits, objects, depth;
+    uint64_t read, phase_usec[CLI_USAGE_PHASES];
+};
+
+/* An archive member known by its compressed data, see
+ * cli_member_cache_check() */
+struct cli_member_key {
+    unsigned char digest[16];
+    unsigned int recursion;
+};
+
+/* Profile of a scan, see cl_engine_set_clcb_profile(). The nodes are kept
+ * in preorder; while an object is scanned its node holds the counters as
+ * they were when it started. */
+struct cli_profile_node {
+    cli_file_t type;
+    unsigned int depth;
+    unsigned int parent; /* index + 1, 0 for the scanned file */
+    uint64_t size, usec, read, inflated, matcher;
+    const fmap_t *map;
+    uint64_t child_read; /* read through the maps of the contained objects */
+};
+
+struct cli_profile {
+    struct cli_profile_node *nodes;
+    unsigned int count, size;
+    unsigned int current; /* index + 1 of the object being scanned */
+    uint64_t inflated, matcher; /* running totals */
+};
+
 /* internal clamav context */
 typedef struct cli_ctx_tag {
     const char **virname;
@@ -156,8 +220,23 @@ typedef struct cli_ctx_tag {
     struct json_object *properties;
     struct json_object *wrkproperty;
 #endif
-    struct timeval time_limit;
+    struct cli_budget *budget; /* shared by all the objects of the scan */
+    uint64_t budget_cpu; /* thread CPU time already charged to the budget */
+    unsigned int budget_tick;
     int limit_exceeded;
+    struct cli_arena arena;
+    unsigned char *extract_spare; /* buffer of the last extracted object */
+    size_t extract_sparesize;
+    uint64_t scanstat_child; /* usec spent in the objects of the current one */
+    struct cli_member_pool *member_pool; /* threads scanning the members of the current archive */
+    struct cli_member_job *member_job; /* member scanned on one of these threads */
+    struct cli_member_key *member_key; /* member being scanned, remembered by cache_add() */
+    struct cli_profile *profile; /* with a profile callback */
+    struct cl_scan_probe *probe; /* registered by the scanning thread */
+    const struct cl_engine *overlay; /* signatures scanned along with those of the engine */
+    unsigned int sigprof_tick; /* see cli_sigprof_start() */
+    unsigned int in_matcher; /* nested calls of the matcher being timed */
+    unsigned int nested_maps; /* maps pushed or swapped in so far, see cache_add() */
 } cli_ctx;
 
 #define STATS_ANON_UUID "5b585e8f-3be5-11e3-bf0b-18037319526c"
@@ -175,18 +254,36 @@ typedef struct cli_flagged_sample {
     struct cli_flagged_sample *next;
 } cli_flagged_sample_t;
 
+/* The samples are spread over the shards by their MD5, each shard with its
+ * own lock, so that detections only contend when they hit the same one */
+#define STATS_SHARDS 32
+
+typedef struct cli_stats_shard {
+    cli_flagged_sample_t *samples;
+    uint32_t nsamples;
+    size_t size; /* accounted as in clamav_stats_get_size() */
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+#endif
+} cli_stats_shard_t;
+
 typedef struct cli_clamav_intel {
     char *hostid;
     char *host_info;
-    cli_flagged_sample_t *samples;
+    cli_flagged_sample_t *samples; /* snapshot being submitted */
     uint32_t nsamples;
     uint32_t maxsamples;
     uint32_t maxmem;
     uint32_t timeout;
     time_t nextupdate;
     struct cl_engine *engine;
+    cli_stats_shard_t shards[STATS_SHARDS];
 #ifdef CL_THREAD_SAFE
-    pthread_mutex_t mutex;
+    pthread_mutex_t mutex; /* hostid and the submitter */
+    pthread_cond_t submit_cond;
+    pthread_t submitter;
+    int submitter_state; /* STATS_SUBMITTER_* */
+    volatile int submit_pending;
 #endif
 } cli_intel_t;
 
@@ -216,7 +313,7 @@ struct icomtr {
     unsigned int gsum;
     unsigned int bsum;
     unsigned int ccount;
-    char *name;
+    uint32_t name; /* in engine->cold */
 };
 
 struct icon_matcher {
@@ -224,6 +321,9 @@ struct icon_matcher {
     unsigned int group_counts[2];
     struct icomtr *icons[3];
     unsigned int icon_counts[3];
+    /* icons[i] is sorted by group[0], the icons of group g are
+     * icons[i][group_index[i][g]] up to icons[i][group_index[i][g + 1]] */
+    unsigned int *group_index[3];
 };
 
 struct cli_dbinfo {
@@ -245,11 +345,49 @@ struct cli_pwdb {
     char *name;
     unsigned char *passwd;
     uint16_t length;
+    uint32_t zipkey[3]; /* zip keys after the password, see cli_zip_initkey() */
     struct cli_pwdb *next;
 };
 
+/* per file type counters, updated with atomic adds by the scanning
+ * threads; entry 0 collects the objects that were never typed */
+#define CLI_SCANSTAT_TYPES (CL_TYPE_IGNORED - CL_TYPENO + 2)
+struct cli_scanstat {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t usec;
+};
+
+/* phases of the engine load, see loadstats.h */
+enum cli_loadstat_phase {
+    CLI_LOADSTAT_LOAD = 0,
+    CLI_LOADSTAT_CVD_VERIFY,
+    CLI_LOADSTAT_CVD_UNPACK,
+    CLI_LOADSTAT_PARSE_HASH,
+    CLI_LOADSTAT_PARSE_BODY,
+    CLI_LOADSTAT_PARSE_LOGICAL,
+    CLI_LOADSTAT_PARSE_BYTECODE,
+    CLI_LOADSTAT_PARSE_YARA,
+    CLI_LOADSTAT_PARSE_OTHER,
+    CLI_LOADSTAT_COMPILE,
+    CLI_LOADSTAT_AC,
+    CLI_LOADSTAT_HASH,
+    CLI_LOADSTAT_PCRE,
+    CLI_LOADSTAT_BYTECODE,
+    CLI_LOADSTAT_CACHE,
+    CLI_LOADSTAT_PHASES
+};
+
+struct cli_loadstat {
+    uint64_t calls;
+    uint64_t wall_usec;
+    uint64_t cpu_usec;
+    int64_t mem;
+};
+
 struct cl_engine {
     uint32_t refcount; /* reference counter */
+    uint32_t generation; /* unique per cl_engine_compile(), never 0 */
     uint32_t sdb;
     uint32_t dboptions;
     uint32_t dbversion[2];
@@ -305,6 +443,8 @@ struct cl_engine {
     /* Filetype definitions */
     struct cli_ftype *ftypes;
     struct cli_ftype *ptypes;
+    struct cli_ftindex *ftindex;
+    struct cli_matcher *ftroot; /* the FTM signatures of type 1 alone */
 
     /* Container password storage */
     struct cli_pwdb **pwdbs;
@@ -323,8 +463,19 @@ struct cl_engine {
     /* Icon reference storage */
     struct icon_matcher *iconcheck;
 
+    /* Strings kept compressed, see coldstore.h */
+    struct cli_coldstore *cold;
+
     /* Negative cache storage */
     struct CACHE *cache;
+    struct member_cache *member_cache;
+
+    /* Persistent cache file and signature set fingerprints, the second
+     * one leaves out the whole-file MD5 signatures */
+    char *cache_file;
+    void *cache_dbctx, *cache_sigctx;
+    unsigned char cache_dbdigest[16], cache_sigdigest[16];
+    void *cache_migrate;
 
     /* Database information from .info files */
     struct cli_dbinfo *dbinfo;
@@ -345,6 +496,8 @@ struct cl_engine {
     clcb_hash cb_hash;
     clcb_meta cb_meta;
     clcb_file_props cb_file_props;
+    clcb_file_props_stream cb_file_props_stream;
+    clcb_profile cb_profile;
 
     /* Used for bytecode */
     struct cli_all_bc bcs;
@@ -380,14 +533,90 @@ struct cl_engine {
     uint32_t maxiconspe; /* max number of icons to scan for PE */
     uint32_t maxrechwp3; /* max recursive calls for HWP3 parsing */
 
-    /* millisecond time limit for preclassification scanning */
+    /* per scan budget: milliseconds of wall time and of CPU time, bytes
+     * extracted from archives and compressed files (0 = unlimited) */
     uint32_t time_limit;
+    uint32_t cpu_limit;
+    uint64_t max_inflated;
 
     /* PCRE matching limitations */
     uint64_t pcre_match_limit;
     uint64_t pcre_recmatch_limit;
     uint64_t pcre_max_filesize;
 
+    /* worker threads for the raw scan of large files (0 = serial) */
+    uint32_t parallel_scan;
+
+    /* number of entries in the scan cache */
+    uint32_t cache_size;
+
+    /* huge page backing of the memory pool (enum cl_hugepages) */
+    uint32_t hugepages;
+
+    /* hash databases shared via a mapped image */
+    char *hash_image;
+    struct cli_hm_image *hm_image;
+
+    /* byte pair costs steering the choice of the AC anchors and the
+     * prefilter contents, see cli_ac_profile_load() */
+    char *ac_profile;
+    uint8_t *ac_cost;
+
+    /* threads parsing the hash databases and building the tries (0 = serial) */
+    uint32_t load_threads;
+    struct cli_loadq *loadq;
+
+    /* build the file type matchers on first use */
+    uint32_t lazy_matchers;
+
+    /* largest extracted object kept in memory (0 = always a temporary file) */
+    uint64_t extract_mem;
+
+    /* threads scanning the members of a large archive (0 = serial) */
+    uint32_t archive_threads;
+
+    /* threads decoding the blocks of a compressed file (0 = serial) */
+    uint32_t decompress_threads;
+
+    /* signatures added by cl_engine_apply_cdiff() */
+    const struct cl_engine *patch;
+    struct cli_patchset *patchset;
+
+    /* engine of an overlay from cl_engine_overlay_new(), which only holds
+     * the signatures scanned along with those of the base */
+    struct cl_engine *base;
+
+    /* see cl_engine_get_scanstats() */
+    struct cli_scanstat scanstats[CLI_SCANSTAT_TYPES];
+
+    /* see cl_engine_get_sigstats() */
+    uint32_t sigprof_rate;
+    struct cli_sigprof *sigprof;
+
+    /* see cl_engine_get_loadstats() */
+    struct cli_loadstat loadstats[CLI_LOADSTAT_PHASES];
+    struct cli_loadtimer *loadtimer;
+
+    /* Match the BM patterns in the pass of the AC matcher */
+    uint32_t fused_scan;
+
+    /* Targets (1 << target) matched with one AC trie along with the
+     * generic signatures, see cli_ac_merge() */
+    uint32_t merged_targets;
+
+    /* Extract the likely malicious archive members first, see
+     * cli_unzip() */
+    uint32_t archive_order;
+
+    /* Only the body signatures of shard shard_index (out of shard_count)
+     * are loaded, see cli_chkshard() */
+    uint32_t shard_index, shard_count;
+
+    /* memory the decompressors of all the scans may hold at once (0 = no
+     * limit), see cli_memgov_reserve() */
+    uint64_t max_decompress_mem;
+    struct cli_memgov *memgov;
+
 #ifdef HAVE_YARA
     /* YARA */
     struct _yara_global * yara_global;
@@ -427,6 +656,8 @@ struct cl_settings {
     clcb_hash cb_hash;
     clcb_meta cb_meta;
     clcb_file_props cb_file_props;
+    clcb_file_props_stream cb_file_props_stream;
+    clcb_profile cb_profile;
 
     /* Engine max settings */
     uint64_t maxembeddedpe;  /* max size to scan MSEXE for PE */
@@ -457,11 +688,35 @@ struct cl_settings {
     uint64_t pcre_match_limit;
     uint64_t pcre_recmatch_limit;
     uint64_t pcre_max_filesize;
+
+    uint32_t parallel_scan;
+    uint32_t cache_size;
+    uint32_t hugepages;
+    uint32_t load_threads;
+    uint32_t lazy_matchers;
+    uint64_t extract_mem;
+    uint32_t archive_threads;
+    uint32_t decompress_threads;
+    uint32_t sigprof_rate;
+    uint32_t fused_scan;
+    uint32_t merged_targets;
+    uint32_t archive_order;
+    uint32_t shard_index;
+    uint32_t shard_count;
+    uint32_t time_limit;
+    uint32_t cpu_limit;
+    uint64_t max_inflated;
+    uint64_t max_decompress_mem;
+    char *cache_file;
+    char *hash_image;
+    char *ac_profile;
+    void *cache_migrate;
+    size_t cache_migrate_size;
 };
 
-extern int (*cli_unrar_open)(int fd, const char *dirname, unrar_state_t *state);
+extern int (*cli_unrar_open)(unrar_pread_cb_t pread_cb, void *handle, off_t start, const char *dirname, unrar_state_t *state);
 extern int (*cli_unrar_extract_next_prepare)(unrar_state_t *state, const char *dirname);
-extern int (*cli_unrar_extract_next)(unrar_state_t *state, const char *dirname);
+extern int (*cli_unrar_extract_next)(unrar_state_t *state);
 extern void (*cli_unrar_close)(unrar_state_t *state);
 extern int have_rar;
 
@@ -635,6 +890,7 @@ void cli_infomsg(const cli_ctx* ctx, const char *fmt, ...);
 
 void cli_logg_setup(const cli_ctx* ctx);
 void cli_logg_unsetup(void);
+struct cl_scan_probe *cli_scan_probe(void);
 
 /* tell compiler about branches that are very rarely taken,
  * such as debug paths, and error paths */
@@ -699,6 +955,9 @@ char *cli_strndup(const char *s, size_t n);
 int cli_rmdirs(const char *dirname);
 char *cli_hashstream(FILE *fs, unsigned char *digcpy, int type);
 char *cli_hashfile(const char *filename, int type);
+/* AES-CBC decryption of len bytes (a multiple of 16) without padding
+ * removal, 0 on success */
+int cli_aes_cbc_decrypt(const unsigned char *key, unsigned int keylen, const unsigned char *iv, const unsigned char *in, unsigned char *out, size_t len);
 int cli_unlink(const char *pathname);
 int cli_readn(int fd, void *buff, unsigned int count);
 int cli_writen(int fd, const void *buff, unsigned int count);
@@ -708,6 +967,11 @@ int cli_gentempfd(const char *dir, char **name, int *fd);
 unsigned int cli_rndnum(unsigned int max);
 int cli_filecopy(const char *src, const char *dest);
 int cli_mapscan(fmap_t *map, off_t offset, size_t size, cli_ctx *ctx, cli_file_t type);
+void *cli_arena_malloc(struct cli_arena *arena, size_t size);
+void *cli_arena_calloc(struct cli_arena *arena, size_t nmemb, size_t size);
+void cli_arena_getmark(const struct cli_arena *arena, struct cli_arena_mark *mark);
+void cli_arena_release(struct cli_arena *arena, const struct cli_arena_mark *mark);
+void cli_arena_destroy(struct cli_arena *arena);
 bitset_t *cli_bitset_init(void);
 void cli_bitset_free(bitset_t *bs);
 int cli_bitset_set(bitset_t *bs, unsigned long bit_offset);
@@ -720,7 +984,33 @@ unsigned long cli_getsizelimit(cli_ctx *, unsigned long);
 int cli_matchregex(const char *str, const char *regex);
 void cli_qsort(void *a, size_t n, size_t es, int (*cmp)(const void *, const void *));
 void cli_qsort_r(void *a, size_t n, size_t es, int (*cmp)(const void*, const void *, const void *), void *arg);
-int cli_checktimelimit(cli_ctx *ctx);
+void cli_budget_init(struct cli_budget *budget, const struct cl_engine *engine);
+void cli_budget_attach(cli_ctx *ctx, struct cli_budget *budget);
+int cli_budget_check(cli_ctx *ctx);
+int cli_budget_inflate(cli_ctx *ctx, size_t len);
+uint32_t cli_budget_remaining(const cli_ctx *ctx);
+
+/* Memory shared by the scans of an engine, see CL_ENGINE_MAX_DECOMPRESS_MEM.
+ * A parser reserves what it's about to allocate and releases it along with
+ * the buffer; on CL_EMEM it has to do without (spill to disk, skip). */
+int cli_memgov_reserve(cli_ctx *ctx, uint64_t size, int wait);
+void cli_memgov_release(const struct cl_engine *engine, uint64_t size);
+void cli_memgov_free(struct cl_engine *engine);
+
+#define cli_budget_exceeded(ctx) ((ctx)->budget && (ctx)->budget->exceeded)
+
+#define cli_usage(ctx) ((ctx) && (ctx)->budget && (ctx)->budget->usage)
+
+void cli_usage_limit(cli_ctx *ctx, unsigned int limit);
+void cli_usage_object(cli_ctx *ctx);
+void cli_usage_read(cli_ctx *ctx, uint64_t len);
+uint64_t cli_usage_start(cli_ctx *ctx);
+void cli_usage_stop(cli_ctx *ctx, uint64_t start, enum cli_usage_phase phase);
+void cli_usage_fill(const struct cli_budget *budget, uint64_t start, struct cl_scan_usage *usage);
+
+/* Cheap enough for the inner loops: a pointer test unless a limit is set */
+#define cli_checkbudget(ctx) \
+    (((ctx) && (ctx)->budget && (ctx)->budget->armed) ? cli_budget_check(ctx) : CL_SUCCESS)
 
 /* symlink behaviour */
 #define CLI_FTW_FOLLOW_FILE_SYMLINK 0x01
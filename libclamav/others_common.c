@@ -100,6 +100,26 @@ static inline void *cli_getctx(void)
     ctx = pthread_getspecific(cli_ctx_tls_key);
     return ctx ? ctx->cb_ctx : NULL;
 }
+
+static pthread_key_t cli_probe_tls_key;
+static pthread_once_t cli_probe_tls_key_once = PTHREAD_ONCE_INIT;
+
+static void cli_probe_tls_key_alloc(void)
+{
+    pthread_key_create(&cli_probe_tls_key, NULL);
+}
+
+void cl_scan_probe_register(struct cl_scan_probe *probe)
+{
+    pthread_once(&cli_probe_tls_key_once, cli_probe_tls_key_alloc);
+    pthread_setspecific(cli_probe_tls_key, probe);
+}
+
+struct cl_scan_probe *cli_scan_probe(void)
+{
+    pthread_once(&cli_probe_tls_key_once, cli_probe_tls_key_alloc);
+    return pthread_getspecific(cli_probe_tls_key);
+}
 #else
 
 static const cli_ctx *current_ctx = NULL;
@@ -116,6 +136,17 @@ static inline void *cli_getctx(void)
 void cli_logg_unsetup(void)
 {
 }
+
+static struct cl_scan_probe *current_probe = NULL;
+void cl_scan_probe_register(struct cl_scan_probe *probe)
+{
+    current_probe = probe;
+}
+
+struct cl_scan_probe *cli_scan_probe(void)
+{
+    return current_probe;
+}
 #endif
 uint8_t cli_debug_flag = 0;
 uint8_t cli_always_gen_section_hash = 0;
@@ -481,6 +512,7 @@ const char *cli_gettmpdir(void) {
 struct dirent_data {
     char *filename;
     const char *dirname;
+    const char *name; /* last component of filename */
     STATBUF *statbuf;
     long  ino; /* -1: inode not available */
     int   is_dir;/* 0 - no, 1 - yes */
@@ -512,8 +544,32 @@ static inline int ft_skipped(enum filetype ft)
     return ft != ft_regular && ft != ft_directory;
 }
 
+/* Directories are read and their entries stat()ed relative to the fd of
+ * the directory, so the kernel resolves a single component each time
+ * rather than the whole path */
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR) && defined(O_DIRECTORY) && defined(AT_SYMLINK_NOFOLLOW)
+#define FTW_AT
+#if defined(HAVE_STAT64) && STAT64_BLACKLIST
+#define FSTATAT fstatat64
+#else
+#define FSTATAT fstatat
+#endif
+#endif
+
+static int ftw_stat(int dfd, const char *name, const char *fname, int follow, STATBUF *statbuf)
+{
+#ifdef FTW_AT
+    if (dfd >= 0)
+	return FSTATAT(dfd, name, statbuf, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+    UNUSEDPARAM(dfd);
+    UNUSEDPARAM(name);
+#endif
+    return follow ? CLAMSTAT(fname, statbuf) : LSTAT(fname, statbuf);
+}
+
 #define FOLLOW_SYMLINK_MASK (CLI_FTW_FOLLOW_FILE_SYMLINK | CLI_FTW_FOLLOW_DIR_SYMLINK)
-static int get_filetype(const char *fname, int flags, int need_stat,
+static int get_filetype(const char *fname, int dfd, const char *name, int flags, int need_stat,
 			 STATBUF *statbuf, enum filetype *ft)
 {
     int stated = 0;
@@ -528,7 +584,7 @@ static int get_filetype(const char *fname, int flags, int need_stat,
 	     * to lstat(), we can just stat() directly.*/
 	    if (*ft != ft_link) {
 		/* need to lstat to determine if it is a symlink */
-		if (LSTAT(fname, statbuf) == -1)
+		if (ftw_stat(dfd, name, fname, 0, statbuf) == -1)
 		    return -1;
 		if (S_ISLNK(statbuf->st_mode)) {
 		    *ft = ft_link;
@@ -547,7 +603,7 @@ static int get_filetype(const char *fname, int flags, int need_stat,
     }
 
     if (need_stat) {
-	if (CLAMSTAT(fname, statbuf) == -1)
+	if (ftw_stat(dfd, name, fname, 1, statbuf) == -1)
 	    return -1;
 	stated = 1;
     }
@@ -571,13 +627,13 @@ static int get_filetype(const char *fname, int flags, int need_stat,
     return stated;
 }
 
-static int handle_filetype(const char *fname, int flags,
+static int handle_filetype(const char *fname, int dfd, const char *name, int flags,
 			   STATBUF *statbuf, int *stated, enum filetype *ft,
 			   cli_ftw_cb callback, struct cli_ftw_cbdata *data)
 {
     int ret;
 
-    *stated = get_filetype(fname, flags, flags & CLI_FTW_NEED_STAT , statbuf, ft);
+    *stated = get_filetype(fname, dfd, name, flags, flags & CLI_FTW_NEED_STAT , statbuf, ft);
 
     if (*stated == -1) {
 	/*  we failed a stat() or lstat() */
@@ -596,13 +652,13 @@ static int handle_filetype(const char *fname, int flags,
     return CL_SUCCESS;
 }
 
-static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb callback, struct cli_ftw_cbdata *data, cli_ftw_pathchk pathchk);
-static int handle_entry(struct dirent_data *entry, int flags, int maxdepth, cli_ftw_cb callback, struct cli_ftw_cbdata *data, cli_ftw_pathchk pathchk)
+static int cli_ftw_dir(const char *dirname, int pfd, const char *name, int flags, int maxdepth, cli_ftw_cb callback, struct cli_ftw_cbdata *data, cli_ftw_pathchk pathchk);
+static int handle_entry(struct dirent_data *entry, int pfd, int flags, int maxdepth, cli_ftw_cb callback, struct cli_ftw_cbdata *data, cli_ftw_pathchk pathchk)
 {
     if (!entry->is_dir) {
 	return callback(entry->statbuf, entry->filename, entry->filename, visit_file, data);
     } else {
-	return cli_ftw_dir(entry->dirname, flags, maxdepth, callback, data, pathchk);
+	return cli_ftw_dir(entry->dirname, pfd, entry->name, flags, maxdepth, callback, data, pathchk);
     }
 }
 
@@ -627,7 +683,7 @@ int cli_ftw(char *path, int flags, int maxdepth, cli_ftw_cb callback, struct cli
     }
     if(pathchk && pathchk(path, data) == 1)
 	return CL_SUCCESS;
-    ret = handle_filetype(path, flags, &statbuf, &stated, &ft, callback, data);
+    ret = handle_filetype(path, -1, NULL, flags, &statbuf, &stated, &ft, callback, data);
     if (ret != CL_SUCCESS)
 	return ret;
     if (ft_skipped(ft))
@@ -636,17 +692,44 @@ int cli_ftw(char *path, int flags, int maxdepth, cli_ftw_cb callback, struct cli
     entry.is_dir = ft == ft_directory;
     entry.filename = entry.is_dir ? NULL : strdup(path);
     entry.dirname = entry.is_dir ? path : NULL;
+    entry.name = NULL;
     if (entry.is_dir) {
 	ret = callback(entry.statbuf, NULL, path, visit_directory_toplev, data);
 	if (ret != CL_SUCCESS)
 	    return ret;
     }
-    return handle_entry(&entry, flags, maxdepth, callback, data, pathchk);
+    return handle_entry(&entry, -1, flags, maxdepth, callback, data, pathchk);
 }
 
-static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb callback, struct cli_ftw_cbdata *data, cli_ftw_pathchk pathchk)
+/* Opens name relative to the parent directory pfd when it's known */
+static DIR *ftw_opendir(const char *dirname, int pfd, const char *name)
 {
+#ifdef FTW_AT
     DIR *dd;
+    int fd;
+
+    if (pfd >= 0 && name)
+	fd = openat(pfd, name, O_RDONLY | O_DIRECTORY);
+    else
+	fd = open(dirname, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+	return errno == EMFILE ? opendir(dirname) : NULL;
+    if (!(dd = fdopendir(fd)))
+	close(fd);
+    return dd;
+#else
+    UNUSEDPARAM(pfd);
+    UNUSEDPARAM(name);
+    return opendir(dirname);
+#endif
+}
+
+/* The directory stays open until its subdirectories are walked, they are
+ * opened relative to it */
+static int cli_ftw_dir(const char *dirname, int pfd, const char *name, int flags, int maxdepth, cli_ftw_cb callback, struct cli_ftw_cbdata *data, cli_ftw_pathchk pathchk)
+{
+    DIR *dd;
+    int dfd = -1;
 #if defined(HAVE_READDIR_R_3) || defined(HAVE_READDIR_R_2)
     union {
 	struct dirent d;
@@ -663,9 +746,12 @@ static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb
 	return ret;
     }
 
-    if((dd = opendir(dirname)) != NULL) {
+    if((dd = ftw_opendir(dirname, pfd, name)) != NULL) {
 	struct dirent *dent;
 	int err;
+#ifdef FTW_AT
+	dfd = dirfd(dd);
+#endif
 	errno = 0;
 	ret = CL_SUCCESS;
 #ifdef HAVE_READDIR_R_3
@@ -727,7 +813,7 @@ static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb
 		continue;
 	    }
 
-	    ret = handle_filetype(fname, flags, &statbuf, &stated, &ft, callback, data);
+	    ret = handle_filetype(fname, dfd, dent->d_name, flags, &statbuf, &stated, &ft, callback, data);
 	    if (ret != CL_SUCCESS) {
 		free(fname);
 		break;
@@ -770,6 +856,7 @@ static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb
 		entry->statbuf = statbufp;
 		entry->is_dir = ft == ft_directory;
 		entry->dirname = entry->is_dir ? fname : NULL;
+		entry->name = fname + strlen(fname) - strlen(dent->d_name);
 #ifdef _XOPEN_UNIX
 		entry->ino = dent->d_ino;
 #else
@@ -781,7 +868,6 @@ static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb
 #ifndef HAVE_READDIR_R_3
 	err = errno;
 #endif
-	closedir(dd);
 	ret = CL_SUCCESS;
 	if (err) {
 	    char errs[128];
@@ -798,6 +884,7 @@ static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb
 		    }
 		    free(entries);
 		}
+		closedir(dd);
 		return ret;
 	    }
 	}
@@ -806,7 +893,7 @@ static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb
 	    cli_qsort(entries, entries_cnt, sizeof(*entries), ftw_compare);
 	    for (i = 0; i < entries_cnt; i++) {
 		struct dirent_data *entry = &entries[i];
-		ret = handle_entry(entry, flags, maxdepth-1, callback, data, pathchk);
+		ret = handle_entry(entry, dfd, flags, maxdepth-1, callback, data, pathchk);
 		if (entry->is_dir)
 		    free(entry->filename);
 		if (entry->statbuf)
@@ -821,6 +908,7 @@ static int cli_ftw_dir(const char *dirname, int flags, int maxdepth, cli_ftw_cb
 	    }
 	    free(entries);
 	}
+	closedir(dd);
     } else {
 	ret = callback(NULL, NULL, dirname, error_stat, data);
     }
@@ -58,7 +58,6 @@
 #include "bytecode.h"
 #include "bytecode_api.h"
 #include "arc4.h"
-#include "rijndael.h"
 #include "textnorm.h"
 #include "conv.h"
 #include "json_api.h"
@@ -206,10 +205,15 @@ int pdf_findobj(struct pdf_struct *pdf)
     unsigned genid, objid;
 
     pdf->nobjs++;
-    pdf->objs = cli_realloc2(pdf->objs, sizeof(*pdf->objs)*pdf->nobjs);
-    if (!pdf->objs) {
-        cli_warnmsg("cli_pdf: out of memory parsing objects (%u)\n", pdf->nobjs);
-        return -1;
+    if (pdf->nobjs > pdf->objs_alloc) {
+        /* grow geometrically, documents with many thousands of objects are common */
+        pdf->objs_alloc = pdf->objs_alloc ? pdf->objs_alloc * 2 : 64;
+        pdf->objs = cli_realloc2(pdf->objs, sizeof(*pdf->objs)*pdf->objs_alloc);
+        if (!pdf->objs) {
+            cli_warnmsg("cli_pdf: out of memory parsing objects (%u)\n", pdf->nobjs);
+            pdf->nobjs = pdf->objs_alloc = 0;
+            return -1;
+        }
     }
 
     obj = &pdf->objs[pdf->nobjs-1];
@@ -287,16 +291,16 @@ int pdf_findobj(struct pdf_struct *pdf)
     return 1;/* truncated */
 }
 
-static int filter_writen(struct pdf_struct *pdf, struct pdf_obj *obj, int fout, const char *buf, off_t len, off_t *sum)
+static int filter_writen(struct pdf_struct *pdf, struct pdf_obj *obj, struct cli_extract *x, const char *buf, off_t len, off_t *sum)
 {
     UNUSEDPARAM(obj);
 
     if (cli_checklimits("pdf", pdf->ctx, *sum, 0, 0))
-        return len; /* pretend it was a successful write to suppress CL_EWRITE */
+        return CL_SUCCESS; /* pretend it was a successful write to suppress CL_EWRITE */
 
     *sum += len;
 
-    return cli_writen(fout, buf, len);
+    return cli_extract_write(x, buf, len);
 }
 
 void pdfobj_flag(struct pdf_struct *pdf, struct pdf_obj *obj, enum pdf_flag flag)
@@ -376,6 +380,38 @@ void pdfobj_flag(struct pdf_struct *pdf, struct pdf_obj *obj, enum pdf_flag flag
     cli_dbgmsg("cli_pdf: %s flagged in object %u %u\n", s, obj->id>>8, obj->id&0xff);
 }
 
+static int pdf_objidx_cmp(const void *a, const void *b)
+{
+    const struct pdf_objidx *x = a, *y = b;
+
+    if (x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    return x->i < y->i ? -1 : x->i > y->i;
+}
+
+/* Indexes the objects found by pdf_findobj() by id for find_obj(). Objects
+ * with the same id (incremental updates) stay in the order they were found.
+ * If there's no memory for the index, find_obj() searches linearly. */
+void pdf_index_objs(struct pdf_struct *pdf)
+{
+    uint32_t i;
+
+    free(pdf->objidx);
+    pdf->objidx = NULL;
+    if (!pdf->nobjs)
+        return;
+    pdf->objidx = cli_malloc(pdf->nobjs * sizeof(*pdf->objidx));
+    if (!pdf->objidx) {
+        cli_dbgmsg("cli_pdf: no memory for the object index\n");
+        return;
+    }
+    for (i=0;i<pdf->nobjs;i++) {
+        pdf->objidx[i].id = pdf->objs[i].id;
+        pdf->objidx[i].i = i;
+    }
+    qsort(pdf->objidx, pdf->nobjs, sizeof(*pdf->objidx), pdf_objidx_cmp);
+}
+
 struct pdf_obj *find_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t objid)
 {
     uint32_t j;
@@ -384,6 +420,26 @@ struct pdf_obj *find_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t o
     /* search starting at previous obj (if exists) */
     i = (obj != pdf->objs) ? obj - pdf->objs : 0;
 
+    if (pdf->objidx) {
+        uint32_t lo = 0, hi = pdf->nobjs;
+
+        while (lo < hi) {
+            j = lo + (hi - lo) / 2;
+            if (pdf->objidx[j].id < objid)
+                lo = j + 1;
+            else
+                hi = j;
+        }
+        if (lo == pdf->nobjs || pdf->objidx[lo].id != objid)
+            return NULL;
+
+        /* the first one at or after obj, else the first one */
+        for (j=lo;j<pdf->nobjs && pdf->objidx[j].id == objid;j++)
+            if (pdf->objidx[j].i >= i)
+                return &pdf->objs[pdf->objidx[j].i];
+        return &pdf->objs[pdf->objidx[lo].i];
+    }
+
     for (j=i;j<pdf->nobjs;j++) {
         obj = &pdf->objs[j];
         if (obj->id == objid)
@@ -491,15 +547,18 @@ static int obj_size(struct pdf_struct *pdf, struct pdf_obj *obj, int binary)
     return pdf->offset - obj->start - 6;
 }
 
-static int run_pdf_hooks(struct pdf_struct *pdf, enum pdf_phase phase, int fd, int dumpid)
+static int run_pdf_hooks(struct pdf_struct *pdf, enum pdf_phase phase, struct cli_extract *dump, int dumpid)
 {
     int ret;
     struct cli_bc_ctx *bc_ctx;
     cli_ctx *ctx = pdf->ctx;
-    fmap_t *map;
+    fmap_t *map, *dumpmap = NULL;
 
     UNUSEDPARAM(dumpid);
 
+    if (!cli_bytecode_hook_pending(ctx, ctx->engine, BC_PDF))
+        return CL_CLEAN;
+
     bc_ctx = cli_bytecode_context_alloc();
     if (!bc_ctx) {
         cli_errmsg("cli_pdf: can't allocate memory for bc_ctx");
@@ -507,13 +566,12 @@ static int run_pdf_hooks(struct pdf_struct *pdf, enum pdf_phase phase, int fd, i
     }
 
     map = *ctx->fmap;
-    if (fd != -1) {
-        map = fmap(fd, 0, 0);
-        if (!map) {
+    /* the extracted object is only mapped for the hooks to look at */
+    if (dump) {
+        if ((dumpmap = cli_extract_map(dump)))
+            map = dumpmap;
+        else
             cli_warnmsg("can't mmap pdf extracted obj\n");
-            map = *ctx->fmap;
-            fd = -1;
-        }
     }
 
     cli_bytecode_context_setpdf(bc_ctx, phase, pdf->nobjs, pdf->objs, &pdf->flags, pdf->size, pdf->startoff);
@@ -521,8 +579,8 @@ static int run_pdf_hooks(struct pdf_struct *pdf, enum pdf_phase phase, int fd, i
     ret = cli_bytecode_runhook(ctx, ctx->engine, bc_ctx, BC_PDF, map);
     cli_bytecode_context_destroy(bc_ctx);
 
-    if (fd != -1)
-        funmap(map);
+    if (dumpmap)
+        funmap(dumpmap);
 
     return ret;
 }
@@ -531,11 +589,9 @@ static void dbg_printhex(const char *msg, const char *hex, unsigned len);
 
 static void aes_decrypt(const unsigned char *in, off_t *length, unsigned char *q, char *key, unsigned key_n, int has_iv)
 {
-    unsigned long rk[RKLENGTH(256)];
     unsigned char iv[16];
-    unsigned len = *length;
+    unsigned len = *length, blocks;
     unsigned char pad, i;
-    int nrounds;
 
     cli_dbgmsg("cli_pdf: aes_decrypt: key length: %d, data length: %d\n", key_n, (int)*length);
     if (key_n > 32) {
@@ -557,27 +613,13 @@ static void aes_decrypt(const unsigned char *in, off_t *length, unsigned char *q
         memset(iv, 0, sizeof(iv));
     }
 
-    cli_dbgmsg("aes_decrypt: Calling rijndaelSetupDecrypt\n");
-    nrounds = rijndaelSetupDecrypt(rk, (const unsigned char *)key, key_n*8);
-    if (!nrounds) {
-	cli_dbgmsg("cli_pdf: aes_decrypt: nrounds = 0\n");
-	return;
-    }
-    cli_dbgmsg("aes_decrypt: Beginning rijndaelDecrypt\n");
-
-    while (len >= 16) {
-        unsigned i;
-
-        rijndaelDecrypt(rk, nrounds, in, q);
-        for (i=0;i<16;i++)
-            q[i] ^= iv[i];
-
-        memcpy(iv, in, 16);
-
-        q += 16;
-        in += 16;
-        len -= 16;
+    blocks = len & ~15U;
+    if (cli_aes_cbc_decrypt((const unsigned char *)key, key_n, iv, in, q, blocks)) {
+        cli_dbgmsg("cli_pdf: aes_decrypt: decryption failed (key length: %d)\n", key_n*8);
+        return;
     }
+    q += blocks;
+    len -= blocks;
     if (has_iv) {
         len += 16;
         pad = q[-1];
@@ -726,7 +768,7 @@ enum cstate {
     CSTATE_TJ_PAROPEN
 };
 
-static void process(struct text_norm_state *s, enum cstate *st, const char *buf, int length, int fout)
+static int process(struct text_norm_state *s, enum cstate *st, const char *buf, int length, struct cli_extract *x)
 {
     do {
         switch (*st) {
@@ -736,7 +778,7 @@ static void process(struct text_norm_state *s, enum cstate *st, const char *buf,
             } else {
                 const char *nl = memchr(buf, '\n', length);
                 if (!nl)
-                    return;
+                    return CL_SUCCESS;
 
                 length -= nl - buf;
                 buf = nl;
@@ -753,8 +795,11 @@ static void process(struct text_norm_state *s, enum cstate *st, const char *buf,
                 *st = CSTATE_TJ;
             } else {
                 if (text_normalize_buffer(s, (const unsigned char *)buf, 1) != 1) {
-                    cli_writen(fout, s->out, s->out_pos);
+                    int ret = cli_extract_write(x, s->out, s->out_pos);
+
                     text_normalize_reset(s);
+                    if (ret != CL_SUCCESS)
+                        return ret;
                 }
             }
 
@@ -764,44 +809,47 @@ static void process(struct text_norm_state *s, enum cstate *st, const char *buf,
         buf++;
         length--;
     } while (length > 0);
+
+    return CL_SUCCESS;
 }
 
-static int pdf_scan_contents(int fd, struct pdf_struct *pdf)
+/* The text of a content stream is normalized from the extracted object and
+ * scanned without going to disk (but with keeptmp) */
+static int pdf_scan_contents(struct cli_extract *obj, struct pdf_struct *pdf)
 {
     struct text_norm_state s;
+    struct cli_extract x;
     char fullname[1024];
     char outbuff[BUFSIZ];
-    char inbuf[BUFSIZ];
-    int fout, n, rc;
+    const char *inbuf;
+    fmap_t *map;
+    size_t off, n;
+    int rc = CL_SUCCESS;
     enum cstate st = CSTATE_NONE;
 
-    snprintf(fullname, sizeof(fullname), "%s"PATHSEP"pdf%02u_c", pdf->dir, (pdf->files-1));
-    fout = open(fullname,O_RDWR|O_CREAT|O_EXCL|O_TRUNC|O_BINARY, 0600);
-    if (fout < 0) {
-        char err[128];
+    if (!(map = cli_extract_map(obj)))
+        return CL_EMEM;
 
-        cli_errmsg("cli_pdf: can't create temporary file %s: %s\n", fullname, cli_strerror(errno, err, sizeof(err)));
-        return CL_ETMPFILE;
-    }
+    snprintf(fullname, sizeof(fullname), "%s"PATHSEP"pdf%02u_c", pdf->dir, (pdf->files-1));
+    cli_extract_init(&x, pdf->ctx, fullname);
 
     text_normalize_init(&s, (unsigned char *)outbuff, sizeof(outbuff));
-    while (1) {
-        n = cli_readn(fd, inbuf, sizeof(inbuf));
-        if (n <= 0)
+    for (off = 0; off < map->len && rc == CL_SUCCESS; off += n) {
+        n = MIN(map->len - off, BUFSIZ);
+        if (!(inbuf = fmap_need_off_once(map, off, n)))
             break;
 
-        process(&s, &st, inbuf, n, fout);
+        rc = process(&s, &st, inbuf, n, &x);
     }
+    funmap(map);
 
-    cli_writen(fout, s.out, s.out_pos);
+    if (rc == CL_SUCCESS)
+        rc = cli_extract_write(&x, s.out, s.out_pos);
+    if (rc == CL_SUCCESS)
+        rc = cli_extract_scan(&x);
 
-    lseek(fout, 0, SEEK_SET);
-    rc = cli_magic_scandesc(fout, pdf->ctx);
-    close(fout);
-
-    if (!pdf->ctx->engine->keeptmp)
-        if (cli_unlink(fullname) && rc != CL_VIRUS)
-            rc = CL_EUNLINK;
+    if (cli_extract_done(&x) && rc != CL_VIRUS)
+        rc = CL_EUNLINK;
 
     return rc;
 }
@@ -813,7 +861,7 @@ static char *pdf_readstring(const char *q0, int len, const char *key, unsigned *
 int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
 {
     char fullname[NAME_MAX + 1];
-    int fout;
+    struct cli_extract x;
     off_t sum = 0;
     int rc = CL_SUCCESS;
     int dump = 1;
@@ -841,17 +889,10 @@ int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
 
     cli_dbgmsg("cli_pdf: dumping obj %u %u\n", obj->id>>8, obj->id&0xff);
 
+    /* the object only goes to fullname when it's too big for memory (or
+     * with keeptmp), or when the caller wants the file, see below */
     snprintf(fullname, sizeof(fullname), "%s"PATHSEP"pdf%02u", pdf->dir, pdf->files++);
-    fout = open(fullname,O_RDWR|O_CREAT|O_EXCL|O_TRUNC|O_BINARY, 0600);
-    if (fout < 0) {
-        char err[128];
-        cli_errmsg("cli_pdf: can't create temporary file %s: %s\n", fullname, cli_strerror(errno, err, sizeof(err)));
-
-        return CL_ETMPFILE;
-    }
-
-    if (!(flags & PDF_EXTRACT_OBJ_SCAN))
-        obj->path = strdup(fullname);
+    cli_extract_init(&x, pdf->ctx, fullname);
 
     do {
         if (obj->flags & (1 << OBJ_STREAM)) {
@@ -957,7 +998,7 @@ int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
                         cli_dbgmsg("cli_pdf: failed to locate DecodeParms dictionary start\n");
                 }
 
-                sum = pdf_decodestream(pdf, obj, dparams, start + p_stream, length, xref, fout, &rc);
+                sum = pdf_decodestream(pdf, obj, dparams, start + p_stream, length, xref, &x, &rc);
                 if (dparams)
                     pdf_free_dict(dparams);
 
@@ -1010,9 +1051,9 @@ int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
                         }
                     }
 
-                    if (filter_writen(pdf, obj, fout, out, js_len, &sum) != js_len) {
-                        rc = CL_EWRITE;
-                                free(js);
+                    if ((rc = filter_writen(pdf, obj, &x, out, js_len, &sum)) != CL_SUCCESS) {
+                        free(decrypted);
+                        free(js);
                         break;
                     }
 
@@ -1035,7 +1076,7 @@ int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
 
                         if (q2 > q) {
                             q--;
-                            filter_writen(pdf, obj, fout, q, q2 - q, &sum);
+                            filter_writen(pdf, obj, &x, q, q2 - q, &sum);
                             q++;
                         }
                     }
@@ -1047,8 +1088,8 @@ int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
 
             if (bytesleft < 0)
                 rc = CL_EFORMAT;
-            else if (filter_writen(pdf, obj, fout , pdf->map + obj->start, bytesleft,&sum) != bytesleft)
-                rc = CL_EWRITE;
+            else
+                rc = filter_writen(pdf, obj, &x, pdf->map + obj->start, bytesleft, &sum);
         }
     } while (0);
 
@@ -1061,22 +1102,20 @@ int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
         cli_updatelimits(pdf->ctx, sum);
 
         /* TODO: invoke bytecode on this pdf obj with metainformation associated */
-        lseek(fout, 0, SEEK_SET);
-        rc2 = cli_magic_scandesc(fout, pdf->ctx);
+        rc2 = cli_extract_scan(&x);
         if (rc2 == CL_VIRUS || rc == CL_SUCCESS)
             rc = rc2;
 
         if ((rc == CL_CLEAN) || ((rc == CL_VIRUS) && (pdf->ctx->options & CL_SCAN_ALLMATCHES))) {
-            rc2 = run_pdf_hooks(pdf, PDF_PHASE_POSTDUMP, fout, obj - pdf->objs);
+            rc2 = run_pdf_hooks(pdf, PDF_PHASE_POSTDUMP, &x, obj - pdf->objs);
             if (rc2 == CL_VIRUS)
                 rc = rc2;
         }
 
         if (((rc == CL_CLEAN) || ((rc == CL_VIRUS) && (pdf->ctx->options & CL_SCAN_ALLMATCHES))) && (obj->flags & (1 << OBJ_CONTENTS))) {
-            lseek(fout, 0, SEEK_SET);
             cli_dbgmsg("cli_pdf: dumping contents %u %u\n", obj->id>>8, obj->id&0xff);
 
-            rc2 = pdf_scan_contents(fout, pdf);
+            rc2 = pdf_scan_contents(&x, pdf);
             if (rc2 == CL_VIRUS)
                 rc = rc2;
 
@@ -1084,11 +1123,18 @@ int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags)
         }
     }
 
-    close(fout);
+    if (!(flags & PDF_EXTRACT_OBJ_SCAN)) {
+        int fd;
+
+        /* the caller reads the object back from obj->path */
+        if (cli_extract_fd(&x, &fd) == CL_SUCCESS) {
+            cli_extract_keep(&x);
+            obj->path = strdup(fullname);
+        }
+    }
 
-    if (flags & PDF_EXTRACT_OBJ_SCAN && !pdf->ctx->engine->keeptmp)
-        if (cli_unlink(fullname) && rc != CL_VIRUS)
-            rc = CL_EUNLINK;
+    if (cli_extract_done(&x) && rc != CL_VIRUS)
+        rc = CL_EUNLINK;
 
     return rc;
 }
@@ -2409,7 +2455,7 @@ int cli_pdf(const char *dir, cli_ctx *ctx, off_t offset)
 
     pdf.startoff = offset;
 
-    rc = run_pdf_hooks(&pdf, PDF_PHASE_PRE, -1, -1);
+    rc = run_pdf_hooks(&pdf, PDF_PHASE_PRE, NULL, -1);
     if ((rc == CL_VIRUS) && SCAN_ALL) {
         cli_dbgmsg("cli_pdf: (pre hooks) returned %d\n", rc);
         alerts++;
@@ -2427,6 +2473,8 @@ int cli_pdf(const char *dir, cli_ctx *ctx, off_t offset)
         struct pdf_obj *obj = &pdf.objs[pdf.nobjs-1];
 
         cli_dbgmsg("cli_pdf: found %d %d obj @%ld\n", obj->id >> 8, obj->id&0xff, obj->start + offset);
+        if ((rc = cli_checkbudget(ctx)) != CL_SUCCESS)
+            break;
     }
 
     if (pdf.nobjs)
@@ -2435,21 +2483,24 @@ int cli_pdf(const char *dir, cli_ctx *ctx, off_t offset)
     if (rc == -1)
         pdf.flags |= 1 << BAD_PDF_TOOMANYOBJS;
 
+    pdf_index_objs(&pdf);
+
     /* must parse after finding all objs, so we can flag indirect objects */
     for (i=0;i<pdf.nobjs;i++) {
         struct pdf_obj *obj = &pdf.objs[i];
 
-        if (cli_checktimelimit(ctx) != CL_SUCCESS) {
-            cli_errmsg("Timeout reached in the PDF parser\n");
+        if ((rc = cli_checkbudget(ctx)) != CL_SUCCESS) {
+            cli_dbgmsg("cli_pdf: scan budget exhausted in the PDF parser\n");
 #if HAVE_JSON
             pdf_export_json(&pdf);
 #endif
             free(pdf.objs);
+            free(pdf.objidx);
             if (pdf.fileID)
                 free(pdf.fileID);
             if (pdf.key)
                 free(pdf.key);
-            return CL_ETIMEOUT;
+            return rc;
         }
 
         pdf_parseobj(&pdf, obj);
@@ -2480,7 +2531,7 @@ int cli_pdf(const char *dir, cli_ctx *ctx, off_t offset)
     }
 
     if (!rc) {
-        rc = run_pdf_hooks(&pdf, PDF_PHASE_PARSED, -1, -1);
+        rc = run_pdf_hooks(&pdf, PDF_PHASE_PARSED, NULL, -1);
         cli_dbgmsg("cli_pdf: (parsed hooks) returned %d\n", rc);
         if (rc == CL_VIRUS) {
             alerts++;
@@ -2494,17 +2545,18 @@ int cli_pdf(const char *dir, cli_ctx *ctx, off_t offset)
     for (i=0;!rc && i<pdf.nobjs;i++) {
         struct pdf_obj *obj = &pdf.objs[i];
 
-        if (cli_checktimelimit(ctx) != CL_SUCCESS) {
-            cli_errmsg("Timeout reached in the PDF parser\n");
+        if ((rc = cli_checkbudget(ctx)) != CL_SUCCESS) {
+            cli_dbgmsg("cli_pdf: scan budget exhausted in the PDF parser\n");
 #if HAVE_JSON
             pdf_export_json(&pdf);
 #endif
             free(pdf.objs);
+            free(pdf.objidx);
             if (pdf.fileID)
                 free(pdf.fileID);
             if (pdf.key)
                 free(pdf.key);
-            return CL_ETIMEOUT;
+            return rc;
         }
 
         rc = pdf_extract_obj(&pdf, obj, PDF_EXTRACT_OBJ_SCAN);
@@ -2532,7 +2584,7 @@ int cli_pdf(const char *dir, cli_ctx *ctx, off_t offset)
 
    if (pdf.flags && !rc) {
         cli_dbgmsg("cli_pdf: flags 0x%02x\n", pdf.flags);
-        rc = run_pdf_hooks(&pdf, PDF_PHASE_END, -1, -1);
+        rc = run_pdf_hooks(&pdf, PDF_PHASE_END, NULL, -1);
         if (rc == CL_VIRUS) {
             alerts++;
             if (SCAN_ALL) {
@@ -2576,6 +2628,7 @@ int cli_pdf(const char *dir, cli_ctx *ctx, off_t offset)
 
     cli_dbgmsg("cli_pdf: returning %d\n", rc);
     free(pdf.objs);
+    free(pdf.objidx);
     free(pdf.fileID);
     free(pdf.key);
 
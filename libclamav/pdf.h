@@ -123,9 +123,16 @@ enum enc_method {
     ENC_AESV3
 };
 
+/* an entry of pdf_struct.objidx, sorted by id and then by index */
+struct pdf_objidx {
+    uint32_t id;
+    uint32_t i; /* index in pdf_struct.objs */
+};
+
 struct pdf_struct {
     struct pdf_obj *objs;
-    unsigned nobjs;
+    unsigned nobjs, objs_alloc;
+    struct pdf_objidx *objidx; /* see pdf_index_objs(), NULL if not built */
     unsigned flags;
     unsigned enc_method_stream;
     unsigned enc_method_string;
@@ -158,6 +165,7 @@ void pdf_parseobj(struct pdf_struct *pdf, struct pdf_obj *obj);
 int pdf_extract_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t flags);
 int pdf_findobj(struct pdf_struct *pdf);
 struct pdf_obj *find_obj(struct pdf_struct *pdf, struct pdf_obj *obj, uint32_t objid);
+void pdf_index_objs(struct pdf_struct *pdf);
 
 void pdf_handle_enc(struct pdf_struct *pdf);
 char *decrypt_any(struct pdf_struct *pdf, uint32_t id, const char *in, off_t *length, enum enc_method enc_method);
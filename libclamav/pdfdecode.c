@@ -64,6 +64,7 @@
 #include "bytecode.h"
 #include "bytecode_api.h"
 #include "lzw/lzwdec.h"
+#include "inflate_buf.h"
 
 #define PDFTOKEN_FLAG_XREF 0x1
 
@@ -76,6 +77,7 @@ struct pdf_token {
 };
 
 static  int pdf_decodestream_internal(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token);
+static  int pdf_decode_chain(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token, const char *stream, uint32_t streamlen);
 static  int pdf_decode_dump(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_token *token, int lvl);
 
 static  int filter_ascii85decode(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_token *token);
@@ -85,12 +87,13 @@ static  int filter_asciihexdecode(struct pdf_struct *pdf, struct pdf_obj *obj, s
 static  int filter_decrypt(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token, int mode);
 static  int filter_lzwdecode(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token);
 
-off_t pdf_decodestream(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, const char *stream, uint32_t streamlen, int xref, int fout, int *rc)
+off_t pdf_decodestream(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, const char *stream, uint32_t streamlen, int xref, struct cli_extract *x, int *rc)
 {
     struct pdf_token *token;
     off_t rv;
+    int ret;
 
-    if (!stream || !streamlen || fout < 0) {
+    if (!stream || !streamlen || !x) {
         cli_dbgmsg("cli_pdf: no filters or stream on obj %u %u\n", obj->id>>8, obj->id&0xff);
         if (rc)
             *rc = CL_ENULLARG;
@@ -114,20 +117,24 @@ off_t pdf_decodestream(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_d
         token->flags |= PDFTOKEN_FLAG_XREF;
 
     token->success = 0;
-
-    token->content = cli_malloc(streamlen);
-    if (!token->content) {
-        free(token);
-        if (rc)
-            *rc = CL_EMEM;
-        return -1;
-    }
-    memcpy(token->content, stream, streamlen);
-    token->length = streamlen;
+    token->content = NULL;
+    token->length = 0;
 
     cli_dbgmsg("cli_pdf: detected %lu applied filters\n", (long unsigned)(obj->numfilters));
 
-    rv = pdf_decodestream_internal(pdf, obj, params, token);
+    if ((rv = pdf_decode_chain(pdf, obj, params, token, stream, streamlen)) == CL_BREAK) {
+        token->content = cli_malloc(streamlen);
+        if (!token->content) {
+            free(token);
+            if (rc)
+                *rc = CL_EMEM;
+            return -1;
+        }
+        memcpy(token->content, stream, streamlen);
+        token->length = streamlen;
+
+        rv = pdf_decodestream_internal(pdf, obj, params, token);
+    }
     /* return is generally ignored */
     if (rc) {
         if (rv == CL_VIRUS)
@@ -138,10 +145,12 @@ off_t pdf_decodestream(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_d
 
     if (token->success) {
         if (!cli_checklimits("pdf", pdf->ctx, token->length, 0, 0)) {
-            if (cli_writen(fout, token->content, token->length) != token->length) {
+            if ((ret = cli_extract_write(x, token->content, token->length)) != CL_SUCCESS) {
                 cli_errmsg("cli_pdf: failed to write output file\n");
                 if (rc)
-                    *rc = CL_EWRITE;
+                    *rc = ret;
+                free(token->content);
+                free(token);
                 return -1;
             }
             rv = token->length;
@@ -150,10 +159,12 @@ off_t pdf_decodestream(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_d
         if (!cli_checklimits("pdf", pdf->ctx, streamlen, 0, 0)) {
             cli_dbgmsg("cli_pdf: no non-forced filters decoded, returning raw stream\n");
 
-            if (cli_writen(fout, stream, streamlen) != streamlen) {
+            if ((ret = cli_extract_write(x, stream, streamlen)) != CL_SUCCESS) {
                 cli_errmsg("cli_pdf: failed to write output file\n");
                 if (rc)
-                    *rc = CL_EWRITE;
+                    *rc = ret;
+                free(token->content);
+                free(token);
                 return -1;
             }
             rv = streamlen;
@@ -523,6 +534,55 @@ static uint8_t *decode_nextlinestart(uint8_t *content, uint32_t length)
     return pt;
 }
 
+/* Inflates a well-formed zlib stream in one go, the buffer doubling as
+ * needed; CL_BREAK hands anything else (dictionary, bad checksum, errors,
+ * limits reached) over to the zlib loop in filter_flatedecode() */
+static int flatedecode_buf(struct pdf_struct *pdf, const uint8_t *content, uint32_t length, uint8_t **decoded, uint32_t *declen)
+{
+    struct cli_inflate *s;
+    uint8_t *buf = NULL, *temp;
+    uint32_t capacity = BUFSIZ;
+    size_t in, out;
+    int zstat, rc = CL_BREAK;
+
+    if (length < 6 || (content[0] & 0x0f) != 8 || (content[0] >> 4) > 7 ||
+        (content[1] & 0x20) || ((content[0] << 8) | content[1]) % 31)
+        return CL_BREAK;
+    if (!(s = cli_inflate_new(content + 2, length - 2, 0)))
+        return CL_BREAK;
+
+    while (1) {
+        if (!(temp = cli_realloc(buf, capacity))) {
+            zstat = CLI_INFLATE_ERROR;
+            break;
+        }
+        buf = temp;
+        if ((zstat = cli_inflate(s, buf, capacity)) != CLI_INFLATE_FULL)
+            break;
+        if (capacity > 0x7fffffff || cli_checklimits("pdf", pdf->ctx, capacity * 2, 0, 0) != CL_SUCCESS) {
+            zstat = CLI_INFLATE_ERROR;
+            break;
+        }
+        capacity *= 2;
+    }
+
+    if (zstat == CLI_INFLATE_END) {
+        in = 2 + cli_inflate_in(s);
+        out = cli_inflate_out(s);
+        if (in + 4 <= length && adler32(adler32(0, NULL, 0), buf, out) == (uint32_t)be32_to_host(cli_readint32(content + in))) {
+            if ((rc = cli_budget_inflate(pdf->ctx, out)) == CL_SUCCESS) {
+                *decoded = buf;
+                *declen = out;
+                buf = NULL;
+            }
+        }
+    }
+
+    cli_inflate_free(s);
+    free(buf);
+    return rc;
+}
+
 static int filter_flatedecode(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token)
 {
     uint8_t *decoded, *temp;
@@ -547,6 +607,18 @@ static int filter_flatedecode(struct pdf_struct *pdf, struct pdf_obj *obj, struc
             return CL_SUCCESS;
     }
 
+    if ((rc = flatedecode_buf(pdf, content, length, &decoded, &declen)) != CL_BREAK) {
+        if (rc == CL_SUCCESS) {
+            cli_dbgmsg("cli_pdf: inflated %lu bytes from %lu total bytes\n",
+                       (unsigned long)declen, (unsigned long)(token->length));
+            free(token->content);
+            token->content = decoded;
+            token->length = declen;
+        }
+        return rc;
+    }
+    rc = CL_SUCCESS;
+
     if (!(decoded = (uint8_t *)cli_calloc(BUFSIZ, sizeof(uint8_t)))) {
         cli_errmsg("cli_pdf: cannot allocate memory for decoded output\n");
         return CL_EMEM;
@@ -599,7 +671,8 @@ static int filter_flatedecode(struct pdf_struct *pdf, struct pdf_obj *obj, struc
     while (zstat == Z_OK && stream.avail_in) {
         /* extend output capacity if needed,*/
         if(stream.avail_out == 0) {
-            if ((rc = cli_checklimits("pdf", pdf->ctx, capacity+BUFSIZ, 0, 0)) != CL_SUCCESS)
+            if ((rc = cli_checklimits("pdf", pdf->ctx, capacity+BUFSIZ, 0, 0)) != CL_SUCCESS ||
+                (rc = cli_budget_inflate(pdf->ctx, BUFSIZ)) != CL_SUCCESS)
                 break;
 
             if (!(temp = cli_realloc(decoded, capacity + BUFSIZ))) {
@@ -768,18 +841,9 @@ static int filter_decrypt(struct pdf_struct *pdf, struct pdf_obj *obj, struct pd
     return CL_SUCCESS;
 }
 
-static int filter_lzwdecode(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token)
+static int lzw_earlychange(struct pdf_dict *params)
 {
-    uint8_t *decoded, *temp;
-    uint32_t declen = 0, capacity = 0;
-
-    uint8_t *content = (uint8_t *)token->content;
-    uint32_t length = token->length;
-    lzw_stream stream;
-    int echg = 1, lzwstat, skip = 0, rc = CL_SUCCESS;
-
-    if (pdf->ctx && !(pdf->ctx->dconf->other & OTHER_CONF_LZW))
-        return CL_BREAK;
+    int echg = 1;
 
     if (params) {
         struct pdf_dict_node *node = params->nodes;
@@ -802,6 +866,24 @@ static int filter_lzwdecode(struct pdf_struct *pdf, struct pdf_obj *obj, struct
         }
     }
 
+    return echg;
+}
+
+static int filter_lzwdecode(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token)
+{
+    uint8_t *decoded, *temp;
+    uint32_t declen = 0, capacity = 0;
+
+    uint8_t *content = (uint8_t *)token->content;
+    uint32_t length = token->length;
+    lzw_stream stream;
+    int echg, lzwstat, skip = 0, rc = CL_SUCCESS;
+
+    if (pdf->ctx && !(pdf->ctx->dconf->other & OTHER_CONF_LZW))
+        return CL_BREAK;
+
+    echg = lzw_earlychange(params);
+
     if (*content == '\r') {
         content++;
         length--;
@@ -868,7 +950,8 @@ static int filter_lzwdecode(struct pdf_struct *pdf, struct pdf_obj *obj, struct
     while (lzwstat == Z_OK && stream.avail_in) {
         /* extend output capacity if needed,*/
         if(stream.avail_out == 0) {
-            if ((rc = cli_checklimits("pdf", pdf->ctx, capacity+BUFSIZ, 0, 0)) != CL_SUCCESS)
+            if ((rc = cli_checklimits("pdf", pdf->ctx, capacity+BUFSIZ, 0, 0)) != CL_SUCCESS ||
+                (rc = cli_budget_inflate(pdf->ctx, BUFSIZ)) != CL_SUCCESS)
                 break;
 
             if (!(temp = cli_realloc(decoded, capacity + BUFSIZ))) {
@@ -946,3 +1029,451 @@ static int filter_lzwdecode(struct pdf_struct *pdf, struct pdf_obj *obj, struct
 
     return rc;
 }
+
+/*
+ * Single pass decoding of a filter chain
+ *
+ * The stage by stage decoders above turn the whole stream into a buffer for
+ * each filter. A chain of the streamable filters (ASCIIHex, ASCII85,
+ * RunLength, Flate and LZW) is instead pulled through the stages a buffer
+ * at a time, only the output of the last filter is kept in full. The limits
+ * are checked at the same points as the stage by stage decoders, for every
+ * stage. Anything those handle differently from a clean decoding (format
+ * errors, restarts, a limit reached past the first filter, ...) makes
+ * pdf_decode_chain() return CL_BREAK for the stream to be decoded again
+ * stage by stage, with the same results as before.
+ */
+struct pdf_stage {
+    uint32_t filter;
+    uint8_t in[BUFSIZ];     /* input from the previous stage */
+    size_t in_pos, in_len;
+    uint8_t out[BUFSIZ];    /* output not yet pulled by the next stage */
+    size_t out_pos, out_len;
+    int eof;                /* previous stage exhausted */
+    int done;               /* no more output */
+    uint64_t total;         /* bytes output */
+    uint64_t capacity;      /* buffer the stage by stage decoder would have */
+    int started;
+    z_stream z;
+    lzw_stream lzw;
+    uint64_t sum;           /* ASCII85 */
+    int quintet;
+};
+
+struct pdf_chain {
+    struct pdf_struct *pdf;
+    struct pdf_obj *obj;
+    struct pdf_dict *params;
+    const uint8_t *src;
+    uint32_t srclen, srcpos;
+    unsigned int n;
+    struct pdf_stage *st;
+    int bad_flate;          /* flag raised once the chain is decoded */
+    int limit;              /* the first stage stopped on a limit */
+};
+
+static int chain_pull(struct pdf_chain *c, unsigned int i, uint8_t *buf, size_t len, size_t *got);
+
+/* Makes need bytes of input available to stage i, unless the previous stage
+ * runs out */
+static int chain_fill(struct pdf_chain *c, unsigned int i, size_t need)
+{
+    struct pdf_stage *s = &c->st[i];
+    size_t avail = s->in_len - s->in_pos, got;
+    int rc;
+
+    if (avail >= need || s->eof)
+        return CL_SUCCESS;
+    if (avail && s->in_pos)
+        memmove(s->in, s->in + s->in_pos, avail);
+    s->in_pos = 0;
+    s->in_len = avail;
+
+    if (!i) {
+        got = MIN(c->srclen - c->srcpos, sizeof(s->in) - s->in_len);
+        memcpy(s->in + s->in_len, c->src + c->srcpos, got);
+        c->srcpos += got;
+        s->in_len += got;
+        if (c->srcpos == c->srclen)
+            s->eof = 1;
+        return CL_SUCCESS;
+    }
+
+    if ((rc = chain_pull(c, i - 1, s->in + s->in_len, sizeof(s->in) - s->in_len, &got)) != CL_SUCCESS)
+        return rc;
+    if (got < sizeof(s->in) - s->in_len)
+        s->eof = 1;
+    s->in_len += got;
+    return CL_SUCCESS;
+}
+
+/* A limit reached by the first stage leaves the raw stream, as in
+ * pdf_decodestream_internal(); past it the stages must be redone */
+static int chain_limit(struct pdf_chain *c, unsigned int i, int rc)
+{
+    if (!i)
+        c->limit = 1;
+    return i ? CL_BREAK : rc;
+}
+
+static int stage_asciihex(struct pdf_chain *c, unsigned int i)
+{
+    struct pdf_stage *s = &c->st[i];
+    int rc;
+
+    while (s->out_len < sizeof(s->out)) {
+        if ((rc = chain_fill(c, i, 2)) != CL_SUCCESS)
+            return rc;
+        if (s->in_len - s->in_pos < 2 || s->in[s->in_pos] == '>') {
+            s->done = 1;
+            break;
+        }
+        if (s->in[s->in_pos] == ' ') {
+            s->in_pos++;
+            continue;
+        }
+        if (cli_hex2str_to((const char *)s->in + s->in_pos, (char *)s->out + s->out_len, 2) == -1) {
+            /* tolerated within the last 3 bytes only */
+            if ((rc = chain_fill(c, i, 4)) != CL_SUCCESS)
+                return rc;
+            if (s->in_len - s->in_pos >= 4)
+                return CL_BREAK;
+            s->in_pos++;
+            continue;
+        }
+        s->in_pos += 2;
+        s->out_len++;
+    }
+    return CL_SUCCESS;
+}
+
+static int stage_ascii85(struct pdf_chain *c, unsigned int i)
+{
+    struct pdf_stage *s = &c->st[i];
+    int byte, rc;
+
+    while (s->out_len + 4 <= sizeof(s->out)) {
+        if ((rc = chain_fill(c, i, 1)) != CL_SUCCESS)
+            return rc;
+        if (s->in_pos == s->in_len) {
+            s->done = 1;
+            break;
+        }
+        byte = s->in[s->in_pos++];
+
+        if (byte == '~') {
+            if ((rc = chain_fill(c, i, 1)) != CL_SUCCESS)
+                return rc;
+            if (s->in_pos < s->in_len && s->in[s->in_pos] == '>')
+                byte = EOF;
+        }
+
+        if (byte >= '!' && byte <= 'u') {
+            s->sum = (s->sum * 85) + ((uint32_t)byte - '!');
+            if (++s->quintet == 5) {
+                s->out[s->out_len++] = (uint8_t)(s->sum >> 24);
+                s->out[s->out_len++] = (uint8_t)((s->sum >> 16) & 0xFF);
+                s->out[s->out_len++] = (uint8_t)((s->sum >> 8) & 0xFF);
+                s->out[s->out_len++] = (uint8_t)(s->sum & 0xFF);
+                s->quintet = 0;
+                s->sum = 0;
+            }
+        } else if (byte == 'z') {
+            if (s->quintet)
+                return CL_BREAK;
+            memset(s->out + s->out_len, 0, 4);
+            s->out_len += 4;
+        } else if (byte == EOF) {
+            if (s->quintet) {
+                int j;
+
+                if (s->quintet == 1)
+                    return CL_BREAK;
+                for (j = s->quintet; j < 5; j++)
+                    s->sum *= 85;
+                s->sum += (0xFFFFFF >> ((s->quintet - 2) * 8));
+                for (j = 0; j < s->quintet - 1; j++)
+                    s->out[s->out_len++] = (uint8_t)((s->sum >> (24 - 8 * j)) & 0xFF);
+            }
+            s->done = 1;
+            break;
+        } else if (!isspace(byte)) {
+            return CL_BREAK;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+static int stage_rldecode(struct pdf_chain *c, unsigned int i)
+{
+    struct pdf_stage *s = &c->st[i];
+    unsigned int srclen, n;
+    int rc;
+
+    while (s->out_len + 128 <= sizeof(s->out)) {
+        if ((rc = chain_fill(c, i, 1)) != CL_SUCCESS)
+            return rc;
+        if (s->in_pos == s->in_len) {
+            s->done = 1;
+            break;
+        }
+        srclen = s->in[s->in_pos++];
+        if (srclen == 128) {
+            s->done = 1;
+            break;
+        }
+
+        n = srclen < 128 ? srclen + 1 : 1;
+        if ((rc = chain_fill(c, i, n)) != CL_SUCCESS)
+            return rc;
+        if (s->in_len - s->in_pos < n)
+            return CL_BREAK;
+
+        if (s->total + s->out_len + (srclen < 128 ? n : 258 - srclen) > s->capacity) {
+            if ((rc = cli_checklimits("pdf", c->pdf->ctx, s->capacity + BUFSIZ, 0, 0)) != CL_SUCCESS)
+                return chain_limit(c, i, rc);
+            s->capacity += BUFSIZ;
+        }
+
+        if (srclen < 128) {
+            memcpy(s->out + s->out_len, s->in + s->in_pos, n);
+            s->out_len += n;
+        } else {
+            memset(s->out + s->out_len, s->in[s->in_pos], 257 - srclen);
+            s->out_len += 257 - srclen;
+        }
+        s->in_pos += n;
+    }
+    return CL_SUCCESS;
+}
+
+/* Flate and LZW */
+static int stage_inflate(struct pdf_chain *c, unsigned int i)
+{
+    struct pdf_stage *s = &c->st[i];
+    size_t room, produced;
+    int zstat, end, rc;
+
+    if (!s->started) {
+        if ((rc = chain_fill(c, i, 1)) != CL_SUCCESS)
+            return rc;
+        /* skipped and flagged by the stage by stage decoders */
+        if (s->in_pos == s->in_len || s->in[s->in_pos] == '\r')
+            return CL_BREAK;
+        if (s->filter == OBJ_FILTER_FLATE) {
+            if (inflateInit(&s->z) != Z_OK)
+                return CL_BREAK;
+        } else {
+            if (lzw_earlychange(c->params))
+                s->lzw.flags |= LZW_FLAG_EARLYCHG;
+            if (lzwInit(&s->lzw) != LZW_OK)
+                return CL_BREAK;
+        }
+        s->started = 1;
+    }
+
+    while (s->out_len < sizeof(s->out)) {
+        if (s->in_pos == s->in_len) {
+            if ((rc = chain_fill(c, i, 1)) != CL_SUCCESS)
+                return rc;
+            /* out of input, completed as on Z_OK */
+            if (s->in_pos == s->in_len) {
+                s->done = 1;
+                break;
+            }
+        }
+
+        if (s->total + s->out_len == s->capacity) {
+            if ((rc = cli_checklimits("pdf", c->pdf->ctx, s->capacity + BUFSIZ, 0, 0)) != CL_SUCCESS ||
+                (rc = cli_budget_inflate(c->pdf->ctx, BUFSIZ)) != CL_SUCCESS)
+                return chain_limit(c, i, rc);
+            s->capacity += BUFSIZ;
+        }
+        room = MIN(sizeof(s->out) - s->out_len, s->capacity - s->total - s->out_len);
+
+        if (s->filter == OBJ_FILTER_FLATE) {
+            s->z.next_in = (Bytef *)s->in + s->in_pos;
+            s->z.avail_in = s->in_len - s->in_pos;
+            s->z.next_out = (Bytef *)s->out + s->out_len;
+            s->z.avail_out = room;
+            zstat = inflate(&s->z, Z_NO_FLUSH);
+            s->in_pos = s->in_len - s->z.avail_in;
+            produced = room - s->z.avail_out;
+            end = zstat == Z_STREAM_END;
+            zstat = zstat == Z_OK || end;
+        } else {
+            s->lzw.next_in = s->in + s->in_pos;
+            s->lzw.avail_in = s->in_len - s->in_pos;
+            s->lzw.next_out = s->out + s->out_len;
+            s->lzw.avail_out = room;
+            zstat = lzwInflate(&s->lzw);
+            s->in_pos = s->in_len - s->lzw.avail_in;
+            produced = room - s->lzw.avail_out;
+            end = zstat == LZW_STREAM_END;
+            zstat = zstat == LZW_OK || end;
+        }
+        s->out_len += produced;
+
+        /* nothing decoded: the stage by stage decoders restart at the next
+         * line or give up */
+        if (!s->total && !s->out_len && (!zstat || end))
+            return CL_BREAK;
+        if (!zstat) {
+            cli_dbgmsg("cli_pdf: error inflating PDF stream in %u %u obj after %llu bytes\n",
+                       c->obj->id>>8, c->obj->id&0xff, (long long unsigned)(s->total + s->out_len));
+            c->bad_flate = 1;
+            end = 1;
+        }
+        if (end) {
+            s->done = 1;
+            break;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+/* Output of stage i; *got < len at its end */
+static int chain_pull(struct pdf_chain *c, unsigned int i, uint8_t *buf, size_t len, size_t *got)
+{
+    struct pdf_stage *s = &c->st[i];
+    size_t todo;
+    int rc;
+
+    *got = 0;
+    while (*got < len) {
+        if (s->out_pos < s->out_len) {
+            todo = MIN(len - *got, s->out_len - s->out_pos);
+            memcpy(buf + *got, s->out + s->out_pos, todo);
+            s->out_pos += todo;
+            *got += todo;
+            continue;
+        }
+        if (s->done)
+            break;
+
+        s->total += s->out_len;
+        s->out_pos = s->out_len = 0;
+        switch (s->filter) {
+        case OBJ_FILTER_AH:
+            rc = stage_asciihex(c, i);
+            break;
+        case OBJ_FILTER_A85:
+            rc = stage_ascii85(c, i);
+            break;
+        case OBJ_FILTER_RL:
+            rc = stage_rldecode(c, i);
+            break;
+        default:
+            rc = stage_inflate(c, i);
+            break;
+        }
+        if (rc != CL_SUCCESS)
+            return rc;
+
+        /* the rest of the input is still decoded, for the errors and flags
+         * it could bring */
+        while (s->done && !s->eof) {
+            if (!i) {
+                s->eof = 1;
+                break;
+            }
+            s->in_pos = s->in_len = 0;
+            if ((rc = chain_fill(c, i, sizeof(s->in))) != CL_SUCCESS)
+                return rc;
+        }
+    }
+    return CL_SUCCESS;
+}
+
+static int pdf_decode_chain(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, struct pdf_token *token, const char *stream, uint32_t streamlen)
+{
+    struct pdf_chain c;
+    uint8_t *decoded = NULL, *temp;
+    size_t declen = 0, capacity = 0, got;
+    unsigned int i;
+    int rc = CL_SUCCESS;
+
+    if (pdf->ctx->engine->keeptmp || (pdf->flags & (1 << DECRYPTABLE_PDF)))
+        return CL_BREAK;
+
+    /* the chain ends at the first filter decoded on its own, whose
+     * decoder would stop the stage by stage decoding there */
+    for (i = 0; i < obj->numfilters; i++) {
+        if (obj->filterlist[i] == OBJ_FILTER_LZW && !(pdf->ctx->dconf->other & OTHER_CONF_LZW))
+            break;
+        if (obj->filterlist[i] != OBJ_FILTER_AH && obj->filterlist[i] != OBJ_FILTER_A85 &&
+            obj->filterlist[i] != OBJ_FILTER_RL && obj->filterlist[i] != OBJ_FILTER_FLATE &&
+            obj->filterlist[i] != OBJ_FILTER_LZW)
+            break;
+    }
+    if (i < 2 || (i < obj->numfilters && obj->filterlist[i] == OBJ_FILTER_CRYPT))
+        return CL_BREAK;
+
+    memset(&c, 0, sizeof(c));
+    c.pdf = pdf;
+    c.obj = obj;
+    c.params = params;
+    c.src = (const uint8_t *)stream;
+    c.srclen = streamlen;
+    c.n = i;
+    if (!(c.st = cli_calloc(c.n, sizeof(*c.st))))
+        return CL_BREAK;
+    for (i = 0; i < c.n; i++) {
+        c.st[i].filter = obj->filterlist[i];
+        c.st[i].capacity = BUFSIZ;
+    }
+
+    cli_dbgmsg("cli_pdf: decoding %u filters in one pass\n", c.n);
+
+    do {
+        if (declen == capacity) {
+            if (capacity >= 0x80000000 || !(temp = cli_realloc(decoded, capacity ? capacity * 2 : BUFSIZ))) {
+                rc = CL_BREAK;
+                break;
+            }
+            decoded = temp;
+            capacity = capacity ? capacity * 2 : BUFSIZ;
+        }
+        if ((rc = chain_pull(&c, c.n - 1, decoded + declen, capacity - declen, &got)) != CL_SUCCESS)
+            break;
+        declen += got;
+    } while (declen == capacity);
+
+    for (i = 0; i < c.n && rc == CL_SUCCESS; i++) {
+        /* an empty stage ends the stage by stage decoding */
+        if (!c.st[i].total && !c.st[i].out_len)
+            rc = CL_BREAK;
+    }
+
+    for (i = 0; i < c.n; i++) {
+        if (!c.st[i].started)
+            continue;
+        if (c.st[i].filter == OBJ_FILTER_FLATE)
+            (void)inflateEnd(&c.st[i].z);
+        else
+            (void)lzwInflateEnd(&c.st[i].lzw);
+    }
+    free(c.st);
+
+    if (rc != CL_SUCCESS) {
+        free(decoded);
+        if (c.limit) {
+            cli_dbgmsg("cli_pdf: stopping after 0 (of %lu) filters (reason: decoding error)\n",
+                       (long unsigned)(obj->numfilters));
+            return CL_SUCCESS;
+        }
+        cli_dbgmsg("cli_pdf: decoding the filters one by one\n");
+        return CL_BREAK;
+    }
+
+    if (c.bad_flate)
+        pdfobj_flag(pdf, obj, BAD_FLATE);
+
+    cli_dbgmsg("cli_pdf: decoded %lu bytes from %lu total bytes\n",
+               (unsigned long)declen, (unsigned long)streamlen);
+
+    token->content = decoded;
+    token->length = declen;
+    token->success = c.n;
+    return CL_SUCCESS;
+}
@@ -35,7 +35,8 @@
 #define __PDFDECODE_H__
 
 #include "pdf.h"
+#include "scanners.h"
 
-off_t pdf_decodestream(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, const char *stream, uint32_t streamlen, int xref, int fout, int *rc);
+off_t pdf_decodestream(struct pdf_struct *pdf, struct pdf_obj *obj, struct pdf_dict *params, const char *stream, uint32_t streamlen, int xref, struct cli_extract *x, int *rc);
 
 #endif /* __PDFDECODE_H__ */
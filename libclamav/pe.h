@@ -173,6 +173,7 @@ enum {
 };
 
 int cli_peheader(fmap_t *map, struct cli_exe_info *peinfo);
+int cli_pe_embedded(fmap_t *map, size_t offset);
 int cli_checkfp_pe(cli_ctx *ctx, uint8_t *authsha1, stats_section_t *hashes, uint32_t flags);
 int cli_genhash_pe(cli_ctx *ctx, unsigned int class, int type);
 
@@ -29,6 +29,7 @@
 #include "clamav.h"
 #include "pe_icons.h"
 #include "others.h"
+#include "coldstore.h"
 
 #define READ32(x) cli_readint32(&(x))
 #define READ16(x) cli_readint16(&(x))
@@ -639,22 +640,77 @@ static const uint32_t btable[256][3] = {
  {0x11e2194b,0x07273d51,0x5e2f5196}, {0x120b3333,0x0737ae14,0x5f07c8f3},
 };
 
-static void lab(double r, double g, double b, double *L, double *A, double *B) {
-    double x, y, z;
-    r /= 255.0f;
-    g /= 255.0f;
-    b /= 255.0f;
-
-    if (r > 0.04045f) r = pow(((r + 0.055f) / 1.055f), 2.4f);
-    else r /= 12.92f;
-    if (g > 0.04045f) g = pow(((g + 0.055f) / 1.055f), 2.4f);
-    else g /= 12.92f;
-    if (b > 0.04045f) b = pow(((b + 0.055f) / 1.055f), 2.4f);
-    else b /= 12.92f;
+/* linear RGB (0-100) of the sRGB components, the first half of lab() */
+static const double srgb[256] = {
+ 0, 0.030352698175647903, 0.060705396351295807, 0.091058094526943717,
+ 0.12141079270259161, 0.15176349087823951, 0.18211618905388743, 0.21246888722953536,
+ 0.24282158540518323, 0.27317428358083118, 0.30352698175647902, 0.33465353808650494,
+ 0.36765069180134685, 0.40247165895218207, 0.43914415856229133, 0.47769530062887966,
+ 0.5181516205578427, 0.56053911054168992, 0.60488324824406492, 0.65120902310083817,
+ 0.69954096050356063, 0.74990314409433323, 0.80231923637038705, 0.85681249777083557,
+ 0.91340580439616936, 0.97212166449250803, 1.0329822338167323, 1.096009329985052,
+ 1.1612244458958312, 1.2286487623073801, 1.2983031596426517, 1.3702082290851145,
+ 1.4443842830234273, 1.520851364896658, 1.5996292584866714, 1.6807374966997592,
+ 1.7641953698755808, 1.8500219336579482, 1.9382360164587906, 2.028856226543879,
+ 2.1219009587663118, 2.2173884009715903, 2.3153365400960193, 2.4157631679784317,
+ 2.5186858869035387, 2.6241221148937885, 2.7320890907652462, 2.8426038789618318,
+ 2.9556833741811417, 3.0713443058040952, 3.1896032421397353, 3.3104765944957175,
+ 3.4339806210841983, 3.5601314307722705, 3.6889449866852941, 3.8204371096710856,
+ 3.9546234816322237, 4.0915196487333603, 4.2311410244899301, 4.3735028927442485,
+ 4.5186204105345782, 4.6665086108624871, 4.8171824053633339, 4.9706565868845942,
+ 5.1269458319763217, 5.2860647032978578, 5.4480276519446518, 5.6128490196987704,
+ 5.780543041206597, 5.9511238460868467, 6.1246054609720426, 6.3010018114862394,
+ 6.4803267241617961, 6.6625939282977127, 6.8478170577619792, 7.036009652740284,
+ 7.2271851614332165, 7.4213569417040697, 7.6185382626791975, 7.8187423063028145,
+ 8.0219821688480089, 8.2282708623856351, 8.4376213162127378, 8.650046378241969,
+ 8.8655588163535679, 9.0841713197111478, 9.3058965000427296, 9.5307468928882102,
+ 9.7587349588145269, 9.9898730845996262, 10.224173584386335, 10.461648700807201,
+ 10.702310606081298, 10.946171403083969, 11.193243126390378, 11.443537743293792,
+ 11.697067154799438, 11.953843196594683, 12.213877639996399, 12.477182192876139,
+ 12.74376850056397, 13.013648146731486, 13.286832654254809, 13.563333486058088,
+ 13.843162045938156, 14.126329679370933, 14.412847674300059, 14.702727261908377,
+ 14.995979617372759, 15.292615860602721, 15.592647056963349, 15.896084217982962,
+ 16.202938302046046, 16.51322021507174, 16.82694081117836, 17.144110893334393,
+ 17.464741213996287, 17.788842475733386, 18.116425331840443, 18.447500386937961,
+ 18.782078197560772, 19.12016927273514, 19.461784074544664, 19.806933018685289,
+ 20.155626475009829, 20.507874768062074, 20.863688177600913, 21.22307693911463,
+ 21.586051244325741, 21.952621241686487, 22.322797036865293, 22.696588693224388,
+ 23.074006232288863, 23.455059634207238, 23.839758838204009, 24.228113743024046,
+ 24.620134207369254, 25.015830050327708, 25.41521105179525, 25.818286952889903,
+ 26.22506745635922, 26.635562226980646, 27.049780891955294, 27.467733041294935,
+ 27.889428228202718, 28.314875969447446, 28.744085745731855, 29.177067002054812,
+ 29.613829148067598, 30.054381558424488, 30.498733573127769, 30.946894497867177,
+ 31.398873604354023, 31.854680130650014, 32.314323281490964, 32.777812228605505,
+ 33.245156111028841, 33.716364035411594, 34.191445076324179, 34.67040827655628,
+ 35.153262647412006, 35.640017169000501, 36.130680790522298, 36.625262430551423,
+ 37.123770977313221, 37.626215288958235, 38.132604193832151, 38.642946490741586,
+ 39.157250949216298, 39.675526309767463, 40.197781284142373, 40.724024555575461,
+ 41.254264779035864, 41.7885105814713, 42.326770562048907, 42.86905329239238,
+ 43.415367316816059, 43.965721152555695, 44.520123289996086, 45.078582192895652,
+ 45.641106298607966, 46.207704018300227, 46.778383737168923, 47.353153814652586,
+ 47.932022584641686, 48.514998355685805, 49.102089411198051, 49.693304009656899,
+ 50.28865038480528, 50.88813674584717, 51.491771277641703, 52.099562140894761,
+ 52.711517472347978, 53.327645384965635, 53.947953968118988, 54.572451287768352,
+ 55.201145386642914, 55.834044284418269, 56.471155977891854, 57.112488441156131,
+ 57.758049625769722, 58.407847460926362, 59.061889853621921, 59.720184688819302,
+ 60.382739829611488, 61.049563117382412, 61.720662371966206, 62.396045391804336,
+ 63.075719954100947, 63.75969381497648, 64.447974709619231, 65.140570352435518,
+ 65.83748843719782, 66.538736637191249, 67.244322605358491, 67.954253974442921,
+ 68.668538357130174, 69.387183346188053, 70.110196514604979, 70.83758541572665,
+ 71.569357583391536, 72.305520532064406, 73.046081756968846, 73.79104873421791,
+ 74.540428920943597, 75.294229755424794, 76.052458657213847, 76.815123027261791,
+ 77.58223024804208, 78.353787683673247, 79.129802680040001, 79.910282564913189,
+ 80.69523464806835, 81.484666221403131, 82.278584559053385, 83.076996917508112,
+ 83.879910535723141, 84.687332635233616, 85.499270420265375, 86.315731077845172,
+ 87.136721777909713, 87.962249673413623, 88.792321900436207, 89.626945578287277,
+ 90.466127809611876, 91.309875680493633, 92.158196260557773, 93.011096603072232,
+ 93.868583745048525, 94.730664707341106, 95.597346494745906, 96.46863609609801,
+ 97.344540484368181, 98.225066616758582, 99.110221434797495, 100.00001186443315,
+};
 
-    r *= 100.0f;
-    g *= 100.0f;
-    b *= 100.0f;
+static void lab(unsigned int red, unsigned int green, unsigned int blue, double *L, double *A, double *B) {
+    double x, y, z;
+    double r = srgb[red], g = srgb[green], b = srgb[blue];
 
     x = r * 0.4124f + g * 0.3576f + b * 0.1805f;
     y = r * 0.2126f + g * 0.7152f + b * 0.0722f;
@@ -718,7 +774,7 @@ static double labdiff(unsigned int rgb) {
 
     lab(r, g, b, &L2, &A2, &B2);
 
-    return sqrt(pow(L1 - L2, 2.0f) + pow(A1 - A2, 2.0f) + pow(B1 - B2, 2.0f));
+    return sqrt((L1 - L2) * (L1 - L2) + (A1 - A2) * (A1 - A2) + (B1 - B2) * (B1 - B2));
 }
 
 #ifndef USE_FLOATS
@@ -804,7 +860,7 @@ static void makebmp(const char *step, const char *tempd, int w, int h, void *dat
     free(fname);
 }
 
-static unsigned int matchpoint(unsigned int side, unsigned int *x1, unsigned int *y1, unsigned int *avg1, const unsigned int *x2, const unsigned int *y2, const unsigned int *avg2, unsigned int max) {
+static unsigned int matchpoint(unsigned int side, const unsigned int *x1, const unsigned int *y1, const unsigned int *avg1, const unsigned int *x2, const unsigned int *y2, const unsigned int *avg2, unsigned int max) {
     unsigned int i, j, best, match = 0, ksize = side / 4;
 
     for(i=0; i<3; i++) {
@@ -826,7 +882,7 @@ static unsigned int matchpoint(unsigned int side, unsigned int *x1, unsigned int
     return match / 3;
 }
 
-static unsigned int matchbwpoint(unsigned int side, unsigned int *x1a, unsigned int *y1a, unsigned int *avg1a, unsigned int *x1b, unsigned int *y1b, unsigned int *avg1b, const unsigned int *x2a, const unsigned int *y2a, const unsigned int *avg2a, const unsigned int *x2b, const unsigned int *y2b, const unsigned int *avg2b) {
+static unsigned int matchbwpoint(unsigned int side, const unsigned int *x1a, const unsigned int *y1a, const unsigned int *avg1a, const unsigned int *x1b, const unsigned int *y1b, const unsigned int *avg1b, const unsigned int *x2a, const unsigned int *y2a, const unsigned int *avg2a, const unsigned int *x2b, const unsigned int *y2b, const unsigned int *avg2b) {
     unsigned int i, j, best, match = 0, ksize = side / 4;
     unsigned int x1[6], y1[6], avg1[6], x2[6], y2[6], avg2[6];
 
@@ -880,40 +936,69 @@ static void hsv(unsigned int c, unsigned int *r, unsigned int *g, unsigned int *
 	*s = 255 * (*delta) / max;
 }
 
+/* hsv() derived values of a pixel, computed once for all the windows */
+struct icon_px {
+    unsigned int col, light, colored, r, g, b;
+};
+
+#define COUNTCOLOR(px) do {		\
+	if((px)->colored) {		\
+	    res->ccount++;		\
+	    res->rsum += (px)->r;	\
+	    res->gsum += (px)->g;	\
+	    res->bsum += (px)->b;	\
+	}				\
+    } while(0)
+
 static int getmetrics(unsigned int side, unsigned int *imagedata, struct icomtr *res, const char *tempd) {
     unsigned int x, y, xk, yk, i, j, *tmp;
     unsigned int ksize = side / 4, bwonly = 0;
     unsigned int edge_avg[6], edge_x[6]={0,0,0,0,0,0}, edge_y[6]={0,0,0,0,0,0}, noedge_avg[6], noedge_x[6]={0,0,0,0,0,0}, noedge_y[6]={0,0,0,0,0,0};
+    struct icon_px *px;
     double *sobel;
 
     if(!(tmp = cli_malloc(side*side*4*2))) {
         cli_errmsg("getmetrics: Unable to allocate memory for tmp %u\n", (side*side*4*2));
         return CL_EMEM;
     }
+    if(!(px = cli_malloc(side*side*sizeof(*px)))) {
+        cli_errmsg("getmetrics: Unable to allocate memory for the hsv data\n");
+	free(tmp);
+        return CL_EMEM;
+    }
 
     memset(res, 0, sizeof(*res));
 
+    for(i=0; i<side*side; i++) {
+	unsigned int r, g, b, s, v, delta;
+
+	hsv(imagedata[i], &r, &g, &b, &s, &v, &delta);
+	px[i].col = (unsigned int)sqrt(s*s*v);
+	px[i].light = v;
+	px[i].colored = s> 85 && v> 85;
+	if(px[i].colored) {
+	    px[i].r = 100 - 100 * abs((int)g - (int)b) / delta;
+	    px[i].g = 100 - 100 * abs((int)r - (int)b) / delta;
+	    px[i].b = 100 - 100 * abs((int)r - (int)g) / delta;
+	}
+    }
+
     /* compute colored, gray, bright and dark areas, color presence */
     for(y=0; y<=side - ksize; y++) {
 	for(x=0; x<=side - ksize; x++) {
 	    unsigned int colsum = 0, lightsum = 0;
-	    unsigned int r, g, b, s, v, delta;
+	    const struct icon_px *p;
 
 	    if(x==0 && y==0) {
 		/* Here we handle the 1st window which is fully calculated */
 		for(yk=0; yk<ksize; yk++) {
 		    for(xk=0; xk<ksize; xk++) {
-			hsv(imagedata[yk * side + xk], &r, &g, &b, &s, &v, &delta);
-			colsum += (unsigned int)sqrt(s*s*v);
-			lightsum += v;
+			p = &px[yk * side + xk];
+			colsum += p->col;
+			lightsum += p->light;
 
 			/* count colors (full square) */
-			if(s> 85 && v> 85) {
-			    res->ccount++;
-			    res->rsum += 100 - 100 * abs((int)g - (int)b) / delta;
-			    res->gsum += 100 - 100 * abs((int)r - (int)b) / delta;
-			    res->bsum += 100 - 100 * abs((int)r - (int)g) / delta;
-			}
+			COUNTCOLOR(p);
 		    }
 		}
 	    } else if(x) { /* Here we incrementally calculate rows and columns
@@ -922,49 +1007,41 @@ static int getmetrics(unsigned int side, unsigned int *imagedata, struct icomtr
 		lightsum = tmp[side*side + y*side+x-1];
 		for(yk=0; yk<ksize; yk++) {
 		    /* remove previous column */ 
-		    hsv(imagedata[(y+yk) * side + x-1], &r, &g, &b, &s, &v, &delta);
-		    colsum -= (unsigned int)sqrt(s*s*v);
-		    lightsum -= v;
+		    p = &px[(y+yk) * side + x-1];
+		    colsum -= p->col;
+		    lightsum -= p->light;
 		    /* add next column */
-		    hsv(imagedata[(y+yk) * side + x+ksize-1], &r, &g, &b, &s, &v, &delta);
-		    colsum += (unsigned int)sqrt(s*s*v);
-		    lightsum += v;
+		    p = &px[(y+yk) * side + x+ksize-1];
+		    colsum += p->col;
+		    lightsum += p->light;
 
 		    /* count colors (full column or only the last px) */
-		    if((y == 0 || yk==ksize-1) && s> 85 && v> 85) {
-		    	res->ccount++;
-		    	res->rsum += 100 - 100 * abs((int)g - (int)b) / delta;
-		    	res->gsum += 100 - 100 * abs((int)r - (int)b) / delta;
-		    	res->bsum += 100 - 100 * abs((int)r - (int)g) / delta;
-		    }
+		    if(y == 0 || yk==ksize-1)
+			COUNTCOLOR(p);
 		}
 	    } else {
 		colsum = tmp[(y-1)*side];
 		lightsum = tmp[side*side + (y-1)*side];
 		for(xk=0; xk<ksize; xk++) {
 		    /* remove previous row */
-		    hsv(imagedata[(y-1) * side + xk], &r, &g, &b, &s, &v, &delta);
-		    colsum -= (unsigned int)sqrt(s*s*v);
-		    lightsum -= v;
+		    p = &px[(y-1) * side + xk];
+		    colsum -= p->col;
+		    lightsum -= p->light;
 
 		    /* add next row */
-		    hsv(imagedata[(y+ksize-1) * side + xk], &r, &g, &b, &s, &v, &delta);
-		    colsum += (unsigned int)sqrt(s*s*v);
-		    lightsum += v;
+		    p = &px[(y+ksize-1) * side + xk];
+		    colsum += p->col;
+		    lightsum += p->light;
 
 		    /* count colors (full row) */
-		    if(s> 85 && v> 85) {
-		    	res->ccount++;
-		    	res->rsum += 100 - 100 * abs((int)g - (int)b) / delta;
-		    	res->gsum += 100 - 100 * abs((int)r - (int)b) / delta;
-		    	res->bsum += 100 - 100 * abs((int)r - (int)g) / delta;
-		    }
+		    COUNTCOLOR(p);
 		}
 	    }
 	    tmp[y*side+x] = colsum;
 	    tmp[side*side + y*side+x] = lightsum;
 	}
     }
+    free(px);
 
 
     /* extract top 3 non overlapping areas for: colored, gray, bright and dark areas, color presence */
@@ -1059,8 +1136,15 @@ static int getmetrics(unsigned int side, unsigned int *imagedata, struct icomtr
 #define sobel imagedata
 #endif
     for(y=0; y<side; y++) {
+	unsigned int last = 0;
 	for(x=0; x<side; x++) {
-	    sobel[y * side + x] = LABDIFF(imagedata[y * side + x]);
+	    unsigned int c = imagedata[y * side + x];
+	    /* runs of the same color are common in icons */
+	    if(x && c == last)
+		sobel[y * side + x] = sobel[y * side + x - 1];
+	    else
+		sobel[y * side + x] = LABDIFF(c);
+	    last = c;
 	}
     }
     for(y=1; y<side-1; y++) {
@@ -1291,8 +1375,188 @@ static int getmetrics(unsigned int side, unsigned int *imagedata, struct icomtr
     return CL_CLEAN;
 }
 
-static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
-    icon_groupset *set = icon_env->set;
+/* The metrics of an icon don't depend on the signature: they're kept with
+ * the map for the other icon conditions of the scan */
+enum {
+    ICON_METRICS,	/* metrics computed */
+    ICON_NOMETRICS,	/* not computed, no signature wanted them */
+    ICON_SKIP,		/* not matchable */
+    ICON_ERR_OOF,
+    ICON_ERR_BHOOF,
+    ICON_ERR_BHTS,
+    ICON_ERR_TSTL,
+    ICON_ERR_INSL
+};
+
+struct icon_metrics {
+    uint32_t rva;
+    unsigned int state;
+    unsigned int side;
+    struct icomtr metrics;
+};
+
+/* followed by the icon_metrics entries */
+struct icon_cache {
+    size_t off, len;
+    unsigned int count;
+};
+
+static struct icon_metrics *icon_cached(fmap_t *map, uint32_t rva) {
+    struct icon_cache *c = map->iconmetrics;
+    struct icon_metrics *m;
+    unsigned int i;
+
+    if(!c)
+	return NULL;
+    if(c->off != map->nested_offset || c->len != map->len) {
+	free(c);
+	map->iconmetrics = NULL;
+	return NULL;
+    }
+    m = (struct icon_metrics *)(c + 1);
+    for(i=0; i<c->count; i++)
+	if(m[i].rva == rva)
+	    return &m[i];
+    return NULL;
+}
+
+static void icon_cache_add(fmap_t *map, const struct icon_metrics *im) {
+    struct icon_cache *c = map->iconmetrics;
+    unsigned int count = c ? c->count : 0;
+
+    if(!(count % 16)) {
+	if(!(c = cli_realloc(c, sizeof(*c) + (count + 16) * sizeof(*im))))
+	    return;
+	if(!map->iconmetrics) {
+	    c->off = map->nested_offset;
+	    c->len = map->len;
+	    c->count = 0;
+	}
+	map->iconmetrics = c;
+    }
+    ((struct icon_metrics *)(c + 1))[c->count++] = *im;
+}
+
+/* Side of the image once scaled by parseicon() */
+static unsigned int icon_side(unsigned int width, unsigned int height, unsigned int scalemode) {
+    switch(scalemode) {
+    case 0:
+	return width;
+    case 1:
+	while(width > 32)
+	    width /= 2;
+	return width;
+    default:
+	if(abs((int)width - 32) + abs((int)height - 32) < abs((int)width - 24) + abs((int)height - 24))
+	    return 32;
+	else if(abs((int)width - 24) + abs((int)height - 24) < abs((int)width - 16) + abs((int)height - 16))
+	    return 24;
+	return 16;
+    }
+}
+
+#define ICON_INSET(set, type, g) ((set)->v[type][(g) / 64] & ((uint64_t)1 << ((g) % 64)))
+
+/* Returns 1 if a signature in the groups of set has icons of this size */
+static int icon_wanted(const icon_groupset *set, const struct icon_matcher *matcher, unsigned int side) {
+    unsigned int enginesize = (side >> 3) - 2, g, x;
+    const unsigned int *idx = matcher->group_index[enginesize];
+
+    if(!idx)
+	return 0;
+    for(g=0; g<matcher->group_counts[0]; g++) {
+	if(!ICON_INSET(set, 0, g))
+	    continue;
+	for(x=idx[g]; x<idx[g + 1]; x++)
+	    if(ICON_INSET(set, 1, matcher->icons[enginesize][x].group[1]))
+		return 1;
+    }
+    return 0;
+}
+
+/* Compares the metrics of an icon with the signatures in the groups of set,
+ * going through the group index of the matcher instead of all the icons */
+static int icon_match(const icon_groupset *set, const struct cl_engine *engine, const struct icomtr *metrics, unsigned int side) {
+    const struct icon_matcher *matcher = engine->iconcheck;
+    unsigned int enginesize = (side >> 3) - 2, g, x;
+    const unsigned int *idx = matcher->group_index[enginesize];
+
+    if(!idx)
+	return CL_SUCCESS;
+    for(g=0; g<matcher->group_counts[0]; g++) {
+	if(!ICON_INSET(set, 0, g))
+	    continue;
+	for(x=idx[g]; x<idx[g + 1]; x++) {
+	    const struct icomtr *ico = &matcher->icons[enginesize][x];
+	    unsigned int color = 0, gray = 0, bright, dark, edge, noedge, reds, greens, blues, ccount;
+	    unsigned int colors, confidence, bwmatch = 0, positivematch = 64 + 4*(2-enginesize);
+
+	    if(!ICON_INSET(set, 1, ico->group[1]))
+		continue;
+
+	    if(!metrics->ccount && !ico->ccount) {
+		/* BW matching */
+		edge = matchbwpoint(side, metrics->edge_x, metrics->edge_y, metrics->edge_avg, metrics->color_x, metrics->color_y, metrics->color_avg, ico->edge_x, ico->edge_y, ico->edge_avg, ico->color_x, ico->color_y, ico->color_avg);
+		noedge = matchbwpoint(side, metrics->noedge_x, metrics->noedge_y, metrics->noedge_avg, metrics->gray_x, metrics->gray_y, metrics->gray_avg, ico->noedge_x, ico->noedge_y, ico->noedge_avg, ico->gray_x, ico->gray_y, ico->gray_avg);
+		bwmatch = 1;
+	    } else {
+		edge = matchpoint(side, metrics->edge_x, metrics->edge_y, metrics->edge_avg, ico->edge_x, ico->edge_y, ico->edge_avg, 255);
+		noedge = matchpoint(side, metrics->noedge_x, metrics->noedge_y, metrics->noedge_avg, ico->noedge_x, ico->noedge_y, ico->noedge_avg, 255);
+		if(metrics->ccount && ico->ccount) {
+		    /* color matching */
+		    color = matchpoint(side, metrics->color_x, metrics->color_y, metrics->color_avg, ico->color_x, ico->color_y, ico->color_avg, 4072);
+		    gray = matchpoint(side, metrics->gray_x, metrics->gray_y, metrics->gray_avg, ico->gray_x, ico->gray_y, ico->gray_avg, 4072);
+		}
+	    }
+
+	    bright = matchpoint(side, metrics->bright_x, metrics->bright_y, metrics->bright_avg, ico->bright_x, ico->bright_y, ico->bright_avg, 255);
+	    dark = matchpoint(side, metrics->dark_x, metrics->dark_y, metrics->dark_avg, ico->dark_x, ico->dark_y, ico->dark_avg, 255);
+
+	    reds = abs((int)metrics->rsum - (int)ico->rsum) * 10;
+	    reds = (reds < 100) * (100 - reds);
+	    greens = abs((int)metrics->gsum - (int)ico->gsum) * 10;
+	    greens = (greens < 100) * (100 - greens);
+	    blues = abs((int)metrics->bsum - (int)ico->bsum) * 10;
+	    blues = (blues < 100) * (100 - blues);
+	    ccount = abs((int)metrics->ccount - (int)ico->ccount) * 10;
+	    ccount = (ccount < 100) * (100 - ccount);
+	    colors = (reds + greens + blues + ccount) / 4;
+
+	    if(bwmatch) {
+		confidence = (bright + dark + edge * 2 + noedge) / 6;
+		positivematch = 70;
+	    } else
+		confidence = (color + (gray + bright + noedge)*2/3 + dark + edge + colors) / 6;
+
+#ifdef LOGPARSEICONDETAILS
+	    cli_dbgmsg("parseicon: edge confidence: %u%%\n", edge);
+	    cli_dbgmsg("parseicon: noedge confidence: %u%%\n", noedge);
+	    if(!bwmatch) {
+		cli_dbgmsg("parseicon: color confidence: %u%%\n", color);
+		cli_dbgmsg("parseicon: gray confidence: %u%%\n", gray);
+	    }
+	    cli_dbgmsg("parseicon: bright confidence: %u%%\n", bright);
+	    cli_dbgmsg("parseicon: dark confidence: %u%%\n", dark);
+	    if(!bwmatch)
+		cli_dbgmsg("parseicon: spread confidence: red %u%%, green %u%%, blue %u%% - colors %u%%\n", reds, greens, blues, ccount);
+#endif
+
+	    if(confidence >= positivematch) {
+		if(cli_debug_flag) {
+		    char *name = cli_cold_get(engine->cold, ico->name);
+
+		    cli_dbgmsg("icon_match: %s, confidence: %u\n", name ? name : "(name unavailable)", confidence);
+		    free(name);
+		}
+		return CL_VIRUS;
+	    }
+	}
+    }
+
+    return CL_SUCCESS;
+}
+
+static int icon_decode(struct ICON_ENV *icon_env, uint32_t rva, struct icon_metrics *im) {
     cli_ctx *ctx = icon_env->ctx;
     struct cli_exe_section *exe_sections = icon_env->exe_sections;
     uint16_t nsections = icon_env->nsections;
@@ -1311,28 +1575,27 @@ static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
 	unsigned int used;
 	unsigned int important;
     } bmphdr;
-    struct icomtr metrics;
     const unsigned char *rawimage;
     const char *tempd;
     const uint32_t *palette = NULL;
     uint32_t *imagedata;
     unsigned int scanlinesz, andlinesz;
     unsigned int width, height, depth, x, y;
-    unsigned int err, scalemode = 2, enginesize;
+    unsigned int err, scalemode = 2;
     fmap_t *map;
     uint32_t icoff;
     struct icon_matcher *matcher;
     unsigned int special_32_is_32 = 0;
 
-    if(!ctx || !ctx->engine || !(matcher=ctx->engine->iconcheck))
-	return CL_SUCCESS;
+    matcher = ctx->engine->iconcheck;
     map = *ctx->fmap;
+    im->state = ICON_SKIP;
     tempd = (cli_debug_flag && ctx->engine->keeptmp) ? (ctx->engine->tmpdir ? ctx->engine->tmpdir : cli_gettmpdir()) : NULL;
     icoff = cli_rawaddr(rva, exe_sections, nsections, &err, map->len, hdr_size);
 
     /* read the bitmap header */
     if(err || !(rawimage = fmap_need_off_once(map, icoff, 4))) {
-	icon_env->err_oof++;
+	im->state = ICON_ERR_OOF;
 	//cli_dbgmsg("parseicon: offset to icon is out of file\n");
 	return CL_SUCCESS;
     }
@@ -1340,13 +1603,13 @@ static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
     rva = cli_readint32(rawimage);
     icoff = cli_rawaddr(rva, exe_sections, nsections, &err, map->len, hdr_size);
     if(err || fmap_readn(map, &bmphdr, icoff, sizeof(bmphdr)) != sizeof(bmphdr)) {
-	icon_env->err_bhoof++;
+	im->state = ICON_ERR_BHOOF;
 	//cli_dbgmsg("parseicon: bmp header is out of file\n");
 	return CL_SUCCESS;
     }
 
     if((size_t)READ32(bmphdr.sz) < sizeof(bmphdr)) {
-	icon_env->err_bhts++;
+	im->state = ICON_ERR_BHTS;
 	//cli_dbgmsg("parseicon: BMP header too small\n");
 	return CL_SUCCESS;
     }
@@ -1358,12 +1621,12 @@ static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
     height = READ32(bmphdr.h) / 2;
     depth = READ16(bmphdr.depth);
     if(width > 256 || height > 256 || width < 16 || height < 16) {
-	icon_env->err_tstl++;
+	im->state = ICON_ERR_TSTL;
 	//cli_dbgmsg("parseicon: Image too small or too big (%ux%u)\n", width, height);
 	return CL_SUCCESS;
     }
     if(width < height * 3 / 4 || height < width * 3 / 4) {
-	icon_env->err_insl++;
+	im->state = ICON_ERR_INSL;
         //cli_dbgmsg("parseicon: Image not square enough (%ux%u)\n", width, height);
 	return CL_SUCCESS;
     }	
@@ -1378,6 +1641,13 @@ static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
 	    scalemode = 2;
     }
 
+    /* the metrics are only needed for the sizes the signatures use */
+    im->side = icon_side(width, height, scalemode);
+    if(!cli_debug_flag && !icon_wanted(icon_env->set, matcher, im->side)) {
+	im->state = ICON_NOMETRICS;
+	return CL_SUCCESS;
+    }
+
     cli_dbgmsg("parseicon: Bitmap - %ux%ux%u\n", width, height, depth);
 
     /* check color depth and load palette */
@@ -1557,6 +1827,7 @@ static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
 	    scaley = (double)height / newsize;
 	    if(!(newdata = cli_malloc(newsize * newsize * sizeof(*newdata)))) {
 		cli_errmsg("parseicon: Unable to allocate memory for scaling image\n");
+		free(imagedata);
 		return CL_EMEM;
 	    }
 	    cli_dbgmsg("parseicon: Slow scaling to %ux%u (%f, %f)\n", newsize, newsize, scalex, scaley);
@@ -1573,77 +1844,54 @@ static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
     }
     makebmp("2-alpha-blend", tempd, width, height, imagedata);
 
-    getmetrics(width, imagedata, &metrics, tempd);
+    if(getmetrics(width, imagedata, &im->metrics, tempd) == CL_CLEAN)
+	im->state = ICON_METRICS;
+    im->side = width;
     free(imagedata);
+    return CL_SUCCESS;
+}
 
-    enginesize = (width >> 3) - 2;
-    for(x=0; x<matcher->icon_counts[enginesize]; x++) {
-	unsigned int color = 0, gray = 0, bright, dark, edge, noedge, reds, greens, blues, ccount;
-	unsigned int colors, confidence, bwmatch = 0, positivematch = 64 + 4*(2-enginesize);
-	unsigned int i, j;
-
-	i = matcher->icons[enginesize][x].group[0];
-	j = i % 64;
-	i /= 64;
-	if(!(set->v[0][i] & ((uint64_t)1<<j))) continue;
-	i = matcher->icons[enginesize][x].group[1];
-	j = i % 64;
-	i /= 64;
-	if(!(set->v[1][i] & ((uint64_t)1<<j))) continue;
-	
-	if(!metrics.ccount && !matcher->icons[enginesize][x].ccount) {
-	    /* BW matching */
-	    edge = matchbwpoint(width, metrics.edge_x, metrics.edge_y, metrics.edge_avg, metrics.color_x, metrics.color_y, metrics.color_avg, matcher->icons[enginesize][x].edge_x, matcher->icons[enginesize][x].edge_y, matcher->icons[enginesize][x].edge_avg, matcher->icons[enginesize][x].color_x, matcher->icons[enginesize][x].color_y, matcher->icons[enginesize][x].color_avg);
-	    noedge = matchbwpoint(width, metrics.noedge_x, metrics.noedge_y, metrics.noedge_avg, metrics.gray_x, metrics.gray_y, metrics.gray_avg, matcher->icons[enginesize][x].noedge_x, matcher->icons[enginesize][x].noedge_y, matcher->icons[enginesize][x].noedge_avg, matcher->icons[enginesize][x].gray_x, matcher->icons[enginesize][x].gray_y, matcher->icons[enginesize][x].gray_avg);
-	    bwmatch = 1;
-	} else {
-	    edge = matchpoint(width, metrics.edge_x, metrics.edge_y, metrics.edge_avg, matcher->icons[enginesize][x].edge_x, matcher->icons[enginesize][x].edge_y, matcher->icons[enginesize][x].edge_avg, 255);
-	    noedge = matchpoint(width, metrics.noedge_x, metrics.noedge_y, metrics.noedge_avg, matcher->icons[enginesize][x].noedge_x, matcher->icons[enginesize][x].noedge_y, matcher->icons[enginesize][x].noedge_avg, 255);
-	    if(metrics.ccount && matcher->icons[enginesize][x].ccount) {
-		/* color matching */
-		color = matchpoint(width, metrics.color_x, metrics.color_y, metrics.color_avg, matcher->icons[enginesize][x].color_x, matcher->icons[enginesize][x].color_y, matcher->icons[enginesize][x].color_avg, 4072);
-		gray = matchpoint(width, metrics.gray_x, metrics.gray_y, metrics.gray_avg, matcher->icons[enginesize][x].gray_x, matcher->icons[enginesize][x].gray_y, matcher->icons[enginesize][x].gray_avg, 4072);
-	    }
-	}
-
-	bright = matchpoint(width, metrics.bright_x, metrics.bright_y, metrics.bright_avg, matcher->icons[enginesize][x].bright_x, matcher->icons[enginesize][x].bright_y, matcher->icons[enginesize][x].bright_avg, 255);
-	dark = matchpoint(width, metrics.dark_x, metrics.dark_y, metrics.dark_avg, matcher->icons[enginesize][x].dark_x, matcher->icons[enginesize][x].dark_y, matcher->icons[enginesize][x].dark_avg, 255);
-
-	reds = abs((int)metrics.rsum - (int)matcher->icons[enginesize][x].rsum) * 10;
-	reds = (reds < 100) * (100 - reds);
-	greens = abs((int)metrics.gsum - (int)matcher->icons[enginesize][x].gsum) * 10;
-	greens = (greens < 100) * (100 - greens);
-	blues = abs((int)metrics.bsum - (int)matcher->icons[enginesize][x].bsum) * 10;
-	blues = (blues < 100) * (100 - blues);
-	ccount = abs((int)metrics.ccount - (int)matcher->icons[enginesize][x].ccount) * 10;
-	ccount = (ccount < 100) * (100 - ccount);
-	colors = (reds + greens + blues + ccount) / 4;
-
-	if(bwmatch) {
-	    confidence = (bright + dark + edge * 2 + noedge) / 6;
-	    positivematch = 70;
-	} else
-	    confidence = (color + (gray + bright + noedge)*2/3 + dark + edge + colors) / 6;
+static int parseicon(struct ICON_ENV *icon_env, uint32_t rva) {
+    cli_ctx *ctx = icon_env->ctx;
+    struct icon_metrics *m, im;
+    fmap_t *map;
+    int ret;
 
-#ifdef LOGPARSEICONDETAILS
-	cli_dbgmsg("parseicon: edge confidence: %u%%\n", edge);
-	cli_dbgmsg("parseicon: noedge confidence: %u%%\n", noedge);
-	if(!bwmatch) {
-	    cli_dbgmsg("parseicon: color confidence: %u%%\n", color);
-	    cli_dbgmsg("parseicon: gray confidence: %u%%\n", gray);
-	}
-	cli_dbgmsg("parseicon: bright confidence: %u%%\n", bright);
-	cli_dbgmsg("parseicon: dark confidence: %u%%\n", dark);
-	if(!bwmatch)
-	    cli_dbgmsg("parseicon: spread confidence: red %u%%, green %u%%, blue %u%% - colors %u%%\n", reds, greens, blues, ccount);
-#endif
+    if(!ctx || !ctx->engine || !ctx->engine->iconcheck)
+	return CL_SUCCESS;
+    map = *ctx->fmap;
 
-	if(confidence >= positivematch) {
-	    cli_dbgmsg("confidence: %u\n", confidence);
-	    return CL_VIRUS;
-	}
+    if(!(m = icon_cached(map, rva)) ||
+       (m->state == ICON_NOMETRICS && (cli_debug_flag || icon_wanted(icon_env->set, ctx->engine->iconcheck, m->side)))) {
+	im.rva = rva;
+	if((ret = icon_decode(icon_env, rva, &im)) != CL_SUCCESS)
+	    return ret;
+	if(m)
+	    *m = im;
+	else
+	    icon_cache_add(map, &im);
+	m = &im;
     }
 
+    switch(m->state) {
+    case ICON_METRICS:
+	return icon_match(icon_env->set, ctx->engine, &m->metrics, m->side);
+    case ICON_ERR_OOF:
+	icon_env->err_oof++;
+	break;
+    case ICON_ERR_BHOOF:
+	icon_env->err_bhoof++;
+	break;
+    case ICON_ERR_BHTS:
+	icon_env->err_bhts++;
+	break;
+    case ICON_ERR_TSTL:
+	icon_env->err_tstl++;
+	break;
+    case ICON_ERR_INSL:
+	icon_env->err_insl++;
+	break;
+    }
     return CL_SUCCESS;
 }
 
@@ -24,7 +24,8 @@
 
 #include "cltypes.h"
 #include "pe.h"
+#include "scanners.h"
 
-int petite_inflate2x_1to9(char *buf, uint32_t minrva, uint32_t bufsz, struct cli_exe_section *sections, unsigned int sectcount, uint32_t Imagebase, uint32_t pep, int desc, int version, uint32_t ResRva, uint32_t ResSize);
+int petite_inflate2x_1to9(char *buf, uint32_t minrva, uint32_t bufsz, struct cli_exe_section *sections, unsigned int sectcount, uint32_t Imagebase, uint32_t pep, struct cli_extract *x, int version, uint32_t ResRva, uint32_t ResSize);
 
 #endif
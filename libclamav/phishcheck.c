@@ -730,10 +730,31 @@ cleanupURL(struct string *URL,struct string *pre_URL, int isReal)
 }
 
 /* -------end runtime disable---------*/
+#define HREF_KEY_LEN 2048
+
+/* Builds the key identifying an href in the cache of clean results.
+ * Returns 0 if the href doesn't fit, it is then checked without caching. */
+static size_t href_key(char *key, const struct url_check *urls)
+{
+	const char *real = urls->realLink.data ? urls->realLink.data : "";
+	const char *display = urls->displayLink.data ? urls->displayLink.data : "";
+	const size_t real_len = strlen(real), display_len = strlen(display);
+	int n;
+
+	n = snprintf(key, HREF_KEY_LEN, "%x:%x:%lu:", urls->flags, urls->link_type, (unsigned long)real_len);
+	if(n < 0 || n + real_len + display_len > HREF_KEY_LEN)
+		return 0;
+	memcpy(key + n, real, real_len);
+	memcpy(key + n + real_len, display, display_len);
+	return n + real_len + display_len;
+}
+
 int phishingScan(cli_ctx* ctx,tag_arguments_t* hrefs)
 {
 	/* TODO: get_host and then apply regex, etc. */
-	int i;
+	int i, ret = CL_CLEAN;
+	struct cli_hashtable checked;
+	int use_cache;
 	struct phishcheck* pchk = (struct phishcheck*) ctx->engine->phishcheck;
 	/* check for status of whitelist fatal error, etc. */
 	if(!pchk || pchk->is_disabled)
@@ -774,9 +795,14 @@ int phishingScan(cli_ctx* ctx,tag_arguments_t* hrefs)
 	fclose(f);
 	return 0;
 #endif
+	/* newsletters repeat the same links many times, remember the ones
+	 * already found clean instead of checking them again */
+	use_cache = hrefs->count > 1 && cli_hashtab_init(&checked, 64) == 0;
 	for(i=0;i<hrefs->count;i++) {
 			struct url_check urls;
 			enum phish_status rc;
+			char key[HREF_KEY_LEN];
+			size_t key_len = 0;
 			urls.flags	 = strncmp((char*)hrefs->tag[i],href_text,href_text_len)? (CL_PHISH_ALL_CHECKS&~CHECK_SSL): CL_PHISH_ALL_CHECKS;
 			urls.link_type   = 0;
 			if(!strncmp((char*)hrefs->tag[i],src_text,src_text_len)) {
@@ -804,14 +830,24 @@ int phishingScan(cli_ctx* ctx,tag_arguments_t* hrefs)
 				urls.displayLink.data = url;
 			}
 
+			if(use_cache) {
+				key_len = href_key(key, &urls);
+				if(key_len && cli_hashtab_find(&checked, key, key_len)) {
+					cli_dbgmsg("Phishcheck: link already checked\n");
+					continue;
+				}
+			}
+
 			rc = phishingCheck(ctx->engine,&urls);
 			if(pchk->is_disabled)
-				return CL_CLEAN;
+				break;
 			free_if_needed(&urls);
 			cli_dbgmsg("Phishcheck: Phishing scan result: %s\n",phishing_ret_toString(rc));
 			switch(rc)/*TODO: support flags from ctx->options,*/
 			{
 				case CL_PHISH_CLEAN:
+					if(key_len)
+						cli_hashtab_insert(&checked, key, key_len, 0);
 					continue;
 				case CL_PHISH_NUMERIC_IP:
 				    cli_append_virus(ctx, "Heuristics.Phishing.Email.Cloaked.NumericIP");
@@ -839,9 +875,14 @@ int phishingScan(cli_ctx* ctx,tag_arguments_t* hrefs)
 				    cli_append_virus(ctx, "Heuristics.Phishing.Email.SpoofedDomain");
 					break;
 			}
-			return cli_found_possibly_unwanted(ctx);
+			ret = cli_found_possibly_unwanted(ctx);
+			break;
+	}
+	if(use_cache) {
+		cli_hashtab_clear(&checked);
+		cli_hashtab_free(&checked);
 	}
-	return CL_CLEAN;
+	return ret;
 }
 
 static char hex2int(const unsigned char* src)
@@ -1184,6 +1225,7 @@ static int whitelist_check(const struct cl_engine* engine,struct url_check* urls
 	return whitelist_match(engine,urls->realLink.data,urls->displayLink.data,hostOnly);
 }
 
+#define URL_MAX_LEN 1024
 static int hash_match(const struct regex_matcher *rlist, const char *host, size_t hlen, const char *path, size_t plen, int *prefix_matched)
 {
 	const char *virname;
@@ -1200,23 +1242,25 @@ static int hash_match(const struct regex_matcher *rlist, const char *host, size_
 	    const char hexchars[] = "0123456789ABCDEF";
 	    unsigned char h[65];
 	    unsigned char sha256_dig[32];
+	    char buf[URL_MAX_LEN+3];
 	    unsigned i;
-        void *sha256;
 
-        sha256 = cl_hash_init("sha256");
-        if (!(sha256))
-            return CL_EMEM;
-
-        cl_update_hash(sha256, (void *)host, hlen);
-        cl_update_hash(sha256, (void *)path, plen);
-        cl_finish_hash(sha256, sha256_dig);
+	    /* both come from the canonical URL buffer of url_hash_match() */
+	    if(hlen + plen > sizeof(buf))
+		return CL_SUCCESS;
+	    memcpy(buf, host, hlen);
+	    memcpy(buf + hlen, path, plen);
+	    if(!cl_sha256(buf, hlen + plen, sha256_dig, NULL))
+		return CL_EMEM;
 
-	    for(i=0;i<32;i++) {
-		h[2*i] = hexchars[sha256_dig[i]>>4];
-		h[2*i+1] = hexchars[sha256_dig[i]&0xf];
+	    if(cli_debug_flag) {
+		for(i=0;i<32;i++) {
+		    h[2*i] = hexchars[sha256_dig[i]>>4];
+		    h[2*i+1] = hexchars[sha256_dig[i]&0xf];
+		}
+		h[64]='\0';
+		cli_dbgmsg("Looking up hash %s for %s(%u)%s(%u)\n", h, host, (unsigned)hlen, path, (unsigned)plen);
 	    }
-	    h[64]='\0';
-	    cli_dbgmsg("Looking up hash %s for %s(%u)%s(%u)\n", h, host, (unsigned)hlen, path, (unsigned)plen);
 #if 0
 	    if (prefix_matched) {
 		if (cli_bm_scanbuff(sha256_dig, 4, &virname, NULL, &rlist->hostkey_prefix,0,NULL,NULL,NULL) == CL_VIRUS) {
@@ -1226,6 +1270,8 @@ static int hash_match(const struct regex_matcher *rlist, const char *host, size_
 		    return CL_SUCCESS;
 	    }
 #endif
+	    if (!regex_list_hash_maybe(rlist, sha256_dig))
+		return CL_SUCCESS;
 	    if (cli_bm_scanbuff(sha256_dig, 32, &virname, NULL, &rlist->sha256_hashes,0,NULL,NULL,NULL) == CL_VIRUS) {
 		cli_dbgmsg("This hash matched: %s\n", h);
 		switch(*virname) {
@@ -1244,7 +1290,6 @@ static int hash_match(const struct regex_matcher *rlist, const char *host, size_
 	return CL_SUCCESS;
 }
 
-#define URL_MAX_LEN 1024
 #define COMPONENTS 4
 int cli_url_canon(const char *inurl, size_t len, char *urlbuff, size_t dest_len, char **host, size_t *hostlen, const char **path, size_t *pathlen)
 {
@@ -33,6 +33,114 @@ static int prtn_intxn_list_is_empty(prtn_intxn_list_t* list)
     return (list->Head == NULL);
 }
 
+static inline int node_height(const prtn_intxn_node_t *node)
+{
+    return node ? node->Height : 0;
+}
+
+static void node_update(prtn_intxn_node_t *node)
+{
+    int lh = node_height(node->Left), rh = node_height(node->Right);
+
+    node->Height = (lh > rh ? lh : rh) + 1;
+    node->MaxEnd = node->Start + node->Size;
+    if (node->Left && node->Left->MaxEnd > node->MaxEnd)
+        node->MaxEnd = node->Left->MaxEnd;
+    if (node->Right && node->Right->MaxEnd > node->MaxEnd)
+        node->MaxEnd = node->Right->MaxEnd;
+}
+
+static prtn_intxn_node_t *node_rotate_right(prtn_intxn_node_t *node)
+{
+    prtn_intxn_node_t *left = node->Left;
+
+    node->Left = left->Right;
+    left->Right = node;
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+static prtn_intxn_node_t *node_rotate_left(prtn_intxn_node_t *node)
+{
+    prtn_intxn_node_t *right = node->Right;
+
+    node->Right = right->Left;
+    right->Left = node;
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+static prtn_intxn_node_t *node_insert(prtn_intxn_node_t *node, prtn_intxn_node_t *new_node)
+{
+    int balance;
+
+    if (!node)
+        return new_node;
+
+    if (new_node->Start < node->Start)
+        node->Left = node_insert(node->Left, new_node);
+    else
+        node->Right = node_insert(node->Right, new_node);
+    node_update(node);
+
+    balance = node_height(node->Left) - node_height(node->Right);
+    if (balance > 1) {
+        if (node_height(node->Left->Left) < node_height(node->Left->Right))
+            node->Left = node_rotate_left(node->Left);
+        return node_rotate_right(node);
+    }
+    if (balance < -1) {
+        if (node_height(node->Right->Right) < node_height(node->Right->Left))
+            node->Right = node_rotate_right(node->Right);
+        return node_rotate_left(node);
+    }
+    return node;
+}
+
+/* Partitions that start at the same offset always intersect, those that are
+ * only adjacent don't */
+static prtn_intxn_node_t *node_search(prtn_intxn_node_t *root, off_t start, size_t size)
+{
+    prtn_intxn_node_t *node;
+
+    for (node = root; node != NULL; node = (start < node->Start) ? node->Left : node->Right) {
+        if (node->Start == start)
+            return node;
+    }
+
+    node = root;
+    while (node != NULL) {
+        if (start > node->Start) {
+            if (node->Start + node->Size > (unsigned long)start)
+                return node;
+        }
+        else if (start + size > (unsigned long)(node->Start)) {
+            return node;
+        }
+
+        /* an intersection on the right means there's one on the left too,
+         * if anything on the left reaches past start */
+        if (node->Left && node->Left->MaxEnd > start)
+            node = node->Left;
+        else
+            node = node->Right;
+    }
+
+    return NULL;
+}
+
+static void node_free(prtn_intxn_node_t *node)
+{
+    if (!node)
+        return;
+
+    node_free(node->Left);
+    node_free(node->Right);
+    free(node);
+}
+
 int prtn_intxn_list_init(prtn_intxn_list_t* list)
 {
     list->Head = NULL;
@@ -45,34 +153,14 @@ int prtn_intxn_list_check(prtn_intxn_list_t* list, unsigned *pitxn, off_t start,
     prtn_intxn_node_t *new_node, *check_node;
     int ret = CL_CLEAN;
 
-    *pitxn = list->Size;
-
-    check_node = list->Head;
-    while (check_node != NULL) {
-        (*pitxn)--;
-
-        if (start > check_node->Start) {
-            if (check_node->Start+check_node->Size > (unsigned long)start) {
-                ret = CL_VIRUS;
-                break;
-            }
-        }
-        else if (start < check_node->Start) {
-            if (start+size > (unsigned long)(check_node->Start)) {
-                ret = CL_VIRUS;
-                break;
-            }
-        }
-        else {
-            ret = CL_VIRUS;
-            break;
-        }
-
-        check_node = check_node->Next;
+    check_node = node_search(list->Head, start, size);
+    if (check_node != NULL) {
+        *pitxn = check_node->Index;
+        ret = CL_VIRUS;
     }
 
     /* allocate new node for partition bounds */
-    new_node = (prtn_intxn_node_t *) cli_malloc(sizeof(prtn_intxn_node_t));
+    new_node = (prtn_intxn_node_t *) cli_calloc(1, sizeof(prtn_intxn_node_t));
     if (!new_node) {
         cli_dbgmsg("PRTN_INTXN: could not allocate new node for checklist!\n");
         prtn_intxn_list_free(list);
@@ -81,24 +169,20 @@ int prtn_intxn_list_check(prtn_intxn_list_t* list, unsigned *pitxn, off_t start,
 
     new_node->Start = start;
     new_node->Size = size;
-    new_node->Next = list->Head;
+    new_node->Index = list->Size;
+    node_update(new_node);
 
-    list->Head = new_node;
+    list->Head = node_insert(list->Head, new_node);
     (list->Size)++;
     return ret;
 }
 
 int prtn_intxn_list_free(prtn_intxn_list_t* list)
 {
-    prtn_intxn_node_t *next = NULL;
-
-    while (!prtn_intxn_list_is_empty(list)) {
-        next = list->Head->Next;
-
-        free(list->Head);
-
-        list->Head = next;
-        list->Size--;
+    if (!prtn_intxn_list_is_empty(list)) {
+        node_free(list->Head);
+        list->Head = NULL;
+        list->Size = 0;
     }
 
     return CL_SUCCESS;
@@ -31,15 +31,21 @@
 
 #define PRTN_INTXN_DETECTION "heuristic.partitionintersection"
 
+/* The partitions checked so far are kept in an interval tree: an AVL tree
+ * keyed on Start, where each node also knows the end of the partition that
+ * reaches furthest in its subtree */
 struct prtn_intxn_node;
 typedef struct prtn_intxn_node {
     off_t Start;
     size_t Size;
-    struct prtn_intxn_node *Next;
+    off_t MaxEnd;
+    unsigned Index; /* order of the check */
+    int Height;
+    struct prtn_intxn_node *Left, *Right;
 } prtn_intxn_node_t;
 
 typedef struct prtn_intxn_list {
-    struct prtn_intxn_node *Head;
+    struct prtn_intxn_node *Head; /* root */
     size_t Size; /* for debug */
 } prtn_intxn_list_t;
 
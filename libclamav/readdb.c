@@ -39,6 +39,9 @@
 #include <fcntl.h>
 #include <zlib.h>
 #include <errno.h>
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
 
 #include "clamav.h"
 #include "cvd.h"
@@ -66,6 +69,7 @@
 #include "phish_domaincheck_db.h"
 #include "regex_list.h"
 #include "hashtab.h"
+#include "unzip.h"
 
 #if defined(HAVE_READDIR_R_3) || defined(HAVE_READDIR_R_2)
 #include <limits.h>
@@ -78,12 +82,20 @@
 #include "bytecode_priv.h"
 #include "cache.h"
 #include "openioc.h"
+#include "sigprof.h"
+#include "loadstats.h"
+#include "coldstore.h"
+#include "stats.h"
 
 #ifdef CL_THREAD_SAFE
 #  include <pthread.h>
 static pthread_mutex_t cli_ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cli_lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+/* bumped for every compiled engine, see cli_ac_initdata_cached() */
+static uint32_t cli_engine_generation = 0;
+
 #ifdef HAVE_YARA
 #include "yara_clam.h"
 #include "yara_compiler.h"
@@ -586,6 +598,21 @@ int cli_parse_add(struct cli_matcher *root, const char *virname, const char *hex
             cli_errmsg("cli_parse_add(): Problem adding signature (3).\n");
             return ret;
         }
+    } else if(options & CL_DB_VERIFY_ONLY) {
+        /* what cli_bm_addpatt() checks, without keeping the pattern */
+        uint32_t offdata[4], offset_min, offset_max;
+
+        if(!(pt = cli_hex2str(hexsig)))
+            return CL_EMALFDB;
+        free(pt);
+        if(hexlen / 2 < BM_MIN_LENGTH) {
+            cli_errmsg("cli_parse_add(): Signature for %s is too short\n", virname);
+            return CL_EMALFDB;
+        }
+        if((ret = cli_caloff(offset, NULL, root->type, offdata, &offset_min, &offset_max))) {
+            cli_errmsg("cli_parse_add(): Can't calculate offset for signature %s\n", virname);
+            return ret;
+        }
     } else {
         bm_new = (struct cli_bm_patt *) mpool_calloc(root->mempool, 1, sizeof(struct cli_bm_patt));
         if(!bm_new)
@@ -628,6 +655,9 @@ int cli_initroots(struct cl_engine *engine, unsigned int options)
 
     UNUSEDPARAM(options);
 
+    if(engine->ac_profile && !engine->ac_cost && (ret = cli_ac_profile_load(engine)))
+	return ret;
+
     for(i = 0; i < CLI_MTARGETS; i++) {
 	if(!engine->root[i]) {
 	    cli_dbgmsg("Initializing engine->root[%d]\n", i);
@@ -649,6 +679,9 @@ int cli_initroots(struct cl_engine *engine, unsigned int options)
 		cli_errmsg("cli_initroots: Can't initialise AC pattern matcher\n");
 		return ret;
 	    }
+	    root->ac_cost = engine->ac_cost;
+	    if(root->filter)
+		root->filter->cost = engine->ac_cost;
 
 	    if(!root->ac_only) {
 		cli_dbgmsg("cli_initroots: Initializing BM tables of root[%d]\n", i);
@@ -677,18 +710,10 @@ char *cli_dbgets(char *buff, unsigned int size, FILE *fs, struct cli_dbio *dbio)
 		if(!dbio->size)
 		    return NULL;
 
-		if(dbio->gzs) {
-		    bread = gzread(dbio->gzs, dbio->readpt, dbio->readsize);
-		    if(bread == -1) {
-			cli_errmsg("cli_dbgets: gzread() failed\n");
-			return NULL;
-		    }
-		} else {
-		    bread = fread(dbio->readpt, 1, dbio->readsize, dbio->fs);
-		    if(!bread && ferror(dbio->fs)) {
-			cli_errmsg("cli_dbgets: fread() failed\n");
-			return NULL;
-		    }
+		bread = cli_dbio_read(dbio, dbio->readpt, dbio->readsize);
+		if(bread == -1) {
+		    cli_errmsg("cli_dbgets: Can't read database\n");
+		    return NULL;
 		}
 		if(!bread)
 		    return NULL;
@@ -829,6 +854,23 @@ static int cli_chkign(const struct cli_matcher *ignored, const char *signame, co
     return ret;
 }
 
+/* With CL_ENGINE_SHARD_COUNT set, the body signatures (.db, .ndb and .ldb)
+ * are spread over the shards by the hash of their names and each engine
+ * only loads its own; the hash signatures and the rest are loaded by all.
+ * Returns 1 if the signature belongs to another shard */
+static int cli_chkshard(const struct cl_engine *engine, const char *signame)
+{
+    uint32_t h = 2166136261U;
+
+    if(engine->shard_count < 2)
+	return 0;
+    while(*signame) {
+	h ^= (unsigned char)*signame++;
+	h *= 16777619;
+    }
+    return h % engine->shard_count != engine->shard_index;
+}
+
 static int cli_chkpua(const char *signame, const char *pua_cats, unsigned int options)
 {
 	char cat[32], *pt;
@@ -906,6 +948,9 @@ static int cli_loaddb(FILE *fs, struct cl_engine *engine, unsigned int *signo, u
 	if(engine->ignored && cli_chkign(engine->ignored, start, buffer_cpy))
 	    continue;
 
+	if(cli_chkshard(engine, start))
+	    continue;
+
 	if(engine->cb_sigload && engine->cb_sigload("db", start, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
 	    cli_dbgmsg("cli_loaddb: skipping %s due to callback\n", start);
 	    continue;
@@ -940,7 +985,49 @@ static int cli_loaddb(FILE *fs, struct cl_engine *engine, unsigned int *signo, u
     return CL_SUCCESS;
 }
 
+static int idb_groupcmp(const void *a, const void *b)
+{
+    const struct icomtr *m1 = a, *m2 = b;
+
+    if(m1->group[0] != m2->group[0])
+	return m1->group[0] < m2->group[0] ? -1 : 1;
+    if(m1->group[1] != m2->group[1])
+	return m1->group[1] < m2->group[1] ? -1 : 1;
+    return 0;
+}
+
+/* Sorts the icons of each size by group so that parseicon() only compares
+ * the ones in the groups of the signature */
+static int idb_index(struct cl_engine *engine, struct icon_matcher *matcher)
+{
+    unsigned int i, j, g;
+
+    for(i=0; i<3; i++) {
+	if(!matcher->icon_counts[i])
+	    continue;
+	qsort(matcher->icons[i], matcher->icon_counts[i], sizeof(struct icomtr), idb_groupcmp);
+	if(!(matcher->group_index[i] = mpool_malloc(engine->mempool, sizeof(unsigned int) * (matcher->group_counts[0] + 1)))) {
+	    cli_errmsg("cli_loadidb: Can't allocate memory for the icon index\n");
+	    return CL_EMEM;
+	}
+	for(g=0, j=0; g<=matcher->group_counts[0]; g++) {
+	    while(j < matcher->icon_counts[i] && matcher->icons[i][j].group[0] < g)
+		j++;
+	    matcher->group_index[i][g] = j;
+	}
+    }
+    return CL_SUCCESS;
+}
+
 #define ICO_TOKENS 4
+/* The store of the strings kept compressed, created on first use */
+static struct cli_coldstore *cli_engine_cold(struct cl_engine *engine)
+{
+    if(!engine->cold && !(engine->cold = cli_cold_new(engine->mempool)))
+	cli_errmsg("Can't allocate memory for the cold store\n");
+    return engine->cold;
+}
+
 static int cli_loadidb(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio)
 {
         const char *tokens[ICO_TOKENS + 1];
@@ -1113,7 +1200,7 @@ static int cli_loadidb(FILE *fs, struct cl_engine *engine, unsigned int *signo,
 	    break;
 	}
 
-	if(!(metric->name = cli_mpool_strdup(engine->mempool, tokens[0]))) {
+	if(!cli_engine_cold(engine) || cli_cold_add(engine->cold, tokens[0], &metric->name)) {
 	    ret = CL_EMEM;
 	    break;
 	}
@@ -1167,6 +1254,9 @@ static int cli_loadidb(FILE *fs, struct cl_engine *engine, unsigned int *signo,
 	return ret;
     }
 
+    if((ret = idb_index(engine, matcher)))
+	return ret;
+
     if(signo)
 	*signo += sigs;
 
@@ -1266,6 +1356,9 @@ static int cli_loadndb(FILE *fs, struct cl_engine *engine, unsigned int *signo,
 	if(engine->ignored && cli_chkign(engine->ignored, virname, buffer_cpy))
 	    continue;
 
+	if(!sdb && cli_chkshard(engine, virname))
+	    continue;
+
 	if(!sdb && engine->cb_sigload && engine->cb_sigload("ndb", virname, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
 	    cli_dbgmsg("cli_loadndb: skipping %s due to callback\n", virname);
 	    continue;
@@ -1670,6 +1763,12 @@ static int load_oneldb(char *buffer, int chkpua, struct cl_engine *engine, unsig
         return CL_SUCCESS;
     }
 
+    /* the logical signatures of the bytecodes go along with them */
+    if(!bc_idx && cli_chkshard(engine, virname)) {
+        (*sigs)--;
+        return CL_SUCCESS;
+    }
+
     if(engine->cb_sigload && engine->cb_sigload("ldb", virname, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
         cli_dbgmsg("cli_loadldb: skipping %s due to callback\n", virname);
         (*sigs)--;
@@ -1829,6 +1928,10 @@ static int load_oneldb(char *buffer, int chkpua, struct cl_engine *engine, unsig
     }
 
     memcpy(&lsig->tdb, &tdb, sizeof(tdb));
+#if HAVE_PCRE
+    if((ret = cli_pcre_addlits(root, lsigid[0], subsigs)))
+        return ret;
+#endif
     return CL_SUCCESS;
 }
 
@@ -2021,6 +2124,32 @@ static int cli_loadcbc(FILE *fs, struct cl_engine *engine, unsigned int *signo,
  * MagicType:Offset:HexSig:Name:RequiredType:DetectedType[:MinFL[:MaxFL]]
  */
 #define FTM_TOKENS 8
+/* The type 1 FTM signatures also go to a matcher of their own, which
+ * cli_filetype2() runs instead of the generic one */
+static int cli_initftroot(struct cl_engine *engine)
+{
+	struct cli_matcher *root;
+	int ret;
+
+    if(engine->ftroot)
+	return CL_SUCCESS;
+    if(!(root = (struct cli_matcher *) mpool_calloc(engine->mempool, 1, sizeof(struct cli_matcher)))) {
+	cli_errmsg("cli_initftroot: Can't allocate memory for cli_matcher\n");
+	return CL_EMEM;
+    }
+#ifdef USE_MPOOL
+    root->mempool = engine->mempool;
+#endif
+    root->ac_only = 1;
+    if((ret = cli_ac_init(root, engine->ac_mindepth, engine->ac_maxdepth, engine->dconf->other&OTHER_CONF_PREFILTERING))) {
+	cli_errmsg("cli_initftroot: Can't initialise AC pattern matcher\n");
+	mpool_free(engine->mempool, root);
+	return ret;
+    }
+    engine->ftroot = root;
+    return CL_SUCCESS;
+}
+
 static int cli_loadftm(FILE *fs, struct cl_engine *engine, unsigned int options, unsigned int internal, struct cli_dbio *dbio)
 {
 	const char *tokens[FTM_TOKENS + 1], *pt;
@@ -2031,7 +2160,7 @@ static int cli_loadftm(FILE *fs, struct cl_engine *engine, unsigned int options,
 	int ret;
 	int magictype;
 
-    if((ret = cli_initroots(engine, options)))
+    if((ret = cli_initroots(engine, options)) || (ret = cli_initftroot(engine)))
 	return ret;
 
     while(1) {
@@ -2094,6 +2223,8 @@ static int cli_loadftm(FILE *fs, struct cl_engine *engine, unsigned int options,
 	if(magictype == 1) { /* A-C */
 	    if((ret = cli_parse_add(engine->root[0], tokens[3], tokens[2], 0, rtype, type, tokens[1], 0, NULL, options)))
 		break;
+	    if((ret = cli_parse_add(engine->ftroot, tokens[3], tokens[2], 0, rtype, type, tokens[1], 0, NULL, options)))
+		break;
 
 	} else if ((magictype == 0) || (magictype == 4)) { /* memcmp() */
 	    if(!cli_isnumber(tokens[1])) {
@@ -2276,6 +2407,10 @@ static int cli_loadinfo(FILE *fs, struct cl_engine *engine, unsigned int options
 }
 
 #define IGN_MAX_TOKENS   3
+#ifdef CL_THREAD_SAFE
+static int cli_loadjobs_wait(struct cl_engine *engine);
+#endif
+
 static int cli_loadign(FILE *fs, struct cl_engine *engine, unsigned int options, struct cli_dbio *dbio)
 {
 	const char *tokens[IGN_MAX_TOKENS + 1], *signame, *hash = NULL;
@@ -2286,6 +2421,12 @@ static int cli_loadign(FILE *fs, struct cl_engine *engine, unsigned int options,
 
     UNUSEDPARAM(options);
 
+#ifdef CL_THREAD_SAFE
+    /* the queued hash databases are parsed against the current list */
+    if((ret = cli_loadjobs_wait(engine)))
+	return ret;
+#endif
+
     if(!engine->ignored) {
 	engine->ignored = (struct cli_matcher *) mpool_calloc(engine->mempool, 1, sizeof(struct cli_matcher));
 	if(!engine->ignored)
@@ -2324,6 +2465,7 @@ static int cli_loadign(FILE *fs, struct cl_engine *engine, unsigned int options,
 	    ret = CL_EMALFDB;
 	    break;
 	}
+	cli_hm_image_ignore(engine, signame, hash);
         if (len < 3) {
             int pad = 3 - len;
             /* patch-up for Boyer-Moore minimum length of 3: pad with spaces */ 
@@ -2383,191 +2525,814 @@ static int cli_loadign(FILE *fs, struct cl_engine *engine, unsigned int options,
 #define MD5_IMP	    3
 
 #define MD5_TOKENS 5
-static int cli_loadhash(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int mode, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+/* Parses a line of a hash database, returns CL_BREAK if it must be skipped */
+static int cli_hashline(const struct cl_engine *engine, char *buffer, char *buffer_cpy, unsigned int mode, unsigned int options, const char **hash, unsigned long *size, const char **virname)
 {
     const char *tokens[MD5_TOKENS + 1];
-    char buffer[FILEBUFF], *buffer_cpy = NULL;
-    const char *pt, *virname;
-    int ret = CL_SUCCESS;
-    unsigned int size_field = 1, md5_field = 0, line = 0, sigs = 0, tokens_count;
-    unsigned int req_fl = 0; 
-    struct cli_matcher *db;
-    unsigned long size;
-
+    const char *pt;
+    unsigned int size_field = 1, md5_field = 0, tokens_count;
+    unsigned int req_fl = 0;
 
     if(mode == MD5_MDB) {
 	size_field = 0;
 	md5_field = 1;
-	db = engine->hm_mdb;
-    } else if(mode == MD5_HDB)
-	db = engine->hm_hdb;
-    else if(mode == MD5_IMP)
-	db = engine->hm_imp;
-    else
-	db = engine->hm_fp;
-
-    if(!db) {
-	if(!(db = mpool_calloc(engine->mempool, 1, sizeof(*db))))
-	    return CL_EMEM;
-#ifdef USE_MPOOL
-	db->mempool = engine->mempool;
-#endif
-	if(mode == MD5_HDB)
-	    engine->hm_hdb = db;
-	else if(mode == MD5_MDB)
-	    engine->hm_mdb = db;
-	else if(mode == MD5_IMP)
-	    engine->hm_imp = db;
-	else
-	    engine->hm_fp = db;
     }
 
+    cli_chomp(buffer);
     if(engine->ignored)
-	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
-        cli_errmsg("cli_loadhash: Can't allocate memory for buffer_cpy\n");
-	    return CL_EMEM;
-    }
-
-    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
-	line++;
-	if(buffer[0] == '#')
-	    continue;
-	cli_chomp(buffer);
-	if(engine->ignored)
-	    strcpy(buffer_cpy, buffer);
+	strcpy(buffer_cpy, buffer);
 
-	tokens_count = cli_strtokenize(buffer, ':', MD5_TOKENS + 1, tokens);
-	if(tokens_count < 3) {
-	    ret = CL_EMALFDB;
-	    break;
-	}
-	if(tokens_count > MD5_TOKENS - 2) {
-	    req_fl = atoi(tokens[MD5_TOKENS - 2]);
+    tokens_count = cli_strtokenize(buffer, ':', MD5_TOKENS + 1, tokens);
+    if(tokens_count < 3)
+	return CL_EMALFDB;
+    if(tokens_count > MD5_TOKENS - 2) {
+	req_fl = atoi(tokens[MD5_TOKENS - 2]);
 
-	    if(tokens_count > MD5_TOKENS) {
-		ret = CL_EMALFDB;
-		break;
-	    }
+	if(tokens_count > MD5_TOKENS)
+	    return CL_EMALFDB;
 
-	    if(cl_retflevel() < req_fl)
-		continue;
-	    if(tokens_count == MD5_TOKENS) {
-		int max_fl = atoi(tokens[MD5_TOKENS - 1]);
-		if(cl_retflevel() > (unsigned int)max_fl)
-		    continue;
-	    }
+	if(cl_retflevel() < req_fl)
+	    return CL_BREAK;
+	if(tokens_count == MD5_TOKENS) {
+	    int max_fl = atoi(tokens[MD5_TOKENS - 1]);
+	    if(cl_retflevel() > (unsigned int)max_fl)
+		return CL_BREAK;
 	}
+    }
 
-	if((mode == MD5_MDB) || strcmp(tokens[size_field],"*")) {
-	    size = strtoul(tokens[size_field], (char **)&pt, 10);
-	    if(*pt || !size || size >= 0xffffffff) {
-		cli_errmsg("cli_loadhash: Invalid value for the size field\n");
-		ret = CL_EMALFDB;
-		break;
-	    }
+    if((mode == MD5_MDB) || strcmp(tokens[size_field],"*")) {
+	*size = strtoul(tokens[size_field], (char **)&pt, 10);
+	if(*pt || !*size || *size >= 0xffffffff) {
+	    cli_errmsg("cli_loadhash: Invalid value for the size field\n");
+	    return CL_EMALFDB;
 	}
-	else {
-	    size = 0;
-	    if((tokens_count < MD5_TOKENS - 1) || (req_fl < 73)) {
-		cli_errmsg("cli_loadhash: Minimum FLEVEL field must be at least 73 for wildcard size hash signatures."
-			" For reference, running FLEVEL is %d\n", cl_retflevel());
-		ret = CL_EMALFDB;
-		break;
-	    }
+    }
+    else {
+	*size = 0;
+	if((tokens_count < MD5_TOKENS - 1) || (req_fl < 73)) {
+	    cli_errmsg("cli_loadhash: Minimum FLEVEL field must be at least 73 for wildcard size hash signatures."
+		    " For reference, running FLEVEL is %d\n", cl_retflevel());
+	    return CL_EMALFDB;
 	}
+    }
 
-	pt = tokens[2]; /* virname */
-	if(engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)))
-	    if(cli_chkpua(pt, engine->pua_cats, options))
-		continue;
+    pt = tokens[2]; /* virname */
+    if(engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)))
+	if(cli_chkpua(pt, engine->pua_cats, options))
+	    return CL_BREAK;
+
+    if(engine->ignored && cli_chkign(engine->ignored, pt, buffer_cpy))
+	return CL_BREAK;
+
+    *hash = tokens[md5_field];
+    *virname = pt;
+    return CL_SUCCESS;
+}
+
+#ifdef CL_THREAD_SAFE
+/*
+ * Parallel loading of the hash databases: the text of each file is read by
+ * the loading thread (so the CVD size and digest checks still apply) and
+ * parsed by a worker thread. The parsed entries are added to the engine by
+ * the loading thread, in the order the files were loaded.
+ */
+struct cli_loadent {
+    uint32_t size;
+    uint32_t name;
+    uint32_t type;
+    uint8_t hash[CLI_HASHLEN_MAX];
+};
+
+struct cli_loadjob {
+    char *text;
+    size_t len;
+    char *dbname;
+    struct cli_matcher *root;
+    unsigned int mode, options, *signo;
+    int staged;
+    uint8_t key[32];
+
+    /* set by the worker */
+    struct cli_loadent *ent;
+    uint32_t nent;
+    unsigned int line;
+    int ret, done;
+    struct cli_loadjob *next;
+};
+
+struct cli_loadq {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t done;
+    pthread_t *threads;
+    unsigned int nthreads, queued, stop;
+    struct cli_loadjob *head, *tail, *next;
+    int ret;
+};
+
+static void cli_loadjob_parse(const struct cl_engine *engine, struct cli_loadjob *job)
+{
+    char *buffer_cpy = NULL, *pt, *next, *end = job->text + job->len;
+    const char *hash, *virname;
+    uint32_t max = 0;
+    unsigned long size;
+    int ret = CL_SUCCESS;
+
+    if(engine->ignored && !(buffer_cpy = cli_malloc(FILEBUFF))) {
+	job->ret = CL_EMEM;
+	return;
+    }
+
+    for(pt = job->text; pt < end; pt = next) {
+	struct cli_loadent *ent;
+	size_t hlen;
 
-	if(engine->ignored && cli_chkign(engine->ignored, pt, buffer_cpy))
+	/* the line is tokenized in place */
+	next = pt + strlen(pt) + 1;
+	job->line++;
+	if(pt[0] == '#')
 	    continue;
+	ret = cli_hashline(engine, pt, buffer_cpy, job->mode, job->options, &hash, &size, &virname);
+	if(ret == CL_BREAK) {
+	    ret = CL_SUCCESS;
+	    continue;
+	}
+	if(ret)
+	    break;
 
-	if(engine->cb_sigload) {
-	    const char *dot = strchr(dbname, '.');
-	    if(!dot)
-		dot = dbname;
-	    else
-		dot++;
-	    if(engine->cb_sigload(dot, pt, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
-		cli_dbgmsg("cli_loadhash: skipping %s (%s) due to callback\n", pt, dot);
-	        continue;
+	if(job->nent == max) {
+	    max = max ? max * 2 : 1024;
+	    if(!(ent = cli_realloc(job->ent, max * sizeof(*ent)))) {
+		ret = CL_EMEM;
+		break;
 	    }
+	    job->ent = ent;
 	}
-
-	virname = cli_mpool_virname(engine->mempool, pt, options & CL_DB_OFFICIAL);
-	if(!virname) {
+	ent = &job->ent[job->nent];
+	hlen = strlen(hash);
+	if(hlen == 32)
+	    ent->type = CLI_HASH_MD5;
+	else if(hlen == 40)
+	    ent->type = CLI_HASH_SHA1;
+	else if(hlen == 64)
+	    ent->type = CLI_HASH_SHA256;
+	if((hlen != 32 && hlen != 40 && hlen != 64) || cli_hex2str_to(hash, (char *)ent->hash, hlen)) {
+	    cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", job->line);
 	    ret = CL_EMALFDB;
 	    break;
 	}
+	ent->size = size;
+	ent->name = virname - job->text;
+	job->nent++;
+    }
+    free(buffer_cpy);
+    job->ret = ret;
+}
 
-	if((ret = hm_addhash_str(db, tokens[md5_field], size, virname))) {
-	    cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", line);
-	    mpool_free(engine->mempool, (void *)virname);
+static void *cli_loadjob_worker(void *arg)
+{
+    struct cl_engine *engine = (struct cl_engine *)arg;
+    struct cli_loadq *q = engine->loadq;
+    struct cli_loadjob *job;
+
+    pthread_mutex_lock(&q->mutex);
+    while(1) {
+	while(!q->next && !q->stop)
+	    pthread_cond_wait(&q->cond, &q->mutex);
+	if(!q->next)
 	    break;
-	}
+	job = q->next;
+	q->next = job->next;
+	pthread_mutex_unlock(&q->mutex);
 
-	sigs++;
+	cli_loadjob_parse(engine, job);
+
+	pthread_mutex_lock(&q->mutex);
+	job->done = 1;
+	pthread_cond_broadcast(&q->done);
     }
-    if(engine->ignored)
-	free(buffer_cpy);
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
 
-    if(!line) {
+/* Adds the entries of a parsed job to the engine */
+static int cli_loadjob_merge(struct cl_engine *engine, struct cli_loadjob *job)
+{
+    const char *virname;
+    uint32_t i;
+    int ret = job->ret;
+
+    if(!ret && !job->line) {
 	cli_errmsg("cli_loadhash: Empty database file\n");
-	return CL_EMALFDB;
+	ret = CL_EMALFDB;
     }
 
-    if(ret) {
-	cli_errmsg("cli_loadhash: Problem parsing database at line %u\n", line);
-	return ret;
+    if(!ret && job->staged)
+	cli_hm_image_stage(engine, job->root, job->key, job->dbname);
+    for(i = 0; !ret && i < job->nent; i++) {
+	const struct cli_loadent *ent = &job->ent[i];
+
+	if(!(virname = cli_mpool_virname(engine->mempool, job->text + ent->name, job->options & CL_DB_OFFICIAL))) {
+	    ret = CL_EMALFDB;
+	    break;
+	}
+	if(job->staged) {
+	    ret = cli_hm_image_addbin(engine, ent->hash, ent->type, ent->size, virname);
+	    mpool_free(engine->mempool, (void *)virname);
+	} else if((ret = hm_addhash_bin(job->root, ent->hash, ent->type, ent->size, virname)))
+	    mpool_free(engine->mempool, (void *)virname);
     }
+    if(job->staged) {
+	int ret2 = cli_hm_image_end(engine, job->nent, ret);
 
-    if(signo)
-	*signo += sigs;
+	if(!ret)
+	    ret = ret2;
+    }
 
-    return CL_SUCCESS;
+    if(ret)
+	cli_errmsg("cli_loadhash: Problem parsing database %s at line %u\n", job->dbname, job->line);
+    else if(job->signo)
+	*job->signo += job->nent;
+    return ret;
 }
 
-#define MD_TOKENS 9
-static int cli_loadmd(FILE *fs, struct cl_engine *engine, unsigned int *signo, int type, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+static void cli_loadjob_free(struct cli_loadjob *job)
 {
-	const char *tokens[MD_TOKENS + 1];
-	char buffer[FILEBUFF], *buffer_cpy = NULL;
-	unsigned int line = 0, sigs = 0, tokens_count;
-	int ret = CL_SUCCESS;
-	struct cli_cdb *new;
+    free(job->text);
+    free(job->dbname);
+    free(job->ent);
+    free(job);
+}
 
-    UNUSEDPARAM(dbname);
+/* Merges the finished jobs in order; with wait set, all the jobs */
+static void cli_loadjobs_reap(struct cl_engine *engine, unsigned int wait)
+{
+    struct cli_loadq *q = engine->loadq;
+    struct cli_loadjob *job;
+    int ret;
 
-    if(engine->ignored)
-	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
-        cli_errmsg("cli_loadmd: Can't allocate memory for buffer_cpy\n");
-	    return CL_EMEM;
+    while((job = q->head)) {
+	pthread_mutex_lock(&q->mutex);
+	while(!job->done && wait)
+	    pthread_cond_wait(&q->done, &q->mutex);
+	if(!job->done) {
+	    pthread_mutex_unlock(&q->mutex);
+	    break;
+	}
+	q->head = job->next;
+	if(!q->head)
+	    q->tail = NULL;
+	q->queued--;
+	pthread_mutex_unlock(&q->mutex);
+
+	if((ret = cli_loadjob_merge(engine, job)) && !q->ret)
+	    q->ret = ret;
+	cli_loadjob_free(job);
+	if(wait)
+	    wait--;
     }
+}
 
-    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
-	line++;
-	if(buffer[0] == '#')
-	    continue;
+/* Waits for the pending jobs and returns the first error */
+static int cli_loadjobs_wait(struct cl_engine *engine)
+{
+    int ret;
 
-	cli_chomp(buffer);
-	if(engine->ignored)
-	    strcpy(buffer_cpy, buffer);
+    if(!engine->loadq)
+	return CL_SUCCESS;
+    cli_loadjobs_reap(engine, ~0u);
+    ret = engine->loadq->ret;
+    engine->loadq->ret = CL_SUCCESS;
+    return ret;
+}
 
-	tokens_count = cli_strtokenize(buffer, ':', MD_TOKENS + 1, tokens);
-	if(tokens_count != MD_TOKENS) {
-	    ret = CL_EMALFDB;
-	    break;
-	}
+/* Stops the worker threads, merging the pending jobs */
+static int cli_loadjobs_stop(struct cl_engine *engine)
+{
+    struct cli_loadq *q = engine->loadq;
+    unsigned int i;
+    int ret;
 
-	if(strcmp(tokens[1], "*") && !cli_isnumber(tokens[1])) {
-	    cli_errmsg("cli_loadmd: Invalid value for the 'encrypted' field\n");
-	    ret = CL_EMALFDB;
-	    break;
-	}
-	if(strcmp(tokens[3], "*") && !cli_isnumber(tokens[3])) {
-	    cli_errmsg("cli_loadmd: Invalid value for the 'original size' field\n");
+    if(!q)
+	return CL_SUCCESS;
+    ret = cli_loadjobs_wait(engine);
+    pthread_mutex_lock(&q->mutex);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    for(i = 0; i < q->nthreads; i++)
+	pthread_join(q->threads[i], NULL);
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+    pthread_cond_destroy(&q->done);
+    free(q->threads);
+    free(q);
+    engine->loadq = NULL;
+    return ret;
+}
+
+static struct cli_loadq *cli_loadjobs_init(struct cl_engine *engine)
+{
+    struct cli_loadq *q;
+    unsigned int i, n = engine->load_threads;
+
+    if(n > CLI_MAX_LOAD_THREADS)
+	n = CLI_MAX_LOAD_THREADS;
+    if(!(q = cli_calloc(1, sizeof(*q))))
+	return NULL;
+    if(!(q->threads = cli_calloc(n, sizeof(*q->threads)))) {
+	free(q);
+	return NULL;
+    }
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    pthread_cond_init(&q->done, NULL);
+    engine->loadq = q;
+    for(i = 0; i < n; i++)
+	if(pthread_create(&q->threads[i], NULL, cli_loadjob_worker, engine))
+	    break;
+    q->nthreads = i;
+    if(!i) {
+	cli_warnmsg("cli_loadhash: Can't start the database loading threads\n");
+	cli_loadjobs_stop(engine);
+	return NULL;
+    }
+    cli_dbgmsg("cli_loadhash: Parsing hash databases with %u threads\n", i);
+    return q;
+}
+
+/* Reads a hash database and queues it for parsing */
+static int cli_loadjob_submit(FILE *fs, struct cl_engine *engine, unsigned int *signo, struct cli_matcher *root, unsigned int mode, unsigned int options, struct cli_dbio *dbio, const char *dbname, int staged, const uint8_t *key)
+{
+    struct cli_loadq *q = engine->loadq;
+    struct cli_loadjob *job;
+    char buffer[FILEBUFF];
+    size_t max = 0;
+
+    if(!q && !(q = cli_loadjobs_init(engine)))
+	return CL_BREAK;
+
+    if(!(job = cli_calloc(1, sizeof(*job))) || !(job->dbname = cli_strdup(dbname))) {
+	free(job);
+	return CL_EMEM;
+    }
+    job->root = root;
+    job->mode = mode;
+    job->options = options;
+    job->signo = signo;
+    job->staged = staged;
+    if(staged)
+	memcpy(job->key, key, 32);
+
+    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
+	size_t len = strlen(buffer) + 1;
+
+	if(job->len + len > max) {
+	    char *text;
+
+	    max = max ? max * 2 : 65536;
+	    if(!(text = cli_realloc(job->text, max))) {
+		cli_loadjob_free(job);
+		return CL_EMEM;
+	    }
+	    job->text = text;
+	}
+	memcpy(job->text + job->len, buffer, len);
+	job->len += len;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    if(q->tail)
+	q->tail->next = job;
+    else
+	q->head = job;
+    q->tail = job;
+    if(!q->next)
+	q->next = job;
+    q->queued++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+
+    /* merge what's ready, keeping a bounded backlog */
+    cli_loadjobs_reap(engine, 0);
+    if(q->queued > 2 * q->nthreads)
+	cli_loadjobs_reap(engine, q->queued - 2 * q->nthreads);
+    return CL_SUCCESS;
+}
+#endif
+
+static struct cli_matcher *cli_hashroot(struct cl_engine *engine, unsigned int mode)
+{
+	struct cli_matcher *db;
+
+    if(mode == MD5_MDB)
+	db = engine->hm_mdb;
+    else if(mode == MD5_HDB)
+	db = engine->hm_hdb;
+    else if(mode == MD5_IMP)
+	db = engine->hm_imp;
+    else
+	db = engine->hm_fp;
+
+    if(!db) {
+	if(!(db = mpool_calloc(engine->mempool, 1, sizeof(*db))))
+	    return NULL;
+#ifdef USE_MPOOL
+	db->mempool = engine->mempool;
+#endif
+	if(mode == MD5_HDB)
+	    engine->hm_hdb = db;
+	else if(mode == MD5_MDB)
+	    engine->hm_mdb = db;
+	else if(mode == MD5_IMP)
+	    engine->hm_imp = db;
+	else
+	    engine->hm_fp = db;
+    }
+
+    return db;
+}
+
+static int cli_loadhash(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int mode, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+{
+    char buffer[FILEBUFF], *buffer_cpy = NULL;
+    const char *pt, *hash, *virname;
+    int ret = CL_SUCCESS, staged = 0;
+    unsigned int line = 0, sigs = 0;
+    struct cli_matcher *db;
+    unsigned long size;
+    uint8_t key[32];
+
+
+    if(!(db = cli_hashroot(engine, mode)))
+	return CL_EMEM;
+
+    if(engine->hash_image) {
+	/* 0: mapped from the hash image, 1: added to a new image section */
+	if(!(staged = cli_hm_image_begin(engine, db, mode, options, fs, dbio, dbname, signo, key)))
+	    return CL_SUCCESS;
+	staged = (staged > 0);
+    }
+
+#ifdef CL_THREAD_SAFE
+    if(engine->load_threads > 1 && !engine->cb_sigload && !(options & CL_DB_VERIFY_ONLY)) {
+	ret = cli_loadjob_submit(fs, engine, signo, db, mode, options, dbio, dbname, staged, key);
+	if(ret != CL_BREAK)
+	    return ret;
+	ret = CL_SUCCESS;
+    }
+#endif
+
+    if(engine->ignored)
+	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
+        cli_errmsg("cli_loadhash: Can't allocate memory for buffer_cpy\n");
+	    return CL_EMEM;
+    }
+
+    if(staged)
+	cli_hm_image_stage(engine, db, key, dbname);
+
+    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
+	line++;
+	if(buffer[0] == '#')
+	    continue;
+
+	ret = cli_hashline(engine, buffer, buffer_cpy, mode, options, &hash, &size, &pt);
+	if(ret == CL_BREAK) {
+	    ret = CL_SUCCESS;
+	    continue;
+	}
+	if(ret)
+	    break;
+
+	if(engine->cb_sigload) {
+	    const char *dot = strchr(dbname, '.');
+	    if(!dot)
+		dot = dbname;
+	    else
+		dot++;
+	    if(engine->cb_sigload(dot, pt, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
+		cli_dbgmsg("cli_loadhash: skipping %s (%s) due to callback\n", pt, dot);
+	        continue;
+	    }
+	}
+
+	virname = cli_mpool_virname(engine->mempool, pt, options & CL_DB_OFFICIAL);
+	if(!virname) {
+	    ret = CL_EMALFDB;
+	    break;
+	}
+
+	if(options & CL_DB_VERIFY_ONLY) {
+	    ret = hm_checkhash_str(hash, size);
+	    mpool_free(engine->mempool, (void *)virname);
+	    if(ret) {
+		cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", line);
+		break;
+	    }
+	} else if(staged) {
+	    ret = cli_hm_image_add(engine, hash, size, virname);
+	    mpool_free(engine->mempool, (void *)virname);
+	    if(ret) {
+		cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", line);
+		break;
+	    }
+	} else if((ret = hm_addhash_str(db, hash, size, virname))) {
+	    cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", line);
+	    mpool_free(engine->mempool, (void *)virname);
+	    break;
+	}
+
+	sigs++;
+    }
+    if(engine->ignored)
+	free(buffer_cpy);
+
+    if(staged) {
+	int ret2 = cli_hm_image_end(engine, sigs, ret || !line);
+
+	if(!ret)
+	    ret = ret2;
+    }
+
+    if(!line) {
+	cli_errmsg("cli_loadhash: Empty database file\n");
+	return CL_EMALFDB;
+    }
+
+    if(ret) {
+	cli_errmsg("cli_loadhash: Problem parsing database at line %u\n", line);
+	return ret;
+    }
+
+    if(signo)
+	*signo += sigs;
+
+    return CL_SUCCESS;
+}
+
+/* Raw read of a database member (the text buffer of cli_dbgets is bypassed) */
+static size_t cli_dbread(void *buff, size_t size, FILE *fs, struct cli_dbio *dbio)
+{
+	size_t bread;
+	int n;
+
+    if(fs)
+	return fread(buff, 1, size, fs);
+
+    if(size > dbio->size)
+	size = dbio->size;
+    for(bread = 0; bread < size; bread += n) {
+	n = cli_dbio_read(dbio, (char *) buff + bread, size - bread);
+	if(n <= 0)
+	    break;
+    }
+    dbio->size -= bread;
+    dbio->bread += bread;
+    if(dbio->hashctx)
+	cl_update_hash(dbio->hashctx, buff, bread);
+    return bread;
+}
+
+static const struct {
+    const char *ext;
+    unsigned int mode;
+    unsigned int pua;
+} bdb_types[] = {
+    { "hdb", MD5_HDB, 0 },
+    { "hsb", MD5_HDB, 0 },
+    { "hdu", MD5_HDB, 1 },
+    { "hsu", MD5_HDB, 1 },
+    { "mdb", MD5_MDB, 0 },
+    { "msb", MD5_MDB, 0 },
+    { "mdu", MD5_MDB, 1 },
+    { "msu", MD5_MDB, 1 },
+    { "fp",  MD5_FP,  0 },
+    { "sfp", MD5_FP,  0 },
+    { "imp", MD5_IMP, 0 },
+
+    { NULL,  0,       0 }
+};
+
+/* .ign2 entries with a checksum refer to the text form of the signature */
+static int cli_bdbign(const struct cl_engine *engine, const struct cli_bdb_ent *ent, unsigned int mode, unsigned int hlen, const char *virname)
+{
+	char entry[FILEBUFF], hash[2 * CLI_HASHLEN_MAX + 1], size[16];
+	unsigned int i, minfl = le16_to_host(ent->minfl), maxfl = le16_to_host(ent->maxfl);
+	int len;
+
+    for(i = 0; i < hlen; i++)
+	sprintf(hash + 2 * i, "%02x", ent->hash[i]);
+    if(ent->size)
+	snprintf(size, sizeof(size), "%u", le32_to_host(ent->size));
+    else
+	strcpy(size, "*");
+
+    if(mode == MD5_MDB)
+	len = snprintf(entry, sizeof(entry), "%s:%s:%s", size, hash, virname);
+    else
+	len = snprintf(entry, sizeof(entry), "%s:%s:%s", hash, size, virname);
+    if(len > 0 && (size_t) len < sizeof(entry) && (minfl || maxfl != CLI_BDB_NOMAXFL)) {
+	if(maxfl != CLI_BDB_NOMAXFL)
+	    snprintf(entry + len, sizeof(entry) - len, ":%u:%u", minfl, maxfl);
+	else
+	    snprintf(entry + len, sizeof(entry) - len, ":%u", minfl);
+    }
+    return cli_chkign(engine->ignored, virname, entry);
+}
+
+static int cli_loadbdbsec(struct cl_engine *engine, const struct cli_bdb_sec *sec, const struct cli_bdb_ent *ent, const char *names, unsigned int *sigs, unsigned int options)
+{
+	char ext[5];
+	unsigned int i, mode, count = le32_to_host(sec->count), strsize = le32_to_host(sec->strsize), hlen;
+	struct cli_matcher *db;
+	const char *pt, *virname;
+	uint32_t size;
+	int ret;
+
+    memcpy(ext, sec->ext, 4);
+    ext[4] = 0;
+    for(i = 0; bdb_types[i].ext && strcmp(ext, bdb_types[i].ext); i++);
+    if(!bdb_types[i].ext) {
+	cli_errmsg("cli_loadbdb: Unknown section type %s\n", ext);
+	return CL_EMALFDB;
+    }
+    if(bdb_types[i].pua) {
+	if(!(options & CL_DB_PUA)) {
+	    cli_dbgmsg("cli_loadbdb: %s section skipped\n", ext);
+	    return CL_SUCCESS;
+	}
+	options |= CL_DB_PUA_MODE;
+    }
+    mode = bdb_types[i].mode;
+    if(!(db = cli_hashroot(engine, mode)))
+	return CL_EMEM;
+
+    for(i = 0; i < count; i++, ent++) {
+	if(ent->type >= CLI_HASH_AVAIL_TYPES || le32_to_host(ent->name) >= strsize) {
+	    cli_errmsg("cli_loadbdb: Malformed entry %u in %s section\n", i, ext);
+	    return CL_EMALFDB;
+	}
+	size = le32_to_host(ent->size);
+	if(!size && mode == MD5_MDB) {
+	    cli_errmsg("cli_loadbdb: Invalid value for the size field\n");
+	    return CL_EMALFDB;
+	}
+	if(cl_retflevel() < le16_to_host(ent->minfl) || (le16_to_host(ent->maxfl) != CLI_BDB_NOMAXFL && cl_retflevel() > le16_to_host(ent->maxfl)))
+	    continue;
+
+	pt = names + le32_to_host(ent->name);
+	hlen = (ent->type == CLI_HASH_MD5) ? 16 : (ent->type == CLI_HASH_SHA1) ? 20 : 32;
+
+	if(engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)))
+	    if(cli_chkpua(pt, engine->pua_cats, options))
+		continue;
+
+	if(engine->ignored && cli_bdbign(engine, ent, mode, hlen, pt))
+	    continue;
+
+	if(engine->cb_sigload && engine->cb_sigload(ext, pt, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
+	    cli_dbgmsg("cli_loadbdb: skipping %s (%s) due to callback\n", pt, ext);
+	    continue;
+	}
+
+	if(!(virname = cli_mpool_virname(engine->mempool, pt, options & CL_DB_OFFICIAL)))
+	    return CL_EMALFDB;
+	if((ret = hm_addhash_bin(db, ent->hash, ent->type, size, virname))) {
+	    mpool_free(engine->mempool, (void *) virname);
+	    return ret;
+	}
+	(*sigs)++;
+    }
+    return CL_SUCCESS;
+}
+
+static int cli_loadbdb(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+{
+	const struct cli_bdb_hdr *hdr;
+	const struct cli_bdb_sec *sec;
+	unsigned char *data = NULL;
+	size_t len, off, n;
+	unsigned int i, count, strsize, sigs = 0, mapped = 0;
+	int ret = CL_SUCCESS;
+	STATBUF sb;
+
+    if(fs) {
+	if(FSTAT(fileno(fs), &sb) || (uint64_t) sb.st_size != (size_t) sb.st_size) {
+	    cli_errmsg("cli_loadbdb: Can't get status of %s\n", dbname);
+	    return CL_ESTAT;
+	}
+	len = sb.st_size;
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+	if(len && (data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fs), 0)) != MAP_FAILED)
+	    mapped = 1;
+	else
+	    data = NULL;
+#endif
+    } else {
+	len = dbio->size;
+    }
+
+    if(!mapped) {
+	if(!(data = cli_malloc(len + 1))) {
+	    cli_errmsg("cli_loadbdb: Can't allocate memory for %s\n", dbname);
+	    return CL_EMEM;
+	}
+	if(cli_dbread(data, len, fs, dbio) != len) {
+	    cli_errmsg("cli_loadbdb: Can't read %s\n", dbname);
+	    free(data);
+	    return CL_EREAD;
+	}
+    }
+
+    hdr = (const struct cli_bdb_hdr *) data;
+    if(len < sizeof(*hdr) || memcmp(hdr->magic, CLI_BDB_MAGIC, sizeof(hdr->magic))) {
+	cli_errmsg("cli_loadbdb: %s is not a precompiled database\n", dbname);
+	ret = CL_EMALFDB;
+    } else if(le32_to_host(hdr->version) != CLI_BDB_VERSION) {
+	cli_errmsg("cli_loadbdb: Unsupported version %u of %s\n", le32_to_host(hdr->version), dbname);
+	ret = CL_EMALFDB;
+    }
+
+    off = sizeof(*hdr);
+    for(i = 0; !ret && i < le32_to_host(hdr->sections); i++) {
+	if(len - off < sizeof(*sec)) {
+	    ret = CL_EMALFDB;
+	    break;
+	}
+	sec = (const struct cli_bdb_sec *) (data + off);
+	off += sizeof(*sec);
+	count = le32_to_host(sec->count);
+	strsize = le32_to_host(sec->strsize);
+	n = (size_t) count * sizeof(struct cli_bdb_ent);
+	if(n / sizeof(struct cli_bdb_ent) != count || len - off < n || len - off - n < strsize || (strsize && data[off + n + strsize - 1])) {
+	    ret = CL_EMALFDB;
+	    break;
+	}
+	ret = cli_loadbdbsec(engine, sec, (const struct cli_bdb_ent *) (data + off), (const char *) data + off + n, &sigs, options);
+	off += n + strsize;
+	off = (off + 7) & ~(size_t) 7;
+	if(off > len)
+	    off = len;
+    }
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+    if(mapped)
+	munmap(data, len);
+    else
+#endif
+	free(data);
+
+    if(ret) {
+	cli_errmsg("cli_loadbdb: Problem parsing database %s\n", dbname);
+	return ret;
+    }
+
+    if(signo)
+	*signo += sigs;
+
+    return CL_SUCCESS;
+}
+
+#define MD_TOKENS 9
+static int cli_loadmd(FILE *fs, struct cl_engine *engine, unsigned int *signo, int type, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+{
+	const char *tokens[MD_TOKENS + 1];
+	char buffer[FILEBUFF], *buffer_cpy = NULL;
+	unsigned int line = 0, sigs = 0, tokens_count;
+	int ret = CL_SUCCESS;
+	struct cli_cdb *new;
+
+    UNUSEDPARAM(dbname);
+
+    if(engine->ignored)
+	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
+        cli_errmsg("cli_loadmd: Can't allocate memory for buffer_cpy\n");
+	    return CL_EMEM;
+    }
+
+    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
+	line++;
+	if(buffer[0] == '#')
+	    continue;
+
+	cli_chomp(buffer);
+	if(engine->ignored)
+	    strcpy(buffer_cpy, buffer);
+
+	tokens_count = cli_strtokenize(buffer, ':', MD_TOKENS + 1, tokens);
+	if(tokens_count != MD_TOKENS) {
+	    ret = CL_EMALFDB;
+	    break;
+	}
+
+	if(strcmp(tokens[1], "*") && !cli_isnumber(tokens[1])) {
+	    cli_errmsg("cli_loadmd: Invalid value for the 'encrypted' field\n");
+	    ret = CL_EMALFDB;
+	    break;
+	}
+	if(strcmp(tokens[3], "*") && !cli_isnumber(tokens[3])) {
+	    cli_errmsg("cli_loadmd: Invalid value for the 'original size' field\n");
 	    ret = CL_EMALFDB;
 	    break;
 	}
@@ -3835,7 +4600,7 @@ static int load_oneyara(YR_RULE *rule, int chkpua, struct cl_engine *engine, uns
                     (ytable.table[i]->sigopts & ACPATT_OPTION_WIDE) ? "w" : "",
                     (ytable.table[i]->sigopts & ACPATT_OPTION_ASCII) ? "a" : "");
 
-        if((ret = cli_sigopts_handler(root, newident, ytable.table[i]->hexstr, ytable.table[i]->sigopts, 0, 0, ytable.table[i]->offset, target, lsigid, options)) != CL_SUCCESS) {
+        if((ret = cli_sigopts_handler(root, newident, ytable.table[i]->hexstr, ytable.table[i]->sigopts | ACPATT_OPTION_ATOM, 0, 0, ytable.table[i]->offset, target, lsigid, options)) != CL_SUCCESS) {
             root->ac_lsigs--;
             FREE_TDB(tdb);
             ytable_delete(&ytable);
@@ -3972,6 +4737,7 @@ static int cli_loadyara(FILE *fs, struct cl_engine *engine, unsigned int *signo,
     compiler.rules_table = engine->yara_global->rules_table;
     compiler.objects_table = engine->yara_global->objects_table;
     compiler.allow_includes = 1;
+    compiler.optimize_code = engine->dconf->other & OTHER_CONF_YARAOPT;
     _yr_compiler_push_file_name(&compiler, filename);
 
     rc = yr_lex_parse_rules_file(fs, &compiler);
@@ -4190,6 +4956,8 @@ static int cli_loadpwdb(FILE *fs, struct cl_engine *engine, unsigned int options
                 break;
             }
 
+            cli_zip_initkey(new->zipkey, new->passwd, new->length);
+
             /* add to the engine list, sorted by target type */
 	    new->next = engine->pwdbs[container];
 	    engine->pwdbs[container] = new;
@@ -4218,6 +4986,29 @@ static int cli_loadpwdb(FILE *fs, struct cl_engine *engine, unsigned int options
 
 static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned int *signo, unsigned int options);
 
+/* the CVD containers are timed in cvd-verify and cvd-unpack, and their
+ * files in their own phases */
+static enum cli_loadstat_phase cli_loadphase(const char *dbname)
+{
+    if(cli_strbcasestr(dbname, ".cvd") || cli_strbcasestr(dbname, ".cld") || cli_strbcasestr(dbname, ".cud"))
+	return CLI_LOADSTAT_LOAD;
+    if(cli_strbcasestr(dbname, ".hdb") || cli_strbcasestr(dbname, ".hsb") || cli_strbcasestr(dbname, ".hdu") ||
+       cli_strbcasestr(dbname, ".hsu") || cli_strbcasestr(dbname, ".mdb") || cli_strbcasestr(dbname, ".msb") ||
+       cli_strbcasestr(dbname, ".mdu") || cli_strbcasestr(dbname, ".msu") || cli_strbcasestr(dbname, ".fp") ||
+       cli_strbcasestr(dbname, ".sfp") || cli_strbcasestr(dbname, ".imp"))
+	return CLI_LOADSTAT_PARSE_HASH;
+    if(cli_strbcasestr(dbname, ".db") || cli_strbcasestr(dbname, ".ndb") || cli_strbcasestr(dbname, ".ndu") ||
+       cli_strbcasestr(dbname, ".sdb"))
+	return CLI_LOADSTAT_PARSE_BODY;
+    if(cli_strbcasestr(dbname, ".ldb") || cli_strbcasestr(dbname, ".ldu"))
+	return CLI_LOADSTAT_PARSE_LOGICAL;
+    if(cli_strbcasestr(dbname, ".cbc"))
+	return CLI_LOADSTAT_PARSE_BYTECODE;
+    if(cli_strbcasestr(dbname, ".yar") || cli_strbcasestr(dbname, ".yara"))
+	return CLI_LOADSTAT_PARSE_YARA;
+    return CLI_LOADSTAT_PARSE_OTHER;
+}
+
 int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio)
 {
 	FILE *fs = NULL;
@@ -4225,6 +5016,7 @@ int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo
 	uint8_t skipped = 0;
 	const char *dbname;
 	char buff[FILEBUFF];
+	struct cli_loadtimer timer;
 
 
     if(dbio && dbio->chkonly) {
@@ -4250,6 +5042,10 @@ int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo
     else
 	dbname = filename;
 
+    if(fs)
+	cli_cache_dbfile(engine, filename, fileno(fs));
+
+    cli_loadstat_start(engine, &timer, cli_loadphase(dbname));
 #ifdef HAVE_YARA
     if(options & CL_DB_YARA_ONLY) {
         if(cli_strbcasestr(dbname, ".yar") || cli_strbcasestr(dbname, ".yara"))
@@ -4294,6 +5090,9 @@ int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo
 	else
 	    skipped = 1;
 
+    } else if(cli_strbcasestr(dbname, ".bdb")) {
+	ret = cli_loadbdb(fs, engine, signo, options, dbio, dbname);
+
     } else if(cli_strbcasestr(dbname, ".ndb")) {
 	ret = cli_loadndb(fs, engine, signo, 0, options, dbio, dbname);
 
@@ -4369,6 +5168,7 @@ int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo
 	cli_warnmsg("cli_load: unknown extension - skipping %s\n", filename);
 	skipped = 1;
     } 
+    cli_loadstat_stop(engine, &timer);
 
     if(ret) {
 	cli_errmsg("Can't load %s: %s\n", filename, cl_strerror(ret));
@@ -4576,21 +5376,12 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
     return ret;
 }
 
-int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, unsigned int dboptions)
+static int cli_loadpath(const char *path, struct cl_engine *engine, unsigned int *signo, unsigned int dboptions)
 {
 	STATBUF sb;
+	struct cli_loadtimer timer;
 	int ret;
 
-    if(!engine) {
-	cli_errmsg("cl_load: engine == NULL\n");
-	return CL_ENULLARG;
-    }
-
-    if(engine->dboptions & CL_DB_COMPILED) {
-	cli_errmsg("cl_load(): can't load new databases when engine is already compiled\n");
-	return CL_EARG;
-    }
-
     if(CLAMSTAT(path, &sb) == -1) {
         switch (errno) {
 #if defined(EACCES)
@@ -4636,7 +5427,10 @@ int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, uns
 	cli_dbgmsg("Bytecode engine disabled\n");
     }
 
-    if(cli_cache_init(engine))
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_CACHE);
+    ret = cli_cache_init(engine);
+    cli_loadstat_stop(engine, &timer);
+    if(ret)
 	return CL_EMEM;
 
     engine->dboptions |= dboptions;
@@ -4655,6 +5449,15 @@ int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, uns
 	    return CL_EOPEN;
     }
 
+#ifdef CL_THREAD_SAFE
+    {
+	int ret2 = cli_loadjobs_stop(engine);
+
+	if(ret == CL_SUCCESS)
+	    ret = ret2;
+    }
+#endif
+
 #ifdef YARA_PROTO
     if (yara_total) {
         cli_yaramsg("$$$$$$$$$$$$ YARA $$$$$$$$$$$$\n");
@@ -4669,6 +5472,27 @@ int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, uns
     return ret;
 }
 
+int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, unsigned int dboptions)
+{
+	struct cli_loadtimer timer;
+	int ret;
+
+    if(!engine) {
+	cli_errmsg("cl_load: engine == NULL\n");
+	return CL_ENULLARG;
+    }
+
+    if(engine->dboptions & CL_DB_COMPILED) {
+	cli_errmsg("cl_load(): can't load new databases when engine is already compiled\n");
+	return CL_EARG;
+    }
+
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_LOAD);
+    ret = cli_loadpath(path, engine, signo, dboptions);
+    cli_loadstat_stop(engine, &timer);
+    return ret;
+}
+
 const char *cl_retdbdir(void)
 {
     return DATADIR;
@@ -4840,55 +5664,653 @@ void cli_pwdb_list_free(struct cl_engine *engine, struct cli_pwdb *pwdb)
 {
     struct cli_pwdb *thiz, *that;
 
-    thiz = pwdb;
-    while (thiz) {
-	that = thiz->next;
+    thiz = pwdb;
+    while (thiz) {
+	that = thiz->next;
+
+	mpool_free(engine->mempool, thiz->name);
+	mpool_free(engine->mempool, thiz->passwd);
+	mpool_free(engine->mempool, thiz);
+
+	thiz = that;
+    }
+}
+
+int cl_statfree(struct cl_stat *dbstat)
+{
+
+    if(dbstat) {
+
+#ifdef _WIN32
+	    int i;
+
+	if(dbstat->statdname) {
+	    for(i = 0; i < dbstat->entries; i++) {
+		if(dbstat->statdname[i])
+		    free(dbstat->statdname[i]);
+		dbstat->statdname[i] = NULL;
+	    }
+	    free(dbstat->statdname);
+	    dbstat->statdname = NULL;
+	}
+#endif
+
+	if(dbstat->stattab) {
+	    free(dbstat->stattab);
+	    dbstat->stattab = NULL;
+	}
+	dbstat->entries = 0;
+
+	if(dbstat->dir) {
+	    free(dbstat->dir);
+	    dbstat->dir = NULL;
+	}
+    } else {
+        cli_errmsg("cl_statfree(): Null argument passed\n");
+	return CL_ENULLARG;
+    }
+
+    return CL_SUCCESS;
+}
+
+/* Hot updates: cl_engine_apply_cdiff() loads the signatures added by the
+ * scripts into a separate patch engine, rebuilt from all the lines added
+ * since the last reload and scanned after the main one by
+ * cli_fmap_scandesc(). The deleted signatures are disabled in place by
+ * pointing their virname at cli_virname_deleted; the original names are
+ * put back by cl_engine_free(). Patch engines replaced by a later script
+ * may still be in use by a scan, so they are only freed along with the
+ * main engine. */
+struct cli_patchdb {
+    char *name;
+    char **lines;
+    unsigned int count, max;
+    struct cli_patchdb *next;
+};
+
+struct cli_patchslot {
+    const char **slot;
+    const char *virname;
+};
+
+struct cli_patchset {
+    struct cli_patchdb *dbs;
+    struct cli_patchslot *slots;
+    unsigned int nslots, maxslots;
+    struct cl_engine *current;
+    struct cl_engine **retired;
+    unsigned int nretired;
+    unsigned int sigs;
+};
+
+#define CDIFF_ADD  0x1 /* lines can be added */
+#define CDIFF_HASH 0x2 /* the name is the third field */
+#define CDIFF_LSIG 0x4 /* the name is the first ';' separated field */
+#define CDIFF_MDB  0x8 /* section hashes */
+#define CDIFF_FP   0x10
+
+static const struct {
+    const char *ext;
+    unsigned int flags;
+} cdiff_dbtypes[] = {
+    { ".hdb", CDIFF_ADD | CDIFF_HASH },
+    { ".hdu", CDIFF_ADD | CDIFF_HASH },
+    { ".hsb", CDIFF_ADD | CDIFF_HASH },
+    { ".hsu", CDIFF_ADD | CDIFF_HASH },
+    { ".mdb", CDIFF_HASH | CDIFF_MDB },
+    { ".mdu", CDIFF_HASH | CDIFF_MDB },
+    { ".msb", CDIFF_HASH | CDIFF_MDB },
+    { ".msu", CDIFF_HASH | CDIFF_MDB },
+    { ".fp", CDIFF_HASH | CDIFF_FP },
+    { ".sfp", CDIFF_HASH | CDIFF_FP },
+    { ".ndb", CDIFF_ADD },
+    { ".ndu", CDIFF_ADD },
+    { ".ldb", CDIFF_ADD | CDIFF_LSIG },
+    { ".ldu", CDIFF_ADD | CDIFF_LSIG },
+    { NULL, 0 }
+};
+
+/* Returns the CDIFF_* flags of a database, -1 if it can't be patched */
+static int cdiff_dbtype(const char *dbname)
+{
+	unsigned int i;
+
+    for(i = 0; cdiff_dbtypes[i].ext; i++)
+	if(cli_strbcasestr(dbname, cdiff_dbtypes[i].ext))
+	    return cdiff_dbtypes[i].flags;
+    return -1;
+}
+
+static char *cdiff_signame(const char *line, int flags)
+{
+    if(flags & CDIFF_HASH)
+	return cli_strtok(line, 2, ":");
+    return cli_strtok(line, 0, (flags & CDIFF_LSIG) ? ";" : ":");
+}
+
+/* Matches the names stored with or without the .UNOFFICIAL suffix */
+static int cdiff_namecmp(const char *virname, const char *name)
+{
+	size_t len = strlen(name);
+
+    if(strncmp(virname, name, len))
+	return 1;
+    return virname[len] && strcmp(virname + len, ".UNOFFICIAL");
+}
+
+/* Reads a whole line of the script, without the line terminator */
+static char *cdiff_getline(FILE *fs, char **buf, size_t *size)
+{
+	size_t len = 0;
+	char *pt;
+
+    while(1) {
+	if(len + 2 > *size) {
+	    if(!(pt = cli_realloc(*buf, *size ? *size * 2 : FILEBUFF)))
+		return NULL;
+	    *buf = pt;
+	    *size = *size ? *size * 2 : FILEBUFF;
+	}
+	if(!fgets(*buf + len, *size - len, fs)) {
+	    if(!len)
+		return NULL;
+	    break;
+	}
+	len += strlen(*buf + len);
+	if(len && (*buf)[len - 1] == '\n')
+	    break;
+    }
+    while(len && ((*buf)[len - 1] == '\n' || (*buf)[len - 1] == '\r'))
+	(*buf)[--len] = 0;
+    return *buf;
+}
+
+static void cdiff_freedbs(struct cli_patchdb *db)
+{
+	struct cli_patchdb *next;
+
+    for(; db; db = next) {
+	next = db->next;
+	while(db->count)
+	    free(db->lines[--db->count]);
+	free(db->lines);
+	free(db->name);
+	free(db);
+    }
+}
+
+/* Copies the lines added so far, so that a failed script leaves them alone */
+static struct cli_patchdb *cdiff_copydbs(const struct cli_patchdb *db)
+{
+	struct cli_patchdb *head = NULL, **last = &head, *new;
+	unsigned int i;
+
+    for(; db; db = db->next) {
+	if(!(new = cli_calloc(1, sizeof(*new))) || !(new->name = cli_strdup(db->name)) ||
+	   (db->count && !(new->lines = cli_malloc(db->count * sizeof(char *))))) {
+	    if(new)
+		free(new->name);
+	    free(new);
+	    cdiff_freedbs(head);
+	    return NULL;
+	}
+	*last = new;
+	last = &new->next;
+	new->max = db->count;
+	for(i = 0; i < db->count; i++) {
+	    if(!(new->lines[i] = cli_strdup(db->lines[i]))) {
+		cdiff_freedbs(head);
+		return NULL;
+	    }
+	    new->count++;
+	}
+    }
+    return head;
+}
+
+static struct cli_patchdb *cdiff_getdb(struct cli_patchdb **dbs, const char *name)
+{
+	struct cli_patchdb *db;
+
+    for(db = *dbs; db; db = db->next)
+	if(!strcmp(db->name, name))
+	    return db;
+    if(!(db = cli_calloc(1, sizeof(*db))))
+	return NULL;
+    if(!(db->name = cli_strdup(name))) {
+	free(db);
+	return NULL;
+    }
+    db->next = *dbs;
+    *dbs = db;
+    return db;
+}
+
+static int cdiff_addline(struct cli_patchdb *db, const char *line)
+{
+	char **lines;
+
+    if(db->count == db->max) {
+	if(!(lines = cli_realloc(db->lines, (db->max ? db->max * 2 : 16) * sizeof(char *))))
+	    return CL_EMEM;
+	db->lines = lines;
+	db->max = db->max ? db->max * 2 : 16;
+    }
+    if(!(db->lines[db->count] = cli_strdup(line)))
+	return CL_EMEM;
+    db->count++;
+    return CL_SUCCESS;
+}
+
+/* Drops the lines added earlier with the given signature name */
+static unsigned int cdiff_delline(struct cli_patchdb *db, const char *name, int flags)
+{
+	unsigned int i, j, dropped = 0;
+	char *signame;
+
+    for(i = j = 0; i < db->count; i++) {
+	if((signame = cdiff_signame(db->lines[i], flags)) && !strcmp(signame, name)) {
+	    free(db->lines[i]);
+	    dropped++;
+	} else {
+	    db->lines[j++] = db->lines[i];
+	}
+	free(signame);
+    }
+    db->count = j;
+    return dropped;
+}
+
+struct cdiff_match {
+    const char *name;
+    struct cli_patchslot *slots;
+    unsigned int count, max;
+    int readonly;
+};
+
+static int cdiff_match_cb(void *arg, const char **slot, const char *virname)
+{
+	struct cdiff_match *m = (struct cdiff_match *)arg;
+	struct cli_patchslot *slots;
+
+    if(virname == cli_virname_deleted || cdiff_namecmp(virname, m->name))
+	return 0;
+    if(!slot) {
+	m->readonly = 1;
+	return 1;
+    }
+    if(m->count == m->max) {
+	if(!(slots = cli_realloc(m->slots, (m->max ? m->max * 2 : 16) * sizeof(*slots))))
+	    return CL_EMEM;
+	m->slots = slots;
+	m->max = m->max ? m->max * 2 : 16;
+    }
+    m->slots[m->count].slot = slot;
+    m->slots[m->count].virname = virname;
+    m->count++;
+    return 0;
+}
+
+/* Collects the slots of the signatures of the main engine with that name */
+static int cdiff_match(struct cl_engine *engine, struct cdiff_match *m, const char *name, int flags, int *found)
+{
+	struct cli_matcher *root;
+	unsigned int i, count = m->count;
+	int ret = 0;
+
+    m->name = name;
+    if(flags & CDIFF_HASH) {
+	root = (flags & CDIFF_MDB) ? engine->hm_mdb : (flags & CDIFF_FP) ? engine->hm_fp : engine->hm_hdb;
+	if(root)
+	    ret = cli_hm_walknames(root, cdiff_match_cb, m);
+    } else {
+	for(i = 0; !ret && i < CLI_MTARGETS; i++) {
+	    uint32_t j;
+
+	    if(!(root = engine->root[i]))
+		continue;
+	    if(!(flags & CDIFF_LSIG))
+		ret = cli_ac_walknames(root, cdiff_match_cb, m) || cli_bm_walknames(root, cdiff_match_cb, m);
+	    else for(j = 0; !ret && j < root->ac_lsigs; j++)
+		ret = cdiff_match_cb(m, &root->ac_lsigtable[j]->virname, root->ac_lsigtable[j]->virname);
+	}
+    }
+    if(m->readonly) {
+	cli_warnmsg("cl_engine_apply_cdiff: %s is in the mapped hash image\n", name);
+	return CL_EFORMAT;
+    }
+    if(ret)
+	return CL_EMEM;
+    *found = m->count > count;
+    return CL_SUCCESS;
+}
+
+/* A new engine with the settings of engine, for signatures scanned along
+ * with its own: no cache, no statistics and no load threads */
+static struct cl_engine *cli_engine_derive(const struct cl_engine *engine)
+{
+	struct cl_engine *new;
+	struct cl_settings *settings;
+	int ret;
+
+    if(!(new = cl_engine_new()))
+	return NULL;
+    if(!(settings = cl_engine_settings_copy(engine))) {
+	cl_engine_free(new);
+	return NULL;
+    }
+    free(settings->cache_file);
+    free(settings->hash_image);
+    free(settings->cache_migrate);
+    settings->cache_file = settings->hash_image = NULL;
+    settings->cache_migrate = NULL;
+    settings->cb_stats_add_sample = NULL;
+    settings->cb_stats_remove_sample = NULL;
+    settings->cb_stats_decrement_count = NULL;
+    settings->cb_stats_submit = NULL;
+    settings->cb_stats_flush = NULL;
+    settings->cb_stats_get_num = NULL;
+    settings->cb_stats_get_size = NULL;
+    settings->cb_stats_get_hostid = NULL;
+    settings->load_threads = 0;
+    settings->engine_options |= ENGINE_OPTIONS_DISABLE_CACHE;
+    ret = cl_engine_settings_apply(new, settings);
+    cl_engine_settings_free(settings);
+    if(ret) {
+	cl_engine_free(new);
+	return NULL;
+    }
+    return new;
+}
+
+/* Builds a patch engine with the given lines, NULL if there are none */
+static int cdiff_buildpatch(struct cl_engine *engine, const struct cli_patchdb *dbs, struct cl_engine **patch, unsigned int *sigs)
+{
+	struct cl_engine *new;
+	const struct cli_patchdb *db;
+	char *tmp, *path;
+	unsigned int i, dboptions;
+	FILE *fs;
+	int fd, ret = CL_SUCCESS;
+
+    *patch = NULL;
+    *sigs = 0;
+    for(db = dbs; db && !db->count; db = db->next);
+    if(!db)
+	return CL_SUCCESS;
+
+    if(!(new = cli_engine_derive(engine)))
+	return CL_EMEM;
+
+    dboptions = (engine->dboptions & (CL_DB_PUA | CL_DB_PUA_MODE | CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE | CL_DB_ENHANCED)) | CL_DB_OFFICIAL;
+    if(!ret)
+	ret = cli_initroots(new, dboptions);
+
+    for(db = dbs; !ret && db; db = db->next) {
+	if(!db->count)
+	    continue;
+	if(!(tmp = cli_gentemp(engine->tmpdir))) {
+	    ret = CL_EMEM;
+	    break;
+	}
+	path = cli_malloc(strlen(tmp) + strlen(db->name) + 2);
+	if(path)
+	    sprintf(path, "%s.%s", tmp, db->name);
+	free(tmp);
+	if(!path) {
+	    ret = CL_EMEM;
+	    break;
+	}
+	if((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, S_IRUSR | S_IWUSR)) < 0 || !(fs = fdopen(fd, "wb"))) {
+	    cli_errmsg("cl_engine_apply_cdiff: Can't create %s\n", path);
+	    if(fd >= 0) {
+		close(fd);
+		cli_unlink(path);
+	    }
+	    free(path);
+	    ret = CL_ECREAT;
+	    break;
+	}
+	for(i = 0; i < db->count; i++)
+	    if(fprintf(fs, "%s\n", db->lines[i]) < 0)
+		break;
+	if(fclose(fs) || i < db->count) {
+	    cli_errmsg("cl_engine_apply_cdiff: Can't write %s\n", path);
+	    ret = CL_EWRITE;
+	} else {
+	    ret = cl_load(path, new, sigs, dboptions);
+	}
+	if(!engine->keeptmp)
+	    cli_unlink(path);
+	free(path);
+    }
+
+    if(!ret)
+	ret = cl_engine_compile(new);
+    if(ret) {
+	cl_engine_free(new);
+	return ret;
+    }
+    *patch = new;
+    return CL_SUCCESS;
+}
+
+int cl_engine_apply_cdiff(struct cl_engine *engine, const char *script, unsigned int *signo)
+{
+	struct cli_patchset *ps;
+	struct cli_patchdb *dbs = NULL, *db = NULL;
+	struct cdiff_match m;
+	struct cl_engine *patch, **retired;
+	char *buf = NULL, *line, *arg, *name, *newline;
+	size_t size = 0;
+	unsigned int i, lineno = 0, added = 0, removed = 0, sigs;
+	int flags = 0, skip = 0, changed = 0, found, ret = CL_SUCCESS;
+	FILE *fs;
+
+
+    if(!engine || !script)
+	return CL_ENULLARG;
+
+    if(!(engine->dboptions & CL_DB_COMPILED)) {
+	cli_errmsg("cl_engine_apply_cdiff: The engine is not compiled\n");
+	return CL_EARG;
+    }
+
+    if(!(ps = engine->patchset)) {
+	if(!(ps = cli_calloc(1, sizeof(*ps))))
+	    return CL_EMEM;
+	engine->patchset = ps;
+    }
+
+    if(!(fs = fopen(script, "rb"))) {
+	cli_errmsg("cl_engine_apply_cdiff: Can't open %s\n", script);
+	return CL_EOPEN;
+    }
+
+    if(ps->dbs && !(dbs = cdiff_copydbs(ps->dbs))) {
+	fclose(fs);
+	return CL_EMEM;
+    }
+    memset(&m, 0, sizeof(m));
+
+    /* nothing is changed in the engine until the whole script is processed */
+    while(!ret && (line = cdiff_getline(fs, &buf, &size))) {
+	lineno++;
+	if(!*line)
+	    continue;
+
+	if(!strncmp(line, "OPEN ", 5)) {
+	    if(db || skip) {
+		cli_errmsg("cl_engine_apply_cdiff: Line %u: database already opened\n", lineno);
+		ret = CL_EMALFDB;
+	    } else if(cli_strbcasestr(line + 5, ".info")) {
+		skip = 1;
+	    } else if(strchr(line + 5, '/') || (flags = cdiff_dbtype(line + 5)) < 0) {
+		cli_warnmsg("cl_engine_apply_cdiff: Can't patch %s in place\n", line + 5);
+		ret = CL_EFORMAT;
+	    } else if(!(db = cdiff_getdb(&dbs, line + 5))) {
+		ret = CL_EMEM;
+	    }
+	    continue;
+	}
 
-	mpool_free(engine->mempool, thiz->name);
-	mpool_free(engine->mempool, thiz->passwd);
-	mpool_free(engine->mempool, thiz);
+	if(!strcmp(line, "CLOSE")) {
+	    if(!db && !skip) {
+		cli_errmsg("cl_engine_apply_cdiff: Line %u: no database opened\n", lineno);
+		ret = CL_EMALFDB;
+	    }
+	    db = NULL;
+	    skip = 0;
+	    continue;
+	}
 
-	thiz = that;
-    }
-}
+	if(skip)
+	    continue;
 
-int cl_statfree(struct cl_stat *dbstat)
-{
+	if(!strncmp(line, "ADD ", 4)) {
+	    newline = line + 4;
+	    arg = NULL;
+	} else if(!strncmp(line, "DEL ", 4)) {
+	    /* DEL line_no first_bytes */
+	    if((arg = strchr(line + 4, ' ')))
+		arg++;
+	    newline = NULL;
+	} else if(!strncmp(line, "XCHG ", 5)) {
+	    /* XCHG line_no first_bytes_of_old_line new_line */
+	    if((arg = strchr(line + 5, ' ')) && (newline = strchr(++arg, ' ')))
+		*newline++ = 0;
+	    else
+		arg = NULL;
+	} else {
+	    cli_warnmsg("cl_engine_apply_cdiff: Line %u: unsupported command\n", lineno);
+	    ret = CL_EFORMAT;
+	    continue;
+	}
 
-    if(dbstat) {
+	if(!db) {
+	    cli_errmsg("cl_engine_apply_cdiff: Line %u: no database opened\n", lineno);
+	    ret = CL_EMALFDB;
+	    continue;
+	}
+	if((!arg && !newline) || (newline && !*newline)) {
+	    cli_errmsg("cl_engine_apply_cdiff: Line %u: malformed command\n", lineno);
+	    ret = CL_EMALFDB;
+	    continue;
+	}
 
-#ifdef _WIN32
-	    int i;
+	if(arg) {
+	    if(!(name = cdiff_signame(arg, flags))) {
+		cli_warnmsg("cl_engine_apply_cdiff: Line %u: no signature name\n", lineno);
+		ret = CL_EFORMAT;
+		continue;
+	    }
+	    if(cdiff_delline(db, name, flags))
+		changed = 1;
+	    if(!(ret = cdiff_match(engine, &m, name, flags, &found)) && found)
+		removed++;
+	    free(name);
+	}
 
-	if(dbstat->statdname) {
-	    for(i = 0; i < dbstat->entries; i++) {
-		if(dbstat->statdname[i])
-		    free(dbstat->statdname[i]);
-		dbstat->statdname[i] = NULL;
+	if(!ret && newline) {
+	    if(!(flags & CDIFF_ADD)) {
+		cli_warnmsg("cl_engine_apply_cdiff: Can't add signatures to %s in place\n", db->name);
+		ret = CL_EFORMAT;
+		continue;
 	    }
-	    free(dbstat->statdname);
-	    dbstat->statdname = NULL;
+	    ret = cdiff_addline(db, newline);
+	    changed = 1;
+	    added++;
 	}
-#endif
+    }
+    fclose(fs);
+    free(buf);
 
-	if(dbstat->stattab) {
-	    free(dbstat->stattab);
-	    dbstat->stattab = NULL;
+    if(!ret && (db || skip)) {
+	cli_errmsg("cl_engine_apply_cdiff: Missing CLOSE\n");
+	ret = CL_EMALFDB;
+    }
+
+    patch = ps->current;
+    sigs = ps->sigs;
+    if(!ret && changed) {
+	if(ps->nretired % 8 == 0 && ps->current) {
+	    if(!(retired = cli_realloc(ps->retired, (ps->nretired + 8) * sizeof(*retired))))
+		ret = CL_EMEM;
+	    else
+		ps->retired = retired;
 	}
-	dbstat->entries = 0;
+	if(!ret)
+	    ret = cdiff_buildpatch(engine, dbs, &patch, &sigs);
+    }
+    if(!ret && ps->nslots + m.count > ps->maxslots) {
+	struct cli_patchslot *slots = cli_realloc(ps->slots, (ps->nslots + m.count) * sizeof(*slots));
 
-	if(dbstat->dir) {
-	    free(dbstat->dir);
-	    dbstat->dir = NULL;
+	if(!slots) {
+	    if(patch != ps->current)
+		cl_engine_free(patch);
+	    ret = CL_EMEM;
+	} else {
+	    ps->slots = slots;
+	    ps->maxslots = ps->nslots + m.count;
 	}
-    } else {
-        cli_errmsg("cl_statfree(): Null argument passed\n");
-	return CL_ENULLARG;
     }
 
+    if(ret) {
+	free(m.slots);
+	cdiff_freedbs(dbs);
+	return ret;
+    }
+
+    for(i = 0; i < m.count; i++) {
+	ps->slots[ps->nslots++] = m.slots[i];
+	*m.slots[i].slot = cli_virname_deleted;
+    }
+    free(m.slots);
+
+    if(patch != ps->current) {
+	if(ps->current)
+	    ps->retired[ps->nretired++] = ps->current;
+	ps->current = patch;
+#ifdef __GNUC__
+	__sync_synchronize();
+#endif
+	engine->patch = patch;
+    }
+    cdiff_freedbs(ps->dbs);
+    ps->dbs = dbs;
+
+    if(added)
+	cli_cache_clear(engine);
+
+    if(signo)
+	*signo = *signo + sigs - ps->sigs - removed;
+    ps->sigs = sigs;
+    cli_dbgmsg("cl_engine_apply_cdiff: %u signatures added, %u removed, %u in the patch engine\n", added, removed, sigs);
     return CL_SUCCESS;
 }
 
+static void cli_patchset_free(struct cl_engine *engine)
+{
+	struct cli_patchset *ps = engine->patchset;
+
+    if(!ps)
+	return;
+
+    /* the regular cleanup frees the original names */
+    while(ps->nslots--)
+	*ps->slots[ps->nslots].slot = ps->slots[ps->nslots].virname;
+    free(ps->slots);
+    if(ps->current)
+	cl_engine_free(ps->current);
+    while(ps->nretired)
+	cl_engine_free(ps->retired[--ps->nretired]);
+    free(ps->retired);
+    cdiff_freedbs(ps->dbs);
+    free(ps);
+    engine->patchset = NULL;
+    engine->patch = NULL;
+}
+
 int cl_engine_free(struct cl_engine *engine)
 {
 	unsigned int i, j;
@@ -4914,26 +6336,32 @@ int cl_engine_free(struct cl_engine *engine)
 	return CL_SUCCESS;
     }
 
+#ifdef CL_THREAD_SAFE
+    cli_loadjobs_stop(engine);
+#endif
+
+    if (engine->stats_data)
+        clamav_stats_stop(engine->stats_data);
     if (engine->cb_stats_submit)
         engine->cb_stats_submit(engine, engine->stats_data);
 
 #ifdef CL_THREAD_SAFE
-    if (engine->stats_data) {
-        cli_intel_t *intel = (cli_intel_t *)(engine->stats_data);
-
-        pthread_mutex_destroy(&(intel->mutex));
-    }
-
     pthread_mutex_unlock(&cli_ref_mutex);
 #endif
-    if (engine->stats_data)
+    if (engine->stats_data) {
+        clamav_stats_free(engine->stats_data);
         free(engine->stats_data);
+    }
+
+    cli_patchset_free(engine);
+    cli_sigprof_free(engine->sigprof);
 
     if(engine->root) {
 	for(i = 0; i < CLI_MTARGETS; i++) {
 	    if((root = engine->root[i])) {
 		if(!root->ac_only)
 		    cli_bm_free(root);
+		cli_ac_free_merged(root);
 		cli_ac_free(root);
 		if(root->ac_lsigtable) {
 		    for(j = 0; j < root->ac_lsigs; j++) {
@@ -4953,6 +6381,11 @@ int cl_engine_free(struct cl_engine *engine)
 	mpool_free(engine->mempool, engine->root);
     }
 
+    if((root = engine->ftroot)) {
+	cli_ac_free(root);
+	mpool_free(engine->mempool, root);
+    }
+
     if((root = engine->hm_hdb)) {
 	hm_free(root);
 	mpool_free(engine->mempool, root);
@@ -4968,6 +6401,14 @@ int cl_engine_free(struct cl_engine *engine)
 	mpool_free(engine->mempool, root);
     }
 
+    cli_hm_image_free(engine);
+    if(engine->hash_image)
+	mpool_free(engine->mempool, engine->hash_image);
+    if(engine->ac_profile)
+	mpool_free(engine->mempool, engine->ac_profile);
+    if(engine->ac_cost)
+	mpool_free(engine->mempool, engine->ac_cost);
+
     crtmgr_free(&engine->cmgr);
 
     while(engine->cdb) {
@@ -5021,13 +6462,10 @@ int cl_engine_free(struct cl_engine *engine)
     if(engine->iconcheck) {
 	struct icon_matcher *iconcheck = engine->iconcheck;
 	for(i=0; i<3; i++) {
-	    if(iconcheck->icons[i]) {
-		for (j=0;j<iconcheck->icon_counts[i];j++) {
-		    struct icomtr* metric = iconcheck->icons[i];
-		    mpool_free(engine->mempool, metric[j].name);
-		}
+	    if(iconcheck->icons[i])
 		mpool_free(engine->mempool, iconcheck->icons[i]);
-	    }
+	    if(iconcheck->group_index[i])
+		mpool_free(engine->mempool, iconcheck->group_index[i]);
 	}
 	if(iconcheck->group_names[0]) {
 	    for(i=0; i<iconcheck->group_counts[0]; i++)
@@ -5047,6 +6485,11 @@ int cl_engine_free(struct cl_engine *engine)
 
     if(engine->cache)
 	cli_cache_destroy(engine);
+    if(engine->cache_file)
+	mpool_free(engine->mempool, engine->cache_file);
+    cl_hash_destroy(engine->cache_dbctx);
+    cl_hash_destroy(engine->cache_sigctx);
+    free(engine->cache_migrate);
 
     cli_ftfree(engine);
     if(engine->ignored) {
@@ -5073,6 +6516,8 @@ int cl_engine_free(struct cl_engine *engine)
 	mpool_free(engine->mempool, root);
     }
 
+    cli_cold_free(engine->cold);
+
 #ifdef USE_MPOOL
     if(engine->mempool) mpool_destroy(engine->mempool);
 #endif
@@ -5081,18 +6526,176 @@ int cl_engine_free(struct cl_engine *engine)
     cli_yara_free(engine);
 #endif
 
+    cli_memgov_free(engine);
+
+    if(engine->base)
+	cl_engine_free(engine->base);
     free(engine);
     return CL_SUCCESS;
 }
 
-int cl_engine_compile(struct cl_engine *engine)
+#ifdef CL_THREAD_SAFE
+struct cli_triejob {
+    struct cl_engine *engine;
+    pthread_mutex_t mutex;
+    unsigned int next, skip;
+    int ret;
+};
+
+static void *cli_trie_worker(void *arg)
 {
-	unsigned int i;
+    struct cli_triejob *job = (struct cli_triejob *)arg;
+    struct cli_matcher **roots = job->engine->root;
+    unsigned int i;
+    int ret;
+
+    while(1) {
+	pthread_mutex_lock(&job->mutex);
+	while(job->next < CLI_MTARGETS && (!roots[job->next] || roots[job->next]->lazy || job->next == job->skip))
+	    job->next++;
+	i = job->next++;
+	pthread_mutex_unlock(&job->mutex);
+	if(i >= CLI_MTARGETS)
+	    break;
+
+	if((ret = cli_ac_maketrie(roots[i], 1))) {
+	    pthread_mutex_lock(&job->mutex);
+	    if(!job->ret)
+		job->ret = ret;
+	    pthread_mutex_unlock(&job->mutex);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Builds the AC tries of all the roots with engine->load_threads threads.
+ * The largest root goes first and splits its BFS levels between the
+ * threads, the other roots are then built side by side.
+ */
+static int cli_compile_tries(struct cl_engine *engine)
+{
+    pthread_t tid[CLI_MAX_LOAD_THREADS];
+    struct cli_triejob job;
+    unsigned int i, n, started = 0, largest = 0;
+    int ret;
+
+    n = engine->load_threads;
+    if(n > CLI_MAX_LOAD_THREADS)
+	n = CLI_MAX_LOAD_THREADS;
+    for(i = 1; i < CLI_MTARGETS; i++)
+	if(engine->root[i] && !engine->root[i]->lazy && (!engine->root[largest] || engine->root[i]->ac_nodes > engine->root[largest]->ac_nodes))
+	    largest = i;
+    if(engine->root[largest] && (ret = cli_ac_maketrie(engine->root[largest], n)))
+	return ret;
+
+    memset(&job, 0, sizeof(job));
+    job.engine = engine;
+    job.skip = largest;
+    pthread_mutex_init(&job.mutex, NULL);
+    for(i = 1; i < n; i++) {
+	if(pthread_create(&tid[started], NULL, cli_trie_worker, &job))
+	    break;
+	started++;
+    }
+    cli_trie_worker(&job);
+    for(i = 0; i < started; i++)
+	pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&job.mutex);
+    cli_dbgmsg("cl_engine_compile: built the tries with %u threads\n", started + 1);
+    return job.ret;
+}
+#endif
+
+/* Builds the AC trie, unless already built, the logical expressions and
+ * the PCREs of a root */
+/* timed when called by cl_engine_compile(), the builds on first use aren't */
+static int cli_buildroot(const struct cl_engine *engine, unsigned int i, unsigned int built)
+{
+	struct cli_matcher *root = engine->root[i];
+	struct cli_loadtimer timer;
+	int ret, timed = engine->loadtimer != NULL;
+
+    if(timed)
+	cli_loadstat_start(engine, &timer, CLI_LOADSTAT_AC);
+    if(built || !(ret = cli_ac_maketrie(root, 1))) {
+	cli_ac_finishtrie(root);
+	ret = cli_ac_buildlsigs(root);
+    }
+    if(timed)
+	cli_loadstat_stop(engine, &timer);
+    if(ret)
+	return ret;
+#if HAVE_PCRE
+    if(timed)
+	cli_loadstat_start(engine, &timer, CLI_LOADSTAT_PCRE);
+    ret = cli_pcre_build(root, engine->pcre_match_limit, engine->pcre_recmatch_limit, engine->dconf);
+    if(timed)
+	cli_loadstat_stop(engine, &timer);
+    if(ret)
+	return ret;
+
+    cli_dbgmsg("Matcher[%u]: %s: AC sigs: %u (reloff: %u, absoff: %u) BM sigs: %u (reloff: %u, absoff: %u) PCREs: %u (reloff: %u, absoff: %u) maxpatlen %u %s\n", i, cli_mtargets[i].name, root->ac_patterns, root->ac_reloff_num, root->ac_absoff_num, root->bm_patterns, root->bm_reloff_num, root->bm_absoff_num, root->pcre_metas, root->pcre_reloff_num, root->pcre_absoff_num, root->maxpatlen, root->ac_only ? "(ac_only mode)" : "");
+#else
+    cli_dbgmsg("Matcher[%u]: %s: AC sigs: %u (reloff: %u, absoff: %u) BM sigs: %u (reloff: %u, absoff: %u) maxpatlen %u PCREs: 0 (disabled) %s\n", i, cli_mtargets[i].name, root->ac_patterns, root->ac_reloff_num, root->ac_absoff_num, root->bm_patterns, root->bm_reloff_num, root->bm_absoff_num, root->maxpatlen, root->ac_only ? "(ac_only mode)" : "");
+#endif
+    return CL_SUCCESS;
+}
+
+/* The roots left by CL_ENGINE_LAZY_MATCHERS are built by the first scan
+ * needing them; the builds are serialized as they use the memory pool */
+struct cli_matcher *cli_getroot(const struct cl_engine *engine, unsigned int target)
+{
+	struct cli_matcher *root = engine->root[target];
+	int ret;
+
+    if(!root || !root->lazy)
+	return root;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&cli_lazy_mutex);
+#endif
+    if(root->lazy == 1) {
+	if((ret = cli_buildroot(engine, target, 0)))
+	    cli_errmsg("cli_getroot: Can't build the %s matcher: %s\n", cli_mtargets[target].name, cl_strerror(ret));
+#ifdef __GNUC__
+	__sync_synchronize();
+#endif
+	root->lazy = ret ? 2 : 0;
+    }
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&cli_lazy_mutex);
+#endif
+    return root->lazy ? NULL : root;
+}
+
+/* Moves the logic of the compiled logical signatures to the cold store,
+ * only the debug output reads it again. The roots built on first use keep
+ * theirs, the store takes no additions once the scans have started. */
+static int cli_coldlogic(struct cl_engine *engine, struct cli_matcher *root)
+{
+	struct cli_ac_lsig *lsig;
+	uint32_t i;
+
+    for(i = 0; i < root->ac_lsigs; i++) {
+	lsig = root->ac_lsigtable[i];
+	if(lsig->type != CLI_LSIG_NORMAL || !lsig->ops || !lsig->u.logic)
+	    continue;
+	if(!cli_engine_cold(engine) || cli_cold_add(engine->cold, lsig->u.logic, &lsig->logic_cold))
+	    return CL_EMEM;
+	mpool_free(engine->mempool, lsig->u.logic);
+	lsig->u.logic = NULL;
+    }
+    return CL_SUCCESS;
+}
+
+static int cli_engine_compile(struct cl_engine *engine)
+{
+	unsigned int i, built = 0;
 	int ret;
 	struct cli_matcher *root;
+	struct cli_loadtimer timer;
 
-    if(!engine)
-	return CL_ENULLARG;
 #ifdef HAVE_YARA
     /* Free YARA hash tables - only needed for parse and load */
     if (engine->yara_global != NULL) {
@@ -5107,26 +6710,57 @@ int cl_engine_compile(struct cl_engine *engine)
     if(!engine->ftypes)
 	if((ret = cli_loadftm(NULL, engine, 0, 1, NULL)))
 	    return ret;
+    if((ret = cli_ftindex_build(engine)))
+	return ret;
 
     /* handle default passwords */
     if(!engine->pwdbs[0] && !engine->pwdbs[1] && !engine->pwdbs[2])
 	if((ret = cli_loadpwdb(NULL, engine, 0, 1, NULL)))
 	    return ret;
 
+    /* the generic root is also used for the file type recognition */
+    if(engine->lazy_matchers)
+	for(i = 1; i < CLI_MTARGETS; i++)
+	    if((root = engine->root[i]))
+		root->lazy = 1;
+
+#ifdef CL_THREAD_SAFE
+    if(engine->load_threads > 1) {
+	cli_loadstat_start(engine, &timer, CLI_LOADSTAT_AC);
+	ret = cli_compile_tries(engine);
+	cli_loadstat_stop(engine, &timer);
+	if(ret)
+	    return ret;
+	built = 1;
+    }
+#endif
+
     for(i = 0; i < CLI_MTARGETS; i++) {
 	if((root = engine->root[i])) {
-	    if((ret = cli_ac_buildtrie(root)))
+	    if(root->lazy) {
+		cli_dbgmsg("Matcher[%u]: %s: AC sigs: %u BM sigs: %u, built on first use\n", i, cli_mtargets[i].name, root->ac_patterns, root->bm_patterns);
+		continue;
+	    }
+	    if((ret = cli_buildroot(engine, i, built)) || (ret = cli_coldlogic(engine, root)))
 		return ret;
-#if HAVE_PCRE
-            if((ret = cli_pcre_build(root, engine->pcre_match_limit, engine->pcre_recmatch_limit, engine->dconf)))
-                return ret;
-
-	    cli_dbgmsg("Matcher[%u]: %s: AC sigs: %u (reloff: %u, absoff: %u) BM sigs: %u (reloff: %u, absoff: %u) PCREs: %u (reloff: %u, absoff: %u) maxpatlen %u %s\n", i, cli_mtargets[i].name, root->ac_patterns, root->ac_reloff_num, root->ac_absoff_num, root->bm_patterns, root->bm_reloff_num, root->bm_absoff_num, root->pcre_metas, root->pcre_reloff_num, root->pcre_absoff_num, root->maxpatlen, root->ac_only ? "(ac_only mode)" : "");
-#else
-	    cli_dbgmsg("Matcher[%u]: %s: AC sigs: %u (reloff: %u, absoff: %u) BM sigs: %u (reloff: %u, absoff: %u) maxpatlen %u PCREs: 0 (disabled) %s\n", i, cli_mtargets[i].name, root->ac_patterns, root->ac_reloff_num, root->ac_absoff_num, root->bm_patterns, root->bm_reloff_num, root->bm_absoff_num, root->maxpatlen, root->ac_only ? "(ac_only mode)" : "");
-#endif
 	}
     }
+    /* the roots left for later are built without the generic patterns */
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_AC);
+    ret = CL_SUCCESS;
+    for(i = 1; i < CLI_MTARGETS && engine->root[0] && !ret; i++) {
+	if((engine->merged_targets & (1U << i)) && (root = engine->root[i]) && !root->lazy)
+	    ret = cli_ac_merge(root, engine->root[0], engine->load_threads ? engine->load_threads : 1);
+    }
+    if(!ret && (root = engine->ftroot) && !(ret = cli_ac_maketrie(root, 1))) {
+	cli_ac_finishtrie(root);
+	cli_dbgmsg("Matcher: file types: AC sigs: %u\n", root->ac_patterns);
+    }
+    cli_loadstat_stop(engine, &timer);
+    if(ret)
+	return ret;
+
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_HASH);
     if(engine->hm_hdb)
 	hm_flush(engine->hm_hdb);
 
@@ -5136,6 +6770,9 @@ int cl_engine_compile(struct cl_engine *engine)
     if(engine->hm_fp)
 	hm_flush(engine->hm_fp);
 
+    cli_hm_image_compile(engine);
+    cli_loadstat_stop(engine, &timer);
+
     if((ret = cli_build_regex_list(engine->whitelist_matcher))) {
 	    return ret;
     }
@@ -5167,19 +6804,67 @@ int cl_engine_compile(struct cl_engine *engine)
 	mpool_free(engine->mempool, root);
 	engine->test_root = NULL;
     }
+    if(engine->cold) {
+	size_t ulen, clen;
+
+	if((ret = cli_cold_seal(engine->cold)))
+	    return ret;
+	cli_cold_stats(engine->cold, &ulen, &clen);
+	cli_dbgmsg("cl_engine_compile: cold strings: %lu bytes stored in %lu\n", (unsigned long)ulen, (unsigned long)clen);
+    }
     cli_dconf_print(engine->dconf);
     mpool_flush(engine->mempool);
 
     /* Compile bytecode */
-    if((ret = cli_bytecode_prepare2(engine, &engine->bcs, engine->dconf->bytecode))) {
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_BYTECODE);
+    ret = cli_bytecode_prepare2(engine, &engine->bcs, engine->dconf->bytecode);
+    cli_loadstat_stop(engine, &timer);
+    if(ret) {
 	cli_errmsg("Unable to compile/load bytecode: %s\n", cl_strerror(ret));
 	return ret;
     }
 
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_CACHE);
+    if(!(ret = cli_cache_load(engine)))
+	cli_cache_migrate(engine);
+    cli_loadstat_stop(engine, &timer);
+    if(ret)
+	return ret;
+
+    if(engine->sigprof_rate && !engine->sigprof && !(engine->sigprof = cli_sigprof_new(engine->sigprof_rate)))
+	return CL_EMEM;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&cli_ref_mutex);
+#endif
+    engine->generation = ++cli_engine_generation;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&cli_ref_mutex);
+#endif
+
     engine->dboptions |= CL_DB_COMPILED;
     return CL_SUCCESS;
 }
 
+int cl_engine_compile(struct cl_engine *engine)
+{
+	struct cli_loadtimer timer;
+	int ret;
+
+    if(!engine)
+	return CL_ENULLARG;
+
+    if(engine->dboptions & CL_DB_VERIFY_ONLY) {
+	cli_errmsg("cl_engine_compile: The signatures were loaded with CL_DB_VERIFY_ONLY\n");
+	return CL_EARG;
+    }
+
+    cli_loadstat_start(engine, &timer, CLI_LOADSTAT_COMPILE);
+    ret = cli_engine_compile(engine);
+    cli_loadstat_stop(engine, &timer);
+    return ret;
+}
+
 int cl_engine_addref(struct cl_engine *engine)
 {
     if(!engine) {
@@ -5200,6 +6885,117 @@ int cl_engine_addref(struct cl_engine *engine)
     return CL_SUCCESS;
 }
 
+struct cl_engine *cl_engine_overlay_new(struct cl_engine *base)
+{
+	struct cl_engine *overlay;
+
+
+    if(!base) {
+	cli_errmsg("cl_engine_overlay_new: base == NULL\n");
+	return NULL;
+    }
+
+    if(!(base->dboptions & CL_DB_COMPILED) || base->base) {
+	cli_errmsg("cl_engine_overlay_new: The base engine must be compiled and not an overlay\n");
+	return NULL;
+    }
+
+    if(!(overlay = cli_engine_derive(base)))
+	return NULL;
+    cl_engine_addref(base);
+    overlay->base = base;
+    return overlay;
+}
+
+int cl_engine_get_memstats(const struct cl_engine *engine, struct cl_memstat *stats, unsigned int *count)
+{
+	struct cl_memstat st;
+	const struct cli_matcher *root;
+	unsigned int i, n = 0;
+	static const char *hashnames[] = { "HDB", "MDB", "FP", "IMP" };
+	const struct cli_matcher *hashdbs[4];
+
+    if(!engine || !count || (*count && !stats)) {
+	cli_errmsg("cl_engine_get_memstats: NULL argument\n");
+	return CL_ENULLARG;
+    }
+
+#ifdef CL_THREAD_SAFE
+    /* roots built on first use must not change under us */
+    pthread_mutex_lock(&cli_lazy_mutex);
+#endif
+    for(i = 0; i < CLI_MTARGETS; i++) {
+	if(!(root = engine->root[i]))
+	    continue;
+	memset(&st, 0, sizeof(st));
+	strncpy(st.name, cli_mtargets[i].name, sizeof(st.name) - 1);
+	st.sigs = root->ac_patterns + root->bm_patterns;
+	cli_ac_memstats(root, &st.bytes[CL_MEMSTAT_AC_NODES], &st.bytes[CL_MEMSTAT_AC_TRANS], &st.bytes[CL_MEMSTAT_AC_PATTERNS]);
+	if(root->ac_merged) {
+	    /* its patterns are counted with their roots */
+	    size_t shared = 0;
+
+	    cli_ac_memstats(root->ac_merged, &st.bytes[CL_MEMSTAT_AC_NODES], &st.bytes[CL_MEMSTAT_AC_TRANS], &shared);
+	}
+	st.bytes[CL_MEMSTAT_BM] = cli_bm_memstats(root);
+#if HAVE_PCRE
+	st.sigs += root->pcre_metas;
+#endif
+	st.bytes[CL_MEMSTAT_PCRE] = cli_pcre_memstats(root);
+	if(n < *count)
+	    stats[n] = st;
+	n++;
+    }
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&cli_lazy_mutex);
+#endif
+
+    hashdbs[0] = engine->hm_hdb;
+    hashdbs[1] = engine->hm_mdb;
+    hashdbs[2] = engine->hm_fp;
+    hashdbs[3] = engine->hm_imp;
+    for(i = 0; i < 4; i++) {
+	if(!hashdbs[i])
+	    continue;
+	memset(&st, 0, sizeof(st));
+	strncpy(st.name, hashnames[i], sizeof(st.name) - 1);
+	st.bytes[CL_MEMSTAT_HASH] = cli_hm_memstats(hashdbs[i], &st.sigs);
+	if(n < *count)
+	    stats[n] = st;
+	n++;
+    }
+
+    if(engine->bcs.count) {
+	memset(&st, 0, sizeof(st));
+	strcpy(st.name, "BYTECODE");
+	st.sigs = engine->bcs.count;
+	for(i = 0; i < engine->bcs.count; i++)
+	    st.bytes[CL_MEMSTAT_BYTECODE] += cli_bytecode_memsize(&engine->bcs.all_bcs[i]);
+	if(n < *count)
+	    stats[n] = st;
+	n++;
+    }
+
+#ifdef HAVE_YARA
+    if(engine->yara_global && engine->yara_global->the_arena) {
+	const YR_ARENA_PAGE *page;
+	size_t bytes = 0;
+
+	for(page = engine->yara_global->the_arena->page_list_head; page; page = page->next)
+	    bytes += sizeof(*page) + page->size;
+	memset(&st, 0, sizeof(st));
+	strcpy(st.name, "YARA");
+	st.bytes[CL_MEMSTAT_YARA] = bytes;
+	if(n < *count)
+	    stats[n] = st;
+	n++;
+    }
+#endif
+
+    *count = n;
+    return CL_SUCCESS;
+}
+
 static int countentries(const char *dbname, unsigned int *sigs)
 {
 	char buffer[CLI_DEFAULT_LSIG_BUFSIZE + 1];
@@ -5237,6 +7033,24 @@ static int countsigs(const char *dbname, unsigned int options, unsigned int *sig
 	if(options & CL_COUNTSIGS_UNOFFICIAL)
 	    (*sigs)++;
 
+    } else if(cli_strbcasestr(dbname, ".bdb")) {
+	if(options & CL_COUNTSIGS_UNOFFICIAL) {
+		struct cli_bdb_hdr hdr;
+		FILE *fs = fopen(dbname, "rb");
+
+	    if(!fs) {
+		cli_errmsg("countsigs: Can't open file %s\n", dbname);
+		return CL_EOPEN;
+	    }
+	    if(fread(&hdr, sizeof(hdr), 1, fs) != 1 || memcmp(hdr.magic, CLI_BDB_MAGIC, sizeof(hdr.magic))) {
+		cli_errmsg("countsigs: Can't parse %s\n", dbname);
+		fclose(fs);
+		return CL_EMALFDB;
+	    }
+	    fclose(fs);
+	    *sigs += le32_to_host(hdr.sigs);
+	}
+
     } else if(cli_strbcasestr(dbname, ".wdb") || cli_strbcasestr(dbname, ".fp") || cli_strbcasestr(dbname, ".ftm") || cli_strbcasestr(dbname, ".cfg") || cli_strbcasestr(dbname, ".cat")) {
 	/* ignore */
 
@@ -43,6 +43,7 @@
 	cli_strbcasestr(ext, ".sfp")   ||	\
 	cli_strbcasestr(ext, ".msb")   ||	\
 	cli_strbcasestr(ext, ".msu")   ||	\
+	cli_strbcasestr(ext, ".bdb")   ||	\
 	cli_strbcasestr(ext, ".ndb")   ||	\
 	cli_strbcasestr(ext, ".ndu")   ||	\
 	cli_strbcasestr(ext, ".ldb")   ||	\
@@ -84,6 +85,7 @@
 	cli_strbcasestr(ext, ".sfp")   ||	\
 	cli_strbcasestr(ext, ".msb")   ||	\
 	cli_strbcasestr(ext, ".msu")   ||	\
+	cli_strbcasestr(ext, ".bdb")   ||	\
 	cli_strbcasestr(ext, ".ndb")   ||	\
 	cli_strbcasestr(ext, ".ndu")   ||	\
 	cli_strbcasestr(ext, ".ldb")   ||	\
@@ -114,6 +116,42 @@ int cli_sigopts_handler(struct cli_matcher *root, const char *virname, const cha
 
 int cli_parse_add(struct cli_matcher *root, const char *virname, const char *hexsig, uint8_t sigopts, uint16_t rtype, uint16_t type, const char *offset, uint8_t target, const uint32_t *lsigid, unsigned int options);
 
+/*
+ * Precompiled hash database (.bdb), written by sigtool --compile-db.
+ * All fields are little endian. The header is followed by the sections,
+ * each made of a section header, the fixed size entries and the string
+ * table with the (NUL terminated) signature names. Sections start at
+ * 8 byte boundaries.
+ */
+#define CLI_BDB_MAGIC "ClamBDB"
+#define CLI_BDB_VERSION 1
+#define CLI_BDB_NOMAXFL 0xffff
+
+struct cli_bdb_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t sections;
+    uint32_t sigs;
+    uint32_t reserved;
+};
+
+struct cli_bdb_sec {
+    char ext[4];	/* source database type, eg. "hsb" */
+    uint32_t count;
+    uint32_t strsize;
+    uint32_t reserved;
+};
+
+struct cli_bdb_ent {
+    uint32_t size;	/* 0: any size */
+    uint32_t name;	/* offset in the string table */
+    uint16_t minfl;
+    uint16_t maxfl;	/* CLI_BDB_NOMAXFL: none */
+    uint8_t type;	/* enum CLI_HASH_TYPE */
+    uint8_t pad[3];
+    uint8_t hash[32];
+};
+
 int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio);
 
 char *cli_dbgets(char *buff, unsigned int size, FILE *fs, struct cli_dbio *dbio);
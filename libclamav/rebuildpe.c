@@ -120,17 +120,17 @@ struct IMAGE_PE_HEADER {
 \x00\x00\x00\x00\x10\x00\x00\x00\
 "
 
-int cli_rebuildpe(char *buffer, struct cli_exe_section *sections, int sects, uint32_t base, uint32_t ep, uint32_t ResRva, uint32_t ResSize, int file)
+int cli_rebuildpe(char *buffer, struct cli_exe_section *sections, int sects, uint32_t base, uint32_t ep, uint32_t ResRva, uint32_t ResSize, struct cli_extract *x)
 {
-  return cli_rebuildpe_align(buffer, sections, sects, base, ep, ResRva, ResSize, file, 0);
+  return cli_rebuildpe_align(buffer, sections, sects, base, ep, ResRva, ResSize, x, 0);
 }
 
-int cli_rebuildpe_align(char *buffer, struct cli_exe_section *sections, int sects, uint32_t base, uint32_t ep, uint32_t ResRva, uint32_t ResSize, int file, uint32_t align)
+int cli_rebuildpe_align(char *buffer, struct cli_exe_section *sections, int sects, uint32_t base, uint32_t ep, uint32_t ResRva, uint32_t ResSize, struct cli_extract *x, uint32_t align)
 {
   uint32_t datasize=0, rawbase=PESALIGN(0x148+0x80+0x28*sects, 0x200);
   char *pefile=NULL, *curpe;
   struct IMAGE_PE_HEADER *fakepe;
-  int i, gotghost=(sections[0].rva > PESALIGN(rawbase, 0x1000));
+  int i, inbuf=1, gotghost=(sections[0].rva > PESALIGN(rawbase, 0x1000));
 
   if (gotghost) rawbase=PESALIGN(0x148+0x80+0x28*(sects+1), 0x200);
 
@@ -147,9 +147,13 @@ int cli_rebuildpe_align(char *buffer, struct cli_exe_section *sections, int sect
   if(datasize > CLI_MAX_ALLOCATION)
     return 0;
 
-  pefile = (char *) cli_calloc(rawbase+datasize, 1);
-  if(!pefile)
+  /* rebuilt straight into the sink's buffer when it goes to memory */
+  if ((pefile = (char *) cli_extract_reserve(x, rawbase+datasize)))
+      memset(pefile, 0, rawbase+datasize);
+  else if (!(pefile = (char *) cli_calloc(rawbase+datasize, 1)))
       return 0;
+  else
+      inbuf = 0;
 
   memcpy(pefile, HEADERS, 0x148);
 
@@ -205,7 +209,9 @@ int cli_rebuildpe_align(char *buffer, struct cli_exe_section *sections, int sect
   }
   fakepe->SizeOfImage = EC32(datasize);
 
-  i = (cli_writen(file, pefile, rawbase)!=-1);
+  if (inbuf)
+      return cli_extract_commit(x, rawbase) == CL_SUCCESS;
+  i = (cli_extract_write(x, pefile, rawbase) == CL_SUCCESS);
   free(pefile);
   return i;
 }
@@ -0,0 +1,520 @@
+/*
+ *  Compile the common URL list regular expressions to a DFA.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "clamav.h"
+#include "others.h"
+#include "regex_dfa.h"
+#define MODULE "regex_dfa: "
+
+/* Patterns needing more than this are left to cli_regexec() */
+#define DFA_MAX_NODES	1024	/* NFA nodes, two per literal */
+#define DFA_MAX_SETS	64	/* distinct byte sets */
+#define DFA_MAX_STATES	512
+#define DFA_MAX_DEPTH	16	/* nested groups */
+
+#define BITMAP_HASSET(b, i) ((b)[(i)>>3] & (1<<((i)&7)))
+#define BITMAP_SET(b, i) ((b)[(i)>>3] |= (1<<((i)&7)))
+
+struct cli_regex_dfa {
+	uint8_t classes[256];	/* byte -> byte class */
+	unsigned nclasses;
+	unsigned nstates;
+	uint8_t *accept;
+	uint16_t *trans;	/* nstates rows of nclasses */
+};
+
+/* --- Thompson NFA --- */
+
+enum nfa_type {
+	NFA_EPS,	/* -> out1 */
+	NFA_SPLIT,	/* -> out1, out2 */
+	NFA_SET,	/* byte in set -> out1 */
+	NFA_ACCEPT
+};
+
+struct nfa_node {
+	uint8_t type;
+	uint8_t set;
+	uint16_t out1;
+	uint16_t out2;
+};
+
+struct nfa {
+	const char *pat;
+	size_t pos;
+	unsigned nodes;
+	unsigned sets;
+	struct nfa_node node[DFA_MAX_NODES];
+	uint8_t set[DFA_MAX_SETS][32];
+};
+
+/* a fragment runs from start to an NFA_EPS end whose out1 is not set yet */
+struct frag {
+	uint16_t start;
+	uint16_t end;
+};
+
+static int nfa_node(struct nfa *nfa, enum nfa_type type, uint16_t out1, uint16_t out2)
+{
+	struct nfa_node *n;
+	if(nfa->nodes == DFA_MAX_NODES)
+		return -1;
+	n = &nfa->node[nfa->nodes];
+	n->type = type;
+	n->set = 0;
+	n->out1 = out1;
+	n->out2 = out2;
+	return nfa->nodes++;
+}
+
+static int frag_set(struct nfa *nfa, struct frag *f, const uint8_t *bitmap)
+{
+	unsigned i;
+	int n, e;
+
+	for(i=0;i<nfa->sets;i++)
+		if(!memcmp(nfa->set[i], bitmap, 32))
+			break;
+	if(i == nfa->sets) {
+		if(nfa->sets == DFA_MAX_SETS)
+			return -1;
+		memcpy(nfa->set[nfa->sets++], bitmap, 32);
+	}
+	if((e = nfa_node(nfa, NFA_EPS, 0, 0)) < 0 ||
+	   (n = nfa_node(nfa, NFA_SET, e, 0)) < 0)
+		return -1;
+	nfa->node[n].set = i;
+	f->start = n;
+	f->end = e;
+	return 0;
+}
+
+/* parses the bracket expression after '[', in the way regcomp() does.
+ * Collating elements, equivalence classes and character class names are
+ * not handled */
+static int parse_bracket(struct nfa *nfa, struct frag *f)
+{
+	const unsigned char *p = (const unsigned char*)nfa->pat;
+	uint8_t bitmap[32];
+	size_t pos = nfa->pos;
+	unsigned c, d, i;
+	int neg = 0;
+
+	memset(bitmap, 0, sizeof(bitmap));
+	if(p[pos] == '^') {
+		neg = 1;
+		pos++;
+	}
+	if(p[pos] == ']' || p[pos] == '-')
+		BITMAP_SET(bitmap, p[pos++]);
+	while(p[pos] != ']') {
+		c = p[pos];
+		if(!c || c == '[' || c >= 0x80)
+			return -1;
+		if(c == '-') {
+			/* only allowed as the last one */
+			if(p[pos+1] != ']')
+				return -1;
+			BITMAP_SET(bitmap, c);
+			pos++;
+			continue;
+		}
+		pos++;
+		if(p[pos] == '-' && p[pos+1] != ']') {
+			d = p[pos+1];
+			if(!d || d == '[' || d == '-' || d >= 0x80 || d < c)
+				return -1;
+			for(i=c;i<=d;i++)
+				BITMAP_SET(bitmap, i);
+			pos += 2;
+		} else {
+			BITMAP_SET(bitmap, c);
+		}
+	}
+	nfa->pos = pos + 1;
+	if(neg)
+		for(i=0;i<32;i++)
+			bitmap[i] = ~bitmap[i];
+	return frag_set(nfa, f, bitmap);
+}
+
+static int parse_alt(struct nfa *nfa, struct frag *f, unsigned depth);
+
+static int parse_atom(struct nfa *nfa, struct frag *f, unsigned depth)
+{
+	uint8_t bitmap[32];
+	unsigned char c = nfa->pat[nfa->pos];
+
+	switch(c) {
+		case '(':
+			nfa->pos++;
+			if(depth == DFA_MAX_DEPTH || nfa->pat[nfa->pos] == ')')
+				return -1;
+			if(parse_alt(nfa, f, depth + 1) < 0 || nfa->pat[nfa->pos] != ')')
+				return -1;
+			nfa->pos++;
+			return 0;
+		case '.':
+			nfa->pos++;
+			memset(bitmap, 0xff, sizeof(bitmap));
+			return frag_set(nfa, f, bitmap);
+		case '[':
+			nfa->pos++;
+			return parse_bracket(nfa, f);
+		case '\\':
+			c = nfa->pat[++nfa->pos];
+			if(!c || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+				return -1;
+			break;
+		case ')':
+		case '|':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		case '^':
+		case '$':
+		case '\0':
+			return -1;
+		default:
+			break;
+	}
+	if(c >= 0x80)
+		return -1;
+	nfa->pos++;
+	memset(bitmap, 0, sizeof(bitmap));
+	BITMAP_SET(bitmap, c);
+	return frag_set(nfa, f, bitmap);
+}
+
+static int parse_piece(struct nfa *nfa, struct frag *f, unsigned depth)
+{
+	int s, e;
+	char c;
+
+	if(parse_atom(nfa, f, depth) < 0)
+		return -1;
+	c = nfa->pat[nfa->pos];
+	if(c != '*' && c != '+' && c != '?')
+		return 0;
+	nfa->pos++;
+	if((e = nfa_node(nfa, NFA_EPS, 0, 0)) < 0 ||
+	   (s = nfa_node(nfa, NFA_SPLIT, f->start, e)) < 0)
+		return -1;
+	/* x? : s -> (x | e)
+	 * x* : s -> (x -> s | e)
+	 * x+ : x -> s -> (x | e) */
+	nfa->node[f->end].out1 = c == '?' ? e : s;
+	if(c != '+')
+		f->start = s;
+	f->end = e;
+	c = nfa->pat[nfa->pos];
+	/* regcomp() rejects repeated operators, bounds aren't handled */
+	return (c == '*' || c == '+' || c == '?' || c == '{') ? -1 : 0;
+}
+
+static int parse_branch(struct nfa *nfa, struct frag *f, unsigned depth)
+{
+	struct frag g;
+	char c;
+
+	if(parse_piece(nfa, f, depth) < 0)
+		return -1;
+	while((c = nfa->pat[nfa->pos]) && c != '|' && c != ')') {
+		if(parse_piece(nfa, &g, depth) < 0)
+			return -1;
+		nfa->node[f->end].out1 = g.start;
+		f->end = g.end;
+	}
+	return 0;
+}
+
+static int parse_alt(struct nfa *nfa, struct frag *f, unsigned depth)
+{
+	struct frag g;
+	int s, e;
+
+	if(parse_branch(nfa, f, depth) < 0)
+		return -1;
+	while(nfa->pat[nfa->pos] == '|') {
+		nfa->pos++;
+		if(parse_branch(nfa, &g, depth) < 0)
+			return -1;
+		if((e = nfa_node(nfa, NFA_EPS, 0, 0)) < 0 ||
+		   (s = nfa_node(nfa, NFA_SPLIT, f->start, g.start)) < 0)
+			return -1;
+		nfa->node[f->end].out1 = e;
+		nfa->node[g.end].out1 = e;
+		f->start = s;
+		f->end = e;
+	}
+	return 0;
+}
+
+/* adds the NFA_SET and NFA_ACCEPT nodes reachable from @from without
+ * consuming a byte to @set; @seen holds the nodes visited so far */
+static void nfa_closure(const struct nfa *nfa, unsigned from, uint64_t *set, uint64_t *seen, uint16_t *stack)
+{
+	unsigned sp = 0, n;
+
+	stack[sp++] = from;
+	while(sp) {
+		n = stack[--sp];
+		if(seen[n >> 6] & ((uint64_t)1 << (n & 63)))
+			continue;
+		seen[n >> 6] |= (uint64_t)1 << (n & 63);
+		switch(nfa->node[n].type) {
+			case NFA_SPLIT:
+				stack[sp++] = nfa->node[n].out2;
+				/* fall-through */
+			case NFA_EPS:
+				stack[sp++] = nfa->node[n].out1;
+				break;
+			default:
+				set[n >> 6] |= (uint64_t)1 << (n & 63);
+				break;
+		}
+	}
+}
+
+/* --- subset construction --- */
+
+struct dfa_build {
+	const struct nfa *nfa;
+	unsigned words;		/* per state set */
+	unsigned accept_node;
+	uint64_t *sets;
+	uint32_t *hashes;
+	struct cli_regex_dfa *dfa;
+};
+
+static uint32_t set_hash(const uint64_t *set, unsigned words)
+{
+	uint32_t h = 2166136261u;
+	unsigned i;
+	for(i=0;i<words;i++) {
+		h = (h ^ (uint32_t)set[i]) * 16777619u;
+		h = (h ^ (uint32_t)(set[i] >> 32)) * 16777619u;
+	}
+	return h;
+}
+
+/* returns the DFA state for @set, adding it if new */
+static int dfa_state(struct dfa_build *b, const uint64_t *set)
+{
+	struct cli_regex_dfa *dfa = b->dfa;
+	uint32_t h = set_hash(set, b->words);
+	unsigned i, n;
+	void *tmp;
+
+	for(i=0;i<dfa->nstates;i++)
+		if(b->hashes[i] == h && !memcmp(&b->sets[i * b->words], set, b->words * sizeof(*set)))
+			return i;
+	if(dfa->nstates == DFA_MAX_STATES)
+		return -1;
+	n = dfa->nstates + 1;
+	if(!(tmp = cli_realloc(b->sets, n * b->words * sizeof(*b->sets))))
+		return -1;
+	b->sets = tmp;
+	if(!(tmp = cli_realloc(b->hashes, n * sizeof(*b->hashes))))
+		return -1;
+	b->hashes = tmp;
+	if(!(tmp = cli_realloc(dfa->accept, n * sizeof(*dfa->accept))))
+		return -1;
+	dfa->accept = tmp;
+	if(!(tmp = cli_realloc(dfa->trans, n * dfa->nclasses * sizeof(*dfa->trans))))
+		return -1;
+	dfa->trans = tmp;
+	memcpy(&b->sets[i * b->words], set, b->words * sizeof(*set));
+	b->hashes[i] = h;
+	dfa->accept[i] = (set[b->accept_node >> 6] >> (b->accept_node & 63)) & 1;
+	dfa->nstates = n;
+	return i;
+}
+
+/* splits the bytes into classes which no set of the NFA tells apart */
+static void dfa_classes(const struct nfa *nfa, struct cli_regex_dfa *dfa, uint8_t *rep)
+{
+	int remap[512];
+	unsigned i, s, b, n = 1;
+
+	memset(dfa->classes, 0, sizeof(dfa->classes));
+	for(s=0;s<nfa->sets;s++) {
+		for(i=0;i<2*n;i++)
+			remap[i] = -1;
+		for(b=n=0;b<256;b++) {
+			unsigned k = dfa->classes[b] * 2 + !!BITMAP_HASSET(nfa->set[s], b);
+			if(remap[k] < 0)
+				remap[k] = n++;
+			dfa->classes[b] = remap[k];
+		}
+	}
+	for(b=256;b>0;b--)
+		rep[dfa->classes[b-1]] = b-1;
+	dfa->nclasses = n;
+}
+
+static int dfa_build(struct dfa_build *b, unsigned start)
+{
+	const struct nfa *nfa = b->nfa;
+	struct cli_regex_dfa *dfa = b->dfa;
+	uint64_t *seen, *start_set, *next;
+	uint16_t *stack, *active;
+	uint8_t rep[256];
+	unsigned i, c, w, nactive;
+	int ret = -1, st;
+
+	seen = cli_malloc(3 * b->words * sizeof(*seen));
+	/* every node is expanded once, pushing at most two others */
+	stack = cli_malloc((3 * nfa->nodes + 1) * sizeof(*stack));
+	if(!seen || !stack) {
+		free(seen);
+		free(stack);
+		return -1;
+	}
+	start_set = seen + b->words;
+	next = start_set + b->words;
+	active = stack + 2 * nfa->nodes + 1;
+
+	dfa_classes(nfa, dfa, rep);
+	memset(seen, 0, 2 * b->words * sizeof(*seen));
+	nfa_closure(nfa, start, start_set, seen, stack);
+	if(dfa_state(b, start_set) < 0)
+		goto done;
+
+	/* the search isn't anchored: the start set is added after every
+	 * byte, as for a leading .* */
+	for(i=0;i<dfa->nstates;i++) {
+		uint16_t *row;
+		if(dfa->accept[i]) {
+			/* only whether there is a match is needed, stop at the
+			 * first one */
+			row = &dfa->trans[i * dfa->nclasses];
+			for(c=0;c<dfa->nclasses;c++)
+				row[c] = i;
+			continue;
+		}
+		nactive = 0;
+		for(w=0;w<b->words;w++) {
+			uint64_t bits = b->sets[i * b->words + w];
+			unsigned n = w * 64;
+			for(;bits;bits >>= 1, n++)
+				if(bits & 1)
+					active[nactive++] = n;
+		}
+		for(c=0;c<dfa->nclasses;c++) {
+			memcpy(next, start_set, b->words * sizeof(*next));
+			memset(seen, 0, b->words * sizeof(*seen));
+			for(w=0;w<nactive;w++) {
+				const struct nfa_node *n = &nfa->node[active[w]];
+				if(n->type == NFA_SET && BITMAP_HASSET(nfa->set[n->set], rep[c]))
+					nfa_closure(nfa, n->out1, next, seen, stack);
+			}
+			if((st = dfa_state(b, next)) < 0)
+				goto done;
+			/* dfa_state() may have moved the table */
+			dfa->trans[i * dfa->nclasses + c] = st;
+		}
+	}
+	ret = 0;
+done:
+	free(seen);
+	free(stack);
+	return ret;
+}
+
+struct cli_regex_dfa *cli_regex_dfa_compile(const char *pattern)
+{
+	struct cli_regex_dfa *dfa;
+	struct dfa_build b;
+	struct nfa *nfa;
+	struct frag f;
+	int accept;
+
+	nfa = cli_malloc(sizeof(*nfa));
+	if(!nfa) {
+		cli_errmsg(MODULE "Unable to allocate memory for NFA\n");
+		return NULL;
+	}
+	nfa->pat = pattern;
+	nfa->pos = 0;
+	nfa->nodes = 0;
+	nfa->sets = 0;
+	if(parse_alt(nfa, &f, 0) < 0 || pattern[nfa->pos] ||
+	   (accept = nfa_node(nfa, NFA_ACCEPT, 0, 0)) < 0) {
+		cli_dbgmsg(MODULE "Not compiling %s\n", pattern);
+		free(nfa);
+		return NULL;
+	}
+	nfa->node[f.end].out1 = accept;
+
+	dfa = cli_calloc(1, sizeof(*dfa));
+	if(!dfa) {
+		cli_errmsg(MODULE "Unable to allocate memory for DFA\n");
+		free(nfa);
+		return NULL;
+	}
+	b.nfa = nfa;
+	b.words = (nfa->nodes + 63) / 64;
+	b.accept_node = accept;
+	b.sets = NULL;
+	b.hashes = NULL;
+	b.dfa = dfa;
+	if(dfa_build(&b, f.start) < 0) {
+		cli_dbgmsg(MODULE "Too many states for %s\n", pattern);
+		cli_regex_dfa_free(dfa);
+		dfa = NULL;
+	} else {
+		cli_dbgmsg(MODULE "%s: %u states, %u byte classes\n", pattern, dfa->nstates, dfa->nclasses);
+	}
+	free(b.sets);
+	free(b.hashes);
+	free(nfa);
+	return dfa;
+}
+
+/* same result as !cli_regexec(preg, string, 0, NULL, 0) */
+int cli_regex_dfa_match(const struct cli_regex_dfa *dfa, const char *string)
+{
+	const unsigned char *p = (const unsigned char*)string;
+	unsigned s = 0;
+
+	while(!dfa->accept[s]) {
+		if(!*p)
+			return 0;
+		s = dfa->trans[s * dfa->nclasses + dfa->classes[*p++]];
+	}
+	return 1;
+}
+
+void cli_regex_dfa_free(struct cli_regex_dfa *dfa)
+{
+	if(!dfa)
+		return;
+	free(dfa->accept);
+	free(dfa->trans);
+	free(dfa);
+}
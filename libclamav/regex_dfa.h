@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/* Deterministic automata for the regular expressions of the URL lists.
+ *
+ * The patterns there are mostly host names made of literals, '.', simple
+ * bracket expressions, groups of alternatives and the * + ? operators.
+ * These are compiled to a DFA over byte classes which answers, one table
+ * lookup per byte, whether cli_regexec(preg, string, 0, NULL, 0) would
+ * match. Anything else (anchors, bounds, character class names, non-ASCII
+ * bytes, ...) is left to cli_regexec(): cli_regex_dfa_compile() returns
+ * NULL for it. */
+
+#ifndef REGEX_DFA_H
+#define REGEX_DFA_H
+
+struct cli_regex_dfa;
+
+struct cli_regex_dfa *cli_regex_dfa_compile(const char *pattern);
+int cli_regex_dfa_match(const struct cli_regex_dfa *dfa, const char *string);
+void cli_regex_dfa_free(struct cli_regex_dfa *dfa);
+
+#endif
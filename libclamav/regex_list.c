@@ -52,6 +52,7 @@
 #include "readdb.h"
 #include "jsparse/textbuf.h"
 #include "regex_suffix.h"
+#include "regex_dfa.h"
 #include "default.h"
 #include "hashtab.h"
 
@@ -67,6 +68,10 @@ static int add_static_pattern(struct regex_matcher *matcher, char* pattern);
 #define MATCH_SUCCESS 0
 #define MATCH_FAILED  -1
 
+/* lookup buffers up to this size live on the stack; hrefs are truncated by
+ * htmlnorm, so this covers the real+displayed pair in practice */
+#define REGEX_LIST_STACKBUF 2048
+
 /*
  * Call this function when an unrecoverable error has occurred, (instead of exit).
  */
@@ -173,16 +178,26 @@ int regex_list_match(struct regex_matcher* matcher,char* real_url,const char* di
 		return 0;
 	}
 	{
-		char *buffer = cli_malloc(buffer_len+1);
-		char *bufrev;
+		char stackbuf[2][REGEX_LIST_STACKBUF];
+		char *buffer, *bufrev;
+		size_t i;
 		int rc = 0, root;
 		struct cli_ac_data mdata;
 		struct cli_ac_result *res = NULL;
 
-		if(!buffer) {
-            cli_errmsg("regex_list_match: Unable to allocate memory for buffer\n");
-			return CL_EMEM;
-        }
+		if(buffer_len < REGEX_LIST_STACKBUF) {
+			buffer = stackbuf[0];
+			bufrev = stackbuf[1];
+		} else {
+			buffer = cli_malloc(buffer_len+1);
+			bufrev = cli_malloc(buffer_len+1);
+			if(!buffer || !bufrev) {
+				cli_errmsg("regex_list_match: Unable to allocate memory for buffer\n");
+				free(buffer);
+				free(bufrev);
+				return CL_EMEM;
+			}
+		}
 
 		strncpy(buffer,real_url,real_len);
 		buffer[real_len]= (!is_whitelist && hostOnly) ? '/' : ':';
@@ -193,24 +208,31 @@ int regex_list_match(struct regex_matcher* matcher,char* real_url,const char* di
 		buffer[buffer_len]=0;
 		cli_dbgmsg("Looking up in regex_list: %s\n", buffer);
 
-		if((rc = cli_ac_initdata(&mdata, 0, 0, 0, CLI_DEFAULT_AC_TRACKLEN)))
-			return rc;
-
-		bufrev = cli_strdup(buffer);
-		if(!bufrev)
-			return CL_EMEM;
-		reverse_string(bufrev);
-		rc = filter_search(&matcher->filter, (const unsigned char*)bufrev, buffer_len) != -1;
-		if(rc == -1) {
-			free(buffer);
-			free(bufrev);
+		for(i=0;i<buffer_len;i++)
+			bufrev[i] = buffer[buffer_len-i-1];
+		bufrev[buffer_len] = '\0';
+		if(!matcher->filter_incomplete && !matcher->root_regex_idx &&
+		   filter_search(&matcher->filter, (const unsigned char*)bufrev, buffer_len) == -1) {
 			/* filter says this suffix doesn't match.
 			 * The filter has false positives, but no false
 			 * negatives */
+			if(buffer != stackbuf[0]) {
+				free(buffer);
+				free(bufrev);
+			}
 			return 0;
 		}
+
+		if((rc = cli_ac_initdata(&mdata, 0, 0, 0, CLI_DEFAULT_AC_TRACKLEN))) {
+			if(buffer != stackbuf[0]) {
+				free(buffer);
+				free(bufrev);
+			}
+			return rc;
+		}
 		rc = cli_ac_scanbuff((const unsigned char*)bufrev,buffer_len, NULL, (void*)&regex, &res, &matcher->suffixes,&mdata,0,0,NULL,AC_SCAN_VIR,NULL);
-		free(bufrev);
+		if(bufrev != stackbuf[1])
+			free(bufrev);
 		cli_ac_freedata(&mdata);
 
 		rc = 0;
@@ -229,6 +251,8 @@ int regex_list_match(struct regex_matcher* matcher,char* real_url,const char* di
 				if (!regex->preg) {
 					/* we matched a static pattern */
 					rc = validate_subdomain(regex, pre_fixup, buffer, buffer_len, real_url, real_len, orig_real_url);
+				} else if (regex->dfa) {
+					rc = cli_regex_dfa_match(regex->dfa, buffer);
 				} else {
 					rc = !cli_regexec(regex->preg, buffer, 0, NULL, 0);
 				}
@@ -241,7 +265,8 @@ int regex_list_match(struct regex_matcher* matcher,char* real_url,const char* di
 			    free(q);
 			}
 		}
-		free(buffer);
+		if(buffer != stackbuf[0])
+			free(buffer);
 		if(!rc)
 			cli_dbgmsg("Lookup result: not in regex list\n");
 		else
@@ -332,6 +357,122 @@ static int functionality_level_check(char* line)
 	}
 }
 
+/* deltas in a run before the next full prefix, bounds the walk of a lookup */
+#define HASH_PFX_RUN 100
+
+static uint32_t hash_pfx(const unsigned char *sha256)
+{
+	return ((uint32_t)sha256[0] << 24) | ((uint32_t)sha256[1] << 16) | ((uint32_t)sha256[2] << 8) | sha256[3];
+}
+
+static void hash_pfx_clear(struct hash_prefix_set *set)
+{
+	free(set->index);
+	free(set->runs);
+	free(set->deltas);
+	set->index = set->runs = NULL;
+	set->deltas = NULL;
+	set->nindex = set->ndeltas = 0;
+}
+
+static int hash_pfx_add(struct hash_prefix_set *set, const unsigned char *sha256)
+{
+	if(set->index) {
+		/* too late to rebuild it, lookups go to the matcher */
+		hash_pfx_clear(set);
+		set->stale = 1;
+	}
+	if(set->stale)
+		return CL_SUCCESS;
+	if(set->count == set->size) {
+		size_t size = set->size ? set->size * 2 : 1024;
+		uint32_t *prefixes = cli_realloc(set->prefixes, size * sizeof(*prefixes));
+
+		if(!prefixes)
+			return CL_EMEM;
+		set->prefixes = prefixes;
+		set->size = size;
+	}
+	set->prefixes[set->count++] = hash_pfx(sha256);
+	return CL_SUCCESS;
+}
+
+static int hash_pfx_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int hash_pfx_build(struct hash_prefix_set *set)
+{
+	size_t i, run = 0;
+	uint32_t last = 0;
+
+	if(set->stale || !set->count) {
+		free(set->prefixes);
+		set->prefixes = NULL;
+		set->count = set->size = 0;
+		return CL_SUCCESS;
+	}
+	qsort(set->prefixes, set->count, sizeof(*set->prefixes), hash_pfx_cmp);
+	set->index = cli_malloc(set->count * sizeof(*set->index));
+	set->runs = cli_malloc(set->count * sizeof(*set->runs));
+	set->deltas = cli_malloc(set->count * sizeof(*set->deltas));
+	if(!set->index || !set->runs || !set->deltas) {
+		hash_pfx_clear(set);
+		return CL_EMEM;
+	}
+	for(i = 0; i < set->count; i++) {
+		uint32_t pfx = set->prefixes[i];
+
+		if(i && pfx == last)
+			continue;
+		if(!set->nindex || pfx - last > 0xffff || run == HASH_PFX_RUN) {
+			set->index[set->nindex] = pfx;
+			set->runs[set->nindex++] = set->ndeltas;
+			run = 0;
+		} else {
+			set->deltas[set->ndeltas++] = pfx - last;
+			run++;
+		}
+		last = pfx;
+	}
+	cli_dbgmsg("hash_pfx_build: %lu prefixes in %lu runs\n", (unsigned long)set->count, (unsigned long)set->nindex);
+	free(set->prefixes);
+	set->prefixes = NULL;
+	set->count = set->size = 0;
+	return CL_SUCCESS;
+}
+
+/* 0 when no full hash loaded starts as @sha256 */
+int regex_list_hash_maybe(const struct regex_matcher *matcher, const unsigned char *sha256)
+{
+	const struct hash_prefix_set *set = &matcher->hash_pfx;
+	uint32_t pfx = hash_pfx(sha256), v;
+	size_t lo = 0, hi, i, end;
+
+	if(!set->index)
+		return 1;
+	/* last run starting at or below the prefix */
+	hi = set->nindex;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if(set->index[mid] <= pfx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(!lo)
+		return 0;
+	v = set->index[--lo];
+	end = lo + 1 < set->nindex ? set->runs[lo + 1] : set->ndeltas;
+	for(i = set->runs[lo]; v < pfx && i < end; i++)
+		v += set->deltas[i];
+	return v == pfx;
+}
+
 static int add_hash(struct regex_matcher *matcher, char* pattern, const char fl, int is_prefix)
 {
 	int rc;
@@ -376,6 +517,8 @@ static int add_hash(struct regex_matcher *matcher, char* pattern, const char fl,
 	}
 	*pat->virname = fl;
 	cli_hashset_addkey(&matcher->sha256_pfx_set, cli_readint32(pat->pattern));
+	if(!is_prefix && (rc = hash_pfx_add(&matcher->hash_pfx, pat->pattern)))
+		return rc;
 	if((rc = cli_bm_addpatt(bm, pat, "*"))) {
 		cli_errmsg("add_hash: failed to add BM pattern\n");
 		free(pat->pattern);
@@ -522,6 +665,8 @@ int cli_build_regex_list(struct regex_matcher* matcher)
 		return rc;
 	matcher->list_built=1;
 	cli_hashset_destroy(&matcher->sha256_pfx_set);
+	if(( rc = hash_pfx_build(&matcher->hash_pfx) ))
+		return rc;
 
 	return CL_SUCCESS;
 }
@@ -552,12 +697,17 @@ void regex_list_done(struct regex_matcher* matcher)
 				regex_t *r = matcher->all_pregs[i];
 				cli_regfree(r);
 				mpool_free(matcher->mempool, r);
+				cli_regex_dfa_free(matcher->all_dfas[i]);
 			}
 			mpool_free(matcher->mempool, matcher->all_pregs);
+			mpool_free(matcher->mempool, matcher->all_dfas);
 		}
 		cli_hashtab_free(&matcher->suffix_hash);
 		cli_bm_free(&matcher->sha256_hashes);
 		cli_bm_free(&matcher->hostkey_prefix);
+		hash_pfx_clear(&matcher->hash_pfx);
+		free(matcher->hash_pfx.prefixes);
+		matcher->hash_pfx.prefixes = NULL;
 	}
 }
 
@@ -608,7 +758,8 @@ static int add_newsuffix(struct regex_matcher *matcher, struct regex_list *info,
 		mpool_free(matcher->mempool, new);
 		return ret;
 	}
-	filter_add_static(&matcher->filter, (const unsigned char*)suffix, len, "regex");
+	if(filter_add_static(&matcher->filter, (const unsigned char*)suffix, len, "regex") == -1)
+		matcher->filter_incomplete = 1;
 	return CL_SUCCESS;
 }
 
@@ -640,6 +791,8 @@ static int add_pattern_suffix(void *cbdata, const char *suffix, size_t suffix_le
     }
 	regex->pattern = iregex->pattern ? cli_strdup(iregex->pattern) : NULL;
 	regex->preg = iregex->preg;
+	/* regexes are added right after new_preg() */
+	regex->dfa = regex->preg ? matcher->all_dfas[matcher->regex_cnt-1] : NULL;
 	regex->nxt = NULL;
 	el = cli_hashtab_find(&matcher->suffix_hash, suffix, suffix_len);
 	/* TODO: what if suffixes are prefixes of eachother and only one will
@@ -684,10 +837,12 @@ static regex_t *new_preg(struct regex_matcher *matcher)
 {
 	regex_t *r;
 	matcher->all_pregs = mpool_realloc(matcher->mempool, matcher->all_pregs, ++matcher->regex_cnt * sizeof(*matcher->all_pregs));
-	if(!matcher->all_pregs) {
+	matcher->all_dfas = mpool_realloc(matcher->mempool, matcher->all_dfas, matcher->regex_cnt * sizeof(*matcher->all_dfas));
+	if(!matcher->all_pregs || !matcher->all_dfas) {
         cli_errmsg("new_preg: Unable to reallocate memory\n");
 		return NULL;
     }
+	matcher->all_dfas[matcher->regex_cnt-1] = NULL;
 	r = mpool_malloc(matcher->mempool, sizeof(*r));
 	if(!r) {
         cli_errmsg("new_preg: Unable to allocate memory\n");
@@ -707,6 +862,7 @@ static int add_static_pattern(struct regex_matcher *matcher, char* pattern)
 	regex.nxt = NULL;
 	regex.pattern = cli_strdup(pattern);
 	regex.preg = NULL;
+	regex.dfa = NULL;
 	rc = add_pattern_suffix(matcher, pattern, len, &regex);
 	free(regex.pattern);
 	return rc;
@@ -738,9 +894,14 @@ int regex_list_add_pattern(struct regex_matcher *matcher, char *pattern)
 	if(!preg)
 		return CL_EMEM;
 
+	/* the common shapes are matched without regexec() */
+	matcher->all_dfas[matcher->regex_cnt-1] = cli_regex_dfa_compile(pattern);
+
 	rc = cli_regex2suffix(pattern, preg, add_pattern_suffix, (void*)matcher);
 	if(rc) {
 		cli_regfree(preg);
+		cli_regex_dfa_free(matcher->all_dfas[matcher->regex_cnt-1]);
+		matcher->all_dfas[matcher->regex_cnt-1] = NULL;
 	}
 
 	return rc;
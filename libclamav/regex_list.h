@@ -39,6 +39,19 @@ struct regex_list_ht {
 	struct regex_list *tail;
 };
 
+/* The first 4 bytes of the full URL hashes, sorted and stored as the
+ * differences between neighbours (as Chromium's PrefixSet): a lookup which
+ * misses here skips the Boyer-Moore scan. */
+struct hash_prefix_set {
+	uint32_t *prefixes; /* collected while loading */
+	size_t count, size;
+	uint32_t *index; /* first prefix of each run */
+	uint32_t *runs; /* where the deltas of each run start */
+	uint16_t *deltas;
+	size_t nindex, ndeltas;
+	int stale; /* hashes added after the set was built */
+};
+
 struct regex_matcher {
 	struct cli_hashtable suffix_hash;
 	size_t suffix_cnt;
@@ -46,10 +59,12 @@ struct regex_matcher {
 	size_t root_regex_idx;
 	size_t regex_cnt;
 	regex_t **all_pregs;
+	struct cli_regex_dfa **all_dfas; /* same index as all_pregs, NULL if regexec() is needed */
 	struct cli_matcher suffixes;
 	struct cli_matcher sha256_hashes;
 	struct cli_hashset sha256_pfx_set;
 	struct cli_matcher hostkey_prefix;
+	struct hash_prefix_set hash_pfx;
 	struct filter filter;
 #ifdef USE_MPOOL
 	mpool_t *mempool;
@@ -57,6 +72,7 @@ struct regex_matcher {
 	int list_inited:2;
 	int list_loaded:2;
 	int list_built:2;
+	unsigned filter_incomplete:1; /* some suffix is too short for the filter */
 };
 
 int cli_build_regex_list(struct regex_matcher* matcher);
@@ -67,6 +83,7 @@ int load_regex_matcher(struct cl_engine *engine,struct regex_matcher* matcher,FI
 void regex_list_cleanup(struct regex_matcher* matcher);
 void regex_list_done(struct regex_matcher* matcher);
 int is_regex_ok(struct regex_matcher* matcher);
+int regex_list_hash_maybe(const struct regex_matcher *matcher, const unsigned char *sha256);
 
 #endif
 
@@ -34,11 +34,19 @@
 #include <pcre.h>
 #endif
 
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
 #include "clamav.h"
 #include "cltypes.h"
 #include "others.h"
 #include "regex_pcre.h"
 
+#if USING_PCRE2 || defined(PCRE_STUDY_JIT_COMPILE)
+#define CLI_PCRE_JIT 1
+#endif
+
 #if USING_PCRE2
 /* NOTE: pcre2 could use mpool through ext */
 void *cli_pcre_malloc(size_t size, void *ext)
@@ -67,6 +75,120 @@ int cli_pcre_init_internal()
     return CL_SUCCESS;
 }
 
+#ifdef CLI_PCRE_JIT
+/* Per-thread state reused by every match: the JIT stack and, for PCRE2,
+ * the match data. The compiled regexes are shared between the threads,
+ * their JIT stack callback looks up the stack of the calling thread. */
+#define PCRE_JIT_STACK_START (32*1024)
+#define PCRE_JIT_STACK_MAX   (1024*1024)
+
+struct cli_pcre_tls {
+#if USING_PCRE2
+    pcre2_jit_stack *jit_stack;
+    pcre2_match_data *match_data; /* NULL while lent out */
+#else
+    pcre_jit_stack *jit_stack;
+#endif
+    int jit_stack_failed;
+};
+
+static void pcre_tls_destroy(void *ptr)
+{
+    struct cli_pcre_tls *tls = ptr;
+
+    if (!tls)
+        return;
+#if USING_PCRE2
+    if (tls->jit_stack)
+        pcre2_jit_stack_free(tls->jit_stack);
+    if (tls->match_data)
+        pcre2_match_data_free(tls->match_data);
+#else
+    if (tls->jit_stack)
+        pcre_jit_stack_free(tls->jit_stack);
+#endif
+    free(tls);
+}
+
+#ifdef CL_THREAD_SAFE
+static pthread_key_t pcre_tls_key;
+static pthread_once_t pcre_tls_key_once = PTHREAD_ONCE_INIT;
+
+/* the destructor doesn't run for the main thread */
+static void pcre_tls_cleanup_main(void)
+{
+    pcre_tls_destroy(pthread_getspecific(pcre_tls_key));
+    pthread_setspecific(pcre_tls_key, NULL);
+}
+
+static void pcre_tls_key_alloc(void)
+{
+    pthread_key_create(&pcre_tls_key, pcre_tls_destroy);
+    if (atexit(pcre_tls_cleanup_main))
+        cli_dbgmsg("pcre_tls: failed to register atexit\n");
+}
+
+static struct cli_pcre_tls *pcre_tls_get(void)
+{
+    struct cli_pcre_tls *tls;
+
+    pthread_once(&pcre_tls_key_once, pcre_tls_key_alloc);
+    if (!(tls = pthread_getspecific(pcre_tls_key))) {
+        if (!(tls = cli_calloc(1, sizeof(*tls))))
+            return NULL;
+        if (pthread_setspecific(pcre_tls_key, tls)) {
+            free(tls);
+            return NULL;
+        }
+    }
+    return tls;
+}
+#else
+static struct cli_pcre_tls *pcre_tls_global = NULL;
+
+static void pcre_tls_cleanup_main(void)
+{
+    pcre_tls_destroy(pcre_tls_global);
+    pcre_tls_global = NULL;
+}
+
+static struct cli_pcre_tls *pcre_tls_get(void)
+{
+    if (!pcre_tls_global) {
+        if (!(pcre_tls_global = cli_calloc(1, sizeof(*pcre_tls_global))))
+            return NULL;
+        if (atexit(pcre_tls_cleanup_main))
+            cli_dbgmsg("pcre_tls: failed to register atexit\n");
+    }
+    return pcre_tls_global;
+}
+#endif
+
+/* JIT stack callback; NULL makes the JIT use 32K of the machine stack */
+#if USING_PCRE2
+static pcre2_jit_stack *pcre_tls_jit_stack(void *data)
+#else
+static pcre_jit_stack *pcre_tls_jit_stack(void *data)
+#endif
+{
+    struct cli_pcre_tls *tls = pcre_tls_get();
+
+    UNUSEDPARAM(data);
+    if (!tls)
+        return NULL;
+    if (!tls->jit_stack && !tls->jit_stack_failed) {
+#if USING_PCRE2
+        tls->jit_stack = pcre2_jit_stack_create(PCRE_JIT_STACK_START, PCRE_JIT_STACK_MAX, NULL);
+#else
+        tls->jit_stack = pcre_jit_stack_alloc(PCRE_JIT_STACK_START, PCRE_JIT_STACK_MAX);
+#endif
+        if (!tls->jit_stack)
+            tls->jit_stack_failed = 1;
+    }
+    return tls->jit_stack;
+}
+#endif
+
 int cli_pcre_addoptions(struct cli_pcre_data *pd, const char **opt, int errout)
 {
     if (!pd || !opt || !(*opt))
@@ -148,6 +270,11 @@ int cli_pcre_compile(struct cli_pcre_data *pd, long long unsigned match_limit, l
         return CL_EMALFDB;
     }
 
+    /* pcre2_match() uses the interpreter if this fails */
+    if ((errornum = pcre2_jit_compile(pd->re, PCRE2_JIT_COMPLETE)))
+        cli_dbgmsg("cli_pcre_compile: no JIT code for /%s/: %d\n", pd->expression, errornum);
+    (void)pcre2_pattern_info(pd->re, PCRE2_INFO_CAPTURECOUNT, &pd->capturecount);
+
     /* setup matching context and set the match limits */
     pd->mctx = pcre2_match_context_create(gctx);
     if (!pd->mctx) {
@@ -159,6 +286,7 @@ int cli_pcre_compile(struct cli_pcre_data *pd, long long unsigned match_limit, l
 
     pcre2_set_match_limit(pd->mctx, match_limit);
     pcre2_set_recursion_limit(pd->mctx, match_limit_recursion);
+    pcre2_jit_stack_assign(pd->mctx, pcre_tls_jit_stack, NULL);
 
     /* non-dynamic allocated fields set by caller */
     pcre2_compile_context_free(cctx);
@@ -187,7 +315,13 @@ int cli_pcre_compile(struct cli_pcre_data *pd, long long unsigned match_limit, l
     }
 
     /* now study it... (section totally not from snort) */
+#ifdef CLI_PCRE_JIT
+    pd->ex = pcre_study(pd->re, PCRE_STUDY_JIT_COMPILE, &error);
+    if (pd->ex)
+        pcre_assign_jit_stack(pd->ex, pcre_tls_jit_stack, NULL);
+#else
     pd->ex = pcre_study(pd->re, 0, &error);
+#endif
     if (!(pd->ex)) {
         pd->ex = (pcre_extra *)cli_calloc(1, sizeof(*(pd->ex)));
         if (!(pd->ex)) {
@@ -237,6 +371,11 @@ int cli_pcre_match(struct cli_pcre_data *pd, const unsigned char *buffer, uint32
     /* execute the pcre and return */
 #if USING_PCRE2
     rc = pcre2_match(pd->re, buffer, buflen, startoffset, options, results->match_data, pd->mctx);
+    if (rc == PCRE2_ERROR_JIT_STACKLIMIT) {
+        /* the interpreter only has the recursion limit */
+        cli_dbgmsg("cli_pcre_match: JIT stack limit exceeded, retrying without JIT\n");
+        rc = pcre2_match(pd->re, buffer, buflen, startoffset, options | PCRE2_NO_JIT, results->match_data, pd->mctx);
+    }
     if (rc < 0 && rc != PCRE2_ERROR_NOMATCH) {
         switch (rc) {
         case PCRE2_ERROR_CALLOUT:
@@ -265,6 +404,16 @@ int cli_pcre_match(struct cli_pcre_data *pd, const unsigned char *buffer, uint32
     }
 #else
     rc = pcre_exec(pd->re, pd->ex, buffer, buflen, startoffset, options, results->ovector, OVECCOUNT);
+#ifdef CLI_PCRE_JIT
+    if (rc == PCRE_ERROR_JIT_STACKLIMIT) {
+        /* the interpreter only has the recursion limit */
+        pcre_extra ex = *pd->ex;
+
+        cli_dbgmsg("cli_pcre_match: JIT stack limit exceeded, retrying without JIT\n");
+        ex.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+        rc = pcre_exec(pd->re, &ex, buffer, buflen, startoffset, options, results->ovector, OVECCOUNT);
+    }
+#endif
     if (rc < 0 && rc != PCRE_ERROR_NOMATCH) {
         switch (rc) {
         case PCRE_ERROR_CALLOUT:
@@ -425,12 +574,24 @@ int cli_pcre_results_reset(struct cli_pcre_results *results, const struct cli_pc
     results->err = CL_SUCCESS;
     results->match[0] = results->match[1] = 0;
 #if USING_PCRE2
-    if (results->match_data)
-        pcre2_match_data_free(results->match_data);
+    /* match data is only set up when none large enough is at hand */
+    if (!results->match_data) {
+        struct cli_pcre_tls *tls = pcre_tls_get();
 
-    results->match_data = pcre2_match_data_create_from_pattern(pd->re, NULL);
-    if (!results->match_data)
-        return CL_EMEM;
+        if (tls) {
+            results->match_data = tls->match_data;
+            tls->match_data = NULL;
+        }
+    }
+    if (results->match_data && pcre2_get_ovector_count(results->match_data) <= pd->capturecount) {
+        pcre2_match_data_free(results->match_data);
+        results->match_data = NULL;
+    }
+    if (!results->match_data) {
+        results->match_data = pcre2_match_data_create(pd->capturecount + 1, NULL);
+        if (!results->match_data)
+            return CL_EMEM;
+    }
 #else
     memset(results->ovector, 0, OVECCOUNT);
 #endif
@@ -440,11 +601,49 @@ int cli_pcre_results_reset(struct cli_pcre_results *results, const struct cli_pc
 void cli_pcre_results_free(struct cli_pcre_results *results)
 {
 #if USING_PCRE2
-    if (results->match_data)
-        pcre2_match_data_free(results->match_data);
+    if (results->match_data) {
+        struct cli_pcre_tls *tls = pcre_tls_get();
+
+        /* kept for the next scan on this thread */
+        if (tls && !tls->match_data)
+            tls->match_data = results->match_data;
+        else
+            pcre2_match_data_free(results->match_data);
+        results->match_data = NULL;
+    }
 #endif
 }
 
+/* compiled pattern, study data and JIT code of a regex */
+size_t cli_pcre_memsize(const struct cli_pcre_data *pd)
+{
+    size_t total = 0;
+#if USING_PCRE2
+    size_t size;
+
+    if (!pd->re)
+        return 0;
+    if (!pcre2_pattern_info(pd->re, PCRE2_INFO_SIZE, &size))
+        total += size;
+    if (!pcre2_pattern_info(pd->re, PCRE2_INFO_JITSIZE, &size))
+        total += size;
+#else
+    size_t size;
+
+    if (!pd->re)
+        return 0;
+    if (!pcre_fullinfo(pd->re, pd->ex, PCRE_INFO_SIZE, &size))
+        total += size;
+    if (pd->ex && !pcre_fullinfo(pd->re, pd->ex, PCRE_INFO_STUDYSIZE, &size))
+        total += size;
+#ifdef PCRE_INFO_JITSIZE
+    if (pd->ex && !pcre_fullinfo(pd->re, pd->ex, PCRE_INFO_JITSIZE, &size))
+        total += size;
+#endif
+#endif
+    return total;
+}
+
 void cli_pcre_free_single(struct cli_pcre_data *pd)
 {
 #if USING_PCRE2
@@ -463,7 +662,12 @@ void cli_pcre_free_single(struct cli_pcre_data *pd)
         pd->re = NULL;
     }
     if (pd->ex) {
+#ifdef CLI_PCRE_JIT
+        /* releases the JIT code too */
+        pcre_free_study(pd->ex);
+#else
         free(pd->ex);
+#endif
         pd->ex = NULL;
     }
 #endif
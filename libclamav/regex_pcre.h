@@ -52,13 +52,14 @@ struct cli_pcre_data {
     int options;                  /* pcre options */
     char *expression;             /* copied regular expression */
     uint32_t search_offset;       /* start offset to search at for pcre_exec */
+    uint32_t capturecount;        /* match data needs one more pair */
 };
 
 struct cli_pcre_results {
     int err;
     uint32_t match[2]; /* populated by cli_pcre_match to be start (0) and end (1) offset of match */
 
-    pcre2_match_data *match_data;
+    pcre2_match_data *match_data; /* taken from and given back to the thread's pool */
 };
 #else
 struct cli_pcre_data {
@@ -86,5 +87,6 @@ void cli_pcre_report(const struct cli_pcre_data *pd, const unsigned char *buffer
 int cli_pcre_results_reset(struct cli_pcre_results *results, const struct cli_pcre_data *pd);
 void cli_pcre_results_free(struct cli_pcre_results *results);
 void cli_pcre_free_single(struct cli_pcre_data *pd);
+size_t cli_pcre_memsize(const struct cli_pcre_data *pd);
 #endif /* HAVE_PCRE */
 #endif /*_REGEX_PCRE_H_*/
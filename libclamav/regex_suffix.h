@@ -24,9 +24,12 @@
 #define REGEX_SUFFIX_H
 #include "regex/regex.h"
 
+struct cli_regex_dfa;
+
 struct regex_list {
 	char *pattern;
 	regex_t *preg;
+	const struct cli_regex_dfa *dfa;
 	struct regex_list *nxt;
 };
 typedef int (*suffix_callback)(void *cbdata, const char *suffix, size_t len, const struct regex_list *regex);
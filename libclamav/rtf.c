@@ -96,8 +96,8 @@ static const unsigned char rtf_data_magic[] = {0x01, 0x05, 0x00, 0x00, 0x02, 0x0
 static const size_t rtf_data_magic_len  = sizeof(rtf_data_magic);
 
 struct rtf_object_data {
-	char* name;
-	int  fd;
+	struct cli_extract x;/* the object being dumped, in memory unless it's too big */
+	int  dumping;
 	int partial;
 	int has_partial;
 	enum rtf_objdata_state internal_state;
@@ -129,6 +129,26 @@ static const short int hextable[256] = {
        0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0
 };
 
+/* hextable, with 0x10 for the characters which are not hex digits */
+static const unsigned char hexval[256] = {
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 
+       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+};
+
 static void init_rtf_state(struct rtf_state* state)
 {
 	*state = base_state;
@@ -219,14 +239,13 @@ static int rtf_object_begin(struct rtf_state* state,cli_ctx* ctx,const char* tmp
         cli_errmsg("rtf_object_begin: Unable to allocate memory for object data\n");
 		return CL_EMEM;
     }
-	data->fd = -1;
+	data->dumping = 0;
 	data->partial = 0;
 	data->has_partial = 0;
 	data->bread = 0;
 	data->internal_state = WAIT_MAGIC;
 	data->tmpdir = tmpdir;
 	data->ctx    = ctx;
-	data->name   = NULL;
 	data->desc_name = NULL;
 
 	state->cb_data = data;
@@ -236,24 +255,22 @@ static int rtf_object_begin(struct rtf_state* state,cli_ctx* ctx,const char* tmp
 
 static int decode_and_scan(struct rtf_object_data* data, cli_ctx* ctx)
 {
-	int ret=CL_CLEAN;
+	int ret=CL_CLEAN, rc, fd;
 
-	cli_dbgmsg("RTF:Scanning embedded object:%s\n",data->name);
-	if(data->bread == 1 && data->fd > 0) {
+	cli_dbgmsg("RTF:Scanning embedded object (%lu bytes)\n", (unsigned long int) data->x.len);
+	if(data->bread == 1) {
 		cli_dbgmsg("Decoding ole object\n");
-		ret = cli_scan_ole10(data->fd, ctx);
-	}
-	else if(data->fd > 0)
-		ret = cli_magic_scandesc(data->fd,ctx);
-	if(data->fd > 0)
-	close(data->fd);
-	data->fd = -1;
-	if(data->name) {
-		if(!ctx->engine->keeptmp)
-			if(cli_unlink(data->name)) ret = CL_EUNLINK;
-		free(data->name);
-		data->name = NULL;
+		if(data->x.fd == -1)
+			ret = cli_scan_ole10_mem(data->x.buf, data->x.len, ctx);
+		else if((ret = cli_extract_fd(&data->x, &fd)) == CL_SUCCESS)
+			ret = cli_scan_ole10(fd, ctx);
 	}
+	else
+		ret = cli_extract_scan(&data->x);
+	rc = cli_extract_done(&data->x);
+	data->dumping = 0;
+	if(ret == CL_CLEAN && rc)
+		ret = rc;
 
 	if(ret != CL_CLEAN)
 		return ret;
@@ -286,6 +303,13 @@ static int rtf_object_process(struct rtf_state* state, const unsigned char* inpu
 		i = 0;
 
 	for(;i<len;i++) {
+		/* the digits usually come in long runs between the line breaks */
+		while(i + 1 < len && !((hexval[input[i]] | hexval[input[i + 1]]) & 0x10)) {
+			outdata[out_cnt++] = (hexval[input[i]] << 4) | hexval[input[i + 1]];
+			i += 2;
+		}
+		if(i == len)
+			break;
 		if(isxdigit(input[i])) {
 				const unsigned char byte = hextable[ input[i++] ] << 4;
 				while(i<len && !isxdigit(input[i]))
@@ -396,8 +420,8 @@ static int rtf_object_process(struct rtf_state* state, const unsigned char* inpu
 							    out_data += i;
 							    data->bread=0;
 							    cli_dbgmsg("Dumping rtf embedded object of size:%lu\n", (unsigned long int) data->desc_len);
-							    if((ret = cli_gentempfd(data->tmpdir, &data->name, &data->fd)))
-								    return ret;
+							    cli_extract_init(&data->x, data->ctx, NULL);
+							    data->dumping = 1;
 							    data->internal_state = DUMP_DATA;
 	    						    cli_dbgmsg("RTF: next state: DUMP_DATA\n");
 						    }
@@ -412,17 +436,16 @@ static int rtf_object_process(struct rtf_state* state, const unsigned char* inpu
 							    char out[4];
 							    data->bread = 1;/* flag to indicate this needs to be scanned with cli_decode_ole_object*/
 							    cli_writeint32(out,data->desc_len);
-							    if(cli_writen(data->fd,out,4)!=4)
-								    return CL_EWRITE; 
+							    if((ret = cli_extract_write(&data->x,out,4)))
+								    return ret;
 							}
 							else
 								data->bread = 2;
 						}
 
 						data->desc_len -= out_want;
-						if(cli_writen(data->fd,out_data,out_want) != out_want) {
-							return CL_EWRITE;
-						}
+						if((ret = cli_extract_write(&data->x,out_data,out_want)))
+							return ret;
 						out_data += out_want;
 						out_cnt  -= out_want;
 						if(!data->desc_len) { 
@@ -451,11 +474,9 @@ static int rtf_object_end(struct rtf_state* state,cli_ctx* ctx)
 	int rc = 0;
 	if(!data)
 		return 0;
-	if(data->fd > 0) { 
+	if(data->dumping) {
 		rc = decode_and_scan(data, ctx);
 	}
-	if(data->name)
-		free(data->name);
 	if(data->desc_name)
 		free(data->desc_name);
 	free(data);
@@ -497,14 +518,10 @@ static void cleanup_stack(struct stack* stack,struct rtf_state* state,cli_ctx* c
 		state.cb_end(&state,ctx);\
 	tableDestroy(actiontable);\
 	cleanup_stack(&stack,&state,ctx);\
-        if(!ctx->engine->keeptmp)\
-		cli_rmdirs(tempname);\
-	free(tempname);\
 	free(stack.states);
 
 int cli_scanrtf(cli_ctx *ctx)
 {
-	char* tempname;
 	const unsigned char* ptr;
 	const unsigned char* ptr_end;
 	int ret = CL_CLEAN;
@@ -533,23 +550,10 @@ int cli_scanrtf(cli_ctx *ctx)
 		return CL_EMEM;
     }
 
-	if(!(tempname = cli_gentemp(ctx->engine->tmpdir)))
-	    return CL_EMEM;
-
-	if(mkdir(tempname, 0700)) {
-	    	cli_dbgmsg("ScanRTF -> Can't create temporary directory %s\n", tempname);
-		free(stack.states);
-		free(tempname);
-		return CL_ETMPDIR;
-	}
-
 	actiontable = tableCreate();
 	if((ret = load_actions(actiontable))) {
 		cli_dbgmsg("RTF: Unable to load rtf action table\n");
 		free(stack.states);
-		if(!ctx->engine->keeptmp)
-			cli_rmdirs(tempname);
-		free(tempname);
 		tableDestroy(actiontable);
 		return ret;
 	}
@@ -597,7 +601,7 @@ int cli_scanrtf(cli_ctx *ctx)
 									}
 								if(state.cb_begin) {
 									if(!state.cb_data)
-										 if(( ret = state.cb_begin(&state, ctx,tempname) )) {
+										 if(( ret = state.cb_begin(&state, ctx,ctx->engine->tmpdir) )) {
 											 SCAN_CLEANUP;
 											 return ret;
 										}
@@ -43,6 +43,9 @@
 #ifdef HAVE_SYS_TIMES_H
 #include <sys/times.h>
 #endif
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #define DCONF_ARCH  ctx->dconf->archive
 #define DCONF_DOC   ctx->dconf->doc
@@ -80,6 +83,7 @@
 #include "textnorm.h"
 #include <zlib.h>
 #include "unzip.h"
+#include "inflate_buf.h"
 #include "dlp.h"
 #include "default.h"
 #include "cpio.h"
@@ -200,7 +204,7 @@ static int cli_scandir(const char *dirname, cli_ctx *ctx)
     return CL_CLEAN;
 }
 
-static int cli_unrar_scanmetadata(int desc, unrar_metadata_t *metadata, cli_ctx *ctx, unsigned int files, uint32_t* sfx_check)
+static int cli_unrar_scanmetadata(unrar_metadata_t *metadata, cli_ctx *ctx, unsigned int files, uint32_t* sfx_check)
 {
 	int ret = CL_SUCCESS;
         int virus_found = 0;
@@ -225,7 +229,7 @@ static int cli_unrar_scanmetadata(int desc, unrar_metadata_t *metadata, cli_ctx
 
     if(DETECT_ENCRYPTED && metadata->encrypted) {
 	cli_dbgmsg("RAR: Encrypted files found in archive.\n");
-	ret = cli_scandesc(desc, ctx, 0, 0, NULL, AC_SCAN_VIR, NULL);
+	ret = cli_fmap_scandesc(ctx, 0, 0, NULL, AC_SCAN_VIR, NULL, NULL);
 	if(ret != CL_VIRUS) {
 	    cli_append_virus(ctx, "Heuristics.Encrypted.RAR");
 	    return CL_VIRUS;
@@ -237,20 +241,113 @@ static int cli_unrar_scanmetadata(int desc, unrar_metadata_t *metadata, cli_ctx
     return ret;
 }
 
-static int cli_scanrar(int desc, cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_check)
+/* Starts the member cache digest of the file prepared by the unrar code
+ * with its packed data, see cli_member_cache_start() */
+static void *rar_member_digest(cli_ctx *ctx, fmap_t *map, const unrar_state_t *state)
+{
+	const unrar_fileheader_t *fh = state->file_header;
+	uint64_t params[7] = { fh->method, fh->unpack_ver, fh->flags, fh->pack_size, fh->unpack_size, fh->file_crc, state->maxfilesize };
+	size_t offset = fh->start_offset + fh->head_size;
+	uint32_t todo = fh->pack_size;
+	const void *data;
+	size_t bytes;
+	void *h;
+
+    if(!state->standalone || !(h = cli_member_cache_start(ctx, fh->pack_size, params, sizeof(params))))
+	return NULL;
+    while(todo) {
+	bytes = MIN(todo, FILEBUFF);
+	if(!(data = fmap_need_off_once(map, offset, bytes))) {
+	    cl_hash_destroy(h);
+	    return NULL;
+	}
+	cl_update_hash(h, (void *) data, bytes);
+	offset += bytes;
+	todo -= bytes;
+    }
+    return h;
+}
+
+static int rar_pread(void *handle, void *buf, unsigned int count, off_t offset)
+{
+    return fmap_readn((fmap_t *) handle, buf, offset, count);
+}
+
+/* Where the unrar code sends the files, see rar_write() */
+struct rar_output {
+    struct cli_extract *x;
+    int ret;
+};
+
+static int rar_write(void *handle, const void *buf, unsigned int size)
+{
+	struct rar_output *out = handle;
+
+    /* decoded again only to get to the file after it, see rar_reextract() */
+    if(!out->x)
+	return size;
+    if(out->ret == CL_SUCCESS)
+	out->ret = cli_extract_write(out->x, buf, size);
+    return out->ret == CL_SUCCESS ? (int) size : -1;
+}
+
+static void rar_free_metadata(unrar_metadata_t *metadata)
+{
+	unrar_metadata_t *next;
+
+    while(metadata) {
+	next = metadata->next;
+	free(metadata->filename);
+	free(metadata);
+	metadata = next;
+    }
+}
+
+/* Unpacks the file number n of the archive once more, when the scan asks
+ * for it with cli_extract_again(): in a solid archive the files before it
+ * have to be decoded again too, their data is dropped */
+static int rar_reextract(cli_ctx *ctx, off_t sfx_offset, unsigned long n, uint64_t maxfilesize, struct rar_output *out)
+{
+	struct rar_output skip = { NULL, CL_SUCCESS };
+	unrar_state_t rar_state;
+	int ret = CL_EUNPACK;
+
+    if(cli_unrar_open(rar_pread, *ctx->fmap, sfx_offset, NULL, &rar_state) != UNRAR_OK)
+	return CL_EUNPACK;
+    rar_state.maxfilesize = maxfilesize;
+    rar_state.write_cb = rar_write;
+    while(cli_unrar_extract_next_prepare(&rar_state, NULL) == UNRAR_OK) {
+	if(rar_state.file_count == n) {
+	    rar_state.write_handle = out;
+	    cli_unrar_extract_next(&rar_state);
+	    ret = CL_SUCCESS;
+	    break;
+	}
+	rar_state.write_handle = &skip;
+	rar_state.skip = 1;
+	if(cli_unrar_extract_next(&rar_state) != UNRAR_OK)
+	    break;
+    }
+    rar_free_metadata(rar_state.metadata);
+    cli_unrar_close(&rar_state);
+    return ret;
+}
+
+static int cli_scanrar(cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_check)
 {
 	int ret = CL_CLEAN;
-	unrar_metadata_t *metadata, *metadata_tmp;
 	char *dir;
 	unrar_state_t rar_state;
 	unsigned int viruses_found = 0;
+	struct cli_member_key key, *mkey, *saved_key;
+	struct cli_extract x;
+	struct rar_output out;
+	fmap_t *map = *ctx->fmap;
+	unsigned long n;
+	void *h;
 
     cli_dbgmsg("in scanrar()\n");
 
-    if(sfx_offset)
-	if(lseek(desc, sfx_offset, SEEK_SET) == -1)
-	    return CL_ESEEK;
-
     /* generate the temporary directory */
     if(!(dir = cli_gentemp(ctx->engine->tmpdir)))
 	return CL_EMEM;
@@ -261,18 +358,14 @@ static int cli_scanrar(int desc, cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_c
 	return CL_ETMPDIR;
     }
 
-    if((ret = cli_unrar_open(desc, dir, &rar_state)) != UNRAR_OK) {
+    if((ret = cli_unrar_open(rar_pread, map, sfx_offset, dir, &rar_state)) != UNRAR_OK) {
 	if(!ctx->engine->keeptmp)
 	    cli_rmdirs(dir);
 	free(dir);
 	if(ret == UNRAR_PASSWD) {
 	    cli_dbgmsg("RAR: Encrypted main header\n");
 	    if(DETECT_ENCRYPTED) {
-		if (lseek(desc, 0, SEEK_SET) == -1) {
-            cli_dbgmsg("RAR: call to lseek() failed\n");
-            return CL_ESEEK;
-        }
-		ret = cli_scandesc(desc, ctx, 0, 0, NULL, AC_SCAN_VIR, NULL);
+		ret = cli_fmap_scandesc(ctx, 0, 0, NULL, AC_SCAN_VIR, NULL, NULL);
 		if(ret != CL_VIRUS)
 		    cli_append_virus(ctx, "Heuristics.Encrypted.RAR");
 		return CL_VIRUS;
@@ -287,7 +380,6 @@ static int cli_scanrar(int desc, cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_c
 
     do {
 	int rc;
-	rar_state.ofd = -1;
 	ret = cli_unrar_extract_next_prepare(&rar_state,dir);
 	if(ret != UNRAR_OK) {
 	    if(ret == UNRAR_BREAK)
@@ -309,7 +401,26 @@ static int cli_scanrar(int desc, cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_c
 	else
 	    rar_state.maxfilesize = ctx->engine->maxfilesize;
 
-	ret = cli_unrar_extract_next(&rar_state,dir);
+	/* the same file was found clean before, see cli_member_cache_check() */
+	mkey = NULL;
+	if((h = rar_member_digest(ctx, map, &rar_state))) {
+	    if(cli_member_cache_check(h, ctx, &key) == CL_CLEAN)
+		rar_state.skip = 1;
+	    else
+		mkey = &key;
+	}
+
+	/* the file is scanned as it's unpacked when it's large enough */
+	cli_extract_init(&x, ctx, NULL);
+	if(!rar_state.maxfilesize || rar_state.metadata_tail->unpack_size <= rar_state.maxfilesize)
+	    cli_extract_expect(&x, rar_state.metadata_tail->unpack_size);
+	out.x = &x;
+	out.ret = CL_SUCCESS;
+	rar_state.write_cb = rar_write;
+	rar_state.write_handle = &out;
+	n = rar_state.file_count;
+
+	ret = cli_unrar_extract_next(&rar_state);
 	if(ret == UNRAR_OK)
 	    ret = CL_SUCCESS;
 	else if(ret == UNRAR_EMEM)
@@ -317,15 +428,22 @@ static int cli_scanrar(int desc, cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_c
 	else
 	    ret = CL_EFORMAT;
 
-	if(rar_state.ofd > 0) {
-	    if (lseek(rar_state.ofd,0,SEEK_SET) == -1) {
-            cli_dbgmsg("RAR: Call to lseek() failed\n");
-            ret = CL_ESEEK;
-        }
-	    rc = cli_magic_scandesc(rar_state.ofd,ctx);
-	    close(rar_state.ofd);
-	    if(!ctx->engine->keeptmp) 
-		if (cli_unlink(rar_state.filename)) ret = CL_EUNLINK;
+	if(rar_state.unpacked) {
+	    saved_key = ctx->member_key;
+	    ctx->member_key = mkey;
+	    for(;;) {
+		rc = out.ret;
+		if(rc == CL_SUCCESS)
+		    rc = cli_extract_scan(&x);
+		if(!cli_extract_again(&x))
+		    break;
+		out.ret = CL_SUCCESS;
+		if((rc = rar_reextract(ctx, sfx_offset, n, rar_state.maxfilesize, &out)) != CL_SUCCESS)
+		    break;
+	    }
+	    ctx->member_key = saved_key;
+	    if(cli_extract_done(&x) != CL_SUCCESS)
+		ret = CL_EUNLINK;
 	    if(rc == CL_VIRUS ) {
 		cli_dbgmsg("RAR: infected with %s\n", cli_get_last_virus(ctx));
 		ret = CL_VIRUS;
@@ -341,15 +459,13 @@ static int cli_scanrar(int desc, cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_c
 	}
 
 	if(ret == CL_SUCCESS)
-	    ret = cli_unrar_scanmetadata(desc,rar_state.metadata_tail, ctx, rar_state.file_count, sfx_check);
+	    ret = cli_unrar_scanmetadata(rar_state.metadata_tail, ctx, rar_state.file_count, sfx_check);
 
     } while(ret == CL_SUCCESS);
 
     if(ret == CL_BREAK)
 	ret = CL_CLEAN;
 
-    metadata = metadata_tmp = rar_state.metadata; 
-
     if(cli_scandir(rar_state.comment_dir, ctx) == CL_VIRUS)
 	ret = CL_VIRUS;
 
@@ -360,13 +476,7 @@ static int cli_scanrar(int desc, cli_ctx *ctx, off_t sfx_offset, uint32_t *sfx_c
 
     free(dir);
 
-    metadata = metadata_tmp;
-    while (metadata) {
-    	metadata_tmp = metadata->next;
-    	free(metadata->filename);
-    	free(metadata);
-    	metadata = metadata_tmp;
-    }
+    rar_free_metadata(rar_state.metadata);
     cli_dbgmsg("RAR: Exit code: %d\n", ret);
 
     if (SCAN_ALL && viruses_found)
@@ -541,51 +651,28 @@ static int cli_scangzip_with_zib_from_the_80s(cli_ctx *ctx, unsigned char *buff)
     return ret;
 }
 
-static int cli_scangzip(cli_ctx *ctx)
+static int gzip_inflate(cli_ctx *ctx, z_stream *z, struct cli_extract *x)
 {
-	int fd, ret = CL_CLEAN;
 	unsigned char buff[FILEBUFF];
-	char *tmpname;
-	z_stream z;
 	size_t at = 0, outsize = 0;
 	fmap_t *map = *ctx->fmap;
- 	
-    cli_dbgmsg("in cli_scangzip()\n");
-
-    memset(&z, 0, sizeof(z));
-    if((ret = inflateInit2(&z, MAX_WBITS + 16)) != Z_OK) {
-	cli_dbgmsg("GZip: InflateInit failed: %d\n", ret);
-	return cli_scangzip_with_zib_from_the_80s(ctx, buff);
-    }
-
-    if((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd)) != CL_SUCCESS) {
-	cli_dbgmsg("GZip: Can't generate temporary file.\n");
-	inflateEnd(&z);
-	return ret;
-    }
+	int ret;
 
     while (at < map->len) {
 	unsigned int bytes = MIN(map->len - at, map->pgsz);
-	if(!(z.next_in = (void*)fmap_need_off_once(map, at, bytes))) {
+	if(!(z->next_in = (void*)fmap_need_off_once(map, at, bytes))) {
 	    cli_dbgmsg("GZip: Can't read %u bytes @ %lu.\n", bytes, (long unsigned)at);
-	    inflateEnd(&z);
-	    close(fd);
-	    if (cli_unlink(tmpname)) {
-		free(tmpname);
-		return CL_EUNLINK;
-	    }
-	    free(tmpname);
 	    return CL_EREAD;
 	}
 	at += bytes;
-	z.avail_in = bytes;
+	z->avail_in = bytes;
 	do {
 	    int inf;
-	    z.avail_out = sizeof(buff);
-            z.next_out = buff;
-	    inf = inflate(&z, Z_NO_FLUSH);
+	    z->avail_out = sizeof(buff);
+            z->next_out = buff;
+	    inf = inflate(z, Z_NO_FLUSH);
 	    if(inf != Z_OK && inf != Z_STREAM_END && inf != Z_BUF_ERROR) {
-		if (sizeof(buff) == z.avail_out) {
+		if (sizeof(buff) == z->avail_out) {
 		    cli_dbgmsg("GZip: Bad stream, nothing in output buffer.\n");
 		    at = map->len;
 		    break;
@@ -595,54 +682,274 @@ static int cli_scangzip(cli_ctx *ctx)
 		    /* no break yet, flush extracted bytes to file */
 		}
 	    }
-	    if(cli_writen(fd, buff, sizeof(buff) - z.avail_out) < 0) {
-		inflateEnd(&z);	    
-		close(fd);
-		if (cli_unlink(tmpname)) {
-		    free(tmpname);
-		    return CL_EUNLINK;
-		}
-		free(tmpname);
-		return CL_EWRITE;
-	    }
-	    outsize += sizeof(buff) - z.avail_out;
+	    if((ret = cli_extract_write(x, buff, sizeof(buff) - z->avail_out)) != CL_SUCCESS)
+		return ret;
+	    outsize += sizeof(buff) - z->avail_out;
 	    if(cli_checklimits("GZip", ctx, outsize, 0, 0)!=CL_CLEAN) {
 		at = map->len;
 		break;
 	    }
 	    if(inf == Z_STREAM_END) {
-		at -= z.avail_in;
-		inflateReset(&z);
+		at -= z->avail_in;
+		inflateReset(z);
 		break;
 	    }
 	    else if(inf != Z_OK && inf != Z_BUF_ERROR) {
 		at = map->len;
 		break;
 	    }
-	} while (z.avail_out == 0);
+	} while (z->avail_out == 0);
     }
+    return CL_SUCCESS;
+}
 
-    inflateEnd(&z);	    
+/* Single member gzip whose size is known from the trailer: the data is
+ * decoded at once into the extract buffer. Returns CL_BREAK when the file
+ * has to go through gzip_inflate() instead. The CRC isn't checked, zlib
+ * only does it after passing on all the data anyway. */
+static int gzip_inflate_buf(cli_ctx *ctx, struct cli_extract *x, uint32_t isize)
+{
+	fmap_t *map = *ctx->fmap;
+	const unsigned char *data;
+	unsigned char *dst;
+	size_t hlen = 10, inlen, outlen;
+
+    /* no deflate stream expands more than 1032 times */
+    if(!isize || isize / 1032 > map->len || cli_checklimits("GZip", ctx, isize, 0, 0) != CL_CLEAN)
+	return CL_BREAK;
+    if(!(data = fmap_need_off_once(map, 0, map->len)))
+	return CL_BREAK;
+    if(data[0] != 0x1f || data[1] != 0x8b || data[2] != 8 || (data[3] & 0xe2))
+	return CL_BREAK;
+    if(data[3] & 4) {
+	hlen += 2 + (uint16_t)cli_readint16(data + 10);
+	if(hlen > map->len)
+	    return CL_BREAK;
+    }
+    if(data[3] & 8) {
+	while(hlen < map->len && data[hlen])
+	    hlen++;
+	hlen++;
+    }
+    if(data[3] & 16) {
+	while(hlen < map->len && data[hlen])
+	    hlen++;
+	hlen++;
+    }
+    if(hlen + 8 > map->len || !(dst = cli_extract_reserve(x, isize)))
+	return CL_BREAK;
+    if(cli_inflate_buf(data + hlen, map->len - hlen - 8, dst, isize, &inlen, &outlen, 0) != CLI_INFLATE_END ||
+       hlen + inlen + 8 != map->len)
+	return CL_BREAK;
+    return cli_extract_commit(x, outlen);
+}
 
-    if((ret = cli_magic_scandesc(fd, ctx)) == CL_VIRUS) {
-	cli_dbgmsg("GZip: Infected with %s\n", cli_get_last_virus(ctx));
-	close(fd);
-	if(!ctx->engine->keeptmp) {
-	    if (cli_unlink(tmpname)) {
-	    	free(tmpname);
-		return CL_EUNLINK;
-	    }
+static int cli_scangzip(cli_ctx *ctx)
+{
+	int ret = CL_CLEAN;
+	unsigned char buff[FILEBUFF];
+	const unsigned char *trailer;
+	uint32_t isize = 0;
+	struct cli_extract x;
+	z_stream z;
+	int fast = 0;
+	fmap_t *map = *ctx->fmap;
+ 	
+    cli_dbgmsg("in cli_scangzip()\n");
+
+    memset(&z, 0, sizeof(z));
+    if((ret = inflateInit2(&z, MAX_WBITS + 16)) != Z_OK) {
+	cli_dbgmsg("GZip: InflateInit failed: %d\n", ret);
+	return cli_scangzip_with_zib_from_the_80s(ctx, buff);
+    }
+
+    cli_extract_init(&x, ctx, NULL);
+    /* ISIZE of the last member, a mismatch only costs a second pass */
+    if(map->len > 18 && (trailer = fmap_need_off_once(map, map->len - 4, 4))) {
+	isize = (uint32_t)cli_readint32(trailer);
+	if(!ctx->engine->maxfilesize || isize <= ctx->engine->maxfilesize) {
+	    cli_extract_expect(&x, isize);
+	    fast = 1;
 	}
-	free(tmpname);
-	return CL_VIRUS;
     }
-    close(fd);
-    if(!ctx->engine->keeptmp)
-	if (cli_unlink(tmpname)) ret = CL_EUNLINK;
-    free(tmpname);
+
+    if(fast && (ret = gzip_inflate_buf(ctx, &x, isize)) != CL_BREAK) {
+	if(ret == CL_SUCCESS)
+	    ret = cli_extract_scan(&x);
+    } else do {
+	inflateReset(&z);
+	if((ret = gzip_inflate(ctx, &z, &x)) == CL_SUCCESS)
+	    ret = cli_extract_scan(&x);
+    } while(cli_extract_again(&x));
+
+    inflateEnd(&z);
+
+    if(ret == CL_VIRUS)
+	cli_dbgmsg("GZip: Infected with %s\n", cli_get_last_virus(ctx));
+    if (cli_extract_done(&x))
+	return CL_EUNLINK;
     return ret;
 }
 
+#ifdef CL_THREAD_SAFE
+/* Parallel decoding of compressed files made of independent blocks
+ * (CL_ENGINE_DECOMPRESS_THREADS).
+ *
+ * The scanning thread finds the blocks and queues them in file order, the
+ * threads decode each one to a buffer of its own and the scanning thread
+ * then writes them out in the same order, as a serial decoder would. At
+ * most twice as many blocks as threads are held in memory: a job slot is
+ * only reused once its block is written out. */
+struct decode_job {
+    const unsigned char *src; /* mapped input, or buf */
+    size_t srclen;
+    unsigned char *buf;
+    size_t off; /* where src is mapped from, when it's not buf */
+    unsigned char *out;
+    size_t outlen;
+    int state; /* 0 queued, 1 done, -1 failed */
+};
+
+struct decode_pool {
+    int (*decode)(const struct decode_pool *, struct decode_job *);
+    const void *arg;
+    fmap_t *map;
+    struct decode_job *jobs;
+    unsigned int window;
+    size_t next, queued;
+    struct cli_budget *budget;
+    int quit;
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+    pthread_t tid[CLI_MAX_DECOMPRESS_THREADS];
+    unsigned int started;
+};
+
+static void *decode_pool_worker(void *arg)
+{
+    struct decode_pool *pool = (struct decode_pool *)arg;
+    struct decode_job *job;
+    cli_ctx ctx;
+    int ok;
+
+    /* only to charge the CPU time to the scan */
+    memset(&ctx, 0, sizeof(ctx));
+    cli_budget_attach(&ctx, pool->budget);
+    pthread_mutex_lock(&pool->mutex);
+    while(1) {
+	while(pool->next == pool->queued && !pool->quit)
+	    pthread_cond_wait(&pool->work, &pool->mutex);
+	if(pool->quit)
+	    break;
+	job = &pool->jobs[pool->next++ % pool->window];
+	pthread_mutex_unlock(&pool->mutex);
+
+	ok = !(pool->budget && pool->budget->exceeded) && pool->decode(pool, job) == CL_SUCCESS;
+	if(!ok) {
+	    free(job->out);
+	    job->out = NULL;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	job->state = ok ? 1 : -1;
+	pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    cli_budget_attach(&ctx, NULL);
+    return NULL;
+}
+
+/* Starts the threads, returns 0 when none could be started */
+static int decode_pool_init(struct decode_pool *pool, cli_ctx *ctx, int (*decode)(const struct decode_pool *, struct decode_job *), const void *arg)
+{
+    unsigned int threads = ctx->engine->decompress_threads;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->decode = decode;
+    pool->arg = arg;
+    pool->map = *ctx->fmap;
+    pool->budget = ctx->budget;
+    pool->window = 2 * threads;
+    if(!(pool->jobs = cli_calloc(pool->window, sizeof(*pool->jobs))))
+	return 0;
+    if(pthread_mutex_init(&pool->mutex, NULL)) {
+	free(pool->jobs);
+	return 0;
+    }
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for(pool->started = 0; pool->started < threads; pool->started++)
+	if(pthread_create(&pool->tid[pool->started], NULL, decode_pool_worker, pool))
+	    break;
+    if(!pool->started) {
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->jobs);
+	return 0;
+    }
+    return 1;
+}
+
+/* The slot of the next block to queue, NULL while the window is full:
+ * seq is the first block not written out yet */
+static struct decode_job *decode_pool_slot(struct decode_pool *pool, size_t seq)
+{
+    if(pool->queued >= seq + pool->window)
+	return NULL;
+    return &pool->jobs[pool->queued % pool->window];
+}
+
+static void decode_pool_queue(struct decode_pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->queued++;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Waits for block seq, which must have been queued */
+static struct decode_job *decode_pool_wait(struct decode_pool *pool, size_t seq)
+{
+    struct decode_job *job = &pool->jobs[seq % pool->window];
+
+    pthread_mutex_lock(&pool->mutex);
+    while(!job->state)
+	pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    return job;
+}
+
+/* Frees the slot of a block which is done or was never queued */
+static void decode_pool_release(struct decode_pool *pool, struct decode_job *job)
+{
+    if(job->src && !job->buf)
+	fmap_unneed_off(pool->map, job->off, job->srclen);
+    free(job->buf);
+    free(job->out);
+    memset(job, 0, sizeof(*job));
+}
+
+/* Stops the threads and frees the blocks not written out */
+static void decode_pool_free(struct decode_pool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for(i = 0; i < pool->started; i++)
+	pthread_join(pool->tid[i], NULL);
+    for(i = 0; i < pool->window; i++)
+	decode_pool_release(pool, &pool->jobs[i]);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->jobs);
+}
+#endif
+
 #ifndef HAVE_BZLIB_H
 static int cli_scanbzip(cli_ctx *ctx) {
     cli_warnmsg("cli_scanbzip: bzip2 support not compiled in\n");
@@ -657,11 +964,231 @@ static int cli_scanbzip(cli_ctx *ctx) {
 #define BZ2_bzDecompressEnd bzDecompressEnd
 #endif
 
+#ifdef CL_THREAD_SAFE
+/* The blocks of a bzip2 stream start with a 48 bit magic number, followed
+ * by the CRC of the data in the block, and the stream ends with another
+ * one, followed by the combined CRC of the blocks. Neither is aligned on
+ * a byte. */
+#define BZ_BLOCK_MAGIC 0x314159265359ULL
+#define BZ_EOS_MAGIC   0x177245385090ULL
+#define BZ_MAGIC_MASK  0xffffffffffffULL
+
+struct bz_split {
+    fmap_t *map;
+    size_t off; /* next byte to look at */
+    uint64_t w; /* the bytes before */
+    uint64_t min; /* no magic number starts before this bit */
+    unsigned char hint[256];
+};
+
+static void bz_split_init(struct bz_split *sp, fmap_t *map)
+{
+    unsigned int i;
+
+    memset(sp, 0, sizeof(*sp));
+    sp->map = map;
+    sp->min = 32;
+    /* whatever its alignment, the byte before the last one of a magic
+     * number is one of these */
+    for(i = 0; i < 8; i++) {
+	sp->hint[((BZ_BLOCK_MAGIC << i) >> 8) & 0xff] = 1;
+	sp->hint[((BZ_EOS_MAGIC << i) >> 8) & 0xff] = 1;
+    }
+}
+
+/* Finds the next magic number: *bit gets where it starts and *eos whether
+ * it ends the stream; 0 at the end of the file */
+static int bz_split_next(struct bz_split *sp, uint64_t *bit, int *eos)
+{
+    const unsigned char *p;
+    size_t avail, i;
+    uint64_t m, end;
+    unsigned int j;
+
+    while((p = fmap_need_off_once_len(sp->map, sp->off, FILEBUFF, &avail)) && avail) {
+	for(i = 0; i < avail; ) {
+	    sp->w = (sp->w << 8) | p[i++];
+	    if(!sp->hint[(sp->w >> 8) & 0xff])
+		continue;
+	    for(j = 0; j < 8; j++) {
+		m = (sp->w >> j) & BZ_MAGIC_MASK;
+		if(m != BZ_BLOCK_MAGIC && m != BZ_EOS_MAGIC)
+		    continue;
+		end = (uint64_t)(sp->off + i) * 8 - j;
+		if(end < 48 || end - 48 < sp->min)
+		    continue;
+		*bit = end - 48;
+		*eos = m == BZ_EOS_MAGIC;
+		/* the CRC may look like a magic number too */
+		sp->min = end + 32;
+		sp->off += i;
+		return 1;
+	    }
+	}
+	sp->off += avail;
+    }
+    return 0;
+}
+
+static void bz_putbits(unsigned char *buf, uint64_t *pos, uint64_t v, unsigned int n)
+{
+    while(n--) {
+	if((v >> n) & 1)
+	    buf[*pos / 8] |= 0x80 >> (*pos % 8);
+	(*pos)++;
+    }
+}
+
+/* Makes a stream of its own out of the block between bit start and bit
+ * end: the header, the block and the end of stream, whose combined CRC is
+ * the one of the block */
+static unsigned char *bz_block_stream(fmap_t *map, unsigned char level, uint64_t start, uint64_t end, size_t *len)
+{
+    const unsigned char *p;
+    unsigned char *buf;
+    uint64_t bits = end - start, pos, crc = 0;
+    size_t off = start / 8, n = (end + 7) / 8 - off, i;
+    unsigned int sh = start % 8;
+
+    if(bits < 80 || bits / 8 > CLI_MAX_DECOMPRESS_BLOCK)
+	return NULL;
+    /* one byte more to shift from, when there's one */
+    if(off + n < map->len)
+	n++;
+    if(!(p = fmap_need_off_once(map, off, n)))
+	return NULL;
+    *len = 4 + (bits + 80 + 7) / 8;
+    if(!(buf = cli_calloc(*len, 1)))
+	return NULL;
+    memcpy(buf, "BZh", 3);
+    buf[3] = level;
+    for(i = 0; i < (bits + 7) / 8; i++)
+	buf[4 + i] = (p[i] << sh) | (sh && i + 1 < n ? p[i + 1] >> (8 - sh) : 0);
+    if(bits % 8)
+	buf[4 + bits / 8] &= 0xff << (8 - bits % 8);
+    for(pos = 32 + 48; pos < 32 + 80; pos++)
+	crc = (crc << 1) | ((buf[pos / 8] >> (7 - pos % 8)) & 1);
+    pos = 32 + bits;
+    bz_putbits(buf, &pos, BZ_EOS_MAGIC, 48);
+    bz_putbits(buf, &pos, crc, 32);
+    return buf;
+}
+
+static int bz_decode_job(const struct decode_pool *pool, struct decode_job *job)
+{
+    bz_stream strm;
+    unsigned char *out;
+    size_t size = 1024 * 1024;
+    int rc;
+
+    UNUSEDPARAM(pool);
+    memset(&strm, 0, sizeof(strm));
+    if(BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+	return CL_EMEM;
+    strm.next_in = (char *)job->src;
+    strm.avail_in = job->srclen;
+    while(1) {
+	/* a block decodes to 900 KB, or much more with long runs */
+	if(!(out = cli_realloc(job->out, size))) {
+	    rc = BZ_MEM_ERROR;
+	    break;
+	}
+	job->out = out;
+	strm.next_out = (char *)out + job->outlen;
+	strm.avail_out = size - job->outlen;
+	rc = BZ2_bzDecompress(&strm);
+	job->outlen = size - strm.avail_out;
+	if(rc != BZ_OK || strm.avail_out || size >= CLI_MAX_DECOMPRESS_BLOCK)
+	    break;
+	size *= 2;
+    }
+    BZ2_bzDecompressEnd(&strm);
+    return rc == BZ_STREAM_END ? CL_SUCCESS : CL_EFORMAT;
+}
+
+/* Decodes the blocks of the first stream with the threads. Returns 0,
+ * before anything is written, when the threads can't be used; -1 when a
+ * block fails to decode on its own, which is what a corrupted block or a
+ * magic number found by chance in the compressed data look like: the
+ * caller then starts over with the serial decoder. The outcome goes to
+ * *ret otherwise. */
+static int bz_decode_mt(cli_ctx *ctx, struct cli_extract *x, int *ret)
+{
+    fmap_t *map = *ctx->fmap;
+    struct decode_pool pool;
+    struct decode_job *job;
+    struct bz_split sp;
+    const unsigned char *p;
+    unsigned long int size = 0;
+    unsigned char level;
+    uint64_t cur, next;
+    size_t i, j, queued = 0, towrite;
+    int eos = 0, found, stop = 0, res = 1;
+
+    if(map->len < CLI_DEFAULT_DECOMPRESS_THREADS_FSIZE || !(p = fmap_need_off_once(map, 0, 4)) ||
+       memcmp(p, "BZh", 3) || p[3] < '1' || p[3] > '9')
+	return 0;
+    level = p[3];
+    bz_split_init(&sp, map);
+    if(!bz_split_next(&sp, &cur, &eos) || eos || cur != 32)
+	return 0;
+    if(!decode_pool_init(&pool, ctx, bz_decode_job, NULL))
+	return 0;
+    cli_dbgmsg("Bzip: decoding blocks with %u threads\n", pool.started);
+
+    *ret = CL_SUCCESS;
+    for(i = 0; ; i++) {
+	/* the input of the blocks is copied out here, the threads don't
+	 * touch the fmap */
+	while(!eos && (job = decode_pool_slot(&pool, i))) {
+	    /* an unfinished block at the end decodes to nothing */
+	    if(!(found = bz_split_next(&sp, &next, &eos)) ||
+	       !(job->buf = bz_block_stream(map, level, cur, next, &job->srclen))) {
+		eos = 1;
+		if(found)
+		    res = -1;
+		break;
+	    }
+	    job->src = job->buf;
+	    decode_pool_queue(&pool);
+	    queued++;
+	    cur = next;
+	}
+	if(i == queued)
+	    break;
+	if((job = decode_pool_wait(&pool, i))->state != 1) {
+	    cli_dbgmsg("Bzip: block %lu doesn't decode on its own\n", (unsigned long)i);
+	    res = -1;
+	    break;
+	}
+
+	/* same chunks and limits as the serial decoder */
+	for(j = 0; j < job->outlen; j += towrite) {
+	    towrite = MIN(job->outlen - j, FILEBUFF);
+	    size += towrite;
+	    if((*ret = cli_extract_write(x, job->out + j, towrite)) != CL_SUCCESS) {
+		cli_dbgmsg("Bzip: Can't write to file.\n");
+		break;
+	    }
+	    if(cli_checklimits("Bzip", ctx, size, 0, 0) != CL_CLEAN) {
+		stop = 1;
+		break;
+	    }
+	}
+	decode_pool_release(&pool, job);
+	if(*ret != CL_SUCCESS || stop)
+	    break;
+    }
+    decode_pool_free(&pool);
+    return res;
+}
+#endif
+
 static int cli_scanbzip(cli_ctx *ctx)
 {
-    int ret = CL_CLEAN, fd, rc;
+    int ret = CL_CLEAN, rc, mt = 0;
     unsigned long int size = 0;
-    char *tmpname;
+    struct cli_extract x;
     bz_stream strm;
     size_t off = 0;
     size_t avail;
@@ -676,13 +1203,24 @@ static int cli_scanbzip(cli_ctx *ctx)
 	return CL_EOPEN;
     }
 
-    if((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd))) {
-	cli_dbgmsg("Bzip: Can't generate temporary file.\n");
+    cli_extract_init(&x, ctx, NULL);
+
+#ifdef CL_THREAD_SAFE
+    if (ctx->engine->decompress_threads)
+	mt = bz_decode_mt(ctx, &x, &ret);
+    if (mt < 0) {
+	/* start over with the serial decoder */
+	cli_extract_done(&x);
+	cli_extract_init(&x, ctx, NULL);
+    } else if (mt > 0 && ret != CL_SUCCESS) {
 	BZ2_bzDecompressEnd(&strm);
+	if (cli_extract_done(&x))
+	    return CL_EUNLINK;
 	return ret;
     }
+#endif
 
-    do {
+    if (mt <= 0) do {
 	if (!strm.avail_in) {
 	    strm.next_in = (void*)fmap_need_off_once_len(*ctx->fmap, off, FILEBUFF, &avail);
 	    strm.avail_in = avail;
@@ -703,18 +1241,12 @@ static int cli_scanbzip(cli_ctx *ctx)
 
 	    size += sizeof(buf) - strm.avail_out;
 
-	    if(cli_writen(fd, buf, sizeof(buf) - strm.avail_out) != sizeof(buf) - strm.avail_out) {
+	    if((ret = cli_extract_write(&x, buf, sizeof(buf) - strm.avail_out)) != CL_SUCCESS) {
 		cli_dbgmsg("Bzip: Can't write to file.\n");
 		BZ2_bzDecompressEnd(&strm);
-		close(fd);
-		if(!ctx->engine->keeptmp) {
-		    if (cli_unlink(tmpname)) {
-			free(tmpname);
-			return CL_EUNLINK;
-		    }
-		}
-		free(tmpname);
-		return CL_EWRITE;
+		if (cli_extract_done(&x))
+		    return CL_EUNLINK;
+		return ret;
 	    }
 
 	    if(cli_checklimits("Bzip", ctx, size, 0, 0) != CL_CLEAN)
@@ -727,152 +1259,334 @@ static int cli_scanbzip(cli_ctx *ctx)
 
     BZ2_bzDecompressEnd(&strm);
 
-    if((ret = cli_magic_scandesc(fd, ctx)) == CL_VIRUS ) {
+    if((ret = cli_extract_scan(&x)) == CL_VIRUS ) {
 	cli_dbgmsg("Bzip: Infected with %s\n", cli_get_last_virus(ctx));
-	close(fd);
-	if(!ctx->engine->keeptmp) {
-	    if (cli_unlink(tmpname)) {
-		ret = CL_EUNLINK;
-		free(tmpname);
-		return ret;
-	    }
-	}
-	free(tmpname);
+	if (cli_extract_done(&x))
+	    return CL_EUNLINK;
 	return CL_VIRUS;
     }
-    close(fd);
-    if(!ctx->engine->keeptmp)
-	if (cli_unlink(tmpname)) ret = CL_EUNLINK;
-    free(tmpname);
+    if (cli_extract_done(&x))
+	ret = CL_EUNLINK;
 
     return ret;
 }
 #endif
 
-static int cli_scanxz(cli_ctx *ctx)
+/* Finds the index of the last stream: its size goes to *isize, the length
+ * of the file without the final padding to *len and the stream flags from
+ * the footer to flags, if not NULL */
+static const unsigned char *xz_index(fmap_t *map, size_t *len, uint64_t *isize, unsigned char *flags)
 {
-    int ret = CL_CLEAN, fd, rc;
-    unsigned long int size = 0;
-    char *tmpname;
-    struct CLI_XZ strm;
-    size_t off = 0;
-    size_t avail;
-    unsigned char *buf;
+    const unsigned char *p;
+
+    /* stream padding */
+    *len = map->len;
+    while(*len >= 4 && (p = fmap_need_off_once(map, *len - 4, 4)) && !cli_readint32(p))
+	*len -= 4;
+    if(*len < 32 || !(p = fmap_need_off_once(map, *len - 12, 12)) || p[10] != 'Y' || p[11] != 'Z')
+	return NULL;
+    if(flags)
+	memcpy(flags, p + 8, 2);
+    *isize = ((uint64_t)(uint32_t)cli_readint32(p + 4) + 1) * 4;
+    if(*isize > *len - 24 || !(p = fmap_need_off_once(map, *len - 12 - *isize, *isize)) || p[0])
+	return NULL;
+    return p;
+}
 
-    buf = cli_malloc(CLI_XZ_OBUF_SIZE);
-    if (buf == NULL) {
-	cli_errmsg("cli_scanxz: nomemory for decompress buffer.\n");
-        return CL_EMEM;
-    }
-    memset(&strm, 0x00, sizeof(struct CLI_XZ));
-    strm.next_out = buf;
-    strm.avail_out = CLI_XZ_OBUF_SIZE;
-    rc = cli_XzInit(&strm);
-    if (rc != XZ_RESULT_OK) {
-	cli_errmsg("cli_scanxz: DecompressInit failed: %i\n", rc);
-        free(buf);
-	return CL_EOPEN;
+/* Walks the records of an index: the number of records first, then the
+ * unpadded and uncompressed size of each block. Returns the next field,
+ * or 0 when the index is broken. */
+static int xz_index_field(const unsigned char *p, uint64_t isize, size_t *off, uint64_t *v)
+{
+    unsigned int i;
+
+    for(*v = 0, i = 0; ; i++) {
+	if(*off >= isize || i == 9)
+	    return 0;
+	*v |= (uint64_t)(p[*off] & 0x7f) << (i * 7);
+	if(!(p[(*off)++] & 0x80))
+	    return 1;
     }
+}
 
-    if ((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd))) {
-	cli_errmsg("cli_scanxz: Can't generate temporary file.\n");
-	cli_XzShutdown(&strm);
-        free(buf);
-	return ret;
+/* Uncompressed size recorded in the index of the last stream, 0 if unknown */
+static uint64_t xz_usize(fmap_t *map)
+{
+    const unsigned char *p;
+    uint64_t isize, records, usize = 0, v;
+    size_t len, off = 1;
+    unsigned int field;
+
+    if(!(p = xz_index(map, &len, &isize, NULL)))
+	return 0;
+    for(field = 0, records = 1; field < 1 + 2 * records; field++) {
+	if(!xz_index_field(p, isize, &off, &v))
+	    return 0;
+	if(!field) {
+	    if(v > isize / 2)
+		return 0;
+	    records = v;
+	} else if(!(field & 1)) {
+	    usize += v;
+	}
+    }
+    return usize;
+}
+
+#ifdef CL_THREAD_SAFE
+struct xz_block {
+    size_t off, size;
+    uint64_t usize;
+};
+
+/* Lays out the blocks of a file made of a single stream, as written by
+ * xz -T; 0 when it can't be decoded in parallel */
+static size_t xz_blocks(fmap_t *map, struct xz_block **blocks)
+{
+    const unsigned char *p;
+    unsigned char hflags[2], fflags[2];
+    uint64_t isize, records, u, v;
+    size_t len, off = 1, pos = 12, i;
+
+    *blocks = NULL;
+    /* the stream flags are repeated in the footer */
+    if(!(p = fmap_need_off_once(map, 0, 12)) || memcmp(p, "\xfd" "7zXZ\0", 6))
+	return 0;
+    memcpy(hflags, p + 6, 2);
+    if(!(p = xz_index(map, &len, &isize, fflags)) || memcmp(hflags, fflags, 2) ||
+       !xz_index_field(p, isize, &off, &records) || records < 2 || records > isize / 2)
+	return 0;
+    if(!(*blocks = cli_calloc(records, sizeof(**blocks))))
+	return 0;
+    for(i = 0; i < records; i++) {
+	if(!xz_index_field(p, isize, &off, &u) || !xz_index_field(p, isize, &off, &v) ||
+	   !u || u > len - pos || v > CLI_MAX_DECOMPRESS_BLOCK)
+	    break;
+	(*blocks)[i].off = pos;
+	(*blocks)[i].size = (u + 3) & ~(uint64_t)3;
+	(*blocks)[i].usize = v;
+	if((*blocks)[i].size > len - pos)
+	    break;
+	pos += (*blocks)[i].size;
+    }
+    /* the blocks are followed by the index */
+    if(i < records || pos != len - 12 - isize) {
+	free(*blocks);
+	*blocks = NULL;
+	return 0;
+    }
+    return records;
+}
+
+/* outlen is set to the size recorded in the index */
+static int xz_decode_job(const struct decode_pool *pool, struct decode_job *job)
+{
+    if(!(job->out = cli_malloc(job->outlen + 1)))
+	return CL_EMEM;
+    if(cli_XzDecodeBlock(pool->arg, job->src, job->srclen, job->out, job->outlen) != XZ_RESULT_OK)
+	return CL_EFORMAT;
+    return CL_SUCCESS;
+}
+
+/* Decodes the blocks with the threads. Returns 0, before anything is
+ * written, when the file is not made of independent blocks or the threads
+ * can't be started; the outcome goes to *ret otherwise. */
+static int xz_decode_mt(cli_ctx *ctx, struct cli_extract *x, int *ret)
+{
+    fmap_t *map = *ctx->fmap;
+    struct decode_pool pool;
+    struct decode_job *job;
+    struct xz_block *blocks;
+    const unsigned char *header;
+    unsigned long int size = 0;
+    size_t nblocks, i, j, queued = 0, towrite;
+
+    if(!(nblocks = xz_blocks(map, &blocks)))
+	return 0;
+    if(!(header = fmap_need_off(map, 0, 12))) {
+	free(blocks);
+	return 0;
+    }
+    if(!decode_pool_init(&pool, ctx, xz_decode_job, header)) {
+	fmap_unneed_off(map, 0, 12);
+	free(blocks);
+	return 0;
+    }
+    cli_dbgmsg("cli_scanxz: decoding %lu blocks with %u threads\n", (unsigned long)nblocks, pool.started);
+
+    *ret = CL_SUCCESS;
+    for(i = 0; i < nblocks; i++) {
+	/* the input of the blocks is mapped here, the threads don't touch
+	 * the fmap */
+	while(queued < nblocks && (job = decode_pool_slot(&pool, i))) {
+	    if(!(job->src = fmap_need_off(map, blocks[queued].off, blocks[queued].size))) {
+		nblocks = queued;
+		break;
+	    }
+	    job->off = blocks[queued].off;
+	    job->srclen = blocks[queued].size;
+	    job->outlen = blocks[queued].usize;
+	    decode_pool_queue(&pool);
+	    queued++;
+	}
+	if(i == queued || (job = decode_pool_wait(&pool, i))->state != 1) {
+	    cli_errmsg("cli_scanxz: decompress error in block %lu\n", (unsigned long)i);
+	    *ret = CL_EFORMAT;
+	    break;
+	}
+
+	/* same chunks and limits as the serial decoder */
+	for(j = 0; j < job->outlen; j += towrite) {
+	    towrite = MIN(job->outlen - j, CLI_XZ_OBUF_SIZE);
+	    size += towrite;
+	    if((*ret = cli_extract_write(x, job->out + j, towrite)) != CL_SUCCESS) {
+		if (*ret != CL_BREAK && !cli_budget_exceeded(ctx))
+		    cli_errmsg("cli_scanxz: Can't write to file.\n");
+		break;
+	    }
+	    if (cli_checklimits("cli_scanxz", ctx, size, 0, 0) != CL_CLEAN) {
+		if (!cli_budget_exceeded(ctx))
+		    cli_warnmsg("cli_scanxz: decompress file size exceeds limits - "
+				"only scanning %li bytes\n", size);
+		nblocks = 0;
+		break;
+	    }
+	}
+	decode_pool_release(&pool, job);
+	if(*ret != CL_SUCCESS)
+	    break;
     }
-    cli_dbgmsg("cli_scanxz: decompressing to file %s\n", tmpname);
 
+    decode_pool_free(&pool);
+    fmap_unneed_off(map, 0, 12);
+    free(blocks);
+    return 1;
+}
+#endif
+
+static int xz_decode(cli_ctx *ctx, struct CLI_XZ *strm, unsigned char *buf, struct cli_extract *x)
+{
+    int ret, rc;
+    unsigned long int size = 0;
+    size_t off = 0;
+    size_t avail;
+
+#ifdef CL_THREAD_SAFE
+    if (ctx->engine->decompress_threads && xz_decode_mt(ctx, x, &ret))
+	return ret;
+#endif
     do {
         /* set up input buffer */
-	if (!strm.avail_in) {
-            strm.next_in = (void*)fmap_need_off_once_len(*ctx->fmap, off, CLI_XZ_IBUF_SIZE, &avail);
-	    strm.avail_in = avail;
+	if (!strm->avail_in) {
+            strm->next_in = (void*)fmap_need_off_once_len(*ctx->fmap, off, CLI_XZ_IBUF_SIZE, &avail);
+	    strm->avail_in = avail;
 	    off += avail;
-	    if (!strm.avail_in) {
+	    if (!strm->avail_in) {
 		cli_errmsg("cli_scanxz: premature end of compressed stream\n");
-                ret = CL_EFORMAT;
-		goto xz_exit;
+		return CL_EFORMAT;
 	    }
 	}
 
         /* xz decompress a chunk */
-	rc = cli_XzDecode(&strm);
+	rc = cli_XzDecode(strm);
 	if (XZ_RESULT_OK != rc && XZ_STREAM_END != rc) {
 	    cli_errmsg("cli_scanxz: decompress error: %d\n", rc);
-            ret = CL_EFORMAT;
-            goto xz_exit;
+	    return CL_EFORMAT;
 	}
         //cli_dbgmsg("cli_scanxz: xz decompressed %li of %li available bytes\n",
-        //           avail - strm.avail_in, avail);
+        //           avail - strm->avail_in, avail);
         
         /* write decompress buffer */
-	if (!strm.avail_out || rc == XZ_STREAM_END) {            
-	    size_t towrite = CLI_XZ_OBUF_SIZE - strm.avail_out;
+	if (!strm->avail_out || rc == XZ_STREAM_END) {            
+	    size_t towrite = CLI_XZ_OBUF_SIZE - strm->avail_out;
 	    size += towrite;
 
             //cli_dbgmsg("Writing %li bytes to XZ decompress temp file(%li byte total)\n",
             //           towrite, size);
 
-	    if((size_t)cli_writen(fd, buf, towrite) != towrite) {
-		cli_errmsg("cli_scanxz: Can't write to file.\n");
-                ret = CL_EWRITE;
-                goto xz_exit;
+	    if((ret = cli_extract_write(x, buf, towrite)) != CL_SUCCESS) {
+		if (ret != CL_BREAK && !cli_budget_exceeded(ctx))
+		    cli_errmsg("cli_scanxz: Can't write to file.\n");
+		return ret;
 	    }
 	    if (cli_checklimits("cli_scanxz", ctx, size, 0, 0) != CL_CLEAN) {
-                cli_warnmsg("cli_scanxz: decompress file size exceeds limits - "
-                            "only scanning %li bytes\n", size);
+		if (!cli_budget_exceeded(ctx))
+                    cli_warnmsg("cli_scanxz: decompress file size exceeds limits - "
+                                "only scanning %li bytes\n", size);
 		break;
             }
-	    strm.next_out = buf;
-	    strm.avail_out = CLI_XZ_OBUF_SIZE;
+	    strm->next_out = buf;
+	    strm->avail_out = CLI_XZ_OBUF_SIZE;
 	}
     } while (XZ_STREAM_END != rc);
 
-    /* scan decompressed file */
-    if ((ret = cli_magic_scandesc(fd, ctx)) == CL_VIRUS ) {
-	cli_dbgmsg("cli_scanxz: Infected with %s\n", cli_get_last_virus(ctx));
+    return CL_SUCCESS;
+}
+
+static int cli_scanxz(cli_ctx *ctx)
+{
+    int ret = CL_CLEAN, rc;
+    struct cli_extract x;
+    struct CLI_XZ strm;
+    uint64_t usize;
+    unsigned char *buf;
+
+    buf = cli_malloc(CLI_XZ_OBUF_SIZE);
+    if (buf == NULL) {
+	cli_errmsg("cli_scanxz: nomemory for decompress buffer.\n");
+        return CL_EMEM;
     }
 
- xz_exit:
-    cli_XzShutdown(&strm);
-    close(fd);
-    if(!ctx->engine->keeptmp)
-	if (cli_unlink(tmpname) && ret == CL_CLEAN)
-            ret = CL_EUNLINK;
-    free(tmpname);
+    cli_extract_init(&x, ctx, NULL);
+    usize = xz_usize(*ctx->fmap);
+    if (usize && (!ctx->engine->maxfilesize || usize <= ctx->engine->maxfilesize))
+	cli_extract_expect(&x, usize);
+
+    do {
+	memset(&strm, 0x00, sizeof(struct CLI_XZ));
+	strm.next_out = buf;
+	strm.avail_out = CLI_XZ_OBUF_SIZE;
+	rc = cli_XzInit(&strm);
+	if (rc != XZ_RESULT_OK) {
+	    cli_errmsg("cli_scanxz: DecompressInit failed: %i\n", rc);
+	    ret = CL_EOPEN;
+	    break;
+	}
+	/* scan decompressed file */
+	if ((ret = xz_decode(ctx, &strm, buf, &x)) == CL_SUCCESS)
+	    ret = cli_extract_scan(&x);
+	cli_XzShutdown(&strm);
+    } while (cli_extract_again(&x));
+
+    if (ret == CL_VIRUS)
+	cli_dbgmsg("cli_scanxz: Infected with %s\n", cli_get_last_virus(ctx));
+    if (cli_extract_done(&x) && ret == CL_CLEAN)
+        ret = CL_EUNLINK;
     free(buf);
     return ret;
 }
 
 static int cli_scanszdd(cli_ctx *ctx)
 {
-	int ofd, ret;
-	char *tmpname;
+	struct cli_extract x;
+	int ret;
 
 
     cli_dbgmsg("in cli_scanszdd()\n");
 
-    if((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &ofd))) {
-	cli_dbgmsg("MSEXPAND: Can't generate temporary file/descriptor\n");
-	return ret;
-    }
-
-    ret = cli_msexpand(ctx, ofd);
+    cli_extract_init(&x, ctx, NULL);
+    ret = cli_msexpand(ctx, &x);
 
     if(ret != CL_SUCCESS) { /* CL_VIRUS or some error */
-	close(ofd);
-	if(!ctx->engine->keeptmp)
-	    if (cli_unlink(tmpname)) ret = CL_EUNLINK;
-	free(tmpname);	
+	if (cli_extract_done(&x))
+	    ret = CL_EUNLINK;
 	return ret;
     }
 
-    cli_dbgmsg("MSEXPAND: Decompressed into %s\n", tmpname);
-    ret = cli_magic_scandesc(ofd, ctx);
-    close(ofd);
-    if(!ctx->engine->keeptmp)
-	if (cli_unlink(tmpname)) ret = CL_EUNLINK;
-    free(tmpname);	
+    cli_dbgmsg("MSEXPAND: Decompressed %lu bytes\n", (unsigned long)x.len);
+    ret = cli_extract_scan(&x);
+    if (cli_extract_done(&x))
+	ret = CL_EUNLINK;
 
     return ret;
 }
@@ -880,12 +1594,15 @@ static int cli_scanszdd(cli_ctx *ctx)
 static int vba_scandata(const unsigned char *data, unsigned int len, cli_ctx *ctx)
 {
 	struct cli_matcher *groot = ctx->engine->root[0];
-	struct cli_matcher *troot = ctx->engine->root[2];
+	struct cli_matcher *troot = cli_getroot(ctx->engine, 2);
 	struct cli_ac_data gmdata, tmdata;
 	struct cli_ac_data *mdata[2];
 	int ret;
 	unsigned int viruses_found = 0;
 
+    if(!troot)
+	return CL_EMEM;
+
     if((ret = cli_ac_initdata(&tmdata, troot->ac_partsigs, troot->ac_lsigs, troot->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)))
 	return ret;
 
@@ -905,6 +1622,7 @@ static int vba_scandata(const unsigned char *data, unsigned int len, cli_ctx *ct
         *ctx->fmap = cl_fmap_open_memory(data, len);
         if (*ctx->fmap == NULL)
             return CL_EMEM;
+        ctx->nested_maps++;
 	ret = cli_exp_eval(ctx, troot, &tmdata, NULL, NULL);
 	if (ret == CL_VIRUS)
 	    viruses_found++;
@@ -938,6 +1656,7 @@ static int cli_vba_scandir(const char *dirname, cli_ctx *ctx, struct uniq *U)
 	char *hash;
 	uint32_t hashcnt;
 	unsigned int viruses_found = 0;
+	fmap_t *map;
 
 
     cli_dbgmsg("VBADir: %s\n", dirname);
@@ -951,9 +1670,12 @@ static int cli_vba_scandir(const char *dirname, cli_ctx *ctx, struct uniq *U)
 		vbaname[sizeof(vbaname)-1] = '\0';
 		fd = open(vbaname, O_RDONLY|O_BINARY);
 		if(fd == -1) continue;
-		cli_dbgmsg("VBADir: Decompress VBA project '%s_%u'\n", vba_project->name[i], j);
-		data = (unsigned char *)cli_vba_inflate(fd, vba_project->offset[i], &data_len);
+		map = fmap(fd, 0, 0);
 		close(fd);
+		if(!map) continue;
+		cli_dbgmsg("VBADir: Decompress VBA project '%s_%u'\n", vba_project->name[i], j);
+		data = (unsigned char *)cli_vba_inflate(map, vba_project->offset[i], &data_len);
+		funmap(map);
 		hasmacros++;
 		if(!data) {
 		    cli_dbgmsg("VBADir: WARNING: VBA project '%s_%u' decompressed to NULL\n", vba_project->name[i], j);
@@ -1188,13 +1910,47 @@ static int cli_vba_scandir(const char *dirname, cli_ctx *ctx, struct uniq *U)
     return ret;
 }
 
+/* Scans one of the normalised streams of cli_scanhtml(): from out, or from
+ * the file of the same name in dir with --leave-temps */
+static int scanhtml_stream(cli_ctx *ctx, const char *dir, const char *name, const struct text_buffer *buf, cli_file_t type)
+{
+    char fullname[1024];
+    fmap_t *map;
+    int fd, ret;
+
+    if (!buf) {
+	snprintf(fullname, 1024, "%s"PATHSEP"%s", dir, name);
+	fd = open(fullname, O_RDONLY|O_BINARY);
+	if (fd < 0)
+	    return CL_CLEAN;
+	ret = cli_scandesc(fd, ctx, type, 0, NULL, AC_SCAN_VIR, NULL);
+	close(fd);
+	return ret;
+    }
+
+    if (!buf->pos)
+	return CL_CLEAN;
+    map = *ctx->fmap;
+    if (!(*ctx->fmap = cl_fmap_open_memory(buf->data, buf->pos))) {
+	*ctx->fmap = map;
+	return CL_EMEM;
+    }
+    ctx->nested_maps++;
+    ret = cli_fmap_scandesc(ctx, type, 0, NULL, AC_SCAN_VIR, NULL, NULL);
+    map->dont_cache_flag = (*ctx->fmap)->dont_cache_flag;
+    funmap(*ctx->fmap);
+    *ctx->fmap = map;
+    return ret;
+}
+
 static int cli_scanhtml(cli_ctx *ctx)
 {
     char *tempname, fullname[1024];
-    int ret=CL_CLEAN, fd;
+    int ret=CL_CLEAN;
     fmap_t *map = *ctx->fmap;
     unsigned int viruses_found = 0;
     uint64_t curr_len = map->len;
+    struct html_norm_output out, *mem = NULL;
 
     cli_dbgmsg("in cli_scanhtml()\n");
 
@@ -1207,22 +1963,23 @@ static int cli_scanhtml(cli_ctx *ctx)
     if(!(tempname = cli_gentemp(ctx->engine->tmpdir)))
 	return CL_EMEM;
 
-    if(mkdir(tempname, 0700)) {
-        cli_errmsg("cli_scanhtml: Can't create temporary directory %s\n", tempname);
-	free(tempname);
-        return CL_ETMPDIR;
+    /* the normalised streams only go to files with --leave-temps, the
+     * directory is otherwise left to the data: URIs, if there are any */
+    if (!ctx->engine->keeptmp) {
+	html_normalise_map_mem(map, tempname, &out, ctx->dconf);
+	mem = &out;
+    } else {
+	if(mkdir(tempname, 0700)) {
+	    cli_errmsg("cli_scanhtml: Can't create temporary directory %s\n", tempname);
+	    free(tempname);
+	    return CL_ETMPDIR;
+	}
+	cli_dbgmsg("cli_scanhtml: using tempdir %s\n", tempname);
+	html_normalise_map(map, tempname, NULL, ctx->dconf);
     }
 
-    cli_dbgmsg("cli_scanhtml: using tempdir %s\n", tempname);
-
-    html_normalise_map(map, tempname, NULL, ctx->dconf);
-    snprintf(fullname, 1024, "%s"PATHSEP"nocomment.html", tempname);
-    fd = open(fullname, O_RDONLY|O_BINARY);
-    if (fd >= 0) {
-	if ((ret = cli_scandesc(fd, ctx, CL_TYPE_HTML, 0, NULL, AC_SCAN_VIR, NULL)) == CL_VIRUS)
-	    viruses_found++;
-	close(fd);
-    }
+    if ((ret = scanhtml_stream(ctx, tempname, "nocomment.html", mem ? &mem->nocomment : NULL, CL_TYPE_HTML)) == CL_VIRUS)
+	viruses_found++;
 
     if(ret == CL_CLEAN || (ret == CL_VIRUS && SCAN_ALL)) {
         /* CL_ENGINE_MAX_HTMLNOTAGS */
@@ -1233,37 +1990,30 @@ static int cli_scanhtml(cli_ctx *ctx)
             cli_dbgmsg("cli_scanhtml: skipping notags (normalized size over MaxHTMLNoTags)\n");
 	}
         else {
-            snprintf(fullname, 1024, "%s"PATHSEP"notags.html", tempname);
-            fd = open(fullname, O_RDONLY|O_BINARY);
-            if(fd >= 0) {
-                if ((ret = cli_scandesc(fd, ctx, CL_TYPE_HTML, 0, NULL, AC_SCAN_VIR, NULL)) == CL_VIRUS) 
-                    viruses_found++;
-                close(fd);
-            }
+            if ((ret = scanhtml_stream(ctx, tempname, "notags.html", mem ? &mem->notags : NULL, CL_TYPE_HTML)) == CL_VIRUS)
+                viruses_found++;
         }
     }
 
     if(ret == CL_CLEAN || (ret == CL_VIRUS && SCAN_ALL)) {
-	    snprintf(fullname, 1024, "%s"PATHSEP"javascript", tempname);
-	    fd = open(fullname, O_RDONLY|O_BINARY);
-	    if(fd >= 0) {
-		if ((ret = cli_scandesc(fd, ctx, CL_TYPE_HTML, 0, NULL, AC_SCAN_VIR, NULL)) == CL_VIRUS)
-		    viruses_found++;
-		if (ret == CL_CLEAN || (ret == CL_VIRUS && SCAN_ALL)) {
-		    if ((ret = cli_scandesc(fd, ctx, CL_TYPE_TEXT_ASCII, 0, NULL, AC_SCAN_VIR, NULL)) == CL_VIRUS)
-			viruses_found++;
-		}
-		close(fd);
-	    }
+	if ((ret = scanhtml_stream(ctx, tempname, "javascript", mem ? &mem->javascript : NULL, CL_TYPE_HTML)) == CL_VIRUS)
+	    viruses_found++;
+	if (ret == CL_CLEAN || (ret == CL_VIRUS && SCAN_ALL)) {
+	    if ((ret = scanhtml_stream(ctx, tempname, "javascript", mem ? &mem->javascript : NULL, CL_TYPE_TEXT_ASCII)) == CL_VIRUS)
+		viruses_found++;
+	}
     }
 
-    if (ret == CL_CLEAN || (ret == CL_VIRUS && SCAN_ALL)) {
+    if ((ret == CL_CLEAN || (ret == CL_VIRUS && SCAN_ALL)) && (!mem || mem->rfc2397)) {
 	snprintf(fullname, 1024, "%s"PATHSEP"rfc2397", tempname);
 	ret = cli_scandir(fullname, ctx);
     }
 
-    if(!ctx->engine->keeptmp)
-        cli_rmdirs(tempname);
+    if (mem) {
+	if (mem->rfc2397)
+	    cli_rmdirs(tempname);
+	html_norm_output_free(mem);
+    }
 
     free(tempname);
     if (SCAN_ALL && viruses_found)
@@ -1295,7 +2045,7 @@ static int cli_scanscript(cli_ctx *ctx)
 	map = *ctx->fmap;
 	curr_len = map->len;
 	groot = ctx->engine->root[0];
-	troot = ctx->engine->root[7];
+	troot = cli_getroot(ctx->engine, 7);
 	maxpatlen = troot ? troot->maxpatlen : 0;
 
 	cli_dbgmsg("in cli_scanscript()\n");
@@ -1359,6 +2109,7 @@ static int cli_scanscript(cli_ctx *ctx)
 		if (!(*ctx->fmap)) {
 			cli_errmsg("cli_scanscript: could not map file %s\n",tmpname);
 		} else {
+			ctx->nested_maps++;
 
 			/* scan map */
 			ret = cli_fmap_scandesc(ctx, CL_TYPE_TEXT_ASCII, 0, NULL, AC_SCAN_VIR, NULL, NULL);
@@ -1449,60 +2200,58 @@ static int cli_scanhtml_utf16(cli_ctx *ctx)
 	char *tempname, *decoded;
 	const char *buff;
 	int ret = CL_CLEAN, fd, bytes;
-	size_t at = 0;
+	size_t at = 0, len;
 	fmap_t *map = *ctx->fmap;
 
     cli_dbgmsg("in cli_scanhtml_utf16()\n");
 
-    if(!(tempname = cli_gentemp(ctx->engine->tmpdir)))
-	return CL_EMEM;
-
-    if((fd = open(tempname, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRWXU)) < 0) {
-	cli_errmsg("cli_scanhtml_utf16: Can't create file %s\n", tempname);
-	free(tempname);
-	return CL_EOPEN;
+    /* the data is decoded in memory and normalized from there */
+    len = map->len / 2;
+    if(!len)
+	return CL_CLEAN;
+    if(len > ctx->engine->maxhtmlnormalize) {
+	cli_dbgmsg("cli_scanhtml_utf16: exiting (file larger than MaxHTMLNormalize)\n");
+	return CL_CLEAN;
     }
-
-    cli_dbgmsg("cli_scanhtml_utf16: using tempfile %s\n", tempname);
+    if(!(decoded = cli_malloc(len)))
+	return CL_EMEM;
 
     while(at < map->len) {
 	bytes = MIN(map->len - at, map->pgsz * 16);
 	if(!(buff = fmap_need_off_once(map, at, bytes))) {
-	    close(fd);
-	    cli_unlink(tempname);
-	    free(tempname);
+	    free(decoded);
 	    return CL_EREAD;
 	}
+	/* at stays even, an odd last byte is dropped */
+	cli_utf16toascii_buf(decoded + at / 2, buff, bytes);
 	at += bytes;
-	decoded = cli_utf16toascii(buff, bytes);
-	if(decoded) {
-	    if(write(fd, decoded, bytes / 2) == -1) {
+    }
+
+    if(ctx->engine->keeptmp && (tempname = cli_gentemp(ctx->engine->tmpdir))) {
+	if((fd = open(tempname, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRWXU)) < 0) {
+	    cli_errmsg("cli_scanhtml_utf16: Can't create file %s\n", tempname);
+	} else {
+	    if(cli_writen(fd, decoded, len) == -1)
 		cli_errmsg("cli_scanhtml_utf16: Can't write to file %s\n", tempname);
-		free(decoded);
-		close(fd);
-		cli_unlink(tempname);
-		free(tempname);
-		return CL_EWRITE;
-	    }
-	    free(decoded);
+	    else
+		cli_dbgmsg("cli_scanhtml_utf16: Decoded HTML data saved in %s\n", tempname);
+	    close(fd);
 	}
+	free(tempname);
     }
 
-    *ctx->fmap = fmap(fd, 0, 0);
+    *ctx->fmap = cl_fmap_open_memory(decoded, len);
     if(*ctx->fmap) {
+	ctx->nested_maps++;
 	ret = cli_scanhtml(ctx);
 	funmap(*ctx->fmap);
-    } else
-	cli_errmsg("cli_scanhtml_utf16: fmap of %s failed\n", tempname);
+    } else {
+	cli_errmsg("cli_scanhtml_utf16: fmap of the decoded data failed\n");
+	ret = CL_EMEM;
+    }
 
     *ctx->fmap = map;
-    close(fd);
-
-    if(!ctx->engine->keeptmp) {
-	if (cli_unlink(tempname)) ret = CL_EUNLINK;
-    } else
-	cli_dbgmsg("cli_scanhtml_utf16: Decoded HTML data saved in %s\n", tempname);
-    free(tempname);
+    free(decoded);
 
     return ret;
 }
@@ -1557,7 +2306,7 @@ static int cli_scanole2(cli_ctx *ctx)
 static int cli_scantar(cli_ctx *ctx, unsigned int posix)
 {
 	char *dir;
-	int ret = CL_CLEAN;
+	int ret = CL_CLEAN, pooled;
 
 
     cli_dbgmsg("in cli_scantar()\n");
@@ -1572,7 +2321,10 @@ static int cli_scantar(cli_ctx *ctx, unsigned int posix)
 	return CL_ETMPDIR;
     }
 
+    pooled = cli_member_pool_start(ctx);
     ret = cli_untar(dir, posix, ctx);
+    if(pooled)
+	ret = cli_member_pool_finish(ctx, ret);
 
     if(!ctx->engine->keeptmp)
 	cli_rmdirs(dir);
@@ -1893,91 +2645,45 @@ static int cli_scan_structured(cli_ctx *ctx)
     return CL_CLEAN;
 }
 
+/* The embedded PE is scanned in place as a nested map of the parent, the
+ * data the raw scan has just paged in is reused rather than copied out */
 static int cli_scanembpe(cli_ctx *ctx, off_t offset)
 {
-	int fd, bytes, ret = CL_CLEAN;
-	unsigned long int size = 0, todo;
-	const char *buff;
-	char *tmpname;
+	int ret;
+	size_t size;
 	fmap_t *map = *ctx->fmap;
 	unsigned int corrupted_input;
 
-    tmpname = cli_gentemp(ctx->engine->tmpdir);
-    if(!tmpname)
-	return CL_EMEM;
-
-    if((fd = open(tmpname, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRWXU)) < 0) {
-	cli_errmsg("cli_scanembpe: Can't create file %s\n", tmpname);
-	free(tmpname);
-	return CL_ECREAT;
-    }
-
-    todo = map->len - offset;
-    while(1) {
-	bytes = MIN(todo, map->pgsz);
-	if(!bytes)
-	    break;
-
-	if(!(buff = fmap_need_off_once(map, offset + size, bytes))) {
-	    close(fd);
-	    if(!ctx->engine->keeptmp) {
-		if (cli_unlink(tmpname)) {
-		    free(tmpname);
-		    return CL_EUNLINK;
-		}
-	    }
-	    free(tmpname);
-	    return CL_EREAD;
-	}
-	size += bytes;
-	todo -= bytes;
-
-	if(cli_checklimits("cli_scanembpe", ctx, size, 0, 0)!=CL_CLEAN)
-	    break;
+    if(offset < 0 || (size_t)offset >= map->len)
+	return CL_CLEAN;
 
-	if(cli_writen(fd, buff, bytes) != bytes) {
-	    cli_dbgmsg("cli_scanembpe: Can't write to temporary file\n");
-	    close(fd);
-	    if(!ctx->engine->keeptmp) {
-		if (cli_unlink(tmpname)) {
-		    free(tmpname);
-		    return CL_EUNLINK;
-		}
-	    }
-	    free(tmpname);
-	    return CL_EWRITE;
+    /* an embedded PE over the limits is truncated rather than skipped */
+    size = map->len - offset;
+    if(cli_checklimits("cli_scanembpe", ctx, size, 0, 0) != CL_CLEAN) {
+	if(ctx->engine->maxfilesize && size > ctx->engine->maxfilesize)
+	    size = ctx->engine->maxfilesize;
+	if(ctx->engine->maxscansize) {
+	    if(ctx->scansize >= ctx->engine->maxscansize)
+		size = 0;
+	    else if(size > ctx->engine->maxscansize - ctx->scansize)
+		size = ctx->engine->maxscansize - ctx->scansize;
 	}
+	if(!size)
+	    return CL_CLEAN;
     }
 
     ctx->recursion++;
     corrupted_input = ctx->corrupted_input;
     ctx->corrupted_input = 1;
-    ret = cli_magic_scandesc(fd, ctx);
+    ret = cli_map_scan(map, offset, size, ctx, CL_TYPE_ANY);
     ctx->corrupted_input = corrupted_input;
+    ctx->recursion--;
     if(ret == CL_VIRUS) {
 	cli_dbgmsg("cli_scanembpe: Infected with %s\n", cli_get_last_virus(ctx));
-	close(fd);
-	if(!ctx->engine->keeptmp) {
-	    if (cli_unlink(tmpname)) {
-	    	free(tmpname);
-		return CL_EUNLINK;
-	    }
-	}
-	free(tmpname);	
 	return CL_VIRUS;
     }
-    ctx->recursion--;
-
-    close(fd);
-    if(!ctx->engine->keeptmp) {
-	if (cli_unlink(tmpname)) {
-	    free(tmpname);
-	    return CL_EUNLINK;
-	}
-    }
-    free(tmpname);
 
-    /* intentionally ignore possible errors from cli_magic_scandesc */
+    /* intentionally ignore possible errors from cli_map_scan */
     return CL_CLEAN;
 }
 
@@ -2131,7 +2837,6 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
 	int ret = CL_CLEAN, nret = CL_CLEAN;
 	struct cli_matched_type *ftoffset = NULL, *fpt;
 	uint32_t lastrar;
-	struct cli_exe_info peinfo;
 	unsigned int acmode = AC_SCAN_VIR, break_loop = 0;
 	fmap_t *map = *ctx->fmap;
 	cli_file_t current_container_type = ctx->container_type;
@@ -2192,34 +2897,10 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     break;
                 case CL_TYPE_RARSFX:
                     if(type != CL_TYPE_RAR && have_rar && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_RAR)) {
-                        char *tmpname = NULL;
-                        int tmpfd = fmap_fd(map);
                         ctx->container_type = CL_TYPE_RAR;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
                         cli_dbgmsg("RAR/RAR-SFX signature found at %u\n", (unsigned int) fpt->offset);
-                        /* if map is not file-backed, have to dump to file for scanrar */
-                        if(tmpfd == -1) {
-                            nret = fmap_dump_to_file(map, ctx->engine->tmpdir, &tmpname, &tmpfd);
-                            if(nret != CL_SUCCESS) {
-                                cli_dbgmsg("cli_scanraw: failed to generate temporary file.\n");
-                                ret = nret;
-                                break_loop = 1;
-                                break;
-                            }
-                        }
-                        /* scan existing file */
-                        nret = cli_scanrar(tmpfd, ctx, fpt->offset, &lastrar);
-                        /* if dumped tempfile, need to cleanup */
-                        if(tmpname) {
-                            close(tmpfd);
-                            if(!ctx->engine->keeptmp) {
-                                if (cli_unlink(tmpname)) {
-                                    ret = nret = CL_EUNLINK;
-                                    break_loop = 1;
-                                }
-                            }
-                            free(tmpname);
-                        }
+                        nret = cli_scanrar(ctx, fpt->offset, &lastrar);
                     }
                     break;
 
@@ -2341,14 +3022,9 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                         }
                         ctx->container_type = CL_TYPE_MSEXE; /* PE is a container for another executable here */
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        memset(&peinfo, 0, sizeof(struct cli_exe_info));
-                        peinfo.offset = fpt->offset;
-                        if(cli_peheader(map, &peinfo) == 0) {
+                        if(cli_pe_embedded(map, fpt->offset)) {
                             cli_dbgmsg("*** Detected embedded PE file at %u ***\n", 
                                        (unsigned int) fpt->offset);
-                            if(peinfo.section)
-                                free(peinfo.section);
-                            cli_hashset_destroy(&peinfo.vinfo);
 
                             nret = cli_scanembpe(ctx, fpt->offset);
                             break_loop = 1; /* we can stop here and other
@@ -2438,7 +3114,7 @@ static void emax_reached(cli_ctx *ctx) {
 	return retcode;							\
     } while(0)
 
-static int magic_scandesc_cleanup(cli_ctx *ctx, cli_file_t type, unsigned char *hash, size_t hashed_size, int cache_clean, int retcode, void *parent_property)
+static int magic_scandesc_cleanup(cli_ctx *ctx, cli_file_t type, unsigned char *hash, size_t hashed_size, int cache_clean, unsigned int nested_maps, int retcode, void *parent_property)
 {
     int cb_retcode;
 #if HAVE_JSON
@@ -2479,10 +3155,11 @@ static int magic_scandesc_cleanup(cli_ctx *ctx, cli_file_t type, unsigned char *
         }
         perf_stop(ctx, PERFT_POSTCB);
     }
-    if (cb_retcode == CL_CLEAN && cache_clean) {
+    /* a scan cut short by the budget is incomplete all the way up */
+    if (cb_retcode == CL_CLEAN && cache_clean && !cli_budget_exceeded(ctx)) {
         perf_start(ctx, PERFT_CACHE);
         if (!(SCAN_PROPERTIES))
-            cache_add(hash, hashed_size, ctx);
+            cache_add(hash, hashed_size, ctx, ctx->nested_maps == nested_maps);
         perf_stop(ctx, PERFT_CACHE);
     }
     if (retcode == CL_VIRUS && SCAN_ALL)
@@ -2530,7 +3207,41 @@ static int dispatch_prescan(clcb_pre_scan cb, cli_ctx *ctx, const char *filetype
     return res;
 }
 
-static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
+/* Scan probe, see cl_scan_probe_register(). Returns the phase to restore
+ * with probe_pop(). */
+static unsigned int probe_push(struct cl_scan_probe *probe, const char *type)
+{
+    unsigned int phase = probe->phase;
+
+    probe->seq++;
+    __sync_synchronize();
+    if (probe->depth < CL_PROBE_DEPTH)
+        probe->types[probe->depth] = type;
+    probe->depth++;
+    probe->phase = CL_PROBE_PARSE;
+    __sync_synchronize();
+    probe->seq++;
+    return phase;
+}
+
+static void probe_pop(struct cl_scan_probe *probe, unsigned int phase)
+{
+    probe->seq++;
+    __sync_synchronize();
+    probe->depth--;
+    probe->phase = phase;
+    __sync_synchronize();
+    probe->seq++;
+}
+
+/* once the type is known; a single pointer, no need for seq */
+static void probe_settype(struct cl_scan_probe *probe, const char *type)
+{
+    if (probe->depth && probe->depth <= CL_PROBE_DEPTH)
+        probe->types[probe->depth - 1] = type;
+}
+
+static int magic_scandesc_typed(cli_ctx *ctx, cli_file_t type, cli_file_t *scanned_type)
 {
 	int ret = CL_CLEAN;
 	cli_file_t dettype = 0;
@@ -2542,6 +3253,8 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 	const char *filetype;
 	int cache_clean = 0, res;
     int run_cleanup = 0;
+    unsigned int nested_maps = ctx->nested_maps;
+    uint64_t usage_hash;
 #if HAVE_JSON
 	struct json_object *parent_property = NULL;
 #else
@@ -2560,11 +3273,17 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 
     if(ctx->engine->maxreclevel && ctx->recursion > ctx->engine->maxreclevel) {
         cli_dbgmsg("cli_magic_scandesc: Archive recursion limit exceeded (%u, max: %u)\n", ctx->recursion, ctx->engine->maxreclevel);
+	cli_usage_limit(ctx, CL_LIMIT_RECURSION);
 	emax_reached(ctx);
         cli_check_blockmax(ctx, CL_EMAXREC);
 	early_ret_from_magicscan(CL_CLEAN);
     }
 
+    if((ret = cli_checkbudget(ctx)) != CL_SUCCESS) {
+	emax_reached(ctx);
+	early_ret_from_magicscan(ret);
+    }
+
     if(cli_updatelimits(ctx, (*ctx->fmap)->len)!=CL_CLEAN) {
 	emax_reached(ctx);
         early_ret_from_magicscan(CL_CLEAN);
@@ -2584,6 +3303,9 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 	early_ret_from_magicscan(CL_EREAD);
     }
     filetype = cli_ftname(type);
+    *scanned_type = type;
+    if (ctx->probe)
+        probe_settype(ctx->probe, filetype);
 
 #if HAVE_JSON
     if (ctx->options & CL_SCAN_FILE_PROPERTIES) {
@@ -2657,12 +3379,13 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     ret = dispatch_prescan(ctx->engine->cb_pre_cache, ctx, filetype, old_hook_lsig_matches, parent_property, hash, hashed_size, &run_cleanup);
     if (run_cleanup) {
         if (ret == CL_VIRUS)
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, cli_checkfp(hash, hashed_size, ctx), parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, cli_checkfp(hash, hashed_size, ctx), parent_property);
         else
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, CL_CLEAN, parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, CL_CLEAN, parent_property);
     }
 
     perf_start(ctx, PERFT_CACHE);
+    usage_hash = cli_usage_start(ctx);
     if (!(SCAN_PROPERTIES))
         res = cache_check(hash, ctx);
 
@@ -2689,6 +3412,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 
     if(res != CL_VIRUS) {
 	perf_stop(ctx, PERFT_CACHE);
+	cli_usage_stop(ctx, usage_hash, CLI_USAGE_HASH);
 #if HAVE_JSON
         ctx->wrkproperty = parent_property;
 #endif
@@ -2696,11 +3420,13 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     }
 
     perf_stop(ctx, PERFT_CACHE);
+    cli_usage_stop(ctx, usage_hash, CLI_USAGE_HASH);
     hashed_size = (*ctx->fmap)->len;
     ctx->hook_lsig_matches = NULL;
 
     if(!(ctx->options&~CL_SCAN_ALLMATCHES) || (ctx->recursion == ctx->engine->maxreclevel)) { /* raw mode (stdin, etc.) or last level of recursion */
 	if(ctx->recursion == ctx->engine->maxreclevel) {
+            cli_usage_limit(ctx, CL_LIMIT_RECURSION);
             cli_check_blockmax(ctx, CL_EMAXREC);
 	    cli_dbgmsg("cli_magic_scandesc: Hit recursion limit, only scanning raw file\n");
         }
@@ -2710,9 +3436,9 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     ret = dispatch_prescan(ctx->engine->cb_pre_scan, ctx, filetype, old_hook_lsig_matches, parent_property, hash, hashed_size, &run_cleanup);
     if (run_cleanup) {
         if (ret == CL_VIRUS)
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, cli_checkfp(hash, hashed_size, ctx), parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, cli_checkfp(hash, hashed_size, ctx), parent_property);
         else
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, ret, parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, ret, parent_property);
     }
 	/* ret_from_magicscan can be used below here*/
 	if((ret = cli_fmap_scandesc(ctx, 0, 0, NULL, AC_SCAN_VIR, NULL, hash)) == CL_VIRUS)
@@ -2725,15 +3451,15 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 	}
 
 	ctx->hook_lsig_matches = old_hook_lsig_matches;
-	return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, ret, parent_property);
+	return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, ret, parent_property);
     }
 
     ret = dispatch_prescan(ctx->engine->cb_pre_scan, ctx, filetype, old_hook_lsig_matches, parent_property, hash, hashed_size, &run_cleanup);
     if (run_cleanup) {
         if (ret == CL_VIRUS)
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, cli_checkfp(hash, hashed_size, ctx), parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, cli_checkfp(hash, hashed_size, ctx), parent_property);
         else
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, ret, parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, ret, parent_property);
     }
     /* ret_from_magicscan can be used below here*/
 
@@ -2744,7 +3470,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     ctx->hook_lsig_matches = cli_bitset_init();
     if (!ctx->hook_lsig_matches) {
 	ctx->hook_lsig_matches = old_hook_lsig_matches;
-    return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, CL_EMEM, parent_property);
+    return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, CL_EMEM, parent_property);
     }
 
     if(type != CL_TYPE_IGNORED && ctx->engine->sdb) {
@@ -2752,7 +3478,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 	    ret = cli_checkfp(hash, hashed_size, ctx);
 	    cli_bitset_free(ctx->hook_lsig_matches);
 	    ctx->hook_lsig_matches = old_hook_lsig_matches;
-        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, ret, parent_property);
+        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, ret, parent_property);
 	}
     }
 
@@ -2795,24 +3521,8 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 
 	case CL_TYPE_RAR:
 	    ctx->container_type = CL_TYPE_RAR;
-	    if(have_rar && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_RAR)) {
-		char *tmpname = NULL;
-		int desc = fmap_fd(*ctx->fmap);
-		if (desc == -1) {
-		    cli_dbgmsg("fmap not backed by file, dumping ...\n");
-		    ret = fmap_dump_to_file(*ctx->fmap, ctx->engine->tmpdir, &tmpname, &desc);
-		    if (ret != CL_SUCCESS) {
-			cli_dbgmsg("fmap_fd: failed to generate temporary file.\n");
-			break;
-		    }
-		}
-		ret = cli_scanrar(desc, ctx, 0, NULL);
-		if (tmpname) {
-		    close(desc);
-		    unlink(tmpname);
-		    free(tmpname);
-		}
-	    }
+	    if(have_rar && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_RAR))
+		ret = cli_scanrar(ctx, 0, NULL);
 	    break;
 
 	case CL_TYPE_OOXML_WORD:
@@ -3105,7 +3815,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 	ret = cli_checkfp(hash, hashed_size, ctx);
 	cli_bitset_free(ctx->hook_lsig_matches);
 	ctx->hook_lsig_matches = old_hook_lsig_matches;
-    return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, ret, parent_property);
+    return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, ret, parent_property);
     }
 
     if(type == CL_TYPE_ZIP && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_ZIP)) {
@@ -3135,7 +3845,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 		    cli_dbgmsg("Descriptor[%d]: cli_scanraw error %s\n", fmap_fd(*ctx->fmap), cl_strerror(res));
 		    cli_bitset_free(ctx->hook_lsig_matches);
 		    ctx->hook_lsig_matches = old_hook_lsig_matches;
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, res, parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, res, parent_property);
 		/* CL_VIRUS = malware found, check FP and report */
 		case CL_VIRUS:
 		    ret = cli_checkfp(hash, hashed_size, ctx);
@@ -3143,7 +3853,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 			break;
 		    cli_bitset_free(ctx->hook_lsig_matches);
 		    ctx->hook_lsig_matches = old_hook_lsig_matches;
-            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, ret, parent_property);
+            return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, ret, parent_property);
 		/* "MAX" conditions should still fully scan the current file */
 		case CL_EMAXREC:
 		case CL_EMAXSIZE:
@@ -3218,48 +3928,263 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 #if HAVE_JSON
         ctx->wrkproperty = parent_property;
 #endif
-        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, CL_CLEAN, parent_property);
+        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, CL_CLEAN, parent_property);
 	case CL_CLEAN:
 	    cache_clean = 1;
 #if HAVE_JSON
         ctx->wrkproperty = parent_property;
 #endif
-        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, CL_CLEAN, parent_property);
+        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, CL_CLEAN, parent_property);
 	default:
-        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, ret, parent_property);
+        return magic_scandesc_cleanup(ctx, type, hash, hashed_size, cache_clean, nested_maps, ret, parent_property);
     }
 }
 
-static int cli_base_scandesc(int desc, cli_ctx *ctx, cli_file_t type)
+static void scanstat_add(cli_ctx *ctx, cli_file_t type, size_t len, uint64_t usec)
 {
-    STATBUF sb;
-    int ret;
+    struct cli_scanstat *stat;
 
-#ifdef HAVE__INTERNAL__SHA_COLLECT
-    if(ctx->sha_collect>0) ctx->sha_collect = 0;
-#endif
-    cli_dbgmsg("in cli_magic_scandesc (reclevel: %u/%u)\n", ctx->recursion, ctx->engine->maxreclevel);
-    if(FSTAT(desc, &sb) == -1) {
-	cli_errmsg("magic_scandesc: Can't fstat descriptor %d\n", desc);
-	early_ret_from_magicscan(CL_ESTAT);
-    }
-    if(sb.st_size <= 5) {
-	cli_dbgmsg("Small data (%u bytes)\n", (unsigned int) sb.st_size);
-	early_ret_from_magicscan(CL_CLEAN);
+    if (!ctx->engine)
+        return;
+    if (type >= CL_TYPENO && type < CL_TYPE_IGNORED)
+        stat = (struct cli_scanstat *)&ctx->engine->scanstats[type - CL_TYPENO + 1];
+    else
+        stat = (struct cli_scanstat *)&ctx->engine->scanstats[0];
+    __sync_fetch_and_add(&stat->files, 1);
+    __sync_fetch_and_add(&stat->bytes, len);
+    __sync_fetch_and_add(&stat->usec, usec);
+}
+
+/* Scan profile, see cl_engine_set_clcb_profile() */
+#define CLI_PROFILE_MAXNODES 100000
+
+/* Opens the node of an object, returns its index + 1 or 0 if it isn't
+ * recorded */
+static unsigned int profile_push(cli_ctx *ctx, cli_file_t type, uint64_t now)
+{
+    struct cli_profile *prof = ctx->profile;
+    struct cli_profile_node *node;
+    const fmap_t *map = *ctx->fmap;
+
+    if (prof->count == prof->size) {
+        unsigned int size = prof->size ? prof->size * 2 : 64;
+
+        if (size > CLI_PROFILE_MAXNODES)
+            size = CLI_PROFILE_MAXNODES;
+        if (prof->count >= size || !(node = cli_realloc(prof->nodes, size * sizeof(*node))))
+            return 0;
+        prof->nodes = node;
+        prof->size = size;
     }
+    node = &prof->nodes[prof->count++];
+    node->type = type;
+    node->depth = prof->current ? prof->nodes[prof->current - 1].depth + 1 : 0;
+    node->parent = prof->current;
+    node->size = map->len;
+    node->usec = now;
+    node->read = map->bytes_read;
+    node->inflated = prof->inflated;
+    node->matcher = prof->matcher;
+    node->map = map;
+    node->child_read = 0;
+    prof->current = prof->count;
+    return prof->count;
+}
 
-    ctx->fmap++;
-    perf_start(ctx, PERFT_MAP);
-    if(!(*ctx->fmap = fmap(desc, 0, sb.st_size))) {
-	cli_errmsg("CRITICAL: fmap() failed\n");
-	ctx->fmap--;
-	perf_stop(ctx, PERFT_MAP);
-	early_ret_from_magicscan(CL_EMEM);
+/* Turns the counters of the node into what the object took; what was read
+ * through the map of the parent is already in the parent's count */
+static void profile_pop(cli_ctx *ctx, unsigned int id, cli_file_t type, uint64_t now)
+{
+    struct cli_profile *prof = ctx->profile;
+    struct cli_profile_node *node = &prof->nodes[id - 1], *parent;
+
+    node->type = type;
+    node->usec = now > node->usec ? now - node->usec : 0;
+    node->read = node->map->bytes_read - node->read + node->child_read;
+    node->inflated = prof->inflated - node->inflated;
+    node->matcher = prof->matcher - node->matcher;
+    prof->current = node->parent;
+    if (node->parent) {
+        parent = &prof->nodes[node->parent - 1];
+        if (parent->map != node->map)
+            parent->child_read += node->read;
     }
-    perf_stop(ctx, PERFT_MAP);
+    node->map = NULL;
+}
 
-    ret = magic_scandesc(ctx, type);
+static int profile_node_json(char *buf, size_t size, const char *name, const struct cli_profile_node *node)
+{
+    return snprintf(buf, size, "{\"name\":\"%s\",\"value\":%llu,\"size\":%llu,\"read\":%llu,\"inflated\":%llu,\"matcher\":%llu,\"children\":[",
+                    name, (long long unsigned)node->usec, (long long unsigned)node->size, (long long unsigned)node->read,
+                    (long long unsigned)node->inflated, (long long unsigned)node->matcher);
+}
 
+/* The nodes under a root named "scan" which adds up the objects scanned at
+ * the top level (the file and, with file properties, their JSON) */
+static char *profile_json(const struct cli_profile *prof)
+{
+    struct cli_profile_node root;
+    const struct cli_profile_node *node;
+    unsigned int i, depth, prev = 0;
+    size_t len, size = 4096;
+    const char *name;
+    char *buf, *tmp;
+
+    memset(&root, 0, sizeof(root));
+    for (i = 0; i < prof->count; i++) {
+        node = &prof->nodes[i];
+        if (node->depth)
+            continue;
+        root.usec += node->usec;
+        root.size += node->size;
+        root.read += node->read;
+        root.inflated += node->inflated;
+        root.matcher += node->matcher;
+    }
+    if (!(buf = cli_malloc(size)))
+        return NULL;
+    len = profile_node_json(buf, size, "scan", &root);
+
+    for (i = 0; i <= prof->count; i++) {
+        node = i < prof->count ? &prof->nodes[i] : NULL;
+        depth = node ? node->depth + 1 : 0;
+        if (size - len < 512 + 2 * (prev + 1)) {
+            size = size * 2 + 2 * (prev + 1);
+            if (!(tmp = cli_realloc(buf, size))) {
+                free(buf);
+                return NULL;
+            }
+            buf = tmp;
+        }
+        if (depth <= prev) {
+            /* close the previous object and its parents up to this level */
+            for (; prev >= depth; prev--) {
+                buf[len++] = ']';
+                buf[len++] = '}';
+                if (!prev)
+                    break;
+            }
+            if (!node)
+                break;
+            buf[len++] = ',';
+        }
+        name = cli_ftname(node->type);
+        len += profile_node_json(buf + len, size - len, name ? name : "CL_TYPE_ANY", node);
+        prev = depth;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static void profile_report(cli_ctx *ctx, int desc)
+{
+    char *json;
+
+    if (!ctx->profile->count)
+        return;
+    if (!(json = profile_json(ctx->profile))) {
+        cli_errmsg("scan_common: no memory for the scan profile\n");
+        return;
+    }
+    ctx->engine->cb_profile(desc, json, ctx->cb_ctx);
+    free(json);
+}
+
+/* count the object in the engine's per file type statistics; the
+ * contained objects are scanned from inside magic_scandesc_typed(), their
+ * time is taken out of the time of the container */
+static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
+{
+    struct timeval tv_start, tv_end;
+    uint64_t usec, parent_child = ctx->scanstat_child;
+    size_t len = (*ctx->fmap)->len;
+    unsigned int prof = 0, phase = 0;
+    int ret;
+
+    ctx->scanstat_child = 0;
+    gettimeofday(&tv_start, NULL);
+    if (cli_usage(ctx))
+        cli_usage_object(ctx);
+    if (ctx->profile)
+        prof = profile_push(ctx, type, (uint64_t)tv_start.tv_sec * 1000000 + tv_start.tv_usec);
+    if (ctx->probe)
+        phase = probe_push(ctx->probe, cli_ftname(type));
+    ret = magic_scandesc_typed(ctx, type, &type);
+    if (ctx->probe)
+        probe_pop(ctx->probe, phase);
+    gettimeofday(&tv_end, NULL);
+    if (prof)
+        profile_pop(ctx, prof, type, (uint64_t)tv_end.tv_sec * 1000000 + tv_end.tv_usec);
+    usec = (tv_end.tv_sec - tv_start.tv_sec) * 1000000 + tv_end.tv_usec - tv_start.tv_usec;
+    if ((int64_t)usec < 0)
+        usec = 0;
+
+    scanstat_add(ctx, type, len, usec > ctx->scanstat_child ? usec - ctx->scanstat_child : 0);
+    ctx->scanstat_child = parent_child + usec;
+    return ret;
+}
+
+int cl_engine_get_scanstats(const struct cl_engine *engine, struct cl_scanstat *stats, unsigned int *count)
+{
+    unsigned int i, n = 0;
+    const char *name;
+
+    if (!engine || !count || (*count && !stats)) {
+        cli_errmsg("cl_engine_get_scanstats: NULL argument\n");
+        return CL_ENULLARG;
+    }
+    for (i = 0; i < CLI_SCANSTAT_TYPES; i++) {
+        const struct cli_scanstat *stat = &engine->scanstats[i];
+
+        if (!stat->files)
+            continue;
+        if (n < *count) {
+            name = i ? cli_ftname(i + CL_TYPENO - 1) : NULL;
+            strncpy(stats[n].name, name ? name : "CL_TYPE_ANY", sizeof(stats[n].name) - 1);
+            stats[n].name[sizeof(stats[n].name) - 1] = '\0';
+            stats[n].files = stat->files;
+            stats[n].bytes = stat->bytes;
+            stats[n].usec = stat->usec;
+        }
+        n++;
+    }
+    *count = n;
+    return CL_SUCCESS;
+}
+
+static int cli_base_scandesc(int desc, cli_ctx *ctx, cli_file_t type)
+{
+    STATBUF sb;
+    int ret;
+
+#ifdef HAVE__INTERNAL__SHA_COLLECT
+    if(ctx->sha_collect>0) ctx->sha_collect = 0;
+#endif
+    cli_dbgmsg("in cli_magic_scandesc (reclevel: %u/%u)\n", ctx->recursion, ctx->engine->maxreclevel);
+    if(FSTAT(desc, &sb) == -1) {
+	cli_errmsg("magic_scandesc: Can't fstat descriptor %d\n", desc);
+	early_ret_from_magicscan(CL_ESTAT);
+    }
+    if(sb.st_size <= 5) {
+	cli_dbgmsg("Small data (%u bytes)\n", (unsigned int) sb.st_size);
+	early_ret_from_magicscan(CL_CLEAN);
+    }
+
+    ctx->fmap++;
+    ctx->nested_maps++;
+    perf_start(ctx, PERFT_MAP);
+    if(!(*ctx->fmap = fmap(desc, 0, sb.st_size))) {
+	cli_errmsg("CRITICAL: fmap() failed\n");
+	ctx->fmap--;
+	perf_stop(ctx, PERFT_MAP);
+	early_ret_from_magicscan(CL_EMEM);
+    }
+    perf_stop(ctx, PERFT_MAP);
+
+    ret = magic_scandesc(ctx, type);
+
+    if (cli_usage(ctx))
+        cli_usage_read(ctx, (*ctx->fmap)->bytes_read);
     funmap(*ctx->fmap);
     ctx->fmap--;
     return ret;
@@ -3392,6 +4317,7 @@ int cli_map_scandesc(cl_fmap_t *map, off_t offset, size_t length, cli_ctx *ctx,
 	return CL_CLEAN;
     }
     ctx->fmap++;
+    ctx->nested_maps++;
     *ctx->fmap = map;
     /* can't change offset because then we'd have to discard/move cached
      * data, instead use another offset to reuse the already cached data */
@@ -3427,9 +4353,1094 @@ int cli_mem_scandesc(const void *buffer, size_t length, cli_ctx *ctx)
     return ret;
 }
 
-static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context)
+/* path is the name of the temporary file, NULL for one from cli_gentempfd() */
+void cli_extract_init(struct cli_extract *x, cli_ctx *ctx, const char *path)
+{
+    memset(x, 0, sizeof(*x));
+    x->ctx = ctx;
+    x->fd = -1;
+    x->path = path;
+}
+
+void cli_extract_expect(struct cli_extract *x, uint64_t size)
+{
+    x->expect = size;
+}
+
+static void extract_putbuf(struct cli_extract *x)
+{
+    cli_ctx *ctx = x->ctx;
+
+    if (!x->buf)
+	return;
+    if (!ctx->extract_spare) {
+	ctx->extract_spare = x->buf;
+	ctx->extract_sparesize = x->size;
+    } else {
+	free(x->buf);
+	cli_memgov_release(ctx->engine, x->size);
+    }
+    x->buf = NULL;
+    x->size = 0;
+}
+
+static int extract_grow(struct cli_extract *x, size_t need, size_t max)
+{
+    cli_ctx *ctx = x->ctx;
+    unsigned char *buf;
+    size_t size;
+
+    if (!x->buf && ctx->extract_spare) {
+	x->buf = ctx->extract_spare;
+	x->size = ctx->extract_sparesize;
+	ctx->extract_spare = NULL;
+	ctx->extract_sparesize = 0;
+	if (need <= x->size)
+	    return CL_SUCCESS;
+    }
+    size = x->size ? x->size : CLI_EXTRACT_MINBUF;
+    while (size < need)
+	size *= 2;
+    if (size > max)
+	size = max;
+    /* the buffer comes out of the engine's decompression memory, if it
+     * runs short the object goes to a temporary file */
+    if (size > x->size && cli_memgov_reserve(ctx, size - x->size, 0) != CL_SUCCESS)
+	return CL_EMEM;
+    if (!(buf = cli_realloc(x->buf, size))) {
+	if (size > x->size)
+	    cli_memgov_release(ctx->engine, size - x->size);
+	return CL_EMEM;
+    }
+    x->buf = buf;
+    x->size = size;
+    return CL_SUCCESS;
+}
+
+/* Moves the data collected so far to the temporary file */
+static int extract_spill(struct cli_extract *x)
+{
+    int ret;
+
+    if (x->path) {
+	if ((x->fd = open(x->path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRUSR|S_IWUSR)) == -1) {
+	    cli_warnmsg("cli_extract: failed to create temporary file %s\n", x->path);
+	    return CL_ETMPFILE;
+	}
+    } else if ((ret = cli_gentempfd(x->ctx->engine->tmpdir, &x->tmpname, &x->fd)) != CL_SUCCESS) {
+	cli_dbgmsg("cli_extract: Can't generate temporary file.\n");
+	return ret;
+    }
+    if (x->len) {
+	cli_dbgmsg("cli_extract: moving %lu bytes to %s\n", (unsigned long)x->len, x->path ? x->path : x->tmpname);
+	if (cli_writen(x->fd, x->buf, x->len) != (int)x->len)
+	    return CL_EWRITE;
+    }
+    extract_putbuf(x);
+    return CL_SUCCESS;
+}
+
+static uint64_t extract_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int extract_feed(struct cli_extract *x, const void *data, size_t len)
+{
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < 2; i++) {
+	if (x->stream[i] && (ret = cli_stream_scan_update(x->stream[i], data, len)) != CL_SUCCESS) {
+	    if (ret == CL_BREAK)
+		x->again = 1;
+	    return ret;
+	}
+    }
+    return CL_SUCCESS;
+}
+
+/* Drops the scan started by extract_stream(), along with what it counted */
+static void extract_unstream(struct cli_extract *x)
+{
+    cli_ctx *ctx = x->ctx;
+
+    cli_stream_scan_free(x->stream[1]);
+    cli_stream_scan_free(x->stream[0]);
+    x->stream[0] = x->stream[1] = NULL;
+    ctx->scansize = x->scansize;
+    ctx->scannedfiles = x->scannedfiles;
+    if (ctx->scanned)
+	*ctx->scanned = x->scanned;
+}
+
+/* Starts scanning the object as it's extracted, instead of writing it to a
+ * temporary file, when what magic_scandesc() would do with it comes down to
+ * the raw scan: text too large for the normalisation and binary data, or
+ * any type in raw mode and at the last recursion level. The type is taken
+ * from the data collected so far. */
+static void extract_stream(struct cli_extract *x)
+{
+    cli_ctx *ctx = x->ctx;
+    const struct cl_engine *engine = ctx->engine;
+    cli_file_t type = CL_TYPE_ANY;
+    unsigned int acmode = AC_SCAN_VIR;
+    fmap_t *map;
+    int raw, ret;
+
+    if (x->expect <= x->len || x->len < MAGIC_BUFFER_SIZE || (size_t)x->expect != x->expect ||
+	ctx->member_pool || engine->keeptmp || (engine->engine_options & ENGINE_OPTIONS_FORCE_TO_DISK) ||
+	SCAN_ALL || SCAN_PROPERTIES || engine->patch || ctx->overlay ||
+	engine->cb_pre_cache || engine->cb_pre_scan || engine->cb_post_scan ||
+	(engine->maxreclevel && ctx->recursion > engine->maxreclevel))
+	return;
+
+    raw = !(ctx->options & ~CL_SCAN_ALLMATCHES) || ctx->recursion == engine->maxreclevel;
+    if (!raw) {
+	if (!(map = cl_fmap_open_memory(x->buf, x->len)))
+	    return;
+	type = cli_filetype2(map, engine, CL_TYPE_ANY);
+	funmap(map);
+	switch (type) {
+	    case CL_TYPE_TEXT_ASCII:
+		if (SCAN_STRUCTURED && (DCONF_OTHER & OTHER_CONF_DLP))
+		    return;
+		/* fall through */
+	    case CL_TYPE_TEXT_UTF8:
+		if (ctx->container_type == CL_TYPE_MAIL ||
+		    ((DCONF_DOC & DOC_CONF_SCRIPT) && SCAN_HTML && x->expect <= engine->maxscriptnormalize))
+		    return;
+		break;
+	    case CL_TYPE_BINARY_DATA:
+		break;
+	    default:
+		return;
+	}
+	acmode |= AC_SCAN_FT;
+    }
+
+    x->scansize = ctx->scansize;
+    x->scannedfiles = ctx->scannedfiles;
+    x->scanned = ctx->scanned ? *ctx->scanned : 0;
+    if (cli_updatelimits(ctx, x->expect) != CL_CLEAN)
+	return;
+    x->start = extract_usec();
+    ret = cli_stream_scan_new(&x->stream[0], ctx, x->expect, type == CL_TYPE_TEXT_ASCII ? 0 : type, 0, acmode);
+    if (ret == CL_SUCCESS && type == CL_TYPE_BINARY_DATA)
+	ret = cli_stream_scan_new(&x->stream[1], ctx, x->expect, CL_TYPE_OTHER, 1, AC_SCAN_VIR);
+    if (ret == CL_SUCCESS)
+	ret = extract_feed(x, x->buf, x->len);
+    if (ret != CL_SUCCESS) {
+	extract_unstream(x);
+	x->again = 0;
+	return;
+    }
+    cli_dbgmsg("cli_extract: scanning %llu bytes of %s while extracting them\n", (long long unsigned)x->expect, cli_ftname(type));
+    x->type = type;
+    x->hlen = x->len;
+}
+
+int cli_extract_write(struct cli_extract *x, const void *data, size_t len)
+{
+    const struct cl_engine *engine = x->ctx->engine;
+    size_t need = x->len + len;
+    int ret;
+
+    if (!len)
+	return CL_SUCCESS;
+    if ((ret = cli_budget_inflate(x->ctx, len)) != CL_SUCCESS)
+	return ret;
+    if (x->expect && x->fd == -1 && !x->stream[0] && need > engine->extract_mem && need > x->len)
+	extract_stream(x);
+    if (x->stream[0]) {
+	if ((ret = extract_feed(x, data, len)) != CL_SUCCESS)
+	    return ret;
+	x->len = need;
+	return CL_SUCCESS;
+    }
+    if (x->fd == -1) {
+	if (engine->keeptmp || (engine->engine_options & ENGINE_OPTIONS_FORCE_TO_DISK) ||
+	    need < x->len || need > engine->extract_mem ||
+	    (need > x->size && extract_grow(x, need, engine->extract_mem) != CL_SUCCESS)) {
+	    if ((ret = extract_spill(x)) != CL_SUCCESS)
+		return ret;
+	} else {
+	    memcpy(x->buf + x->len, data, len);
+	    x->len = need;
+	    return CL_SUCCESS;
+	}
+    }
+    if (cli_writen(x->fd, data, len) != (int)len)
+	return CL_EWRITE;
+    x->len = need;
+    return CL_SUCCESS;
+}
+
+/* Room for len bytes to be decoded straight into the buffer, NULL when the
+ * object doesn't go to memory; cli_extract_commit() then adds what was
+ * actually decoded */
+unsigned char *cli_extract_reserve(struct cli_extract *x, size_t len)
+{
+    const struct cl_engine *engine = x->ctx->engine;
+    size_t need = x->len + len;
+
+    if (!len || x->fd != -1 || x->stream[0] || x->range ||
+	engine->keeptmp || (engine->engine_options & ENGINE_OPTIONS_FORCE_TO_DISK) ||
+	need < x->len || need > engine->extract_mem ||
+	(need > x->size && extract_grow(x, need, engine->extract_mem) != CL_SUCCESS))
+	return NULL;
+    return x->buf + x->len;
+}
+
+int cli_extract_commit(struct cli_extract *x, size_t len)
+{
+    int ret;
+
+    if ((ret = cli_budget_inflate(x->ctx, len)) != CL_SUCCESS)
+	return ret;
+    x->len += len;
+    return CL_SUCCESS;
+}
+
+/* Collects a range of the map as if it was extracted */
+static int extract_copy(struct cli_extract *x, fmap_t *map, size_t offset, size_t len)
 {
+    const void *data;
+    size_t todo;
+    int ret;
+
+    while (len) {
+	todo = MIN(len, map->pgsz);
+	if (!(data = fmap_need_off_once(map, offset, todo)))
+	    return CL_EREAD;
+	if ((ret = cli_extract_write(x, data, todo)) != CL_SUCCESS)
+	    return ret;
+	offset += todo;
+	len -= todo;
+    }
+    return CL_SUCCESS;
+}
+
+/* For the consumers which need a descriptor */
+int cli_extract_fd(struct cli_extract *x, int *fd)
+{
+    size_t len;
+    int ret;
+
+    if (x->stream[0]) {
+	x->again = 1;
+	return CL_BREAK;
+    }
+    if (x->range) {
+	len = x->len;
+	x->range = 0;
+	x->len = 0;
+	if ((ret = extract_copy(x, x->map, x->offset, len)) != CL_SUCCESS)
+	    return ret;
+    }
+    if (x->fd == -1 && (ret = extract_spill(x)) != CL_SUCCESS)
+	return ret;
+    if (lseek(x->fd, 0, SEEK_SET) == -1) {
+	cli_dbgmsg("cli_extract: call to lseek() failed\n");
+	return CL_ESEEK;
+    }
+    *fd = x->fd;
+    return CL_SUCCESS;
+}
+
+/* For the consumers which read the data back: a map of the buffer, or of
+ * the temporary file if the object went to disk; funmap() it when done */
+fmap_t *cli_extract_map(struct cli_extract *x)
+{
+    int fd;
+
+    if (x->range)
+	return fmap_duplicate(x->map, x->offset, x->len);
+    if (x->fd == -1 && !x->stream[0])
+	return cl_fmap_open_memory(x->buf, x->len);
+    if (cli_extract_fd(x, &fd) != CL_SUCCESS)
+	return NULL;
+    return fmap(fd, 0, 0);
+}
+
+/* Leaves the file created by cli_extract_fd() to the caller, who's then in
+ * charge of removing it */
+void cli_extract_keep(struct cli_extract *x)
+{
+    if (x->fd != -1) {
+	close(x->fd);
+	x->fd = -1;
+    }
+    free(x->tmpname);
+    x->tmpname = NULL;
+}
+
+/* Parallel scan of archive members (CL_ENGINE_ARCHIVE_THREADS).
+ *
+ * While a large zip or tar archive is unpacked, cli_extract_scan() hands
+ * each member over to a set of threads instead of scanning it in place. A
+ * member is scanned with a context of its own, which records the detections
+ * instead of reporting them; the detections, the limits and the counters are
+ * merged back into the archive's context in member order, as if the members
+ * had been scanned one after the other. Once a member is found infected (and
+ * not in allmatch mode) the members after it are dropped, nested extraction
+ * in the ones being scanned is stopped by cli_checklimits() and unpacking
+ * ends. At most twice as many members as threads are queued or being
+ * scanned, each one in memory or in its temporary file.
+ */
+struct cli_member_hit {
+    const char *virname;
+    int hashed;
+    unsigned long long size;
+    char md5[33];
+};
+
+struct cli_member_job {
+    struct cli_member_job *next;
+    struct cli_member_pool *pool;
+    unsigned int seq;
+    /* the member, in memory, in a temporary file or mapped from a range of
+     * the archive, see cli_member_scan_range() */
+    unsigned char *buf;
+    size_t len, size;
+    int fd;
+    char *tmpname;
+    fmap_t *map;
+    cli_file_t type;
+    /* state of the archive's context when the member was extracted */
+    unsigned int recursion;
+    cli_file_t container_type;
+    size_t container_size;
+    unsigned long scansize;
+    unsigned int scannedfiles;
+    int limit_exceeded;
+    fmap_t parent; /* stands for the archive's fmaps in emax_reached() */
+    struct cli_member_key key; /* see cli_member_cache_check() */
+    int keyed;
+    /* outcome */
+    int done, ret;
+    struct cli_member_hit *hits;
+    unsigned int nhits;
+    unsigned long scanned;
+    unsigned int found_possibly_unwanted;
+    uint64_t usec;
+};
+
+void cli_member_virus(struct cli_member_job *job, const char *virname)
+{
+    struct cli_member_hit *hits;
+
+    if (!(hits = cli_realloc(job->hits, (job->nhits + 1) * sizeof(*hits))))
+	return;
+    job->hits = hits;
+    memset(&hits[job->nhits], 0, sizeof(*hits));
+    hits[job->nhits++].virname = virname;
+}
+
+void cli_member_hash(struct cli_member_job *job, unsigned long long size, const char *md5)
+{
+    struct cli_member_hit *hit;
+
+    if (!job->nhits)
+	return;
+    hit = &job->hits[job->nhits - 1];
+    hit->hashed = 1;
+    hit->size = size;
+    strncpy(hit->md5, md5, 32);
+    hit->md5[32] = 0;
+}
+
+#ifdef CL_THREAD_SAFE
+struct cli_member_pool {
+    const struct cl_engine *engine;
+    unsigned int options;
+    struct cli_dconf *dconf;
+    const struct cl_engine *overlay;
+    void *cb_ctx;
+    struct cli_budget *budget;
+    unsigned int recursion;
+    unsigned int threads, started, idle, max_pending;
+    pthread_t tid[CLI_MAX_ARCHIVE_THREADS];
+    struct cli_member_job *head, *tail, *next;
+    unsigned int seq, pending;
+    volatile unsigned int stop; /* seq of the first infected member */
+    int quit, found;
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+};
+
+int cli_member_cancelled(const cli_ctx *ctx)
+{
+    const struct cli_member_job *job = ctx->member_job;
+
+    return job && job->seq > job->pool->stop;
+}
+
+static void member_job_release(struct cli_member_pool *pool, struct cli_member_job *job)
+{
+    if (job->buf) {
+	free(job->buf);
+	cli_memgov_release(pool->engine, job->size);
+	job->buf = NULL;
+	job->size = 0;
+    }
+    if (job->fd != -1) {
+	close(job->fd);
+	job->fd = -1;
+	if (job->tmpname && !pool->engine->keeptmp)
+	    cli_unlink(job->tmpname);
+    }
+    free(job->tmpname);
+    job->tmpname = NULL;
+    if (job->map) {
+	funmap(job->map);
+	job->map = NULL;
+    }
+}
+
+static void member_job_scan(struct cli_member_pool *pool, struct cli_member_job *job)
+{
+    const char *virname = NULL;
+    unsigned long scanned = 0;
+    fmap_t **fmaps;
     cli_ctx ctx;
+    int ret;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.engine = pool->engine;
+    ctx.virname = &virname;
+    ctx.scanned = &scanned;
+    ctx.options = pool->options;
+    ctx.dconf = pool->dconf;
+    ctx.overlay = pool->overlay;
+    ctx.cb_ctx = pool->cb_ctx;
+    ctx.recursion = job->recursion;
+    ctx.container_type = job->container_type;
+    ctx.container_size = job->container_size;
+    ctx.scansize = job->scansize;
+    ctx.scannedfiles = job->scannedfiles;
+    ctx.limit_exceeded = job->limit_exceeded;
+    ctx.member_job = job;
+    if (job->keyed)
+	ctx.member_key = &job->key;
+
+    /* a NULL terminated stack with the archive's stand-in at the bottom */
+    if (!(fmaps = cli_calloc(sizeof(fmap_t *), pool->engine->maxreclevel + 3))) {
+	job->ret = CL_EMEM;
+	return;
+    }
+    if (!(ctx.hook_lsig_matches = cli_bitset_init())) {
+	free(fmaps);
+	job->ret = CL_EMEM;
+	return;
+    }
+    ctx.fmap = fmaps + 1;
+    *ctx.fmap = &job->parent;
+    cli_budget_attach(&ctx, pool->budget);
+    cli_logg_setup(&ctx);
+
+    if (job->fd != -1) {
+	if (lseek(job->fd, 0, SEEK_SET) == -1) {
+	    cli_dbgmsg("cli_member_pool: call to lseek() failed\n");
+	    ret = CL_ESEEK;
+	} else {
+	    ret = cli_magic_scandesc(job->fd, &ctx);
+	}
+    } else if (job->map) {
+	cli_dbgmsg("in cli_magic_scandesc (reclevel: %u/%u), %lu bytes of the container\n", ctx.recursion, ctx.engine->maxreclevel, (unsigned long)job->map->len);
+	ctx.fmap++;
+	*ctx.fmap = job->map;
+	ret = magic_scandesc(&ctx, job->type);
+	ctx.fmap--;
+    } else {
+	cli_dbgmsg("in cli_magic_scandesc (reclevel: %u/%u), %lu bytes in memory\n", ctx.recursion, ctx.engine->maxreclevel, (unsigned long)job->len);
+	ctx.fmap++;
+	if (!(*ctx.fmap = cl_fmap_open_memory(job->buf, job->len))) {
+	    ret = CL_EMEM;
+	} else {
+	    ret = magic_scandesc(&ctx, CL_TYPE_ANY);
+	    funmap(*ctx.fmap);
+	}
+	ctx.fmap--;
+    }
+
+    cli_logg_unsetup();
+    cli_budget_attach(&ctx, NULL);
+    job->ret = ret;
+    job->scanned = scanned;
+    job->scansize = ctx.scansize - job->scansize;
+    job->scannedfiles = ctx.scannedfiles - job->scannedfiles;
+    job->limit_exceeded = ctx.limit_exceeded;
+    job->found_possibly_unwanted = ctx.found_possibly_unwanted;
+    job->usec = ctx.scanstat_child;
+    cli_bitset_free(ctx.hook_lsig_matches);
+    cli_arena_destroy(&ctx.arena);
+    cli_extract_free(&ctx);
+    free(fmaps);
+}
+
+static void *member_pool_worker(void *arg)
+{
+    struct cli_member_pool *pool = (struct cli_member_pool *)arg;
+    struct cli_member_job *job;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+	while (!pool->next && !pool->quit) {
+	    pool->idle++;
+	    pthread_cond_wait(&pool->work, &pool->mutex);
+	    pool->idle--;
+	}
+	if (!(job = pool->next))
+	    break;
+	pool->next = job->next;
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (job->seq < pool->stop)
+	    member_job_scan(pool, job);
+	else
+	    cli_dbgmsg("cli_member_pool: dropping member %u, an earlier one is infected\n", job->seq);
+	member_job_release(pool, job);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (job->ret == CL_VIRUS && !(pool->options & CL_SCAN_ALLMATCHES) && job->seq < pool->stop)
+	    pool->stop = job->seq;
+	job->done = 1;
+	pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/* Reports the outcome of a member to the archive's context */
+static void member_job_merge(cli_ctx *ctx, struct cli_member_pool *pool, struct cli_member_job *job)
+{
+    unsigned int i;
+
+    if (!pool->found || SCAN_ALL) {
+	for (i = 0; i < job->nhits; i++) {
+	    cli_append_virus(ctx, job->hits[i].virname);
+	    if (job->hits[i].hashed && ctx->engine->cb_hash)
+		ctx->engine->cb_hash(-1, job->hits[i].size, (const unsigned char *)job->hits[i].md5, job->hits[i].virname, ctx->cb_ctx);
+	}
+	if (job->found_possibly_unwanted)
+	    ctx->found_possibly_unwanted = 1;
+	if (job->limit_exceeded)
+	    ctx->limit_exceeded = 1;
+	if (job->ret == CL_VIRUS)
+	    pool->found = 1;
+    }
+    if (job->parent.dont_cache_flag)
+	emax_reached(ctx);
+    ctx->scansize += job->scansize;
+    ctx->scannedfiles += job->scannedfiles;
+    ctx->nested_maps++;
+    if (ctx->scanned)
+	*ctx->scanned += job->scanned;
+    ctx->scanstat_child += job->usec;
+    free(job->hits);
+    free(job);
+}
+
+/* Merges the members scanned so far, in order, until no more than max are
+ * left queued or being scanned */
+static void member_pool_reap(cli_ctx *ctx, unsigned int max)
+{
+    struct cli_member_pool *pool = ctx->member_pool;
+    struct cli_member_job *job;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+	while ((job = pool->head) && job->done) {
+	    if (!(pool->head = job->next))
+		pool->tail = NULL;
+	    pool->pending--;
+	    pthread_mutex_unlock(&pool->mutex);
+	    member_job_merge(ctx, pool, job);
+	    pthread_mutex_lock(&pool->mutex);
+	}
+	if (pool->pending <= max)
+	    break;
+	pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+int cli_member_pool_start(cli_ctx *ctx)
+{
+    const struct cl_engine *engine = ctx->engine;
+    struct cli_member_pool *pool;
+
+    if (!engine->archive_threads || ctx->member_pool || ctx->member_job || ctx->profile ||
+	(*ctx->fmap)->len < CLI_DEFAULT_ARCHIVE_THREADS_FSIZE ||
+	SCAN_PROPERTIES || (ctx->options & CL_SCAN_PERFORMANCE_INFO) ||
+	engine->cb_pre_cache || engine->cb_pre_scan || engine->cb_post_scan || engine->cb_meta)
+	return 0;
+
+    if (!(pool = cli_calloc(1, sizeof(*pool))))
+	return 0;
+    if (pthread_mutex_init(&pool->mutex, NULL)) {
+	free(pool);
+	return 0;
+    }
+    if (pthread_cond_init(&pool->work, NULL)) {
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+	return 0;
+    }
+    if (pthread_cond_init(&pool->done, NULL)) {
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+	return 0;
+    }
+    pool->engine = engine;
+    pool->options = ctx->options;
+    pool->dconf = ctx->dconf;
+    pool->overlay = ctx->overlay;
+    pool->cb_ctx = ctx->cb_ctx;
+    pool->budget = ctx->budget;
+    pool->recursion = ctx->recursion;
+    pool->threads = engine->archive_threads;
+    pool->max_pending = 2 * pool->threads;
+    pool->stop = ~0u;
+    ctx->member_pool = pool;
+    cli_dbgmsg("cli_member_pool: scanning the members on up to %u threads\n", pool->threads);
+    return 1;
+}
+
+/* Queues the job, or scans it in place when no thread could be started */
+static void member_pool_queue(cli_ctx *ctx, struct cli_member_job *job)
+{
+    struct cli_member_pool *pool = ctx->member_pool;
+    int inline_scan = 0;
+
+    job->pool = pool;
+    job->recursion = ctx->recursion;
+    job->container_type = ctx->container_type;
+    job->container_size = ctx->container_size;
+    job->scansize = ctx->scansize;
+    job->scannedfiles = ctx->scannedfiles;
+    job->limit_exceeded = ctx->limit_exceeded;
+    if (ctx->member_key && ctx->member_key->recursion == ctx->recursion) {
+	job->key = *ctx->member_key;
+	job->keyed = 1;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    job->seq = pool->seq++;
+    if (pool->tail)
+	pool->tail->next = job;
+    else
+	pool->head = job;
+    pool->tail = job;
+    if (!pool->next)
+	pool->next = job;
+    pool->pending++;
+    if (!pool->idle && pool->started < pool->threads &&
+	!pthread_create(&pool->tid[pool->started], NULL, member_pool_worker, pool))
+	pool->started++;
+    if (pool->started) {
+	pthread_cond_signal(&pool->work);
+    } else {
+	/* no thread to hand it to */
+	pool->next = NULL;
+	inline_scan = 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (inline_scan) {
+	member_job_scan(pool, job);
+	member_job_release(pool, job);
+	job->done = 1;
+	if (job->ret == CL_VIRUS && !SCAN_ALL)
+	    pool->stop = job->seq;
+    }
+}
+
+static int member_pool_submit(struct cli_extract *x)
+{
+    cli_ctx *ctx = x->ctx;
+    struct cli_member_pool *pool = ctx->member_pool;
+    struct cli_member_job *job;
+
+    if (x->fd == -1 && x->len <= 5) {
+	cli_dbgmsg("Small data (%u bytes)\n", (unsigned int) x->len);
+	return CL_CLEAN;
+    }
+    member_pool_reap(ctx, pool->max_pending - 1);
+    if (!SCAN_ALL && pool->stop != ~0u)
+	return CL_VIRUS;
+
+    if (!(job = cli_calloc(1, sizeof(*job))))
+	return CL_EMEM;
+    /* the member now belongs to the job */
+    if (x->fd != -1) {
+	job->fd = x->fd;
+	x->fd = -1;
+	if (x->path) {
+	    job->tmpname = cli_strdup(x->path);
+	} else {
+	    job->tmpname = x->tmpname;
+	    x->tmpname = NULL;
+	}
+    } else {
+	job->fd = -1;
+	job->buf = x->buf;
+	job->len = x->len;
+	job->size = x->size;
+	x->buf = NULL;
+	x->size = 0;
+    }
+    member_pool_queue(ctx, job);
+    return CL_CLEAN;
+}
+
+/* Partitions are read straight from the container: each job gets a map of
+ * its own over the range, so the threads don't share the page cache of the
+ * container's map. Maps behind a callback stay on this thread, since the
+ * callback may not be reentrant. */
+int cli_member_scan_range(cli_ctx *ctx, off_t offset, size_t len, cli_file_t type)
+{
+    struct cli_member_pool *pool = ctx->member_pool;
+    fmap_t *map = *ctx->fmap;
+    struct cli_member_job *job;
+
+    if (!pool || ctx->recursion != pool->recursion || (!map->data && !map->handle_is_fd) ||
+	(ctx->engine->engine_options & ENGINE_OPTIONS_FORCE_TO_DISK))
+	return cli_map_scan(map, offset, len, ctx, type);
+
+    cli_dbgmsg("cli_member_scan_range: [%ld, +%lu)\n", (long)offset, (unsigned long)len);
+    if (offset < 0 || (size_t)offset >= map->len) {
+	cli_dbgmsg("Invalid offset: %ld\n", (long)offset);
+	return CL_CLEAN;
+    }
+    if (!len) len = map->len - offset;
+    if (len > map->len - offset) {
+	cli_dbgmsg("Data truncated: %lu -> %lu\n", (unsigned long)len, (unsigned long)(map->len - offset));
+	len = map->len - offset;
+    }
+    if (len <= 5) {
+	cli_dbgmsg("Small data (%u bytes)\n", (unsigned int) len);
+	return CL_CLEAN;
+    }
+
+    member_pool_reap(ctx, pool->max_pending - 1);
+    if (!SCAN_ALL && pool->stop != ~0u)
+	return CL_VIRUS;
+
+    if (!(job = cli_calloc(1, sizeof(*job))))
+	return CL_EMEM;
+    if (!(job->map = fmap_duplicate(map, offset, len))) {
+	free(job);
+	return cli_map_scan(map, offset, len, ctx, type);
+    }
+    job->fd = -1;
+    job->type = type;
+    member_pool_queue(ctx, job);
+    return CL_CLEAN;
+}
+
+int cli_member_pool_finish(cli_ctx *ctx, int ret)
+{
+    struct cli_member_pool *pool = ctx->member_pool;
+    unsigned int i;
+
+    member_pool_reap(ctx, 0);
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->started; i++)
+	pthread_join(pool->tid[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->mutex);
+    ctx->member_pool = NULL;
+    cli_dbgmsg("cli_member_pool: %u members handed to %u threads\n", pool->seq, pool->started);
+    if (pool->found)
+	ret = CL_VIRUS;
+    free(pool);
+    return ret;
+}
+#else
+int cli_member_cancelled(const cli_ctx *ctx)
+{
+    UNUSEDPARAM(ctx);
+    return 0;
+}
+
+int cli_member_pool_start(cli_ctx *ctx)
+{
+    UNUSEDPARAM(ctx);
+    return 0;
+}
+
+int cli_member_pool_finish(cli_ctx *ctx, int ret)
+{
+    UNUSEDPARAM(ctx);
+    return ret;
+}
+
+int cli_member_scan_range(cli_ctx *ctx, off_t offset, size_t len, cli_file_t type)
+{
+    return cli_map_scan(*ctx->fmap, offset, len, ctx, type);
+}
+#endif
+
+/* The rest of magic_scandesc() for an object scanned while extracted */
+static int extract_stream_scan(struct cli_extract *x)
+{
+    cli_ctx *ctx = x->ctx;
+    unsigned char hash[16];
+    unsigned int prof = 0;
+    uint64_t usec;
+    int ret;
+
+    cli_dbgmsg("in cli_magic_scandesc (reclevel: %u/%u), %lu bytes scanned while extracted\n", ctx->recursion, ctx->engine->maxreclevel, (unsigned long)x->len);
+    ctx->fmap++;
+    ctx->nested_maps++;
+    if (!(*ctx->fmap = cl_fmap_open_memory(x->buf, x->hlen))) {
+	ctx->fmap--;
+	return CL_EMEM;
+    }
+    if (ctx->recursion == ctx->engine->maxreclevel)
+	cli_check_blockmax(ctx, CL_EMAXREC);
+    if (ctx->profile && (prof = profile_push(ctx, x->type, x->start)))
+	ctx->profile->nodes[prof - 1].size = x->len;
+
+    ret = cli_stream_scan_final(x->stream[0], hash);
+    if (ret == CL_CLEAN && x->type == CL_TYPE_BINARY_DATA) {
+	if (SCAN_ALGO && (DCONF_OTHER & OTHER_CONF_MYDOOMLOG))
+	    ret = cli_check_mydoom_log(ctx);
+	if (ret == CL_CLEAN && x->stream[1])
+	    ret = cli_stream_scan_final(x->stream[1], NULL);
+    }
+    if (ret == CL_VIRUS)
+	ret = cli_stream_scan_checkfp(x->stream[0]);
+
+    if (ret == CL_BREAK) {
+	x->again = 1;
+    } else if (ret == CL_CLEAN) {
+	if (ctx->recursion == ctx->engine->maxreclevel)
+	    emax_reached(ctx);
+	else if (!ctx->found_possibly_unwanted && !ctx->num_viruses && !(SCAN_PROPERTIES))
+	    cache_add(hash, x->len, ctx, 0);
+    }
+    usec = extract_usec();
+    if (prof)
+	profile_pop(ctx, prof, x->type, usec);
+    funmap(*ctx->fmap);
+    ctx->fmap--;
+    if (!x->again) {
+	cli_stream_scan_free(x->stream[1]);
+	cli_stream_scan_free(x->stream[0]);
+	x->stream[0] = x->stream[1] = NULL;
+    }
+
+    usec -= x->start;
+    if ((int64_t)usec < 0)
+	usec = 0;
+    scanstat_add(ctx, x->type, x->len, usec);
+    ctx->scanstat_child += usec;
+    return ret;
+}
+
+/* The object is the range [offset, offset + len) of the map being scanned.
+ * It's copied like extracted data when the scan has to go to another thread
+ * or the temporary files are kept, or when something was written already. */
+int cli_extract_range(struct cli_extract *x, size_t offset, size_t len)
+{
+    cli_ctx *ctx = x->ctx;
+    fmap_t *map = *ctx->fmap;
+
+    if (!len)
+	return CL_SUCCESS;
+    if (!CLI_ISCONTAINED(0, map->len, offset, len))
+	return CL_EREAD;
+    if (x->len || x->range || ctx->engine->keeptmp)
+	return extract_copy(x, map, offset, len);
+#ifdef CL_THREAD_SAFE
+    if (ctx->member_pool && ctx->recursion == ctx->member_pool->recursion)
+	return extract_copy(x, map, offset, len);
+#endif
+    x->map = map;
+    x->offset = offset;
+    x->len = len;
+    x->range = 1;
+    return CL_SUCCESS;
+}
+
+int cli_extract_scan(struct cli_extract *x)
+{
+    cli_ctx *ctx = x->ctx;
+    int ret;
+
+    if (x->range)
+	return cli_map_scan(x->map, x->offset, x->len, ctx, CL_TYPE_ANY);
+    if (x->stream[0])
+	return extract_stream_scan(x);
+#ifdef CL_THREAD_SAFE
+    if (ctx->member_pool && ctx->recursion == ctx->member_pool->recursion)
+	return member_pool_submit(x);
+#endif
+    if (x->fd != -1)
+	return cli_magic_scandesc(x->fd, ctx);
+
+    cli_dbgmsg("in cli_magic_scandesc (reclevel: %u/%u), %lu bytes in memory\n", ctx->recursion, ctx->engine->maxreclevel, (unsigned long)x->len);
+    if (x->len <= 5) {
+	cli_dbgmsg("Small data (%u bytes)\n", (unsigned int) x->len);
+	return CL_CLEAN;
+    }
+    ctx->fmap++;
+    ctx->nested_maps++;
+    if (!(*ctx->fmap = cl_fmap_open_memory(x->buf, x->len))) {
+	ctx->fmap--;
+	return CL_EMEM;
+    }
+    ret = magic_scandesc(ctx, CL_TYPE_ANY);
+    funmap(*ctx->fmap);
+    ctx->fmap--;
+    return ret;
+}
+
+/* Returns 1 when the object has to be extracted again after CL_BREAK, to
+ * memory or to a temporary file this time */
+int cli_extract_again(struct cli_extract *x)
+{
+    if (!x->again)
+	return 0;
+    cli_dbgmsg("cli_extract: the object needs the whole file, extracting it again\n");
+    extract_unstream(x);
+    extract_putbuf(x);
+    x->len = x->hlen = 0;
+    x->expect = 0;
+    x->again = 0;
+    return 1;
+}
+
+/* Releases the buffer or the temporary file */
+int cli_extract_done(struct cli_extract *x)
+{
+    int ret = CL_SUCCESS;
+
+    /* given up before the scan */
+    if (x->stream[0])
+	extract_unstream(x);
+    x->hlen = 0;
+    x->again = 0;
+    x->range = 0;
+    x->map = NULL;
+    extract_putbuf(x);
+    if (x->fd != -1) {
+	close(x->fd);
+	x->fd = -1;
+	if (!x->ctx->engine->keeptmp && cli_unlink(x->path ? x->path : x->tmpname))
+	    ret = CL_EUNLINK;
+    }
+    free(x->tmpname);
+    x->tmpname = NULL;
+    x->len = 0;
+    return ret;
+}
+
+void cli_extract_free(cli_ctx *ctx)
+{
+    free(ctx->extract_spare);
+    cli_memgov_release(ctx->engine, ctx->extract_sparesize);
+    ctx->extract_spare = NULL;
+    ctx->extract_sparesize = 0;
+}
+
+#if HAVE_JSON
+/* Where the file properties json goes once the scan is over */
+struct json_sink {
+    clcb_file_props_stream cb;
+    void *cb_ctx;
+    int rc;
+    int fd; /* keeptmp copy */
+    char *tmpname;
+};
+
+static int json_sink_emit(const char *chunk, size_t len, void *cbdata)
+{
+    struct json_sink *sink = cbdata;
+
+    if (sink->fd != -1 && cli_writen(sink->fd, chunk, len) < 0) {
+        cli_dbgmsg("scan_common: cli_writen error writing json properties file.\n");
+        close(sink->fd);
+        sink->fd = -1;
+    }
+    if (sink->cb)
+        return sink->cb(chunk, len, sink->rc, sink->cb_ctx);
+    return CL_SUCCESS;
+}
+#endif
+
+/* The state that outlives a single file of a batch: the fmap stack, the
+ * hook bitset, the arena blocks and the extraction buffer */
+static int scan_setup(cli_ctx *ctx, const struct cl_engine *engine, unsigned int scanoptions)
+{
+    memset(ctx, '\0', sizeof(cli_ctx));
+    if (engine->base) {
+        /* the settings and all the other databases are those of the base */
+        ctx->overlay = engine;
+        engine = engine->base;
+    }
+    ctx->engine = engine;
+    ctx->options = scanoptions;
+    ctx->dconf = (struct cli_dconf *) engine->dconf;
+    ctx->fmap = cli_calloc(sizeof(fmap_t *), ctx->engine->maxreclevel + 2);
+    if(!ctx->fmap)
+	return CL_EMEM;
+    if (!(ctx->hook_lsig_matches = cli_bitset_init())) {
+	free(ctx->fmap);
+	return CL_EMEM;
+    }
+    ctx->probe = cli_scan_probe();
+    return CL_SUCCESS;
+}
+
+static void scan_teardown(cli_ctx *ctx)
+{
+    cli_bitset_free(ctx->hook_lsig_matches);
+    cli_arena_destroy(&ctx->arena);
+    cli_extract_free(ctx);
+    free(ctx->fmap);
+}
+
+/* Resets what the previous file of a batch left in ctx */
+static void scan_reset(cli_ctx *ctx, unsigned int scanoptions)
+{
+    cli_ctx keep = *ctx;
+    struct cli_arena_mark empty;
+
+    memset(ctx, '\0', sizeof(cli_ctx));
+    ctx->engine = keep.engine;
+    ctx->options = scanoptions;
+    ctx->dconf = keep.dconf;
+    ctx->fmap = keep.fmap;
+    memset(ctx->fmap, 0, sizeof(fmap_t *) * (ctx->engine->maxreclevel + 2));
+    ctx->hook_lsig_matches = keep.hook_lsig_matches;
+    memset(ctx->hook_lsig_matches->bitset, 0, ctx->hook_lsig_matches->length);
+    ctx->arena = keep.arena;
+    empty.blk = NULL;
+    empty.used = 0;
+    cli_arena_release(&ctx->arena, &empty); /* keeps the spare blocks */
+    ctx->extract_spare = keep.extract_spare;
+    ctx->extract_sparesize = keep.extract_sparesize;
+    ctx->probe = keep.probe;
+    ctx->overlay = keep.overlay;
+}
+
+static int scan_one(cli_ctx *ctx, int desc, cl_fmap_t *map, const char **virname, unsigned long int *scanned, void *context, struct cl_scan_usage *usage)
+{
+    struct cli_budget budget;
+    struct cli_profile profile;
+    uint64_t usage_start = 0, map_read = 0;
     int rc;
     STATBUF sb;
 
@@ -3445,92 +5456,87 @@ static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned
             return CL_CLEAN;
     }
 
-    memset(&ctx, '\0', sizeof(cli_ctx));
-    ctx.engine = engine;
-    ctx.virname = virname;
-    ctx.scanned = scanned;
-    ctx.options = scanoptions;
-    ctx.found_possibly_unwanted = 0;
-    ctx.container_type = CL_TYPE_ANY;
-    ctx.container_size = 0;
-    ctx.dconf = (struct cli_dconf *) engine->dconf;
-    ctx.cb_ctx = context;
-    ctx.fmap = cli_calloc(sizeof(fmap_t *), ctx.engine->maxreclevel + 2);
-    if(!ctx.fmap)
-	return CL_EMEM;
-    if (!(ctx.hook_lsig_matches = cli_bitset_init())) {
-	free(ctx.fmap);
-	return CL_EMEM;
-    }
-    perf_init(&ctx);
-
-    if (ctx.options & CL_SCAN_FILE_PROPERTIES && ctx.engine->time_limit != 0) {
-        if (gettimeofday(&ctx.time_limit, NULL) == 0) {
-            uint32_t secs = ctx.engine->time_limit / 1000;
-            uint32_t usecs = (ctx.engine->time_limit % 1000) * 1000;
-            ctx.time_limit.tv_sec += secs;
-            ctx.time_limit.tv_usec += usecs;
-            if (ctx.time_limit.tv_usec >= 1000000) {
-                ctx.time_limit.tv_usec -= 1000000;
-                ctx.time_limit.tv_sec++;
-            }
-        } else {
-            char buf[64];
-            cli_dbgmsg("scan_common; gettimeofday error: %s\n", cli_strerror(errno, buf, 64));
-        }
+    ctx->virname = virname;
+    ctx->scanned = scanned;
+    ctx->container_type = CL_TYPE_ANY;
+    ctx->cb_ctx = context;
+    perf_init(ctx);
+
+    cli_budget_init(&budget, ctx->engine);
+    if (usage) {
+        budget.usage = 1;
+        map_read = map ? map->bytes_read : 0;
     }
+    cli_budget_attach(ctx, &budget);
+    usage_start = cli_usage_start(ctx);
 
 #ifdef HAVE__INTERNAL__SHA_COLLECT
-    if(scanoptions & CL_SCAN_INTERNAL_COLLECT_SHA) {
+    if(ctx->options & CL_SCAN_INTERNAL_COLLECT_SHA) {
 	char link[32];
 	ssize_t linksz;
 
 
 	snprintf(link, sizeof(link), "/proc/self/fd/%u", desc);
 	link[sizeof(link)-1]='\0';
-	if((linksz=readlink(link, ctx.entry_filename, sizeof(ctx.entry_filename)-1))==-1) {
+	if((linksz=readlink(link, ctx->entry_filename, sizeof(ctx->entry_filename)-1))==-1) {
 	    cli_errmsg("failed to resolve filename for descriptor %d (%s)\n", desc, link);
-	    strcpy(ctx.entry_filename, "NO_IDEA");
+	    strcpy(ctx->entry_filename, "NO_IDEA");
 	} else
-	    ctx.entry_filename[linksz]='\0';
+	    ctx->entry_filename[linksz]='\0';
     } while(0);
 #endif
 
-    cli_logg_setup(&ctx);
-    rc = map ? cli_map_scandesc(map, 0, map->len, &ctx, CL_TYPE_ANY) : cli_magic_scandesc(desc, &ctx);
+    if (ctx->engine->cb_profile) {
+        memset(&profile, 0, sizeof(profile));
+        ctx->profile = &profile;
+    }
+
+    cli_logg_setup(ctx);
+    rc = map ? cli_map_scandesc(map, 0, map->len, ctx, CL_TYPE_ANY) : cli_magic_scandesc(desc, ctx);
 
 #if HAVE_JSON
-    if (ctx.options & CL_SCAN_FILE_PROPERTIES && ctx.properties!=NULL) {
+    if (ctx->options & CL_SCAN_FILE_PROPERTIES && ctx->properties!=NULL) {
         json_object *jobj;
-        const char *jstring;
+        const char *jstring = NULL;
+        struct cli_matcher *iroot;
+        int stream_only;
 
         /* set value of unique root object tag */
-        if (json_object_object_get_ex(ctx.properties, "FileType", &jobj)) {
+        if (json_object_object_get_ex(ctx->properties, "FileType", &jobj)) {
             enum json_type type;
             const char *jstr;
 
             type = json_object_get_type(jobj);
             if (type == json_type_string) {
                 jstr = json_object_get_string(jobj);
-                cli_jsonstr(ctx.properties, "RootFileType", jstr);
+                cli_jsonstr(ctx->properties, "RootFileType", jstr);
             }
         }
 
-        /* serialize json properties to string */
-        jstring = json_object_to_json_string(ctx.properties);
-        if (NULL == jstring) {
-            cli_errmsg("scan_common: no memory for json serialization.\n");
-            rc = CL_EMEM;
+        /* serialize json properties to string, unless they're only streamed */
+        iroot = ctx->engine->root[13];
+        stream_only = ctx->engine->cb_file_props_stream && !ctx->engine->cb_file_props && !cli_debug_flag &&
+            !iroot->ac_lsigs && !iroot->ac_patterns && !iroot->pcre_metas;
+        if (!stream_only) {
+            jstring = json_object_to_json_string(ctx->properties);
+            if (NULL == jstring) {
+                cli_errmsg("scan_common: no memory for json serialization.\n");
+                rc = CL_EMEM;
+            }
         }
-        else {
+        if (NULL != jstring || stream_only) {
             int ret = CL_SUCCESS;
-            struct cli_matcher *iroot = ctx.engine->root[13];
-            cli_dbgmsg("%s\n", jstring);
+            struct json_sink sink;
+            if (jstring)
+                cli_dbgmsg("%s\n", jstring);
 
             if (rc != CL_VIRUS) {
                 /* run bytecode preclass hook; generate fmap if needed for running hook */
-                struct cli_bc_ctx *bc_ctx = cli_bytecode_context_alloc();
-                if (!bc_ctx) {
+                struct cli_bc_ctx *bc_ctx = NULL;
+                if (!cli_bytecode_hook_pending(ctx, ctx->engine, BC_PRECLASS)) {
+                    cli_dbgmsg("scan_common: no preclass bytecode to run\n");
+                }
+                else if (!(bc_ctx = cli_bytecode_context_alloc())) {
                     cli_errmsg("scan_common: can't allocate memory for bc_ctx\n");
                     rc = CL_EMEM;
                 }
@@ -3538,17 +5544,17 @@ static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned
                     fmap_t *pc_map = map;
 
                     if (!pc_map) {
-                        perf_start(&ctx, PERFT_MAP);
+                        perf_start(ctx, PERFT_MAP);
                         if(!(pc_map = fmap(desc, 0, sb.st_size))) {
-                            perf_stop(&ctx, PERFT_MAP);
+                            perf_stop(ctx, PERFT_MAP);
                             rc = CL_EMEM;
                         }
-                        perf_stop(&ctx, PERFT_MAP);
+                        perf_stop(ctx, PERFT_MAP);
                     }
 
                     if (pc_map) {
-                        cli_bytecode_context_setctx(bc_ctx, &ctx);
-                        rc = cli_bytecode_runhook(&ctx, ctx.engine, bc_ctx, BC_PRECLASS, pc_map);
+                        cli_bytecode_context_setctx(bc_ctx, ctx);
+                        rc = cli_bytecode_runhook(ctx, ctx->engine, bc_ctx, BC_PRECLASS, pc_map);
                         cli_bytecode_context_destroy(bc_ctx);
 
                         if (!map)
@@ -3559,67 +5565,138 @@ static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned
                 /* backwards compatibility: scan the json string unless a virus was detected */
                 if (rc != CL_VIRUS && (iroot->ac_lsigs || iroot->ac_patterns || iroot->pcre_metas)) {
                     cli_dbgmsg("scan_common: running deprecated preclass bytecodes for target type 13\n");
-                    ctx.options &= ~CL_SCAN_FILE_PROPERTIES;
-                    rc = cli_mem_scandesc(jstring, strlen(jstring), &ctx);
+                    ctx->options &= ~CL_SCAN_FILE_PROPERTIES;
+                    rc = cli_mem_scandesc(jstring, strlen(jstring), ctx);
                 }
             }
 
             /* Invoke file props callback */
-            if (ctx.engine->cb_file_props != NULL) {
-                ret = ctx.engine->cb_file_props(jstring, rc, ctx.cb_ctx);
+            if (ctx->engine->cb_file_props != NULL) {
+                ret = ctx->engine->cb_file_props(jstring, rc, ctx->cb_ctx);
                 if (ret != CL_SUCCESS)
                     rc = ret;
             }
 
-            /* keeptmp file processing for file properties json string */
-            if (ctx.engine->keeptmp) {
-                int fd = -1;
-                char * tmpname = NULL;
-                if ((ret = cli_gentempfd(ctx.engine->tmpdir, &tmpname, &fd)) != CL_SUCCESS) {
+            /* streaming callback and keeptmp file for the file properties json */
+            memset(&sink, 0, sizeof(sink));
+            sink.fd = -1;
+            if (ctx->engine->cb_file_props_stream) {
+                sink.cb = ctx->engine->cb_file_props_stream;
+                sink.cb_ctx = ctx->cb_ctx;
+                sink.rc = rc;
+            }
+            if (ctx->engine->keeptmp) {
+                if ((ret = cli_gentempfd(ctx->engine->tmpdir, &sink.tmpname, &sink.fd)) != CL_SUCCESS)
                     cli_dbgmsg("scan_common: Can't create json properties file, ret = %i.\n", ret);
+            }
+            if (sink.cb || sink.fd != -1) {
+                if (jstring) {
+                    ret = json_sink_emit(jstring, strlen(jstring), &sink);
                 } else {
-                    if (cli_writen(fd, jstring, strlen(jstring)) < 0)
-                        cli_dbgmsg("scan_common: cli_writen error writing json properties file.\n");
+                    struct cli_arena_mark mark;
+                    char *buf;
+
+                    cli_arena_getmark(&ctx->arena, &mark);
+                    if ((buf = cli_arena_malloc(&ctx->arena, JSON_WRITER_CHUNK)))
+                        ret = cli_json_write(ctx->properties, buf, JSON_WRITER_CHUNK, json_sink_emit, &sink);
                     else
-                        cli_dbgmsg("json written to: %s\n", tmpname);
+                        ret = CL_EMEM;
+                    cli_arena_release(&ctx->arena, &mark);
                 }
-                if (fd != -1)
-                    close(fd);
-                if (NULL != tmpname)
-                    free(tmpname);
+                if (ret == CL_SUCCESS && sink.cb)
+                    ret = sink.cb(NULL, 0, rc, sink.cb_ctx);
+                if (ret != CL_SUCCESS)
+                    rc = ret;
             }
+            if (sink.fd != -1) {
+                close(sink.fd);
+                cli_dbgmsg("json written to: %s\n", sink.tmpname);
+            }
+            free(sink.tmpname);
         }
-        cli_json_delobj(ctx.properties); /* frees all json memory */
-#if 0
-        // test code  - to be deleted
-        if (cli_checktimelimit(&ctx) != CL_SUCCESS) {
-            cli_errmsg("scan_common: timeout!\n");
-            rc = CL_ETIMEOUT;
-        }
-#endif
+        cli_json_delobj(ctx->properties); /* frees all json memory */
     }
 #endif
 
-    cli_bitset_free(ctx.hook_lsig_matches);
-    free(ctx.fmap);
+    if (ctx->profile) {
+        profile_report(ctx, map ? -1 : desc);
+        free(profile.nodes);
+    }
+    if (usage && map)
+        cli_usage_read(ctx, map->bytes_read - map_read);
+    cli_budget_attach(ctx, NULL);
+    if (usage)
+        cli_usage_fill(&budget, usage_start, usage);
+    /* whatever the object given up on returned, the file wasn't scanned
+     * completely: that's Heuristic.Limits.Exceeded with BlockMax and an
+     * error otherwise */
+    if (budget.exceeded && rc != CL_VIRUS)
+        rc = ctx->num_viruses ? CL_VIRUS : budget.exceeded;
     if (rc == CL_CLEAN) {
-        if ((ctx.num_viruses != 0 && (ctx.options & (CL_SCAN_ALLMATCHES | CL_SCAN_BLOCKMAX))) ||
-            ctx.found_possibly_unwanted)
+        if ((ctx->num_viruses != 0 && (ctx->options & (CL_SCAN_ALLMATCHES | CL_SCAN_BLOCKMAX))) ||
+            ctx->found_possibly_unwanted)
                 rc = CL_VIRUS;
     }
     cli_logg_unsetup();
-    perf_done(&ctx);
+    perf_done(ctx);
+    return rc;
+}
+
+static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context, struct cl_scan_usage *usage)
+{
+    cli_ctx ctx;
+    int rc;
+
+    if ((rc = scan_setup(&ctx, engine, scanoptions)) != CL_SUCCESS)
+        return rc;
+    rc = scan_one(&ctx, desc, map, virname, scanned, context, usage);
+    scan_teardown(&ctx);
     return rc;
 }
 
 int cl_scandesc_callback(int desc, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context)
 {
-    return scan_common(desc, NULL, virname, scanned, engine, scanoptions, context);
+    return scan_common(desc, NULL, virname, scanned, engine, scanoptions, context, NULL);
+}
+
+int cl_scandesc_usage(int desc, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context, struct cl_scan_usage *usage)
+{
+    return scan_common(desc, NULL, virname, scanned, engine, scanoptions, context, usage);
+}
+
+int cl_scanmap_usage(cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context, struct cl_scan_usage *usage)
+{
+    return scan_common(-1, map, virname, scanned, engine, scanoptions, context, usage);
 }
 
 int cl_scanmap_callback(cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context)
 {
-    return scan_common(-1, map, virname, scanned, engine, scanoptions, context);
+    return scan_common(-1, map, virname, scanned, engine, scanoptions, context, NULL);
+}
+
+int cl_scanmap_batch(cl_fmap_t * const *maps, struct cl_scan_result *results, unsigned int count, const struct cl_engine *engine, unsigned int scanoptions)
+{
+    cli_ctx ctx;
+    unsigned int i;
+    int rc;
+
+    if (!maps || !results || !engine)
+        return CL_ENULLARG;
+    if ((rc = scan_setup(&ctx, engine, scanoptions)) != CL_SUCCESS)
+        return rc;
+    for (i = 0; i < count; i++) {
+        results[i].virname = NULL;
+        results[i].scanned = 0;
+        if (!maps[i]) {
+            results[i].ret = CL_ENULLARG;
+            continue;
+        }
+        if (i)
+            scan_reset(&ctx, scanoptions);
+        results[i].ret = scan_one(&ctx, -1, maps[i], &results[i].virname, &results[i].scanned, results[i].context, NULL);
+    }
+    scan_teardown(&ctx);
+    return CL_SUCCESS;
 }
 
 int cli_found_possibly_unwanted(cli_ctx* ctx)
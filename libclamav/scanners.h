@@ -34,4 +34,66 @@ int cli_map_scan(cl_fmap_t *map, off_t offset, size_t length, cli_ctx *ctx, cli_
 int cli_mem_scandesc(const void *buffer, size_t length, cli_ctx *ctx);
 int cli_found_possibly_unwanted(cli_ctx* ctx);
 
+/* Sink for the objects extracted from containers: the data is collected in
+ * memory and scanned through a memory fmap, it only goes to a temporary file
+ * once it outgrows CL_ENGINE_EXTRACT_MEM (or with keeptmp and forcetodisk).
+ * The buffer is handed on to the next object of the same scan.
+ *
+ * When the extractor knows the size of the object in advance it passes it
+ * to cli_extract_expect(): an object which doesn't fit in memory is then
+ * scanned while it's extracted if its type only needs the raw scan, see
+ * extract_stream(). Should it turn out to need the whole file after all,
+ * cli_extract_write() or cli_extract_scan() fail with CL_BREAK and
+ * cli_extract_again() tells the extractor to start over.
+ *
+ * An object stored as is in the container is passed to cli_extract_range()
+ * instead: it's then scanned in place as a nested map of the container, see
+ * cli_map_scan(), and only copied when a descriptor is asked for. */
+struct cli_extract {
+    cli_ctx *ctx;
+    unsigned char *buf;
+    size_t len, size;
+    int fd;
+    char *tmpname;
+    const char *path;
+    uint64_t expect;
+    struct cli_stream_scan *stream[2];
+    cli_file_t type;
+    size_t hlen;
+    int again;
+    unsigned long scansize, scanned;
+    unsigned int scannedfiles;
+    uint64_t start;
+    fmap_t *map;
+    size_t offset;
+    int range;
+};
+
+void cli_extract_init(struct cli_extract *x, cli_ctx *ctx, const char *path);
+void cli_extract_expect(struct cli_extract *x, uint64_t size);
+int cli_extract_write(struct cli_extract *x, const void *data, size_t len);
+int cli_extract_range(struct cli_extract *x, size_t offset, size_t len);
+unsigned char *cli_extract_reserve(struct cli_extract *x, size_t len);
+int cli_extract_commit(struct cli_extract *x, size_t len);
+int cli_extract_fd(struct cli_extract *x, int *fd);
+fmap_t *cli_extract_map(struct cli_extract *x);
+void cli_extract_keep(struct cli_extract *x);
+int cli_extract_scan(struct cli_extract *x);
+int cli_extract_again(struct cli_extract *x);
+int cli_extract_done(struct cli_extract *x);
+void cli_extract_free(cli_ctx *ctx);
+
+/* Threads scanning the members of an archive while it's unpacked: between
+ * cli_member_pool_start() and cli_member_pool_finish() cli_extract_scan()
+ * queues the members, see CL_ENGINE_ARCHIVE_THREADS. The scan of a member
+ * reports its detections to cli_member_virus() and cli_member_hash(). */
+int cli_member_pool_start(cli_ctx *ctx);
+int cli_member_pool_finish(cli_ctx *ctx, int ret);
+int cli_member_cancelled(const cli_ctx *ctx);
+void cli_member_virus(struct cli_member_job *job, const char *virname);
+void cli_member_hash(struct cli_member_job *job, unsigned long long size, const char *md5);
+/* Like cli_map_scan() on the current map, but the range goes to the member
+ * threads when a pool was started at this level, as for partitions */
+int cli_member_scan_range(cli_ctx *ctx, off_t offset, size_t len, cli_file_t type);
+
 #endif
@@ -0,0 +1,304 @@
+/*
+ *  Asynchronous scanning: scan queues with a pollable completion fd.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "clamav.h"
+#include "others.h"
+
+/* A queue owns a fixed set of worker threads which take the submitted
+ * scans in order and move them to the completion list. The completion fd
+ * is the read end of a pipe holding a single byte while completions are
+ * waiting, so it can be polled level triggered. Without thread support
+ * the scans run in cl_scan_submit() itself. */
+
+#define SCANQ_DEFAULT_THREADS 4
+#define SCANQ_MAX_THREADS 256
+
+struct cl_scan_job {
+    int desc;
+    cl_fmap_t *map;
+    unsigned int scanoptions;
+    void *context;
+    struct cl_scan_result res;
+    struct cl_scan_job *next;
+};
+
+struct cl_scan_queue {
+    const struct cl_engine *engine;
+    struct cl_scan_job *pending, *pending_tail;
+    struct cl_scan_job *done, *done_tail;
+    unsigned int inflight; /* submitted and not reaped yet */
+    int pipefd[2], signaled;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t completed;
+    pthread_t *threads;
+    unsigned int nthreads, stop;
+#endif
+};
+
+static void scanq_run(struct cl_scan_queue *q, struct cl_scan_job *job)
+{
+    job->res.context = job->context;
+    job->res.virname = NULL;
+    job->res.scanned = 0;
+    if(job->map)
+        job->res.ret = cl_scanmap_callback(job->map, &job->res.virname, &job->res.scanned, q->engine, job->scanoptions, job->context);
+    else
+        job->res.ret = cl_scandesc_callback(job->desc, &job->res.virname, &job->res.scanned, q->engine, job->scanoptions, job->context);
+}
+
+/* called with the mutex held */
+static void scanq_complete(struct cl_scan_queue *q, struct cl_scan_job *job)
+{
+    job->next = NULL;
+    if(q->done_tail)
+        q->done_tail->next = job;
+    else
+        q->done = job;
+    q->done_tail = job;
+
+#ifndef _WIN32
+    if(!q->signaled && q->pipefd[1] >= 0) {
+        char c = 0;
+
+        if(write(q->pipefd[1], &c, 1) == 1)
+            q->signaled = 1;
+    }
+#endif
+#ifdef CL_THREAD_SAFE
+    pthread_cond_broadcast(&q->completed);
+#endif
+}
+
+#ifdef CL_THREAD_SAFE
+static void *scanq_worker(void *arg)
+{
+    struct cl_scan_queue *q = (struct cl_scan_queue *)arg;
+    struct cl_scan_job *job;
+
+    pthread_mutex_lock(&q->mutex);
+    while(1) {
+        while(!q->pending && !q->stop)
+            pthread_cond_wait(&q->work, &q->mutex);
+        if(!(job = q->pending))
+            break;
+        if(!(q->pending = job->next))
+            q->pending_tail = NULL;
+        pthread_mutex_unlock(&q->mutex);
+
+        scanq_run(q, job);
+
+        pthread_mutex_lock(&q->mutex);
+        scanq_complete(q, job);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+#endif
+
+struct cl_scan_queue *cl_scan_queue_new(const struct cl_engine *engine, unsigned int nthreads)
+{
+    struct cl_scan_queue *q;
+
+    if(!engine)
+        return NULL;
+    if(!(q = cli_calloc(1, sizeof(*q))))
+        return NULL;
+    q->engine = engine;
+    q->pipefd[0] = q->pipefd[1] = -1;
+
+#ifndef _WIN32
+    if(pipe(q->pipefd)) {
+        cli_errmsg("cl_scan_queue_new: Can't create the completion pipe: %s\n", strerror(errno));
+        free(q);
+        return NULL;
+    }
+    fcntl(q->pipefd[0], F_SETFL, fcntl(q->pipefd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(q->pipefd[1], F_SETFL, fcntl(q->pipefd[1], F_GETFL) | O_NONBLOCK);
+    fcntl(q->pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(q->pipefd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+#ifdef CL_THREAD_SAFE
+    if(!nthreads)
+        nthreads = SCANQ_DEFAULT_THREADS;
+    if(nthreads > SCANQ_MAX_THREADS)
+        nthreads = SCANQ_MAX_THREADS;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->completed, NULL);
+    if(!(q->threads = cli_calloc(nthreads, sizeof(*q->threads)))) {
+        cl_scan_queue_free(q);
+        return NULL;
+    }
+    for(q->nthreads = 0; q->nthreads < nthreads; q->nthreads++) {
+        if(pthread_create(&q->threads[q->nthreads], NULL, scanq_worker, q))
+            break;
+    }
+    if(!q->nthreads) {
+        cli_errmsg("cl_scan_queue_new: Can't start the scan threads\n");
+        cl_scan_queue_free(q);
+        return NULL;
+    }
+#else
+    UNUSEDPARAM(nthreads);
+#endif
+    return q;
+}
+
+static int scanq_submit(struct cl_scan_queue *q, int desc, cl_fmap_t *map, unsigned int scanoptions, void *context)
+{
+    struct cl_scan_job *job;
+
+    if(!q)
+        return CL_ENULLARG;
+    if(!(job = cli_calloc(1, sizeof(*job))))
+        return CL_EMEM;
+    job->desc = desc;
+    job->map = map;
+    job->scanoptions = scanoptions;
+    job->context = context;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&q->mutex);
+    if(q->stop) {
+        pthread_mutex_unlock(&q->mutex);
+        free(job);
+        return CL_EARG;
+    }
+    if(q->pending_tail)
+        q->pending_tail->next = job;
+    else
+        q->pending = job;
+    q->pending_tail = job;
+    q->inflight++;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->mutex);
+#else
+    q->inflight++;
+    scanq_run(q, job);
+    scanq_complete(q, job);
+#endif
+    return CL_SUCCESS;
+}
+
+int cl_scan_submit(struct cl_scan_queue *q, int desc, unsigned int scanoptions, void *context)
+{
+    if(desc < 0)
+        return CL_EARG;
+    return scanq_submit(q, desc, NULL, scanoptions, context);
+}
+
+int cl_scan_submit_map(struct cl_scan_queue *q, cl_fmap_t *map, unsigned int scanoptions, void *context)
+{
+    if(!map)
+        return CL_ENULLARG;
+    return scanq_submit(q, -1, map, scanoptions, context);
+}
+
+int cl_scan_queue_fd(const struct cl_scan_queue *q)
+{
+    return q ? q->pipefd[0] : -1;
+}
+
+int cl_scan_reap(struct cl_scan_queue *q, struct cl_scan_result *results, unsigned int max, int wait)
+{
+    struct cl_scan_job *job;
+    unsigned int n = 0;
+
+    if(!q || !results)
+        return -1;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&q->mutex);
+    while(wait && !q->done && q->inflight)
+        pthread_cond_wait(&q->completed, &q->mutex);
+#else
+    UNUSEDPARAM(wait);
+#endif
+    while(n < max && (job = q->done)) {
+        if(!(q->done = job->next))
+            q->done_tail = NULL;
+        results[n++] = job->res;
+        q->inflight--;
+        free(job);
+    }
+#ifndef _WIN32
+    if(!q->done && q->signaled) {
+        char c;
+
+        if(read(q->pipefd[0], &c, 1) == 1)
+            q->signaled = 0;
+    }
+#endif
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&q->mutex);
+#endif
+    return n;
+}
+
+void cl_scan_queue_free(struct cl_scan_queue *q)
+{
+    struct cl_scan_job *job;
+
+    if(!q)
+        return;
+
+#ifdef CL_THREAD_SAFE
+    /* the queued scans still run, their results are dropped */
+    pthread_mutex_lock(&q->mutex);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->mutex);
+    while(q->nthreads)
+        pthread_join(q->threads[--q->nthreads], NULL);
+    free(q->threads);
+    pthread_cond_destroy(&q->completed);
+    pthread_cond_destroy(&q->work);
+    pthread_mutex_destroy(&q->mutex);
+#endif
+
+    while((job = q->done)) {
+        q->done = job->next;
+        free(job);
+    }
+#ifndef _WIN32
+    if(q->pipefd[0] >= 0)
+        close(q->pipefd[0]);
+    if(q->pipefd[1] >= 0)
+        close(q->pipefd[1]);
+#endif
+    free(q);
+}
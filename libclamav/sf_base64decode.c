@@ -25,8 +25,16 @@
 #include "clamav-config.h"
 #endif
 
+#include <string.h>
+
 #include "sf_base64decode.h"
 
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#include <tmmintrin.h>
+#define BASE64_SIMD 1
+#endif
+
 uint8_t sf_decode64tab[256] = {
         100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,
         100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,
@@ -45,6 +53,77 @@ uint8_t sf_decode64tab[256] = {
         100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,
         100,100,100,100,100,100,100,100,100,100,100,100,100,100,100,100};
 
+#ifdef BASE64_SIMD
+/* Decodes 16 base64 characters into 12 bytes, returns 0 if any of them is
+ * outside the alphabet (padding included).  The characters are classified
+ * by their nibbles and translated with a per high nibble offset. */
+__attribute__((target("ssse3")))
+static int base64_block_ssse3(const uint8_t *in, uint8_t *out)
+{
+   const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+   const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+   const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+   const __m128i mask_2f = _mm_set1_epi8(0x2f);
+   __m128i v, hi, lo, roll;
+   uint8_t tmp[16];
+
+   v = _mm_loadu_si128((const __m128i *)in);
+   hi = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+   lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, mask_2f));
+   if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, _mm_shuffle_epi8(lut_hi, hi)), _mm_setzero_si128())))
+      return 0;
+   roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f), hi));
+   v = _mm_add_epi8(v, roll);
+   /* pack 4 x 6 bits into 24 bits per dword, then drop the top bytes */
+   v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+   v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+   v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+   _mm_storeu_si128((__m128i *)tmp, v);
+   memcpy(out, tmp, 12);
+   return 1;
+}
+#endif
+
+/* Decodes the leading run of complete groups of four alphabet characters,
+ * stopping at padding, whitespace or anything else the callers handle one
+ * character at a time.  Returns the number of input characters consumed;
+ * out receives 3 bytes per 4 of them. */
+size_t sf_base64decode_run(const uint8_t *inbuf, size_t inbuf_size, uint8_t *outbuf)
+{
+   const uint8_t *cursor = inbuf;
+   const uint8_t *end = inbuf + (inbuf_size & ~(size_t)3);
+   uint8_t a, b, c, d;
+
+#ifdef BASE64_SIMD
+   static int ssse3 = -1;
+
+   if(ssse3 < 0)
+      ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+   if(ssse3)
+      while((end - cursor >= 16) && base64_block_ssse3(cursor, outbuf)) {
+         cursor += 16;
+         outbuf += 12;
+      }
+#endif
+   while(cursor < end) {
+      a = sf_decode64tab[cursor[0]];
+      b = sf_decode64tab[cursor[1]];
+      c = sf_decode64tab[cursor[2]];
+      d = sf_decode64tab[cursor[3]];
+      /* 99 ('=') and 100 (invalid) both have bit 6 set */
+      if((a | b | c | d) & 0xc0)
+         break;
+      *outbuf++ = (a << 2) | (b >> 4);
+      *outbuf++ = (b << 4) | (c >> 2);
+      *outbuf++ = (c << 6) | d;
+      cursor += 4;
+   }
+   return cursor - inbuf;
+}
+
 /* base64decode assumes the input data terminates with '=' and/or at the end of the input buffer
  * at inbuf_size.  If extra characters exist within inbuf before inbuf_size is reached, it will
  * happily decode what it can and skip over what it can't.  This is consistent with other decoders
@@ -78,6 +157,26 @@ int sf_base64decode(uint8_t *inbuf, size_t inbuf_size, uint8_t *outbuf, size_t o
    cursor = inbuf;
    outbuf_ptr = outbuf;
    while((cursor < endofinbuf) && (n < max_base64_chars)) {
+      if(base64data_ptr == base64data) {
+         /* whole groups that fit both limits can skip the byte loop */
+         size_t groups = (size_t)(endofinbuf - cursor);
+
+         if(groups > max_base64_chars - n)
+            groups = max_base64_chars - n;
+         groups /= 4;
+         if(groups > (outbuf_size - *bytes_written) / 3)
+            groups = (outbuf_size - *bytes_written) / 3;
+         if(groups) {
+            size_t done = sf_base64decode_run(cursor, groups * 4, outbuf_ptr);
+
+            cursor += done;
+            n += done;
+            outbuf_ptr += done / 4 * 3;
+            *bytes_written += done / 4 * 3;
+            if((cursor >= endofinbuf) || (n >= max_base64_chars))
+               break;
+         }
+      }
       if(sf_decode64tab[*cursor] != 100) {
          *base64data_ptr++ = *cursor;
          n++;  /* Number of base64 bytes we've stored */
@@ -28,5 +28,6 @@
 #include "cltypes.h"
 
 int sf_base64decode(uint8_t*, size_t, uint8_t*, size_t, size_t*); 
+size_t sf_base64decode_run(const uint8_t*, size_t, uint8_t*);
 
 #endif
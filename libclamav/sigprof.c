@@ -0,0 +1,185 @@
+/*
+ *  Sampled cost of the signatures.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "clamav.h"
+#include "others.h"
+#include "sigprof.h"
+
+/* signatures are kept in an open addressed table keyed by their address;
+ * the ones not found within SIGPROF_PROBES slots are only counted */
+#define SIGPROF_BITS	14
+#define SIGPROF_SLOTS	(1 << SIGPROF_BITS)
+#define SIGPROF_PROBES	32
+
+struct sigprof_slot {
+    const void *sig; /* set once, by compare and swap */
+    const char *name;
+    uint32_t type;
+    uint64_t samples;
+    uint64_t nsec;
+    uint64_t max_nsec;
+};
+
+struct cli_sigprof {
+    uint32_t rate;
+    uint64_t draws;
+    uint64_t dropped;
+    struct sigprof_slot slots[SIGPROF_SLOTS];
+};
+
+static const char *sigprof_types[CLI_SIGPROF_TYPES] = {
+    "bytecode", "pcre", "lsig", "yara", "special"
+};
+
+struct cli_sigprof *cli_sigprof_new(uint32_t rate)
+{
+    struct cli_sigprof *prof;
+
+    if (!(prof = cli_calloc(1, sizeof(*prof)))) {
+        cli_errmsg("cli_sigprof_new: Can't allocate memory for the signature profile\n");
+        return NULL;
+    }
+    prof->rate = rate ? rate : 1;
+    return prof;
+}
+
+void cli_sigprof_free(struct cli_sigprof *prof)
+{
+    free(prof);
+}
+
+/* evaluations to skip before the next sample, 1 to 2 * rate - 1; drawn
+ * from a shared counter so that concurrent scans don't sample in step */
+uint32_t cli_sigprof_interval(struct cli_sigprof *prof)
+{
+    uint64_t x = __sync_add_and_fetch(&prof->draws, 1) * 0x9e3779b97f4a7c15ULL;
+
+    x ^= x >> 29;
+    return 1 + (uint32_t)(x % (2 * (uint64_t)prof->rate - 1));
+}
+
+uint64_t cli_sigprof_now(void)
+{
+    struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
+void cli_sigprof_add(struct cli_sigprof *prof, enum cli_sigprof_type type, const void *sig, const char *name, uint64_t start)
+{
+    uint64_t nsec = cli_sigprof_now() - start, max;
+    uint32_t h = (uint32_t)(((uint64_t)(uintptr_t)sig * 0x9e3779b97f4a7c15ULL) >> (64 - SIGPROF_BITS));
+    struct sigprof_slot *slot;
+    unsigned int i;
+
+    if ((int64_t)nsec < 0)
+        nsec = 0;
+    for (i = 0; i < SIGPROF_PROBES; i++) {
+        slot = &prof->slots[(h + i) & (SIGPROF_SLOTS - 1)];
+        if (slot->sig == sig)
+            break;
+        if (!slot->sig && __sync_bool_compare_and_swap((void **)&slot->sig, NULL, (void *)sig)) {
+            slot->name = name;
+            slot->type = type;
+            break;
+        }
+        if (slot->sig == sig)
+            break;
+    }
+    if (i == SIGPROF_PROBES) {
+        __sync_fetch_and_add(&prof->dropped, 1);
+        return;
+    }
+    __sync_fetch_and_add(&slot->samples, 1);
+    __sync_fetch_and_add(&slot->nsec, nsec);
+    while ((max = slot->max_nsec) < nsec && !__sync_bool_compare_and_swap(&slot->max_nsec, max, nsec))
+        ;
+}
+
+static int sigstat_cmp(const void *a, const void *b)
+{
+    const struct cl_sigstat *sa = a, *sb = b;
+
+    if (sa->nsec != sb->nsec)
+        return sa->nsec < sb->nsec ? 1 : -1;
+    return sa->samples < sb->samples ? 1 : sa->samples > sb->samples ? -1 : 0;
+}
+
+int cl_engine_get_sigstats(const struct cl_engine *engine, struct cl_sigstat *stats, unsigned int *count)
+{
+    const struct cli_sigprof *prof;
+    struct cl_sigstat *all;
+    unsigned int i, n = 0;
+    size_t len;
+
+    if (!engine || !count || (*count && !stats)) {
+        cli_errmsg("cl_engine_get_sigstats: NULL argument\n");
+        return CL_ENULLARG;
+    }
+    if (!(prof = engine->sigprof)) {
+        *count = 0;
+        return CL_SUCCESS;
+    }
+    if (!(all = cli_malloc(SIGPROF_SLOTS * sizeof(*all)))) {
+        cli_errmsg("cl_engine_get_sigstats: Can't allocate memory for the statistics\n");
+        return CL_EMEM;
+    }
+    for (i = 0; i < SIGPROF_SLOTS; i++) {
+        const struct sigprof_slot *slot = &prof->slots[i];
+        const char *name = slot->name;
+
+        if (!slot->samples)
+            continue;
+        strncpy(all[n].type, slot->type < CLI_SIGPROF_TYPES ? sigprof_types[slot->type] : "", sizeof(all[n].type) - 1);
+        all[n].type[sizeof(all[n].type) - 1] = '\0';
+        /* bytecodes are named by their logical signature */
+        len = name ? strcspn(name, ";") : 0;
+        if (len >= sizeof(all[n].name))
+            len = sizeof(all[n].name) - 1;
+        memcpy(all[n].name, name ? name : "", len);
+        all[n].name[len] = '\0';
+        all[n].samples = slot->samples;
+        all[n].nsec = slot->nsec;
+        all[n].max_nsec = slot->max_nsec;
+        n++;
+    }
+    if (prof->dropped)
+        cli_dbgmsg("cl_engine_get_sigstats: %llu samples dropped, table full\n", (unsigned long long)prof->dropped);
+    cli_qsort(all, n, sizeof(*all), sigstat_cmp);
+    if (*count)
+        memcpy(stats, all, (n < *count ? n : *count) * sizeof(*all));
+    free(all);
+    *count = n;
+    return CL_SUCCESS;
+}
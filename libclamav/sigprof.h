@@ -0,0 +1,73 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/* Sampled cost of the signatures, see cl_engine_get_sigstats().
+ *
+ * With CL_ENGINE_SIGPROF_RATE set, the evaluations of the signatures that
+ * can be expensive on their own (bytecodes, PCREs, logical and YARA
+ * conditions, AC patterns with alternatives) ask cli_sigprof_start()
+ * whether to time them. Each scan counts the evaluations down from a
+ * random interval averaging the rate, so only the sampled ones read the
+ * clock, and cli_sigprof_stop() adds their time to the signature with
+ * atomic operations. Without a rate, the cost is a test of the engine. */
+
+#ifndef __SIGPROF_H
+#define __SIGPROF_H
+
+#include "others.h"
+
+enum cli_sigprof_type {
+    CLI_SIGPROF_BYTECODE = 0,
+    CLI_SIGPROF_PCRE,
+    CLI_SIGPROF_LSIG,
+    CLI_SIGPROF_YARA,
+    CLI_SIGPROF_SPECIAL,
+    CLI_SIGPROF_TYPES
+};
+
+struct cli_sigprof *cli_sigprof_new(uint32_t rate);
+void cli_sigprof_free(struct cli_sigprof *prof);
+uint32_t cli_sigprof_interval(struct cli_sigprof *prof);
+uint64_t cli_sigprof_now(void);
+void cli_sigprof_add(struct cli_sigprof *prof, enum cli_sigprof_type type, const void *sig, const char *name, uint64_t start);
+
+/* Returns the start time when this evaluation is sampled, 0 otherwise. A
+ * new scan starts with a tick of 0, which draws its first interval. */
+static inline uint64_t cli_sigprof_start(cli_ctx *ctx)
+{
+    struct cli_sigprof *prof;
+    unsigned int tick;
+
+    if (!ctx || !ctx->engine || !(prof = ctx->engine->sigprof))
+        return 0;
+    if ((tick = ctx->sigprof_tick) > 1) {
+        ctx->sigprof_tick = tick - 1;
+        return 0;
+    }
+    ctx->sigprof_tick = cli_sigprof_interval(prof);
+    return tick ? cli_sigprof_now() : 0;
+}
+
+/* sig identifies the signature, name must live as long as the engine */
+static inline void cli_sigprof_stop(cli_ctx *ctx, enum cli_sigprof_type type, const void *sig, const char *name, uint64_t start)
+{
+    if (start)
+        cli_sigprof_add(ctx->engine->sigprof, type, sig, name, start);
+}
+
+#endif
@@ -159,7 +159,7 @@ static uint32_t summit (char *src, int size)
 }
 
 
-int unspin(char *src, int ssize, struct cli_exe_section *sections, int sectcnt, uint32_t nep, int desc, cli_ctx *ctx) {
+int unspin(char *src, int ssize, struct cli_exe_section *sections, int sectcnt, uint32_t nep, struct cli_extract *x, cli_ctx *ctx) {
   char *curr, *emu, *ep, *spinned;
   char **sects;
   int blobsz=0, j;
@@ -493,7 +493,7 @@ int unspin(char *src, int ssize, struct cli_exe_section *sections, int sectcnt,
 	bitmap = bitmap >>1;
       }
 
-      if (! cli_rebuildpe(ep, rebhlp, sectcnt, 0x400000, 0x1000, 0, 0, desc)) { /* can't be bothered fixing those values: the rebuilt exe is completely broken anyway. */
+      if (! cli_rebuildpe(ep, rebhlp, sectcnt, 0x400000, 0x1000, 0, 0, x)) { /* can't be bothered fixing those values: the rebuilt exe is completely broken anyway. */
 	cli_dbgmsg("spin: Cannot write unpacked file\n");
 	retval = 1;
       }
@@ -25,6 +25,6 @@
 #include "cltypes.h"
 #include "rebuildpe.h"
 
-int unspin(char *, int, struct cli_exe_section *, int, uint32_t, int, cli_ctx *);
+int unspin(char *, int, struct cli_exe_section *, int, uint32_t, struct cli_extract *, cli_ctx *);
 
 #endif
@@ -62,7 +62,7 @@
 
 #define DEBUG_STATS 0
 
-static cli_flagged_sample_t *find_sample(cli_intel_t *intel, const char *virname, const unsigned char *md5, size_t size, stats_section_t *sections);
+static cli_flagged_sample_t *find_sample(cli_stats_shard_t *shard, const char *virname, const unsigned char *md5, size_t size, stats_section_t *sections);
 void free_sample(cli_flagged_sample_t *sample);
 
 #if DEBUG_STATS
@@ -137,12 +137,224 @@ void print_sample(cli_flagged_sample_t *sample)
 }
 #endif
 
+#define STATS_SUBMITTER_NONE 0
+#define STATS_SUBMITTER_RUNNING 1
+#define STATS_SUBMITTER_STOPPED 2
+
+static inline cli_stats_shard_t *get_shard(cli_intel_t *intel, const unsigned char *md5)
+{
+    return &intel->shards[md5[0] % STATS_SHARDS];
+}
+
+static size_t sample_size(const cli_flagged_sample_t *sample)
+{
+    size_t sz = sizeof(cli_flagged_sample_t), i;
+
+    if ((sample->virus_name)) {
+        for (i=0; sample->virus_name[i] != NULL; i++)
+            sz += strlen(sample->virus_name[i]);
+        sz += sizeof(char **) * i;
+    }
+
+    return sz;
+}
+
+static void unlink_sample(cli_stats_shard_t *shard, cli_flagged_sample_t *sample)
+{
+    if (sample->prev)
+        sample->prev->next = sample->next;
+    if (sample->next)
+        sample->next->prev = sample->prev;
+    if (sample == shard->samples)
+        shard->samples = sample->next;
+
+    shard->nsamples--;
+    shard->size -= sample_size(sample);
+}
+
+/* Takes the samples out of all the shards, holding each lock just for that */
+static cli_flagged_sample_t *detach_samples(cli_intel_t *intel, uint32_t *nsamples)
+{
+    cli_flagged_sample_t *head = NULL, *tail = NULL, *samples;
+    size_t i;
+#ifdef CL_THREAD_SAFE
+    int err;
+#endif
+
+    *nsamples = 0;
+    for (i=0; i < STATS_SHARDS; i++) {
+        cli_stats_shard_t *shard = &intel->shards[i];
+
+#ifdef CL_THREAD_SAFE
+        err = pthread_mutex_lock(&(shard->mutex));
+        if (err) {
+            cli_warnmsg("detach_samples: locking mutex failed (err: %d): %s\n", err, strerror(err));
+            continue;
+        }
+#endif
+        samples = shard->samples;
+        *nsamples += shard->nsamples;
+        shard->samples = NULL;
+        shard->nsamples = 0;
+        shard->size = 0;
+#ifdef CL_THREAD_SAFE
+        pthread_mutex_unlock(&(shard->mutex));
+#endif
+
+        if (!(samples))
+            continue;
+
+        if (tail) {
+            tail->next = samples;
+            samples->prev = tail;
+        } else {
+            head = samples;
+        }
+        for (tail = samples; tail->next != NULL; tail = tail->next)
+            ;
+    }
+
+    return head;
+}
+
+#ifdef CL_THREAD_SAFE
+static void *stats_submitter(void *arg)
+{
+    cli_intel_t *intel = (cli_intel_t *)arg;
+
+    pthread_mutex_lock(&(intel->mutex));
+    while (intel->submitter_state == STATS_SUBMITTER_RUNNING) {
+        if (!intel->submit_pending) {
+            pthread_cond_wait(&(intel->submit_cond), &(intel->mutex));
+            continue;
+        }
+        pthread_mutex_unlock(&(intel->mutex));
+
+        clamav_stats_submit(intel->engine, intel);
+
+        pthread_mutex_lock(&(intel->mutex));
+        intel->submit_pending = 0;
+    }
+    pthread_mutex_unlock(&(intel->mutex));
+
+    return NULL;
+}
+
+/* Hands the submission to the submitter thread, started on first use. Returns
+ * 0 if the caller has to submit by itself. */
+static int submit_async(cli_intel_t *intel)
+{
+    int ret = 1;
+
+    if (intel->submit_pending)
+        return 1;
+
+    pthread_mutex_lock(&(intel->mutex));
+    if (intel->submitter_state == STATS_SUBMITTER_NONE) {
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        if (pthread_create(&(intel->submitter), &attr, stats_submitter, intel))
+            cli_warnmsg("clamav_stats_add_sample: can't start the submitter thread\n");
+        else
+            intel->submitter_state = STATS_SUBMITTER_RUNNING;
+        pthread_attr_destroy(&attr);
+    }
+
+    if (intel->submitter_state == STATS_SUBMITTER_RUNNING) {
+        intel->submit_pending = 1;
+        pthread_cond_signal(&(intel->submit_cond));
+    } else {
+        ret = 0;
+    }
+    pthread_mutex_unlock(&(intel->mutex));
+
+    return ret;
+}
+#endif
+
+int clamav_stats_init(cli_intel_t *intel)
+{
+#ifdef CL_THREAD_SAFE
+    size_t i;
+
+    for (i=0; i < STATS_SHARDS; i++) {
+        if (pthread_mutex_init(&(intel->shards[i].mutex), NULL)) {
+            while (i--)
+                pthread_mutex_destroy(&(intel->shards[i].mutex));
+            return -1;
+        }
+    }
+
+    if (pthread_mutex_init(&(intel->mutex), NULL)) {
+        for (i=0; i < STATS_SHARDS; i++)
+            pthread_mutex_destroy(&(intel->shards[i].mutex));
+        return -1;
+    }
+
+    if (pthread_cond_init(&(intel->submit_cond), NULL)) {
+        pthread_mutex_destroy(&(intel->mutex));
+        for (i=0; i < STATS_SHARDS; i++)
+            pthread_mutex_destroy(&(intel->shards[i].mutex));
+        return -1;
+    }
+
+    intel->submitter_state = STATS_SUBMITTER_NONE;
+    intel->submit_pending = 0;
+#else
+    UNUSEDPARAM(intel);
+#endif
+
+    return 0;
+}
+
+/* Waits for a pending submission and stops the submitter thread */
+void clamav_stats_stop(cli_intel_t *intel)
+{
+#ifdef CL_THREAD_SAFE
+    int running;
+
+    pthread_mutex_lock(&(intel->mutex));
+    running = (intel->submitter_state == STATS_SUBMITTER_RUNNING);
+    intel->submitter_state = STATS_SUBMITTER_STOPPED;
+    pthread_cond_signal(&(intel->submit_cond));
+    pthread_mutex_unlock(&(intel->mutex));
+
+    if (running)
+        pthread_join(intel->submitter, NULL);
+#else
+    UNUSEDPARAM(intel);
+#endif
+}
+
+void clamav_stats_free(cli_intel_t *intel)
+{
+    cli_flagged_sample_t *sample, *next;
+    uint32_t n;
+#ifdef CL_THREAD_SAFE
+    size_t i;
+#endif
+
+    clamav_stats_stop(intel);
+
+    for (sample = detach_samples(intel, &n); sample != NULL; sample = next) {
+        next = sample->next;
+        free_sample(sample);
+    }
+
+#ifdef CL_THREAD_SAFE
+    pthread_cond_destroy(&(intel->submit_cond));
+    pthread_mutex_destroy(&(intel->mutex));
+    for (i=0; i < STATS_SHARDS; i++)
+        pthread_mutex_destroy(&(intel->shards[i].mutex));
+#endif
+}
+
 void clamav_stats_add_sample(const char *virname, const unsigned char *md5, size_t size, stats_section_t *sections, void *cbdata)
 {
     cli_intel_t *intel;
+    cli_stats_shard_t *shard;
     cli_flagged_sample_t *sample;
-    size_t i;
-    char **p;
     int err, submit=0;
 
     if (!(cbdata))
@@ -170,7 +382,11 @@ void clamav_stats_add_sample(const char *virname, const unsigned char *md5, size
 
     if (submit) {
         if ((intel->engine->cb_stats_submit)) {
-            intel->engine->cb_stats_submit(intel->engine, cbdata);
+#ifdef CL_THREAD_SAFE
+            /* our own submission doesn't need to hold up the scan */
+            if (intel->engine->cb_stats_submit != clamav_stats_submit || !submit_async(intel))
+#endif
+                intel->engine->cb_stats_submit(intel->engine, cbdata);
         } else {
             if ((intel->engine->cb_stats_flush))
                 intel->engine->cb_stats_flush(intel->engine, intel);
@@ -179,84 +395,38 @@ void clamav_stats_add_sample(const char *virname, const unsigned char *md5, size
         }
     }
 
+    shard = get_shard(intel, md5);
 #ifdef CL_THREAD_SAFE
-    err = pthread_mutex_lock(&(intel->mutex));
+    err = pthread_mutex_lock(&(shard->mutex));
     if (err) {
         cli_warnmsg("clamav_stats_add_sample: locking mutex failed (err: %d): %s\n", err, strerror(err));
         return;
     }
 #endif
 
-    sample = find_sample(intel, virname, md5, size, sections);
+    sample = find_sample(shard, virname, md5, size, sections);
     if (!(sample)) {
-        if (!(intel->samples)) {
-            sample = intel->samples = calloc(1, sizeof(cli_flagged_sample_t));
-            if (!(sample))
-                goto end;
-        } else {
-            sample = calloc(1, sizeof(cli_flagged_sample_t));
-            if (!(sample))
-                goto end;
-
-            sample->next = intel->samples;
-            intel->samples->prev = sample;
-            intel->samples = sample;
-        }
-
-        if ((sample->virus_name)) {
-            for (i=0; sample->virus_name[i] != NULL; i++)
-                ;
-            p = realloc(sample->virus_name, sizeof(char **) * (i + 1));
-            if (!(p)) {
-                free(sample->virus_name);
-                free(sample);
-                if (sample == intel->samples)
-                    intel->samples = NULL;
-
-                goto end;
-            }
-
-            sample->virus_name = p;
-        } else {
-            i=0;
-            sample->virus_name = calloc(1, sizeof(char **));
-            if (!(sample->virus_name)) {
-                free(sample);
-                if (sample == intel->samples)
-                    intel->samples = NULL;
-
-                goto end;
-            }
-        }
+        sample = calloc(1, sizeof(cli_flagged_sample_t));
+        if (!(sample))
+            goto end;
 
-        sample->virus_name[i] = strdup((virname != NULL) ? virname : "[unknown]");
-        if (!(sample->virus_name[i])) {
-            free(sample->virus_name);
+        sample->virus_name = calloc(2, sizeof(char **));
+        if (!(sample->virus_name)) {
             free(sample);
-            if (sample == intel->samples)
-                intel->samples = NULL;
-
             goto end;
         }
 
-        p = realloc(sample->virus_name, sizeof(char **) * (i+2));
-        if (!(p)) {
+        sample->virus_name[0] = strdup((virname != NULL) ? virname : "[unknown]");
+        if (!(sample->virus_name[0])) {
             free(sample->virus_name);
             free(sample);
-            if (sample == intel->samples)
-                intel->samples = NULL;
-
             goto end;
         }
 
-        sample->virus_name = p;
-        sample->virus_name[i+1] = NULL;
-
         memcpy(sample->md5, md5, sizeof(sample->md5));
         sample->size = (uint32_t)size;
-        intel->nsamples++;
 
-        if (sections && sections->nsections && !(sample->sections)) {
+        if (sections && sections->nsections) {
             /* Copy the section data that has already been allocated. We don't care if calloc fails; just skip copying if it does. */
             sample->sections = calloc(1, sizeof(stats_section_t));
             if ((sample->sections)) {
@@ -270,13 +440,20 @@ void clamav_stats_add_sample(const char *virname, const unsigned char *md5, size
                 }
             }
         }
+
+        sample->next = shard->samples;
+        if ((shard->samples))
+            shard->samples->prev = sample;
+        shard->samples = sample;
+        shard->nsamples++;
+        shard->size += sample_size(sample);
     }
 
     sample->hits++;
 
 end:
 #ifdef CL_THREAD_SAFE
-    err = pthread_mutex_unlock(&(intel->mutex));
+    err = pthread_mutex_unlock(&(shard->mutex));
     if (err) {
         cli_warnmsg("clamav_stats_add_sample: unlcoking mutex failed (err: %d): %s\n", err, strerror(err));
     }
@@ -288,6 +465,7 @@ void clamav_stats_flush(struct cl_engine *engine, void *cbdata)
 {
     cli_intel_t *intel;
     cli_flagged_sample_t *sample, *next;
+    uint32_t n;
     int err;
 
     if (!(cbdata) || !(engine))
@@ -295,6 +473,12 @@ void clamav_stats_flush(struct cl_engine *engine, void *cbdata)
 
     intel = (cli_intel_t *)cbdata;
 
+    for (sample = detach_samples(intel, &n); sample != NULL; sample = next) {
+        next = sample->next;
+
+        free_sample(sample);
+    }
+
 #ifdef CL_THREAD_SAFE
     err = pthread_mutex_lock(&(intel->mutex));
     if (err) {
@@ -303,14 +487,6 @@ void clamav_stats_flush(struct cl_engine *engine, void *cbdata)
     }
 #endif
 
-    for (sample=intel->samples; sample != NULL; sample = next) {
-        next = sample->next;
-
-        free_sample(sample);
-    }
-
-    intel->samples = NULL;
-    intel->nsamples = 0;
     if (intel->hostid) {
         free(intel->hostid);
         intel->hostid = NULL;
@@ -378,12 +554,7 @@ void clamav_stats_submit(struct cl_engine *engine, void *cbdata)
     }
 #endif
 
-    /* Empty out the cached intelligence data so that other threads don't sit waiting to add data to the cache */
     memcpy(&myintel, intel, sizeof(cli_intel_t));
-    intel->samples = NULL;
-    intel->nsamples = 0;
-
-    json = export_stats_to_json(engine, &myintel);
 
 #ifdef CL_THREAD_SAFE
     err = pthread_mutex_unlock(&(intel->mutex));
@@ -392,6 +563,11 @@ void clamav_stats_submit(struct cl_engine *engine, void *cbdata)
     }
 #endif
 
+    /* Empty out the shards first, the scanners only wait for that */
+    myintel.samples = detach_samples(intel, &myintel.nsamples);
+
+    json = export_stats_to_json(engine, &myintel);
+
     for (sample=myintel.samples; sample != NULL; sample = next) {
 #if DEBUG_STATS
         print_sample(sample);
@@ -417,6 +593,7 @@ void clamav_stats_submit(struct cl_engine *engine, void *cbdata)
 void clamav_stats_remove_sample(const char *virname, const unsigned char *md5, size_t size, void *cbdata)
 {
     cli_intel_t *intel;
+    cli_stats_shard_t *shard;
     cli_flagged_sample_t *sample;
     int err;
 
@@ -424,28 +601,22 @@ void clamav_stats_remove_sample(const char *virname, const unsigned char *md5, s
     if (!(intel))
         return;
 
+    shard = get_shard(intel, md5);
 #ifdef CL_THREAD_SAFE
-    err = pthread_mutex_lock(&(intel->mutex));
+    err = pthread_mutex_lock(&(shard->mutex));
     if (err) {
         cli_warnmsg("clamav_stats_remove_sample: locking mutex failed (err: %d): %s\n", err, strerror(err));
         return;
     }
 #endif
 
-    while ((sample = find_sample(intel, virname, md5, size, NULL))) {
-        if (sample->prev)
-            sample->prev->next = sample->next;
-        if (sample->next)
-            sample->next->prev = sample->prev;
-        if (sample == intel->samples)
-            intel->samples = sample->next;
-
+    while ((sample = find_sample(shard, virname, md5, size, NULL))) {
+        unlink_sample(shard, sample);
         free_sample(sample);
-        intel->nsamples--;
     }
 
 #ifdef CL_THREAD_SAFE
-    err = pthread_mutex_unlock(&(intel->mutex));
+    err = pthread_mutex_unlock(&(shard->mutex));
     if (err) {
         cli_warnmsg("clamav_stats_remove_sample: unlocking mutex failed (err: %d): %s\n", err, strerror(err));
     }
@@ -455,94 +626,77 @@ void clamav_stats_remove_sample(const char *virname, const unsigned char *md5, s
 void clamav_stats_decrement_count(const char *virname, const unsigned char *md5, size_t size, void *cbdata)
 {
     cli_intel_t *intel;
+    cli_stats_shard_t *shard;
     cli_flagged_sample_t *sample;
-    int err;
+    int err, remove = 0;
 
     intel = (cli_intel_t *)cbdata;
     if (!(intel))
         return;
 
+    shard = get_shard(intel, md5);
 #ifdef CL_THREAD_SAFE
-    err = pthread_mutex_lock(&(intel->mutex));
+    err = pthread_mutex_lock(&(shard->mutex));
     if (err) {
         cli_warnmsg("clamav_stats_decrement_count: locking mutex failed (err: %d): %s\n", err, strerror(err));
         return;
     }
 #endif
 
-    sample = find_sample(intel, virname, md5, size, NULL);
-    if (!(sample))
-        goto clamav_stats_decrement_end;
-
-    if (sample->hits == 1) {
-        if ((intel->engine->cb_stats_remove_sample))
-            intel->engine->cb_stats_remove_sample(virname, md5, size, intel);
+    sample = find_sample(shard, virname, md5, size, NULL);
+    if ((sample)) {
+        if (sample->hits == 1)
+            remove = 1;
         else
-            clamav_stats_remove_sample(virname, md5, size, intel);
-
-        goto clamav_stats_decrement_end;
+            sample->hits--;
     }
 
-    sample->hits--;
-
- clamav_stats_decrement_end:
 #ifdef CL_THREAD_SAFE
-    err = pthread_mutex_unlock(&(intel->mutex));
+    err = pthread_mutex_unlock(&(shard->mutex));
     if (err) {
         cli_warnmsg("clamav_stats_decrement_count: unlocking mutex failed (err: %d): %s\n", err, strerror(err));
     }
 #endif
-    return;
+
+    /* the removal takes the lock on its own */
+    if (remove) {
+        if ((intel->engine->cb_stats_remove_sample))
+            intel->engine->cb_stats_remove_sample(virname, md5, size, intel);
+        else
+            clamav_stats_remove_sample(virname, md5, size, intel);
+    }
 }
 
+/* The totals are read without the shard locks: they're only compared
+ * against the submission thresholds */
 size_t clamav_stats_get_num(void *cbdata)
 {
     cli_intel_t *intel;
+    size_t n = 0, i;
 
     intel = (cli_intel_t *)cbdata;
 
     if (!(intel))
         return 0;
 
-    return intel->nsamples;
+    for (i=0; i < STATS_SHARDS; i++)
+        n += intel->shards[i].nsamples;
+
+    return n;
 }
 
 size_t clamav_stats_get_size(void *cbdata)
 {
     cli_intel_t *intel;
-    cli_flagged_sample_t *sample;
     size_t sz, i;
-    int err;
 
     intel = (cli_intel_t *)cbdata;
     if (!(intel))
         return 0;
 
     sz = sizeof(cli_intel_t);
-
-#ifdef CL_THREAD_SAFE
-    err = pthread_mutex_lock(&(intel->mutex));
-    if (err) {
-        cli_warnmsg("clamav_stats_get_size: locking mutex failed (err: %d): %s\n", err, strerror(err));
-        return sz;
-    }
-#endif
-
-    for (sample = intel->samples; sample != NULL; sample = sample->next) {
-        sz += sizeof(cli_flagged_sample_t);
-        if ((sample->virus_name)) {
-            for (i=0; sample->virus_name[i] != NULL; i++)
-                sz += strlen(sample->virus_name[i]);
-            sz += sizeof(char **) * i;
-        }
-    }
-
-#ifdef CL_THREAD_SAFE
-    err = pthread_mutex_unlock(&(intel->mutex));
-    if (err) {
-        cli_warnmsg("clamav_stats_get_size: unlocking mutex failed (err: %d): %s\n", err, strerror(err));
-    }
-#endif
+    for (i=0; i < STATS_SHARDS; i++)
+        sz += intel->shards[i].size;
 
     return sz;
 }
@@ -611,12 +765,12 @@ char *clamav_stats_get_hostid(void *cbdata)
 }
 #endif
 
-static cli_flagged_sample_t *find_sample(cli_intel_t *intel, const char *virname, const unsigned char *md5, size_t size, stats_section_t *sections)
+static cli_flagged_sample_t *find_sample(cli_stats_shard_t *shard, const char *virname, const unsigned char *md5, size_t size, stats_section_t *sections)
 {
     cli_flagged_sample_t *sample;
     size_t i;
 
-    for (sample = intel->samples; sample != NULL; sample = sample->next) {
+    for (sample = shard->samples; sample != NULL; sample = sample->next) {
         int foundSections = 0;
 
         if (sample->size != size)
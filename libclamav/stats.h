@@ -33,4 +33,8 @@ size_t clamav_stats_get_num(void *cbdata);
 size_t clamav_stats_get_size(void *cbdata);
 char *clamav_stats_get_hostid(void *cbdata);
 
+int clamav_stats_init(cli_intel_t *intel);
+void clamav_stats_stop(cli_intel_t *intel);
+void clamav_stats_free(cli_intel_t *intel);
+
 #endif
@@ -249,7 +249,6 @@ char *cli_str2hex(const char *string, unsigned int len)
 char *cli_utf16toascii(const char *str, unsigned int length)
 {
 	char *decoded;
-	unsigned int i, j;
 
 
     if(length < 2) {
@@ -263,14 +262,22 @@ char *cli_utf16toascii(const char *str, unsigned int length)
     if(!(decoded = cli_calloc(length / 2 + 1, sizeof(char))))
 	return NULL;
 
-    for(i = 0, j = 0; i < length; i += 2, j++) {
-       decoded[j] = str[i + 1] << 4;
-       decoded[j] += str[i];
-    }
-
+    cli_utf16toascii_buf(decoded, str, length);
     return decoded;
 }
 
+/* cli_utf16toascii() into a caller's buffer of length / 2 bytes; a plain
+ * loop over unsigned bytes the compiler can vectorize */
+void cli_utf16toascii_buf(char *dst, const char *str, size_t length)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	unsigned char *d = (unsigned char *) dst;
+	size_t i;
+
+    for(i = 0; i < length / 2; i++)
+	d[i] = (unsigned char) (s[2 * i] + (s[2 * i + 1] << 4));
+}
+
 int cli_strbcasestr(const char *haystack, const char *needle)
 {
 	const char *pt =  haystack;
@@ -48,6 +48,7 @@ int cli_hex2num(const char *hex);
 int cli_xtoi(const char *hex);
 char *cli_str2hex(const char *string, unsigned int len);
 char *cli_utf16toascii(const char *str, unsigned int length);
+void cli_utf16toascii_buf(char *dst, const char *str, size_t length);
 char *cli_strtokbuf(const char *input, int fieldno, const char *delim, char *output);
 const char *cli_memstr(const char *haystack, unsigned int hs, const char *needle, unsigned int ns);
 char *cli_strrcpy(char *dest, const char *source);
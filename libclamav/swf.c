@@ -120,45 +120,35 @@ struct swf_file_hdr {
     uint32_t filesize;
 };
 
+/* The body is inflated into an extraction buffer and scanned from memory:
+ * the FWS file it makes up comes back to cli_scanswf() for the tag walk */
 static int scanzws(cli_ctx *ctx, struct swf_file_hdr *hdr)
 {
         struct CLI_LZMA lz;
-        unsigned char inbuff[FILEBUFF], outbuff[FILEBUFF];
+        unsigned char outbuff[FILEBUFF];
+        struct cli_extract x;
         fmap_t *map = *ctx->fmap;
         /* strip off header */
         off_t offset = 8;
         uint32_t d_insize;
-        size_t outsize = 8;
+        size_t outsize = 8, avail;
         int ret, lret, count;
-        char *tmpname;
-        int fd;
 
-    if((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd)) != CL_SUCCESS) {
-        cli_errmsg("scanzws: Can't generate temporary file\n");
-        return ret;
-    }
+    cli_extract_init(&x, ctx, NULL);
 
     hdr->signature[0] = 'F';
-    if(cli_writen(fd, hdr, sizeof(struct swf_file_hdr)) != sizeof(struct swf_file_hdr)) {
-        cli_errmsg("scanzws: Can't write to file %s\n", tmpname);
-        close(fd);
-        if(cli_unlink(tmpname)) {
-            free(tmpname);
+    if((ret = cli_extract_write(&x, hdr, sizeof(struct swf_file_hdr))) != CL_SUCCESS) {
+        cli_errmsg("scanzws: Can't write decompressed data\n");
+        if(cli_extract_done(&x))
             return CL_EUNLINK;
-        }
-        free(tmpname);
-        return CL_EWRITE;
+        return ret;
     }
 
     /* read 4 bytes (for compressed 32-bit filesize) [not used for LZMA] */
     if (fmap_readn(map, &d_insize, offset, sizeof(d_insize)) != sizeof(d_insize)) {
         cli_errmsg("scanzws: Error reading SWF file\n");
-        close(fd);
-        if (cli_unlink(tmpname)) {
-            free(tmpname);
+        if (cli_extract_done(&x))
             return CL_EUNLINK;
-        }
-        free(tmpname);
         return CL_EREAD;
     }
     offset += sizeof(d_insize);
@@ -173,85 +163,51 @@ static int scanzws(cli_ctx *ctx, struct swf_file_hdr *hdr)
                     d_insize, (long long unsigned)(map->len - 17));
     }
 
+    memset(&lz, 0, sizeof(lz));
+    lz.ctx = ctx;
+
     /* first buffer required for initializing LZMA */
-    ret = fmap_readn(map, inbuff, offset, FILEBUFF);
-    if (ret < 0) {
-        cli_errmsg("scanzws: Error reading SWF file\n");
-        close(fd);
-        if (cli_unlink(tmpname)) {
-            free(tmpname);
-            return CL_EUNLINK;
-        }
-        free(tmpname);
-        return CL_EUNPACK;
-    }
-    /* nothing written, likely truncated */
-    if (!ret) {
+    lz.next_in = (unsigned char *)fmap_need_off_once_len(map, offset, FILEBUFF, &avail);
+    /* nothing read, likely truncated */
+    if (!lz.next_in || !avail) {
         cli_errmsg("scanzws: possibly truncated file\n");
-        close(fd);
-        if (cli_unlink(tmpname)) {
-            free(tmpname);
+        if (cli_extract_done(&x))
             return CL_EUNLINK;
-        }
-        free(tmpname);
         return CL_EFORMAT;
     }
-    offset += ret;
+    offset += avail;
 
-    memset(&lz, 0, sizeof(lz));
-    lz.next_in = inbuff;
     lz.next_out = outbuff;
-    lz.avail_in = ret;
+    lz.avail_in = avail;
     lz.avail_out = FILEBUFF;
 
     lret = cli_LzmaInit(&lz, hdr->filesize);
     if (lret != LZMA_RESULT_OK) {
         cli_errmsg("scanzws: LzmaInit() failed\n");
-        close(fd);
-        if (cli_unlink(tmpname)) {
-            free(tmpname);
+        if (cli_extract_done(&x))
             return CL_EUNLINK;
-        }
-        free(tmpname);
         return CL_EUNPACK;
     }
 
     while (lret == LZMA_RESULT_OK) {
         if (lz.avail_in == 0) {
-            lz.next_in = inbuff;
-
-            ret = fmap_readn(map, inbuff, offset, FILEBUFF);
-            if (ret < 0) {
-                cli_errmsg("scanzws: Error reading SWF file\n");
-                cli_LzmaShutdown(&lz);
-                close(fd);
-                if (cli_unlink(tmpname)) {
-                    free(tmpname);
-                    return CL_EUNLINK;
-                }
-                free(tmpname);
-                return CL_EUNPACK;
-            }
-            if (!ret)
+            lz.next_in = (unsigned char *)fmap_need_off_once_len(map, offset, FILEBUFF, &avail);
+            if (!lz.next_in || !avail)
                 break;
-            lz.avail_in = ret;
-            offset += ret;
+            lz.avail_in = avail;
+            offset += avail;
         }
         lret = cli_LzmaDecode(&lz);
         count = FILEBUFF - lz.avail_out;
         if (count) {
             if (cli_checklimits("SWF", ctx, outsize + count, 0, 0) != CL_SUCCESS)
                 break;
-            if (cli_writen(fd, outbuff, count) != count) {
-                cli_errmsg("scanzws: Can't write to file %s\n", tmpname);
+            if ((ret = cli_extract_write(&x, outbuff, count)) != CL_SUCCESS) {
+                cli_errmsg("scanzws: Can't write decompressed data\n");
                 cli_LzmaShutdown(&lz);
-                close(fd);
-                if (cli_unlink(tmpname)) {
-                    free(tmpname);
+                if (cli_extract_done(&x))
                     return CL_EUNLINK;
-                }
-                free(tmpname);
-                return CL_EWRITE;
+                return ret;
             }
             outsize += count;
         }
@@ -265,17 +221,13 @@ static int scanzws(cli_ctx *ctx, struct swf_file_hdr *hdr)
         /* outsize starts at 8, therefore, if its still 8, nothing was decompressed */
         if (outsize == 8) {
             cli_infomsg(ctx, "scanzws: Error decompressing SWF file. No data decompressed.\n");
-            close(fd);
-            if (cli_unlink(tmpname)) {
-                free(tmpname);
+            if (cli_extract_done(&x))
                 return CL_EUNLINK;
-            }
-            free(tmpname);
             return CL_EUNPACK;
         }
         cli_infomsg(ctx, "scanzws: Error decompressing SWF file. Scanning what was decompressed.\n");
     }
-    cli_dbgmsg("SWF: Decompressed[LZMA] to %s, size %llu\n", tmpname, (long long unsigned)outsize);
+    cli_dbgmsg("SWF: Decompressed[LZMA], size %llu\n", (long long unsigned)outsize);
 
     /* check if declared output size matches actual output size */
     if (hdr->filesize != outsize) {
@@ -286,47 +238,33 @@ static int scanzws(cli_ctx *ctx, struct swf_file_hdr *hdr)
                    hdr->filesize, (long long unsigned)outsize);
     }
 
-    ret = cli_magic_scandesc(fd, ctx);
-
-    close(fd);
-    if (!(ctx->engine->keeptmp)) {
-        if (cli_unlink(tmpname)) {
-            free(tmpname);
-            return CL_EUNLINK;
-        }
-    }
-    free(tmpname);
+    ret = cli_extract_scan(&x);
+    if(cli_extract_done(&x))
+        return CL_EUNLINK;
     return ret;
 }
 
 static int scancws(cli_ctx *ctx, struct swf_file_hdr *hdr)
 {
         z_stream stream;
-        char inbuff[FILEBUFF], outbuff[FILEBUFF];
+        char outbuff[FILEBUFF];
+        struct cli_extract x;
         fmap_t *map = *ctx->fmap;
-        int offset = 8, ret, zret, outsize = 8, count, zend;
-        char *tmpname;
-        int fd;
+        size_t offset = 8, avail;
+        int ret, zret, outsize = 8, count, zend;
 
-    if((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd)) != CL_SUCCESS) {
-        cli_errmsg("scancws: Can't generate temporary file\n");
-        return ret;
-    }
+    cli_extract_init(&x, ctx, NULL);
 
     hdr->signature[0] = 'F';
-    if(cli_writen(fd, hdr, sizeof(struct swf_file_hdr)) != sizeof(struct swf_file_hdr)) {
-        cli_errmsg("scancws: Can't write to file %s\n", tmpname);
-        close(fd);
-        if(cli_unlink(tmpname)) {
-            free(tmpname);
+    if((ret = cli_extract_write(&x, hdr, sizeof(struct swf_file_hdr))) != CL_SUCCESS) {
+        cli_errmsg("scancws: Can't write decompressed data\n");
+        if(cli_extract_done(&x))
             return CL_EUNLINK;
-        }
-        free(tmpname);
-        return CL_EWRITE;
+        return ret;
     }
 
     stream.avail_in = 0;
-    stream.next_in = (Bytef *)inbuff;
+    stream.next_in = NULL;
     stream.next_out = (Bytef *)outbuff;
     stream.zalloc = (alloc_func) NULL;
     stream.zfree = (free_func) NULL;
@@ -336,50 +274,30 @@ static int scancws(cli_ctx *ctx, struct swf_file_hdr *hdr)
     zret = inflateInit(&stream);
     if(zret != Z_OK) {
         cli_errmsg("scancws: inflateInit() failed\n");
-        close(fd);
-        if(cli_unlink(tmpname)) {
-            free(tmpname);
+        if(cli_extract_done(&x))
             return CL_EUNLINK;
-        }
-        free(tmpname);
         return CL_EUNPACK;
     }
 
     do {
         if(stream.avail_in == 0) {
-            stream.next_in = (Bytef *)inbuff;
-            ret = fmap_readn(map, inbuff, offset, FILEBUFF);
-            if(ret < 0) {
-                cli_errmsg("scancws: Error reading SWF file\n");
-                close(fd);
-                inflateEnd(&stream);
-                if(cli_unlink(tmpname)) {
-                    free(tmpname);
-                    return CL_EUNLINK;
-                }
-                free(tmpname);
-                return CL_EUNPACK;
-            }
-            if(!ret)
+            stream.next_in = (Bytef *)fmap_need_off_once_len(map, offset, FILEBUFF, &avail);
+            if(!stream.next_in || !avail)
                 break;
-            stream.avail_in = ret;
-            offset += ret;
+            stream.avail_in = avail;
+            offset += avail;
         }
         zret = inflate(&stream, Z_SYNC_FLUSH);
         count = FILEBUFF - stream.avail_out;
         if(count) {
             if(cli_checklimits("SWF", ctx, outsize + count, 0, 0) != CL_SUCCESS)
                 break;
-            if(cli_writen(fd, outbuff, count) != count) {
-                cli_errmsg("scancws: Can't write to file %s\n", tmpname);
+            if((ret = cli_extract_write(&x, outbuff, count)) != CL_SUCCESS) {
+                cli_errmsg("scancws: Can't write decompressed data\n");
                 inflateEnd(&stream);
-                close(fd);
-                if(cli_unlink(tmpname)) {
-                    free(tmpname);
+                if(cli_extract_done(&x))
                     return CL_EUNLINK;
-                }
-                free(tmpname);
-                return CL_EWRITE;
+                return ret;
             }
             outsize += count;
         }
@@ -396,17 +314,13 @@ static int scancws(cli_ctx *ctx, struct swf_file_hdr *hdr)
          */
         if (outsize == 8) {
             cli_infomsg(ctx, "scancws: Error decompressing SWF file. No data decompressed.\n");
-            close(fd);
-            if(cli_unlink(tmpname)) {
-                free(tmpname);
+            if(cli_extract_done(&x))
                 return CL_EUNLINK;
-            }
-            free(tmpname);
             return CL_EUNPACK;
         }
         cli_infomsg(ctx, "scancws: Error decompressing SWF file. Scanning what was decompressed.\n");
     }
-    cli_dbgmsg("SWF: Decompressed[zlib] to %s, size %d\n", tmpname, outsize);
+    cli_dbgmsg("SWF: Decompressed[zlib], size %d\n", outsize);
 
     /* check if declared output size matches actual output size */
     if (hdr->filesize != outsize) {
@@ -417,16 +331,9 @@ static int scancws(cli_ctx *ctx, struct swf_file_hdr *hdr)
                    hdr->filesize, (long long unsigned)outsize);
     }
 
-    ret = cli_magic_scandesc(fd, ctx);
-
-    close(fd);
-    if(!ctx->engine->keeptmp) {
-        if(cli_unlink(tmpname)) {
-            free(tmpname);
-            return CL_EUNLINK;
-        }
-    }
-    free(tmpname);
+    ret = cli_extract_scan(&x);
+    if(cli_extract_done(&x))
+        return CL_EUNLINK;
     return ret;
 }
 
@@ -76,71 +76,37 @@ static char text_chars[256] = {
 	I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I   /* 0xfX */
 };
 
+/* Bytes which may be of class F: below 0x20, or 0x7f. The test is done on
+ * 8 bytes at a time and may flag a byte next to a real candidate too, the
+ * flagged words are checked against text_chars byte by byte. */
+#define TD_ONES	    0x0101010101010101ULL
+#define TD_SUSPECT(w) \
+    ((((w) - TD_ONES * 0x20) | (((w) ^ (TD_ONES * 0x7f)) - TD_ONES)) & ~(w) & (TD_ONES * 0x80))
+
 static int td_isascii(const unsigned char *buf, unsigned int len)
 {
-	unsigned int i;
-
-    for(i = 0; i < len; i++)
+	unsigned int i = 0, j;
+	uint64_t w;
+
+    for(; i + 8 <= len; i += 8) {
+	memcpy(&w, buf + i, 8);
+	if(TD_SUSPECT(w))
+	    for(j = i; j < i + 8; j++)
+		if(text_chars[buf[j]] == F)
+		    return 0;
+    }
+    for(; i < len; i++)
 	if(text_chars[buf[i]] == F)
 	    return 0;
 
     return 1;
 }
 
-static int td_isutf8(const unsigned char *buf, unsigned int len)
-{
-	unsigned int i, j, gotone = 0;
-
-
-    for(i = 0; i < len; i++) {
-	if((buf[i] & 0x80) == 0) {  /* 0xxxxxxx is plain ASCII */
-	    /*
-	     * Even if the whole file is valid UTF-8 sequences,
-	     * still reject it if it uses weird control characters.
-	     */
-	    if(text_chars[buf[i]] != T)
-		return 0;
-
-	} else if((buf[i] & 0x40) == 0) { /* 10xxxxxx never 1st byte */
-	    return 0;
-	} else {			   /* 11xxxxxx begins UTF-8 */
-		unsigned int following;
-
-	    if((buf[i] & 0x20) == 0) {		/* 110xxxxx */
-		/* c = buf[i] & 0x1f; */
-		following = 1;
-	    } else if((buf[i] & 0x10) == 0) {	/* 1110xxxx */
-		/* c = buf[i] & 0x0f; */
-		following = 2;
-	    } else if((buf[i] & 0x08) == 0) {	/* 11110xxx */
-		/* c = buf[i] & 0x07; */
-		following = 3;
-	    } else if((buf[i] & 0x04) == 0) {	/* 111110xx */
-		/* c = buf[i] & 0x03; */
-		following = 4;
-	    } else if((buf[i] & 0x02) == 0) {	/* 1111110x */
-		/* c = buf[i] & 0x01; */
-		following = 5;
-	    } else {
-		return 0;
-	    }
-
-	    for(j = 0; j < following; j++) {
-		if(++i >= len)
-		    return gotone;
-
-		if((buf[i] & 0x80) == 0 || (buf[i] & 0x40))
-		    return 0;
-
-		/* c = (c << 6) + (buf[i] & 0x3f); */
-	    }
-
-	    gotone = 1;
-	}
-    }
-
-    return gotone;
-}
+/*
+ * There is no UTF-8 check: all the characters of class F are below 0x80
+ * and a UTF-8 buffer may not contain any of them, so every buffer valid
+ * as UTF-8 text is already taken for ASCII by td_isascii().
+ */
 
 static int td_isutf16(const unsigned char *buf, unsigned int len)
 {
@@ -192,9 +158,6 @@ cli_file_t cli_texttype(const unsigned char *buf, unsigned int len)
     if(td_isascii(buf, len)) {
 	cli_dbgmsg("Recognized ASCII text\n");
 	return CL_TYPE_TEXT_ASCII;
-    } else if(td_isutf8(buf, len)) {
-	cli_dbgmsg("Recognized UTF-8 character data\n");
-	return CL_TYPE_TEXT_UTF8;
     } else if((ret = td_isutf16(buf, len))) {
 	cli_dbgmsg("Recognized %s character data\n", (ret == 1) ? "UTF-16LE" : "UTF-16BE");
 	return (ret == 1) ? CL_TYPE_TEXT_UTF16LE : CL_TYPE_TEXT_UTF16BE;
@@ -32,6 +32,11 @@
 #include "textnorm.h"
 #include "bignum_fast.h"
 
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#define TEXTNORM_SIMD 1
+#endif
+
 int text_normalize_init(struct text_norm_state *state, unsigned char *out, size_t out_len)
 {
 	if(!state) {
@@ -90,6 +95,31 @@ static const enum normalize_action char_action[256] = {
 	IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN, IGN
 };
 
+#ifdef TEXTNORM_SIMD
+/* Normalizes 16 bytes of printable ASCII and single spaces, which is what
+ * most of a text looks like. Returns 0 and leaves the block to the caller
+ * if it holds anything else or a space that collapses. */
+static int text_normalize_block(struct text_norm_state *state, const unsigned char *buf, unsigned char *p)
+{
+	const __m128i v = _mm_loadu_si128((const __m128i *)buf);
+	__m128i upper;
+	unsigned int spaces;
+
+	/* 0x20 - 0x7f; the signed compare keeps bytes > 0x7f out */
+	if(_mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f))) != 0xffff)
+		return 0;
+
+	spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	if((spaces & (spaces << 1)) || ((spaces & 1) && state->space_written))
+		return 0;
+
+	upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	_mm_storeu_si128((__m128i *)p, _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(32))));
+	state->space_written = (spaces >> 15) & 1;
+	return 1;
+}
+#endif
+
 /* Normalizes the text at @buf of length @buf_len, @buf can include \0 characters.
  * Stores the normalized text in @state's buffer. 
  * Returns how many bytes it consumed of the input. */
@@ -100,7 +130,16 @@ size_t text_normalize_buffer(struct text_norm_state *state, const unsigned char
 	unsigned char *p = state->out + state->out_pos;
 
 	for(i=0; i < buf_len && p < out_end; i++) {
-		unsigned char c = buf[i];
+		unsigned char c;
+
+#ifdef TEXTNORM_SIMD
+		if(buf_len - i >= 16 && out_end - p >= 16 && text_normalize_block(state, buf + i, p)) {
+			p += 16;
+			i += 15;
+			continue;
+		}
+#endif
+		c = buf[i];
 		switch(char_action[c]) {
 			case NORMALIZE_SKIP:
 				continue;
@@ -121,7 +121,7 @@ nsp1:00435A5A                 push    8000h
 
 
 /* real_unpack(start_of_stuff, dest, malloc, free); */
-uint32_t unspack(const char *start_of_stuff, char *dest, cli_ctx *ctx, uint32_t rva, uint32_t base, uint32_t ep, int file) {
+uint32_t unspack(const char *start_of_stuff, char *dest, cli_ctx *ctx, uint32_t rva, uint32_t base, uint32_t ep, struct cli_extract *x) {
   uint8_t c = *start_of_stuff;
   uint32_t i,firstbyte,tre,allocsz,tablesz,dsize,ssize;
   uint16_t *table;
@@ -170,7 +170,7 @@ uint32_t unspack(const char *start_of_stuff, char *dest, cli_ctx *ctx, uint32_t
   section.rsz = dsize;
   section.vsz = dsize;
   section.rva = rva;
-  return !cli_rebuildpe(dest, &section, 1, base, ep, 0, 0, file);
+  return !cli_rebuildpe(dest, &section, 1, base, ep, 0, 0, x);
 }
 
 
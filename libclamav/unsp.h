@@ -24,6 +24,7 @@
 
 #include "cltypes.h"
 #include "others.h"
+#include "scanners.h"
 
 struct UNSP {
   const char *src_curr;
@@ -36,7 +37,7 @@ struct UNSP {
   char *table;
 };
 
-uint32_t unspack(const char *, char *, cli_ctx *, uint32_t, uint32_t, uint32_t, int);
+uint32_t unspack(const char *, char *, cli_ctx *, uint32_t, uint32_t, uint32_t, struct cli_extract *);
 uint32_t very_real_unpack(uint16_t *, uint32_t, uint32_t, uint32_t, uint32_t,const char *, uint32_t, char *, uint32_t);
 uint32_t get_byte(struct UNSP *);
 int getbit_from_table(uint16_t *, struct UNSP *);
@@ -39,6 +39,7 @@
 
 #include <zlib.h>
 #include "inflate64.h"
+#include "inflate_buf.h"
 #if HAVE_BZLIB_H
 #include <bzlib.h>
 #endif
@@ -50,44 +51,55 @@
 #include "matcher.h"
 #include "fmap.h"
 #include "json_api.h"
+#include "cache.h"
 
 #define UNZIP_PRIVATE
 #include "unzip.h"
 
-#define ZIP_CRC32(r,c,b,l)			\
-    do {					\
-	r = crc32(~c,b,l);			\
-	r = ~r;					\
-    } while(0)
-
 
 static int wrap_inflateinit2(void *a, int b) {
   return inflateInit2(a, b);
 }
 
-static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t method, uint16_t flags, unsigned int *fu, cli_ctx *ctx, char *tmpd, zip_cb zcb) {
+/* soff is the offset of src in the map, -1 when src isn't mapped data */
+static int unz(const uint8_t *src, off_t soff, uint32_t csize, uint32_t usize, uint16_t method, uint16_t flags, unsigned int *fu, cli_ctx *ctx, char *tmpd, zip_cb zcb, void *zcbdata) {
   char name[1024], obuf[BUFSIZ];
-  char *tempfile = name;
-  int of, ret=CL_CLEAN;
+  struct cli_extract x;
+  struct cli_member_key key, *mkey = NULL, *saved_key;
+  fmap_t *map;
+  int ret=CL_CLEAN;
   unsigned int res=1, written=0;
 
+  /* the same member was found clean before, see cli_member_cache_check() */
+  if(zcb == zip_scan_cb) {
+    uint32_t params[4] = { method, flags, csize, usize };
+    void *h = cli_member_cache_start(ctx, csize, params, sizeof(params));
+
+    if(h) {
+      cl_update_hash(h, (void *)src, csize);
+      if(cli_member_cache_check(h, ctx, &key) == CL_CLEAN) {
+	(*fu)++;
+	return CL_CLEAN;
+      }
+      mkey = &key;
+    }
+  }
+
   if(tmpd) {
     snprintf(name, sizeof(name), "%s"PATHSEP"zip.%03u", tmpd, *fu);
     name[sizeof(name)-1]='\0';
-  } else {
-    if(!(tempfile = cli_gentemp(ctx->engine->tmpdir))) return CL_EMEM;
-  }
-  if((of = open(tempfile, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRUSR|S_IWUSR))==-1) {
-    cli_warnmsg("cli_unzip: failed to create temporary file %s\n", tempfile);
-    if(!tmpd) free(tempfile);
-    return CL_ETMPFILE;
   }
+  cli_extract_init(&x, ctx, tmpd ? name : NULL);
+  /* scanned while inflated when too large for memory, see cli_extract_expect() */
+  if(zcb == zip_scan_cb && method != ALG_STORED && (!ctx->engine->maxfilesize || usize <= ctx->engine->maxfilesize))
+    cli_extract_expect(&x, usize);
+ again:
   switch (method) {
   case ALG_STORED:
     if(csize<usize) {
       unsigned int fake = *fu + 1;
       cli_dbgmsg("cli_unzip: attempting to inflate stored file with inconsistent size\n");
-      if ((ret=unz(src, csize, usize, ALG_DEFLATE, 0, &fake, ctx, tmpd, zcb))==CL_CLEAN) {
+      if ((ret=unz(src, -1, csize, usize, ALG_DEFLATE, 0, &fake, ctx, tmpd, zcb, zcbdata))==CL_CLEAN) {
 	(*fu)++;
 	res=fake-(*fu);
       }
@@ -98,8 +110,11 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	cli_dbgmsg("cli_unzip: trimming output size to maxfilesize (%lu)\n", (long unsigned int) ctx->engine->maxfilesize);
 	csize = ctx->engine->maxfilesize;
       }
-      if(cli_writen(of, src, csize)!=(int)csize) ret = CL_EWRITE;
-      else res=0;
+      if(soff >= 0)
+	ret = cli_extract_range(&x, soff, csize);
+      else
+	ret = cli_extract_write(&x, src, csize);
+      if(ret == CL_SUCCESS) res=0;
     }
     break;
 
@@ -120,6 +135,21 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
     void **next_out;
     unsigned int *avail_in;
     unsigned int *avail_out;
+    unsigned char *dst;
+    size_t outlen;
+
+    /* decoded in one go when the whole member fits in memory, the stream
+     * is inflated below should anything be wrong with it */
+    if(usize && (!ctx->engine->maxfilesize || usize <= ctx->engine->maxfilesize) &&
+       (method == ALG_DEFLATE64 || usize / 1032 <= csize) &&
+       (dst = cli_extract_reserve(&x, usize)) &&
+       cli_inflate_buf(src, csize, dst, usize, NULL, &outlen, method == ALG_DEFLATE64) == CLI_INFLATE_END) {
+      if((ret = cli_extract_commit(&x, outlen)) == CL_SUCCESS)
+	res = 0;
+      else
+	res = 100;
+      break;
+    }
 
     if(method == ALG_DEFLATE64) {
       unz_init = (unz_init_)inflate64Init2;
@@ -160,9 +190,9 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	  res = Z_STREAM_END;
 	  break;
 	}
-	if(cli_writen(of, obuf, sizeof(obuf)-(*avail_out)) != (int)(sizeof(obuf)-(*avail_out))) {
+	if((ret = cli_extract_write(&x, obuf, sizeof(obuf)-(*avail_out))) != CL_SUCCESS) {
+          if(ret != CL_BREAK && !cli_budget_exceeded(ctx))
             cli_warnmsg("cli_unzip: falied to write %lu inflated bytes\n", (unsigned long int)sizeof(obuf)-(*avail_out));
-	  ret = CL_EWRITE;
 	  res = 100;
 	  break;
 	}
@@ -204,9 +234,9 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	  res = BZ_STREAM_END;
 	  break;
 	}
-	if(cli_writen(of, obuf, sizeof(obuf)-strm.avail_out) != (int)(sizeof(obuf)-strm.avail_out)) {
+	if((ret = cli_extract_write(&x, obuf, sizeof(obuf)-strm.avail_out)) != CL_SUCCESS) {
+          if(ret != CL_BREAK && !cli_budget_exceeded(ctx))
             cli_warnmsg("cli_unzip: falied to write %lu bunzipped bytes\n", (long unsigned int)sizeof(obuf)-strm.avail_out);
-	  ret = CL_EWRITE;
 	  res = 100;
 	  break;
 	}
@@ -241,9 +271,9 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	  res = 0;
 	  break;
 	}
-	if(cli_writen(of, obuf, sizeof(obuf)-strm.avail_out) != (int)(sizeof(obuf)-strm.avail_out)) {
+	if((ret = cli_extract_write(&x, obuf, sizeof(obuf)-strm.avail_out)) != CL_SUCCESS) {
+          if(ret != CL_BREAK && !cli_budget_exceeded(ctx))
             cli_warnmsg("cli_unzip: falied to write %lu exploded bytes\n", (unsigned long int) sizeof(obuf)-strm.avail_out);
-	  ret = CL_EWRITE;
 	  res = 100;
 	  break;
 	}
@@ -286,52 +316,104 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
     break;
   }
 
+  if(!res && zcb == zip_scan_cb) {
+    saved_key = ctx->member_key;
+    ctx->member_key = mkey;
+    ret = cli_extract_scan(&x);
+    ctx->member_key = saved_key;
+  }
+  if(cli_extract_again(&x)) {
+    ret = CL_CLEAN;
+    res = 1;
+    written = 0;
+    goto again;
+  }
+
   if(!res) {
     (*fu)++;
-    cli_dbgmsg("cli_unzip: extracted to %s\n", tempfile);
-    if (lseek(of, 0, SEEK_SET) == -1) {
-        cli_dbgmsg("cli_unzip: call to lseek() failed\n");
-        if (!(tmpd))
-            free(tempfile);
-        close(of);
-        return CL_ESEEK;
-    }
-    ret = zcb(of, ctx);
-    close(of);
-    if(!ctx->engine->keeptmp)
-      if(cli_unlink(tempfile)) ret = CL_EUNLINK;
-    if(!tmpd) free(tempfile);
+    cli_dbgmsg("cli_unzip: extracted %lu bytes\n", (unsigned long int)x.len);
+    /* the other callbacks parse the member */
+    if(zcb != zip_scan_cb) {
+      if((map = cli_extract_map(&x))) {
+        ret = zcb(map, ctx, zcbdata);
+        funmap(map);
+      } else {
+        ret = CL_EMAP;
+      }
+    }
+    if(cli_extract_done(&x)) ret = CL_EUNLINK;
     return ret;
   }
 
-  close(of);
-  if(!ctx->engine->keeptmp)
-    if(cli_unlink(tempfile)) ret = CL_EUNLINK;
-  if(!tmpd) free(tempfile);
+  if(cli_extract_done(&x)) ret = CL_EUNLINK;
   cli_dbgmsg("cli_unzip: extraction failed\n");
   return ret;
 }
 
+/* crc32 table of the zip specification: the key updates take a byte at a
+ * time, a lookup here instead of a call to zlib for each byte */
+static const uint32_t zcrctab[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
 /* zip update keys, taken from zip specification */
 static inline void zupdatekey(uint32_t key[3], unsigned char input)
 {
-    unsigned char tmp[1];
-    unsigned long crctmp;
-
-    tmp[0] = input;
-    ZIP_CRC32(key[0], key[0], tmp, 1);
+    key[0] = zcrctab[(key[0] ^ input) & 0xff] ^ (key[0] >> 8);
 
     key[1] = key[1] + (key[0] & 0xff);
     key[1] = key[1] * 134775813 + 1;
 
-    tmp[0] = key[1] >> 24;
-    ZIP_CRC32(key[2], key[2], tmp, 1);
+    key[2] = zcrctab[(key[2] ^ (key[1] >> 24)) & 0xff] ^ (key[2] >> 8);
 }
 
-/* zip init keys */
-static inline void zinitkey(uint32_t key[3], struct cli_pwdb *password)
+/* zip init keys, called once for each password when the .pwdb is loaded
+ * (see cli_loadpwdb()) so zdecrypt() only copies the result */
+void cli_zip_initkey(uint32_t key[3], const unsigned char *passwd, uint16_t length)
 {
-    int i;
+    unsigned int i;
 
     /* intialize keys, these are specified but the zip specification */
     key[0] = 305419896L;
@@ -339,8 +421,8 @@ static inline void zinitkey(uint32_t key[3], struct cli_pwdb *password)
     key[2] = 878082192L;
 
     /* update keys with password  */
-    for (i = 0; i < password->length; i++)
-	zupdatekey(key, password->passwd[i]);
+    for (i = 0; i < length; i++)
+	zupdatekey(key, passwd[i]);
 }
 
 /* zip decrypt byte */
@@ -353,11 +435,12 @@ static inline unsigned char zdecryptbyte(uint32_t key[3])
 
 /* zip decrypt, CL_EPARSE = could not apply a password, csize includes the decryption header */
 /* TODO - search for strong encryption header (0x0017) and handle them */
-static inline int zdecrypt(const uint8_t *src, uint32_t csize, uint32_t usize, const uint8_t *lh, unsigned int *fu, cli_ctx *ctx, char *tmpd, zip_cb zcb)
+static inline int zdecrypt(const uint8_t *src, uint32_t csize, uint32_t usize, const uint8_t *lh, unsigned int *fu, cli_ctx *ctx, char *tmpd, zip_cb zcb, void *zcbdata)
 {
     int i, ret, v = 0;
     uint32_t key[3];
     uint8_t eh[12]; /* encryption header buffer */
+    uint8_t check[2];
     struct cli_pwdb *password, *pass_any, *pass_zip;
 
     if (!ctx || !ctx->engine)
@@ -369,124 +452,110 @@ static inline int zdecrypt(const uint8_t *src, uint32_t csize, uint32_t usize, c
 	return CL_SUCCESS;
     }
 
+    if (csize <= SIZEOF_EH) {
+	cli_dbgmsg("cli_unzip: decrypt - no data after the encryption header\n");
+	return CL_SUCCESS;
+    }
+
     pass_any = ctx->engine->pwdbs[CLI_PWDB_ANY];
     pass_zip = ctx->engine->pwdbs[CLI_PWDB_ZIP];
 
+    /* the check bytes the last header bytes decrypt to with the right
+     * password: the high byte of the crc32 (or of the time with a data
+     * descriptor), before 2.0 the two high bytes */
+    if (LH_flags & F_USEDD) {
+	check[0] = LH_mtime & 0xff;
+	check[1] = (LH_mtime >> 8) & 0xff;
+    } else {
+	check[0] = (LH_crc32 >> 16) & 0xff;
+	check[1] = (LH_crc32 >> 24) & 0xff;
+    }
+
     while (pass_any || pass_zip) {
 	password = pass_zip ? pass_zip : pass_any;
 
-	zinitkey(key, password);
+	memcpy(key, password->zipkey, sizeof(key));
 
-	/* decrypting the encryption header */
+	/* decrypting the encryption header, the last byte doesn't need the
+	 * key update */
 	memcpy(eh, src, SIZEOF_EH);
 
-	for (i = 0; i < SIZEOF_EH; i++) {
+	for (i = 0; i < SIZEOF_EH - 1; i++) {
 	    eh[i] ^= zdecryptbyte(key);
 	    zupdatekey(key, eh[i]);
 	}
+	eh[SIZEOF_EH-1] ^= zdecryptbyte(key);
 
 	/* verify that the password is correct */
-	if (LH_version > 20) { /* higher than 2.0 */
-	    uint16_t a = eh[SIZEOF_EH-1];
-
-	    if (LH_flags & F_USEDD) {
-		cli_dbgmsg("cli_unzip: decrypt - (v%u) >> 0x%02x 0x%x (moddate)\n", LH_version, a, LH_mtime);
-		if (a == ((LH_mtime >> 8) & 0xff))
-		    v = 1;
-	    } else {
-		cli_dbgmsg("cli_unzip: decrypt - (v%u) >> 0x%02x 0x%x (crc32)\n", LH_version, a, LH_crc32);
-		if (a == ((LH_crc32 >> 24) & 0xff))
-		    v = 1;
-	    }
-	} else {
-	    uint16_t a = eh[SIZEOF_EH-1], b = eh[SIZEOF_EH-2];
-
-	    if (LH_flags & F_USEDD) {
-		cli_dbgmsg("cli_unzip: decrypt - (v%u) >> 0x0000%02x%02x 0x%x (moddate)\n", LH_version, a, b, LH_mtime);
-		if ((b | (a << 8)) == (LH_mtime & 0xffff))
-		    v = 1;
-	    } else {
-		cli_dbgmsg("cli_unzip: decrypt - (v%u) >> 0x0000%02x%02x 0x%x (crc32)\n", LH_version, eh[SIZEOF_EH-1], eh[SIZEOF_EH-2], LH_crc32);
-		if ((b | (a << 8)) == ((LH_crc32 >> 16) & 0xffff))
-		    v = 1;
-	    }
+	if (eh[SIZEOF_EH-1] == check[1] && (LH_version > 20 || eh[SIZEOF_EH-2] == check[0])) {
+	    cli_dbgmsg("cli_unzip: decrypt - (v%u) >> 0x%02x%02x matches the %s\n", LH_version, eh[SIZEOF_EH-1], eh[SIZEOF_EH-2], (LH_flags & F_USEDD) ? "moddate" : "crc32");
+	    v = 1;
 	}
 
 	if (v) {
-	    char name[1024], obuf[BUFSIZ];
-	    char *tempfile = name;
-	    unsigned int written = 0, total = 0;
+	    char name[1024];
+	    uint8_t obuf[BUFSIZ], *dst;
+	    unsigned int written = 0, total = csize - SIZEOF_EH;
+	    struct cli_extract x;
 	    fmap_t *dcypt_map;
 	    const uint8_t *dcypt_zip;
-	    int of;
 
 	    cli_dbgmsg("cli_unzip: decrypt - password [%s] matches\n", password->name);
+	    zupdatekey(key, eh[SIZEOF_EH-1]);
 
-	    /* output decrypted data to tempfile */
+	    /* decrypted in memory, to a temporary file only with keeptmp or
+	     * when too large */
 	    if(tmpd) {
 		snprintf(name, sizeof(name), "%s"PATHSEP"zip.decrypt.%03u", tmpd, *fu);
 		name[sizeof(name)-1]='\0';
-	    } else {
-		if(!(tempfile = cli_gentemp(ctx->engine->tmpdir))) return CL_EMEM;
 	    }
-	    if((of = open(tempfile, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRUSR|S_IWUSR))==-1) {
-		cli_warnmsg("cli_unzip: decrypt - failed to create temporary file %s\n", tempfile);
-		if(!tmpd) free(tempfile);
-		return CL_ETMPFILE;
-	    }
-
-	    for (i = 12; i < csize; i++) {
-		obuf[written] = src[i] ^ zdecryptbyte(key);
-		zupdatekey(key, obuf[written]);
+	    cli_extract_init(&x, ctx, tmpd ? name : NULL);
 
-		written++;
-		if (written >= BUFSIZ) {
-		    if (cli_writen(of, obuf, written)!=(int)written) {
-			ret = CL_EWRITE;
-			goto zd_clean;
-		    }
-		    total += written;
-		    written = 0;
+	    if ((dst = cli_extract_reserve(&x, total))) {
+		for (i = SIZEOF_EH; i < csize; i++) {
+		    *dst = src[i] ^ zdecryptbyte(key);
+		    zupdatekey(key, *dst++);
 		}
-	    }
-	    if (written) {
-		if (cli_writen(of, obuf, written)!=(int)written) {
-		    ret = CL_EWRITE;
-		    goto zd_clean;
+		ret = cli_extract_commit(&x, total);
+	    } else {
+		ret = CL_SUCCESS;
+		for (i = SIZEOF_EH; i < csize && ret == CL_SUCCESS; i++) {
+		    obuf[written] = src[i] ^ zdecryptbyte(key);
+		    zupdatekey(key, obuf[written]);
+
+		    if (++written >= sizeof(obuf) || i == csize - 1) {
+			ret = cli_extract_write(&x, obuf, written);
+			written = 0;
+		    }
 		}
-		total += written;
-		written = 0;
 	    }
+	    if (ret != CL_SUCCESS)
+		goto zd_clean;
 
-	    cli_dbgmsg("cli_unzip: decrypt - decrypted %u bytes to %s\n", total, tempfile);
+	    cli_dbgmsg("cli_unzip: decrypt - decrypted %u bytes\n", total);
 
 	    /* decrypt data to new fmap -> buffer */
-	    if (!(dcypt_map = fmap(of, 0, total))) {
-		cli_warnmsg("cli_unzip: decrypt - failed to create fmap on decrypted file %s\n", tempfile);
+	    if (!(dcypt_map = cli_extract_map(&x))) {
+		cli_warnmsg("cli_unzip: decrypt - failed to create fmap on decrypted data\n");
 		ret = CL_EMAP;
 		goto zd_clean;
 	    }
 
 	    if (!(dcypt_zip = fmap_need_off_once(dcypt_map, 0, total))) {
-		cli_warnmsg("cli_unzip: decrypt - failed to acquire buffer on decrypted file %s\n", tempfile);
+		cli_warnmsg("cli_unzip: decrypt - failed to acquire buffer on decrypted data\n");
 		funmap(dcypt_map);
 		ret = CL_EREAD;
 		goto zd_clean;
 	    }
 
 	    /* call unz on decrypted output */
-	    ret = unz(dcypt_zip, csize - SIZEOF_EH, usize, LH_method, LH_flags, fu, ctx, tmpd, zcb);
+	    ret = unz(dcypt_zip, -1, total, usize, LH_method, LH_flags, fu, ctx, tmpd, zcb, zcbdata);
 
 	    /* clean-up and return */
 	    funmap(dcypt_map);
 	zd_clean:
-	    close(of);
-	    if (!ctx->engine->keeptmp)
-                if (cli_unlink(tempfile)) {
-		    if (!tmpd) free(tempfile);
-		    return CL_EUNLINK;
-		}
-            if (!tmpd) free(tempfile);
+	    if (cli_extract_done(&x))
+		return CL_EUNLINK;
 	    return ret;
 	}
 
@@ -500,11 +569,83 @@ static inline int zdecrypt(const uint8_t *src, uint32_t csize, uint32_t usize, c
     return CL_SUCCESS;
 }
 
-static unsigned int lhdr(fmap_t *map, uint32_t loff,uint32_t zsize, unsigned int *fu, unsigned int fc, const uint8_t *ch, int *ret, cli_ctx *ctx, char *tmpd, int detect_encrypted, zip_cb zcb) {
+/* Fills in the sizes and the local header offset set to 0xffffffff in the
+ * header from its zip64 extended information extra field; values that
+ * don't fit in 32 bits are left alone. The field only holds the values
+ * which are 0xffffffff in the header, hence all those in the header must
+ * be passed. Returns 1 if a field was found. */
+static int zip64_extra(fmap_t *map, size_t eoff, uint16_t elen, uint32_t *usize, uint32_t *csize, uint32_t *loff)
+{
+  const uint8_t *extra, *field;
+  uint32_t *want[3], i;
+  uint16_t id, size;
+
+  if(!elen || !(extra = fmap_need_off_once(map, eoff, elen)))
+    return 0;
+  want[0] = usize;
+  want[1] = csize;
+  want[2] = loff;
+  while(elen >= 4) {
+    id = cli_readint16(extra);
+    size = cli_readint16(extra + 2);
+    if(size > elen - 4)
+      break;
+    if(id == 0x0001) {
+      field = extra + 4;
+      for(i = 0; i < 3; i++) {
+	if(!want[i] || *want[i] != 0xffffffff)
+	  continue;
+	if(field + 8 > extra + 4 + size)
+	  break;
+	if(!cli_readint32(field + 4))
+	  *want[i] = cli_readint32(field);
+	field += 8;
+      }
+      return 1;
+    }
+    extra += 4 + size;
+    elen -= 4 + size;
+  }
+  return 0;
+}
+
+/* Size of a stored member followed by a data descriptor, when there's no
+ * central directory to tell it: the descriptor is the first one whose
+ * sizes match the distance from the start of the data. Returns 2 for a
+ * zip64 descriptor. */
+static int zip_dd_size(fmap_t *map, size_t off, uint32_t zsize, uint32_t *size)
+{
+  const uint8_t *p;
+  uint32_t pos = 0, len, i;
+
+  while(pos + 16 <= zsize) {
+    len = MIN(zsize - pos, 65536);
+    if(!(p = fmap_need_off_once(map, off + pos, len)))
+      return 0;
+    for(i = 0; i + 16 <= len; i++) {
+      if(p[i] != 'P' || p[i+1] != 'K' || p[i+2] != 7 || p[i+3] != 8 || (uint32_t)cli_readint32(p + i + 8) != pos + i)
+	continue;
+      if(i + 24 <= len && !cli_readint32(p + i + 12) && (uint32_t)cli_readint32(p + i + 16) == pos + i && !cli_readint32(p + i + 20)) {
+	*size = pos + i;
+	return 2;
+      }
+      if((uint32_t)cli_readint32(p + i + 12) == pos + i) {
+	*size = pos + i;
+	return 1;
+      }
+    }
+    if(len < 65536)
+      break;
+    pos += len - 23;
+  }
+  return 0;
+}
+
+static unsigned int lhdr(fmap_t *map, uint32_t loff,uint32_t zsize, unsigned int *fu, unsigned int fc, const uint8_t *ch, int *ret, cli_ctx *ctx, char *tmpd, int detect_encrypted, zip_cb zcb, void *zcbdata) {
   const uint8_t *lh, *zip;
   char name[256];
   uint32_t csize, usize;
-  int virus_found = 0;
+  int virus_found = 0, zip64 = 0;
 
   if(!(lh = fmap_need_off(map, loff, SIZEOF_LH))) {
       cli_dbgmsg("cli_unzip: lh - out of file\n");
@@ -565,20 +706,39 @@ static unsigned int lhdr(fmap_t *map, uint32_t loff,uint32_t zsize, unsigned int
     virus_found = 1;
   }
  
-  if(LH_flags & F_USEDD) {
-    cli_dbgmsg("cli_unzip: lh - has data desc\n");
-    if(!ch) {
-	fmap_unneed_off(map, loff, SIZEOF_LH);
-	return 0;
-    }
-    else { usize = CH_usize; csize = CH_csize; }
-  } else { usize = LH_usize; csize = LH_csize; }
-
   if(zsize<=LH_elen) {
     cli_dbgmsg("cli_unzip: lh - extra out of file\n");
     fmap_unneed_off(map, loff, SIZEOF_LH);
     return 0;
   }
+
+  if(LH_flags & F_USEDD) {
+    cli_dbgmsg("cli_unzip: lh - has data desc\n");
+    if(ch) {
+      usize = CH_usize;
+      csize = CH_csize;
+      if((usize == 0xffffffff || csize == 0xffffffff) &&
+	 zip64_extra(map, fmap_ptr2off(map, ch) + SIZEOF_CH + CH_flen, CH_elen, &usize, &csize, NULL))
+	zip64 = 1;
+    } else if(LH_method == ALG_STORED && !(LH_flags & F_ENCR) &&
+	      (zip64 = zip_dd_size(map, fmap_ptr2off(map, zip) + LH_elen, zsize - LH_elen, &csize))) {
+      cli_dbgmsg("cli_unzip: lh - stored data of %u bytes up to the data desc\n", csize);
+      usize = csize;
+      zip64--;
+    } else {
+      fmap_unneed_off(map, loff, SIZEOF_LH);
+      return 0;
+    }
+  } else {
+    usize = LH_usize;
+    csize = LH_csize;
+    if((usize == 0xffffffff || csize == 0xffffffff) &&
+       zip64_extra(map, fmap_ptr2off(map, zip), LH_elen, &usize, &csize, NULL))
+      zip64 = 1;
+  }
+  if(usize == 0xffffffff || csize == 0xffffffff)
+    cli_dbgmsg("cli_unzip: lh - zip64 sizes out of range\n");
+
   zip+=LH_elen;
   zsize-=LH_elen;
 
@@ -592,10 +752,10 @@ static unsigned int lhdr(fmap_t *map, uint32_t loff,uint32_t zsize, unsigned int
       }
       if(LH_flags & F_ENCR) {
 	  if(fmap_need_ptr_once(map, zip, csize))
-	      *ret = zdecrypt(zip, csize, usize, lh, fu, ctx, tmpd, zcb);
+	      *ret = zdecrypt(zip, csize, usize, lh, fu, ctx, tmpd, zcb, zcbdata);
       } else {
 	  if(fmap_need_ptr_once(map, zip, csize))
-	      *ret = unz(zip, csize, usize, LH_method, LH_flags, fu, ctx, tmpd, zcb);
+	      *ret = unz(zip, fmap_ptr2off(map, zip), csize, usize, LH_method, LH_flags, fu, ctx, tmpd, zcb, zcbdata);
       }
       zip+=csize;
       zsize-=csize;
@@ -606,11 +766,14 @@ static unsigned int lhdr(fmap_t *map, uint32_t loff,uint32_t zsize, unsigned int
 
   fmap_unneed_off(map, loff, SIZEOF_LH); /* unneed now. block is guaranteed to exists till the next need */
   if(LH_flags & F_USEDD) {
-      if(zsize<12) {
+      /* crc32 and the sizes, which take 64 bits each with zip64 */
+      uint32_t ddsize = zip64 ? 20 : 12;
+
+      if(zsize<ddsize) {
 	  cli_dbgmsg("cli_unzip: lh - data desc out of file\n");
 	  return 0;
       }
-      zsize-=12;
+      zsize-=ddsize;
       if(fmap_need_ptr_once(map, zip, 4)) {
 	  if(cli_readint32(zip)==0x08074b50) {
 	      if(zsize<4) {
@@ -620,11 +783,49 @@ static unsigned int lhdr(fmap_t *map, uint32_t loff,uint32_t zsize, unsigned int
 	      zip+=4;
 	  }
       }
-      zip+=12;
+      zip+=ddsize;
   }
   return zip-lh;
 }
 
+/* Offset of the central directory from the zip64 end of central directory
+ * record, through the locator which precedes the end of central directory
+ * record at eoc */
+static uint32_t zip64_central(fmap_t *map, uint32_t fsize, uint32_t eoc)
+{
+  const uint8_t *ptr;
+  uint32_t off;
+
+  if(eoc < 20 || !(ptr = fmap_need_off_once(map, eoc - 20, 20)) || cli_readint32(ptr) != 0x07064b50 || cli_readint32(ptr + 12))
+      return 0xffffffff;
+  off = cli_readint32(ptr + 8);
+  if(!CLI_ISCONTAINED(0, fsize, off, 56) || !(ptr = fmap_need_off_once(map, off, 56)) ||
+     cli_readint32(ptr) != 0x06064b50 || cli_readint32(ptr + 52))
+      return 0xffffffff;
+  return cli_readint32(ptr + 48);
+}
+
+/* Offset of the central directory from the end of central directory
+ * record, 0 if there's none */
+static uint32_t zip_central(fmap_t *map, uint32_t fsize)
+{
+  const char *ptr;
+  uint32_t coff;
+
+  for(coff=fsize-22 ; coff>0 ; coff--) { /* sizeof(EOC)==22 */
+      if(!(ptr = fmap_need_off_once(map, coff, 20)))
+	  continue;
+      if(cli_readint32(ptr)==0x06054b50) {
+	  uint32_t chptr = cli_readint32(&ptr[16]);
+	  if(chptr == 0xffffffff)
+	      chptr = zip64_central(map, fsize, coff);
+	  if(!CLI_ISCONTAINED(0, fsize, chptr, SIZEOF_CH)) continue;
+	  return chptr;
+      }
+  }
+  return 0;
+}
+
 static unsigned int chdr(fmap_t *map, uint32_t coff, uint32_t zsize, unsigned int *fu, unsigned int fc, int *ret, cli_ctx *ctx, char *tmpd, struct zip_requests *requests) {
   char name[256];
   int last = 0;
@@ -674,8 +875,14 @@ static unsigned int chdr(fmap_t *map, uint32_t coff, uint32_t zsize, unsigned in
   coff+=CH_clen;
 
   if (!requests) {
-      if(CH_off<zsize-SIZEOF_LH) {
-          lhdr(map, CH_off, zsize-CH_off, fu, fc, ch, ret, ctx, tmpd, 1, zip_scan_cb);
+      uint32_t loff = CH_off, usize = CH_usize, csize = CH_csize;
+
+      /* even for the final entry, whose extra field may end right at the
+       * end of the directory; zip64_extra() only reads what is mapped */
+      if(loff == 0xffffffff)
+          zip64_extra(map, coff - CH_clen - CH_elen, CH_elen, &usize, &csize, &loff);
+      if(loff<zsize-SIZEOF_LH) {
+          lhdr(map, loff, zsize-loff, fu, fc, ch, ret, ctx, tmpd, 1, zip_scan_cb, NULL);
       } else cli_dbgmsg("cli_unzip: ch - local hdr out of file\n");
   }
   else {
@@ -702,14 +909,137 @@ static unsigned int chdr(fmap_t *map, uint32_t coff, uint32_t zsize, unsigned in
   return (last?0:coff);
 }
 
+/* Risk ordering of the central directory (CL_ENGINE_ARCHIVE_ORDER): the
+ * members are extracted by class (see zip_rank_ext) and then by compressed
+ * size, so that the scan of an infected archive can stop before the bulk of
+ * it is inflated. Larger directories are kept in stored order. */
+#define ZIP_ORDER_MAX 65536
+
+struct zip_rank {
+    uint64_t rank;
+    uint32_t coff;
+    uint32_t index;
+};
+
+static const struct {
+    const char *ext;
+    unsigned int rank;
+} zip_rank_exts[] = {
+    /* executables and scripts */
+    { "exe", 0 }, { "dll", 0 }, { "scr", 0 }, { "com", 0 }, { "pif", 0 },
+    { "cpl", 0 }, { "sys", 0 }, { "ocx", 0 }, { "msi", 0 }, { "lnk", 0 },
+    { "bat", 0 }, { "cmd", 0 }, { "ps1", 0 }, { "js", 0 }, { "jse", 0 },
+    { "vbs", 0 }, { "vbe", 0 }, { "wsf", 0 }, { "wsh", 0 }, { "hta", 0 },
+    { "jar", 0 }, { "class", 0 }, { "dex", 0 }, { "apk", 0 }, { "so", 0 },
+    { "elf", 0 }, { "dylib", 0 },
+    /* documents with active content */
+    { "doc", 1 }, { "docm", 1 }, { "dot", 1 }, { "dotm", 1 }, { "xls", 1 },
+    { "xlsm", 1 }, { "xlam", 1 }, { "ppt", 1 }, { "pptm", 1 }, { "rtf", 1 },
+    { "pdf", 1 }, { "swf", 1 }, { "htm", 1 }, { "html", 1 }, { "chm", 1 },
+    /* nested archives */
+    { "zip", 2 }, { "rar", 2 }, { "7z", 2 }, { "cab", 2 }, { "arj", 2 },
+    { "gz", 2 }, { "tgz", 2 }, { "bz2", 2 }, { "xz", 2 }, { "tar", 2 },
+    { "iso", 2 }, { "img", 2 }
+};
+
+static unsigned int zip_rank_ext(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    unsigned int i;
+
+    if(!ext || strchr(ext, '/') || strchr(ext, '\\'))
+        return 3;
+    for(i = 0; i < sizeof(zip_rank_exts) / sizeof(zip_rank_exts[0]); i++)
+        if(!strcasecmp(ext + 1, zip_rank_exts[i].ext))
+            return zip_rank_exts[i].rank;
+    return 3;
+}
+
+static int zip_rank_cmp(const void *a, const void *b)
+{
+    const struct zip_rank *ea = a, *eb = b;
+
+    if(ea->rank != eb->rank)
+        return ea->rank < eb->rank ? -1 : 1;
+    return ea->index < eb->index ? -1 : ea->index > eb->index;
+}
+
+/* Walks the central directory like chdr() and returns its entries in
+ * extraction order, NULL to keep the stored order */
+static struct zip_rank *zip_order(fmap_t *map, uint32_t coff, uint32_t zsize, unsigned int *count)
+{
+    struct zip_rank *entries = NULL, *tmp;
+    unsigned int n = 0, max = 0;
+    const uint8_t *ch;
+    char name[256];
+
+    while((ch = fmap_need_off_once(map, coff, SIZEOF_CH)) && CH_magic == 0x02014b50) {
+        uint32_t next = coff + SIZEOF_CH, csize = CH_csize, usize = CH_usize;
+        unsigned int rank, last = 0;
+
+        if(n == max) {
+            if(n >= ZIP_ORDER_MAX) {
+                cli_dbgmsg("cli_unzip: too many entries to order\n");
+                free(entries);
+                return NULL;
+            }
+            max = max ? max * 2 : 64;
+            if(!(tmp = cli_realloc(entries, max * sizeof(*entries)))) {
+                free(entries);
+                return NULL;
+            }
+            entries = tmp;
+        }
+
+        name[0] = '\0';
+        if(zsize - next <= CH_flen) {
+            last = 1;
+        } else {
+            unsigned int size = (CH_flen >= sizeof(name)) ? sizeof(name) - 1 : CH_flen;
+            const char *src = fmap_need_off_once(map, next, size);
+            if(src) {
+                memcpy(name, src, size);
+                name[size] = '\0';
+            }
+        }
+
+        /* extreme ratios are mostly bombs, inflate them last */
+        if(csize && usize / csize > 100)
+            rank = 4;
+        else
+            rank = zip_rank_ext(name);
+        entries[n].rank = ((uint64_t)rank << 32) | csize;
+        entries[n].coff = coff;
+        entries[n].index = n;
+        n++;
+
+        if(last)
+            break;
+        next += CH_flen;
+        if(zsize - next <= CH_elen)
+            break;
+        next += CH_elen;
+        if(zsize - next < CH_clen)
+            break;
+        coff = next + CH_clen;
+    }
+
+    if(!n) {
+        free(entries);
+        return NULL;
+    }
+    qsort(entries, n, sizeof(*entries), zip_rank_cmp);
+    *count = n;
+    return entries;
+}
+
 int cli_unzip(cli_ctx *ctx) {
   unsigned int fc=0, fu=0;
   int ret=CL_CLEAN;
   uint32_t fsize, lhoff = 0, coff = 0;
   fmap_t *map = *ctx->fmap;
   char *tmpd;
-  const char *ptr;
-  int virus_found = 0;
+  int virus_found = 0, pooled;
 #if HAVE_JSON
   int toval = 0;
 #endif
@@ -732,21 +1062,35 @@ int cli_unzip(cli_ctx *ctx) {
     free(tmpd);
     return CL_ETMPDIR;
   }
+  pooled = cli_member_pool_start(ctx);
 
-  for(coff=fsize-22 ; coff>0 ; coff--) { /* sizeof(EOC)==22 */
-      if(!(ptr = fmap_need_off_once(map, coff, 20)))
-	  continue;
-      if(cli_readint32(ptr)==0x06054b50) {
-	  uint32_t chptr = cli_readint32(&ptr[16]);
-	  if(!CLI_ISCONTAINED(0, fsize, chptr, SIZEOF_CH)) continue;
-	  coff=chptr;
-	  break;
-      }
-  }
+  if((coff = zip_central(map, fsize))) {
+      struct zip_rank *order = NULL;
+      unsigned int i, n = 0;
 
-  if(coff) {
       cli_dbgmsg("cli_unzip: central @%x\n", coff);
-      while((coff=chdr(map, coff, fsize, &fu, fc+1, &ret, ctx, tmpd, NULL))) {
+      /* with AllMatch everything gets scanned anyway */
+      if(ctx->engine->archive_order && !SCAN_ALL)
+          order = zip_order(map, coff, fsize, &n);
+      /* the members keep their stored number for the metadata sigs */
+      for(i = 0; order && i < n && ret == CL_CLEAN; i++) {
+	  if(chdr(map, order[i].coff, fsize, &fu, order[i].index+1, &ret, ctx, tmpd, NULL))
+	      fc++;
+	  if (ctx->engine->maxfiles && fu>=ctx->engine->maxfiles) {
+	      cli_dbgmsg("cli_unzip: Files limit reached (max: %u)\n", ctx->engine->maxfiles);
+	      ret=CL_EMAXFILES;
+	  }
+#if HAVE_JSON
+          if (cli_json_timeout_cycle_check(ctx, &toval) != CL_SUCCESS) {
+              ret=CL_ETIMEOUT;
+          }
+#endif
+      }
+      if(order) {
+          free(order);
+          coff = 0;
+      }
+      while(coff && (coff=chdr(map, coff, fsize, &fu, fc+1, &ret, ctx, tmpd, NULL))) {
 	  fc++;
 	  if (ctx->engine->maxfiles && fu>=ctx->engine->maxfiles) {
 	      cli_dbgmsg("cli_unzip: Files limit reached (max: %u)\n", ctx->engine->maxfiles);
@@ -770,7 +1114,7 @@ int cli_unzip(cli_ctx *ctx) {
       ret = CL_VIRUS;
   if(fu<=(fc/4)) { /* FIXME: make up a sane ratio or remove the whole logic */
     fc = 0;
-    while (ret==CL_CLEAN && lhoff<fsize && (coff=lhdr(map, lhoff, fsize-lhoff, &fu, fc+1, NULL, &ret, ctx, tmpd, 1, zip_scan_cb))) {
+    while (ret==CL_CLEAN && lhoff<fsize && (coff=lhdr(map, lhoff, fsize-lhoff, &fu, fc+1, NULL, &ret, ctx, tmpd, 1, zip_scan_cb, NULL))) {
       fc++;
       lhoff+=coff;
       if (SCAN_ALL && ret == CL_VIRUS) {
@@ -790,6 +1134,8 @@ int cli_unzip(cli_ctx *ctx) {
     }
   }
 
+  if (pooled)
+    ret = cli_member_pool_finish(ctx, ret);
   if (!ctx->engine->keeptmp) cli_rmdirs(tmpd);
   free(tmpd);
 
@@ -799,7 +1145,7 @@ int cli_unzip(cli_ctx *ctx) {
   return ret;
 }
 
-int unzip_single_internal(cli_ctx *ctx, off_t lhoffl, zip_cb zcb)
+int unzip_single_internal(cli_ctx *ctx, off_t lhoffl, zip_cb zcb, void *zcbdata)
 {
   int ret=CL_CLEAN;
   unsigned int fu=0;
@@ -817,13 +1163,13 @@ int unzip_single_internal(cli_ctx *ctx, off_t lhoffl, zip_cb zcb)
     return CL_CLEAN;
   }
 
-  lhdr(map, lhoffl, fsize, &fu, 0, NULL, &ret, ctx, NULL, 0, zcb);
+  lhdr(map, lhoffl, fsize, &fu, 0, NULL, &ret, ctx, NULL, 0, zcb, zcbdata);
 
   return ret;
 }
 
 int cli_unzip_single(cli_ctx *ctx, off_t lhoffl) {
-    return unzip_single_internal(ctx, lhoffl, zip_scan_cb);
+    return unzip_single_internal(ctx, lhoffl, zip_scan_cb, NULL);
 }
 
 int unzip_search_add(struct zip_requests *requests, const char *name, size_t nlen)
@@ -844,16 +1190,146 @@ int unzip_search_add(struct zip_requests *requests, const char *name, size_t nle
     return CL_SUCCESS;
 }
 
+static uint32_t zip_index_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    while(len--)
+        h = (h ^ (unsigned char) *name++) * 16777619U;
+    return h;
+}
+
+/* Walks the central directory as chdr() does; with index NULL it only
+ * counts the entries and the room their names take */
+static void zip_index_walk(fmap_t *map, uint32_t coff, uint32_t fsize, struct zip_index *index, uint32_t *count, size_t *nbytes)
+{
+    uint8_t ch[SIZEOF_CH];
+    const uint8_t *ptr;
+    const char *src;
+    struct zip_entry *e;
+    uint32_t n = 0, flen;
+    size_t bytes = 0;
+
+    while((ptr = fmap_need_off_once(map, coff, SIZEOF_CH)) && cli_readint32(ptr) == 0x02014b50) {
+        if(index && n == index->count)
+            break;
+        memcpy(ch, ptr, SIZEOF_CH);
+        coff += SIZEOF_CH;
+        if(fsize-coff <= CH_flen)
+            break;
+        flen = MIN(CH_flen, ZIP_NAME_MAX);
+        if(index && (!flen || !(src = fmap_need_off_once(map, coff, flen))))
+            flen = 0;
+        coff += CH_flen;
+        if(fsize-coff <= CH_elen)
+            break;
+        coff += CH_elen;
+        if(fsize-coff < CH_clen)
+            break;
+        coff += CH_clen;
+
+        if(index) {
+            e = &index->entries[n];
+            e->loff = CH_off;
+            e->csize = CH_csize;
+            e->usize = CH_usize;
+            e->crc32 = CH_crc32;
+            e->method = CH_method;
+            e->flags = CH_flags;
+            e->name = bytes;
+            e->nlen = flen;
+            e->hash = zip_index_hash(src, flen);
+            if(flen)
+                memcpy(index->names + bytes, src, flen);
+            index->names[bytes + flen] = '\0';
+            if(e->loff == 0xffffffff || e->csize == 0xffffffff || e->usize == 0xffffffff)
+                zip64_extra(map, coff - CH_clen - CH_elen, CH_elen, &e->usize, &e->csize, &e->loff);
+        }
+        n++;
+        bytes += flen + 1;
+    }
+    *count = n;
+    *nbytes = bytes;
+}
+
+/* Returns the index of the central directory of the map, parsing it on the
+ * first call for the current extent of the map; NULL if out of memory */
+const struct zip_index *unzip_index(fmap_t *map)
+{
+    struct zip_index *index = map->zipindex;
+    uint32_t fsize, coff = 0, count = 0, buckets = 1, i;
+    size_t nbytes = 0;
+
+    if(index && index->off == map->nested_offset && index->len == map->len)
+        return index;
+    free(map->zipindex);
+    map->zipindex = NULL;
+
+    fsize = (uint32_t)map->len;
+    if((size_t)fsize != map->len)
+        cli_dbgmsg("unzip_index: file too big\n");
+    else if(fsize < SIZEOF_CH)
+        cli_dbgmsg("unzip_index: file too short\n");
+    else if(!(coff = zip_central(map, fsize)))
+        cli_dbgmsg("unzip_index: cannot locate central directory\n");
+    if(coff)
+        zip_index_walk(map, coff, fsize, NULL, &count, &nbytes);
+    while(buckets < count)
+        buckets *= 2;
+
+    if(!(index = cli_malloc(sizeof(*index) + count * sizeof(*index->entries) + buckets * sizeof(*index->buckets) + nbytes))) {
+        cli_errmsg("unzip_index: cannot allocate memory for %u entries\n", count);
+        return NULL;
+    }
+    index->off = map->nested_offset;
+    index->len = map->len;
+    index->count = count;
+    index->mask = buckets - 1;
+    index->entries = (struct zip_entry *)(index + 1);
+    index->buckets = (uint32_t *)(index->entries + count);
+    index->names = (char *)(index->buckets + buckets);
+    if(count)
+        zip_index_walk(map, coff, fsize, index, &index->count, &nbytes);
+
+    /* chained backwards so that the first of the entries with the same name
+     * is found first */
+    for(i = 0; i < buckets; i++)
+        index->buckets[i] = ZIP_INDEX_END;
+    for(i = index->count; i--; ) {
+        struct zip_entry *e = &index->entries[i];
+
+        e->next = index->buckets[e->hash & index->mask];
+        index->buckets[e->hash & index->mask] = i;
+    }
+    cli_dbgmsg("unzip_index: %u entries in the central directory @%x\n", index->count, coff);
+    map->zipindex = index;
+    return index;
+}
+
+const struct zip_entry *unzip_index_find(const struct zip_index *index, const char *name, size_t nlen)
+{
+    uint32_t hash = zip_index_hash(name, nlen), i;
+    const struct zip_entry *e;
+
+    for(i = index->buckets[hash & index->mask]; i != ZIP_INDEX_END; i = e->next) {
+        e = &index->entries[i];
+        if(e->hash == hash && e->nlen == nlen && !memcmp(index->names + e->name, name, nlen))
+            return e;
+    }
+    return NULL;
+}
+
+/* The requests are prefixes of the names, the first entry matching any of
+ * them is returned (CL_VIRUS) */
 int unzip_search(cli_ctx *ctx, fmap_t *map, struct zip_requests *requests)
 {
-    unsigned int fc = 0;
-    fmap_t *zmap = map;
-    size_t fsize;
-    uint32_t coff = 0;
-    const char *ptr;
-    int ret = CL_CLEAN;
+    const struct zip_index *index;
+    const struct zip_entry *e;
+    uint32_t fc;
+    size_t len;
+    int i, ret = CL_CLEAN;
 #if HAVE_JSON
-    uint32_t toval = 0;
+    int toval = 0;
 #endif
     cli_dbgmsg("in unzip_search\n");
 
@@ -862,74 +1338,64 @@ int unzip_search(cli_ctx *ctx, fmap_t *map, struct zip_requests *requests)
     }
 
     /* get priority to given map over *ctx->fmap */
-    if (ctx && !map)
-        zmap = *ctx->fmap;
-    fsize = zmap->len;
-    if(sizeof(off_t)!=sizeof(uint32_t) && fsize!=zmap->len) {
-        cli_dbgmsg("unzip_search: file too big\n");
-        return CL_CLEAN;
-    }
-    if (fsize < SIZEOF_CH) {
-        cli_dbgmsg("unzip_search: file too short\n");
-        return CL_CLEAN;
-    }
-
-    for(coff=fsize-22 ; coff>0 ; coff--) { /* sizeof(EOC)==22 */
-        if(!(ptr = fmap_need_off_once(zmap, coff, 20)))
-            continue;
-        if(cli_readint32(ptr)==0x06054b50) {
-            uint32_t chptr = cli_readint32(&ptr[16]);
-            if(!CLI_ISCONTAINED(0, fsize, chptr, SIZEOF_CH)) continue;
-            coff=chptr;
-            break;
-        }
-    }
-
-    if(coff) {
-        cli_dbgmsg("unzip_search: central @%x\n", coff);
-        while(ret==CL_CLEAN && (coff=chdr(zmap, coff, fsize, NULL, fc+1, &ret, ctx, NULL, requests))) {
-            if (requests->match) {
-                ret=CL_VIRUS;
-            }
-
-            fc++;
-            if (ctx && ctx->engine->maxfiles && fc >= ctx->engine->maxfiles) {
-                cli_dbgmsg("cli_unzip: Files limit reached (max: %u)\n", ctx->engine->maxfiles);
-                ret=CL_EMAXFILES;
-            }
+    if (!(index = unzip_index(map ? map : *ctx->fmap)))
+        return CL_EMEM;
 #if HAVE_JSON
-            if (ctx && cli_json_timeout_cycle_check(ctx, (int *)(&toval)) != CL_SUCCESS) {
-                ret=CL_ETIMEOUT;
-            }
+    if (ctx && cli_json_timeout_cycle_check(ctx, &toval) != CL_SUCCESS)
+        return CL_ETIMEOUT;
 #endif
+
+    for (fc = 0; ret == CL_CLEAN && fc < index->count; fc++) {
+        e = &index->entries[fc];
+        for (i = 0; i < requests->namecnt; ++i) {
+            len = MIN(ZIP_NAME_MAX, requests->namelens[i]);
+            if (!strncmp(requests->names[i], index->names + e->name, len)) {
+                requests->match = 1;
+                requests->found = i;
+                requests->loff = e->loff;
+            }
+        }
+        if (requests->match)
+            ret = CL_VIRUS;
+        if (ctx && ctx->engine->maxfiles && fc + 1 >= ctx->engine->maxfiles) {
+            cli_dbgmsg("cli_unzip: Files limit reached (max: %u)\n", ctx->engine->maxfiles);
+            ret = CL_EMAXFILES;
         }
-    } else {
-        cli_dbgmsg("unzip_search: cannot locate central directory\n");
     }
 
     return ret;
 }
 
+/* Looks the exact name up in the index, CL_VIRUS when it's found */
 int unzip_search_single(cli_ctx *ctx, const char *name, size_t nlen, uint32_t *loff)
 {
-    struct zip_requests requests;
-    int ret;
+    const struct zip_index *index;
+    const struct zip_entry *e;
+    uint32_t fc;
+#if HAVE_JSON
+    int toval = 0;
+#endif
 
     cli_dbgmsg("in unzip_search_single\n");
     if (!ctx) {
         return CL_ENULLARG;
     }
 
-    memset(&requests, 0, sizeof(struct zip_requests));
-
-    if ((ret = unzip_search_add(&requests, name, nlen)) != CL_SUCCESS) {
-        return ret;
-    }
+    if (!(index = unzip_index(*ctx->fmap)))
+        return CL_EMEM;
+#if HAVE_JSON
+    if (cli_json_timeout_cycle_check(ctx, &toval) != CL_SUCCESS)
+        return CL_ETIMEOUT;
+#endif
 
-    if ((ret = unzip_search(ctx, NULL, &requests)) == CL_VIRUS) {
-        *loff = requests.loff;
+    e = unzip_index_find(index, name, nlen);
+    fc = e ? e - index->entries + 1 : index->count;
+    if (ctx->engine->maxfiles && fc >= ctx->engine->maxfiles) {
+        cli_dbgmsg("cli_unzip: Files limit reached (max: %u)\n", ctx->engine->maxfiles);
+        return CL_EMAXFILES;
     }
-
-    return ret;
+    if (!e)
+        return CL_CLEAN;
+    *loff = e->loff;
+    return CL_VIRUS;
 }
-
@@ -28,8 +28,11 @@
 
 #include "others.h"
 
-typedef int (*zip_cb)(int fd, cli_ctx *ctx);
-#define zip_scan_cb cli_magic_scandesc
+/* Callback for the members to be parsed rather than scanned: it gets a map
+ * of the member, which stays in memory unless it outgrows
+ * CL_ENGINE_EXTRACT_MEM, and the cbdata passed to unzip_single_internal() */
+typedef int (*zip_cb)(fmap_t *map, cli_ctx *ctx, void *cbdata);
+#define zip_scan_cb NULL
 
 #define MAX_ZIP_REQUESTS 10
 struct zip_requests {
@@ -42,13 +45,37 @@ struct zip_requests {
 };
 
 int cli_unzip(cli_ctx *);
-int cli_unzip_single_internal(cli_ctx *, off_t, zip_cb);
-int unzip_single_internal(cli_ctx *, off_t, zip_cb);
+int unzip_single_internal(cli_ctx *, off_t, zip_cb, void *);
 int cli_unzip_single(cli_ctx *, off_t);
 
+/* Central directory index of a map, built by unzip_index() when first
+ * needed and kept with the map until its extent changes. Names longer
+ * than ZIP_NAME_MAX are truncated, as when scanning the archive. */
+#define ZIP_NAME_MAX 255
+#define ZIP_INDEX_END 0xffffffff
+
+struct zip_entry {
+    uint32_t hash, next;
+    uint32_t loff, csize, usize, crc32;
+    uint16_t method, flags;
+    uint32_t name, nlen; /* offset and length in zip_index.names */
+};
+
+struct zip_index {
+    size_t off, len;
+    uint32_t count, mask;
+    struct zip_entry *entries; /* in the directory order */
+    uint32_t *buckets;
+    char *names;
+};
+
+const struct zip_index *unzip_index(fmap_t *map);
+const struct zip_entry *unzip_index_find(const struct zip_index *index, const char *name, size_t nlen);
+
 int unzip_search_add(struct zip_requests *, const char *, size_t);
 int unzip_search(cli_ctx *, fmap_t *, struct zip_requests *);
 int unzip_search_single(cli_ctx *, const char *, size_t, uint32_t *);
+void cli_zip_initkey(uint32_t key[3], const unsigned char *passwd, uint16_t length);
 
 
 #ifdef UNZIP_PRIVATE
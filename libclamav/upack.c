@@ -55,7 +55,7 @@ int unupack399(char *, uint32_t, uint32_t, char *, uint32_t, char *, char *, uin
 
 enum { UPACK_399, UPACK_11_12, UPACK_0151477, UPACK_0297729 };
 
-int unupack(int upack, char *dest, uint32_t dsize, char *buff, uint32_t vma, uint32_t ep, uint32_t base, uint32_t va, int file)
+int unupack(int upack, char *dest, uint32_t dsize, char *buff, uint32_t vma, uint32_t ep, uint32_t base, uint32_t va, struct cli_extract *x)
 {
 	int j, searchval;
 	char *loc_esi, *loc_edi = NULL, *loc_ebx, *end_edi, *save_edi, *alvalue;
@@ -444,7 +444,7 @@ int unupack(int upack, char *dest, uint32_t dsize, char *buff, uint32_t vma, uin
 		return 0;
 	}
 
-	if (!cli_rebuildpe(dest + (upack?0:va), &section, 1, base, original_ep, 0, 0, file)) {
+	if (!cli_rebuildpe(dest + (upack?0:va), &section, 1, base, original_ep, 0, 0, x)) {
 		cli_dbgmsg("Upack: Rebuilding failed\n");
 		return 0;
 	}
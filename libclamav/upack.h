@@ -27,7 +27,8 @@
 #endif
 
 #include "cltypes.h"
+#include "scanners.h"
 
-int unupack(int, char *, uint32_t, char *, uint32_t, uint32_t, uint32_t, uint32_t, int);
+int unupack(int, char *, uint32_t, char *, uint32_t, uint32_t, uint32_t, uint32_t, struct cli_extract *);
 
 #endif
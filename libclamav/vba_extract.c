@@ -76,6 +76,9 @@ static	int	skip_past_nul(int fd);
 static	int	read_uint16(int fd, uint16_t *u, int big_endian);
 static	int	read_uint32(int fd, uint32_t *u, int big_endian);
 static	int	seekandread(int fd, off_t offset, int whence, void *data, size_t len);
+static	int	map_read(fmap_t *map, size_t *at, void *data, size_t len);
+static	int	map_read_uint16(fmap_t *map, size_t *at, uint16_t *u, int big_endian);
+static	int	map_read_uint32(fmap_t *map, size_t *at, uint32_t *u, int big_endian);
 static	vba_project_t	*create_vba_project(int record_count, const char *dir, struct uniq *U);
 
 static uint16_t
@@ -153,9 +156,9 @@ get_unicode_name(const char *name, int size, int big_endian)
 }
 
 
-static void vba56_test_middle(int fd)
+static void vba56_test_middle(fmap_t *map, size_t *at)
 {
-	char test_middle[MIDDLE_SIZE];
+	const char *test_middle;
 
 	/* MacOffice middle */
 	static const uint8_t middle1_str[MIDDLE_SIZE] = {
@@ -168,35 +171,35 @@ static void vba56_test_middle(int fd)
 		0x85, 0x2e, 0x02, 0x60, 0x8c, 0x4d, 0x0b, 0xb4, 0x00, 0x00
 	};
 
-	if(cli_readn(fd, &test_middle, MIDDLE_SIZE) != MIDDLE_SIZE)
+	if(*at > map->len || map->len - *at < MIDDLE_SIZE) {
+		*at = map->len;
+		return;
+	}
+	if(!(test_middle = fmap_need_off_once(map, *at, MIDDLE_SIZE)))
 		return;
 
 	if((memcmp(test_middle, middle1_str, MIDDLE_SIZE) != 0) &&
 	   (memcmp(test_middle, middle2_str, MIDDLE_SIZE) != 0)) {
 		cli_dbgmsg("middle not found\n");
-		if (lseek(fd, -MIDDLE_SIZE, SEEK_CUR) == -1) {
-            cli_dbgmsg("vba_test_middle: call to lseek() failed\n");
-            return;
-        }
-	} else
+	} else {
 		cli_dbgmsg("middle found\n");
+		*at += MIDDLE_SIZE;
+	}
 }
 
 /* return count of valid strings found, 0 on error */
 static int
-vba_read_project_strings(int fd, int big_endian)
+vba_read_project_strings(fmap_t *map, size_t *at, int big_endian)
 {
-    unsigned char *buf = NULL;
-    uint16_t buflen = 0;
+    const unsigned char *buf;
     uint16_t length = 0;
     int ret = 0, getnewlength = 1;
 
     for(;;) {
-        off_t offset;
         char *name;
 
         /* if no initial name length, exit */
-        if(getnewlength && !read_uint16(fd, &length, big_endian)) {
+        if(getnewlength && !map_read_uint16(map, at, &length, big_endian)) {
             ret = 0;
             break;
         }
@@ -204,38 +207,13 @@ vba_read_project_strings(int fd, int big_endian)
 
         /* if too short, break */
         if (length < 6) {
-            if (lseek(fd, -2, SEEK_CUR) == -1) {
-                cli_dbgmsg("vba_read_project_strings: call to lseek() has failed\n");
-                ret = 0;
-            }
-            break;
-        }
-        /* ensure buffer is large enough */
-        if(length > buflen) {
-            unsigned char *newbuf = (unsigned char *)cli_realloc(buf, length);
-            if(newbuf == NULL) {
-                ret = 0;
-                break;
-            }
-            buflen = length;
-            buf = newbuf;
-        }
-
-        /* save current offset */
-        offset = lseek(fd, 0, SEEK_CUR);
-        if (offset == -1) {
-            cli_dbgmsg("vba_read_project_strings: call to lseek() has failed\n");
-            ret = 0;
+            *at -= 2;
             break;
         }
 
         /* if read name failed, break */
-        if(cli_readn(fd, buf, length) != (int)length) {
+        if(*at > map->len || map->len - *at < length || !(buf = fmap_need_off_once(map, *at, length))) {
             cli_dbgmsg("read name failed - rewinding\n");
-            if (lseek(fd, offset, SEEK_SET) == -1) {
-                cli_dbgmsg("call to lseek() in read name failed\n");
-                ret = 0;
-            }
             break;
         }
         name = get_unicode_name((const char *)buf, length, big_endian);
@@ -245,17 +223,15 @@ vba_read_project_strings(int fd, int big_endian)
         if((name == NULL) || (memcmp("*\\", name, 2) != 0) ||
            (strchr("ghcd", name[2]) == NULL)) {
             /* Not a valid string, rewind */
-            if (lseek(fd, -(length+2), SEEK_CUR) == -1) {
-                cli_dbgmsg("call to lseek() after get_unicode_name has failed\n");
-                ret = 0;
-            }
+            *at -= 2;
             free(name);
             break;
         }
         free(name);
+        *at += length;
 
         /* can't get length, break */
-        if(!read_uint16(fd, &length, big_endian)) {
+        if(!map_read_uint16(map, at, &length, big_endian)) {
             break;
         }
 
@@ -267,32 +243,26 @@ vba_read_project_strings(int fd, int big_endian)
         }
 
         /* determine offset and run middle test */
-        offset = lseek(fd, 10, SEEK_CUR);
-        if (offset == -1) {
-            cli_dbgmsg("call to lseek() has failed\n");
-            ret = 0;
-            break;
-        }
-        cli_dbgmsg("offset: %lu\n", (unsigned long)offset);
-        vba56_test_middle(fd);
+        *at += 10;
+        cli_dbgmsg("offset: %lu\n", (unsigned long)*at);
+        vba56_test_middle(map, at);
         getnewlength = 1;
     }
 
-    free(buf);
     return ret;
 }
 
 vba_project_t *
 cli_vba_readdir(const char *dir, struct uniq *U, uint32_t which)
 {
-	unsigned char *buf;
+	const unsigned char *buf;
 	const unsigned char vba56_signature[] = { 0xcc, 0x61 };
-	uint16_t record_count, buflen, ffff, byte_count;
+	uint16_t record_count, ffff, byte_count;
 	uint32_t offset;
 	int i, j, fd, big_endian = FALSE;
 	vba_project_t *vba_project;
-	struct vba56_header v56h;
-	off_t seekback;
+	size_t at, seekback;
+	fmap_t *map;
 	char fullname[1024], *hash;
 
 	cli_dbgmsg("in cli_vba_readdir()\n");
@@ -313,39 +283,34 @@ cli_vba_readdir(const char *dir, struct uniq *U, uint32_t which)
 	if(fd == -1)
 		return NULL;
 
-	if(cli_readn(fd, &v56h, sizeof(struct vba56_header)) != sizeof(struct vba56_header)) {
-		close(fd);
-		return NULL;
-	}
-	if (memcmp(v56h.magic, vba56_signature, sizeof(v56h.magic)) != 0) {
-		close(fd);
+	/* the stream is parsed through the map, the descriptor isn't needed */
+	map = fmap(fd, 0, 0);
+	close(fd);
+	if(!map)
 		return NULL;
-	}
 
-	i = vba_read_project_strings(fd, TRUE);
-	if ((seekback = lseek(fd, 0, SEEK_CUR)) == -1) {
-		cli_dbgmsg("vba_readdir: lseek() failed. Unable to guess VBA type\n");
-		close(fd);
+	if(!(buf = fmap_need_off_once(map, 0, sizeof(struct vba56_header)))) {
+		funmap(map);
 		return NULL;
 	}
-	if (lseek(fd, sizeof(struct vba56_header), SEEK_SET) == -1) {
-		cli_dbgmsg("vba_readdir: lseek() failed. Unable to guess VBA type\n");
-		close(fd);
+	if (memcmp(((const struct vba56_header *)buf)->magic, vba56_signature, sizeof(vba56_signature)) != 0) {
+		funmap(map);
 		return NULL;
 	}
-	j = vba_read_project_strings(fd, FALSE);
+
+	at = sizeof(struct vba56_header);
+	i = vba_read_project_strings(map, &at, TRUE);
+	seekback = at;
+	at = sizeof(struct vba56_header);
+	j = vba_read_project_strings(map, &at, FALSE);
 	if(!i && !j) {
-		close(fd);
+		funmap(map);
 		cli_dbgmsg("vba_readdir: Unable to guess VBA type\n");
 		return NULL;
 	}
 	if (i > j) {
 		big_endian = TRUE;
-		if (lseek(fd, seekback, SEEK_SET) == -1) {
-			cli_dbgmsg("vba_readdir: call to lseek() while guessing big-endian has failed\n");
-			close(fd);
-			return NULL;
-		}
+		at = seekback;
 		cli_dbgmsg("vba_readdir: Guessing big-endian\n");
 	} else {
 		cli_dbgmsg("vba_readdir: Guessing little-endian\n");
@@ -353,99 +318,78 @@ cli_vba_readdir(const char *dir, struct uniq *U, uint32_t which)
 
 	/* junk some more stuff */
 	do
-		if (cli_readn(fd, &ffff, 2) != 2) {
-			close(fd);
+		if (!map_read(map, &at, &ffff, 2)) {
+			funmap(map);
 			return NULL;
 		}
 	while(ffff != 0xFFFF);
 
 	/* check for alignment error */
-	if(!seekandread(fd, -3, SEEK_CUR, &ffff, sizeof(uint16_t))) {
-		close(fd);
+	at -= 3;
+	if(!map_read(map, &at, &ffff, sizeof(uint16_t))) {
+		funmap(map);
 		return NULL;
 	}
-	if (ffff != 0xFFFF) {
-		if (lseek(fd, 1, SEEK_CUR) == -1) {
-            cli_dbgmsg("call to lseek() while checking alignment error has failed\n");
-            close(fd);
-            return NULL;
-        }
-    }
+	if (ffff != 0xFFFF)
+		at++;
 
-	if(!read_uint16(fd, &ffff, big_endian)) {
-		close(fd);
+	if(!map_read_uint16(map, &at, &ffff, big_endian)) {
+		funmap(map);
 		return NULL;
 	}
 
-	if(ffff != 0xFFFF) {
-		if (lseek(fd, ffff, SEEK_CUR) == -1) {
-            cli_dbgmsg("call to lseek() while checking alignment error has failed\n");
-            close(fd);
-            return NULL;
-        }
-    }
+	if(ffff != 0xFFFF)
+		at += ffff;
 
-	if(!read_uint16(fd, &ffff, big_endian)) {
-		close(fd);
+	if(!map_read_uint16(map, &at, &ffff, big_endian)) {
+		funmap(map);
 		return NULL;
 	}
 
 	if(ffff == 0xFFFF)
 		ffff = 0;
 
-	if (lseek(fd, ffff + 100, SEEK_CUR) == -1) {
-        cli_dbgmsg("call to lseek() failed\n");
-        close(fd);
-        return NULL;
-    }
+	at += ffff + 100;
 
-	if(!read_uint16(fd, &record_count, big_endian)) {
-		close(fd);
+	if(!map_read_uint16(map, &at, &record_count, big_endian)) {
+		funmap(map);
 		return NULL;
 	}
 	cli_dbgmsg("vba_readdir: VBA Record count %d\n", record_count);
 	if (record_count == 0) {
 		/* No macros, assume clean */
-		close(fd);
+		funmap(map);
 		return NULL;
 	}
 	if (record_count > MAX_VBA_COUNT) {
 		/* Almost certainly an error */
 		cli_dbgmsg("vba_readdir: VBA Record count too big\n");
-		close(fd);
+		funmap(map);
 		return NULL;
 	}
 
 	vba_project = create_vba_project(record_count, dir, U);
 	if(vba_project == NULL) {
-		close(fd);
+		funmap(map);
 		return NULL;
 	}
-	buf = NULL;
-	buflen = 0;
 	for(i = 0; i < record_count; i++) {
 		uint16_t length;
 		char *ptr;
 
 		vba_project->colls[i] = 0;
-		if(!read_uint16(fd, &length, big_endian))
+		if(!map_read_uint16(map, &at, &length, big_endian))
 			break;
 
 		if (length == 0) {
 			cli_dbgmsg("vba_readdir: zero name length\n");
 			break;
 		}
-		if(length > buflen) {
-			unsigned char *newbuf = (unsigned char *)cli_realloc(buf, length);
-			if(newbuf == NULL)
-				break;
-			buflen = length;
-			buf = newbuf;
-		}
-		if (cli_readn(fd, buf, length) != length) {
+		if (at > map->len || map->len - at < length || !(buf = fmap_need_off_once(map, at, length))) {
 			cli_dbgmsg("vba_readdir: read name failed\n");
 			break;
 		}
+		at += length;
 		ptr = get_unicode_name((const char *)buf, length, big_endian);
 		if(ptr == NULL) break;
 		if (!(vba_project->colls[i]=uniq_get(U, ptr, strlen(ptr), &hash))) {
@@ -456,34 +400,31 @@ cli_vba_readdir(const char *dir, struct uniq *U, uint32_t which)
 		cli_dbgmsg("vba_readdir: project name: %s (%s)\n", ptr, hash);
 		free(ptr);
 		vba_project->name[i] = hash;
-		if(!read_uint16(fd, &length, big_endian))
+		if(!map_read_uint16(map, &at, &length, big_endian))
 			break;
-		lseek(fd, length, SEEK_CUR);
+		at += length;
 
-		if(!read_uint16(fd, &ffff, big_endian))
+		if(!map_read_uint16(map, &at, &ffff, big_endian))
 			break;
 		if (ffff == 0xFFFF) {
-			lseek(fd, 2, SEEK_CUR);
-			if(!read_uint16(fd, &ffff, big_endian))
+			at += 2;
+			if(!map_read_uint16(map, &at, &ffff, big_endian))
 				break;
-			lseek(fd, ffff + 8, SEEK_CUR);
+			at += ffff + 8;
 		} else
-			lseek(fd, ffff + 10, SEEK_CUR);
+			at += ffff + 10;
 
-		if(!read_uint16(fd, &byte_count, big_endian))
+		if(!map_read_uint16(map, &at, &byte_count, big_endian))
 			break;
-		lseek(fd, (8 * byte_count) + 5, SEEK_CUR);
-		if(!read_uint32(fd, &offset, big_endian))
+		at += (8 * byte_count) + 5;
+		if(!map_read_uint32(map, &at, &offset, big_endian))
 			break;
 		cli_dbgmsg("vba_readdir: offset: %u\n", (unsigned int)offset);
 		vba_project->offset[i] = offset;
-		lseek(fd, 2, SEEK_CUR);
+		at += 2;
 	}
 
-	if(buf)
-		free(buf);
-
-	close(fd);
+	funmap(map);
 
 	if(i < record_count) {
 		free(vba_project->name);
@@ -498,15 +439,17 @@ cli_vba_readdir(const char *dir, struct uniq *U, uint32_t which)
 }
 
 unsigned char *
-cli_vba_inflate(int fd, off_t offset, int *size)
+cli_vba_inflate(fmap_t *map, off_t offset, int *size)
 {
 	unsigned int pos, shift, mask, distance, clean;
 	uint8_t flag;
 	uint16_t token;
 	blob *b;
 	unsigned char buffer[VBA_COMPRESSION_WINDOW];
+	const unsigned char *data;
+	size_t at, end;
 
-	if(fd < 0)
+	if(!map)
 		return NULL;
 
 	b = blobCreate();
@@ -514,24 +457,41 @@ cli_vba_inflate(int fd, off_t offset, int *size)
 	if(b == NULL)
 		return NULL;
 
+	/* 1byte ?? , 2byte length ?? */
+	if(offset < 0 || (size_t)offset + 3 >= map->len) {
+		data = NULL;
+		end = 0;
+	} else {
+		end = map->len - offset - 3;
+		if(!(data = fmap_need_off_once(map, offset + 3, end))) {
+			blobDestroy(b);
+			if(size)
+				*size = 0;
+			return NULL;
+		}
+	}
+
 	memset(buffer, 0, sizeof(buffer));
-	lseek(fd, offset+3, SEEK_SET); /* 1byte ?? , 2byte length ?? */
 	clean = TRUE;
 	pos = 0;
+	at = 0;
 
-	while (cli_readn(fd, &flag, 1) == 1) {
+	while (at < end) {
+		flag = data[at++];
 		for(mask = 1; mask < 0x100; mask<<=1) {
 			unsigned int winpos = pos % VBA_COMPRESSION_WINDOW;
 			if (flag & mask) {
 				uint16_t len;
 				unsigned int srcpos;
 
-				if(!read_uint16(fd, &token, FALSE)) {
+				if(end - at < 2) {
 					blobDestroy(b);
 					if(size)
 						*size = 0;
 					return NULL;
 				}
+				token = cli_readint16(&data[at]);
+				at += 2;
 				shift = 12 - (winpos > 0x10)
 						- (winpos > 0x20)
 						- (winpos > 0x40)
@@ -559,18 +519,21 @@ cli_vba_inflate(int fd, off_t offset, int *size)
 					}
 			} else {
 				if((pos != 0) && (winpos == 0) && clean) {
-					if (cli_readn(fd, &token, 2) != 2) {
+					if (end - at < 2) {
 						blobDestroy(b);
 						if(size)
 							*size = 0;
 						return NULL;
 					}
+					at += 2;
 					(void)blobAddData(b, buffer, VBA_COMPRESSION_WINDOW);
 					clean = FALSE;
 					break;
 				}
-				if(cli_readn(fd, &buffer[winpos], 1) == 1)
+				if(at < end) {
+					buffer[winpos] = data[at++];
 					pos++;
+				}
 			}
 			clean = TRUE;
 		}
@@ -672,6 +635,63 @@ cli_scan_ole10(int fd, cli_ctx *ctx)
 	return ret;
 }
 
+static int
+ole10_skip_past_nul(const unsigned char *data, size_t len, size_t *off)
+{
+	const unsigned char *end;
+
+	if(*off >= len)
+		return FALSE;
+	if(!(end = memchr(data + *off, '\0', len - *off)))
+		return FALSE;
+	*off = end - data + 1;
+	return TRUE;
+}
+
+/*
+ * cli_scan_ole10() on an object in memory: the object is scanned in
+ * place, not copied to a temporary file
+ */
+int
+cli_scan_ole10_mem(const unsigned char *data, size_t len, cli_ctx *ctx)
+{
+	uint32_t object_size;
+	size_t off = 4;
+
+	if(len < 4)
+		return CL_CLEAN;
+	object_size = cli_readint32(data);
+
+	if(len - 4 >= object_size) {
+		/* Probably the OLE type id */
+		off += 2;
+
+		/* Attachment name */
+		if(!ole10_skip_past_nul(data, len, &off))
+			return CL_CLEAN;
+
+		/* Attachment full path */
+		if(!ole10_skip_past_nul(data, len, &off))
+			return CL_CLEAN;
+
+		/* ??? */
+		off += 8;
+
+		/* Attachment full path */
+		if(!ole10_skip_past_nul(data, len, &off))
+			return CL_CLEAN;
+
+		if(off + 4 > len)
+			return CL_CLEAN;
+		object_size = cli_readint32(data + off);
+		off += 4;
+	}
+	if(off >= len)
+		return CL_CLEAN;
+	cli_dbgmsg("cli_decode_ole_object: scanning %lu bytes in memory\n", (unsigned long) MIN(object_size, len - off));
+	return cli_mem_scandesc(data + off, MIN(object_size, len - off), ctx);
+}
+
 /*
  * Powerpoint files
  */
@@ -1300,6 +1320,43 @@ seekandread(int fd, off_t offset, int whence, void *data, size_t len)
 	return cli_readn(fd, data, (unsigned int)len) == (int)len;
 }
 
+/*
+ * Read len bytes at *at from the map and move past them. Return success or fail
+ */
+static int
+map_read(fmap_t *map, size_t *at, void *data, size_t len)
+{
+	if(fmap_readn(map, data, *at, len) != (int)len)
+		return FALSE;
+	*at += len;
+	return TRUE;
+}
+
+/*
+ * Like read_uint16() and read_uint32(), from the map
+ */
+static int
+map_read_uint16(fmap_t *map, size_t *at, uint16_t *u, int big_endian)
+{
+	if(!map_read(map, at, u, sizeof(uint16_t)))
+		return FALSE;
+
+	*u = vba_endian_convert_16(*u, big_endian);
+
+	return TRUE;
+}
+
+static int
+map_read_uint32(fmap_t *map, size_t *at, uint32_t *u, int big_endian)
+{
+	if(!map_read(map, at, u, sizeof(uint32_t)))
+		return FALSE;
+
+	*u = vba_endian_convert_32(*u, big_endian);
+
+	return TRUE;
+}
+
 /*
  * Create and initialise a vba_project structure
  */
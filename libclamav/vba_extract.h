@@ -27,6 +27,7 @@
 #include "others.h"
 #include "cltypes.h"
 #include "uniq.h"
+#include "fmap.h"
 
 typedef struct vba_project_tag {
 	char **name;
@@ -41,8 +42,9 @@ typedef struct vba_project_tag {
 
 vba_project_t	*cli_vba_readdir(const char *dir, struct uniq *U, uint32_t which);
 vba_project_t	*cli_wm_readdir(int fd);
-unsigned char	*cli_vba_inflate(int fd, off_t offset, int *size);
+unsigned char	*cli_vba_inflate(fmap_t *map, off_t offset, int *size);
 int	cli_scan_ole10(int fd, cli_ctx *ctx);
+int	cli_scan_ole10_mem(const unsigned char *data, size_t len, cli_ctx *ctx);
 char	*cli_ppt_vba_read(int fd, cli_ctx *ctx);
 unsigned char	*cli_wm_decrypt_macro(int fd, off_t offset, uint32_t len,
 					unsigned char key);
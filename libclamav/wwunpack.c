@@ -72,7 +72,7 @@ if (bc>=(N)) { \
   } \
 }
 
-int wwunpack(uint8_t *exe, uint32_t exesz, uint8_t *wwsect, struct cli_exe_section *sects, uint16_t scount, uint32_t pe, int desc) {
+int wwunpack(uint8_t *exe, uint32_t exesz, uint8_t *wwsect, struct cli_exe_section *sects, uint16_t scount, uint32_t pe, struct cli_extract *x) {
   uint8_t *structs = wwsect + 0x2a1, *compd, *ccur, *unpd, *ucur, bc;
   uint32_t src, srcend, szd, bt, bits;
   int error=0, i;
@@ -248,7 +248,7 @@ int wwunpack(uint8_t *exe, uint32_t exesz, uint8_t *wwsect, struct cli_exe_secti
 	}
 
     memset(structs, 0, 0x28);
-    error = (uint32_t)cli_writen(desc, exe, exesz)!=exesz;
+    error = cli_extract_write(x, exe, exesz)!=CL_SUCCESS;
   }
   return error;
 }
@@ -24,7 +24,8 @@
 
 #include "cltypes.h"
 #include "execs.h"
+#include "scanners.h"
 
-int wwunpack(uint8_t *, uint32_t, uint8_t *, struct cli_exe_section *, uint16_t, uint32_t, int);
+int wwunpack(uint8_t *, uint32_t, uint8_t *, struct cli_exe_section *, uint16_t, uint32_t, struct cli_extract *);
 
 #endif
@@ -439,6 +439,7 @@ int cli_scanxar(cli_ctx *ctx)
     unsigned char *a_cksum = NULL, *e_cksum = NULL;
     void *a_hash_ctx = NULL, *e_hash_ctx = NULL;
     char result[SHA1_HASH_SIZE];
+    struct cli_extract x;
 
     memset(&strm, 0x00, sizeof(z_stream));
 
@@ -552,9 +553,8 @@ int cli_scanxar(cli_ctx *ctx)
         goto exit_reader;
     }
 
-    /* Walk the TOC XML and extract files */
-    fd = -1;
-    tmpname = NULL;
+    /* Walk the TOC XML and extract files, see cli_extract_init() */
+    cli_extract_init(&x, ctx, NULL);
     while (CL_SUCCESS == (rc = xar_get_toc_data_values(reader, &length, &offset, &size, &encoding,
                                                        &a_cksum, &a_hash, &e_cksum, &e_hash))) {
         int do_extract_cksum = 1;
@@ -563,23 +563,15 @@ int cli_scanxar(cli_ctx *ctx)
         void *a_mc, *e_mc;
         char * expected;
 
-        /* clean up temp file from previous loop iteration */
-        if (fd > -1 && tmpname) {
-            rc = xar_cleanup_temp_file(ctx, fd, tmpname);
-            if (rc != CL_SUCCESS)
-                goto exit_reader;
-        }
+        /* release the member of the previous loop iteration */
+        if ((rc = cli_extract_done(&x)) != CL_SUCCESS)
+            goto exit_tmpfile;
 
         at = offset + hdr.toc_length_compressed + hdr.size;
 
-        if ((rc = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd)) != CL_SUCCESS) {
-            cli_dbgmsg("cli_scanxar: Can't generate temporary file.\n");
-            goto exit_reader;
-        }
-
-        cli_dbgmsg("cli_scanxar: decompress into temp file:\n%s, size %zu,\n"
+        cli_dbgmsg("cli_scanxar: extract size %zu,\n"
                    "from xar heap offset %zu length %zu\n",
-                   tmpname, size, offset, length);
+                   size, offset, length);
 
 
         a_hash_ctx = xar_hash_init(a_hash, &a_sc, &a_mc);
@@ -627,10 +619,9 @@ int cli_scanxar(cli_ctx *ctx)
                     if (e_hash_ctx != NULL)
                         xar_hash_update(e_hash_ctx, buff, bytes, e_hash);
                    
-                    if (cli_writen(fd, buff, bytes) < 0) {
-                        cli_dbgmsg("cli_scanxar: cli_writen error file %s.\n", tmpname);
+                    if ((rc = cli_extract_write(&x, buff, bytes)) != CL_SUCCESS) {
+                        cli_dbgmsg("cli_scanxar: cli_extract_write error %i.\n", rc);
                         inflateEnd(&strm);
-                        rc = CL_EWRITE;
                         goto exit_tmpfile;
                     }
                     outsize += sizeof(buff) - strm.avail_out;
@@ -667,6 +658,7 @@ int cli_scanxar(cli_ctx *ctx)
                     length = in_remaining;
 
                 memset(&lz, 0, sizeof(lz));
+                lz.ctx = ctx;
                 if (buff == NULL) {
                     cli_dbgmsg("cli_scanxar: memory request for lzma decompression buffer fails.\n");
                     rc = CL_EMEM;
@@ -751,12 +743,11 @@ int cli_scanxar(cli_ctx *ctx)
                     /*            "consumed %li of %li available compressed bytes.\n", */
                     /*            avail_out, in_consumed, avail_in); */
 
-                    if (cli_writen(fd, buff, avail_out) < 0) {
-                        cli_dbgmsg("cli_scanxar: cli_writen error writing lzma temp file for %llu bytes.\n",
-                                   (long long unsigned)avail_out);
+                    if ((rc = cli_extract_write(&x, buff, avail_out)) != CL_SUCCESS) {
+                        cli_dbgmsg("cli_scanxar: cli_extract_write error %i for %llu lzma bytes.\n",
+                                   rc, (long long unsigned)avail_out);
                         __lzma_wrap_free(NULL, buff);
                         cli_LzmaShutdown(&lz);
-                        rc = CL_EWRITE;
                         goto exit_tmpfile;
                     }
 
@@ -778,7 +769,7 @@ int cli_scanxar(cli_ctx *ctx)
         default:
         case CL_TYPE_BZ:
         case CL_TYPE_XZ:
-            /* for uncompressed, bzip2, xz, and unknown, just pull the file, cli_magic_scandesc does the rest */
+            /* for uncompressed, bzip2, xz, and unknown, scan the stored data in place, magic_scandesc does the rest */
             do_extract_cksum = 0;
             {
                 size_t writelen = MIN(map->len - at, length);
@@ -798,9 +789,8 @@ int cli_scanxar(cli_ctx *ctx)
                 if (a_hash_ctx != NULL)
                     xar_hash_update(a_hash_ctx, blockp, writelen, a_hash);
                 
-                if (cli_writen(fd, blockp, writelen) < 0) {
-                    cli_dbgmsg("cli_scanxar: cli_writen error %zu bytes @ %li.\n", writelen, at);
-                    rc = CL_EWRITE;
+                if ((rc = cli_extract_range(&x, at, writelen)) != CL_SUCCESS) {
+                    cli_dbgmsg("cli_scanxar: cli_extract_range error %i, %zu bytes @ %zu.\n", rc, writelen, at);
                     goto exit_tmpfile;
                 }
                 /*break;*/
@@ -846,14 +836,14 @@ int cli_scanxar(cli_ctx *ctx)
                 }
             }
         
-            rc = cli_magic_scandesc(fd, ctx);
+            rc = cli_extract_scan(&x);
             if (rc != CL_SUCCESS) {
                 if (rc == CL_VIRUS) {
                     cli_dbgmsg("cli_scanxar: Infected with %s\n", cli_get_last_virus(ctx));
                     if (!SCAN_ALL)
                         goto exit_tmpfile;
                 } else if (rc != CL_BREAK) {
-                    cli_dbgmsg("cli_scanxar: cli_magic_scandesc error %i\n", rc);
+                    cli_dbgmsg("cli_scanxar: cli_extract_scan error %i\n", rc);
                     goto exit_tmpfile;
                 }
             }
@@ -870,7 +860,8 @@ int cli_scanxar(cli_ctx *ctx)
     }
 
  exit_tmpfile:
-    xar_cleanup_temp_file(ctx, fd, tmpname);
+    if (cli_extract_done(&x) && rc != CL_VIRUS)
+        rc = CL_EUNLINK;
     if (a_hash_ctx != NULL)
         xar_hash_final(a_hash_ctx, result, a_hash);
     if (e_hash_ctx != NULL)
@@ -108,7 +108,7 @@ int cli_scanxdp(cli_ctx *ctx)
     char *dumpname;
     size_t i;
     
-    buf = (const char *)fmap_need_off_once(map, map->offset, map->len);
+    buf = (const char *)fmap_need_off_once(map, 0, map->len);
     if (!(buf))
         return CL_EREAD;
 
@@ -60,6 +60,45 @@ void cli_XzShutdown(struct CLI_XZ *XZ) {
     XzUnpacker_Free(&XZ->state);
 }
 
+/* Decodes one block of a stream on its own: header is the stream header,
+ * src the block with its padding and check, which must decode to exactly
+ * dstlen bytes; dst has room for one more. cli_XzInit() must have been
+ * called before, for the tables. */
+int cli_XzDecodeBlock(const unsigned char *header, const unsigned char *src, size_t srclen, unsigned char *dst, size_t dstlen) {
+    static const Byte index = 0;
+    CXzUnpacker state;
+    ECoderStatus status;
+    SizeT outbytes, inbytes;
+    SRes res;
+
+    XzUnpacker_Create(&state, &g_Alloc);
+    if (Xz_ParseHeader(&state.streamFlags, header) != SZ_OK) {
+        XzUnpacker_Free(&state);
+        return XZ_RESULT_DATA_ERROR;
+    }
+    state.state = XZ_STATE_BLOCK_HEADER;
+    state.sha = NULL;
+    state.indexSize = 0;
+    state.numBlocks = 0;
+
+    /* one byte more than the block holds, so that its end is read */
+    inbytes = srclen;
+    outbytes = dstlen + 1;
+    res = XzUnpacker_Code(&state, dst, &outbytes, src, &inbytes, CODER_FINISH_ANY, &status);
+    if (res == SZ_OK && (inbytes != srclen || outbytes != dstlen))
+        res = SZ_ERROR_DATA;
+    /* the check is verified as the next block or the index starts */
+    if (res == SZ_OK) {
+        inbytes = 1;
+        outbytes = 0;
+        res = XzUnpacker_Code(&state, NULL, &outbytes, &index, &inbytes, CODER_FINISH_ANY, &status);
+        if (res == SZ_OK && state.state != XZ_STATE_STREAM_INDEX)
+            res = SZ_ERROR_DATA;
+    }
+    XzUnpacker_Free(&state);
+    return res == SZ_OK ? XZ_RESULT_OK : XZ_RESULT_DATA_ERROR;
+}
+
 int cli_XzDecode(struct CLI_XZ *XZ) {
     SRes res;
     SizeT outbytes, inbytes;
@@ -38,6 +38,7 @@ struct CLI_XZ {
 int cli_XzInit(struct CLI_XZ *);
 void cli_XzShutdown(struct CLI_XZ *);
 int cli_XzDecode(struct CLI_XZ *);
+int cli_XzDecodeBlock(const unsigned char *header, const unsigned char *src, size_t srclen, unsigned char *dst, size_t dstlen);
 
 #define XZ_RESULT_OK 0
 #define XZ_RESULT_DATA_ERROR 1
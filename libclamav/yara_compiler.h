@@ -101,6 +101,7 @@ typedef struct _YR_COMPILER
   STAILQ_HEAD(cs, _yc_string) current_rule_string_q;
   YR_ARENA*         the_arena;
   uint32_t          current_rule_clflags;
+  int               optimize_code;
 
 } YR_COMPILER;
 
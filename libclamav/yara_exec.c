@@ -51,6 +51,7 @@ typedef struct _YR_MATCH
 #include "matcher.h"
 #include "matcher-ac.h"
 #include "yara_clam.h"
+#include "yara_arena.h"
 #include "yara_exec.h"
 #endif
 
@@ -270,6 +271,40 @@ int yr_execute_code(
         }
         break;
 
+      case OP_JFALSE:
+        // Short-circuit of an AND: a false or undefined left operand
+        // is the result.
+        pop(r1);
+
+        if (IS_UNDEFINED(r1) || !r1)
+        {
+          push(0);
+          ip = *(uint8_t**)(ip + 1);
+          ip--;
+        }
+        else
+        {
+          push(r1);
+          ip += sizeof(uint64_t);
+        }
+        break;
+
+      case OP_JTRUE:
+        // Short-circuit of an OR of booleans.
+        pop(r1);
+        push(r1);
+
+        if (!IS_UNDEFINED(r1) && r1)
+        {
+          ip = *(uint8_t**)(ip + 1);
+          ip--;
+        }
+        else
+        {
+          ip += sizeof(uint64_t);
+        }
+        break;
+
       case OP_AND:
         pop(r2);
         pop(r1);
@@ -425,7 +460,11 @@ int yr_execute_code(
 #if REAL_YARA
         push(rule->t_flags[tidx] & RULE_TFLAGS_MATCH ? 1 : 0);
 #else
-        push(acdata->yr_matches[rule->lsigid]);
+        {
+            struct cli_ac_lsigstate *st = cli_ac_lsigstate(acdata, rule->lsigid);
+
+            push(st ? st->yr_match : 0);
+        }
 #endif
         break;
 
@@ -439,8 +478,11 @@ int yr_execute_code(
           rule->t_flags[tidx] |= RULE_TFLAGS_MATCH;
 #else
         {
+            struct cli_ac_lsigstate *st = cli_ac_lsigstate_add(acdata, aclsig->id);
+
             rule_matches++;
-            acdata->yr_matches[aclsig->id] = 1;
+            if (st)
+                st->yr_match = 1;
         }
 #endif
 
@@ -569,7 +611,7 @@ int yr_execute_code(
 #if REAL_YARA
         push(string->matches[tidx].tail != NULL ? 1 : 0);
 #else
-        push(acdata->lsigsuboff_first[aclsig->id][string->subsig_id] != CLI_OFF_NONE ? 1 : 0);
+        push(cli_ac_lsigsuboff_first(acdata, aclsig->id)[string->subsig_id] != CLI_OFF_NONE ? 1 : 0);
 #endif
         break;
 
@@ -604,7 +646,7 @@ int yr_execute_code(
         }
 #else
         found = 0;
-        ls_matches = acdata->lsig_matches[aclsig->id];
+        ls_matches = cli_ac_lsigmatches(acdata, aclsig->id);
         if (ls_matches != NULL) {
             ss_matches = ls_matches->matches[string->subsig_id];
             if (ss_matches != NULL) {
@@ -658,7 +700,7 @@ int yr_execute_code(
         }
 #else
         found = FALSE;
-        ls_matches = acdata->lsig_matches[aclsig->id];
+        ls_matches = cli_ac_lsigmatches(acdata, aclsig->id);
         if (ls_matches != NULL) {
             ss_matches = ls_matches->matches[string->subsig_id];
             if (ss_matches != NULL) {
@@ -688,7 +730,7 @@ int yr_execute_code(
 #if REAL_YARA
         push(string->matches[tidx].count);
 #else
-        push(acdata->lsigcnt[aclsig->id][string->subsig_id]);
+        push(cli_ac_lsigcnt(acdata, aclsig->id)[string->subsig_id]);
 #endif
         break;
 
@@ -722,7 +764,7 @@ int yr_execute_code(
 #else
         i = r1 - 1;
         found = FALSE;
-        ls_matches = acdata->lsig_matches[aclsig->id];
+        ls_matches = cli_ac_lsigmatches(acdata, aclsig->id);
         if (ls_matches != NULL && i >= 0) {
             ss_matches = ls_matches->matches[string->subsig_id];
             if (ss_matches != NULL) {
@@ -758,7 +800,7 @@ int yr_execute_code(
         {
           string = UINT64_TO_PTR(YR_STRING*, r1);
           lsig_id = string->subsig_id;
-          if (acdata->lsigsuboff_first[aclsig->id][lsig_id] != CLI_OFF_NONE)
+          if (cli_ac_lsigsuboff_first(acdata, aclsig->id)[lsig_id] != CLI_OFF_NONE)
             found++;
           count++;
           pop(r1);
@@ -917,3 +959,751 @@ int yr_execute_code(
 
   return ERROR_SUCCESS;
 }
+
+
+//
+// Condition code optimization, run on the code of each rule once it is
+// parsed. The code is decoded into an array of instructions, constant
+// operations are folded, the operands of OP_AND and OP_OR are swapped
+// when the second one is estimated to be cheaper, and an OP_JFALSE
+// (OP_JTRUE for an OR of booleans) is inserted between the operands so
+// that the second one is only evaluated when the first doesn't decide
+// the result. The operands are found by following the stack effect of
+// the instructions, code with anything else is left as it is.
+//
+
+#define OPT_UNSUPPORTED   -1
+
+#define OPT_DELETED       0
+
+#define OPT_CONST         1
+#define OPT_BOOL          2
+
+// weight of the instructions evaluated at each iteration of a loop
+#define OPT_LOOP_WEIGHT   8
+
+
+typedef struct _OPT_INSN
+{
+  uint8_t op;
+  int64_t arg;
+  int32_t target;   // index of the jump target, -1 if not a jump
+
+} OPT_INSN;
+
+
+typedef struct _OPT_VALUE
+{
+  int32_t start;    // first instruction computing the value
+  int flags;
+  int64_t value;
+
+} OPT_VALUE;
+
+
+typedef struct _OPT_BINOP
+{
+  int32_t at;       // the OP_AND or OP_OR
+  int32_t left;     // first instruction of each operand
+  int32_t right;
+  int flags;        // OPT_BOOL if both operands are booleans
+
+} OPT_BINOP;
+
+
+static int _yr_opt_has_arg(
+    uint8_t op)
+{
+  switch(op)
+  {
+    case OP_PUSH:
+    case OP_CLEAR_M:
+    case OP_ADD_M:
+    case OP_INCR_M:
+    case OP_PUSH_M:
+    case OP_POP_M:
+    case OP_SWAPUNDEF:
+    case OP_JNUNDEF:
+    case OP_JLE:
+    case OP_JFALSE:
+    case OP_JTRUE:
+    case OP_PUSH_RULE:
+    case OP_MATCH_RULE:
+    case OP_OBJ_LOAD:
+    case OP_OBJ_FIELD:
+    case OP_CALL:
+    case OP_IMPORT:
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+static int _yr_opt_is_jump(
+    uint8_t op)
+{
+  return op == OP_JNUNDEF || op == OP_JLE ||
+         op == OP_JFALSE || op == OP_JTRUE;
+}
+
+
+static uint32_t _yr_opt_weight(
+    uint8_t op)
+{
+  switch(op)
+  {
+    case OP_STR_FOUND_AT:
+    case OP_STR_FOUND_IN:
+    case OP_INT8:
+    case OP_INT16:
+    case OP_INT32:
+    case OP_UINT8:
+    case OP_UINT16:
+    case OP_UINT32:
+    case OP_SZ_EQ:
+    case OP_SZ_NEQ:
+    case OP_SZ_TO_BOOL:
+    case OP_CONTAINS:
+      return 16;
+
+    case OP_MATCHES:
+      return 64;
+
+    case OP_OF:
+      return 4;
+  }
+  return 1;
+}
+
+
+static int _yr_opt_decode(
+    uint8_t* code,
+    size_t size,
+    OPT_INSN* insn,
+    int32_t* index,
+    int32_t* count)
+{
+  size_t offset = 0;
+  uint8_t* address;
+  int32_t i, n = 0;
+
+  // index gives the instruction at each byte offset, -1 for arguments
+  while (offset < size)
+  {
+    index[offset] = n;
+    insn[n].op = code[offset];
+    insn[n].arg = 0;
+    insn[n].target = -1;
+
+    if (_yr_opt_has_arg(code[offset]))
+    {
+      if (size - offset <= sizeof(int64_t))
+        return OPT_UNSUPPORTED;
+
+      memcpy(&insn[n].arg, code + offset + 1, sizeof(int64_t));
+
+      for (i = 1; i <= (int32_t) sizeof(int64_t); i++)
+        index[offset + i] = -1;
+
+      offset += sizeof(int64_t);
+    }
+
+    offset++;
+    n++;
+  }
+
+  if (n == 0 || insn[n - 1].op != OP_HALT)
+    return OPT_UNSUPPORTED;
+
+  for (i = 0; i < n; i++)
+  {
+    if (!_yr_opt_is_jump(insn[i].op))
+      continue;
+
+    address = UINT64_TO_PTR(uint8_t*, insn[i].arg);
+
+    if (address < code || address >= code + size ||
+        index[address - code] < 0)
+      return OPT_UNSUPPORTED;
+
+    insn[i].target = index[address - code];
+  }
+
+  *count = n;
+  return ERROR_SUCCESS;
+}
+
+
+static int _yr_opt_fold(
+    uint8_t op,
+    OPT_VALUE* operands,
+    int count,
+    int64_t* result)
+{
+  int64_t r1 = operands[0].value;
+  int64_t r2 = count > 1 ? operands[1].value : 0;
+  int i;
+
+  if (count < 1 || count > 2)
+    return FALSE;
+
+  for (i = 0; i < count; i++)
+    if (!(operands[i].flags & OPT_CONST) || IS_UNDEFINED(operands[i].value))
+      return FALSE;
+
+  switch(op)
+  {
+    case OP_AND:  *result = r1 & r2; break;
+    case OP_OR:   *result = r1 | r2; break;
+    case OP_XOR:  *result = r1 ^ r2; break;
+    case OP_NOT:  *result = !r1; break;
+    case OP_NEG:  *result = ~r1; break;
+    case OP_LT:   *result = r1 < r2; break;
+    case OP_GT:   *result = r1 > r2; break;
+    case OP_LE:   *result = r1 <= r2; break;
+    case OP_GE:   *result = r1 >= r2; break;
+    case OP_EQ:   *result = r1 == r2; break;
+    case OP_NEQ:  *result = r1 != r2; break;
+    case OP_ADD:  *result = (int64_t) ((uint64_t) r1 + (uint64_t) r2); break;
+    case OP_SUB:  *result = (int64_t) ((uint64_t) r1 - (uint64_t) r2); break;
+    case OP_MUL:  *result = (int64_t) ((uint64_t) r1 * (uint64_t) r2); break;
+
+    case OP_DIV:
+    case OP_MOD:
+      // left to fail at scan time, as before
+      if (r2 == 0 || (r2 == -1 && r1 == INT64_MIN))
+        return FALSE;
+      *result = op == OP_DIV ? r1 / r2 : r1 % r2;
+      break;
+
+    case OP_SHL:
+    case OP_SHR:
+      if (r2 < 0 || r2 > 63)
+        return FALSE;
+      *result = op == OP_SHL ? (int64_t) ((uint64_t) r1 << r2) : r1 >> r2;
+      break;
+
+    default:
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+//
+// Follows the stack through the code, recording the operands of the
+// OP_AND and OP_OR in the order they complete (inner ones first). With
+// fold, constant operations become a single OP_PUSH and the rest of their
+// instructions are marked OPT_DELETED.
+//
+
+static int _yr_opt_scan(
+    OPT_INSN* insn,
+    int32_t count,
+    OPT_VALUE* stack,
+    OPT_BINOP* binops,
+    int32_t* binop_count,
+    int fold)
+{
+  int32_t sp = 0;
+  int32_t nbinops = 0;
+  int32_t i, j;
+  int64_t value;
+  uint8_t op;
+  int pops;
+  int flags;
+
+  for (i = 0; i < count; i++)
+  {
+    op = insn[i].op;
+    pops = 0;
+    flags = 0;
+
+    switch(op)
+    {
+      case OPT_DELETED:
+        continue;
+
+      case OP_HALT:
+        if (sp != 0 || i != count - 1)
+          return OPT_UNSUPPORTED;
+
+        *binop_count = nbinops;
+        return ERROR_SUCCESS;
+
+      case OP_PUSH:
+        value = insn[i].arg;
+        flags = OPT_CONST;
+        if (value == 0 || value == 1)
+          flags |= OPT_BOOL;
+        stack[sp].start = i;
+        stack[sp].flags = flags;
+        stack[sp].value = value;
+        sp++;
+        continue;
+
+      case OP_PUSH_RULE:
+        flags = OPT_BOOL;
+        break;
+
+      case OP_PUSH_M:
+      case OP_FILESIZE:
+      case OP_ENTRYPOINT:
+        break;
+
+      case OP_CLEAR_M:
+      case OP_INCR_M:
+      case OP_JLE:
+        continue;
+
+      case OP_POP:
+      case OP_POP_M:
+      case OP_ADD_M:
+      case OP_MATCH_RULE:
+        if (sp < 1)
+          return OPT_UNSUPPORTED;
+        sp--;
+        continue;
+
+      case OP_JNUNDEF:
+        // Loops over lists leave only the end-of-list marker, an
+        // OP_PUSH of UNDEFINED, once they are done.
+        while (sp > 0 && !((stack[sp - 1].flags & OPT_CONST) &&
+                           IS_UNDEFINED(stack[sp - 1].value)))
+          sp--;
+
+        if (sp < 1)
+          return OPT_UNSUPPORTED;
+        continue;
+
+      case OP_OF:
+        while (sp > 0 && !((stack[sp - 1].flags & OPT_CONST) &&
+                           IS_UNDEFINED(stack[sp - 1].value)))
+          sp--;
+
+        // the marker and the quantifier
+        pops = 2;
+        flags = OPT_BOOL;
+        break;
+
+      case OP_NOT:
+      case OP_SZ_TO_BOOL:
+      case OP_STR_FOUND:
+        pops = 1;
+        flags = OPT_BOOL;
+        break;
+
+      case OP_NEG:
+      case OP_SWAPUNDEF:
+      case OP_STR_COUNT:
+      case OP_INT8:
+      case OP_INT16:
+      case OP_INT32:
+      case OP_UINT8:
+      case OP_UINT16:
+      case OP_UINT32:
+        pops = 1;
+        break;
+
+      case OP_LT:
+      case OP_GT:
+      case OP_LE:
+      case OP_GE:
+      case OP_EQ:
+      case OP_NEQ:
+      case OP_SZ_EQ:
+      case OP_SZ_NEQ:
+      case OP_CONTAINS:
+      case OP_MATCHES:
+      case OP_STR_FOUND_AT:
+        pops = 2;
+        flags = OPT_BOOL;
+        break;
+
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOD:
+      case OP_SHL:
+      case OP_SHR:
+      case OP_XOR:
+      case OP_STR_OFFSET:
+        pops = 2;
+        break;
+
+      case OP_AND:
+      case OP_OR:
+        if (sp < 2)
+          return OPT_UNSUPPORTED;
+
+        binops[nbinops].at = i;
+        binops[nbinops].left = stack[sp - 2].start;
+        binops[nbinops].right = stack[sp - 1].start;
+        binops[nbinops].flags =
+            stack[sp - 2].flags & stack[sp - 1].flags & OPT_BOOL;
+
+        // an AND with a boolean is a boolean, an OR needs both
+        if (op == OP_AND)
+          flags = (stack[sp - 2].flags | stack[sp - 1].flags) & OPT_BOOL;
+        else
+          flags = binops[nbinops].flags;
+
+        nbinops++;
+        pops = 2;
+        break;
+
+      case OP_STR_FOUND_IN:
+        pops = 3;
+        flags = OPT_BOOL;
+        break;
+
+      default:
+        // modules, functions and the jumps this inserts
+        return OPT_UNSUPPORTED;
+    }
+
+    if (sp < pops)
+      return OPT_UNSUPPORTED;
+
+    sp -= pops;
+
+    if (pops == 0)
+    {
+      stack[sp].start = i;
+    }
+    else if (fold && _yr_opt_fold(op, stack + sp, pops, &value))
+    {
+      // the operands are single OP_PUSH, the first one takes the result
+      j = stack[sp].start;
+      insn[j].arg = value;
+
+      for (j++; j <= i; j++)
+        insn[j].op = OPT_DELETED;
+
+      if (op == OP_AND || op == OP_OR)
+        nbinops--;
+
+      flags = OPT_CONST;
+      if (value == 0 || value == 1)
+        flags |= OPT_BOOL;
+
+      stack[sp].value = value;
+    }
+
+    stack[sp].flags = flags;
+    sp++;
+  }
+
+  return OPT_UNSUPPORTED;
+}
+
+
+static int32_t _yr_opt_compact(
+    OPT_INSN* insn,
+    int32_t count,
+    int32_t* map)
+{
+  int32_t i, n = 0;
+
+  // jumps never target deleted instructions
+  for (i = 0; i < count; i++)
+  {
+    map[i] = n;
+    if (insn[i].op != OPT_DELETED)
+      insn[n++] = insn[i];
+  }
+
+  for (i = 0; i < n; i++)
+    if (insn[i].target >= 0)
+      insn[i].target = map[insn[i].target];
+
+  return n;
+}
+
+
+//
+// cost[i] is the estimated cost of the instructions before i, with the
+// ones in loops weighted by OPT_LOOP_WEIGHT for each level.
+//
+
+static void _yr_opt_cost(
+    OPT_INSN* insn,
+    int32_t count,
+    uint64_t* weight,
+    uint64_t* cost)
+{
+  int32_t i, j;
+
+  for (i = 0; i < count; i++)
+    weight[i] = _yr_opt_weight(insn[i].op);
+
+  for (i = 0; i < count; i++)
+    if (insn[i].target >= 0 && insn[i].target <= i)
+      for (j = insn[i].target; j <= i; j++)
+        weight[j] *= OPT_LOOP_WEIGHT;
+
+  cost[0] = 0;
+
+  for (i = 0; i < count; i++)
+    cost[i + 1] = cost[i] + weight[i];
+}
+
+
+static int _yr_opt_region(
+    OPT_BINOP* binop,
+    int32_t i)
+{
+  if (i < binop->left || i >= binop->at)
+    return 0;
+
+  return i < binop->right ? 1 : 2;
+}
+
+
+static void _yr_opt_swap(
+    OPT_INSN* insn,
+    int32_t count,
+    OPT_INSN* tmp,
+    OPT_BINOP* binop)
+{
+  int32_t left_len = binop->right - binop->left;
+  int32_t right_len = binop->at - binop->right;
+  int32_t i, target;
+
+  // no jump enters or leaves an operand, loops stay in one piece
+  for (i = 0; i < count; i++)
+    if (insn[i].target >= 0 &&
+        _yr_opt_region(binop, i) != _yr_opt_region(binop, insn[i].target))
+      return;
+
+  memcpy(tmp, insn + binop->left, (left_len + right_len) * sizeof(OPT_INSN));
+
+  memcpy(insn + binop->left,
+         tmp + left_len,
+         right_len * sizeof(OPT_INSN));
+
+  memcpy(insn + binop->left + right_len,
+         tmp,
+         left_len * sizeof(OPT_INSN));
+
+  for (i = 0; i < count; i++)
+  {
+    target = insn[i].target;
+
+    if (target < binop->left || target >= binop->at)
+      continue;
+
+    if (target < binop->right)
+      insn[i].target = target + right_len;
+    else
+      insn[i].target = target - left_len;
+  }
+}
+
+
+//
+// Rewrites the code written so far to code_arena, which is replaced by a
+// new arena with the optimized code. Only done for code in a single page,
+// as the jumps between pages can't be followed.
+//
+
+int yr_optimize_code(
+    YR_ARENA** code_arena)
+{
+  YR_ARENA_PAGE* page = (*code_arena)->page_list_head;
+  YR_ARENA* arena;
+
+  OPT_INSN* insn = NULL;
+  OPT_INSN* tmp = NULL;
+  OPT_VALUE* stack = NULL;
+  OPT_BINOP* binops = NULL;
+
+  int32_t* map = NULL;
+  uint64_t* weight = NULL;
+  uint64_t* cost = NULL;
+
+  int32_t count, folded, nbinops, n, i, j, t;
+  size_t size;
+
+  uint8_t* code = NULL;
+  uint8_t* base;
+  uint64_t address;
+
+  int result;
+
+  if (page == NULL || page != (*code_arena)->current_page || page->used == 0)
+    return ERROR_SUCCESS;
+
+  size = page->used;
+
+  // at most one instruction per byte, plus one jump per AND or OR
+  insn = (OPT_INSN*) yr_malloc(size * sizeof(OPT_INSN));
+  tmp = (OPT_INSN*) yr_malloc(2 * size * sizeof(OPT_INSN));
+  stack = (OPT_VALUE*) yr_malloc(size * sizeof(OPT_VALUE));
+  binops = (OPT_BINOP*) yr_malloc(size * sizeof(OPT_BINOP));
+  map = (int32_t*) yr_malloc(2 * size * sizeof(int32_t));
+  weight = (uint64_t*) yr_malloc(size * sizeof(uint64_t));
+  cost = (uint64_t*) yr_malloc((size + 1) * sizeof(uint64_t));
+
+  if (insn == NULL || tmp == NULL || stack == NULL || binops == NULL ||
+      map == NULL || weight == NULL || cost == NULL)
+  {
+    result = ERROR_INSUFICIENT_MEMORY;
+    goto done;
+  }
+
+  result = _yr_opt_decode(page->address, size, insn, map, &count);
+
+  if (result == ERROR_SUCCESS)
+    result = _yr_opt_scan(insn, count, stack, binops, &nbinops, TRUE);
+
+  if (result != ERROR_SUCCESS)
+    goto done;
+
+  folded = count;
+  count = _yr_opt_compact(insn, count, map);
+  folded -= count;
+
+  result = _yr_opt_scan(insn, count, stack, binops, &nbinops, FALSE);
+
+  if (result != ERROR_SUCCESS)
+    goto done;
+
+  // Inner operations come first. Swapping the operands of one only moves
+  // instructions within an operand of the ones enclosing it, so their
+  // positions and costs stay valid.
+  _yr_opt_cost(insn, count, weight, cost);
+
+  for (i = 0; i < nbinops; i++)
+  {
+    if (cost[binops[i].at] - cost[binops[i].right] <
+        cost[binops[i].right] - cost[binops[i].left])
+      _yr_opt_swap(insn, count, tmp, &binops[i]);
+  }
+
+  result = _yr_opt_scan(insn, count, stack, binops, &nbinops, FALSE);
+
+  if (result != ERROR_SUCCESS)
+    goto done;
+
+  if (nbinops == 0 && folded == 0)
+    goto done;
+
+  // Insert the jumps in front of the second operands, to the instruction
+  // after the AND or OR. An OR of integers needs both operands.
+  for (i = 0; i < count; i++)
+    map[i] = -1;
+
+  for (i = 0; i < nbinops; i++)
+    if (insn[binops[i].at].op == OP_AND || (binops[i].flags & OPT_BOOL))
+      map[binops[i].right] = i;
+
+  for (i = 0, n = 0; i < count; i++)
+  {
+    if (map[i] >= 0)
+    {
+      j = map[i];
+      tmp[n].op = insn[binops[j].at].op == OP_AND ? OP_JFALSE : OP_JTRUE;
+      tmp[n].arg = 0;
+      tmp[n].target = binops[j].at + 1;
+      n++;
+    }
+
+    map[i] = n;
+    tmp[n++] = insn[i];
+  }
+
+  // The inserted jumps go to the jump in front of their target, if any,
+  // so that they can be threaded below. Loops go to the instruction.
+  for (i = 0; i < n; i++)
+  {
+    if (tmp[i].target < 0)
+      continue;
+
+    t = map[tmp[i].target];
+
+    if ((tmp[i].op == OP_JFALSE || tmp[i].op == OP_JTRUE) && t > 0 &&
+        (tmp[t - 1].op == OP_JFALSE || tmp[t - 1].op == OP_JTRUE))
+      t--;
+
+    tmp[i].target = t;
+  }
+
+  // A false AND falls to the next jump, which is taken too (or not, for
+  // an OP_JTRUE), go there directly. Same for a true OR.
+  for (i = 0; i < n; i++)
+  {
+    if (tmp[i].op != OP_JFALSE && tmp[i].op != OP_JTRUE)
+      continue;
+
+    for (j = 0; j < n; j++)
+    {
+      t = tmp[i].target;
+
+      if (tmp[t].op == tmp[i].op)
+        tmp[i].target = tmp[t].target;
+      else if (tmp[t].op == OP_JFALSE || tmp[t].op == OP_JTRUE)
+        tmp[i].target = t + 1;
+      else
+        break;
+    }
+  }
+
+  // byte offsets of the instructions
+  for (i = 0, size = 0; i < n; i++)
+  {
+    map[i] = size;
+    size += _yr_opt_has_arg(tmp[i].op) ? 1 + sizeof(int64_t) : 1;
+  }
+
+  code = (uint8_t*) yr_malloc(size);
+
+  if (code == NULL)
+  {
+    result = ERROR_INSUFICIENT_MEMORY;
+    goto done;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    code[map[i]] = tmp[i].op;
+
+    if (_yr_opt_has_arg(tmp[i].op))
+      memcpy(code + map[i] + 1, &tmp[i].arg, sizeof(int64_t));
+  }
+
+  result = yr_arena_create(size > 65536 ? size : 65536, 0, &arena);
+
+  if (result == ERROR_SUCCESS)
+    result = yr_arena_write_data(arena, code, size, (void**) &base);
+
+  if (result != ERROR_SUCCESS)
+    goto done;
+
+  for (i = 0; i < n; i++)
+  {
+    if (tmp[i].target < 0)
+      continue;
+
+    address = PTR_TO_UINT64(base + map[tmp[i].target]);
+    memcpy(base + map[i] + 1, &address, sizeof(int64_t));
+  }
+
+  yr_arena_destroy(*code_arena);
+  *code_arena = arena;
+
+done:
+  yr_free(insn);
+  yr_free(tmp);
+  yr_free(stack);
+  yr_free(binops);
+  yr_free(map);
+  yr_free(weight);
+  yr_free(cost);
+  yr_free(code);
+
+  // code this can't follow is run as it is
+  return result == OPT_UNSUPPORTED ? ERROR_SUCCESS : result;
+}
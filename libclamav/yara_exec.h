@@ -85,6 +85,10 @@ limitations under the License.
 #define OP_MATCHES        54
 #define OP_IMPORT         55
 
+/* only emitted by yr_optimize_code() */
+#define OP_JFALSE         56
+#define OP_JTRUE          57
+
 
 int yr_execute_code(
 #if REAL_YARA
@@ -97,4 +101,10 @@ int yr_execute_code(
     int timeout,
     time_t start_time);
 
+
+struct _YR_ARENA;
+
+int yr_optimize_code(
+    struct _YR_ARENA** code_arena);
+
 #endif
@@ -811,6 +811,8 @@ int yr_parser_reduce_rule_declaration(
   //TBD: seems like we will need the following yr_arena_coalesce, but it is not working.
   //Yara condition code will work OK as long as it is less than 64K.
   //FAIL_ON_COMPILER_ERROR(yr_arena_coalesce(compiler->code_arena));
+  if (compiler->optimize_code)
+    FAIL_ON_COMPILER_ERROR(yr_optimize_code(&compiler->code_arena));
   rule->code_start = yr_arena_base_address(compiler->code_arena);
   yr_arena_append(compiler->the_arena, compiler->code_arena);
   FAIL_ON_COMPILER_ERROR(yr_arena_create(65536, 0, &compiler->code_arena));
@@ -222,7 +222,7 @@ static int yc_poly_emulator(cli_ctx *ctx, char *base, unsigned int filesize, cha
 /* ========================================================================== */
 /* Main routine which calls all others */
 
-int yc_decrypt(cli_ctx *ctx, char *fbuf, unsigned int filesize, struct cli_exe_section *sections, unsigned int sectcount, uint32_t peoffset, int desc, uint32_t ecx,int16_t offset) {
+int yc_decrypt(cli_ctx *ctx, char *fbuf, unsigned int filesize, struct cli_exe_section *sections, unsigned int sectcount, uint32_t peoffset, struct cli_extract *x, uint32_t ecx,int16_t offset) {
   uint32_t ycsect = sections[sectcount].raw+offset;
   unsigned int i;
   struct pe_image_file_hdr *pe = (struct pe_image_file_hdr*) (fbuf + peoffset);
@@ -304,7 +304,7 @@ int yc_decrypt(cli_ctx *ctx, char *fbuf, unsigned int filesize, struct cli_exe_s
   /* Fix SizeOfImage */
   cli_writeint32((char *)pe + sizeof(struct pe_image_file_hdr) + 0x38, cli_readint32((char *)pe + sizeof(struct pe_image_file_hdr) + 0x38) - sections[sectcount].vsz);
 
-  if (cli_writen(desc, fbuf, filesize)==-1) {
+  if (cli_extract_write(x, fbuf, filesize)!=CL_SUCCESS) {
     cli_dbgmsg("yC: Cannot write unpacked file\n");
     return CL_EUNPACK;
   }
@@ -25,7 +25,8 @@
 #include "pe.h"
 #include "execs.h"
 #include "cltypes.h"
+#include "scanners.h"
 
-int yc_decrypt(cli_ctx *, char *, unsigned int, struct cli_exe_section *, unsigned int, uint32_t, int,uint32_t,int16_t);
+int yc_decrypt(cli_ctx *, char *, unsigned int, struct cli_exe_section *, unsigned int, uint32_t, struct cli_extract *,uint32_t,int16_t);
 
 #endif
@@ -101,7 +101,7 @@ unsigned int rar_getbits(unpack_data_t *unpack_data)
 	return(bit_field & 0xffff);
 }
 
-int rar_unp_read_buf(int fd, unpack_data_t *unpack_data)
+int rar_unp_read_buf(unpack_data_t *unpack_data)
 {
 	int data_size, retval;
 	unsigned int read_size;
@@ -128,7 +128,7 @@ int rar_unp_read_buf(int fd, unpack_data_t *unpack_data)
 	} else {
 		read_size = (MAX_BUF_SIZE-data_size)&~0xf;
 	}
-	retval = read(fd, unpack_data->in_buf+data_size, read_size);	
+	retval = unpack_data->read_cb(unpack_data->read_handle, unpack_data->in_buf+data_size, read_size);
 	if (retval > 0) {
 		unpack_data->read_top += retval;
 		unpack_data->pack_size -= retval;
@@ -142,10 +142,10 @@ int rar_unp_read_buf(int fd, unpack_data_t *unpack_data)
 	return (retval!=-1);
 }
 
-unsigned int rar_get_char(int fd, unpack_data_t *unpack_data)
+unsigned int rar_get_char(unpack_data_t *unpack_data)
 {
 	if (unpack_data->in_addr > MAX_BUF_SIZE-30) {
-		if (!rar_unp_read_buf(fd, unpack_data)) {
+		if (!rar_unp_read_buf(unpack_data)) {
 			rar_dbgmsg("rar_get_char: rar_unp_read_buf FAILED\n"); /* FIXME: cli_errmsg */
 			return -1;
 		}
@@ -168,7 +168,7 @@ static void unp_write_data(unpack_data_t *unpack_data, uint8_t *data, int size)
 	    if(unpack_data->written_size + size > unpack_data->max_size)
 		size = unpack_data->max_size - unpack_data->written_size;
 	}
-	if((ret = write(unpack_data->ofd, data, size)) > 0)
+	if((ret = unpack_data->write_cb(unpack_data->write_handle, data, size)) > 0)
 	    unpack_data->written_size += ret;
 }
 
@@ -390,7 +390,7 @@ int rar_decode_number(unpack_data_t *unpack_data, struct Decode *decode)
 	return(decode->DecodeNum[n]);
 }
 
-static int read_tables(int fd, unpack_data_t *unpack_data)
+static int read_tables(unpack_data_t *unpack_data)
 {
 	uint8_t bit_length[BC];
 	unsigned char table[HUFF_TABLE_SIZE];
@@ -398,10 +398,10 @@ static int read_tables(int fd, unpack_data_t *unpack_data)
 	int i, length, zero_count, number, n;
 	const int table_size=HUFF_TABLE_SIZE;
 	
-	rar_dbgmsg("in read_tables Offset=%ld in_addr=%d read_top=%d\n", lseek(fd, 0, SEEK_CUR),
+	rar_dbgmsg("in read_tables in_addr=%d read_top=%d\n",
 				unpack_data->in_addr, unpack_data->read_top);
 	if (unpack_data->in_addr > unpack_data->read_top-25) {
-		if (!rar_unp_read_buf(fd, unpack_data)) {
+		if (!rar_unp_read_buf(unpack_data)) {
 			rar_dbgmsg("ERROR: read_tables rar_unp_read_buf failed\n");
 			return FALSE;
 		}
@@ -412,7 +412,7 @@ static int read_tables(int fd, unpack_data_t *unpack_data)
 	if (bit_field & 0x8000) {
 		unpack_data->unp_block_type = BLOCK_PPM;
 		rar_dbgmsg("Calling ppm_decode_init\n");
-		if(!ppm_decode_init(&unpack_data->ppm_data, fd, unpack_data, &unpack_data->ppm_esc_char)) {
+		if(!ppm_decode_init(&unpack_data->ppm_data, unpack_data, &unpack_data->ppm_esc_char)) {
 		    rar_dbgmsg("unrar: read_tables: ppm_decode_init failed\n");
 		    return FALSE;
 		}
@@ -451,7 +451,7 @@ static int read_tables(int fd, unpack_data_t *unpack_data)
 	memset(table, 0, sizeof(table));
 	for (i=0;i<table_size;) {
 		if (unpack_data->in_addr > unpack_data->read_top-5) {
-			if (!rar_unp_read_buf(fd, unpack_data)) {
+			if (!rar_unp_read_buf(unpack_data)) {
 				rar_dbgmsg("ERROR: read_tables rar_unp_read_buf failed 2\n");
 				return FALSE;
 			}
@@ -503,7 +503,7 @@ static int read_tables(int fd, unpack_data_t *unpack_data)
   	return TRUE;
 }
 
-static int read_end_of_block(int fd, unpack_data_t *unpack_data)
+static int read_end_of_block(unpack_data_t *unpack_data)
 {
 	unsigned int bit_field;
 	int new_table, new_file=FALSE;
@@ -520,7 +520,7 @@ static int read_end_of_block(int fd, unpack_data_t *unpack_data)
 	unpack_data->tables_read = !new_table;
 	rar_dbgmsg("NewFile=%d NewTable=%d TablesRead=%d\n", new_file,
 			new_table, unpack_data->tables_read);
-	return !(new_file || (new_table && !read_tables(fd, unpack_data)));
+	return !(new_file || (new_table && !read_tables(unpack_data)));
 }
 
 void rar_init_filters(unpack_data_t *unpack_data)
@@ -737,7 +737,7 @@ static int add_vm_code(unpack_data_t *unpack_data, unsigned int first_byte,
 	return TRUE;
 }
 
-static int read_vm_code(unpack_data_t *unpack_data, int fd)
+static int read_vm_code(unpack_data_t *unpack_data)
 {
 	unsigned int first_byte;
 	int length, i, retval;
@@ -760,7 +760,7 @@ static int read_vm_code(unpack_data_t *unpack_data, int fd)
 	}
 	for (i=0 ; i < length ; i++) {
 		if (unpack_data->in_addr >= unpack_data->read_top-1 &&
-				!rar_unp_read_buf(fd, unpack_data) && i<length-1) {
+				!rar_unp_read_buf(unpack_data) && i<length-1) {
 			free(vmcode);
 			return FALSE;
 		}
@@ -772,29 +772,29 @@ static int read_vm_code(unpack_data_t *unpack_data, int fd)
 	return retval;
 }
 
-static int read_vm_code_PPM(unpack_data_t *unpack_data, int fd)
+static int read_vm_code_PPM(unpack_data_t *unpack_data)
 {
 	unsigned int first_byte;
 	int length, i, ch, retval, b1, b2;
 	unsigned char *vmcode;
 	
-	first_byte = ppm_decode_char(&unpack_data->ppm_data, fd, unpack_data);
+	first_byte = ppm_decode_char(&unpack_data->ppm_data, unpack_data);
 	if ((int)first_byte == -1) {
 		return FALSE;
 	}
 	length = (first_byte & 7) + 1;
 	if (length == 7) {
-		b1 = ppm_decode_char(&unpack_data->ppm_data, fd, unpack_data);
+		b1 = ppm_decode_char(&unpack_data->ppm_data, unpack_data);
 		if (b1 == -1) {
 			return FALSE;
 		}
 		length = b1 + 7;
 	} else if (length == 8) {
-		b1 = ppm_decode_char(&unpack_data->ppm_data, fd, unpack_data);
+		b1 = ppm_decode_char(&unpack_data->ppm_data, unpack_data);
 		if (b1 == -1) {
 			return FALSE;
 		}
-		b2 = ppm_decode_char(&unpack_data->ppm_data, fd, unpack_data);
+		b2 = ppm_decode_char(&unpack_data->ppm_data, unpack_data);
 		if (b2 == -1) {
 			return FALSE;
 		}
@@ -806,7 +806,7 @@ static int read_vm_code_PPM(unpack_data_t *unpack_data, int fd)
 		return FALSE;
 	}
 	for (i=0 ; i < length ; i++) {
-		ch = ppm_decode_char(&unpack_data->ppm_data, fd, unpack_data);
+		ch = ppm_decode_char(&unpack_data->ppm_data, unpack_data);
 		if (ch == -1) {
 			free(vmcode);
 			return FALSE;
@@ -851,7 +851,7 @@ void rar_unpack_init_data(int solid, unpack_data_t *unpack_data)
 
 }
 
-static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
+static int rar_unpack29(int solid, unpack_data_t *unpack_data)
 {
 	unsigned char ldecode[]={0,1,2,3,4,5,6,7,8,10,12,14,16,20,24,28,
 			32,40,48,56,64,80,96,112,128,160,192,224};
@@ -870,17 +870,16 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 	int retval=TRUE, i, number, length, dist_number, low_dist, ch, next_ch;
 	int length_number, failed;
 
-	rar_dbgmsg("Offset: %ld\n", lseek(fd, 0, SEEK_CUR));
 	if (!solid) {
 		rar_dbgmsg("Not solid\n");
 	}
 	rar_unpack_init_data(solid, unpack_data);
-	if (!rar_unp_read_buf(fd, unpack_data)) {
+	if (!rar_unp_read_buf(unpack_data)) {
 		return FALSE;
 	}
 	if (!solid || !unpack_data->tables_read) {
 		rar_dbgmsg("Read tables\n");
-		if (!read_tables(fd, unpack_data)) {
+		if (!read_tables(unpack_data)) {
 			return FALSE;
 		}
 	}
@@ -890,7 +889,7 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 		unpack_data->unp_ptr &= MAXWINMASK;
 		rar_dbgmsg("UnpPtr = %d\n", unpack_data->unp_ptr);
 		if (unpack_data->in_addr > unpack_data->read_border) {
-			if (!rar_unp_read_buf(fd, unpack_data)) {
+			if (!rar_unp_read_buf(unpack_data)) {
 				retval = FALSE;
 				break;
 			}
@@ -900,7 +899,7 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 			unp_write_buf(unpack_data);
 		}
 		if (unpack_data->unp_block_type == BLOCK_PPM) {
-			ch = ppm_decode_char(&unpack_data->ppm_data, fd, unpack_data);
+			ch = ppm_decode_char(&unpack_data->ppm_data, unpack_data);
 			rar_dbgmsg("PPM char: %d\n", ch);
 			if (ch == -1) {
 				ppm_cleanup(&unpack_data->ppm_data);
@@ -910,14 +909,14 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 			}
 			if (ch == unpack_data->ppm_esc_char) {
 				next_ch = ppm_decode_char(&unpack_data->ppm_data,
-							fd, unpack_data);
+							unpack_data);
 				rar_dbgmsg("PPM next char: %d\n", next_ch);
 				if (next_ch == -1) {
 					retval = FALSE;
 					break;
 				}
 				if (next_ch == 0) {
-					if (!read_tables(fd, unpack_data)) {
+					if (!read_tables(unpack_data)) {
 						retval = FALSE;
 						break;
 					}
@@ -927,7 +926,7 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 					break;
 				}
 				if (next_ch == 3) {
-					if (!read_vm_code_PPM(unpack_data, fd)) {
+					if (!read_vm_code_PPM(unpack_data)) {
 						retval = FALSE;
 						break;
 					}
@@ -939,7 +938,7 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 					failed = FALSE;
 					for (i=0 ; i < 4 && !failed; i++) {
 						ch = ppm_decode_char(&unpack_data->ppm_data,
-								fd, unpack_data);
+								unpack_data);
 						if (ch == -1) {
 							failed = TRUE;
 						} else {
@@ -960,7 +959,7 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 				}
 				if (next_ch == 5) {
 					int length = ppm_decode_char(&unpack_data->ppm_data,
-								fd, unpack_data);
+								unpack_data);
 					rar_dbgmsg("PPM length: %d\n", length);
 					if (length == -1) {
 						retval = FALSE;
@@ -1029,13 +1028,13 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 				continue;
 			}
 			if (number == 256) {
-				if (!read_end_of_block(fd, unpack_data)) {
+				if (!read_end_of_block(unpack_data)) {
 					break;
 				}
 				continue;
 			}
 			if (number == 257) {
-				if (!read_vm_code(unpack_data, fd)) {
+				if (!read_vm_code(unpack_data)) {
 					retval = FALSE;
 					break;
 				}
@@ -1087,28 +1086,28 @@ static int rar_unpack29(int fd, int solid, unpack_data_t *unpack_data)
 	return retval;
 }
 
-int rar_unpack(int fd, int method, int solid, unpack_data_t *unpack_data)
+int rar_unpack(int method, int solid, unpack_data_t *unpack_data)
 {
 	int retval = FALSE;
 	switch(method) {
 	case 15:
-		retval = rar_unpack15(fd, solid, unpack_data);
+		retval = rar_unpack15(solid, unpack_data);
 		break;
 	case 20:
 	case 26:
-		retval = rar_unpack20(fd, solid, unpack_data);
+		retval = rar_unpack20(solid, unpack_data);
 		break;
 	case 29:
-		retval = rar_unpack29(fd, solid, unpack_data);
+		retval = rar_unpack29(solid, unpack_data);
 		break;
 	default:
-		retval = rar_unpack29(fd, solid, unpack_data);
+		retval = rar_unpack29(solid, unpack_data);
 		if(retval == FALSE) {
 		    rarvm_free(&unpack_data->rarvm_data);
-		    retval = rar_unpack20(fd, solid, unpack_data);
+		    retval = rar_unpack20(solid, unpack_data);
 		    if(retval == FALSE) {
 			rarvm_free(&unpack_data->rarvm_data);
-			retval = rar_unpack15(fd, solid, unpack_data);
+			retval = rar_unpack15(solid, unpack_data);
 		    }
 		}
 		break;
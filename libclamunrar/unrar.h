@@ -178,9 +178,17 @@ struct AudioVariables
 };
 /* *************** */
 
+/* the packed data is read and the unpacked data written through these,
+ * they return the number of bytes transferred or -1 */
+typedef int (*rar_read_cb_t)(void *handle, void *buf, unsigned int size);
+typedef int (*rar_write_cb_t)(void *handle, const void *buf, unsigned int size);
+
 typedef struct unpack_data_tag
 {
-	int ofd;
+	rar_read_cb_t read_cb;
+	void *read_handle;
+	rar_write_cb_t write_cb;
+	void *write_handle;
 	
 	unsigned char in_buf[MAX_BUF_SIZE];
 	uint8_t window[MAXWINSIZE];
@@ -254,16 +262,16 @@ enum BLOCK_TYPES
 	BLOCK_PPM
 };
 
-unsigned int rar_get_char(int fd, unpack_data_t *unpack_data);
+unsigned int rar_get_char(unpack_data_t *unpack_data);
 void rar_addbits(unpack_data_t *unpack_data, int bits);
 unsigned int rar_getbits(unpack_data_t *unpack_data);
-int rar_unp_read_buf(int fd, unpack_data_t *unpack_data);
+int rar_unp_read_buf(unpack_data_t *unpack_data);
 void rar_unpack_init_data(int solid, unpack_data_t *unpack_data);
 void rar_make_decode_tables(unsigned char *len_tab, struct Decode *decode, int size);
 void rar_unp_write_buf_old(unpack_data_t *unpack_data);
 int rar_decode_number(unpack_data_t *unpack_data, struct Decode *decode);
 void rar_init_filters(unpack_data_t *unpack_data);
-int rar_unpack(int fd, int method, int solid, unpack_data_t *unpack_data);
+int rar_unpack(int method, int solid, unpack_data_t *unpack_data);
 
 #ifdef HAVE_PRAGMA_PACK
 #pragma pack()
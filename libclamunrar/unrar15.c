@@ -430,11 +430,11 @@ static void long_lz(unpack_data_t *unpack_data)
 	copy_string15(unpack_data, distance, length);
 }
 
-int rar_unpack15(int fd, int solid, unpack_data_t *unpack_data)
+int rar_unpack15(int solid, unpack_data_t *unpack_data)
 {
 	rar_unpack_init_data(solid, unpack_data);
 	unpack_init_data15(solid, unpack_data);
-	if (!rar_unp_read_buf(fd, unpack_data)) {
+	if (!rar_unp_read_buf(unpack_data)) {
 		return FALSE;
 	}
 	if (!solid) {
@@ -454,7 +454,7 @@ int rar_unpack15(int fd, int solid, unpack_data_t *unpack_data)
 		unpack_data->unp_ptr &= MAXWINMASK;
 		
 		if (unpack_data->in_addr > unpack_data->read_top-30 &&
-				!rar_unp_read_buf(fd, unpack_data)) {
+				!rar_unp_read_buf(unpack_data)) {
 			break;
 		}
 		
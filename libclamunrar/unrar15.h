@@ -18,6 +18,6 @@
 #ifndef UNRAR15_H
 #define UNRAR15_H 1
 
-int rar_unpack15(int fd, int solid, unpack_data_t *unpack_data);
+int rar_unpack15(int solid, unpack_data_t *unpack_data);
 
 #endif
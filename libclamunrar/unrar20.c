@@ -63,7 +63,7 @@ static void copy_string20(unpack_data_t *unpack_data, unsigned int length, unsig
 	}
 }
 			
-static int read_tables20(int fd, unpack_data_t *unpack_data)
+static int read_tables20(unpack_data_t *unpack_data)
 {
 	unsigned char bit_length[BC20];
 	unsigned char table[MC20 * 4];
@@ -73,7 +73,7 @@ static int read_tables20(int fd, unpack_data_t *unpack_data)
 	rar_dbgmsg("in read_tables20\n");
 	
 	if (unpack_data->in_addr > unpack_data->read_top-25) {
-		if (!rar_unp_read_buf(fd, unpack_data)) {
+		if (!rar_unp_read_buf(unpack_data)) {
 			return FALSE;
 		}
 	}
@@ -105,7 +105,7 @@ static int read_tables20(int fd, unpack_data_t *unpack_data)
 	memset(table, 0, sizeof(table));
 	for (i=0; i<table_size;) {
 		if (unpack_data->in_addr > unpack_data->read_top-5) {
-			if (!rar_unp_read_buf(fd, unpack_data)) {
+			if (!rar_unp_read_buf(unpack_data)) {
 				return FALSE;
 			}
 		}
@@ -150,16 +150,16 @@ static int read_tables20(int fd, unpack_data_t *unpack_data)
 	return TRUE;
 }
 
-static void read_last_tables(int fd, unpack_data_t *unpack_data)
+static void read_last_tables(unpack_data_t *unpack_data)
 {
 	if (unpack_data->read_top >= unpack_data->in_addr+5) {
 		if (unpack_data->unp_audio_block) {
 			if (rar_decode_number(unpack_data,
 				(struct Decode *)&unpack_data->MD[unpack_data->unp_cur_channel]) == 256) {
-				read_tables20(fd, unpack_data);
+				read_tables20(unpack_data);
 			}
 		} else if (rar_decode_number(unpack_data, (struct Decode *)&unpack_data->LD) == 269) {
-			read_tables20(fd, unpack_data);
+			read_tables20(unpack_data);
 		}
 	}
 }
@@ -267,7 +267,7 @@ static unsigned char decode_audio(unpack_data_t *unpack_data, int delta)
 	return ((unsigned char) ch);
 }
 
-int rar_unpack20(int fd, int solid, unpack_data_t *unpack_data)
+int rar_unpack20(int solid, unpack_data_t *unpack_data)
 {
 	unsigned char ldecode[]={0,1,2,3,4,5,6,7,8,10,12,14,16,20,24,28,
 			32,40,48,56,64,80,96,112,128,160,192,224};
@@ -286,12 +286,12 @@ int rar_unpack20(int fd, int solid, unpack_data_t *unpack_data)
 	rar_dbgmsg("in rar_unpack20\n");
 
 	rar_unpack_init_data(solid, unpack_data);
-	if (!rar_unp_read_buf(fd, unpack_data)) {
+	if (!rar_unp_read_buf(unpack_data)) {
 		rar_dbgmsg("rar_unp_read_buf 1 failed\n");
 		return FALSE;
 	}
 	if (!solid) {
-		if (!read_tables20(fd, unpack_data)) {
+		if (!read_tables20(unpack_data)) {
 			rar_dbgmsg("read_tables20 failed\n");
 			return FALSE;
 		}
@@ -303,7 +303,7 @@ int rar_unpack20(int fd, int solid, unpack_data_t *unpack_data)
 		unpack_data->unp_ptr &= MAXWINMASK;
 		
 		if (unpack_data->in_addr > unpack_data->read_top-30) {
-			if (!rar_unp_read_buf(fd, unpack_data)) {
+			if (!rar_unp_read_buf(unpack_data)) {
 				rar_dbgmsg("rar_unp_read_buf 2 failed\n");
 				break;
 			}
@@ -316,7 +316,7 @@ int rar_unpack20(int fd, int solid, unpack_data_t *unpack_data)
 			audio_number = rar_decode_number(unpack_data,
 				(struct Decode *)&unpack_data->MD[unpack_data->unp_cur_channel]);
 			if (audio_number == 256) {
-				if (!read_tables20(fd, unpack_data)) {
+				if (!read_tables20(unpack_data)) {
 					retval = FALSE;
 					break;
 				}
@@ -362,7 +362,7 @@ int rar_unpack20(int fd, int solid, unpack_data_t *unpack_data)
 			continue;
 		}
 		if (number == 269) {
-			if (!read_tables20(fd, unpack_data)) {
+			if (!read_tables20(unpack_data)) {
 				retval = FALSE;
 				break;
 			}
@@ -403,7 +403,7 @@ int rar_unpack20(int fd, int solid, unpack_data_t *unpack_data)
 		}
 	}
 	if (retval) {
-		read_last_tables(fd, unpack_data);
+		read_last_tables(unpack_data);
 		rar_unp_write_buf_old(unpack_data);
 	}
 	return retval;
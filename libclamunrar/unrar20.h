@@ -26,6 +26,6 @@
 #define NC20 298  /* alphabet = {0, 1, 2, ..., NC - 1} */
 
 void unpack_init_data20(int solid, unpack_data_t *unpack_data);
-int rar_unpack20(int fd, int solid, unpack_data_t *unpack_data);
+int rar_unpack20(int solid, unpack_data_t *unpack_data);
 
 #endif
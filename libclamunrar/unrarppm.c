@@ -324,7 +324,7 @@ static void  sub_allocator_free_units(sub_allocator_t *sub_alloc, void *ptr, int
 /************** End of Allocator code block *********************/
 
 /************** Start of Range Coder code block *********************/
-static void range_coder_init_decoder(range_coder_t *coder, int fd,
+static void range_coder_init_decoder(range_coder_t *coder,
 			unpack_data_t *unpack_data)
 {
 	int i;
@@ -332,7 +332,7 @@ static void range_coder_init_decoder(range_coder_t *coder, int fd,
 	coder->range = (unsigned int) -1;
 	
 	for (i=0; i < 4 ; i++) {
-		coder->code = (coder->code << 8) | rar_get_char(fd, unpack_data);
+		coder->code = (coder->code << 8) | rar_get_char(unpack_data);
 	}
 }
 
@@ -346,10 +346,10 @@ static unsigned int  coder_get_current_shift_count(range_coder_t *coder, unsigne
 	return (coder->code - coder->low) / (coder->range >>= shift);
 }
 
-#define ARI_DEC_NORMALISE(fd, unpack_data, code, low, range)					\
+#define ARI_DEC_NORMALISE(unpack_data, code, low, range)					\
 {												\
 	while ((low^(low+range)) < TOP || (range < BOT && ((range=-low&(BOT-1)),1))) {		\
-		code = (code << 8) | rar_get_char(fd, unpack_data);				\
+		code = (code << 8) | rar_get_char(unpack_data);				\
 		range <<= 8;									\
 		low <<= 8;									\
 	}											\
@@ -938,16 +938,16 @@ void ppm_cleanup(ppm_data_t *ppm_data)
 	start_model_rare(ppm_data, 2);
 }
 
-int ppm_decode_init(ppm_data_t *ppm_data, int fd, unpack_data_t *unpack_data, int *EscChar)
+int ppm_decode_init(ppm_data_t *ppm_data, unpack_data_t *unpack_data, int *EscChar)
 {
 	int max_order, Reset, MaxMB;
 	
-	max_order = rar_get_char(fd, unpack_data);
+	max_order = rar_get_char(unpack_data);
 	rar_dbgmsg("ppm_decode_init max_order=%d\n", max_order);
 	Reset = (max_order & 0x20) ? 1 : 0;
 	rar_dbgmsg("ppm_decode_init Reset=%d\n", Reset);
 	if (Reset) {
-		MaxMB = rar_get_char(fd, unpack_data);
+		MaxMB = rar_get_char(unpack_data);
 		rar_dbgmsg("ppm_decode_init MaxMB=%d\n", MaxMB);
 	} else {
 		if (sub_allocator_get_allocated_memory(&ppm_data->sub_alloc) == 0) {
@@ -955,10 +955,10 @@ int ppm_decode_init(ppm_data_t *ppm_data, int fd, unpack_data_t *unpack_data, in
 		}
 	}
 	if (max_order & 0x40) {
-		*EscChar = rar_get_char(fd, unpack_data);
+		*EscChar = rar_get_char(unpack_data);
 		rar_dbgmsg("ppm_decode_init EscChar=%d\n", *EscChar);
 	}
-	range_coder_init_decoder(&ppm_data->coder, fd, unpack_data);
+	range_coder_init_decoder(&ppm_data->coder, unpack_data);
 	if (Reset) {
 		max_order = (max_order & 0x1f) + 1;
 		if (max_order > 16) {
@@ -981,7 +981,7 @@ int ppm_decode_init(ppm_data_t *ppm_data, int fd, unpack_data_t *unpack_data, in
 	return (ppm_data->min_context != NULL);
 }
 
-int ppm_decode_char(ppm_data_t *ppm_data, int fd, unpack_data_t *unpack_data)
+int ppm_decode_char(ppm_data_t *ppm_data, unpack_data_t *unpack_data)
 {
 	int symbol;
 
@@ -1003,7 +1003,7 @@ int ppm_decode_char(ppm_data_t *ppm_data, int fd, unpack_data_t *unpack_data)
 	coder_decode(&ppm_data->coder);
 	
 	while (!ppm_data->found_state) {
-		ARI_DEC_NORMALISE(fd, unpack_data, ppm_data->coder.code, 
+		ARI_DEC_NORMALISE(unpack_data, ppm_data->coder.code, 
 				ppm_data->coder.low, ppm_data->coder.range);
 		do {
 			ppm_data->order_fall++;
@@ -1033,7 +1033,7 @@ int ppm_decode_char(ppm_data_t *ppm_data, int fd, unpack_data_t *unpack_data)
 			clear_mask(ppm_data);
 		}
 	}
-	ARI_DEC_NORMALISE(fd, unpack_data, ppm_data->coder.code, ppm_data->coder.low,
+	ARI_DEC_NORMALISE(unpack_data, ppm_data->coder.code, ppm_data->coder.low,
 				ppm_data->coder.range);
 	return symbol;
 }
@@ -56,7 +56,27 @@ static uint32_t unrar_endian_convert_32(uint32_t v)
 static void unrar_dbgmsg(const char* fmt,...){}
 #endif
 
-static void *read_header(int fd, header_type hdr_type)
+static int unrar_read(unrar_state_t *state, void *buf, unsigned int count)
+{
+	int ret;
+
+    ret = state->pread_cb(state->handle, buf, count, state->offset);
+    if(ret > 0)
+	state->offset += ret;
+    return ret;
+}
+
+static int unpack_read(void *handle, void *buf, unsigned int size)
+{
+    return unrar_read((unrar_state_t *) handle, buf, size);
+}
+
+static int fd_write(void *handle, const void *buf, unsigned int size)
+{
+    return write(*(int *) handle, buf, size);
+}
+
+static void *read_header(unrar_state_t *state, header_type hdr_type)
 {
 	unsigned char encrypt_ver;
 
@@ -69,7 +89,7 @@ static void *read_header(int fd, header_type hdr_type)
 	    if(!main_hdr)
 		return NULL;
 
-	    if(read(fd, main_hdr, SIZEOF_NEWMHD) != SIZEOF_NEWMHD) {
+	    if(unrar_read(state, main_hdr, SIZEOF_NEWMHD) != SIZEOF_NEWMHD) {
 		free(main_hdr);
 		return NULL;
 	    }
@@ -77,7 +97,7 @@ static void *read_header(int fd, header_type hdr_type)
 	    main_hdr->head_size = unrar_endian_convert_16(main_hdr->head_size);
 	    main_hdr->head_crc = unrar_endian_convert_16(main_hdr->head_crc);
 	    if(main_hdr->flags & MHD_ENCRYPTVER) {
-		if(read(fd, &encrypt_ver, sizeof(unsigned char)) != sizeof(unsigned char)) {
+		if(unrar_read(state, &encrypt_ver, sizeof(unsigned char)) != sizeof(unsigned char)) {
 		    free(main_hdr);
                     return NULL;
 		}
@@ -92,7 +112,7 @@ static void *read_header(int fd, header_type hdr_type)
 	    if(!file_hdr)
 		return NULL;
 
-	    if(read(fd, file_hdr, SIZEOF_NEWLHD) != SIZEOF_NEWLHD) {
+	    if(unrar_read(state, file_hdr, SIZEOF_NEWLHD) != SIZEOF_NEWLHD) {
 		free(file_hdr);
 		return NULL;
 	    }
@@ -103,7 +123,7 @@ static void *read_header(int fd, header_type hdr_type)
 	    file_hdr->file_crc = unrar_endian_convert_32(file_hdr->file_crc);
 	    file_hdr->name_size = unrar_endian_convert_16(file_hdr->name_size);
 	    if(file_hdr->flags & 0x100) {
-		if(read(fd, (char *) file_hdr + SIZEOF_NEWLHD, 8) != 8) {
+		if(unrar_read(state, (char *) file_hdr + SIZEOF_NEWLHD, 8) != 8) {
 		    free(file_hdr);
 		    return NULL;
 		}
@@ -122,7 +142,7 @@ static void *read_header(int fd, header_type hdr_type)
 	    if(!comment_hdr)
 		return NULL;
 
-	    if(read(fd, comment_hdr, SIZEOF_COMMHEAD) != SIZEOF_COMMHEAD) {
+	    if(unrar_read(state, comment_hdr, SIZEOF_COMMHEAD) != SIZEOF_COMMHEAD) {
 		free(comment_hdr);
 		return NULL;
 	    }
@@ -137,19 +157,15 @@ static void *read_header(int fd, header_type hdr_type)
     return NULL;
 }
 
-static unrar_fileheader_t *read_block(int fd, header_type hdr_type)
+static unrar_fileheader_t *read_block(unrar_state_t *state, header_type hdr_type)
 {
 	unrar_fileheader_t *file_header;
 	off_t offset;
 
 
     for (;;) {
-	offset = lseek(fd, 0, SEEK_CUR);
-    if (offset == -1) {
-        unrar_dbgmsg("UNRAR: seek: call to lseek() failed in read_block\n");
-        return NULL;
-    }
-	file_header = read_header(fd, FILE_HEAD);
+	offset = state->offset;
+	file_header = read_header(state, FILE_HEAD);
 	if(!file_header)
 	    return NULL;
 
@@ -171,16 +187,11 @@ static unrar_fileheader_t *read_block(int fd, header_type hdr_type)
 
 	unrar_dbgmsg("UNRAR: Found block type: 0x%x\n", file_header->head_type);
 	unrar_dbgmsg("UNRAR: Head Size: %.4x\n", file_header->head_size);
-	if(lseek(fd, file_header->next_offset, SEEK_SET) != file_header->next_offset) {
-	    unrar_dbgmsg("seek: %ld\n", file_header->next_offset);
-            free(file_header);
-	    return NULL;
-	}
-
+	state->offset = file_header->next_offset;
 	free(file_header);
     }
 
-    unrar_dbgmsg("UNRAR: read_block out offset=%ld\n", lseek(fd, 0, SEEK_CUR));
+    unrar_dbgmsg("UNRAR: read_block out offset=%ld\n", state->offset);
     unrar_dbgmsg("UNRAR: Found file block.\n");
     unrar_dbgmsg("UNRAR: Pack Size: %u\n", file_header->pack_size);
     unrar_dbgmsg("UNRAR: UnPack Version: 0x%.2x\n", file_header->unpack_ver);
@@ -190,7 +201,7 @@ static unrar_fileheader_t *read_block(int fd, header_type hdr_type)
 	free(file_header);
 	return NULL;
     }
-    if(read(fd, file_header->filename, file_header->name_size) != file_header->name_size) {
+    if(unrar_read(state, file_header->filename, file_header->name_size) != file_header->name_size) {
 	free(file_header->filename);
 	free(file_header);
 	return NULL;
@@ -201,13 +212,13 @@ static unrar_fileheader_t *read_block(int fd, header_type hdr_type)
     return file_header;
 }
 
-static int is_rar_archive(int fd)
+static int is_rar_archive(unrar_state_t *state)
 {
 	mark_header_t mark;
 	const mark_header_t rar_hdr[2] = {{{0x52, 0x61, 0x72, 0x21, 0x1a, 0x07, 0x00}}, {{'U', 'n', 'i', 'q', 'u', 'E', '!'}}};
 
 
-    if(read(fd, &mark, SIZEOF_MARKHEAD) != SIZEOF_MARKHEAD)
+    if(unrar_read(state, &mark, SIZEOF_MARKHEAD) != SIZEOF_MARKHEAD)
 	return FALSE;
 
     if(memcmp(&mark, &rar_hdr[0], SIZEOF_MARKHEAD) == 0)
@@ -229,7 +240,7 @@ static void unpack_free_data(unpack_data_t *unpack_data)
 	rarvm_free(&unpack_data->rarvm_data);
 }
 
-static unsigned int copy_file_data(int ifd, int ofd, unsigned int len)
+static unsigned int copy_file_data(unrar_state_t *state, unrar_write_cb_t write_cb, void *handle, unsigned int len)
 {
 	unsigned char data[8192];
 	unsigned int todo, count, rem;
@@ -237,11 +248,11 @@ static unsigned int copy_file_data(int ifd, int ofd, unsigned int len)
     rem = len;
     while(rem > 0) {
 	todo = MIN(8192, rem);
-	count = read(ifd, data, todo);
+	count = unrar_read(state, data, todo);
 	if(count != todo)
 	    return len-rem;
 
-	if(write(ofd, data, count) != (ssize_t) count)
+	if(write_cb(handle, data, count) != (int) count)
 	    return len-rem-count;
 
 	rem -= count;
@@ -249,7 +260,7 @@ static unsigned int copy_file_data(int ifd, int ofd, unsigned int len)
     return len;
 }
 
-int unrar_open(int fd, const char *dirname, unrar_state_t *state)
+int unrar_open(unrar_pread_cb_t pread_cb, void *handle, off_t start, const char *dirname, unrar_state_t *state)
 {
 	int ofd, retval;
 	char filename[1024];
@@ -262,10 +273,15 @@ int unrar_open(int fd, const char *dirname, unrar_state_t *state)
     if(!state)
 	return UNRAR_ERR;
 
-    if(!is_rar_archive(fd))
+    state->pread_cb = pread_cb;
+    state->handle = handle;
+    state->offset = start;
+    state->comment_dir = NULL;
+
+    if(!is_rar_archive(state))
 	return UNRAR_ERR;
 
-    main_hdr = read_header(fd, MAIN_HEAD);
+    main_hdr = read_header(state, MAIN_HEAD);
     if(!main_hdr)
 	return UNRAR_ERR;
 
@@ -279,15 +295,18 @@ int unrar_open(int fd, const char *dirname, unrar_state_t *state)
 	goto err_mhdr;
     }
 
-    snprintf(filename,1024,"%s"PATHSEP"comments", dirname);
-    if(mkdir(filename,0700)) {
-	unrar_dbgmsg("UNRAR: Unable to create comment temporary directory\n");
-	goto err_mhdr;
-    }
-    state->comment_dir = strdup(filename);
-    if(!state->comment_dir) {
-	ret = UNRAR_EMEM;
-	goto err_mhdr;
+    /* without a directory the comments are left out */
+    if(dirname) {
+	snprintf(filename,1024,"%s"PATHSEP"comments", dirname);
+	if(mkdir(filename,0700)) {
+	    unrar_dbgmsg("UNRAR: Unable to create comment temporary directory\n");
+	    goto err_mhdr;
+	}
+	state->comment_dir = strdup(filename);
+	if(!state->comment_dir) {
+	    ret = UNRAR_EMEM;
+	    goto err_mhdr;
+	}
     }
 
     if(main_hdr->head_size < SIZEOF_NEWMHD)
@@ -299,6 +318,8 @@ int unrar_open(int fd, const char *dirname, unrar_state_t *state)
 	ret = UNRAR_EMEM;
 	goto err_cmt_dir;
     }
+    unpack_data->read_cb = unpack_read;
+    unpack_data->read_handle = state;
     unpack_data->rarvm_data.mem = NULL;
     unpack_data->old_filter_lengths = NULL;
     unpack_data->PrgStack.array = unpack_data->Filters.array = NULL;
@@ -308,16 +329,12 @@ int unrar_open(int fd, const char *dirname, unrar_state_t *state)
 
     ppm_constructor(&unpack_data->ppm_data);
 
-    if(main_hdr->flags & MHD_COMMENT) {
+    if((main_hdr->flags & MHD_COMMENT) && state->comment_dir) {
 	unrar_comment_header_t *comment_header;
 	unrar_dbgmsg("UNRAR: RAR main comment\n");
-	offset = lseek(fd, 0, SEEK_CUR);
-        if (offset == -1) {
-            unrar_dbgmsg("UNRAR: seek: lseek() call failed in unrar_open\n");
-	    goto err_unpack_data;
-        }
+	offset = state->offset;
 	unrar_dbgmsg("UNRAR: Offset: %x\n", offset);
-	comment_header = read_header(fd, COMM_HEAD);
+	comment_header = read_header(state, COMM_HEAD);
 	if(comment_header) {
 	    unrar_dbgmsg("UNRAR: Comment type: 0x%.2x\n", comment_header->head_type);
 	    unrar_dbgmsg("UNRAR: Head size: 0x%.4x\n", comment_header->head_size);
@@ -333,12 +350,13 @@ int unrar_open(int fd, const char *dirname, unrar_state_t *state)
 	    } else {
 		if(comment_header->method == 0x30) {
 		    unrar_dbgmsg("UNRAR: Copying stored comment (not packed)\n");
-		    copy_file_data(fd, ofd, comment_header->unpack_size);
+		    copy_file_data(state, fd_write, &ofd, comment_header->unpack_size);
 		} else {
-		    unpack_data->ofd = ofd;
+		    unpack_data->write_cb = fd_write;
+		    unpack_data->write_handle = &ofd;
 		    unpack_data->dest_unp_size = comment_header->unpack_size;
 		    unpack_data->pack_size = comment_header->head_size - SIZEOF_COMMHEAD;
-                    retval = rar_unpack(fd, comment_header->unpack_ver, FALSE, unpack_data);
+                    retval = rar_unpack(comment_header->unpack_ver, FALSE, unpack_data);
 		    if (!retval)
 			    unrar_dbgmsg("UNRAR: failed to unpack comment\n");
 		    unpack_free_data(unpack_data);
@@ -347,22 +365,16 @@ int unrar_open(int fd, const char *dirname, unrar_state_t *state)
 	    }
 	    free(comment_header);
 	}
-        if (lseek(fd, offset, SEEK_SET) == -1) {
-            unrar_dbgmsg("UNRAR: seek: call to lseek() failed in unrar_open: %ld\n", offset);
-	    goto err_unpack_data;
-        }
+	state->offset = offset;
     }
 
-    if(main_hdr->head_size > SIZEOF_NEWMHD) {
-	if (!lseek(fd, main_hdr->head_size - SIZEOF_NEWMHD, SEEK_CUR))
-	    goto err_unpack_data;
-    }
+    if(main_hdr->head_size > SIZEOF_NEWMHD)
+	state->offset += main_hdr->head_size - SIZEOF_NEWMHD;
 
     state->unpack_data = unpack_data;
     state->main_hdr = main_hdr;
     state->metadata_tail = state->metadata = NULL;
     state->file_count = 1;
-    state->fd = fd;
 
     return UNRAR_OK;
 
@@ -387,7 +399,7 @@ int unrar_extract_next_prepare(unrar_state_t *state, const char *dirname)
 	unrar_metadata_t *new_metadata;
 
 
-    state->file_header = read_block(state->fd, FILE_HEAD);
+    state->file_header = read_block(state, FILE_HEAD);
     if(!state->file_header)
 	return UNRAR_BREAK; /* end of archive */
 
@@ -412,11 +424,11 @@ int unrar_extract_next_prepare(unrar_state_t *state, const char *dirname)
 	state->metadata_tail->next = new_metadata;
 	state->metadata_tail = new_metadata;
     }
-    if(state->file_header->flags & LHD_COMMENT) {
+    if((state->file_header->flags & LHD_COMMENT) && state->comment_dir) {
 	unrar_comment_header_t *comment_header;
 
 	unrar_dbgmsg("UNRAR: File comment present\n");
-	comment_header = read_header(state->fd, COMM_HEAD);
+	comment_header = read_header(state, COMM_HEAD);
 	if(comment_header) {
 	    unrar_dbgmsg("UNRAR: Comment type: 0x%.2x\n", comment_header->head_type);
 	    unrar_dbgmsg("UNRAR: Head size: 0x%.4x\n", comment_header->head_size);
@@ -433,7 +445,7 @@ int unrar_extract_next_prepare(unrar_state_t *state, const char *dirname)
 		    unrar_dbgmsg("UNRAR: ERROR: Failed to open output file\n");
 		} else {
 		    unrar_dbgmsg("UNRAR: Copying file comment (not packed)\n");
-		    copy_file_data(state->fd, ofd, comment_header->unpack_size);
+		    copy_file_data(state, fd_write, &ofd, comment_header->unpack_size);
 		    close(ofd);
 		}
 	    }
@@ -441,22 +453,20 @@ int unrar_extract_next_prepare(unrar_state_t *state, const char *dirname)
 	}
     }
 
+    state->standalone = !(state->main_hdr->flags & MHD_SOLID) &&
+	!(state->file_header->flags & (LHD_SOLID | LHD_PASSWORD | LHD_SPLIT_BEFORE | LHD_SPLIT_AFTER));
+    state->skip = 0;
+    state->unpacked = 0;
     return UNRAR_OK;
 }
 
-int unrar_extract_next(unrar_state_t *state, const char *dirname)
+int unrar_extract_next(unrar_state_t *state)
 {
-	int ofd;
 	int retval;
 	unpack_data_t *unpack_data;
 
 
-    if(lseek(state->fd, state->file_header->start_offset+state->file_header->head_size, SEEK_SET) != state->file_header->start_offset+state->file_header->head_size) {
-	unrar_dbgmsg("UNRAR: Seek failed: %ld\n", state->file_header->start_offset+state->file_header->head_size);
-	free(state->file_header->filename);
-	free(state->file_header);
-	return UNRAR_ERR;
-    }
+    state->offset = state->file_header->start_offset+state->file_header->head_size;
 
     if(state->file_header->flags & LHD_PASSWORD) {
 	unrar_dbgmsg("UNRAR: PASSWORDed file: %s\n", state->file_header->filename);
@@ -467,33 +477,30 @@ int unrar_extract_next(unrar_state_t *state, const char *dirname)
     } else if((state->main_hdr->flags & MHD_VOLUME) && (state->main_hdr->flags & MHD_SOLID)) {
 	unrar_dbgmsg("UNRAR: Skipping file inside multi-volume solid archive\n");
 
+    } else if(state->skip && state->standalone) {
+	unrar_dbgmsg("UNRAR: Skipping file at the caller's request\n");
+
     } else {
-	snprintf(state->filename, 1024, "%s"PATHSEP"%lu.ura", dirname, state->file_count);
-	ofd = open(state->filename, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0600);
-	if(ofd < 0) {
-	    free(state->file_header->filename);
-	    free(state->file_header);
-	    unrar_dbgmsg("UNRAR: ERROR: Failed to open output file\n");
-	    return UNRAR_ERR;
-	}
 	unpack_data = (unpack_data_t *) state->unpack_data;
-	state->ofd = unpack_data->ofd = ofd;
+	unpack_data->write_cb = state->write_cb;
+	unpack_data->write_handle = state->write_handle;
 	unpack_data->max_size = state->maxfilesize;
+	state->unpacked = 1;
 	if(state->file_header->method == 0x30) {
 	    unrar_dbgmsg("UNRAR: Copying stored file (not packed)\n");
-	    copy_file_data(state->fd, ofd, state->file_header->pack_size);
+	    copy_file_data(state, state->write_cb, state->write_handle, state->file_header->pack_size);
 	} else {
 	    unpack_data->dest_unp_size = state->file_header->unpack_size;
 	    unpack_data->pack_size = state->file_header->pack_size;
 	    if(state->file_header->unpack_ver <= 15) {
-		retval = rar_unpack(state->fd, 15, (state->file_count>1) && ((state->main_hdr->flags&MHD_SOLID)!=0), unpack_data);
+		retval = rar_unpack(15, (state->file_count>1) && ((state->main_hdr->flags&MHD_SOLID)!=0), unpack_data);
 	    } else {
 		if((state->file_count == 1) && (state->file_header->flags & LHD_SOLID)) {
 		    unrar_dbgmsg("UNRAR: Bad header. First file can't be SOLID.\n");
 		    unrar_dbgmsg("UNRAR: Clearing flag and continuing.\n");
 		    state->file_header->flags -= LHD_SOLID;
 		}
-		retval = rar_unpack(state->fd, state->file_header->unpack_ver, state->file_header->flags & LHD_SOLID, unpack_data);
+		retval = rar_unpack(state->file_header->unpack_ver, state->file_header->flags & LHD_SOLID, unpack_data);
 	    }
 	    unrar_dbgmsg("UNRAR: Expected File CRC: 0x%x\n", state->file_header->file_crc);
 	    unrar_dbgmsg("UNRAR: Computed File CRC: 0x%x\n", unpack_data->unp_crc^0xffffffff);
@@ -514,13 +521,7 @@ int unrar_extract_next(unrar_state_t *state, const char *dirname)
 	}
     }
 
-    if(lseek(state->fd, state->file_header->next_offset, SEEK_SET) != state->file_header->next_offset) {
-	unrar_dbgmsg("UNRAR: ERROR: seek failed: %ld\n", state->file_header->next_offset);
-	free(state->file_header->filename);
-	free(state->file_header);
-	return UNRAR_ERR;
-    }
-
+    state->offset = state->file_header->next_offset;
     free(state->file_header->filename);
     free(state->file_header);
     unpack_free_data(state->unpack_data);
@@ -112,6 +112,12 @@ typedef struct unrar_metadata_tag
     uint8_t method;
 } unrar_metadata_t;
 
+/* The archive is read with pread_cb(handle, buf, count, offset) and the
+ * files unpacked by unrar_extract_next() are passed to write_cb, both
+ * return the number of bytes transferred or -1 */
+typedef int (*unrar_pread_cb_t)(void *handle, void *buf, unsigned int count, off_t offset);
+typedef int (*unrar_write_cb_t)(void *handle, const void *buf, unsigned int size);
+
 typedef struct unrar_state_tag {
     unrar_fileheader_t *file_header;
     unrar_metadata_t *metadata;
@@ -121,14 +127,22 @@ typedef struct unrar_state_tag {
     char *comment_dir;
     unsigned long file_count;
     uint64_t maxfilesize;
-    int fd, ofd;
-    char filename[1024];
+    unrar_pread_cb_t pread_cb;
+    void *handle;
+    off_t offset; /* of the next read in the archive */
+    unrar_write_cb_t write_cb; /* set by the caller, with write_handle */
+    void *write_handle;
+    int standalone; /* the prepared file can be unpacked on its own */
+    int skip; /* set by the caller to step over the prepared file */
+    int unpacked; /* the file went to write_cb */
 } unrar_state_t;
 
 
-int unrar_open(int fd, const char *dirname, unrar_state_t *state);
+/* the archive begins at start, the comments go to dirname and are left
+ * out when it's NULL */
+int unrar_open(unrar_pread_cb_t pread_cb, void *handle, off_t start, const char *dirname, unrar_state_t *state);
 int unrar_extract_next_prepare(unrar_state_t *state, const char *dirname);
-int unrar_extract_next(unrar_state_t *state, const char *dirname);
+int unrar_extract_next(unrar_state_t *state);
 void unrar_close(unrar_state_t *state);
 
 #endif
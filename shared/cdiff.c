@@ -41,6 +41,8 @@
 #include "libclamav/others.h"
 #include "libclamav/cvd.h"
 #include "libclamav/default.h"
+#include "libclamav/readdb.h"
+#include "libclamav/matcher-hash.h"
 
 #include "zlib.h"
 
@@ -60,11 +62,31 @@ struct cdiff_node {
     struct cdiff_node *next;
 };
 
+/* The databases are loaded once into an array of lines, the commands work
+ * on the arrays and cdiff_apply() writes the files back once at the end */
+struct cdiff_line {
+    char *str; /* not terminated, with its '\n' unless the last line */
+    unsigned int len;
+    unsigned int own; /* allocated, else points into the file data */
+};
+
+struct cdiff_file {
+    char *name;
+    char *data;
+    struct cdiff_line *lines;
+    unsigned int nlines, maxlines;
+    unsigned int exists, ondisk, dirty;
+    struct cdiff_file *next;
+};
+
 struct cdiff_ctx {
     char *open_db;
     struct cdiff_node *add_start, *add_last;
     struct cdiff_node *del_start;
     struct cdiff_node *xchg_start, *xchg_last;
+    struct cdiff_file *files;
+    cdiff_fetch_t fetch;
+    void *fetchctx;
 };
 
 struct cdiff_cmd {
@@ -343,137 +365,575 @@ static int cdiff_cmd_xchg(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf,
     return 0;
 }
 
-static int cdiff_cmd_close(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf, unsigned int lbuflen)
+/* The precompiled hash databases (.bdb) are patched in their text form,
+ * one "ext:hash:size:minfl:maxfl:name" line per entry and a line with just
+ * the extension for an empty section. The order of the sections and of
+ * the entries is kept both ways, so that what sigtool --compile-db wrote
+ * is encoded back byte for byte. */
+static int cdiff_bdb_grow(char **buf, size_t *max, size_t len, size_t need)
 {
-	struct cdiff_node *add, *del, *xchg;
-	unsigned int lines = 0;
-	char *tmp;
-	FILE *fh, *tmpfh;
+	char *newbuf;
 
-    UNUSEDPARAM(cmdstr);
 
+    if(*max - len >= need)
+	return 0;
+    while(*max - len < need)
+	*max = *max ? *max * 2 : 65536;
+    if(!(newbuf = realloc(*buf, *max))) {
+	logg("!cdiff_bdb: Can't allocate %lu bytes\n", (unsigned long) *max);
+	return -1;
+    }
+    *buf = newbuf;
+    return 0;
+}
 
-    if(!ctx->open_db) {
-	logg("!cdiff_cmd_close: No database to close\n");
+int cdiff_bdb_decode(const char *data, size_t size, char **text, size_t *len)
+{
+	struct cli_bdb_hdr hdr;
+	struct cli_bdb_sec sec;
+	struct cli_bdb_ent ent;
+	unsigned int i, j, k, count, strsize, sections, name, hlen;
+	size_t pos, max = 0, tlen = 0;
+	const char *names;
+	char ext[5], *out = NULL;
+
+
+    if(size < sizeof(hdr))
+	goto bad;
+    memcpy(&hdr, data, sizeof(hdr));
+    if(memcmp(hdr.magic, CLI_BDB_MAGIC, sizeof(hdr.magic)) || le32_to_host(hdr.version) != CLI_BDB_VERSION)
+	goto bad;
+    sections = le32_to_host(hdr.sections);
+
+    for(pos = sizeof(hdr), i = 0; i < sections; i++) {
+	if(size - pos < sizeof(sec))
+	    goto bad;
+	memcpy(&sec, data + pos, sizeof(sec));
+	pos += sizeof(sec);
+	count = le32_to_host(sec.count);
+	strsize = le32_to_host(sec.strsize);
+	if(count > (size - pos) / sizeof(ent) || strsize > size - pos - count * sizeof(ent))
+	    goto bad;
+	memcpy(ext, sec.ext, 4);
+	ext[4] = 0;
+	if(!ext[0] || strchr(ext, ':') || strchr(ext, '\n'))
+	    goto bad;
+	names = data + pos + count * sizeof(ent);
+
+	if(!count) {
+	    if(cdiff_bdb_grow(&out, &max, tlen, 6))
+		goto fail;
+	    tlen += sprintf(out + tlen, "%s\n", ext);
+	}
+	for(j = 0; j < count; j++) {
+	    memcpy(&ent, data + pos + j * sizeof(ent), sizeof(ent));
+	    name = le32_to_host(ent.name);
+	    if(name >= strsize || !memchr(names + name, 0, strsize - name))
+		goto bad;
+	    switch(ent.type) {
+		case CLI_HASH_MD5:
+		    hlen = 16;
+		    break;
+		case CLI_HASH_SHA1:
+		    hlen = 20;
+		    break;
+		case CLI_HASH_SHA256:
+		    hlen = 32;
+		    break;
+		default:
+		    goto bad;
+	    }
+	    if(cdiff_bdb_grow(&out, &max, tlen, 96 + strlen(names + name)))
+		goto fail;
+	    tlen += sprintf(out + tlen, "%s:", ext);
+	    for(k = 0; k < hlen; k++)
+		tlen += sprintf(out + tlen, "%02x", ent.hash[k]);
+	    tlen += sprintf(out + tlen, ":%u:%u:%u:%s\n", le32_to_host(ent.size), le16_to_host(ent.minfl), le16_to_host(ent.maxfl), names + name);
+	}
+
+	pos += count * sizeof(ent) + strsize;
+	if(strsize & 7)
+	    pos += 8 - (strsize & 7);
+	if(pos > size)
+	    goto bad;
+    }
+
+    *text = out;
+    *len = tlen;
+    return 0;
+
+bad:
+    logg("!cdiff_bdb_decode: Malformed database\n");
+fail:
+    free(out);
+    return -1;
+}
+
+/* appends the section collected so far */
+static int cdiff_bdb_flush(char **out, size_t *max, size_t *olen, const char *ext, const struct cli_bdb_ent *ents, unsigned int count, const char *names, unsigned int strsize)
+{
+	struct cli_bdb_sec sec;
+	size_t pad = (8 - (strsize & 7)) & 7;
+
+
+    if(cdiff_bdb_grow(out, max, *olen, sizeof(sec) + count * sizeof(*ents) + strsize + pad))
 	return -1;
+    memset(&sec, 0, sizeof(sec));
+    strncpy(sec.ext, ext, sizeof(sec.ext));
+    sec.count = le32_to_host(count);
+    sec.strsize = le32_to_host(strsize);
+    memcpy(*out + *olen, &sec, sizeof(sec));
+    *olen += sizeof(sec);
+    if(count)
+	memcpy(*out + *olen, ents, count * sizeof(*ents));
+    *olen += count * sizeof(*ents);
+    if(strsize)
+	memcpy(*out + *olen, names, strsize);
+    *olen += strsize;
+    memset(*out + *olen, 0, pad);
+    *olen += pad;
+    return 0;
+}
+
+int cdiff_bdb_encode(const char *text, size_t len, char **data, size_t *size)
+{
+	struct cli_bdb_hdr hdr;
+	struct cli_bdb_ent *ents = NULL, *ent;
+	char *out = NULL, *names = NULL, *line = NULL, *tokens[6], ext[5], *pt;
+	size_t max = 0, olen = sizeof(hdr), nmax = 0, pos, end, hlen;
+	unsigned int count = 0, emax = 0, strsize = 0, sections = 0, sigs = 0, n = 0;
+	unsigned long val[3];
+	int i;
+
+
+    ext[0] = 0;
+    if(cdiff_bdb_grow(&out, &max, 0, sizeof(hdr)))
+	return -1;
+
+    for(pos = 0; ; pos = end + 1) {
+	free(line);
+	line = NULL;
+	if(pos < len) {
+	    for(end = pos; end < len && text[end] != '\n'; end++);
+	    if(end == pos)
+		goto bad;
+	    if(!(line = cli_malloc(end - pos + 1)))
+		goto fail;
+	    memcpy(line, text + pos, end - pos);
+	    line[end - pos] = 0;
+	    n = strcspn(line, ":");
+	}
+
+	/* another extension starts a new section, the end of the data ends
+	 * the last one */
+	if(!line || n != strlen(ext) || strncmp(ext, line, n)) {
+	    if(ext[0]) {
+		if(cdiff_bdb_flush(&out, &max, &olen, ext, ents, count, names, strsize))
+		    goto fail;
+		sections++;
+		sigs += count;
+		count = strsize = 0;
+	    }
+	    if(!line)
+		break;
+	    if(!n || n > 4)
+		goto bad;
+	    memcpy(ext, line, n);
+	    ext[n] = 0;
+	    if(!line[n])
+		continue; /* empty section */
+	}
+
+	if(cli_strtokenize(line, ':', 6, (const char **) tokens) != 6 || !tokens[5])
+	    goto bad;
+	hlen = strlen(tokens[1]) / 2;
+	if(hlen != 16 && hlen != 20 && hlen != 32)
+	    goto bad;
+	for(i = 0; i < 3; i++) {
+	    val[i] = strtoul(tokens[i + 2], &pt, 10);
+	    if(!*tokens[i + 2] || *pt || val[i] > (i ? 0xffff : 0xffffffff))
+		goto bad;
+	}
+
+	if(count == emax) {
+	    emax = emax ? emax * 2 : 1024;
+	    if(!(ent = realloc(ents, emax * sizeof(*ents)))) {
+		logg("!cdiff_bdb_encode: Can't allocate memory\n");
+		goto fail;
+	    }
+	    ents = ent;
+	}
+	if(cdiff_bdb_grow(&names, &nmax, strsize, strlen(tokens[5]) + 1))
+	    goto fail;
+
+	ent = &ents[count];
+	memset(ent, 0, sizeof(*ent));
+	if(cli_hex2str_to(tokens[1], (char *) ent->hash, hlen * 2))
+	    goto bad;
+	ent->type = (hlen == 16) ? CLI_HASH_MD5 : (hlen == 20) ? CLI_HASH_SHA1 : CLI_HASH_SHA256;
+	ent->size = le32_to_host(val[0]);
+	ent->name = le32_to_host(strsize);
+	ent->minfl = le16_to_host(val[1]);
+	ent->maxfl = le16_to_host(val[2]);
+	strcpy(names + strsize, tokens[5]);
+	strsize += strlen(tokens[5]) + 1;
+	count++;
     }
 
-    add = ctx->add_start;
-    del = ctx->del_start;
-    xchg = ctx->xchg_start;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CLI_BDB_MAGIC, sizeof(hdr.magic));
+    hdr.version = le32_to_host(CLI_BDB_VERSION);
+    hdr.sections = le32_to_host(sections);
+    hdr.sigs = le32_to_host(sigs);
+    memcpy(out, &hdr, sizeof(hdr));
 
-    if(del || xchg) {
+    free(line);
+    free(ents);
+    free(names);
+    *data = out;
+    *size = olen;
+    return 0;
 
-	if(!(fh = fopen(ctx->open_db, "rb"))) {
-	    logg("!cdiff_cmd_close: Can't open file %s for reading\n", ctx->open_db);
-	    return -1;
+bad:
+    logg("!cdiff_bdb_encode: Malformed entry: %s\n", line ? line : "");
+fail:
+    free(line);
+    free(ents);
+    free(names);
+    free(out);
+    return -1;
+}
+
+static void cdiff_file_clear(struct cdiff_file *file)
+{
+	unsigned int i;
+
+
+    for(i = 0; i < file->nlines; i++)
+	if(file->lines[i].own)
+	    free(file->lines[i].str);
+    file->nlines = 0;
+}
+
+static void cdiff_files_free(struct cdiff_ctx *ctx)
+{
+	struct cdiff_file *pt;
+
+
+    while(ctx->files) {
+	pt = ctx->files;
+	ctx->files = pt->next;
+	cdiff_file_clear(pt);
+	free(pt->lines);
+	free(pt->data);
+	free(pt->name);
+	free(pt);
+    }
+}
+
+/* appends a line, joined to the last one if that has no '\n' yet */
+static int cdiff_file_append(struct cdiff_file *file, char *str, unsigned int len, unsigned int own)
+{
+	struct cdiff_line *last, *newlines;
+	char *join;
+
+
+    if(file->nlines) {
+	last = &file->lines[file->nlines - 1];
+	if(last->str[last->len - 1] != '\n') {
+	    if(!(join = malloc(last->len + len))) {
+		logg("!cdiff_file_append: Can't allocate memory for line\n");
+		return -1;
+	    }
+	    memcpy(join, last->str, last->len);
+	    memcpy(join + last->len, str, len);
+	    if(last->own)
+		free(last->str);
+	    if(own)
+		free(str);
+	    last->str = join;
+	    last->len += len;
+	    last->own = 1;
+	    return 0;
 	}
+    }
 
-	if(!(tmp = cli_gentemp("."))) {
-	    logg("!cdiff_cmd_close: Can't generate temporary name\n");
-	    fclose(fh);
+    if(file->nlines == file->maxlines) {
+	file->maxlines = file->maxlines ? file->maxlines * 2 : 1024;
+	if(!(newlines = realloc(file->lines, file->maxlines * sizeof(struct cdiff_line)))) {
+	    logg("!cdiff_file_append: Can't allocate memory for %u lines\n", file->maxlines);
 	    return -1;
 	}
+	file->lines = newlines;
+    }
+    file->lines[file->nlines].str = str;
+    file->lines[file->nlines].len = len;
+    file->lines[file->nlines++].own = own;
+    return 0;
+}
 
-	if(!(tmpfh = fopen(tmp, "wb"))) {
-	    logg("!cdiff_cmd_close: Can't open file %s for writing\n", tmp);
-	    fclose(fh);
-	    free(tmp);
-	    return -1;
+/* the database as modified so far, loaded on first use */
+static struct cdiff_file *cdiff_file_get(struct cdiff_ctx *ctx, const char *name, unsigned int load)
+{
+	struct cdiff_file *file;
+	struct stat sb;
+	FILE *fh;
+	size_t i, start, size;
+	char *text;
+	int ret;
+
+
+    for(file = ctx->files; file; file = file->next)
+	if(!strcmp(file->name, name))
+	    return file;
+
+    if(!(file = calloc(1, sizeof(struct cdiff_file))) || !(file->name = strdup(name))) {
+	logg("!cdiff_file_get: Can't allocate memory for %s\n", name);
+	free(file);
+	return NULL;
+    }
+    file->next = ctx->files;
+    ctx->files = file;
+
+    if(stat(name, &sb) == -1) {
+	if(!ctx->fetch || (ret = ctx->fetch(name, ctx->fetchctx)) == 1)
+	    return file;
+	if(ret == -1) {
+	    logg("!cdiff_file_get: Can't fetch %s\n", name);
+	    return NULL;
 	}
+	if(stat(name, &sb) == -1)
+	    return file;
+    }
+    file->exists = file->ondisk = 1;
+    if(!load || !sb.st_size)
+	return file;
 
-	while(fgets(lbuf, lbuflen, fh)) {
-	    lines++;
+    if(!(fh = fopen(name, "rb"))) {
+	logg("!cdiff_file_get: Can't open file %s for reading\n", name);
+	return NULL;
+    }
+    if(!(file->data = malloc(sb.st_size)) || fread(file->data, 1, sb.st_size, fh) != (size_t) sb.st_size) {
+	logg("!cdiff_file_get: Can't read %s\n", name);
+	fclose(fh);
+	return NULL;
+    }
+    fclose(fh);
 
-	    if(del && del->lineno == lines) {
-		if(strncmp(lbuf, del->str, strlen(del->str))) {
-		    fclose(fh);
-		    fclose(tmpfh);
-		    unlink(tmp);
-		    free(tmp);
-		    logg("!cdiff_cmd_close: Can't apply DEL at line %d of %s\n", lines, ctx->open_db);
-		    return -1;
-		}
-		del = del->next;
-		continue;
-	    }
+    size = sb.st_size;
+    if(cli_strbcasestr(name, ".bdb")) {
+	if(cdiff_bdb_decode(file->data, size, &text, &size) == -1) {
+	    logg("!cdiff_file_get: Can't decode %s\n", name);
+	    return NULL;
+	}
+	free(file->data);
+	file->data = text;
+    }
 
-	    if(xchg && xchg->lineno == lines) {
-		if(strncmp(lbuf, xchg->str, strlen(xchg->str))) {
-		    fclose(fh);
-		    fclose(tmpfh);
-		    unlink(tmp);
-		    free(tmp);
-		    logg("!cdiff_cmd_close: Can't apply XCHG at line %d of %s\n", lines, ctx->open_db);
-		    return -1;
-		}
+    for(i = 0, start = 0; i < size; i++) {
+	if(file->data[i] == '\n' || i + 1 == size) {
+	    if(cdiff_file_append(file, file->data + start, i + 1 - start, 0) == -1)
+		return NULL;
+	    start = i + 1;
+	}
+    }
+    return file;
+}
 
-		if(fputs(xchg->str2, tmpfh) == EOF || fputc('\n', tmpfh) == EOF) {
-		    fclose(fh);
-		    fclose(tmpfh);
-		    unlink(tmp);
-		    logg("!cdiff_cmd_close: Can't write to %s\n", tmp);
-		    free(tmp);
-		    return -1;
-		}
-		xchg = xchg->next;
-		continue;
-	    }
+/* same test as strncmp() on the line read with fgets() */
+static int cdiff_line_cmp(const struct cdiff_line *line, const char *str)
+{
+	size_t len = strlen(str);
 
-	    if(fputs(lbuf, tmpfh) == EOF) {
-		fclose(fh);
-		fclose(tmpfh);
-		unlink(tmp);
-		logg("!cdiff_cmd_close: Can't write to %s\n", tmp);
-		free(tmp);
+    return len > line->len || memcmp(line->str, str, len);
+}
+
+static int cdiff_files_write(struct cdiff_ctx *ctx)
+{
+	struct cdiff_file *file;
+	unsigned int i;
+	char *tmp, *text, *data;
+	size_t len, size;
+	FILE *fh;
+
+
+    for(file = ctx->files; file; file = file->next) {
+	if(!file->dirty)
+	    continue;
+
+	if(!file->exists) {
+	    if(file->ondisk && unlink(file->name) == -1) {
+		logg("!cdiff_apply: Can't unlink %s\n", file->name);
 		return -1;
 	    }
+	    continue;
 	}
 
-	fclose(fh);
-	fclose(tmpfh);
+	if(!(tmp = cli_gentemp("."))) {
+	    logg("!cdiff_apply: Can't generate temporary name\n");
+	    return -1;
+	}
 
-	if(del || xchg) {
-	    logg("!cdiff_cmd_close: Not all DEL/XCHG have been executed\n");
-	    unlink(tmp);
+	if(!(fh = fopen(tmp, "wb"))) {
+	    logg("!cdiff_apply: Can't open file %s for writing\n", tmp);
 	    free(tmp);
 	    return -1;
 	}
 
-	if(unlink(ctx->open_db) == -1) {
-	    logg("!cdiff_cmd_close: Can't unlink %s\n", ctx->open_db);
+	if(cli_strbcasestr(file->name, ".bdb")) {
+	    for(len = 0, i = 0; i < file->nlines; i++)
+		len += file->lines[i].len;
+	    data = NULL;
+	    if((text = malloc(len + 1))) {
+		for(len = 0, i = 0; i < file->nlines; i++) {
+		    memcpy(text + len, file->lines[i].str, file->lines[i].len);
+		    len += file->lines[i].len;
+		}
+		if(cdiff_bdb_encode(text, len, &data, &size) == -1)
+		    data = NULL;
+		free(text);
+	    }
+	    i = data && fwrite(data, 1, size, fh) == size ? file->nlines : 0;
+	    if(!data)
+		logg("!cdiff_apply: Can't encode %s\n", file->name);
+	    free(data);
+	} else {
+	    for(i = 0; i < file->nlines; i++)
+		if(fwrite(file->lines[i].str, 1, file->lines[i].len, fh) != file->lines[i].len)
+		    break;
+	}
+
+	if(fclose(fh) == EOF || i < file->nlines) {
+	    logg("!cdiff_apply: Can't write to %s\n", tmp);
 	    unlink(tmp);
 	    free(tmp);
 	    return -1;
 	}
 
-	if(rename(tmp, ctx->open_db) == -1) {
-	    logg("!cdiff_cmd_close: Can't rename %s to %s\n", tmp, ctx->open_db);
+	if(file->ondisk && unlink(file->name) == -1) {
+	    logg("!cdiff_apply: Can't unlink %s\n", file->name);
 	    unlink(tmp);
 	    free(tmp);
 	    return -1;
 	}
 
+	if(rename(tmp, file->name) == -1) {
+	    logg("!cdiff_apply: Can't rename %s to %s\n", tmp, file->name);
+	    unlink(tmp);
+	    free(tmp);
+	    return -1;
+	}
 	free(tmp);
     }
 
-    if(add) {
+    return 0;
+}
+
+static int cdiff_cmd_close(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf, unsigned int lbuflen)
+{
+	struct cdiff_node *add, *del, *xchg;
+	struct cdiff_file *file;
+	struct cdiff_line *line;
+	unsigned int i, n, len;
+	char *str;
+
+    UNUSEDPARAM(cmdstr);
+    UNUSEDPARAM(lbuf);
+    UNUSEDPARAM(lbuflen);
+
+
+    if(!ctx->open_db) {
+	logg("!cdiff_cmd_close: No database to close\n");
+	return -1;
+    }
 
-	if(!(fh = fopen(ctx->open_db, "ab"))) {
-	    logg("!cdiff_cmd_close: Can't open file %s for appending\n", ctx->open_db);
+    add = ctx->add_start;
+    del = ctx->del_start;
+    xchg = ctx->xchg_start;
+
+    if(!(file = cdiff_file_get(ctx, ctx->open_db, 1)))
+	return -1;
+
+    if(del || xchg) {
+
+	if(!file->exists) {
+	    logg("!cdiff_cmd_close: Can't open file %s for reading\n", ctx->open_db);
 	    return -1;
 	}
 
-	while(add) {
-	    if(fputs(add->str, fh) == EOF || fputc('\n', fh) == EOF) {
-		fclose(fh);
-		logg("!cdiff_cmd_close: Can't write to %s\n", ctx->open_db);
-		return -1;
+	/* check everything first, the lines are only changed below */
+	for(i = 0; i < file->nlines; i++) {
+	    if(del && del->lineno == i + 1) {
+		if(cdiff_line_cmp(&file->lines[i], del->str)) {
+		    logg("!cdiff_cmd_close: Can't apply DEL at line %d of %s\n", i + 1, ctx->open_db);
+		    return -1;
+		}
+		del = del->next;
+		continue;
+	    }
+
+	    if(xchg && xchg->lineno == i + 1) {
+		if(cdiff_line_cmp(&file->lines[i], xchg->str)) {
+		    logg("!cdiff_cmd_close: Can't apply XCHG at line %d of %s\n", i + 1, ctx->open_db);
+		    return -1;
+		}
+		xchg = xchg->next;
 	    }
-	    add = add->next;
 	}
 
-	fclose(fh);
+	if(del || xchg) {
+	    logg("!cdiff_cmd_close: Not all DEL/XCHG have been executed\n");
+	    return -1;
+	}
+
+	del = ctx->del_start;
+	xchg = ctx->xchg_start;
+	for(i = 0, n = 0; i < file->nlines; i++) {
+	    line = &file->lines[i];
+	    if(del && del->lineno == i + 1) {
+		if(line->own)
+		    free(line->str);
+		del = del->next;
+		continue;
+	    }
+
+	    if(xchg && xchg->lineno == i + 1) {
+		len = strlen(xchg->str2);
+		if(!(str = malloc(len + 1))) {
+		    logg("!cdiff_cmd_close: Can't allocate memory for line\n");
+		    file->nlines = n + file->nlines - i;
+		    memmove(&file->lines[n], line, (file->nlines - n) * sizeof(struct cdiff_line));
+		    return -1;
+		}
+		memcpy(str, xchg->str2, len);
+		str[len] = '\n';
+		if(line->own)
+		    free(line->str);
+		line->str = str;
+		line->len = len + 1;
+		line->own = 1;
+		xchg = xchg->next;
+	    }
+	    file->lines[n++] = *line;
+	}
+	file->nlines = n;
+	file->dirty = 1;
+    }
+
+    while(add) {
+	len = strlen(add->str);
+	if(!(str = malloc(len + 1))) {
+	    logg("!cdiff_cmd_close: Can't allocate memory for line\n");
+	    return -1;
+	}
+	memcpy(str, add->str, len);
+	str[len] = '\n';
+	if(cdiff_file_append(file, str, len + 1, 1) == -1) {
+	    free(str);
+	    return -1;
+	}
+	file->exists = file->dirty = 1;
+	add = add->next;
     }
 
     cdiff_ctx_free(ctx);
@@ -483,9 +943,14 @@ static int cdiff_cmd_close(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf
 
 static int cdiff_cmd_move(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf, unsigned int lbuflen)
 {
-	unsigned int lines = 0, start_line, end_line;
-	char *arg, *srcdb, *dstdb, *tmpdb, *start_str, *end_str;
-	FILE *src, *dst, *tmp;
+	unsigned int i, start_line, end_line;
+	char *arg, *srcdb, *dstdb, *start_str, *end_str;
+	struct cdiff_file *src, *dst;
+	struct cdiff_line *moved;
+	int ret = -1;
+
+    UNUSEDPARAM(lbuf);
+    UNUSEDPARAM(lbuflen);
 
 
     if(ctx->open_db) {
@@ -523,173 +988,74 @@ static int cdiff_cmd_move(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf,
 	return -1;
     }
 
-    if(!(srcdb = cdiff_token(cmdstr, 1, 0))) {
-	logg("!cdiff_cmd_move: Can't get first argument\n");
-	free(start_str);
-	free(end_str);
-	return -1;
+    srcdb = cdiff_token(cmdstr, 1, 0);
+    dstdb = cdiff_token(cmdstr, 2, 0);
+    if(!srcdb || !dstdb) {
+	logg("!cdiff_cmd_move: Can't get %s argument\n", srcdb ? "second" : "first");
+	goto done;
     }
 
-    if(!(src = fopen(srcdb, "rb"))) {
+    if(!(src = cdiff_file_get(ctx, srcdb, 1)))
+	goto done;
+    if(!src->exists) {
 	logg("!cdiff_cmd_move: Can't open %s for reading\n", srcdb);
-	free(start_str);
-	free(end_str);
-	free(srcdb);
-	return -1;
-    }
-
-    if(!(dstdb = cdiff_token(cmdstr, 2, 0))) {
-	logg("!cdiff_cmd_move: Can't get second argument\n");
-	free(start_str);
-	free(end_str);
-	free(srcdb);
-	fclose(src);
-	return -1;
-    }
-
-    if(!(dst = fopen(dstdb, "ab"))) {
-	logg("!cdiff_cmd_move: Can't open %s for appending\n", dstdb);
-	free(start_str);
-	free(end_str);
-	free(srcdb);
-	fclose(src);
-	free(dstdb);
-	return -1;
+	goto done;
     }
 
-    if(!(tmpdb = cli_gentemp("."))) {
-	logg("!cdiff_cmd_move: Can't generate temporary name\n");
-	free(start_str);
-	free(end_str);
-	free(srcdb);
-	fclose(src);
-	free(dstdb);
-	fclose(dst);
-	return -1;
+    if(!start_line || start_line > src->nlines) {
+	logg("!cdiff_cmd_move: No data was moved from %s to %s\n", srcdb, dstdb);
+	goto done;
     }
+    /* a range past the end stops at the last line */
+    if(end_line > src->nlines)
+	end_line = src->nlines;
 
-    if(!(tmp = fopen(tmpdb, "wb"))) {
-	logg("!cdiff_cmd_move: Can't open file %s for writing\n", tmpdb);
-	free(start_str);
-	free(end_str);
-	free(srcdb);
-	fclose(src);
-	free(dstdb);
-	fclose(dst);
-	free(tmpdb);
-	return -1;
+    if(cdiff_line_cmp(&src->lines[start_line - 1], start_str)) {
+	logg("!cdiff_cmd_close: Can't apply MOVE due to conflict at line %d\n", start_line);
+	goto done;
     }
-
-    while(fgets(lbuf, lbuflen, src)) {
-	lines++;
-
-	if(lines == start_line) {
-	    if(strncmp(lbuf, start_str, strlen(start_str))) {
-		free(start_str);
-		free(end_str);
-		free(srcdb);
-		fclose(src);
-		free(dstdb);
-		fclose(dst);
-		fclose(tmp);
-		unlink(tmpdb);
-		free(tmpdb);
-		logg("!cdiff_cmd_close: Can't apply MOVE due to conflict at line %d\n", lines);
-		return -1;
-	    }
-
-	    do {
-		if(fputs(lbuf, dst) == EOF) {
-		    free(start_str);
-		    free(end_str);
-		    free(srcdb);
-		    fclose(src);
-		    fclose(dst);
-		    fclose(tmp);
-		    unlink(tmpdb);
-		    free(tmpdb);
-		    logg("!cdiff_cmd_move: Can't write to %s\n", dstdb);
-		    free(dstdb);
-		    return -1;
-		}
-	    } while((lines < end_line) && fgets(lbuf, lbuflen, src) && lines++);
-
-	    fclose(dst);
-	    dst = NULL;
-	    free(dstdb);
-	    free(start_str);
-
-	    if(strncmp(lbuf, end_str, strlen(end_str))) {
-		free(end_str);
-		free(srcdb);
-		fclose(src);
-		fclose(tmp);
-		unlink(tmpdb);
-		free(tmpdb);
-		logg("!cdiff_cmd_close: Can't apply MOVE due to conflict at line %d\n", lines);
-		return -1;
-	    }
-
-	    free(end_str);
-	    continue;
-	}
-
-	if(fputs(lbuf, tmp) == EOF) {
-	    if(dst) {
-		fclose(dst);
-		free(dstdb);
-		free(start_str);
-		free(end_str);
-	    }
-	    free(srcdb);
-	    fclose(src);
-	    fclose(tmp);
-	    unlink(tmpdb);
-	    logg("!cdiff_cmd_move: Can't write to %s\n", tmpdb);
-	    free(tmpdb);
-	    return -1;
-	}
+    if(cdiff_line_cmp(&src->lines[end_line - 1], end_str)) {
+	logg("!cdiff_cmd_close: Can't apply MOVE due to conflict at line %d\n", end_line);
+	goto done;
     }
 
-    fclose(src);
-    fclose(tmp);
-
-    if(dst) {
-	fclose(dst);
-	free(start_str);
-	free(end_str);
-	unlink(tmpdb);
-	free(tmpdb);
-	logg("!cdiff_cmd_move: No data was moved from %s to %s\n", srcdb, dstdb);
-	free(srcdb);
-	free(dstdb);
-	return -1;
-    }
+    if(!(dst = cdiff_file_get(ctx, dstdb, 1)))
+	goto done;
 
-    if(unlink(srcdb) == -1) {
-	logg("!cdiff_cmd_move: Can't unlink %s\n", srcdb);
-	free(srcdb);
-	unlink(tmpdb);
-	free(tmpdb);
-	return -1;
+    /* taken out of src first, src and dst may be the same */
+    if(!(moved = malloc((end_line - start_line + 1) * sizeof(struct cdiff_line)))) {
+	logg("!cdiff_cmd_move: Can't allocate memory for the lines\n");
+	goto done;
     }
-
-    if(rename(tmpdb, srcdb) == -1) {
-	logg("!cdiff_cmd_move: Can't rename %s to %s\n", tmpdb, srcdb);
-	free(srcdb);
-	unlink(tmpdb);
-	free(tmpdb);
-	return -1;
+    memcpy(moved, &src->lines[start_line - 1], (end_line - start_line + 1) * sizeof(struct cdiff_line));
+    memmove(&src->lines[start_line - 1], &src->lines[end_line], (src->nlines - end_line) * sizeof(struct cdiff_line));
+    src->nlines -= end_line - start_line + 1;
+    src->dirty = 1;
+
+    for(i = 0; i < end_line - start_line + 1; i++) {
+	if(cdiff_file_append(dst, moved[i].str, moved[i].len, moved[i].own) == -1) {
+	    for(; i < end_line - start_line + 1; i++)
+		if(moved[i].own)
+		    free(moved[i].str);
+	    free(moved);
+	    goto done;
+	}
     }
+    free(moved);
+    dst->exists = dst->dirty = 1;
+    ret = 0;
 
+done:
+    free(start_str);
+    free(end_str);
     free(srcdb);
-    free(tmpdb);
-
-    return 0;
+    free(dstdb);
+    return ret;
 }
 
 static int cdiff_cmd_unlink(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf, unsigned int lbuflen)
 {
+	struct cdiff_file *file;
 	char *db;
 	unsigned int i;
 
@@ -714,11 +1080,19 @@ static int cdiff_cmd_unlink(const char *cmdstr, struct cdiff_ctx *ctx, char *lbu
 	}
     }
 
-    if(unlink(db) == -1) {
+    if(!(file = cdiff_file_get(ctx, db, 0))) {
+	free(db);
+	return -1;
+    }
+
+    if(!file->exists) {
 	logg("!cdiff_cmd_unlink: Can't unlink %s\n", db);
 	free(db);
 	return -1;
     }
+    cdiff_file_clear(file);
+    file->exists = 0;
+    file->dirty = 1;
 
     free(db);
     return 0;
@@ -768,6 +1142,11 @@ static int cdiff_execute(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf,
 }
 
 int cdiff_apply(int fd, unsigned short mode)
+{
+    return cdiff_apply_fetch(fd, mode, NULL, NULL);
+}
+
+int cdiff_apply_fetch(int fd, unsigned short mode, cdiff_fetch_t fetch, void *fetchctx)
 {
 	struct cdiff_ctx ctx;
 	FILE *fh;
@@ -784,6 +1163,8 @@ int cdiff_apply(int fd, unsigned short mode)
 #define DSIGBUFF 350
 
     memset(&ctx, 0, sizeof(ctx));
+    ctx.fetch = fetch;
+    ctx.fetchctx = fetchctx;
 
     if((desc = dup(fd)) == -1) {
 	logg("!cdiff_apply: Can't duplicate descriptor %d\n", fd);
@@ -932,6 +1313,7 @@ int cdiff_apply(int fd, unsigned short mode)
 	    if(!gzgets(gzh, line, bufsize)) {
 		logg("!cdiff_apply: Premature EOF at line %d\n", lines + 1);
 		cdiff_ctx_free(&ctx);
+		cdiff_files_free(&ctx);
 		gzclose(gzh);
 		free(line);
 		free(lbuf);
@@ -956,6 +1338,8 @@ int cdiff_apply(int fd, unsigned short mode)
 		    if(!r1 || !r2) {
 			logg("!cdiff_apply: Can't resize line buffer to %d bytes\n", line_size);
 			cdiff_ctx_free(&ctx);
+			cdiff_files_free(&ctx);
+		cdiff_files_free(&ctx);
 			gzclose(gzh);
 			if(!r1 && !r2) {
 			    free(line);
@@ -978,6 +1362,7 @@ int cdiff_apply(int fd, unsigned short mode)
 	    if(cdiff_execute(line, &ctx, lbuf, line_size) == -1) {
 		logg("!cdiff_apply: Error executing command at line %d\n", lines);
 		cdiff_ctx_free(&ctx);
+		cdiff_files_free(&ctx);
 		gzclose(gzh);
 		free(line);
 		free(lbuf);
@@ -1017,6 +1402,8 @@ int cdiff_apply(int fd, unsigned short mode)
 		    if(!r1 || !r2) {
 			logg("!cdiff_apply: Can't resize line buffer to %d bytes\n", line_size);
 			cdiff_ctx_free(&ctx);
+			cdiff_files_free(&ctx);
+		cdiff_files_free(&ctx);
 			fclose(fh);
 			if(!r1 && !r2) {
 			    free(line);
@@ -1039,6 +1426,7 @@ int cdiff_apply(int fd, unsigned short mode)
 	    if(cdiff_execute(line, &ctx, lbuf, line_size) == -1) {
 		logg("!cdiff_apply: Error executing command at line %d\n", lines);
 		cdiff_ctx_free(&ctx);
+		cdiff_files_free(&ctx);
 		fclose(fh);
 		free(line);
 		free(lbuf);
@@ -1057,8 +1445,15 @@ int cdiff_apply(int fd, unsigned short mode)
     if(ctx.open_db) {
 	logg("*cdiff_apply: File %s was not properly closed\n", ctx.open_db);
 	cdiff_ctx_free(&ctx);
+	cdiff_files_free(&ctx);
+	return -1;
+    }
+
+    if(cdiff_files_write(&ctx) == -1) {
+	cdiff_files_free(&ctx);
 	return -1;
     }
+    cdiff_files_free(&ctx);
 
     logg("*cdiff_apply: Parsed %d lines and executed %d commands\n", lines, cmds);
     return 0;
@@ -21,6 +21,14 @@
 #ifndef __CDIFF_H
 #define __CDIFF_H
 
+/* Called for a database missing from the working directory, to create it
+ * there from wherever the caller keeps it. Returns 0 when it was created,
+ * 1 when there's no such database and -1 on errors. */
+typedef int (*cdiff_fetch_t)(const char *name, void *ctx);
+
 int cdiff_apply(int fd, unsigned short mode);
+int cdiff_apply_fetch(int fd, unsigned short mode, cdiff_fetch_t fetch, void *fetchctx);
+int cdiff_bdb_decode(const char *data, size_t size, char **text, size_t *len);
+int cdiff_bdb_encode(const char *text, size_t len, char **data, size_t *size);
 
 #endif
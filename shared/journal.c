@@ -0,0 +1,361 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "libclamav/clamav.h"
+#include "libclamav/cltypes.h"
+#include "shared/output.h"
+#include "shared/journal.h"
+
+#define JOURNAL_MAGIC	"ClamJrnl"
+#define JOURNAL_VERSION	1
+#define JOURNAL_MINSIZE	1024
+
+struct journal_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t options;
+    unsigned char digest[16];
+    uint64_t entries;
+};
+
+struct journal_rec {
+    uint64_t dev, ino, size, mtime, ctime;
+    uint32_t len, pad;
+};
+
+struct journal_entry {
+    struct journal_entry *next;
+    uint32_t hash;
+    struct journal_rec rec;
+    char path[1];
+};
+
+struct scan_journal {
+    char *file;
+    struct journal_entry **table;
+    uint32_t size, entries;
+    unsigned char digest[16];
+    uint32_t options;
+    int dirty;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+#endif
+};
+
+#ifdef CL_THREAD_SAFE
+#define JOURNAL_LOCK(j)	    pthread_mutex_lock(&(j)->mutex)
+#define JOURNAL_UNLOCK(j)   pthread_mutex_unlock(&(j)->mutex)
+#else
+#define JOURNAL_LOCK(j)
+#define JOURNAL_UNLOCK(j)
+#endif
+
+static uint32_t journal_hash(const char *path, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    while(len--)
+	h = (h ^ (unsigned char) *path++) * 16777619U;
+    return h;
+}
+
+static void journal_rec_set(struct journal_rec *rec, const STATBUF *sb)
+{
+    rec->dev = sb->st_dev;
+    rec->ino = sb->st_ino;
+    rec->size = sb->st_size;
+    rec->mtime = sb->st_mtime;
+    rec->ctime = sb->st_ctime;
+}
+
+static struct journal_entry **journal_find(struct scan_journal *j, const char *path, size_t len, uint32_t hash)
+{
+    struct journal_entry **e = &j->table[hash & (j->size - 1)];
+
+    while(*e && ((*e)->hash != hash || (*e)->rec.len != len || memcmp((*e)->path, path, len)))
+	e = &(*e)->next;
+    return e;
+}
+
+static void journal_clear(struct scan_journal *j)
+{
+    struct journal_entry *e, *next;
+    uint32_t i;
+
+    for(i = 0; i < j->size; i++) {
+	for(e = j->table[i]; e; e = next) {
+	    next = e->next;
+	    free(e);
+	}
+	j->table[i] = NULL;
+    }
+    j->entries = 0;
+}
+
+static void journal_grow(struct scan_journal *j)
+{
+    struct journal_entry **table, *e, *next;
+    uint32_t i, size = j->size * 2;
+
+    if(!(table = calloc(size, sizeof(*table))))
+	return;
+    for(i = 0; i < j->size; i++) {
+	for(e = j->table[i]; e; e = next) {
+	    next = e->next;
+	    e->next = table[e->hash & (size - 1)];
+	    table[e->hash & (size - 1)] = e;
+	}
+    }
+    free(j->table);
+    j->table = table;
+    j->size = size;
+}
+
+static struct journal_entry *journal_insert(struct scan_journal *j, const char *path, size_t len)
+{
+    uint32_t hash = journal_hash(path, len);
+    struct journal_entry **e = journal_find(j, path, len, hash);
+
+    if(*e)
+	return *e;
+    if(!(*e = malloc(sizeof(**e) + len)))
+	return NULL;
+    (*e)->next = NULL;
+    (*e)->hash = hash;
+    (*e)->rec.len = len;
+    (*e)->rec.pad = 0;
+    memcpy((*e)->path, path, len);
+    (*e)->path[len] = 0;
+    if(++j->entries > j->size) {
+	struct journal_entry *ret = *e;
+
+	journal_grow(j);
+	return ret;
+    }
+    return *e;
+}
+
+/* Drops the entries recorded with another signature set or other options */
+static void journal_sync(struct scan_journal *j, const struct cl_engine *engine, unsigned int options)
+{
+    unsigned char digest[16];
+
+    if(cl_engine_get_digest(engine, digest))
+	memset(digest, 0, sizeof(digest));
+    if(!memcmp(digest, j->digest, sizeof(digest)) && options == j->options)
+	return;
+    if(j->entries)
+	logg("*journal: signatures or options changed, dropping %u entries\n", j->entries);
+    journal_clear(j);
+    memcpy(j->digest, digest, sizeof(digest));
+    j->options = options;
+    j->dirty = 1;
+}
+
+static void journal_load(struct scan_journal *j)
+{
+    struct journal_hdr hdr;
+    struct journal_rec rec;
+    struct journal_entry *e;
+    char *path = NULL;
+    uint64_t i;
+    FILE *f;
+
+    if(!(f = fopen(j->file, "rb")))
+	return;
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) || hdr.version != JOURNAL_VERSION) {
+	logg("^journal: %s is not a valid scan journal, ignoring it\n", j->file);
+	fclose(f);
+	return;
+    }
+    memcpy(j->digest, hdr.digest, sizeof(j->digest));
+    j->options = hdr.options;
+    for(i = 0; i < hdr.entries; i++) {
+	if(fread(&rec, sizeof(rec), 1, f) != 1 || !rec.len || rec.len > 65536)
+	    break;
+	if(!(path = realloc(path, rec.len)) || fread(path, rec.len, 1, f) != 1)
+	    break;
+	if(!(e = journal_insert(j, path, rec.len)))
+	    break;
+	e->rec = rec;
+    }
+    if(i != hdr.entries) {
+	logg("^journal: %s is truncated, %u entries loaded\n", j->file, j->entries);
+	j->dirty = 1;
+    }
+    free(path);
+    fclose(f);
+    logg("*journal: %u entries loaded from %s\n", j->entries, j->file);
+}
+
+struct scan_journal *journal_open(const char *file)
+{
+    struct scan_journal *j;
+
+    if(!(j = calloc(1, sizeof(*j))))
+	return NULL;
+    j->size = JOURNAL_MINSIZE;
+    if(!(j->file = strdup(file)) || !(j->table = calloc(j->size, sizeof(*j->table)))) {
+	free(j->file);
+	free(j);
+	return NULL;
+    }
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_init(&j->mutex, NULL);
+#endif
+    journal_load(j);
+    return j;
+}
+
+/* Returns 1 if path was found clean before and its inode didn't change since */
+int journal_check(struct scan_journal *j, const struct cl_engine *engine, unsigned int options, const char *path, const STATBUF *sb)
+{
+    size_t len = strlen(path);
+    struct journal_entry *e;
+    struct journal_rec rec;
+    int ret = 0;
+
+    journal_rec_set(&rec, sb);
+    JOURNAL_LOCK(j);
+    journal_sync(j, engine, options);
+    if((e = *journal_find(j, path, len, journal_hash(path, len))))
+	ret = e->rec.dev == rec.dev && e->rec.ino == rec.ino && e->rec.size == rec.size &&
+	      e->rec.mtime == rec.mtime && e->rec.ctime == rec.ctime;
+    JOURNAL_UNLOCK(j);
+    return ret;
+}
+
+/* Records path as clean; sb must have been taken before the scan, which
+ * started reading the file at start */
+void journal_add(struct scan_journal *j, const struct cl_engine *engine, unsigned int options, const char *path, const STATBUF *sb, time_t start)
+{
+    struct journal_entry *e;
+
+    if(sb->st_ctime >= start || sb->st_mtime >= start) {
+	journal_remove(j, path);
+	return;
+    }
+    JOURNAL_LOCK(j);
+    journal_sync(j, engine, options);
+    if((e = journal_insert(j, path, strlen(path)))) {
+	journal_rec_set(&e->rec, sb);
+	j->dirty = 1;
+    }
+    JOURNAL_UNLOCK(j);
+}
+
+void journal_remove(struct scan_journal *j, const char *path)
+{
+    size_t len = strlen(path);
+    struct journal_entry **e, *del;
+
+    JOURNAL_LOCK(j);
+    e = journal_find(j, path, len, journal_hash(path, len));
+    if((del = *e)) {
+	*e = del->next;
+	free(del);
+	j->entries--;
+	j->dirty = 1;
+    }
+    JOURNAL_UNLOCK(j);
+}
+
+/* Writes the journal to a temporary file which then replaces the old one */
+int journal_save(struct scan_journal *j)
+{
+    struct journal_hdr hdr;
+    struct journal_entry *e;
+    char *tmpname;
+    uint32_t i;
+    FILE *f;
+    int fd, ret = 0;
+
+    JOURNAL_LOCK(j);
+    if(!j->dirty) {
+	JOURNAL_UNLOCK(j);
+	return 0;
+    }
+    if(!(tmpname = malloc(strlen(j->file) + 16))) {
+	JOURNAL_UNLOCK(j);
+	return -1;
+    }
+    sprintf(tmpname, "%s.%u", j->file, (unsigned int) getpid());
+    if((fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, S_IRUSR|S_IWUSR)) < 0 || !(f = fdopen(fd, "wb"))) {
+	logg("!journal: Can't create %s\n", tmpname);
+	if(fd >= 0)
+	    close(fd);
+	free(tmpname);
+	JOURNAL_UNLOCK(j);
+	return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.options = j->options;
+    memcpy(hdr.digest, j->digest, sizeof(hdr.digest));
+    hdr.entries = j->entries;
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+	ret = -1;
+    for(i = 0; !ret && i < j->size; i++)
+	for(e = j->table[i]; !ret && e; e = e->next)
+	    if(fwrite(&e->rec, sizeof(e->rec), 1, f) != 1 || fwrite(e->path, e->rec.len, 1, f) != 1)
+		ret = -1;
+
+    if(fclose(f) || ret || rename(tmpname, j->file)) {
+	logg("!journal: Can't write %s\n", j->file);
+	unlink(tmpname);
+	ret = -1;
+    } else {
+	logg("*journal: %u entries written to %s\n", j->entries, j->file);
+	j->dirty = 0;
+    }
+    free(tmpname);
+    JOURNAL_UNLOCK(j);
+    return ret;
+}
+
+void journal_free(struct scan_journal *j)
+{
+    if(!j)
+	return;
+    journal_clear(j);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_destroy(&j->mutex);
+#endif
+    free(j->table);
+    free(j->file);
+    free(j);
+}
@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/* Scan journal for incremental sweeps.
+ *
+ * The journal remembers the files found clean together with their device,
+ * inode, size, mtime and ctime. It is bound to the engine fingerprint (see
+ * cl_engine_get_digest()) and the scan options: as soon as either differs
+ * all the entries are dropped, so a file is only skipped when neither the
+ * file nor the signatures changed since it was last scanned.
+ *
+ * Timestamps only have a resolution of one second here, hence a file whose
+ * ctime is not older than the second its scan started in isn't recorded: it
+ * might still change without the ctime moving.
+ */
+
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <time.h>
+#include "libclamav/clamav.h"
+
+struct scan_journal;
+
+struct scan_journal *journal_open(const char *file);
+int journal_check(struct scan_journal *j, const struct cl_engine *engine, unsigned int options, const char *path, const STATBUF *sb);
+void journal_add(struct scan_journal *j, const struct cl_engine *engine, unsigned int options, const char *path, const STATBUF *sb, time_t start);
+void journal_remove(struct scan_journal *j, const char *path);
+int journal_save(struct scan_journal *j);
+void journal_free(struct scan_journal *j);
+
+#endif
@@ -86,10 +86,12 @@ const struct clam_option __clam_options[] = {
     { NULL, "multiscan", 'm', CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMDSCAN, "", "" },
     { NULL, "fdpass", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMDSCAN, "", "" },
     { NULL, "stream", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMDSCAN, "", "" },
+    { NULL, "connections", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 1, NULL, 0, OPT_CLAMDSCAN, "", "" },
     { NULL, "allmatch", 'z', CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMSCAN | OPT_CLAMDSCAN, "", "" },
     { NULL, "normalize", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 1, NULL, 0, OPT_CLAMSCAN, "Perform HTML, script, and text normalization", "" },
     { NULL, "database", 'd', CLOPT_TYPE_STRING, NULL, -1, DATADIR, FLAG_REQUIRED | FLAG_MULTIPLE, OPT_CLAMSCAN, "", "" }, /* merge it with DatabaseDirectory (and fix conflict with --datadir */
     { NULL, "recursive", 'r', CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMSCAN, "", "" },
+    { NULL, "threads", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 1, NULL, 0, OPT_CLAMSCAN | OPT_SIGTOOL, "", "" },
     { NULL, "gen-mdb", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMSCAN, "Always generate MDB entries for PE sections", "" },
     { NULL, "follow-dir-symlinks", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 1, NULL, 0, OPT_CLAMSCAN, "", "" },
     { NULL, "follow-file-symlinks", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 1, NULL, 0, OPT_CLAMSCAN, "", "" },
@@ -123,6 +125,7 @@ const struct clam_option __clam_options[] = {
     { NULL, "unsigned", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "no-cdiff", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "server", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
+    { NULL, "compile-db", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "unpack", 'u', CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "unpack-current", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "info", 'i', CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
@@ -130,6 +133,9 @@ const struct clam_option __clam_options[] = {
     { NULL, "find-sigs", 'f', CLOPT_TYPE_STRING, NULL, -1, DATADIR, FLAG_REQUIRED, OPT_SIGTOOL, "", "" },
     { NULL, "decode-sigs", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "test-sigs", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
+    { NULL, "profile-sigs", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
+    { NULL, "corpus", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
+    { NULL, "build-ac-profile", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "vba", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "vba-hex", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
     { NULL, "diff", 'd', CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_SIGTOOL, "", "" },
@@ -153,6 +159,8 @@ const struct clam_option __clam_options[] = {
     { NULL, "no-trace-showsource", 's', CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMBC, "Don't show source line during tracing",""},
 
     { NULL, "archive-verbose", 'a', CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMSCAN, "", ""},
+    { NULL, "profile", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMSCAN, "", "" },
+    { NULL, "debug-load-timing", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMSCAN, "", "" },
 
     /* cmdline only - deprecated */
     { NULL, "bytecode-trust-all", 't', CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMSCAN | OPT_DEPRECATED, "", ""},
@@ -218,8 +226,12 @@ const struct clam_option __clam_options[] = {
 
     { "LogRotate", "log-rotate", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD | OPT_FRESHCLAM | OPT_MILTER, "Rotate log file. Requires LogFileMaxSize option set prior to this option.", "yes" },
 
+    { "LogBufferSize", NULL, 0, CLOPT_TYPE_SIZE, MATCH_SIZE, 0, NULL, 0, OPT_CLAMD, "Write the log file from a separate thread, through a buffer of this size\n(allocated twice). When the buffer is full, errors and warnings wait for it\nand the other messages are dropped and counted in the log.\nThe default 0 writes each message synchronously.", "64K" },
+
     { "ExtendedDetectionInfo", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "Log additional information about the infected file, such as its\nsize and hash, together with the virus name.", "yes" },
 
+    { "ScanUsageReply", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "Append the resources used by the scan to the OK and FOUND replies of\nINSTREAM and FILDES, as key=value pairs.", "no" },
+
     { "PidFile", "pid", 'p', CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD | OPT_FRESHCLAM | OPT_MILTER, "Save the process ID to a file.", "/var/run/clam.pid" },
 
     { "TemporaryDirectory", "tempdir", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD | OPT_MILTER | OPT_CLAMSCAN | OPT_SIGTOOL, "This option allows you to change the default temporary directory.", "/tmp" },
@@ -247,6 +259,8 @@ const struct clam_option __clam_options[] = {
 
     { "StreamMaxLength", NULL, 0, CLOPT_TYPE_SIZE, MATCH_SIZE, CLI_DEFAULT_MAXFILESIZE, NULL, 0, OPT_CLAMD, "Close the STREAM session when the data size limit is exceeded.\nThe value should match your MTA's limit for the maximum attachment size.", "25M" },
 
+    { "StreamMaxMemSize", NULL, 0, CLOPT_TYPE_SIZE, MATCH_SIZE, 1048576, NULL, 0, OPT_CLAMD, "INSTREAM data up to this size is kept in memory and scanned without\na temporary file. Larger streams are moved to TemporaryDirectory.\nA value of 0 always uses a temporary file.", "4M" },
+
     { "StreamMinPort", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 1024, NULL, 0, OPT_CLAMD, "The STREAM command uses an FTP-like protocol.\nThis option sets the lower boundary for the port range.", "1024" },
 
     { "StreamMaxPort", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 2048, NULL, 0, OPT_CLAMD, "This option sets the upper boundary for the port range.", "2048" },
@@ -261,6 +275,22 @@ const struct clam_option __clam_options[] = {
 
     { "ReadTimeout", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 120, NULL, 0, OPT_MILTER, "Waiting for data from clamd will timeout after this time (seconds).", "300" },
 
+    { "AdaptiveThreads", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "Size the thread pool from the load, between MinThreads and MaxThreads.\nWorkers are added while jobs are waiting and the CPUs have room, depending on\nthe share of the scan time spent on the CPU, and removed when the CPUs are saturated.", "yes" },
+
+    { "MinThreads", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 2, NULL, 0, OPT_CLAMD, "With AdaptiveThreads, the number of threads allowed to run is never lowered below this.", "4" },
+
+    { "WorkerCPUs", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD, "Run the worker threads on these CPUs only (a list like 0-7,16-23).", "0-7,16-23" },
+
+    { "WorkerCPUPinning", NULL, 0, CLOPT_TYPE_STRING, "^(set|thread)$", -1, "set", 0, OPT_CLAMD, "How the workers are placed on WorkerCPUs:\n\tset - each worker can run on any of them\n\tthread - each worker stays on one CPU, the n-th worker on the n-th CPU listed,\n\t\t so that it keeps its caches warm. Listing the CPUs of one NUMA node\n\t\t first keeps the busiest workers on that node.", "thread" },
+
+    { "WorkerProcesses", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD, "Run this many clamd processes, each with its own MaxThreads threads, sharing the\nlistening sockets and the database loaded once by the main process. A crash\nonly ends the scans of one process, which is then restarted. The database is\nreloaded by the main process, then the processes are replaced one at a time.\n0 runs the threads in a single process.", "4" },
+
+    { "AcceptThreads", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 1, NULL, 0, OPT_CLAMD, "Accept and read the commands of the TCP connections in this many threads,\neach with listening sockets of its own bound with SO_REUSEPORT; the kernel spreads\nthe connections over them. The scans still go to the MaxThreads worker threads.\nIgnored with WorkerProcesses and with the sockets of systemd.", "4" },
+
+    { "ProfileSampleInterval", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD, "Every this many milliseconds, record what the busy worker threads are scanning:\nthe types of the nested objects and whether they are parsed or matched.\nThe PROFILE command reports the recent samples. 0 disables sampling.", "10" },
+
+    { "SignatureProfileRate", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD, "Time about one in this many evaluations of the bytecodes, PCREs, logical and\nYARA conditions and body signatures with alternatives. The SIGSTATS command\nreports the most expensive signatures. 0 disables sampling.", "1000" },
+
     { "MaxQueue", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 100, NULL, 0, OPT_CLAMD, "Maximum number of queued items (including those being processed by MaxThreads\nthreads). It is recommended to have this value at least twice MaxThreads\nif possible.\nWARNING: you shouldn't increase this too much to avoid running out of file\n descriptors, the following condition should hold:\n MaxThreads*MaxRecursion + MaxQueue - MaxThreads  + 6 < RLIMIT_NOFILE\n (usual max for RLIMIT_NOFILE is 1024)\n", "200" },
 
     { "IdleTimeout", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 30, NULL, 0, OPT_CLAMD, "This option specifies how long (in seconds) the process should wait\nfor a new job.", "60" },
@@ -277,8 +307,38 @@ const struct clam_option __clam_options[] = {
 
     { "SelfCheck", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 600, NULL, 0, OPT_CLAMD, "This option specifies the time intervals (in seconds) in which clamd\nshould perform a database check.", "600" },
 
+    { "WatchDatabaseDirectory", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "Watch the database directory with inotify or kqueue and check the database as soon as\na database file changes, instead of every SelfCheck seconds.", "no" },
+
+    { "WatchDatabaseDelay", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 5, NULL, 0, OPT_CLAMD, "With WatchDatabaseDirectory, the time (in seconds) the directory must stay unchanged\nbefore the database is checked, so that the files written by one update\nare picked up by a single reload.", "5" },
+
+    { "ConcurrentDatabaseReload", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 1, NULL, 0, OPT_CLAMD, "Load the new database in a separate thread on a reload while the old one keeps serving the scans.\nThe new database takes over once it's loaded and the old one is released when the scans using it finish.\nBoth databases are in memory during the reload. When disabled, no new commands are served until the reload is done.", "yes" },
+
+    { "LowMemoryReload", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "Let the scans using the old database finish before loading the new one on a reload,\nso that the two databases are never in memory at the same time. No new commands\nare served until the reload is done.", "no" },
+
+    { "BackgroundStartupLoad", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "Open the sockets and accept the connections at startup, before the database is loaded.\nThe database is loaded in a separate thread and the commands received meanwhile\nare served once it's ready. Ignored with WorkerProcesses.", "yes" },
+
+    { "LowMemoryReloadWait", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 60, NULL, 0, OPT_CLAMD, "With LowMemoryReload, the longest time (in seconds) to wait for the running scans.\nThe database is reloaded anyway when they take longer. 0 waits as long as needed.", "60" },
+
     { "DisableCache", "disable-cache", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option allows you to disable clamd's caching feature.", "no" },
 
+    { "CacheFile", "cache-file", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Save the cache of clean files to this file when the engine is released (on reload or exit) and load it at startup.\nThe file is only reused if the databases and the engine settings didn't change.\nThe file allows skipping the scan of the files it lists, so it must not be writable by untrusted users.", "/var/lib/clamav/clamd.cache" },
+
+    { "ScanJournal", "journal", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Record the files found clean by CONTSCAN and MULTISCAN (clamd) or by clamscan in this file, together with their inode, size and\ntimestamps, and skip them as long as neither they nor the databases and the scan options changed.\nInfected files and files which couldn't be scanned are always scanned again.\nThe file allows skipping the scan of the files it lists, so it must not be writable by untrusted users.", "/var/lib/clamav/clamd.journal" },
+
+    { "CacheSize", "cache-size", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 65536, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the number of files remembered by the cache of clean files.", "65536" },
+
+    { "HashImageFile", "hash-image-file", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Keep the hash signatures (.hdb, .hsb, .mdb, .msb, .fp, .sfp, .imp) in this file and map it into memory,\nso that all the processes using the same file share one copy of them.\nThe file is rewritten when a database changes. It must not be writable by untrusted users.", "/var/lib/clamav/hashes.img" },
+
+    { "HugePages", "huge-pages", 0, CLOPT_TYPE_STRING, "^(no|transparent|explicit)$", -1, "no", 0, OPT_CLAMD | OPT_CLAMSCAN, "Back the memory holding the signature database with huge pages, which reduces TLB misses while scanning.\nPossible values:\n\tno - use regular pages\n\ttransparent - ask the kernel for transparent huge pages\n\texplicit - use the huge pages reserved with vm.nr_hugepages,\n\t\t falling back to transparent huge pages when they run out", "transparent" },
+
+    { "DatabaseLoadThreads", "database-load-threads", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Number of threads parsing the hash signature databases (.hdb, .hsb, .mdb, .msb, .fp, .sfp, .imp)\nwhile the databases are loaded, and building the pattern matchers afterwards. 0 disables the threads.", "4" },
+
+    { "SignatureShard", NULL, 0, CLOPT_TYPE_STRING, "^[0-9]+/[0-9]+$", -1, NULL, 0, OPT_CLAMD, "Only load the body signatures (.db, .ndb and .ldb files) of one shard out of\nseveral, given as INDEX/COUNT (e.g. 2/4). The signatures are spread over the\nshards by the hash of their names, so that every signature is loaded by exactly\none of COUNT daemons configured with the indexes 1 to COUNT; the hash and\nother signatures are loaded by all of them. A file is then infected if any of\nthe daemons finds it so.", "1/4" },
+
+    { "ACProfileFile", "ac-profile-file", 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Choose the parts of the body signatures which enter the pattern matcher and its\nprefilter by how rare their bytes are in the data described by this profile,\nbuilt with sigtool --build-ac-profile from a sample of the scanned files.\nThe profile only affects the speed of the scans, not their results.", "/var/lib/clamav/clamd.acprofile" },
+
+    { "LazyMatchers", "lazy-matchers", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Build the pattern matchers of the file type specific signatures (PE, ELF, Mach-O,\nPDF, ...) the first time a file of that type is scanned instead of at startup.\nThis shortens the startup and saves memory when some file types are never seen.", "no" },
+
     { "VirusEvent", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD, "Execute a command when a virus is found. In the command string %v will be\nreplaced with the virus name. Additionally, two environment variables will\nbe defined: $CLAM_VIRUSEVENT_FILENAME and $CLAM_VIRUSEVENT_VIRUSNAME.", "/usr/bin/mailx -s \"ClamAV VIRUS ALERT: %v\" alert < /dev/null" },
 
     { "ExitOnOOM", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "Stop the daemon when libclamav reports an out of memory condition.", "yes" },
@@ -395,7 +455,15 @@ const struct clam_option __clam_options[] = {
 
     { "MaxRecHWP3", "max-rechwp3", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, CLI_DEFAULT_MAXRECHWP3, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the maximum recursive calls to HWP3 parsing function.\nHWP3 files using more than this limit will be terminated and alert the user.\nScans will be unable to scan any HWP3 attachments if the recursive limit is reached.\nNegative values are not allowed.\nWARNING: setting this limit too high may result in severe damage or impact performance.", "16" },
 
-    { "TimeLimit", "timelimit", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMSCAN, "This clamscan option is currently for testing only. It sets the engine parameter CL_ENGINE_TIME_LIMIT. The value is in milliseconds.", "0" },
+    { "TimeLimit", "timelimit", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMSCAN, "This clamscan option is an alias of --max-scantime, kept for compatibility. The value is in milliseconds.", "0" },
+
+    { "MaxScanTime", "max-scantime", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the maximum amount of time (in milliseconds) a single file may take to scan,\nthe objects found inside it included. Bytecode signatures don't run past it either.\nWhen the limit is reached the scan is abandoned and reported as an error, or as\nHeuristic.Limits.Exceeded when BlockMax is enabled.\nThe value of 0 disables the limit.", "120000" },
+
+    { "MaxScanCPUTime", "max-scan-cputime", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the maximum CPU time (in milliseconds) a single file may take to scan,\nsummed over the threads taking part in it (see ArchiveScanThreads).\nIt is enforced like MaxScanTime.\nThe value of 0 disables the limit.", "60000" },
+
+    { "MaxInflatedSize", "max-inflated-size", 0, CLOPT_TYPE_SIZE, MATCH_SIZE, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the maximum amount of data extracted from archives and\ncompressed files (zip, tar, gzip, bzip2, xz, 7z, PDF streams...) while a single\nfile is scanned. Unlike MaxScanSize it also counts the data that is extracted but never scanned.\nIt is enforced like MaxScanTime.\nThe value of 0 disables the limit.", "1G" },
+
+    { "MaxDecompressMemory", NULL, 0, CLOPT_TYPE_SIZE, MATCH_SIZE, 0, NULL, 0, OPT_CLAMD, "This option sets the maximum amount of memory the decompressors and the\nextracted files held in memory may use at once, across all the scans in progress\n(7z dictionaries and solid blocks, LZMA dictionaries, extracted files...).\nA file that doesn't fit goes to a temporary file; a scan that needs a dictionary\nwaits up to two seconds for the other scans to free some memory, then skips\nthe compressed data.\nThe value of 0 disables the limit.", "2G" },
 
     { "PCREMatchLimit", "pcre-match-limit", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, CLI_DEFAULT_PCRE_MATCH_LIMIT, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the maximum calls to the PCRE match function during an instance of regex matching.\nInstances using more than this limit will be terminated and alert the user but the scan will continue.\nFor more information on match_limit, see the PCRE documentation.\nNegative values are not allowed.\nWARNING: setting this limit too high may severely impact performance.", "10000" },
 
@@ -403,6 +471,18 @@ const struct clam_option __clam_options[] = {
 
     { "PCREMaxFileSize", "pcre-max-filesize", 0, CLOPT_TYPE_SIZE, MATCH_SIZE, CLI_DEFAULT_PCRE_MAX_FILESIZE, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the maximum filesize for which PCRE subsigs will be executed.\nFiles exceeding this limit will not have PCRE subsigs executed unless a subsig is encompassed to a smaller buffer.\nNegative values are not allowed.\nSetting this value to zero disables the limit.\nWARNING: setting this limit too high or disabling it may severely impact performance.", "25M" },
 
+    { "ExtractMaxMemSize", "extract-max-mem-size", 0, CLOPT_TYPE_SIZE, MATCH_SIZE, CLI_DEFAULT_EXTRACT_MEM, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Files extracted from archives and compressed files up to this size are kept in\nmemory and scanned without a temporary file. Larger ones are moved to\nTemporaryDirectory. The value of 0 disables the limit, extracted files are\nthen only bounded by MaxFileSize. ForceToDisk always uses temporary files.", "4M" },
+
+    { "ArchiveScanThreads", "archive-scan-threads", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the number of threads scanning the members of a single large\nzip or tar archive (16 MB or more) while it is unpacked. Members are reported\nin archive order and the scan stops at the first infected one unless AllMatch\nis enabled.\nThese threads are started by each scan on top of the regular ones.\nThe value of 0 disables parallel archive scanning.", "4" },
+
+    { "ArchiveRiskOrder", "archive-risk-order", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Extract the members of zip archives that are the most likely to be malicious\n(executables, scripts, documents with macros, nested archives) first, so\nthat the scan of an infected archive ends sooner. The members are still\nreported by their position in the archive. This option has no effect when\nAllMatch is enabled.", "no" },
+
+    { "FusedPatternScan", "fused-pattern-scan", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "Match the static body signatures in the same pass over the data as the\nother ones instead of a pass of their own. When a file matches several\nsignatures, a different one may be reported first.", "yes" },
+    { "MergedScanTarget", "merged-scan-target", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, -1, NULL, FLAG_MULTIPLE, OPT_CLAMD | OPT_CLAMSCAN, "Match the body signatures of this target type (as in the Target field of the\nsignatures: 1 = PE, 3 = HTML, 4 = Mail...) and the generic ones in a single\npass over the files of the type instead of a pass for each. It takes the memory\nof another matcher per target and doesn't apply to the targets left by\nLazyMatchers. This option can be used multiple times.", "1\n3\n4" },
+    { "DecompressThreads", "decompress-threads", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the number of threads decoding the independent blocks of a\nsingle xz file, such as those written by xz -T, or the blocks of a bzip2\nfile larger than 1 MB. The data is still scanned in order, up to twice as\nmany blocks as threads are held in memory.\nThese threads are started by each scan on top of the regular ones.\nThe value of 0 disables parallel decompression.", "4" },
+
+    { "ParallelScanThreads", "parallel-scan-threads", 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD | OPT_CLAMSCAN, "This option sets the number of threads used to scan the raw content of a single large file (32 MB or more).\nThese threads are started by each scan on top of the regular ones, so the value should be kept low when many files are scanned concurrently.\nValues of 0 and 1 disable parallel scanning.", "4" },
+
     /* OnAccess settings */
     { "ScanOnAccess", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, -1, NULL, 0, OPT_CLAMD, "This option enables on-access scanning (Linux only)", "no" },
 
@@ -416,6 +496,14 @@ const struct clam_option __clam_options[] = {
 
     { "OnAccessMaxFileSize", NULL, 0, CLOPT_TYPE_SIZE, MATCH_SIZE, 5242880, NULL, 0, OPT_CLAMD, "Files larger than this value will not be scanned in on access.", "5M" },
 
+    { "OnAccessMaxThreads", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 5, NULL, 0, OPT_CLAMD, "Number of threads scanning the files on access. A slow file only holds up\nthe processes waiting for it.", "10" },
+
+    { "OnAccessCacheSize", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 16384, NULL, 0, OPT_CLAMD, "Number of files remembered as clean by the on-access scanner. Opening an unchanged\nfile again needs no scan, the file is recognized by its inode, size and times.\nThe same file opened by several processes at once is scanned once. 0 disables the cache.", "65536" },
+
+    { "OnAccessCloseWriteDelay", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_CLAMD, "Scan a written file in the background this many milliseconds after it was\nclosed, instead of at once. Further closes of the same file within the delay\nmerge into a single scan. The scan runs at idle I/O priority and its result\nis cached (see OnAccessCacheSize), so the opens of the file that follow are\nallowed or, with OnAccessPrevention, denied without a scan. 0 disables it.", "2000" },
+
+    { "OnAccessQuarantineDirectory", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_CLAMD, "Move the files found infected by a deferred scan (OnAccessCloseWriteDelay)\nto this directory. It must be on the same filesystem as the files.", "/var/lib/clamav/quarantine" },
+
     { "OnAccessDisableDDD", "disable-ddd", 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "This option toggles the dynamic directory determination system for on-access scanning (Linux only).", "no" },
 
     { "OnAccessPrevention", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_CLAMD, "This option changes fanotify behavior to prevent access attempts on malicious files instead of simply notifying the user (On Access scan only).", "yes" },
@@ -454,6 +542,8 @@ const struct clam_option __clam_options[] = {
 
     { "TestDatabases", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 1, NULL, 0, OPT_FRESHCLAM, "With this option enabled, freshclam will attempt to load new\ndatabases into memory to make sure they are properly handled\nby libclamav before replacing the old ones.", "yes" },
 
+    { "TestDatabasesFull", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_FRESHCLAM, "By default TestDatabases only parses and checks the signatures, without\nbuilding the matchers or compiling the bytecodes to native code. With this\noption enabled, the new databases are loaded completely, using as much\nmemory as in clamd.", "no" },
+
     { "CompressLocalDatabase", NULL, 0, CLOPT_TYPE_BOOL, MATCH_BOOL, 0, NULL, 0, OPT_FRESHCLAM, "By default freshclam will keep the local databases (.cld) uncompressed to\nmake their handling faster. With this option you can enable the compression.\nThe change will take effect with the next database update.", "" },
 
     { "ExtraDatabase", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, FLAG_MULTIPLE, OPT_FRESHCLAM, "Download an additional 3rd party signature database distributed through\nthe ClamAV mirrors. This option can be used multiple times.\nHere you can find a list of available databases:\nhttp://www.clamav.net/download/cvd/3rdparty", "dbname1\ndbname2" },
@@ -485,6 +575,8 @@ const struct clam_option __clam_options[] = {
 
     { "ReceiveTimeout", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 30, NULL, 0, OPT_FRESHCLAM, "Timeout in seconds when reading from database server.", "30" },
 
+    { "ConcurrentDatabases", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 1, NULL, 0, OPT_FRESHCLAM, "Number of databases updated at the same time, each in its own process with\none connection to the mirrors. The value of 1 updates them one by one.", "4" },
+
     { "SubmitDetectionStats", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_FRESHCLAM, "When enabled freshclam will submit statistics to the ClamAV Project about\nthe latest virus detections in your environment. The ClamAV maintainers\nwill then use this data to determine what types of malware are the most\ndetected in the field and in what geographic area they are.\nFreshclam will connect to clamd in order to get recent statistics.", "/path/to/clamd.conf" },
 
     { "DetectionStatsCountry", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_FRESHCLAM, "Country of origin of malware/detection statistics (for statistical\npurposes only). The statistics collector at ClamAV.net will look up\nyour IP address to determine the geographical origin of the malware\nreported by your installation. If this installation is mainly used to\nscan data which comes from a different location, please enable this\noption and enter a two-letter code (see http://www.iana.org/domains/root/db/)\nof the country of origin.", "country-code" },
@@ -519,7 +611,13 @@ const struct clam_option __clam_options[] = {
 
     /* Milter specific options */
 
-    { "ClamdSocket", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, FLAG_MULTIPLE, OPT_MILTER, "Define the clamd socket to connect to for scanning.\nThis option is mandatory! Syntax:\n  ClamdSocket unix:path\n  ClamdSocket tcp:host:port\nThe first syntax specifies a local unix socket (needs an absolute path) e.g.:\n  ClamdSocket unix:/var/run/clamd/clamd.socket\nThe second syntax specifies a tcp local or remote tcp socket: the\nhost can be a hostname or an ip address; the \":port\" field is only required\nfor IPv6 addresses, otherwise it defaults to 3310\n  ClamdSocket tcp:192.168.0.1\nThis option can be repeated several times with different sockets or even\nwith the same socket: clamd servers will be selected in a round-robin fashion.", "tcp:scanner.mydomain:7357" },
+    { "ClamdSocket", NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, FLAG_MULTIPLE, OPT_MILTER, "Define the clamd socket to connect to for scanning.\nThis option is mandatory! Syntax:\n  ClamdSocket unix:path\n  ClamdSocket tcp:host:port\nThe first syntax specifies a local unix socket (needs an absolute path) e.g.:\n  ClamdSocket unix:/var/run/clamd/clamd.socket\nThe second syntax specifies a tcp local or remote tcp socket: the\nhost can be a hostname or an ip address; the \":port\" field is only required\nfor IPv6 addresses, otherwise it defaults to 3310\n  ClamdSocket tcp:192.168.0.1\nThis option can be repeated several times with different sockets or even\nwith the same socket: the least loaded clamd server is selected, based on\nits queue length and on how fast it has been replying.", "tcp:scanner.mydomain:7357" },
+
+    { "ClamdSessionTimeout", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 20, NULL, 0, OPT_MILTER, "Connections to clamd are kept open (in IDSESSION mode) and reused for the\nfollowing messages for up to this many seconds of inactivity.\nThis value should be lower than IdleTimeout in clamd.conf.\nThe value of 0 opens a new connection for each message.", "20" },
+
+    { "StreamSpoolSize", NULL, 0, CLOPT_TYPE_SIZE, MATCH_SIZE, 16777216, NULL, 0, OPT_MILTER, "Messages are buffered in memory and streamed to clamd in the background, so\nthat the MTA doesn't wait on clamd while sending the message. This is the\ntotal amount of memory shared by all the messages in transit; when it's\nfull the MTA has to wait.\nThe value of 0 disables buffering.", "32M" },
+
+    { "VerdictCacheSize", NULL, 0, CLOPT_TYPE_NUMBER, MATCH_NUMBER, 0, NULL, 0, OPT_MILTER, "Remember the clamd verdict for this many recently seen message bodies, so that\nthe copies of the same message sent in separate SMTP transactions (e.g. bulk\nmail) are only scanned once. A cached verdict is only used as long as the\nclamd servers are running the same signature version.\nThe value of 0 disables the cache.", "10000" },
 
     { "MilterSocket",NULL, 0, CLOPT_TYPE_STRING, NULL, -1, NULL, 0, OPT_MILTER, "Define the interface through which we communicate with sendmail.\nThis option is mandatory! Possible formats are:\n[[unix|local]:]/path/to/file - to specify a unix domain socket;\ninet:port@[hostname|ip-address] - to specify an ipv4 socket;\ninet6:port@[hostname|ip-address] - to specify an ipv6 socket.", "/tmp/clamav-milter.socket\ninet:7357" },
 
@@ -272,6 +272,24 @@ static int logg_open(void)
     return 0;
 }
 
+#ifdef CL_THREAD_SAFE
+/* Asynchronous logging (logg_async_start()): logg() appends the lines for
+ * the log file to a bounded buffer and a writer thread swaps it with a
+ * second one and writes it out in one go, flushing once per batch. When
+ * the buffer is full, errors and warnings wait for the writer, the other
+ * messages are dropped and counted in the log. The foreground and syslog
+ * output don't go through the buffer. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued, space;
+    pthread_t thread;
+    char *buf, *spare;
+    size_t len, size;
+    unsigned long dropped;
+    int running, stop, reopen;
+} logg_q = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+#endif
+
 void logg_close(void)
 {
 #if defined(USE_SYSLOG) && !defined(C_AIX)
@@ -280,6 +298,16 @@ void logg_close(void)
 #endif
 
 #ifdef CL_THREAD_SAFE
+    /* the writer closes the file after what's queued before */
+    pthread_mutex_lock(&logg_q.mutex);
+    if(logg_q.running) {
+	logg_q.reopen = 1;
+	pthread_cond_signal(&logg_q.queued);
+	pthread_mutex_unlock(&logg_q.mutex);
+	return;
+    }
+    pthread_mutex_unlock(&logg_q.mutex);
+
     pthread_mutex_lock(&logg_mutex);
 #endif
     if(logg_fp) {
@@ -310,16 +338,252 @@ void logg_close(void)
  *  $	  no	   mprintf     no	yes   LOG_DEBUG
  *  none  yes	   mprintf     yes	yes   LOG_INFO
  */
+/* called with logg_mutex held */
+static int logg_fopen(void)
+{
+	mode_t old_umask;
+#ifdef F_WRLCK
+	struct flock fl;
+#endif
+
+    old_umask = umask(0037);
+    if((logg_fp = fopen(logg_file, "at")) == NULL) {
+        umask(old_umask);
+        printf("ERROR: Can't open %s in append mode (check permissions!).\n", logg_file);
+        return -1;
+    } else umask(old_umask);
+
+#ifdef F_WRLCK
+    if(logg_lock) {
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        if(fcntl(fileno(logg_fp), F_SETLK, &fl) == -1) {
+#ifdef EOPNOTSUPP
+            if(errno == EOPNOTSUPP)
+                printf("WARNING: File locking not supported (NFS?)\n");
+            else
+#endif
+            {
+                printf("ERROR: %s is locked by another process\n", logg_file);
+                return -1;
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+static void logg_echo(char *buff)
+{
+    if(logg_foreground) {
+	if(buff[0] != '#')
+	    mprintf("%s", buff);
+    }
+
+#if defined(USE_SYSLOG) && !defined(C_AIX)
+    if(logg_syslog) {
+	cli_chomp(buff);
+	if(buff[0] == '!') {
+	    syslog(LOG_ERR, "%s", buff + 1);
+	} else if(buff[0] == '^') {
+	    if(!logg_nowarn)
+		syslog(LOG_WARNING, "%s", buff + 1);
+	} else if(buff[0] == '*' || buff[0] == '$') {
+	    syslog(LOG_DEBUG, "%s", buff + 1);
+	} else if(buff[0] == '#' || buff[0] == '~') {
+	    syslog(LOG_INFO, "%s", buff + 1);
+	} else syslog(LOG_INFO, "%s", buff);
+
+    }
+#endif
+}
+
+#ifdef CL_THREAD_SAFE
+static void *logg_writer(void *arg)
+{
+	char *batch;
+	size_t len;
+	unsigned long dropped;
+	int reopen;
+
+    UNUSEDPARAM(arg);
+    pthread_mutex_lock(&logg_q.mutex);
+    while(1) {
+	while(!logg_q.len && !logg_q.dropped && !logg_q.reopen && !logg_q.stop)
+	    pthread_cond_wait(&logg_q.queued, &logg_q.mutex);
+	if(!logg_q.len && !logg_q.dropped && !logg_q.reopen)
+	    break;
+	batch = logg_q.buf;
+	logg_q.buf = logg_q.spare;
+	logg_q.spare = batch;
+	len = logg_q.len;
+	dropped = logg_q.dropped;
+	reopen = logg_q.reopen;
+	logg_q.len = 0;
+	logg_q.dropped = 0;
+	logg_q.reopen = 0;
+	pthread_cond_broadcast(&logg_q.space);
+	pthread_mutex_unlock(&logg_q.mutex);
+
+	pthread_mutex_lock(&logg_mutex);
+	if(len || dropped) {
+	    logg_open();
+	    if(!logg_fp && logg_file && logg_fopen() == -1 && logg_fp) {
+		fclose(logg_fp);
+		logg_fp = NULL;
+	    }
+	    if(logg_fp) {
+		fwrite(batch, 1, len, logg_fp);
+		if(dropped)
+		    fprintf(logg_fp, "WARNING: %lu log messages dropped, the log buffer was full\n", dropped);
+		fflush(logg_fp);
+	    }
+	}
+	if(reopen && logg_fp) {
+	    fclose(logg_fp);
+	    logg_fp = NULL;
+	}
+	pthread_mutex_unlock(&logg_mutex);
+
+	pthread_mutex_lock(&logg_q.mutex);
+    }
+    pthread_mutex_unlock(&logg_q.mutex);
+    return NULL;
+}
+
+/* -1: not queued, the caller writes the line itself */
+static int logg_queue(const char *buff)
+{
+	char timestr[32];
+	const char *prefix = "", *msg = buff;
+	size_t tlen = 0, plen, mlen, need;
+	int urgent = 0;
+
+    if(*buff == '!') {
+	prefix = "ERROR: ";
+	msg++;
+	urgent = 1;
+    } else if(*buff == '^') {
+	if(logg_nowarn)
+	    return 0;
+	prefix = "WARNING: ";
+	msg++;
+	urgent = 1;
+    } else if(*buff == '*' || *buff == '$' || *buff == '#' || *buff == '~') {
+	msg++;
+    }
+    if(logg_time && ((*buff != '*') || logg_verbose)) {
+	time_t currtime;
+
+	time(&currtime);
+	cli_ctime(&currtime, timestr, sizeof(timestr) - 4);
+	/* cut trailing \n */
+	tlen = strlen(timestr);
+	if(tlen && timestr[tlen - 1] == '\n')
+	    tlen--;
+	memcpy(timestr + tlen, " -> ", 4);
+	tlen += 4;
+    }
+    plen = strlen(prefix);
+    mlen = strlen(msg);
+
+    pthread_mutex_lock(&logg_q.mutex);
+    if(!logg_q.running) {
+	pthread_mutex_unlock(&logg_q.mutex);
+	return -1;
+    }
+    need = tlen + plen + mlen;
+    if(need > logg_q.size)
+	mlen -= need - logg_q.size, need = logg_q.size;
+    if(need > logg_q.size - logg_q.len) {
+	if(!urgent) {
+	    logg_q.dropped++;
+	    pthread_mutex_unlock(&logg_q.mutex);
+	    return 0;
+	}
+	while(logg_q.running && need > logg_q.size - logg_q.len)
+	    pthread_cond_wait(&logg_q.space, &logg_q.mutex);
+	if(!logg_q.running) {
+	    pthread_mutex_unlock(&logg_q.mutex);
+	    return -1;
+	}
+    }
+    memcpy(logg_q.buf + logg_q.len, timestr, tlen);
+    memcpy(logg_q.buf + logg_q.len + tlen, prefix, plen);
+    memcpy(logg_q.buf + logg_q.len + tlen + plen, msg, mlen);
+    if(!logg_q.len)
+	pthread_cond_signal(&logg_q.queued);
+    logg_q.len += need;
+    pthread_mutex_unlock(&logg_q.mutex);
+    return 0;
+}
+#endif
+
+int logg_async_start(size_t size)
+{
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&logg_q.mutex);
+    if(logg_q.running || !size) {
+	pthread_mutex_unlock(&logg_q.mutex);
+	return logg_q.running ? 0 : -1;
+    }
+    logg_q.buf = malloc(size);
+    logg_q.spare = malloc(size);
+    if(!logg_q.buf || !logg_q.spare) {
+	free(logg_q.buf);
+	free(logg_q.spare);
+	logg_q.buf = logg_q.spare = NULL;
+	pthread_mutex_unlock(&logg_q.mutex);
+	return -1;
+    }
+    logg_q.size = size;
+    logg_q.len = 0;
+    logg_q.dropped = 0;
+    logg_q.stop = logg_q.reopen = 0;
+    if(pthread_create(&logg_q.thread, NULL, logg_writer, NULL)) {
+	free(logg_q.buf);
+	free(logg_q.spare);
+	logg_q.buf = logg_q.spare = NULL;
+	pthread_mutex_unlock(&logg_q.mutex);
+	return -1;
+    }
+    logg_q.running = 1;
+    pthread_mutex_unlock(&logg_q.mutex);
+    return 0;
+#else
+    UNUSEDPARAM(size);
+    return -1;
+#endif
+}
+
+/* writes out what's queued and goes back to synchronous logging */
+void logg_async_stop(void)
+{
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&logg_q.mutex);
+    if(!logg_q.running) {
+	pthread_mutex_unlock(&logg_q.mutex);
+	return;
+    }
+    logg_q.running = 0;
+    logg_q.stop = 1;
+    pthread_cond_signal(&logg_q.queued);
+    pthread_cond_broadcast(&logg_q.space);
+    pthread_mutex_unlock(&logg_q.mutex);
+
+    pthread_join(logg_q.thread, NULL);
+    free(logg_q.buf);
+    free(logg_q.spare);
+    logg_q.buf = logg_q.spare = NULL;
+#endif
+}
+
 int logg(const char *str, ...)
 {
 	va_list args;
 	char buffer[1025], *abuffer = NULL, *buff;
 	time_t currtime;
 	size_t len;
-	mode_t old_umask;
-#ifdef F_WRLCK
-	struct flock fl;
-#endif
 
     if ((*str == '$' && logg_verbose < 2) ||
 	(*str == '*' && !logg_verbose))
@@ -344,46 +608,25 @@ int logg(const char *str, ...)
     buff[len - 1] = 0;
 
 #ifdef CL_THREAD_SAFE
+    if(logg_file && !logg_queue(buff)) {
+	logg_echo(buff);
+	if(len > sizeof(buffer))
+	    free(abuffer);
+	return 0;
+    }
+
     pthread_mutex_lock(&logg_mutex);
 #endif
 
     logg_open();
 
-    if(!logg_fp && logg_file) {
-        old_umask = umask(0037);
-        if((logg_fp = fopen(logg_file, "at")) == NULL) {
-            umask(old_umask);
+    if(!logg_fp && logg_file && logg_fopen() == -1) {
 #ifdef CL_THREAD_SAFE
-            pthread_mutex_unlock(&logg_mutex);
-#endif
-            printf("ERROR: Can't open %s in append mode (check permissions!).\n", logg_file);
-            if(len > sizeof(buffer))
-                free(abuffer);
-            return -1;
-        } else umask(old_umask);
-
-#ifdef F_WRLCK
-        if(logg_lock) {
-            memset(&fl, 0, sizeof(fl));
-            fl.l_type = F_WRLCK;
-            if(fcntl(fileno(logg_fp), F_SETLK, &fl) == -1) {
-#ifdef EOPNOTSUPP
-                if(errno == EOPNOTSUPP)
-                    printf("WARNING: File locking not supported (NFS?)\n");
-                else
-#endif
-                {
-#ifdef CL_THREAD_SAFE
-                    pthread_mutex_unlock(&logg_mutex);
-#endif
-                    printf("ERROR: %s is locked by another process\n", logg_file);
-                    if(len > sizeof(buffer))
-                    free(abuffer);
-                    return -1;
-                }
-            }
-        }
+        pthread_mutex_unlock(&logg_mutex);
 #endif
+        if(len > sizeof(buffer))
+            free(abuffer);
+        return -1;
     }
 
 	if(logg_fp) {
@@ -418,27 +661,7 @@ int logg(const char *str, ...)
 		fflush(logg_fp);
 	}
 
-    if(logg_foreground) {
-	if(buff[0] != '#')
-	    mprintf("%s", buff);
-    }
-
-#if defined(USE_SYSLOG) && !defined(C_AIX)
-    if(logg_syslog) {
-	cli_chomp(buff);
-	if(buff[0] == '!') {
-	    syslog(LOG_ERR, "%s", buff + 1);
-	} else if(buff[0] == '^') {
-	    if(!logg_nowarn)
-		syslog(LOG_WARNING, "%s", buff + 1);
-	} else if(buff[0] == '*' || buff[0] == '$') {
-	    syslog(LOG_DEBUG, "%s", buff + 1);
-	} else if(buff[0] == '#' || buff[0] == '~') {
-	    syslog(LOG_INFO, "%s", buff + 1);
-	} else syslog(LOG_INFO, "%s", buff);
-
-    }
-#endif
+    logg_echo(buff);
 
 #ifdef CL_THREAD_SAFE
     pthread_mutex_unlock(&logg_mutex);
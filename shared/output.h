@@ -46,6 +46,8 @@ int logg(const char *str, ...);
 #endif
 
 void logg_close(void);
+int logg_async_start(size_t size);
+void logg_async_stop(void);
 extern short int logg_verbose, logg_nowarn, logg_lock, logg_time, logg_noflush, logg_rotate;
 extern off_t logg_size;
 extern const char *logg_file;
@@ -0,0 +1,199 @@
+/*
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/* Shared memory submission ring for local clamd clients.
+ *
+ * The client creates a sealed memfd laid out as a shmring_header, nslots
+ * shmring_slot entries and nslots data areas of slot_size bytes each, and
+ * hands it to clamd with zSHMRING\0 inside an IDSESSION (the memfd travels
+ * as ancillary data, like with FILDES). After clamd replied "<id>: SHMRING
+ * OK" the socket only carries doorbell bytes: the client writes one after
+ * posting slots, clamd writes one after completing slots.
+ *
+ * Slot states only move FREE -> POSTED (client), POSTED -> BUSY -> DONE
+ * (clamd), DONE -> FREE (client), so every transition has a single writer.
+ */
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+#include "libclamav/cltypes.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(F_SEAL_SHRINK) && defined(MFD_ALLOW_SEALING)
+#define SHMRING_SUPPORTED 1
+#endif
+
+#define SHMRING_MAGIC 0x52534c43 /* "CLSR" */
+#define SHMRING_VERSION 1
+#define SHMRING_RESULT 64
+
+enum shmring_state {
+    SHMRING_FREE = 0,
+    SHMRING_POSTED,
+    SHMRING_BUSY,
+    SHMRING_DONE
+};
+
+enum shmring_status {
+    SHMRING_CLEAN = 0,
+    SHMRING_VIRUS,
+    SHMRING_ERROR
+};
+
+struct shmring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t reserved;
+    uint64_t slot_size; /* bytes of data for each slot */
+    uint64_t data_off; /* start of the data areas, page aligned */
+};
+
+struct shmring_slot {
+    volatile uint32_t state;
+    uint32_t status; /* enum shmring_status, valid when DONE */
+    uint64_t cookie; /* opaque to clamd */
+    uint64_t length; /* bytes of data posted */
+    char result[SHMRING_RESULT]; /* virus name or error message */
+};
+
+static inline uint64_t shmring_data_off(uint32_t nslots)
+{
+    uint64_t off = sizeof(struct shmring_header) + (uint64_t)nslots * sizeof(struct shmring_slot);
+    return (off + 4095) & ~(uint64_t)4095;
+}
+
+#ifdef SHMRING_SUPPORTED
+/* client side */
+
+struct shmring_client {
+    int fd;
+    char *base;
+    size_t size;
+    struct shmring_header *hdr;
+    struct shmring_slot *slots;
+};
+
+static inline int shmring_client_init(struct shmring_client *c, uint32_t nslots, uint64_t slot_size)
+{
+    uint64_t data_off = shmring_data_off(nslots);
+
+    memset(c, 0, sizeof(*c));
+    c->size = data_off + nslots * slot_size;
+    if ((c->fd = memfd_create("clamd-shmring", MFD_ALLOW_SEALING)) == -1)
+	return -1;
+    if (ftruncate(c->fd, c->size) == -1 || fcntl(c->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) == -1 ||
+	(c->base = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0)) == MAP_FAILED) {
+	close(c->fd);
+	return -1;
+    }
+    c->hdr = (struct shmring_header *)c->base;
+    c->slots = (struct shmring_slot *)(c->base + sizeof(*c->hdr));
+    c->hdr->magic = SHMRING_MAGIC;
+    c->hdr->version = SHMRING_VERSION;
+    c->hdr->nslots = nslots;
+    c->hdr->slot_size = slot_size;
+    c->hdr->data_off = data_off;
+    return 0;
+}
+
+/* send zSHMRING\0 with the memfd, must be inside an IDSESSION */
+static inline int shmring_client_attach(const struct shmring_client *c, int sockd)
+{
+    static char cmd[] = "zSHMRING\0x";
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+	unsigned char buff[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr hdr;
+    } b;
+    struct iovec iov[1];
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = cmd;
+    iov[0].iov_len = sizeof(cmd) - 1;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = b.buff;
+    msg.msg_controllen = sizeof(b.buff);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), &c->fd, sizeof(int));
+    return sendmsg(sockd, &msg, 0) == (ssize_t)iov[0].iov_len ? 0 : -1;
+}
+
+/* copy data into a free slot and post it, returns the slot number or -1 if
+ * all slots are in use; write a doorbell byte to the socket afterwards */
+static inline int shmring_client_post(struct shmring_client *c, const void *data, size_t len, uint64_t cookie)
+{
+    uint32_t i;
+
+    if (len > c->hdr->slot_size)
+	return -1;
+    for (i = 0; i < c->hdr->nslots; i++) {
+	struct shmring_slot *slot = &c->slots[i];
+	if (slot->state != SHMRING_FREE)
+	    continue;
+	memcpy(c->base + c->hdr->data_off + i * c->hdr->slot_size, data, len);
+	slot->cookie = cookie;
+	slot->length = len;
+	__sync_synchronize();
+	slot->state = SHMRING_POSTED;
+	return i;
+    }
+    return -1;
+}
+
+/* returns the next completed slot at or after *from, or NULL; the caller
+ * reads status/result/cookie and then frees it with shmring_client_release() */
+static inline struct shmring_slot *shmring_client_done(struct shmring_client *c, uint32_t *from)
+{
+    for (; *from < c->hdr->nslots; (*from)++) {
+	if (c->slots[*from].state == SHMRING_DONE) {
+	    __sync_synchronize();
+	    return &c->slots[(*from)++];
+	}
+    }
+    return NULL;
+}
+
+static inline void shmring_client_release(struct shmring_slot *slot)
+{
+    __sync_synchronize();
+    slot->state = SHMRING_FREE;
+}
+
+static inline void shmring_client_free(struct shmring_client *c)
+{
+    munmap(c->base, c->size);
+    close(c->fd);
+}
+#endif
+
+#endif
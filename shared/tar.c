@@ -115,3 +115,128 @@ int tar_addfile(int fd, gzFile gzs, const char *file)
 
     return 0;
 }
+
+/* writes the header and the data of a member read from the tar stream src,
+ * whose header was just read with tar_nextfile() */
+int tar_copyfile(int fd, gzFile gzs, gzFile src, const char *file, unsigned int size)
+{
+	struct tar_header hdr;
+	unsigned char buff[FILEBUFF], *pt;
+	unsigned int i, chksum = 0, pad;
+	int bytes;
+
+
+    memset(&hdr, 0, TARBLK);
+    strncpy(hdr.name, file, 100);
+    hdr.name[99]='\0';
+    snprintf(hdr.size, 12, "%o", size);
+    pt = (unsigned char *) &hdr;
+    for(i = 0; i < TARBLK; i++)
+	chksum += *pt++;
+    snprintf(hdr.chksum, 8, "%06o", chksum + 256);
+
+    if(gzs) {
+	if(!gzwrite(gzs, &hdr, TARBLK))
+	    return -1;
+    } else {
+	if(write(fd, &hdr, TARBLK) != TARBLK)
+	    return -1;
+    }
+
+    pad = size % TARBLK ? TARBLK - size % TARBLK : 0;
+    while(size) {
+	if((bytes = gzread(src, buff, size < FILEBUFF ? size : FILEBUFF)) <= 0)
+	    return -1;
+	size -= bytes;
+	if(gzs) {
+	    if(!gzwrite(gzs, buff, bytes))
+		return -1;
+	} else {
+	    if(write(fd, buff, bytes) != bytes)
+		return -1;
+	}
+    }
+
+    if(pad) {
+	if(gzseek(src, pad, SEEK_CUR) == -1)
+	    return -1;
+	memset(&hdr, 0, TARBLK);
+	if(gzs) {
+	    if(!gzwrite(gzs, &hdr, pad))
+		return -1;
+	} else {
+	    if(write(fd, &hdr, pad) == -1)
+		return -1;
+	}
+    }
+
+    return 0;
+}
+
+/* reads the next member header of the tar stream src: returns 1 with the
+ * name (101 bytes) and the size, 0 at the end of the archive and -1 on
+ * errors */
+int tar_nextfile(gzFile src, char *name, unsigned int *size)
+{
+	struct tar_header hdr;
+	char osize[13];
+	int bytes;
+
+
+    if(!(bytes = gzread(src, &hdr, TARBLK)) || (bytes == TARBLK && !hdr.name[0]))
+	return 0;
+    if(bytes != TARBLK)
+	return -1;
+
+    if(hdr.type[0] != '0' && hdr.type[0] != '\0')
+	return -1;
+
+    strncpy(name, hdr.name, 100);
+    name[100] = '\0';
+    if(strchr(name, '/'))
+	return -1;
+
+    strncpy(osize, hdr.size, 12);
+    osize[12] = '\0';
+    if(sscanf(osize, "%o", size) != 1)
+	return -1;
+
+    return 1;
+}
+
+/* skips the data of the member whose header was just read */
+int tar_skipfile(gzFile src, unsigned int size)
+{
+    if(size % TARBLK)
+	size += TARBLK - size % TARBLK;
+    return gzseek(src, size, SEEK_CUR) == -1 ? -1 : 0;
+}
+
+/* writes the data of the member whose header was just read to file */
+int tar_extractfile(gzFile src, const char *file, unsigned int size)
+{
+	unsigned char buff[FILEBUFF];
+	unsigned int pad;
+	int fd, bytes;
+
+
+    if((fd = open(file, O_WRONLY|O_CREAT|O_EXCL|O_BINARY, 0644)) == -1)
+	return -1;
+
+    pad = size % TARBLK ? TARBLK - size % TARBLK : 0;
+    while(size) {
+	if((bytes = gzread(src, buff, size < FILEBUFF ? size : FILEBUFF)) <= 0 || write(fd, buff, bytes) != bytes) {
+	    close(fd);
+	    unlink(file);
+	    return -1;
+	}
+	size -= bytes;
+    }
+
+    if(close(fd) == -1 || (pad && gzseek(src, pad, SEEK_CUR) == -1)) {
+	unlink(file);
+	return -1;
+    }
+
+    return 0;
+}
@@ -25,5 +25,9 @@
 #include <zlib.h>
 
 int tar_addfile(int fd, gzFile gzs, const char *file);
+int tar_copyfile(int fd, gzFile gzs, gzFile src, const char *file, unsigned int size);
+int tar_nextfile(gzFile src, char *name, unsigned int *size);
+int tar_skipfile(gzFile src, unsigned int size);
+int tar_extractfile(gzFile src, const char *file, unsigned int size);
 
 #endif
@@ -49,6 +49,10 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <libgen.h>
+#include <sys/time.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_TERMIOS_H
 #include <termios.h>
@@ -64,6 +68,7 @@
 
 #include "libclamav/clamav.h"
 #include "libclamav/matcher.h"
+#include "libclamav/matcher-ac.h"
 #include "libclamav/cvd.h"
 #include "libclamav/str.h"
 #include "libclamav/ole2_extract.h"
@@ -74,6 +79,7 @@
 #include "libclamav/readdb.h"
 #include "libclamav/others.h"
 #include "libclamav/pe.h"
+#include "libclamav/hashtab.h"
 
 #define MAX_DEL_LOOKAHEAD   5000
 
@@ -119,6 +125,7 @@ static const struct dblist_s {
     { "crb",   1 },
     { "cdb",   1 },
     { "imp",   1 },
+    { "bdb",   1 },
 
     { NULL,	    0 }
 };
@@ -955,8 +962,12 @@ static int build(const struct optstruct *opts)
 	if(!bc || hy) {
 	    for(i = 0; dblist[i].ext; i++) {
 		snprintf(dbfile, sizeof(dbfile), "%s.%s", dbname, dblist[i].ext);
-		if(dblist[i].count && !access(dbfile, R_OK))
-		    entries += countlines(dbfile);
+		if(dblist[i].count && !access(dbfile, R_OK)) {
+		    if(!strcmp(dblist[i].ext, "bdb"))
+			cl_countsigs(dbfile, CL_COUNTSIGS_UNOFFICIAL, &entries);
+		    else
+			entries += countlines(dbfile);
+		}
 	    }
 	}
 
@@ -1302,6 +1313,175 @@ static int build(const struct optstruct *opts)
     return ret;
 }
 
+static int compilesec(const char *dbfile, const char *ext, int mdb, FILE *out, unsigned int *sigs)
+{
+	FILE *fs;
+	char buffer[FILEBUFF], *tokens[6], *hash, *pt;
+	struct cli_bdb_sec sec;
+	struct cli_bdb_ent *ents = NULL, *ent;
+	char *names = NULL;
+	unsigned int count = 0, strsize = 0, line = 0, tokens_count, hlen;
+	unsigned long size, minfl, maxfl;
+	static const char zero[8];
+	int ret = -1;
+
+    if(!(fs = fopen(dbfile, "rb"))) {
+	mprintf("!compilesec: Can't open file %s\n", dbfile);
+	return -1;
+    }
+
+    while(fgets(buffer, sizeof(buffer), fs)) {
+	line++;
+	cli_chomp(buffer);
+	if(buffer[0] == '#' || !buffer[0])
+	    continue;
+
+	tokens_count = cli_strtokenize(buffer, ':', 6, (const char **) tokens);
+	if(tokens_count < 3 || tokens_count > 5)
+	    break;
+
+	hash = tokens[mdb ? 1 : 0];
+	hlen = strlen(hash) / 2;
+	if(hlen != 16 && hlen != 20 && hlen != 32)
+	    break;
+
+	minfl = tokens_count > 3 ? strtoul(tokens[3], &pt, 10) : 0;
+	if(tokens_count > 3 && (*pt || minfl >= CLI_BDB_NOMAXFL))
+	    break;
+	maxfl = tokens_count > 4 ? strtoul(tokens[4], &pt, 10) : CLI_BDB_NOMAXFL;
+	if(tokens_count > 4 && (*pt || maxfl >= CLI_BDB_NOMAXFL))
+	    break;
+
+	if(!mdb && !strcmp(tokens[1], "*")) {
+	    if(minfl < 73) {
+		mprintf("!compilesec: Minimum FLEVEL field must be at least 73 for wildcard size hash signatures\n");
+		break;
+	    }
+	    size = 0;
+	} else {
+	    size = strtoul(tokens[mdb ? 0 : 1], &pt, 10);
+	    if(*pt || !size || size >= 0xffffffff)
+		break;
+	}
+
+	if(!(count % 1024)) {
+	    if(!(ent = realloc(ents, (count + 1024) * sizeof(*ents)))) {
+		mprintf("!compilesec: Can't allocate memory\n");
+		goto done;
+	    }
+	    ents = ent;
+	}
+	if(!(pt = realloc(names, strsize + strlen(tokens[2]) + 1))) {
+	    mprintf("!compilesec: Can't allocate memory\n");
+	    goto done;
+	}
+	names = pt;
+
+	ent = &ents[count];
+	memset(ent, 0, sizeof(*ent));
+	if(!(pt = cli_hex2str(hash)))
+	    break;
+	memcpy(ent->hash, pt, hlen);
+	free(pt);
+	ent->type = (hlen == 16) ? CLI_HASH_MD5 : (hlen == 20) ? CLI_HASH_SHA1 : CLI_HASH_SHA256;
+	ent->size = le32_to_host(size);
+	ent->name = le32_to_host(strsize);
+	ent->minfl = le16_to_host(minfl);
+	ent->maxfl = le16_to_host(maxfl);
+	strcpy(names + strsize, tokens[2]);
+	strsize += strlen(tokens[2]) + 1;
+	count++;
+    }
+
+    if(!feof(fs)) {
+	mprintf("!compilesec: Malformed signature at line %u of %s\n", line, dbfile);
+	goto done;
+    }
+
+    memset(&sec, 0, sizeof(sec));
+    strncpy(sec.ext, ext, sizeof(sec.ext));
+    sec.count = le32_to_host(count);
+    sec.strsize = le32_to_host(strsize);
+    if(fwrite(&sec, sizeof(sec), 1, out) != 1 || (count && fwrite(ents, sizeof(*ents), count, out) != count)
+       || (strsize && fwrite(names, strsize, 1, out) != 1) || ((strsize & 7) && fwrite(zero, 8 - (strsize & 7), 1, out) != 1)) {
+	mprintf("!compilesec: Can't write section %s\n", ext);
+	goto done;
+    }
+    mprintf("Compiled %u signatures from %s\n", count, dbfile);
+    *sigs += count;
+    ret = 0;
+
+done:
+    fclose(fs);
+    free(ents);
+    free(names);
+    return ret;
+}
+
+static int compiledb(const struct optstruct *opts)
+{
+	const char *dbname = optget(opts, "compile-db")->strarg;
+	char dbfile[1024], bdbfile[1024];
+	struct cli_bdb_hdr hdr;
+	FILE *out;
+	unsigned int i, sections = 0, sigs = 0;
+	static const struct {
+	    const char *ext;
+	    int mdb;
+	} hashdbs[] = {
+	    { "hdb", 0 }, { "hsb", 0 }, { "hdu", 0 }, { "hsu", 0 },
+	    { "mdb", 1 }, { "msb", 1 }, { "mdu", 1 }, { "msu", 1 },
+	    { "fp",  0 }, { "sfp", 0 }, { "imp", 1 },
+	    { NULL,  0 }
+	};
+
+    snprintf(bdbfile, sizeof(bdbfile), "%s.bdb", dbname);
+    if(!(out = fopen(bdbfile, "wb"))) {
+	mprintf("!compiledb: Can't create %s\n", bdbfile);
+	return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    if(fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+	mprintf("!compiledb: Can't write to %s\n", bdbfile);
+	fclose(out);
+	unlink(bdbfile);
+	return -1;
+    }
+
+    for(i = 0; hashdbs[i].ext; i++) {
+	snprintf(dbfile, sizeof(dbfile), "%s.%s", dbname, hashdbs[i].ext);
+	if(access(dbfile, R_OK))
+	    continue;
+	if(compilesec(dbfile, hashdbs[i].ext, hashdbs[i].mdb, out, &sigs)) {
+	    fclose(out);
+	    unlink(bdbfile);
+	    return -1;
+	}
+	sections++;
+    }
+
+    if(!sections) {
+	mprintf("!compiledb: No hash databases found for %s\n", dbname);
+	fclose(out);
+	unlink(bdbfile);
+	return -1;
+    }
+
+    memcpy(hdr.magic, CLI_BDB_MAGIC, sizeof(hdr.magic));
+    hdr.version = le32_to_host(CLI_BDB_VERSION);
+    hdr.sections = le32_to_host(sections);
+    hdr.sigs = le32_to_host(sigs);
+    if(fseek(out, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, out) != 1 || fclose(out)) {
+	mprintf("!compiledb: Can't write to %s\n", bdbfile);
+	unlink(bdbfile);
+	return -1;
+    }
+
+    mprintf("%s created (%u signatures)\n", bdbfile, sigs);
+    return 0;
+}
+
 static int unpack(const struct optstruct *opts)
 {
 	char name[512], *dbdir;
@@ -1881,7 +2061,7 @@ static int maxlinelen(const char *file)
     return nmax + 1;
 }
 
-static int compare(const char *oldpath, const char *newpath, FILE *diff)
+static int comparefiles(const char *oldpath, const char *newpath, const char *name, FILE *diff)
 {
 	FILE *old, *new;
 	char *obuff, *nbuff, *tbuff, *pt, *omd5, *nmd5;
@@ -1932,7 +2112,7 @@ static int compare(const char *oldpath, const char *newpath, FILE *diff)
     if(l1 > CLI_DEFAULT_LSIG_BUFSIZE)
 	fprintf(diff, "#LSIZE %u\n", l1 + 32);
 
-    fprintf(diff, "OPEN %s\n", newpath);
+    fprintf(diff, "OPEN %s\n", name);
 
     if(!(new = fopen(newpath, "rb"))) {
 	mprintf("!compare: Can't open file %s for reading\n", newpath);
@@ -2031,8 +2211,8 @@ static int compare(const char *oldpath, const char *newpath, FILE *diff)
     free(obuff);
     free(tbuff);
     if(badxchg) {
-	fprintf(diff, "UNLINK %s\n", newpath);
-	fprintf(diff, "OPEN %s\n", newpath);
+	fprintf(diff, "UNLINK %s\n", name);
+	fprintf(diff, "OPEN %s\n", name);
 	rewind(new);
 	while(fgets(nbuff, l1, new)) {
 	    cli_chomp(nbuff);
@@ -2045,6 +2225,103 @@ static int compare(const char *oldpath, const char *newpath, FILE *diff)
     return 0;
 }
 
+/* write the records of a precompiled database as text lines */
+static int decodebdb(const char *path, const char *txtpath)
+{
+	STATBUF sb;
+	char *data, *text;
+	size_t len;
+	int fd, ret = -1;
+	FILE *fh;
+
+    if((fd = open(path, O_RDONLY|O_BINARY)) == -1 || FSTAT(fd, &sb) == -1) {
+	mprintf("!decodebdb: Can't open %s\n", path);
+	if(fd != -1)
+	    close(fd);
+	return -1;
+    }
+    if(!(data = malloc(sb.st_size + 1))) {
+	mprintf("!decodebdb: Can't allocate memory for %s\n", path);
+	close(fd);
+	return -1;
+    }
+    if(cli_readn(fd, data, sb.st_size) != sb.st_size) {
+	mprintf("!decodebdb: Can't read %s\n", path);
+	close(fd);
+	free(data);
+	return -1;
+    }
+    close(fd);
+
+    if(cdiff_bdb_decode(data, sb.st_size, &text, &len) == -1) {
+	mprintf("!decodebdb: %s is not a valid precompiled database\n", path);
+	free(data);
+	return -1;
+    }
+    free(data);
+
+    if((fh = fopen(txtpath, "wb"))) {
+	if(fwrite(text, 1, len, fh) == len && fclose(fh) != EOF)
+	    ret = 0;
+	else
+	    mprintf("!decodebdb: Can't write %s\n", txtpath);
+    } else {
+	mprintf("!decodebdb: Can't create %s\n", txtpath);
+    }
+    free(text);
+    return ret;
+}
+
+/* precompiled databases are diffed record by record, cdiff_apply()
+ * encodes the patched records back */
+static int comparebdb(const char *oldpath, const char *newpath, FILE *diff)
+{
+	char *omd5, *nmd5, *otxt = NULL, *ntxt;
+	int ret = -1;
+
+    if(!access(oldpath, R_OK) && (omd5 = cli_hashfile(oldpath, 1))) {
+	if(!(nmd5 = cli_hashfile(newpath, 1))) {
+	    mprintf("!compare: Can't get MD5 checksum of %s\n", newpath);
+	    free(omd5);
+	    return -1;
+	}
+	ret = strcmp(omd5, nmd5);
+	free(omd5);
+	free(nmd5);
+	if(!ret)
+	    return 0;
+	if(!(otxt = cli_gentemp(NULL)) || decodebdb(oldpath, otxt) == -1) {
+	    if(otxt)
+		unlink(otxt);
+	    free(otxt);
+	    return -1;
+	}
+    }
+
+    if(!(ntxt = cli_gentemp(NULL))) {
+	mprintf("!compare: Can't generate temporary name\n");
+	ret = -1;
+    } else {
+	ret = decodebdb(newpath, ntxt);
+	if(!ret)
+	    ret = comparefiles(otxt ? otxt : oldpath, ntxt, newpath, diff);
+	unlink(ntxt);
+	free(ntxt);
+    }
+    if(otxt) {
+	unlink(otxt);
+	free(otxt);
+    }
+    return ret;
+}
+
+static int compare(const char *oldpath, const char *newpath, FILE *diff)
+{
+    if(cli_strbcasestr(newpath, ".bdb"))
+	return comparebdb(oldpath, newpath, diff);
+    return comparefiles(oldpath, newpath, newpath, diff);
+}
+
 static int compareone(const struct optstruct *opts)
 {
     if(!opts->filename) {
@@ -3185,6 +3462,309 @@ static int testsigs(const struct optstruct *opts)
     return ret;
 }
 
+/* --profile-sigs: the hits come from the virus callback, the evaluations
+ * and their cost from the signature profile of the engine, sampled at a
+ * rate of 1 so that every evaluation is timed */
+struct profile_job {
+    struct cl_engine *engine;
+    char **files;
+    unsigned int nfiles, next;
+    unsigned long long bytes;
+    unsigned int matched;
+    struct cli_hashtable hits;
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+#endif
+};
+
+#ifdef CL_THREAD_SAFE
+#define PROFILE_LOCK(job) pthread_mutex_lock(&(job)->mutex)
+#define PROFILE_UNLOCK(job) pthread_mutex_unlock(&(job)->mutex)
+#else
+#define PROFILE_LOCK(job)
+#define PROFILE_UNLOCK(job)
+#endif
+
+static int profile_addfiles(struct profile_job *job, const char *dirname)
+{
+	DIR *dd;
+	struct dirent *dent;
+	STATBUF sb;
+	char *path, **files;
+	int ret = 0;
+
+
+    if(!(dd = opendir(dirname))) {
+	mprintf("!profilesigs: Can't open directory %s\n", dirname);
+	return -1;
+    }
+    while((dent = readdir(dd))) {
+	if(!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+	    continue;
+	if(!(path = malloc(strlen(dirname) + strlen(dent->d_name) + 2))) {
+	    mprintf("!profilesigs: Can't allocate memory for the list of files\n");
+	    ret = -1;
+	    break;
+	}
+	sprintf(path, "%s"PATHSEP"%s", dirname, dent->d_name);
+	if(LSTAT(path, &sb) == -1 || !(S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode))) {
+	    free(path);
+	    continue;
+	}
+	if(S_ISDIR(sb.st_mode)) {
+	    ret = profile_addfiles(job, path);
+	    free(path);
+	    if(ret)
+		break;
+	    continue;
+	}
+	if(!(files = realloc(job->files, (job->nfiles + 1) * sizeof(char *)))) {
+	    mprintf("!profilesigs: Can't allocate memory for the list of files\n");
+	    free(path);
+	    ret = -1;
+	    break;
+	}
+	job->files = files;
+	job->files[job->nfiles++] = path;
+    }
+    closedir(dd);
+    return ret;
+}
+
+static void profile_virus_found(int fd, const char *virname, void *context)
+{
+	struct profile_job *job = context;
+	struct cli_element *el;
+	size_t len = strlen(virname);
+
+    UNUSEDPARAM(fd);
+    PROFILE_LOCK(job);
+    if((el = cli_hashtab_find(&job->hits, virname, len)))
+	el->data++;
+    else
+	cli_hashtab_insert(&job->hits, virname, len, 1);
+    PROFILE_UNLOCK(job);
+}
+
+static void *profile_worker(void *arg)
+{
+	struct profile_job *job = arg;
+	const char *virname;
+	unsigned int i;
+	STATBUF sb;
+	int fd, ret;
+
+
+    for(;;) {
+	PROFILE_LOCK(job);
+	i = job->next++;
+	PROFILE_UNLOCK(job);
+	if(i >= job->nfiles)
+	    break;
+
+	if((fd = open(job->files[i], O_RDONLY|O_BINARY)) == -1) {
+	    mprintf("^profilesigs: Can't open file %s\n", job->files[i]);
+	    continue;
+	}
+	ret = cl_scandesc_callback(fd, &virname, NULL, job->engine, CL_SCAN_STDOPT | CL_SCAN_ALLMATCHES, job);
+	if(ret != CL_CLEAN && ret != CL_VIRUS)
+	    mprintf("^profilesigs: %s: %s\n", job->files[i], cl_strerror(ret));
+	PROFILE_LOCK(job);
+	if(ret == CL_VIRUS)
+	    job->matched++;
+	if(FSTAT(fd, &sb) != -1)
+	    job->bytes += sb.st_size;
+	PROFILE_UNLOCK(job);
+	close(fd);
+    }
+    return NULL;
+}
+
+static int profilesigs(const struct optstruct *opts)
+{
+	struct profile_job job;
+	struct cl_sigstat *stats = NULL;
+	struct cli_element *el;
+	const struct optstruct *opt;
+	unsigned int sigs = 0, count = 0, nthreads = 1, i;
+	unsigned long long hits;
+	struct timeval tv_start, tv_end;
+	int ret = -1;
+#ifdef CL_THREAD_SAFE
+	pthread_t *tids;
+	unsigned int started;
+#endif
+
+
+    if(!optget(opts, "corpus")->enabled) {
+	mprintf("!--profile-sigs requires --corpus\n");
+	return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    if(cli_hashtab_init(&job.hits, 1024) < 0) {
+	mprintf("!profilesigs: Can't allocate memory for the hit counts\n");
+	return -1;
+    }
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_init(&job.mutex, NULL);
+    /* all the cores unless told otherwise */
+    opt = optget(opts, "threads");
+    if(opt->active)
+	nthreads = opt->numarg;
+#ifdef _SC_NPROCESSORS_ONLN
+    else if(sysconf(_SC_NPROCESSORS_ONLN) > 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(!nthreads)
+	nthreads = 1;
+#endif
+
+    if(!(job.engine = cl_engine_new())) {
+	mprintf("!profilesigs: Can't create new engine\n");
+	goto done;
+    }
+    cl_engine_set_num(job.engine, CL_ENGINE_SIGPROF_RATE, 1);
+    cl_engine_set_clcb_virus_found(job.engine, profile_virus_found);
+
+    opt = optget(opts, "profile-sigs");
+    if((ret = cl_load(opt->strarg, job.engine, &sigs, CL_DB_STDOPT | CL_DB_PUA)) != CL_SUCCESS) {
+	mprintf("!profilesigs: Can't load %s: %s\n", opt->strarg, cl_strerror(ret));
+	ret = -1;
+	goto done;
+    }
+    if((ret = cl_engine_compile(job.engine)) != CL_SUCCESS) {
+	mprintf("!profilesigs: Can't compile engine: %s\n", cl_strerror(ret));
+	ret = -1;
+	goto done;
+    }
+    if((ret = profile_addfiles(&job, optget(opts, "corpus")->strarg)))
+	goto done;
+
+    mprintf("Scanning %u files with %u signatures in %u thread%s\n", job.nfiles, sigs, nthreads, nthreads > 1 ? "s" : "");
+    gettimeofday(&tv_start, NULL);
+#ifdef CL_THREAD_SAFE
+    if(!(tids = malloc(nthreads * sizeof(pthread_t)))) {
+	mprintf("!profilesigs: Can't allocate memory for the threads\n");
+	ret = -1;
+	goto done;
+    }
+    for(started = 0; started < nthreads; started++)
+	if(pthread_create(&tids[started], NULL, profile_worker, &job))
+	    break;
+    if(!started)
+	profile_worker(&job);
+    for(i = 0; i < started; i++)
+	pthread_join(tids[i], NULL);
+    free(tids);
+#else
+    profile_worker(&job);
+#endif
+    gettimeofday(&tv_end, NULL);
+    mprintf("Scanned %u files (%.2f MB) in %.2f s, %u matched\n\n", job.nfiles, job.bytes / 1048576.0,
+	    (tv_end.tv_sec - tv_start.tv_sec) + (tv_end.tv_usec - tv_start.tv_usec) / 1000000.0, job.matched);
+
+    /* most expensive first; a trigger is an evaluation after the patterns
+     * of the signature matched, a false one didn't end in a detection */
+    if(cl_engine_get_sigstats(job.engine, NULL, &count) == CL_SUCCESS && count) {
+	if(!(stats = malloc(count * sizeof(*stats)))) {
+	    mprintf("!profilesigs: Can't allocate memory for the statistics\n");
+	    ret = -1;
+	    goto done;
+	}
+	cl_engine_get_sigstats(job.engine, stats, &count);
+    }
+    mprintf("%-9s %10s %8s %7s %11s %9s %9s  %s\n", "TYPE", "TRIGGERS", "HITS", "FALSE", "TOTAL(ms)", "AVG(us)", "MAX(us)", "NAME");
+    for(i = 0; i < count; i++) {
+	hits = 0;
+	if((el = cli_hashtab_find(&job.hits, stats[i].name, strlen(stats[i].name)))) {
+	    hits = el->data;
+	    el->data = 0; /* listed */
+	}
+	mprintf("%-9s %10llu %8llu %6.1f%% %11.2f %9.1f %9.1f  %s\n", stats[i].type, stats[i].samples, hits,
+		hits >= stats[i].samples ? 0.0 : 100.0 * (stats[i].samples - hits) / stats[i].samples,
+		stats[i].nsec / 1000000.0, stats[i].nsec / 1000.0 / stats[i].samples, stats[i].max_nsec / 1000.0, stats[i].name);
+    }
+    /* plain body and hash signatures aren't timed, only their hits count */
+    for(i = 0; i < job.hits.capacity; i++) {
+	el = &job.hits.htable[i];
+	if(el->key && el->len && el->data)
+	    mprintf("%-9s %10s %8llu %7s %11s %9s %9s  %s\n", "-", "-", (unsigned long long) el->data, "-", "-", "-", "-", el->key);
+    }
+    ret = 0;
+
+done:
+    for(i = 0; i < job.nfiles; i++)
+	free(job.files[i]);
+    free(job.files);
+    free(stats);
+    cli_hashtab_free(&job.hits);
+    if(job.engine)
+	cl_engine_free(job.engine);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_destroy(&job.mutex);
+#endif
+    return ret;
+}
+
+/* --build-ac-profile: count the byte pairs of the corpus, the pairs
+ * spanning two reads included */
+static int buildacprofile(const struct optstruct *opts)
+{
+	struct profile_job job;
+	uint64_t *counts;
+	unsigned char buff[FILEBUFF];
+	unsigned long long bytes = 0;
+	unsigned int i, prev;
+	ssize_t bread, j;
+	int fd, ret = -1;
+
+
+    if(!optget(opts, "corpus")->enabled) {
+	mprintf("!--build-ac-profile requires --corpus\n");
+	return -1;
+    }
+    if(!(counts = calloc(65536, sizeof(uint64_t)))) {
+	mprintf("!buildacprofile: Can't allocate memory for the pair counts\n");
+	return -1;
+    }
+    memset(&job, 0, sizeof(job));
+    if(profile_addfiles(&job, optget(opts, "corpus")->strarg))
+	goto done;
+
+    for(i = 0; i < job.nfiles; i++) {
+	if((fd = open(job.files[i], O_RDONLY|O_BINARY)) == -1) {
+	    mprintf("^buildacprofile: Can't open file %s\n", job.files[i]);
+	    continue;
+	}
+	prev = 0x100;
+	while((bread = read(fd, buff, sizeof(buff))) > 0) {
+	    for(j = 0; j < bread; j++) {
+		if(prev < 0x100)
+		    counts[(prev << 8) | buff[j]]++;
+		prev = buff[j];
+	    }
+	    bytes += bread;
+	}
+	close(fd);
+    }
+
+    if((ret = cli_ac_profile_write(optget(opts, "build-ac-profile")->strarg, counts)) != CL_SUCCESS) {
+	mprintf("!buildacprofile: Can't write the profile: %s\n", cl_strerror(ret));
+	ret = -1;
+	goto done;
+    }
+    mprintf("Profile built from %u files (%.2f MB)\n", job.nfiles, bytes / 1048576.0);
+    ret = 0;
+
+done:
+    for(i = 0; i < job.nfiles; i++)
+	free(job.files[i]);
+    free(job.files);
+    free(counts);
+    return ret;
+}
+
 static int diffdirs(const char *old, const char *new, const char *patch)
 {
 	FILE *diff;
@@ -3523,6 +4103,8 @@ static void help(void)
     mprintf("    --print-certs=FILE                     Print Authenticode details from a PE\n");
     mprintf("    --server=ADDR                          ClamAV Signing Service address\n");
     mprintf("    --datadir=DIR                          Use DIR as default database directory\n");
+    mprintf("    --compile-db=NAME                      Convert the hash databases NAME.*\n");
+    mprintf("                                           into a precompiled NAME.bdb\n");
     mprintf("    --unpack=FILE          -u FILE         Unpack a CVD/CLD file\n");
     mprintf("    --unpack-current=SHORTNAME             Unpack local CVD/CLD into cwd\n");
     mprintf("    --list-sigs[=FILE]     -l[FILE]        List signature names\n");
@@ -3530,6 +4112,11 @@ static void help(void)
     mprintf("    --decode-sigs                          Decode signatures from stdin\n");
     mprintf("    --test-sigs=DATABASE TARGET_FILE       Test signatures from DATABASE against \n");
     mprintf("                                           TARGET_FILE\n");
+    mprintf("    --profile-sigs=DATABASE --corpus=DIR   Scan DIR with DATABASE and report the\n");
+    mprintf("                                           hits and cost of each signature\n");
+    mprintf("    --threads=#n                           Scan the corpus with #n threads\n");
+    mprintf("    --build-ac-profile=FILE --corpus=DIR   Build an AC profile (see ACProfileFile\n");
+    mprintf("                                           in clamd.conf) from the files in DIR\n");
     mprintf("    --vba=FILE                             Extract VBA/Word6 macro code\n");
     mprintf("    --vba-hex=FILE                         Extract Word6 macro code with hex values\n");
     mprintf("    --diff=OLD NEW         -d OLD NEW      Create diff for OLD and NEW CVDs\n");
@@ -3604,6 +4191,8 @@ int main(int argc, char **argv)
 	ret = utf16decode(opts);
     else if(optget(opts, "build")->enabled)
 	ret = build(opts);
+    else if(optget(opts, "compile-db")->enabled)
+	ret = compiledb(opts);
     else if(optget(opts, "unpack")->enabled)
 	ret = unpack(opts);
     else if(optget(opts, "unpack-current")->enabled)
@@ -3618,6 +4207,10 @@ int main(int argc, char **argv)
 	ret = decodesigs();
     else if(optget(opts, "test-sigs")->enabled)
 	ret = testsigs(opts);
+    else if(optget(opts, "profile-sigs")->enabled)
+	ret = profilesigs(opts);
+    else if(optget(opts, "build-ac-profile")->enabled)
+	ret = buildacprofile(opts);
     else if(optget(opts, "vba")->enabled || optget(opts, "vba-hex")->enabled)
 	ret = vbadump(opts);
     else if(optget(opts, "diff")->enabled)
@@ -1116,6 +1116,7 @@ int sigtool_vba_scandir (const char *dirname, int hex_output, struct uniq *U)
     char *fullname, vbaname[1024], *hash;
     unsigned char *data;
     uint32_t hashcnt;
+    fmap_t *map;
     unsigned int j;
 
     hashcnt = uniq_get(U, "_vba_project", 12, NULL);
@@ -1128,8 +1129,11 @@ int sigtool_vba_scandir (const char *dirname, int hex_output, struct uniq *U)
 		vbaname[sizeof(vbaname)-1] = '\0';
 		fd = open(vbaname, O_RDONLY|O_BINARY);
 		if(fd == -1) continue;
-		data = (unsigned char *)cli_vba_inflate(fd, vba_project->offset[i], &data_len);
+		map = fmap(fd, 0, 0);
 		close(fd);
+		if(!map) continue;
+		data = (unsigned char *)cli_vba_inflate(map, vba_project->offset[i], &data_len);
+		funmap(map);
 
 		if(data) {
 		    data = (unsigned char *) realloc (data, data_len + 1);
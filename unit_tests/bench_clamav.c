@@ -0,0 +1,651 @@
+/*
+ *  Throughput benchmarks for libclamav.
+ *
+ *  Copyright (C) 2015 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+/*
+ * bench_clamav [-t seconds] [-n] [-d database -c corpus]
+ *
+ * Runs the microbenchmarks of the matchers, the cache and a few parsers on
+ * synthetic data, then with -d and -c scans every file of the corpus and
+ * reports the throughput and the latency per file type. The report is JSON
+ * on stdout, with the keys in a fixed order so that the reports of two
+ * builds can be compared with diff or a script. Built by "make bench".
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include "../libclamav/clamav.h"
+#include "../libclamav/others.h"
+#include "../libclamav/readdb.h"
+#include "../libclamav/matcher.h"
+#include "../libclamav/matcher-ac.h"
+#include "../libclamav/matcher-bm.h"
+#include "../libclamav/matcher-hash.h"
+#include "../libclamav/filtering.h"
+#include "../libclamav/htmlnorm.h"
+#include "../libclamav/fmap.h"
+#include "../libclamav/default.h"
+
+#define BENCH_DATA	(4 * 1024 * 1024)
+#define BENCH_SIGS	2000
+#define BENCH_HASHES	100000
+
+static double bench_secs = 1.0;
+static int bench_first = 1;
+
+static double now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+    if(!clock_gettime(CLOCK_MONOTONIC, &ts))
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+}
+
+/* same data on every run and every platform */
+static uint64_t rnd_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return (uint32_t)(rnd_state >> 32);
+}
+
+/* half random bytes, half lower case text */
+static unsigned char *bench_data(size_t len)
+{
+	unsigned char *data;
+	size_t i;
+
+    if(!(data = malloc(len)))
+	return NULL;
+    for(i = 0; i < len; i++) {
+	if((i / 4096) % 2)
+	    data[i] = rnd();
+	else
+	    data[i] = (rnd() % 8) ? 'a' + rnd() % 26 : ' ';
+    }
+    return data;
+}
+
+static void bench_hex(char *hex, unsigned char *raw, unsigned int len)
+{
+	unsigned int i;
+
+    for(i = 0; i < len; i++) {
+	raw[i] = rnd();
+	sprintf(hex + 2 * i, "%02x", raw[i]);
+    }
+}
+
+static void report(const char *name, unsigned long iterations, double secs, double bytes)
+{
+    printf("%s    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.1f, \"mb_per_s\": %.2f}",
+	   bench_first ? "" : ",\n", name, iterations, secs * 1e9 / iterations, bytes ? bytes / secs / 1048576.0 : 0.0);
+    bench_first = 0;
+}
+
+/* calls fn until bench_secs have elapsed, returns the iterations */
+#define BENCH_LOOP(n, secs, body)				\
+    do {							\
+	double start_ = now();					\
+	n = 0;							\
+	do {							\
+	    body;						\
+	    n++;						\
+	} while((secs = now() - start_) < bench_secs);		\
+    } while(0)
+
+static struct cli_matcher *bench_root(struct cl_engine *engine, unsigned int i)
+{
+	struct cli_matcher *root;
+
+    if(!(root = mpool_calloc(engine->mempool, 1, sizeof(struct cli_matcher))))
+	return NULL;
+#ifdef USE_MPOOL
+    root->mempool = engine->mempool;
+#endif
+    engine->root[i] = root;
+    return root;
+}
+
+static int bench_ac(struct cl_engine *engine, const unsigned char *data)
+{
+	struct cli_matcher *root;
+	struct cli_ac_data mdata;
+	const char *virname;
+	char hex[64], name[32];
+	unsigned char raw[16];
+	unsigned long n;
+	unsigned int i;
+	double secs;
+
+    if(!(root = bench_root(engine, 0)))
+	return CL_EMEM;
+    root->ac_only = 1;
+    if(cli_ac_init(root, CLI_DEFAULT_AC_MINDEPTH, CLI_DEFAULT_AC_MAXDEPTH, 1))
+	return CL_EMEM;
+    /* a fifth of them with a wildcard in the middle */
+    for(i = 0; i < BENCH_SIGS; i++) {
+	bench_hex(hex, raw, 12);
+	if(!(i % 5))
+	    memcpy(hex + 8, "??", 2);
+	snprintf(name, sizeof(name), "Bench.AC-%u", i);
+	if(cli_parse_add(root, name, hex, 0, 0, 0, "*", 0, NULL, 0))
+	    return CL_EMALFDB;
+    }
+    if(cli_ac_buildtrie(root) || cli_ac_initdata(&mdata, root->ac_partsigs, 0, 0, CLI_DEFAULT_AC_TRACKLEN))
+	return CL_EMEM;
+
+    BENCH_LOOP(n, secs, cli_ac_scanbuff(data, BENCH_DATA, &virname, NULL, NULL, root, &mdata, 0, 0, NULL, AC_SCAN_VIR, NULL));
+    report("cli_ac_scanbuff", n, secs, (double)n * BENCH_DATA);
+    cli_ac_freedata(&mdata);
+    return CL_SUCCESS;
+}
+
+static int bench_bm(struct cl_engine *engine, const unsigned char *data, struct filter *filter)
+{
+	struct cli_matcher *root;
+	const char *virname;
+	char hex[64], name[32];
+	unsigned char raw[16];
+	unsigned long n;
+	unsigned int i;
+	double secs;
+
+    if(!(root = bench_root(engine, 1)))
+	return CL_EMEM;
+    if(cli_bm_init(root))
+	return CL_EMEM;
+    filter_init(filter);
+    for(i = 0; i < BENCH_SIGS; i++) {
+	bench_hex(hex, raw, 12);
+	snprintf(name, sizeof(name), "Bench.BM-%u", i);
+	if(cli_parse_add(root, name, hex, 0, 0, 0, "*", 0, NULL, 0))
+	    return CL_EMALFDB;
+	filter_add_static(filter, raw, 12, name);
+    }
+
+    BENCH_LOOP(n, secs, cli_bm_scanbuff(data, BENCH_DATA, &virname, NULL, root, 0, NULL, NULL, NULL));
+    report("cli_bm_scanbuff", n, secs, (double)n * BENCH_DATA);
+
+    BENCH_LOOP(n, secs, filter_search(filter, data, BENCH_DATA));
+    report("filter_search", n, secs, (double)n * BENCH_DATA);
+    return CL_SUCCESS;
+}
+
+static int bench_hm(struct cl_engine *engine)
+{
+	struct cli_matcher *root;
+	unsigned char (*digests)[16];
+	const char *virname;
+	char hex[64], name[32];
+	unsigned long n;
+	unsigned int i;
+	double secs;
+	int ret = CL_EMEM;
+
+    if(!(root = mpool_calloc(engine->mempool, 1, sizeof(struct cli_matcher))))
+	return CL_EMEM;
+#ifdef USE_MPOOL
+    root->mempool = engine->mempool;
+#endif
+    /* every other lookup is a hit */
+    if(!(digests = malloc(2 * BENCH_HASHES * sizeof(*digests))))
+	goto done;
+    for(i = 0; i < BENCH_HASHES; i++) {
+	bench_hex(hex, digests[2 * i], 16);
+	snprintf(name, sizeof(name), "Bench.HM-%u", i);
+	if(hm_addhash_str(root, hex, 1234, name)) {
+	    ret = CL_EMALFDB;
+	    goto done;
+	}
+	bench_hex(hex, digests[2 * i + 1], 16);
+    }
+    hm_flush(root);
+
+    i = 0;
+    BENCH_LOOP(n, secs, cli_hm_scan(digests[i++ % (2 * BENCH_HASHES)], 1234, &virname, root, CLI_HASH_MD5));
+    report("cli_hm_scan", n, secs, 0);
+    ret = CL_SUCCESS;
+
+done:
+    free(digests);
+    hm_free(root);
+    mpool_free(engine->mempool, root);
+    return ret;
+}
+
+static int bench_html(const unsigned char *data)
+{
+	char dir[] = "bench-html-XXXXXX";
+	unsigned char *html;
+	size_t len = 0, i;
+	cl_fmap_t *map;
+	unsigned long n;
+	double secs;
+
+    if(!(html = malloc(BENCH_DATA + 64)))
+	return CL_EMEM;
+    /* text between tags, links and scripts */
+    for(i = 0; len + 64 < BENCH_DATA; i++) {
+	switch(i % 4) {
+	    case 0:
+		len += sprintf((char *)html + len, "<p class=\"x%u\">", (unsigned int)i);
+		break;
+	    case 1:
+		len += sprintf((char *)html + len, "<a href=\"http://example.com/%u\">", (unsigned int)i);
+		break;
+	    case 2:
+		len += sprintf((char *)html + len, "<script>var a%u = 1;</script>", (unsigned int)i);
+		break;
+	    default:
+		memcpy(html + len, data + (i * 37) % 4096, 32);
+		len += 32;
+	}
+    }
+    if(!mkdtemp(dir) || !(map = cl_fmap_open_memory(html, len))) {
+	free(html);
+	return CL_ETMPDIR;
+    }
+
+    BENCH_LOOP(n, secs, html_normalise_map(map, dir, NULL, NULL));
+    report("html_normalise_map", n, secs, (double)n * len);
+
+    cl_fmap_close(map);
+    cli_rmdirs(dir);
+    free(html);
+    return CL_SUCCESS;
+}
+
+/* compressed text, gzip framing with windowBits 31 */
+static unsigned char *bench_deflate(const unsigned char *data, size_t len, int windowbits, size_t *outlen)
+{
+	z_stream z;
+	unsigned char *out;
+	size_t max = len + len / 100 + 1024;
+
+    if(!(out = malloc(max)))
+	return NULL;
+    memset(&z, 0, sizeof(z));
+    if(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowbits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	free(out);
+	return NULL;
+    }
+    z.next_in = (unsigned char *)data;
+    z.avail_in = len;
+    z.next_out = out;
+    z.avail_out = max;
+    if(deflate(&z, Z_FINISH) != Z_STREAM_END) {
+	deflateEnd(&z);
+	free(out);
+	return NULL;
+    }
+    *outlen = z.total_out;
+    deflateEnd(&z);
+    return out;
+}
+
+static void bench_scan(struct cl_engine *engine, const char *name, const unsigned char *buf, size_t len, double bytes)
+{
+	cl_fmap_t *map;
+	const char *virname;
+	unsigned long n;
+	double secs;
+
+    if(!(map = cl_fmap_open_memory(buf, len)))
+	return;
+    BENCH_LOOP(n, secs, cl_scanmap_callback(map, &virname, NULL, engine, CL_SCAN_STDOPT, NULL));
+    report(name, n, secs, (double)n * bytes);
+    cl_fmap_close(map);
+}
+
+/* the parsers and the cache through cl_scanmap_callback() with an empty
+ * database; the MB/s are those of the uncompressed data */
+static int bench_parsers(const unsigned char *data)
+{
+	struct cl_engine *engine;
+	unsigned char *text, *gz, *z, *pdf;
+	size_t gzlen, zlen, len = 0;
+	unsigned int i;
+	int ret;
+
+    if(!(engine = cl_engine_new()))
+	return CL_EMEM;
+    if((ret = cl_engine_compile(engine))) {
+	cl_engine_free(engine);
+	return ret;
+    }
+
+    /* a cached file is only hashed and looked up */
+    bench_scan(engine, "cache_check", data, 65536, 65536);
+
+    if(!(text = malloc(BENCH_DATA))) {
+	cl_engine_free(engine);
+	return CL_EMEM;
+    }
+    for(i = 0; i < BENCH_DATA; i++)
+	text[i] = data[(i % 4096) + 8192 * (i / 65536 % 8)];
+    if((gz = bench_deflate(text, BENCH_DATA, 31, &gzlen))) {
+	bench_scan(engine, "inflate", gz, gzlen, BENCH_DATA);
+	free(gz);
+    }
+
+    /* 256 objects with a FlateDecode stream of 16 KB each */
+    if((z = bench_deflate(text, 16384, 15, &zlen)) && (pdf = malloc(256 * (zlen + 128) + 64))) {
+	len = sprintf((char *)pdf, "%%PDF-1.4\n");
+	for(i = 0; i < 256; i++) {
+	    len += sprintf((char *)pdf + len, "%u 0 obj\n<< /Length %u /Filter /FlateDecode >>\nstream\n", i + 1, (unsigned int)zlen);
+	    memcpy(pdf + len, z, zlen);
+	    len += zlen;
+	    len += sprintf((char *)pdf + len, "\nendstream\nendobj\n");
+	}
+	len += sprintf((char *)pdf + len, "trailer\n<< /Root 1 0 R >>\n%%%%EOF\n");
+	bench_scan(engine, "pdf", pdf, len, 256.0 * 16384);
+	free(pdf);
+    }
+    free(z);
+    free(text);
+    cl_engine_free(engine);
+    return CL_SUCCESS;
+}
+
+static int bench_micro(void)
+{
+	struct cl_engine *engine;
+	struct filter *filter;
+	unsigned char *data;
+	int ret;
+
+    if(!(data = bench_data(BENCH_DATA)))
+	return CL_EMEM;
+    if(!(engine = cl_engine_new()) || !(filter = malloc(sizeof(*filter)))) {
+	if(engine)
+	    cl_engine_free(engine);
+	free(data);
+	return CL_EMEM;
+    }
+
+    printf("  \"micro\": [\n");
+    if(!(ret = bench_ac(engine, data)) && !(ret = bench_bm(engine, data, filter)) && !(ret = bench_hm(engine)) && !(ret = bench_html(data)))
+	ret = bench_parsers(data);
+    printf("\n  ]");
+
+    free(filter);
+    cl_engine_free(engine);
+    free(data);
+    return ret;
+}
+
+struct corpus_type {
+    char name[64];
+    double *msecs;
+    unsigned int files, max;
+    uint64_t bytes;
+    double secs;
+};
+
+struct corpus {
+    struct cl_engine *engine;
+    struct corpus_type *types;
+    unsigned int ntypes, files, errors, infected;
+    uint64_t bytes;
+    double secs;
+};
+
+/* the first call of a scan is the one of the file itself */
+static cl_error_t corpus_pre_scan(int fd, const char *type, void *context)
+{
+	char *name = context;
+
+    UNUSEDPARAM(fd);
+    if(!name[0]) {
+	strncpy(name, type, 63);
+	name[63] = '\0';
+    }
+    return CL_CLEAN;
+}
+
+static struct corpus_type *corpus_type(struct corpus *c, const char *name)
+{
+	struct corpus_type *t;
+	unsigned int i;
+
+    for(i = 0; i < c->ntypes; i++)
+	if(!strcmp(c->types[i].name, name))
+	    return &c->types[i];
+    if(!(t = realloc(c->types, (c->ntypes + 1) * sizeof(*t))))
+	return NULL;
+    c->types = t;
+    t = &c->types[c->ntypes++];
+    memset(t, 0, sizeof(*t));
+    strcpy(t->name, name);
+    return t;
+}
+
+static int corpus_scan(struct corpus *c, const char *dirname)
+{
+	struct corpus_type *t;
+	struct dirent *dent;
+	struct stat sb;
+	const char *virname;
+	char *path, type[64];
+	double start, secs, *msecs;
+	DIR *dd;
+	int fd, ret;
+
+    if(!(dd = opendir(dirname))) {
+	fprintf(stderr, "bench_clamav: Can't open directory %s\n", dirname);
+	return -1;
+    }
+    while((dent = readdir(dd))) {
+	if(!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+	    continue;
+	if(!(path = malloc(strlen(dirname) + strlen(dent->d_name) + 2)))
+	    break;
+	sprintf(path, "%s/%s", dirname, dent->d_name);
+	if(lstat(path, &sb) == -1 || !(S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode))) {
+	    free(path);
+	    continue;
+	}
+	if(S_ISDIR(sb.st_mode)) {
+	    corpus_scan(c, path);
+	    free(path);
+	    continue;
+	}
+	if((fd = open(path, O_RDONLY)) == -1) {
+	    fprintf(stderr, "bench_clamav: Can't open %s\n", path);
+	    free(path);
+	    continue;
+	}
+	type[0] = '\0';
+	start = now();
+	ret = cl_scandesc_callback(fd, &virname, NULL, c->engine, CL_SCAN_STDOPT, type);
+	secs = now() - start;
+	close(fd);
+	if(ret == CL_VIRUS)
+	    c->infected++;
+	else if(ret != CL_CLEAN)
+	    c->errors++;
+
+	if(!type[0])
+	    strcpy(type, "CL_TYPE_ANY");
+	if(!(t = corpus_type(c, type))) {
+	    free(path);
+	    break;
+	}
+	if(t->files == t->max) {
+	    if(!(msecs = realloc(t->msecs, (t->max ? 2 * t->max : 64) * sizeof(double)))) {
+		free(path);
+		break;
+	    }
+	    t->msecs = msecs;
+	    t->max = t->max ? 2 * t->max : 64;
+	}
+	t->msecs[t->files++] = secs * 1000;
+	t->bytes += sb.st_size;
+	t->secs += secs;
+	c->files++;
+	c->bytes += sb.st_size;
+	c->secs += secs;
+	free(path);
+    }
+    closedir(dd);
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_type(const void *a, const void *b)
+{
+    return strcmp(((const struct corpus_type *)a)->name, ((const struct corpus_type *)b)->name);
+}
+
+/* nearest rank */
+static double percentile(const double *sorted, unsigned int n, unsigned int p)
+{
+	unsigned int rank = (n * p + 99) / 100;
+
+    return n ? sorted[rank ? rank - 1 : 0] : 0.0;
+}
+
+static int bench_corpus(const char *database, const char *dirname)
+{
+	struct corpus c;
+	struct corpus_type *t;
+	unsigned int sigs = 0, i;
+	int ret;
+
+    memset(&c, 0, sizeof(c));
+    if(!(c.engine = cl_engine_new()))
+	return CL_EMEM;
+    if((ret = cl_load(database, c.engine, &sigs, CL_DB_STDOPT)) || (ret = cl_engine_compile(c.engine))) {
+	fprintf(stderr, "bench_clamav: Can't load %s: %s\n", database, cl_strerror(ret));
+	cl_engine_free(c.engine);
+	return ret;
+    }
+    /* every file is scanned, even if the corpus has duplicates */
+    cl_engine_set_num(c.engine, CL_ENGINE_DISABLE_CACHE, 1);
+    cl_engine_set_clcb_pre_scan(c.engine, corpus_pre_scan);
+
+    if(!(ret = corpus_scan(&c, dirname))) {
+	cli_qsort(c.types, c.ntypes, sizeof(*c.types), cmp_type);
+	printf(",\n  \"corpus\": {\"signatures\": %u, \"files\": %u, \"bytes\": %llu, \"infected\": %u, \"errors\": %u, \"seconds\": %.3f, \"mb_per_s\": %.2f, \"files_per_s\": %.1f, \"types\": [\n",
+	       sigs, c.files, (unsigned long long)c.bytes, c.infected, c.errors, c.secs,
+	       c.secs ? c.bytes / c.secs / 1048576.0 : 0.0, c.secs ? c.files / c.secs : 0.0);
+	for(i = 0; i < c.ntypes; i++) {
+	    t = &c.types[i];
+	    cli_qsort(t->msecs, t->files, sizeof(double), cmp_double);
+	    printf("    {\"type\": \"%s\", \"files\": %u, \"bytes\": %llu, \"mb_per_s\": %.2f, \"files_per_s\": %.1f, \"p50_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+		   t->name, t->files, (unsigned long long)t->bytes, t->secs ? t->bytes / t->secs / 1048576.0 : 0.0,
+		   t->secs ? t->files / t->secs : 0.0, percentile(t->msecs, t->files, 50), percentile(t->msecs, t->files, 99),
+		   i + 1 < c.ntypes ? "," : "");
+	}
+	printf("  ]}");
+    }
+
+    for(i = 0; i < c.ntypes; i++)
+	free(c.types[i].msecs);
+    free(c.types);
+    cl_engine_free(c.engine);
+    return ret;
+}
+
+static void help(void)
+{
+    fprintf(stderr, "Usage: bench_clamav [-t seconds] [-n] [-d database -c corpus]\n");
+    fprintf(stderr, "    -t SECONDS    Run each microbenchmark for SECONDS (default: 1)\n");
+    fprintf(stderr, "    -n            Skip the microbenchmarks\n");
+    fprintf(stderr, "    -d DATABASE   Signatures for the corpus run (file or directory)\n");
+    fprintf(stderr, "    -c DIRECTORY  Scan every file of DIRECTORY, recursively\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *database = NULL, *corpus = NULL;
+	int opt, micro = 1, ret = 0;
+
+    while((opt = getopt(argc, argv, "t:nd:c:h")) != -1) {
+	switch(opt) {
+	    case 't':
+		bench_secs = atof(optarg);
+		break;
+	    case 'n':
+		micro = 0;
+		break;
+	    case 'd':
+		database = optarg;
+		break;
+	    case 'c':
+		corpus = optarg;
+		break;
+	    default:
+		help();
+		return opt == 'h' ? 0 : 2;
+	}
+    }
+    if(!!database != !!corpus || bench_secs <= 0) {
+	help();
+	return 2;
+    }
+    if((ret = cl_init(CL_INIT_DEFAULT))) {
+	fprintf(stderr, "bench_clamav: cl_init() failed: %s\n", cl_strerror(ret));
+	return 1;
+    }
+
+    printf("{\n  \"version\": \"%s\"", cl_retver());
+    if(micro) {
+	printf(",\n");
+	if((ret = bench_micro()))
+	    fprintf(stderr, "bench_clamav: microbenchmarks failed: %s\n", cl_strerror(ret));
+    }
+    if(!ret && corpus)
+	ret = bench_corpus(database, corpus);
+    printf("\n}\n");
+
+    return ret ? 1 : 0;
+}
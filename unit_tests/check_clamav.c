@@ -23,6 +23,8 @@
 #include "../libclamav/version.h"
 #include "../libclamav/dsig.h"
 #include "../libclamav/fpu.h"
+#include "../libclamav/hashtab.h"
+#include "../libclamav/cache.h"
 #include "checks.h"
 
 static int fpu_words  = FPU_ENDIAN_INITME;
@@ -598,8 +600,207 @@ START_TEST (test_cl_scanmap_callback_mem_allscan)
     munmap(mem, size);
 }
 END_TEST
+
+/* zip64 and data descriptor variants of a zip with clam.exe stored in it */
+enum { ZIP64_LOCAL, ZIP64_CENTRAL, ZIP_STREAMED, ZIP_FIXTURES };
+
+static void zput(unsigned char **p, uint32_t v, unsigned int n)
+{
+    while (n--) {
+	*(*p)++ = v & 0xff;
+	v >>= 8;
+    }
+}
+
+static uint32_t zcrc32(const unsigned char *buf, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    unsigned int k;
+
+    while (len--) {
+	crc ^= *buf++;
+	for (k = 0; k < 8; k++)
+	    crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static size_t zip_fixture(int type, unsigned char *zip, const unsigned char *data, uint32_t size)
+{
+    unsigned char *p = zip;
+    uint32_t crc = zcrc32(data, size), cdoff, eocd64;
+    int streamed = type != ZIP64_LOCAL;
+
+    /* the local header tells nothing but the zip64 sizes or, when
+     * streamed, that a data descriptor follows */
+    zput(&p, 0x04034b50, 4);
+    zput(&p, 45, 2);
+    zput(&p, streamed ? 0x8 : 0, 2);
+    zput(&p, 0, 2 + 2 + 2);
+    zput(&p, streamed ? 0 : crc, 4);
+    zput(&p, streamed ? 0 : 0xffffffff, 4);
+    zput(&p, streamed ? 0 : 0xffffffff, 4);
+    zput(&p, 8, 2);
+    zput(&p, streamed ? 0 : 20, 2);
+    memcpy(p, "clam.exe", 8);
+    p += 8;
+    if (!streamed) {
+	zput(&p, 0x0001, 2);
+	zput(&p, 16, 2);
+	zput(&p, size, 4);
+	zput(&p, 0, 4);
+	zput(&p, size, 4);
+	zput(&p, 0, 4);
+    }
+    memcpy(p, data, size);
+    p += size;
+    if (type == ZIP_STREAMED) {
+	zput(&p, 0x08074b50, 4);
+	zput(&p, crc, 4);
+	zput(&p, size, 4);
+	zput(&p, size, 4);
+    }
+    if (type == ZIP64_LOCAL) {
+	/* an empty member, so that clam.exe doesn't end the file and
+	 * can't be picked up as an embedded PE instead */
+	zput(&p, 0x04034b50, 4);
+	zput(&p, 20, 2);
+	zput(&p, 0, 2 + 2 + 2 + 2 + 4 + 4 + 4);
+	zput(&p, 3, 2);
+	zput(&p, 0, 2);
+	memcpy(p, "end", 3);
+	p += 3;
+    }
+    if (type != ZIP64_CENTRAL)
+	return p - zip;
+
+    /* without a descriptor the member can only be found through the
+     * central directory, which the zip64 records point to */
+    cdoff = p - zip;
+    zput(&p, 0x02014b50, 4);
+    zput(&p, 45, 2);
+    zput(&p, 45, 2);
+    zput(&p, 0x8, 2);
+    zput(&p, 0, 2 + 2 + 2);
+    zput(&p, crc, 4);
+    zput(&p, size, 4);
+    zput(&p, size, 4);
+    zput(&p, 8, 2);
+    zput(&p, 12, 2);
+    zput(&p, 0, 2 + 2 + 2 + 4);
+    zput(&p, 0xffffffff, 4);
+    memcpy(p, "clam.exe", 8);
+    p += 8;
+    zput(&p, 0x0001, 2);
+    zput(&p, 8, 2);
+    zput(&p, 0, 8);
+
+    eocd64 = p - zip;
+    zput(&p, 0x06064b50, 4);
+    zput(&p, 44, 8);
+    zput(&p, 45, 2);
+    zput(&p, 45, 2);
+    zput(&p, 0, 4 + 4);
+    zput(&p, 1, 8);
+    zput(&p, 1, 8);
+    zput(&p, eocd64 - cdoff, 8);
+    zput(&p, cdoff, 4);
+    zput(&p, 0, 4);
+
+    zput(&p, 0x07064b50, 4);
+    zput(&p, 0, 4);
+    zput(&p, eocd64, 4);
+    zput(&p, 0, 4);
+    zput(&p, 1, 4);
+
+    zput(&p, 0x06054b50, 4);
+    zput(&p, 0, 2 + 2);
+    zput(&p, 0xffff, 2);
+    zput(&p, 0xffff, 2);
+    zput(&p, eocd64 - cdoff, 4);
+    zput(&p, 0xffffffff, 4);
+    zput(&p, 0, 2);
+    return p - zip;
+}
+
+/* int cli_unzip(cli_ctx *ctx), the member sizes or offset coming from
+ * zip64 fields or from a data descriptor */
+START_TEST (test_cli_unzip_zip64)
+{
+    const char *virname = NULL;
+    unsigned long int scanned = 0;
+    unsigned char *data, *zip;
+    cl_fmap_t *map;
+    size_t len;
+    STATBUF st;
+    int fd, ret;
+
+    fd = open(OBJDIR"/../test/clam.exe", O_RDONLY);
+    fail_unless(fd >= 0, "open");
+    fail_unless(FSTAT(fd, &st) == 0, "fstat");
+    data = cli_malloc(st.st_size);
+    zip = cli_malloc(st.st_size + 512);
+    fail_unless(data && zip, "cli_malloc");
+    fail_unless(read(fd, data, st.st_size) == st.st_size, "read");
+    close(fd);
+
+    len = zip_fixture(_i, zip, data, st.st_size);
+    map = cl_fmap_open_memory(zip, len);
+    fail_unless(!!map, "cl_fmap_open_memory");
+    ret = cl_scanmap_callback(map, &virname, &scanned, g_engine, CL_SCAN_STDOPT, NULL);
+    cl_fmap_close(map);
+    fail_unless_fmt(ret == CL_VIRUS, "fixture %d: cl_scanmap_callback failed: %s", _i, cl_strerror(ret));
+    fail_unless_fmt(virname && !strcmp(virname, "ClamAV-Test-File.UNOFFICIAL"), "fixture %d: virusname: %s", _i, virname);
+    free(zip);
+    free(data);
+}
+END_TEST
 #endif
 
+static const char cdiff_sample[] = "cl_engine_apply_cdiff test sample";
+
+/* int cl_engine_apply_cdiff(struct cl_engine *engine, const char *script, unsigned int *signo) */
+START_TEST (test_cl_engine_apply_cdiff)
+{
+    const char *virname = NULL;
+    unsigned long int scanned = 0;
+    unsigned int sigs = 1;
+    cl_fmap_t *map;
+    char *script;
+    FILE *fs;
+    size_t i;
+    int ret;
+
+    script = cli_gentemp(NULL);
+    fail_unless(!!script, "cli_gentemp");
+    fs = fopen(script, "w");
+    fail_unless(!!fs, "fopen");
+    /* drop the hash signature and add a body signature for the sample */
+    fprintf(fs, "OPEN clamav.hdb\nDEL 1 aa15bcf478d165efd2065190eb473bcb:544:ClamAV-Test-File\nCLOSE\n");
+    fprintf(fs, "OPEN test.ndb\nADD Test.Cdiff:0:*:");
+    for (i = 0; i < sizeof(cdiff_sample) - 1; i++)
+	fprintf(fs, "%02x", (unsigned char)cdiff_sample[i]);
+    fprintf(fs, "\nCLOSE\n");
+    fail_unless(fclose(fs) == 0, "fclose");
+
+    ret = cl_engine_apply_cdiff(g_engine, script, &sigs);
+    cli_unlink(script);
+    free(script);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_apply_cdiff failed: %s", cl_strerror(ret));
+    fail_unless_fmt(sigs == 1, "sigs: %u", sigs);
+
+    ret = cl_scanfile(OBJDIR"/../test/clam.exe", &virname, &scanned, g_engine, CL_SCAN_STDOPT);
+    fail_unless_fmt(ret == CL_CLEAN, "deleted signature still matches: %s", virname);
+
+    map = cl_fmap_open_memory(cdiff_sample, sizeof(cdiff_sample) - 1);
+    fail_unless(!!map, "cl_fmap_open_memory");
+    ret = cl_scanmap_callback(map, &virname, &scanned, g_engine, CL_SCAN_STDOPT, NULL);
+    cl_fmap_close(map);
+    fail_unless_fmt(ret == CL_VIRUS, "added signature doesn't match: %s", cl_strerror(ret));
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Cdiff"), "virusname: %s", virname);
+}
+END_TEST
+
 static Suite *test_cl_suite(void)
 {
     Suite *s = suite_create("cl_api");
@@ -628,6 +829,7 @@ static Suite *test_cl_suite(void)
 
     suite_add_tcase(s, tc_cl_scan);
     tcase_add_checked_fixture (tc_cl_scan, engine_setup, engine_teardown);
+    tcase_add_test(tc_cl_scan, test_cl_engine_apply_cdiff);
 #ifdef CHECK_HAVE_LOOPS
     if (get_fpu_endian() == FPU_ENDIAN_UNKNOWN)
         expect--;
@@ -644,6 +846,7 @@ static Suite *test_cl_suite(void)
     tcase_add_loop_test(tc_cl_scan, test_cl_scanmap_callback_handle_allscan, 0, expect);
     tcase_add_loop_test(tc_cl_scan, test_cl_scanmap_callback_mem, 0, expect);
     tcase_add_loop_test(tc_cl_scan, test_cl_scanmap_callback_mem_allscan, 0, expect);
+    tcase_add_loop_test(tc_cl_scan, test_cli_unzip_zip64, 0, ZIP_FIXTURES);
 
     user_timeout = getenv("T");
     if (user_timeout) {
@@ -832,11 +1035,159 @@ START_TEST (test_sha256)
 }
 END_TEST
 
+#define HASHTAB_KEYS 5000
+
+static size_t hashtab_key(char *key, size_t size, unsigned int i)
+{
+    return snprintf(key, size, "key-%u", i * 2654435761U);
+}
+
+/* int cli_hashtab_insert/find/delete(), growing from a small table */
+START_TEST (test_cli_hashtab)
+{
+    struct cli_hashtable ht;
+    struct cli_element *el;
+    char key[32];
+    unsigned int i, round;
+    size_t len;
+
+    fail_unless(cli_hashtab_init(&ht, 8) == 0, "cli_hashtab_init");
+    for (i = 0; i < HASHTAB_KEYS; i++) {
+	len = hashtab_key(key, sizeof(key), i);
+	fail_unless(cli_hashtab_insert(&ht, key, len, i) != NULL, "cli_hashtab_insert");
+    }
+    fail_unless_fmt(ht.used == HASHTAB_KEYS, "used: %lu", (unsigned long)ht.used);
+    fail_unless_fmt(ht.capacity >= HASHTAB_KEYS, "capacity: %lu", (unsigned long)ht.capacity);
+
+    /* an existing key gets its data updated */
+    len = hashtab_key(key, sizeof(key), 7);
+    fail_unless(cli_hashtab_insert(&ht, key, len, -7) != NULL, "cli_hashtab_insert");
+    fail_unless(ht.used == HASHTAB_KEYS, "duplicate key inserted");
+    el = cli_hashtab_find(&ht, key, len);
+    fail_unless(el && el->data == -7, "data not updated");
+    fail_unless(cli_hashtab_insert(&ht, key, len, 7) != NULL, "cli_hashtab_insert");
+
+    /* delete and reinsert half of the keys a few times, so that
+     * the deleted slots are reused or purged by a rehash */
+    for (round = 0; round < 4; round++) {
+	for (i = round & 1; i < HASHTAB_KEYS; i += 2) {
+	    len = hashtab_key(key, sizeof(key), i);
+	    cli_hashtab_delete(&ht, key, len);
+	}
+	fail_unless_fmt(ht.used == HASHTAB_KEYS / 2, "used after delete: %lu", (unsigned long)ht.used);
+	for (i = 0; i < HASHTAB_KEYS; i++) {
+	    len = hashtab_key(key, sizeof(key), i);
+	    el = cli_hashtab_find(&ht, key, len);
+	    if ((i & 1) == (round & 1))
+		fail_unless_fmt(!el, "deleted key %s found", key);
+	    else
+		fail_unless_fmt(el && el->data == i && el->len == len && !memcmp(el->key, key, len), "key %s not found", key);
+	}
+	for (i = round & 1; i < HASHTAB_KEYS; i += 2) {
+	    len = hashtab_key(key, sizeof(key), i);
+	    fail_unless(cli_hashtab_insert(&ht, key, len, i) != NULL, "cli_hashtab_insert");
+	}
+	fail_unless_fmt(ht.used == HASHTAB_KEYS, "used after reinsert: %lu", (unsigned long)ht.used);
+    }
+    for (i = 0; i < HASHTAB_KEYS; i++) {
+	len = hashtab_key(key, sizeof(key), i);
+	el = cli_hashtab_find(&ht, key, len);
+	fail_unless_fmt(el && el->data == i, "key %s not found", key);
+    }
+    len = hashtab_key(key, sizeof(key), HASHTAB_KEYS);
+    fail_unless(!cli_hashtab_find(&ht, key, len), "missing key found");
+
+    cli_hashtab_clear(&ht);
+    fail_unless(ht.used == 0 && ht.deleted == 0, "cli_hashtab_clear");
+    len = hashtab_key(key, sizeof(key), 0);
+    fail_unless(!cli_hashtab_find(&ht, key, len), "key found after cli_hashtab_clear");
+    fail_unless(cli_hashtab_insert(&ht, key, len, 0) != NULL, "cli_hashtab_insert");
+    fail_unless(cli_hashtab_find(&ht, key, len) != NULL, "key not found after cli_hashtab_clear");
+    cli_hashtab_free(&ht);
+}
+END_TEST
+
+#define CACHE_SAMPLES 8
+
+/* looks buf up in the cache of ctx, as the scanners do */
+static int cache_sample(cli_ctx *ctx, const char *buf, int add)
+{
+    unsigned char hash[16];
+    cl_fmap_t *map;
+    int ret;
+
+    map = cl_fmap_open_memory(buf, strlen(buf));
+    fail_unless(!!map, "cl_fmap_open_memory");
+    ctx->fmap = &map;
+    ret = cache_check(hash, ctx);
+    if (add)
+	cache_add(hash, map->len, ctx, 1);
+    cl_fmap_close(map);
+    ctx->fmap = NULL;
+    return ret;
+}
+
+/* cache_add(), cache_check(), cli_cache_clear() and the eviction from a
+ * full bucket */
+START_TEST (test_cli_cache)
+{
+    struct cl_engine *engine;
+    unsigned int sigs = 0, i, n, hits;
+    unsigned char md5[16], first = 0;
+    char samples[CACHE_SAMPLES][32];
+    cli_ctx ctx;
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    /* the smallest cache has one bucket per tree, so the samples whose
+     * MD5 starts with the same byte share it */
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_CACHE_SIZE, 1) == 0, "cl_engine_set_num");
+    fail_unless(cl_load(OBJDIR"/clamav.hdb", engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.engine = engine;
+
+    for (i = 0, n = 0; n < CACHE_SAMPLES; i++) {
+	fail_unless(i < 1000000, "no colliding samples");
+	snprintf(samples[n], sizeof(samples[n]), "cache sample %u", i);
+	cl_hash_data("md5", samples[n], strlen(samples[n]), md5, NULL);
+	if (!n)
+	    first = md5[0];
+	if (md5[0] == first)
+	    n++;
+    }
+
+    fail_unless(cache_sample(&ctx, samples[0], 0) == CL_VIRUS, "empty cache hit");
+    fail_unless(cache_sample(&ctx, samples[0], 1) == CL_VIRUS, "cache hit before cache_add");
+    fail_unless(cache_sample(&ctx, samples[0], 0) == CL_CLEAN, "cache miss after cache_add");
+
+    /* the bucket holds 4 of them: every new sample takes the place of
+     * one of the older ones */
+    for (i = 1; i < CACHE_SAMPLES; i++) {
+	cache_sample(&ctx, samples[i], 1);
+	fail_unless_fmt(cache_sample(&ctx, samples[i], 0) == CL_CLEAN, "sample %u missing after cache_add", i);
+	for (n = 0, hits = 0; n <= i; n++)
+	    hits += cache_sample(&ctx, samples[n], 0) == CL_CLEAN;
+	fail_unless_fmt(hits == (i < 4 ? i + 1 : 4), "%u samples of %u cached", hits, i + 1);
+    }
+
+    cli_cache_clear(engine);
+    for (i = 0; i < CACHE_SAMPLES; i++)
+	fail_unless_fmt(cache_sample(&ctx, samples[i], 0) == CL_VIRUS, "sample %u cached after cli_cache_clear", i);
+    cache_sample(&ctx, samples[0], 1);
+    fail_unless(cache_sample(&ctx, samples[0], 0) == CL_CLEAN, "cache miss after cli_cache_clear");
+
+    cl_engine_free(engine);
+}
+END_TEST
+
 static Suite *test_cli_suite(void)
 {
     Suite *s = suite_create("cli");
     TCase *tc_cli_others = tcase_create("byteorder_macros");
     TCase *tc_cli_dsig = tcase_create("digital signatures");
+    TCase *tc_cli_hashtab = tcase_create("hashtab");
+    TCase *tc_cli_cache = tcase_create("cache");
 
     suite_add_tcase (s, tc_cli_others);
     tcase_add_checked_fixture (tc_cli_others, data_setup, data_teardown);
@@ -848,6 +1199,12 @@ static Suite *test_cli_suite(void)
     tcase_add_loop_test(tc_cli_dsig, test_cli_dsig, 0, dsig_tests_cnt);
     tcase_add_test(tc_cli_dsig, test_sha256);
 
+    suite_add_tcase (s, tc_cli_hashtab);
+    tcase_add_test(tc_cli_hashtab, test_cli_hashtab);
+
+    suite_add_tcase (s, tc_cli_cache);
+    tcase_add_test(tc_cli_cache, test_cli_cache);
+
     return s;
 }
 #endif /* CHECK_HAVE_LOOPS */
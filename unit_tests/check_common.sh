@@ -312,6 +312,14 @@ run_reload_test()
 	grep "ClamAV-RELOAD-TestFile" clamdscan.log >/dev/null 2>/dev/null && die "RELOAD test(1) failed!"
 	echo "ClamAV-RELOAD-TestFile:0:0:436c616d41562d52454c4f41442d54657374" >test-db/new.ndb
 	$CLAMDSCAN --reload --config-file=test-clamd.conf || die "clamdscan says reload failed!"
+	# the new database is loaded in the background, wait for it
+	i=0
+	while test $i -lt 30; do
+	    run_clamdscan_fileonly reload-testfile
+	    grep "ClamAV-RELOAD-TestFile" clamdscan.log >/dev/null 2>/dev/null && break
+	    sleep 1
+	    i=`expr $i + 1`
+	done
 	run_clamdscan reload-testfile
 	failed=0
 	grep "ClamAV-RELOAD-TestFile" clamdscan.log >/dev/null 2>/dev/null || die "RELOAD test failed! (after reload)"
@@ -352,6 +352,83 @@ START_TEST (test_ac_scanbuff_allscan_ex) {
 }
 END_TEST
 
+/* scans every dataset of both tables, ret[] and vn[] get the results */
+static void ac_scan_datasets(struct cli_matcher *root, struct cli_ac_data *mdata, int *ret, const char **vn)
+{
+	unsigned int i, j = 0;
+
+    for(i = 0; ac_testdata[i].data; i++, j++) {
+	vn[j] = NULL;
+	ret[j] = cli_ac_scanbuff((const unsigned char*)ac_testdata[i].data, strlen(ac_testdata[i].data), &vn[j], NULL, NULL, root, mdata, 0, 0, NULL, AC_SCAN_VIR, NULL);
+    }
+    for(i = 0; ac_sigopts_testdata[i].data; i++, j++) {
+	vn[j] = NULL;
+	ret[j] = cli_ac_scanbuff((const unsigned char*)ac_sigopts_testdata[i].data, ac_sigopts_testdata[i].dlength, &vn[j], NULL, NULL, root, mdata, 0, 0, NULL, AC_SCAN_VIR, NULL);
+    }
+}
+
+START_TEST (test_ac_scanbuff_compact) {
+	struct cli_ac_data mdata;
+	struct cli_matcher *root;
+	uint32_t *ctrans;
+	unsigned int i, n;
+	int ret, cret[64], pret[64];
+	const char *cvn[64], *pvn[64];
+
+    root = ctx.engine->root[0];
+    fail_unless(root != NULL, "root == NULL");
+    root->ac_only = 1;
+
+#ifdef USE_MPOOL
+    root->mempool = mpool_create();
+#endif
+    ret = cli_ac_init(root, CLI_DEFAULT_AC_MINDEPTH, CLI_DEFAULT_AC_MAXDEPTH, 1);
+    fail_unless(ret == CL_SUCCESS, "[ac_compact] cli_ac_init() failed");
+
+    for(i = 0, n = 0; ac_testdata[i].data; i++, n++) {
+	ret = cli_parse_add(root, ac_testdata[i].virname, ac_testdata[i].hexsig, 0, 0, 0, "*", 0, NULL, 0);
+	fail_unless(ret == CL_SUCCESS, "[ac_compact] cli_parse_add() failed");
+    }
+    for(i = 0; ac_sigopts_testdata[i].data; i++, n++) {
+	ret = cli_sigopts_handler(root, ac_sigopts_testdata[i].virname, ac_sigopts_testdata[i].hexsig, ac_sigopts_testdata[i].sigopts, 0, 0, ac_sigopts_testdata[i].offset, 0, NULL, 0);
+	fail_unless(ret == CL_SUCCESS, "[ac_compact] cli_sigopts_handler() failed");
+    }
+    fail_unless(n <= 64, "[ac_compact] too many datasets");
+
+    /* cli_ac_maketrie() keeps the pointer transitions next to the compact
+     * ones, so both can be scanned with */
+    ret = cli_ac_maketrie(root, 0);
+    fail_unless(ret == CL_SUCCESS, "[ac_compact] cli_ac_maketrie() failed");
+    fail_unless(root->ac_ctrans != NULL, "[ac_compact] no compact trie");
+
+    ret = cli_ac_initdata(&mdata, root->ac_partsigs, 0, 0, CLI_DEFAULT_AC_TRACKLEN);
+    fail_unless(ret == CL_SUCCESS, "[ac_compact] cli_ac_initdata() failed");
+
+    ac_scan_datasets(root, &mdata, cret, cvn);
+    ctrans = root->ac_ctrans;
+    root->ac_ctrans = NULL;
+    ac_scan_datasets(root, &mdata, pret, pvn);
+    root->ac_ctrans = ctrans;
+
+    for(i = 0; i < n; i++) {
+	fail_unless_fmt(cret[i] == pret[i], "[ac_compact] Dataset %u: %d with, %d without the compact trie", i, cret[i], pret[i]);
+	if(cret[i] == CL_VIRUS)
+	    fail_unless_fmt(cvn[i] && pvn[i] && !strcmp(cvn[i], pvn[i]), "[ac_compact] Dataset %u matched with %s and %s", i, cvn[i], pvn[i]);
+    }
+    /* the first match may come from the other table */
+    for(i = 0; ac_testdata[i].data; i++)
+	fail_unless_fmt(cret[i] == CL_VIRUS, "[ac_compact] cli_ac_scanbuff() failed for %s", ac_testdata[i].virname);
+
+    /* the released pointer transitions must not be needed any more */
+    cli_ac_finishtrie(root);
+    ac_scan_datasets(root, &mdata, pret, pvn);
+    for(i = 0; i < n; i++)
+	fail_unless_fmt(cret[i] == pret[i], "[ac_compact] Dataset %u: %d before, %d after cli_ac_finishtrie()", i, cret[i], pret[i]);
+
+    cli_ac_freedata(&mdata);
+}
+END_TEST
+
 START_TEST (test_bm_scanbuff) {
 	struct cli_matcher *root;
 	const char *virname = NULL;
@@ -520,6 +597,154 @@ END_TEST
 
 #endif /* HAVE_PCRE */
 
+#if HAVE_YARA
+
+/* yr_optimize_code() folds constants, swaps the operands of and/or and
+ * jumps over the second one, the rules must match the same samples with
+ * the optimizer turned off through dconf */
+static const struct yara_testdata_s {
+    const char *name;
+    const char *rule;
+} yara_testdata[] = {
+    { "opt_and", "strings: $a = \"alpha\" $b = \"bravo\" condition: $a and $b" },
+    { "opt_or", "strings: $a = \"alpha\" $b = \"bravo\" condition: $a or $b" },
+    { "opt_nested", "strings: $a = \"alpha\" $b = \"bravo\" $c = \"charlie\" condition: ($a or $b) and ($c or not $b)" },
+    { "opt_nested2", "strings: $a = \"alpha\" $b = \"bravo\" $c = \"charlie\" condition: (($a and $b) or ($b and $c)) and not ($a and $c)" },
+    { "opt_chain", "strings: $a = \"alpha\" $b = \"bravo\" $c = \"charlie\" condition: $a and $b or $c at 9" },
+    /* constant operands */
+    { "opt_fold", "strings: $a = \"alpha\" condition: $a and 2 + 3 * 4 == 14 and (1 << 4 > 15 or 0)" },
+    { "opt_fold_false", "strings: $a = \"alpha\" $b = \"bravo\" condition: $a and 1 + 1 == 3 or $b" },
+    { "opt_fold_or", "strings: $a = \"alpha\" $b = \"bravo\" condition: $b or (0 and $a) or 7 \\ 2 == 4" },
+    /* undefined operands, and/or with an integer are bitwise */
+    { "opt_undef_and", "strings: $a = \"alpha\" $b = \"bravo\" condition: $a and @b[1]" },
+    { "opt_undef_or", "strings: $a = \"alpha\" $b = \"bravo\" condition: @b[1] or $a" },
+    { "opt_undef_not", "strings: $b = \"bravo\" $c = \"charlie\" condition: not @c[1] or $b" },
+    { "opt_undef_both", "strings: $b = \"bravo\" $c = \"charlie\" condition: @b[2] or @c[1]" },
+    { "opt_int_and", "strings: $a = \"alpha\" $c = \"charlie\" condition: #a and $c" },
+    { "opt_int_or", "strings: $a = \"alpha\" $b = \"bravo\" $c = \"charlie\" condition: (#a or #c) and $b" },
+    /* loops, their jumps cross the inserted ones */
+    { "opt_loop", "strings: $a = \"alpha\" $b = \"bravo\" condition: for any i in (1..#a) : (@a[i] > 5 and @a[i] < 20) and $b" },
+    { "opt_of", "strings: $a = \"alpha\" $b = \"bravo\" $c = \"charlie\" condition: 2 of ($a, $b, $c) or filesize < 10" },
+    { "opt_for_of", "strings: $a = \"alpha\" $b = \"bravo\" condition: for all of ($a, $b) : ($ in (0..15) or $ at 20)" },
+    { "opt_uint", "strings: $b = \"bravo\" condition: uint8(0) == 0x61 and $b" },
+
+    { NULL, NULL }
+};
+
+static const char *yara_samples[] = {
+    "alpha alpha charlie",
+    "alpha bravo 0123456",
+    "xx bravo charlie",
+    "0123456789012 alpha charlie bravo",
+    "alpha bravo alpha charlie",
+    "01234 bravo alpha",
+    "alpha  bravo charlie",
+    "xx charlie yy",
+    "charlie!",
+    NULL
+};
+
+static void yara_virus_found(int fd, const char *virname, void *context)
+{
+    uint32_t *matches = (uint32_t *) context;
+    size_t len;
+    unsigned int i;
+
+    UNUSEDPARAM(fd);
+
+    if (strncmp(virname, "YARA.", 5))
+	return;
+    virname += 5;
+    for(i = 0; yara_testdata[i].name; i++) {
+	len = strlen(yara_testdata[i].name);
+	if (!strncmp(virname, yara_testdata[i].name, len) && (virname[len] == '.' || !virname[len]))
+	    *matches |= 1 << i;
+    }
+}
+
+static struct cl_engine *yara_engine(const char *dbfile, int optimize)
+{
+	struct cl_engine *engine;
+	unsigned int sigs = 0;
+	int ret;
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new() failed");
+    if (!optimize)
+	engine->dconf->other &= ~OTHER_CONF_YARAOPT;
+
+    ret = cl_load(dbfile, engine, &sigs, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "[yara] cl_load() failed: %s", cl_strerror(ret));
+    fail_unless_fmt(sigs == sizeof(yara_testdata) / sizeof(yara_testdata[0]) - 1, "[yara] %u rules loaded", sigs);
+    ret = cl_engine_compile(engine);
+    fail_unless_fmt(ret == CL_SUCCESS, "[yara] cl_engine_compile() failed: %s", cl_strerror(ret));
+    cl_engine_set_clcb_virus_found(engine, yara_virus_found);
+
+    return engine;
+}
+
+static uint32_t yara_scan(struct cl_engine *engine, const char *sample)
+{
+	const char *virname = NULL;
+	unsigned long int scanned = 0;
+	uint32_t matches = 0;
+	cl_fmap_t *map;
+	int ret;
+
+    map = cl_fmap_open_memory(sample, strlen(sample));
+    fail_unless(!!map, "cl_fmap_open_memory() failed");
+    ret = cl_scanmap_callback(map, &virname, &scanned, engine, CL_SCAN_STDOPT | CL_SCAN_ALLMATCHES, &matches);
+    fail_unless_fmt(ret == CL_CLEAN || ret == CL_VIRUS, "[yara] cl_scanmap_callback() failed: %s", cl_strerror(ret));
+    cl_fmap_close(map);
+
+    return matches;
+}
+
+START_TEST (test_yara_optimize_code) {
+	struct cl_engine *engine, *engine_noopt;
+	uint32_t matches, matches_noopt, all, any = 0;
+	char *tmp, *dbfile;
+	unsigned int i;
+	FILE *fs;
+
+    tmp = cli_gentemp(NULL);
+    fail_unless(!!tmp, "cli_gentemp() failed");
+    dbfile = cli_malloc(strlen(tmp) + 5);
+    fail_unless(!!dbfile, "cli_malloc() failed");
+    sprintf(dbfile, "%s.yar", tmp);
+    free(tmp);
+
+    fs = fopen(dbfile, "w");
+    fail_unless(!!fs, "fopen() failed");
+    for(i = 0; yara_testdata[i].name; i++)
+	fprintf(fs, "rule %s { %s }\n", yara_testdata[i].name, yara_testdata[i].rule);
+    fail_unless(fclose(fs) == 0, "fclose() failed");
+
+    engine = yara_engine(dbfile, 1);
+    engine_noopt = yara_engine(dbfile, 0);
+    cli_unlink(dbfile);
+    free(dbfile);
+
+    all = (1 << i) - 1;
+    for(i = 0; yara_samples[i]; i++) {
+	matches = yara_scan(engine, yara_samples[i]);
+	matches_noopt = yara_scan(engine_noopt, yara_samples[i]);
+	fail_unless_fmt(matches == matches_noopt, "[yara] sample %u: matches %x, %x without yr_optimize_code()", i, matches, matches_noopt);
+	all &= matches;
+	any |= matches;
+    }
+
+    /* each rule is true for some samples and false for others */
+    for(i = 0; yara_testdata[i].name; i++)
+	fail_unless_fmt((any & ~all) & (1 << i), "[yara] rule %s matches %s sample", yara_testdata[i].name, (all & (1 << i)) ? "every" : "no");
+
+    cl_engine_free(engine);
+    cl_engine_free(engine_noopt);
+}
+END_TEST
+
+#endif /* HAVE_YARA */
+
 Suite *test_matchers_suite(void)
 {
     Suite *s = suite_create("matchers");
@@ -529,6 +754,7 @@ Suite *test_matchers_suite(void)
     tcase_add_checked_fixture (tc_matchers, setup, teardown);
     tcase_add_test(tc_matchers, test_ac_scanbuff);
     tcase_add_test(tc_matchers, test_ac_scanbuff_ex);
+    tcase_add_test(tc_matchers, test_ac_scanbuff_compact);
     tcase_add_test(tc_matchers, test_bm_scanbuff);
 #if HAVE_PCRE
     tcase_add_test(tc_matchers, test_pcre_scanbuff);
@@ -538,6 +764,9 @@ Suite *test_matchers_suite(void)
     tcase_add_test(tc_matchers, test_bm_scanbuff_allscan);
 #if HAVE_PCRE
     tcase_add_test(tc_matchers, test_pcre_scanbuff_allscan);
+#endif
+#if HAVE_YARA
+    tcase_add_test(tc_matchers, test_yara_optimize_code);
 #endif
     return s;
 }
@@ -38,6 +38,7 @@
 #include "../libclamav/phishcheck.h"
 #include "../libclamav/regex_suffix.h"
 #include "../libclamav/regex_list.h"
+#include "../libclamav/regex_dfa.h"
 #include "../libclamav/phish_domaincheck_db.h"
 #include "../libclamav/phish_whitelist.h"
 #include "checks.h"
@@ -565,6 +566,45 @@ START_TEST (test_regexes)
     cli_regfree(&reg);
 }
 END_TEST
+
+static void dfa_check(const regex_t *reg, struct cli_regex_dfa *dfa, const char *text)
+{
+    int match = cli_regexec(reg, text, 0, NULL, 0) != REG_NOMATCH;
+
+    fail_unless_fmt(cli_regex_dfa_match(dfa, text) == match, "DFA and cli_regexec disagree on %s\n", text);
+}
+
+/* the DFA must answer as cli_regexec() for every pair of URLs of rtests */
+START_TEST (test_regex_dfa)
+{
+    const struct rtest *rtest = &rtests[_i];
+    struct cli_regex_dfa *dfa;
+    regex_t reg;
+    char text[1024];
+    unsigned int i, j;
+
+    if(!rtest->pattern)
+	return;
+    dfa = cli_regex_dfa_compile(rtest->pattern);
+    if(rtest->result == 4) {
+	fail_unless_fmt(!dfa, "DFA compiled from invalid regex %s\n", rtest->pattern);
+	return;
+    }
+    fail_unless_fmt(!!dfa, "no DFA for %s\n", rtest->pattern);
+    fail_unless(cli_regcomp(&reg, rtest->pattern, REG_EXTENDED) == 0, "cli_regcomp");
+
+    for(i = 0; i < sizeof(rtests)/sizeof(rtests[0]); i++) {
+	dfa_check(&reg, dfa, rtests[i].realurl);
+	dfa_check(&reg, dfa, rtests[i].displayurl);
+	for(j = 0; j < sizeof(rtests)/sizeof(rtests[0]); j++) {
+	    snprintf(text, sizeof(text), "%s:%s/", rtests[i].realurl, rtests[j].displayurl);
+	    dfa_check(&reg, dfa, text);
+	}
+    }
+    cli_regfree(&reg);
+    cli_regex_dfa_free(dfa);
+}
+END_TEST
 #endif
 
 START_TEST(phishing_fake_test)
@@ -655,6 +695,7 @@ Suite *test_regex_suite(void)
 	suite_add_tcase(s, tc_regex);
 #ifdef CHECK_HAVE_LOOPS
 	tcase_add_loop_test(tc_regex, test_regexes, 0, sizeof(rg)/sizeof(rg[0]));
+	tcase_add_loop_test(tc_regex, test_regex_dfa, 0, sizeof(rtests)/sizeof(rtests[0]));
 #endif
 	return s;
 }